@@ -0,0 +1,16 @@
+#!/bin/bash
+
+set -euo pipefail
+cd "$(dirname $(readlink -f "$0"))/.."
+
+source ./ci/check_if_nightly.sh
+
+export MEMORY_PROFILER_TEST_TARGET=x86_64-unknown-linux-gnu
+
+cd preload
+cargo build --target=$MEMORY_PROFILER_TEST_TARGET $FEATURES_NIGHTLY --release
+cd ..
+
+cd integration-tests
+MEMORY_PROFILER_TEST_PRELOAD_PATH=$MEMORY_PROFILER_TEST_TARGET/release cargo test --release --no-default-features -- --ignored --nocapture benchmark_hot_path
+cd ..
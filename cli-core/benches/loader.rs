@@ -0,0 +1,339 @@
+// Benchmarks of how fast the data is loaded and analyzed.
+//
+// The traces are generated synthetically in memory. How many events they have is controlled
+// with `BYTEHOUND_BENCH_EVENTS` (a comma separated list, `1000000` by default), e.g.:
+//
+//     BYTEHOUND_BENCH_EVENTS=1000000,10000000,100000000 cargo bench -p cli-core --bench loader
+//
+// A real trace (e.g. `simulation/memory-profiling-simulation.dat`) can also be benchmarked
+// by pointing `BYTEHOUND_BENCH_TRACE` at it.
+//
+// The peak memory usage of the loading is printed before each of the groups is benchmarked.
+
+use std::io::{self, Read};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, SamplingMode, Throughput};
+
+use cli_core::event::{AllocBody, AllocationId, DataId, Event, HeaderBody, HEADER_FLAG_IS_LITTLE_ENDIAN};
+use cli_core::{
+    Compile,
+    Data,
+    Loader,
+    RawAllocationFilter,
+    Select,
+    Timestamp,
+    build_allocation_timeline,
+    export_as_flamegraph,
+    export_as_heaptrack,
+    export_as_replay,
+    parse_events
+};
+use common::lz4_stream::Lz4Writer;
+use common::speedy::Writable;
+
+const BACKTRACE_COUNT: u64 = 1024;
+const THREAD_COUNT: u64 = 8;
+
+/// A cheaply cloneable in-memory trace.
+#[derive(Clone)]
+struct Trace {
+    bytes: Arc< Vec< u8 > >,
+    event_count: u64
+}
+
+struct TraceReader {
+    bytes: Arc< Vec< u8 > >,
+    position: usize
+}
+
+impl Read for TraceReader {
+    fn read( &mut self, buffer: &mut [u8] ) -> io::Result< usize > {
+        let remaining = &self.bytes[ self.position.. ];
+        let length = std::cmp::min( remaining.len(), buffer.len() );
+        buffer[ ..length ].copy_from_slice( &remaining[ ..length ] );
+        self.position += length;
+        Ok( length )
+    }
+}
+
+impl Trace {
+    fn reader( &self ) -> TraceReader {
+        TraceReader { bytes: self.bytes.clone(), position: 0 }
+    }
+
+    fn load( &self ) -> Data {
+        Loader::load_from_stream_without_debug_info( self.reader() ).unwrap()
+    }
+}
+
+struct LiveAllocation {
+    id: AllocationId,
+    pointer: u64,
+    thread: u32
+}
+
+/// Generates a trace of roughly `event_count` events which looks somewhat like a real one:
+/// most of the allocations are short lived, some are reallocated, and some are leaked.
+fn generate_trace( event_count: u64 ) -> Trace {
+    let mut rng = oorandom::Rand64::new( 12341234 );
+    let mut fp = Lz4Writer::new( Vec::new() );
+
+    Event::Header( HeaderBody {
+        id: DataId::new( 1, 2 ),
+        initial_timestamp: Timestamp::from_usecs( 0 ),
+        timestamp: Timestamp::from_usecs( 0 ),
+        wall_clock_secs: 1_600_000_000,
+        wall_clock_nsecs: 0,
+        pid: 1,
+        cmdline: b"benchmark\0".to_vec(),
+        executable: b"/benchmark".to_vec(),
+        arch: "x86_64".into(),
+        flags: HEADER_FLAG_IS_LITTLE_ENDIAN,
+        pointer_size: 8
+    }).write_to_stream( &mut fp ).unwrap();
+
+    for backtrace in 1..=BACKTRACE_COUNT {
+        let depth = rng.rand_range( 8..40 );
+        let addresses: Vec< u64 > = (0..depth).map( |_| 0x400000 + rng.rand_range( 0..0x100000 ) ).collect();
+        Event::Backtrace { id: backtrace, addresses: addresses.into() }.write_to_stream( &mut fp ).unwrap();
+    }
+
+    let mut live: Vec< LiveAllocation > = Vec::new();
+    let mut next_allocation = [0; THREAD_COUNT as usize];
+    let mut next_pointer = 0x10000000;
+    let mut written = BACKTRACE_COUNT;
+    while written < event_count {
+        let timestamp = Timestamp::from_usecs( written );
+        let roll = rng.rand_float();
+        if live.is_empty() || roll < 0.50 {
+            let thread = rng.rand_range( 0..THREAD_COUNT );
+            next_allocation[ thread as usize ] += 1;
+            let id = AllocationId { thread: thread + 1, allocation: next_allocation[ thread as usize ] };
+
+            let size = rng.rand_range( 1..4096 );
+            let pointer = next_pointer;
+            next_pointer += (size + 15) & !15;
+
+            Event::AllocEx {
+                id,
+                timestamp,
+                allocation: AllocBody {
+                    pointer,
+                    size,
+                    backtrace: rng.rand_range( 1..BACKTRACE_COUNT + 1 ),
+                    thread: thread as u32 + 1,
+                    flags: 0,
+                    extra_usable_space: 0,
+                    preceding_free_space: 0
+                }
+            }.write_to_stream( &mut fp ).unwrap();
+
+            live.push( LiveAllocation { id, pointer, thread: thread as u32 + 1 } );
+        } else if roll < 0.55 {
+            let index = rng.rand_range( 0..live.len() as u64 ) as usize;
+            let size = rng.rand_range( 1..16384 );
+            let pointer = next_pointer;
+            next_pointer += (size + 15) & !15;
+
+            let allocation = &mut live[ index ];
+            Event::ReallocEx {
+                id: allocation.id,
+                timestamp,
+                old_pointer: allocation.pointer,
+                allocation: AllocBody {
+                    pointer,
+                    size,
+                    backtrace: rng.rand_range( 1..BACKTRACE_COUNT + 1 ),
+                    thread: allocation.thread,
+                    flags: 0,
+                    extra_usable_space: 0,
+                    preceding_free_space: 0
+                }
+            }.write_to_stream( &mut fp ).unwrap();
+
+            allocation.pointer = pointer;
+        } else if roll < 0.995 {
+            let index = rng.rand_range( 0..live.len() as u64 ) as usize;
+            let allocation = live.swap_remove( index );
+            Event::FreeEx {
+                id: allocation.id,
+                timestamp,
+                pointer: allocation.pointer,
+                backtrace: 0,
+                thread: allocation.thread
+            }.write_to_stream( &mut fp ).unwrap();
+        } else {
+            // Leak it.
+            live.pop();
+            continue;
+        }
+
+        written += 1;
+    }
+
+    Trace {
+        bytes: Arc::new( fp.into_inner().unwrap() ),
+        event_count: written
+    }
+}
+
+fn event_counts() -> Vec< u64 > {
+    std::env::var( "BYTEHOUND_BENCH_EVENTS" ).ok()
+        .map( |counts| counts.split( ',' ).map( |count| count.trim().parse().expect( "invalid BYTEHOUND_BENCH_EVENTS" ) ).collect() )
+        .unwrap_or_else( || vec![ 1_000_000 ] )
+}
+
+fn traces() -> Vec< (String, Trace) > {
+    if let Ok( path ) = std::env::var( "BYTEHOUND_BENCH_TRACE" ) {
+        let bytes = std::fs::read( &path ).unwrap();
+        let event_count = parse_events( io::Cursor::new( bytes.clone() ) ).unwrap().1.count() as u64 + 1;
+        return vec![ (path, Trace { bytes: Arc::new( bytes ), event_count }) ];
+    }
+
+    event_counts().into_iter().map( |count| (count.to_string(), generate_trace( count )) ).collect()
+}
+
+/// Resets the peak resident set size of this process, so that `peak_rss` only covers what happens afterwards.
+fn reset_peak_rss() {
+    let _ = std::fs::write( "/proc/self/clear_refs", "5" );
+}
+
+/// Returns the peak resident set size of this process, in bytes.
+fn peak_rss() -> Option< u64 > {
+    let status = std::fs::read_to_string( "/proc/self/status" ).ok()?;
+    let line = status.lines().find( |line| line.starts_with( "VmHWM:" ) )?;
+    let kilobytes: u64 = line[ "VmHWM:".len().. ].trim().trim_end_matches( "kB" ).trim().parse().ok()?;
+    Some( kilobytes * 1024 )
+}
+
+fn report_memory_usage( name: &str, trace: &Trace ) -> Data {
+    reset_peak_rss();
+    let baseline = peak_rss().unwrap_or( 0 );
+    let start = Instant::now();
+    let data = trace.load();
+    let elapsed = start.elapsed();
+    let peak = peak_rss().unwrap_or( 0 );
+
+    eprintln!(
+        "{}: {} events loaded in {:.2}s ({:.0} events/s); peak RSS grew by {} MiB, the data takes {} MiB",
+        name,
+        trace.event_count,
+        elapsed.as_secs_f64(),
+        trace.event_count as f64 / elapsed.as_secs_f64(),
+        peak.saturating_sub( baseline ) / (1024 * 1024),
+        data.memory_usage() / (1024 * 1024)
+    );
+
+    data
+}
+
+fn benchmark_loading( c: &mut Criterion ) {
+    for (name, trace) in traces() {
+        let mut group = c.benchmark_group( "loading" );
+        group.sampling_mode( SamplingMode::Flat );
+        group.sample_size( 10 );
+        group.throughput( Throughput::Elements( trace.event_count ) );
+
+        group.bench_with_input( BenchmarkId::new( "load_from_stream", &name ), &trace, |b, trace| {
+            b.iter( || black_box( trace.load() ) );
+        });
+
+        group.bench_with_input( BenchmarkId::new( "process", &name ), &trace, |b, trace| {
+            b.iter_custom( |iterations| {
+                let mut total = Duration::default();
+                for _ in 0..iterations {
+                    let (header, events) = parse_events( trace.reader() ).unwrap();
+                    let events: Vec< _ > = events.map( |event| event.unwrap() ).collect();
+
+                    let start = Instant::now();
+                    let mut loader = Loader::new( header, nwind::DebugInfoIndex::new() );
+                    for event in events {
+                        loader.process( event );
+                    }
+                    total += start.elapsed();
+
+                    black_box( loader.finalize() );
+                }
+
+                total
+            });
+        });
+
+        group.bench_with_input( BenchmarkId::new( "finalize", &name ), &trace, |b, trace| {
+            b.iter_custom( |iterations| {
+                let mut total = Duration::default();
+                for _ in 0..iterations {
+                    let (header, events) = parse_events( trace.reader() ).unwrap();
+                    let mut loader = Loader::new( header, nwind::DebugInfoIndex::new() );
+                    for event in events {
+                        loader.process( event.unwrap() );
+                    }
+
+                    let start = Instant::now();
+                    black_box( loader.finalize() );
+                    total += start.elapsed();
+                }
+
+                total
+            });
+        });
+
+        group.finish();
+    }
+}
+
+fn benchmark_analysis( c: &mut Criterion ) {
+    for (name, trace) in traces() {
+        let data = report_memory_usage( &name, &trace );
+        let allocation_count = data.alloc_sorted_by_timestamp( None, None ).len() as u64;
+
+        let mut group = c.benchmark_group( "analysis" );
+        group.sampling_mode( SamplingMode::Flat );
+        group.sample_size( 10 );
+        group.throughput( Throughput::Elements( allocation_count ) );
+
+        group.bench_function( BenchmarkId::new( "filter_only_leaked", &name ), |b| {
+            let mut filter = RawAllocationFilter::default();
+            filter.common_filter.only_leaked = true;
+            b.iter( || black_box( filter.compile( &data ).select( &data ).count_ones() ) );
+        });
+
+        group.bench_function( BenchmarkId::new( "filter_larger_than_1k", &name ), |b| {
+            let mut filter = RawAllocationFilter::default();
+            filter.common_filter.only_larger = Some( 1024 );
+            b.iter( || black_box( filter.compile( &data ).select( &data ).count_ones() ) );
+        });
+
+        group.bench_function( BenchmarkId::new( "group_by_backtrace", &name ), |b| {
+            let ids = data.alloc_sorted_by_timestamp( None, None );
+            b.iter( || black_box( data.group_by_backtrace( ids ) ) );
+        });
+
+        group.bench_function( BenchmarkId::new( "build_allocation_timeline", &name ), |b| {
+            b.iter( || black_box( build_allocation_timeline( &data, data.initial_timestamp(), data.last_timestamp(), data.operation_ids() ) ) );
+        });
+
+        group.bench_function( BenchmarkId::new( "export_as_flamegraph", &name ), |b| {
+            b.iter( || {
+                let mut output = String::new();
+                let _ = export_as_flamegraph( &data, &mut output, |_, _| true );
+                black_box( output )
+            });
+        });
+
+        group.bench_function( BenchmarkId::new( "export_as_heaptrack", &name ), |b| {
+            b.iter( || export_as_heaptrack( &data, io::sink(), |_, _| true ).unwrap() );
+        });
+
+        group.bench_function( BenchmarkId::new( "export_as_replay", &name ), |b| {
+            b.iter( || export_as_replay( &data, io::sink(), |_, _| true ).unwrap() );
+        });
+
+        group.finish();
+    }
+}
+
+criterion_group!( benches, benchmark_loading, benchmark_analysis );
+criterion_main!( benches );
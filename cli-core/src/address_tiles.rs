@@ -0,0 +1,231 @@
+//! A multi-level index of which parts of the address space were occupied.
+//!
+//! The address space is split into tiles at several granularities, from a single page up to whole
+//! terabytes, and every level stores how many bytes of each of its tiles were occupied. Consecutive
+//! tiles which are occupied the same are coalesced into a single run, so a huge mapping doesn't need
+//! a separate entry for every one of its pages, and the whole index takes memory proportional to the
+//! number of the occupied ranges instead of to the size of the address space. Looking up what's
+//! visible at a given zoom level then only has to binary search the runs of a single level.
+
+use std::ops::Range;
+use std::sync::Arc;
+
+use lru::LruCache;
+use parking_lot::Mutex;
+
+use crate::{AllocationId, Data};
+
+/// The size of the tiles at the finest level.
+const FIRST_TILE_SHIFT: u32 = 12;
+
+/// Every level has tiles this many times bigger than the one before it.
+const SHIFT_PER_LEVEL: u32 = 4;
+
+const LEVEL_COUNT: usize = 9;
+
+/// How many indexes for different filters are kept around.
+const CACHE_SIZE: usize = 8;
+
+/// A run of consecutive tiles which are all occupied the same.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub struct TileRun {
+    /// The address of the first tile.
+    pub address: u64,
+    /// How many tiles there are.
+    pub count: u64,
+    /// How many bytes of every one of the tiles were occupied.
+    pub occupied: u64
+}
+
+struct Level {
+    shift: u32,
+    /// Kept as tile indexes so that the runs can't overflow at the end of the address space.
+    runs: Vec< (u64, u64, u64) >
+}
+
+impl Level {
+    fn add_tiles( &mut self, first: u64, count: u64, occupied: u64 ) {
+        if let Some( last ) = self.runs.last_mut() {
+            if last.1 == 1 && count == 1 && last.0 == first {
+                // The previous range ended within this same tile.
+                last.2 += occupied;
+                return;
+            }
+
+            if last.0 + last.1 == first && last.2 == occupied {
+                last.1 += count;
+                return;
+            }
+        }
+
+        self.runs.push( (first, count, occupied) );
+    }
+
+    fn add_range( &mut self, range: Range< u64 > ) {
+        let first = range.start >> self.shift;
+        let last = (range.end - 1) >> self.shift;
+        if first == last {
+            self.add_tiles( first, 1, range.end - range.start );
+            return;
+        }
+
+        let tile_size = 1 << self.shift;
+        self.add_tiles( first, 1, ((first + 1) << self.shift) - range.start );
+        if last > first + 1 {
+            self.add_tiles( first + 1, last - first - 1, tile_size );
+        }
+        self.add_tiles( last, 1, range.end - (last << self.shift) );
+    }
+}
+
+pub struct AddressTiles {
+    levels: Vec< Level >
+}
+
+impl AddressTiles {
+    /// Builds the index out of ranges which have to be sorted and which can't overlap.
+    pub fn new( ranges: impl IntoIterator< Item = Range< u64 > > ) -> Self {
+        let mut levels: Vec< _ > = (0..LEVEL_COUNT as u32).map( |level| Level {
+            shift: FIRST_TILE_SHIFT + level * SHIFT_PER_LEVEL,
+            runs: Vec::new()
+        }).collect();
+
+        for range in ranges {
+            if range.start >= range.end {
+                continue;
+            }
+
+            for level in &mut levels {
+                level.add_range( range.clone() );
+            }
+        }
+
+        for level in &mut levels {
+            level.runs.shrink_to_fit();
+        }
+
+        AddressTiles { levels }
+    }
+
+    /// Builds the index of the address space occupied by the given allocations.
+    pub fn from_allocations( data: &Data, filter: impl Fn( AllocationId ) -> bool ) -> Self {
+        let mut ranges = Vec::new();
+        let mut current: Option< Range< u64 > > = None;
+        for &id in data.alloc_sorted_by_address( None, None ) {
+            if !filter( id ) {
+                continue;
+            }
+
+            let range = data.get_allocation( id ).actual_range( data );
+            match current {
+                Some( ref mut current ) if range.start <= current.end => {
+                    current.end = std::cmp::max( current.end, range.end );
+                },
+                _ => {
+                    ranges.extend( current.replace( range ) );
+                }
+            }
+        }
+
+        ranges.extend( current );
+        Self::new( ranges )
+    }
+
+    pub fn level_count( &self ) -> usize {
+        self.levels.len()
+    }
+
+    pub fn tile_size( &self, level: usize ) -> u64 {
+        1 << self.levels[ level ].shift
+    }
+
+    /// Picks the finest level at which the given range doesn't span more than `max_tiles` tiles.
+    pub fn level_for( &self, range: Range< u64 >, max_tiles: u64 ) -> usize {
+        let length = range.end.saturating_sub( range.start );
+        self.levels.iter().position( |level| (length >> level.shift) < std::cmp::max( max_tiles, 1 ) ).unwrap_or( self.levels.len() - 1 )
+    }
+
+    /// Returns the runs of a given level which overlap with the given range; the runs aren't clipped to it.
+    pub fn tiles< 'a >( &'a self, level: usize, range: Range< u64 > ) -> impl Iterator< Item = TileRun > + 'a {
+        let level = &self.levels[ level ];
+        let shift = level.shift;
+        let (first, end) = if range.start < range.end {
+            (range.start >> shift, ((range.end - 1) >> shift) + 1)
+        } else {
+            (0, 0)
+        };
+
+        let start = level.runs.partition_point( |&(index, count, _)| index + count <= first );
+        level.runs[ start.. ].iter()
+            .take_while( move |&&(index, _, _)| index < end )
+            .map( move |&(index, count, occupied)| TileRun {
+                address: index << shift,
+                count,
+                occupied
+            })
+    }
+
+    pub fn memory_usage( &self ) -> usize {
+        self.levels.iter().map( |level| level.runs.capacity() * std::mem::size_of::< (u64, u64, u64) >() ).sum()
+    }
+}
+
+/// The most recently used indexes, keyed by the filters they were built for.
+pub struct AddressTilesCache( Mutex< LruCache< String, Arc< AddressTiles > > > );
+
+impl Default for AddressTilesCache {
+    fn default() -> Self {
+        AddressTilesCache( Mutex::new( LruCache::new( CACHE_SIZE ) ) )
+    }
+}
+
+impl AddressTilesCache {
+    pub(crate) fn get_or_insert_with( &self, key: String, callback: impl FnOnce() -> AddressTiles ) -> Arc< AddressTiles > {
+        if let Some( tiles ) = self.0.lock().get( &key ) {
+            return tiles.clone();
+        }
+
+        let tiles = Arc::new( callback() );
+        self.0.lock().put( key, tiles.clone() );
+        tiles
+    }
+
+    pub(crate) fn memory_usage( &self ) -> usize {
+        self.0.lock().iter().map( |(_, tiles)| tiles.memory_usage() ).sum()
+    }
+}
+
+#[test]
+fn test_address_tiles() {
+    let tiles = AddressTiles::new( vec![
+        0x1000..0x1800,
+        0x1900..0x2100,
+        0x10000..0x15000,
+        0x7fff_0000_0000..0x7fff_8000_0000
+    ]);
+
+    let runs: Vec< _ > = tiles.tiles( 0, 0..0x20000 ).collect();
+    assert_eq!( runs, vec![
+        TileRun { address: 0x1000, count: 1, occupied: 0xF00 },
+        TileRun { address: 0x2000, count: 1, occupied: 0x100 },
+        TileRun { address: 0x10000, count: 5, occupied: 0x1000 }
+    ]);
+
+    let runs: Vec< _ > = tiles.tiles( 0, 0x12000..0x13000 ).collect();
+    assert_eq!( runs, vec![ TileRun { address: 0x10000, count: 5, occupied: 0x1000 } ] );
+
+    let runs: Vec< _ > = tiles.tiles( 1, 0..0x20000 ).collect();
+    assert_eq!( runs, vec![
+        TileRun { address: 0, count: 1, occupied: 0x1000 },
+        TileRun { address: 0x10000, count: 1, occupied: 0x5000 }
+    ]);
+
+    // The 2GB mapping is a single run of 512k pages.
+    let runs: Vec< _ > = tiles.tiles( 0, 0x7fff_0000_0000..0x8000_0000_0000 ).collect();
+    assert_eq!( runs, vec![ TileRun { address: 0x7fff_0000_0000, count: 0x80000, occupied: 0x1000 } ] );
+
+    assert_eq!( tiles.level_for( 0..0x8000_0000_0000, 1024 ), 7 );
+    assert_eq!( tiles.tile_size( 7 ), 1 << 40 );
+    assert_eq!( tiles.level_for( 0x10000..0x20000, 1024 ), 0 );
+    assert_eq!( tiles.tiles( 0, 0x3000..0x3000 ).count(), 0 );
+}
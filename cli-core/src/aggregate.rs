@@ -0,0 +1,270 @@
+//! Folds the allocations which get deallocated into per-backtrace aggregates while the data is being loaded.
+//!
+//! The aggregates are exactly what the profiler itself emits when it culls the temporary allocations,
+//! so the group statistics and the allocation rates still see every allocation, but only those which
+//! are alive at any given moment have to be kept around here, and only those which were never
+//! deallocated get loaded. The memory needed is then proportional to the number of live allocations
+//! and backtraces instead of to the number of events.
+
+use std::collections::VecDeque;
+use std::io;
+
+use ahash::AHashMap as HashMap;
+
+use common::Timestamp;
+use common::event::{AllocBody, AllocationId, CulledAllocationStatistics, Event, culled_lifetime_bucket};
+
+/// How often the aggregates are emitted; this is the resolution of the per-backtrace timelines.
+const INTERVAL: Timestamp = Timestamp::from_secs( 1 );
+
+struct LiveAllocation {
+    counter: u64,
+    id: AllocationId,
+    timestamp: Timestamp,
+    allocation: AllocBody
+}
+
+fn is_tracked( id: AllocationId ) -> bool {
+    !id.is_invalid() && !id.is_untracked()
+}
+
+pub struct AggregatedEvents< I > {
+    inner: I,
+    live_by_id: HashMap< AllocationId, LiveAllocation >,
+    live_by_pointer: HashMap< u64, LiveAllocation >,
+    counter: u64,
+    statistics: HashMap< u64, CulledAllocationStatistics >,
+    interval_start: Option< Timestamp >,
+    current_timestamp: Timestamp,
+    output: VecDeque< Event< 'static > >,
+    is_finished: bool
+}
+
+impl< I > AggregatedEvents< I > where I: Iterator< Item = io::Result< Event< 'static > > > {
+    pub fn new( inner: I ) -> Self {
+        AggregatedEvents {
+            inner,
+            live_by_id: HashMap::new(),
+            live_by_pointer: HashMap::new(),
+            counter: 0,
+            statistics: HashMap::new(),
+            interval_start: None,
+            current_timestamp: Timestamp::min(),
+            output: VecDeque::new(),
+            is_finished: false
+        }
+    }
+
+    fn advance( &mut self, timestamp: Timestamp ) {
+        if timestamp <= self.current_timestamp {
+            return;
+        }
+
+        self.current_timestamp = timestamp;
+        let interval_start = *self.interval_start.get_or_insert( timestamp );
+        if timestamp - interval_start >= INTERVAL {
+            self.flush_statistics();
+            self.interval_start = Some( timestamp );
+        }
+    }
+
+    fn flush_statistics( &mut self ) {
+        if self.statistics.is_empty() {
+            return;
+        }
+
+        let mut entries: Vec< _ > = self.statistics.drain().map( |(_, entry)| entry ).collect();
+        entries.sort_unstable_by_key( |entry| entry.backtrace );
+        self.output.push_back( Event::CulledAllocations {
+            timestamp: self.current_timestamp,
+            entries: entries.into()
+        });
+    }
+
+    fn take_live( &mut self, id: AllocationId, pointer: u64 ) -> Option< LiveAllocation > {
+        if is_tracked( id ) {
+            self.live_by_id.remove( &id )
+        } else {
+            self.live_by_pointer.remove( &pointer )
+        }
+    }
+
+    fn on_allocation( &mut self, id: AllocationId, timestamp: Timestamp, allocation: AllocBody ) {
+        let counter = self.counter;
+        self.counter += 1;
+
+        let live = LiveAllocation { counter, id, timestamp, allocation };
+        if is_tracked( id ) {
+            self.live_by_id.insert( id, live );
+        } else {
+            self.live_by_pointer.insert( live.allocation.pointer, live );
+        }
+    }
+
+    fn cull( &mut self, live: LiveAllocation, deallocated_at: Timestamp ) {
+        let usable_size = live.allocation.size + live.allocation.extra_usable_space as u64;
+        let lifetime = deallocated_at.as_usecs().saturating_sub( live.timestamp.as_usecs() );
+        let entry = self.statistics.entry( live.allocation.backtrace ).or_insert_with( || {
+            CulledAllocationStatistics {
+                backtrace: live.allocation.backtrace,
+                first_allocation: live.timestamp,
+                last_allocation: live.timestamp,
+                count: 0,
+                size: 0,
+                min_size: usable_size,
+                max_size: usable_size,
+                lifetimes: Vec::new()
+            }
+        });
+
+        entry.first_allocation = std::cmp::min( entry.first_allocation, live.timestamp );
+        entry.last_allocation = std::cmp::max( entry.last_allocation, live.timestamp );
+        entry.count += 1;
+        entry.size += usable_size;
+        entry.min_size = std::cmp::min( entry.min_size, usable_size );
+        entry.max_size = std::cmp::max( entry.max_size, usable_size );
+
+        let bucket = culled_lifetime_bucket( lifetime );
+        if entry.lifetimes.len() <= bucket {
+            entry.lifetimes.resize( bucket + 1, 0 );
+        }
+        entry.lifetimes[ bucket ] += 1;
+    }
+
+    /// The events of the allocations which we haven't seen, e.g. those from a checkpoint, are passed through.
+    fn process( &mut self, event: Event< 'static > ) {
+        if let Some( timestamp ) = event.timestamp() {
+            self.advance( timestamp );
+        }
+
+        match event {
+            Event::Alloc { timestamp, allocation } => self.on_allocation( AllocationId::UNTRACKED, timestamp, allocation ),
+            Event::AllocEx { id, timestamp, allocation } => self.on_allocation( id, timestamp, allocation ),
+            Event::Realloc { timestamp, old_pointer, allocation } => {
+                match self.take_live( AllocationId::UNTRACKED, old_pointer ) {
+                    Some( live ) => {
+                        self.cull( live, timestamp );
+                        self.on_allocation( AllocationId::UNTRACKED, timestamp, allocation );
+                    },
+                    None => self.output.push_back( Event::Realloc { timestamp, old_pointer, allocation } )
+                }
+            },
+            Event::ReallocEx { id, timestamp, old_pointer, allocation } => {
+                match self.take_live( id, old_pointer ) {
+                    Some( live ) => {
+                        self.cull( live, timestamp );
+                        self.on_allocation( id, timestamp, allocation );
+                    },
+                    None => self.output.push_back( Event::ReallocEx { id, timestamp, old_pointer, allocation } )
+                }
+            },
+            Event::Free { timestamp, pointer, backtrace, thread } => {
+                match self.take_live( AllocationId::UNTRACKED, pointer ) {
+                    Some( live ) => self.cull( live, timestamp ),
+                    None => self.output.push_back( Event::Free { timestamp, pointer, backtrace, thread } )
+                }
+            },
+            Event::FreeEx { id, timestamp, pointer, backtrace, thread } => {
+                match self.take_live( id, pointer ) {
+                    Some( live ) => self.cull( live, timestamp ),
+                    None => self.output.push_back( Event::FreeEx { id, timestamp, pointer, backtrace, thread } )
+                }
+            },
+            event => self.output.push_back( event )
+        }
+    }
+
+    /// Emits the last aggregates, and then every allocation which was never deallocated.
+    fn finish( &mut self ) {
+        self.flush_statistics();
+
+        let mut leaked: Vec< _ > = self.live_by_id.drain().map( |(_, live)| live ).collect();
+        leaked.extend( self.live_by_pointer.drain().map( |(_, live)| live ) );
+        leaked.sort_unstable_by_key( |live| live.counter );
+
+        for live in leaked {
+            self.output.push_back( Event::AllocEx {
+                id: live.id,
+                timestamp: live.timestamp,
+                allocation: live.allocation
+            });
+        }
+
+        self.is_finished = true;
+    }
+}
+
+impl< I > Iterator for AggregatedEvents< I > where I: Iterator< Item = io::Result< Event< 'static > > > {
+    type Item = io::Result< Event< 'static > >;
+
+    fn next( &mut self ) -> Option< Self::Item > {
+        loop {
+            if let Some( event ) = self.output.pop_front() {
+                return Some( Ok( event ) );
+            }
+
+            if self.is_finished {
+                return None;
+            }
+
+            match self.inner.next() {
+                Some( Ok( event ) ) => self.process( event ),
+                Some( Err( error ) ) => return Some( Err( error ) ),
+                None => self.finish()
+            }
+        }
+    }
+}
+
+#[test]
+fn test_aggregated_events() {
+    let allocation = |pointer: u64, size: u64, backtrace: u64| AllocBody {
+        pointer,
+        size,
+        backtrace,
+        thread: 1,
+        flags: 0,
+        extra_usable_space: 0,
+        preceding_free_space: 0
+    };
+
+    let events = vec![
+        Event::Alloc { timestamp: Timestamp::from_secs( 1 ), allocation: allocation( 0x1000, 10, 1 ) },
+        Event::Alloc { timestamp: Timestamp::from_secs( 1 ), allocation: allocation( 0x2000, 20, 1 ) },
+        Event::Alloc { timestamp: Timestamp::from_secs( 1 ), allocation: allocation( 0x3000, 30, 2 ) },
+        Event::Free { timestamp: Timestamp::from_secs( 2 ), pointer: 0x1000, backtrace: 0, thread: 1 },
+        Event::Realloc { timestamp: Timestamp::from_secs( 4 ), old_pointer: 0x3000, allocation: allocation( 0x4000, 40, 2 ) },
+        Event::Free { timestamp: Timestamp::from_secs( 5 ), pointer: 0x5000, backtrace: 0, thread: 1 }
+    ];
+
+    let output: Vec< _ > = AggregatedEvents::new( events.into_iter().map( Ok ) ).map( |event| event.unwrap() ).collect();
+    assert_eq!( output.len(), 5 );
+
+    match output[ 0 ] {
+        Event::CulledAllocations { timestamp, ref entries } => {
+            assert_eq!( timestamp, Timestamp::from_secs( 4 ) );
+            assert_eq!( entries.len(), 1 );
+            assert_eq!( entries[ 0 ].backtrace, 1 );
+            assert_eq!( entries[ 0 ].count, 1 );
+            assert_eq!( entries[ 0 ].size, 10 );
+            assert_eq!( entries[ 0 ].lifetimes.len(), culled_lifetime_bucket( 1_000_000 ) + 1 );
+        },
+        _ => panic!()
+    }
+
+    match output[ 1 ] {
+        Event::CulledAllocations { timestamp, ref entries } => {
+            assert_eq!( timestamp, Timestamp::from_secs( 5 ) );
+            assert_eq!( entries.len(), 1 );
+            assert_eq!( entries[ 0 ].backtrace, 2 );
+            assert_eq!( entries[ 0 ].size, 30 );
+        },
+        _ => panic!()
+    }
+
+    // The deallocation of something we haven't seen is passed through.
+    assert!( matches!( output[ 2 ], Event::Free { pointer: 0x5000, .. } ) );
+
+    assert!( matches!( output[ 3 ], Event::AllocEx { allocation: AllocBody { pointer: 0x2000, .. }, .. } ) );
+    assert!( matches!( output[ 4 ], Event::AllocEx { allocation: AllocBody { pointer: 0x4000, .. }, .. } ) );
+}
@@ -0,0 +1,258 @@
+//! How many allocations every backtrace made over time, to find where the allocation churn comes from.
+//!
+//! The allocations are bucketed into fixed intervals by when they were made, in a single pass.
+//! The culled allocations are only known in aggregate, so every batch of them is spread evenly
+//! over the intervals between the first and the last allocation of the batch.
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+
+use crate::{AllocationId, BacktraceId, CulledAllocations, Data, Timestamp};
+
+/// How many allocations were made in a single interval.
+#[derive(Copy, Clone, PartialEq, Eq, Debug, Default)]
+pub struct RateBucket {
+    /// The index of the interval, counting from the start of the profiling.
+    pub index: u64,
+    pub count: u64,
+    pub size: u64
+}
+
+/// The allocation rate of a single backtrace.
+#[derive(Clone, Debug)]
+pub struct AllocationRate {
+    pub backtrace: BacktraceId,
+    /// Only the intervals in which something was allocated, sorted.
+    pub buckets: Vec< RateBucket >,
+    pub count: u64,
+    pub size: u64,
+    /// How many of those allocations were culled.
+    pub culled_count: u64,
+    pub culled_size: u64,
+    /// The lifetime histogram of the culled allocations; see `CulledAllocations::lifetimes`.
+    pub culled_lifetimes: Vec< u64 >
+}
+
+impl AllocationRate {
+    pub fn peak_count( &self ) -> u64 {
+        self.buckets.iter().map( |bucket| bucket.count ).max().unwrap_or( 0 )
+    }
+
+    pub fn peak_size( &self ) -> u64 {
+        self.buckets.iter().map( |bucket| bucket.size ).max().unwrap_or( 0 )
+    }
+}
+
+#[derive(Clone, Debug)]
+pub struct AllocationRates {
+    pub start: Timestamp,
+    pub interval: Timestamp,
+    /// Sorted by the number of allocations, highest first.
+    pub rates: Vec< AllocationRate >
+}
+
+impl AllocationRates {
+    /// Turns a value from a single interval into a value per second.
+    pub fn per_second( &self, value: u64 ) -> f64 {
+        value as f64 * 1_000_000.0 / self.interval.as_usecs() as f64
+    }
+
+    /// When the interval with a given index starts.
+    pub fn timestamp_of( &self, index: u64 ) -> Timestamp {
+        Timestamp::from_usecs( self.start.as_usecs() + index * self.interval.as_usecs() )
+    }
+}
+
+type Buckets = HashMap< (BacktraceId, u64), (u64, u64) >;
+
+#[inline]
+fn bucket_of( start: Timestamp, interval: u64, timestamp: Timestamp ) -> u64 {
+    timestamp.as_usecs().saturating_sub( start.as_usecs() ) / interval
+}
+
+fn spread_culled( start: Timestamp, interval: u64, culled: &CulledAllocations, output: &mut Buckets ) {
+    let first = bucket_of( start, interval, culled.first_allocation );
+    let last = std::cmp::max( bucket_of( start, interval, culled.last_allocation ), first );
+    let length = last - first + 1;
+
+    for index in first..=last {
+        // Whatever doesn't divide evenly goes into the earliest intervals.
+        let offset = index - first;
+        let count = culled.count / length + if offset < culled.count % length { 1 } else { 0 };
+        let size = culled.size / length + if offset < culled.size % length { 1 } else { 0 };
+        if count == 0 && size == 0 {
+            continue;
+        }
+
+        let entry = output.entry( (culled.backtrace, index) ).or_default();
+        entry.0 += count;
+        entry.1 += size;
+    }
+}
+
+fn merge( mut lhs: Buckets, rhs: Buckets ) -> Buckets {
+    for (key, (count, size)) in rhs {
+        let entry = lhs.entry( key ).or_default();
+        entry.0 += count;
+        entry.1 += size;
+    }
+    lhs
+}
+
+type CulledTotals = HashMap< BacktraceId, (u64, u64, Vec< u64 >) >;
+
+fn add_culled_totals( totals: &mut CulledTotals, culled: &CulledAllocations ) {
+    let entry = totals.entry( culled.backtrace ).or_default();
+    entry.0 += culled.count;
+    entry.1 += culled.size;
+    if entry.2.len() < culled.lifetimes.len() {
+        entry.2.resize( culled.lifetimes.len(), 0 );
+    }
+
+    for (total, &count) in entry.2.iter_mut().zip( culled.lifetimes.iter() ) {
+        *total += count;
+    }
+}
+
+fn collect_rates( buckets: Buckets, mut culled: CulledTotals ) -> Vec< AllocationRate > {
+    let mut by_backtrace: HashMap< BacktraceId, Vec< RateBucket > > = HashMap::new();
+    for ((backtrace, index), (count, size)) in buckets {
+        by_backtrace.entry( backtrace ).or_default().push( RateBucket { index, count, size } );
+    }
+
+    let by_backtrace: Vec< _ > = by_backtrace.into_iter().map( |(backtrace, buckets)| {
+        (backtrace, buckets, culled.remove( &backtrace ).unwrap_or_default())
+    }).collect();
+
+    let mut rates: Vec< _ > = by_backtrace.into_par_iter().map( |(backtrace, mut buckets, (culled_count, culled_size, culled_lifetimes))| {
+        buckets.sort_unstable_by_key( |bucket| bucket.index );
+        AllocationRate {
+            backtrace,
+            count: buckets.iter().map( |bucket| bucket.count ).sum(),
+            size: buckets.iter().map( |bucket| bucket.size ).sum(),
+            buckets,
+            culled_count,
+            culled_size,
+            culled_lifetimes
+        }
+    }).collect();
+
+    rates.par_sort_unstable_by( |lhs, rhs| {
+        rhs.count.cmp( &lhs.count )
+            .then( rhs.size.cmp( &lhs.size ) )
+            .then( lhs.backtrace.cmp( &rhs.backtrace ) )
+    });
+
+    rates
+}
+
+/// Buckets the given allocations by their backtrace and by when they were made.
+///
+/// The culled allocations can't be filtered like the others, so they're only included
+/// when every allocation was given.
+pub fn find_allocation_rates( data: &Data, ids: &[AllocationId], interval: Timestamp ) -> AllocationRates {
+    let start = data.initial_timestamp();
+    let interval = std::cmp::max( interval, Timestamp::from_usecs( 1 ) );
+    let interval_us = interval.as_usecs();
+
+    let mut buckets = ids.par_iter()
+        .fold( Buckets::new, |mut output, &id| {
+            let allocation = data.get_allocation( id );
+            let entry = output.entry( (allocation.backtrace, bucket_of( start, interval_us, allocation.timestamp )) ).or_default();
+            entry.0 += allocation.sample_count();
+            entry.1 += allocation.size;
+            output
+        })
+        .reduce( Buckets::new, merge );
+
+    let mut culled_totals = CulledTotals::new();
+    if ids.len() == data.allocation_count() {
+        for culled in data.culled_allocations() {
+            spread_culled( start, interval_us, culled, &mut buckets );
+            add_culled_totals( &mut culled_totals, culled );
+        }
+    }
+
+    AllocationRates {
+        start,
+        interval,
+        rates: collect_rates( buckets, culled_totals )
+    }
+}
+
+#[test]
+fn test_spread_culled() {
+    let mut buckets = Buckets::new();
+    let culled = CulledAllocations {
+        backtrace: BacktraceId::new( 1 ),
+        first_allocation: Timestamp::from_secs( 11 ),
+        last_allocation: Timestamp::from_secs( 13 ),
+        count: 5,
+        size: 300,
+        lifetimes: Vec::new()
+    };
+
+    spread_culled( Timestamp::from_secs( 10 ), 1_000_000, &culled, &mut buckets );
+    assert_eq!( buckets.len(), 3 );
+    assert_eq!( buckets[ &(BacktraceId::new( 1 ), 1) ], (2, 100) );
+    assert_eq!( buckets[ &(BacktraceId::new( 1 ), 2) ], (2, 100) );
+    assert_eq!( buckets[ &(BacktraceId::new( 1 ), 3) ], (1, 100) );
+
+    // A batch which fits into a single interval.
+    let culled = CulledAllocations {
+        first_allocation: Timestamp::from_secs( 11 ),
+        last_allocation: Timestamp::from_secs( 11 ),
+        ..culled
+    };
+
+    spread_culled( Timestamp::from_secs( 10 ), 1_000_000, &culled, &mut buckets );
+    assert_eq!( buckets[ &(BacktraceId::new( 1 ), 1) ], (7, 400) );
+}
+
+#[test]
+fn test_collect_rates() {
+    let mut buckets = Buckets::new();
+    buckets.insert( (BacktraceId::new( 1 ), 5), (10, 100) );
+    buckets.insert( (BacktraceId::new( 1 ), 2), (30, 300) );
+    buckets.insert( (BacktraceId::new( 2 ), 0), (50, 50) );
+
+    let mut culled = CulledTotals::new();
+    add_culled_totals( &mut culled, &CulledAllocations {
+        backtrace: BacktraceId::new( 1 ),
+        first_allocation: Timestamp::from_secs( 1 ),
+        last_allocation: Timestamp::from_secs( 2 ),
+        count: 3,
+        size: 30,
+        lifetimes: vec![ 1, 2 ]
+    });
+    add_culled_totals( &mut culled, &CulledAllocations {
+        backtrace: BacktraceId::new( 1 ),
+        first_allocation: Timestamp::from_secs( 3 ),
+        last_allocation: Timestamp::from_secs( 3 ),
+        count: 2,
+        size: 20,
+        lifetimes: vec![ 0, 0, 2 ]
+    });
+
+    let rates = collect_rates( buckets, culled );
+    assert_eq!( rates.len(), 2 );
+    assert_eq!( rates[ 0 ].backtrace, BacktraceId::new( 2 ) );
+    assert_eq!( rates[ 0 ].culled_count, 0 );
+    assert_eq!( rates[ 1 ].backtrace, BacktraceId::new( 1 ) );
+    assert_eq!( rates[ 1 ].count, 40 );
+    assert_eq!( rates[ 1 ].size, 400 );
+    assert_eq!( rates[ 1 ].culled_count, 5 );
+    assert_eq!( rates[ 1 ].culled_size, 50 );
+    assert_eq!( rates[ 1 ].culled_lifetimes, vec![ 1, 2, 2 ] );
+    assert_eq!( rates[ 1 ].buckets.iter().map( |bucket| bucket.index ).collect::< Vec< _ > >(), vec![ 2, 5 ] );
+    assert_eq!( rates[ 1 ].peak_count(), 30 );
+
+    let rates = AllocationRates {
+        start: Timestamp::from_secs( 1 ),
+        interval: Timestamp::from_msecs( 500 ),
+        rates
+    };
+
+    assert_eq!( rates.per_second( 10 ), 20.0 );
+    assert_eq!( rates.timestamp_of( 3 ), Timestamp::from_msecs( 2500 ) );
+}
@@ -0,0 +1,500 @@
+//! A rough simulation of how the recorded allocations would be laid out by a given allocator.
+//!
+//! Replaying a trace for real with a different allocator is slow, so instead we estimate how much
+//! memory each allocator would keep resident by mapping every allocation onto the allocator's size
+//! classes and packing them into its slabs (jemalloc), pages (mimalloc) or heap (glibc):
+//!
+//!   * for jemalloc and mimalloc every size class is independent and is simulated in parallel;
+//!     a slab is as big as in their default configurations, its memory only becomes resident
+//!     once its regions are handed out, and it's given back as soon as it's empty,
+//!   * for glibc the chunks are carved out of a single heap with best-fit reuse and coalescing
+//!     of the freed chunks, and the heap is trimmed once enough of its top is free; the per-thread
+//!     arenas, the tcache and the fastbins aren't modeled,
+//!   * anything which any of the allocators would map directly is simply rounded up to whole pages.
+//!
+//! This ignores the allocators' metadata and their cached and not yet purged memory, so the results
+//! are only good for comparing the allocators with each other and not for predicting the exact RSS.
+
+use std::collections::{BTreeMap, BTreeSet};
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+use smallvec::SmallVec;
+
+use crate::size_classes::{GLIBC_MMAP_THRESHOLD, MIMALLOC_MEDIUM_OBJECT_SIZE_MAX, PAGE_SIZE, requested_size};
+use crate::{Data, OperationId, SizeClassAllocator, Timestamp};
+
+/// The biggest size class which jemalloc puts into slabs with 4KB pages.
+const JEMALLOC_SMALL_SIZE_MAX: u64 = 14 * 1024;
+
+const MIMALLOC_SMALL_OBJECT_SIZE_MAX: u64 = 16 * 1024;
+const MIMALLOC_SMALL_PAGE_SIZE: u64 = 64 * 1024;
+const MIMALLOC_MEDIUM_PAGE_SIZE: u64 = 512 * 1024;
+
+// The default `M_TRIM_THRESHOLD`.
+const GLIBC_TRIM_THRESHOLD: u64 = 128 * 1024;
+const GLIBC_MIN_CHUNK_SIZE: u64 = 32;
+
+#[inline]
+fn round_up( value: u64, alignment: u64 ) -> u64 {
+    (value + alignment - 1) / alignment * alignment
+}
+
+fn gcd( mut lhs: u64, mut rhs: u64 ) -> u64 {
+    while rhs != 0 {
+        let remainder = lhs % rhs;
+        lhs = rhs;
+        rhs = remainder;
+    }
+
+    lhs
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+enum Placement {
+    Slab { slab_size: u64 },
+    Heap { chunk_size: u64 },
+    Direct { size: u64 }
+}
+
+fn placement( allocator: SizeClassAllocator, size_class: u64 ) -> Placement {
+    match allocator {
+        SizeClassAllocator::Jemalloc if size_class <= JEMALLOC_SMALL_SIZE_MAX => {
+            // Like `sc.c` picks it: the smallest multiple of the page size which has no space left over.
+            Placement::Slab { slab_size: size_class / gcd( size_class, PAGE_SIZE ) * PAGE_SIZE }
+        },
+        SizeClassAllocator::Mimalloc if size_class <= MIMALLOC_SMALL_OBJECT_SIZE_MAX => {
+            Placement::Slab { slab_size: MIMALLOC_SMALL_PAGE_SIZE }
+        },
+        SizeClassAllocator::Mimalloc if size_class <= MIMALLOC_MEDIUM_OBJECT_SIZE_MAX => {
+            Placement::Slab { slab_size: MIMALLOC_MEDIUM_PAGE_SIZE }
+        },
+        SizeClassAllocator::Glibc if size_class + 8 < GLIBC_MMAP_THRESHOLD => {
+            Placement::Heap { chunk_size: size_class + 8 }
+        },
+        SizeClassAllocator::Glibc => Placement::Direct { size: size_class + 16 },
+        SizeClassAllocator::Jemalloc | SizeClassAllocator::Mimalloc => Placement::Direct { size: round_up( size_class, PAGE_SIZE ) }
+    }
+}
+
+#[derive(Copy, Clone)]
+struct Operation {
+    timestamp: Timestamp,
+    id: u64,
+    count: u32,
+    is_allocation: bool
+}
+
+#[derive(Copy, Clone, Default)]
+struct Slab {
+    live: u32,
+    /// How many regions were ever handed out since the slab was created; only those are resident.
+    touched: u32
+}
+
+/// The slabs of a single size class.
+struct SlabSimulation {
+    region_size: u64,
+    regions_per_slab: u32,
+    slab_size: u64,
+    slabs: Vec< Slab >,
+    non_full: BTreeSet< u32 >,
+    unused: BTreeSet< u32 >,
+    placements: HashMap< u64, SmallVec< [u32; 1] > >,
+    deltas: Vec< (Timestamp, i64) >
+}
+
+impl SlabSimulation {
+    fn new( region_size: u64, slab_size: u64 ) -> Self {
+        SlabSimulation {
+            region_size,
+            regions_per_slab: (slab_size / region_size) as u32,
+            slab_size,
+            slabs: Vec::new(),
+            non_full: BTreeSet::new(),
+            unused: BTreeSet::new(),
+            placements: HashMap::new(),
+            deltas: Vec::new()
+        }
+    }
+
+    fn resident( &self, touched: u32 ) -> u64 {
+        std::cmp::min( round_up( touched as u64 * self.region_size, PAGE_SIZE ), self.slab_size )
+    }
+
+    fn allocate_region( &mut self, timestamp: Timestamp ) -> u32 {
+        // Both allocators prefer to allocate from the oldest slabs, which here are the ones with the lowest index.
+        let index = match self.non_full.iter().next().copied() {
+            Some( index ) => index,
+            None => {
+                let index = match self.unused.iter().next().copied() {
+                    Some( index ) => {
+                        self.unused.remove( &index );
+                        index
+                    },
+                    None => {
+                        self.slabs.push( Slab::default() );
+                        self.slabs.len() as u32 - 1
+                    }
+                };
+
+                self.non_full.insert( index );
+                index
+            }
+        };
+
+        let slab = self.slabs[ index as usize ];
+        if slab.live == slab.touched {
+            let delta = self.resident( slab.touched + 1 ) - self.resident( slab.touched );
+            if delta != 0 {
+                self.deltas.push( (timestamp, delta as i64) );
+            }
+            self.slabs[ index as usize ].touched += 1;
+        }
+
+        self.slabs[ index as usize ].live += 1;
+        if self.slabs[ index as usize ].live == self.regions_per_slab {
+            self.non_full.remove( &index );
+        }
+
+        index
+    }
+
+    fn deallocate_region( &mut self, timestamp: Timestamp, index: u32 ) {
+        let slab = &mut self.slabs[ index as usize ];
+        let was_full = slab.live == self.regions_per_slab;
+        slab.live -= 1;
+        if slab.live == 0 {
+            let touched = std::mem::replace( &mut slab.touched, 0 );
+            self.non_full.remove( &index );
+            self.unused.insert( index );
+            self.deltas.push( (timestamp, -(self.resident( touched ) as i64)) );
+        } else if was_full {
+            self.non_full.insert( index );
+        }
+    }
+
+    fn run( mut self, operations: &[Operation] ) -> Vec< (Timestamp, i64) > {
+        for operation in operations {
+            if operation.is_allocation {
+                let regions = (0..operation.count).map( |_| self.allocate_region( operation.timestamp ) ).collect();
+                self.placements.insert( operation.id, regions );
+            } else if let Some( regions ) = self.placements.remove( &operation.id ) {
+                for index in regions {
+                    self.deallocate_region( operation.timestamp, index );
+                }
+            }
+        }
+
+        self.deltas
+    }
+}
+
+/// A single glibc heap.
+struct HeapSimulation {
+    free_by_address: BTreeMap< u64, u64 >,
+    free_by_size: BTreeSet< (u64, u64) >,
+    /// Where the unused space at the end of the heap starts.
+    top: u64,
+    /// Where the heap ends.
+    end: u64,
+    placements: HashMap< u64, SmallVec< [(u64, u64); 1] > >,
+    deltas: Vec< (Timestamp, i64) >
+}
+
+impl HeapSimulation {
+    fn new() -> Self {
+        HeapSimulation {
+            free_by_address: BTreeMap::new(),
+            free_by_size: BTreeSet::new(),
+            top: 0,
+            end: 0,
+            placements: HashMap::new(),
+            deltas: Vec::new()
+        }
+    }
+
+    fn remove_free( &mut self, address: u64, size: u64 ) {
+        self.free_by_address.remove( &address );
+        self.free_by_size.remove( &(size, address) );
+    }
+
+    fn insert_free( &mut self, address: u64, size: u64 ) {
+        self.free_by_address.insert( address, size );
+        self.free_by_size.insert( (size, address) );
+    }
+
+    fn allocate_chunk( &mut self, timestamp: Timestamp, chunk_size: u64 ) -> (u64, u64) {
+        if let Some( &(size, address) ) = self.free_by_size.range( (chunk_size, 0).. ).next() {
+            self.remove_free( address, size );
+            if size - chunk_size >= GLIBC_MIN_CHUNK_SIZE {
+                self.insert_free( address + chunk_size, size - chunk_size );
+                return (address, chunk_size);
+            }
+
+            return (address, size);
+        }
+
+        let address = self.top;
+        self.top += chunk_size;
+        if self.top > self.end {
+            let end = round_up( self.top, PAGE_SIZE );
+            self.deltas.push( (timestamp, (end - self.end) as i64) );
+            self.end = end;
+        }
+
+        (address, chunk_size)
+    }
+
+    fn deallocate_chunk( &mut self, timestamp: Timestamp, mut address: u64, mut size: u64 ) {
+        if let Some( (&previous_address, &previous_size) ) = self.free_by_address.range( ..address ).next_back() {
+            if previous_address + previous_size == address {
+                self.remove_free( previous_address, previous_size );
+                address = previous_address;
+                size += previous_size;
+            }
+        }
+
+        if let Some( &next_size ) = self.free_by_address.get( &(address + size) ) {
+            self.remove_free( address + size, next_size );
+            size += next_size;
+        }
+
+        if address + size != self.top {
+            self.insert_free( address, size );
+            return;
+        }
+
+        self.top = address;
+        if self.end - self.top >= GLIBC_TRIM_THRESHOLD {
+            let end = round_up( self.top, PAGE_SIZE );
+            self.deltas.push( (timestamp, -((self.end - end) as i64)) );
+            self.end = end;
+        }
+    }
+
+    fn run( mut self, operations: &[(Operation, u64)] ) -> Vec< (Timestamp, i64) > {
+        for &(operation, chunk_size) in operations {
+            if operation.is_allocation {
+                let chunks = (0..operation.count).map( |_| self.allocate_chunk( operation.timestamp, chunk_size ) ).collect();
+                self.placements.insert( operation.id, chunks );
+            } else if let Some( chunks ) = self.placements.remove( &operation.id ) {
+                for (address, size) in chunks {
+                    self.deallocate_chunk( operation.timestamp, address, size );
+                }
+            }
+        }
+
+        self.deltas
+    }
+}
+
+/// The simulated footprint of a set of allocations under a single allocator.
+pub struct AllocatorSimulation {
+    pub allocator: SizeClassAllocator,
+    /// How the simulated resident memory changes over time; sorted by the timestamp.
+    pub resident_deltas: Vec< (Timestamp, i64) >,
+    pub peak_resident: u64,
+    pub peak_resident_timestamp: Timestamp,
+    /// How many bytes the live allocations have requested when the resident memory peaked.
+    pub requested_at_peak: u64,
+    pub peak_requested: u64,
+    pub final_resident: u64,
+    /// How much of the resident memory wasn't requested, averaged over time.
+    pub average_fragmentation: f64
+}
+
+impl AllocatorSimulation {
+    /// Simulates the given operations, which have to be sorted by their timestamps.
+    pub fn new( data: &Data, ops: &[OperationId], allocator: SizeClassAllocator ) -> Self {
+        let mut requested_deltas = Vec::with_capacity( ops.len() );
+        let mut resident_deltas = Vec::new();
+        let mut by_size_class: HashMap< u64, Vec< Operation > > = HashMap::new();
+        let mut heap_operations = Vec::new();
+        for &op in ops {
+            if !op.is_allocation() && !op.is_deallocation() {
+                continue;
+            }
+
+            let allocation = data.get_allocation( op.id() );
+            let is_allocation = op.is_allocation();
+            let timestamp = if is_allocation { allocation.timestamp } else { allocation.deallocation.as_ref().unwrap().timestamp };
+            let sign = if is_allocation { 1 } else { -1 };
+            requested_deltas.push( (timestamp, sign * allocation.size as i64) );
+
+            let operation = Operation {
+                timestamp,
+                id: op.id().raw(),
+                count: allocation.sample_count() as u32,
+                is_allocation
+            };
+
+            let size_class = allocator.size_class( requested_size( allocation ) );
+            match placement( allocator, size_class ) {
+                Placement::Slab { .. } => by_size_class.entry( size_class ).or_default().push( operation ),
+                Placement::Heap { chunk_size } => heap_operations.push( (operation, chunk_size) ),
+                Placement::Direct { size } => resident_deltas.push( (timestamp, sign * (size * operation.count as u64) as i64) )
+            }
+        }
+
+        let by_size_class: Vec< _ > = by_size_class.into_iter().collect();
+        let (heap_deltas, slab_deltas) = rayon::join(
+            || HeapSimulation::new().run( &heap_operations ),
+            || by_size_class.into_par_iter().map( |(size_class, operations)| {
+                let slab_size = match placement( allocator, size_class ) {
+                    Placement::Slab { slab_size } => slab_size,
+                    _ => unreachable!()
+                };
+
+                SlabSimulation::new( size_class, slab_size ).run( &operations )
+            }).flatten_iter().collect::< Vec< _ > >()
+        );
+
+        resident_deltas.extend( heap_deltas );
+        resident_deltas.extend( slab_deltas );
+        resident_deltas.par_sort_by_key( |&(timestamp, _)| timestamp );
+
+        Self::from_deltas( allocator, resident_deltas, &requested_deltas )
+    }
+
+    fn from_deltas( allocator: SizeClassAllocator, resident_deltas: Vec< (Timestamp, i64) >, requested_deltas: &[(Timestamp, i64)] ) -> Self {
+        let mut peak_resident = 0;
+        let mut peak_resident_timestamp = Timestamp::min();
+        let mut requested_at_peak = 0;
+        let mut peak_requested = 0;
+
+        let mut resident: i64 = 0;
+        let mut requested: i64 = 0;
+        let mut last_timestamp = None;
+        let mut resident_area = 0.0;
+        let mut unrequested_area = 0.0;
+
+        let mut resident_iter = resident_deltas.iter().peekable();
+        let mut requested_iter = requested_deltas.iter().peekable();
+        loop {
+            let timestamp = match (resident_iter.peek(), requested_iter.peek()) {
+                (Some( &&(lhs, _) ), Some( &&(rhs, _) )) => std::cmp::min( lhs, rhs ),
+                (Some( &&(timestamp, _) ), None) | (None, Some( &&(timestamp, _) )) => timestamp,
+                (None, None) => break
+            };
+
+            if let Some( last_timestamp ) = last_timestamp {
+                let elapsed = (timestamp - last_timestamp).as_usecs() as f64;
+                resident_area += resident as f64 * elapsed;
+                unrequested_area += std::cmp::max( resident - requested, 0 ) as f64 * elapsed;
+            }
+            last_timestamp = Some( timestamp );
+
+            while let Some( &(_, delta) ) = resident_iter.next_if( |&&(current, _)| current == timestamp ) {
+                resident += delta;
+            }
+
+            while let Some( &(_, delta) ) = requested_iter.next_if( |&&(current, _)| current == timestamp ) {
+                requested += delta;
+            }
+
+            if resident as u64 > peak_resident {
+                peak_resident = resident as u64;
+                peak_resident_timestamp = timestamp;
+                requested_at_peak = std::cmp::max( requested, 0 ) as u64;
+            }
+
+            peak_requested = std::cmp::max( peak_requested, std::cmp::max( requested, 0 ) as u64 );
+        }
+
+        AllocatorSimulation {
+            allocator,
+            resident_deltas,
+            peak_resident,
+            peak_resident_timestamp,
+            requested_at_peak,
+            peak_requested,
+            final_resident: std::cmp::max( resident, 0 ) as u64,
+            average_fragmentation: if resident_area > 0.0 { unrequested_area / resident_area } else { 0.0 }
+        }
+    }
+
+    /// How much of the resident memory wasn't requested when it peaked.
+    pub fn fragmentation_at_peak( &self ) -> f64 {
+        if self.peak_resident == 0 {
+            return 0.0;
+        }
+
+        1.0 - std::cmp::min( self.requested_at_peak, self.peak_resident ) as f64 / self.peak_resident as f64
+    }
+}
+
+#[test]
+fn test_slab_placement() {
+    assert_eq!( placement( SizeClassAllocator::Jemalloc, 8 ), Placement::Slab { slab_size: 4096 } );
+    assert_eq!( placement( SizeClassAllocator::Jemalloc, 48 ), Placement::Slab { slab_size: 3 * 4096 } );
+    assert_eq!( placement( SizeClassAllocator::Jemalloc, 14 * 1024 ), Placement::Slab { slab_size: 7 * 4096 } );
+    assert_eq!( placement( SizeClassAllocator::Jemalloc, 16 * 1024 ), Placement::Direct { size: 16 * 1024 } );
+    assert_eq!( placement( SizeClassAllocator::Mimalloc, 1024 ), Placement::Slab { slab_size: 64 * 1024 } );
+    assert_eq!( placement( SizeClassAllocator::Mimalloc, 20 * 1024 ), Placement::Slab { slab_size: 512 * 1024 } );
+    assert_eq!( placement( SizeClassAllocator::Glibc, 24 ), Placement::Heap { chunk_size: 32 } );
+    assert_eq!( placement( SizeClassAllocator::Glibc, 200 * 1024 + 4096 - 16 ), Placement::Direct { size: 200 * 1024 + 4096 } );
+}
+
+#[test]
+fn test_slab_simulation() {
+    let operation = |timestamp: u64, id: u64, is_allocation: bool| Operation {
+        timestamp: Timestamp::from_secs( timestamp ),
+        id,
+        count: 1,
+        is_allocation
+    };
+
+    // Four 1KB regions per 4KB slab.
+    let deltas = SlabSimulation::new( 1024, 4096 ).run( &[
+        operation( 1, 1, true ),
+        operation( 2, 2, true ),
+        operation( 3, 3, true ),
+        operation( 4, 4, true ),
+        operation( 5, 5, true ),
+        operation( 6, 1, false ),
+        operation( 7, 6, true ),
+        operation( 8, 5, false )
+    ]);
+
+    let deltas: Vec< _ > = deltas.into_iter().map( |(timestamp, delta)| (timestamp.as_secs(), delta) ).collect();
+    assert_eq!( deltas, vec![ (1, 4096), (5, 4096), (8, -4096) ] );
+}
+
+#[test]
+fn test_heap_simulation() {
+    let operation = |timestamp: u64, id: u64, is_allocation: bool| (Operation {
+        timestamp: Timestamp::from_secs( timestamp ),
+        id,
+        count: 1,
+        is_allocation
+    }, 64 * 1024);
+
+    let deltas = HeapSimulation::new().run( &[
+        operation( 1, 1, true ),
+        operation( 2, 2, true ),
+        operation( 3, 3, true ),
+        operation( 4, 2, false ),
+        // This one fits into the hole left by the previous one.
+        operation( 5, 4, true ),
+        operation( 6, 3, false ),
+        operation( 7, 4, false ),
+    ]);
+
+    let deltas: Vec< _ > = deltas.into_iter().map( |(timestamp, delta)| (timestamp.as_secs(), delta) ).collect();
+    assert_eq!( deltas, vec![ (1, 64 * 1024), (2, 64 * 1024), (3, 64 * 1024), (7, -128 * 1024) ] );
+}
+
+#[test]
+fn test_simulation_statistics() {
+    let resident = vec![ (Timestamp::from_secs( 1 ), 4096), (Timestamp::from_secs( 3 ), -4096) ];
+    let requested = vec![ (Timestamp::from_secs( 1 ), 1024), (Timestamp::from_secs( 2 ), 1024), (Timestamp::from_secs( 3 ), -2048) ];
+    let simulation = AllocatorSimulation::from_deltas( SizeClassAllocator::Jemalloc, resident, &requested );
+    assert_eq!( simulation.peak_resident, 4096 );
+    assert_eq!( simulation.peak_resident_timestamp, Timestamp::from_secs( 1 ) );
+    assert_eq!( simulation.requested_at_peak, 1024 );
+    assert_eq!( simulation.peak_requested, 2048 );
+    assert_eq!( simulation.final_resident, 0 );
+    assert_eq!( simulation.fragmentation_at_peak(), 0.75 );
+    assert!( (simulation.average_fragmentation - 0.625).abs() < 1e-9 );
+}
@@ -0,0 +1,110 @@
+//! All of the backtraces merged into a single prefix tree of frames.
+//!
+//! Most of the backtraces share the majority of their frames with other backtraces,
+//! so anything which needs to aggregate over the whole call tree (like the flamegraphs)
+//! can work on every unique prefix once instead of walking every frame of every backtrace.
+
+use ahash::AHashMap as HashMap;
+
+use crate::data::{BacktraceId, FrameId};
+
+/// The parent of the nodes which are at the outermost frames of their backtraces.
+pub const ROOT: u32 = u32::MAX;
+
+pub struct BacktraceTrie {
+    /// The parent of every node; always lower than the index of the node itself.
+    parents: Vec< u32 >,
+    frames: Vec< u32 >,
+    /// The node at the innermost frame of every backtrace, or `ROOT` if the backtrace is empty.
+    leaves: Vec< u32 >
+}
+
+impl BacktraceTrie {
+    /// Builds the trie out of the backtraces, given in root-first order.
+    pub fn new< I, B >( backtraces: I ) -> Self
+        where I: IntoIterator< Item = B >,
+              B: IntoIterator< Item = FrameId >
+    {
+        let mut parents = Vec::new();
+        let mut frames = Vec::new();
+        let mut leaves = Vec::new();
+        let mut children: HashMap< (u32, u32), u32 > = HashMap::new();
+        for backtrace in backtraces {
+            let mut node = ROOT;
+            for frame_id in backtrace {
+                let frame_id = frame_id as u32;
+                node = *children.entry( (node, frame_id) ).or_insert_with( || {
+                    assert!( parents.len() < ROOT as usize );
+                    parents.push( node );
+                    frames.push( frame_id );
+                    parents.len() as u32 - 1
+                });
+            }
+
+            leaves.push( node );
+        }
+
+        parents.shrink_to_fit();
+        frames.shrink_to_fit();
+        BacktraceTrie { parents, frames, leaves }
+    }
+
+    pub fn len( &self ) -> usize {
+        self.parents.len()
+    }
+
+    pub fn is_empty( &self ) -> bool {
+        self.parents.is_empty()
+    }
+
+    #[inline]
+    pub fn parent( &self, node: u32 ) -> u32 {
+        self.parents[ node as usize ]
+    }
+
+    #[inline]
+    pub fn frame( &self, node: u32 ) -> FrameId {
+        self.frames[ node as usize ] as FrameId
+    }
+
+    #[inline]
+    pub fn leaf( &self, id: BacktraceId ) -> u32 {
+        self.leaves[ id.raw() as usize ]
+    }
+
+    /// Returns how many bytes this takes on the heap.
+    pub fn memory_usage( &self ) -> usize {
+        (self.parents.capacity() + self.frames.capacity() + self.leaves.capacity()) * std::mem::size_of::< u32 >()
+    }
+}
+
+#[test]
+fn test_backtrace_trie() {
+    let backtraces: Vec< Vec< FrameId > > = vec![
+        vec![ 1, 2, 3 ],
+        vec![ 1, 2, 4 ],
+        vec![],
+        vec![ 1, 2 ],
+        vec![ 5, 2, 3 ],
+        vec![ 1, 2, 3 ]
+    ];
+
+    let trie = BacktraceTrie::new( backtraces.iter().map( |frames| frames.iter().copied() ) );
+    assert_eq!( trie.len(), 7 );
+
+    for (index, frames) in backtraces.iter().enumerate() {
+        let mut node = trie.leaf( BacktraceId::new( index as u32 ) );
+        let mut walked = Vec::new();
+        while node != ROOT {
+            assert!( trie.parent( node ) == ROOT || trie.parent( node ) < node );
+            walked.push( trie.frame( node ) );
+            node = trie.parent( node );
+        }
+
+        walked.reverse();
+        assert_eq!( &walked, frames );
+    }
+
+    assert_eq!( trie.leaf( BacktraceId::new( 0 ) ), trie.leaf( BacktraceId::new( 5 ) ) );
+    assert_eq!( trie.parent( trie.leaf( BacktraceId::new( 1 ) ) ), trie.leaf( BacktraceId::new( 3 ) ) );
+}
@@ -0,0 +1,144 @@
+use rayon::prelude::*;
+
+/// A dense set of indexes from `0` to `len`, one bit per index.
+#[derive(Clone, PartialEq, Eq, Debug)]
+pub struct Bitmap {
+    words: Vec< u64 >,
+    length: usize
+}
+
+#[inline]
+fn word_count( length: usize ) -> usize {
+    (length + 63) / 64
+}
+
+impl Bitmap {
+    pub fn empty( length: usize ) -> Self {
+        Bitmap {
+            words: vec![ 0; word_count( length ) ],
+            length
+        }
+    }
+
+    pub fn full( length: usize ) -> Self {
+        let mut bitmap = Bitmap {
+            words: vec![ !0; word_count( length ) ],
+            length
+        };
+
+        bitmap.clear_tail();
+        bitmap
+    }
+
+    /// Creates a bitmap by calling `callback` for every 64-bit word in parallel.
+    ///
+    /// The `callback` receives the index of the first bit of the word and the number
+    /// of valid bits in it.
+    pub fn from_words< F >( length: usize, callback: F ) -> Self where F: Fn( usize, usize ) -> u64 + Send + Sync {
+        let mut words = vec![ 0; word_count( length ) ];
+        words.par_iter_mut().enumerate().for_each( |(word_index, word)| {
+            let start = word_index * 64;
+            *word = callback( start, std::cmp::min( length - start, 64 ) );
+        });
+
+        let mut bitmap = Bitmap { words, length };
+        bitmap.clear_tail();
+        bitmap
+    }
+
+    fn clear_tail( &mut self ) {
+        let tail = self.length % 64;
+        if tail != 0 {
+            *self.words.last_mut().unwrap() &= (1 << tail) - 1;
+        }
+    }
+
+    #[inline]
+    pub fn len( &self ) -> usize {
+        self.length
+    }
+
+    #[inline]
+    pub fn contains( &self, index: usize ) -> bool {
+        index < self.length && self.words[ index / 64 ] & (1 << (index % 64)) != 0
+    }
+
+    #[inline]
+    pub fn insert( &mut self, index: usize ) {
+        assert!( index < self.length );
+        self.words[ index / 64 ] |= 1 << (index % 64);
+    }
+
+    pub fn count_ones( &self ) -> usize {
+        self.words.iter().map( |word| word.count_ones() as usize ).sum()
+    }
+
+    pub fn intersect_with( &mut self, rhs: &Bitmap ) {
+        assert_eq!( self.length, rhs.length );
+        for (lhs, rhs) in self.words.iter_mut().zip( rhs.words.iter() ) {
+            *lhs &= *rhs;
+        }
+    }
+
+    pub fn union_with( &mut self, rhs: &Bitmap ) {
+        assert_eq!( self.length, rhs.length );
+        for (lhs, rhs) in self.words.iter_mut().zip( rhs.words.iter() ) {
+            *lhs |= *rhs;
+        }
+    }
+
+    pub fn invert( &mut self ) {
+        for word in self.words.iter_mut() {
+            *word = !*word;
+        }
+
+        self.clear_tail();
+    }
+
+    pub fn iter< 'a >( &'a self ) -> impl Iterator< Item = usize > + 'a {
+        self.words.iter().enumerate().flat_map( |(word_index, &word)| {
+            let mut word = word;
+            std::iter::from_fn( move || {
+                if word == 0 {
+                    return None;
+                }
+
+                let bit = word.trailing_zeros() as usize;
+                word &= word - 1;
+                Some( word_index * 64 + bit )
+            })
+        })
+    }
+}
+
+#[test]
+fn test_bitmap() {
+    let mut bitmap = Bitmap::empty( 130 );
+    bitmap.insert( 0 );
+    bitmap.insert( 63 );
+    bitmap.insert( 64 );
+    bitmap.insert( 129 );
+    assert_eq!( bitmap.iter().collect::< Vec< _ > >(), vec![ 0, 63, 64, 129 ] );
+    assert!( bitmap.contains( 63 ) );
+    assert!( !bitmap.contains( 62 ) );
+    assert!( !bitmap.contains( 130 ) );
+
+    let mut inverted = bitmap.clone();
+    inverted.invert();
+    assert_eq!( inverted.count_ones(), 126 );
+    assert!( !inverted.contains( 129 ) );
+
+    inverted.intersect_with( &bitmap );
+    assert_eq!( inverted.count_ones(), 0 );
+
+    inverted.union_with( &bitmap );
+    assert_eq!( inverted, bitmap );
+
+    assert_eq!( Bitmap::full( 130 ).count_ones(), 130 );
+
+    let odd = Bitmap::from_words( 130, |start, count| {
+        (0..count).filter( |bit| (start + bit) % 2 == 1 ).fold( 0, |word, bit| word | (1 << bit) )
+    });
+    assert_eq!( odd.count_ones(), 65 );
+    assert!( odd.iter().all( |index| index % 2 == 1 ) );
+}
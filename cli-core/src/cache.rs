@@ -0,0 +1,1627 @@
+//! A columnar on-disk cache of the fully loaded `Data`.
+//!
+//! Loading a big trace can take a long time, so the finalized `Data` can be saved into
+//! a `.bhcache` file right next to it and loaded back from there the next time.
+//!
+//! Every column is stored as a little endian `u64` element count followed by the elements
+//! themselves, padded to a multiple of eight bytes. The cache is mapped into memory when
+//! loaded and the biggest columns are used in-place, so they don't take up any memory
+//! of their own and can be paged out by the kernel when they're not being used. The few
+//! things which don't fit into this scheme, like the maps, are stored as opaque byte columns.
+
+use std::ffi::{OsStr, OsString};
+use std::fs::{self, File};
+use std::io::{self, BufWriter, Write};
+use std::mem;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::{Instant, UNIX_EPOCH};
+
+use byteorder::{ByteOrder, LittleEndian, ReadBytesExt, WriteBytesExt};
+use once_cell::sync::OnceCell;
+
+use common::event::{BacktraceCacheLevelStatistics, JemallocArenaStats, JemallocBinStats, ProfilerHistogram, RuntimeOption};
+
+use crate::data::{
+    Allocation,
+    AllocationChain,
+    AllocationColumns,
+    AllocationFlags,
+    AllocationId,
+    BacktraceId,
+    CodePointer,
+    CulledAllocations,
+    AllocatorLatencies,
+    PageFault,
+    AllocatorCall,
+    Data,
+    DataId,
+    Deallocation,
+    GroupStatistics,
+    HugePageFlags,
+    Mallopt,
+    MalloptKind,
+    Map,
+    MapDeallocation,
+    MapId,
+    MapRegion,
+    MapRegionDeallocation,
+    MapRegionDeallocationSource,
+    MapSource,
+    MapUsage,
+    JemallocSnapshot,
+    CgroupSample,
+    MemoryDump,
+    MemoryAdvice,
+    OperationId,
+    OptionChange,
+    Pool,
+    RegionFlags,
+    ResidencySample,
+    StringId,
+    StringInterner,
+    Thread,
+    Timestamp,
+    build_map_sparklines
+};
+
+use crate::column::{Column, Mapping};
+use crate::frame::Frame;
+use crate::vecvec::DenseVecVec;
+use crate::lifetime_sketch::LifetimeSketch;
+
+const MAGIC: &[u8; 8] = b"BHCACHE\0";
+
+/// Has to be bumped every time the layout of the file changes.
+const VERSION: u64 = 23;
+
+const HAS_DEALLOCATION: u8 = 1 << 0;
+const HAS_DEALLOCATION_BACKTRACE: u8 = 1 << 1;
+
+/// Identifies the exact trace from which the cache was generated.
+#[derive(PartialEq, Eq, Debug)]
+pub struct CacheKey {
+    id: (u64, u64),
+    file_size: u64,
+    mtime_secs: u64,
+    mtime_nsecs: u64,
+    debug_symbols_hash: u64
+}
+
+impl CacheKey {
+    pub fn new< D: AsRef< OsStr > >( id: DataId, path: &Path, debug_symbols: &[D] ) -> io::Result< Self > {
+        let metadata = fs::metadata( path )?;
+        let mtime = metadata.modified()?.duration_since( UNIX_EPOCH ).unwrap_or_default();
+
+        // FNV-1a; the same debug symbols must always hash to the same value, even across builds.
+        let mut debug_symbols_hash: u64 = 0xcbf29ce484222325;
+        for path in debug_symbols {
+            for &byte in path.as_ref().to_string_lossy().as_bytes().iter().chain( &[0] ) {
+                debug_symbols_hash ^= byte as u64;
+                debug_symbols_hash = debug_symbols_hash.wrapping_mul( 0x100000001b3 );
+            }
+        }
+
+        Ok( CacheKey {
+            id: id.raw(),
+            file_size: metadata.len(),
+            mtime_secs: mtime.as_secs(),
+            mtime_nsecs: mtime.subsec_nanos() as u64,
+            debug_symbols_hash
+        })
+    }
+}
+
+/// Returns the path of the cache for the given trace.
+pub fn cache_path( path: &Path ) -> PathBuf {
+    let mut cache_path: OsString = path.as_os_str().to_owned();
+    cache_path.push( ".bhcache" );
+    cache_path.into()
+}
+
+fn invalid_data( message: &str ) -> io::Error {
+    io::Error::new( io::ErrorKind::InvalidData, format!( "corrupted cache: {}", message ) )
+}
+
+trait Value: Copy {
+    const SIZE: usize;
+    fn write_to< W: Write >( self, fp: &mut W ) -> io::Result< () >;
+    fn read_from( bytes: &[u8] ) -> Self;
+}
+
+impl Value for u8 {
+    const SIZE: usize = 1;
+
+    fn write_to< W: Write >( self, fp: &mut W ) -> io::Result< () > {
+        fp.write_u8( self )
+    }
+
+    fn read_from( bytes: &[u8] ) -> Self {
+        bytes[ 0 ]
+    }
+}
+
+impl Value for u32 {
+    const SIZE: usize = 4;
+
+    fn write_to< W: Write >( self, fp: &mut W ) -> io::Result< () > {
+        fp.write_u32::< LittleEndian >( self )
+    }
+
+    fn read_from( bytes: &[u8] ) -> Self {
+        LittleEndian::read_u32( bytes )
+    }
+}
+
+impl Value for u64 {
+    const SIZE: usize = 8;
+
+    fn write_to< W: Write >( self, fp: &mut W ) -> io::Result< () > {
+        fp.write_u64::< LittleEndian >( self )
+    }
+
+    fn read_from( bytes: &[u8] ) -> Self {
+        LittleEndian::read_u64( bytes )
+    }
+}
+
+fn padding( size: usize ) -> usize {
+    (8 - size % 8) % 8
+}
+
+struct CacheWriter< W: Write > {
+    fp: W
+}
+
+impl< W: Write > CacheWriter< W > {
+    fn u64( &mut self, value: u64 ) -> io::Result< () > {
+        self.fp.write_u64::< LittleEndian >( value )
+    }
+
+    fn column< T: Value, I: ExactSizeIterator< Item = T > >( &mut self, values: I ) -> io::Result< () > {
+        let length = values.len();
+        self.u64( length as u64 )?;
+        for value in values {
+            value.write_to( &mut self.fp )?;
+        }
+
+        let padding = padding( length * T::SIZE );
+        self.fp.write_all( &[0; 8][ ..padding ] )
+    }
+
+    fn bytes( &mut self, bytes: &[u8] ) -> io::Result< () > {
+        self.column( bytes.iter().cloned() )
+    }
+}
+
+/// Types which are stored in the cache exactly like they're laid out in memory
+/// (on a little endian machine), so their columns can be used straight from the mapping.
+unsafe trait Mappable: Sized {
+    type Raw: Value;
+    fn from_raw( raw: Self::Raw ) -> Self;
+
+    /// Checks whether all of the raw values are valid representations of this type.
+    fn validate( _: &[u8] ) -> bool {
+        true
+    }
+}
+
+unsafe impl Mappable for u64 {
+    type Raw = u64;
+    fn from_raw( raw: u64 ) -> Self {
+        raw
+    }
+}
+
+unsafe impl Mappable for OperationId {
+    type Raw = u64;
+    fn from_raw( raw: u64 ) -> Self {
+        OperationId::from_raw( raw )
+    }
+}
+
+unsafe impl Mappable for AllocationId {
+    type Raw = u64;
+    fn from_raw( raw: u64 ) -> Self {
+        AllocationId::new( raw - 1 )
+    }
+
+    fn validate( bytes: &[u8] ) -> bool {
+        bytes.chunks_exact( 8 ).all( |raw| LittleEndian::read_u64( raw ) != 0 )
+    }
+}
+
+unsafe impl Mappable for usize {
+    type Raw = u64;
+    fn from_raw( raw: u64 ) -> Self {
+        raw as usize
+    }
+
+    fn validate( bytes: &[u8] ) -> bool {
+        mem::size_of::< usize >() == 8 || bytes.chunks_exact( 8 ).all( |raw| LittleEndian::read_u64( raw ) <= usize::MAX as u64 )
+    }
+}
+
+unsafe impl Mappable for Timestamp {
+    type Raw = u64;
+    fn from_raw( raw: u64 ) -> Self {
+        Timestamp::from_usecs( raw )
+    }
+}
+
+unsafe impl Mappable for BacktraceId {
+    type Raw = u32;
+    fn from_raw( raw: u32 ) -> Self {
+        BacktraceId::new( raw )
+    }
+}
+
+unsafe impl Mappable for AllocationFlags {
+    type Raw = u8;
+    fn from_raw( raw: u8 ) -> Self {
+        AllocationFlags::from_bits_truncate( raw )
+    }
+
+    fn validate( bytes: &[u8] ) -> bool {
+        bytes.iter().all( |&raw| AllocationFlags::from_bits( raw ).is_some() )
+    }
+}
+
+struct CacheReader {
+    mapping: Arc< Mapping >,
+    position: usize
+}
+
+impl CacheReader {
+    fn take( &mut self, length: usize ) -> io::Result< &[u8] > {
+        let bytes = self.mapping.as_slice();
+        if length > bytes.len() - self.position {
+            return Err( invalid_data( "unexpected end of file" ) );
+        }
+
+        let bytes = &bytes[ self.position..self.position + length ];
+        self.position += length;
+        Ok( bytes )
+    }
+
+    fn u64( &mut self ) -> io::Result< u64 > {
+        self.take( 8 ).map( LittleEndian::read_u64 )
+    }
+
+    /// Returns the byte offset and the length of the next column.
+    fn column_range( &mut self, element_size: usize ) -> io::Result< (usize, usize) > {
+        let length = self.u64()?;
+        let size = length.checked_mul( element_size as u64 ).ok_or_else( || invalid_data( "column too big" ) )?;
+        if size > self.mapping.as_slice().len() as u64 {
+            return Err( invalid_data( "unexpected end of file" ) );
+        }
+
+        let size = size as usize;
+        let offset = self.position;
+        self.take( size + padding( size ) )?;
+        Ok( (offset, length as usize) )
+    }
+
+    fn column< T: Value >( &mut self ) -> io::Result< Vec< T > > {
+        let (offset, length) = self.column_range( T::SIZE )?;
+        let bytes = &self.mapping.as_slice()[ offset..offset + length * T::SIZE ];
+        Ok( bytes.chunks_exact( T::SIZE ).map( T::read_from ).collect() )
+    }
+
+    fn column_of_length< T: Value >( &mut self, length: usize ) -> io::Result< Vec< T > > {
+        let column = self.column()?;
+        if column.len() != length {
+            return Err( invalid_data( "mismatched column length" ) );
+        }
+
+        Ok( column )
+    }
+
+    /// Returns the next column as a view into the mapping if possible.
+    fn mapped_column< T: Mappable >( &mut self ) -> io::Result< Column< T > > {
+        let size = T::Raw::SIZE;
+        let (offset, length) = self.column_range( size )?;
+        let bytes = &self.mapping.as_slice()[ offset..offset + length * size ];
+        if !T::validate( bytes ) {
+            return Err( invalid_data( "invalid value" ) );
+        }
+
+        if cfg!( target_endian = "little" ) && mem::size_of::< T >() == size && bytes.as_ptr() as usize % mem::align_of::< T >() == 0 {
+            return Ok( unsafe { Column::from_mapping( self.mapping.clone(), offset, length ) } );
+        }
+
+        Ok( bytes.chunks_exact( size ).map( |raw| T::from_raw( T::Raw::read_from( raw ) ) ).collect() )
+    }
+
+    fn mapped_column_of_length< T: Mappable >( &mut self, length: usize ) -> io::Result< Column< T > > {
+        let column = self.mapped_column()?;
+        if column.len() != length {
+            return Err( invalid_data( "mismatched column length" ) );
+        }
+
+        Ok( column )
+    }
+
+    fn string( &mut self ) -> io::Result< String > {
+        String::from_utf8( self.column()? ).map_err( |_| invalid_data( "invalid string" ) )
+    }
+}
+
+fn encode_allocation_id( id: Option< AllocationId > ) -> u64 {
+    id.map( |id| id.raw() + 1 ).unwrap_or( 0 )
+}
+
+fn decode_allocation_id( value: u64 ) -> Option< AllocationId > {
+    if value == 0 {
+        None
+    } else {
+        Some( AllocationId::new( value - 1 ) )
+    }
+}
+
+fn encode_timestamp( timestamp: Option< Timestamp > ) -> u64 {
+    timestamp.map( |timestamp| timestamp.as_usecs() + 1 ).unwrap_or( 0 )
+}
+
+fn decode_timestamp( value: u64 ) -> Option< Timestamp > {
+    value.checked_sub( 1 ).map( Timestamp::from_usecs )
+}
+
+fn encode_string_id( id: Option< StringId > ) -> u32 {
+    id.map( |id| id.to_usize() as u32 + 1 ).unwrap_or( 0 )
+}
+
+fn decode_string_id( value: u32, interner: &StringInterner ) -> io::Result< Option< StringId > > {
+    if value == 0 {
+        return Ok( None );
+    }
+
+    let index = value as usize - 1;
+    if index >= interner.len() {
+        return Err( invalid_data( "string out of range" ) );
+    }
+
+    Ok( Some( StringId::from_usize( index ) ) )
+}
+
+fn write_string( fp: &mut Vec< u8 >, string: &str ) -> io::Result< () > {
+    fp.write_u64::< LittleEndian >( string.len() as u64 )?;
+    fp.write_all( string.as_bytes() )
+}
+
+fn read_string( fp: &mut &[u8] ) -> io::Result< Box< str > > {
+    let length = fp.read_u64::< LittleEndian >()?;
+    if length > fp.len() as u64 {
+        return Err( invalid_data( "string too long" ) );
+    }
+
+    let (string, rest) = fp.split_at( length as usize );
+    *fp = rest;
+    std::str::from_utf8( string ).map( |string| string.into() ).map_err( |_| invalid_data( "invalid string" ) )
+}
+
+fn read_length( fp: &mut &[u8] ) -> io::Result< usize > {
+    let length = fp.read_u64::< LittleEndian >()?;
+    if length > fp.len() as u64 {
+        return Err( invalid_data( "sequence too long" ) );
+    }
+
+    Ok( length as usize )
+}
+
+fn write_map_source( fp: &mut Vec< u8 >, source: &MapSource ) -> io::Result< () > {
+    fp.write_u64::< LittleEndian >( source.timestamp.as_usecs() )?;
+    fp.write_u32::< LittleEndian >( source.backtrace.raw() )?;
+    fp.write_u32::< LittleEndian >( source.thread )
+}
+
+fn read_map_source( fp: &mut &[u8] ) -> io::Result< MapSource > {
+    Ok( MapSource {
+        timestamp: Timestamp::from_usecs( fp.read_u64::< LittleEndian >()? ),
+        backtrace: BacktraceId::new( fp.read_u32::< LittleEndian >()? ),
+        thread: fp.read_u32::< LittleEndian >()?
+    })
+}
+
+fn write_optional_map_source( fp: &mut Vec< u8 >, source: Option< &MapSource > ) -> io::Result< () > {
+    match source {
+        Some( source ) => {
+            fp.write_u8( 1 )?;
+            write_map_source( fp, source )
+        },
+        None => fp.write_u8( 0 )
+    }
+}
+
+fn read_optional_map_source( fp: &mut &[u8] ) -> io::Result< Option< MapSource > > {
+    if fp.read_u8()? != 0 {
+        Ok( Some( read_map_source( fp )? ) )
+    } else {
+        Ok( None )
+    }
+}
+
+fn write_map( fp: &mut Vec< u8 >, map: &Map ) -> io::Result< () > {
+    fp.write_u64::< LittleEndian >( map.id.raw() )?;
+    fp.write_u64::< LittleEndian >( map.timestamp.as_usecs() )?;
+    write_optional_map_source( fp, map.source.as_ref() )?;
+
+    fp.write_u64::< LittleEndian >( map.regions.len() as u64 )?;
+    for region in &map.regions {
+        fp.write_u64::< LittleEndian >( region.timestamp.as_usecs() )?;
+        fp.write_u64::< LittleEndian >( region.pointer )?;
+        fp.write_u64::< LittleEndian >( region.size )?;
+        fp.write_u32::< LittleEndian >( region.flags.bits() )?;
+        fp.write_u64::< LittleEndian >( region.file_offset )?;
+        fp.write_u64::< LittleEndian >( region.inode )?;
+        fp.write_u32::< LittleEndian >( region.major )?;
+        fp.write_u32::< LittleEndian >( region.minor )?;
+        write_string( fp, &region.name )?;
+        match region.deallocation {
+            Some( ref deallocation ) => {
+                fp.write_u8( 1 )?;
+                fp.write_u64::< LittleEndian >( deallocation.timestamp.as_usecs() )?;
+                fp.write_u64::< LittleEndian >( deallocation.sources.len() as u64 )?;
+                for source in &deallocation.sources {
+                    fp.write_u64::< LittleEndian >( source.address )?;
+                    fp.write_u64::< LittleEndian >( source.length )?;
+                    write_map_source( fp, &source.source )?;
+                }
+            },
+            None => fp.write_u8( 0 )?
+        }
+    }
+
+    match map.deallocation {
+        Some( ref deallocation ) => {
+            fp.write_u8( 1 )?;
+            fp.write_u64::< LittleEndian >( deallocation.timestamp.as_usecs() )?;
+            write_optional_map_source( fp, deallocation.source.as_ref() )?;
+        },
+        None => fp.write_u8( 0 )?
+    }
+
+    fp.write_u64::< LittleEndian >( map.usage_history.len() as u64 )?;
+    for usage in &map.usage_history {
+        fp.write_u64::< LittleEndian >( usage.timestamp.as_usecs() )?;
+        fp.write_u64::< LittleEndian >( usage.address_space )?;
+        fp.write_u64::< LittleEndian >( usage.anonymous )?;
+        fp.write_u64::< LittleEndian >( usage.shared_clean )?;
+        fp.write_u64::< LittleEndian >( usage.shared_dirty )?;
+        fp.write_u64::< LittleEndian >( usage.private_clean )?;
+        fp.write_u64::< LittleEndian >( usage.private_dirty )?;
+        fp.write_u64::< LittleEndian >( usage.swap )?;
+        fp.write_u64::< LittleEndian >( usage.anon_huge_pages )?;
+        fp.write_u64::< LittleEndian >( usage.shmem_pmd_mapped )?;
+        fp.write_u64::< LittleEndian >( usage.file_pmd_mapped )?;
+    }
+
+    fp.write_u64::< LittleEndian >( map.pointer )?;
+    fp.write_u64::< LittleEndian >( map.size )?;
+    fp.write_u32::< LittleEndian >( map.flags.bits() )?;
+    write_string( fp, &map.name )?;
+    fp.write_u64::< LittleEndian >( map.peak_rss )?;
+    fp.write_u64::< LittleEndian >( map.peak_huge_pages )?;
+    fp.write_u8( map.huge_page_flags.bits() )?;
+    fp.write_u64::< LittleEndian >( map.purge_count )?;
+    fp.write_u64::< LittleEndian >( map.purged )?;
+    fp.write_u64::< LittleEndian >( map.reclaimed )?;
+    fp.write_u64::< LittleEndian >( map.refaulted )
+}
+
+fn write_profiler_histogram( fp: &mut Vec< u8 >, histogram: &ProfilerHistogram ) -> io::Result< () > {
+    write_string( fp, &histogram.name )?;
+    fp.write_u64::< LittleEndian >( histogram.count )?;
+    fp.write_u64::< LittleEndian >( histogram.sum )?;
+    fp.write_u64::< LittleEndian >( histogram.buckets.len() as u64 )?;
+    for &bucket in &histogram.buckets {
+        fp.write_u64::< LittleEndian >( bucket )?;
+    }
+
+    Ok(())
+}
+
+fn read_profiler_histogram( fp: &mut &[u8] ) -> io::Result< ProfilerHistogram > {
+    let name = read_string( fp )?.into();
+    let count = fp.read_u64::< LittleEndian >()?;
+    let sum = fp.read_u64::< LittleEndian >()?;
+    let bucket_count = read_length( fp )?;
+    let mut buckets = Vec::with_capacity( bucket_count );
+    for _ in 0..bucket_count {
+        buckets.push( fp.read_u64::< LittleEndian >()? );
+    }
+
+    Ok( ProfilerHistogram { name, count, sum, buckets } )
+}
+
+fn write_jemalloc_snapshot( fp: &mut Vec< u8 >, snapshot: &JemallocSnapshot ) -> io::Result< () > {
+    fp.write_u64::< LittleEndian >( snapshot.timestamp.as_usecs() )?;
+    fp.write_u64::< LittleEndian >( snapshot.page_size )?;
+    fp.write_u64::< LittleEndian >( snapshot.allocated )?;
+    fp.write_u64::< LittleEndian >( snapshot.active )?;
+    fp.write_u64::< LittleEndian >( snapshot.metadata )?;
+    fp.write_u64::< LittleEndian >( snapshot.resident )?;
+    fp.write_u64::< LittleEndian >( snapshot.mapped )?;
+    fp.write_u64::< LittleEndian >( snapshot.retained )?;
+
+    fp.write_u64::< LittleEndian >( snapshot.arenas.len() as u64 )?;
+    for arena in &snapshot.arenas {
+        fp.write_u32::< LittleEndian >( arena.index )?;
+        fp.write_u32::< LittleEndian >( arena.threads )?;
+        fp.write_u64::< LittleEndian >( arena.pactive )?;
+        fp.write_u64::< LittleEndian >( arena.pdirty )?;
+        fp.write_u64::< LittleEndian >( arena.pmuzzy )?;
+        fp.write_u64::< LittleEndian >( arena.mapped )?;
+        fp.write_u64::< LittleEndian >( arena.retained )?;
+        fp.write_u64::< LittleEndian >( arena.resident )?;
+        fp.write_u64::< LittleEndian >( arena.tcache_bytes )?;
+        fp.write_u64::< LittleEndian >( arena.small_allocated )?;
+        fp.write_u64::< LittleEndian >( arena.large_allocated )?;
+    }
+
+    fp.write_u64::< LittleEndian >( snapshot.bins.len() as u64 )?;
+    for bin in &snapshot.bins {
+        fp.write_u64::< LittleEndian >( bin.size )?;
+        fp.write_u64::< LittleEndian >( bin.regions_per_slab )?;
+        fp.write_u64::< LittleEndian >( bin.current_regions )?;
+        fp.write_u64::< LittleEndian >( bin.current_slabs )?;
+        fp.write_u64::< LittleEndian >( bin.nonfull_slabs )?;
+    }
+
+    Ok(())
+}
+
+fn read_jemalloc_snapshot( fp: &mut &[u8] ) -> io::Result< JemallocSnapshot > {
+    let timestamp = Timestamp::from_usecs( fp.read_u64::< LittleEndian >()? );
+    let page_size = fp.read_u64::< LittleEndian >()?;
+    let allocated = fp.read_u64::< LittleEndian >()?;
+    let active = fp.read_u64::< LittleEndian >()?;
+    let metadata = fp.read_u64::< LittleEndian >()?;
+    let resident = fp.read_u64::< LittleEndian >()?;
+    let mapped = fp.read_u64::< LittleEndian >()?;
+    let retained = fp.read_u64::< LittleEndian >()?;
+
+    let arena_count = read_length( fp )?;
+    let mut arenas = Vec::with_capacity( arena_count );
+    for _ in 0..arena_count {
+        arenas.push( JemallocArenaStats {
+            index: fp.read_u32::< LittleEndian >()?,
+            threads: fp.read_u32::< LittleEndian >()?,
+            pactive: fp.read_u64::< LittleEndian >()?,
+            pdirty: fp.read_u64::< LittleEndian >()?,
+            pmuzzy: fp.read_u64::< LittleEndian >()?,
+            mapped: fp.read_u64::< LittleEndian >()?,
+            retained: fp.read_u64::< LittleEndian >()?,
+            resident: fp.read_u64::< LittleEndian >()?,
+            tcache_bytes: fp.read_u64::< LittleEndian >()?,
+            small_allocated: fp.read_u64::< LittleEndian >()?,
+            large_allocated: fp.read_u64::< LittleEndian >()?
+        });
+    }
+
+    let bin_count = read_length( fp )?;
+    let mut bins = Vec::with_capacity( bin_count );
+    for _ in 0..bin_count {
+        bins.push( JemallocBinStats {
+            size: fp.read_u64::< LittleEndian >()?,
+            regions_per_slab: fp.read_u64::< LittleEndian >()?,
+            current_regions: fp.read_u64::< LittleEndian >()?,
+            current_slabs: fp.read_u64::< LittleEndian >()?,
+            nonfull_slabs: fp.read_u64::< LittleEndian >()?
+        });
+    }
+
+    Ok( JemallocSnapshot { timestamp, page_size, allocated, active, metadata, resident, mapped, retained, arenas, bins } )
+}
+
+fn read_map( fp: &mut &[u8] ) -> io::Result< Map > {
+    let id = MapId( fp.read_u64::< LittleEndian >()? );
+    let timestamp = Timestamp::from_usecs( fp.read_u64::< LittleEndian >()? );
+    let source = read_optional_map_source( fp )?;
+
+    let region_count = read_length( fp )?;
+    let mut regions = smallvec::SmallVec::with_capacity( region_count );
+    for _ in 0..region_count {
+        let timestamp = Timestamp::from_usecs( fp.read_u64::< LittleEndian >()? );
+        let pointer = fp.read_u64::< LittleEndian >()?;
+        let size = fp.read_u64::< LittleEndian >()?;
+        let flags = RegionFlags::from_bits_truncate( fp.read_u32::< LittleEndian >()? );
+        let file_offset = fp.read_u64::< LittleEndian >()?;
+        let inode = fp.read_u64::< LittleEndian >()?;
+        let major = fp.read_u32::< LittleEndian >()?;
+        let minor = fp.read_u32::< LittleEndian >()?;
+        let name = read_string( fp )?;
+        let deallocation =
+            if fp.read_u8()? != 0 {
+                let timestamp = Timestamp::from_usecs( fp.read_u64::< LittleEndian >()? );
+                let source_count = read_length( fp )?;
+                let mut sources = smallvec::SmallVec::with_capacity( source_count );
+                for _ in 0..source_count {
+                    sources.push( MapRegionDeallocationSource {
+                        address: fp.read_u64::< LittleEndian >()?,
+                        length: fp.read_u64::< LittleEndian >()?,
+                        source: read_map_source( fp )?
+                    });
+                }
+
+                Some( MapRegionDeallocation { timestamp, sources } )
+            } else {
+                None
+            };
+
+        regions.push( MapRegion {
+            timestamp,
+            pointer,
+            size,
+            flags,
+            file_offset,
+            inode,
+            major,
+            minor,
+            name,
+            deallocation
+        });
+    }
+
+    let deallocation =
+        if fp.read_u8()? != 0 {
+            Some( MapDeallocation {
+                timestamp: Timestamp::from_usecs( fp.read_u64::< LittleEndian >()? ),
+                source: read_optional_map_source( fp )?
+            })
+        } else {
+            None
+        };
+
+    let usage_count = read_length( fp )?;
+    let mut usage_history = Vec::with_capacity( usage_count );
+    for _ in 0..usage_count {
+        usage_history.push( MapUsage {
+            timestamp: Timestamp::from_usecs( fp.read_u64::< LittleEndian >()? ),
+            address_space: fp.read_u64::< LittleEndian >()?,
+            anonymous: fp.read_u64::< LittleEndian >()?,
+            shared_clean: fp.read_u64::< LittleEndian >()?,
+            shared_dirty: fp.read_u64::< LittleEndian >()?,
+            private_clean: fp.read_u64::< LittleEndian >()?,
+            private_dirty: fp.read_u64::< LittleEndian >()?,
+            swap: fp.read_u64::< LittleEndian >()?,
+            anon_huge_pages: fp.read_u64::< LittleEndian >()?,
+            shmem_pmd_mapped: fp.read_u64::< LittleEndian >()?,
+            file_pmd_mapped: fp.read_u64::< LittleEndian >()?
+        });
+    }
+
+    Ok( Map {
+        id,
+        timestamp,
+        source,
+        regions,
+        deallocation,
+        usage_history,
+        sparkline: Default::default(),
+        pointer: fp.read_u64::< LittleEndian >()?,
+        size: fp.read_u64::< LittleEndian >()?,
+        flags: RegionFlags::from_bits_truncate( fp.read_u32::< LittleEndian >()? ),
+        name: read_string( fp )?,
+        peak_rss: fp.read_u64::< LittleEndian >()?,
+        peak_huge_pages: fp.read_u64::< LittleEndian >()?,
+        huge_page_flags: HugePageFlags::from_bits_truncate( fp.read_u8()? ),
+        purge_count: fp.read_u64::< LittleEndian >()?,
+        purged: fp.read_u64::< LittleEndian >()?,
+        reclaimed: fp.read_u64::< LittleEndian >()?,
+        refaulted: fp.read_u64::< LittleEndian >()?
+    })
+}
+
+fn write_header< W: Write >( fp: &mut CacheWriter< W >, key: &CacheKey ) -> io::Result< () > {
+    fp.fp.write_all( MAGIC )?;
+    fp.u64( VERSION )?;
+    fp.bytes( env!( "CARGO_PKG_VERSION" ).as_bytes() )?;
+    fp.u64( key.id.0 )?;
+    fp.u64( key.id.1 )?;
+    fp.u64( key.file_size )?;
+    fp.u64( key.mtime_secs )?;
+    fp.u64( key.mtime_nsecs )?;
+    fp.u64( key.debug_symbols_hash )
+}
+
+/// Returns whether the cache was generated by this exact version from the exact same trace.
+fn read_header( fp: &mut CacheReader ) -> io::Result< bool > {
+    let magic = match fp.take( MAGIC.len() ) {
+        Ok( magic ) => magic,
+        Err( _ ) => return Ok( false )
+    };
+
+    if magic != MAGIC || fp.u64()? != VERSION {
+        return Ok( false );
+    }
+
+    Ok( fp.string()? == env!( "CARGO_PKG_VERSION" ) )
+}
+
+fn write_data< W: Write >( fp: &mut CacheWriter< W >, data: &Data ) -> io::Result< () > {
+    let (id_a, id_b) = data.id.raw();
+    fp.u64( id_a )?;
+    fp.u64( id_b )?;
+    match data.parent_id {
+        Some( parent_id ) => {
+            let (id_a, id_b) = parent_id.raw();
+            fp.u64( 1 )?;
+            fp.u64( id_a )?;
+            fp.u64( id_b )?;
+        },
+        None => {
+            fp.u64( 0 )?;
+            fp.u64( 0 )?;
+            fp.u64( 0 )?;
+        }
+    }
+
+    fp.u64( data.initial_timestamp.as_usecs() )?;
+    fp.u64( data.last_timestamp.as_usecs() )?;
+    fp.bytes( data.executable.as_bytes() )?;
+    fp.bytes( data.cmdline.as_bytes() )?;
+    fp.bytes( data.architecture.as_bytes() )?;
+    fp.u64( data.pointer_size )?;
+    fp.u64( data.total_allocated )?;
+    fp.u64( data.total_allocated_count )?;
+    fp.u64( data.total_freed )?;
+    fp.u64( data.total_freed_count )?;
+    fp.u64( data.maximum_backtrace_depth as u64 )?;
+
+    let strings = (0..data.interner.len()).map( |index| data.interner.resolve( StringId::from_usize( index ) ).unwrap() );
+    fp.column( strings.clone().map( |string| string.len() as u64 ) )?;
+    let strings: Vec< u8 > = strings.flat_map( |string| string.bytes() ).collect();
+    fp.bytes( &strings )?;
+
+    fp.column( data.operations.iter().map( |operation| operation.raw() ) )?;
+
+    let allocations = &data.allocations;
+    fp.column( allocations.iter().map( |allocation| allocation.pointer ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.timestamp.as_usecs() ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.thread ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.size ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.backtrace.raw() ) )?;
+    fp.column( allocations.iter().map( |allocation| {
+        match allocation.deallocation {
+            Some( Deallocation { backtrace: Some( _ ), .. } ) => HAS_DEALLOCATION | HAS_DEALLOCATION_BACKTRACE,
+            Some( _ ) => HAS_DEALLOCATION,
+            None => 0
+        }
+    }))?;
+    fp.column( allocations.iter().map( |allocation| allocation.deallocation.as_ref().map( |deallocation| deallocation.timestamp.as_usecs() ).unwrap_or( 0 ) ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.deallocation.as_ref().map( |deallocation| deallocation.thread ).unwrap_or( 0 ) ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.deallocation.as_ref().and_then( |deallocation| deallocation.backtrace ).map( |backtrace| backtrace.raw() ).unwrap_or( 0 ) ) )?;
+    fp.column( allocations.iter().map( |allocation| encode_allocation_id( allocation.reallocation ) ) )?;
+    fp.column( allocations.iter().map( |allocation| encode_allocation_id( allocation.reallocated_from ) ) )?;
+    fp.column( allocations.iter().map( |allocation| encode_allocation_id( allocation.first_allocation_in_chain ) ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.position_in_chain ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.flags.bits() ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.extra_usable_space ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.marker ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.thread_tag ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.pool.map( |pool| pool as u32 + 1 ).unwrap_or( 0 ) ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.thread_numa_node.unwrap_or( u8::MAX ) ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.memory_numa_node.unwrap_or( u8::MAX ) ) )?;
+    fp.column( allocations.iter().map( |allocation| allocation.sample_weight.to_bits() ) )?;
+
+    let columns = &data.allocation_columns;
+    fp.column( columns.pointers.iter().copied() )?;
+    fp.column( columns.sizes.iter().copied() )?;
+    fp.column( columns.timestamps.iter().map( |timestamp| timestamp.as_usecs() ) )?;
+    fp.column( columns.deallocation_timestamps.iter().map( |timestamp| timestamp.as_usecs() ) )?;
+    fp.column( columns.backtraces.iter().map( |backtrace| backtrace.raw() ) )?;
+    fp.column( columns.flags.iter().map( |flags| flags.bits() ) )?;
+
+    fp.column( data.sorted_by_timestamp.iter().map( |&id| encode_allocation_id( Some( id ) ) ) )?;
+    fp.column( data.ids_sorted_by_address().iter().map( |&id| encode_allocation_id( Some( id ) ) ) )?;
+    fp.column( data.ids_sorted_by_size().iter().map( |&id| encode_allocation_id( Some( id ) ) ) )?;
+
+    let frames = &data.frames;
+    fp.column( frames.iter().map( |frame| frame.address().raw() ) )?;
+    fp.column( frames.iter().map( |frame| frame.count() ) )?;
+    fp.column( frames.iter().map( |frame| frame.is_inline() as u8 ) )?;
+    fp.column( frames.iter().map( |frame| encode_string_id( frame.library() ) ) )?;
+    fp.column( frames.iter().map( |frame| encode_string_id( frame.function() ) ) )?;
+    fp.column( frames.iter().map( |frame| encode_string_id( frame.raw_function() ) ) )?;
+    fp.column( frames.iter().map( |frame| encode_string_id( frame.source() ) ) )?;
+    fp.column( frames.iter().map( |frame| frame.line().unwrap_or( 0 ) ) )?;
+    fp.column( frames.iter().map( |frame| frame.column().unwrap_or( 0 ) ) )?;
+
+    fp.column( data.backtraces.iter().map( |&(offset, _)| offset ) )?;
+    fp.column( data.backtraces.iter().map( |&(_, length)| length ) )?;
+    fp.column( data.backtraces_storage.iter().map( |&frame_id| frame_id as u64 ) )?;
+
+    let (index, storage) = data.allocations_by_backtrace.raw_parts();
+    fp.column( index.iter().map( |&(offset, _)| offset ) )?;
+    fp.column( index.iter().map( |&(_, length)| length ) )?;
+    fp.column( storage.iter().map( |&id| encode_allocation_id( Some( id ) ) ) )?;
+
+    let mallopts = &data.mallopts;
+    fp.column( mallopts.iter().map( |mallopt| mallopt.timestamp.as_usecs() ) )?;
+    fp.column( mallopts.iter().map( |mallopt| mallopt.backtrace.raw() ) )?;
+    fp.column( mallopts.iter().map( |mallopt| mallopt.thread ) )?;
+    fp.column( mallopts.iter().map( |mallopt| mallopt.kind.raw() as u32 ) )?;
+    fp.column( mallopts.iter().map( |mallopt| mallopt.value as u32 ) )?;
+    fp.column( mallopts.iter().map( |mallopt| mallopt.result as u32 ) )?;
+
+    let memory_advices = &data.memory_advices;
+    fp.column( memory_advices.iter().map( |advice| advice.timestamp.as_usecs() ) )?;
+    fp.column( memory_advices.iter().map( |advice| advice.backtrace.raw() ) )?;
+    fp.column( memory_advices.iter().map( |advice| advice.thread ) )?;
+    fp.column( memory_advices.iter().map( |advice| advice.address ) )?;
+    fp.column( memory_advices.iter().map( |advice| advice.length ) )?;
+    fp.column( memory_advices.iter().map( |advice| advice.advice as u32 ) )?;
+
+    let residency_samples = &data.residency_samples;
+    fp.column( residency_samples.iter().map( |sample| sample.timestamp.as_usecs() ) )?;
+    fp.column( residency_samples.iter().map( |sample| sample.backtrace.raw() ) )?;
+    fp.column( residency_samples.iter().map( |sample| sample.idle_tracking as u8 ) )?;
+    fp.column( residency_samples.iter().map( |sample| sample.allocation_count ) )?;
+    fp.column( residency_samples.iter().map( |sample| sample.allocated_size ) )?;
+    fp.column( residency_samples.iter().map( |sample| sample.pages ) )?;
+    fp.column( residency_samples.iter().map( |sample| sample.resident_pages ) )?;
+    fp.column( residency_samples.iter().map( |sample| sample.swapped_pages ) )?;
+    fp.column( residency_samples.iter().map( |sample| sample.idle_pages ) )?;
+
+    let culled_allocations = &data.culled_allocations;
+    fp.column( culled_allocations.iter().map( |culled| culled.backtrace.raw() ) )?;
+    fp.column( culled_allocations.iter().map( |culled| culled.first_allocation.as_usecs() ) )?;
+    fp.column( culled_allocations.iter().map( |culled| culled.last_allocation.as_usecs() ) )?;
+    fp.column( culled_allocations.iter().map( |culled| culled.count ) )?;
+    fp.column( culled_allocations.iter().map( |culled| culled.size ) )?;
+    fp.column( culled_allocations.iter().map( |culled| culled.lifetimes.len() as u64 ) )?;
+    let culled_lifetimes: Vec< u64 > = culled_allocations.iter().flat_map( |culled| culled.lifetimes.iter().copied() ).collect();
+    fp.column( culled_lifetimes.into_iter() )?;
+
+    let group_stats = &data.group_stats;
+    fp.column( group_stats.iter().map( |stats| stats.first_allocation.as_usecs() ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.last_allocation.as_usecs() ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.alloc_count ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.alloc_size ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.free_count ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.free_size ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.min_size ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.max_size ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.max_total_usage_first_seen_at.as_usecs() ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.max_total_usage ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.lifetime_p50.as_usecs() ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.lifetime_p90.as_usecs() ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.lifetimes.zero_count ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.lifetimes.offset ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.lifetimes.min ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.lifetimes.max ) )?;
+    fp.column( group_stats.iter().map( |stats| stats.lifetimes.counts.len() as u64 ) )?;
+    let lifetime_counts: Vec< u64 > = group_stats.iter().flat_map( |stats| stats.lifetimes.counts.iter().copied() ).collect();
+    fp.column( lifetime_counts.into_iter() )?;
+
+    fp.column( data.chains.iter().map( |chain| chain.first.raw() ) )?;
+    fp.column( data.chains.iter().map( |chain| chain.first.raw() ) )?;
+    fp.column( data.chains.iter().map( |chain| chain.last.raw() ) )?;
+    fp.column( data.chains.iter().map( |chain| chain.length ) )?;
+
+    let mut maps = Vec::new();
+    for map in &data.maps {
+        write_map( &mut maps, map )?;
+    }
+    fp.u64( data.maps.len() as u64 )?;
+    fp.bytes( &maps )?;
+    fp.column( data.map_ids.iter().map( |id| id.raw() ) )?;
+
+    let mut histograms = Vec::new();
+    for histogram in &data.profiler_histograms {
+        write_profiler_histogram( &mut histograms, histogram )?;
+    }
+    fp.u64( data.profiler_bytes_written )?;
+    fp.u64( data.profiler_histograms.len() as u64 )?;
+    fp.bytes( &histograms )?;
+
+    fp.column( data.backtrace_cache_statistics.iter().map( |level| level.hits ) )?;
+    fp.column( data.backtrace_cache_statistics.iter().map( |level| level.misses ) )?;
+    fp.column( data.backtrace_cache_statistics.iter().map( |level| level.conflicts ) )?;
+    fp.column( data.backtrace_cache_statistics.iter().map( |level| level.capacity ) )?;
+
+    let mut snapshots = Vec::new();
+    for snapshot in &data.jemalloc_snapshots {
+        write_jemalloc_snapshot( &mut snapshots, snapshot )?;
+    }
+    fp.u64( data.jemalloc_snapshots.len() as u64 )?;
+    fp.bytes( &snapshots )?;
+
+    let option_changes = &data.option_changes;
+    fp.column( option_changes.iter().map( |change| change.timestamp.as_usecs() ) )?;
+    fp.column( option_changes.iter().map( |change| RuntimeOption::ALL.iter().position( |&option| option == change.option ).unwrap() as u8 ) )?;
+    fp.column( option_changes.iter().map( |change| change.value ) )?;
+
+    fp.column( data.pools.iter().map( |pool| pool.id as u32 ) )?;
+    fp.column( data.pools.iter().map( |pool| encode_string_id( Some( pool.name ) ) ) )?;
+    fp.column( data.pools.iter().map( |pool| pool.flags ) )?;
+
+    fp.column( data.threads.iter().map( |thread| thread.id ) )?;
+    fp.column( data.threads.iter().map( |thread| encode_string_id( thread.name ) ) )?;
+    fp.column( data.threads.iter().map( |thread| encode_timestamp( thread.started_at ) ) )?;
+    fp.column( data.threads.iter().map( |thread| encode_timestamp( thread.exited_at ) ) )?;
+
+    let samples = &data.cgroup_samples;
+    fp.column( samples.iter().map( |sample| sample.timestamp.as_usecs() ) )?;
+    fp.column( samples.iter().map( |sample| sample.current ) )?;
+    fp.column( samples.iter().map( |sample| sample.limit ) )?;
+    fp.column( samples.iter().map( |sample| sample.anon ) )?;
+    fp.column( samples.iter().map( |sample| sample.file ) )?;
+    fp.column( samples.iter().map( |sample| sample.kernel ) )?;
+    fp.column( samples.iter().map( |sample| sample.sock ) )?;
+    fp.column( samples.iter().map( |sample| sample.pressure_some ) )?;
+    fp.column( samples.iter().map( |sample| sample.pressure_full ) )?;
+
+    let dumps = &data.memory_dumps;
+    fp.column( dumps.iter().map( |dump| dump.timestamp.as_usecs() ) )?;
+    fp.column( dumps.iter().map( |dump| dump.addresses.len() as u64 ) )?;
+    fp.column( dumps.iter().flat_map( |dump| dump.addresses.iter().copied() ).collect::< Vec< _ > >().into_iter() )?;
+    fp.column( dumps.iter().flat_map( |dump| dump.values.iter().copied() ).collect::< Vec< _ > >().into_iter() )?;
+    fp.column( dumps.iter().map( |dump| dump.allocation_ids.len() as u64 ) )?;
+    fp.column( dumps.iter().flat_map( |dump| dump.allocation_ids.iter().map( |id| id.raw() ) ).collect::< Vec< _ > >().into_iter() )?;
+    fp.column( dumps.iter().flat_map( |dump| dump.content_hashes.iter().copied() ).collect::< Vec< _ > >().into_iter() )?;
+
+    let latencies = &data.allocator_latencies;
+    fp.column( latencies.iter().map( |latencies| latencies.backtrace.raw() ) )?;
+    fp.column( latencies.iter().map( |latencies| AllocatorCall::ALL.iter().position( |&call| call == latencies.call ).unwrap() as u8 ) )?;
+    fp.column( latencies.iter().map( |latencies| latencies.count ) )?;
+    fp.column( latencies.iter().map( |latencies| latencies.total ) )?;
+    fp.column( latencies.iter().map( |latencies| latencies.max ) )?;
+    fp.column( latencies.iter().map( |latencies| latencies.buckets.len() as u64 ) )?;
+    fp.column( latencies.iter().flat_map( |latencies| latencies.buckets.iter().copied() ).collect::< Vec< _ > >().into_iter() )?;
+
+    let page_faults = &data.page_faults;
+    fp.u64( data.page_fault_period )?;
+    fp.column( page_faults.iter().map( |page_fault| page_fault.timestamp.as_usecs() ) )?;
+    fp.column( page_faults.iter().map( |page_fault| page_fault.thread ) )?;
+    fp.column( page_faults.iter().map( |page_fault| page_fault.address ) )?;
+    fp.column( page_faults.iter().map( |page_fault| encode_allocation_id( page_fault.allocation ) ) )?;
+    fp.column( page_faults.iter().map( |page_fault| page_fault.map.map( |map| map.raw() + 1 ).unwrap_or( 0 ) ) )?;
+
+    Ok(())
+}
+
+fn read_data( fp: &mut CacheReader ) -> io::Result< Data > {
+    let id = DataId::new( fp.u64()?, fp.u64()? );
+    let has_parent_id = fp.u64()? != 0;
+    let parent_id = DataId::new( fp.u64()?, fp.u64()? );
+    let parent_id = if has_parent_id { Some( parent_id ) } else { None };
+
+    let initial_timestamp = Timestamp::from_usecs( fp.u64()? );
+    let last_timestamp = Timestamp::from_usecs( fp.u64()? );
+    let executable = fp.string()?;
+    let cmdline = fp.string()?;
+    let architecture = fp.string()?;
+    let pointer_size = fp.u64()?;
+    let total_allocated = fp.u64()?;
+    let total_allocated_count = fp.u64()?;
+    let total_freed = fp.u64()?;
+    let total_freed_count = fp.u64()?;
+    let maximum_backtrace_depth = fp.u64()? as u32;
+
+    let string_lengths: Vec< u64 > = fp.column()?;
+    let strings: Vec< u8 > = fp.column()?;
+    let strings = std::str::from_utf8( &strings ).map_err( |_| invalid_data( "invalid string" ) )?;
+    let mut interner = StringInterner::new();
+    let mut offset = 0;
+    for length in string_lengths {
+        let string = offset.checked_add( length as usize ).and_then( |end| strings.get( offset..end ) ).ok_or_else( || invalid_data( "string out of range" ) )?;
+        let string_id = interner.get_or_intern( string );
+        if string_id.to_usize() + 1 != interner.len() {
+            return Err( invalid_data( "duplicate string" ) );
+        }
+
+        offset += string.len();
+    }
+
+    let operations = fp.mapped_column()?;
+
+    let pointers: Vec< u64 > = fp.column()?;
+    let count = pointers.len();
+    let timestamps: Vec< u64 > = fp.column_of_length( count )?;
+    let threads: Vec< u32 > = fp.column_of_length( count )?;
+    let sizes: Vec< u64 > = fp.column_of_length( count )?;
+    let backtraces: Vec< u32 > = fp.column_of_length( count )?;
+    let deallocation_flags: Vec< u8 > = fp.column_of_length( count )?;
+    let deallocation_timestamps: Vec< u64 > = fp.column_of_length( count )?;
+    let deallocation_threads: Vec< u32 > = fp.column_of_length( count )?;
+    let deallocation_backtraces: Vec< u32 > = fp.column_of_length( count )?;
+    let reallocations: Vec< u64 > = fp.column_of_length( count )?;
+    let reallocated_froms: Vec< u64 > = fp.column_of_length( count )?;
+    let first_allocations_in_chain: Vec< u64 > = fp.column_of_length( count )?;
+    let positions_in_chain: Vec< u32 > = fp.column_of_length( count )?;
+    let flags: Vec< u8 > = fp.column_of_length( count )?;
+    let extra_usable_spaces: Vec< u32 > = fp.column_of_length( count )?;
+    let markers: Vec< u32 > = fp.column_of_length( count )?;
+    let thread_tags: Vec< u32 > = fp.column_of_length( count )?;
+    let pools: Vec< u32 > = fp.column_of_length( count )?;
+    let thread_numa_nodes: Vec< u8 > = fp.column_of_length( count )?;
+    let memory_numa_nodes: Vec< u8 > = fp.column_of_length( count )?;
+    let sample_weights: Vec< u32 > = fp.column_of_length( count )?;
+
+    let allocations = (0..count).map( |index| {
+        let deallocation =
+            if deallocation_flags[ index ] & HAS_DEALLOCATION != 0 {
+                let backtrace =
+                    if deallocation_flags[ index ] & HAS_DEALLOCATION_BACKTRACE != 0 {
+                        Some( BacktraceId::new( deallocation_backtraces[ index ] ) )
+                    } else {
+                        None
+                    };
+
+                Some( Deallocation {
+                    timestamp: Timestamp::from_usecs( deallocation_timestamps[ index ] ),
+                    thread: deallocation_threads[ index ],
+                    backtrace
+                })
+            } else {
+                None
+            };
+
+        Allocation {
+            pointer: pointers[ index ],
+            timestamp: Timestamp::from_usecs( timestamps[ index ] ),
+            thread: threads[ index ],
+            size: sizes[ index ],
+            backtrace: BacktraceId::new( backtraces[ index ] ),
+            deallocation,
+            reallocation: decode_allocation_id( reallocations[ index ] ),
+            reallocated_from: decode_allocation_id( reallocated_froms[ index ] ),
+            first_allocation_in_chain: decode_allocation_id( first_allocations_in_chain[ index ] ),
+            position_in_chain: positions_in_chain[ index ],
+            flags: AllocationFlags::from_bits_truncate( flags[ index ] ),
+            extra_usable_space: extra_usable_spaces[ index ],
+            marker: markers[ index ],
+            thread_tag: thread_tags[ index ],
+            pool: pools[ index ].checked_sub( 1 ).map( |pool| pool as u16 ),
+            thread_numa_node: Some( thread_numa_nodes[ index ] ).filter( |&node| node != u8::MAX ),
+            memory_numa_node: Some( memory_numa_nodes[ index ] ).filter( |&node| node != u8::MAX ),
+            sample_weight: f32::from_bits( sample_weights[ index ] )
+        }
+    }).collect();
+
+    let allocation_columns = AllocationColumns {
+        pointers: fp.mapped_column_of_length( count )?,
+        sizes: fp.mapped_column_of_length( count )?,
+        timestamps: fp.mapped_column_of_length( count )?,
+        deallocation_timestamps: fp.mapped_column_of_length( count )?,
+        backtraces: fp.mapped_column_of_length( count )?,
+        flags: fp.mapped_column_of_length( count )?
+    };
+
+    let sorted_by_timestamp = fp.mapped_column_of_length( count )?;
+    let sorted_by_address = OnceCell::from( fp.mapped_column_of_length( count )? );
+    let sorted_by_size = OnceCell::from( fp.mapped_column_of_length( count )? );
+
+    let addresses: Vec< u64 > = fp.column()?;
+    let frame_count = addresses.len();
+    let counts: Vec< u64 > = fp.column_of_length( frame_count )?;
+    let is_inline: Vec< u8 > = fp.column_of_length( frame_count )?;
+    let libraries: Vec< u32 > = fp.column_of_length( frame_count )?;
+    let functions: Vec< u32 > = fp.column_of_length( frame_count )?;
+    let raw_functions: Vec< u32 > = fp.column_of_length( frame_count )?;
+    let sources: Vec< u32 > = fp.column_of_length( frame_count )?;
+    let lines: Vec< u32 > = fp.column_of_length( frame_count )?;
+    let columns: Vec< u32 > = fp.column_of_length( frame_count )?;
+
+    let mut frames = Vec::with_capacity( frame_count );
+    for index in 0..frame_count {
+        let mut frame = Frame::new_unknown( CodePointer::new( addresses[ index ] ) );
+        frame.increment_count( counts[ index ] );
+        frame.set_is_inline( is_inline[ index ] != 0 );
+        if let Some( string_id ) = decode_string_id( libraries[ index ], &interner )? {
+            frame.set_library( string_id );
+        }
+        if let Some( string_id ) = decode_string_id( functions[ index ], &interner )? {
+            frame.set_function( string_id );
+        }
+        if let Some( string_id ) = decode_string_id( raw_functions[ index ], &interner )? {
+            frame.set_raw_function( string_id );
+        }
+        if let Some( string_id ) = decode_string_id( sources[ index ], &interner )? {
+            frame.set_source( string_id );
+        }
+        frame.set_line( lines[ index ] );
+        frame.set_column( columns[ index ] );
+        frames.push( frame );
+    }
+
+    let backtrace_offsets: Vec< u32 > = fp.column()?;
+    let backtrace_lengths: Vec< u32 > = fp.column_of_length( backtrace_offsets.len() )?;
+    let backtraces_storage: Column< usize > = fp.mapped_column()?;
+    for (&offset, &length) in backtrace_offsets.iter().zip( backtrace_lengths.iter() ) {
+        if offset as u64 + length as u64 > backtraces_storage.len() as u64 {
+            return Err( invalid_data( "backtrace out of range" ) );
+        }
+    }
+    if backtraces_storage.iter().any( |&frame_id| frame_id >= frame_count ) {
+        return Err( invalid_data( "frame out of range" ) );
+    }
+    let backtraces = backtrace_offsets.into_iter().zip( backtrace_lengths.into_iter() ).collect();
+
+    let index_offsets: Vec< u32 > = fp.column()?;
+    let index_lengths: Vec< u32 > = fp.column_of_length( index_offsets.len() )?;
+    let storage: Column< AllocationId > = fp.mapped_column()?;
+    for (&offset, &length) in index_offsets.iter().zip( index_lengths.iter() ) {
+        if offset as u64 + length as u64 > storage.len() as u64 {
+            return Err( invalid_data( "allocation group out of range" ) );
+        }
+    }
+    let allocations_by_backtrace = DenseVecVec::from_raw_parts( index_offsets.into_iter().zip( index_lengths.into_iter() ).collect(), storage );
+
+    let mallopt_timestamps: Vec< u64 > = fp.column()?;
+    let mallopt_count = mallopt_timestamps.len();
+    let mallopt_backtraces: Vec< u32 > = fp.column_of_length( mallopt_count )?;
+    let mallopt_threads: Vec< u32 > = fp.column_of_length( mallopt_count )?;
+    let mallopt_kinds: Vec< u32 > = fp.column_of_length( mallopt_count )?;
+    let mallopt_values: Vec< u32 > = fp.column_of_length( mallopt_count )?;
+    let mallopt_results: Vec< u32 > = fp.column_of_length( mallopt_count )?;
+    let mallopts = (0..mallopt_count).map( |index| Mallopt {
+        timestamp: Timestamp::from_usecs( mallopt_timestamps[ index ] ),
+        backtrace: BacktraceId::new( mallopt_backtraces[ index ] ),
+        thread: mallopt_threads[ index ],
+        kind: MalloptKind::from( mallopt_kinds[ index ] as i32 ),
+        value: mallopt_values[ index ] as i32,
+        result: mallopt_results[ index ] as i32
+    }).collect();
+
+    let advice_timestamps: Vec< u64 > = fp.column()?;
+    let advice_count = advice_timestamps.len();
+    let advice_backtraces: Vec< u32 > = fp.column_of_length( advice_count )?;
+    let advice_threads: Vec< u32 > = fp.column_of_length( advice_count )?;
+    let advice_addresses: Vec< u64 > = fp.column_of_length( advice_count )?;
+    let advice_lengths: Vec< u64 > = fp.column_of_length( advice_count )?;
+    let advice_values: Vec< u32 > = fp.column_of_length( advice_count )?;
+    let memory_advices = (0..advice_count).map( |index| MemoryAdvice {
+        timestamp: Timestamp::from_usecs( advice_timestamps[ index ] ),
+        backtrace: BacktraceId::new( advice_backtraces[ index ] ),
+        thread: advice_threads[ index ],
+        address: advice_addresses[ index ],
+        length: advice_lengths[ index ],
+        advice: advice_values[ index ] as i32
+    }).collect();
+
+    let residency_timestamps: Vec< u64 > = fp.column()?;
+    let residency_count = residency_timestamps.len();
+    let residency_backtraces: Vec< u32 > = fp.column_of_length( residency_count )?;
+    let residency_idle_tracking: Vec< u8 > = fp.column_of_length( residency_count )?;
+    let residency_allocation_counts: Vec< u64 > = fp.column_of_length( residency_count )?;
+    let residency_allocated_sizes: Vec< u64 > = fp.column_of_length( residency_count )?;
+    let residency_pages: Vec< u64 > = fp.column_of_length( residency_count )?;
+    let residency_resident_pages: Vec< u64 > = fp.column_of_length( residency_count )?;
+    let residency_swapped_pages: Vec< u64 > = fp.column_of_length( residency_count )?;
+    let residency_idle_pages: Vec< u64 > = fp.column_of_length( residency_count )?;
+    let residency_samples = (0..residency_count).map( |index| ResidencySample {
+        timestamp: Timestamp::from_usecs( residency_timestamps[ index ] ),
+        backtrace: BacktraceId::new( residency_backtraces[ index ] ),
+        idle_tracking: residency_idle_tracking[ index ] != 0,
+        allocation_count: residency_allocation_counts[ index ],
+        allocated_size: residency_allocated_sizes[ index ],
+        pages: residency_pages[ index ],
+        resident_pages: residency_resident_pages[ index ],
+        swapped_pages: residency_swapped_pages[ index ],
+        idle_pages: residency_idle_pages[ index ]
+    }).collect();
+
+    let culled_backtraces: Vec< u32 > = fp.column()?;
+    let culled_count = culled_backtraces.len();
+    let culled_first_allocations: Vec< u64 > = fp.column_of_length( culled_count )?;
+    let culled_last_allocations: Vec< u64 > = fp.column_of_length( culled_count )?;
+    let culled_counts: Vec< u64 > = fp.column_of_length( culled_count )?;
+    let culled_sizes: Vec< u64 > = fp.column_of_length( culled_count )?;
+    let culled_lifetime_lengths: Vec< u64 > = fp.column_of_length( culled_count )?;
+    let culled_lifetimes: Vec< u64 > = fp.column()?;
+    if culled_lifetime_lengths.iter().try_fold( 0_u64, |sum, &length| sum.checked_add( length ) ) != Some( culled_lifetimes.len() as u64 ) {
+        return Err( invalid_data( "mismatched culled lifetimes length" ) );
+    }
+
+    let mut culled_lifetimes = culled_lifetimes.into_iter();
+    let culled_allocations = (0..culled_count).map( |index| CulledAllocations {
+        backtrace: BacktraceId::new( culled_backtraces[ index ] ),
+        first_allocation: Timestamp::from_usecs( culled_first_allocations[ index ] ),
+        last_allocation: Timestamp::from_usecs( culled_last_allocations[ index ] ),
+        count: culled_counts[ index ],
+        size: culled_sizes[ index ],
+        lifetimes: culled_lifetimes.by_ref().take( culled_lifetime_lengths[ index ] as usize ).collect()
+    }).collect();
+
+    let first_allocations: Vec< u64 > = fp.column()?;
+    let group_count = first_allocations.len();
+    let last_allocations: Vec< u64 > = fp.column_of_length( group_count )?;
+    let alloc_counts: Vec< u64 > = fp.column_of_length( group_count )?;
+    let alloc_sizes: Vec< u64 > = fp.column_of_length( group_count )?;
+    let free_counts: Vec< u64 > = fp.column_of_length( group_count )?;
+    let free_sizes: Vec< u64 > = fp.column_of_length( group_count )?;
+    let min_sizes: Vec< u64 > = fp.column_of_length( group_count )?;
+    let max_sizes: Vec< u64 > = fp.column_of_length( group_count )?;
+    let max_total_usage_first_seen_ats: Vec< u64 > = fp.column_of_length( group_count )?;
+    let max_total_usages: Vec< u64 > = fp.column_of_length( group_count )?;
+    let lifetime_p50s: Vec< u64 > = fp.column_of_length( group_count )?;
+    let lifetime_p90s: Vec< u64 > = fp.column_of_length( group_count )?;
+    let lifetime_zero_counts: Vec< u64 > = fp.column_of_length( group_count )?;
+    let lifetime_offsets: Vec< u32 > = fp.column_of_length( group_count )?;
+    let lifetime_mins: Vec< u64 > = fp.column_of_length( group_count )?;
+    let lifetime_maxs: Vec< u64 > = fp.column_of_length( group_count )?;
+    let lifetime_lengths: Vec< u64 > = fp.column_of_length( group_count )?;
+    let lifetime_counts: Vec< u64 > = fp.column()?;
+    if lifetime_lengths.iter().try_fold( 0_u64, |sum, &length| sum.checked_add( length ) ) != Some( lifetime_counts.len() as u64 ) {
+        return Err( invalid_data( "mismatched lifetime sketches length" ) );
+    }
+
+    let mut lifetime_counts = lifetime_counts.into_iter();
+    let group_stats = (0..group_count).map( |index| GroupStatistics {
+        first_allocation: Timestamp::from_usecs( first_allocations[ index ] ),
+        last_allocation: Timestamp::from_usecs( last_allocations[ index ] ),
+        alloc_count: alloc_counts[ index ],
+        alloc_size: alloc_sizes[ index ],
+        free_count: free_counts[ index ],
+        free_size: free_sizes[ index ],
+        min_size: min_sizes[ index ],
+        max_size: max_sizes[ index ],
+        max_total_usage_first_seen_at: Timestamp::from_usecs( max_total_usage_first_seen_ats[ index ] ),
+        max_total_usage: max_total_usages[ index ],
+        lifetime_p50: Timestamp::from_usecs( lifetime_p50s[ index ] ),
+        lifetime_p90: Timestamp::from_usecs( lifetime_p90s[ index ] ),
+        lifetimes: LifetimeSketch {
+            zero_count: lifetime_zero_counts[ index ],
+            offset: lifetime_offsets[ index ],
+            counts: lifetime_counts.by_ref().take( lifetime_lengths[ index ] as usize ).collect(),
+            min: lifetime_mins[ index ],
+            max: lifetime_maxs[ index ]
+        }
+    }).collect();
+
+    let chain_keys: Vec< u64 > = fp.column()?;
+    let chain_count = chain_keys.len();
+    let chain_firsts: Vec< u64 > = fp.column_of_length( chain_count )?;
+    let chain_lasts: Vec< u64 > = fp.column_of_length( chain_count )?;
+    let chain_lengths: Vec< u32 > = fp.column_of_length( chain_count )?;
+    let mut chains: Vec< _ > = (0..chain_count).map( |index| {
+        AllocationChain {
+            first: AllocationId::new( chain_firsts[ index ] ),
+            last: AllocationId::new( chain_lasts[ index ] ),
+            length: chain_lengths[ index ]
+        }
+    }).collect();
+
+    // Older caches were written out of a hash map.
+    chains.sort_unstable_by_key( |chain| chain.first );
+
+    let map_count = fp.u64()?;
+    let map_bytes: Vec< u8 > = fp.column()?;
+    let mut map_bytes = &map_bytes[..];
+    if map_count > map_bytes.len() as u64 {
+        return Err( invalid_data( "too many maps" ) );
+    }
+    let mut maps = Vec::with_capacity( map_count as usize );
+    for _ in 0..map_count {
+        maps.push( read_map( &mut map_bytes )? );
+    }
+
+    // These are cheap to rebuild, so they're not cached.
+    build_map_sparklines( &mut maps, initial_timestamp, last_timestamp );
+    let map_ids = fp.column::< u64 >()?.into_iter().map( MapId ).collect();
+
+    let profiler_bytes_written = fp.u64()?;
+    let histogram_count = fp.u64()?;
+    let histogram_bytes: Vec< u8 > = fp.column()?;
+    let mut histogram_bytes = &histogram_bytes[..];
+    if histogram_count > histogram_bytes.len() as u64 {
+        return Err( invalid_data( "too many profiler histograms" ) );
+    }
+    let mut profiler_histograms = Vec::with_capacity( histogram_count as usize );
+    for _ in 0..histogram_count {
+        profiler_histograms.push( read_profiler_histogram( &mut histogram_bytes )? );
+    }
+
+    let cache_hits: Vec< u64 > = fp.column()?;
+    let cache_misses: Vec< u64 > = fp.column()?;
+    let cache_conflicts: Vec< u64 > = fp.column()?;
+    let cache_capacities: Vec< u64 > = fp.column()?;
+    if cache_misses.len() != cache_hits.len() || cache_conflicts.len() != cache_hits.len() || cache_capacities.len() != cache_hits.len() {
+        return Err( invalid_data( "mismatched backtrace cache statistics" ) );
+    }
+    let backtrace_cache_statistics = (0..cache_hits.len()).map( |index| BacktraceCacheLevelStatistics {
+        hits: cache_hits[ index ],
+        misses: cache_misses[ index ],
+        conflicts: cache_conflicts[ index ],
+        capacity: cache_capacities[ index ]
+    }).collect();
+
+    let snapshot_count = fp.u64()?;
+    let snapshot_bytes: Vec< u8 > = fp.column()?;
+    let mut snapshot_bytes = &snapshot_bytes[..];
+    if snapshot_count > snapshot_bytes.len() as u64 {
+        return Err( invalid_data( "too many jemalloc snapshots" ) );
+    }
+    let mut jemalloc_snapshots = Vec::with_capacity( snapshot_count as usize );
+    for _ in 0..snapshot_count {
+        jemalloc_snapshots.push( read_jemalloc_snapshot( &mut snapshot_bytes )? );
+    }
+
+    let option_change_timestamps: Vec< u64 > = fp.column()?;
+    let option_change_count = option_change_timestamps.len();
+    let option_change_options: Vec< u8 > = fp.column_of_length( option_change_count )?;
+    let option_change_values: Vec< u64 > = fp.column_of_length( option_change_count )?;
+    let option_changes = (0..option_change_count).map( |index| {
+        let option = *RuntimeOption::ALL.get( option_change_options[ index ] as usize ).ok_or_else( || invalid_data( "invalid runtime option" ) )?;
+        Ok( OptionChange {
+            timestamp: Timestamp::from_usecs( option_change_timestamps[ index ] ),
+            option,
+            value: option_change_values[ index ]
+        })
+    }).collect::< io::Result< Vec< _ > > >()?;
+
+    let pool_ids: Vec< u32 > = fp.column()?;
+    let pool_names: Vec< u32 > = fp.column_of_length( pool_ids.len() )?;
+    let pool_flags: Vec< u32 > = fp.column_of_length( pool_ids.len() )?;
+    let pools = pool_ids.into_iter().zip( pool_names ).zip( pool_flags ).map( |((id, name), flags)| {
+        let name = decode_string_id( name, &interner )?.ok_or_else( || invalid_data( "missing pool name" ) )?;
+        Ok( Pool { id: id as u16, name, flags } )
+    }).collect::< io::Result< Vec< _ > > >()?;
+
+    let thread_ids: Vec< u32 > = fp.column()?;
+    let thread_names: Vec< u32 > = fp.column_of_length( thread_ids.len() )?;
+    let thread_starts: Vec< u64 > = fp.column_of_length( thread_ids.len() )?;
+    let thread_exits: Vec< u64 > = fp.column_of_length( thread_ids.len() )?;
+    let threads = (0..thread_ids.len()).map( |index| {
+        Ok( Thread {
+            id: thread_ids[ index ],
+            name: decode_string_id( thread_names[ index ], &interner )?,
+            started_at: decode_timestamp( thread_starts[ index ] ),
+            exited_at: decode_timestamp( thread_exits[ index ] )
+        })
+    }).collect::< io::Result< Vec< _ > > >()?;
+
+    let cgroup_timestamps: Vec< u64 > = fp.column()?;
+    let cgroup_sample_count = cgroup_timestamps.len();
+    let cgroup_currents: Vec< u64 > = fp.column_of_length( cgroup_sample_count )?;
+    let cgroup_limits: Vec< u64 > = fp.column_of_length( cgroup_sample_count )?;
+    let cgroup_anons: Vec< u64 > = fp.column_of_length( cgroup_sample_count )?;
+    let cgroup_files: Vec< u64 > = fp.column_of_length( cgroup_sample_count )?;
+    let cgroup_kernels: Vec< u64 > = fp.column_of_length( cgroup_sample_count )?;
+    let cgroup_socks: Vec< u64 > = fp.column_of_length( cgroup_sample_count )?;
+    let cgroup_pressures_some: Vec< u64 > = fp.column_of_length( cgroup_sample_count )?;
+    let cgroup_pressures_full: Vec< u64 > = fp.column_of_length( cgroup_sample_count )?;
+    let cgroup_samples = (0..cgroup_sample_count).map( |index| CgroupSample {
+        timestamp: Timestamp::from_usecs( cgroup_timestamps[ index ] ),
+        current: cgroup_currents[ index ],
+        limit: cgroup_limits[ index ],
+        anon: cgroup_anons[ index ],
+        file: cgroup_files[ index ],
+        kernel: cgroup_kernels[ index ],
+        sock: cgroup_socks[ index ],
+        pressure_some: cgroup_pressures_some[ index ],
+        pressure_full: cgroup_pressures_full[ index ]
+    }).collect();
+
+    let dump_timestamps: Vec< u64 > = fp.column()?;
+    let dump_lengths: Vec< u64 > = fp.column_of_length( dump_timestamps.len() )?;
+    let dump_addresses: Vec< u64 > = fp.column()?;
+    let dump_values: Vec< u64 > = fp.column_of_length( dump_addresses.len() )?;
+    if dump_lengths.iter().try_fold( 0_u64, |sum, &length| sum.checked_add( length ) ) != Some( dump_addresses.len() as u64 ) {
+        return Err( invalid_data( "mismatched memory dumps length" ) );
+    }
+
+    let dump_hashed_lengths: Vec< u64 > = fp.column_of_length( dump_timestamps.len() )?;
+    let dump_allocation_ids: Vec< u64 > = fp.column()?;
+    let dump_content_hashes: Vec< u64 > = fp.column_of_length( dump_allocation_ids.len() )?;
+    if dump_hashed_lengths.iter().try_fold( 0_u64, |sum, &length| sum.checked_add( length ) ) != Some( dump_allocation_ids.len() as u64 ) {
+        return Err( invalid_data( "mismatched memory dump hashes length" ) );
+    }
+
+    let mut offset = 0;
+    let mut hashed_offset = 0;
+    let memory_dumps = (0..dump_timestamps.len()).map( |index| {
+        let range = offset..offset + dump_lengths[ index ] as usize;
+        let hashed_range = hashed_offset..hashed_offset + dump_hashed_lengths[ index ] as usize;
+        offset = range.end;
+        hashed_offset = hashed_range.end;
+        MemoryDump {
+            timestamp: Timestamp::from_usecs( dump_timestamps[ index ] ),
+            addresses: dump_addresses[ range.clone() ].to_vec(),
+            values: dump_values[ range ].to_vec(),
+            allocation_ids: dump_allocation_ids[ hashed_range.clone() ].iter().map( |&id| AllocationId::new( id ) ).collect(),
+            content_hashes: dump_content_hashes[ hashed_range ].to_vec()
+        }
+    }).collect();
+
+    let latency_backtraces: Vec< u32 > = fp.column()?;
+    let latency_count = latency_backtraces.len();
+    let latency_calls: Vec< u8 > = fp.column_of_length( latency_count )?;
+    let latency_counts: Vec< u64 > = fp.column_of_length( latency_count )?;
+    let latency_totals: Vec< u64 > = fp.column_of_length( latency_count )?;
+    let latency_maxes: Vec< u64 > = fp.column_of_length( latency_count )?;
+    let latency_bucket_lengths: Vec< u64 > = fp.column_of_length( latency_count )?;
+    let latency_buckets: Vec< u64 > = fp.column()?;
+    if latency_bucket_lengths.iter().try_fold( 0_u64, |sum, &length| sum.checked_add( length ) ) != Some( latency_buckets.len() as u64 ) {
+        return Err( invalid_data( "mismatched allocator latency buckets length" ) );
+    }
+
+    let mut latency_buckets = latency_buckets.into_iter();
+    let mut allocator_latencies = Vec::with_capacity( latency_count );
+    for index in 0..latency_count {
+        let call = *AllocatorCall::ALL.get( latency_calls[ index ] as usize ).ok_or_else( || invalid_data( "invalid allocator call" ) )?;
+        allocator_latencies.push( AllocatorLatencies {
+            backtrace: BacktraceId::new( latency_backtraces[ index ] ),
+            call,
+            count: latency_counts[ index ],
+            total: latency_totals[ index ],
+            max: latency_maxes[ index ],
+            buckets: latency_buckets.by_ref().take( latency_bucket_lengths[ index ] as usize ).collect()
+        });
+    }
+
+    let page_fault_period = fp.u64()?;
+    let page_fault_timestamps: Vec< Timestamp > = fp.column()?;
+    let page_fault_count = page_fault_timestamps.len();
+    let page_fault_threads: Vec< u32 > = fp.column_of_length( page_fault_count )?;
+    let page_fault_addresses: Vec< u64 > = fp.column_of_length( page_fault_count )?;
+    let page_fault_allocations: Vec< u64 > = fp.column_of_length( page_fault_count )?;
+    let page_fault_maps: Vec< u64 > = fp.column_of_length( page_fault_count )?;
+    let page_faults = (0..page_fault_count).map( |index| PageFault {
+        timestamp: page_fault_timestamps[ index ],
+        thread: page_fault_threads[ index ],
+        address: page_fault_addresses[ index ],
+        allocation: decode_allocation_id( page_fault_allocations[ index ] ),
+        map: page_fault_maps[ index ].checked_sub( 1 ).map( MapId )
+    }).collect();
+
+    Ok( Data {
+        id,
+        parent_id,
+        initial_timestamp,
+        last_timestamp,
+        executable,
+        cmdline,
+        architecture,
+        pointer_size,
+        interner,
+        operations,
+        allocations,
+        allocation_columns,
+        sorted_by_timestamp,
+        sorted_by_address,
+        sorted_by_size,
+        frames,
+        backtraces,
+        backtraces_storage,
+        allocations_by_backtrace,
+        backtraces_by_frame: Default::default(),
+        backtrace_trie: Default::default(),
+        live_index: Default::default(),
+        total_allocated,
+        total_allocated_count,
+        total_freed,
+        total_freed_count,
+        mallopts,
+        memory_advices,
+        residency_samples,
+        culled_allocations,
+        allocator_latencies,
+        page_faults,
+        page_fault_period,
+        jemalloc_snapshots,
+        cgroup_samples,
+        memory_dumps,
+        option_changes,
+        pools,
+        threads,
+        maximum_backtrace_depth,
+        group_stats,
+        profiler_bytes_written,
+        profiler_histograms,
+        backtrace_cache_statistics,
+        chains,
+        maps,
+        map_ids,
+        selection_cache: Default::default(),
+        address_tiles_cache: Default::default(),
+        call_tree_cache: Default::default()
+    })
+}
+
+/// Loads the data from the cache at `path`.
+///
+/// Returns `None` if there's no cache or if it was generated from a different trace.
+pub fn load( path: &Path, key: &CacheKey ) -> io::Result< Option< Data > > {
+    let start_timestamp = Instant::now();
+    let fp = match File::open( path ) {
+        Ok( fp ) => fp,
+        Err( ref error ) if error.kind() == io::ErrorKind::NotFound => return Ok( None ),
+        Err( error ) => return Err( error )
+    };
+
+    // The cache is only ever replaced by renaming a new file over it, so the mapping stays valid.
+    let mapping = Mapping::new( &fp )?;
+    let mut fp = CacheReader { mapping: Arc::new( mapping ), position: 0 };
+    if !read_header( &mut fp )? {
+        info!( "Ignoring cache {:?} generated by a different version", path );
+        return Ok( None );
+    }
+
+    let cached_key = CacheKey {
+        id: (fp.u64()?, fp.u64()?),
+        file_size: fp.u64()?,
+        mtime_secs: fp.u64()?,
+        mtime_nsecs: fp.u64()?,
+        debug_symbols_hash: fp.u64()?
+    };
+
+    if cached_key != *key {
+        info!( "Ignoring stale cache {:?}", path );
+        return Ok( None );
+    }
+
+    let data = read_data( &mut fp )?;
+    let elapsed = start_timestamp.elapsed();
+    info!( "Loaded data from cache in {}s {:03}", elapsed.as_secs(), elapsed.subsec_millis() );
+    Ok( Some( data ) )
+}
+
+/// Saves the data into a cache at `path`.
+pub fn store( path: &Path, key: &CacheKey, data: &Data ) -> io::Result< () > {
+    let mut tmp_path: OsString = path.as_os_str().to_owned();
+    tmp_path.push( ".tmp" );
+    let tmp_path: PathBuf = tmp_path.into();
+
+    let result = (|| {
+        let mut fp = CacheWriter { fp: BufWriter::new( File::create( &tmp_path )? ) };
+        write_header( &mut fp, key )?;
+        write_data( &mut fp, data )?;
+        fp.fp.into_inner().map_err( |error| error.into_error() )?.sync_all()?;
+        fs::rename( &tmp_path, path )
+    })();
+
+    if result.is_err() {
+        let _ = fs::remove_file( &tmp_path );
+    }
+
+    result
+}
+
+#[cfg(test)]
+fn reader_for( bytes: &[u8] ) -> CacheReader {
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    static COUNTER: AtomicUsize = AtomicUsize::new( 0 );
+
+    let path = std::env::temp_dir().join( format!( "bytehound-test-cache-{}-{}", std::process::id(), COUNTER.fetch_add( 1, Ordering::SeqCst ) ) );
+    fs::write( &path, bytes ).unwrap();
+    let fp = File::open( &path ).unwrap();
+    let mapping = Mapping::new( &fp ).unwrap();
+    let _ = fs::remove_file( &path );
+
+    CacheReader { mapping: Arc::new( mapping ), position: 0 }
+}
+
+#[test]
+fn test_cache_columns() {
+    let mut fp = CacheWriter { fp: Vec::new() };
+    fp.column( [1_u8, 2, 3].iter().cloned() ).unwrap();
+    fp.column( [10_u32].iter().cloned() ).unwrap();
+    fp.column( [100_u64, 200].iter().cloned() ).unwrap();
+    fp.bytes( b"" ).unwrap();
+    fp.column( [1_u64, 2, 3].iter().cloned() ).unwrap();
+    fp.column( [0_u64].iter().cloned() ).unwrap();
+    let buffer = fp.fp;
+    assert_eq!( buffer.len(), (8 + 8) + (8 + 8) + (8 + 16) + 8 + (8 + 24) + (8 + 8) );
+
+    let mut fp = reader_for( &buffer );
+    assert_eq!( fp.column::< u8 >().unwrap(), vec![ 1, 2, 3 ] );
+    assert_eq!( fp.column_of_length::< u32 >( 1 ).unwrap(), vec![ 10 ] );
+    assert_eq!( fp.column::< u64 >().unwrap(), vec![ 100, 200 ] );
+    assert_eq!( fp.string().unwrap(), "" );
+
+    let ids: Column< AllocationId > = fp.mapped_column().unwrap();
+    assert_eq!( ids.is_mapped(), cfg!( target_endian = "little" ) );
+    assert_eq!( &ids[..], &[ AllocationId::new( 0 ), AllocationId::new( 1 ), AllocationId::new( 2 ) ] );
+
+    // Zero is not a valid `AllocationId`.
+    assert!( fp.mapped_column::< AllocationId >().is_err() );
+    assert!( fp.u64().is_err() );
+
+    let mut fp = reader_for( &buffer[ ..20 ] );
+    assert!( fp.column::< u8 >().is_ok() );
+    assert!( fp.column::< u32 >().is_err() );
+}
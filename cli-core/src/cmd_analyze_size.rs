@@ -2,7 +2,7 @@ use std::io::{self, Read};
 use ahash::AHashMap as HashMap;
 use common::event::Event;
 use common::Timestamp;
-use crate::reader::parse_events;
+use crate::reader::scan_events;
 
 fn format_count( count: usize ) -> String {
     if count < 1000 {
@@ -15,8 +15,6 @@ fn format_count( count: usize ) -> String {
 }
 
 pub fn analyze_size( fp: impl Read + Send + 'static ) -> Result< (), io::Error > {
-    let (_, event_stream) = parse_events( fp )?;
-
     const S_OTHER: usize = 0;
     const S_ALLOC: usize = 1;
     const S_REALLOC: usize = 2;
@@ -76,14 +74,9 @@ pub fn analyze_size( fp: impl Read + Send + 'static ) -> Result< (), io::Error >
     }
 
     let mut allocations = HashMap::new();
-    for event in event_stream {
-        let event = match event {
-            Ok( event ) => event,
-            Err( _ ) => break
-        };
-
-        let size = common::speedy::Writable::< common::speedy::LittleEndian >::bytes_needed( &event ).unwrap();
-        let kind = match event {
+    scan_events( fp, |event, size| {
+        let kind = match *event {
+            | Event::Header( .. ) => return,
             | Event::Alloc { .. } => S_ALLOC,
             | Event::AllocEx { id, timestamp, .. } => {
                 allocations.insert( id, timestamp );
@@ -105,17 +98,28 @@ pub fn analyze_size( fp: impl Read + Send + 'static ) -> Result< (), io::Error >
             | Event::Backtrace32 { .. } => S_BACKTRACE,
             | Event::File { .. } => S_FILE,
             | Event::File64 { .. } => S_FILE,
-            | Event::GroupStatistics { .. } => S_STATS,
+            | Event::GroupStatistics { .. }
+            | Event::BacktraceSummaries { .. }
+            | Event::ResidencySamples { .. }
+            | Event::JemallocStats { .. }
+            | Event::NumaPlacements { .. }
+            | Event::CulledAllocations { .. }
+            | Event::AllocatorLatencies { .. }
+            | Event::PageFaults { .. }
+            | Event::CgroupMemory { .. }
+            | Event::ProfilerStatistics { .. }
+            | Event::BacktraceCacheStatistics { .. } => S_STATS,
             | Event::AddRegion { .. }
             | Event::RemoveRegion { .. }
             | Event::MemoryMapEx { .. } => S_MAPS,
-            | Event::UpdateRegionUsage { .. } => S_MAPS_USAGE,
+            | Event::UpdateRegionUsage { .. }
+            | Event::UpdateRegionUsageEx { .. } => S_MAPS_USAGE,
             _ => S_OTHER
         };
 
         stats[ kind ].size += size;
         stats[ kind ].count += 1;
-    }
+    })?;
 
     *allocation_buckets.last_mut().unwrap() += allocations.len();
 
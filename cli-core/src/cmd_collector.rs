@@ -0,0 +1,221 @@
+//! A local collector for the processes which were told to hand their data over with `MEMORY_PROFILER_COLLECTOR`.
+//!
+//! Every process which connects passes us a memfd-backed ring, which we map, and from then on it writes
+//! everything uncompressed into it. We drain the rings, compress the data and write it out, so the
+//! profiled processes don't have to spend any time on the compression and the I/O themselves.
+
+use std::fs::{self, File};
+use std::io::{self, Write};
+use std::os::unix::fs::FileTypeExt;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::{Path, PathBuf};
+use std::thread;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use common::shm_ring::{self, ShmRing};
+
+use crate::threaded_lz4_stream::Lz4Writer;
+
+/// How long to sleep for when a ring is empty.
+const POLL_INTERVAL: Duration = Duration::from_millis( 5 );
+
+/// How often we check whether the processes which haven't closed their rings are still alive.
+const LIVENESS_CHECK_INTERVAL: Duration = Duration::from_secs( 1 );
+
+struct MappedRing( ShmRing );
+
+impl MappedRing {
+    fn map( fd: RawFd, length: usize ) -> io::Result< Self > {
+        if length <= shm_ring::HEADER_SIZE || !(length - shm_ring::HEADER_SIZE).is_power_of_two() {
+            return Err( io::Error::new( io::ErrorKind::InvalidData, format!( "invalid ring length: {}", length ) ) );
+        }
+
+        let pointer = unsafe { libc::mmap( std::ptr::null_mut(), length, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, fd, 0 ) };
+        if pointer == libc::MAP_FAILED {
+            return Err( io::Error::last_os_error() );
+        }
+
+        Ok( MappedRing( unsafe { ShmRing::from_raw( pointer as *mut u8, length ) } ) )
+    }
+}
+
+impl Drop for MappedRing {
+    fn drop( &mut self ) {
+        unsafe {
+            libc::munmap( self.0.as_ptr() as *mut libc::c_void, self.0.len() );
+        }
+    }
+}
+
+/// Receives the ring's file descriptor along with its length.
+fn receive_ring( stream: &UnixStream ) -> io::Result< (RawFd, usize) > {
+    let mut payload = [0_u8; 8];
+    let mut control = [0_u64; 8];
+    unsafe {
+        let mut iov = libc::iovec {
+            iov_base: payload.as_mut_ptr() as *mut libc::c_void,
+            iov_len: payload.len()
+        };
+
+        let mut message: libc::msghdr = std::mem::zeroed();
+        message.msg_iov = &mut iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+        message.msg_controllen = std::mem::size_of_val( &control ) as _;
+
+        let count = libc::recvmsg( stream.as_raw_fd(), &mut message, libc::MSG_CMSG_CLOEXEC );
+        if count < 0 {
+            return Err( io::Error::last_os_error() );
+        }
+
+        let header = libc::CMSG_FIRSTHDR( &message );
+        if count as usize != payload.len() || header.is_null() || (*header).cmsg_level != libc::SOL_SOCKET || (*header).cmsg_type != libc::SCM_RIGHTS {
+            return Err( io::Error::new( io::ErrorKind::InvalidData, "the process didn't send us a ring" ) );
+        }
+
+        let fd = std::ptr::read_unaligned( libc::CMSG_DATA( header ) as *const RawFd );
+        Ok( (fd, u64::from_le_bytes( payload ) as usize) )
+    }
+}
+
+fn peer_pid( stream: &UnixStream ) -> io::Result< u32 > {
+    let mut credentials: libc::ucred = unsafe { std::mem::zeroed() };
+    let mut length = std::mem::size_of::< libc::ucred >() as libc::socklen_t;
+    let result = unsafe {
+        libc::getsockopt(
+            stream.as_raw_fd(),
+            libc::SOL_SOCKET,
+            libc::SO_PEERCRED,
+            &mut credentials as *mut libc::ucred as *mut libc::c_void,
+            &mut length
+        )
+    };
+
+    if result != 0 {
+        return Err( io::Error::last_os_error() );
+    }
+
+    Ok( credentials.pid as u32 )
+}
+
+fn is_process_alive( pid: u32 ) -> bool {
+    unsafe {
+        libc::kill( pid as libc::pid_t, 0 ) == 0 || *libc::__errno_location() != libc::ESRCH
+    }
+}
+
+/// Expands the same `%p`, `%t`, `%e` and `%n` placeholders as `MEMORY_PROFILER_OUTPUT` does.
+fn generate_filename( pattern: &str, pid: u32, counter: u64 ) -> PathBuf {
+    let mut output = String::new();
+    let mut seen_percent = false;
+    for ch in pattern.chars() {
+        if !seen_percent && ch == '%' {
+            seen_percent = true;
+            continue;
+        }
+
+        if seen_percent {
+            seen_percent = false;
+            match ch {
+                '%' => output.push( ch ),
+                'p' => output.push_str( &pid.to_string() ),
+                't' => {
+                    let timestamp = SystemTime::now().duration_since( UNIX_EPOCH ).map( |duration| duration.as_secs() ).unwrap_or( 0 );
+                    output.push_str( &timestamp.to_string() );
+                },
+                'e' => {
+                    let executable = fs::read_link( format!( "/proc/{}/exe", pid ) ).ok();
+                    let executable = executable.as_ref().and_then( |path| path.file_name() ).map( |name| name.to_string_lossy().into_owned() );
+                    output.push_str( executable.as_ref().map( |name| name.as_str() ).unwrap_or( "unknown" ) );
+                },
+                'n' => output.push_str( &counter.to_string() ),
+                _ => {}
+            }
+        } else {
+            output.push( ch );
+        }
+    }
+
+    output.into()
+}
+
+fn collect_from( mut stream: UnixStream, output_pattern: &str, counter: u64 ) -> io::Result< () > {
+    let pid = peer_pid( &stream )?;
+    let (fd, length) = receive_ring( &stream )?;
+    let ring = MappedRing::map( fd, length );
+    unsafe {
+        libc::close( fd );
+    }
+
+    let ring = ring?;
+    ring.0.set_consumer_pid( std::process::id() );
+    stream.write_all( &[1] )?;
+    std::mem::drop( stream );
+
+    let path = generate_filename( output_pattern, pid, counter );
+    info!( "Collecting the data of process {} into {:?}...", pid, path );
+
+    let thread_count = thread::available_parallelism().map( |count| count.get() ).unwrap_or( 1 );
+    let mut fp = Lz4Writer::with_thread_count( File::create( &path )?, thread_count );
+    let mut buffer = Vec::new();
+    let mut last_liveness_check = Instant::now();
+    loop {
+        // This has to be checked before the ring is drained, or we could miss whatever was written in between.
+        let check_liveness = last_liveness_check.elapsed() >= LIVENESS_CHECK_INTERVAL;
+        if check_liveness {
+            last_liveness_check = Instant::now();
+        }
+
+        let is_finished = ring.0.is_closed() || (check_liveness && !is_process_alive( pid ));
+
+        buffer.clear();
+        if ring.0.read_into( &mut buffer ) > 0 {
+            fp.write_all( &buffer )?;
+        } else if !is_finished {
+            thread::sleep( POLL_INTERVAL );
+        }
+
+        if is_finished {
+            break;
+        }
+    }
+
+    fp.flush()?;
+    info!( "Process {} has finished; its data was written to {:?}", pid, path );
+    Ok(())
+}
+
+/// Listens on the given socket and collects the data of every process which connects to it.
+pub fn main( socket_path: &Path, output_pattern: &str ) -> Result< (), io::Error > {
+    if let Ok( metadata ) = fs::symlink_metadata( socket_path ) {
+        if metadata.file_type().is_socket() {
+            fs::remove_file( socket_path )?;
+        }
+    }
+
+    let listener = UnixListener::bind( socket_path )?;
+    info!( "Listening on {:?}...", socket_path );
+
+    let mut counter = 0;
+    for stream in listener.incoming() {
+        let stream = match stream {
+            Ok( stream ) => stream,
+            Err( error ) => {
+                warn!( "Failed to accept a connection: {}", error );
+                continue;
+            }
+        };
+
+        let output_pattern = output_pattern.to_owned();
+        let nth = counter;
+        counter += 1;
+        thread::spawn( move || {
+            if let Err( error ) = collect_from( stream, &output_pattern, nth ) {
+                error!( "Failed to collect the data of a process: {}", error );
+            }
+        });
+    }
+
+    Ok(())
+}
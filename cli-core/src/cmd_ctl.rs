@@ -0,0 +1,105 @@
+use std::error::Error;
+use std::net::TcpStream;
+use std::io;
+
+use common::speedy::{Readable, Writable};
+
+use common::request::{BroadcastHeader, Request, Response};
+use common::event::RuntimeOption;
+
+/// The first protocol version which supports changing the options at runtime.
+const CONTROL_PROTOCOL_VERSION: u32 = 4;
+
+/// The first protocol version which supports the flight recorder.
+const FLIGHT_RECORDER_PROTOCOL_VERSION: u32 = 5;
+
+/// Parses a `NAME=VALUE` assignment of one of the options which can be changed at runtime.
+pub fn parse_assignment( source: &str ) -> Result< (RuntimeOption, u64), String > {
+    let index = source.find( '=' ).ok_or_else( || format!( "expected NAME=VALUE, got '{}'", source ) )?;
+    let (name, value) = (source[ ..index ].trim(), source[ index + 1.. ].trim());
+    let option = RuntimeOption::from_name( name ).ok_or_else( || format!( "unknown option: '{}'", name ) )?;
+    let value = match value {
+        "true" | "on" if option.is_flag() => 1,
+        "false" | "off" if option.is_flag() => 0,
+        _ => value.parse().map_err( |_| format!( "invalid value for {}: '{}'", option.name(), value ) )?
+    };
+
+    if option.is_flag() && value > 1 {
+        return Err( format!( "{} can only be set to 0 or 1", option.name() ) );
+    }
+
+    Ok( (option, value) )
+}
+
+fn read_options( socket: &TcpStream ) -> io::Result< Vec< (RuntimeOption, u64) > > {
+    loop {
+        match Response::read_from_stream_unbuffered( socket )? {
+            Response::Options( options ) => return Ok( options ),
+            Response::Pong => continue,
+            _ => return Err( io::Error::new( io::ErrorKind::Other, "unexpected message" ) )
+        }
+    }
+}
+
+/// Changes the given options of a running process, and prints all of them afterwards.
+///
+/// If `dump_flight_recorder` is set then the process is also asked to write out what its flight recorder has.
+pub fn main( target: &str, assignments: &[(RuntimeOption, u64)], dump_flight_recorder: bool ) -> Result< (), Box< dyn Error > > {
+    let socket = TcpStream::connect( target )?;
+    let BroadcastHeader { pid, executable, protocol_version, .. } = match Response::read_from_stream_unbuffered( &socket )? {
+        Response::Start( header ) => header,
+        _ => return Err( io::Error::new( io::ErrorKind::Other, "unexpected message" ).into() )
+    };
+
+    info!( "Connected to {} (PID {})", String::from_utf8_lossy( &executable ), pid );
+    if protocol_version < CONTROL_PROTOCOL_VERSION {
+        return Err( format!( "the process is using an old protocol version ({}) which doesn't support changing its options", protocol_version ).into() );
+    }
+
+    if dump_flight_recorder {
+        if protocol_version < FLIGHT_RECORDER_PROTOCOL_VERSION {
+            return Err( format!( "the process is using an old protocol version ({}) which doesn't have a flight recorder", protocol_version ).into() );
+        }
+
+        // The dump is written by the process itself, where its output would normally go.
+        Request::DumpFlightRecorder.write_to_stream( &socket )?;
+        info!( "Requested a dump of the flight recorder" );
+    }
+
+    let mut options = None;
+    for &(option, value) in assignments {
+        Request::SetOption { option, value }.write_to_stream( &socket )?;
+        let current = read_options( &socket )?;
+        if current.iter().find( |&&(current_option, _)| current_option == option ).map( |&(_, current_value)| current_value ) != Some( value ) {
+            return Err( format!( "the process refused to set {} to {}", option.name(), value ).into() );
+        }
+
+        info!( "Set {} to {}", option.name(), value );
+        options = Some( current );
+    }
+
+    let options = match options {
+        Some( options ) => options,
+        None => {
+            Request::GetOptions.write_to_stream( &socket )?;
+            read_options( &socket )?
+        }
+    };
+
+    for (option, value) in options {
+        println!( "{} = {}", option.name(), value );
+    }
+
+    Ok(())
+}
+
+#[test]
+fn test_parse_assignment() {
+    assert_eq!( parse_assignment( "sampling_interval=4096" ), Ok( (RuntimeOption::SamplingInterval, 4096) ) );
+    assert_eq!( parse_assignment( "MEMORY_PROFILER_GATHER_MAPS = off" ), Ok( (RuntimeOption::GatherMaps, 0) ) );
+    assert_eq!( parse_assignment( "grab_backtraces_on_free=1" ), Ok( (RuntimeOption::GrabBacktracesOnFree, 1) ) );
+    assert!( parse_assignment( "gather_maps=2" ).is_err() );
+    assert!( parse_assignment( "sampling_interval=on" ).is_err() );
+    assert!( parse_assignment( "output=foo" ).is_err() );
+    assert!( parse_assignment( "sampling_interval" ).is_err() );
+}
@@ -1,65 +1,530 @@
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 use std::fs::File;
+use std::io::{self, Write};
 use std::collections::HashMap;
 use std::collections::hash_map::Entry;
-use common::event::Event;
-use crate::reader::parse_events;
+use ahash::{AHashMap, AHashSet};
+use common::Timestamp;
+use common::event::{AllocBody, AllocationId, BacktraceSummary, Event};
+use common::speedy::Writable;
+use crate::loader::Loader;
+use crate::reader::{parse_events_in_time_range, scan_events_in_time_range};
+use crate::threaded_lz4_stream::Lz4Writer;
 
-pub fn extract( input: PathBuf, output: PathBuf ) -> Result< (), std::io::Error > {
+fn extract_file( output: &Path, counter: &mut HashMap< PathBuf, usize >, path: &str, contents: &[u8] ) -> io::Result< () > {
+    let mut relative_path = path;
+    if relative_path.starts_with( "/" ) {
+        relative_path = &relative_path[ 1.. ];
+    }
+
+    let mut target_path = output.join( relative_path );
+
+    info!( "Extracting {:?} into {:?}...", path, target_path );
+    if let Some( parent ) = target_path.parent() {
+        std::fs::create_dir_all( parent )?;
+    }
+
+    match counter.entry( target_path.clone() ) {
+        Entry::Vacant( bucket ) => {
+            bucket.insert( 0 );
+        },
+        Entry::Occupied( mut bucket ) => {
+            let parent = target_path.parent().unwrap();
+            let mut filename = target_path.file_name().unwrap().to_os_string();
+
+            if *bucket.get() == 0 {
+                let mut filename = filename.clone();
+                filename.push( ".000" );
+                std::fs::rename( &target_path, parent.join( filename ) )?;
+            }
+
+            filename.push( format!( ".{:03}", bucket.get() ) );
+            target_path = parent.join( filename );
+
+            *bucket.get_mut() += 1;
+        }
+    }
+
+    std::fs::write( target_path, contents )
+}
+
+pub fn extract( input: PathBuf, output: PathBuf, from: Option< u64 >, to: Option< u64 > ) -> Result< (), std::io::Error > {
     info!( "Opening {:?}...", input );
     let fp = File::open( input )?;
-    let (_, event_stream) = parse_events( fp )?;
+    let from = from.map( Timestamp::from_secs );
+    let to = to.map( Timestamp::from_secs );
 
     info!( "Creating {:?} if it doesn't exist...", output );
     std::fs::create_dir_all( &output )?;
 
+    // Only the files matter here, so the events don't have to be fully read.
+    let mut range = (Timestamp::min(), Timestamp::max());
     let mut counter = HashMap::new();
-    for event in event_stream {
-        let event = match event {
-            Ok( event ) => event,
-            Err( _ ) => break
+    let mut result = Ok(());
+    scan_events_in_time_range( fp, from, to, |event, _| {
+        if result.is_err() {
+            return;
+        }
+
+        match *event {
+            Event::Header( ref header ) => {
+                range = (
+                    from.map( |from| header.initial_timestamp + from ).unwrap_or( Timestamp::min() ),
+                    to.map( |to| header.initial_timestamp + to ).unwrap_or( Timestamp::max() )
+                );
+            },
+            Event::File { timestamp, .. } | Event::File64 { timestamp, .. } if timestamp < range.0 || timestamp > range.1 => {},
+            Event::File { ref path, ref contents, .. } | Event::File64 { ref path, ref contents, .. } => {
+                result = extract_file( &output, &mut counter, path, contents );
+            },
+            _ => {}
+        }
+    })?;
+
+    result
+}
+
+/// An allocation which is still alive, with all of its reallocations.
+type LiveAllocation = smallvec::SmallVec< [(Timestamp, AllocBody); 1] >;
+
+#[derive(Default)]
+struct LiveMap {
+    mmap: Option< Event< 'static > >,
+    /// The `AddRegion` of every region which is still mapped, with its latest `UpdateRegionUsage` or `UpdateRegionUsageEx`.
+    regions: Vec< (Event< 'static >, Option< Event< 'static > >) >
+}
+
+/// Everything from before the window which is still relevant at its start.
+#[derive(Default)]
+struct Prefix {
+    metadata: Vec< Event< 'static > >,
+    wall_clock: Option< Event< 'static > >,
+    files: Vec< Event< 'static > >,
+    file_index_by_path: AHashMap< String, usize >,
+    maps: AHashMap< u64, LiveMap >,
+    allocations_by_id: AHashMap< AllocationId, LiveAllocation >,
+    allocations_by_pointer: AHashMap< u64, LiveAllocation >,
+    summaries: AHashMap< u64, BacktraceSummary >
+}
+
+impl Prefix {
+    fn add_file( &mut self, path: &str, event: Event< 'static > ) {
+        match self.file_index_by_path.get( path ) {
+            Some( &index ) => self.files[ index ] = event,
+            None => {
+                self.file_index_by_path.insert( path.to_owned(), self.files.len() );
+                self.files.push( event );
+            }
+        }
+    }
+}
+
+struct WindowWriter< F: Write > {
+    fp: F,
+    threads: Option< AHashSet< u32 > >,
+    previous_backtrace_on_thread: AHashMap< u32, Vec< u64 > >,
+    backtraces: AHashMap< u64, Vec< u64 > >,
+    written_backtraces: AHashSet< u64 >,
+    /// The allocations which were skipped because of the thread filter, so that their reallocations and frees can be skipped too.
+    skipped_ids: AHashSet< AllocationId >,
+    skipped_pointers: AHashSet< u64 >
+}
+
+impl< F: Write > WindowWriter< F > {
+    /// Remembers the backtraces instead of writing them, so that only those which end up being used are written.
+    ///
+    /// Returns `false` if the event isn't a backtrace.
+    fn remember_backtrace( &mut self, event: &Event ) -> bool {
+        let (id, addresses) = match *event {
+            Event::Backtrace { id, ref addresses } => (id, addresses.to_vec()),
+            Event::Backtrace32 { id, ref addresses } => (id, addresses.iter().map( |&address| address as u64 ).collect()),
+            Event::PartialBacktrace { id, thread, frames_invalidated, ref addresses } => {
+                let addresses = Loader::expand_partial_backtrace( &mut self.previous_backtrace_on_thread, thread, frames_invalidated, addresses.iter().copied() );
+                *self.previous_backtrace_on_thread.get_mut( &thread ).unwrap() = addresses.clone();
+                (id, addresses)
+            },
+            Event::PartialBacktrace32 { id, thread, frames_invalidated, ref addresses } => {
+                let addresses = Loader::expand_partial_backtrace( &mut self.previous_backtrace_on_thread, thread, frames_invalidated, addresses.iter().map( |&address| address as u64 ) );
+                *self.previous_backtrace_on_thread.get_mut( &thread ).unwrap() = addresses.clone();
+                (id, addresses)
+            },
+            _ => return false
         };
 
-        match event {
-            Event::File { path, contents, .. } | Event::File64 { path, contents, .. } => {
-                let mut relative_path = &*path;
-                if relative_path.starts_with( "/" ) {
-                    relative_path = &relative_path[ 1.. ];
-                }
+        self.backtraces.insert( id, addresses );
+        true
+    }
+
+    fn write_backtrace( &mut self, id: u64 ) -> io::Result< () > {
+        if id == 0 || self.written_backtraces.contains( &id ) {
+            return Ok(());
+        }
+
+        if let Some( addresses ) = self.backtraces.get( &id ) {
+            Event::Backtrace { id, addresses: addresses.into() }.write_to_stream( &mut self.fp )?;
+            self.written_backtraces.insert( id );
+        }
 
-                let mut target_path = output.join( relative_path );
+        Ok(())
+    }
 
-                info!( "Extracting {:?} into {:?}...", path, target_path );
-                if let Some( parent ) = target_path.parent() {
-                    std::fs::create_dir_all( parent )?;
+    /// Writes an event, along with any backtraces it needs which weren't written yet.
+    fn write( &mut self, event: &Event ) -> io::Result< () > {
+        match *event {
+            Event::AllocEx { ref allocation, .. } | Event::ReallocEx { ref allocation, .. } => self.write_backtrace( allocation.backtrace )?,
+            Event::FreeEx { backtrace, .. } |
+            Event::MemoryMap { backtrace, .. } |
+            Event::MemoryUnmap { backtrace, .. } |
+            Event::Mallopt { backtrace, .. } |
+            Event::MemoryAdvice { backtrace, .. } |
+            Event::GroupStatistics { backtrace, .. } => self.write_backtrace( backtrace )?,
+            Event::MemoryMapEx { ref source, .. } => self.write_backtrace( source.backtrace )?,
+            Event::RemoveRegion { ref sources, .. } => {
+                for source in sources.iter() {
+                    self.write_backtrace( source.source.backtrace )?;
+                }
+            },
+            Event::BacktraceSummaries { ref entries, .. } => {
+                for entry in entries.iter() {
+                    self.write_backtrace( entry.backtrace )?;
+                }
+            },
+            Event::ResidencySamples { ref entries, .. } => {
+                for entry in entries.iter() {
+                    self.write_backtrace( entry.backtrace )?;
                 }
+            },
+            Event::CulledAllocations { ref entries, .. } => {
+                for entry in entries.iter() {
+                    self.write_backtrace( entry.backtrace )?;
+                }
+            },
+            Event::AllocatorLatencies { ref entries, .. } => {
+                for entry in entries.iter() {
+                    self.write_backtrace( entry.backtrace )?;
+                }
+            },
+            Event::Checkpoint { ref allocations, .. } => {
+                for allocation in allocations.iter() {
+                    self.write_backtrace( allocation.allocation.backtrace )?;
+                }
+            },
+            _ => {}
+        }
+
+        event.write_to_stream( &mut self.fp )?;
+        Ok(())
+    }
 
-                match counter.entry( target_path.clone() ) {
-                    Entry::Vacant( bucket ) => {
-                        bucket.insert( 0 );
-                    },
-                    Entry::Occupied( mut bucket ) => {
-                        let parent = target_path.parent().unwrap();
-                        let mut filename = target_path.file_name().unwrap().to_os_string();
+    fn is_thread_selected( &self, thread: u32 ) -> bool {
+        self.threads.as_ref().map( |threads| threads.contains( &thread ) ).unwrap_or( true )
+    }
 
-                        if *bucket.get() == 0 {
-                            let mut filename = filename.clone();
-                            filename.push( ".000" );
-                            std::fs::rename( &target_path, parent.join( filename ) )?;
-                        }
+    /// Applies the thread filter to an allocation event; returns `false` if it should be skipped.
+    fn filter_allocation( &mut self, event: &Event ) -> bool {
+        if self.threads.is_none() {
+            return true;
+        }
+
+        match *event {
+            Event::AllocEx { id, ref allocation, .. } => {
+                if self.is_thread_selected( allocation.thread ) {
+                    return true;
+                }
 
-                        filename.push( format!( ".{:03}", bucket.get() ) );
-                        target_path = parent.join( filename );
+                if id.is_untracked() || id.is_invalid() {
+                    self.skipped_pointers.insert( allocation.pointer );
+                } else {
+                    self.skipped_ids.insert( id );
+                }
 
-                        *bucket.get_mut() += 1;
+                false
+            },
+            Event::ReallocEx { id, old_pointer, ref allocation, .. } => {
+                if id.is_untracked() || id.is_invalid() {
+                    if self.skipped_pointers.remove( &old_pointer ) {
+                        self.skipped_pointers.insert( allocation.pointer );
+                        return false;
                     }
+                } else if self.skipped_ids.contains( &id ) {
+                    return false;
                 }
 
-                std::fs::write( target_path, contents )?;
+                true
             },
-            _ => {}
+            Event::FreeEx { id, pointer, .. } => {
+                if id.is_untracked() || id.is_invalid() {
+                    !self.skipped_pointers.remove( &pointer )
+                } else {
+                    !self.skipped_ids.remove( &id )
+                }
+            },
+            // These contain the allocations of every thread.
+            Event::Checkpoint { .. } => false,
+            _ => true
+        }
+    }
+}
+
+/// The old events are converted to their newer versions so that only those have to be handled.
+fn upgrade_event( event: Event< 'static > ) -> Event< 'static > {
+    match event {
+        Event::Alloc { timestamp, allocation } => Event::AllocEx { id: AllocationId::UNTRACKED, timestamp, allocation },
+        Event::Realloc { timestamp, old_pointer, allocation } => Event::ReallocEx { id: AllocationId::UNTRACKED, timestamp, old_pointer, allocation },
+        Event::Free { timestamp, pointer, backtrace, thread } => Event::FreeEx { id: AllocationId::UNTRACKED, timestamp, pointer, backtrace, thread },
+        event => event
+    }
+}
+
+fn add_to_prefix< F: Write >( prefix: &mut Prefix, writer: &mut WindowWriter< F >, event: Event< 'static > ) {
+    if !writer.filter_allocation( &event ) {
+        return;
+    }
+
+    match event {
+        Event::AllocEx { id, timestamp, allocation } => {
+            let allocations = if id.is_untracked() || id.is_invalid() {
+                prefix.allocations_by_pointer.entry( allocation.pointer ).or_default()
+            } else {
+                prefix.allocations_by_id.entry( id ).or_default()
+            };
+
+            allocations.clear();
+            allocations.push( (timestamp, allocation) );
+        },
+        Event::ReallocEx { id, timestamp, old_pointer, allocation } => {
+            if id.is_untracked() || id.is_invalid() {
+                if let Some( mut allocations ) = prefix.allocations_by_pointer.remove( &old_pointer ) {
+                    allocations.push( (timestamp, allocation) );
+                    prefix.allocations_by_pointer.insert( allocation.pointer, allocations );
+                }
+            } else if let Some( allocations ) = prefix.allocations_by_id.get_mut( &id ) {
+                allocations.push( (timestamp, allocation) );
+            }
+        },
+        Event::FreeEx { id, pointer, .. } => {
+            if id.is_untracked() || id.is_invalid() {
+                prefix.allocations_by_pointer.remove( &pointer );
+            } else {
+                prefix.allocations_by_id.remove( &id );
+            }
+        },
+        Event::MemoryMapEx { map_id, .. } => {
+            prefix.maps.insert( map_id, LiveMap { mmap: Some( event ), regions: Vec::new() } );
+        },
+        Event::AddRegion { map_id, .. } => {
+            prefix.maps.entry( map_id ).or_default().regions.push( (event, None) );
+        },
+        Event::RemoveRegion { map_id, address, length, .. } => {
+            if let Some( map ) = prefix.maps.get_mut( &map_id ) {
+                let position = map.regions.iter().rposition( |(region, _)| match *region {
+                    Event::AddRegion { address: region_address, length: region_length, .. } => region_address == address && region_length == length,
+                    _ => false
+                });
+
+                if let Some( position ) = position {
+                    map.regions.remove( position );
+                }
+
+                if map.regions.is_empty() {
+                    prefix.maps.remove( &map_id );
+                }
+            }
+        },
+        Event::UpdateRegionUsage { map_id, address, length, .. } |
+        Event::UpdateRegionUsageEx { map_id, address, length, .. } => {
+            if let Some( map ) = prefix.maps.get_mut( &map_id ) {
+                let region = map.regions.iter_mut().rev().find( |(region, _)| match *region {
+                    Event::AddRegion { address: region_address, length: region_length, .. } => region_address == address && region_length == length,
+                    _ => false
+                });
+
+                if let Some( (_, usage) ) = region {
+                    *usage = Some( event );
+                }
+            }
+        },
+        Event::File { ref path, .. } | Event::File64 { ref path, .. } | Event::BinaryReference { ref path, .. } | Event::BinaryIdentity { ref path, .. } => {
+            let key = match event {
+                Event::BinaryReference { .. } | Event::BinaryIdentity { .. } => format!( "\0{}", path ),
+                _ => path.to_string()
+            };
+
+            prefix.add_file( &key, event );
+        },
+        Event::BacktraceSummaries { ref entries, .. } => {
+            for entry in entries.iter() {
+                prefix.summaries.insert( entry.backtrace, entry.clone() );
+            }
+        },
+        Event::WallClock { .. } => {
+            prefix.wall_clock = Some( event );
+        },
+        Event::Environ { .. } |
+        Event::SamplingInterval { .. } |
+        Event::OptionChanged { .. } |
+        Event::ThreadTag { .. } |
+        Event::ThreadStarted { .. } |
+        Event::ThreadRenamed { .. } |
+        Event::ThreadExited { .. } |
+        Event::PoolCreated { .. } |
+        Event::ParentData { .. } |
+        Event::String { .. } |
+        Event::DecodedFrame { .. } |
+        Event::DecodedBacktrace { .. } |
+        Event::GroupStatistics { .. } => {
+            prefix.metadata.push( event );
+        },
+
+        // None of these matter for what's alive at the start of the window.
+        Event::Header( .. ) |
+        Event::Alloc { .. } |
+        Event::Realloc { .. } |
+        Event::Free { .. } |
+        Event::Backtrace { .. } |
+        Event::Backtrace32 { .. } |
+        Event::PartialBacktrace { .. } |
+        Event::PartialBacktrace32 { .. } |
+        Event::MemoryDump { .. } |
+        Event::MemoryDumpStarted { .. } |
+        Event::Marker { .. } |
+        Event::MemoryMap { .. } |
+        Event::MemoryUnmap { .. } |
+        Event::Mallopt { .. } |
+        Event::MemoryAdvice { .. } |
+        Event::ResidencySamples { .. } |
+        Event::JemallocStats { .. } |
+        Event::NumaPlacements { .. } |
+        Event::CulledAllocations { .. } |
+        Event::AllocatorLatencies { .. } |
+        Event::PageFaults { .. } |
+        Event::PoolAlloc { .. } |
+        Event::PoolFree { .. } |
+        Event::PoolReset { .. } |
+        Event::CgroupMemory { .. } |
+        Event::ThreadContext { .. } |
+        Event::AllocCompact { .. } |
+        Event::ReallocCompact { .. } |
+        Event::ResizeCompact { .. } |
+        Event::FreeCompact { .. } |
+        Event::ProfilerStatistics { .. } |
+        Event::BacktraceCacheStatistics { .. } |
+        Event::ChildData { .. } |
+        Event::Checkpoint { .. } => {}
+    }
+}
+
+fn write_allocation< F: Write >( writer: &mut WindowWriter< F >, id: AllocationId, allocations: LiveAllocation ) -> io::Result< () > {
+    let mut old_pointer = 0;
+    for (nth, (timestamp, allocation)) in allocations.into_iter().enumerate() {
+        let pointer = allocation.pointer;
+        if nth == 0 {
+            writer.write( &Event::AllocEx { id, timestamp, allocation } )?;
+        } else {
+            writer.write( &Event::ReallocEx { id, timestamp, old_pointer, allocation } )?;
+        }
+
+        old_pointer = pointer;
+    }
+
+    Ok(())
+}
+
+fn write_prefix< F: Write >( prefix: Prefix, writer: &mut WindowWriter< F >, timestamp: Timestamp ) -> io::Result< () > {
+    for event in prefix.metadata.iter().chain( prefix.wall_clock.iter() ).chain( prefix.files.iter() ) {
+        writer.write( event )?;
+    }
+
+    let mut maps: Vec< _ > = prefix.maps.into_iter().collect();
+    maps.sort_unstable_by_key( |&(map_id, _)| map_id );
+    for (_, map) in maps {
+        for event in map.mmap.iter() {
+            writer.write( event )?;
+        }
+
+        for (region, usage) in map.regions {
+            writer.write( &region )?;
+            if let Some( usage ) = usage {
+                writer.write( &usage )?;
+            }
         }
     }
 
+    // Sort them so that the output doesn't differ based on the hashmap's iteration order.
+    let mut allocations: Vec< _ > = prefix.allocations_by_id.into_iter()
+        .chain( prefix.allocations_by_pointer.into_iter().map( |(_, allocations)| (AllocationId::UNTRACKED, allocations) ) )
+        .collect();
+    allocations.sort_unstable_by_key( |(id, allocations)| (allocations[ 0 ].0, *id, allocations[ 0 ].1.pointer) );
+    for (id, allocations) in allocations {
+        write_allocation( writer, id, allocations )?;
+    }
+
+    if !prefix.summaries.is_empty() {
+        let mut entries: Vec< _ > = prefix.summaries.into_iter().map( |(_, entry)| entry ).collect();
+        entries.sort_unstable_by_key( |entry| entry.backtrace );
+        writer.write( &Event::BacktraceSummaries { timestamp, entries: entries.into() } )?;
+    }
+
     Ok(())
 }
+
+/// Writes out a new data file with only the events from within the given time range, and optionally only
+/// the allocations made by the given threads.
+///
+/// The output starts with everything which was still alive at the start of the range (the allocations,
+/// the maps, the files and the backtraces they use), so that it can be loaded on its own.
+///
+/// Everything before the start of the range still has to be read, but if the data has a chunk index
+/// then whatever's after the end of the range is skipped.
+pub fn extract_window( input: PathBuf, output: PathBuf, from: Option< u64 >, to: Option< u64 >, threads: Vec< u32 > ) -> Result< (), io::Error > {
+    info!( "Opening {:?}...", input );
+    let fp = File::open( input )?;
+    let (header, event_stream) = parse_events_in_time_range( fp, None, to.map( Timestamp::from_secs ) )?;
+    let from = from.map( |from| header.initial_timestamp + Timestamp::from_secs( from ) ).unwrap_or( Timestamp::min() );
+    let to = to.map( |to| header.initial_timestamp + Timestamp::from_secs( to ) ).unwrap_or( Timestamp::max() );
+
+    let thread_count = std::thread::available_parallelism().map( |count| count.get() ).unwrap_or( 1 );
+    let mut writer = WindowWriter {
+        fp: Lz4Writer::with_thread_count( File::create( output )?, thread_count ),
+        threads: if threads.is_empty() { None } else { Some( threads.into_iter().collect() ) },
+        previous_backtrace_on_thread: AHashMap::new(),
+        backtraces: AHashMap::new(),
+        written_backtraces: AHashSet::new(),
+        skipped_ids: AHashSet::new(),
+        skipped_pointers: AHashSet::new()
+    };
+
+    Event::Header( header ).write_to_stream( &mut writer.fp )?;
+
+    let mut prefix = Some( Prefix::default() );
+    for event in event_stream {
+        let event = upgrade_event( event? );
+        if writer.remember_backtrace( &event ) {
+            continue;
+        }
+
+        let timestamp = event.timestamp();
+        if prefix.is_some() {
+            if timestamp.map( |timestamp| timestamp < from ).unwrap_or( true ) {
+                add_to_prefix( prefix.as_mut().unwrap(), &mut writer, event );
+                continue;
+            }
+
+            write_prefix( prefix.take().unwrap(), &mut writer, from )?;
+        }
+
+        if timestamp.map( |timestamp| timestamp > to ).unwrap_or( false ) {
+            continue;
+        }
+
+        if writer.filter_allocation( &event ) {
+            writer.write( &event )?;
+        }
+    }
+
+    if let Some( prefix ) = prefix {
+        write_prefix( prefix, &mut writer, from )?;
+    }
+
+    writer.fp.finish()
+}
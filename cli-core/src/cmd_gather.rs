@@ -7,27 +7,168 @@ use std::collections::{HashMap, HashSet};
 use std::sync::{Arc, Mutex, MutexGuard};
 use std::time::{Duration, Instant};
 use std::mem;
+use std::path::{Path, PathBuf};
 
 use chrono::prelude::*;
 use common::speedy::{Readable, Writable};
 
-use common::request::{PROTOCOL_VERSION, BroadcastHeader, Request, Response};
+use common::request::{PROTOCOL_VERSION, BroadcastHeader, Request, Response, ResumePoint, SessionRequest};
 use common::get_local_ips;
 use common::event::DataId;
 
+pub use common::request::StreamKind;
+
 use crate::util::{ReadableDuration, Sigint, on_ctrlc};
 
+/// The first protocol version with resumable sessions.
+const SESSION_PROTOCOL_VERSION: u32 = 3;
+
+/// After how long without hearing anything from the process a session's connection is considered lost, in seconds.
+const CONNECTION_TIMEOUT: u64 = 60;
+
+/// For how long we try to resume a session before giving up, in seconds.
+const RECONNECT_TIMEOUT: u64 = 300;
+
+/// How often what was received is acknowledged, in bytes.
+const ACKNOWLEDGE_INTERVAL: u64 = 4 * 1024 * 1024;
+
+/// How to gather, and how much.
+#[derive(Clone, Debug)]
+pub struct GatherOptions {
+    pub kind: StreamKind,
+    /// Where the data is written; the current directory by default.
+    pub output_dir: Option< PathBuf >,
+    /// At most how many bytes are written for all of the processes on a single host.
+    pub disk_budget: Option< u64 >,
+    /// At most how many bytes per second are received from all of the processes on a single host.
+    pub bandwidth_budget: Option< u64 >
+}
+
+impl Default for GatherOptions {
+    fn default() -> Self {
+        GatherOptions {
+            kind: StreamKind::Full,
+            output_dir: None,
+            disk_budget: None,
+            bandwidth_budget: None
+        }
+    }
+}
+
+/// A bandwidth limit which lets through up to a second's worth of bursts.
+struct TokenBucket {
+    rate: u64,
+    /// Goes negative when more was taken than was available.
+    available: f64
+}
+
+impl TokenBucket {
+    fn new( rate: u64 ) -> Self {
+        TokenBucket {
+            rate,
+            available: rate as f64
+        }
+    }
+
+    fn refill( &mut self, elapsed: Duration ) {
+        self.available = (self.available + elapsed.as_secs_f64() * self.rate as f64).min( self.rate as f64 );
+    }
+
+    /// Takes out a given number of bytes, returning for how long to wait until they're paid for.
+    fn take( &mut self, length: u64 ) -> Duration {
+        self.available -= length as f64;
+        if self.available >= 0.0 {
+            return Duration::from_secs( 0 );
+        }
+
+        Duration::from_secs_f64( -self.available / self.rate as f64 )
+    }
+}
+
+struct BudgetState {
+    written: u64,
+    bandwidth: Option< TokenBucket >,
+    last_refill: Instant,
+    is_exhausted: bool
+}
+
+/// The budgets shared by all of the processes from a single host.
+struct HostBudget {
+    host: IpAddr,
+    disk_budget: Option< u64 >,
+    state: Mutex< BudgetState >
+}
+
+impl HostBudget {
+    fn new( host: IpAddr, options: &GatherOptions ) -> Self {
+        HostBudget {
+            host,
+            disk_budget: options.disk_budget,
+            state: Mutex::new( BudgetState {
+                written: 0,
+                bandwidth: options.bandwidth_budget.map( |rate| TokenBucket::new( std::cmp::max( rate, 1 ) ) ),
+                last_refill: Instant::now(),
+                is_exhausted: false
+            })
+        }
+    }
+
+    fn is_exhausted( &self ) -> bool {
+        self.state.lock().unwrap().is_exhausted
+    }
+
+    /// Accounts for some data which is about to be written; waits if it was received too fast.
+    fn on_received( &self, length: u64 ) -> io::Result< () > {
+        let delay = {
+            let mut state = self.state.lock().unwrap();
+            if let Some( disk_budget ) = self.disk_budget {
+                if state.written + length > disk_budget {
+                    if !state.is_exhausted {
+                        error!( "The disk budget for {} was exhausted; not gathering from it anymore", self.host );
+                        state.is_exhausted = true;
+                    }
+
+                    return Err( io::Error::new( ErrorKind::Other, "the disk budget was exhausted" ) );
+                }
+            }
+
+            state.written += length;
+
+            let elapsed = state.last_refill.elapsed();
+            state.last_refill = Instant::now();
+            match state.bandwidth {
+                Some( ref mut bandwidth ) => {
+                    bandwidth.refill( elapsed );
+                    bandwidth.take( length )
+                },
+                None => return Ok(())
+            }
+        };
+
+        if delay > Duration::from_secs( 0 ) {
+            thread::sleep( delay );
+        }
+
+        Ok(())
+    }
+}
+
 struct Wrapper {
     sigint: Sigint,
-    stream: TcpStream
+    stream: TcpStream,
+    last_received: Instant,
+    /// Whether the connection can be given up on if nothing was received for a while.
+    is_resumable: bool
 }
 
 impl Wrapper {
-    fn new( sigint: Sigint, stream: TcpStream ) -> io::Result< Self > {
+    fn new( sigint: Sigint, stream: TcpStream, is_resumable: bool ) -> io::Result< Self > {
         stream.set_read_timeout( Some( Duration::from_secs( 5 ) ) )?;
         Ok( Wrapper {
             sigint,
-            stream
+            stream,
+            last_received: Instant::now(),
+            is_resumable
         })
     }
 }
@@ -41,29 +182,151 @@ impl io::Read for Wrapper {
 
             match self.stream.read( buffer ) {
                 Err( ref error ) if error.kind() == ErrorKind::WouldBlock || error.kind() == ErrorKind::TimedOut => {
+                    if self.is_resumable && self.last_received.elapsed() > Duration::from_secs( CONNECTION_TIMEOUT ) {
+                        return Err( io::Error::new( ErrorKind::TimedOut, "the connection timed out" ) );
+                    }
+
                     Request::Ping.write_to_stream( &self.stream )?;
                     continue;
                 },
+                Ok( count ) => {
+                    self.last_received = Instant::now();
+                    return Ok( count );
+                },
                 result => return result
             }
         }
     }
 }
 
-fn client_loop( socket: TcpStream, mut fp: File, sigint: Sigint, mut ip_lock: Option< MutexGuard< () > > ) -> Result< (), io::Error > {
-    let timestamp = Instant::now();
-    let address = socket.peer_addr().unwrap();
-    let mut socket = Wrapper::new( sigint.clone(), socket )?;
+/// Where a resumable session with a process currently is.
+struct Session {
+    id: u64,
+    /// How much of the stream was already received.
+    offset: u64,
+    acknowledged: u64,
+    /// `None` right after connecting, since the chunks which were lost still got their sequence numbers.
+    next_sequence: Option< u64 >
+}
+
+impl Session {
+    fn new( id: u64 ) -> Self {
+        Session {
+            id,
+            offset: 0,
+            acknowledged: 0,
+            next_sequence: None
+        }
+    }
+
+    fn acknowledge( &mut self, stream: &TcpStream ) -> io::Result< () > {
+        if self.offset > self.acknowledged {
+            Request::Acknowledge( self.offset ).write_to_stream( stream )?;
+            self.acknowledged = self.offset;
+        }
+
+        Ok(())
+    }
+}
+
+/// Everything about a single process from which we're gathering.
+struct Gathering {
+    address: SocketAddr,
+    id: DataId,
+    pid: u32,
+    basename: String,
+    kind: StreamKind,
+    output_dir: Option< PathBuf >,
+    budget: Option< Arc< HostBudget > >,
+    fp: File,
+    filename: String,
+    session: Option< Session >
+}
+
+impl Gathering {
+    fn write( &mut self, data: &[u8] ) -> io::Result< () > {
+        if let Some( ref budget ) = self.budget {
+            budget.on_received( data.len() as u64 )?;
+        }
+
+        self.fp.write_all( data ).map_err( fatal )
+    }
+
+    fn on_chunk( &mut self, stream: &TcpStream, sequence: u64, offset: u64, data: &[u8] ) -> io::Result< () > {
+        let session = match self.session {
+            Some( ref mut session ) => session,
+            None => return Err( io::Error::new( ErrorKind::InvalidData, "received a chunk outside of a session" ) )
+        };
+
+        if let Some( expected ) = session.next_sequence {
+            if sequence != expected {
+                return Err( io::Error::new( ErrorKind::InvalidData, format!( "expected chunk #{}, got #{}", expected, sequence ) ) );
+            }
+        }
+
+        if offset != session.offset {
+            return Err( io::Error::new( ErrorKind::InvalidData, format!( "expected a chunk at offset {}, got one at {}", session.offset, offset ) ) );
+        }
+
+        session.next_sequence = Some( sequence + 1 );
+        self.write( data )?;
+
+        let session = self.session.as_mut().unwrap();
+        session.offset += data.len() as u64;
+        if session.offset - session.acknowledged >= ACKNOWLEDGE_INTERVAL {
+            session.acknowledge( stream )?;
+        }
+
+        Ok(())
+    }
 
+    /// Continues in a new file, for when a session couldn't be resumed and the process started a new one.
+    fn start_new_session( &mut self, session: u64 ) -> io::Result< () > {
+        let (fp, filename) = create_output_file( self.output_dir.as_ref().map( |path| path.as_path() ), self.pid, &self.basename, Some( session ) )?;
+        warn!( "The session with {} couldn't be resumed; '{}' is incomplete, continuing in '{}'...", self.address, self.filename, filename );
+        self.fp = fp;
+        self.filename = filename;
+        self.session = Some( Session::new( session ) );
+        Ok(())
+    }
+}
+
+/// Wraps an error which must not be treated as if the connection was lost.
+fn fatal( error: io::Error ) -> io::Error {
+    io::Error::new( ErrorKind::Other, error )
+}
+
+fn is_connection_lost( error: &io::Error ) -> bool {
+    match error.kind() {
+        ErrorKind::ConnectionReset |
+        ErrorKind::ConnectionAborted |
+        ErrorKind::BrokenPipe |
+        ErrorKind::NotConnected |
+        ErrorKind::TimedOut |
+        ErrorKind::InvalidData => true,
+        _ => false
+    }
+}
+
+fn receive( socket: &mut Wrapper, gathering: &mut Gathering, sigint: &Sigint, timestamp: Instant, ip_lock: &mut Option< MutexGuard< () > > ) -> Result< (), io::Error > {
+    let address = gathering.address;
     while !sigint.was_sent() {
         if ip_lock.is_some() && timestamp.elapsed() > Duration::from_secs( 60 ) {
-            ip_lock = None;
+            *ip_lock = None;
         }
 
-        let response = Response::read_from_stream_unbuffered( &mut socket );
+        let response = Response::read_from_stream_unbuffered( &mut *socket );
         match response {
             Ok( Response::Data( data ) ) => {
-                fp.write_all( &data )?;
+                gathering.write( &data )?;
+            },
+            Ok( Response::Chunk { sequence, offset, data } ) => {
+                gathering.on_chunk( &socket.stream, sequence, offset, &data )?;
+            },
+            Ok( Response::Pong ) => {
+                if let Some( ref mut session ) = gathering.session {
+                    session.acknowledge( &socket.stream )?;
+                }
             },
             Ok( Response::FinishedInitialStreaming ) => {
                 info!( "Initial data received from {}; starting online gathering...", address );
@@ -93,12 +356,125 @@ fn client_loop( socket: TcpStream, mut fp: File, sigint: Sigint, mut ip_lock: Op
     Ok(())
 }
 
-fn connect< A: ToSocketAddrs >( target: A ) -> Result< (TcpStream, File, String), io::Error > {
+/// Gathers from a single process until it's done; returns the file into which the rest of the data was written.
+fn client_loop( socket: TcpStream, mut gathering: Gathering, sigint: Sigint, mut ip_lock: Option< MutexGuard< () > > ) -> Result< String, io::Error > {
+    let timestamp = Instant::now();
+    let mut socket = Wrapper::new( sigint.clone(), socket, gathering.session.is_some() )?;
+    loop {
+        let error = match receive( &mut socket, &mut gathering, &sigint, timestamp, &mut ip_lock ) {
+            Ok(()) => return Ok( gathering.filename ),
+            Err( error ) => error
+        };
+
+        if gathering.session.is_none() || !is_connection_lost( &error ) {
+            return Err( error );
+        }
+
+        warn!( "Lost the connection to {}: {}", gathering.address, error );
+        match reconnect( &mut gathering, &sigint )? {
+            Some( stream ) => socket = Wrapper::new( sigint.clone(), stream, true )?,
+            None => return Ok( gathering.filename )
+        }
+    }
+}
+
+/// Tries to connect to the process again and resume the session; returns `None` if the process is gone.
+fn try_resume( gathering: &mut Gathering ) -> io::Result< Option< TcpStream > > {
+    let socket = TcpStream::connect_timeout( &gathering.address, Duration::from_secs( 10 ) )?;
+    socket.set_read_timeout( Some( Duration::from_secs( 10 ) ) )?;
+    match Response::read_from_stream_unbuffered( &socket )? {
+        Response::Start( ref header ) if header.id == gathering.id => {},
+        Response::Start( _ ) => return Ok( None ),
+        _ => return Err( io::Error::new( ErrorKind::InvalidData, "unexpected message" ) )
+    }
+
+    let (id, offset) = {
+        let session = gathering.session.as_mut().unwrap();
+        session.next_sequence = None;
+        (session.id, session.offset)
+    };
+
+    let resume = ResumePoint { session: id, offset };
+    Request::StartSession( SessionRequest { kind: gathering.kind, resume: Some( resume ) } ).write_to_stream( &socket )?;
+    match Response::read_from_stream_unbuffered( &socket )? {
+        Response::SessionStarted { session, offset: resumed_offset, .. } if session == id && resumed_offset == offset => {
+            info!( "Resumed the session with {} at offset {}", gathering.address, offset );
+        },
+        Response::SessionStarted { session, offset: 0, .. } => {
+            gathering.start_new_session( session )?;
+        },
+        _ => return Err( io::Error::new( ErrorKind::InvalidData, "unexpected message" ) )
+    }
+
+    Ok( Some( socket ) )
+}
+
+fn reconnect( gathering: &mut Gathering, sigint: &Sigint ) -> io::Result< Option< TcpStream > > {
+    let started = Instant::now();
+    let mut delay = Duration::from_secs( 1 );
+    loop {
+        let waiting_since = Instant::now();
+        while waiting_since.elapsed() < delay {
+            if sigint.was_sent() {
+                return Ok( None );
+            }
+
+            thread::sleep( Duration::from_millis( 100 ) );
+        }
+
+        info!( "Trying to reconnect to {}...", gathering.address );
+        match try_resume( gathering ) {
+            Ok( Some( socket ) ) => return Ok( Some( socket ) ),
+            Ok( None ) => {
+                info!( "A different process is now listening at {}; assuming the old one exited", gathering.address );
+                return Ok( None );
+            },
+            Err( ref error ) if error.kind() == ErrorKind::ConnectionRefused => {
+                info!( "Nothing is listening at {} anymore; assuming the process exited", gathering.address );
+                return Ok( None );
+            },
+            Err( error ) => {
+                if started.elapsed() > Duration::from_secs( RECONNECT_TIMEOUT ) {
+                    return Err( error );
+                }
+
+                info!( "Failed to reconnect to {}: {}", gathering.address, error );
+                delay = std::cmp::min( delay * 2, Duration::from_secs( 10 ) );
+            }
+        }
+    }
+}
+
+fn create_output_file( output_dir: Option< &Path >, pid: u32, basename: &str, session: Option< u64 > ) -> Result< (File, String), io::Error > {
+    let now = Utc::now();
+    let mut filename = format!( "{}{:02}{:02}_{:02}{:02}{:02}_{:05}_{}", now.year(), now.month(), now.day(), now.hour(), now.minute(), now.second(), pid, basename );
+    if let Some( session ) = session {
+        filename.push_str( &format!( "_session{}", session ) );
+    }
+
+    filename.push_str( ".dat" );
+    if let Some( output_dir ) = output_dir {
+        filename = output_dir.join( filename ).to_string_lossy().into_owned();
+    }
+
+    info!( "Gathering events to '{}'...", filename );
+
+    match File::create( &filename ) {
+        Ok( fp ) => Ok( (fp, filename) ),
+        Err( error ) => {
+            error!( "Unable to create '{}': {}", filename, error );
+            Err( io::Error::new( io::ErrorKind::Other, "unable to create output file" ) )
+        }
+    }
+}
+
+fn connect< A: ToSocketAddrs >( target: A, options: &GatherOptions, budget: Option< Arc< HostBudget > > ) -> Result< (TcpStream, Gathering), io::Error > {
+    let kind = options.kind;
     let socket = TcpStream::connect( target )?;
     let target = socket.peer_addr().unwrap();
     let response = Response::read_from_stream_unbuffered( &socket )?;
     match response {
-        Response::Start( BroadcastHeader { pid, executable, arch, timestamp, initial_timestamp, .. } ) => {
+        Response::Start( BroadcastHeader { id, pid, executable, arch, timestamp, initial_timestamp, protocol_version, .. } ) => {
             let executable = String::from_utf8_lossy( &executable );
             info!( "Connection established to {}:", target );
             info!( "  Executable: {}", executable );
@@ -114,21 +490,44 @@ fn connect< A: ToSocketAddrs >( target: A ) -> Result< (TcpStream, File, String)
                 }
             }).collect();
 
-            let now = Utc::now();
-            let filename = format!( "{}{:02}{:02}_{:02}{:02}{:02}_{:05}_{}.dat", now.year(), now.month(), now.day(), now.hour(), now.minute(), now.second(), pid, basename );
-            info!( "Gathering events to '{}'...", filename );
-
-            let fp = match File::create( &filename ) {
-                Ok( fp ) => fp,
-                Err( error ) => {
-                    error!( "Unable to create '{}': {}", filename, error );
-                    return Err( io::Error::new( io::ErrorKind::Other, "unable to create output file" ) );
+            let session = if protocol_version >= SESSION_PROTOCOL_VERSION {
+                Request::StartSession( SessionRequest { kind, resume: None } ).write_to_stream( &socket )?;
+                match Response::read_from_stream_unbuffered( &socket )? {
+                    Response::SessionStarted { session, kind: streamed_kind, .. } => {
+                        info!( "      Stream: {:?}", streamed_kind );
+                        Some( Session::new( session ) )
+                    },
+                    Response::StreamKindUnavailable( streamed_kind ) => {
+                        error!( "The process at {} can only stream {:?}, which is more than what was requested", target, streamed_kind );
+                        return Err( io::Error::new( io::ErrorKind::Other, "the requested stream kind is unavailable" ) );
+                    },
+                    _ => return Err( io::Error::new( io::ErrorKind::Other, "unexpected message" ) )
+                }
+            } else {
+                if kind != StreamKind::Full {
+                    error!( "The process at {} is using an old protocol version ({}) which can't select what's streamed", target, protocol_version );
+                    return Err( io::Error::new( io::ErrorKind::Other, "the requested stream kind is unavailable" ) );
                 }
+
+                Request::StartStreaming.write_to_stream( &socket )?;
+                None
             };
 
-            Request::StartStreaming.write_to_stream( &socket )?;
+            let (fp, filename) = create_output_file( options.output_dir.as_ref().map( |path| path.as_path() ), pid, &basename, None )?;
+            let gathering = Gathering {
+                address: target,
+                id,
+                pid,
+                basename,
+                kind,
+                output_dir: options.output_dir.clone(),
+                budget,
+                fp,
+                filename,
+                session
+            };
 
-            Ok( (socket, fp, filename) )
+            Ok( (socket, gathering) )
         },
         _ => return Err( io::Error::new( io::ErrorKind::Other, "unexpected message" ) )
     }
@@ -160,9 +559,44 @@ impl Drop for ClientLifetime {
     }
 }
 
-pub fn main( target: Option< &str > ) -> Result< (), Box< dyn Error > > {
+/// Starts gathering from the given `target` on a background thread.
+///
+/// Returns the path of the file to which the data is being written, which can be
+/// read at any time to get everything gathered until then, and the handle of the thread,
+/// which finishes once the target disconnects.
+pub fn gather_in_background( target: &str ) -> Result< (PathBuf, thread::JoinHandle< () >), io::Error > {
+    let (socket, gathering) = connect( target, &GatherOptions::default(), None )?;
+    let filename = gathering.filename.clone();
+    let handle = thread::spawn( move || {
+        match client_loop( socket, gathering, Sigint::default(), None ) {
+            Ok( _ ) => info!( "Gathering finished successfully!" ),
+            Err( err ) => error!( "Gathering failed: {:?}", err )
+        }
+    });
+
+    Ok( (filename.into(), handle) )
+}
+
+pub fn parse_stream_kind( source: &str ) -> Result< StreamKind, String > {
+    match source {
+        "full" => Ok( StreamKind::Full ),
+        "sampled" => Ok( StreamKind::Sampled ),
+        "summary" => Ok( StreamKind::SummaryOnly ),
+        _ => Err( format!( "unknown stream kind: '{}'", source ) )
+    }
+}
+
+/// Gathers from a single `target`, or from every process which announces itself if there's none,
+/// until interrupted.
+pub fn main( target: Option< &str >, options: GatherOptions ) -> Result< (), Box< dyn Error > > {
+    if let Some( ref output_dir ) = options.output_dir {
+        std::fs::create_dir_all( output_dir )?;
+    }
+
     let clients: Arc< Mutex< HashSet< DataId > > > = Arc::new( Mutex::new( HashSet::new() ) );
     let mut locks: HashMap< IpAddr, Arc< Mutex< () > > > = HashMap::new();
+    let mut budgets: HashMap< IpAddr, Arc< HostBudget > > = HashMap::new();
+    let has_budgets = options.disk_budget.is_some() || options.bandwidth_budget.is_some();
     let sigint = on_ctrlc();
     match target {
         None => {
@@ -171,8 +605,10 @@ pub fn main( target: Option< &str > ) -> Result< (), Box< dyn Error > > {
             let socket = UdpSocket::bind( "0.0.0.0:43512" ).expect( "cannot bind the UDP socket" );
             socket.set_read_timeout( Some( Duration::from_millis( 100 ) ) ).expect( "cannot set read timeout" );
 
+            let mut handles = Vec::new();
             info!( "Scanning..." );
             while !sigint.was_sent() {
+                handles.retain( |handle: &thread::JoinHandle< () >| !handle.is_finished() );
                 if let Ok( (byte_count, addr) ) = socket.recv_from( &mut buffer ) {
                     let ip = if get_local_ips().iter().any( |&local_ip| addr.ip() == local_ip ) {
                         IpAddr::V4( Ipv4Addr::new( 127, 0, 0, 1 ) )
@@ -199,6 +635,17 @@ pub fn main( target: Option< &str > ) -> Result< (), Box< dyn Error > > {
                         continue;
                     }
 
+                    let budget = if has_budgets {
+                        let budget = budgets.entry( ip ).or_insert_with( || Arc::new( HostBudget::new( ip, &options ) ) ).clone();
+                        if budget.is_exhausted() {
+                            continue;
+                        }
+
+                        Some( budget )
+                    } else {
+                        None
+                    };
+
                     let id = start_body.id;
                     let lifetime = match ClientLifetime::new( &clients, id ) {
                         Some( lifetime ) => lifetime,
@@ -209,31 +656,44 @@ pub fn main( target: Option< &str > ) -> Result< (), Box< dyn Error > > {
                     info!( "Found a new client {}", addr );
 
                     let sigint = sigint.clone();
+                    let options = options.clone();
                     let ip_lock = locks.entry( addr.ip() ).or_insert_with( || Arc::new( Mutex::new(()) ) ).clone();
-                    thread::spawn( move || {
+                    handles.push( thread::spawn( move || {
                         let _lifetime = lifetime;
                         let ip_lock = ip_lock.lock().unwrap();
 
                         info!( "Trying to connect to {}...", addr );
-                        let (socket, fp, filename) = match connect( addr ) {
+                        let (socket, gathering) = match connect( addr, &options, budget ) {
                             Ok( value ) => value,
                             Err( err ) => {
                                 error!( "Failed to connect to '{}': {}", addr, err );
                                 return;
                             }
                         };
-                        match client_loop( socket, fp, sigint, Some( ip_lock ) ) {
-                            Ok(()) => info!( "Gathering finished for {}; '{}' is now complete", addr, filename ),
+                        match client_loop( socket, gathering, sigint, Some( ip_lock ) ) {
+                            Ok( filename ) => info!( "Gathering finished for {}; '{}' is now complete", addr, filename ),
                             Err( err ) => error!( "Gathering failed for {}: {:?}", addr, err )
                         }
-                    });
+                    }));
                 }
             }
+
+            // Let everyone finish writing out what they already have.
+            for handle in handles {
+                let _ = handle.join();
+            }
         },
         Some( target ) => {
-            let (socket, fp, _) = connect( target )?;
-            match client_loop( socket, fp, sigint, None ) {
-                Ok(()) => info!( "Gathering finished successfully!" ),
+            let budget = if has_budgets {
+                let address = target.to_socket_addrs()?.next().ok_or_else( || io::Error::new( ErrorKind::Other, "invalid target" ) )?;
+                Some( Arc::new( HostBudget::new( address.ip(), &options ) ) )
+            } else {
+                None
+            };
+
+            let (socket, gathering) = connect( target, &options, budget )?;
+            match client_loop( socket, gathering, sigint, None ) {
+                Ok( _ ) => info!( "Gathering finished successfully!" ),
                 Err( err ) => error!( "Gathering failed: {:?}", err )
             }
         }
@@ -242,3 +702,25 @@ pub fn main( target: Option< &str > ) -> Result< (), Box< dyn Error > > {
     info!( "Finished!" );
     Ok(())
 }
+
+#[test]
+fn test_parse_stream_kind() {
+    assert_eq!( parse_stream_kind( "summary" ), Ok( StreamKind::SummaryOnly ) );
+    assert_eq!( parse_stream_kind( "full" ), Ok( StreamKind::Full ) );
+    assert!( parse_stream_kind( "everything" ).is_err() );
+}
+
+#[test]
+fn test_token_bucket() {
+    let mut bucket = TokenBucket::new( 1000 );
+    assert_eq!( bucket.take( 600 ), Duration::from_secs( 0 ) );
+    assert_eq!( bucket.take( 900 ), Duration::from_millis( 500 ) );
+
+    bucket.refill( Duration::from_millis( 500 ) );
+    assert_eq!( bucket.take( 0 ), Duration::from_secs( 0 ) );
+
+    // The bursts are limited to a second's worth.
+    bucket.refill( Duration::from_secs( 10 ) );
+    assert_eq!( bucket.take( 1000 ), Duration::from_secs( 0 ) );
+    assert_eq!( bucket.take( 1 ), Duration::from_millis( 1 ) );
+}
@@ -0,0 +1,713 @@
+//! Generates synthetic data files directly in the same format the profiler writes, without
+//! having to actually run anything under it.
+//!
+//! Every simulated thread allocates independently of the others, so the threads are split
+//! between a few workers which all simulate the same slice of time in parallel; the events
+//! of each slice are then written out one worker after another.
+
+use std::borrow::Cow;
+use std::cmp::{max, min, Reverse};
+use std::collections::BinaryHeap;
+use std::fmt;
+use std::io::{self, Write};
+use std::str::FromStr;
+use std::time::Instant;
+
+use rayon::prelude::*;
+
+use common::Timestamp;
+use common::event::{
+    AllocBody,
+    AllocationId,
+    DataId,
+    Event,
+    HeaderBody,
+    RegionFlags,
+    RegionSource,
+    RegionTargetedSource,
+    HEADER_FLAG_IS_LITTLE_ENDIAN
+};
+use common::speedy::Writable;
+
+use crate::threaded_lz4_stream::Lz4Writer;
+
+/// Roughly how many events all of the workers should generate during a single slice of time.
+const EVENTS_PER_SLICE: f64 = (1 << 20) as f64;
+
+/// How many of the most recently generated backtraces new backtraces can share their frames with.
+const PARENT_BACKTRACE_COUNT: usize = 4096;
+
+/// The probability that a new backtrace shares some of its outermost frames with an older one.
+const SHARED_PREFIX_PROBABILITY: f64 = 0.9;
+
+/// How many distinct functions the backtraces are made of.
+const FUNCTION_COUNT: u64 = 64 * 1024;
+
+/// How much more likely the most popular backtraces are to be used for an allocation
+/// than the least popular ones; the `n`-th backtrace is picked with a probability
+/// proportional to `n^(1 / BACKTRACE_SKEW - 1)`.
+const BACKTRACE_SKEW: f64 = 4.0;
+
+const HEAP_BASE: u64 = 0x1000_0000_0000;
+const HEAP_LENGTH_PER_WORKER: u64 = 1 << 40;
+const MMAP_BASE: u64 = 0x7000_0000_0000;
+const MMAP_LENGTH_PER_WORKER: u64 = 1 << 38;
+const PAGE_SIZE: u64 = 4096;
+
+/// A distribution of random values, parsed from e.g. `exponential:10` or `lognormal:64:1.5`.
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub enum Distribution {
+    Constant( f64 ),
+    /// Between the minimum and the maximum.
+    Uniform( f64, f64 ),
+    /// With the given mean.
+    Exponential( f64 ),
+    /// With the given median and the standard deviation of its logarithm.
+    LogNormal( f64, f64 ),
+    /// With the given minimum and shape; the smaller the shape the longer the tail.
+    Pareto( f64, f64 )
+}
+
+impl Distribution {
+    fn sample( &self, rng: &mut Rng ) -> f64 {
+        match *self {
+            Distribution::Constant( value ) => value,
+            Distribution::Uniform( minimum, maximum ) => minimum + (maximum - minimum) * rng.uniform(),
+            Distribution::Exponential( mean ) => -rng.uniform().ln() * mean,
+            Distribution::LogNormal( median, sigma ) => median * (sigma * rng.normal()).exp(),
+            Distribution::Pareto( minimum, shape ) => minimum / rng.uniform().powf( 1.0 / shape )
+        }
+    }
+
+    fn mean( &self ) -> f64 {
+        match *self {
+            Distribution::Constant( value ) => value,
+            Distribution::Uniform( minimum, maximum ) => (minimum + maximum) / 2.0,
+            Distribution::Exponential( mean ) => mean,
+            Distribution::LogNormal( median, sigma ) => median * (sigma * sigma / 2.0).exp(),
+            Distribution::Pareto( _, shape ) if shape <= 1.0 => std::f64::INFINITY,
+            Distribution::Pareto( minimum, shape ) => minimum * shape / (shape - 1.0)
+        }
+    }
+}
+
+impl fmt::Display for Distribution {
+    fn fmt( &self, fmt: &mut fmt::Formatter ) -> fmt::Result {
+        match *self {
+            Distribution::Constant( value ) => write!( fmt, "constant:{}", value ),
+            Distribution::Uniform( minimum, maximum ) => write!( fmt, "uniform:{}:{}", minimum, maximum ),
+            Distribution::Exponential( mean ) => write!( fmt, "exponential:{}", mean ),
+            Distribution::LogNormal( median, sigma ) => write!( fmt, "lognormal:{}:{}", median, sigma ),
+            Distribution::Pareto( minimum, shape ) => write!( fmt, "pareto:{}:{}", minimum, shape )
+        }
+    }
+}
+
+impl FromStr for Distribution {
+    type Err = String;
+    fn from_str( string: &str ) -> Result< Self, Self::Err > {
+        let mut chunks = string.split( ':' );
+        let kind = chunks.next().unwrap();
+        let arguments: Vec< f64 > = chunks
+            .map( |chunk| chunk.parse().map_err( |_| format!( "invalid number in distribution '{}': '{}'", string, chunk ) ) )
+            .collect::< Result< _, _ > >()?;
+
+        if arguments.iter().any( |argument| !argument.is_finite() || *argument < 0.0 ) {
+            return Err( format!( "invalid distribution '{}': the arguments must be non-negative", string ) );
+        }
+
+        let distribution = match (kind, &arguments[..]) {
+            ("constant", &[value]) => Distribution::Constant( value ),
+            ("uniform", &[minimum, maximum]) if minimum <= maximum => Distribution::Uniform( minimum, maximum ),
+            ("exponential", &[mean]) => Distribution::Exponential( mean ),
+            ("lognormal", &[median, sigma]) => Distribution::LogNormal( median, sigma ),
+            ("pareto", &[minimum, shape]) if shape > 0.0 => Distribution::Pareto( minimum, shape ),
+            _ => {
+                return Err( format!(
+                    "invalid distribution '{}'; expected one of: 'constant:VALUE', 'uniform:MIN:MAX', 'exponential:MEAN', 'lognormal:MEDIAN:SIGMA' or 'pareto:MIN:SHAPE'",
+                    string
+                ));
+            }
+        };
+
+        Ok( distribution )
+    }
+}
+
+/// This is xorshift64*; it's more than good enough for this, and much faster than anything cryptographic.
+struct Rng( u64 );
+
+impl Rng {
+    fn new( seed: u64 ) -> Self {
+        // The xorshift generator gets stuck if its state is zero.
+        Rng( seed.wrapping_mul( 0x9E3779B97F4A7C15 ) | 1 )
+    }
+
+    #[inline]
+    fn next( &mut self ) -> u64 {
+        let mut x = self.0;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        self.0 = x;
+        x.wrapping_mul( 0x2545F4914F6CDD1D )
+    }
+
+    /// A uniformly distributed value in the range of (0, 1].
+    #[inline]
+    fn uniform( &mut self ) -> f64 {
+        ((self.next() >> 11) + 1) as f64 / (1_u64 << 53) as f64
+    }
+
+    /// A normally distributed value with a mean of zero and a standard deviation of one.
+    fn normal( &mut self ) -> f64 {
+        (-2.0 * self.uniform().ln()).sqrt() * (2.0 * std::f64::consts::PI * self.uniform()).cos()
+    }
+
+    #[inline]
+    fn below( &mut self, count: u64 ) -> u64 {
+        ((self.next() >> 32) * count) >> 32
+    }
+}
+
+#[derive(Clone, Debug)]
+pub struct GenerateOptions {
+    /// Roughly how many events should be generated in total.
+    pub event_count: u64,
+    pub thread_count: u32,
+    pub backtrace_count: u64,
+    /// The number of frames of each backtrace.
+    pub backtrace_depth: Distribution,
+    /// The time between two allocations made by the same thread, in microseconds.
+    pub allocation_interval: Distribution,
+    /// The size of every allocation, in bytes.
+    pub allocation_size: Distribution,
+    /// How long every allocation (or a single reallocation of it) lives, in microseconds.
+    pub lifetime: Distribution,
+    /// The probability that an allocation will never be freed.
+    pub leak_probability: f64,
+    /// The probability that an allocation will be reallocated instead of freed; the chains
+    /// of reallocations are geometrically distributed.
+    pub realloc_probability: f64,
+    /// The probability that an allocation will be an `mmap` instead of a `malloc`.
+    pub mmap_probability: f64,
+    /// The length of every `mmap`, in bytes.
+    pub mmap_size: Distribution,
+    pub seed: u64,
+    pub compress: bool
+}
+
+impl Default for GenerateOptions {
+    fn default() -> Self {
+        GenerateOptions {
+            event_count: 1_000_000,
+            thread_count: 8,
+            backtrace_count: 10_000,
+            backtrace_depth: Distribution::Uniform( 8.0, 48.0 ),
+            allocation_interval: Distribution::Exponential( 5.0 ),
+            allocation_size: Distribution::LogNormal( 64.0, 1.5 ),
+            lifetime: Distribution::LogNormal( 100.0, 3.0 ),
+            leak_probability: 0.01,
+            realloc_probability: 0.1,
+            mmap_probability: 0.001,
+            mmap_size: Distribution::LogNormal( 256.0 * 1024.0, 1.5 ),
+            seed: 0,
+            compress: true
+        }
+    }
+}
+
+enum LiveKind {
+    Heap {
+        id: AllocationId,
+        size_class: usize
+    },
+    Mmap {
+        map_id: u64
+    }
+}
+
+struct Live {
+    kind: LiveKind,
+    pointer: u64,
+    size: u64,
+    backtrace: u64,
+    thread: u32
+}
+
+struct Thread {
+    id: u32,
+    allocation_counter: u64
+}
+
+/// Simulates a subset of the threads.
+struct Worker< 'a > {
+    options: &'a GenerateOptions,
+    rng: Rng,
+    threads: Vec< Thread >,
+    /// The next thing to happen, as `(time, tag)`; see `Worker::run`.
+    queue: BinaryHeap< Reverse< (u64, u64) > >,
+    live: Vec< Live >,
+    unused_live: Vec< usize >,
+    /// The freed heap pointers, by their size class.
+    free_pointers: Vec< Vec< u64 > >,
+    heap_range: (u64, u64),
+    next_heap_pointer: u64,
+    mmap_range: (u64, u64),
+    next_mmap_pointer: u64,
+    next_map_id: u64,
+    map_id_stride: u64,
+    quota: u64,
+    written: u64,
+    buffer: Vec< u8 >
+}
+
+impl< 'a > Worker< 'a > {
+    fn new( options: &'a GenerateOptions, index: usize, worker_count: usize, quota: u64 ) -> Self {
+        let mut rng = Rng::new( options.seed ^ (index as u64 + 1) );
+        let threads: Vec< _ > = (index..options.thread_count as usize)
+            .step_by( worker_count )
+            .map( |thread| Thread { id: thread as u32 + 1, allocation_counter: 0 } )
+            .collect();
+
+        let mut queue = BinaryHeap::new();
+        for thread in 0..threads.len() {
+            let time = options.allocation_interval.sample( &mut rng ) as u64;
+            queue.push( Reverse( (time, (thread as u64) << 1) ) );
+        }
+
+        let heap_base = HEAP_BASE + index as u64 * HEAP_LENGTH_PER_WORKER;
+        let mmap_base = MMAP_BASE + index as u64 * MMAP_LENGTH_PER_WORKER;
+        Worker {
+            options,
+            rng,
+            threads,
+            queue,
+            live: Vec::new(),
+            unused_live: Vec::new(),
+            free_pointers: (0..64).map( |_| Vec::new() ).collect(),
+            heap_range: (heap_base, heap_base + HEAP_LENGTH_PER_WORKER),
+            next_heap_pointer: heap_base,
+            mmap_range: (mmap_base, mmap_base + MMAP_LENGTH_PER_WORKER),
+            next_mmap_pointer: mmap_base,
+            next_map_id: index as u64 + 1,
+            map_id_stride: worker_count as u64,
+            quota,
+            written: 0,
+            buffer: Vec::new()
+        }
+    }
+
+    fn is_done( &self ) -> bool {
+        self.written >= self.quota || self.queue.is_empty()
+    }
+
+    /// Generates everything which happens before `end` into the `buffer`.
+    ///
+    /// Every entry in the `queue` is tagged with either `thread << 1`, when that thread
+    /// should allocate again, or with `live << 1 | 1`, when that allocation should go away.
+    fn run( &mut self, end: u64 ) {
+        while let Some( &Reverse( (time, tag) ) ) = self.queue.peek() {
+            if time >= end || self.written >= self.quota {
+                break;
+            }
+
+            self.queue.pop();
+            if tag & 1 == 0 {
+                self.allocate( time, (tag >> 1) as usize );
+            } else {
+                self.expire( time, (tag >> 1) as usize );
+            }
+        }
+    }
+
+    fn sample( &mut self, distribution: Distribution ) -> f64 {
+        distribution.sample( &mut self.rng )
+    }
+
+    fn pick_backtrace( &mut self ) -> u64 {
+        let index = (self.options.backtrace_count as f64 * self.rng.uniform().powf( BACKTRACE_SKEW )) as u64;
+        min( index, self.options.backtrace_count - 1 ) + 1
+    }
+
+    fn reserve_heap( &mut self, size: u64 ) -> (u64, usize) {
+        let size_class = max( 64 - (size - 1).leading_zeros() as usize, 4 );
+        if let Some( pointer ) = self.free_pointers[ size_class ].pop() {
+            return (pointer, size_class);
+        }
+
+        // If we ever run out of the address space then just start reusing it.
+        if self.next_heap_pointer + (1 << size_class) > self.heap_range.1 {
+            self.next_heap_pointer = self.heap_range.0;
+        }
+
+        let pointer = self.next_heap_pointer;
+        self.next_heap_pointer += 1 << size_class;
+        (pointer, size_class)
+    }
+
+    fn reserve_mmap( &mut self, length: u64 ) -> u64 {
+        if self.next_mmap_pointer + length > self.mmap_range.1 {
+            self.next_mmap_pointer = self.mmap_range.0;
+        }
+
+        let pointer = self.next_mmap_pointer;
+        self.next_mmap_pointer += length;
+        pointer
+    }
+
+    fn push_live( &mut self, live: Live ) -> usize {
+        if let Some( index ) = self.unused_live.pop() {
+            self.live[ index ] = live;
+            index
+        } else {
+            self.live.push( live );
+            self.live.len() - 1
+        }
+    }
+
+    fn schedule_expiration( &mut self, time: u64, index: usize ) {
+        let lifetime = self.sample( self.options.lifetime ) as u64;
+        self.queue.push( Reverse( (time + max( lifetime, 1 ), (index as u64) << 1 | 1) ) );
+    }
+
+    fn allocate( &mut self, time: u64, thread_index: usize ) {
+        let interval = self.sample( self.options.allocation_interval ) as u64;
+        self.queue.push( Reverse( (time + max( interval, 1 ), (thread_index as u64) << 1) ) );
+
+        let backtrace = self.pick_backtrace();
+        let thread = self.threads[ thread_index ].id;
+        let timestamp = Timestamp::from_usecs( time );
+        if self.rng.uniform() <= self.options.mmap_probability {
+            let length = max( self.sample( self.options.mmap_size ) as u64, 1 );
+            let length = (length + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+            let pointer = self.reserve_mmap( length );
+            let map_id = self.next_map_id;
+            self.next_map_id += self.map_id_stride;
+
+            let source = RegionSource { timestamp, backtrace, thread };
+            self.write( Event::MemoryMapEx {
+                map_id,
+                address: pointer,
+                requested_address: 0,
+                requested_length: length,
+                mmap_protection: 0x1 | 0x2,
+                // MAP_PRIVATE | MAP_ANONYMOUS
+                mmap_flags: 0x02 | 0x20,
+                file_descriptor: !0,
+                offset: 0,
+                source: source.clone()
+            });
+
+            self.write( Event::AddRegion {
+                timestamp,
+                map_id,
+                address: pointer,
+                length,
+                file_offset: 0,
+                inode: 0,
+                major: 0,
+                minor: 0,
+                flags: RegionFlags::READABLE | RegionFlags::WRITABLE,
+                name: "".into()
+            });
+
+            // Pretend that some of it was touched.
+            let touched = (length / 1024) * self.rng.below( 101 ) / 100;
+            self.write( Event::UpdateRegionUsage {
+                timestamp,
+                map_id,
+                address: pointer,
+                length,
+                anonymous: touched,
+                shared_clean: 0,
+                shared_dirty: 0,
+                private_clean: 0,
+                private_dirty: touched,
+                swap: 0
+            });
+
+            if self.rng.uniform() > self.options.leak_probability {
+                let index = self.push_live( Live {
+                    kind: LiveKind::Mmap { map_id },
+                    pointer,
+                    size: length,
+                    backtrace,
+                    thread
+                });
+
+                self.schedule_expiration( time, index );
+            }
+
+            return;
+        }
+
+        let size = max( self.sample( self.options.allocation_size ) as u64, 1 );
+        let (pointer, size_class) = self.reserve_heap( size );
+        let state = &mut self.threads[ thread_index ];
+        state.allocation_counter += 1;
+        let id = AllocationId { thread: thread as u64, allocation: state.allocation_counter };
+
+        self.write( Event::AllocEx {
+            id,
+            timestamp,
+            allocation: AllocBody {
+                pointer,
+                size,
+                backtrace,
+                thread,
+                flags: 0,
+                extra_usable_space: 0,
+                preceding_free_space: 0
+            }
+        });
+
+        if self.rng.uniform() > self.options.leak_probability {
+            let index = self.push_live( Live {
+                kind: LiveKind::Heap { id, size_class },
+                pointer,
+                size,
+                backtrace,
+                thread
+            });
+
+            self.schedule_expiration( time, index );
+        }
+    }
+
+    fn expire( &mut self, time: u64, index: usize ) {
+        let timestamp = Timestamp::from_usecs( time );
+        let live = &self.live[ index ];
+        match live.kind {
+            LiveKind::Heap { id, size_class } => {
+                let (pointer, size, thread) = (live.pointer, live.size, live.thread);
+                self.free_pointers[ size_class ].push( pointer );
+
+                if self.rng.uniform() <= self.options.realloc_probability {
+                    // Most chains of reallocations are made by growing something.
+                    let new_size = size + max( self.sample( self.options.allocation_size ) as u64, 1 );
+                    let (new_pointer, new_size_class) = self.reserve_heap( new_size );
+                    let backtrace = self.pick_backtrace();
+                    self.write( Event::ReallocEx {
+                        id,
+                        timestamp,
+                        old_pointer: pointer,
+                        allocation: AllocBody {
+                            pointer: new_pointer,
+                            size: new_size,
+                            backtrace,
+                            thread,
+                            flags: 0,
+                            extra_usable_space: 0,
+                            preceding_free_space: 0
+                        }
+                    });
+
+                    let live = &mut self.live[ index ];
+                    live.kind = LiveKind::Heap { id, size_class: new_size_class };
+                    live.pointer = new_pointer;
+                    live.size = new_size;
+                    live.backtrace = backtrace;
+                    self.schedule_expiration( time, index );
+                    return;
+                }
+
+                self.write( Event::FreeEx {
+                    id,
+                    timestamp,
+                    pointer,
+                    backtrace: 0,
+                    thread
+                });
+            },
+            LiveKind::Mmap { map_id } => {
+                let (address, length) = (live.pointer, live.size);
+                let source = RegionTargetedSource {
+                    address,
+                    length,
+                    source: RegionSource {
+                        timestamp,
+                        backtrace: live.backtrace,
+                        thread: live.thread
+                    }
+                };
+
+                self.write( Event::RemoveRegion {
+                    timestamp,
+                    map_id,
+                    address,
+                    length,
+                    sources: Cow::Owned( vec![ source ] )
+                });
+            }
+        }
+
+        self.unused_live.push( index );
+    }
+
+    fn write( &mut self, event: Event ) {
+        event.write_to_stream( &mut self.buffer ).unwrap();
+        self.written += 1;
+    }
+}
+
+fn write_backtraces( options: &GenerateOptions, fp: &mut impl Write ) -> io::Result< () > {
+    let mut rng = Rng::new( options.seed );
+
+    // These are kept with the outermost frame first.
+    let mut parents: Vec< Vec< u64 > > = Vec::with_capacity( PARENT_BACKTRACE_COUNT );
+    let mut addresses = Vec::new();
+    for id in 1..=options.backtrace_count {
+        let depth = max( options.backtrace_depth.sample( &mut rng ) as usize, 1 );
+        let mut frames = Vec::with_capacity( depth );
+        if !parents.is_empty() && depth > 1 && rng.uniform() <= SHARED_PREFIX_PROBABILITY {
+            let parent = &parents[ rng.below( parents.len() as u64 ) as usize ];
+            let shared = 1 + rng.below( min( parent.len(), depth - 1 ) as u64 ) as usize;
+            frames.extend_from_slice( &parent[ ..shared ] );
+        }
+
+        while frames.len() < depth {
+            frames.push( 0x400000 + rng.below( FUNCTION_COUNT ) * 16 );
+        }
+
+        addresses.clear();
+        addresses.extend( frames.iter().rev().copied() );
+        Event::Backtrace { id, addresses: Cow::Borrowed( &addresses ) }.write_to_stream( &mut *fp )?;
+
+        if parents.len() < PARENT_BACKTRACE_COUNT {
+            parents.push( frames );
+        } else {
+            parents[ (id as usize) % PARENT_BACKTRACE_COUNT ] = frames;
+        }
+    }
+
+    Ok(())
+}
+
+fn generate_into( options: &GenerateOptions, fp: &mut impl Write ) -> io::Result< u64 > {
+    Event::Header( HeaderBody {
+        id: DataId::new( options.seed, options.event_count ),
+        initial_timestamp: Timestamp::min(),
+        timestamp: Timestamp::min(),
+        wall_clock_secs: 1_600_000_000,
+        wall_clock_nsecs: 0,
+        pid: 1,
+        cmdline: b"bytehound-generate\0".to_vec(),
+        executable: b"/bytehound-generate".to_vec(),
+        arch: "x86_64".into(),
+        flags: HEADER_FLAG_IS_LITTLE_ENDIAN,
+        pointer_size: 8
+    }).write_to_stream( &mut *fp )?;
+
+    write_backtraces( options, fp )?;
+
+    let mut written = 1 + options.backtrace_count;
+    let remaining = options.event_count.saturating_sub( written );
+    let worker_count = min( options.thread_count as usize, rayon::current_num_threads() );
+    let mut workers: Vec< _ > = (0..worker_count).map( |index| {
+        let quota = remaining / worker_count as u64 + if (index as u64) < remaining % worker_count as u64 { 1 } else { 0 };
+        Worker::new( options, index, worker_count, quota )
+    }).collect();
+
+    // Every allocation is eventually followed by either a free or a reallocation.
+    let events_per_usec = options.thread_count as f64 * 2.0 / options.allocation_interval.mean();
+    let slice_length = if events_per_usec.is_finite() && events_per_usec > 0.0 {
+        max( (EVENTS_PER_SLICE / events_per_usec) as u64, 1 )
+    } else {
+        1000
+    };
+
+    let mut end = 0;
+    let mut last_report = 0;
+    while workers.iter().any( |worker| !worker.is_done() ) {
+        end += slice_length;
+        workers.par_iter_mut().for_each( |worker| worker.run( end ) );
+        for worker in &mut workers {
+            fp.write_all( &worker.buffer )?;
+            worker.buffer.clear();
+        }
+
+        written = 1 + options.backtrace_count + workers.iter().map( |worker| worker.written ).sum::< u64 >();
+        if written - last_report >= options.event_count / 10 {
+            last_report = written;
+            info!( "Generated {}% of the events...", written * 100 / max( options.event_count, 1 ) );
+        }
+    }
+
+    Ok( written )
+}
+
+/// Generates a synthetic data file; returns how many events were written.
+pub fn generate( options: &GenerateOptions, fp: impl Write + Send + 'static ) -> io::Result< u64 > {
+    if options.thread_count == 0 || options.backtrace_count == 0 {
+        return Err( io::Error::new( io::ErrorKind::InvalidInput, "at least one thread and one backtrace is required" ) );
+    }
+
+    let start = Instant::now();
+    let written = if options.compress {
+        let thread_count = std::thread::available_parallelism().map( |count| count.get() ).unwrap_or( 1 );
+        let mut fp = Lz4Writer::with_thread_count( fp, thread_count );
+        let written = generate_into( options, &mut fp )?;
+        fp.finish()?;
+        written
+    } else {
+        let mut fp = common::lz4_stream::Lz4Writer::new( fp );
+        fp.disable_compression()?;
+        let written = generate_into( options, &mut fp )?;
+        fp.into_inner()?;
+        written
+    };
+
+    let elapsed = start.elapsed().as_secs_f64();
+    info!( "Generated {} events in {:.2}s ({:.0} events/s)", written, elapsed, written as f64 / elapsed );
+
+    Ok( written )
+}
+
+#[test]
+fn test_parse_distribution() {
+    assert_eq!( "constant:5".parse(), Ok( Distribution::Constant( 5.0 ) ) );
+    assert_eq!( "uniform:1:2.5".parse(), Ok( Distribution::Uniform( 1.0, 2.5 ) ) );
+    assert_eq!( "exponential:10".parse(), Ok( Distribution::Exponential( 10.0 ) ) );
+    assert_eq!( "lognormal:64:1.5".parse(), Ok( Distribution::LogNormal( 64.0, 1.5 ) ) );
+    assert_eq!( "pareto:1:0.5".parse(), Ok( Distribution::Pareto( 1.0, 0.5 ) ) );
+    assert!( "uniform:2:1".parse::< Distribution >().is_err() );
+    assert!( "exponential".parse::< Distribution >().is_err() );
+    assert!( "exponential:x".parse::< Distribution >().is_err() );
+    assert!( "normal:1".parse::< Distribution >().is_err() );
+
+    let distribution = Distribution::LogNormal( 64.0, 1.5 );
+    assert_eq!( distribution.to_string().parse(), Ok( distribution ) );
+}
+
+#[test]
+fn test_generate() {
+    let options = GenerateOptions {
+        event_count: 20_000,
+        thread_count: 4,
+        backtrace_count: 100,
+        mmap_probability: 0.05,
+        ..GenerateOptions::default()
+    };
+
+    let mut fp = common::lz4_stream::Lz4Writer::new( Vec::new() );
+    let written = generate_into( &options, &mut fp ).unwrap();
+    assert!( written >= options.event_count );
+
+    let (_, events) = crate::parse_events( io::Cursor::new( fp.into_inner().unwrap() ) ).unwrap();
+    let mut counts = [0; 4];
+    for event in events {
+        match event.unwrap() {
+            Event::Backtrace { .. } => counts[ 0 ] += 1,
+            Event::AllocEx { .. } => counts[ 1 ] += 1,
+            Event::FreeEx { .. } | Event::ReallocEx { .. } => counts[ 2 ] += 1,
+            Event::MemoryMapEx { .. } => counts[ 3 ] += 1,
+            _ => {}
+        }
+    }
+
+    assert_eq!( counts[ 0 ], 100 );
+    assert!( counts[ 1 ] > 0 );
+    assert!( counts[ 2 ] > 0 );
+    assert!( counts[ 3 ] > 0 );
+}
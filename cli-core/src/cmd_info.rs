@@ -0,0 +1,91 @@
+use std::io::{self, Read};
+
+use ahash::AHashSet as HashSet;
+use common::event::{Event, HeaderBody};
+use common::Timestamp;
+
+use crate::reader::scan_events;
+
+#[derive(Default)]
+struct Summary {
+    header: Option< HeaderBody >,
+    last_timestamp: Option< Timestamp >,
+    event_count: u64,
+    total_size: u64,
+    allocation_count: u64,
+    reallocation_count: u64,
+    deallocation_count: u64,
+    backtrace_count: u64,
+    file_count: u64,
+    memory_dump_count: u64,
+    threads: HashSet< u32 >
+}
+
+impl Summary {
+    fn add( &mut self, event: &Event, size: usize ) {
+        self.event_count += 1;
+        self.total_size += size as u64;
+        if let Some( timestamp ) = event.timestamp() {
+            self.last_timestamp = Some( self.last_timestamp.map( |last| std::cmp::max( last, timestamp ) ).unwrap_or( timestamp ) );
+        }
+
+        match *event {
+            Event::Header( ref header ) => {
+                self.header = Some( header.clone() );
+            },
+            Event::Alloc { ref allocation, .. } | Event::AllocEx { ref allocation, .. } => {
+                self.allocation_count += 1;
+                self.threads.insert( allocation.thread );
+            },
+            Event::Realloc { ref allocation, .. } | Event::ReallocEx { ref allocation, .. } => {
+                self.reallocation_count += 1;
+                self.threads.insert( allocation.thread );
+            },
+            Event::Free { thread, .. } | Event::FreeEx { thread, .. } => {
+                self.deallocation_count += 1;
+                self.threads.insert( thread );
+            },
+            Event::Backtrace { .. } |
+            Event::Backtrace32 { .. } |
+            Event::PartialBacktrace { .. } |
+            Event::PartialBacktrace32 { .. } => {
+                self.backtrace_count += 1;
+            },
+            Event::File { .. } | Event::File64 { .. } => {
+                self.file_count += 1;
+            },
+            Event::MemoryDumpStarted { .. } => {
+                self.memory_dump_count += 1;
+            },
+            Event::ThreadStarted { thread, .. } => {
+                self.threads.insert( thread );
+            },
+            _ => {}
+        }
+    }
+}
+
+/// Prints a quick summary of the data without loading it.
+pub fn info( fp: impl Read + Send + 'static ) -> Result< (), io::Error > {
+    let mut summary = Summary::default();
+    scan_events( fp, |event, size| summary.add( event, size ) )?;
+
+    let header = summary.header.unwrap();
+    let duration = summary.last_timestamp.map( |last| last.as_usecs().saturating_sub( header.initial_timestamp.as_usecs() ) ).unwrap_or( 0 );
+
+    println!( "Executable: {}", String::from_utf8_lossy( &header.executable ) );
+    println!( "Command line: {}", String::from_utf8_lossy( &header.cmdline ).replace( '\0', " " ).trim_end() );
+    println!( "PID: {}", header.pid );
+    println!( "Architecture: {}", header.arch );
+    println!( "Duration: {:.3}s", duration as f64 / 1_000_000.0 );
+    println!( "Events: {} ({}MB uncompressed)", summary.event_count, summary.total_size / (1024 * 1024) );
+    println!( "  Allocations: {}", summary.allocation_count );
+    println!( "  Reallocations: {}", summary.reallocation_count );
+    println!( "  Deallocations: {}", summary.deallocation_count );
+    println!( "  Backtraces: {}", summary.backtrace_count );
+    println!( "  Files: {}", summary.file_count );
+    println!( "  Memory dumps: {}", summary.memory_dump_count );
+    println!( "Threads: {}", summary.threads.len() );
+
+    Ok(())
+}
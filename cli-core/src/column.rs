@@ -0,0 +1,190 @@
+use std::fs::File;
+use std::io;
+use std::iter::FromIterator;
+use std::mem;
+use std::ops::Deref;
+use std::os::unix::io::AsRawFd;
+use std::ptr;
+use std::slice;
+use std::sync::Arc;
+
+/// A whole file mapped read-only into memory.
+///
+/// Since the mapping is private and never written to the kernel is free to drop
+/// its pages at any time and fault them back in from the file when necessary.
+pub struct Mapping {
+    pointer: *mut u8,
+    length: usize
+}
+
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    pub fn new( fp: &File ) -> io::Result< Self > {
+        let length = fp.metadata()?.len() as usize;
+        if length == 0 {
+            return Err( io::Error::new( io::ErrorKind::InvalidData, "cannot map an empty file" ) );
+        }
+
+        let pointer = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                length,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                fp.as_raw_fd(),
+                0
+            )
+        };
+
+        if pointer == libc::MAP_FAILED {
+            return Err( io::Error::last_os_error() );
+        }
+
+        Ok( Mapping {
+            pointer: pointer as *mut u8,
+            length
+        })
+    }
+
+    pub fn as_slice( &self ) -> &[u8] {
+        unsafe {
+            slice::from_raw_parts( self.pointer, self.length )
+        }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop( &mut self ) {
+        unsafe {
+            libc::munmap( self.pointer as *mut libc::c_void, self.length );
+        }
+    }
+}
+
+enum Storage< T > {
+    Owned( Vec< T > ),
+    Mapped {
+        _mapping: Arc< Mapping >,
+        pointer: *const T,
+        length: usize
+    }
+}
+
+/// An immutable array which is either owned or is a view into a `Mapping`.
+pub struct Column< T > {
+    storage: Storage< T >
+}
+
+unsafe impl< T: Send + Sync > Send for Column< T > {}
+unsafe impl< T: Send + Sync > Sync for Column< T > {}
+
+impl< T > Column< T > {
+    /// Creates a view of `length` elements starting at the given byte `offset` of the `mapping`.
+    ///
+    /// Panics if the elements are out of bounds or aren't properly aligned.
+    ///
+    /// # Safety
+    ///
+    /// The bytes in the `mapping` must be a valid representation of `length` elements of type `T`.
+    pub unsafe fn from_mapping( mapping: Arc< Mapping >, offset: usize, length: usize ) -> Self {
+        let size = length.checked_mul( mem::size_of::< T >() ).unwrap();
+        assert!( offset.checked_add( size ).unwrap() <= mapping.length );
+
+        let pointer = mapping.pointer.add( offset ) as *const T;
+        assert_eq!( pointer as usize % mem::align_of::< T >(), 0 );
+
+        Column {
+            storage: Storage::Mapped {
+                _mapping: mapping,
+                pointer,
+                length
+            }
+        }
+    }
+
+    pub fn is_mapped( &self ) -> bool {
+        match self.storage {
+            Storage::Owned( _ ) => false,
+            Storage::Mapped { .. } => true
+        }
+    }
+
+    /// Gives mutable access to the elements, copying them out of the mapping first if necessary.
+    pub fn to_mut( &mut self ) -> &mut Vec< T > where T: Clone {
+        if self.is_mapped() {
+            self.storage = Storage::Owned( self.to_vec() );
+        }
+
+        match self.storage {
+            Storage::Owned( ref mut vec ) => vec,
+            Storage::Mapped { .. } => unreachable!()
+        }
+    }
+
+    pub fn shrink_to_fit( &mut self ) {
+        if let Storage::Owned( ref mut vec ) = self.storage {
+            vec.shrink_to_fit();
+        }
+    }
+}
+
+impl< T > Deref for Column< T > {
+    type Target = [T];
+
+    #[inline]
+    fn deref( &self ) -> &Self::Target {
+        match self.storage {
+            Storage::Owned( ref vec ) => vec,
+            Storage::Mapped { pointer, length, .. } => unsafe { slice::from_raw_parts( pointer, length ) }
+        }
+    }
+}
+
+impl< T > Default for Column< T > {
+    fn default() -> Self {
+        Column {
+            storage: Storage::Owned( Vec::new() )
+        }
+    }
+}
+
+impl< T > From< Vec< T > > for Column< T > {
+    fn from( vec: Vec< T > ) -> Self {
+        Column {
+            storage: Storage::Owned( vec )
+        }
+    }
+}
+
+impl< T > FromIterator< T > for Column< T > {
+    fn from_iter< I: IntoIterator< Item = T > >( iter: I ) -> Self {
+        Vec::from_iter( iter ).into()
+    }
+}
+
+#[test]
+fn test_mapped_column() {
+    use std::io::Write;
+
+    let path = std::env::temp_dir().join( format!( "bytehound-test-mapped-column-{}", std::process::id() ) );
+    let mut fp = File::create( &path ).unwrap();
+    for value in 0..1000_u64 {
+        fp.write_all( &value.to_ne_bytes() ).unwrap();
+    }
+    drop( fp );
+
+    let fp = File::open( &path ).unwrap();
+    let mapping = Arc::new( Mapping::new( &fp ).unwrap() );
+    let _ = std::fs::remove_file( &path );
+
+    let mut column: Column< u64 > = unsafe { Column::from_mapping( mapping, 8 * 10, 20 ) };
+    assert!( column.is_mapped() );
+    assert_eq!( &column[..], &(10..30).collect::< Vec< _ > >()[..] );
+
+    column.to_mut().push( 1234 );
+    assert!( !column.is_mapped() );
+    assert_eq!( column.len(), 21 );
+    assert_eq!( column[ 20 ], 1234 );
+}
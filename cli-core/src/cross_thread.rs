@@ -0,0 +1,161 @@
+//! Accounting of the allocations which were deallocated on a different thread than the one which made them.
+//!
+//! Handing memory over to another thread to free it is what the slow remote deallocation paths of most
+//! of the allocators with thread caches are there for, so the backtraces which do it a lot are the
+//! ones which could benefit the most from a thread-local pool. For every such backtrace the frees
+//! are broken down into a matrix of the allocating threads versus the deallocating threads, along
+//! with how long the allocations lived before they were handed over and freed.
+
+use std::cmp;
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+
+use crate::{Allocation, AllocationId, BacktraceId, Data, ThreadId, Timestamp};
+
+/// The allocations from a single backtrace which one thread made and another one deallocated.
+#[derive(Clone, Debug)]
+pub struct ThreadHandoff {
+    pub allocating_thread: ThreadId,
+    pub deallocating_thread: ThreadId,
+    pub count: u64,
+    pub size: u64,
+    /// The sum of the lifetimes of the allocations.
+    pub total_latency: Timestamp,
+    pub max_latency: Timestamp
+}
+
+impl ThreadHandoff {
+    pub fn mean_latency( &self ) -> Timestamp {
+        Timestamp::from_usecs( self.total_latency.as_usecs() / cmp::max( self.count, 1 ) )
+    }
+}
+
+#[derive(Clone, Debug)]
+pub struct CrossThreadFrees {
+    pub backtrace: BacktraceId,
+    /// How many of the given allocations from this backtrace were deallocated, on any thread.
+    pub freed_count: u64,
+    /// How many of those were deallocated on a different thread, and their total size.
+    pub count: u64,
+    pub size: u64,
+    /// The median and the highest lifetime of the allocations which were deallocated on a different thread.
+    pub latency_p50: Timestamp,
+    pub max_latency: Timestamp,
+    /// The most frequent pairs of threads first.
+    pub handoffs: Vec< ThreadHandoff >
+}
+
+impl CrossThreadFrees {
+    /// Which fraction of the deallocations happened on a different thread.
+    pub fn ratio( &self ) -> f64 {
+        self.count as f64 / cmp::max( self.freed_count, 1 ) as f64
+    }
+}
+
+/// Returns whether the allocation was deallocated on a different thread than the one which made it,
+/// and if so how long it lived.
+#[inline]
+pub fn cross_thread_latency( allocation: &Allocation ) -> Option< Timestamp > {
+    let deallocation = allocation.deallocation.as_ref()?;
+    if deallocation.thread == allocation.thread {
+        return None;
+    }
+
+    Some( deallocation.timestamp - allocation.timestamp )
+}
+
+struct Entry {
+    backtrace: BacktraceId,
+    allocating_thread: ThreadId,
+    deallocating_thread: ThreadId,
+    size: u64,
+    latency: Timestamp
+}
+
+/// Finds the backtraces from which the given allocations were deallocated on a different thread,
+/// with the backtraces which did that the most first.
+pub fn find_cross_thread_frees( data: &Data, ids: &[AllocationId] ) -> Vec< CrossThreadFrees > {
+    let mut entries: Vec< Entry > = ids.par_iter().filter_map( |&id| {
+        let allocation = data.get_allocation( id );
+        let latency = cross_thread_latency( allocation )?;
+        Some( Entry {
+            backtrace: allocation.backtrace,
+            allocating_thread: allocation.thread,
+            deallocating_thread: allocation.deallocation.as_ref()?.thread,
+            size: allocation.usable_size(),
+            latency
+        })
+    }).collect();
+
+    let freed_count_by_backtrace = ids.par_iter()
+        .fold( HashMap::new, |mut counts, &id| {
+            let allocation = data.get_allocation( id );
+            if allocation.deallocation.is_some() {
+                *counts.entry( allocation.backtrace ).or_insert( 0 ) += 1;
+            }
+            counts
+        })
+        .reduce( HashMap::new, |mut lhs, rhs| {
+            for (backtrace, count) in rhs {
+                *lhs.entry( backtrace ).or_insert( 0 ) += count;
+            }
+            lhs
+        });
+
+    entries.par_sort_unstable_by_key( |entry| (entry.backtrace, entry.allocating_thread, entry.deallocating_thread) );
+
+    let mut ranges = Vec::new();
+    let mut offset = 0;
+    for index in 1..=entries.len() {
+        if index == entries.len() || entries[ index ].backtrace != entries[ offset ].backtrace {
+            ranges.push( offset..index );
+            offset = index;
+        }
+    }
+
+    let entries = &entries;
+    let freed_count_by_backtrace = &freed_count_by_backtrace;
+    let mut output: Vec< _ > = ranges.into_par_iter().map( |range| {
+        let group = &entries[ range ];
+        let mut handoffs: Vec< ThreadHandoff > = Vec::new();
+        for entry in group {
+            match handoffs.last_mut() {
+                Some( last ) if last.allocating_thread == entry.allocating_thread && last.deallocating_thread == entry.deallocating_thread => {
+                    last.count += 1;
+                    last.size += entry.size;
+                    last.total_latency = last.total_latency + entry.latency;
+                    last.max_latency = cmp::max( last.max_latency, entry.latency );
+                },
+                _ => handoffs.push( ThreadHandoff {
+                    allocating_thread: entry.allocating_thread,
+                    deallocating_thread: entry.deallocating_thread,
+                    count: 1,
+                    size: entry.size,
+                    total_latency: entry.latency,
+                    max_latency: entry.latency
+                })
+            }
+        }
+
+        handoffs.sort_by( |lhs, rhs| rhs.count.cmp( &lhs.count ).then( rhs.size.cmp( &lhs.size ) ) );
+
+        let mut latencies: Vec< Timestamp > = group.iter().map( |entry| entry.latency ).collect();
+        let middle = latencies.len() / 2;
+        let latency_p50 = *latencies.select_nth_unstable( middle ).1;
+
+        let backtrace = group[ 0 ].backtrace;
+        CrossThreadFrees {
+            backtrace,
+            freed_count: freed_count_by_backtrace.get( &backtrace ).copied().unwrap_or( 0 ),
+            count: group.len() as u64,
+            size: group.iter().map( |entry| entry.size ).sum(),
+            latency_p50,
+            max_latency: handoffs.iter().map( |handoff| handoff.max_latency ).max().unwrap(),
+            handoffs
+        }
+    }).collect();
+
+    output.par_sort_unstable_by( |lhs, rhs| rhs.count.cmp( &lhs.count ).then( rhs.size.cmp( &lhs.size ) ).then( lhs.backtrace.cmp( &rhs.backtrace ) ) );
+    output
+}
@@ -1,40 +1,58 @@
 use std::fmt;
+use std::mem;
 use std::ops::Range;
 use std::num::{NonZeroU32, NonZeroU64};
-use std::cmp::Ordering;
+use std::cmp::{self, Ordering};
 use std::borrow::{Borrow, Cow};
 use std::iter::FusedIterator;
 use std::collections::BTreeMap;
+use std::sync::Arc;
 
 use ahash::AHashMap as HashMap;
-use string_interner;
-
-use crate::tree::Tree;
+use once_cell::sync::OnceCell;
+use rayon::prelude::*;
+use regex::Regex;
+
+use crate::column::Column;
+use crate::backtrace_trie::BacktraceTrie;
+use crate::bitmap::Bitmap;
+use crate::filter::SelectionCache;
+use crate::tree::{CallTreeCache, Tree};
 use crate::tree_printer::dump_tree;
 use crate::frame::Frame;
-use crate::vecvec::DenseVecVec;
+use crate::lifetime_sketch::LifetimeSketch;
+use crate::live_index::{LiveIndex, LiveUsage};
+use crate::address_tiles::{AddressTiles, AddressTilesCache};
+use crate::sort::sort_ids_by_key;
+use crate::vecvec::{DenseVecVec, VecVec};
 use crate::util::{ReadableSize, table_to_string};
 
 pub use common::{Timestamp};
 pub use common::event::DataId;
 pub use common::event::RegionFlags;
+pub use common::event::HugePageFlags;
+use common::event::ProfilerHistogram;
+pub use common::event::BacktraceCacheLevelStatistics;
+pub use common::event::{JemallocArenaStats, JemallocBinStats};
+pub use common::event::RuntimeOption;
+pub use common::event::AllocatorCall;
 
-pub type StringInterner = string_interner::StringInterner< StringId >;
+pub use crate::interner::StringInterner;
 
 #[derive(Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash, Debug)]
 #[repr(transparent)]
 pub struct StringId( NonZeroU32 );
 
-impl string_interner::Symbol for StringId {
+impl StringId {
     #[inline]
-    fn from_usize( value: usize ) -> Self {
+    pub fn from_usize( value: usize ) -> Self {
         unsafe {
             StringId( NonZeroU32::new_unchecked( (value + 1) as u32 ) )
         }
     }
 
     #[inline]
-    fn to_usize( self ) -> usize {
+    pub fn to_usize( self ) -> usize {
         self.0.get() as usize - 1
     }
 }
@@ -97,6 +115,16 @@ impl OperationId {
     pub fn id( &self ) -> AllocationId {
         AllocationId::new( self.0 & !(3 << 62) )
     }
+
+    #[inline]
+    pub(crate) fn raw( &self ) -> u64 {
+        self.0
+    }
+
+    #[inline]
+    pub(crate) fn from_raw( raw: u64 ) -> Self {
+        OperationId( raw )
+    }
 }
 
 #[test]
@@ -121,8 +149,26 @@ fn test_operation_id() {
     assert_eq!( id.id(), max );
 }
 
+/// Which of the frames' strings a regex is matched against.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum FrameField {
+    /// The demangled function, or the raw one if it couldn't be demangled.
+    Function,
+    Source
+}
+
+impl FrameField {
+    fn get( self, frame: &Frame ) -> Option< StringId > {
+        match self {
+            FrameField::Function => frame.function().or_else( || frame.raw_function() ),
+            FrameField::Source => frame.source()
+        }
+    }
+}
+
 pub struct Data {
     pub(crate) id: DataId,
+    pub(crate) parent_id: Option< DataId >,
     pub(crate) initial_timestamp: Timestamp,
     pub(crate) last_timestamp: Timestamp,
     pub(crate) executable: String,
@@ -130,25 +176,58 @@ pub struct Data {
     pub(crate) architecture: String,
     pub(crate) pointer_size: u64,
     pub(crate) interner: StringInterner,
-    pub(crate) operations: Vec< OperationId >,
+    pub(crate) operations: Column< OperationId >,
     pub(crate) allocations: Vec< Allocation >,
-    pub(crate) sorted_by_timestamp: Vec< AllocationId >,
-    pub(crate) sorted_by_address: Vec< AllocationId >,
-    pub(crate) sorted_by_size: Vec< AllocationId >,
+    pub(crate) allocation_columns: AllocationColumns,
+    pub(crate) sorted_by_timestamp: Column< AllocationId >,
+    pub(crate) sorted_by_address: OnceCell< Column< AllocationId > >,
+    pub(crate) sorted_by_size: OnceCell< Column< AllocationId > >,
     pub(crate) frames: Vec< Frame >,
     pub(crate) backtraces: Vec< BacktraceStorageRef >,
-    pub(crate) backtraces_storage: Vec< FrameId >,
+    pub(crate) backtraces_storage: Column< FrameId >,
     pub(crate) allocations_by_backtrace: DenseVecVec< AllocationId >,
+    pub(crate) backtraces_by_frame: OnceCell< DenseVecVec< BacktraceId > >,
+    pub(crate) backtrace_trie: OnceCell< BacktraceTrie >,
+    pub(crate) live_index: OnceCell< LiveIndex >,
     pub(crate) total_allocated: u64,
     pub(crate) total_allocated_count: u64,
     pub(crate) total_freed: u64,
     pub(crate) total_freed_count: u64,
     pub(crate) mallopts: Vec< Mallopt >,
+    pub(crate) memory_advices: Vec< MemoryAdvice >,
+    pub(crate) residency_samples: Vec< ResidencySample >,
+    /// Sorted by the first allocation.
+    pub(crate) culled_allocations: Vec< CulledAllocations >,
+    /// Sorted by the backtrace and the call.
+    pub(crate) allocator_latencies: Vec< AllocatorLatencies >,
+    /// Sorted by their timestamp.
+    pub(crate) page_faults: Vec< PageFault >,
+    pub(crate) page_fault_period: u64,
+    pub(crate) jemalloc_snapshots: Vec< JemallocSnapshot >,
+    /// Sorted by their timestamp.
+    pub(crate) cgroup_samples: Vec< CgroupSample >,
+    /// Sorted by their timestamp.
+    pub(crate) memory_dumps: Vec< MemoryDump >,
+    /// Sorted by their timestamp.
+    pub(crate) option_changes: Vec< OptionChange >,
+    /// Sorted by their ID.
+    pub(crate) pools: Vec< Pool >,
+    /// Sorted by their ID.
+    pub(crate) threads: Vec< Thread >,
     pub(crate) maximum_backtrace_depth: u32,
     pub(crate) group_stats: Vec< GroupStatistics >,
-    pub(crate) chains: HashMap< AllocationId, AllocationChain >,
+    pub(crate) profiler_bytes_written: u64,
+    /// The profiler's own statistics, if it was running with `MEMORY_PROFILER_INSTRUMENTATION`.
+    pub(crate) profiler_histograms: Vec< ProfilerHistogram >,
+    /// The latest counters of the profiler's backtrace caches, from the 1st level up.
+    pub(crate) backtrace_cache_statistics: Vec< BacktraceCacheLevelStatistics >,
+    /// Sorted by the first allocation.
+    pub(crate) chains: Vec< AllocationChain >,
     pub(crate) maps: Vec< Map >,
     pub(crate) map_ids: Vec< MapId >,
+    pub(crate) selection_cache: SelectionCache,
+    pub(crate) address_tiles_cache: AddressTilesCache,
+    pub(crate) call_tree_cache: CallTreeCache,
 }
 
 pub type DataPointer = u64;
@@ -215,10 +294,12 @@ pub enum SourceKey {
 }
 
 bitflags! {
+    #[repr(transparent)]
     pub struct AllocationFlags: u8 {
         const IS_PREV_IN_USE    = 1 << 0;
         const IS_MMAPED         = 1 << 1;
         const IN_NON_MAIN_ARENA = 1 << 2;
+        const IS_SAMPLED        = 1 << 3;
         const IS_JEMALLOC       = 1 << 5;
         const IS_SHARED_PTR     = 1 << 6;
         const IS_CALLOC         = 1 << 7;
@@ -247,6 +328,57 @@ pub struct Allocation {
     pub flags: AllocationFlags,
     pub extra_usable_space: u32,
     pub marker: u32,
+    /// The tag which the allocating thread had set through `memory_profiler_set_thread_tag`; `0` if none.
+    pub thread_tag: u32,
+    /// The custom pool allocator which reported this allocation, if any; see `Pool`.
+    pub pool: Option< u16 >,
+    /// The NUMA node of the CPU on which the allocating thread was running, if known.
+    pub thread_numa_node: Option< u8 >,
+    /// The NUMA node on which the first page of the allocation ended up, if known.
+    pub memory_numa_node: Option< u8 >,
+    /// How many allocations this one statistically represents; always `1.0` unless the data was sampled.
+    ///
+    /// The `size` and `extra_usable_space` are already scaled by this.
+    pub sample_weight: f32,
+}
+
+/// Dense copies of the fields of the allocations which the filters look at the most.
+///
+/// Going through these is a lot more cache friendly than going through the full `Allocation`s.
+#[derive(Default)]
+pub struct AllocationColumns {
+    pub(crate) pointers: Column< DataPointer >,
+    pub(crate) sizes: Column< u64 >,
+    pub(crate) timestamps: Column< Timestamp >,
+    /// `Timestamp::max()` for the allocations which were never deallocated.
+    pub(crate) deallocation_timestamps: Column< Timestamp >,
+    pub(crate) backtraces: Column< BacktraceId >,
+    pub(crate) flags: Column< AllocationFlags >
+}
+
+impl AllocationColumns {
+    pub(crate) fn new( allocations: &[Allocation] ) -> Self {
+        AllocationColumns {
+            pointers: allocations.iter().map( |allocation| allocation.pointer ).collect(),
+            sizes: allocations.iter().map( |allocation| allocation.size ).collect(),
+            timestamps: allocations.iter().map( |allocation| allocation.timestamp ).collect(),
+            deallocation_timestamps: allocations.iter().map( |allocation| {
+                allocation.deallocation.as_ref().map( |deallocation| deallocation.timestamp ).unwrap_or( Timestamp::max() )
+            }).collect(),
+            backtraces: allocations.iter().map( |allocation| allocation.backtrace ).collect(),
+            flags: allocations.iter().map( |allocation| allocation.flags ).collect()
+        }
+    }
+
+    #[inline]
+    pub(crate) fn deallocation_timestamp( &self, id: AllocationId ) -> Option< Timestamp > {
+        let timestamp = self.deallocation_timestamps[ id.raw() as usize ];
+        if timestamp == Timestamp::max() {
+            None
+        } else {
+            Some( timestamp )
+        }
+    }
 }
 
 #[derive(Debug)]
@@ -259,7 +391,14 @@ pub struct GroupStatistics {
     pub free_size: u64,
     pub min_size: u64,
     pub max_size: u64,
-    pub max_total_usage_first_seen_at: Timestamp
+    pub max_total_usage_first_seen_at: Timestamp,
+    /// The highest total amount of memory used by the group at the same time.
+    pub max_total_usage: u64,
+    /// The median and the 90th percentile of the lifetimes of the deallocated allocations.
+    pub lifetime_p50: Timestamp,
+    pub lifetime_p90: Timestamp,
+    /// The distribution of the lifetimes of the deallocated allocations, including the culled ones.
+    pub lifetimes: LifetimeSketch
 }
 
 impl Default for GroupStatistics {
@@ -273,7 +412,11 @@ impl Default for GroupStatistics {
             free_size: 0,
             min_size: -1_i64 as u64,
             max_size: 0,
-            max_total_usage_first_seen_at: Timestamp::min()
+            max_total_usage_first_seen_at: Timestamp::min(),
+            max_total_usage: 0,
+            lifetime_p50: Timestamp::min(),
+            lifetime_p90: Timestamp::min(),
+            lifetimes: LifetimeSketch::new()
         }
     }
 }
@@ -315,6 +458,9 @@ pub struct UsageDelta {
     pub private_clean: i64,
     pub private_dirty: i64,
     pub swap: i64,
+    pub anon_huge_pages: i64,
+    pub shmem_pmd_mapped: i64,
+    pub file_pmd_mapped: i64,
 }
 
 impl UsageDelta {
@@ -322,6 +468,11 @@ impl UsageDelta {
         self.shared_clean + self.shared_dirty + self.private_clean + self.private_dirty
     }
 
+    /// The part of the RSS which is backed by transparent huge pages.
+    pub fn huge_pages( &self ) -> i64 {
+        self.anon_huge_pages + self.shmem_pmd_mapped + self.file_pmd_mapped
+    }
+
     pub fn clean( &self ) -> i64 {
         self.shared_clean + self.private_clean
     }
@@ -342,12 +493,77 @@ pub struct MapUsage {
     pub private_clean: u64,
     pub private_dirty: u64,
     pub swap: u64,
+    pub anon_huge_pages: u64,
+    pub shmem_pmd_mapped: u64,
+    pub file_pmd_mapped: u64,
 }
 
 impl MapUsage {
     pub fn rss( &self ) -> u64 {
         self.shared_clean + self.shared_dirty + self.private_clean + self.private_dirty
     }
+
+    /// The part of the RSS which is backed by transparent huge pages.
+    pub fn huge_pages( &self ) -> u64 {
+        self.anon_huge_pages + self.shmem_pmd_mapped + self.file_pmd_mapped
+    }
+}
+
+/// How many points every map's sparkline has.
+pub const MAP_SPARKLINE_LENGTH: usize = 48;
+
+/// The map's usage downsampled over the whole run, in KiB, so that it can be drawn inline without
+/// going through its whole usage history.
+///
+/// Every point is the peak usage within its slice of time; it's empty if the usage was never read.
+#[derive(Clone, Default, Debug)]
+pub struct MapSparkline {
+    pub rss: Box< [u32] >,
+    pub dirty: Box< [u32] >,
+    pub swap: Box< [u32] >
+}
+
+impl MapSparkline {
+    pub fn build( usage_history: &[MapUsage], start: Timestamp, end: Timestamp ) -> Self {
+        if usage_history.is_empty() {
+            return Self::default();
+        }
+
+        let start = start.as_usecs();
+        let span = cmp::max( end.as_usecs().saturating_sub( start ), 1 ) as u128;
+        let point_at = |timestamp: Timestamp| {
+            let offset = timestamp.as_usecs().saturating_sub( start ) as u128;
+            cmp::min( (offset * MAP_SPARKLINE_LENGTH as u128 / span) as usize, MAP_SPARKLINE_LENGTH - 1 )
+        };
+
+        let kib = |bytes: u64| cmp::min( bytes / 1024, u32::MAX as u64 ) as u32;
+        let mut rss = vec![ 0; MAP_SPARKLINE_LENGTH ];
+        let mut dirty = vec![ 0; MAP_SPARKLINE_LENGTH ];
+        let mut swap = vec![ 0; MAP_SPARKLINE_LENGTH ];
+        for (index, usage) in usage_history.iter().enumerate() {
+            // Every reading stays in effect until the next one.
+            let first = point_at( usage.timestamp );
+            let last = usage_history.get( index + 1 ).map( |next| point_at( next.timestamp ) ).unwrap_or( MAP_SPARKLINE_LENGTH - 1 );
+            for point in first..=last {
+                rss[ point ] = cmp::max( rss[ point ], kib( usage.rss() ) );
+                dirty[ point ] = cmp::max( dirty[ point ], kib( usage.shared_dirty + usage.private_dirty ) );
+                swap[ point ] = cmp::max( swap[ point ], kib( usage.swap ) );
+            }
+        }
+
+        MapSparkline {
+            rss: rss.into(),
+            dirty: dirty.into(),
+            swap: swap.into()
+        }
+    }
+}
+
+/// Builds the sparklines of all of the maps, spanning the given time range.
+pub(crate) fn build_map_sparklines( maps: &mut [Map], start: Timestamp, end: Timestamp ) {
+    maps.par_iter_mut().for_each( |map| {
+        map.sparkline = MapSparkline::build( &map.usage_history, start, end );
+    });
 }
 
 #[derive(Debug)]
@@ -375,11 +591,23 @@ pub struct Map {
     // It contains the very last deallocation.
     pub deallocation: Option< MapDeallocation >,
     pub usage_history: Vec< MapUsage >,
+    pub sparkline: MapSparkline,
     pub pointer: DataPointer,
     pub size: u64,
     pub flags: RegionFlags,
     pub name: Box< str >,
     pub peak_rss: u64,
+    pub peak_huge_pages: u64,
+    /// The huge page advice which was ever seen on any of the map's regions.
+    pub huge_page_flags: HugePageFlags,
+    /// How many times `madvise` was called to give back some of the map's memory to the kernel.
+    pub purge_count: u64,
+    /// How many bytes of the map were given back to the kernel with `madvise`.
+    pub purged: u64,
+    /// How much of the RSS has dropped after the memory was given back.
+    pub reclaimed: u64,
+    /// How much of the reclaimed RSS was faulted back in afterwards.
+    pub refaulted: u64,
 }
 
 impl Map {
@@ -497,6 +725,296 @@ pub struct Mallopt {
     pub result: i32
 }
 
+/// A call to `madvise` which either changed the transparent huge page advice
+/// of a range of memory or which gave it back to the kernel.
+#[derive(Debug)]
+pub struct MemoryAdvice {
+    pub timestamp: Timestamp,
+    pub backtrace: BacktraceId,
+    pub thread: ThreadId,
+    pub address: u64,
+    pub length: u64,
+    pub advice: i32
+}
+
+/// The aggregated counters of the temporary allocations from a single backtrace
+/// which were culled, either by the profiler itself or when the data was squeezed.
+#[derive(Clone, Debug)]
+pub struct CulledAllocations {
+    pub backtrace: BacktraceId,
+    pub first_allocation: Timestamp,
+    pub last_allocation: Timestamp,
+    pub count: u64,
+    pub size: u64,
+    /// How many of the allocations lived for how long, bucketed by `common::event::culled_lifetime_bucket`;
+    /// empty when the profiler didn't record it.
+    pub lifetimes: Vec< u64 >
+}
+
+impl CulledAllocations {
+    /// Returns the lower and the upper bound, in microseconds, of the lifetimes in a given bucket of `lifetimes`.
+    pub fn lifetime_bucket_range( index: usize ) -> (u64, u64) {
+        if index == 0 {
+            (0, 1)
+        } else {
+            (1 << (index - 1), 1 << index)
+        }
+    }
+}
+
+/// How long the allocator took to service the sampled calls from a single backtrace, over the whole run.
+#[derive(Clone, Debug)]
+pub struct AllocatorLatencies {
+    pub backtrace: BacktraceId,
+    pub call: AllocatorCall,
+    pub count: u64,
+    /// The sum and the maximum of the latencies, in nanoseconds.
+    pub total: u64,
+    pub max: u64,
+    /// How many of the calls took how long, bucketed by `common::event::allocator_latency_bucket`.
+    pub buckets: Vec< u64 >
+}
+
+impl AllocatorLatencies {
+    /// Returns the lower and the upper bound, in nanoseconds, of the latencies in a given bucket of `buckets`.
+    pub fn bucket_range( index: usize ) -> (u64, u64) {
+        if index == 0 {
+            (0, 1)
+        } else {
+            (1 << (index - 1), 1 << index)
+        }
+    }
+
+    pub fn mean( &self ) -> u64 {
+        self.total / std::cmp::max( self.count, 1 )
+    }
+
+    /// Returns an upper bound, in nanoseconds, of the latency below which the given fraction of the calls are.
+    pub fn quantile( &self, quantile: f64 ) -> u64 {
+        let threshold = (self.count as f64 * quantile).ceil() as u64;
+        let mut sum = 0;
+        for (index, &count) in self.buckets.iter().enumerate() {
+            sum += count;
+            if sum >= threshold {
+                return std::cmp::min( Self::bucket_range( index ).1, self.max );
+            }
+        }
+
+        self.max
+    }
+}
+
+#[test]
+fn test_allocator_latency_quantiles() {
+    let latencies = AllocatorLatencies {
+        backtrace: BacktraceId::new( 1 ),
+        call: AllocatorCall::Allocate,
+        count: 100,
+        total: 100 * 50 + 5000,
+        max: 5000,
+        buckets: vec![ 0, 0, 0, 0, 0, 0, 99, 0, 0, 0, 0, 0, 0, 1 ]
+    };
+
+    assert_eq!( latencies.quantile( 0.5 ), 64 );
+    assert_eq!( latencies.quantile( 0.99 ), 64 );
+    assert_eq!( latencies.quantile( 1.0 ), 5000 );
+    assert_eq!( AllocatorLatencies::bucket_range( 13 ), (4096, 8192) );
+}
+
+/// A single sampled page fault, along with whatever was mapped at the faulting address when it happened.
+#[derive(Clone, Debug)]
+pub struct PageFault {
+    pub timestamp: Timestamp,
+    pub thread: ThreadId,
+    pub address: u64,
+    /// The allocation which was live at the faulting address, if any.
+    pub allocation: Option< AllocationId >,
+    /// The map which contained the faulting address, if the maps were gathered.
+    pub map: Option< MapId >
+}
+
+/// A setting of the profiler which was changed while it was running.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub struct OptionChange {
+    pub timestamp: Timestamp,
+    pub option: RuntimeOption,
+    pub value: u64
+}
+
+/// A thread of the profiled process which either allocated something or was announced by the profiler.
+///
+/// The operating system can reuse the IDs of the threads which have exited, in which case this is
+/// a mix of every thread which had the same ID.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub struct Thread {
+    pub id: ThreadId,
+    /// The latest name the thread had, if the profiler has recorded it.
+    pub name: Option< StringId >,
+    /// When the profiler first saw the thread, if it has recorded that.
+    pub started_at: Option< Timestamp >,
+    pub exited_at: Option< Timestamp >
+}
+
+impl Thread {
+    pub(crate) fn new( id: ThreadId ) -> Self {
+        Thread {
+            id,
+            name: None,
+            started_at: None,
+            exited_at: None
+        }
+    }
+}
+
+/// A custom pool or arena allocator which reported the allocations it made out of its own memory.
+///
+/// Those allocations overlap with the memory of the pool itself, which is most likely
+/// also tracked as one or more ordinary allocations, unless it's an external allocator
+/// whose memory lives in an address space of its own.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub struct Pool {
+    pub id: u16,
+    pub name: StringId,
+    /// A combination of the `POOL_FLAG_*` flags.
+    pub flags: u32
+}
+
+impl Pool {
+    /// Whether this is an external allocator of memory which isn't the process' own, e.g. a GPU's.
+    pub fn is_device( &self ) -> bool {
+        self.flags & common::event::POOL_FLAG_DEVICE != 0
+    }
+}
+
+/// How much of the memory of the sampled live allocations of a single backtrace
+/// was actually resident at a given time. All of the counts are in pages.
+#[derive(Clone, Debug)]
+pub struct ResidencySample {
+    pub timestamp: Timestamp,
+    pub backtrace: BacktraceId,
+    /// Whether the `idle_pages` were actually tracked.
+    pub idle_tracking: bool,
+    pub allocation_count: u64,
+    pub allocated_size: u64,
+    pub pages: u64,
+    pub resident_pages: u64,
+    pub swapped_pages: u64,
+    /// The resident pages which weren't accessed since the previous pass.
+    pub idle_pages: u64
+}
+
+impl ResidencySample {
+    /// The pages which were never touched since they were allocated, or which were purged since.
+    pub fn untouched_pages( &self ) -> u64 {
+        self.pages - self.resident_pages - self.swapped_pages
+    }
+}
+
+/// The memory usage of the process' cgroup at a given time; all of the sizes are in bytes.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub struct CgroupSample {
+    pub timestamp: Timestamp,
+    pub current: u64,
+    /// `u64::MAX` if there's no limit.
+    pub limit: u64,
+    pub anon: u64,
+    pub file: u64,
+    pub kernel: u64,
+    pub sock: u64,
+    /// The total time, in microseconds, during which some (or all) of the cgroup's tasks were stalled on memory.
+    pub pressure_some: u64,
+    pub pressure_full: u64
+}
+
+/// The words of a memory dump which could be pointers into the heap.
+#[derive(Clone, PartialEq, Eq, Debug)]
+pub struct MemoryDump {
+    /// When the process was forked to be dumped; the dump is of the memory as it was then.
+    pub timestamp: Timestamp,
+    /// Where each of the `values` is, in the same order in which they were dumped.
+    pub addresses: Vec< u64 >,
+    pub values: Vec< u64 >,
+    /// The allocations which were alive when the dump was made, sorted, and the hashes of their contents.
+    pub allocation_ids: Vec< AllocationId >,
+    pub content_hashes: Vec< u64 >
+}
+
+/// The statistics of jemalloc at a given time; all of the sizes are in bytes.
+#[derive(Clone, Debug)]
+pub struct JemallocSnapshot {
+    pub timestamp: Timestamp,
+    pub page_size: u64,
+    pub allocated: u64,
+    pub active: u64,
+    pub metadata: u64,
+    pub resident: u64,
+    pub mapped: u64,
+    pub retained: u64,
+    pub arenas: Vec< JemallocArenaStats >,
+    pub bins: Vec< JemallocBinStats >
+}
+
+impl JemallocSnapshot {
+    pub fn dirty( &self ) -> u64 {
+        self.arenas.iter().map( |arena| arena.pdirty ).sum::< u64 >() * self.page_size
+    }
+
+    pub fn muzzy( &self ) -> u64 {
+        self.arenas.iter().map( |arena| arena.pmuzzy ).sum::< u64 >() * self.page_size
+    }
+
+    pub fn tcache( &self ) -> u64 {
+        self.arenas.iter().map( |arena| arena.tcache_bytes ).sum()
+    }
+
+    /// How much of the active memory isn't actually allocated.
+    pub fn fragmentation( &self ) -> f64 {
+        if self.active == 0 {
+            0.0
+        } else {
+            self.active.saturating_sub( self.allocated ) as f64 / self.active as f64
+        }
+    }
+
+    fn memory_usage( &self ) -> usize {
+        mem::size_of::< Self >() + size_of_slice( &self.arenas ) + size_of_slice( &self.bins )
+    }
+}
+
+impl MemoryAdvice {
+    pub const MADV_DONTNEED: i32 = 4;
+    pub const MADV_FREE: i32 = 8;
+    pub const MADV_REMOVE: i32 = 9;
+    pub const MADV_HUGEPAGE: i32 = 14;
+    pub const MADV_NOHUGEPAGE: i32 = 15;
+    pub const MADV_PAGEOUT: i32 = 21;
+    pub const MADV_COLLAPSE: i32 = 25;
+
+    pub fn name( &self ) -> Option< &'static str > {
+        let name = match self.advice {
+            Self::MADV_DONTNEED => "MADV_DONTNEED",
+            Self::MADV_FREE => "MADV_FREE",
+            Self::MADV_REMOVE => "MADV_REMOVE",
+            Self::MADV_HUGEPAGE => "MADV_HUGEPAGE",
+            Self::MADV_NOHUGEPAGE => "MADV_NOHUGEPAGE",
+            Self::MADV_PAGEOUT => "MADV_PAGEOUT",
+            Self::MADV_COLLAPSE => "MADV_COLLAPSE",
+            _ => return None
+        };
+
+        Some( name )
+    }
+
+    /// Whether this gave the memory back to the kernel, which is what the allocators
+    /// usually do instead of unmapping it.
+    pub fn is_purge( &self ) -> bool {
+        match self.advice {
+            Self::MADV_DONTNEED | Self::MADV_FREE | Self::MADV_REMOVE | Self::MADV_PAGEOUT => true,
+            _ => false
+        }
+    }
+}
+
 impl Allocation {
     #[inline]
     pub fn was_deallocated( &self ) -> bool {
@@ -528,6 +1046,17 @@ impl Allocation {
         self.flags.contains( AllocationFlags::IS_MMAPED )
     }
 
+    #[inline]
+    pub fn is_sampled( &self ) -> bool {
+        self.flags.contains( AllocationFlags::IS_SAMPLED )
+    }
+
+    /// The estimated number of allocations this allocation stands for.
+    #[inline]
+    pub fn sample_count( &self ) -> u64 {
+        std::cmp::max( self.sample_weight.round() as u64, 1 )
+    }
+
     #[inline]
     pub fn usable_size( &self ) -> u64 {
         self.size + self.extra_usable_space as u64
@@ -578,60 +1107,99 @@ fn binary_search_range< 'a, T, V, W, F >( array: &'a [T], min: Option< V >, max:
           W: Borrow< V >,
           F: Fn( &'a T ) -> W
 {
-    if array.is_empty() {
+    // The comparators never return `Equal`, so these always find the first index for which the predicate doesn't hold,
+    // and don't have to go over every duplicate of the bound.
+    let partition_point = |is_before: &dyn Fn( &V ) -> bool| {
+        array.binary_search_by( |key| if is_before( callback( key ).borrow() ) { Ordering::Less } else { Ordering::Greater } ).unwrap_err()
+    };
+
+    let start = match min {
+        Some( ref min ) => partition_point( &|value| value < min ),
+        None => 0
+    };
+
+    let end = match max {
+        Some( ref max ) => partition_point( &|value| value <= max ),
+        None => array.len()
+    };
+
+    if start >= end {
         return 0..0;
     }
 
-    let start = if let Some( min ) = min {
-        if min > *callback( array.last().unwrap() ).borrow() {
-            return 0..0;
+    start..end
+}
+
+/// Groups the `items` by a key which is less than `key_count`, returning every non-empty group
+/// as `(key, offset, length)` into the grouped items, with the groups sorted by their keys.
+///
+/// The items keep their order within every group.
+pub(crate) fn group_by_dense_key< T, F >( items: &[T], key_count: usize, key_of: F ) -> (Vec< (usize, u32, u32) >, Vec< T >)
+    where T: Copy + Send + Sync,
+          F: Fn( T ) -> usize + Sync
+{
+    let chunk_size = std::cmp::max( items.len() / rayon::current_num_threads() + 1, 64 * 1024 );
+
+    // There are usually far fewer keys than items, so every chunk gets
+    // its own dense array of offsets and is grouped with a counting sort.
+    let chunks: Vec< (Vec< u32 >, Vec< T >) > = items.par_chunks( chunk_size ).map( |chunk| {
+        let mut offsets = vec![ 0; key_count + 1 ];
+        for &item in chunk {
+            offsets[ key_of( item ) + 1 ] += 1;
         }
 
-        if min <= *callback( array.first().unwrap() ).borrow() {
-            0
-        } else {
-            match array.binary_search_by( |key| callback( key ).borrow().cmp( &min ) ) {
-                Ok( mut index ) => {
-                    while index > 0 && callback( &array[ index - 1 ] ).borrow().cmp( &min ) == Ordering::Equal {
-                        index -= 1;
-                    }
-                    index
-                },
-                Err( index ) => index
-            }
+        for index in 1..offsets.len() {
+            offsets[ index ] += offsets[ index - 1 ];
         }
-    } else {
-        0
-    };
 
-    let end = if let Some( max ) = max {
-        if max < *callback( array.first().unwrap() ).borrow() {
-            return 0..0;
+        let mut positions = offsets.clone();
+        let mut grouped = chunk.to_vec();
+        for &item in chunk {
+            let position = &mut positions[ key_of( item ) ];
+            grouped[ *position as usize ] = item;
+            *position += 1;
         }
 
-        if max >= *callback( array.last().unwrap() ).borrow() {
-            array.len()
-        } else {
-            match array.binary_search_by( |key| callback( key ).borrow().cmp( &max ) ) {
-                Ok( mut index ) => {
-                    while index + 1 < array.len() && callback( &array[ index + 1 ] ).borrow().cmp( &max ) == Ordering::Equal {
-                        index += 1;
-                    }
-                    index + 1
-                },
-                Err( index ) => index
-            }
+        (offsets, grouped)
+    }).collect();
+
+    let lengths: Vec< u32 > = (0..key_count).into_par_iter().map( |key| {
+        chunks.iter().map( |(offsets, _)| offsets[ key + 1 ] - offsets[ key ] ).sum()
+    }).collect();
+
+    let mut index = Vec::new();
+    let mut storage = items.to_vec();
+    let mut groups = Vec::new();
+    let mut remaining = storage.as_mut_slice();
+    let mut offset = 0;
+    for (key, &length) in lengths.iter().enumerate() {
+        if length == 0 {
+            continue;
         }
-    } else {
-        array.len()
-    };
 
-    start..end
+        let (group, rest) = std::mem::take( &mut remaining ).split_at_mut( length as usize );
+        remaining = rest;
+        index.push( (key, offset, length) );
+        groups.push( (key, group) );
+        offset += length;
+    }
+
+    // Every group is merged from the chunks in their original order.
+    groups.into_par_iter().for_each( |(key, group)| {
+        let mut position = 0;
+        for (offsets, grouped) in &chunks {
+            let part = &grouped[ offsets[ key ] as usize..offsets[ key + 1 ] as usize ];
+            group[ position..position + part.len() ].copy_from_slice( part );
+            position += part.len();
+        }
+    });
+
+    (index, storage)
 }
 
 #[cfg(test)]
 mod tests {
-    use super::binary_search_range;
+    use super::{binary_search_range, group_by_dense_key, MapSparkline, MapUsage, Timestamp, MAP_SPARKLINE_LENGTH};
 
     quickcheck! {
         fn binary_search_range_works( xs: Vec< u8 >, min: Option< u8 >, max: Option< u8 > ) -> bool {
@@ -654,6 +1222,49 @@ mod tests {
         }
     }
 
+    #[test]
+    fn test_group_by_dense_key() {
+        let items: Vec< (usize, usize) > = (0..200_000).map( |index| ((index * 7919) % 13, index) ).collect();
+        let (index, grouped) = group_by_dense_key( &items, 16, |(key, _)| key );
+        assert_eq!( index.len(), 13 );
+        assert_eq!( grouped.len(), items.len() );
+        for (key, offset, length) in index {
+            let group = &grouped[ offset as usize..(offset + length) as usize ];
+            let expected: Vec< _ > = items.iter().copied().filter( |&(item_key, _)| item_key == key ).collect();
+            assert_eq!( group, expected.as_slice() );
+        }
+    }
+
+    #[test]
+    fn test_map_sparkline() {
+        let usage = |secs: u64, rss: u64| MapUsage {
+            timestamp: Timestamp::from_usecs( secs * 1_000_000 ),
+            address_space: 0,
+            anonymous: 0,
+            shared_clean: 0,
+            shared_dirty: 0,
+            private_clean: 0,
+            private_dirty: rss,
+            swap: 0,
+            anon_huge_pages: 0,
+            shmem_pmd_mapped: 0,
+            file_pmd_mapped: 0
+        };
+
+        assert!( MapSparkline::build( &[], Timestamp::min(), Timestamp::from_usecs( 1_000_000 ) ).rss.is_empty() );
+
+        let length = MAP_SPARKLINE_LENGTH as u64;
+        let history = [usage( length / 2, 4096 ), usage( length / 2, 8192 ), usage( length / 2 + 1, 1024 )];
+        let sparkline = MapSparkline::build( &history, Timestamp::min(), Timestamp::from_usecs( length * 1_000_000 ) );
+        assert_eq!( sparkline.rss.len(), MAP_SPARKLINE_LENGTH );
+        assert_eq!( sparkline.rss[ 0 ], 0 );
+        assert_eq!( sparkline.rss[ MAP_SPARKLINE_LENGTH / 2 ], 8 );
+        assert_eq!( sparkline.rss[ MAP_SPARKLINE_LENGTH / 2 + 1 ], 8 );
+        assert_eq!( sparkline.rss[ MAP_SPARKLINE_LENGTH - 1 ], 1 );
+        assert_eq!( sparkline.rss, sparkline.dirty );
+        assert!( sparkline.swap.iter().all( |&value| value == 0 ) );
+    }
+
     #[test]
     fn test_binary_search_range() {
         assert_eq!(
@@ -715,14 +1326,41 @@ impl Data {
         self.sorted_by( &self.sorted_by_timestamp, min, max, |alloc| &alloc.timestamp )
     }
 
+    pub(crate) fn ids_sorted_by_size( &self ) -> &[AllocationId] {
+        self.sorted_by_size.get_or_init( || sort_ids_by_key( &self.allocation_columns.sizes ).into() )
+    }
+
+    pub(crate) fn ids_sorted_by_address( &self ) -> &[AllocationId] {
+        self.sorted_by_address.get_or_init( || sort_ids_by_key( &self.allocation_columns.pointers ).into() )
+    }
+
     #[inline]
     pub fn alloc_sorted_by_size( &self, min: Option< u64 >, max: Option< u64 > ) -> &[AllocationId] {
-        self.sorted_by( &self.sorted_by_size, min, max, |alloc| &alloc.size )
+        self.sorted_by( self.ids_sorted_by_size(), min, max, |alloc| &alloc.size )
     }
 
     #[inline]
     pub fn alloc_sorted_by_address( &self, min: Option< u64 >, max: Option< u64 > ) -> &[AllocationId] {
-        self.sorted_by( &self.sorted_by_address, min, max, |alloc| &alloc.pointer )
+        self.sorted_by( self.ids_sorted_by_address(), min, max, |alloc| &alloc.pointer )
+    }
+
+    pub(crate) fn live_index( &self ) -> &LiveIndex {
+        self.live_index.get_or_init( || LiveIndex::new( self ) )
+    }
+
+    /// Returns the allocations which were alive right after the given point in time, sorted by when they were made.
+    pub fn alloc_alive_at( &self, timestamp: Timestamp ) -> Vec< AllocationId > {
+        self.live_index().allocated_until_and_alive_after( self, timestamp, timestamp )
+    }
+
+    /// Returns how much memory was in use right after the given point in time.
+    pub fn usage_at( &self, timestamp: Timestamp ) -> LiveUsage {
+        self.live_index().usage_at( self, timestamp )
+    }
+
+    #[inline]
+    pub fn allocation_count( &self ) -> usize {
+        self.allocations.len()
     }
 
     #[inline]
@@ -738,6 +1376,17 @@ impl Data {
         &self.operations
     }
 
+    /// Returns when the given operation happened; the operations are sorted by this.
+    #[inline]
+    pub(crate) fn operation_timestamp( &self, op: OperationId ) -> Timestamp {
+        let index = op.id().raw() as usize;
+        if op.is_deallocation() {
+            self.allocation_columns.deallocation_timestamps[ index ]
+        } else {
+            self.allocation_columns.timestamps[ index ]
+        }
+    }
+
     #[inline]
     pub fn operations< 'a >( &'a self ) -> impl Iterator< Item = Operation< 'a > > + 'a {
         self.operations.iter().map( move |op| {
@@ -792,6 +1441,19 @@ impl Data {
         self.last_timestamp
     }
 
+    /// The number of bytes the profiler has written out, if it was running with `MEMORY_PROFILER_INSTRUMENTATION`.
+    pub fn profiler_bytes_written( &self ) -> u64 {
+        self.profiler_bytes_written
+    }
+
+    pub fn profiler_histograms( &self ) -> &[ProfilerHistogram] {
+        &self.profiler_histograms
+    }
+
+    pub fn backtrace_cache_statistics( &self ) -> &[BacktraceCacheLevelStatistics] {
+        &self.backtrace_cache_statistics
+    }
+
     #[inline]
     pub fn pointer_size( &self ) -> u64 {
         self.pointer_size
@@ -817,6 +1479,12 @@ impl Data {
         self.id
     }
 
+    /// The ID of the data of the process which spawned this one, if it was also profiled.
+    #[inline]
+    pub fn parent_id( &self ) -> Option< DataId > {
+        self.parent_id
+    }
+
     #[inline]
     pub fn unique_backtrace_count( &self ) -> usize {
         self.backtraces.len()
@@ -827,6 +1495,86 @@ impl Data {
         self.maximum_backtrace_depth
     }
 
+    /// Returns the selection which was cached under the given `key`, or generates it with `callback` and caches it.
+    ///
+    /// The keys share their namespace with the cached selections of the filters, which are keyed by their
+    /// `Debug` representation, so they should have a distinct prefix.
+    pub fn cached_selection< E >( &self, key: String, callback: impl FnOnce() -> Result< Bitmap, E > ) -> Result< Arc< Bitmap >, E > {
+        self.selection_cache.get_or_try_insert_with( key, || callback().map( Arc::new ) )
+    }
+
+    /// Like `cached_selection`, but for when the `callback` can return a selection which is already shared.
+    pub fn cached_shared_selection< E >( &self, key: String, callback: impl FnOnce() -> Result< Arc< Bitmap >, E > ) -> Result< Arc< Bitmap >, E > {
+        self.selection_cache.get_or_try_insert_with( key, callback )
+    }
+
+    /// Returns the index of the address space which was cached under the given `key`, or builds it with `callback`.
+    pub fn cached_address_tiles( &self, key: String, callback: impl FnOnce() -> AddressTiles ) -> Arc< AddressTiles > {
+        self.address_tiles_cache.get_or_insert_with( key, callback )
+    }
+
+    /// Returns the call tree which was cached under the given `key`, or builds it with `callback`.
+    pub fn cached_call_tree( &self, key: String, callback: impl FnOnce() -> Tree< SourceKey, FrameId > ) -> Arc< Tree< SourceKey, FrameId > > {
+        self.call_tree_cache.get_or_insert_with( key, callback )
+    }
+
+    /// A rough estimate of how much memory this takes, whether it's on the heap or mapped from a cache file.
+    pub fn memory_usage( &self ) -> usize {
+        fn size_of_slice< T >( slice: &[T] ) -> usize {
+            slice.len() * mem::size_of::< T >()
+        }
+
+        fn size_of_vecvec< T >( vecvec: &DenseVecVec< T > ) -> usize {
+            let (index, storage) = vecvec.raw_parts();
+            size_of_slice( index ) + size_of_slice( storage )
+        }
+
+        let columns = &self.allocation_columns;
+        let strings = self.interner.memory_usage();
+        let usage_history: usize = self.maps.iter().map( |map| size_of_slice( &map.usage_history ) ).sum();
+
+        strings +
+        size_of_slice( &self.operations ) +
+        size_of_slice( &self.allocations ) +
+        size_of_slice( &columns.pointers ) +
+        size_of_slice( &columns.sizes ) +
+        size_of_slice( &columns.timestamps ) +
+        size_of_slice( &columns.deallocation_timestamps ) +
+        size_of_slice( &columns.backtraces ) +
+        size_of_slice( &columns.flags ) +
+        size_of_slice( &self.sorted_by_timestamp ) +
+        self.sorted_by_address.get().map( |column| size_of_slice( column ) ).unwrap_or( 0 ) +
+        self.sorted_by_size.get().map( |column| size_of_slice( column ) ).unwrap_or( 0 ) +
+        size_of_slice( &self.frames ) +
+        size_of_slice( &self.backtraces ) +
+        size_of_slice( &self.backtraces_storage ) +
+        size_of_vecvec( &self.allocations_by_backtrace ) +
+        self.backtraces_by_frame.get().map( size_of_vecvec ).unwrap_or( 0 ) +
+        self.backtrace_trie.get().map( |trie| trie.memory_usage() ).unwrap_or( 0 ) +
+        self.live_index.get().map( |index| index.memory_usage() ).unwrap_or( 0 ) +
+        self.address_tiles_cache.memory_usage() +
+        self.call_tree_cache.memory_usage() +
+        size_of_slice( &self.mallopts ) +
+        size_of_slice( &self.memory_advices ) +
+        size_of_slice( &self.residency_samples ) +
+        size_of_slice( &self.culled_allocations ) +
+        self.culled_allocations.iter().map( |culled| size_of_slice( &culled.lifetimes ) ).sum::< usize >() +
+        size_of_slice( &self.allocator_latencies ) +
+        self.allocator_latencies.iter().map( |latencies| size_of_slice( &latencies.buckets ) ).sum::< usize >() +
+        size_of_slice( &self.page_faults ) +
+        self.jemalloc_snapshots.iter().map( |snapshot| snapshot.memory_usage() ).sum::< usize >() +
+        size_of_slice( &self.cgroup_samples ) +
+        size_of_slice( &self.option_changes ) +
+        size_of_slice( &self.pools ) +
+        size_of_slice( &self.threads ) +
+        size_of_slice( &self.group_stats ) +
+        self.group_stats.iter().map( |stats| stats.lifetimes.memory_usage() ).sum::< usize >() +
+        size_of_slice( &self.chains ) +
+        size_of_slice( &self.maps ) +
+        usage_history +
+        size_of_slice( &self.map_ids )
+    }
+
     #[inline]
     pub fn get_frame_ids( &self, id: BacktraceId ) -> &[FrameId] {
         let (offset, length) = self.backtraces[ id.0 as usize ];
@@ -837,14 +1585,137 @@ impl Data {
         &self.frames[ id ]
     }
 
+    /// Returns an index of the backtraces which go through every frame, in ascending order.
+    pub(crate) fn backtraces_by_frame( &self ) -> &DenseVecVec< BacktraceId > {
+        self.backtraces_by_frame.get_or_init( || {
+            let mut backtraces_by_frame = vec![ Vec::new(); self.frames.len() ];
+            for index in 0..self.backtraces.len() {
+                let backtrace_id = BacktraceId::new( index as u32 );
+                for &frame_id in self.get_frame_ids( backtrace_id ) {
+                    let backtraces: &mut Vec< BacktraceId > = &mut backtraces_by_frame[ frame_id ];
+                    // Recursive backtraces can go through the same frame more than once.
+                    if backtraces.last() != Some( &backtrace_id ) {
+                        backtraces.push( backtrace_id );
+                    }
+                }
+            }
+
+            let mut index = DenseVecVec::new();
+            for backtraces in backtraces_by_frame {
+                index.push( backtraces );
+            }
+
+            index.shrink_to_fit();
+            index
+        })
+    }
+
+    /// Returns the frames whose function or source matches the `regex`, indexed by their IDs.
+    ///
+    /// The regex is only ever run once for every distinct interned string, in parallel,
+    /// and the result is cached, so the filters which reuse it are only bitmap operations.
+    pub fn frames_matching( &self, field: FrameField, regex: &Regex ) -> Arc< Bitmap > {
+        let key = format!( "frames_matching:{:?}:{}", field, regex.as_str() );
+        let result: Result< _, () > = self.cached_selection( key, || {
+            let interner = &self.interner;
+            let strings = Bitmap::from_words( interner.len(), |start, count| {
+                let mut word = 0;
+                for bit in 0..count {
+                    if regex.is_match( interner.resolve( StringId::from_usize( start + bit ) ).unwrap() ) {
+                        word |= 1 << bit;
+                    }
+                }
+                word
+            });
+
+            let frames = &self.frames;
+            Ok( Bitmap::from_words( frames.len(), |start, count| {
+                let mut word = 0;
+                for bit in 0..count {
+                    if field.get( &frames[ start + bit ] ).map( |id| strings.contains( id.to_usize() ) ).unwrap_or( false ) {
+                        word |= 1 << bit;
+                    }
+                }
+                word
+            }))
+        });
+
+        result.unwrap()
+    }
+
+    /// Returns the backtraces which go through any of the given frames, indexed by their IDs.
+    pub fn backtraces_through_frames( &self, frames: &Bitmap ) -> Bitmap {
+        let backtraces_by_frame = self.backtraces_by_frame();
+        let mut backtraces = Bitmap::empty( self.backtraces.len() );
+        for frame_id in frames.iter() {
+            for backtrace_id in backtraces_by_frame.get( frame_id ) {
+                backtraces.insert( backtrace_id.raw() as usize );
+            }
+        }
+
+        backtraces
+    }
+
+    /// Returns the backtraces which go through any frame whose function or source matches the `regex`; this is cached too.
+    pub fn backtraces_matching( &self, field: FrameField, regex: &Regex ) -> Arc< Bitmap > {
+        let key = format!( "backtraces_matching:{:?}:{}", field, regex.as_str() );
+        let result: Result< _, () > = self.cached_selection( key, || {
+            Ok( self.backtraces_through_frames( &self.frames_matching( field, regex ) ) )
+        });
+
+        result.unwrap()
+    }
+
+    /// Returns the backtraces which go through a frame which matches both the `function` and the `source`
+    /// regexes, and through no frame which matches either the `negative_function` or the `negative_source`.
+    pub fn backtraces_matching_frames(
+        &self,
+        function: Option< &Regex >,
+        source: Option< &Regex >,
+        negative_function: Option< &Regex >,
+        negative_source: Option< &Regex >
+    ) -> Bitmap {
+        let mut matched = match (function, source) {
+            (None, None) => Bitmap::full( self.backtraces.len() ),
+            (Some( regex ), None) => (*self.backtraces_matching( FrameField::Function, regex )).clone(),
+            (None, Some( regex )) => (*self.backtraces_matching( FrameField::Source, regex )).clone(),
+            (Some( function ), Some( source )) => {
+                // Both have to match the same frame.
+                let mut frames = (*self.frames_matching( FrameField::Function, function )).clone();
+                frames.intersect_with( &self.frames_matching( FrameField::Source, source ) );
+                self.backtraces_through_frames( &frames )
+            }
+        };
+
+        for (field, regex) in [(FrameField::Function, negative_function), (FrameField::Source, negative_source)] {
+            if let Some( regex ) = regex {
+                let mut negative = (*self.backtraces_matching( field, regex )).clone();
+                negative.invert();
+                matched.intersect_with( &negative );
+            }
+        }
+
+        matched
+    }
+
+    /// Returns every backtrace merged into a single prefix tree, built on first use.
+    pub(crate) fn backtrace_trie( &self ) -> &BacktraceTrie {
+        self.backtrace_trie.get_or_init( || {
+            BacktraceTrie::new( (0..self.backtraces.len()).map( |index| {
+                self.get_frame_ids( BacktraceId::new( index as u32 ) ).iter().rev().copied()
+            }))
+        })
+    }
+
     pub fn get_chain_by_first_allocation( &self, id: AllocationId ) -> Option< &AllocationChain > {
-        self.chains.get( &id )
+        let index = self.chains.binary_search_by_key( &id, |chain| chain.first ).ok()?;
+        Some( &self.chains[ index ] )
     }
 
     pub fn get_chain_by_any_allocation( &self, id: AllocationId ) -> AllocationChain {
         let alloc = self.get_allocation( id );
         if let Some( initial ) = alloc.first_allocation_in_chain {
-            self.chains.get( &initial ).unwrap().clone()
+            self.get_chain_by_first_allocation( initial ).unwrap().clone()
         } else {
             AllocationChain {
                 first: id,
@@ -882,6 +1753,15 @@ impl Data {
         &self.group_stats[ id.raw() as usize ]
     }
 
+    /// Groups the given allocations by their backtraces, sorting the groups by their backtrace IDs
+    /// and keeping the order of the allocations within every group.
+    pub fn group_by_backtrace( &self, ids: &[AllocationId] ) -> VecVec< BacktraceId, AllocationId > {
+        let backtraces = &self.allocation_columns.backtraces;
+        let (index, storage) = group_by_dense_key( ids, self.backtraces.len(), |id| backtraces[ id.raw() as usize ].raw() as usize );
+        let index = index.into_iter().map( |(key, offset, length)| (BacktraceId::new( key as u32 ), offset, length) ).collect();
+        VecVec::from_raw_parts( index, storage )
+    }
+
     pub fn all_backtraces< 'a >( &'a self ) ->
         impl SliceLikeIterator<
             Item = (
@@ -927,6 +1807,14 @@ impl Data {
         tree
     }
 
+    fn source_key( frame: &Frame ) -> SourceKey {
+        match (frame.source(), frame.line(), frame.function().or( frame.raw_function() )) {
+            (Some( source ), Some( line ), _) => SourceKey::Location( source, line ),
+            (_, _, Some( function )) => SourceKey::Function( function ),
+            _ => SourceKey::Address( frame.address() )
+        }
+    }
+
     pub fn tree_by_source< F >( &self, filter: F ) -> Tree< SourceKey, FrameId > where F: Fn( AllocationId, &Allocation ) -> bool {
         let mut tree = Tree::new();
         for (allocation_id, allocation) in self.allocations_with_id() {
@@ -935,43 +1823,192 @@ impl Data {
             }
 
             tree.add_allocation( &allocation, allocation_id, self.get_backtrace( allocation.backtrace ).map( |(frame_id, frame)| {
-                let key = match (frame.source(), frame.line(), frame.function().or( frame.raw_function() )) {
-                    (Some( source ), Some( line ), _) => SourceKey::Location( source, line ),
-                    (_, _, Some( function )) => SourceKey::Function( function ),
-                    _ => SourceKey::Address( frame.address() )
-                };
-
-                (key, frame_id)
+                (Self::source_key( frame ), frame_id)
             }));
         }
 
         tree
     }
 
-    pub fn dump_tree( &self, tree: &Tree< SourceKey, FrameId > ) -> Vec< Vec< String > > {
-        dump_tree( &tree, self.initial_timestamp, |&frame_id| {
-            let frame = &self.frames[ frame_id ];
-            if let Some( function ) = frame.any_function() {
-                let function = self.interner.resolve( function ).unwrap();
-                if let (Some( source ), Some( line )) = (frame.source(), frame.line()) {
-                    let source = self.interner.resolve( source ).unwrap();
-                    let filename = &source[ source.rfind( "/" ).map( |index| index + 1 ).unwrap_or( 0 ).. ];
-                    format!( "{} [{}:{}]", function, filename, line )
-                } else {
-                    format!( "{}", function )
+    /// Builds a call tree of the matching allocations without remembering which allocations went where.
+    ///
+    /// The allocations are first summed up per backtrace in parallel, so the tree itself only has
+    /// to be walked once for every distinct backtrace instead of once for every allocation. The
+    /// backtraces are added in the order of their IDs, so the same filter always gives the same node IDs.
+    ///
+    /// A `bottom_up` tree starts at the innermost frames, so its roots are where the memory was actually allocated.
+    pub fn call_tree< F >( &self, filter: F, bottom_up: bool ) -> Tree< SourceKey, FrameId > where F: Fn( AllocationId, &Allocation ) -> bool + Sync {
+        type Group = (u64, u64, Timestamp, Timestamp);
+
+        fn merge( group: &mut Group, other: Group ) {
+            group.0 += other.0;
+            group.1 += other.1;
+            group.2 = cmp::min( group.2, other.2 );
+            group.3 = cmp::max( group.3, other.3 );
+        }
+
+        let groups = self.allocations.par_iter().enumerate()
+            .fold( HashMap::new, |mut groups: HashMap< BacktraceId, Group >, (index, allocation)| {
+                if filter( AllocationId::new( index as _ ), allocation ) {
+                    let group = (1, allocation.size, allocation.timestamp, allocation.timestamp);
+                    match groups.get_mut( &allocation.backtrace ) {
+                        Some( existing ) => merge( existing, group ),
+                        None => { groups.insert( allocation.backtrace, group ); }
+                    }
                 }
-            } else if let Some( library ) = frame.library() {
-                format!( "{} [{}]", frame.address(), self.interner.resolve( library ).unwrap() )
+                groups
+            })
+            .reduce( HashMap::new, |mut lhs, rhs| {
+                for (backtrace, group) in rhs {
+                    match lhs.get_mut( &backtrace ) {
+                        Some( existing ) => merge( existing, group ),
+                        None => { lhs.insert( backtrace, group ); }
+                    }
+                }
+                lhs
+            });
+
+        let mut groups: Vec< _ > = groups.into_iter().collect();
+        groups.par_sort_unstable_by_key( |&(backtrace, _)| backtrace );
+
+        let mut tree = Tree::new();
+        for (backtrace, (count, size, first_timestamp, last_timestamp)) in groups {
+            let frames = self.get_backtrace( backtrace ).map( |(frame_id, frame)| (Self::source_key( frame ), frame_id) );
+            if bottom_up {
+                tree.add_allocations( frames.rev(), count, size, first_timestamp, last_timestamp );
             } else {
-                format!( "{}", frame.address() )
+                tree.add_allocations( frames, count, size, first_timestamp, last_timestamp );
             }
-        })
+        }
+
+        tree
+    }
+
+    /// Formats a frame the way it's shown in the call trees.
+    pub fn tree_frame_label( &self, frame_id: FrameId ) -> String {
+        let frame = &self.frames[ frame_id ];
+        if let Some( function ) = frame.any_function() {
+            let function = self.interner.resolve( function ).unwrap();
+            if let (Some( source ), Some( line )) = (frame.source(), frame.line()) {
+                let source = self.interner.resolve( source ).unwrap();
+                let filename = &source[ source.rfind( "/" ).map( |index| index + 1 ).unwrap_or( 0 ).. ];
+                format!( "{} [{}:{}]", function, filename, line )
+            } else {
+                format!( "{}", function )
+            }
+        } else if let Some( library ) = frame.library() {
+            format!( "{} [{}]", frame.address(), self.interner.resolve( library ).unwrap() )
+        } else {
+            format!( "{}", frame.address() )
+        }
+    }
+
+    pub fn dump_tree( &self, tree: &Tree< SourceKey, FrameId > ) -> Vec< Vec< String > > {
+        dump_tree( &tree, self.initial_timestamp, |&frame_id| self.tree_frame_label( frame_id ) )
     }
 
     pub fn mallopts( &self ) -> &[Mallopt] {
         &self.mallopts
     }
 
+    pub fn memory_advices( &self ) -> &[MemoryAdvice] {
+        &self.memory_advices
+    }
+
+    /// The residency samples from every pass, sorted by their timestamp.
+    pub fn residency_samples( &self ) -> &[ResidencySample] {
+        &self.residency_samples
+    }
+
+    /// The counters of the culled allocations, sorted by when the first one of each batch was made.
+    pub fn culled_allocations( &self ) -> &[CulledAllocations] {
+        &self.culled_allocations
+    }
+
+    /// How long the allocator took to service the sampled calls, per backtrace; sorted by the backtrace.
+    pub fn allocator_latencies( &self ) -> &[AllocatorLatencies] {
+        &self.allocator_latencies
+    }
+
+    /// The sampled page faults, sorted by their timestamp.
+    pub fn page_faults( &self ) -> &[PageFault] {
+        &self.page_faults
+    }
+
+    /// How many page faults every one of the `page_faults` stands for.
+    pub fn page_fault_period( &self ) -> u64 {
+        self.page_fault_period
+    }
+
+    /// The snapshots of the jemalloc statistics, sorted by their timestamp.
+    pub fn jemalloc_snapshots( &self ) -> &[JemallocSnapshot] {
+        &self.jemalloc_snapshots
+    }
+
+    /// The samples of the memory usage of the process' cgroup, sorted by their timestamp.
+    pub fn cgroup_samples( &self ) -> &[CgroupSample] {
+        &self.cgroup_samples
+    }
+
+    pub fn memory_dumps( &self ) -> &[MemoryDump] {
+        &self.memory_dumps
+    }
+
+    /// The settings which were changed while the profiler was running, sorted by their timestamp.
+    pub fn option_changes( &self ) -> &[OptionChange] {
+        &self.option_changes
+    }
+
+    /// Returns the value a setting was changed to at or before the given point in time, if it was changed at all.
+    pub fn option_at( &self, option: RuntimeOption, timestamp: Timestamp ) -> Option< u64 > {
+        let end = self.option_changes.partition_point( |change| change.timestamp <= timestamp );
+        self.option_changes[ ..end ].iter().rev().find( |change| change.option == option ).map( |change| change.value )
+    }
+
+    /// The custom pool allocators which were registered, sorted by their ID.
+    pub fn pools( &self ) -> &[Pool] {
+        &self.pools
+    }
+
+    pub fn pool( &self, id: u16 ) -> Option< &Pool > {
+        let index = self.pools.binary_search_by_key( &id, |pool| pool.id ).ok()?;
+        Some( &self.pools[ index ] )
+    }
+
+    pub fn pool_name( &self, id: u16 ) -> Option< &str > {
+        self.interner.resolve( self.pool( id )?.name )
+    }
+
+    /// Every thread which allocated something or which the profiler has seen, sorted by their ID.
+    pub fn threads( &self ) -> &[Thread] {
+        &self.threads
+    }
+
+    pub fn thread( &self, id: ThreadId ) -> Option< &Thread > {
+        let index = self.threads.binary_search_by_key( &id, |thread| thread.id ).ok()?;
+        Some( &self.threads[ index ] )
+    }
+
+    pub fn thread_name( &self, id: ThreadId ) -> Option< &str > {
+        self.interner.resolve( self.thread( id )?.name? )
+    }
+
+    /// Whether the allocation was made by an external allocator from memory which isn't the process' own.
+    pub fn is_device_allocation( &self, allocation: &Allocation ) -> bool {
+        allocation.pool.and_then( |pool| self.pool( pool ) ).map( |pool| pool.is_device() ).unwrap_or( false )
+    }
+
+    /// The residency samples from the very last pass.
+    pub fn last_residency_samples( &self ) -> &[ResidencySample] {
+        let last_timestamp = match self.residency_samples.last() {
+            Some( sample ) => sample.timestamp,
+            None => return &[]
+        };
+
+        let start = self.residency_samples.partition_point( |sample| sample.timestamp < last_timestamp );
+        &self.residency_samples[ start.. ]
+    }
+
     pub fn get_dynamic_constants( &self ) -> BTreeMap< String, BTreeMap< u32, CountAndSize > > {
         self.collate_allocations( |frame| {
             let raw_function = match frame.raw_function() {
@@ -1060,7 +2097,7 @@ impl Data {
             let (source, line) = src;
             let per_line = per_file.entry( source ).or_insert_with( || BTreeMap::new() );
             let stats = per_line.entry( line ).or_insert( CountAndSize { count: 0, size: 0 } );
-            stats.count += 1;
+            stats.count += allocation.sample_count();
             stats.size += allocation.usable_size();
         }
 
@@ -0,0 +1,54 @@
+//! Fetching of the binaries which weren't recorded in the data from a debuginfod server.
+//!
+//! This goes through the `debuginfod-find` tool from elfutils, so it uses the usual `DEBUGINFOD_URLS`
+//! and keeps everything it fetches in its own cache, so the binaries are only ever downloaded once.
+//! Nothing is fetched unless `DEBUGINFOD_URLS` is set.
+
+use std::path::PathBuf;
+use std::process::{Command, Stdio};
+
+fn build_id_to_hex( build_id: &[u8] ) -> String {
+    build_id.iter().map( |byte| format!( "{:02x}", byte ) ).collect()
+}
+
+/// Returns the path to a locally cached copy of the binary with the given build ID.
+pub fn fetch_executable( build_id: &[u8] ) -> Option< PathBuf > {
+    if build_id.is_empty() || std::env::var_os( "DEBUGINFOD_URLS" ).map( |urls| urls.is_empty() ).unwrap_or( true ) {
+        return None;
+    }
+
+    let build_id = build_id_to_hex( build_id );
+    info!( "Fetching the binary with build ID {} from debuginfod...", build_id );
+    let output = Command::new( "debuginfod-find" )
+        .arg( "executable" )
+        .arg( &build_id )
+        .stdin( Stdio::null() )
+        .stderr( Stdio::null() )
+        .output();
+
+    let output = match output {
+        Ok( output ) => output,
+        Err( error ) => {
+            warn!( "Failed to run 'debuginfod-find': {}", error );
+            return None;
+        }
+    };
+
+    if !output.status.success() {
+        warn!( "The binary with build ID {} wasn't found on any debuginfod server", build_id );
+        return None;
+    }
+
+    let path = String::from_utf8_lossy( &output.stdout ).trim().to_owned();
+    if path.is_empty() {
+        return None;
+    }
+
+    Some( path.into() )
+}
+
+#[test]
+fn test_build_id_to_hex() {
+    assert_eq!( build_id_to_hex( &[ 0x00, 0xab, 0x12 ] ), "00ab12" );
+    assert_eq!( build_id_to_hex( &[] ), "" );
+}
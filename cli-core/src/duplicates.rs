@@ -0,0 +1,273 @@
+//! Detection of the allocations whose contents were identical in a memory dump.
+//!
+//! The contents of every allocation which was alive when a dump was made are hashed while the dump
+//! is being loaded, so only a single hash per allocation has to be kept around. The dump comes in
+//! chunks which skip the pages which were all zeros, so the hash is fed a word at a time and
+//! whatever was skipped is hashed as zeros; that way the same contents always get the same hash
+//! regardless of where they were split. The allocations with the same size and the same hash
+//! are then grouped together, and every copy after the first one is a potential saving.
+
+use std::cmp;
+use std::convert::TryInto;
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+
+use crate::{AllocationId, BacktraceId, Data, MemoryDump};
+
+const SEED: u64 = 0x243F_6A88_85A3_08D3;
+const MULTIPLIER: u64 = 0x9E37_79B9_7F4A_7C15;
+
+static ZEROS: [u8; 4096] = [0; 4096];
+
+#[inline]
+fn folded_multiply( lhs: u64, rhs: u64 ) -> u64 {
+    let result = lhs as u128 * rhs as u128;
+    result as u64 ^ (result >> 64) as u64
+}
+
+#[inline]
+fn mix( hash: u64, word: u64 ) -> u64 {
+    folded_multiply( hash ^ word ^ SEED, MULTIPLIER )
+}
+
+#[derive(Copy, Clone)]
+struct HashState {
+    hash: u64,
+    /// How many bytes were hashed so far, including the `pending` ones.
+    length: u64,
+    pending: [u8; 8],
+    pending_length: usize
+}
+
+impl HashState {
+    fn new() -> Self {
+        HashState {
+            hash: SEED,
+            length: 0,
+            pending: [0; 8],
+            pending_length: 0
+        }
+    }
+
+    fn update( &mut self, mut bytes: &[u8] ) {
+        self.length += bytes.len() as u64;
+        if self.pending_length != 0 {
+            let count = cmp::min( 8 - self.pending_length, bytes.len() );
+            self.pending[ self.pending_length..self.pending_length + count ].copy_from_slice( &bytes[ ..count ] );
+            self.pending_length += count;
+            bytes = &bytes[ count.. ];
+            if self.pending_length < 8 {
+                return;
+            }
+
+            self.hash = mix( self.hash, u64::from_le_bytes( self.pending ) );
+            self.pending_length = 0;
+        }
+
+        let mut words = bytes.chunks_exact( 8 );
+        for word in &mut words {
+            self.hash = mix( self.hash, u64::from_le_bytes( word.try_into().unwrap() ) );
+        }
+
+        let remainder = words.remainder();
+        self.pending[ ..remainder.len() ].copy_from_slice( remainder );
+        self.pending_length = remainder.len();
+    }
+
+    /// Hashes zeros up until the given `length`.
+    fn skip_to( &mut self, length: u64 ) {
+        while self.length < length {
+            let count = cmp::min( length - self.length, ZEROS.len() as u64 ) as usize;
+            self.update( &ZEROS[ ..count ] );
+        }
+    }
+
+    fn finish( mut self ) -> u64 {
+        if self.pending_length != 0 {
+            self.pending[ self.pending_length.. ].fill( 0 );
+            self.hash = mix( self.hash, u64::from_le_bytes( self.pending ) );
+        }
+
+        mix( self.hash, self.length )
+    }
+}
+
+struct HashedAllocation {
+    pointer: u64,
+    end: u64,
+    id: AllocationId,
+    state: HashState
+}
+
+/// Hashes the contents of the given allocations out of the chunks of a memory dump.
+pub(crate) struct ContentHasher {
+    /// Sorted by their address.
+    allocations: Vec< HashedAllocation >
+}
+
+impl ContentHasher {
+    /// Expects the `(pointer, size, id)` of every allocation which was alive when the dump was made;
+    /// those can't overlap.
+    pub fn new( allocations: Vec< (u64, u64, AllocationId) > ) -> Self {
+        let mut allocations: Vec< _ > = allocations.into_iter().map( |(pointer, size, id)| HashedAllocation {
+            pointer,
+            end: pointer + size,
+            id,
+            state: HashState::new()
+        }).collect();
+
+        allocations.par_sort_unstable_by_key( |allocation| allocation.pointer );
+        ContentHasher { allocations }
+    }
+
+    /// Hashes the parts of the allocations which are within the given chunk; the chunks have to be fed in order.
+    pub fn feed( &mut self, address: u64, data: &[u8] ) {
+        let end_address = address + data.len() as u64;
+        let start = self.allocations.partition_point( |allocation| allocation.end <= address );
+        let end = start + self.allocations[ start.. ].partition_point( |allocation| allocation.pointer < end_address );
+        self.allocations[ start..end ].par_iter_mut().with_min_len( 64 ).for_each( |allocation| {
+            let from = cmp::max( allocation.pointer, address );
+            let to = cmp::min( allocation.end, end_address );
+            let offset = from - allocation.pointer;
+            if offset < allocation.state.length {
+                // The chunks came out of order, so the hash would be wrong anyway.
+                return;
+            }
+
+            allocation.state.skip_to( offset );
+            allocation.state.update( &data[ (from - address) as usize..(to - address) as usize ] );
+        });
+    }
+
+    /// Returns the IDs of the allocations, sorted, and the hashes of their contents.
+    pub fn finish( self ) -> (Vec< AllocationId >, Vec< u64 >) {
+        let mut hashes: Vec< _ > = self.allocations.into_par_iter().map( |allocation| {
+            let mut state = allocation.state;
+            state.skip_to( allocation.end - allocation.pointer );
+            (allocation.id, state.finish())
+        }).collect();
+
+        hashes.par_sort_unstable_by_key( |&(id, _)| id );
+        hashes.into_iter().unzip()
+    }
+}
+
+/// A group of allocations whose contents were identical when a memory dump was made.
+#[derive(Clone, Debug)]
+pub struct DuplicateGroup {
+    /// The size of each of the copies.
+    pub size: u64,
+    pub count: u64,
+    /// How much memory would be saved if only a single one of the copies was kept.
+    pub wasted_size: u64,
+    /// The backtraces which made the copies and how many each of them made, the most frequent first.
+    pub backtraces: Vec< (BacktraceId, u64) >,
+    /// Every one of the copies, sorted.
+    pub allocation_ids: Vec< AllocationId >
+}
+
+/// Finds the groups of the given allocations which had identical contents when the `dump` was made,
+/// with the groups which waste the most memory first.
+///
+/// Only the allocations which were alive at that time are taken into account, and the sampled ones
+/// and those made from pools were never hashed in the first place.
+pub fn find_duplicates( data: &Data, ids: &[AllocationId], dump: &MemoryDump ) -> Vec< DuplicateGroup > {
+    let mut selected = ids.to_vec();
+    selected.par_sort_unstable();
+
+    let mut entries: Vec< (u64, u64, AllocationId) > = dump.allocation_ids.par_iter().zip( dump.content_hashes.par_iter() ).filter_map( |(&id, &hash)| {
+        selected.binary_search( &id ).ok()?;
+        Some( (data.get_allocation( id ).size, hash, id) )
+    }).collect();
+
+    std::mem::drop( selected );
+    entries.par_sort_unstable();
+
+    let mut ranges = Vec::new();
+    let mut offset = 0;
+    for index in 1..=entries.len() {
+        if index == entries.len() || entries[ index ].0 != entries[ offset ].0 || entries[ index ].1 != entries[ offset ].1 {
+            if index - offset > 1 {
+                ranges.push( offset..index );
+            }
+            offset = index;
+        }
+    }
+
+    let entries = &entries;
+    let mut groups: Vec< _ > = ranges.into_par_iter().map( |range| {
+        let group = &entries[ range ];
+        let mut backtraces: HashMap< BacktraceId, u64 > = HashMap::new();
+        let mut total_size = 0;
+        let mut min_size = u64::MAX;
+        for &(_, _, id) in group {
+            let allocation = data.get_allocation( id );
+            *backtraces.entry( allocation.backtrace ).or_insert( 0 ) += 1;
+            total_size += allocation.usable_size();
+            min_size = cmp::min( min_size, allocation.usable_size() );
+        }
+
+        let mut backtraces: Vec< _ > = backtraces.into_iter().collect();
+        backtraces.sort_unstable_by( |lhs, rhs| rhs.1.cmp( &lhs.1 ).then( lhs.0.cmp( &rhs.0 ) ) );
+
+        DuplicateGroup {
+            size: group[ 0 ].0,
+            count: group.len() as u64,
+            wasted_size: total_size - min_size,
+            backtraces,
+            // These are already sorted since the sizes and the hashes are the same.
+            allocation_ids: group.iter().map( |&(_, _, id)| id ).collect()
+        }
+    }).collect();
+
+    groups.par_sort_unstable_by( |lhs, rhs| rhs.wasted_size.cmp( &lhs.wasted_size ).then( rhs.size.cmp( &lhs.size ) ).then( lhs.allocation_ids.cmp( &rhs.allocation_ids ) ) );
+    groups
+}
+
+#[test]
+fn test_content_hasher() {
+    let mut hasher = ContentHasher::new( vec![
+        (0x1000, 24, AllocationId::new( 2 )),
+        (0x2000, 24, AllocationId::new( 1 )),
+        (0x3000, 0x2000, AllocationId::new( 3 )),
+        (0x6000, 0x2000, AllocationId::new( 4 )),
+        (0x9000, 5, AllocationId::new( 5 )),
+        (0xa000, 5, AllocationId::new( 6 ))
+    ]);
+
+    let mut page = vec![ 0; 0x1000 ];
+    page[ 0..24 ].copy_from_slice( b"Hello world! Hello you!!" );
+
+    // The same contents, but split at a different point.
+    hasher.feed( 0x1000, &page[ ..12 ] );
+    hasher.feed( 0x100c, &page[ 12.. ] );
+    hasher.feed( 0x2000, &page );
+
+    // The same page, but at the start of one and at the end of the other.
+    let mut page = vec![ 0; 0x1000 ];
+    page[ 0 ] = 1;
+    hasher.feed( 0x3000, &page );
+    hasher.feed( 0x7000, &page );
+
+    // The same as above, but shorter than a single word and different.
+    hasher.feed( 0x9000, b"abcde" );
+    hasher.feed( 0xa000, b"abcdf" );
+
+    let (ids, hashes) = hasher.finish();
+    assert_eq!( ids, (1..=6).map( AllocationId::new ).collect::< Vec< _ > >() );
+    assert_eq!( hashes[ 0 ], hashes[ 1 ] );
+    assert_ne!( hashes[ 2 ], hashes[ 3 ] );
+    assert_ne!( hashes[ 4 ], hashes[ 5 ] );
+    assert_ne!( hashes[ 0 ], hashes[ 4 ] );
+
+    // A buffer which was never dumped at all was all zeros.
+    let mut hasher = ContentHasher::new( vec![
+        (0x1000, 0x2000, AllocationId::new( 1 )),
+        (0x4000, 0x2000, AllocationId::new( 2 ))
+    ]);
+
+    hasher.feed( 0x4000, &vec![ 0; 0x1000 ] );
+    let (_, hashes) = hasher.finish();
+    assert_eq!( hashes[ 0 ], hashes[ 1 ] );
+}
@@ -0,0 +1,115 @@
+//! Off-heap storage of the binaries which were embedded in the data.
+//!
+//! The `Event::File`s can carry whole binaries, and keeping their contents on the heap while the data
+//! is being loaded makes every one of them resident until the loader is done. So instead each binary
+//! is written out into its own unlinked temporary file and mapped back read-only, which lets the kernel
+//! drop its pages whenever it wants to and fault them back in only when they're needed for symbolication.
+//!
+//! The mapped binaries are shared through their build IDs, so when multiple datasets of the same
+//! program are loaded they're only ever stored once, and they're unmapped as soon as nothing uses them.
+
+use std::fs::OpenOptions;
+use std::io::{self, Write};
+use std::path::PathBuf;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use nwind::BinaryData;
+use parking_lot::Mutex;
+
+use crate::column::Mapping;
+
+struct Entry {
+    // This has to be dropped before the `mapping`.
+    binary_data: Arc< BinaryData >,
+    mapping: Mapping
+}
+
+impl Entry {
+    fn is_unused( &self ) -> bool {
+        Arc::strong_count( &self.binary_data ) == 1
+    }
+}
+
+static EMBEDDED_BINARIES: Mutex< Vec< Entry > > = parking_lot::const_mutex( Vec::new() );
+
+fn temporary_path() -> PathBuf {
+    static COUNTER: AtomicUsize = AtomicUsize::new( 0 );
+    let nth = COUNTER.fetch_add( 1, Ordering::Relaxed );
+    std::env::temp_dir().join( format!( "bytehound-binary-{}-{}", std::process::id(), nth ) )
+}
+
+fn spill( contents: &[u8] ) -> io::Result< Mapping > {
+    let path = temporary_path();
+    let mut fp = OpenOptions::new().read( true ).write( true ).create_new( true ).open( &path )?;
+
+    // Nothing else needs the file by its path, so its space is freed as soon as it's unmapped.
+    let _ = std::fs::remove_file( &path );
+
+    fp.write_all( contents )?;
+    Mapping::new( &fp )
+}
+
+/// Loads a binary embedded in the data, reusing an already mapped one with the same name and build ID if there is one.
+pub fn load( path: &str, contents: &[u8] ) -> io::Result< Arc< BinaryData > > {
+    let mapping = spill( contents )?;
+
+    // The `Entry` keeps the mapping alive for as long as anything still holds a reference to the `BinaryData`.
+    let slice: &'static [u8] = unsafe { std::mem::transmute::< &[u8], &'static [u8] >( mapping.as_slice() ) };
+    let binary_data = BinaryData::load_from_static_slice( path, slice )?;
+
+    let mut binaries = EMBEDDED_BINARIES.lock();
+    binaries.retain( |entry| !entry.is_unused() );
+
+    if let Some( build_id ) = binary_data.build_id() {
+        let existing = binaries.iter().find( |entry| {
+            entry.binary_data.build_id() == Some( build_id ) &&
+            entry.binary_data.name() == path &&
+            entry.mapping.as_slice().len() == contents.len()
+        });
+
+        if let Some( entry ) = existing {
+            return Ok( entry.binary_data.clone() );
+        }
+    }
+
+    let binary_data = Arc::new( binary_data );
+    binaries.push( Entry {
+        binary_data: binary_data.clone(),
+        mapping
+    });
+
+    Ok( binary_data )
+}
+
+/// Unmaps every binary which isn't used anymore.
+pub fn release_unused() {
+    EMBEDDED_BINARIES.lock().retain( |entry| !entry.is_unused() );
+}
+
+/// Returns how many binaries are currently mapped and their total size.
+pub fn mapped_size() -> (usize, usize) {
+    let binaries = EMBEDDED_BINARIES.lock();
+    (binaries.len(), binaries.iter().map( |entry| entry.mapping.as_slice().len() ).sum())
+}
+
+#[test]
+fn test_embedded_binaries_are_shared() {
+    let contents = std::fs::read( std::env::current_exe().unwrap() ).unwrap();
+    let first = load( "/usr/bin/test", &contents ).unwrap();
+    let second = load( "/usr/bin/test", &contents ).unwrap();
+    let other = load( "/usr/bin/other", &contents ).unwrap();
+    assert_eq!( Arc::ptr_eq( &first, &second ), first.build_id().is_some() );
+    assert!( !Arc::ptr_eq( &first, &other ) );
+    assert_eq!( first.name(), "/usr/bin/test" );
+
+    std::mem::drop( second );
+    std::mem::drop( other );
+    release_unused();
+    assert!( EMBEDDED_BINARIES.lock().iter().any( |entry| Arc::ptr_eq( &entry.binary_data, &first ) ) );
+
+    let weak = Arc::downgrade( &first );
+    std::mem::drop( first );
+    release_unused();
+    assert!( weak.upgrade().is_none() );
+}
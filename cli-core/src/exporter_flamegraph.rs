@@ -12,7 +12,7 @@ use super::{
 use crate::exporter_flamegraph_pl::dump_collation;
 use crate::io_adapter::IoAdapter;
 
-pub fn lines_to_svg( lines: Vec< String >, output: impl fmt::Write ) {
+pub fn lines_to_svg< 'a >( lines: impl IntoIterator< Item = &'a str >, output: impl fmt::Write ) {
     lazy_static::lazy_static! {
         pub static ref PALETTE_MAP: Mutex< flamegraph::color::PaletteMap > = Mutex::new( flamegraph::color::PaletteMap::default() );
     }
@@ -31,21 +31,22 @@ pub fn lines_to_svg( lines: Vec< String >, output: impl fmt::Write ) {
 
     // We explicitly ignore the error to prevent a panic in case
     // we didn't match any allocations.
-    let _ = flamegraph::from_lines( &mut options, lines.iter().map( |line| line.as_str() ), IoAdapter::new( output ) );
+    let _ = flamegraph::from_lines( &mut options, lines, IoAdapter::new( output ) );
 }
 
 pub fn export_as_flamegraph< T, F >( data: &Data, output: T, filter: F )
     where T: fmt::Write,
-          F: Fn( AllocationId, &Allocation ) -> bool
+          F: Fn( AllocationId, &Allocation ) -> bool + Sync
 {
-    let mut lines = Vec::new();
+    // Every line goes into a single buffer instead of its own `String`;
+    // the lines don't have to be sorted since the flamegraph generator does that anyway.
+    let mut buffer = String::new();
     dump_collation( data, filter, |line| {
-        lines.push( line.to_owned() );
+        buffer.push_str( line );
+        buffer.push( '\n' );
         let result: Result< (), () > = Ok(());
         result
     }).unwrap();
 
-    lines.sort_unstable();
-
-    lines_to_svg( lines, output )
+    lines_to_svg( buffer.lines(), output )
 }
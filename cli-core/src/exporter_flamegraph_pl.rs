@@ -4,12 +4,18 @@ use super::{
     Data,
     Frame,
     FrameId,
+    Node,
     NodeId,
     Tree
 };
 
 use std::fmt::{self, Write};
 
+use rayon::prelude::*;
+
+use crate::backtrace_trie::ROOT;
+use crate::data::Timestamp;
+
 fn dump_collation_impl< O: FnMut( &str ) -> Result< (), E >, K: PartialEq + Clone, E >(
     data: &Data,
     tree: &Tree< K, &Frame >,
@@ -71,14 +77,141 @@ pub fn dump_collation_from_iter< 'a, O, E >(
     dump_collation_impl( data, &tree, 0, &mut Vec::new(), &mut Vec::new(), &mut output )
 }
 
-pub fn dump_collation< F, O, E >( data: &Data, filter: F, output: O ) -> Result< (), E >
-    where F: Fn( AllocationId, &Allocation ) -> bool,
+#[derive(Clone)]
+struct NodeTotals {
+    count: u64,
+    size: u64,
+    first_timestamp: Timestamp,
+    last_timestamp: Timestamp,
+    self_count: u64,
+    self_size: u64,
+    /// The lowest ID of a backtrace which goes through this node.
+    first_backtrace: u32
+}
+
+impl NodeTotals {
+    fn merge( &mut self, other: &NodeTotals ) {
+        self.count += other.count;
+        self.size += other.size;
+        self.first_timestamp = std::cmp::min( self.first_timestamp, other.first_timestamp );
+        self.last_timestamp = std::cmp::max( self.last_timestamp, other.last_timestamp );
+        self.first_backtrace = std::cmp::min( self.first_backtrace, other.first_backtrace );
+    }
+
+    fn apply< K, V >( &self, node: &mut Node< K, V > ) {
+        node.total_count = self.count;
+        node.total_size = self.size;
+        node.total_first_timestamp = self.first_timestamp;
+        node.total_last_timestamp = self.last_timestamp;
+        node.self_count = self.self_count;
+        node.self_size = self.self_size;
+    }
+}
+
+/// Builds a tree out of every allocation which matches the `filter`.
+///
+/// The allocations are filtered and grouped by their backtraces in parallel,
+/// and then their totals are summed up over the backtrace trie, so every frame
+/// which is shared by multiple backtraces is only visited once.
+fn collate< F >( data: &Data, filter: F ) -> Tree< FrameId, &Frame >
+    where F: Fn( AllocationId, &Allocation ) -> bool + Sync
+{
+    let ids: Vec< _ > = data.allocations.par_iter().enumerate()
+        .map( |(index, allocation)| (AllocationId::new( index as _ ), allocation) )
+        .filter( |(id, allocation)| filter( *id, allocation ) )
+        .map( |(id, _)| id )
+        .collect();
+
+    let groups = data.group_by_backtrace( &ids );
+    let columns = &data.allocation_columns;
+    let totals: Vec< _ > = groups.par_iter().map( |(&backtrace, ids)| {
+        let mut size = 0;
+        let mut first_timestamp = Timestamp::max();
+        let mut last_timestamp = Timestamp::min();
+        for id in ids {
+            let timestamp = columns.timestamps[ id.raw() as usize ];
+            size += columns.sizes[ id.raw() as usize ];
+            first_timestamp = std::cmp::min( first_timestamp, timestamp );
+            last_timestamp = std::cmp::max( last_timestamp, timestamp );
+        }
+
+        (backtrace, ids.len() as u64, size, first_timestamp, last_timestamp)
+    }).collect();
+
+    let trie = data.backtrace_trie();
+    let empty = NodeTotals {
+        count: 0,
+        size: 0,
+        first_timestamp: Timestamp::max(),
+        last_timestamp: Timestamp::min(),
+        self_count: 0,
+        self_size: 0,
+        first_backtrace: u32::MAX
+    };
+
+    let mut root = empty.clone();
+    let mut nodes = vec![ empty; trie.len() ];
+    for (backtrace, count, size, first_timestamp, last_timestamp) in totals {
+        let leaf = trie.leaf( backtrace );
+        let node = if leaf == ROOT { &mut root } else { &mut nodes[ leaf as usize ] };
+        node.self_count += count;
+        node.self_size += size;
+        node.merge( &NodeTotals {
+            count,
+            size,
+            first_timestamp,
+            last_timestamp,
+            self_count: 0,
+            self_size: 0,
+            first_backtrace: backtrace.raw()
+        });
+    }
+
+    // Every node comes after its parent, so going backwards sums up the children before their parents.
+    for index in (0..nodes.len()).rev() {
+        if nodes[ index ].count == 0 {
+            continue;
+        }
+
+        let node = nodes[ index ].clone();
+        match trie.parent( index as u32 ) {
+            ROOT => root.merge( &node ),
+            parent => nodes[ parent as usize ].merge( &node )
+        }
+    }
+
+    // Add the nodes in the same order as if the backtraces were added one by one.
+    let mut order: Vec< u32 > = (0..nodes.len() as u32).filter( |&index| nodes[ index as usize ].count != 0 ).collect();
+    order.sort_unstable_by_key( |&index| (nodes[ index as usize ].first_backtrace, index) );
+
+    let mut tree = Tree::new();
+    root.apply( tree.get_node_mut( 0 ) );
+
+    let mut tree_ids: Vec< NodeId > = vec![ 0; nodes.len() ];
+    for index in order {
+        let parent = match trie.parent( index ) {
+            ROOT => 0,
+            parent => tree_ids[ parent as usize ]
+        };
+
+        let frame_id = trie.frame( index );
+        let node_id = tree.push_child( parent, frame_id, data.get_frame( frame_id ) );
+        nodes[ index as usize ].apply( tree.get_node_mut( node_id ) );
+        tree_ids[ index as usize ] = node_id;
+    }
+
+    tree
+}
+
+pub fn dump_collation< F, O, E >( data: &Data, filter: F, mut output: O ) -> Result< (), E >
+    where F: Fn( AllocationId, &Allocation ) -> bool + Sync,
           O: FnMut( &str ) -> Result< (), E >
 {
-    dump_collation_from_iter( data, data.allocations_with_id().filter( |(id, allocation)| filter( *id, allocation ) ), output )
+    let tree = collate( data, filter );
+    dump_collation_impl( data, &tree, 0, &mut Vec::new(), &mut Vec::new(), &mut output )
 }
 
-pub fn export_as_flamegraph_pl< T: fmt::Write, F: Fn( AllocationId, &Allocation ) -> bool >( data: &Data, mut output: T, filter: F ) -> fmt::Result {
+pub fn export_as_flamegraph_pl< T: fmt::Write, F: Fn( AllocationId, &Allocation ) -> bool + Sync >( data: &Data, mut output: T, filter: F ) -> fmt::Result {
     dump_collation( data, filter, |line| {
         writeln!( &mut output, "{}", line )
     })
@@ -1,45 +1,26 @@
-use std::io;
-use std::fmt;
-use std::collections::HashMap;
+use std::io::{self, Write};
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
 
 use super::{
     Allocation,
     AllocationId,
     BacktraceId,
-    CodePointer,
     Data,
-    Frame,
+    FrameId,
     StringId,
     Timestamp,
     Operation
 };
 
-use crate::io_adapter::IoAdapter;
+/// How many lines of a table are formatted at a time by a single thread.
+const LINES_PER_CHUNK: usize = 4096;
 
 #[derive(PartialEq, Eq, Hash)]
 struct AllocInfo {
     size: u64,
-    backtrace: usize
-}
-
-struct Child {
-    ip_index: usize,
-    trace_node_index: usize
-}
-
-struct TraceNode {
-    children: Vec< Child >
-}
-
-pub struct HeaptrackExporter< 'a, T: fmt::Write > {
-    alloc_info_to_index: HashMap< AllocInfo, usize >,
-    backtrace_to_index: HashMap< BacktraceId, usize >,
-    ip_to_index: HashMap< CodePointer, usize >,
-    string_map: HashMap< StringId, usize >,
-    trace_tree: Vec< TraceNode >,
-    tx: T,
-    data: &'a Data,
-    last_elapsed: Timestamp
+    backtrace: u32
 }
 
 /*
@@ -60,198 +41,264 @@ pub struct HeaptrackExporter< 'a, T: fmt::Write > {
         i <address> <module_name_index> [<function_name_index>] [<file_name_index> <line>] [for each inlined frame: <function_name_index> <file_name_index> <line>]...
       String:
         s <string>
-*/
-
-impl< 'a, T: fmt::Write > HeaptrackExporter< 'a, T > {
-    fn new( data: &'a Data, mut tx: T ) -> Result< Self, fmt::Error > {
-        writeln!( tx, "v 10100 2" )?;
-        writeln!( tx, "X {}", data.executable() )?;
 
-        let exporter = HeaptrackExporter {
-            alloc_info_to_index: HashMap::new(),
-            backtrace_to_index: HashMap::new(),
-            ip_to_index: HashMap::new(),
-            string_map: HashMap::new(),
-            trace_tree: vec![ TraceNode {
-                children: Vec::new()
-            }],
-            tx,
-            data,
-            last_elapsed: Timestamp::min()
-        };
-
-        Ok( exporter )
-    }
+    Every table is indexed implicitly by the order in which its entries are written,
+    so the strings, IPs and traces can all be written out up front, before the events.
+*/
 
-    fn emit_timestamp( &mut self, timestamp: Timestamp ) -> Result< (), fmt::Error > {
-        let elapsed = timestamp - self.data.initial_timestamp();
-        if self.last_elapsed != elapsed {
-            writeln!( self.tx, "c {:x}", elapsed.as_msecs() )?;
-            self.last_elapsed = elapsed;
+#[inline]
+fn write_hex( output: &mut Vec< u8 >, mut value: u64 ) {
+    const DIGITS: &[u8; 16] = b"0123456789abcdef";
+
+    let mut buffer = [0; 16];
+    let mut position = buffer.len();
+    loop {
+        position -= 1;
+        buffer[ position ] = DIGITS[ (value & 0xf) as usize ];
+        value >>= 4;
+        if value == 0 {
+            break;
         }
-
-        Ok(())
     }
 
-    fn get_size( &self, allocation: &Allocation ) -> u64 {
-        allocation.size + allocation.extra_usable_space as u64
-    }
+    output.extend_from_slice( &buffer[ position.. ] );
+}
 
-    pub fn handle_alloc( &mut self, allocation: &Allocation ) -> Result< (), fmt::Error > {
-        let alloc_info = AllocInfo {
-            size: self.get_size( allocation ),
-            backtrace: self.resolve_backtrace( allocation.backtrace )?
-        };
+#[inline]
+fn write_line( output: &mut Vec< u8 >, kind: u8, values: &[u64] ) {
+    output.push( kind );
+    for &value in values {
+        output.push( b' ' );
+        write_hex( output, value );
+    }
+    output.push( b'\n' );
+}
 
-        self.emit_timestamp( allocation.timestamp )?;
+/// Formats the lines for the `items` in parallel and writes them out in order.
+fn write_table< W, T, F >( fp: &mut W, items: &[T], format: F ) -> io::Result< () >
+    where W: Write,
+          T: Sync,
+          F: Fn( &mut Vec< u8 >, &T ) + Sync
+{
+    // Only format a limited number of chunks at a time to keep the memory usage bounded.
+    let batch_size = LINES_PER_CHUNK * rayon::current_num_threads() * 2;
+    for batch in items.chunks( batch_size ) {
+        let chunks: Vec< Vec< u8 > > = batch.par_chunks( LINES_PER_CHUNK ).map( |chunk| {
+            let mut output = Vec::new();
+            for item in chunk {
+                format( &mut output, item );
+            }
+            output
+        }).collect();
 
-        let alloc_info_index = self.resolve_alloc_info( alloc_info )?;
-        writeln!( self.tx, "+ {:x}", alloc_info_index )
+        for chunk in chunks {
+            fp.write_all( &chunk )?;
+        }
     }
 
-    pub fn handle_dealloc( &mut self, allocation: &Allocation ) -> Result< (), fmt::Error > {
-        let alloc_info = AllocInfo {
-            size: self.get_size( allocation ),
-            backtrace: self.resolve_backtrace( allocation.backtrace )?
-        };
+    Ok(())
+}
 
-        self.emit_timestamp( allocation.timestamp )?;
+/// The frames of a backtrace which are exported, from the outermost to the innermost.
+fn exported_frames< 'a >( data: &'a Data, backtrace_id: BacktraceId ) -> impl Iterator< Item = FrameId > + 'a {
+    let frame_ids = data.get_frame_ids( backtrace_id );
 
-        let alloc_info_index = self.alloc_info_to_index.get( &alloc_info ).unwrap();
-        writeln!( self.tx, "- {:x}", alloc_info_index )
-    }
+    // The innermost frame is skipped; it's always in the allocator itself.
+    frame_ids.iter().skip( 1 ).rev().copied().filter( move |&frame_id| !data.get_frame( frame_id ).is_inline() )
+}
 
-    fn resolve_backtrace( &mut self, backtrace_id: BacktraceId ) -> Result< usize, fmt::Error > {
-        if let Some( &index ) = self.backtrace_to_index.get( &backtrace_id ) {
-            return Ok( index );
-        }
+pub struct HeaptrackExporter< 'a, W: Write > {
+    alloc_info_to_index: HashMap< AllocInfo, usize >,
+    /// The index of the trace of every backtrace, indexed by `BacktraceId`.
+    backtrace_to_trace: Vec< u32 >,
+    fp: W,
+    line: Vec< u8 >,
+    data: &'a Data,
+    last_elapsed: Timestamp
+}
 
-        let mut parent_trace_index = 0;
-        let frame_ids = self.data.get_frame_ids( backtrace_id );
-        if frame_ids.is_empty() {
-            warn!( "Empty backtrace with ID = {:?}", backtrace_id );
-            return Ok( 0 );
-        }
+impl< 'a, W: Write > HeaptrackExporter< 'a, W > {
+    fn new( data: &'a Data, mut fp: W, used_backtraces: &[BacktraceId] ) -> io::Result< Self > {
+        writeln!( fp, "v 10100 2" )?;
+        writeln!( fp, "X {}", data.executable() )?;
+
+        // Gather every frame which will have to be emitted, deduplicated by the address.
+        let mut frames: Vec< FrameId > = used_backtraces.par_iter().flat_map_iter( |&backtrace_id| exported_frames( data, backtrace_id ) ).collect();
+        frames.par_sort_unstable_by_key( |&frame_id| data.get_frame( frame_id ).address().raw() );
+        frames.dedup_by_key( |frame_id| data.get_frame( *frame_id ).address().raw() );
+
+        let mut strings: Vec< StringId > = frames.par_iter().flat_map_iter( |&frame_id| {
+            let frame = data.get_frame( frame_id );
+            let source = if frame.line().is_some() { frame.source() } else { None };
+            frame.library().into_iter().chain( frame.function().or( frame.raw_function() ) ).chain( source )
+        }).collect();
+        strings.par_sort_unstable();
+        strings.dedup();
+
+        // Zero is reserved for an unknown string and an unknown IP.
+        let string_index = |id: StringId| strings.binary_search( &id ).unwrap() as u64 + 1;
+        let ip_index = |frame_id: FrameId| {
+            let address = data.get_frame( frame_id ).address().raw();
+            frames.binary_search_by_key( &address, |&frame_id| data.get_frame( frame_id ).address().raw() ).unwrap() as u32 + 1
+        };
 
-        let mut i = frame_ids.len() - 1;
-        while i > 0 {
-            let frame = self.data.get_frame( frame_ids[ i ] );
-            if frame.is_inline() {
-                i -= 1;
+        write_table( &mut fp, &strings, |output, &id| {
+            output.extend_from_slice( b"s " );
+            output.extend_from_slice( data.interner().resolve( id ).unwrap().as_bytes() );
+            output.push( b'\n' );
+        })?;
+
+        write_table( &mut fp, &frames, |output, &frame_id| {
+            let frame = data.get_frame( frame_id );
+            let module_name_index = frame.library().map( string_index ).unwrap_or( 0 );
+            output.extend_from_slice( b"i " );
+            write_hex( output, frame.address().raw() );
+            output.push( b' ' );
+            write_hex( output, module_name_index );
+            if let Some( id ) = frame.function().or( frame.raw_function() ) {
+                output.push( b' ' );
+                write_hex( output, string_index( id ) );
+                if let (Some( id ), Some( line )) = (frame.source(), frame.line()) {
+                    output.push( b' ' );
+                    write_hex( output, string_index( id ) );
+                    output.push( b' ' );
+                    write_hex( output, line as u64 );
+                }
+            }
+            output.push( b'\n' );
+        })?;
+
+        // The IPs of every backtrace can be looked up in parallel; only building the tree is sequential.
+        let ips_for_backtrace: Vec< Vec< u32 > > = used_backtraces.par_iter().map( |&backtrace_id| {
+            exported_frames( data, backtrace_id ).map( ip_index ).collect()
+        }).collect();
+
+        let mut backtrace_to_trace = vec![ 0; data.backtraces.len() ];
+        let mut children: HashMap< (u32, u32), u32 > = HashMap::new();
+        let mut line = Vec::new();
+        for (&backtrace_id, ips) in used_backtraces.iter().zip( ips_for_backtrace ) {
+            if data.get_frame_ids( backtrace_id ).is_empty() {
+                warn!( "Empty backtrace with ID = {:?}", backtrace_id );
                 continue;
             }
 
-            i -= 1;
+            let mut parent = 0;
+            for ip in ips {
+                let next = children.len() as u32 + 1;
+                parent = *children.entry( (parent, ip) ).or_insert_with( || {
+                    write_line( &mut line, b't', &[ip as u64, parent as u64] );
+                    next
+                });
+            }
 
-            let ip_index = self.resolve_ip( frame )?;
-            if let Some( child ) = self.trace_tree[ parent_trace_index ].children.iter().find( |child| child.ip_index == ip_index ) {
-                parent_trace_index = child.trace_node_index;
-                continue;
+            if line.len() >= 64 * 1024 {
+                fp.write_all( &line )?;
+                line.clear();
             }
 
-            let trace_node_index = self.trace_tree.len();
-            self.trace_tree.push( TraceNode {
-                children: Vec::new()
-            });
+            backtrace_to_trace[ backtrace_id.raw() as usize ] = parent;
+        }
 
-            self.trace_tree[ parent_trace_index ].children.push( Child {
-                ip_index,
-                trace_node_index
-            });
+        fp.write_all( &line )?;
+        line.clear();
 
-            writeln!( self.tx, "t {:x} {:x}", ip_index, parent_trace_index )?;
-            parent_trace_index = trace_node_index;
-        }
+        let exporter = HeaptrackExporter {
+            alloc_info_to_index: HashMap::new(),
+            backtrace_to_trace,
+            fp,
+            line,
+            data,
+            last_elapsed: Timestamp::min()
+        };
 
-        self.backtrace_to_index.insert( backtrace_id, parent_trace_index );
-        Ok( parent_trace_index )
+        Ok( exporter )
     }
 
-    fn resolve_ip( &mut self, frame: &Frame ) -> Result< usize, fmt::Error > {
-        let address = frame.address();
-        if let Some( &index ) = self.ip_to_index.get( &address ) {
-            return Ok( index );
-        }
-
-        let module_name_index;
-        if let Some( library_id ) = frame.library() {
-            module_name_index = self.resolve_string( library_id )?;
-        } else {
-            module_name_index = 0;
+    fn flush_if_necessary( &mut self ) -> io::Result< () > {
+        if self.line.len() >= 64 * 1024 {
+            self.flush()?;
         }
 
-        let function_name_index;
-        let source;
+        Ok(())
+    }
 
-        if let Some( id ) = frame.function().or( frame.raw_function() ) {
-            function_name_index = Some( self.resolve_string( id )? );
-        } else {
-            function_name_index = None;
-        };
+    fn flush( &mut self ) -> io::Result< () > {
+        self.fp.write_all( &self.line )?;
+        self.line.clear();
+        Ok(())
+    }
 
-        match (frame.source(), frame.line()) {
-            (Some( id ), Some( line )) => {
-                let index = self.resolve_string( id )?;
-                source = Some( (index, line) );
-            },
-            _ => {
-                source = None;
-            }
+    fn emit_timestamp( &mut self, timestamp: Timestamp ) {
+        let elapsed = timestamp - self.data.initial_timestamp();
+        if self.last_elapsed != elapsed {
+            write_line( &mut self.line, b'c', &[elapsed.as_msecs()] );
+            self.last_elapsed = elapsed;
         }
+    }
 
-        write!( self.tx, "i {:x} {:x}", frame.address().raw(), module_name_index )?;
-        if let Some( index ) = function_name_index {
-            write!( self.tx, " {:x}", index )?;
+    fn get_size( &self, allocation: &Allocation ) -> u64 {
+        allocation.size + allocation.extra_usable_space as u64
+    }
 
-            if let Some( (index, line) ) = source {
-                write!( self.tx, " {:x} {:x}", index, line )?;
-            }
+    fn alloc_info( &self, allocation: &Allocation ) -> AllocInfo {
+        AllocInfo {
+            size: self.get_size( allocation ),
+            backtrace: self.backtrace_to_trace[ allocation.backtrace.raw() as usize ]
         }
+    }
 
-        writeln!( self.tx, "" )?;
-
-        let index = self.ip_to_index.len() + 1;
-        self.ip_to_index.insert( address, index );
+    pub fn handle_alloc( &mut self, allocation: &Allocation ) -> io::Result< () > {
+        let alloc_info = self.alloc_info( allocation );
+        self.emit_timestamp( allocation.timestamp );
 
-        Ok( index )
+        let alloc_info_index = self.resolve_alloc_info( alloc_info );
+        write_line( &mut self.line, b'+', &[alloc_info_index as u64] );
+        self.flush_if_necessary()
     }
 
-    fn resolve_string( &mut self, string_id: StringId ) -> Result< usize, fmt::Error > {
-        if let Some( &index ) = self.string_map.get( &string_id ) {
-            return Ok( index );
-        }
-
-        writeln!( self.tx, "s {}", self.data.interner().resolve( string_id ).unwrap() )?;
+    pub fn handle_dealloc( &mut self, allocation: &Allocation ) -> io::Result< () > {
+        let alloc_info = self.alloc_info( allocation );
+        self.emit_timestamp( allocation.timestamp );
 
-        let index = self.string_map.len() + 1;
-        self.string_map.insert( string_id, index );
-        Ok( index )
+        let alloc_info_index = *self.alloc_info_to_index.get( &alloc_info ).unwrap();
+        write_line( &mut self.line, b'-', &[alloc_info_index as u64] );
+        self.flush_if_necessary()
     }
 
-    fn resolve_alloc_info( &mut self, alloc_info: AllocInfo ) -> Result< usize, fmt::Error > {
-        let alloc_info_index = self.alloc_info_to_index.get( &alloc_info ).cloned();
-        let alloc_info_index = match alloc_info_index {
-            Some( value ) => value,
-            None => {
-                writeln!( self.tx, "a {:x} {:x}", alloc_info.size, alloc_info.backtrace )?;
-
-                let index = self.alloc_info_to_index.len();
-                self.alloc_info_to_index.insert( alloc_info, index );
+    fn resolve_alloc_info( &mut self, alloc_info: AllocInfo ) -> usize {
+        if let Some( &index ) = self.alloc_info_to_index.get( &alloc_info ) {
+            return index;
+        }
 
-                index
-            }
-        };
+        write_line( &mut self.line, b'a', &[alloc_info.size, alloc_info.backtrace as u64] );
 
-        Ok( alloc_info_index )
+        let index = self.alloc_info_to_index.len();
+        self.alloc_info_to_index.insert( alloc_info, index );
+        index
     }
 }
 
-fn io_err< T: fmt::Display >( err: T ) -> io::Error {
-    io::Error::new( io::ErrorKind::Other, format!( "serialization failed: {}", err ) )
-}
+pub fn export_as_heaptrack< T: io::Write, F: Fn( AllocationId, &Allocation ) -> bool + Sync >( data: &Data, data_out: T, filter: F ) -> io::Result< () > {
+    // Figure out which backtraces are going to be needed; this has to match the filtering done below.
+    let mut is_used = vec![ false; data.backtraces.len() ];
+    let used: Vec< BacktraceId > = data.allocations.par_iter().enumerate().flat_map_iter( |(index, allocation)| {
+        let allocation_id = AllocationId::new( index as _ );
+        let old_allocation = allocation.reallocated_from.map( |id| data.get_allocation( id ) );
+        let new = if filter( allocation_id, allocation ) { Some( allocation.backtrace ) } else { None };
+        let old = old_allocation.filter( |old_allocation| filter( allocation_id, old_allocation ) ).map( |old_allocation| old_allocation.backtrace );
+        new.into_iter().chain( old )
+    }).collect();
+
+    for backtrace_id in used {
+        is_used[ backtrace_id.raw() as usize ] = true;
+    }
+
+    let used_backtraces: Vec< _ > = is_used.iter().enumerate().filter( |(_, &is_used)| is_used ).map( |(index, _)| BacktraceId::new( index as _ ) ).collect();
+    std::mem::drop( is_used );
+
+    let mut exporter = HeaptrackExporter::new( data, io::BufWriter::new( data_out ), &used_backtraces )?;
+    std::mem::drop( used_backtraces );
 
-pub fn export_as_heaptrack< T: io::Write, F: Fn( AllocationId, &Allocation ) -> bool >( data: &Data, data_out: T, filter: F ) -> io::Result< () > {
-    let mut exporter = HeaptrackExporter::new( data, IoAdapter::new( data_out ) ).map_err( io_err )?;
     for op in data.operations() {
         match op {
             Operation::Allocation { allocation, allocation_id, .. } => {
@@ -259,26 +306,34 @@ pub fn export_as_heaptrack< T: io::Write, F: Fn( AllocationId, &Allocation ) ->
                     continue;
                 }
 
-                exporter.handle_alloc( allocation ).map_err( io_err )?;
+                exporter.handle_alloc( allocation )?;
             },
             Operation::Deallocation { allocation, allocation_id, .. } => {
                 if !filter( allocation_id, allocation ) {
                     continue;
                 }
 
-                exporter.handle_dealloc( allocation ).map_err( io_err )?;
+                exporter.handle_dealloc( allocation )?;
             },
             Operation::Reallocation { old_allocation, new_allocation, allocation_id, .. } => {
                 if filter( allocation_id, old_allocation ) {
-                    exporter.handle_dealloc( old_allocation ).map_err( io_err )?;
+                    exporter.handle_dealloc( old_allocation )?;
                 }
 
                 if filter( allocation_id, new_allocation ) {
-                    exporter.handle_alloc( new_allocation ).map_err( io_err )?;
+                    exporter.handle_alloc( new_allocation )?;
                 }
             }
         }
     }
 
-    Ok(())
+    exporter.flush()?;
+    exporter.fp.flush()
+}
+
+#[test]
+fn test_write_hex() {
+    let mut output = Vec::new();
+    write_line( &mut output, b't', &[0, 1, 0xabcdef, !0] );
+    assert_eq!( output, b"t 0 1 abcdef ffffffffffffffff\n" );
 }
@@ -0,0 +1,659 @@
+use std::fs::File;
+use std::io::{self, Write};
+use std::path::Path;
+
+use ahash::AHashMap as HashMap;
+use flate2::Compression;
+use flate2::write::GzEncoder;
+use rayon::prelude::*;
+
+use super::{
+    Allocation,
+    AllocationId,
+    BacktraceId,
+    Data,
+    FrameId
+};
+
+/*
+    A minimal Parquet writer; every column chunk is a single gzipped data page, optionally
+    preceded by a dictionary page, and there are no statistics or indexes. The metadata is
+    written with Thrift's compact protocol, following `parquet.thrift`:
+
+      FileMetaData: 1: i32 version, 2: list< SchemaElement > schema, 3: i64 num_rows, 4: list< RowGroup > row_groups, 6: string created_by
+      SchemaElement: 1: i32 type, 3: i32 repetition_type, 4: string name, 5: i32 num_children, 6: i32 converted_type
+      RowGroup: 1: list< ColumnChunk > columns, 2: i64 total_byte_size, 3: i64 num_rows
+      ColumnChunk: 2: i64 file_offset, 3: ColumnMetaData meta_data
+      ColumnMetaData: 1: i32 type, 2: list< i32 > encodings, 3: list< string > path_in_schema, 4: i32 codec, 5: i64 num_values,
+                      6: i64 total_uncompressed_size, 7: i64 total_compressed_size, 9: i64 data_page_offset, 11: i64 dictionary_page_offset
+      PageHeader: 1: i32 type, 2: i32 uncompressed_page_size, 3: i32 compressed_page_size, 5: DataPageHeader, 7: DictionaryPageHeader
+      DataPageHeader: 1: i32 num_values, 2: i32 encoding, 3: i32 definition_level_encoding, 4: i32 repetition_level_encoding
+      DictionaryPageHeader: 1: i32 num_values, 2: i32 encoding
+*/
+
+const MAGIC: &[u8] = b"PAR1";
+
+const TYPE_BOOLEAN: i32 = 0;
+const TYPE_INT32: i32 = 1;
+const TYPE_INT64: i32 = 2;
+const TYPE_BYTE_ARRAY: i32 = 6;
+
+const REPETITION_REQUIRED: i32 = 0;
+const REPETITION_OPTIONAL: i32 = 1;
+
+const CONVERTED_UTF8: i32 = 0;
+const CONVERTED_TIMESTAMP_MICROS: i32 = 10;
+const CONVERTED_UINT_32: i32 = 13;
+const CONVERTED_UINT_64: i32 = 14;
+
+const ENCODING_PLAIN: i32 = 0;
+const ENCODING_RLE: i32 = 3;
+const ENCODING_RLE_DICTIONARY: i32 = 8;
+
+const CODEC_GZIP: i32 = 2;
+
+const PAGE_DATA: i32 = 0;
+const PAGE_DICTIONARY: i32 = 2;
+
+const THRIFT_I32: u8 = 5;
+const THRIFT_I64: u8 = 6;
+const THRIFT_BINARY: u8 = 8;
+const THRIFT_LIST: u8 = 9;
+const THRIFT_STRUCT: u8 = 12;
+
+/// How many allocations go into a single row group.
+const ALLOCATIONS_PER_ROW_GROUP: usize = 256 * 1024;
+
+/// How many backtraces or frames go into a single row group.
+const ITEMS_PER_ROW_GROUP: usize = 64 * 1024;
+
+#[inline]
+fn write_varint( output: &mut Vec< u8 >, mut value: u64 ) {
+    while value >= 0x80 {
+        output.push( (value as u8) | 0x80 );
+        value >>= 7;
+    }
+    output.push( value as u8 );
+}
+
+#[inline]
+fn zigzag( value: i64 ) -> u64 {
+    ((value << 1) ^ (value >> 63)) as u64
+}
+
+/// A writer for Thrift's compact protocol.
+#[derive(Default)]
+struct Thrift {
+    output: Vec< u8 >,
+    /// The ID of the last field written in each of the structs which are currently open.
+    last_field: Vec< i16 >
+}
+
+impl Thrift {
+    fn field_header( &mut self, id: i16, kind: u8 ) {
+        let last = self.last_field.last_mut().unwrap();
+        let delta = id - *last;
+        if delta > 0 && delta <= 15 {
+            self.output.push( ((delta as u8) << 4) | kind );
+        } else {
+            self.output.push( kind );
+            write_varint( &mut self.output, zigzag( id as i64 ) );
+        }
+        *last = id;
+    }
+
+    fn begin_struct( &mut self ) {
+        self.last_field.push( 0 );
+    }
+
+    fn end_struct( &mut self ) {
+        self.output.push( 0 );
+        self.last_field.pop();
+    }
+
+    fn struct_field( &mut self, id: i16 ) {
+        self.field_header( id, THRIFT_STRUCT );
+        self.begin_struct();
+    }
+
+    fn i32_field( &mut self, id: i16, value: i32 ) {
+        self.field_header( id, THRIFT_I32 );
+        self.i32( value );
+    }
+
+    fn i64_field( &mut self, id: i16, value: i64 ) {
+        self.field_header( id, THRIFT_I64 );
+        write_varint( &mut self.output, zigzag( value ) );
+    }
+
+    fn string_field( &mut self, id: i16, value: &str ) {
+        self.field_header( id, THRIFT_BINARY );
+        self.string( value );
+    }
+
+    fn list_field( &mut self, id: i16, element_kind: u8, length: usize ) {
+        self.field_header( id, THRIFT_LIST );
+        if length < 15 {
+            self.output.push( ((length as u8) << 4) | element_kind );
+        } else {
+            self.output.push( 0xf0 | element_kind );
+            write_varint( &mut self.output, length as u64 );
+        }
+    }
+
+    fn i32( &mut self, value: i32 ) {
+        write_varint( &mut self.output, zigzag( value as i64 ) );
+    }
+
+    fn string( &mut self, value: &str ) {
+        write_varint( &mut self.output, value.len() as u64 );
+        self.output.extend_from_slice( value.as_bytes() );
+    }
+}
+
+/// Packs the values LSB first, `bit_width` bits each, padding them to a multiple of eight values.
+fn write_bit_packed( output: &mut Vec< u8 >, values: impl ExactSizeIterator< Item = u32 >, bit_width: u32 ) {
+    let total_length = (values.len() + 7) / 8 * bit_width as usize;
+    let start = output.len();
+    let mut buffer: u64 = 0;
+    let mut bits = 0;
+    for value in values {
+        buffer |= (value as u64) << bits;
+        bits += bit_width;
+        while bits >= 8 {
+            output.push( buffer as u8 );
+            buffer >>= 8;
+            bits -= 8;
+        }
+    }
+
+    if bits > 0 {
+        output.push( buffer as u8 );
+    }
+
+    output.resize( start + total_length, 0 );
+}
+
+/// Writes the values with the RLE/bit-packing hybrid encoding, as a single bit-packed run.
+fn write_hybrid( output: &mut Vec< u8 >, values: impl ExactSizeIterator< Item = u32 >, bit_width: u32 ) {
+    let groups = (values.len() + 7) / 8;
+    write_varint( output, ((groups as u64) << 1) | 1 );
+    write_bit_packed( output, values, bit_width );
+}
+
+#[derive(Copy, Clone, PartialEq, Eq)]
+enum Kind {
+    Boolean,
+    Int32,
+    Int64,
+    Text
+}
+
+impl Kind {
+    fn physical_type( self ) -> i32 {
+        match self {
+            Kind::Boolean => TYPE_BOOLEAN,
+            Kind::Int32 => TYPE_INT32,
+            Kind::Int64 => TYPE_INT64,
+            Kind::Text => TYPE_BYTE_ARRAY
+        }
+    }
+}
+
+struct Field {
+    name: &'static str,
+    kind: Kind,
+    optional: bool,
+    converted_type: Option< i32 >,
+    /// Only supported for the `Int32` columns.
+    dictionary: bool
+}
+
+const fn field( name: &'static str, kind: Kind, optional: bool, converted_type: Option< i32 > ) -> Field {
+    Field { name, kind, optional, converted_type, dictionary: false }
+}
+
+enum Value< 'a > {
+    Null,
+    Boolean( bool ),
+    Int32( i32 ),
+    Int64( i64 ),
+    Text( &'a str )
+}
+
+impl< 'a > From< bool > for Value< 'a > {
+    fn from( value: bool ) -> Self {
+        Value::Boolean( value )
+    }
+}
+
+impl< 'a > From< u32 > for Value< 'a > {
+    fn from( value: u32 ) -> Self {
+        Value::Int32( value as i32 )
+    }
+}
+
+impl< 'a > From< u64 > for Value< 'a > {
+    fn from( value: u64 ) -> Self {
+        Value::Int64( value as i64 )
+    }
+}
+
+impl< 'a > From< &'a str > for Value< 'a > {
+    fn from( value: &'a str ) -> Self {
+        Value::Text( value )
+    }
+}
+
+impl< 'a, T > From< Option< T > > for Value< 'a > where T: Into< Value< 'a > > {
+    fn from( value: Option< T > ) -> Self {
+        value.map( |value| value.into() ).unwrap_or( Value::Null )
+    }
+}
+
+/// The values of a single column of a row group.
+struct ColumnWriter {
+    field: &'static Field,
+    count: usize,
+    is_defined: Vec< bool >,
+    /// The PLAIN encoded values of every column other than the boolean and the dictionary encoded ones.
+    values: Vec< u8 >,
+    booleans: Vec< bool >,
+    dictionary: Vec< i32 >,
+    dictionary_index: HashMap< i32, u32 >,
+    indices: Vec< u32 >
+}
+
+struct ColumnMeta {
+    data_page_offset: usize,
+    dictionary_page_offset: Option< usize >,
+    num_values: usize,
+    uncompressed_size: usize,
+    compressed_size: usize
+}
+
+impl ColumnWriter {
+    fn new( field: &'static Field ) -> Self {
+        ColumnWriter {
+            field,
+            count: 0,
+            is_defined: Vec::new(),
+            values: Vec::new(),
+            booleans: Vec::new(),
+            dictionary: Vec::new(),
+            dictionary_index: HashMap::new(),
+            indices: Vec::new()
+        }
+    }
+
+    fn push< 'a >( &mut self, value: impl Into< Value< 'a > > ) {
+        let value = value.into();
+        self.count += 1;
+        if self.field.optional {
+            self.is_defined.push( !matches!( value, Value::Null ) );
+        }
+
+        match value {
+            Value::Null => debug_assert!( self.field.optional, "column '{}' isn't optional", self.field.name ),
+            Value::Boolean( value ) => self.booleans.push( value ),
+            Value::Int32( value ) if self.field.dictionary => {
+                let dictionary = &mut self.dictionary;
+                let index = *self.dictionary_index.entry( value ).or_insert_with( || {
+                    dictionary.push( value );
+                    dictionary.len() as u32 - 1
+                });
+                self.indices.push( index );
+            },
+            Value::Int32( value ) => self.values.extend_from_slice( &value.to_le_bytes() ),
+            Value::Int64( value ) => self.values.extend_from_slice( &value.to_le_bytes() ),
+            Value::Text( value ) => {
+                self.values.extend_from_slice( &(value.len() as u32).to_le_bytes() );
+                self.values.extend_from_slice( value.as_bytes() );
+            }
+        }
+    }
+
+    /// Writes out the pages of this column chunk; the offsets in the returned metadata are relative to `output`.
+    fn finish( self, output: &mut Vec< u8 > ) -> io::Result< ColumnMeta > {
+        let mut meta = ColumnMeta {
+            data_page_offset: 0,
+            dictionary_page_offset: None,
+            num_values: self.count,
+            uncompressed_size: 0,
+            compressed_size: 0
+        };
+
+        let mut body = Vec::new();
+        if self.field.dictionary {
+            for value in &self.dictionary {
+                body.extend_from_slice( &value.to_le_bytes() );
+            }
+
+            meta.dictionary_page_offset = Some( output.len() );
+            write_page( output, &mut meta, PAGE_DICTIONARY, self.dictionary.len(), ENCODING_PLAIN, &body )?;
+            body.clear();
+        }
+
+        if self.field.optional {
+            let mut levels = Vec::new();
+            write_hybrid( &mut levels, self.is_defined.iter().map( |&is_defined| is_defined as u32 ), 1 );
+            body.extend_from_slice( &(levels.len() as u32).to_le_bytes() );
+            body.extend_from_slice( &levels );
+        }
+
+        let encoding = if self.field.dictionary {
+            let bit_width = std::cmp::max( 32 - (self.dictionary.len().saturating_sub( 1 ) as u32).leading_zeros(), 1 );
+            body.push( bit_width as u8 );
+            write_hybrid( &mut body, self.indices.iter().copied(), bit_width );
+            ENCODING_RLE_DICTIONARY
+        } else {
+            if self.field.kind == Kind::Boolean {
+                write_bit_packed( &mut body, self.booleans.iter().map( |&value| value as u32 ), 1 );
+            } else {
+                body.extend_from_slice( &self.values );
+            }
+            ENCODING_PLAIN
+        };
+
+        meta.data_page_offset = output.len();
+        write_page( output, &mut meta, PAGE_DATA, self.count, encoding, &body )?;
+        Ok( meta )
+    }
+}
+
+fn write_page( output: &mut Vec< u8 >, meta: &mut ColumnMeta, kind: i32, num_values: usize, encoding: i32, body: &[u8] ) -> io::Result< () > {
+    let mut encoder = GzEncoder::new( Vec::with_capacity( body.len() / 4 ), Compression::fast() );
+    encoder.write_all( body )?;
+    let compressed = encoder.finish()?;
+
+    let mut header = Thrift::default();
+    header.begin_struct();
+    header.i32_field( 1, kind );
+    header.i32_field( 2, body.len() as i32 );
+    header.i32_field( 3, compressed.len() as i32 );
+    if kind == PAGE_DATA {
+        header.struct_field( 5 );
+        header.i32_field( 1, num_values as i32 );
+        header.i32_field( 2, encoding );
+        header.i32_field( 3, ENCODING_RLE );
+        header.i32_field( 4, ENCODING_RLE );
+        header.end_struct();
+    } else {
+        header.struct_field( 7 );
+        header.i32_field( 1, num_values as i32 );
+        header.i32_field( 2, encoding );
+        header.end_struct();
+    }
+    header.end_struct();
+
+    output.extend_from_slice( &header.output );
+    output.extend_from_slice( &compressed );
+    meta.uncompressed_size += header.output.len() + body.len();
+    meta.compressed_size += header.output.len() + compressed.len();
+    Ok(())
+}
+
+struct RowGroup {
+    bytes: Vec< u8 >,
+    columns: Vec< ColumnMeta >,
+    num_rows: usize
+}
+
+fn encode_row_group< T, F >( fields: &'static [Field], items: &[T], push_rows: &F ) -> io::Result< RowGroup >
+    where F: Fn( &mut [ColumnWriter], &T )
+{
+    let mut writers: Vec< _ > = fields.iter().map( ColumnWriter::new ).collect();
+    for item in items {
+        push_rows( &mut writers, item );
+    }
+
+    let num_rows = writers[ 0 ].count;
+    debug_assert!( writers.iter().all( |writer| writer.count == num_rows ) );
+
+    let mut bytes = Vec::new();
+    let mut columns = Vec::with_capacity( writers.len() );
+    for writer in writers {
+        columns.push( writer.finish( &mut bytes )? );
+    }
+
+    Ok( RowGroup { bytes, columns, num_rows } )
+}
+
+fn write_metadata( fields: &[Field], row_groups: &[(usize, RowGroup)] ) -> Vec< u8 > {
+    let mut thrift = Thrift::default();
+    thrift.begin_struct();
+    thrift.i32_field( 1, 1 );
+
+    thrift.list_field( 2, THRIFT_STRUCT, fields.len() + 1 );
+    thrift.begin_struct();
+    thrift.string_field( 4, "schema" );
+    thrift.i32_field( 5, fields.len() as i32 );
+    thrift.end_struct();
+    for field in fields {
+        thrift.begin_struct();
+        thrift.i32_field( 1, field.kind.physical_type() );
+        thrift.i32_field( 3, if field.optional { REPETITION_OPTIONAL } else { REPETITION_REQUIRED } );
+        thrift.string_field( 4, field.name );
+        if let Some( converted_type ) = field.converted_type {
+            thrift.i32_field( 6, converted_type );
+        }
+        thrift.end_struct();
+    }
+
+    thrift.i64_field( 3, row_groups.iter().map( |(_, row_group)| row_group.num_rows as i64 ).sum() );
+    thrift.list_field( 4, THRIFT_STRUCT, row_groups.len() );
+    for (offset, row_group) in row_groups {
+        thrift.begin_struct();
+        thrift.list_field( 1, THRIFT_STRUCT, fields.len() );
+        for (field, column) in fields.iter().zip( &row_group.columns ) {
+            let start = offset + column.dictionary_page_offset.unwrap_or( column.data_page_offset );
+            thrift.begin_struct();
+            thrift.i64_field( 2, start as i64 );
+            thrift.struct_field( 3 );
+            thrift.i32_field( 1, field.kind.physical_type() );
+            if field.dictionary {
+                thrift.list_field( 2, THRIFT_I32, 3 );
+                for &encoding in &[ENCODING_PLAIN, ENCODING_RLE, ENCODING_RLE_DICTIONARY] {
+                    thrift.i32( encoding );
+                }
+            } else {
+                thrift.list_field( 2, THRIFT_I32, 2 );
+                thrift.i32( ENCODING_PLAIN );
+                thrift.i32( ENCODING_RLE );
+            }
+            thrift.list_field( 3, THRIFT_BINARY, 1 );
+            thrift.string( field.name );
+            thrift.i32_field( 4, CODEC_GZIP );
+            thrift.i64_field( 5, column.num_values as i64 );
+            thrift.i64_field( 6, column.uncompressed_size as i64 );
+            thrift.i64_field( 7, column.compressed_size as i64 );
+            thrift.i64_field( 9, (offset + column.data_page_offset) as i64 );
+            if let Some( dictionary_page_offset ) = column.dictionary_page_offset {
+                thrift.i64_field( 11, (offset + dictionary_page_offset) as i64 );
+            }
+            thrift.end_struct();
+            thrift.end_struct();
+        }
+        thrift.i64_field( 2, row_group.columns.iter().map( |column| column.uncompressed_size as i64 ).sum() );
+        thrift.i64_field( 3, row_group.num_rows as i64 );
+        thrift.end_struct();
+    }
+
+    thrift.string_field( 6, concat!( "bytehound version ", env!( "CARGO_PKG_VERSION" ) ) );
+    thrift.end_struct();
+    thrift.output
+}
+
+/// Writes a single Parquet file with a row group for every chunk of the `items`; the row groups
+/// are encoded in parallel, but only a few of them at a time, so the memory usage stays bounded.
+fn write_table< T, F >( path: &Path, fields: &'static [Field], items: &[T], items_per_row_group: usize, push_rows: F ) -> io::Result< () >
+    where T: Sync,
+          F: Fn( &mut [ColumnWriter], &T ) + Sync
+{
+    let mut fp = io::BufWriter::new( File::create( path )? );
+    fp.write_all( MAGIC )?;
+
+    let mut offset = MAGIC.len();
+    let mut row_groups = Vec::new();
+    let batch_size = items_per_row_group * rayon::current_num_threads();
+    for batch in items.chunks( batch_size ) {
+        let encoded: Vec< io::Result< RowGroup > > = batch.par_chunks( items_per_row_group ).map( |items| encode_row_group( fields, items, &push_rows ) ).collect();
+        for row_group in encoded {
+            let mut row_group = row_group?;
+            if row_group.num_rows == 0 {
+                continue;
+            }
+
+            fp.write_all( &row_group.bytes )?;
+            let length = row_group.bytes.len();
+            row_group.bytes = Vec::new();
+            row_groups.push( (offset, row_group) );
+            offset += length;
+        }
+    }
+
+    let metadata = write_metadata( fields, &row_groups );
+    fp.write_all( &metadata )?;
+    fp.write_all( &(metadata.len() as u32).to_le_bytes() )?;
+    fp.write_all( MAGIC )?;
+    fp.flush()
+}
+
+static ALLOCATION_FIELDS: &[Field] = &[
+    field( "id", Kind::Int64, false, None ),
+    field( "timestamp", Kind::Int64, false, Some( CONVERTED_TIMESTAMP_MICROS ) ),
+    field( "address", Kind::Int64, false, Some( CONVERTED_UINT_64 ) ),
+    field( "size", Kind::Int64, false, Some( CONVERTED_UINT_64 ) ),
+    field( "usable_size", Kind::Int64, false, Some( CONVERTED_UINT_64 ) ),
+    field( "thread", Kind::Int32, false, Some( CONVERTED_UINT_32 ) ),
+    Field { name: "backtrace_id", kind: Kind::Int32, optional: false, converted_type: Some( CONVERTED_UINT_32 ), dictionary: true },
+    field( "flags", Kind::Int32, false, Some( CONVERTED_UINT_32 ) ),
+    field( "is_mmaped", Kind::Boolean, false, None ),
+    field( "is_jemalloc", Kind::Boolean, false, None ),
+    field( "in_main_arena", Kind::Boolean, false, None ),
+    field( "deallocation_timestamp", Kind::Int64, true, Some( CONVERTED_TIMESTAMP_MICROS ) ),
+    field( "deallocation_thread", Kind::Int32, true, Some( CONVERTED_UINT_32 ) ),
+    field( "deallocation_backtrace_id", Kind::Int32, true, Some( CONVERTED_UINT_32 ) ),
+    field( "lifetime_us", Kind::Int64, true, Some( CONVERTED_UINT_64 ) ),
+    field( "chain_first_id", Kind::Int64, false, None ),
+    field( "chain_position", Kind::Int32, false, Some( CONVERTED_UINT_32 ) ),
+    field( "chain_length", Kind::Int32, false, Some( CONVERTED_UINT_32 ) ),
+    field( "chain_lifetime_us", Kind::Int64, true, Some( CONVERTED_UINT_64 ) )
+];
+
+static BACKTRACE_FIELDS: &[Field] = &[
+    field( "backtrace_id", Kind::Int32, false, Some( CONVERTED_UINT_32 ) ),
+    field( "position", Kind::Int32, false, Some( CONVERTED_UINT_32 ) ),
+    field( "frame_id", Kind::Int64, false, None )
+];
+
+static FRAME_FIELDS: &[Field] = &[
+    field( "frame_id", Kind::Int64, false, None ),
+    field( "address", Kind::Int64, false, Some( CONVERTED_UINT_64 ) ),
+    field( "library", Kind::Text, true, Some( CONVERTED_UTF8 ) ),
+    field( "function", Kind::Text, true, Some( CONVERTED_UTF8 ) ),
+    field( "raw_function", Kind::Text, true, Some( CONVERTED_UTF8 ) ),
+    field( "source", Kind::Text, true, Some( CONVERTED_UTF8 ) ),
+    field( "line", Kind::Int32, true, Some( CONVERTED_UINT_32 ) ),
+    field( "column", Kind::Int32, true, Some( CONVERTED_UINT_32 ) ),
+    field( "is_inline", Kind::Boolean, false, None )
+];
+
+/// Exports the matching allocations into `allocations.parquet` in the given directory, in the order
+/// of their timestamps, along with every backtrace in `backtraces.parquet` (a row for every frame,
+/// with the outermost frame first) and every frame in `frames.parquet`.
+pub fn export_as_parquet< F >( data: &Data, output_directory: &Path, filter: F ) -> io::Result< () >
+    where F: Fn( AllocationId, &Allocation ) -> bool + Sync
+{
+    std::fs::create_dir_all( output_directory )?;
+
+    let allocations = data.alloc_sorted_by_timestamp( None, None );
+    write_table( &output_directory.join( "allocations.parquet" ), ALLOCATION_FIELDS, allocations, ALLOCATIONS_PER_ROW_GROUP, |columns, &id| {
+        let allocation = data.get_allocation( id );
+        if !filter( id, allocation ) {
+            return;
+        }
+
+        let deallocation = allocation.deallocation.as_ref();
+        let chain = data.get_chain_by_any_allocation( id );
+        columns[ 0 ].push( id.raw() );
+        columns[ 1 ].push( allocation.timestamp.as_usecs() );
+        columns[ 2 ].push( allocation.pointer );
+        columns[ 3 ].push( allocation.size );
+        columns[ 4 ].push( allocation.usable_size() );
+        columns[ 5 ].push( allocation.thread );
+        columns[ 6 ].push( allocation.backtrace.raw() );
+        columns[ 7 ].push( allocation.flags.bits() as u32 );
+        columns[ 8 ].push( allocation.is_mmaped() );
+        columns[ 9 ].push( allocation.is_jemalloc() );
+        columns[ 10 ].push( !allocation.in_non_main_arena() );
+        columns[ 11 ].push( deallocation.map( |deallocation| deallocation.timestamp.as_usecs() ) );
+        columns[ 12 ].push( deallocation.map( |deallocation| deallocation.thread ) );
+        columns[ 13 ].push( deallocation.and_then( |deallocation| deallocation.backtrace ).map( |backtrace| backtrace.raw() ) );
+        columns[ 14 ].push( deallocation.map( |deallocation| (deallocation.timestamp - allocation.timestamp).as_usecs() ) );
+        columns[ 15 ].push( chain.first.raw() );
+        columns[ 16 ].push( allocation.position_in_chain );
+        columns[ 17 ].push( chain.length );
+        columns[ 18 ].push( chain.lifetime( data ).map( |lifetime| lifetime.as_usecs() ) );
+    })?;
+
+    let backtraces: Vec< BacktraceId > = (0..data.backtraces.len()).map( |index| BacktraceId::new( index as _ ) ).collect();
+    write_table( &output_directory.join( "backtraces.parquet" ), BACKTRACE_FIELDS, &backtraces, ITEMS_PER_ROW_GROUP, |columns, &backtrace_id| {
+        for (position, (frame_id, _)) in data.get_backtrace( backtrace_id ).enumerate() {
+            columns[ 0 ].push( backtrace_id.raw() );
+            columns[ 1 ].push( position as u32 );
+            columns[ 2 ].push( frame_id as u64 );
+        }
+    })?;
+    std::mem::drop( backtraces );
+
+    let frames: Vec< FrameId > = (0..data.frames.len()).collect();
+    write_table( &output_directory.join( "frames.parquet" ), FRAME_FIELDS, &frames, ITEMS_PER_ROW_GROUP, |columns, &frame_id| {
+        let frame = data.get_frame( frame_id );
+        let resolve = |id| data.interner().resolve( id ).unwrap();
+        columns[ 0 ].push( frame_id as u64 );
+        columns[ 1 ].push( frame.address().raw() );
+        columns[ 2 ].push( frame.library().map( resolve ) );
+        columns[ 3 ].push( frame.function().map( resolve ) );
+        columns[ 4 ].push( frame.raw_function().map( resolve ) );
+        columns[ 5 ].push( frame.source().map( resolve ) );
+        columns[ 6 ].push( frame.line() );
+        columns[ 7 ].push( frame.column() );
+        columns[ 8 ].push( frame.is_inline() );
+    })?;
+
+    Ok(())
+}
+
+#[test]
+fn test_thrift_compact() {
+    let mut thrift = Thrift::default();
+    thrift.begin_struct();
+    thrift.i32_field( 1, -1 );
+    thrift.string_field( 4, "ab" );
+    thrift.i64_field( 20, 150 );
+    thrift.list_field( 21, THRIFT_I32, 2 );
+    thrift.i32( 1 );
+    thrift.i32( 2 );
+    thrift.end_struct();
+
+    assert_eq!( thrift.output, [
+        0x15, 0x01,
+        0x38, 0x02, b'a', b'b',
+        0x06, 0x28, 0xac, 0x02,
+        0x19, 0x25, 0x02, 0x04,
+        0x00
+    ]);
+}
+
+#[test]
+fn test_bit_packing() {
+    // The example from the Parquet's documentation of the bit-packed encoding.
+    let mut output = Vec::new();
+    write_bit_packed( &mut output, (0..8).map( |value| value ), 3 );
+    assert_eq!( output, [0b10001000, 0b11000110, 0b11111010] );
+
+    let mut output = Vec::new();
+    write_hybrid( &mut output, [1, 0, 1].iter().copied(), 1 );
+    assert_eq!( output, [0x03, 0b101] );
+}
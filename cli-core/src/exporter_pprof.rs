@@ -0,0 +1,354 @@
+use std::io::{self, Write};
+
+use ahash::AHashMap as HashMap;
+use flate2::Compression;
+use flate2::write::GzEncoder;
+use rayon::prelude::*;
+
+use super::{
+    Allocation,
+    AllocationId,
+    BacktraceId,
+    Data,
+    FrameId,
+    StringId
+};
+
+/*
+    The subset of `profile.proto` which is written out:
+
+      Profile:
+        1: repeated ValueType sample_type
+        2: repeated Sample sample
+        3: repeated Mapping mapping
+        4: repeated Location location
+        5: repeated Function function
+        6: repeated string string_table
+        9: int64 time_nanos
+        10: int64 duration_nanos
+        11: ValueType period_type
+        12: int64 period
+        14: int64 default_sample_type
+      ValueType:
+        1: int64 type, 2: int64 unit
+      Sample:
+        1: repeated uint64 location_id (packed), 2: repeated int64 value (packed)
+      Mapping:
+        1: uint64 id, 5: int64 filename, 7: bool has_functions, 8: bool has_filenames, 9: bool has_line_numbers, 10: bool has_inline_frames
+      Location:
+        1: uint64 id, 2: uint64 mapping_id, 3: uint64 address, 4: repeated Line line
+      Line:
+        1: uint64 function_id, 2: int64 line
+      Function:
+        1: uint64 id, 2: int64 name, 3: int64 system_name, 4: int64 filename
+
+    Every string is an index into the string table, whose first entry has to be empty, and every ID is non-zero.
+    The repeated fields of a message don't have to be contiguous, so the profile is written out
+    one table at a time, without ever having the whole of it in memory.
+*/
+
+/// The strings which aren't in the interner; they're at the start of the string table.
+const FIXED_STRINGS: &[&str] = &[
+    "",
+    "alloc_objects",
+    "count",
+    "alloc_space",
+    "bytes",
+    "inuse_objects",
+    "inuse_space",
+    "space"
+];
+
+const STRING_ALLOC_OBJECTS: u64 = 1;
+const STRING_COUNT: u64 = 2;
+const STRING_ALLOC_SPACE: u64 = 3;
+const STRING_BYTES: u64 = 4;
+const STRING_INUSE_OBJECTS: u64 = 5;
+const STRING_INUSE_SPACE: u64 = 6;
+const STRING_SPACE: u64 = 7;
+
+/// How many entries of a table are encoded at a time by a single thread.
+const ENTRIES_PER_CHUNK: usize = 4096;
+
+#[inline]
+fn write_varint( output: &mut Vec< u8 >, mut value: u64 ) {
+    while value >= 0x80 {
+        output.push( (value as u8) | 0x80 );
+        value >>= 7;
+    }
+    output.push( value as u8 );
+}
+
+#[inline]
+fn write_varint_field( output: &mut Vec< u8 >, field: u32, value: u64 ) {
+    write_varint( output, (field as u64) << 3 );
+    write_varint( output, value );
+}
+
+#[inline]
+fn write_bytes_field( output: &mut Vec< u8 >, field: u32, bytes: &[u8] ) {
+    write_varint( output, ((field as u64) << 3) | 2 );
+    write_varint( output, bytes.len() as u64 );
+    output.extend_from_slice( bytes );
+}
+
+/// Writes a nested message, using `scratch` to encode it since its length has to go first.
+fn write_message_field( output: &mut Vec< u8 >, scratch: &mut Vec< u8 >, field: u32, encode: impl FnOnce( &mut Vec< u8 > ) ) {
+    scratch.clear();
+    encode( scratch );
+    write_bytes_field( output, field, scratch );
+}
+
+fn write_packed_field( output: &mut Vec< u8 >, scratch: &mut Vec< u8 >, field: u32, values: impl IntoIterator< Item = u64 > ) {
+    write_message_field( output, scratch, field, |output| {
+        for value in values {
+            write_varint( output, value );
+        }
+    });
+}
+
+/// Encodes the `items` in parallel and writes them out in order.
+fn write_table< W, T, F >( fp: &mut W, items: &[T], encode: F ) -> io::Result< () >
+    where W: Write,
+          T: Sync,
+          F: Fn( &mut Vec< u8 >, &mut Vec< u8 >, usize, &T ) + Sync
+{
+    // Only encode a limited number of chunks at a time to keep the memory usage bounded.
+    let chunk_size = ENTRIES_PER_CHUNK;
+    let batch_size = chunk_size * rayon::current_num_threads() * 2;
+    for (batch_index, batch) in items.chunks( batch_size ).enumerate() {
+        let chunks: Vec< Vec< u8 > > = batch.par_chunks( chunk_size ).enumerate().map( |(chunk_index, chunk)| {
+            let mut output = Vec::new();
+            let mut scratch = Vec::new();
+            for (index, item) in chunk.iter().enumerate() {
+                encode( &mut output, &mut scratch, batch_index * batch_size + chunk_index * chunk_size + index, item );
+            }
+            output
+        }).collect();
+
+        for chunk in chunks {
+            fp.write_all( &chunk )?;
+        }
+    }
+
+    Ok(())
+}
+
+/// The addresses of a backtrace which are exported, from the innermost to the outermost,
+/// as ranges of the backtrace's frames; the frames inlined at the same address are kept together.
+fn exported_locations< 'a >( data: &'a Data, backtrace_id: BacktraceId ) -> impl Iterator< Item = &'a [FrameId] > + 'a {
+    let frame_ids = data.get_frame_ids( backtrace_id );
+
+    // The innermost frame is skipped; it's always in the allocator itself.
+    let frame_ids = frame_ids.get( 1.. ).unwrap_or( &[] );
+    let mut position = 0;
+    std::iter::from_fn( move || {
+        if position >= frame_ids.len() {
+            return None;
+        }
+
+        let address = data.get_frame( frame_ids[ position ] ).address();
+        let start = position;
+        while position < frame_ids.len() && data.get_frame( frame_ids[ position ] ).address() == address {
+            position += 1;
+        }
+
+        Some( &frame_ids[ start..position ] )
+    })
+}
+
+#[derive(Copy, Clone, Default)]
+struct Totals {
+    alloc_objects: u64,
+    alloc_space: u64,
+    inuse_objects: u64,
+    inuse_space: u64
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+struct FunctionKey {
+    name: Option< StringId >,
+    system_name: Option< StringId >,
+    filename: Option< StringId >
+}
+
+fn function_key( data: &Data, frame_id: FrameId ) -> FunctionKey {
+    let frame = data.get_frame( frame_id );
+    FunctionKey {
+        name: frame.any_function(),
+        system_name: frame.raw_function().or( frame.function() ),
+        filename: frame.source()
+    }
+}
+
+/// Exports the matching allocations as a gzipped `profile.proto`, the format which `pprof` and
+/// most of the continuous profiling services ingest.
+///
+/// There's a single sample for every backtrace, with the `alloc_*` values covering every matching
+/// allocation and the `inuse_*` values covering only the ones which were never deallocated.
+pub fn export_as_pprof< T: io::Write, F: Fn( AllocationId, &Allocation ) -> bool + Sync >( data: &Data, data_out: T, filter: F ) -> io::Result< () > {
+    let samples: Vec< (BacktraceId, Totals) > = (0..data.backtraces.len()).into_par_iter().filter_map( |index| {
+        let backtrace_id = BacktraceId::new( index as _ );
+        let mut totals = Totals::default();
+        for (allocation_id, allocation) in data.get_allocations_by_backtrace( backtrace_id ) {
+            if !filter( allocation_id, allocation ) {
+                continue;
+            }
+
+            let size = allocation.size + allocation.extra_usable_space as u64;
+            totals.alloc_objects += 1;
+            totals.alloc_space += size;
+            if !allocation.was_deallocated() {
+                totals.inuse_objects += 1;
+                totals.inuse_space += size;
+            }
+        }
+
+        if totals.alloc_objects == 0 {
+            None
+        } else {
+            Some( (backtrace_id, totals) )
+        }
+    }).collect();
+
+    // Every address gets a single location, along with whatever was inlined at it.
+    let mut locations: Vec< &[FrameId] > = samples.par_iter().flat_map_iter( |&(backtrace_id, _)| exported_locations( data, backtrace_id ) ).collect();
+    locations.par_sort_unstable_by_key( |frames| data.get_frame( frames[ 0 ] ).address().raw() );
+    locations.dedup_by_key( |frames| data.get_frame( frames[ 0 ] ).address().raw() );
+
+    let mut functions: Vec< FunctionKey > = locations.par_iter()
+        .flat_map_iter( |frames| frames.iter().map( |&frame_id| function_key( data, frame_id ) ) )
+        .filter( |key| key.name.is_some() )
+        .collect();
+    functions.par_sort_unstable();
+    functions.dedup();
+
+    let mut libraries: Vec< StringId > = locations.par_iter().filter_map( |frames| data.get_frame( frames[ 0 ] ).library() ).collect();
+    libraries.par_sort_unstable();
+    libraries.dedup();
+
+    let mut strings: Vec< StringId > = functions.par_iter()
+        .flat_map_iter( |key| key.name.into_iter().chain( key.system_name ).chain( key.filename ) )
+        .chain( libraries.par_iter().copied() )
+        .collect();
+    strings.par_sort_unstable();
+    strings.dedup();
+
+    let string_index = |id: Option< StringId >| {
+        id.map( |id| (strings.binary_search( &id ).unwrap() + FIXED_STRINGS.len()) as u64 ).unwrap_or( 0 )
+    };
+    let location_id = |frames: &[FrameId]| {
+        let address = data.get_frame( frames[ 0 ] ).address().raw();
+        locations.binary_search_by_key( &address, |frames| data.get_frame( frames[ 0 ] ).address().raw() ).unwrap() as u64 + 1
+    };
+
+    let mut fp = GzEncoder::new( io::BufWriter::new( data_out ), Compression::default() );
+    let mut output = Vec::new();
+    let mut scratch = Vec::new();
+    for &(kind, unit) in &[(STRING_ALLOC_OBJECTS, STRING_COUNT), (STRING_ALLOC_SPACE, STRING_BYTES), (STRING_INUSE_OBJECTS, STRING_COUNT), (STRING_INUSE_SPACE, STRING_BYTES)] {
+        write_message_field( &mut output, &mut scratch, 1, |output| {
+            write_varint_field( output, 1, kind );
+            write_varint_field( output, 2, unit );
+        });
+    }
+    fp.write_all( &output )?;
+
+    write_table( &mut fp, &samples, |output, scratch, _, &(backtrace_id, totals)| {
+        let mut sample = Vec::new();
+        write_packed_field( &mut sample, scratch, 1, exported_locations( data, backtrace_id ).map( location_id ) );
+        write_packed_field( &mut sample, scratch, 2, [totals.alloc_objects, totals.alloc_space, totals.inuse_objects, totals.inuse_space].iter().copied() );
+        write_bytes_field( output, 2, &sample );
+    })?;
+    std::mem::drop( samples );
+
+    write_table( &mut fp, &libraries, |output, scratch, index, &library| {
+        write_message_field( output, scratch, 3, |output| {
+            write_varint_field( output, 1, index as u64 + 1 );
+            write_varint_field( output, 5, string_index( Some( library ) ) );
+            for field in 7..=10 {
+                write_varint_field( output, field, 1 );
+            }
+        });
+    })?;
+
+    write_table( &mut fp, &locations, |output, scratch, index, frames| {
+        let mut location = Vec::new();
+        let frame = data.get_frame( frames[ 0 ] );
+        write_varint_field( &mut location, 1, index as u64 + 1 );
+        if let Some( library ) = frame.library() {
+            write_varint_field( &mut location, 2, libraries.binary_search( &library ).unwrap() as u64 + 1 );
+        }
+        write_varint_field( &mut location, 3, frame.address().raw() );
+
+        // The innermost of the inlined functions goes first, and the one they were inlined into goes last.
+        for &frame_id in frames.iter() {
+            let key = function_key( data, frame_id );
+            if key.name.is_none() {
+                continue;
+            }
+
+            let function_id = functions.binary_search( &key ).unwrap() as u64 + 1;
+            let line = data.get_frame( frame_id ).line().unwrap_or( 0 ) as u64;
+            write_message_field( &mut location, scratch, 4, |output| {
+                write_varint_field( output, 1, function_id );
+                if line != 0 {
+                    write_varint_field( output, 2, line );
+                }
+            });
+        }
+
+        write_bytes_field( output, 4, &location );
+    })?;
+
+    write_table( &mut fp, &functions, |output, scratch, index, key| {
+        write_message_field( output, scratch, 5, |output| {
+            write_varint_field( output, 1, index as u64 + 1 );
+            write_varint_field( output, 2, string_index( key.name ) );
+            write_varint_field( output, 3, string_index( key.system_name ) );
+            if key.filename.is_some() {
+                write_varint_field( output, 4, string_index( key.filename ) );
+            }
+        });
+    })?;
+
+    output.clear();
+    for string in FIXED_STRINGS {
+        write_bytes_field( &mut output, 6, string.as_bytes() );
+    }
+    fp.write_all( &output )?;
+
+    write_table( &mut fp, &strings, |output, _, _, &id| {
+        write_bytes_field( output, 6, data.interner().resolve( id ).unwrap().as_bytes() );
+    })?;
+
+    output.clear();
+    write_varint_field( &mut output, 9, data.initial_timestamp().as_usecs() * 1000 );
+    write_varint_field( &mut output, 10, (data.last_timestamp() - data.initial_timestamp()).as_usecs() * 1000 );
+    write_message_field( &mut output, &mut scratch, 11, |output| {
+        write_varint_field( output, 1, STRING_SPACE );
+        write_varint_field( output, 2, STRING_BYTES );
+    });
+    write_varint_field( &mut output, 14, STRING_INUSE_SPACE );
+    fp.write_all( &output )?;
+
+    fp.finish()?.flush()
+}
+
+#[test]
+fn test_write_varint() {
+    let mut output = Vec::new();
+    write_varint( &mut output, 0 );
+    write_varint( &mut output, 1 );
+    write_varint( &mut output, 300 );
+    write_varint( &mut output, !0 );
+    assert_eq!( output, [0x00, 0x01, 0xac, 0x02, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01] );
+
+    let mut output = Vec::new();
+    let mut scratch = Vec::new();
+    write_message_field( &mut output, &mut scratch, 11, |output| {
+        write_varint_field( output, 1, 7 );
+        write_varint_field( output, 2, 4 );
+    });
+    write_packed_field( &mut output, &mut scratch, 1, vec![ 1, 150 ] );
+    assert_eq!( output, [0x5a, 0x04, 0x08, 0x07, 0x10, 0x04, 0x0a, 0x03, 0x01, 0x96, 0x01] );
+}
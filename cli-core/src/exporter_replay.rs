@@ -2,54 +2,188 @@ use std::io;
 use std::collections::HashMap;
 
 use byteorder::{NativeEndian, WriteBytesExt};
+use rayon::prelude::*;
 
-use crate::data::{Allocation, AllocationId, BacktraceId, Data, FrameId, Operation};
+use crate::data::{Allocation, AllocationId, BacktraceId, Data, FrameId, Operation, ThreadId, Timestamp};
 
-#[derive(Default)]
-struct Exporter {
+/*
+    Format of the replay file (every field is a native endian u64):
+      Header:
+        <magic> <slot_count> <thread_count> <handoff_count> <initial_timestamp>
+        [for each thread: <index of the thread's first op>]
+      Ops (four fields each; the ops of every thread end with an OP_END):
+        <kind> <slot or frame or handoff> <timestamp> <size>
+
+    The compact format has the same header, except for the magic, and the thread offsets
+    are byte offsets. Every op is its kind as a single byte followed by only those fields
+    which it uses as LEB128 varints, with the timestamps stored as zigzag encoded deltas
+    from the previous timestamp of the same thread:
+        OP_ALLOC, OP_REALLOC: <slot> <timestamp delta> <size>
+        OP_FREE: <slot> <timestamp delta>
+        OP_GO_DOWN: <frame>
+        OP_WAIT, OP_SIGNAL: <handoff>
+
+    Every thread of the original program gets its own stream of ops. Whenever a slot
+    is touched by a different thread than the one which touched it last the first
+    thread signals a handoff which the second one waits for before it continues.
+*/
+
+const MAGIC: u64 = 0x4248_5250_4c59_0002;
+const COMPACT_MAGIC: u64 = 0x4248_5250_4c59_0003;
+
+const OP_END: u64 = 0;
+const OP_ALLOC: u64 = 1;
+const OP_FREE: u64 = 2;
+const OP_REALLOC: u64 = 3;
+const OP_GO_DOWN: u64 = 4;
+const OP_GO_UP: u64 = 5;
+const OP_WAIT: u64 = 6;
+const OP_SIGNAL: u64 = 7;
+
+type Op = [u64; 4];
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum ReplayFormat {
+    /// Every op takes 32 bytes; this is what older replayers understand.
+    Fixed,
+    /// The ops are variable length; usually four to five times smaller.
+    Compact
+}
+
+fn write_varint( output: &mut Vec< u8 >, mut value: u64 ) {
+    while value >= 0x80 {
+        output.push( (value as u8) | 0x80 );
+        value >>= 7;
+    }
+
+    output.push( value as u8 );
+}
+
+fn encode_compact( ops: &[Op] ) -> Vec< u8 > {
+    let mut output = Vec::with_capacity( ops.len() * 4 );
+    let mut last_timestamp = 0;
+    for &[kind, argument, timestamp, size] in ops {
+        output.push( kind as u8 );
+        match kind {
+            OP_ALLOC | OP_FREE | OP_REALLOC => {
+                let delta = timestamp.wrapping_sub( last_timestamp ) as i64;
+                last_timestamp = timestamp;
+
+                write_varint( &mut output, argument );
+                write_varint( &mut output, ((delta << 1) ^ (delta >> 63)) as u64 );
+                if kind != OP_FREE {
+                    write_varint( &mut output, size );
+                }
+            },
+            OP_GO_DOWN | OP_WAIT | OP_SIGNAL => write_varint( &mut output, argument ),
+            _ => {}
+        }
+    }
+
+    output
+}
+
+struct Event {
+    kind: u64,
+    slot: usize,
+    timestamp: Timestamp,
+    size: u64,
+    backtrace: Option< BacktraceId >,
+    thread: usize,
+    /// The handoff which this event has to wait for before it can run.
+    wait: Option< u64 >,
+    /// The handoff which has to be signalled after this event runs.
+    signal: Option< u64 >
+}
+
+struct Exporter< 'a > {
+    data: &'a Data,
     free_slots: Vec< usize >,
-    slot_count: usize,
     slot_by_pointer: HashMap< u64, usize >,
-    slot_by_index: Vec< usize >,
+    /// The index of the event which last touched a given slot.
+    last_event_for_slot: Vec< usize >,
+    thread_to_index: HashMap< ThreadId, usize >,
+    events: Vec< Event >,
+    handoff_count: u64,
     used_frames: HashMap< FrameId, u64 >
 }
 
-impl Exporter {
-    fn preprocess_alloc( &mut self, allocation: &Allocation ) {
-        let slot = if self.free_slots.is_empty() {
-            let slot = self.slot_count;
-            self.slot_count += 1;
-            slot
-        } else {
-            self.free_slots.pop().unwrap()
+impl< 'a > Exporter< 'a > {
+    fn new( data: &'a Data ) -> Self {
+        Exporter {
+            data,
+            free_slots: Vec::new(),
+            slot_by_pointer: HashMap::new(),
+            last_event_for_slot: Vec::new(),
+            thread_to_index: HashMap::new(),
+            events: Vec::new(),
+            handoff_count: 0,
+            used_frames: HashMap::new()
+        }
+    }
+
+    fn push_event( &mut self, kind: u64, slot: usize, timestamp: Timestamp, size: u64, thread: ThreadId, backtrace: Option< BacktraceId > ) {
+        let next_thread_index = self.thread_to_index.len();
+        let thread = *self.thread_to_index.entry( thread ).or_insert( next_thread_index );
+
+        let mut wait = None;
+        let last_event = std::mem::replace( &mut self.last_event_for_slot[ slot ], self.events.len() );
+        if last_event != !0 && self.events[ last_event ].thread != thread {
+            let handoff = self.handoff_count;
+            self.handoff_count += 1;
+            self.events[ last_event ].signal = Some( handoff );
+            wait = Some( handoff );
+        }
+
+        if let Some( backtrace ) = backtrace {
+            for (frame_id, _) in self.data.get_backtrace( backtrace ) {
+                *self.used_frames.entry( frame_id ).or_insert( 0 ) += 1;
+            }
+        }
+
+        self.events.push( Event {
+            kind,
+            slot,
+            timestamp,
+            size,
+            backtrace,
+            thread,
+            wait,
+            signal: None
+        });
+    }
+
+    fn preprocess_alloc( &mut self, allocation: &Allocation, backtrace: Option< BacktraceId > ) {
+        let slot = match self.free_slots.pop() {
+            Some( slot ) => slot,
+            None => {
+                self.last_event_for_slot.push( !0 );
+                self.last_event_for_slot.len() - 1
+            }
         };
 
         self.slot_by_pointer.insert( allocation.pointer, slot );
-        self.slot_by_index.push( slot );
+        self.push_event( OP_ALLOC, slot, allocation.timestamp, allocation.size, allocation.thread, backtrace );
     }
 
-    fn preprocess_dealloc( &mut self, allocation: &Allocation ) {
+    fn preprocess_dealloc( &mut self, allocation: &Allocation, backtrace: Option< BacktraceId > ) {
         let slot = self.slot_by_pointer.remove( &allocation.pointer ).unwrap();
         self.free_slots.push( slot );
-        self.slot_by_index.push( slot );
+
+        let deallocation = allocation.deallocation.as_ref().unwrap();
+        self.push_event( OP_FREE, slot, deallocation.timestamp, 0, deallocation.thread, backtrace );
     }
 
     fn preprocess_realloc( &mut self, new_allocation: &Allocation, old_allocation: &Allocation ) {
         let slot = self.slot_by_pointer.remove( &old_allocation.pointer ).unwrap();
         self.slot_by_pointer.insert( new_allocation.pointer, slot );
-        self.slot_by_index.push( slot );
-    }
-
-    fn preprocess_backtrace( &mut self, data: &Data, backtrace: BacktraceId ) {
-        for (frame_id, _) in data.get_backtrace( backtrace ) {
-            *self.used_frames.entry( frame_id ).or_insert( 0 ) += 1;
-        }
+        self.push_event( OP_REALLOC, slot, new_allocation.timestamp, new_allocation.size, new_allocation.thread, Some( new_allocation.backtrace ) );
     }
 
-    fn generate_traversal( frame_map: &HashMap< FrameId, usize >, last_backtrace: &mut Option< BacktraceId >, mut output: impl io::Write, data: &Data, backtrace_id: BacktraceId ) -> io::Result< () > {
-        let backtrace = data.get_backtrace( backtrace_id );
+    fn generate_traversal( &self, frame_map: &HashMap< FrameId, usize >, last_backtrace: &mut Option< BacktraceId >, output: &mut Vec< Op >, backtrace_id: BacktraceId ) {
+        let backtrace = self.data.get_backtrace( backtrace_id );
         let (last_len, common_len) = if let Some( last_backtrace_id ) = *last_backtrace {
-            let last_backtrace = data.get_backtrace( last_backtrace_id );
+            let last_backtrace = self.data.get_backtrace( last_backtrace_id );
             let last_len = last_backtrace.len();
             let common_len = backtrace.clone().zip( last_backtrace ).take_while( |((a, _), (b, _))| a == b ).count();
             (last_len, common_len)
@@ -59,51 +193,43 @@ impl Exporter {
 
         let go_up_count = last_len - common_len;
         for _ in 0..go_up_count {
-            output.write_u64::< NativeEndian >( 5 )?;
-            output.write_u64::< NativeEndian >( 0 )?;
-            output.write_u64::< NativeEndian >( 0 )?;
-            output.write_u64::< NativeEndian >( 0 )?;
+            output.push( [OP_GO_UP, 0, 0, 0] );
         }
 
         for (frame_id, _) in backtrace.skip( common_len ) {
-            output.write_u64::< NativeEndian >( 4 )?;
-            output.write_u64::< NativeEndian >( *frame_map.get( &frame_id ).unwrap() as _ )?;
-            output.write_u64::< NativeEndian >( 0 )?;
-            output.write_u64::< NativeEndian >( 0 )?;
+            output.push( [OP_GO_DOWN, *frame_map.get( &frame_id ).unwrap() as u64, 0, 0] );
         }
 
         *last_backtrace = Some( backtrace_id );
-        Ok(())
     }
 
-    fn generate_alloc< T: io::Write >( mut output: T, slot: usize, allocation: &Allocation ) -> io::Result< () > {
-        let timestamp = allocation.timestamp.as_usecs();
-        output.write_u64::< NativeEndian >( 1 )?;
-        output.write_u64::< NativeEndian >( slot as u64 )?;
-        output.write_u64::< NativeEndian >( timestamp as u64 )?;
-        output.write_u64::< NativeEndian >( allocation.size as u64 )?;
-        Ok(())
-    }
+    /// Generates the ops for a single thread.
+    fn generate_thread( &self, frame_map: &HashMap< FrameId, usize >, events: &[usize] ) -> Vec< Op > {
+        let mut output = Vec::new();
+        let mut last_backtrace = None;
+        for &index in events {
+            let event = &self.events[ index ];
+            if let Some( backtrace ) = event.backtrace {
+                self.generate_traversal( frame_map, &mut last_backtrace, &mut output, backtrace );
+            }
 
-    fn generate_dealloc< T: io::Write >( mut output: T, slot: usize, allocation: &Allocation ) -> io::Result< () > {
-        let timestamp = allocation.timestamp.as_usecs();
-        output.write_u64::< NativeEndian >( 2 )?;
-        output.write_u64::< NativeEndian >( slot as u64 )?;
-        output.write_u64::< NativeEndian >( timestamp as u64 )?;
-        output.write_u64::< NativeEndian >( 0 )?;
-        Ok(())
-    }
+            if let Some( handoff ) = event.wait {
+                output.push( [OP_WAIT, handoff, 0, 0] );
+            }
 
-    fn generate_realloc< T: io::Write >( mut output: T, slot: usize, new_allocation: &Allocation ) -> io::Result< () > {
-        let timestamp = new_allocation.timestamp.as_usecs();
-        output.write_u64::< NativeEndian >( 3 )?;
-        output.write_u64::< NativeEndian >( slot as u64 )?;
-        output.write_u64::< NativeEndian >( timestamp as u64 )?;
-        output.write_u64::< NativeEndian >( new_allocation.size as u64 )?;
-        Ok(())
+            output.push( [event.kind, event.slot as u64, event.timestamp.as_usecs(), event.size] );
+
+            if let Some( handoff ) = event.signal {
+                output.push( [OP_SIGNAL, handoff, 0, 0] );
+            }
+        }
+
+        output.push( [OP_END, 0, 0, 0] );
+        output
     }
 
-    fn process< T: io::Write, F: Fn( AllocationId, &Allocation ) -> bool >( mut self, data: &Data, filter: F, mut output: T ) -> io::Result< () > {
+    fn process< T: io::Write, F: Fn( AllocationId, &Allocation ) -> bool >( mut self, filter: F, format: ReplayFormat, mut output: T ) -> io::Result< () > {
+        let data = self.data;
         for operation in data.operations() {
             match operation {
                 Operation::Allocation { allocation, allocation_id, .. } => {
@@ -111,90 +237,105 @@ impl Exporter {
                         continue;
                     }
 
-                    self.preprocess_backtrace( data, allocation.backtrace );
-                    self.preprocess_alloc( allocation );
+                    self.preprocess_alloc( allocation, Some( allocation.backtrace ) );
                 },
                 Operation::Deallocation { allocation, deallocation, allocation_id, .. } => {
                     if !filter( allocation_id, allocation ) {
                         continue;
                     }
 
-                    if let Some( backtrace ) = deallocation.backtrace {
-                        self.preprocess_backtrace( data, backtrace );
-                    }
-                    self.preprocess_dealloc( allocation );
+                    self.preprocess_dealloc( allocation, deallocation.backtrace );
                 },
                 Operation::Reallocation { new_allocation, old_allocation, allocation_id, .. } => {
                     let is_new_ok = filter( allocation_id, new_allocation );
                     let is_old_ok = filter( allocation_id, old_allocation );
 
-                    if is_new_ok || is_old_ok {
-                        self.preprocess_backtrace( data, new_allocation.backtrace );
-                    }
-
                     if is_new_ok && is_old_ok {
                         self.preprocess_realloc( new_allocation, old_allocation );
                     } else if is_new_ok {
-                        self.preprocess_alloc( new_allocation );
+                        self.preprocess_alloc( new_allocation, Some( new_allocation.backtrace ) );
                     } else if is_old_ok {
-                        self.preprocess_dealloc( old_allocation );
+                        self.preprocess_dealloc( old_allocation, Some( new_allocation.backtrace ) );
                     }
                 }
             }
         }
 
-        output.write_u64::< NativeEndian >( self.slot_count as u64 )?;
         let mut frames: Vec< _ > = self.used_frames.drain().collect();
         frames.sort_by_key( |&(_, count)| count );
         frames.reverse();
         let frame_map: HashMap< _, _ > =
             frames.into_iter().enumerate().map( |(index, (frame_id, _))| (frame_id, index) ).collect();
 
-        let mut last_backtrace = None;
-        for (operation, slot) in data.operations().zip( self.slot_by_index ) {
-            match operation {
-                Operation::Allocation { allocation, allocation_id, .. } => {
-                    if !filter( allocation_id, allocation ) {
-                        continue;
-                    }
+        let mut events_for_thread = vec![ Vec::new(); self.thread_to_index.len() ];
+        for (index, event) in self.events.iter().enumerate() {
+            events_for_thread[ event.thread ].push( index );
+        }
 
-                    Self::generate_traversal( &frame_map, &mut last_backtrace, &mut output, data, allocation.backtrace )?;
-                    Self::generate_alloc( &mut output, slot, allocation )?;
-                },
-                Operation::Deallocation { allocation, deallocation, allocation_id, .. } => {
-                    if !filter( allocation_id, allocation ) {
-                        continue;
-                    }
+        let ops_for_thread: Vec< Vec< Op > > = events_for_thread.par_iter().map( |events| self.generate_thread( &frame_map, events ) ).collect();
 
-                    if let Some( backtrace ) = deallocation.backtrace {
-                        Self::generate_traversal( &frame_map, &mut last_backtrace, &mut output, data, backtrace )?;
-                    }
-                    Self::generate_dealloc( &mut output, slot, allocation )?;
-                },
-                Operation::Reallocation { new_allocation, old_allocation, allocation_id, .. } => {
-                    let is_new_ok = filter( allocation_id, new_allocation );
-                    let is_old_ok = filter( allocation_id, old_allocation );
+        if format == ReplayFormat::Compact {
+            let bytes_for_thread: Vec< Vec< u8 > > = ops_for_thread.par_iter().map( |ops| encode_compact( ops ) ).collect();
+            self.write_header( COMPACT_MAGIC, bytes_for_thread.iter().map( |bytes| bytes.len() ), &mut output )?;
+            for bytes in bytes_for_thread {
+                output.write_all( &bytes )?;
+            }
 
-                    if is_new_ok || is_old_ok {
-                        Self::generate_traversal( &frame_map, &mut last_backtrace, &mut output, data, new_allocation.backtrace )?;
-                    }
+            return Ok(());
+        }
 
-                    if is_new_ok && is_old_ok {
-                        Self::generate_realloc( &mut output, slot, new_allocation )?;
-                    } else if is_new_ok {
-                        Self::generate_alloc( &mut output, slot, new_allocation )?;
-                    } else if is_old_ok {
-                        Self::generate_dealloc( &mut output, slot, old_allocation )?;
-                    }
+        self.write_header( MAGIC, ops_for_thread.iter().map( |ops| ops.len() ), &mut output )?;
+        for ops in ops_for_thread {
+            for op in ops {
+                for value in op.iter() {
+                    output.write_u64::< NativeEndian >( *value )?;
                 }
             }
         }
 
-        output.write_u64::< NativeEndian >( 0 )?;
+        Ok(())
+    }
+
+    fn write_header< T: io::Write >( &self, magic: u64, thread_lengths: impl ExactSizeIterator< Item = usize >, output: &mut T ) -> io::Result< () > {
+        output.write_u64::< NativeEndian >( magic )?;
+        output.write_u64::< NativeEndian >( self.last_event_for_slot.len() as u64 )?;
+        output.write_u64::< NativeEndian >( thread_lengths.len() as u64 )?;
+        output.write_u64::< NativeEndian >( self.handoff_count )?;
+        output.write_u64::< NativeEndian >( self.data.initial_timestamp().as_usecs() )?;
+
+        let mut offset = 0;
+        for length in thread_lengths {
+            output.write_u64::< NativeEndian >( offset )?;
+            offset += length as u64;
+        }
+
         Ok(())
     }
 }
 
 pub fn export_as_replay< T: io::Write, F: Fn( AllocationId, &Allocation ) -> bool >( data: &Data, output: T, filter: F ) -> io::Result< () > {
-    Exporter::default().process( data, filter, output )
+    export_as_replay_with_format( data, output, filter, ReplayFormat::Fixed )
+}
+
+pub fn export_as_replay_with_format< T: io::Write, F: Fn( AllocationId, &Allocation ) -> bool >( data: &Data, output: T, filter: F, format: ReplayFormat ) -> io::Result< () > {
+    Exporter::new( data ).process( filter, format, output )
+}
+
+#[test]
+fn test_encode_compact() {
+    let ops = [
+        [OP_GO_DOWN, 300, 0, 0],
+        [OP_ALLOC, 1, 1000, 16],
+        [OP_FREE, 1, 990, 0],
+        [OP_GO_UP, 0, 0, 0],
+        [OP_END, 0, 0, 0]
+    ];
+
+    assert_eq!( encode_compact( &ops ), vec![
+        OP_GO_DOWN as u8, 0xac, 0x02,
+        OP_ALLOC as u8, 1, 0xd0, 0x0f, 16,
+        OP_FREE as u8, 1, 19,
+        OP_GO_UP as u8,
+        OP_END as u8
+    ]);
 }
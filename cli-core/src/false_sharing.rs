@@ -0,0 +1,209 @@
+//! Detection of allocations from different threads which were alive on the same cache line at the same time.
+//!
+//! Two allocations can only share a line through the first or the last line which either of them
+//! touches, so only those are looked at. The allocations which touched a given line are swept through
+//! in the order in which they were made, and every pair which was alive at the same time
+//! and was made by different threads is accounted to its pair of backtraces.
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+
+use crate::{AllocationId, BacktraceId, Data, Timestamp};
+use crate::data::ThreadId;
+use crate::filter::Duration;
+
+pub const DEFAULT_CACHE_LINE_SIZE: u64 = 64;
+
+/// A pair of backtraces whose allocations ended up sharing cache lines.
+#[derive(Clone, Debug)]
+pub struct CoLocatedPair {
+    /// The backtraces of both allocations; the lower one goes first.
+    pub backtraces: (BacktraceId, BacktraceId),
+    /// How many times an allocation from one of the backtraces shared a line with one from the other.
+    pub count: u64,
+    /// For how long in total those allocations were alive at the same time.
+    pub overlap: Duration,
+    /// Every allocation which was involved, sorted.
+    pub allocation_ids: Vec< AllocationId >
+}
+
+#[derive(Copy, Clone)]
+struct Placement {
+    line: u64,
+    start: Timestamp,
+    end: Timestamp,
+    thread: ThreadId,
+    backtrace: BacktraceId,
+    id: AllocationId
+}
+
+struct Accumulator {
+    count: u64,
+    overlap: Timestamp,
+    allocation_ids: Vec< AllocationId >
+}
+
+impl Default for Accumulator {
+    fn default() -> Self {
+        Accumulator {
+            count: 0,
+            overlap: Timestamp::min(),
+            allocation_ids: Vec::new()
+        }
+    }
+}
+
+type Accumulators = HashMap< (BacktraceId, BacktraceId), Accumulator >;
+
+fn sweep_line( placements: &[Placement], active: &mut Vec< Placement >, output: &mut Accumulators ) {
+    active.clear();
+    for placement in placements {
+        // Live allocations can't overlap, so only a handful of them can be active at the same time.
+        active.retain( |other| other.end > placement.start );
+        for other in active.iter() {
+            if other.thread == placement.thread {
+                continue;
+            }
+
+            let key = if other.backtrace <= placement.backtrace {
+                (other.backtrace, placement.backtrace)
+            } else {
+                (placement.backtrace, other.backtrace)
+            };
+
+            let overlap = std::cmp::min( other.end, placement.end ) - placement.start;
+            let accumulator = output.entry( key ).or_default();
+            accumulator.count += 1;
+            accumulator.overlap = accumulator.overlap + overlap;
+            accumulator.allocation_ids.push( other.id );
+            accumulator.allocation_ids.push( placement.id );
+        }
+
+        active.push( *placement );
+    }
+}
+
+fn co_locate( placements: &mut [Placement] ) -> Vec< CoLocatedPair > {
+    placements.par_sort_unstable_by_key( |placement| (placement.line, placement.start) );
+
+    let mut lines = Vec::new();
+    let mut offset = 0;
+    for index in 1..=placements.len() {
+        if index == placements.len() || placements[ index ].line != placements[ offset ].line {
+            // A line which was only ever touched by a single allocation can't be shared.
+            if index - offset > 1 {
+                lines.push( offset..index );
+            }
+            offset = index;
+        }
+    }
+
+    let placements = &*placements;
+    let accumulators = lines.into_par_iter()
+        .fold( || (Accumulators::new(), Vec::new()), |(mut output, mut active), range| {
+            sweep_line( &placements[ range ], &mut active, &mut output );
+            (output, active)
+        })
+        .map( |(output, _)| output )
+        .reduce( Accumulators::new, |mut lhs, rhs| {
+            for (key, value) in rhs {
+                let accumulator = lhs.entry( key ).or_default();
+                accumulator.count += value.count;
+                accumulator.overlap = accumulator.overlap + value.overlap;
+                accumulator.allocation_ids.extend( value.allocation_ids );
+            }
+            lhs
+        });
+
+    let mut pairs: Vec< _ > = accumulators.into_par_iter().map( |(backtraces, mut accumulator)| {
+        accumulator.allocation_ids.sort_unstable();
+        accumulator.allocation_ids.dedup();
+        CoLocatedPair {
+            backtraces,
+            count: accumulator.count,
+            overlap: Duration( accumulator.overlap ),
+            allocation_ids: accumulator.allocation_ids
+        }
+    }).collect();
+
+    pairs.par_sort_unstable_by( |lhs, rhs| rhs.count.cmp( &lhs.count ).then( lhs.backtraces.cmp( &rhs.backtraces ) ) );
+    pairs
+}
+
+/// Finds the pairs of backtraces whose allocations shared cache lines with each other, most frequent first.
+///
+/// The sampled allocations are skipped since their neighbours weren't necessarily tracked.
+pub fn find_co_located_allocations( data: &Data, ids: &[AllocationId], line_size: u64 ) -> Vec< CoLocatedPair > {
+    let line_size = std::cmp::max( line_size, 1 );
+    let last_timestamp = data.last_timestamp();
+    let mut placements: Vec< _ > = ids.par_iter().flat_map_iter( |&id| {
+        let allocation = data.get_allocation( id );
+        if allocation.size == 0 || allocation.is_sampled() {
+            return None.into_iter().chain( None );
+        }
+
+        let placement = Placement {
+            line: allocation.pointer / line_size,
+            start: allocation.timestamp,
+            end: allocation.deallocation.as_ref().map( |deallocation| deallocation.timestamp ).unwrap_or( last_timestamp ),
+            thread: allocation.thread,
+            backtrace: allocation.backtrace,
+            id
+        };
+
+        let last_line = (allocation.pointer + allocation.size - 1) / line_size;
+        let second = if last_line != placement.line {
+            Some( Placement { line: last_line, ..placement } )
+        } else {
+            None
+        };
+
+        Some( placement ).into_iter().chain( second )
+    }).collect();
+
+    co_locate( &mut placements )
+}
+
+#[test]
+fn test_co_locate() {
+    let placement = |line, start, end, thread, backtrace, id| {
+        Placement {
+            line,
+            start: Timestamp::from_secs( start ),
+            end: Timestamp::from_secs( end ),
+            thread,
+            backtrace: BacktraceId::new( backtrace ),
+            id: AllocationId::new( id )
+        }
+    };
+
+    let mut placements = vec![
+        // Shared between two threads for two seconds.
+        placement( 1, 0, 10, 1, 2, 1 ),
+        placement( 1, 8, 20, 2, 1, 2 ),
+        // Shared by the same thread.
+        placement( 2, 0, 10, 1, 3, 3 ),
+        placement( 2, 5, 10, 1, 4, 4 ),
+        // Not alive at the same time.
+        placement( 3, 0, 10, 1, 3, 5 ),
+        placement( 3, 10, 20, 2, 4, 6 ),
+        // Shared again by the same backtraces as the first pair, for one second.
+        placement( 4, 30, 40, 3, 1, 8 ),
+        placement( 4, 39, 50, 4, 2, 7 ),
+        // Shared by the same backtrace.
+        placement( 5, 0, 10, 1, 5, 9 ),
+        placement( 5, 0, 10, 2, 5, 10 )
+    ];
+
+    let pairs = co_locate( &mut placements );
+    assert_eq!( pairs.len(), 2 );
+
+    assert_eq!( pairs[ 0 ].backtraces, (BacktraceId::new( 1 ), BacktraceId::new( 2 )) );
+    assert_eq!( pairs[ 0 ].count, 2 );
+    assert_eq!( pairs[ 0 ].overlap.0, Timestamp::from_secs( 3 ) );
+    assert_eq!( pairs[ 0 ].allocation_ids, vec![ AllocationId::new( 1 ), AllocationId::new( 2 ), AllocationId::new( 7 ), AllocationId::new( 8 ) ] );
+
+    assert_eq!( pairs[ 1 ].backtraces, (BacktraceId::new( 5 ), BacktraceId::new( 5 )) );
+    assert_eq!( pairs[ 1 ].count, 1 );
+    assert_eq!( pairs[ 1 ].overlap.0, Timestamp::from_secs( 10 ) );
+}
@@ -1,15 +1,46 @@
+use std::borrow::Cow;
+use std::sync::Arc;
+
+use rayon::prelude::*;
 use regex::Regex;
-use ahash::AHashMap as HashMap;
 use ahash::AHashSet as HashSet;
-use crate::{Allocation, BacktraceId, Data, Timestamp, DataPointer, Map, MapId};
+use lru::LruCache;
+use parking_lot::Mutex;
+use crate::{Allocation, AllocationId, BacktraceId, Data, Timestamp, DataPointer, Map, MapId};
+use crate::bitmap::Bitmap;
+use crate::data::{AllocationColumns, AllocationFlags};
 
 pub trait TryMatch {
     type Item;
     fn try_match( &self, data: &Data, item: &Self::Item ) -> bool;
 }
 
+/// Matching by an ID, which lets the filter look only at the data it actually needs.
+pub trait TryMatchById: TryMatch {
+    type Id: Copy;
+    fn try_match_by_id( &self, data: &Data, id: Self::Id ) -> bool;
+}
+
+/// Matching every item at once, which returns a bitmap of the indexes of all of the matched items.
+pub trait Select {
+    fn select( &self, data: &Data ) -> Bitmap;
+}
+
+/// A rough estimate of how expensive a filter is and how much it matches, used to order the predicates.
+#[derive(Copy, Clone, Debug)]
+pub struct Estimate {
+    /// The relative cost of matching a single item.
+    pub cost: f64,
+    /// The expected fraction of the items which will be matched.
+    pub selectivity: f64
+}
+
+pub trait Plan {
+    fn estimate( &self, data: &Data ) -> Estimate;
+}
+
 pub trait Compile {
-    type Compiled: TryMatch + Send + Sync;
+    type Compiled: TryMatch + Plan + Send + Sync;
     fn compile( &self, data: &Data ) -> Self::Compiled;
 }
 
@@ -30,7 +61,7 @@ impl Duration {
     }
 }
 
-#[derive(Clone, Default)]
+#[derive(Clone, Default, Debug)]
 pub struct RawBacktraceFilter {
     pub only_passing_through_function: Option< Regex >,
     pub only_not_passing_through_function: Option< Regex >,
@@ -45,7 +76,7 @@ pub struct RawBacktraceFilter {
     pub only_not_matching_deallocation_backtraces: Option< HashSet< BacktraceId > >,
 }
 
-#[derive(Clone, Default)]
+#[derive(Clone, Default, Debug)]
 pub struct RawCommonFilter {
     pub only_larger_or_equal: Option< u64 >,
     pub only_larger: Option< u64 >,
@@ -67,7 +98,7 @@ pub struct RawCommonFilter {
     pub only_temporary: bool,
 }
 
-#[derive(Clone, Default)]
+#[derive(Clone, Default, Debug)]
 pub struct RawAllocationFilter {
     pub backtrace_filter: RawBacktraceFilter,
     pub common_filter: RawCommonFilter,
@@ -104,6 +135,12 @@ pub struct RawAllocationFilter {
     pub only_jemalloc: bool,
     pub only_not_jemalloc: bool,
     pub only_with_marker: Option< u32 >,
+    pub only_with_thread_tag: Option< u32 >,
+    pub only_from_pool: Option< u16 >,
+    pub only_not_from_pools: bool,
+    pub only_on_numa_node: Option< u32 >,
+    pub only_from_thread_on_numa_node: Option< u32 >,
+    pub only_numa_remote: bool,
 
     pub only_from_maps: Option< HashSet< MapId > >,
 }
@@ -115,6 +152,10 @@ pub struct RawMapFilter {
 
     pub only_peak_rss_at_least: Option< u64 >,
     pub only_peak_rss_at_most: Option< u64 >,
+    pub only_peak_huge_pages_at_least: Option< u64 >,
+    pub only_peak_huge_pages_at_most: Option< u64 >,
+    pub only_huge_page_advised: bool,
+    pub only_not_huge_page_advised: bool,
     pub only_jemalloc: bool,
     pub only_not_jemalloc: bool,
     pub only_bytehound: bool,
@@ -127,7 +168,7 @@ pub struct RawMapFilter {
     pub only_not_executable: bool,
 }
 
-#[derive(Copy, Clone)]
+#[derive(Copy, Clone, Debug)]
 pub enum NumberOrFractionOfTotal {
     Number( u64 ),
     Fraction( f64 )
@@ -189,6 +230,8 @@ pub struct RawCompiledAllocationFilter {
     only_position_in_chain_at_most: u32,
 
     enable_group_filter: bool,
+    /// The groups matched by all of the group filters, precomputed when the filter's compiled.
+    matched_groups: Option< Bitmap >,
     only_group_allocations_at_least: usize,
     only_group_allocations_at_most: usize,
     only_group_interval_at_least: Duration,
@@ -202,8 +245,17 @@ pub struct RawCompiledAllocationFilter {
     only_ptmalloc_from_main_arena: Option< bool >,
     only_jemalloc: Option< bool >,
     only_with_marker: Option< u32 >,
+    only_with_thread_tag: Option< u32 >,
+    only_from_pool: Option< u16 >,
+    only_not_from_pools: bool,
+    only_on_numa_node: Option< u32 >,
+    only_from_thread_on_numa_node: Option< u32 >,
+    only_numa_remote: bool,
 
-    only_from_maps: Option< Vec< MapId > >
+    only_from_maps: Option< Vec< MapId > >,
+
+    /// Whether anything besides the `AllocationColumns` has to be looked at.
+    needs_full_allocation: bool
 }
 
 #[derive(Clone)]
@@ -215,6 +267,9 @@ pub struct RawCompiledMapFilter {
 
     only_peak_rss_at_least: Option< u64 >,
     only_peak_rss_at_most: Option< u64 >,
+    only_peak_huge_pages_at_least: Option< u64 >,
+    only_peak_huge_pages_at_most: Option< u64 >,
+    huge_page_advised_filter: Option< bool >,
     jemalloc_filter: Option< bool >,
     bytehound_filter: Option< bool >,
     readable_filter: Option< bool >,
@@ -228,7 +283,7 @@ impl< T > From< T > for Filter< T > {
     }
 }
 
-#[derive(Clone)]
+#[derive(Clone, Debug)]
 pub enum Filter< T > {
     Basic( T ),
     And( Box< Filter< T > >, Box< Filter< T > > ),
@@ -252,114 +307,20 @@ fn compile_backtrace_filter( data: &Data, filter: &RawBacktraceFilter ) -> Optio
     let only_backtrace_length_at_least = filter.only_backtrace_length_at_least.unwrap_or( 0 );
     let only_backtrace_length_at_most = filter.only_backtrace_length_at_most.unwrap_or( !0 );
 
-    let mut matched_backtraces = HashSet::new();
-    let mut positive_cache = HashMap::new();
-    let mut negative_cache = HashMap::new();
-    for (backtrace_id, backtrace) in data.all_backtraces() {
-        if backtrace.len() < only_backtrace_length_at_least || backtrace.len() > only_backtrace_length_at_most {
-            continue;
-        }
-
-        let mut positive_matched =
-            filter.only_passing_through_function.is_none() &&
-            filter.only_passing_through_source.is_none();
-        let mut negative_matched = false;
-        let check_negative =
-            filter.only_not_passing_through_function.is_some() ||
-            filter.only_not_passing_through_source.is_some();
-
-        for (frame_id, frame) in backtrace {
-            let check_positive =
-                if positive_matched {
-                    false
-                } else if let Some( &cached_result ) = positive_cache.get( &frame_id ) {
-                    positive_matched = cached_result;
-                    false
-                } else {
-                    true
-                };
-
-            if positive_matched && !check_negative {
-                break;
-            }
-
-            let mut function = None;
-            if (check_positive && filter.only_passing_through_function.is_some()) || filter.only_not_passing_through_function.is_some() {
-                function = frame.function().or_else( || frame.raw_function() ).map( |id| data.interner().resolve( id ).unwrap() );
-            }
-
-            let mut source = None;
-            if (check_positive && filter.only_passing_through_source.is_some()) || filter.only_not_passing_through_source.is_some() {
-                source = frame.source().map( |id| data.interner().resolve( id ).unwrap() )
-            }
-
-            if check_positive {
-                let matched_function =
-                    if let Some( regex ) = filter.only_passing_through_function.as_ref() {
-                        if let Some( ref function ) = function {
-                            regex.is_match( function )
-                        } else {
-                            false
-                        }
-                    } else {
-                        true
-                    };
-
-                let matched_source =
-                    if let Some( regex ) = filter.only_passing_through_source.as_ref() {
-                        if let Some( ref source ) = source {
-                            regex.is_match( source )
-                        } else {
-                            false
-                        }
-                    } else {
-                        true
-                    };
-
-                positive_matched = matched_function && matched_source;
-                positive_cache.insert( frame_id, positive_matched );
-            }
-
-            if check_negative {
-                match negative_cache.get( &frame_id ).cloned() {
-                    Some( true ) => {
-                        negative_matched = true;
-                        break;
-                    },
-                    Some( false ) => {
-                        continue;
-                    },
-                    None => {}
-                }
-
-                if let Some( regex ) = filter.only_not_passing_through_function.as_ref() {
-                    if let Some( ref function ) = function {
-                        if regex.is_match( function ) {
-                            negative_cache.insert( frame_id, true );
-                            negative_matched = true;
-                            break;
-                        }
-                    }
-                }
-
-                if let Some( regex ) = filter.only_not_passing_through_source.as_ref() {
-                    if let Some( ref source ) = source {
-                        if regex.is_match( source ) {
-                            negative_cache.insert( frame_id, true );
-                            negative_matched = true;
-                            break;
-                        }
-                    }
-                }
-
-                negative_cache.insert( frame_id, false );
-            }
-        }
-
-        if positive_matched && !negative_matched {
-            matched_backtraces.insert( backtrace_id );
-        }
-    }
+    let matched = data.backtraces_matching_frames(
+        filter.only_passing_through_function.as_ref(),
+        filter.only_passing_through_source.as_ref(),
+        filter.only_not_passing_through_function.as_ref(),
+        filter.only_not_passing_through_source.as_ref()
+    );
+
+    let mut matched_backtraces: HashSet< BacktraceId > = matched.iter()
+        .map( |index| BacktraceId::new( index as u32 ) )
+        .filter( |&backtrace_id| {
+            let length = data.get_frame_ids( backtrace_id ).len();
+            length >= only_backtrace_length_at_least && length <= only_backtrace_length_at_most
+        })
+        .collect();
 
     if let Some( ref only_matching_backtraces ) = filter.only_matching_backtraces {
         matched_backtraces = matched_backtraces.intersection( &only_matching_backtraces ).copied().collect();
@@ -499,6 +460,10 @@ impl Compile for RawAllocationFilter {
             is_impossible = true;
         }
 
+        if self.only_from_pool.is_some() && self.only_not_from_pools {
+            is_impossible = true;
+        }
+
         if let Some( ref map_ids ) = self.only_from_maps {
             if map_ids.is_empty() {
                 is_impossible = true;
@@ -564,7 +529,20 @@ impl Compile for RawAllocationFilter {
             self.only_group_leaked_allocations_at_least.is_some() ||
             self.only_group_leaked_allocations_at_most.is_some();
 
-        RawCompiledAllocationFilter {
+        let needs_full_allocation =
+            self.backtrace_filter.only_matching_deallocation_backtraces.is_some() ||
+            self.backtrace_filter.only_not_matching_deallocation_backtraces.is_some() ||
+            enable_chain_filter ||
+            self.only_with_marker.is_some() ||
+            self.only_with_thread_tag.is_some() ||
+            self.only_from_pool.is_some() ||
+            self.only_not_from_pools ||
+            self.only_on_numa_node.is_some() ||
+            self.only_from_thread_on_numa_node.is_some() ||
+            self.only_numa_remote ||
+            self.only_from_maps.is_some();
+
+        let mut compiled = RawCompiledAllocationFilter {
             is_impossible,
 
             backtrace_filter: RawCompiledBacktraceFilter {
@@ -601,6 +579,7 @@ impl Compile for RawAllocationFilter {
             only_group_leaked_allocations_at_most: self.only_group_leaked_allocations_at_most.unwrap_or( NumberOrFractionOfTotal::Number( !0 ) ),
 
             enable_group_filter,
+            matched_groups: None,
 
             only_ptmalloc_mmaped:
                 if self.only_ptmalloc_mmaped {
@@ -627,9 +606,29 @@ impl Compile for RawAllocationFilter {
                     None
                 },
             only_with_marker: self.only_with_marker,
+            only_with_thread_tag: self.only_with_thread_tag,
+            only_from_pool: self.only_from_pool,
+            only_not_from_pools: self.only_not_from_pools,
+            only_on_numa_node: self.only_on_numa_node,
+            only_from_thread_on_numa_node: self.only_from_thread_on_numa_node,
+            only_numa_remote: self.only_numa_remote,
 
             only_from_maps: self.only_from_maps.as_ref().map( |only_from_maps| only_from_maps.iter().copied().collect() ),
+
+            needs_full_allocation
+        };
+
+        if enable_group_filter {
+            let matched_groups = Bitmap::from_words( data.backtraces.len(), |start, count| {
+                (0..count).fold( 0, |word, bit| {
+                    word | ((compiled.try_match_group( data, BacktraceId::new( (start + bit) as u32 ) ) as u64) << bit)
+                })
+            });
+
+            compiled.matched_groups = Some( matched_groups );
         }
+
+        compiled
     }
 }
 
@@ -638,6 +637,7 @@ impl Compile for RawMapFilter {
     fn compile( &self, data: &Data ) -> Self::Compiled {
         let mut is_impossible =
             (self.only_bytehound && self.only_not_bytehound) ||
+            (self.only_huge_page_advised && self.only_not_huge_page_advised) ||
             (self.only_jemalloc && self.only_not_jemalloc) ||
             (self.only_readable && self.only_not_readable) ||
             (self.only_writable && self.only_not_writable) ||
@@ -672,6 +672,9 @@ impl Compile for RawMapFilter {
 
             only_peak_rss_at_least: self.only_peak_rss_at_least,
             only_peak_rss_at_most: self.only_peak_rss_at_most,
+            only_peak_huge_pages_at_least: self.only_peak_huge_pages_at_least,
+            only_peak_huge_pages_at_most: self.only_peak_huge_pages_at_most,
+            huge_page_advised_filter: bool_filter( self.only_huge_page_advised, self.only_not_huge_page_advised ),
             jemalloc_filter: bool_filter( self.only_jemalloc, self.only_not_jemalloc ),
             bytehound_filter:bool_filter( self.only_bytehound, self.only_not_bytehound ),
             readable_filter:bool_filter( self.only_readable, self.only_not_readable ),
@@ -686,11 +689,11 @@ pub struct BacktraceFilterArgs {
     pub deallocation_backtrace: Option< Option< BacktraceId > >
 }
 
-impl TryMatch for RawCompiledBacktraceFilter {
-    type Item = BacktraceFilterArgs;
-    fn try_match( &self, _: &Data, args: &BacktraceFilterArgs ) -> bool {
+impl RawCompiledBacktraceFilter {
+    #[inline]
+    fn try_match_backtrace( &self, backtrace: Option< BacktraceId > ) -> bool {
         if let Some( ref only_backtraces ) = self.only_backtraces {
-            if let Some( backtrace_id ) = args.backtrace {
+            if let Some( backtrace_id ) = backtrace {
                 if !only_backtraces.contains( &backtrace_id ) {
                     return false;
                 }
@@ -700,15 +703,20 @@ impl TryMatch for RawCompiledBacktraceFilter {
         }
 
         if let Some( ref set ) = self.only_not_matching_backtraces {
-            if let Some( backtrace_id ) = args.backtrace {
+            if let Some( backtrace_id ) = backtrace {
                 if set.contains( &backtrace_id ) {
                     return false;
                 }
             }
         }
 
+        true
+    }
+
+    #[inline]
+    fn try_match_deallocation_backtrace( &self, deallocation_backtrace: Option< Option< BacktraceId > > ) -> bool {
         if let Some( ref only_deallocation_backtraces ) = self.only_deallocation_backtraces {
-            if let Some( deallocation ) = args.deallocation_backtrace {
+            if let Some( deallocation ) = deallocation_backtrace {
                 if let Some( backtrace ) = deallocation {
                     if !only_deallocation_backtraces.contains( &backtrace ) {
                         return false;
@@ -722,7 +730,7 @@ impl TryMatch for RawCompiledBacktraceFilter {
         }
 
         if let Some( ref set ) = self.only_not_matching_deallocation_backtraces {
-            if let Some( deallocation ) = args.deallocation_backtrace {
+            if let Some( deallocation ) = deallocation_backtrace {
                 if let Some( backtrace ) = deallocation {
                     if set.contains( &backtrace ) {
                         return false;
@@ -735,6 +743,13 @@ impl TryMatch for RawCompiledBacktraceFilter {
     }
 }
 
+impl TryMatch for RawCompiledBacktraceFilter {
+    type Item = BacktraceFilterArgs;
+    fn try_match( &self, _: &Data, args: &BacktraceFilterArgs ) -> bool {
+        self.try_match_backtrace( args.backtrace ) && self.try_match_deallocation_backtrace( args.deallocation_backtrace )
+    }
+}
+
 pub struct CommonFilterArgs {
     pub pointer: DataPointer,
     pub size: u64,
@@ -794,26 +809,136 @@ impl TryMatch for RawCompiledCommonFilter {
     }
 }
 
-impl TryMatch for RawCompiledAllocationFilter {
-    type Item = Allocation;
-    fn try_match( &self, data: &Data, allocation: &Allocation ) -> bool {
-        if self.is_impossible {
-            return false;
-        }
+/// The fields of an allocation which are also available in the `AllocationColumns`.
+struct DenseAllocationArgs {
+    pointer: DataPointer,
+    size: u64,
+    timestamp: Timestamp,
+    deallocation_timestamp: Option< Timestamp >,
+    backtrace: BacktraceId,
+    flags: AllocationFlags
+}
 
+impl RawCompiledAllocationFilter {
+    /// Matches everything which doesn't need the full `Allocation`.
+    #[inline]
+    fn try_match_dense( &self, data: &Data, args: DenseAllocationArgs ) -> bool {
         if !self.common_filter.try_match( data, &CommonFilterArgs {
-            pointer: allocation.pointer,
-            size: allocation.size,
-            timestamp: allocation.timestamp,
-            deallocation_timestamp: allocation.deallocation.as_ref().map( |deallocation| deallocation.timestamp )
+            pointer: args.pointer,
+            size: args.size,
+            timestamp: args.timestamp,
+            deallocation_timestamp: args.deallocation_timestamp
         }) {
             return false;
         }
 
-        if !self.backtrace_filter.try_match( data, &BacktraceFilterArgs {
-            backtrace: Some( allocation.backtrace ),
-            deallocation_backtrace: allocation.deallocation.as_ref().map( |deallocation| deallocation.backtrace )
-        }) {
+        if !self.try_match_flags( args.flags ) {
+            return false;
+        }
+
+        self.try_match_indirect( data, args.backtrace )
+    }
+
+    #[inline]
+    fn try_match_flags( &self, flags: AllocationFlags ) -> bool {
+        if let Some( value ) = self.only_ptmalloc_mmaped {
+            if flags.contains( AllocationFlags::IS_JEMALLOC ) {
+                return false;
+            }
+
+            if flags.contains( AllocationFlags::IS_MMAPED ) != value {
+                return false;
+            }
+        }
+
+        if let Some( value ) = self.only_ptmalloc_from_main_arena {
+            if flags.contains( AllocationFlags::IS_JEMALLOC ) {
+                return false;
+            }
+
+            if !flags.contains( AllocationFlags::IN_NON_MAIN_ARENA ) != value {
+                return false;
+            }
+        }
+
+        if let Some( value ) = self.only_jemalloc {
+            if flags.contains( AllocationFlags::IS_JEMALLOC ) != value {
+                return false;
+            }
+        }
+
+        true
+    }
+
+    /// Matches everything which has to be looked up through the allocation's backtrace.
+    #[inline]
+    fn try_match_indirect( &self, data: &Data, backtrace: BacktraceId ) -> bool {
+        if !self.backtrace_filter.try_match_backtrace( Some( backtrace ) ) {
+            return false;
+        }
+
+        if let Some( ref matched_groups ) = self.matched_groups {
+            if !matched_groups.contains( backtrace.raw() as usize ) {
+                return false;
+            }
+        }
+
+        true
+    }
+
+    /// Matches the group filters, which only depend on the statistics of the whole group.
+    fn try_match_group( &self, data: &Data, backtrace: BacktraceId ) -> bool {
+        let group_allocations = data.get_allocation_ids_by_backtrace( backtrace );
+        if group_allocations.is_empty() {
+            return false;
+        }
+
+        if group_allocations.len() < self.only_group_allocations_at_least {
+            return false;
+        }
+
+        if group_allocations.len() > self.only_group_allocations_at_most {
+            return false;
+        }
+
+        let first_timestamp = data.allocation_columns.timestamps[ group_allocations.first().unwrap().raw() as usize ];
+        let last_timestamp = data.allocation_columns.timestamps[ group_allocations.last().unwrap().raw() as usize ];
+        let interval = Duration( last_timestamp - first_timestamp );
+
+        if interval < self.only_group_interval_at_least {
+            return false;
+        }
+
+        if interval > self.only_group_interval_at_most {
+            return false;
+        }
+
+        let stats = data.get_group_statistics( backtrace );
+        let total_allocations = stats.alloc_count as u64;
+        let leaked = (stats.alloc_count - stats.free_count) as u64;
+
+        if leaked < self.only_group_leaked_allocations_at_least.get( total_allocations ) {
+            return false;
+        }
+
+        if leaked > self.only_group_leaked_allocations_at_most.get( total_allocations ) {
+            return false;
+        }
+
+        if stats.max_total_usage_first_seen_at < self.only_group_max_total_usage_first_seen_at_least {
+            return false;
+        }
+
+        if stats.max_total_usage_first_seen_at > self.only_group_max_total_usage_first_seen_at_most {
+            return false;
+        }
+
+        true
+    }
+
+    /// Matches everything which `try_match_dense` doesn't.
+    fn try_match_rest( &self, data: &Data, allocation: &Allocation ) -> bool {
+        if !self.backtrace_filter.try_match_deallocation_backtrace( allocation.deallocation.as_ref().map( |deallocation| deallocation.backtrace ) ) {
             return false;
         }
 
@@ -888,88 +1013,306 @@ impl TryMatch for RawCompiledAllocationFilter {
             }
         }
 
-        if self.enable_group_filter {
-            let group_allocations = data.get_allocation_ids_by_backtrace( allocation.backtrace );
-            if group_allocations.len() < self.only_group_allocations_at_least {
-                return false;
-            }
-
-            if group_allocations.len() > self.only_group_allocations_at_most {
+        if let Some( marker ) = self.only_with_marker {
+            if allocation.marker != marker {
                 return false;
             }
+        }
 
-            let first_timestamp = data.get_allocation( *group_allocations.first().unwrap() ).timestamp;
-            let last_timestamp = data.get_allocation( *group_allocations.last().unwrap() ).timestamp;
-            let interval = Duration( last_timestamp - first_timestamp );
-
-            if interval < self.only_group_interval_at_least {
+        if let Some( tag ) = self.only_with_thread_tag {
+            if allocation.thread_tag != tag {
                 return false;
             }
+        }
 
-            if interval > self.only_group_interval_at_most {
+        if let Some( pool ) = self.only_from_pool {
+            if allocation.pool != Some( pool ) {
                 return false;
             }
+        }
 
-            let stats = data.get_group_statistics( allocation.backtrace );
-            let total_allocations = stats.alloc_count as u64;
-            let leaked = (stats.alloc_count - stats.free_count) as u64;
+        if self.only_not_from_pools && allocation.pool.is_some() {
+            return false;
+        }
 
-            if leaked < self.only_group_leaked_allocations_at_least.get( total_allocations ) {
+        if let Some( node ) = self.only_on_numa_node {
+            if allocation.memory_numa_node.map( |value| value as u32 ) != Some( node ) {
                 return false;
             }
+        }
 
-            if leaked > self.only_group_leaked_allocations_at_most.get( total_allocations ) {
+        if let Some( node ) = self.only_from_thread_on_numa_node {
+            if allocation.thread_numa_node.map( |value| value as u32 ) != Some( node ) {
                 return false;
             }
+        }
 
-            if stats.max_total_usage_first_seen_at < self.only_group_max_total_usage_first_seen_at_least {
-                return false;
+        if self.only_numa_remote {
+            match (allocation.thread_numa_node, allocation.memory_numa_node) {
+                (Some( thread_node ), Some( memory_node )) if thread_node != memory_node => {},
+                _ => return false
             }
+        }
 
-            if stats.max_total_usage_first_seen_at > self.only_group_max_total_usage_first_seen_at_most {
+        if let Some( ref only_from_maps ) = self.only_from_maps {
+            if !only_from_maps.iter().any( |&map_id| data.maps[ map_id.raw() as usize ].try_match_allocation( allocation ) ) {
                 return false;
             }
         }
 
-        if let Some( value ) = self.only_ptmalloc_mmaped {
-            if allocation.is_jemalloc() {
-                return false;
-            }
+        true
+    }
+}
 
-            if allocation.is_mmaped() != value {
-                return false;
-            }
+impl TryMatch for RawCompiledAllocationFilter {
+    type Item = Allocation;
+    fn try_match( &self, data: &Data, allocation: &Allocation ) -> bool {
+        if self.is_impossible {
+            return false;
         }
 
-        if let Some( value ) = self.only_ptmalloc_from_main_arena {
-            if allocation.is_jemalloc() {
-                return false;
-            }
+        let args = DenseAllocationArgs {
+            pointer: allocation.pointer,
+            size: allocation.size,
+            timestamp: allocation.timestamp,
+            deallocation_timestamp: allocation.deallocation.as_ref().map( |deallocation| deallocation.timestamp ),
+            backtrace: allocation.backtrace,
+            flags: allocation.flags
+        };
 
-            if !allocation.in_non_main_arena() != value {
-                return false;
-            }
+        self.try_match_dense( data, args ) && self.try_match_rest( data, allocation )
+    }
+}
+
+impl TryMatchById for RawCompiledAllocationFilter {
+    type Id = AllocationId;
+    fn try_match_by_id( &self, data: &Data, id: AllocationId ) -> bool {
+        if self.is_impossible {
+            return false;
         }
 
-        if let Some( value ) = self.only_jemalloc {
-            if allocation.is_jemalloc() != value {
-                return false;
-            }
+        let columns = &data.allocation_columns;
+        let index = id.raw() as usize;
+        let args = DenseAllocationArgs {
+            pointer: columns.pointers[ index ],
+            size: columns.sizes[ index ],
+            timestamp: columns.timestamps[ index ],
+            deallocation_timestamp: columns.deallocation_timestamp( id ),
+            backtrace: columns.backtraces[ index ],
+            flags: columns.flags[ index ]
+        };
+
+        if !self.try_match_dense( data, args ) {
+            return false;
         }
 
-        if let Some( marker ) = self.only_with_marker {
-            if allocation.marker != marker {
-                return false;
+        !self.needs_full_allocation || self.try_match_rest( data, data.get_allocation( id ) )
+    }
+}
+
+/// The part of an allocation filter which can be evaluated straight on the `AllocationColumns`.
+///
+/// Every predicate is evaluated for every row without any branches, so that the compiler
+/// can vectorize them and go through the columns a few rows at a time.
+struct ColumnKernel {
+    size_min: u64,
+    size_max: u64,
+    pointer_min: u64,
+    pointer_max: u64,
+    timestamp_min: u64,
+    timestamp_max: u64,
+    only_deallocated: bool,
+    deallocation_timestamp_min: u64,
+    deallocation_timestamp_max: u64,
+    lifetime_min: u64,
+    lifetime_max: u64,
+    only_leaked_or_deallocated_after: u64,
+    last_timestamp: u64,
+    flags_mask: u8,
+    flags_expected: u8
+}
+
+impl ColumnKernel {
+    /// Returns `None` if the filter can't match anything.
+    fn new( data: &Data, filter: &RawCompiledAllocationFilter ) -> Option< Self > {
+        let common = &filter.common_filter;
+        if filter.is_impossible || common.is_impossible {
+            return None;
+        }
+
+        let mut flag_checks = Vec::new();
+        if let Some( value ) = filter.only_ptmalloc_mmaped {
+            flag_checks.push( (AllocationFlags::IS_JEMALLOC | AllocationFlags::IS_MMAPED, if value { AllocationFlags::IS_MMAPED } else { AllocationFlags::empty() }) );
+        }
+
+        if let Some( value ) = filter.only_ptmalloc_from_main_arena {
+            flag_checks.push( (AllocationFlags::IS_JEMALLOC | AllocationFlags::IN_NON_MAIN_ARENA, if value { AllocationFlags::empty() } else { AllocationFlags::IN_NON_MAIN_ARENA }) );
+        }
+
+        if let Some( value ) = filter.only_jemalloc {
+            flag_checks.push( (AllocationFlags::IS_JEMALLOC, if value { AllocationFlags::IS_JEMALLOC } else { AllocationFlags::empty() }) );
+        }
+
+        // All of the checks can be merged into a single one as long as they don't contradict each other.
+        let flags_mask = flag_checks.iter().fold( AllocationFlags::empty(), |mask, &(check_mask, _)| mask | check_mask );
+        let flags_expected = flag_checks.iter().fold( AllocationFlags::empty(), |expected, &(_, check_expected)| expected | check_expected );
+        if flag_checks.iter().any( |&(check_mask, check_expected)| flags_expected & check_mask != check_expected ) {
+            return None;
+        }
+
+        let (only_deallocated, deallocation_timestamp_min, deallocation_timestamp_max) = match common.only_deallocated_between_inclusive {
+            Some( (min, max) ) => (true, min.as_usecs(), max.as_usecs()),
+            None => (false, 0, !0)
+        };
+
+        Some( ColumnKernel {
+            size_min: common.only_larger_or_equal,
+            size_max: common.only_smaller_or_equal,
+            pointer_min: common.only_address_at_least,
+            pointer_max: common.only_address_at_most,
+            timestamp_min: common.only_allocated_after_at_least.as_usecs(),
+            timestamp_max: common.only_allocated_until_at_most.as_usecs(),
+            only_deallocated,
+            deallocation_timestamp_min,
+            deallocation_timestamp_max,
+            lifetime_min: common.only_alive_for_at_least.0.as_usecs(),
+            lifetime_max: common.only_alive_for_at_most.map( |max| max.0.as_usecs() ).unwrap_or( !0 ),
+            only_leaked_or_deallocated_after: common.only_leaked_or_deallocated_after.as_usecs(),
+            last_timestamp: data.last_timestamp().as_usecs(),
+            flags_mask: flags_mask.bits(),
+            flags_expected: flags_expected.bits()
+        })
+    }
+
+    /// Evaluates up to 64 rows starting at `start`, returning a bit for every matched row.
+    #[inline]
+    fn select( &self, columns: &AllocationColumns, start: usize, count: usize ) -> u64 {
+        debug_assert!( count <= 64 );
+
+        let range = start..start + count;
+        let pointers = &columns.pointers[ range.clone() ];
+        let sizes = &columns.sizes[ range.clone() ];
+        let timestamps = &columns.timestamps[ range.clone() ];
+        let deallocation_timestamps = &columns.deallocation_timestamps[ range.clone() ];
+        let flags = &columns.flags[ range ];
+
+        let never_deallocated = Timestamp::max().as_usecs();
+        let mut word = 0;
+        for index in 0..count {
+            let pointer = pointers[ index ];
+            let size = sizes[ index ];
+            let timestamp = timestamps[ index ].as_usecs();
+            let deallocation_timestamp = deallocation_timestamps[ index ].as_usecs();
+            let is_deallocated = deallocation_timestamp != never_deallocated;
+            let lifetime_end = if is_deallocated { deallocation_timestamp } else { self.last_timestamp };
+            let lifetime = lifetime_end.wrapping_sub( timestamp );
+
+            let matched =
+                (size >= self.size_min) & (size <= self.size_max) &
+                (pointer >= self.pointer_min) & (pointer <= self.pointer_max) &
+                (timestamp >= self.timestamp_min) & (timestamp <= self.timestamp_max) &
+                (!self.only_deallocated | is_deallocated) &
+                (deallocation_timestamp >= self.deallocation_timestamp_min) & (deallocation_timestamp <= self.deallocation_timestamp_max) &
+                (lifetime >= self.lifetime_min) & (lifetime <= self.lifetime_max) &
+                (!is_deallocated | (deallocation_timestamp > self.only_leaked_or_deallocated_after)) &
+                (flags[ index ].bits() & self.flags_mask == self.flags_expected);
+
+            word |= (matched as u64) << index;
+        }
+
+        word
+    }
+}
+
+/// Below what fraction of all of the allocations it's faster to only check the ones from a sorted index.
+const INDEX_SCAN_THRESHOLD: usize = 16;
+
+impl RawCompiledAllocationFilter {
+    /// Returns the allocations within the most selective of the range predicates which has a sorted index.
+    ///
+    /// Every allocation which is matched by the filter is in the returned slice.
+    fn narrowest_index_range< 'a >( &self, data: &'a Data ) -> Option< Cow< 'a, [AllocationId] > > {
+        let common = &self.common_filter;
+        let mut candidates: Vec< &'a [AllocationId] > = Vec::new();
+        if common.only_allocated_after_at_least > data.initial_timestamp || common.only_allocated_until_at_most < data.last_timestamp {
+            candidates.push( data.alloc_sorted_by_timestamp( Some( common.only_allocated_after_at_least ), Some( common.only_allocated_until_at_most ) ) );
+        }
+
+        if common.only_larger_or_equal > 0 || common.only_smaller_or_equal < !0 {
+            candidates.push( data.alloc_sorted_by_size( Some( common.only_larger_or_equal ), Some( common.only_smaller_or_equal ) ) );
+        }
+
+        if common.only_address_at_least > 0 || common.only_address_at_most < !0 {
+            candidates.push( data.alloc_sorted_by_address( Some( common.only_address_at_least ), Some( common.only_address_at_most ) ) );
+        }
+
+        let narrowest = candidates.into_iter().min_by_key( |ids| ids.len() );
+
+        // Only what was alive at some point in time; it's cheap to check how much that is,
+        // but the allocations themselves have to be gathered, so only do that if there are few of them.
+        let alive_after = common.only_leaked_or_deallocated_after;
+        if alive_after > data.initial_timestamp && common.only_allocated_until_at_most <= alive_after {
+            let alive_count = data.usage_at( alive_after ).allocation_count as usize;
+            let is_narrowest = narrowest.map( |ids| alive_count < ids.len() ).unwrap_or( true );
+            if is_narrowest && alive_count < data.allocations.len() / INDEX_SCAN_THRESHOLD {
+                let ids = data.live_index().allocated_until_and_alive_after( data, common.only_allocated_until_at_most, alive_after );
+                return Some( Cow::Owned( ids ) );
             }
         }
 
-        if let Some( ref only_from_maps ) = self.only_from_maps {
-            if !only_from_maps.iter().any( |&map_id| data.maps[ map_id.raw() as usize ].try_match_allocation( allocation ) ) {
-                return false;
+        narrowest.map( Cow::Borrowed )
+    }
+}
+
+impl Select for RawCompiledAllocationFilter {
+    fn select( &self, data: &Data ) -> Bitmap {
+        let length = data.allocations.len();
+        let kernel = match ColumnKernel::new( data, self ) {
+            Some( kernel ) => kernel,
+            None => return Bitmap::empty( length )
+        };
+
+        // If one of the ranges only covers a few allocations then there's no point in looking at the rest.
+        if let Some( ids ) = self.narrowest_index_range( data ) {
+            if ids.len() < length / INDEX_SCAN_THRESHOLD {
+                let matched: Vec< _ > = ids.par_iter().copied().filter( |&id| self.try_match_by_id( data, id ) ).collect();
+                let mut bitmap = Bitmap::empty( length );
+                for id in matched {
+                    bitmap.insert( id.raw() as usize );
+                }
+
+                return bitmap;
             }
         }
 
-        true
+        let needs_per_row_check =
+            self.backtrace_filter.only_backtraces.is_some() ||
+            self.backtrace_filter.only_not_matching_backtraces.is_some() ||
+            self.enable_group_filter ||
+            self.needs_full_allocation;
+
+        let columns = &data.allocation_columns;
+        Bitmap::from_words( length, |start, count| {
+            let mut word = kernel.select( columns, start, count );
+            if needs_per_row_check {
+                let mut remaining = word;
+                while remaining != 0 {
+                    let bit = remaining.trailing_zeros();
+                    remaining &= remaining - 1;
+
+                    let index = start + bit as usize;
+                    let matched =
+                        self.try_match_indirect( data, columns.backtraces[ index ] ) &&
+                        (!self.needs_full_allocation || self.try_match_rest( data, &data.allocations[ index ] ));
+
+                    if !matched {
+                        word &= !(1 << bit);
+                    }
+                }
+            }
+
+            word
+        })
     }
 }
 
@@ -1008,6 +1351,24 @@ impl TryMatch for RawCompiledMapFilter {
             }
         }
 
+        if let Some( huge_pages ) = self.only_peak_huge_pages_at_least {
+            if !(map.peak_huge_pages > huge_pages) {
+                return false;
+            }
+        }
+
+        if let Some( huge_pages ) = self.only_peak_huge_pages_at_most {
+            if !(map.peak_huge_pages < huge_pages) {
+                return false;
+            }
+        }
+
+        if let Some( advised ) = self.huge_page_advised_filter {
+            if map.huge_page_flags.contains( crate::data::HugePageFlags::HUGEPAGE ) != advised {
+                return false;
+            }
+        }
+
         if let Some( jemalloc_filter ) = self.jemalloc_filter {
             if (&*map.name == "[anon:jemalloc]") != jemalloc_filter {
                 return false;
@@ -1042,6 +1403,232 @@ impl TryMatch for RawCompiledMapFilter {
     }
 }
 
+impl TryMatchById for RawCompiledMapFilter {
+    type Id = MapId;
+    fn try_match_by_id( &self, data: &Data, id: MapId ) -> bool {
+        self.try_match( data, &data.maps[ id.raw() as usize ] )
+    }
+}
+
+/// The fraction of the allocations which are within a given range of one of the sorted indexes.
+fn fraction_in_range< V: Ord >( data: &Data, min: V, max: V, slice: impl FnOnce( V, V ) -> usize ) -> f64 {
+    let total = data.allocations.len();
+    if min > max {
+        return 0.0;
+    }
+
+    if total == 0 {
+        return 1.0;
+    }
+
+    slice( min, max ) as f64 / total as f64
+}
+
+/// What we assume a predicate matches when we have nothing better to go on.
+const GUESSED_SELECTIVITY: f64 = 0.5;
+
+impl RawCompiledCommonFilter {
+    /// Guesses the selectivity of the predicates for which we don't have an index.
+    fn guess_selectivity( &self, data: &Data ) -> f64 {
+        let mut selectivity = 1.0;
+        if self.only_deallocated_between_inclusive.is_some() {
+            selectivity *= GUESSED_SELECTIVITY;
+        }
+
+        if self.only_alive_for_at_least.0.as_usecs() > 0 || self.only_alive_for_at_most.is_some() {
+            selectivity *= GUESSED_SELECTIVITY;
+        }
+
+        if self.only_leaked_or_deallocated_after > data.initial_timestamp {
+            selectivity *= GUESSED_SELECTIVITY;
+        }
+
+        selectivity
+    }
+
+    /// Estimates the fraction of the allocations which are going to be matched, using the sorted indexes where possible.
+    fn estimate_allocation_selectivity( &self, data: &Data ) -> f64 {
+        if self.is_impossible {
+            return 0.0;
+        }
+
+        let mut selectivity = self.guess_selectivity( data );
+        if self.only_allocated_after_at_least > data.initial_timestamp || self.only_allocated_until_at_most < data.last_timestamp {
+            selectivity *= fraction_in_range( data, self.only_allocated_after_at_least, self.only_allocated_until_at_most, |min, max| {
+                data.alloc_sorted_by_timestamp( Some( min ), Some( max ) ).len()
+            });
+        }
+
+        if self.only_larger_or_equal > 0 || self.only_smaller_or_equal < !0 {
+            selectivity *= fraction_in_range( data, self.only_larger_or_equal, self.only_smaller_or_equal, |min, max| {
+                data.alloc_sorted_by_size( Some( min ), Some( max ) ).len()
+            });
+        }
+
+        if self.only_address_at_least > 0 || self.only_address_at_most < !0 {
+            selectivity *= fraction_in_range( data, self.only_address_at_least, self.only_address_at_most, |min, max| {
+                data.alloc_sorted_by_address( Some( min ), Some( max ) ).len()
+            });
+        }
+
+        selectivity
+    }
+}
+
+impl Plan for RawCompiledCommonFilter {
+    fn estimate( &self, data: &Data ) -> Estimate {
+        let mut selectivity = self.guess_selectivity( data );
+        if self.is_impossible {
+            selectivity = 0.0;
+        }
+
+        if self.only_larger_or_equal > 0 || self.only_smaller_or_equal < !0 {
+            selectivity *= GUESSED_SELECTIVITY;
+        }
+
+        if self.only_address_at_least > 0 || self.only_address_at_most < !0 {
+            selectivity *= GUESSED_SELECTIVITY;
+        }
+
+        if self.only_allocated_after_at_least > data.initial_timestamp || self.only_allocated_until_at_most < data.last_timestamp {
+            selectivity *= GUESSED_SELECTIVITY;
+        }
+
+        Estimate { cost: 1.0, selectivity }
+    }
+}
+
+impl Plan for RawCompiledAllocationFilter {
+    fn estimate( &self, data: &Data ) -> Estimate {
+        if self.is_impossible {
+            return Estimate { cost: 0.0, selectivity: 0.0 };
+        }
+
+        // Everything in the `AllocationColumns` is cheap; anything which needs a lookup elsewhere isn't.
+        let mut cost = 1.0;
+        let mut selectivity = self.common_filter.estimate_allocation_selectivity( data );
+        if let Some( ref only_backtraces ) = self.backtrace_filter.only_backtraces {
+            let matched: usize = only_backtraces.iter().map( |&id| data.get_allocation_ids_by_backtrace( id ).len() ).sum();
+            selectivity *= if data.allocations.is_empty() { 1.0 } else { matched as f64 / data.allocations.len() as f64 };
+            cost += 2.0;
+        }
+
+        if self.backtrace_filter.only_not_matching_backtraces.is_some() {
+            selectivity *= GUESSED_SELECTIVITY;
+            cost += 2.0;
+        }
+
+        if let Some( ref matched_groups ) = self.matched_groups {
+            let matched: usize = matched_groups.iter().map( |index| data.get_allocation_ids_by_backtrace( BacktraceId::new( index as u32 ) ).len() ).sum();
+            selectivity *= if data.allocations.is_empty() { 1.0 } else { matched as f64 / data.allocations.len() as f64 };
+            cost += 1.0;
+        }
+
+        if self.only_ptmalloc_mmaped.is_some() || self.only_ptmalloc_from_main_arena.is_some() || self.only_jemalloc.is_some() {
+            selectivity *= GUESSED_SELECTIVITY;
+        }
+
+        if self.needs_full_allocation {
+            selectivity *= GUESSED_SELECTIVITY;
+            cost += 4.0;
+        }
+
+        Estimate { cost, selectivity: selectivity.min( 1.0 ) }
+    }
+}
+
+impl Plan for RawCompiledMapFilter {
+    fn estimate( &self, data: &Data ) -> Estimate {
+        if self.is_impossible {
+            return Estimate { cost: 0.0, selectivity: 0.0 };
+        }
+
+        // There are usually very few maps, so there's no point in trying to be precise here.
+        self.common_filter.estimate( data )
+    }
+}
+
+impl< T > Plan for Filter< T > where T: Plan {
+    fn estimate( &self, data: &Data ) -> Estimate {
+        match *self {
+            Self::Basic( ref filter ) => filter.estimate( data ),
+            Self::And( ref lhs, ref rhs ) => {
+                let lhs = lhs.estimate( data );
+                let rhs = rhs.estimate( data );
+                Estimate {
+                    cost: lhs.cost + lhs.selectivity * rhs.cost,
+                    selectivity: lhs.selectivity * rhs.selectivity
+                }
+            },
+            Self::Or( ref lhs, ref rhs ) => {
+                let lhs = lhs.estimate( data );
+                let rhs = rhs.estimate( data );
+                Estimate {
+                    cost: lhs.cost + (1.0 - lhs.selectivity) * rhs.cost,
+                    selectivity: 1.0 - (1.0 - lhs.selectivity) * (1.0 - rhs.selectivity)
+                }
+            },
+            Self::Not( ref filter ) => {
+                let estimate = filter.estimate( data );
+                Estimate {
+                    cost: estimate.cost,
+                    selectivity: 1.0 - estimate.selectivity
+                }
+            }
+        }
+    }
+}
+
+impl< T > Filter< T > where T: Plan {
+    fn flatten_into( self, is_and: bool, output: &mut Vec< Self > ) {
+        match self {
+            Filter::And( lhs, rhs ) if is_and => {
+                (*lhs).flatten_into( is_and, output );
+                (*rhs).flatten_into( is_and, output );
+            },
+            Filter::Or( lhs, rhs ) if !is_and => {
+                (*lhs).flatten_into( is_and, output );
+                (*rhs).flatten_into( is_and, output );
+            },
+            filter => output.push( filter )
+        }
+    }
+
+    /// Reorders a chain of `And`s or `Or`s so that the operands which are most likely
+    /// to decide the result for the least amount of work are checked first.
+    fn reorder( self, data: &Data ) -> Self {
+        let is_and = match self {
+            Filter::And( .. ) => true,
+            Filter::Or( .. ) => false,
+            Filter::Not( filter ) => return Filter::Not( Box::new( (*filter).reorder( data ) ) ),
+            filter => return filter
+        };
+
+        let mut operands = Vec::new();
+        self.flatten_into( is_and, &mut operands );
+
+        let mut ranked: Vec< _ > = operands.into_iter().map( |operand| {
+            let operand = operand.reorder( data );
+            let estimate = operand.estimate( data );
+            let decisive_fraction = if is_and { 1.0 - estimate.selectivity } else { estimate.selectivity };
+            let rank = if decisive_fraction > 0.0 { estimate.cost / decisive_fraction } else { f64::INFINITY };
+            (rank, operand)
+        }).collect();
+
+        ranked.sort_by( |(lhs, _), (rhs, _)| lhs.partial_cmp( rhs ).unwrap_or( std::cmp::Ordering::Equal ) );
+
+        let mut operands = ranked.into_iter().map( |(_, operand)| operand );
+        let first = operands.next().unwrap();
+        operands.fold( first, |lhs, rhs| {
+            if is_and {
+                Filter::And( Box::new( lhs ), Box::new( rhs ) )
+            } else {
+                Filter::Or( Box::new( lhs ), Box::new( rhs ) )
+            }
+        })
+    }
+}
+
 impl< T > TryMatch for Filter< T > where T: TryMatch {
     type Item = T::Item;
     fn try_match( &self, data: &Data, allocation: &Self::Item ) -> bool {
@@ -1054,20 +1641,124 @@ impl< T > TryMatch for Filter< T > where T: TryMatch {
     }
 }
 
-impl< T > Compile for Filter< T > where T: Compile {
-    type Compiled = Filter< T::Compiled >;
-    fn compile( &self, data: &Data ) -> Self::Compiled {
+impl< T > TryMatchById for Filter< T > where T: TryMatchById {
+    type Id = T::Id;
+    fn try_match_by_id( &self, data: &Data, id: Self::Id ) -> bool {
+        match *self {
+            Self::Basic( ref filter ) => filter.try_match_by_id( data, id ),
+            Self::And( ref lhs, ref rhs ) => lhs.try_match_by_id( data, id ) && rhs.try_match_by_id( data, id ),
+            Self::Or( ref lhs, ref rhs ) => lhs.try_match_by_id( data, id ) || rhs.try_match_by_id( data, id ),
+            Self::Not( ref filter ) => !filter.try_match_by_id( data, id )
+        }
+    }
+}
+
+impl< T > Select for Filter< T > where T: Select {
+    fn select( &self, data: &Data ) -> Bitmap {
+        match *self {
+            Self::Basic( ref filter ) => filter.select( data ),
+            Self::And( ref lhs, ref rhs ) => {
+                let mut bitmap = lhs.select( data );
+                bitmap.intersect_with( &rhs.select( data ) );
+                bitmap
+            },
+            Self::Or( ref lhs, ref rhs ) => {
+                let mut bitmap = lhs.select( data );
+                bitmap.union_with( &rhs.select( data ) );
+                bitmap
+            },
+            Self::Not( ref filter ) => {
+                let mut bitmap = filter.select( data );
+                bitmap.invert();
+                bitmap
+            }
+        }
+    }
+}
+
+impl< T > Filter< T > where T: Compile {
+    fn compile_without_reordering( &self, data: &Data ) -> Filter< T::Compiled > {
         match *self {
             Filter::Basic( ref filter ) => Filter::Basic( filter.compile( data ) ),
-            Filter::And( ref lhs, ref rhs ) => Filter::And( Box::new( lhs.compile( data ) ), Box::new( rhs.compile( data ) ) ),
-            Filter::Or( ref lhs, ref rhs ) => Filter::Or( Box::new( lhs.compile( data ) ), Box::new( rhs.compile( data ) ) ),
-            Filter::Not( ref filter ) => Filter::Not( Box::new( filter.compile( data ) ) )
+            Filter::And( ref lhs, ref rhs ) => Filter::And( Box::new( lhs.compile_without_reordering( data ) ), Box::new( rhs.compile_without_reordering( data ) ) ),
+            Filter::Or( ref lhs, ref rhs ) => Filter::Or( Box::new( lhs.compile_without_reordering( data ) ), Box::new( rhs.compile_without_reordering( data ) ) ),
+            Filter::Not( ref filter ) => Filter::Not( Box::new( filter.compile_without_reordering( data ) ) )
         }
     }
 }
 
+impl< T > Compile for Filter< T > where T: Compile {
+    type Compiled = Filter< T::Compiled >;
+    fn compile( &self, data: &Data ) -> Self::Compiled {
+        self.compile_without_reordering( data ).reorder( data )
+    }
+}
+
 pub type AllocationFilter = Filter< RawAllocationFilter >;
 pub type CompiledAllocationFilter = Filter< RawCompiledAllocationFilter >;
 
+const SELECTION_CACHE_SIZE: usize = 16;
+
+/// The allocations matched by the most recently selected filters, keyed by the filters themselves,
+/// along with any other selections cached through `Data::cached_selection`.
+///
+/// Scripts are often rerun with only small changes, so most of the filters
+/// they use, or at least some parts of them, were already evaluated before.
+pub struct SelectionCache( Mutex< LruCache< String, Arc< Bitmap > > > );
+
+impl Default for SelectionCache {
+    fn default() -> Self {
+        SelectionCache( Mutex::new( LruCache::new( SELECTION_CACHE_SIZE ) ) )
+    }
+}
+
+impl SelectionCache {
+    pub(crate) fn get_or_try_insert_with< E >( &self, key: String, callback: impl FnOnce() -> Result< Arc< Bitmap >, E > ) -> Result< Arc< Bitmap >, E > {
+        if let Some( bitmap ) = self.0.lock().get( &key ) {
+            return Ok( bitmap.clone() );
+        }
+
+        // Don't hold the lock while this runs; it could take a while.
+        let bitmap = callback()?;
+        self.0.lock().put( key, bitmap.clone() );
+        Ok( bitmap )
+    }
+}
+
+impl AllocationFilter {
+    /// Selects all of the matching allocations, reusing the results for any parts of the filter which were selected before.
+    pub fn select_cached( &self, data: &Data ) -> Arc< Bitmap > {
+        let key = format!( "{:?}", self );
+        if let Some( bitmap ) = data.selection_cache.0.lock().get( &key ) {
+            return bitmap.clone();
+        }
+
+        let bitmap = match *self {
+            Filter::Basic( ref filter ) => filter.compile( data ).select( data ),
+            Filter::And( ref lhs, ref rhs ) => {
+                let mut bitmap = (*lhs.select_cached( data )).clone();
+                if bitmap.count_ones() != 0 {
+                    bitmap.intersect_with( &rhs.select_cached( data ) );
+                }
+                bitmap
+            },
+            Filter::Or( ref lhs, ref rhs ) => {
+                let mut bitmap = (*lhs.select_cached( data )).clone();
+                bitmap.union_with( &rhs.select_cached( data ) );
+                bitmap
+            },
+            Filter::Not( ref filter ) => {
+                let mut bitmap = (*filter.select_cached( data )).clone();
+                bitmap.invert();
+                bitmap
+            }
+        };
+
+        let bitmap = Arc::new( bitmap );
+        data.selection_cache.0.lock().put( key, bitmap.clone() );
+        bitmap
+    }
+}
+
 pub type MapFilter = Filter< RawMapFilter >;
 pub type CompiledMapFilter = Filter< RawCompiledMapFilter >;
@@ -1,4 +1,5 @@
 use std::num::NonZeroU32;
+use common::elide::ELIDED_FRAMES_MARKER;
 use crate::data::{CodePointer, StringId};
 
 #[derive(Clone, PartialEq, Eq, Hash, Debug)]
@@ -109,6 +110,11 @@ impl Frame {
         self.count += value;
     }
 
+    /// Whether this frame stands in for the frames which were elided from a backtrace which was too deep.
+    pub fn is_elided_frames_marker( &self ) -> bool {
+        self.address.raw() == ELIDED_FRAMES_MARKER
+    }
+
     pub fn any_function( &self ) -> Option< StringId > {
         self.function.or( self.raw_function )
     }
@@ -0,0 +1,336 @@
+//! The reference graph of the heap as it was in a memory dump, and what its allocations kept alive.
+//!
+//! The dump is scanned conservatively: every pointer-sized word which points anywhere into an allocation
+//! which was alive when the dump was made is taken as a reference to it, and the words which aren't
+//! themselves inside of an allocation (e.g. the globals and the stacks) are the roots. An allocation
+//! retains everything which it dominates, that is everything which can only be reached through it,
+//! so its retained size is how much memory would be freed along with it.
+//!
+//! The scan is by far the most expensive part on big heaps, so it's done in parallel; the dominators
+//! are then computed with the iterative algorithm of Cooper, Harvey and Kennedy.
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+
+use crate::{AllocationId, BacktraceId, Data, MemoryDump};
+
+/// The node of the roots; the allocations are numbered from one.
+const ROOT: u32 = 0;
+const UNREACHABLE: u32 = u32::MAX;
+
+/// What the allocations from a single backtrace were keeping alive when a memory dump was made.
+#[derive(Clone, Debug)]
+pub struct HeapRetention {
+    pub backtrace: BacktraceId,
+    /// How many of its allocations were alive, and their total size.
+    pub count: u64,
+    pub size: u64,
+    /// The total size of everything which could only be reached through its allocations, including themselves.
+    pub retained_size: u64,
+    /// How many of its allocations weren't reachable from any of the roots, and their total size.
+    pub unreachable_count: u64,
+    pub unreachable_size: u64,
+    /// Every allocation which was alive, sorted.
+    pub allocation_ids: Vec< AllocationId >
+}
+
+#[derive(Copy, Clone)]
+struct Node {
+    pointer: u64,
+    end: u64,
+    size: u64,
+    backtrace: BacktraceId,
+    id: AllocationId
+}
+
+/// The edges of the node `n` are `targets[ offsets[ n ]..offsets[ n + 1 ] ]`.
+struct Adjacency {
+    offsets: Vec< usize >,
+    targets: Vec< u32 >
+}
+
+impl Adjacency {
+    /// Expects the `edges` to be sorted by their source.
+    fn new( node_count: usize, edges: &[(u32, u32)] ) -> Self {
+        let mut offsets = vec![ 0; node_count + 1 ];
+        for &(source, _) in edges {
+            offsets[ source as usize + 1 ] += 1;
+        }
+
+        for index in 1..offsets.len() {
+            offsets[ index ] += offsets[ index - 1 ];
+        }
+
+        Adjacency {
+            offsets,
+            targets: edges.iter().map( |&(_, target)| target ).collect()
+        }
+    }
+
+    fn of( &self, node: u32 ) -> &[u32] {
+        &self.targets[ self.offsets[ node as usize ]..self.offsets[ node as usize + 1 ] ]
+    }
+}
+
+/// Returns the node of the allocation which contains the `address`, if any; the `nodes` must be sorted by their address.
+fn find( nodes: &[Node], address: u64 ) -> Option< u32 > {
+    let index = nodes.partition_point( |node| node.pointer <= address ).checked_sub( 1 )?;
+    if address < nodes[ index ].end {
+        Some( index as u32 + 1 )
+    } else {
+        None
+    }
+}
+
+/// Returns every node which is reachable from the root, in postorder; the root is always the last one.
+fn postorder( successors: &Adjacency, node_count: usize ) -> Vec< u32 > {
+    let mut is_visited = vec![ false; node_count ];
+    let mut output = Vec::new();
+    let mut stack = vec![ (ROOT, 0) ];
+    is_visited[ ROOT as usize ] = true;
+    while let Some( &(node, index) ) = stack.last() {
+        match successors.of( node ).get( index ) {
+            Some( &successor ) => {
+                stack.last_mut().unwrap().1 += 1;
+                if !is_visited[ successor as usize ] {
+                    is_visited[ successor as usize ] = true;
+                    stack.push( (successor, 0) );
+                }
+            },
+            None => {
+                stack.pop();
+                output.push( node );
+            }
+        }
+    }
+
+    output
+}
+
+fn intersect( dominators: &[u32], ranks: &[u32], mut lhs: u32, mut rhs: u32 ) -> u32 {
+    while lhs != rhs {
+        while ranks[ lhs as usize ] < ranks[ rhs as usize ] {
+            lhs = dominators[ lhs as usize ];
+        }
+        while ranks[ rhs as usize ] < ranks[ lhs as usize ] {
+            rhs = dominators[ rhs as usize ];
+        }
+    }
+
+    lhs
+}
+
+/// Returns the immediate dominator of every node, or `UNREACHABLE` for those which aren't in the `order`.
+fn immediate_dominators( predecessors: &Adjacency, order: &[u32], node_count: usize ) -> Vec< u32 > {
+    let mut ranks = vec![ UNREACHABLE; node_count ];
+    for (rank, &node) in order.iter().enumerate() {
+        ranks[ node as usize ] = rank as u32;
+    }
+
+    let mut dominators = vec![ UNREACHABLE; node_count ];
+    dominators[ ROOT as usize ] = ROOT;
+
+    let mut is_changed = true;
+    while is_changed {
+        is_changed = false;
+        // In reverse postorder at least one of the predecessors of every node was already seen.
+        for &node in order.iter().rev().skip( 1 ) {
+            let mut dominator = UNREACHABLE;
+            for &predecessor in predecessors.of( node ) {
+                if dominators[ predecessor as usize ] == UNREACHABLE {
+                    continue;
+                }
+
+                dominator = if dominator == UNREACHABLE {
+                    predecessor
+                } else {
+                    intersect( &dominators, &ranks, predecessor, dominator )
+                };
+            }
+
+            if dominators[ node as usize ] != dominator {
+                dominators[ node as usize ] = dominator;
+                is_changed = true;
+            }
+        }
+    }
+
+    dominators
+}
+
+fn analyze( nodes: &[Node], addresses: &[u64], values: &[u64] ) -> Vec< HeapRetention > {
+    let node_count = nodes.len() + 1;
+    let mut edges: Vec< (u32, u32) > = addresses.par_iter().zip( values.par_iter() ).filter_map( |(&address, &value)| {
+        let target = find( nodes, value )?;
+        let source = find( nodes, address ).unwrap_or( ROOT );
+        if source == target {
+            return None;
+        }
+
+        Some( (source, target) )
+    }).collect();
+
+    edges.par_sort_unstable();
+    edges.dedup();
+    let successors = Adjacency::new( node_count, &edges );
+
+    let mut edges: Vec< (u32, u32) > = edges.into_par_iter().map( |(source, target)| (target, source) ).collect();
+    edges.par_sort_unstable();
+    let predecessors = Adjacency::new( node_count, &edges );
+    std::mem::drop( edges );
+
+    let order = postorder( &successors, node_count );
+    let dominators = immediate_dominators( &predecessors, &order, node_count );
+
+    // Everything is dominated by its ancestors in the search tree, so they always come later in the postorder.
+    let mut retained_sizes: Vec< u64 > = std::iter::once( 0 ).chain( nodes.iter().map( |node| node.size ) ).collect();
+    for &node in &order[ ..order.len() - 1 ] {
+        retained_sizes[ dominators[ node as usize ] as usize ] += retained_sizes[ node as usize ];
+    }
+
+    let mut output: HashMap< BacktraceId, HeapRetention > = HashMap::new();
+    for (index, node) in nodes.iter().enumerate() {
+        let entry = output.entry( node.backtrace ).or_insert_with( || HeapRetention {
+            backtrace: node.backtrace,
+            count: 0,
+            size: 0,
+            retained_size: 0,
+            unreachable_count: 0,
+            unreachable_size: 0,
+            allocation_ids: Vec::new()
+        });
+
+        entry.count += 1;
+        entry.size += node.size;
+        entry.allocation_ids.push( node.id );
+        if dominators[ index + 1 ] == UNREACHABLE {
+            entry.unreachable_count += 1;
+            entry.unreachable_size += node.size;
+        }
+    }
+
+    // An allocation which is dominated by another one from the same backtrace is already a part of
+    // what that one retains, so walk the dominator tree and only count the outermost ones.
+    let mut tree_edges: Vec< (u32, u32) > = order[ ..order.len() - 1 ].iter().map( |&node| (dominators[ node as usize ], node) ).collect();
+    tree_edges.par_sort_unstable();
+    let tree = Adjacency::new( node_count, &tree_edges );
+    std::mem::drop( tree_edges );
+
+    let mut depths: HashMap< BacktraceId, u32 > = HashMap::new();
+    let mut stack = vec![ (ROOT, 0) ];
+    while let Some( &(node, index) ) = stack.last() {
+        match tree.of( node ).get( index ) {
+            Some( &child ) => {
+                stack.last_mut().unwrap().1 += 1;
+                let backtrace = nodes[ child as usize - 1 ].backtrace;
+                let depth = depths.entry( backtrace ).or_insert( 0 );
+                if *depth == 0 {
+                    output.get_mut( &backtrace ).unwrap().retained_size += retained_sizes[ child as usize ];
+                }
+                *depth += 1;
+                stack.push( (child, 0) );
+            },
+            None => {
+                stack.pop();
+                if node != ROOT {
+                    *depths.get_mut( &nodes[ node as usize - 1 ].backtrace ).unwrap() -= 1;
+                }
+            }
+        }
+    }
+
+    let mut output: Vec< _ > = output.into_iter().map( |(_, mut entry)| {
+        entry.allocation_ids.sort_unstable();
+        entry
+    }).collect();
+
+    output.par_sort_unstable_by( |lhs, rhs| rhs.retained_size.cmp( &lhs.retained_size ).then( lhs.backtrace.cmp( &rhs.backtrace ) ) );
+    output
+}
+
+/// Figures out what the given allocations were keeping alive when the `dump` was made, per backtrace,
+/// with the backtraces which retain the most memory first. Only the allocations which were alive
+/// at that time are taken into account.
+///
+/// The sampled allocations are skipped since whatever they pointed to wasn't necessarily tracked.
+pub fn find_heap_retention( data: &Data, ids: &[AllocationId], dump: &MemoryDump ) -> Vec< HeapRetention > {
+    let mut nodes: Vec< _ > = ids.par_iter().filter_map( |&id| {
+        let allocation = data.get_allocation( id );
+        let is_alive = allocation.timestamp <= dump.timestamp && allocation.deallocation.as_ref().map( |deallocation| deallocation.timestamp > dump.timestamp ).unwrap_or( true );
+        if !is_alive || allocation.size == 0 || allocation.is_sampled() || allocation.pool.is_some() {
+            return None;
+        }
+
+        let size = allocation.usable_size();
+        Some( Node {
+            pointer: allocation.pointer,
+            end: allocation.pointer + size,
+            size,
+            backtrace: allocation.backtrace,
+            id
+        })
+    }).collect();
+
+    nodes.par_sort_unstable_by_key( |node| node.pointer );
+    analyze( &nodes, &dump.addresses, &dump.values )
+}
+
+#[test]
+fn test_heap_retention() {
+    let node = |pointer, backtrace, id| Node {
+        pointer,
+        end: pointer + 16,
+        size: 16,
+        backtrace: BacktraceId::new( backtrace ),
+        id: AllocationId::new( id )
+    };
+
+    let nodes = vec![
+        node( 0x1000, 1, 1 ),
+        node( 0x2000, 2, 2 ),
+        node( 0x3000, 2, 3 ),
+        node( 0x4000, 3, 4 ),
+        node( 0x5000, 3, 5 ),
+        node( 0x6000, 1, 6 )
+    ];
+
+    let references = [
+        // A root which points into the middle of the 1st allocation.
+        (0x100, 0x1008),
+        (0x1000, 0x2000),
+        (0x1008, 0x3000),
+        (0x1004, 0x6000),
+        // Both of these lead to the 4th allocation, so neither of them dominates it.
+        (0x2000, 0x4000),
+        (0x3000, 0x4000),
+        // A cycle back to the 1st allocation.
+        (0x2008, 0x1000),
+        // The 5th allocation isn't referenced by anything.
+        (0x5000, 0x1000),
+        // Doesn't point into any allocation.
+        (0x1000, 0x9000)
+    ];
+
+    let addresses: Vec< _ > = references.iter().map( |&(address, _)| address ).collect();
+    let values: Vec< _ > = references.iter().map( |&(_, value)| value ).collect();
+    let retention = analyze( &nodes, &addresses, &values );
+    assert_eq!( retention.len(), 3 );
+
+    // The 6th allocation is dominated by the 1st one, so it's not counted twice.
+    assert_eq!( retention[ 0 ].backtrace, BacktraceId::new( 1 ) );
+    assert_eq!( retention[ 0 ].count, 2 );
+    assert_eq!( retention[ 0 ].size, 32 );
+    assert_eq!( retention[ 0 ].retained_size, 80 );
+    assert_eq!( retention[ 0 ].unreachable_count, 0 );
+    assert_eq!( retention[ 0 ].allocation_ids, vec![ AllocationId::new( 1 ), AllocationId::new( 6 ) ] );
+
+    assert_eq!( retention[ 1 ].backtrace, BacktraceId::new( 2 ) );
+    assert_eq!( retention[ 1 ].size, 32 );
+    assert_eq!( retention[ 1 ].retained_size, 32 );
+
+    assert_eq!( retention[ 2 ].backtrace, BacktraceId::new( 3 ) );
+    assert_eq!( retention[ 2 ].size, 32 );
+    assert_eq!( retention[ 2 ].retained_size, 16 );
+    assert_eq!( retention[ 2 ].unreachable_count, 1 );
+    assert_eq!( retention[ 2 ].unreachable_size, 16 );
+}
@@ -0,0 +1,155 @@
+//! A string interner which keeps all of the strings in a single buffer.
+//!
+//! Almost all of the interned strings are symbol names, source paths and library names,
+//! and there can be hundreds of thousands of them, so instead of a separate allocation
+//! for each one they're all stored back-to-back. Every string costs only its bytes,
+//! the offset of its end and a slot in the hash table which deduplicates them.
+
+use std::hash::{BuildHasher, Hash, Hasher};
+
+use hashbrown::raw::RawTable;
+
+use crate::data::StringId;
+
+pub struct StringInterner {
+    buffer: String,
+    /// Where every string ends in the `buffer`; every string starts where the previous one ends.
+    ends: Vec< u32 >,
+    /// The indexes of the strings, hashed by their contents.
+    table: RawTable< u32 >,
+    hasher: ahash::RandomState
+}
+
+fn hash_string( hasher: &ahash::RandomState, string: &str ) -> u64 {
+    let mut state = hasher.build_hasher();
+    string.hash( &mut state );
+    state.finish()
+}
+
+#[inline]
+fn string_at< 'a >( buffer: &'a str, ends: &[u32], index: usize ) -> &'a str {
+    let start = if index == 0 { 0 } else { ends[ index - 1 ] as usize };
+    &buffer[ start..ends[ index ] as usize ]
+}
+
+impl Default for StringInterner {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl StringInterner {
+    pub fn new() -> Self {
+        StringInterner {
+            buffer: String::new(),
+            ends: Vec::new(),
+            table: RawTable::new(),
+            hasher: ahash::RandomState::new()
+        }
+    }
+
+    pub fn len( &self ) -> usize {
+        self.ends.len()
+    }
+
+    pub fn is_empty( &self ) -> bool {
+        self.ends.is_empty()
+    }
+
+    pub fn get< T: AsRef< str > >( &self, string: T ) -> Option< StringId > {
+        let string = string.as_ref();
+        let hash = hash_string( &self.hasher, string );
+        let (buffer, ends) = (&self.buffer, &self.ends);
+        self.table.get( hash, |&index| string_at( buffer, ends, index as usize ) == string )
+            .map( |&index| StringId::from_usize( index as usize ) )
+    }
+
+    pub fn get_or_intern< T: AsRef< str > >( &mut self, string: T ) -> StringId {
+        let string = string.as_ref();
+        let hash = hash_string( &self.hasher, string );
+        let (buffer, ends) = (&self.buffer, &self.ends);
+        if let Some( &index ) = self.table.get( hash, |&index| string_at( buffer, ends, index as usize ) == string ) {
+            return StringId::from_usize( index as usize );
+        }
+
+        let index = self.ends.len();
+        self.buffer.push_str( string );
+        assert!( self.buffer.len() <= u32::MAX as usize, "too many strings were interned" );
+        self.ends.push( self.buffer.len() as u32 );
+
+        let (buffer, ends, hasher) = (&self.buffer, &self.ends, &self.hasher);
+        self.table.insert( hash, index as u32, |&index| hash_string( hasher, string_at( buffer, ends, index as usize ) ) );
+
+        StringId::from_usize( index )
+    }
+
+    pub fn resolve( &self, id: StringId ) -> Option< &str > {
+        let index = id.to_usize();
+        if index < self.ends.len() {
+            Some( string_at( &self.buffer, &self.ends, index ) )
+        } else {
+            None
+        }
+    }
+
+    pub fn iter( &self ) -> impl ExactSizeIterator< Item = (StringId, &str) > + '_ {
+        (0..self.ends.len()).map( move |index| (StringId::from_usize( index ), string_at( &self.buffer, &self.ends, index )) )
+    }
+
+    /// Returns how many bytes this takes on the heap.
+    pub fn memory_usage( &self ) -> usize {
+        self.buffer.capacity() +
+        self.ends.capacity() * std::mem::size_of::< u32 >() +
+        self.table.buckets() * (std::mem::size_of::< u32 >() + 1)
+    }
+
+    /// Frees the memory which was reserved for any further strings.
+    pub fn shrink_to_fit( &mut self ) {
+        self.buffer.shrink_to_fit();
+        self.ends.shrink_to_fit();
+
+        let (buffer, ends, hasher) = (&self.buffer, &self.ends, &self.hasher);
+        self.table.shrink_to( 0, |&index| hash_string( hasher, string_at( buffer, ends, index as usize ) ) );
+    }
+}
+
+#[test]
+fn test_interner() {
+    let mut interner = StringInterner::new();
+    assert!( interner.is_empty() );
+
+    let foo = interner.get_or_intern( "foo" );
+    let bar = interner.get_or_intern( String::from( "bar" ) );
+    let empty = interner.get_or_intern( "" );
+    let foobar = interner.get_or_intern( "foobar" );
+
+    assert_eq!( interner.get_or_intern( "foo" ), foo );
+    assert_eq!( interner.get_or_intern( "bar" ), bar );
+    assert_eq!( interner.get_or_intern( "" ), empty );
+    assert_eq!( interner.get( "foobar" ), Some( foobar ) );
+    assert_eq!( interner.get( "baz" ), None );
+    assert_eq!( interner.len(), 4 );
+
+    assert_eq!( foo.to_usize(), 0 );
+    assert_eq!( foobar.to_usize(), 3 );
+    assert_eq!( interner.resolve( foo ), Some( "foo" ) );
+    assert_eq!( interner.resolve( empty ), Some( "" ) );
+    assert_eq!( interner.resolve( foobar ), Some( "foobar" ) );
+    assert_eq!( interner.resolve( StringId::from_usize( 4 ) ), None );
+
+    interner.shrink_to_fit();
+    assert_eq!( interner.get( "bar" ), Some( bar ) );
+    assert_eq!(
+        interner.iter().map( |(id, string)| (id.to_usize(), string) ).collect::< Vec< _ > >(),
+        vec![ (0, "foo"), (1, "bar"), (2, ""), (3, "foobar") ]
+    );
+
+    for nth in 0..10000 {
+        let id = interner.get_or_intern( format!( "string_{}", nth ) );
+        assert_eq!( id.to_usize(), nth + 4 );
+    }
+
+    for nth in 0..10000 {
+        assert_eq!( interner.get( format!( "string_{}", nth ) ).map( |id| id.to_usize() ), Some( nth + 4 ) );
+    }
+}
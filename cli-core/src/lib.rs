@@ -8,47 +8,97 @@ extern crate bitflags;
 extern crate quickcheck;
 
 pub mod cmd_gather;
+pub mod cmd_ctl;
+pub mod cmd_collector;
 pub mod cmd_analyze_size;
+pub mod cmd_info;
 pub mod cmd_extract;
+pub mod cmd_generate;
 
+mod aggregate;
+mod backtrace_trie;
+mod bitmap;
+mod cache;
+mod column;
 mod filter;
 mod util;
 mod tree;
 mod tree_printer;
 mod reader;
+mod roaring;
 mod loader;
+mod pointer_map;
 mod postprocessor;
 mod squeeze;
+mod sort;
+mod symbol_cache;
 mod frame;
 mod data;
+mod debuginfod;
+mod embedded_binaries;
+mod interner;
 mod io_adapter;
 mod exporter_replay;
 mod exporter_heaptrack;
+mod exporter_pprof;
+mod exporter_parquet;
 mod exporter_flamegraph;
 mod exporter_flamegraph_pl;
 mod vecvec;
 mod threaded_lz4_stream;
 mod repack;
 mod timeline;
+mod false_sharing;
+mod heap_graph;
+mod duplicates;
+mod cross_thread;
+mod size_classes;
+mod allocator_simulation;
+mod realloc_growth;
+mod thread_tags;
+mod allocation_rate;
+mod lifetime_sketch;
+mod live_index;
+mod address_tiles;
+mod snapshot_diff;
 pub mod script;
+pub mod script_slave;
 mod script_virtual;
 
-pub use crate::data::{Data, DataId, CodePointer, DataPointer, BacktraceId, Timestamp, Operation, OperationId, StringId, Allocation, AllocationId, FrameId, Mallopt, MalloptKind, CountAndSize, MapId, Map, RegionFlags, MapUsage, UsageDelta};
-pub use crate::loader::Loader;
+pub use crate::data::{Data, DataId, FrameField, CodePointer, DataPointer, BacktraceId, Timestamp, Operation, OperationId, StringId, Allocation, AllocationId, FrameId, Mallopt, MalloptKind, MemoryAdvice, ResidencySample, CulledAllocations, AllocatorLatencies, AllocatorCall, PageFault, OptionChange, Pool, Thread, ThreadId, RuntimeOption, JemallocSnapshot, CgroupSample, MemoryDump, JemallocArenaStats, JemallocBinStats, CountAndSize, MapId, Map, RegionFlags, HugePageFlags, MapUsage, MapSparkline, MAP_SPARKLINE_LENGTH, UsageDelta, SourceKey};
+pub use crate::loader::{Loader, LoadFilter};
 pub use crate::tree::{Tree, Node, NodeId};
 pub use crate::frame::Frame;
-pub use crate::exporter_replay::export_as_replay;
+pub use crate::exporter_replay::{ReplayFormat, export_as_replay, export_as_replay_with_format};
 pub use crate::exporter_heaptrack::export_as_heaptrack;
+pub use crate::exporter_pprof::export_as_pprof;
+pub use crate::exporter_parquet::export_as_parquet;
 pub use crate::exporter_flamegraph_pl::export_as_flamegraph_pl;
 pub use crate::exporter_flamegraph::export_as_flamegraph;
 pub use crate::vecvec::VecVec;
+pub use crate::bitmap::Bitmap;
 pub use crate::util::table_to_string;
 pub use crate::postprocessor::{Anonymize, postprocess};
 pub use crate::squeeze::squeeze_data;
-pub use crate::reader::parse_events;
-pub use crate::repack::repack;
+pub use crate::reader::{parse_events, parse_events_in_time_range};
+pub use crate::repack::{repack, repack_chunks};
+pub use crate::threaded_lz4_stream::set_max_decompression_threads;
+pub use crate::symbol_cache::set_symbol_cache_directory;
+pub use crate::pointer_map::set_live_allocations_spill_threshold;
 pub use crate::script::{EvalOutput, run_script};
-pub use crate::timeline::{build_allocation_timeline, build_map_timeline};
+pub use crate::false_sharing::{CoLocatedPair, DEFAULT_CACHE_LINE_SIZE, find_co_located_allocations};
+pub use crate::heap_graph::{HeapRetention, find_heap_retention};
+pub use crate::duplicates::{DuplicateGroup, find_duplicates};
+pub use crate::cross_thread::{CrossThreadFrees, ThreadHandoff, cross_thread_latency, find_cross_thread_frees};
+pub use crate::size_classes::{RequestedSizes, SizeClass, SizeClassAllocator, SizeClassHistogram};
+pub use crate::allocator_simulation::AllocatorSimulation;
+pub use crate::realloc_growth::{ChainGrowth, ReallocGrowth, find_realloc_growth};
+pub use crate::allocation_rate::{AllocationRate, AllocationRates, RateBucket, find_allocation_rates};
+pub use crate::lifetime_sketch::LifetimeSketch;
+pub use crate::live_index::LiveUsage;
+pub use crate::address_tiles::{AddressTiles, TileRun};
+pub use crate::snapshot_diff::{BacktraceDiff, diff_timestamps, diff_traces};
+pub use crate::timeline::{AllocationDelta, Delta, TimelinePoint, TimelinePyramid, build_allocation_timeline, build_allocation_timelines, build_allocation_timeline_pyramid, build_allocation_timeline_pyramids, peak_memory_usage, build_map_timeline, build_map_timelines, build_map_timeline_pyramid};
 
 pub use common::event;
 
@@ -62,6 +112,10 @@ pub use crate::filter::{
     NumberOrFractionOfTotal,
     Compile,
     TryMatch,
+    TryMatchById,
+    Select,
+    Plan,
+    Estimate,
     MapFilter,
     CompiledMapFilter,
     RawMapFilter,
@@ -0,0 +1,198 @@
+//! Compact quantile sketches of how long the allocations lived.
+//!
+//! This is a DDSketch: the lifetimes are bucketed logarithmically so that every estimated quantile
+//! is within `RELATIVE_ACCURACY` of a real lifetime, no matter how skewed the distribution is.
+//! The sketches are built once per backtrace when the data is loaded and can be merged,
+//! so any quantile of any group of backtraces can be looked up without touching the allocations.
+
+use crate::Timestamp;
+
+pub const RELATIVE_ACCURACY: f64 = 0.02;
+
+#[inline]
+fn gamma_ln() -> f64 {
+    ((1.0 + RELATIVE_ACCURACY) / (1.0 - RELATIVE_ACCURACY)).ln()
+}
+
+/// Returns the bucket into which a lifetime of at least one microsecond goes;
+/// every bucket `n` covers lifetimes in `(gamma^(n - 1), gamma^n]`.
+#[inline]
+fn bucket_of( lifetime_us: u64 ) -> u32 {
+    ((lifetime_us as f64).ln() / gamma_ln()).ceil().max( 0.0 ) as u32
+}
+
+/// Returns the lifetime, in microseconds, which has the lowest relative error for every lifetime in a given bucket.
+#[inline]
+fn value_of( bucket: u32 ) -> f64 {
+    let gamma_ln = gamma_ln();
+    let gamma = gamma_ln.exp();
+    2.0 * (bucket as f64 * gamma_ln).exp() / (gamma + 1.0)
+}
+
+#[derive(Clone, PartialEq, Debug, Default)]
+pub struct LifetimeSketch {
+    /// How many of the lifetimes were shorter than a microsecond.
+    pub(crate) zero_count: u64,
+    /// The bucket of the first entry of `counts`.
+    pub(crate) offset: u32,
+    pub(crate) counts: Vec< u64 >,
+    pub(crate) min: u64,
+    pub(crate) max: u64
+}
+
+impl LifetimeSketch {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Adds `count` lifetimes of the given length.
+    pub fn add( &mut self, lifetime: Timestamp, count: u64 ) {
+        self.add_usecs( lifetime.as_usecs(), count );
+    }
+
+    pub(crate) fn add_usecs( &mut self, lifetime_us: u64, count: u64 ) {
+        if count == 0 {
+            return;
+        }
+
+        if self.is_empty() {
+            self.min = lifetime_us;
+            self.max = lifetime_us;
+        } else {
+            self.min = std::cmp::min( self.min, lifetime_us );
+            self.max = std::cmp::max( self.max, lifetime_us );
+        }
+
+        if lifetime_us == 0 {
+            self.zero_count += count;
+            return;
+        }
+
+        let bucket = bucket_of( lifetime_us );
+        self.reserve_bucket( bucket );
+        self.counts[ (bucket - self.offset) as usize ] += count;
+    }
+
+    fn reserve_bucket( &mut self, bucket: u32 ) {
+        if self.counts.is_empty() {
+            self.offset = bucket;
+            self.counts.push( 0 );
+        } else if bucket < self.offset {
+            let shift = (self.offset - bucket) as usize;
+            self.counts.splice( 0..0, std::iter::repeat( 0 ).take( shift ) );
+            self.offset = bucket;
+        } else if (bucket - self.offset) as usize >= self.counts.len() {
+            self.counts.resize( (bucket - self.offset) as usize + 1, 0 );
+        }
+    }
+
+    pub fn merge( &mut self, other: &LifetimeSketch ) {
+        if other.is_empty() {
+            return;
+        }
+
+        if self.is_empty() {
+            *self = other.clone();
+            return;
+        }
+
+        self.min = std::cmp::min( self.min, other.min );
+        self.max = std::cmp::max( self.max, other.max );
+        self.zero_count += other.zero_count;
+        if other.counts.is_empty() {
+            return;
+        }
+
+        self.reserve_bucket( other.offset );
+        self.reserve_bucket( other.offset + other.counts.len() as u32 - 1 );
+        let start = (other.offset - self.offset) as usize;
+        for (total, &count) in self.counts[ start.. ].iter_mut().zip( other.counts.iter() ) {
+            *total += count;
+        }
+    }
+
+    pub fn count( &self ) -> u64 {
+        self.zero_count + self.counts.iter().sum::< u64 >()
+    }
+
+    pub fn is_empty( &self ) -> bool {
+        self.zero_count == 0 && self.counts.is_empty()
+    }
+
+    /// Returns the approximate lifetime below which the given fraction of the lifetimes fall.
+    pub fn quantile( &self, quantile: f64 ) -> Option< Timestamp > {
+        let count = self.count();
+        if count == 0 {
+            return None;
+        }
+
+        let rank = (quantile.max( 0.0 ).min( 1.0 ) * (count - 1) as f64) as u64;
+        if rank == 0 || rank < self.zero_count {
+            return Some( Timestamp::from_usecs( self.min ) );
+        }
+
+        if rank == count - 1 {
+            return Some( Timestamp::from_usecs( self.max ) );
+        }
+
+        let mut seen = self.zero_count;
+        for (index, &bucket_count) in self.counts.iter().enumerate() {
+            seen += bucket_count;
+            if seen > rank {
+                let value = value_of( self.offset + index as u32 ).round() as u64;
+                return Some( Timestamp::from_usecs( value.max( self.min ).min( self.max ) ) );
+            }
+        }
+
+        Some( Timestamp::from_usecs( self.max ) )
+    }
+
+    pub fn memory_usage( &self ) -> usize {
+        self.counts.capacity() * std::mem::size_of::< u64 >()
+    }
+}
+
+#[test]
+fn test_lifetime_sketch_quantiles() {
+    let mut sketch = LifetimeSketch::new();
+    assert_eq!( sketch.quantile( 0.5 ), None );
+
+    for lifetime in 1..=10000 {
+        sketch.add( Timestamp::from_usecs( lifetime ), 1 );
+    }
+
+    assert_eq!( sketch.count(), 10000 );
+    for &(quantile, expected) in &[(0.5, 5000.0), (0.9, 9000.0), (0.99, 9900.0)] {
+        let value = sketch.quantile( quantile ).unwrap().as_usecs() as f64;
+        assert!( (value - expected).abs() <= expected * RELATIVE_ACCURACY + 1.0, "quantile {} is {}", quantile, value );
+    }
+
+    assert_eq!( sketch.quantile( 0.0 ), Some( Timestamp::from_usecs( 1 ) ) );
+    assert_eq!( sketch.quantile( 1.0 ), Some( Timestamp::from_usecs( 10000 ) ) );
+}
+
+#[test]
+fn test_lifetime_sketch_merge() {
+    let mut short = LifetimeSketch::new();
+    short.add( Timestamp::from_usecs( 0 ), 3 );
+    short.add( Timestamp::from_usecs( 100 ), 2 );
+
+    let mut long = LifetimeSketch::new();
+    long.add( Timestamp::from_secs( 10 ), 5 );
+    long.add( Timestamp::from_usecs( 50 ), 1 );
+
+    let mut merged = short.clone();
+    merged.merge( &long );
+    assert_eq!( merged.count(), 11 );
+    assert_eq!( merged.quantile( 0.0 ), Some( Timestamp::from_usecs( 0 ) ) );
+    assert_eq!( merged.quantile( 1.0 ), Some( Timestamp::from_secs( 10 ) ) );
+
+    // The merge is the same as adding everything to a single sketch, in any order.
+    let mut other = long.clone();
+    other.merge( &short );
+    assert_eq!( other, merged );
+
+    let mut empty = LifetimeSketch::new();
+    empty.merge( &merged );
+    assert_eq!( empty, merged );
+}
@@ -0,0 +1,176 @@
+//! An index of what was alive at any given point in time.
+//!
+//! The allocations sorted by when they were made are split into fixed size blocks, with a binary tree
+//! on top of them in which every node has the latest deallocation within its blocks. Looking for what was
+//! alive at a given point only has to descend into the blocks which have something which outlived it,
+//! so it takes time proportional to what's found instead of to everything which was allocated before.
+//! The total memory usage is checkpointed every few thousand operations, so getting it at any point
+//! only has to replay the operations since the last checkpoint.
+
+use rayon::prelude::*;
+
+use crate::{AllocationId, Data, OperationId, Timestamp};
+
+/// How many allocations every leaf of the tree covers.
+const BLOCK_SIZE: usize = 256;
+
+/// How many operations there are between two checkpoints.
+const CHECKPOINT_INTERVAL: usize = 4096;
+
+/// What was alive at a single point in time.
+#[derive(Copy, Clone, PartialEq, Eq, Debug, Default)]
+pub struct LiveUsage {
+    /// How many allocations were tracked, without scaling up the sampled ones.
+    pub allocation_count: u64,
+    pub count: u64,
+    pub size: u64
+}
+
+type Totals = (i64, i64, i64);
+
+#[inline]
+fn add( lhs: Totals, rhs: Totals ) -> Totals {
+    (lhs.0 + rhs.0, lhs.1 + rhs.1, lhs.2 + rhs.2)
+}
+
+fn delta( data: &Data, op: OperationId ) -> Totals {
+    let allocation = data.get_allocation( op.id() );
+    let count = allocation.sample_count() as i64;
+    let size = allocation.size as i64;
+    if op.is_allocation() {
+        (1, count, size)
+    } else if op.is_deallocation() {
+        (-1, -count, -size)
+    } else {
+        let old_allocation = data.get_allocation( allocation.reallocated_from.unwrap() );
+        (0, count - old_allocation.sample_count() as i64, size - old_allocation.size as i64)
+    }
+}
+
+/// Builds a tree in which every node has the latest deallocation of its children, returning it along with where its leaves start.
+fn build_tree( leaves: Vec< Timestamp > ) -> (Vec< Timestamp >, usize) {
+    let leaf_offset = leaves.len().next_power_of_two();
+    let mut tree = vec![ Timestamp::min(); leaf_offset * 2 ];
+    tree[ leaf_offset..leaf_offset + leaves.len() ].copy_from_slice( &leaves );
+    for node in (1..leaf_offset).rev() {
+        tree[ node ] = std::cmp::max( tree[ node * 2 ], tree[ node * 2 + 1 ] );
+    }
+
+    (tree, leaf_offset)
+}
+
+pub struct LiveIndex {
+    /// The latest deallocation in every node; the root is at index 1, and the leaves start at `leaf_offset`.
+    tree: Vec< Timestamp >,
+    leaf_offset: usize,
+    /// What was alive after every `CHECKPOINT_INTERVAL` operations, starting with nothing.
+    checkpoints: Vec< Totals >
+}
+
+impl LiveIndex {
+    pub fn new( data: &Data ) -> Self {
+        let ids = data.alloc_sorted_by_timestamp( None, None );
+        let deallocation_timestamps = &data.allocation_columns.deallocation_timestamps;
+        let leaves = ids.par_chunks( BLOCK_SIZE ).map( |block| {
+            block.iter().map( |id| deallocation_timestamps[ id.raw() as usize ] ).max().unwrap()
+        }).collect();
+
+        let (tree, leaf_offset) = build_tree( leaves );
+        let deltas: Vec< _ > = data.operation_ids().par_chunks( CHECKPOINT_INTERVAL ).map( |ops| {
+            ops.iter().fold( (0, 0, 0), |totals, &op| add( totals, delta( data, op ) ) )
+        }).collect();
+
+        let mut checkpoints = Vec::with_capacity( deltas.len() + 1 );
+        checkpoints.push( (0, 0, 0) );
+        for delta in deltas {
+            checkpoints.push( add( *checkpoints.last().unwrap(), delta ) );
+        }
+
+        LiveIndex {
+            tree,
+            leaf_offset,
+            checkpoints
+        }
+    }
+
+    /// Collects the blocks under a given node which come before `block_count`
+    /// and have something in them which was deallocated after `timestamp`.
+    fn find_blocks( &self, node: usize, first_block: usize, width: usize, block_count: usize, timestamp: Timestamp, output: &mut Vec< usize > ) {
+        if first_block >= block_count || self.tree[ node ] <= timestamp {
+            return;
+        }
+
+        if width == 1 {
+            output.push( first_block );
+            return;
+        }
+
+        let half = width / 2;
+        self.find_blocks( node * 2, first_block, half, block_count, timestamp, output );
+        self.find_blocks( node * 2 + 1, first_block + half, half, block_count, timestamp, output );
+    }
+
+    /// Returns the allocations made at or before `allocated_until` which were still alive
+    /// after `alive_after`, sorted by when they were made.
+    pub fn allocated_until_and_alive_after( &self, data: &Data, allocated_until: Timestamp, alive_after: Timestamp ) -> Vec< AllocationId > {
+        let ids = data.alloc_sorted_by_timestamp( None, Some( allocated_until ) );
+        let block_count = (ids.len() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        let mut blocks = Vec::new();
+        self.find_blocks( 1, 0, self.leaf_offset, block_count, alive_after, &mut blocks );
+
+        let deallocation_timestamps = &data.allocation_columns.deallocation_timestamps;
+        blocks.into_par_iter().flat_map_iter( |block| {
+            let start = block * BLOCK_SIZE;
+            let end = std::cmp::min( start + BLOCK_SIZE, ids.len() );
+            ids[ start..end ].iter().copied().filter( move |id| deallocation_timestamps[ id.raw() as usize ] > alive_after )
+        }).collect()
+    }
+
+    /// Returns how much was alive right after the given point in time.
+    pub fn usage_at( &self, data: &Data, timestamp: Timestamp ) -> LiveUsage {
+        let ops = data.operation_ids();
+        let end = ops.partition_point( |&op| data.operation_timestamp( op ) <= timestamp );
+        let checkpoint = end / CHECKPOINT_INTERVAL;
+        let totals = ops[ checkpoint * CHECKPOINT_INTERVAL..end ].iter().fold( self.checkpoints[ checkpoint ], |totals, &op| {
+            add( totals, delta( data, op ) )
+        });
+
+        LiveUsage {
+            allocation_count: std::cmp::max( totals.0, 0 ) as u64,
+            count: std::cmp::max( totals.1, 0 ) as u64,
+            size: std::cmp::max( totals.2, 0 ) as u64
+        }
+    }
+
+    pub fn memory_usage( &self ) -> usize {
+        self.tree.capacity() * std::mem::size_of::< Timestamp >() +
+        self.checkpoints.capacity() * std::mem::size_of::< Totals >()
+    }
+}
+
+#[test]
+fn test_find_blocks() {
+    let at = Timestamp::from_secs;
+    let (tree, leaf_offset) = build_tree( vec![ at( 5 ), at( 1 ), Timestamp::max(), at( 3 ), at( 9 ) ] );
+    assert_eq!( leaf_offset, 8 );
+    assert_eq!( tree[ 1 ], Timestamp::max() );
+
+    let index = LiveIndex {
+        tree,
+        leaf_offset,
+        checkpoints: Vec::new()
+    };
+
+    let find = |block_count, timestamp| {
+        let mut blocks = Vec::new();
+        index.find_blocks( 1, 0, index.leaf_offset, block_count, timestamp, &mut blocks );
+        blocks
+    };
+
+    assert_eq!( find( 5, at( 0 ) ), vec![ 0, 1, 2, 3, 4 ] );
+    assert_eq!( find( 5, at( 3 ) ), vec![ 0, 2, 4 ] );
+    assert_eq!( find( 4, at( 3 ) ), vec![ 0, 2 ] );
+    assert_eq!( find( 2, at( 5 ) ), Vec::< usize >::new() );
+    assert_eq!( find( 5, at( 10 ) ), vec![ 2 ] );
+    assert_eq!( find( 0, at( 0 ) ), Vec::< usize >::new() );
+}
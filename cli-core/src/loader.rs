@@ -4,11 +4,12 @@ use std::ops::{Deref, Range};
 use std::io::{self, Read};
 use std::borrow::Cow;
 use std::sync::Arc;
-use std::time::Instant;
+use std::time::{Duration, Instant};
 use std::ffi::OsStr;
+use std::fs::File;
+use std::path::Path;
 use std::cmp;
 
-use std::collections::hash_map;
 use ahash::AHashMap as HashMap;
 use ahash::AHashSet as HashSet;
 use byteorder::{BigEndian, LittleEndian, ByteOrder};
@@ -22,28 +23,54 @@ use common::event::{
     Event,
     HeaderBody,
     AllocBody,
+    CheckpointAllocation,
     FramesInvalidated,
-    HEADER_FLAG_IS_LITTLE_ENDIAN
+    ProfilerHistogram,
+    BacktraceCacheLevelStatistics,
+    HEADER_FLAG_IS_LITTLE_ENDIAN,
+    HEADER_FLAG_HAS_CHILD_PROCESSES
 };
-use fast_range_map::RangeMap;
+use common::speedy::Readable;
+use common::elide::{ELIDED_FRAMES_MARKER, ELIDED_FRAMES_NAME, elide_frames, is_elided_frames_marker};
+use fast_range_map::{FrozenRangeMap, RangeMap};
+use regex::Regex;
 
+use crate::cache::{self, CacheKey};
+use crate::duplicates::ContentHasher;
 use crate::frame::Frame;
+use crate::pointer_map::PointerMap;
+use crate::sort::sort_ids_by_timestamp;
+use crate::symbol_cache::{CachedFrame, SymbolCache};
 use crate::data::{
     Allocation,
     AllocationChain,
+    AllocationColumns,
     AllocationFlags,
     AllocationId,
     BacktraceId,
     BacktraceStorageRef,
     CodePointer,
+    CulledAllocations,
+    AllocatorLatencies,
+    AllocatorCall,
+    PageFault,
     DataPointer,
     Data,
     DataId,
     Deallocation,
     FrameId,
     GroupStatistics,
+    HugePageFlags,
     Mallopt,
+    MemoryAdvice,
+    MemoryDump,
+    ResidencySample,
+    JemallocSnapshot,
+    CgroupSample,
     OperationId,
+    OptionChange,
+    Pool,
+    Thread,
     ThreadId,
     Timestamp,
     StringInterner,
@@ -58,9 +85,13 @@ use crate::data::{
     MapUsage,
     MapSource,
     RegionFlags,
+    build_map_sparklines,
+    group_by_dense_key
 };
 use crate::vecvec::DenseVecVec;
-use crate::reader::parse_events;
+use crate::lifetime_sketch::LifetimeSketch;
+use crate::reader::{parse_events, parse_events_in_background, scan_events};
+use crate::aggregate::AggregatedEvents;
 
 #[derive(Clone, PartialEq, Eq, Default, Debug, Hash)]
 pub struct AddressMapping {
@@ -87,6 +118,49 @@ fn test_clean_symbol() {
     );
 }
 
+/// Whether the header says that the data of the child processes was multiplexed into this data.
+fn has_child_processes( fp: impl Read ) -> Result< bool, io::Error > {
+    let mut fp = common::lz4_stream::Lz4Reader::new( fp );
+    match Event::read_from_stream_unbuffered( &mut fp )? {
+        Event::Header( header ) => Ok( header.flags & HEADER_FLAG_HAS_CHILD_PROCESSES != 0 ),
+        _ => Err( io::Error::new( io::ErrorKind::Other, "data file doesn't start with a proper header" ) )
+    }
+}
+
+/// Restricts which allocations are loaded; everything else is skipped before it's materialized.
+#[derive(Clone, Default)]
+pub struct LoadFilter {
+    /// Only load the allocations made at least this long after the profiling was started.
+    pub only_allocated_after: Option< Duration >,
+    /// Only load the allocations made at most this long after the profiling was started.
+    pub only_allocated_before: Option< Duration >,
+    pub only_threads: Option< std::collections::HashSet< ThreadId > >,
+    pub only_larger_or_equal: Option< u64 >,
+    /// Only load the allocations with a backtrace in which any of the functions matches; this needs eager symbolication.
+    pub only_backtraces_with_function: Option< Regex >,
+    /// Shrink the backtraces which are deeper than this; see `common::elide::elide_frames`.
+    pub max_backtrace_depth: Option< usize >,
+    /// Only load the allocations which were never deallocated, and fold the rest into per-backtrace aggregates; see `AggregatedEvents`.
+    pub aggregate_deallocated: bool
+}
+
+impl LoadFilter {
+    pub fn set_function_regex( &mut self, pattern: &str ) -> Result< (), regex::Error > {
+        self.only_backtraces_with_function = Some( Regex::new( pattern )? );
+        Ok(())
+    }
+
+    pub fn is_empty( &self ) -> bool {
+        self.only_allocated_after.is_none() &&
+        self.only_allocated_before.is_none() &&
+        self.only_threads.is_none() &&
+        self.only_larger_or_equal.is_none() &&
+        self.only_backtraces_with_function.is_none() &&
+        self.max_backtrace_depth.is_none() &&
+        !self.aggregate_deallocated
+    }
+}
+
 pub struct Loader {
     id: DataId,
     header: HeaderBody,
@@ -95,24 +169,41 @@ pub struct Loader {
     address_space_needs_reloading: bool,
     debug_info_index: DebugInfoIndex,
     binaries: HashMap< String, Arc< BinaryData > >,
+    /// The binary and the debug binary which were given to the `address_space` for every mapped file.
+    symbolication_binaries: HashMap< String, SymbolicationBinaries >,
     pending_address_space_maps: Vec< Region >,
-    address_space_maps: RangeMap< Region >,
+    address_space_maps: FrozenRangeMap< Region >,
     backtraces: Vec< BacktraceStorageRef >,
     backtraces_storage: Vec< FrameId >,
     backtrace_to_id: HashMap< Vec< u64 >, BacktraceId >,
     backtrace_remappings: HashMap< u64, BacktraceId >,
     group_stats: Vec< GroupStatistics >,
+    profiler_bytes_written: u64,
+    profiler_histograms: Vec< ProfilerHistogram >,
+    backtrace_cache_statistics: Vec< BacktraceCacheLevelStatistics >,
     operations: Vec< (Timestamp, OperationId) >,
     allocations: Vec< Allocation >,
-    allocation_map: HashMap< (u64, u64), AllocationId >,
-    allocation_range_map: RangeMap< AllocationId >,
-    allocation_range_map_dirty: bool,
-    allocations_by_backtrace: HashMap< BacktraceId, Vec< AllocationId > >,
+    allocation_map: PointerMap,
+    /// Covers every allocation seen so far; whatever points outside of it can't be a pointer into the heap.
+    heap_range: Range< u64 >,
+    memory_dumps: Vec< MemoryDump >,
+    /// Hashes the contents of the allocations from the last dump as it's being loaded.
+    content_hasher: Option< ContentHasher >,
     frames: Vec< Frame >,
     frame_to_id: HashMap< Frame, FrameId >,
     frames_by_address: HashMap< u64, Range< usize > >,
+    defer_symbolication: bool,
+    unresolved_addresses: Vec< (u64, bool) >,
+    unresolved_calls_to_new: Vec< BacktraceId >,
+    symbol_cache: Option< SymbolCache >,
     shared_ptr_backtraces: HashSet< BacktraceId >,
     shared_ptr_allocations: HashMap< DataPointer, AllocationId >,
+    chains: Vec< AllocationChain >,
+    chain_by_first_allocation: HashMap< AllocationId, usize >,
+    load_filter: LoadFilter,
+    backtrace_matches_load_filter: Vec< Option< bool > >,
+    skipped_allocation_count: u64,
+    skipped_allocation_size: u64,
     total_allocated: u64,
     total_allocated_count: u64,
     total_freed: u64,
@@ -120,7 +211,23 @@ pub struct Loader {
     frame_skip_ranges: Vec< Range< u64 > >,
     symbol_new_range: Range< u64 >,
     marker: u32,
+    sampling_interval: u64,
+    parent_id: Option< DataId >,
     mallopts: Vec< Mallopt >,
+    memory_advices: Vec< MemoryAdvice >,
+    residency_samples: Vec< ResidencySample >,
+    culled_allocations: Vec< CulledAllocations >,
+    allocator_latencies: HashMap< (BacktraceId, AllocatorCall), AllocatorLatencies >,
+    page_faults: Vec< PageFault >,
+    page_fault_period: u64,
+    jemalloc_snapshots: Vec< JemallocSnapshot >,
+    cgroup_samples: Vec< CgroupSample >,
+    option_changes: Vec< OptionChange >,
+    thread_tag_changes: HashMap< ThreadId, Vec< (Timestamp, u32) > >,
+    pools: Vec< Pool >,
+    threads: HashMap< ThreadId, Thread >,
+    /// The addresses of the allocations from each pool which are still alive.
+    live_pool_allocations: HashMap< u16, HashSet< DataPointer > >,
     timestamp_to_wall_clock: u64,
     is_little_endian: bool,
     maximum_backtrace_depth: u32,
@@ -132,6 +239,125 @@ pub struct Loader {
     delta_list_for_map: HashMap< MapId, Vec< (Timestamp, UsageDelta) > >,
     last_usage_for_region: HashMap< (MapId, usize), MapUsage >,
     freshly_mmaped: HashSet< MapId >,
+    live_map_regions: RangeMap< MapId >,
+    /// How many of the purged bytes of a map weren't yet seen to be reclaimed, and how many
+    /// of the reclaimed bytes weren't yet seen to be faulted back in.
+    pending_purges: HashMap< MapId, (u64, u64) >,
+}
+
+/// Marks a frame in the backtrace storage which wasn't symbolicated yet; the rest of the bits
+/// is an index into the `unresolved_addresses`.
+const UNRESOLVED_FRAME: FrameId = 1 << (usize::BITS - 1);
+
+fn intern_frame( frames: &mut Vec< Frame >, frame_to_id: &mut HashMap< Frame, FrameId >, frame: Frame ) -> (FrameId, bool) {
+    if let Some( &frame_id ) = frame_to_id.get( &frame ) {
+        (frame_id, false)
+    } else {
+        let frame_id = frames.len();
+        frame_to_id.insert( frame.clone(), frame_id );
+        frames.push( frame );
+        (frame_id, true)
+    }
+}
+
+/// Returns the key under which the symbols of a binary are cached, or `None` if it can't be identified.
+fn symbol_cache_key( build_id: Option< &[u8] >, has_debug_binary: bool, debug_build_id: Option< &[u8] > ) -> Option< String > {
+    let to_hex = |bytes: &[u8]| bytes.iter().map( |byte| format!( "{:02x}", byte ) ).collect::< String >();
+    match (build_id, debug_build_id) {
+        (Some( build_id ), _) if !has_debug_binary => Some( to_hex( build_id ) ),
+        (Some( build_id ), Some( debug_build_id )) => Some( format!( "{}-{}", to_hex( build_id ), to_hex( debug_build_id ) ) ),
+        (None, Some( debug_build_id )) => Some( format!( "debug-{}", to_hex( debug_build_id ) ) ),
+        _ => None
+    }
+}
+
+fn symbolicate< F: FnMut( Frame ) >(
+    address_space: &dyn IAddressSpace,
+    symbol_cache: Option< &mut SymbolCache >,
+    interner: &mut StringInterner,
+    address: u64,
+    callback: F
+) {
+    match symbol_cache {
+        Some( symbol_cache ) => {
+            symbol_cache.symbolicate( interner, address, |interner| {
+                let mut frames = Vec::new();
+                address_to_frame( address_space, interner, address, |frame| frames.push( frame ) );
+                frames
+            }, callback );
+        },
+        None => address_to_frame( address_space, interner, address, callback )
+    }
+}
+
+type SymbolicationBinaries = (Option< Arc< BinaryData > >, Option< Arc< BinaryData > >);
+
+/// The minimum number of addresses which are worth symbolicating on another thread,
+/// since each thread has to build its own address space first.
+const MINIMUM_SYMBOLICATION_CHUNK: usize = 1024;
+
+/// Creates a fresh address space which symbolicates the `regions` the same way as the loader's own.
+fn new_symbolicating_address_space( arch: &str, regions: Vec< Region >, binaries: &HashMap< String, SymbolicationBinaries > ) -> Box< dyn IAddressSpace > {
+    let mut address_space = Loader::new_address_space( arch );
+    address_space.reload( regions, &mut |region, handle| {
+        handle.should_load_frame_descriptions( false );
+        if let Some( (binary_data, debug_binary_data) ) = binaries.get( &region.name ) {
+            if let Some( binary_data ) = binary_data {
+                handle.set_binary( binary_data.clone() );
+            }
+
+            if let Some( debug_binary_data ) = debug_binary_data {
+                handle.set_debug_binary( debug_binary_data.clone() );
+            }
+        }
+    });
+
+    address_space
+}
+
+/// Symbolicates all of the `addresses`, which should be sorted, splitting them into chunks which are resolved in parallel.
+///
+/// The address spaces can't be shared between threads, so every chunk gets its own; if there are only
+/// a few addresses they're all resolved on the current thread through the loader's `address_space`.
+fn symbolicate_in_parallel(
+    address_space: &dyn IAddressSpace,
+    arch: &str,
+    regions: &FrozenRangeMap< Region >,
+    binaries: &HashMap< String, SymbolicationBinaries >,
+    addresses: &[u64]
+) -> Vec< Vec< CachedFrame > > {
+    let chunk_size = cmp::max( addresses.len() / rayon::current_num_threads() + 1, MINIMUM_SYMBOLICATION_CHUNK );
+    if addresses.len() <= chunk_size {
+        return addresses.iter().map( |&address| address_to_cached_frames( address_space, address ) ).collect();
+    }
+
+    let regions: Vec< Region > = regions.values().cloned().collect();
+    let chunks: Vec< Vec< Vec< CachedFrame > > > = addresses.par_chunks( chunk_size ).map( |chunk| {
+        let address_space = new_symbolicating_address_space( arch, regions.clone(), binaries );
+        chunk.iter().map( |&address| address_to_cached_frames( &*address_space, address ) ).collect()
+    }).collect();
+
+    chunks.into_iter().flatten().collect()
+}
+
+/// Does the same as `address_to_frame`, except the strings aren't interned.
+fn address_to_cached_frames( address_space: &dyn IAddressSpace, address: u64 ) -> Vec< CachedFrame > {
+    let mut output = Vec::new();
+    address_space.decode_symbol_while( address, &mut |frame| {
+        output.push( CachedFrame {
+            library: frame.library.take().map( |str| get_basename( &str ).to_owned() ),
+            function: frame.demangled_name.take().map( |str| clean_symbol( str ).into_owned() ),
+            raw_function: frame.name.take().map( |str| str.to_string() ),
+            source: frame.file.take().map( |str| str.to_string() ),
+            line: frame.line.take().map( |value| value as _ ),
+            column: frame.column.take().map( |value| value as _ ),
+            is_inline: frame.is_inline
+        });
+
+        true
+    });
+
+    output
 }
 
 fn address_to_frame< F: FnMut( Frame ) >( address_space: &dyn IAddressSpace, interner: &mut StringInterner, address: u64, mut callback: F ) {
@@ -204,15 +430,165 @@ fn into_key( id: event::AllocationId, pointer: DataPointer ) -> (u64, u64) {
     }
 }
 
+#[test]
+fn test_untracked_allocations_are_paired_by_their_address() {
+    let header = HeaderBody {
+        id: DataId::new( 0, 0 ),
+        initial_timestamp: Timestamp::from_secs( 0 ),
+        timestamp: Timestamp::from_secs( 0 ),
+        wall_clock_secs: 0,
+        wall_clock_nsecs: 0,
+        pid: 1,
+        cmdline: Vec::new(),
+        executable: Vec::new(),
+        arch: "x86_64".into(),
+        flags: 0,
+        pointer_size: 8
+    };
+
+    let body = |pointer, size| AllocBody { pointer, size, backtrace: 1, thread: 1, flags: 0, extra_usable_space: 0, preceding_free_space: 0 };
+    let mut loader = Loader::new( header, DebugInfoIndex::new() );
+    loader.process( Event::Backtrace { id: 1, addresses: Vec::new().into() } );
+
+    // This is what the profiler emits for the IDs which didn't fit into the allocation's trailer.
+    let id = event::AllocationId::UNTRACKED;
+    loader.process( Event::AllocEx { id, timestamp: Timestamp::from_secs( 1 ), allocation: body( 0x1000, 10 ) } );
+    loader.process( Event::ReallocEx { id, timestamp: Timestamp::from_secs( 2 ), old_pointer: 0x1000, allocation: body( 0x2000, 20 ) } );
+    loader.process( Event::FreeEx { id, timestamp: Timestamp::from_secs( 3 ), pointer: 0x2000, backtrace: 0, thread: 1 } );
+
+    let data = loader.finalize();
+    let allocations: Vec< _ > = data.allocations_with_id().collect();
+    assert_eq!( allocations.len(), 2 );
+
+    let (first_id, first) = allocations[ 0 ];
+    let (second_id, second) = allocations[ 1 ];
+    assert_eq!( first.pointer, 0x1000 );
+    assert_eq!( second.pointer, 0x2000 );
+    assert_eq!( first.reallocation.map( |id| id.raw() ), Some( second_id.raw() ) );
+    assert_eq!( second.reallocated_from.map( |id| id.raw() ), Some( first_id.raw() ) );
+    assert!( second.deallocation.is_some() );
+}
+
+/// The allocations from the pools overlap with the pools' own memory, so they're kept under separate keys.
+fn pool_key( pool: u16, pointer: DataPointer ) -> (u64, u64) {
+    (1 << 63 | pool as u64, pointer)
+}
+
+/// The NUMA nodes are stored in a byte; `u8::MAX` is reserved for when the node is unknown.
+fn numa_node_to_u8( node: u32 ) -> Option< u8 > {
+    if node < u8::MAX as u32 {
+        Some( node as u8 )
+    } else {
+        None
+    }
+}
+
+fn parse_numa_node( flags: u32 ) -> Option< u8 > {
+    event::numa_node_from_alloc_flags( flags ).and_then( numa_node_to_u8 )
+}
+
+fn thread_tag_at( changes: &HashMap< ThreadId, Vec< (Timestamp, u32) > >, thread: ThreadId, timestamp: Timestamp ) -> u32 {
+    let changes = match changes.get( &thread ) {
+        Some( changes ) => changes,
+        None => return 0
+    };
+
+    let index = changes.partition_point( |&(changed_at, _)| changed_at <= timestamp );
+    index.checked_sub( 1 ).map( |index| changes[ index ].1 ).unwrap_or( 0 )
+}
+
+#[test]
+fn test_thread_tag_at() {
+    let at = Timestamp::from_secs;
+    let mut changes = HashMap::new();
+    changes.insert( 1, vec![ (at( 10 ), 100), (at( 20 ), 0), (at( 30 ), 300) ] );
+
+    assert_eq!( thread_tag_at( &changes, 1, at( 5 ) ), 0 );
+    assert_eq!( thread_tag_at( &changes, 1, at( 10 ) ), 100 );
+    assert_eq!( thread_tag_at( &changes, 1, at( 25 ) ), 0 );
+    assert_eq!( thread_tag_at( &changes, 1, at( 40 ) ), 300 );
+    assert_eq!( thread_tag_at( &changes, 2, at( 40 ) ), 0 );
+}
+
+/// Adds the allocation counts of every backtrace to each of its frames.
+///
+/// Every chunk of the backtraces is counted into its own array, as the frames near the roots
+/// are shared by almost every backtrace, and those arrays are then summed up per frame.
+fn count_frames( frames: &mut [Frame], backtraces: &[BacktraceStorageRef], backtraces_storage: &[FrameId], group_stats: &[GroupStatistics] ) {
+    let frame_count = frames.len();
+    let chunk_size = cmp::max( backtraces.len() / rayon::current_num_threads() + 1, 64 * 1024 );
+    let counts: Vec< Vec< u64 > > = backtraces.par_chunks( chunk_size ).zip( group_stats.par_chunks( chunk_size ) ).map( |(backtraces, group_stats)| {
+        let mut counts = vec![ 0; frame_count ];
+        for (&(offset, length), stats) in backtraces.iter().zip( group_stats ) {
+            for &frame_id in &backtraces_storage[ offset as usize..(offset + length) as usize ] {
+                counts[ frame_id ] += stats.alloc_count;
+            }
+        }
+
+        counts
+    }).collect();
+
+    frames.par_iter_mut().enumerate().for_each( |(frame_id, frame)| {
+        frame.increment_count( counts.iter().map( |counts| counts[ frame_id ] ).sum() );
+    });
+}
+
+/// Finds the allocation which was live at the address of every page fault by replaying the operations
+/// in the order in which they happened; both the operations and the page faults have to be sorted by time.
+fn resolve_page_faults( allocations: &[Allocation], operations: &[(Timestamp, OperationId)], page_faults: &mut [PageFault] ) {
+    let mut live: std::collections::BTreeMap< DataPointer, AllocationId > = Default::default();
+    let mut operations = operations.iter().peekable();
+    for page_fault in page_faults {
+        while let Some( &&(timestamp, op) ) = operations.peek() {
+            if timestamp > page_fault.timestamp {
+                break;
+            }
+
+            operations.next();
+            let allocation = &allocations[ op.id().raw() as usize ];
+            if op.is_deallocation() {
+                live.remove( &allocation.pointer );
+            } else if op.is_allocation() {
+                live.insert( allocation.pointer, op.id() );
+            } else if op.is_reallocation() {
+                let old_allocation = &allocations[ allocation.reallocated_from.unwrap().raw() as usize ];
+                live.remove( &old_allocation.pointer );
+                live.insert( allocation.pointer, op.id() );
+            }
+        }
+
+        page_fault.allocation = live.range( ..=page_fault.address ).next_back().and_then( |(&pointer, &id)| {
+            let allocation = &allocations[ id.raw() as usize ];
+            if page_fault.address < pointer + allocation.usable_size() {
+                Some( id )
+            } else {
+                None
+            }
+        });
+    }
+}
+
+fn scale_by_weight( value: u64, weight: f32 ) -> u64 {
+    if weight == 1.0 {
+        value
+    } else {
+        (value as f64 * weight as f64).round() as u64
+    }
+}
+
 impl Loader {
-    pub fn new( header: HeaderBody, debug_info_index: DebugInfoIndex ) -> Self {
-        let address_space: Box< dyn IAddressSpace > = match &*header.arch {
+    fn new_address_space( arch: &str ) -> Box< dyn IAddressSpace > {
+        match arch {
             "arm" => Box::new( AddressSpace::< arch::arm::Arch >::new() ),
             "x86_64" => Box::new( AddressSpace::< arch::amd64::Arch >::new() ),
             "mips64" => Box::new( AddressSpace::< arch::mips64::Arch >::new() ),
             "aarch64" => Box::new( AddressSpace::< arch::aarch64::Arch >::new() ),
-            _ => panic!( "Unknown architecture: {}", header.arch )
-        };
+            _ => panic!( "Unknown architecture: {}", arch )
+        }
+    }
+
+    pub fn new( header: HeaderBody, debug_info_index: DebugInfoIndex ) -> Self {
+        let address_space = Loader::new_address_space( &header.arch );
 
         let flags = header.flags;
         let timestamp = header.timestamp;
@@ -227,24 +603,38 @@ impl Loader {
             address_space_needs_reloading: true,
             debug_info_index,
             binaries: Default::default(),
+            symbolication_binaries: Default::default(),
             pending_address_space_maps: Default::default(),
-            address_space_maps: RangeMap::new(),
+            address_space_maps: FrozenRangeMap::new(),
             backtraces: Default::default(),
             backtraces_storage: Default::default(),
             backtrace_to_id: Default::default(),
             backtrace_remappings: Default::default(),
             group_stats: Default::default(),
+            profiler_bytes_written: 0,
+            profiler_histograms: Default::default(),
+            backtrace_cache_statistics: Default::default(),
             operations: Vec::with_capacity( 100000 ),
             allocations: Vec::with_capacity( 100000 ),
             allocation_map: Default::default(),
-            allocation_range_map: RangeMap::new(),
-            allocation_range_map_dirty: true,
-            allocations_by_backtrace: Default::default(),
+            heap_range: u64::MAX..0,
+            memory_dumps: Vec::new(),
+            content_hasher: None,
             frames: Default::default(),
             frame_to_id: Default::default(),
             frames_by_address: Default::default(),
+            defer_symbolication: false,
+            unresolved_addresses: Default::default(),
+            unresolved_calls_to_new: Default::default(),
+            symbol_cache: SymbolCache::new(),
             shared_ptr_backtraces: Default::default(),
             shared_ptr_allocations: Default::default(),
+            chains: Default::default(),
+            chain_by_first_allocation: Default::default(),
+            load_filter: Default::default(),
+            backtrace_matches_load_filter: Default::default(),
+            skipped_allocation_count: 0,
+            skipped_allocation_size: 0,
             total_allocated: 0,
             total_allocated_count: 0,
             total_freed: 0,
@@ -252,7 +642,22 @@ impl Loader {
             frame_skip_ranges: Vec::with_capacity( 4 ),
             symbol_new_range: -1_i64 as u64..0,
             marker: 0,
+            sampling_interval: 0,
+            parent_id: None,
             mallopts: Default::default(),
+            memory_advices: Default::default(),
+            residency_samples: Default::default(),
+            culled_allocations: Default::default(),
+            allocator_latencies: Default::default(),
+            page_faults: Default::default(),
+            page_fault_period: 0,
+            jemalloc_snapshots: Default::default(),
+            cgroup_samples: Default::default(),
+            option_changes: Default::default(),
+            thread_tag_changes: Default::default(),
+            pools: Default::default(),
+            threads: Default::default(),
+            live_pool_allocations: Default::default(),
             timestamp_to_wall_clock: 0,
             is_little_endian: (flags & HEADER_FLAG_IS_LITTLE_ENDIAN) != 0,
             maximum_backtrace_depth: 0,
@@ -264,6 +669,8 @@ impl Loader {
             delta_list_for_map: Default::default(),
             last_usage_for_region: Default::default(),
             freshly_mmaped: Default::default(),
+            live_map_regions: RangeMap::new(),
+            pending_purges: Default::default(),
         };
 
         loader.update_timestamp_to_wall_clock( timestamp, wall_clock_secs, wall_clock_nsecs );
@@ -282,10 +689,20 @@ impl Loader {
     }
 
     pub fn load_from_stream< F: Read + Send + 'static, D: AsRef< OsStr >, I: IntoIterator< Item = D > >( fp: F, debug_symbols: I ) -> Result< Data, io::Error > {
+        Loader::load_from_stream_with_filter( fp, debug_symbols, LoadFilter::default() )
+    }
+
+    pub fn load_from_stream_with_filter< F, D, I >( fp: F, debug_symbols: I, filter: LoadFilter ) -> Result< Data, io::Error >
+        where F: Read + Send + 'static,
+              D: AsRef< OsStr >,
+              I: IntoIterator< Item = D >
+    {
         debug!( "Starting to load data..." );
 
         let start_timestamp = Instant::now();
-        let (header, event_stream) = parse_events( fp )?;
+
+        // The events are decoded on another thread while we're processing them here.
+        let (header, event_stream) = parse_events_in_background( fp )?;
 
         let mut debug_info_index = DebugInfoIndex::new();
         for path in debug_symbols {
@@ -294,9 +711,21 @@ impl Loader {
 
         let mut loader = Loader::new( header, debug_info_index );
 
-        for event in event_stream {
-            let event = event?;
-            loader.process( event );
+        // Matching the functions needs the frames as soon as the backtraces are seen.
+        loader.set_defer_symbolication( filter.only_backtraces_with_function.is_none() );
+        let aggregate_deallocated = filter.aggregate_deallocated;
+        loader.set_load_filter( filter );
+
+        if aggregate_deallocated {
+            for event in AggregatedEvents::new( event_stream ) {
+                let event = event?;
+                loader.process( event );
+            }
+        } else {
+            for event in event_stream {
+                let event = event?;
+                loader.process( event );
+            }
         }
 
         let output = loader.finalize();
@@ -305,6 +734,173 @@ impl Loader {
         Ok( output )
     }
 
+    /// Loads the data from the given file, optionally going through a `.bhcache` file next to it.
+    ///
+    /// If the cache is missing or stale the data is loaded normally and the cache is regenerated.
+    pub fn load_from_file< P: AsRef< Path >, D: AsRef< OsStr > >( path: P, debug_symbols: &[D], use_cache: bool ) -> Result< Data, io::Error > {
+        Loader::load_from_file_with_filter( path, debug_symbols, use_cache, LoadFilter::default() )
+    }
+
+    /// Same as `load_from_file`, except only the allocations which match the `filter` are loaded.
+    ///
+    /// The cache is only used when the `filter` is empty.
+    pub fn load_from_file_with_filter< P: AsRef< Path >, D: AsRef< OsStr > >( path: P, debug_symbols: &[D], use_cache: bool, filter: LoadFilter ) -> Result< Data, io::Error > {
+        let path = path.as_ref();
+        if !use_cache || !filter.is_empty() {
+            return Loader::load_from_stream_with_filter( File::open( path )?, debug_symbols, filter );
+        }
+
+        let (header, _) = parse_events( File::open( path )? )?;
+        let key = CacheKey::new( header.id, path, debug_symbols )?;
+        let cache_path = cache::cache_path( path );
+        match cache::load( &cache_path, &key ) {
+            Ok( Some( data ) ) => return Ok( data ),
+            Ok( None ) => {},
+            Err( error ) => warn!( "Failed to load the cache from {:?}: {}", cache_path, error )
+        }
+
+        let data = Loader::load_from_stream( File::open( path )?, debug_symbols )?;
+        if let Err( error ) = cache::store( &cache_path, &key, &data ) {
+            warn!( "Failed to write the cache to {:?}: {}", cache_path, error );
+        }
+
+        Ok( data )
+    }
+
+    /// Loads the data of the child processes which streamed it through their parent into the given file.
+    ///
+    /// The file is only read once to split it up, and then the children are loaded in parallel.
+    /// Returns the PIDs of the children along with their data, in the order in which they've first
+    /// written anything, and then the children of those; the children whose data couldn't be
+    /// loaded at all are skipped.
+    pub fn load_child_processes_from_file< P: AsRef< Path >, D: AsRef< OsStr > + Sync >( path: P, debug_symbols: &[D], filter: LoadFilter ) -> Result< Vec< (u32, Data) >, io::Error > {
+        let path = path.as_ref();
+        if !has_child_processes( File::open( path )? )? {
+            return Ok( Vec::new() );
+        }
+
+        let children = Loader::load_child_processes_from_stream( File::open( path )?, debug_symbols, filter )?;
+        info!( "Loaded the data of {} child process(es) from {:?}", children.len(), path );
+        Ok( children )
+    }
+
+    fn load_child_processes_from_stream< F: Read + Send + 'static, D: AsRef< OsStr > + Sync >( fp: F, debug_symbols: &[D], filter: LoadFilter ) -> Result< Vec< (u32, Data) >, io::Error > {
+        let mut streams: Vec< (u32, Vec< u8 >) > = Vec::new();
+        let mut index_by_pid = HashMap::new();
+        scan_events( fp, |event, _| {
+            if let Event::ChildData { pid, ref data, .. } = *event {
+                let index = *index_by_pid.entry( pid ).or_insert_with( || {
+                    streams.push( (pid, Vec::new()) );
+                    streams.len() - 1
+                });
+
+                streams[ index ].1.extend_from_slice( data );
+            }
+        })?;
+
+        let loaded: Vec< _ > = streams.into_par_iter().map( |(pid, stream)| {
+            // The children are forked with the same options, so they could have had children of their own too.
+            let grandchildren = has_child_processes( &stream[ .. ] ).and_then( |has_children| {
+                if has_children {
+                    Loader::load_child_processes_from_stream( io::Cursor::new( stream.clone() ), debug_symbols, filter.clone() )
+                } else {
+                    Ok( Vec::new() )
+                }
+            });
+
+            let grandchildren = grandchildren.unwrap_or_else( |error| {
+                warn!( "Failed to load the children of the child process {}: {}", pid, error );
+                Vec::new()
+            });
+
+            let child = match Loader::load_from_stream_with_filter( io::Cursor::new( stream ), debug_symbols, filter.clone() ) {
+                Ok( data ) => Some( (pid, data) ),
+                Err( error ) => {
+                    warn!( "Failed to load the data of the child process {}: {}", pid, error );
+                    None
+                }
+            };
+
+            (child, grandchildren)
+        }).collect();
+
+        let mut children = Vec::new();
+        let mut grandchildren = Vec::new();
+        for (child, descendants) in loaded {
+            children.extend( child );
+            grandchildren.extend( descendants );
+        }
+
+        children.extend( grandchildren );
+        Ok( children )
+    }
+
+    pub fn set_load_filter( &mut self, filter: LoadFilter ) {
+        self.load_filter = filter;
+        self.backtrace_matches_load_filter.clear();
+    }
+
+    fn backtrace_matches_load_filter( &mut self, backtrace: BacktraceId ) -> bool {
+        let regex = match self.load_filter.only_backtraces_with_function {
+            Some( ref regex ) => regex,
+            None => return true
+        };
+
+        let index = backtrace.raw() as usize;
+        if let Some( Some( is_match ) ) = self.backtrace_matches_load_filter.get( index ) {
+            return *is_match;
+        }
+
+        let (offset, length) = self.backtraces[ index ];
+        let interner = self.interner.get_mut();
+        let frames = &self.frames;
+        let is_match = self.backtraces_storage[ offset as usize..(offset + length) as usize ].iter().any( |&frame_id| {
+            let frame = &frames[ frame_id ];
+            frame.function().into_iter().chain( frame.raw_function() ).any( |id| {
+                interner.resolve( id ).map( |name| regex.is_match( name ) ).unwrap_or( false )
+            })
+        });
+
+        if self.backtrace_matches_load_filter.len() <= index {
+            self.backtrace_matches_load_filter.resize( index + 1, None );
+        }
+
+        self.backtrace_matches_load_filter[ index ] = Some( is_match );
+        is_match
+    }
+
+    fn allocation_matches_load_filter( &mut self, timestamp: Timestamp, size: u64, backtrace: BacktraceId, thread: ThreadId ) -> bool {
+        if self.load_filter.only_allocated_after.is_some() || self.load_filter.only_allocated_before.is_some() {
+            let initial_timestamp = self.shift_timestamp( self.header.initial_timestamp );
+            let elapsed = Duration::from_micros( timestamp.as_usecs().saturating_sub( initial_timestamp.as_usecs() ) );
+            if self.load_filter.only_allocated_after.map( |after| elapsed < after ).unwrap_or( false ) ||
+               self.load_filter.only_allocated_before.map( |before| elapsed > before ).unwrap_or( false ) {
+                return false;
+            }
+        }
+
+        if self.load_filter.only_larger_or_equal.map( |min_size| size < min_size ).unwrap_or( false ) {
+            return false;
+        }
+
+        if let Some( ref threads ) = self.load_filter.only_threads {
+            if !threads.contains( &thread ) {
+                return false;
+            }
+        }
+
+        self.backtrace_matches_load_filter( backtrace )
+    }
+
+    /// Makes the loader only symbolicate new addresses in batches, right before the address space
+    /// changes and when the loading is finished, instead of immediately when they're first seen.
+    ///
+    /// The callbacks passed to `process_backtrace_event` will not see the frame IDs
+    /// of addresses which weren't symbolicated, so this is only for when they're not used.
+    pub fn set_defer_symbolication( &mut self, value: bool ) {
+        self.defer_symbolication = value;
+    }
+
     fn shift_timestamp( &self, timestamp: Timestamp ) -> Timestamp {
         Timestamp::from_usecs( timestamp.as_usecs().wrapping_add( self.timestamp_to_wall_clock ) )
     }
@@ -335,6 +931,10 @@ impl Loader {
             allocation_flags |= AllocationFlags::IS_JEMALLOC;
         }
 
+        if flags & event::ALLOC_FLAG_SAMPLED != 0 {
+            allocation_flags |= AllocationFlags::IS_SAMPLED;
+        }
+
         if self.shared_ptr_backtraces.contains( &backtrace ) {
             allocation_flags |= AllocationFlags::IS_SHARED_PTR;
         }
@@ -342,9 +942,22 @@ impl Loader {
         allocation_flags
     }
 
+    /// Estimates how many allocations of a given size an allocation which was sampled represents.
+    ///
+    /// An allocation of `size` bytes is sampled with a probability of `1 - exp( -size / interval )`,
+    /// so its weight is the inverse of that.
+    fn sample_weight( &self, flags: AllocationFlags, size: u64 ) -> f32 {
+        if !flags.contains( AllocationFlags::IS_SAMPLED ) || self.sampling_interval == 0 {
+            return 1.0;
+        }
+
+        let probability = 1.0 - (-(cmp::max( size, 1 ) as f64) / self.sampling_interval as f64).exp();
+        (1.0 / probability) as f32
+    }
+
     fn handle_alloc(
         &mut self,
-        id: event::AllocationId,
+        key: (u64, u64),
         timestamp: Timestamp,
         pointer: DataPointer,
         size: u64,
@@ -352,15 +965,24 @@ impl Loader {
         thread: ThreadId,
         flags: u32,
         extra_usable_space: u32,
-    ) {
+    ) -> Option< AllocationId > {
         self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
 
+        if !self.load_filter.is_empty() && !self.allocation_matches_load_filter( timestamp, size, backtrace, thread ) {
+            self.skipped_allocation_count += 1;
+            self.skipped_allocation_size += size;
+            return None;
+        }
+
+        let raw_flags = flags;
         let flags = self.parse_flags( backtrace, flags );
+        let unscaled_usable_size = size + extra_usable_space as u64;
+        let sample_weight = self.sample_weight( flags, size );
         let allocation_id = AllocationId::new( self.allocations.len() as _ );
         let allocation = Allocation {
             pointer,
             timestamp,
-            size,
+            size: scale_by_weight( size, sample_weight ),
             thread,
             backtrace,
             deallocation: None,
@@ -369,29 +991,32 @@ impl Loader {
             first_allocation_in_chain: None,
             position_in_chain: 0,
             flags,
-            extra_usable_space,
-            marker: self.marker
+            extra_usable_space: cmp::min( scale_by_weight( extra_usable_space as u64, sample_weight ), u32::MAX as u64 ) as u32,
+            marker: self.marker,
+            thread_tag: 0,
+            pool: None,
+            thread_numa_node: parse_numa_node( raw_flags ),
+            memory_numa_node: None,
+            sample_weight
         };
 
-        let key = into_key( id, pointer );
-        let entry = self.allocation_map.entry( key );
-        if let hash_map::Entry::Occupied( entry ) = entry {
-            warn!( "Duplicate allocation of 0x{:016X}; old backtrace = {:?}, new backtrace = {:?}", pointer, self.allocations[ entry.get().raw() as usize ].backtrace, backtrace );
-            return;
+        if let Some( old_id ) = self.allocation_map.get( key ) {
+            warn!( "Duplicate allocation of 0x{:016X}; old backtrace = {:?}, new backtrace = {:?}", pointer, self.allocations[ old_id.raw() as usize ].backtrace, backtrace );
+            return None;
         }
 
         let group_stats = &mut self.group_stats[ allocation.backtrace.raw() as usize ];
         group_stats.first_allocation = cmp::min( group_stats.first_allocation, timestamp );
         group_stats.last_allocation = cmp::max( group_stats.last_allocation, timestamp );
-        group_stats.min_size = cmp::min( group_stats.min_size, allocation.usable_size() );
-        group_stats.max_size = cmp::max( group_stats.max_size, allocation.usable_size() );
-        group_stats.alloc_count += 1;
+        group_stats.min_size = cmp::min( group_stats.min_size, unscaled_usable_size );
+        group_stats.max_size = cmp::max( group_stats.max_size, unscaled_usable_size );
+        group_stats.alloc_count += allocation.sample_count();
         group_stats.alloc_size += allocation.usable_size();
 
+        self.total_allocated += allocation.size;
+        self.total_allocated_count += allocation.sample_count();
         self.allocations.push( allocation );
-        entry.or_insert( allocation_id );
-        self.total_allocated += size;
-        self.total_allocated_count += 1;
+        self.allocation_map.insert( key, allocation_id );
 
         let op = OperationId::new_allocation( allocation_id );
         self.operations.push( (timestamp, op) );
@@ -400,13 +1025,108 @@ impl Loader {
             self.shared_ptr_allocations.insert( pointer, allocation_id );
         }
 
-        self.allocation_range_map_dirty = true;
-        self.allocations_by_backtrace.get_mut( &backtrace ).unwrap().push( allocation_id );
+        self.extend_heap_range( pointer, unscaled_usable_size );
+        Some( allocation_id )
+    }
+
+    /// Handles the latest usage of a region, with every amount in kilobytes.
+    fn handle_region_usage( &mut self, timestamp: Timestamp, map_id: u64, address: u64, length: u64, usage: MapUsage, huge_page_flags: HugePageFlags ) {
+        let timestamp = self.shift_timestamp( timestamp );
+        self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+
+        let id = match self.map_index_map.get( &map_id ) {
+            Some( smap ) => *smap,
+            None => {
+                warn!( "Update for map which was not found: id = {}, address = 0x{:016X}", map_id, address );
+                return;
+            }
+        };
+
+        let map = &mut self.maps[ id.0 as usize ];
+        let (region_index, region) = match map.regions.iter_mut().enumerate().rev().find( |(_, region)| region.pointer == address ) {
+            Some( region_index ) => region_index,
+            None => {
+                warn!( "Update for a map for region which was not found: id = {}, address = 0x{:016X}", map_id, address );
+                return
+            }
+        };
+
+        if region.size != length {
+            warn!( "Length doesn't match for region at 0x{:016X} for region update", address );
+            return;
+        }
+
+        map.huge_page_flags.insert( huge_page_flags );
+        let usage = MapUsage {
+            timestamp,
+            address_space: region.size,
+            anonymous: usage.anonymous * 1024,
+            shared_clean: usage.shared_clean * 1024,
+            shared_dirty: usage.shared_dirty * 1024,
+            private_clean: usage.private_clean * 1024,
+            private_dirty: usage.private_dirty * 1024,
+            swap: usage.swap * 1024,
+            anon_huge_pages: usage.anon_huge_pages * 1024,
+            shmem_pmd_mapped: usage.shmem_pmd_mapped * 1024,
+            file_pmd_mapped: usage.file_pmd_mapped * 1024,
+        };
+
+        let last_usage = self.last_usage_for_region.get_mut( &(map.id, region_index) ).unwrap();
+        if let Some( (unreclaimed, unrefaulted) ) = self.pending_purges.get_mut( &map.id ) {
+            // We only see the usage when it's rescanned, so any drop of the RSS after the memory
+            // was purged is attributed to the purge, and any later growth to it being faulted back in.
+            let (old_rss, new_rss) = (last_usage.rss(), usage.rss());
+            if new_rss < old_rss {
+                let reclaimed = std::cmp::min( old_rss - new_rss, *unreclaimed );
+                *unreclaimed -= reclaimed;
+                *unrefaulted += reclaimed;
+                map.reclaimed += reclaimed;
+            } else {
+                let refaulted = std::cmp::min( new_rss - old_rss, *unrefaulted );
+                *unrefaulted -= refaulted;
+                map.refaulted += refaulted;
+            }
+        }
+
+        let delta_list = self.delta_list_for_map.get_mut( &map.id ).unwrap();
+        delta_list.push( (timestamp, UsageDelta {
+            address_space: 0,
+            anonymous: usage.anonymous as i64 - last_usage.anonymous as i64,
+            shared_clean: usage.shared_clean as i64 - last_usage.shared_clean as i64,
+            shared_dirty: usage.shared_dirty as i64 - last_usage.shared_dirty as i64,
+            private_clean: usage.private_clean as i64 - last_usage.private_clean as i64,
+            private_dirty: usage.private_dirty as i64 - last_usage.private_dirty as i64,
+            swap: usage.swap as i64 - last_usage.swap as i64,
+            anon_huge_pages: usage.anon_huge_pages as i64 - last_usage.anon_huge_pages as i64,
+            shmem_pmd_mapped: usage.shmem_pmd_mapped as i64 - last_usage.shmem_pmd_mapped as i64,
+            file_pmd_mapped: usage.file_pmd_mapped as i64 - last_usage.file_pmd_mapped as i64
+        }));
+        *last_usage = usage;
+    }
+
+    fn handle_purge( &mut self, range: Range< u64 > ) {
+        let mut purged_per_map: smallvec::SmallVec< [(MapId, u64); 1] > = smallvec::SmallVec::new();
+        for (region, &id) in self.live_map_regions.get_all_overlapping( range.clone() ) {
+            let purged = std::cmp::min( region.end, range.end ) - std::cmp::max( region.start, range.start );
+            match purged_per_map.iter_mut().find( |(map_id, _)| *map_id == id ) {
+                Some( (_, total) ) => *total += purged,
+                None => purged_per_map.push( (id, purged) )
+            }
+        }
+
+        for (id, purged) in purged_per_map {
+            let map = &mut self.maps[ id.0 as usize ];
+            map.purge_count += 1;
+            map.purged += purged;
+
+            let (unreclaimed, _) = self.pending_purges.entry( id ).or_insert( (0, 0) );
+            *unreclaimed = std::cmp::min( *unreclaimed + purged, map.size );
+        }
     }
 
     fn handle_free(
         &mut self,
-        id: event::AllocationId,
+        key: (u64, u64),
         timestamp: Timestamp,
         pointer: DataPointer,
         backtrace: Option< BacktraceId >,
@@ -414,8 +1134,7 @@ impl Loader {
     ) {
         self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
 
-        let key = into_key( id, pointer );
-        let allocation_id = match self.allocation_map.remove( &key ) {
+        let allocation_id = match self.allocation_map.remove( key ) {
             Some( id ) => id,
             None => {
                 debug!( "Unknown deallocation of 0x{:016X} at backtrace = {:?}", pointer, backtrace );
@@ -426,9 +1145,9 @@ impl Loader {
         let allocation = &mut self.allocations[ allocation_id.raw() as usize ];
         allocation.deallocation = Some( Deallocation { timestamp, thread, backtrace } );
         self.total_freed += allocation.size;
-        self.total_freed_count += 1;
+        self.total_freed_count += allocation.sample_count();
         let group_stats = &mut self.group_stats[ allocation.backtrace.raw() as usize ];
-        group_stats.free_count += 1;
+        group_stats.free_count += allocation.sample_count();
         group_stats.free_size += allocation.usable_size();
 
         let op = OperationId::new_deallocation( allocation_id );
@@ -437,8 +1156,6 @@ impl Loader {
         if allocation.is_shared_ptr() {
             self.shared_ptr_allocations.remove( &allocation.pointer );
         }
-
-        self.allocation_range_map_dirty = true;
     }
 
     fn handle_realloc(
@@ -456,29 +1173,34 @@ impl Loader {
         self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
 
         let old_key = into_key( id, old_pointer );
-        let allocation_id = match self.allocation_map.remove( &old_key ) {
+        let allocation_id = match self.allocation_map.remove( old_key ) {
             Some( id ) => id,
             None => return
         };
 
+        let raw_flags = flags;
         let flags = self.parse_flags( backtrace, flags );
         let reallocation_id = AllocationId::new( self.allocations.len() as _ );
+        let unscaled_usable_size = size + extra_usable_space as u64;
+        let sample_weight;
         {
             let allocation = &mut self.allocations[ allocation_id.raw() as usize ];
+            // The reallocated memory stands for the same allocations as the original one did.
+            sample_weight = allocation.sample_weight;
             assert!( !allocation.is_shared_ptr() );
 
             allocation.deallocation = Some( Deallocation { timestamp, thread, backtrace: Some( backtrace ) } );
             allocation.reallocation = Some( reallocation_id );
             self.total_freed += allocation.size;
-            self.total_freed_count += 1;
-            self.group_stats[ allocation.backtrace.raw() as usize ].free_count += 1;
+            self.total_freed_count += allocation.sample_count();
+            self.group_stats[ allocation.backtrace.raw() as usize ].free_count += allocation.sample_count();
             self.group_stats[ allocation.backtrace.raw() as usize ].free_size += allocation.usable_size();
         }
 
-        let reallocation = Allocation {
+        let mut reallocation = Allocation {
             pointer: new_pointer,
             timestamp,
-            size,
+            size: scale_by_weight( size, sample_weight ),
             thread,
             backtrace,
             deallocation: None,
@@ -487,35 +1209,65 @@ impl Loader {
             first_allocation_in_chain: None,
             position_in_chain: 0,
             flags,
-            extra_usable_space,
-            marker: self.marker
+            extra_usable_space: cmp::min( scale_by_weight( extra_usable_space as u64, sample_weight ), u32::MAX as u64 ) as u32,
+            marker: self.marker,
+            thread_tag: 0,
+            pool: None,
+            thread_numa_node: parse_numa_node( raw_flags ),
+            memory_numa_node: None,
+            sample_weight
         };
 
         let new_key = into_key( id, new_pointer );
-        let entry = self.allocation_map.entry( new_key );
-        if let hash_map::Entry::Occupied( entry ) = entry {
-            warn!( "Duplicate allocation (during realloc) of 0x{:016X}; old backtrace = {:?}, new backtrace = {:?}", new_pointer, self.allocations[ entry.get().raw() as usize ].backtrace, backtrace );
+        if let Some( old_id ) = self.allocation_map.get( new_key ) {
+            warn!( "Duplicate allocation (during realloc) of 0x{:016X}; old backtrace = {:?}, new backtrace = {:?}", new_pointer, self.allocations[ old_id.raw() as usize ].backtrace, backtrace );
             return;
         }
 
+        // The reallocated allocation is always the last one in its chain, so the chain can be extended right away.
+        {
+            let allocation = &mut self.allocations[ allocation_id.raw() as usize ];
+            let first_allocation_id = match allocation.first_allocation_in_chain {
+                Some( first_allocation_id ) => {
+                    let chain = &mut self.chains[ self.chain_by_first_allocation[ &first_allocation_id ] ];
+                    chain.last = reallocation_id;
+                    chain.length += 1;
+                    first_allocation_id
+                },
+                None => {
+                    allocation.first_allocation_in_chain = Some( allocation_id );
+                    allocation.position_in_chain = 0;
+                    self.chain_by_first_allocation.insert( allocation_id, self.chains.len() );
+                    self.chains.push( AllocationChain {
+                        first: allocation_id,
+                        last: reallocation_id,
+                        length: 2
+                    });
+                    allocation_id
+                }
+            };
+
+            reallocation.first_allocation_in_chain = Some( first_allocation_id );
+            reallocation.position_in_chain = allocation.position_in_chain + 1;
+        }
+
         let group_stats = &mut self.group_stats[ reallocation.backtrace.raw() as usize ];
         group_stats.first_allocation = cmp::min( group_stats.first_allocation, timestamp );
         group_stats.last_allocation = cmp::max( group_stats.last_allocation, timestamp );
-        group_stats.min_size = cmp::min( group_stats.min_size, reallocation.usable_size() );
-        group_stats.max_size = cmp::max( group_stats.max_size, reallocation.usable_size() );
-        group_stats.alloc_count += 1;
+        group_stats.min_size = cmp::min( group_stats.min_size, unscaled_usable_size );
+        group_stats.max_size = cmp::max( group_stats.max_size, unscaled_usable_size );
+        group_stats.alloc_count += reallocation.sample_count();
         group_stats.alloc_size += reallocation.usable_size();
 
+        self.total_allocated += reallocation.size;
+        self.total_allocated_count += reallocation.sample_count();
         self.allocations.push( reallocation );
-        entry.or_insert( reallocation_id );
-        self.total_allocated += size;
-        self.total_allocated_count += 1;
+        self.allocation_map.insert( new_key, reallocation_id );
 
         let op = OperationId::new_reallocation( reallocation_id );
         self.operations.push( (timestamp, op) );
 
-        self.allocation_range_map_dirty = true;
-        self.allocations_by_backtrace.get_mut( &backtrace ).unwrap().push( reallocation_id );
+        self.extend_heap_range( new_pointer, unscaled_usable_size );
     }
 
     pub(crate) fn interner( &mut self ) -> &mut StringInterner {
@@ -523,41 +1275,57 @@ impl Loader {
     }
 
     pub(crate) fn lookup_backtrace( &mut self, backtrace: u64 ) -> Option< BacktraceId > {
-        let backtrace_id = self.backtrace_remappings.get( &backtrace ).cloned()?;
-        self.allocations_by_backtrace.entry( backtrace_id ).or_insert( Vec::new() );
-        Some( backtrace_id )
+        self.backtrace_remappings.get( &backtrace ).cloned()
     }
 
-    fn scan< P: PointerSize, B: ByteOrder >( &self, base_address: u64, data: &[u8] ) {
-        assert_eq!( data.len() % mem::size_of::< P >(), 0 );
-        for (index, subslice) in data.chunks_exact( mem::size_of::< P >() ).enumerate() {
-            let value: u64 = P::read::< B >( subslice ).into();
-            let allocation_id = match self.shared_ptr_allocations.get( &value ) {
-                Some( &value ) => value,
-                None => continue
-            };
+    fn extend_heap_range( &mut self, pointer: u64, size: u64 ) {
+        self.heap_range.start = cmp::min( self.heap_range.start, pointer );
+        self.heap_range.end = cmp::max( self.heap_range.end, pointer + size );
+    }
 
-            let container_address = base_address + (mem::size_of::< P >() * index) as u64;
+    fn start_memory_dump( &mut self, timestamp: Timestamp ) {
+        self.finish_memory_dump();
 
+        // The sizes of the sampled allocations are only estimates, and the pools overlap with the memory they're carved out of.
+        let allocations = self.allocations.iter().enumerate()
+            .filter( |(_, allocation)| !allocation.was_deallocated() && allocation.size != 0 && !allocation.is_sampled() && allocation.pool.is_none() )
+            .map( |(index, allocation)| (allocation.pointer, allocation.size, AllocationId::new( index as _ )) )
+            .collect();
 
-            if let Some( &container_allocation_id ) = self.allocation_range_map.get_value( container_address ) {
-                let allocation: &Allocation = &self.allocations[ allocation_id.raw() as usize ];
-                let container_allocation = &self.allocations[ container_allocation_id.raw() as usize ];
-                assert!( !allocation.was_deallocated() );
-                assert!( !container_allocation.was_deallocated() );
+        self.content_hasher = Some( ContentHasher::new( allocations ) );
+        self.memory_dumps.push( MemoryDump {
+            timestamp,
+            addresses: Vec::new(),
+            values: Vec::new(),
+            allocation_ids: Vec::new(),
+            content_hashes: Vec::new()
+        });
+    }
 
-                trace!(
-                    "Found an instance of shared pointer #{} (0x{:016X}) at 0x{:016X} (0x{:016X} + {}, allocation #{})",
-                    allocation_id.raw(),
-                    value,
-                    container_address,
-                    base_address,
-                    mem::size_of::< P >() * index,
-                    container_allocation_id.raw()
-                );
+    fn finish_memory_dump( &mut self ) {
+        if let Some( content_hasher ) = self.content_hasher.take() {
+            let (allocation_ids, content_hashes) = content_hasher.finish();
+            let dump = self.memory_dumps.last_mut().unwrap();
+            dump.allocation_ids = allocation_ids;
+            dump.content_hashes = content_hashes;
+        }
+    }
 
-                // TODO
+    /// Picks out the words of the dump which could be pointers into the heap.
+    ///
+    /// This only weeds out what obviously isn't a pointer; the rest can only be checked
+    /// once we know which allocations were alive when the dump was made.
+    fn scan< P: PointerSize, B: ByteOrder >( &mut self, base_address: u64, data: &[u8] ) {
+        let heap_range = self.heap_range.clone();
+        let dump = self.memory_dumps.last_mut().unwrap();
+        for (index, subslice) in data.chunks_exact( mem::size_of::< P >() ).enumerate() {
+            let value: u64 = P::read::< B >( subslice ).into();
+            if !heap_range.contains( &value ) {
+                continue;
             }
+
+            dump.addresses.push( base_address + (mem::size_of::< P >() * index) as u64 );
+            dump.values.push( value );
         }
     }
 
@@ -566,6 +1334,8 @@ impl Loader {
             return;
         }
 
+        // Whatever we've seen until now has to be symbolicated with the old address space.
+        self.resolve_deferred_frames();
         self.address_space_needs_reloading = false;
 
         let mut maps = Vec::new();
@@ -588,31 +1358,95 @@ impl Loader {
             debug!( "Skip range: 0x{:016X}-0x{:016X}", range.start, range.end );
         }
 
-        self.address_space_maps = RangeMap::from_vec( maps );
+        // This is only rebuilt when the maps change, and is otherwise only looked up.
+        self.address_space_maps = RangeMap::from_vec( maps ).into_frozen();
         let binaries: Vec< _ > = self.binaries.values().cloned().collect();
         for binary_data in binaries {
             self.scan_for_symbols( &binary_data );
         }
 
         let binaries = &self.binaries;
+        let symbolication_binaries = &mut self.symbolication_binaries;
+        symbolication_binaries.clear();
         let debug_info_index = &mut self.debug_info_index;
         let regions: Vec< Region > = self.address_space_maps.values().cloned().collect();
+        let mut cached_regions = Vec::new();
         self.address_space.reload( regions, &mut |region, handle| {
             handle.should_load_frame_descriptions( false );
 
             let basename = get_basename( &region.name );
-            let debug_binary_data = if let Some( binary_data ) = binaries.get( &region.name ).cloned() {
+            let binary_data = binaries.get( &region.name ).cloned();
+            let binary_build_id = binary_data.as_ref().and_then( |binary_data| binary_data.build_id().map( |build_id| build_id.to_owned() ) );
+            let debug_binary_data = if let Some( ref binary_data ) = binary_data {
                 let debug_binary_data = debug_info_index.get( &basename, binary_data.debuglink(), binary_data.build_id() );
-                handle.set_binary( binary_data );
+                handle.set_binary( binary_data.clone() );
                 debug_binary_data
             } else {
                 debug_info_index.get( &basename, None, None )
             };
 
-            if let Some( debug_binary_data ) = debug_binary_data {
+            let debug_build_id = debug_binary_data.as_ref().and_then( |binary_data| binary_data.build_id().map( |build_id| build_id.to_owned() ) );
+            if let Some( key ) = symbol_cache_key( binary_build_id.as_deref(), debug_binary_data.is_some(), debug_build_id.as_deref() ) {
+                cached_regions.push( (region.start..region.end, region.file_offset, key) );
+            }
+
+            if let Some( ref debug_binary_data ) = debug_binary_data {
                 handle.set_debug_binary( debug_binary_data.clone() );
             }
+
+            symbolication_binaries.insert( region.name.clone(), (binary_data, debug_binary_data) );
         });
+
+        if let Some( ref mut symbol_cache ) = self.symbol_cache {
+            symbol_cache.set_regions( cached_regions );
+        }
+    }
+
+    /// Drops every binary once nothing else is left to be symbolicated, unmapping the embedded ones unless another loader still uses them.
+    fn release_binaries( &mut self ) {
+        self.binaries.clear();
+        self.symbolication_binaries.clear();
+        self.address_space = Loader::new_address_space( &self.header.arch );
+        self.address_space_needs_reloading = true;
+
+        crate::embedded_binaries::release_unused();
+        let (count, size) = crate::embedded_binaries::mapped_size();
+        debug!( "Embedded binaries still mapped: {} ({} bytes)", count, size );
+    }
+
+    /// Finds a binary which was only identified in the data: first among the debug symbols, then at
+    /// its original path as long as it's still the very same file, and at last through debuginfod.
+    fn find_binary( &self, path: &str, build_id: &[u8], debuglink: &[u8], size: u64, mtime: u64 ) -> Option< Arc< BinaryData > > {
+        let build_id = if build_id.is_empty() { None } else { Some( build_id ) };
+        let debuglink = if debuglink.is_empty() { None } else { Some( debuglink ) };
+        if let Some( binary_data ) = self.debug_info_index.get( get_basename( path ), debuglink, build_id ) {
+            return Some( binary_data );
+        }
+
+        let is_unchanged = std::fs::metadata( path ).ok().map( |metadata| {
+            let current_mtime = metadata.modified().ok()
+                .and_then( |current_mtime| current_mtime.duration_since( std::time::UNIX_EPOCH ).ok() )
+                .map( |current_mtime| current_mtime.as_secs() );
+
+            metadata.len() == size && current_mtime == Some( mtime )
+        }).unwrap_or( false );
+
+        // Without a build ID there's no other way to tell whenever it's the same binary.
+        if build_id.is_some() || is_unchanged {
+            let binary_data = std::fs::read( path ).ok()
+                .and_then( |contents| BinaryData::load_from_owned_bytes( path, contents ).ok() )
+                .filter( |binary_data| build_id.is_none() || binary_data.build_id() == build_id );
+
+            if let Some( binary_data ) = binary_data {
+                return Some( Arc::new( binary_data ) );
+            }
+        }
+
+        let location = crate::debuginfod::fetch_executable( build_id? )?;
+        std::fs::read( location ).ok()
+            .and_then( |contents| BinaryData::load_from_owned_bytes( path, contents ).ok() )
+            .filter( |binary_data| binary_data.build_id() == build_id )
+            .map( Arc::new )
     }
 
     fn scan_for_symbols( &mut self, binary_data: &BinaryData ) {
@@ -633,23 +1467,31 @@ impl Loader {
         });
     }
 
+    fn check_for_shared_ptr( &mut self, id: BacktraceId ) {
+        let (offset, length) = self.backtraces[ id.raw() as usize ];
+        let interner = self.interner.get_mut();
+        let frames = &self.frames;
+        let mut iter = self.backtraces_storage[ offset as usize..(offset + length) as usize ].iter().rev().flat_map( |&id| frames[ id ].raw_function().and_then( |id| interner.resolve( id ) ) );
+        if let Some( name ) = iter.next() {
+            if name == "_ZNSt16_Sp_counted_baseILN9__gnu_cxx12_Lock_policyE2EEC4Ev" {
+                self.shared_ptr_backtraces.insert( id );
+            }
+        }
+    }
+
     fn handle_backtrace( &mut self, id: BacktraceId, potentially_call_to_new: bool ) {
         let (offset, length) = self.backtraces[ id.raw() as usize ];
         self.maximum_backtrace_depth = cmp::max( self.maximum_backtrace_depth, length as _ );
 
         if potentially_call_to_new {
-            let interner = self.interner.get_mut();
-            let frames = &self.frames;
-            let mut iter = self.backtraces_storage[ offset as usize.. ].iter().rev().flat_map( |&id| frames[ id ].raw_function().and_then( |id| interner.resolve( id ) ) );
-            if let Some( name ) = iter.next() {
-                if name == "_ZNSt16_Sp_counted_baseILN9__gnu_cxx12_Lock_policyE2EEC4Ev" {
-                    self.shared_ptr_backtraces.insert( id );
-                }
+            let frame_ids = &self.backtraces_storage[ offset as usize..(offset + length) as usize ];
+            if frame_ids.iter().any( |&frame_id| frame_id & UNRESOLVED_FRAME != 0 ) {
+                self.unresolved_calls_to_new.push( id );
+            } else {
+                self.check_for_shared_ptr( id );
             }
         }
 
-        self.allocations_by_backtrace.entry( id ).or_insert( Vec::new() );
-
         assert_eq!( self.group_stats.len(), id.raw() as usize );
         self.group_stats.push( Default::default() );
     }
@@ -678,6 +1520,16 @@ impl Loader {
             to_skip -= 1;
         }
 
+        let max_depth = self.load_filter.max_backtrace_depth.unwrap_or( 0 );
+        let addresses = if max_depth > 0 && addresses.len() - to_skip > max_depth {
+            let mut elided = Vec::with_capacity( max_depth );
+            elide_frames( &addresses[ to_skip.. ], max_depth, ELIDED_FRAMES_MARKER, &mut elided );
+            to_skip = 0;
+            Cow::Owned( elided )
+        } else {
+            addresses
+        };
+
         if let Some( target_id ) = self.backtrace_to_id.get( &addresses[ to_skip.. ] ).cloned() {
             self.backtrace_remappings.insert( raw_id, target_id );
             return None;
@@ -693,6 +1545,15 @@ impl Loader {
         let mut interner = self.interner.get_mut();
 
         for (index, &address) in addresses.iter().enumerate() {
+            if is_elided_frames_marker( address ) {
+                let mut frame = Frame::new_unknown( CodePointer::new( ELIDED_FRAMES_MARKER ) );
+                frame.set_function( interner.get_or_intern( ELIDED_FRAMES_NAME ) );
+                let (frame_id, is_new) = intern_frame( frames, frame_to_id, frame );
+                callback( frame_id, is_new );
+                backtrace_storage.push( frame_id );
+                continue;
+            }
+
             let is_bytehound_tail = index == 0 && self.frame_skip_ranges.iter().any( |range| address >= range.start && address <= range.end );
             let address = if address > 0 { address - 1 } else { 0 };
             if let Some( range ) = self.frames_by_address.get( &address ).cloned() {
@@ -701,18 +1562,15 @@ impl Loader {
                     backtrace_storage.push( frame_id );
                     callback( frame_id, false );
                 }
+            } else if self.defer_symbolication {
+                let offset = backtrace_storage.len();
+                backtrace_storage.push( UNRESOLVED_FRAME | self.unresolved_addresses.len() );
+                self.unresolved_addresses.push( (address, is_bytehound_tail) );
+                self.frames_by_address.insert( address, offset..offset + 1 );
             } else {
                 let offset = backtrace_storage.len();
-                address_to_frame( &*self.address_space, &mut interner, address, |frame| {
-                    let (frame_id, is_new) = if let Some( &frame_id ) = frame_to_id.get( &frame ) {
-                        (frame_id, false)
-                    } else {
-                        let frame_id = frames.len();
-                        frame_to_id.insert( frame.clone(), frame_id );
-                        frames.push( frame );
-                        (frame_id, true)
-                    };
-
+                symbolicate( &*self.address_space, self.symbol_cache.as_mut(), &mut interner, address, |frame| {
+                    let (frame_id, is_new) = intern_frame( frames, frame_to_id, frame );
                     callback( frame_id, is_new );
                     backtrace_storage.push( frame_id );
                 });
@@ -738,6 +1596,86 @@ impl Loader {
         Some( id )
     }
 
+    /// Symbolicates all of the addresses whose symbolication was deferred.
+    pub(crate) fn resolve_deferred_frames( &mut self ) {
+        if self.unresolved_addresses.is_empty() {
+            return;
+        }
+
+        let unresolved = mem::take( &mut self.unresolved_addresses );
+        debug!( "Symbolicating {} address(es)...", unresolved.len() );
+
+        // Going through the addresses in order is a lot friendlier to the caches when looking up the debug info.
+        let mut order: Vec< usize > = (0..unresolved.len()).collect();
+        order.sort_unstable_by_key( |&index| unresolved[ index ].0 );
+
+        let addresses: Vec< u64 > = order.iter().map( |&index| unresolved[ index ].0 ).collect();
+
+        let mut resolved: Vec< Vec< FrameId > > = vec![ Vec::new(); unresolved.len() ];
+        {
+            let address_space = &*self.address_space;
+            let interner = self.interner.get_mut();
+            let frames = &mut self.frames;
+            let frame_to_id = &mut self.frame_to_id;
+            let mut on_frame = |nth: usize, frame: Frame| {
+                resolved[ order[ nth ] ].push( intern_frame( frames, frame_to_id, frame ).0 );
+            };
+
+            match self.symbol_cache {
+                Some( ref mut symbol_cache ) => {
+                    let arch = &self.header.arch;
+                    let regions = &self.address_space_maps;
+                    let binaries = &self.symbolication_binaries;
+                    symbol_cache.symbolicate_many( interner, &addresses, |missing| {
+                        symbolicate_in_parallel( address_space, arch, regions, binaries, missing )
+                    }, on_frame );
+                },
+                None => {
+                    for (nth, &address) in addresses.iter().enumerate() {
+                        address_to_frame( address_space, interner, address, |frame| on_frame( nth, frame ) );
+                    }
+                }
+            }
+        }
+
+        for (output, &(_, is_bytehound_tail)) in resolved.iter_mut().zip( unresolved.iter() ) {
+            if is_bytehound_tail && output.len() > 1 {
+                output.drain( ..output.len() - 1 );
+            }
+        }
+
+        // Every unresolved frame can expand into multiple frames, so everything after it has to be moved.
+        let old_storage = mem::take( &mut self.backtraces_storage );
+        let mut storage = Vec::with_capacity( old_storage.len() );
+        let mut new_offsets = Vec::with_capacity( old_storage.len() + 1 );
+        for frame_id in old_storage {
+            new_offsets.push( storage.len() );
+            if frame_id & UNRESOLVED_FRAME != 0 {
+                storage.extend_from_slice( &resolved[ frame_id & !UNRESOLVED_FRAME ] );
+            } else {
+                storage.push( frame_id );
+            }
+        }
+        new_offsets.push( storage.len() );
+        self.backtraces_storage = storage;
+
+        for backtrace in &mut self.backtraces {
+            let (offset, length) = *backtrace;
+            let start = new_offsets[ offset as usize ];
+            let end = new_offsets[ (offset + length) as usize ];
+            *backtrace = (start as _, (end - start) as _);
+            self.maximum_backtrace_depth = cmp::max( self.maximum_backtrace_depth, (end - start) as _ );
+        }
+
+        for range in self.frames_by_address.values_mut() {
+            *range = new_offsets[ range.start ]..new_offsets[ range.end ];
+        }
+
+        for id in mem::take( &mut self.unresolved_calls_to_new ) {
+            self.check_for_shared_ptr( id );
+        }
+    }
+
     pub(crate) fn expand_partial_backtrace(
         previous_backtrace_on_thread: &mut HashMap< u32, Vec< u64 > >,
         thread: u32,
@@ -807,6 +1745,16 @@ impl Loader {
         &self.frames[ id ]
     }
 
+    pub(crate) fn frame_count( &self ) -> usize {
+        self.frames.len()
+    }
+
+    /// Returns the frames of a backtrace; some of them can still be unresolved if the symbolication is deferred.
+    pub(crate) fn get_backtrace_frame_ids( &self, id: BacktraceId ) -> &[FrameId] {
+        let (offset, length) = self.backtraces[ id.raw() as usize ];
+        &self.backtraces_storage[ offset as usize..(offset + length) as usize ]
+    }
+
     pub fn process( &mut self, event: Event ) {
         match event {
             Event::Header( header ) => {
@@ -854,11 +1802,18 @@ impl Loader {
                     deallocation: None,
                     regions: Default::default(), // This will get populated later.
                     usage_history: Default::default(),
+                    sparkline: Default::default(), // This will get populated later.
                     pointer: address,
                     size: requested_length,
                     flags,
                     name: Default::default(), // This will get populated later.
                     peak_rss: 0, // This will get populated later.
+                    peak_huge_pages: 0, // This will get populated later.
+                    huge_page_flags: HugePageFlags::empty(),
+                    purge_count: 0,
+                    purged: 0,
+                    reclaimed: 0,
+                    refaulted: 0,
                 };
 
                 self.maps.push( map );
@@ -870,7 +1825,10 @@ impl Loader {
                     shared_dirty: 0,
                     private_clean: 0,
                     private_dirty: 0,
-                    swap: 0
+                    swap: 0,
+                    anon_huge_pages: 0,
+                    shmem_pmd_mapped: 0,
+                    file_pmd_mapped: 0
                 })]);
             },
             Event::AddRegion { timestamp, map_id, address, length, file_offset, inode, major, minor, flags, name } => {
@@ -902,7 +1860,10 @@ impl Loader {
                             shared_dirty: 0,
                             private_clean: 0,
                             private_dirty: 0,
-                            swap: 0
+                            swap: 0,
+                            anon_huge_pages: 0,
+                            shmem_pmd_mapped: 0,
+                            file_pmd_mapped: 0
                         }));
 
                         map.name = (&*name).into();
@@ -917,7 +1878,14 @@ impl Loader {
                         deallocation: None,
                         regions: Default::default(),
                         usage_history: Default::default(),
+                        sparkline: Default::default(),
                         peak_rss: 0,
+                        peak_huge_pages: 0,
+                        huge_page_flags: HugePageFlags::empty(),
+                        purge_count: 0,
+                        purged: 0,
+                        reclaimed: 0,
+                        refaulted: 0,
                         pointer: address,
                         size: length,
                         flags,
@@ -948,12 +1916,16 @@ impl Loader {
                     shared_dirty: 0,
                     private_clean: 0,
                     private_dirty: 0,
-                    swap: 0
+                    swap: 0,
+                    anon_huge_pages: 0,
+                    shmem_pmd_mapped: 0,
+                    file_pmd_mapped: 0
                 };
 
                 trace!( "Add region: id = {} ({}), address = 0x{:016X}, length = {}, source = {}", self.map_index_map.get( &map_id ).unwrap().raw(), map_id, address, length, map.source.is_some() );
 
                 self.last_usage_for_region.insert( (map.id, map.regions.len()), usage );
+                self.live_map_regions.insert( address..address + length, map.id );
                 map.regions.push( region );
                 delta_list.push( (timestamp, UsageDelta {
                     address_space: length as i64,
@@ -962,7 +1934,10 @@ impl Loader {
                     shared_dirty: 0,
                     private_clean: 0,
                     private_dirty: 0,
-                    swap: 0
+                    swap: 0,
+                    anon_huge_pages: 0,
+                    shmem_pmd_mapped: 0,
+                    file_pmd_mapped: 0
                 }));
             },
             Event::RemoveRegion { timestamp, map_id, address, length, sources } => {
@@ -1010,6 +1985,7 @@ impl Loader {
                     sources
                 });
 
+                self.live_map_regions.remove( address..address + length );
                 let last_usage = self.last_usage_for_region.remove( &(map.id, region_index) ).unwrap();
                 let delta_list = self.delta_list_for_map.get_mut( &map.id ).unwrap();
                 delta_list.push( (timestamp, UsageDelta {
@@ -1019,58 +1995,63 @@ impl Loader {
                     shared_dirty: -(last_usage.shared_dirty as i64),
                     private_clean: -(last_usage.private_clean as i64),
                     private_dirty: -(last_usage.private_dirty as i64),
-                    swap: -(last_usage.swap as i64)
+                    swap: -(last_usage.swap as i64),
+                    anon_huge_pages: -(last_usage.anon_huge_pages as i64),
+                    shmem_pmd_mapped: -(last_usage.shmem_pmd_mapped as i64),
+                    file_pmd_mapped: -(last_usage.file_pmd_mapped as i64)
                 }));
             },
             Event::UpdateRegionUsage { timestamp, map_id, address, length, anonymous, shared_clean, shared_dirty, private_clean, private_dirty, swap } => {
+                self.handle_region_usage( timestamp, map_id, address, length, MapUsage {
+                    timestamp,
+                    address_space: 0,
+                    anonymous,
+                    shared_clean,
+                    shared_dirty,
+                    private_clean,
+                    private_dirty,
+                    swap,
+                    anon_huge_pages: 0,
+                    shmem_pmd_mapped: 0,
+                    file_pmd_mapped: 0
+                }, HugePageFlags::empty() );
+            },
+            Event::UpdateRegionUsageEx {
+                timestamp, map_id, address, length,
+                anonymous, shared_clean, shared_dirty, private_clean, private_dirty, swap,
+                anon_huge_pages, shmem_pmd_mapped, file_pmd_mapped, huge_page_flags
+            } => {
+                self.handle_region_usage( timestamp, map_id, address, length, MapUsage {
+                    timestamp,
+                    address_space: 0,
+                    anonymous,
+                    shared_clean,
+                    shared_dirty,
+                    private_clean,
+                    private_dirty,
+                    swap,
+                    anon_huge_pages,
+                    shmem_pmd_mapped,
+                    file_pmd_mapped
+                }, huge_page_flags );
+            },
+            Event::MemoryAdvice { timestamp, address, length, advice, backtrace, thread } => {
                 let timestamp = self.shift_timestamp( timestamp );
-                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
-
-                let id = match self.map_index_map.get( &map_id ) {
-                    Some( smap ) => *smap,
-                    None => {
-                        warn!( "Update for map which was not found: id = {}, address = 0x{:016X}", map_id, address );
-                        return;
-                    }
-                };
-
-                let map = &mut self.maps[ id.0 as usize ];
-                let (region_index, region) = match map.regions.iter_mut().enumerate().rev().find( |(_, region)| region.pointer == address ) {
-                    Some( region_index ) => region_index,
-                    None => {
-                        warn!( "Update for a map for region which was not found: id = {}, address = 0x{:016X}", map_id, address );
-                        return
-                    }
+                let backtrace = self.lookup_backtrace( backtrace ).unwrap();
+                let advice = MemoryAdvice {
+                    timestamp,
+                    backtrace,
+                    thread,
+                    address,
+                    length,
+                    advice
                 };
 
-                if region.size != length {
-                    warn!( "Length doesn't match for region at 0x{:016X} for region update", address );
-                    return;
+                if advice.is_purge() {
+                    self.handle_purge( address..address.saturating_add( length ) );
                 }
 
-                let usage = MapUsage {
-                    timestamp,
-                    address_space: region.size,
-                    anonymous: anonymous * 1024,
-                    shared_clean: shared_clean * 1024,
-                    shared_dirty: shared_dirty * 1024,
-                    private_clean: private_clean * 1024,
-                    private_dirty: private_dirty * 1024,
-                    swap: swap * 1024,
-                };
-
-                let last_usage = self.last_usage_for_region.get_mut( &(map.id, region_index) ).unwrap();
-                let delta_list = self.delta_list_for_map.get_mut( &map.id ).unwrap();
-                delta_list.push( (timestamp, UsageDelta {
-                    address_space: 0,
-                    anonymous: usage.anonymous as i64 - last_usage.anonymous as i64,
-                    shared_clean: usage.shared_clean as i64 - last_usage.shared_clean as i64,
-                    shared_dirty: usage.shared_dirty as i64 - last_usage.shared_dirty as i64,
-                    private_clean: usage.private_clean as i64 - last_usage.private_clean as i64,
-                    private_dirty: usage.private_dirty as i64 - last_usage.private_dirty as i64,
-                    swap: usage.swap as i64 - last_usage.swap as i64
-                }));
-                *last_usage = usage;
+                self.memory_advices.push( advice );
             },
             Event::File { ref path, ref contents, .. } | Event::File64 { ref path, ref contents, .. } => {
                 if !contents.starts_with( b"\x7FELF" ) {
@@ -1078,9 +2059,39 @@ impl Loader {
                 }
 
                 trace!( "File: {}", path );
-                if let Ok( binary_data ) = BinaryData::load_from_owned_bytes( &path, contents.clone().into_owned() ) {
+                let binary_data = crate::embedded_binaries::load( &path, &contents ).or_else( |error| {
+                    warn!( "Failed to map binary '{}' out of memory: {}", path, error );
+                    BinaryData::load_from_owned_bytes( &path, contents.clone().into_owned() ).map( Arc::new )
+                });
+
+                if let Ok( binary_data ) = binary_data {
                     self.scan_for_symbols( &binary_data );
-                    self.binaries.insert( path.deref().to_owned(), Arc::new( binary_data ) );
+                    self.binaries.insert( path.deref().to_owned(), binary_data );
+                }
+            },
+            Event::BinaryReference { ref path, ref build_id, ref location, .. } => {
+                trace!( "Binary reference: {} -> {}", path, location );
+                let binary_data = std::fs::read( location.deref() ).ok()
+                    .and_then( |contents| BinaryData::load_from_owned_bytes( &path, contents ).ok() )
+                    .filter( |binary_data| binary_data.build_id() == Some( build_id.deref() ) )
+                    .map( Arc::new )
+                    .or_else( || self.debug_info_index.get( &get_basename( &path ), None, Some( build_id.deref() ) ) );
+
+                if let Some( binary_data ) = binary_data {
+                    self.scan_for_symbols( &binary_data );
+                    self.binaries.insert( path.deref().to_owned(), binary_data );
+                } else {
+                    warn!( "Failed to load binary '{}' from the binary store: {}", path, location );
+                }
+            },
+            Event::BinaryIdentity { ref path, ref build_id, ref debuglink, size, mtime, .. } => {
+                trace!( "Binary identity: {}", path );
+                match self.find_binary( path, build_id, debuglink, size, mtime ) {
+                    Some( binary_data ) => {
+                        self.scan_for_symbols( &binary_data );
+                        self.binaries.insert( path.deref().to_owned(), binary_data );
+                    },
+                    None => warn!( "Failed to find binary '{}'; it won't be symbolicated", path )
                 }
             },
             event @ Event::PartialBacktrace { .. } |
@@ -1131,12 +2142,12 @@ impl Loader {
             Event::Alloc { timestamp, allocation: AllocBody { pointer, size, backtrace, thread, flags, extra_usable_space, preceding_free_space: _ } } => {
                 let timestamp = self.shift_timestamp( timestamp );
                 let backtrace = self.lookup_backtrace( backtrace ).unwrap();
-                self.handle_alloc( event::AllocationId::UNTRACKED, timestamp, pointer, size, backtrace, thread, flags, extra_usable_space );
+                self.handle_alloc( into_key( event::AllocationId::UNTRACKED, pointer ), timestamp, pointer, size, backtrace, thread, flags, extra_usable_space );
             },
             Event::AllocEx { id, timestamp, allocation: AllocBody { pointer, size, backtrace, thread, flags, extra_usable_space, preceding_free_space: _ } } => {
                 let timestamp = self.shift_timestamp( timestamp );
                 let backtrace = self.lookup_backtrace( backtrace ).unwrap();
-                self.handle_alloc( id, timestamp, pointer, size, backtrace, thread, flags, extra_usable_space );
+                self.handle_alloc( into_key( id, pointer ), timestamp, pointer, size, backtrace, thread, flags, extra_usable_space );
             },
             Event::Realloc { timestamp, old_pointer, allocation: AllocBody { pointer, size, backtrace, thread, flags, extra_usable_space, preceding_free_space: _ } } => {
                 let timestamp = self.shift_timestamp( timestamp );
@@ -1151,12 +2162,12 @@ impl Loader {
             Event::Free { timestamp, pointer, backtrace, thread } => {
                 let timestamp = self.shift_timestamp( timestamp );
                 let backtrace = self.lookup_backtrace( backtrace );
-                self.handle_free( event::AllocationId::UNTRACKED, timestamp, pointer, backtrace, thread );
+                self.handle_free( into_key( event::AllocationId::UNTRACKED, pointer ), timestamp, pointer, backtrace, thread );
             },
             Event::FreeEx { id, timestamp, pointer, backtrace, thread } => {
                 let timestamp = self.shift_timestamp( timestamp );
                 let backtrace = self.lookup_backtrace( backtrace );
-                self.handle_free( id, timestamp, pointer, backtrace, thread );
+                self.handle_free( into_key( id, pointer ), timestamp, pointer, backtrace, thread );
             },
             Event::MemoryMap { .. } => {
                 // Not used anymore.
@@ -1186,31 +2197,109 @@ impl Loader {
             Event::Marker { value } => {
                 self.marker = value;
             },
-            Event::MemoryDump { address, length, data } => {
-                if true {
-                    // TODO
-                    return;
+            Event::SamplingInterval { interval } => {
+                self.sampling_interval = interval;
+            },
+            Event::ParentData { id } => {
+                self.parent_id = Some( id );
+            },
+            Event::OptionChanged { timestamp, option, value } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                self.option_changes.push( OptionChange { timestamp, option, value } );
+            },
+            Event::ThreadTag { timestamp, thread, tag } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.thread_tag_changes.entry( thread ).or_default().push( (timestamp, tag) );
+            },
+            Event::ThreadStarted { timestamp, thread, name } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                let name = if name.is_empty() { None } else { Some( self.interner.get_mut().get_or_intern( name ) ) };
+                let entry = self.threads.entry( thread ).or_insert_with( || Thread::new( thread ) );
+                // The flight recorder repeats these at the start of every segment.
+                entry.started_at = Some( entry.started_at.map( |started_at| cmp::min( started_at, timestamp ) ).unwrap_or( timestamp ) );
+                entry.name = name.or( entry.name );
+                if entry.exited_at.map( |exited_at| exited_at <= timestamp ).unwrap_or( false ) {
+                    // The ID was reused.
+                    entry.exited_at = None;
                 }
-
-                if self.allocation_range_map_dirty {
-                    let mut allocations: Vec< (Range< u64 >, AllocationId) > = Vec::with_capacity( self.allocations.len() );
-                    for (allocation_id, allocation) in self.allocations.iter().enumerate() {
-                        let allocation_id = AllocationId::new( allocation_id as _ );
-                        if allocation.was_deallocated() {
-                            continue;
-                        }
-
-                        allocations.push( (allocation.pointer..allocation.pointer + allocation.size, allocation_id) );
+            },
+            Event::ThreadRenamed { thread, name, .. } => {
+                let name = self.interner.get_mut().get_or_intern( name );
+                self.threads.entry( thread ).or_insert_with( || Thread::new( thread ) ).name = Some( name );
+            },
+            Event::ThreadExited { timestamp, thread } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                self.threads.entry( thread ).or_insert_with( || Thread::new( thread ) ).exited_at = Some( timestamp );
+            },
+            Event::ChildData { .. } => {
+                // These are loaded separately through `Loader::load_child_processes_from_file`.
+            },
+            Event::PoolCreated { pool, name, flags, .. } => {
+                let name = self.interner.get_mut().get_or_intern( name );
+                match self.pools.iter_mut().find( |existing| existing.id == pool ) {
+                    // The flight recorder repeats these at the start of every segment.
+                    Some( existing ) => {
+                        existing.name = name;
+                        existing.flags = flags;
+                    },
+                    None => self.pools.push( Pool { id: pool, name, flags } )
+                }
+            },
+            Event::PoolAlloc { timestamp, pool, thread, backtrace, flags, allocations } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                let backtrace = self.lookup_backtrace( backtrace ).unwrap();
+                for allocation in allocations.iter() {
+                    let key = pool_key( pool, allocation.pointer );
+                    if let Some( allocation_id ) = self.handle_alloc( key, timestamp, allocation.pointer, allocation.size, backtrace, thread, flags, 0 ) {
+                        self.allocations[ allocation_id.raw() as usize ].pool = Some( pool );
+                        self.live_pool_allocations.entry( pool ).or_default().insert( allocation.pointer );
                     }
-
-                    let count = allocations.len();
-                    self.allocation_range_map = RangeMap::from_vec( allocations );
-                    self.allocation_range_map_dirty = false;
-                    assert_eq!( count, self.allocation_range_map.len() );
                 }
+            },
+            Event::PoolFree { timestamp, pool, thread, pointers } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                for &pointer in pointers.iter() {
+                    if let Some( live ) = self.live_pool_allocations.get_mut( &pool ) {
+                        live.remove( &pointer );
+                    }
 
+                    self.handle_free( pool_key( pool, pointer ), timestamp, pointer, None, thread );
+                }
+            },
+            Event::PoolReset { timestamp, pool, thread } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                let mut pointers: Vec< _ > = self.live_pool_allocations.remove( &pool ).unwrap_or_default().into_iter().collect();
+                pointers.sort_unstable();
+                for pointer in pointers {
+                    self.handle_free( pool_key( pool, pointer ), timestamp, pointer, None, thread );
+                }
+            },
+            // These are already expanded by the reader.
+            Event::ThreadContext { .. } |
+            Event::AllocCompact { .. } |
+            Event::ReallocCompact { .. } |
+            Event::ResizeCompact { .. } |
+            Event::FreeCompact { .. } => {},
+            Event::MemoryDumpStarted { timestamp } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                self.start_memory_dump( timestamp );
+            },
+            Event::MemoryDump { address, length, data } => {
                 let length = length as usize;
                 assert_eq!( data.len(), length );
+                if self.memory_dumps.is_empty() {
+                    // Older profilers didn't mark the start of a dump.
+                    self.start_memory_dump( self.last_timestamp );
+                }
+
+                if let Some( ref mut content_hasher ) = self.content_hasher {
+                    content_hasher.feed( address, &data );
+                }
+
                 match (self.header.pointer_size, self.is_little_endian) {
                     (4, false) => self.scan::< u32, BigEndian >( address, &data ),
                     (4, true)  => self.scan::< u32, LittleEndian >( address, &data ),
@@ -1232,77 +2321,228 @@ impl Loader {
                 group_stats.alloc_size += free_size;
                 group_stats.free_count += free_count;
                 group_stats.free_size += free_size;
+                self.culled_allocations.push( CulledAllocations {
+                    backtrace,
+                    first_allocation,
+                    last_allocation,
+                    count: free_count,
+                    size: free_size,
+                    lifetimes: Vec::new()
+                });
+            },
+            Event::CulledAllocations { timestamp, entries } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                for entry in entries.iter() {
+                    let first_allocation = self.shift_timestamp( entry.first_allocation );
+                    let last_allocation = self.shift_timestamp( entry.last_allocation );
+                    let backtrace = self.lookup_backtrace( entry.backtrace ).unwrap();
+                    let group_stats = &mut self.group_stats[ backtrace.raw() as usize ];
+                    group_stats.first_allocation = cmp::min( group_stats.first_allocation, first_allocation );
+                    group_stats.last_allocation = cmp::max( group_stats.last_allocation, last_allocation );
+                    group_stats.min_size = cmp::min( group_stats.min_size, entry.min_size );
+                    group_stats.max_size = cmp::max( group_stats.max_size, entry.max_size );
+                    group_stats.alloc_count += entry.count;
+                    group_stats.alloc_size += entry.size;
+                    group_stats.free_count += entry.count;
+                    group_stats.free_size += entry.size;
+                    self.culled_allocations.push( CulledAllocations {
+                        backtrace,
+                        first_allocation,
+                        last_allocation,
+                        count: entry.count,
+                        size: entry.size,
+                        lifetimes: entry.lifetimes.clone()
+                    });
+                }
+            },
+            Event::PageFaults { timestamp, period, entries } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                self.page_fault_period = period;
+                for entry in entries.iter() {
+                    let map = self.live_map_regions.get_value( entry.address ).copied();
+                    let timestamp = self.shift_timestamp( entry.timestamp );
+                    self.page_faults.push( PageFault {
+                        timestamp,
+                        thread: entry.thread,
+                        address: entry.address,
+                        allocation: None,
+                        map
+                    });
+                }
+            },
+            Event::AllocatorLatencies { timestamp, entries } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                for entry in entries.iter() {
+                    let backtrace = self.lookup_backtrace( entry.backtrace ).unwrap();
+                    let latencies = self.allocator_latencies.entry( (backtrace, entry.call) ).or_insert_with( || AllocatorLatencies {
+                        backtrace,
+                        call: entry.call,
+                        count: 0,
+                        total: 0,
+                        max: 0,
+                        buckets: Vec::new()
+                    });
+
+                    latencies.count += entry.count;
+                    latencies.total += entry.total;
+                    latencies.max = cmp::max( latencies.max, entry.max );
+                    if latencies.buckets.len() < entry.buckets.len() {
+                        latencies.buckets.resize( entry.buckets.len(), 0 );
+                    }
+
+                    for (total, &count) in latencies.buckets.iter_mut().zip( entry.buckets.iter() ) {
+                        *total += count;
+                    }
+                }
+            },
+            Event::BacktraceSummaries { timestamp, .. } => {
+                // There are no individual allocations in the summary mode, so there's nothing else to load.
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+            },
+            Event::ResidencySamples { timestamp, idle_tracking, entries } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                for entry in entries.iter() {
+                    let backtrace = self.lookup_backtrace( entry.backtrace ).unwrap();
+                    self.residency_samples.push( ResidencySample {
+                        timestamp,
+                        backtrace,
+                        idle_tracking,
+                        allocation_count: entry.allocation_count,
+                        allocated_size: entry.allocated_size,
+                        pages: entry.pages,
+                        resident_pages: entry.resident_pages,
+                        swapped_pages: entry.swapped_pages,
+                        idle_pages: entry.idle_pages
+                    });
+                }
+            },
+            Event::JemallocStats { timestamp, page_size, allocated, active, metadata, resident, mapped, retained, arenas, bins } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                self.jemalloc_snapshots.push( JemallocSnapshot {
+                    timestamp,
+                    page_size,
+                    allocated,
+                    active,
+                    metadata,
+                    resident,
+                    mapped,
+                    retained,
+                    arenas: arenas.into_owned(),
+                    bins: bins.into_owned()
+                });
+            },
+            Event::CgroupMemory { timestamp, current, limit, anon, file, kernel, sock, pressure_some, pressure_full } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                self.cgroup_samples.push( CgroupSample { timestamp, current, limit, anon, file, kernel, sock, pressure_some, pressure_full } );
+            },
+            Event::NumaPlacements { timestamp, entries } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
+                for entry in entries.iter() {
+                    let allocation_id = match self.allocation_map.get( into_key( entry.id, entry.pointer ) ) {
+                        Some( allocation_id ) => allocation_id,
+                        None => continue
+                    };
+
+                    let allocation = &mut self.allocations[ allocation_id.raw() as usize ];
+                    if allocation.pointer == entry.pointer {
+                        allocation.memory_numa_node = numa_node_to_u8( entry.node );
+                    }
+                }
+            },
+            Event::ProfilerStatistics { bytes_written, histograms, .. } => {
+                // These are cumulative, so the last one has everything.
+                self.profiler_bytes_written = bytes_written;
+                self.profiler_histograms = histograms.into_owned();
+            },
+            Event::BacktraceCacheStatistics { levels, .. } => {
+                self.backtrace_cache_statistics = levels.into_owned();
+            },
+            Event::Checkpoint { timestamp, allocations, .. } => {
+                let timestamp = self.shift_timestamp( timestamp );
+                if self.allocations.is_empty() && self.skipped_allocation_count == 0 {
+                    // The trace starts from this checkpoint, e.g. because it was dumped from the flight recorder,
+                    // so whatever's in it was allocated before the trace starts.
+                    let mut allocations = allocations.into_owned();
+                    allocations.sort_by_key( |allocation| allocation.timestamp );
+                    for CheckpointAllocation { id, timestamp, allocation } in allocations {
+                        let AllocBody { pointer, size, backtrace, thread, flags, extra_usable_space, preceding_free_space: _ } = allocation;
+                        let timestamp = self.shift_timestamp( timestamp );
+                        let backtrace = self.lookup_backtrace( backtrace ).unwrap();
+                        self.handle_alloc( into_key( id, pointer ), timestamp, pointer, size, backtrace, thread, flags, extra_usable_space );
+                    }
+                }
+
+                // Otherwise everything in these was already loaded from the events which came before it.
+                self.last_timestamp = std::cmp::max( self.last_timestamp, timestamp );
             }
         }
     }
 
-    pub fn finalize( mut self ) -> Data {
-        std::mem::take( &mut self.last_usage_for_region );
+    /// Tags every allocation with whatever tag its thread had when it was made.
+    ///
+    /// The tags are only looked up by their timestamps since the events for the allocations
+    /// which were buffered by the profiler can be emitted long after their thread's tag was changed.
+    fn assign_thread_tags( &mut self ) {
+        if self.thread_tag_changes.is_empty() {
+            return;
+        }
 
-        let mut chains = HashMap::new();
-        for index in 0..self.allocations.len() {
-            let mut allocation = &self.allocations[ index ];
-            if allocation.reallocation.is_some() || allocation.reallocated_from.is_none() {
-                continue;
-            }
+        for changes in self.thread_tag_changes.values_mut() {
+            changes.sort_by_key( |&(timestamp, _)| timestamp );
+        }
 
-            let last_allocation_id = AllocationId::new( index as _ );
-            let mut first_allocation_id = last_allocation_id;
-            let mut chain_length = 1;
-            while let Some( previous_id ) = allocation.reallocated_from {
-                first_allocation_id = previous_id;
-                allocation = &self.allocations[ previous_id.raw() as usize ];
-                chain_length += 1;
-            }
+        let thread_tag_changes = &self.thread_tag_changes;
+        self.allocations.par_iter_mut().for_each( |allocation| {
+            allocation.thread_tag = thread_tag_at( thread_tag_changes, allocation.thread, allocation.timestamp );
+        });
+    }
 
-            chains.insert( first_allocation_id, AllocationChain {
-                first: first_allocation_id,
-                last: last_allocation_id,
-                length: chain_length
-            });
+    pub fn finalize( mut self ) -> Data {
+        if self.skipped_allocation_count != 0 {
+            info!( "Skipped {} allocation(s) with a total size of {} byte(s) which didn't match the load filter", self.skipped_allocation_count, self.skipped_allocation_size );
+        }
 
-            let mut current = first_allocation_id;
-            for position in 0.. {
-                let alloc = &mut self.allocations[ current.raw() as usize ];
-                alloc.first_allocation_in_chain = Some( first_allocation_id );
-                alloc.position_in_chain = position;
-                if let Some( next_id ) = alloc.reallocation {
-                    current = next_id;
-                } else {
-                    break;
+        std::mem::take( &mut self.last_usage_for_region );
+
+        self.resolve_deferred_frames();
+        self.release_binaries();
+        self.assign_thread_tags();
+        if !self.shared_ptr_backtraces.is_empty() {
+            // Some of these might have only been found after their allocations were already created.
+            for allocation in &mut self.allocations {
+                if self.shared_ptr_backtraces.contains( &allocation.backtrace ) {
+                    allocation.flags |= AllocationFlags::IS_SHARED_PTR;
                 }
             }
         }
 
+        // The chains were already built while loading; they only need to be sorted for the lookups.
+        let mut chains = mem::take( &mut self.chains );
+        chains.par_sort_unstable_by_key( |chain| chain.first );
+
         let initial_timestamp = self.shift_timestamp( self.header.initial_timestamp );
-        let indices: Vec< AllocationId > = (0..self.allocations.len()).into_iter().map( |id| AllocationId::new( id as _ ) ).collect();
 
-        for (raw_backtrace_id, stats) in self.group_stats.iter().enumerate() {
-            let (backtrace_offset, backtrace_len) = self.backtraces[ raw_backtrace_id ];
-            for &frame_id in &self.backtraces_storage[ backtrace_offset as usize..(backtrace_offset + backtrace_len) as usize ] {
-                self.frames[ frame_id ].increment_count( stats.alloc_count );
-            }
-        }
+        count_frames( &mut self.frames, &self.backtraces, &self.backtraces_storage, &self.group_stats );
 
-        fn cmp_by_time( allocations: &[Allocation], a_id: AllocationId, b_id: AllocationId ) -> std::cmp::Ordering {
-            let a_alloc = &allocations[ a_id.raw() as usize ];
-            let b_alloc = &allocations[ b_id.raw() as usize ];
-            a_alloc.timestamp.cmp( &b_alloc.timestamp ).then_with( ||
-                a_id.raw().cmp( &b_id.raw() )
-            )
-        }
+        // The orders by address and by size are only built when something needs them.
+        let allocation_columns = AllocationColumns::new( &self.allocations );
+        let sorted_by_timestamp = sort_ids_by_timestamp( &allocation_columns.timestamps );
 
-        let mut sorted_by_timestamp = indices.clone();
-        let mut sorted_by_address = indices.clone();
-        let mut sorted_by_size = indices;
-        {
-            let allocations = &self.allocations;
-            sorted_by_timestamp.par_sort_by( |&a_id, &b_id| cmp_by_time( allocations, a_id, b_id ) );
-            sorted_by_address.par_sort_by_key( |index| allocations[ index.raw() as usize ].pointer );
-            sorted_by_size.par_sort_by_key( |index| allocations[ index.raw() as usize ].size );
+        self.operations.par_sort_by_key( |(timestamp, _)| *timestamp );
+        if !self.page_faults.is_empty() {
+            self.page_faults.sort_by_key( |page_fault| page_fault.timestamp );
+            resolve_page_faults( &self.allocations, &self.operations, &mut self.page_faults );
+            self.page_faults.shrink_to_fit();
         }
 
-        self.operations.par_sort_by_key( |(timestamp, _)| *timestamp );
         let operations: Vec< _ > = self.operations.into_iter().map( |(_, op)| op ).collect();
 
         let mut current_total_usage_by_backtrace = Vec::new();
@@ -1337,26 +2577,78 @@ impl Loader {
         self.backtraces.shrink_to_fit();
         self.backtraces_storage.shrink_to_fit();
         self.mallopts.shrink_to_fit();
+        self.memory_advices.shrink_to_fit();
+        self.residency_samples.shrink_to_fit();
+        self.culled_allocations.sort_by_key( |culled| culled.first_allocation );
+        self.culled_allocations.shrink_to_fit();
+        self.jemalloc_snapshots.shrink_to_fit();
+        self.cgroup_samples.shrink_to_fit();
+        self.finish_memory_dump();
+        for dump in &mut self.memory_dumps {
+            dump.addresses.shrink_to_fit();
+            dump.values.shrink_to_fit();
+        }
+        self.option_changes.sort_by_key( |change| change.timestamp );
+        self.option_changes.shrink_to_fit();
+        self.pools.sort_by_key( |pool| pool.id );
+
+        let allocating_threads = self.allocations.par_iter()
+            .fold( HashSet::new, |mut threads, allocation| { threads.insert( allocation.thread ); threads } )
+            .reduce( HashSet::new, |mut lhs, rhs| { lhs.extend( rhs ); lhs } );
+
+        for thread in allocating_threads {
+            self.threads.entry( thread ).or_insert_with( || Thread::new( thread ) );
+        }
+
+        let mut threads: Vec< _ > = std::mem::take( &mut self.threads ).into_iter().map( |(_, thread)| thread ).collect();
+        threads.sort_unstable_by_key( |thread| thread.id );
+
         self.group_stats.shrink_to_fit();
         self.maps.shrink_to_fit();
 
-        for (index, (_, timestamp)) in current_total_max_size_by_backtrace.into_iter().enumerate() {
+        for (index, (size, timestamp)) in current_total_max_size_by_backtrace.into_iter().enumerate() {
             self.group_stats[ index ].max_total_usage_first_seen_at = timestamp;
+            self.group_stats[ index ].max_total_usage = size as u64;
         }
 
-        let mut allocations_by_backtrace = DenseVecVec::new();
-        let mut index: Vec< _ > = self.allocations_by_backtrace.into_iter().collect();
-        index.sort_by_key( |&(k, _)| k );
+        // The allocations are grouped in the order of their timestamps, so every group ends up sorted by time.
+        let backtraces = &allocation_columns.backtraces;
+        let (groups, storage) = group_by_dense_key( &sorted_by_timestamp, self.backtraces.len(), |id| backtraces[ id.raw() as usize ].raw() as usize );
+        let mut index = vec![ (0, 0); self.backtraces.len() ];
+        for (backtrace, offset, length) in groups {
+            index[ backtrace ] = (offset, length);
+        }
 
         let allocations = &self.allocations;
-        for (backtrace_id, mut allocation_ids) in index {
-            debug_assert!( allocation_ids.is_empty() || allocations[ allocation_ids[ 0 ].raw() as usize ].backtrace == backtrace_id );
-            allocation_ids.sort_by( |&a_id, &b_id| cmp_by_time( allocations, a_id, b_id ) );
-            let index = allocations_by_backtrace.push( allocation_ids );
-            assert_eq!( index, backtrace_id.raw() as usize );
-        }
+        self.group_stats.par_iter_mut().zip( index.par_iter() ).for_each( |(stats, &(offset, length))| {
+            let mut sketch = LifetimeSketch::new();
+            let mut lifetimes: Vec< _ > = storage[ offset as usize..(offset + length) as usize ].iter().filter_map( |&id| {
+                let allocation = &allocations[ id.raw() as usize ];
+                let lifetime = allocation.deallocation.as_ref().map( |deallocation| deallocation.timestamp - allocation.timestamp )?;
+                sketch.add( lifetime, allocation.sample_count() );
+                Some( lifetime )
+            }).collect();
+
+            if !lifetimes.is_empty() {
+                stats.lifetimes = sketch;
+                let p50 = lifetimes.len() / 2;
+                let p90 = lifetimes.len() * 9 / 10;
+                stats.lifetime_p90 = *lifetimes.select_nth_unstable( p90 ).1;
+                stats.lifetime_p50 = *lifetimes[ ..=p90 ].select_nth_unstable( p50 ).1;
+            }
+        });
+
+        let allocations_by_backtrace = DenseVecVec::from_raw_parts( index, storage.into() );
 
-        allocations_by_backtrace.shrink_to_fit();
+        // Only the histograms of the culled allocations are known, so just put every bucket's worth of them in its middle.
+        for culled in &self.culled_allocations {
+            let stats = &mut self.group_stats[ culled.backtrace.raw() as usize ];
+            for (index, &count) in culled.lifetimes.iter().enumerate() {
+                let (min, max) = CulledAllocations::lifetime_bucket_range( index );
+                let lifetime = if index == 0 { 0 } else { ((min as f64) * (max as f64)).sqrt().round() as u64 };
+                stats.lifetimes.add( Timestamp::from_usecs( lifetime ), count );
+            }
+        }
 
         let delta_list_for_map = self.delta_list_for_map;
 
@@ -1399,9 +2691,13 @@ impl Loader {
                 private_clean: 0,
                 private_dirty: 0,
                 swap: 0,
+                anon_huge_pages: 0,
+                shmem_pmd_mapped: 0,
+                file_pmd_mapped: 0,
             };
 
             let mut peak_rss = 0;
+            let mut peak_huge_pages = 0;
             let mut usage_history = Vec::with_capacity( new_delta_list.len() );
             for (timestamp, delta) in new_delta_list.into_iter() {
                 let usage = MapUsage {
@@ -1413,47 +2709,84 @@ impl Loader {
                     private_clean: (last_usage.private_clean as i64 + delta.private_clean) as u64,
                     private_dirty: (last_usage.private_dirty as i64 + delta.private_dirty) as u64,
                     swap: (last_usage.swap as i64 + delta.swap) as u64,
+                    anon_huge_pages: (last_usage.anon_huge_pages as i64 + delta.anon_huge_pages) as u64,
+                    shmem_pmd_mapped: (last_usage.shmem_pmd_mapped as i64 + delta.shmem_pmd_mapped) as u64,
+                    file_pmd_mapped: (last_usage.file_pmd_mapped as i64 + delta.file_pmd_mapped) as u64,
                 };
 
                 peak_rss = std::cmp::max( peak_rss, usage.rss() );
+                peak_huge_pages = std::cmp::max( peak_huge_pages, usage.huge_pages() );
                 last_usage = usage.clone();
                 usage_history.push( usage );
             }
 
             map.usage_history = usage_history;
             map.peak_rss = peak_rss;
+            map.peak_huge_pages = peak_huge_pages;
         });
 
+        let mut allocator_latencies: Vec< _ > = self.allocator_latencies.drain().map( |(_, latencies)| latencies ).collect();
+        allocator_latencies.sort_unstable_by_key( |latencies| (latencies.backtrace, latencies.call as u32) );
+
         let last_timestamp = self.group_stats.iter().map( |stats| stats.last_allocation ).max().unwrap_or( initial_timestamp );
         let last_timestamp = std::cmp::max( self.last_timestamp, last_timestamp );
+        build_map_sparklines( &mut self.maps, initial_timestamp, last_timestamp );
+
         Data {
             id: self.id,
+            parent_id: self.parent_id,
             initial_timestamp,
             last_timestamp,
             executable: String::from_utf8_lossy( &self.header.executable ).into_owned(),
             cmdline: String::from_utf8_lossy( &self.header.cmdline ).into_owned(),
             architecture: self.header.arch,
             pointer_size: self.header.pointer_size as _,
-            interner: self.interner.into_inner(),
+            interner: {
+                let mut interner = self.interner.into_inner();
+                interner.shrink_to_fit();
+                interner
+            },
+            allocation_columns,
             allocations: self.allocations,
-            sorted_by_timestamp,
-            sorted_by_address,
-            sorted_by_size,
-            operations,
+            sorted_by_timestamp: sorted_by_timestamp.into(),
+            sorted_by_address: Default::default(),
+            sorted_by_size: Default::default(),
+            operations: operations.into(),
             frames: self.frames,
             backtraces: self.backtraces,
-            backtraces_storage: self.backtraces_storage,
+            backtraces_storage: self.backtraces_storage.into(),
             allocations_by_backtrace,
+            backtraces_by_frame: Default::default(),
+            backtrace_trie: Default::default(),
+            live_index: Default::default(),
             total_allocated: self.total_allocated,
             total_allocated_count: self.total_allocated_count,
             total_freed: self.total_freed,
             total_freed_count: self.total_freed_count,
             mallopts: self.mallopts,
+            memory_advices: self.memory_advices,
+            residency_samples: self.residency_samples,
+            culled_allocations: self.culled_allocations,
+            allocator_latencies,
+            page_faults: self.page_faults,
+            page_fault_period: self.page_fault_period,
+            jemalloc_snapshots: self.jemalloc_snapshots,
+            cgroup_samples: self.cgroup_samples,
+            memory_dumps: self.memory_dumps,
+            option_changes: self.option_changes,
+            pools: self.pools,
+            threads,
             maximum_backtrace_depth: self.maximum_backtrace_depth,
             group_stats: self.group_stats,
+            profiler_bytes_written: self.profiler_bytes_written,
+            profiler_histograms: self.profiler_histograms,
+            backtrace_cache_statistics: self.backtrace_cache_statistics,
             chains,
             map_ids: (0..self.maps.len()).map( |id| MapId( id as u64 ) ).collect(),
             maps: self.maps,
+            selection_cache: Default::default(),
+            address_tiles_cache: Default::default(),
+            call_tree_cache: Default::default(),
         }
     }
 }
@@ -0,0 +1,359 @@
+use std::fs::{self, OpenOptions};
+use std::io;
+use std::mem;
+use std::ops::{Deref, DerefMut};
+use std::os::unix::io::AsRawFd;
+use std::path::PathBuf;
+use std::ptr;
+use std::slice;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use ahash::AHashMap as HashMap;
+
+use crate::data::AllocationId;
+
+const KEY_THREAD_BITS: u32 = 16;
+const KEY_ALLOCATION_BITS: u32 = 64 - KEY_THREAD_BITS;
+const INITIAL_CAPACITY: usize = 1024;
+
+static SPILL_THRESHOLD: AtomicUsize = AtomicUsize::new( 0 );
+
+/// Sets how many bytes the table of the live allocations can take before it's moved into a temporary file.
+///
+/// Passing zero keeps it in memory no matter how big it gets, which is the default.
+pub fn set_live_allocations_spill_threshold( bytes: usize ) {
+    SPILL_THRESHOLD.store( bytes, Ordering::Relaxed );
+}
+
+#[derive(Copy, Clone, Default)]
+#[repr(C)]
+struct Entry {
+    key: u64,
+    /// The raw `AllocationId` plus one; zero for empty slots.
+    value: u64
+}
+
+fn temporary_path() -> PathBuf {
+    static COUNTER: AtomicUsize = AtomicUsize::new( 0 );
+    let nth = COUNTER.fetch_add( 1, Ordering::Relaxed );
+    std::env::temp_dir().join( format!( "bytehound-live-allocations-{}-{}", std::process::id(), nth ) )
+}
+
+/// Entries in a shared mapping of a temporary file, so that the kernel can write them
+/// back to the disk and drop them from memory instead of having to keep them around.
+struct SpilledEntries {
+    pointer: *mut Entry,
+    length: usize
+}
+
+unsafe impl Send for SpilledEntries {}
+unsafe impl Sync for SpilledEntries {}
+
+impl SpilledEntries {
+    fn new( length: usize ) -> io::Result< Self > {
+        let path = temporary_path();
+        let fp = OpenOptions::new().read( true ).write( true ).create_new( true ).open( &path )?;
+
+        // Nothing else needs the file by its path, so its space is freed as soon as it's unmapped.
+        let _ = fs::remove_file( &path );
+
+        // The file starts out sparse and full of zeros, which is what the empty entries are.
+        let size = length * mem::size_of::< Entry >();
+        fp.set_len( size as u64 )?;
+
+        let pointer = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                size,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                fp.as_raw_fd(),
+                0
+            )
+        };
+
+        if pointer == libc::MAP_FAILED {
+            return Err( io::Error::last_os_error() );
+        }
+
+        Ok( SpilledEntries {
+            pointer: pointer as *mut Entry,
+            length
+        })
+    }
+}
+
+impl Drop for SpilledEntries {
+    fn drop( &mut self ) {
+        unsafe {
+            libc::munmap( self.pointer as *mut libc::c_void, self.length * mem::size_of::< Entry >() );
+        }
+    }
+}
+
+enum Entries {
+    InMemory( Vec< Entry > ),
+    Spilled( SpilledEntries )
+}
+
+impl Entries {
+    fn new( length: usize, spill_threshold: usize ) -> Self {
+        if spill_threshold != 0 && length * mem::size_of::< Entry >() >= spill_threshold {
+            match SpilledEntries::new( length ) {
+                Ok( entries ) => return Entries::Spilled( entries ),
+                Err( error ) => warn!( "Failed to spill the live allocations to disk: {}", error )
+            }
+        }
+
+        Entries::InMemory( vec![ Entry::default(); length ] )
+    }
+}
+
+impl Deref for Entries {
+    type Target = [Entry];
+    fn deref( &self ) -> &Self::Target {
+        match *self {
+            Entries::InMemory( ref entries ) => entries,
+            Entries::Spilled( ref entries ) => unsafe { slice::from_raw_parts( entries.pointer, entries.length ) }
+        }
+    }
+}
+
+impl DerefMut for Entries {
+    fn deref_mut( &mut self ) -> &mut Self::Target {
+        match *self {
+            Entries::InMemory( ref mut entries ) => entries,
+            Entries::Spilled( ref mut entries ) => unsafe { slice::from_raw_parts_mut( entries.pointer, entries.length ) }
+        }
+    }
+}
+
+/// A hash map from the keys of the live allocations to their IDs.
+///
+/// This is an open addressing table with linear probing and 16 bytes per entry,
+/// which is about half of what a general purpose map takes for the same keys.
+/// Almost every key fits into a single word; the ones which don't go into
+/// a separate, ordinary map.
+///
+/// Once the table grows above the threshold set with `set_live_allocations_spill_threshold`
+/// it's moved into a temporary file, so that it doesn't have to stay in memory.
+pub struct PointerMap {
+    entries: Entries,
+    length: usize,
+    overflow: HashMap< (u64, u64), AllocationId >,
+    spill_threshold: usize
+}
+
+#[inline]
+fn pack_key( (thread, allocation): (u64, u64) ) -> Option< u64 > {
+    if thread >> KEY_THREAD_BITS != 0 || allocation >> KEY_ALLOCATION_BITS != 0 {
+        return None;
+    }
+
+    Some( thread << KEY_ALLOCATION_BITS | allocation )
+}
+
+impl PointerMap {
+    pub fn new() -> Self {
+        PointerMap::with_spill_threshold( SPILL_THRESHOLD.load( Ordering::Relaxed ) )
+    }
+
+    fn with_spill_threshold( spill_threshold: usize ) -> Self {
+        PointerMap {
+            entries: Entries::new( INITIAL_CAPACITY, spill_threshold ),
+            length: 0,
+            overflow: HashMap::new(),
+            spill_threshold
+        }
+    }
+
+    pub fn len( &self ) -> usize {
+        self.length + self.overflow.len()
+    }
+
+    #[inline]
+    fn mask( &self ) -> usize {
+        self.entries.len() - 1
+    }
+
+    #[inline]
+    fn slot_for( &self, key: u64 ) -> usize {
+        // Fibonacci hashing; the high bits are the best mixed, so use those.
+        let hash = key.wrapping_mul( 0x9E37_79B9_7F4A_7C15 );
+        (hash >> (64 - self.entries.len().trailing_zeros())) as usize
+    }
+
+    #[inline]
+    fn find( &self, key: u64 ) -> Result< usize, usize > {
+        let mask = self.mask();
+        let mut slot = self.slot_for( key );
+        loop {
+            let entry = &self.entries[ slot ];
+            if entry.value == 0 {
+                return Err( slot );
+            }
+
+            if entry.key == key {
+                return Ok( slot );
+            }
+
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    pub fn get( &self, key: (u64, u64) ) -> Option< AllocationId > {
+        match pack_key( key ) {
+            Some( key ) => self.find( key ).ok().map( |slot| AllocationId::new( self.entries[ slot ].value - 1 ) ),
+            None => self.overflow.get( &key ).copied()
+        }
+    }
+
+    /// Inserts a new entry, replacing and returning the old one if the `key` was already present.
+    pub fn insert( &mut self, key: (u64, u64), value: AllocationId ) -> Option< AllocationId > {
+        let packed_key = match pack_key( key ) {
+            Some( key ) => key,
+            None => return self.overflow.insert( key, value )
+        };
+
+        match self.find( packed_key ) {
+            Ok( slot ) => {
+                let entry = &mut self.entries[ slot ];
+                let old_value = AllocationId::new( entry.value - 1 );
+                entry.value = value.raw() + 1;
+                Some( old_value )
+            },
+            Err( slot ) => {
+                self.entries[ slot ] = Entry { key: packed_key, value: value.raw() + 1 };
+                self.length += 1;
+                if self.length * 4 > self.entries.len() * 3 {
+                    self.grow();
+                }
+
+                None
+            }
+        }
+    }
+
+    pub fn remove( &mut self, key: (u64, u64) ) -> Option< AllocationId > {
+        let packed_key = match pack_key( key ) {
+            Some( key ) => key,
+            None => return self.overflow.remove( &key )
+        };
+
+        let mut slot = self.find( packed_key ).ok()?;
+        let value = AllocationId::new( self.entries[ slot ].value - 1 );
+        self.length -= 1;
+
+        // Shift the following entries back instead of leaving a tombstone,
+        // so that the lookups never have to go over deleted entries.
+        let mask = self.mask();
+        let mut next = slot;
+        loop {
+            next = (next + 1) & mask;
+            let entry = self.entries[ next ];
+            if entry.value == 0 {
+                break;
+            }
+
+            let home = self.slot_for( entry.key );
+            let distance_from_home = next.wrapping_sub( home ) & mask;
+            let distance_to_hole = next.wrapping_sub( slot ) & mask;
+            if distance_from_home >= distance_to_hole {
+                self.entries[ slot ] = entry;
+                slot = next;
+            }
+        }
+
+        self.entries[ slot ] = Entry::default();
+        Some( value )
+    }
+
+    fn grow( &mut self ) {
+        let capacity = self.entries.len() * 2;
+        let old_entries = mem::replace( &mut self.entries, Entries::new( capacity, self.spill_threshold ) );
+        for &entry in old_entries.iter() {
+            if entry.value != 0 {
+                let slot = self.find( entry.key ).unwrap_err();
+                self.entries[ slot ] = entry;
+            }
+        }
+    }
+}
+
+impl Default for PointerMap {
+    fn default() -> Self {
+        PointerMap::new()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashMap;
+    use super::{Entries, PointerMap};
+    use crate::data::AllocationId;
+
+    quickcheck! {
+        fn pointer_map_works_like_a_hash_map( operations: Vec< (bool, u8, u16) > ) -> bool {
+            let mut map = PointerMap::new();
+            let mut expected = HashMap::new();
+            for (index, (is_insert, thread, allocation)) in operations.into_iter().enumerate() {
+                // Make some of the keys too big to fit into a single word.
+                let thread = if thread == 255 { 1 << 40 } else { thread as u64 };
+                let key = (thread, allocation as u64);
+                if is_insert {
+                    let value = AllocationId::new( index as u64 );
+                    if map.insert( key, value ) != expected.insert( key, value ) {
+                        return false;
+                    }
+                } else if map.remove( key ) != expected.remove( &key ) {
+                    return false;
+                }
+
+                if map.len() != expected.len() {
+                    return false;
+                }
+            }
+
+            expected.iter().all( |(&key, &value)| map.get( key ) == Some( value ) )
+        }
+    }
+
+    #[test]
+    fn test_pointer_map_grows() {
+        let mut map = PointerMap::new();
+        for pointer in 0..100_000 {
+            assert_eq!( map.insert( (0, pointer * 16), AllocationId::new( pointer ) ), None );
+        }
+
+        for pointer in (0..100_000).step_by( 2 ) {
+            assert_eq!( map.remove( (0, pointer * 16) ), Some( AllocationId::new( pointer ) ) );
+        }
+
+        assert_eq!( map.len(), 50_000 );
+        for pointer in 0..100_000 {
+            let expected = if pointer % 2 == 0 { None } else { Some( AllocationId::new( pointer ) ) };
+            assert_eq!( map.get( (0, pointer * 16) ), expected );
+        }
+    }
+
+    #[test]
+    fn test_pointer_map_spills_to_disk() {
+        let mut map = PointerMap::with_spill_threshold( 64 * 1024 );
+        assert!( matches!( map.entries, Entries::InMemory( .. ) ) );
+
+        for pointer in 0..100_000 {
+            assert_eq!( map.insert( (0, pointer * 16), AllocationId::new( pointer ) ), None );
+        }
+
+        assert!( matches!( map.entries, Entries::Spilled( .. ) ) );
+        for pointer in (0..100_000).step_by( 2 ) {
+            assert_eq!( map.remove( (0, pointer * 16) ), Some( AllocationId::new( pointer ) ) );
+        }
+
+        assert_eq!( map.len(), 50_000 );
+        for pointer in 0..100_000 {
+            let expected = if pointer % 2 == 0 { None } else { Some( AllocationId::new( pointer ) ) };
+            assert_eq!( map.get( (0, pointer * 16) ), expected );
+        }
+    }
+}
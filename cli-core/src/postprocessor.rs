@@ -4,7 +4,6 @@ use std::u64;
 use std::borrow::Cow;
 
 use ahash::AHashSet as HashSet;
-use string_interner::Symbol;
 
 use nwind::{
     DebugInfoIndex
@@ -20,12 +19,16 @@ use common::event::{
     RegionSource,
 };
 
-use common::lz4_stream::{
-    Lz4Writer
-};
-
+use crate::BacktraceId;
 use crate::loader::Loader;
-use crate::reader::parse_events;
+use crate::reader::parse_events_in_background;
+use crate::threaded_lz4_stream::Lz4Writer;
+
+/// How many bytes of events are held back until the backtraces they refer to are symbolicated.
+///
+/// The new addresses are symbolicated in batches, and the more of them there are in a batch
+/// the better the symbol lookups can be ordered; this only bounds how much memory that takes.
+const MAXIMUM_PENDING_SIZE: usize = 32 * 1024 * 1024;
 
 #[derive(Copy, Clone, PartialEq, Eq, Debug)]
 pub enum Anonymize {
@@ -102,14 +105,115 @@ impl FunctionAnonymizer {
     }
 }
 
+/// Keeps the events whose backtraces weren't symbolicated yet, and writes them out once they are.
+struct Emitter< G: Write + Send + 'static > {
+    ofp: Lz4Writer< G >,
+    anonymize: Anonymize,
+    anonymizer_library: PathAnonymizer,
+    anonymizer_source: PathAnonymizer,
+    anonymizer_function: FunctionAnonymizer,
+    emitted_strings: HashSet< crate::StringId >,
+    emitted_frame_count: usize,
+    expected_backtrace_id: u32,
+    pending_backtraces: Vec< BacktraceId >,
+    pending: Vec< u8 >,
+    frames: Vec< u32 >
+}
+
+impl< G: Write + Send + 'static > Emitter< G > {
+    fn intern( &mut self, loader: &mut Loader, id: Option< crate::StringId >, kind: StringKind ) -> io::Result< u32 > {
+        let id = match id {
+            Some( id ) => id,
+            None => return Ok( 0xFFFFFFFF )
+        };
+
+        let raw_id = id.to_usize() as u32;
+        if self.emitted_strings.insert( id ) {
+            let string = loader.interner().resolve( id ).unwrap();
+            let string = match kind {
+                StringKind::Library => self.anonymizer_library.anonymize( self.anonymize, string ),
+                StringKind::Source => self.anonymizer_source.anonymize( self.anonymize, string ),
+                StringKind::Function => self.anonymizer_function.anonymize( self.anonymize, string )
+            };
+
+            Event::String {
+                id: raw_id,
+                string
+            }.write_to_stream( &mut self.ofp )?;
+        }
+
+        Ok( raw_id )
+    }
+
+    /// Symbolicates whatever is left, and writes out the new frames, the new backtraces and then the held back events.
+    fn flush( &mut self, loader: &mut Loader ) -> io::Result< () > {
+        loader.resolve_deferred_frames();
+
+        for frame_id in self.emitted_frame_count..loader.frame_count() {
+            let frame = loader.get_frame( frame_id ).clone();
+            let library = self.intern( loader, frame.library(), StringKind::Library )?;
+            let source = self.intern( loader, frame.source(), StringKind::Source )?;
+
+            let raw_function;
+            let function;
+            if self.anonymize == Anonymize::Full {
+                raw_function = self.intern( loader, frame.raw_function(), StringKind::Function )?;
+                function = 0xFFFFFFFF;
+            } else {
+                raw_function = self.intern( loader, frame.raw_function(), StringKind::Function )?;
+                function = self.intern( loader, frame.function(), StringKind::Function )?;
+            }
+
+            Event::DecodedFrame {
+                address: frame.address().raw(),
+                library,
+                raw_function,
+                function,
+                source,
+                line: frame.line().unwrap_or( 0xFFFFFFFF ),
+                column: frame.column().unwrap_or( 0xFFFFFFFF ),
+                is_inline: frame.is_inline()
+            }.write_to_stream( &mut self.ofp )?;
+        }
+
+        self.emitted_frame_count = loader.frame_count();
+
+        for backtrace_id in std::mem::take( &mut self.pending_backtraces ) {
+            assert_eq!( backtrace_id.raw(), self.expected_backtrace_id );
+            self.expected_backtrace_id += 1;
+
+            self.frames.clear();
+            self.frames.extend( loader.get_backtrace_frame_ids( backtrace_id ).iter().map( |&frame_id| frame_id as u32 ) );
+            Event::DecodedBacktrace {
+                frames: (&self.frames).into()
+            }.write_to_stream( &mut self.ofp )?;
+        }
+
+        self.ofp.write_all( &self.pending )?;
+        self.pending.clear();
+        Ok(())
+    }
+}
+
+#[derive(Copy, Clone)]
+enum StringKind {
+    Library,
+    Source,
+    Function
+}
+
 pub fn postprocess< F, G, D, I  >( ifp: F, ofp: G, debug_symbols: I, anonymize: Anonymize ) -> Result< (), io::Error >
     where F: Read + Send + 'static,
-          G: Write,
+          G: Write + Send + 'static,
           D: AsRef< OsStr >,
           I: IntoIterator< Item = D >
 {
-    let mut ofp = Lz4Writer::new( ofp );
-    let (mut header, event_stream) = parse_events( ifp )?;
+    // The input is decompressed and decoded on other threads, the new addresses are symbolicated
+    // in batches, and the output is compressed on multiple threads, so this thread only has to
+    // rewrite the events.
+    let thread_count = std::thread::available_parallelism().map( |count| count.get() ).unwrap_or( 1 );
+    let ofp = Lz4Writer::with_thread_count( ofp, thread_count );
+    let (mut header, event_stream) = parse_events_in_background( ifp )?;
 
     let mut debug_info_index = DebugInfoIndex::new();
     for path in debug_symbols {
@@ -117,18 +221,25 @@ pub fn postprocess< F, G, D, I  >( ifp: F, ofp: G, debug_symbols: I, anonymize:
     }
 
     let mut loader = Loader::new( header.clone(), debug_info_index );
-    anonymize_header( anonymize, &mut header );
-    Event::Header( header ).write_to_stream( &mut ofp )?;
+    loader.set_defer_symbolication( true );
+
+    let mut emitter = Emitter {
+        ofp,
+        anonymize,
+        anonymizer_library: PathAnonymizer::new( "lib_" ),
+        anonymizer_source: PathAnonymizer::new( "src_" ),
+        anonymizer_function: FunctionAnonymizer::default(),
+        emitted_strings: HashSet::new(),
+        emitted_frame_count: 0,
+        expected_backtrace_id: 0,
+        pending_backtraces: Vec::new(),
+        pending: Vec::new(),
+        frames: Vec::new()
+    };
 
-    let mut anonymizer_library = PathAnonymizer::new( "lib_" );
-    let mut anonymizer_source = PathAnonymizer::new( "src_" );
-    let mut anonymizer_function = FunctionAnonymizer::default();
+    anonymize_header( anonymize, &mut header );
+    Event::Header( header ).write_to_stream( &mut emitter.ofp )?;
 
-    let mut frames = Vec::new();
-    let mut frames_to_write = Vec::new();
-    let mut emitted_strings = HashSet::new();
-    let mut expected_backtrace_id = 0;
-    let mut expected_frame_id = 0;
     for event in event_stream {
         let mut event = event?;
         let mut process = false;
@@ -154,6 +265,8 @@ pub fn postprocess< F, G, D, I  >( ifp: F, ofp: G, debug_symbols: I, anonymize:
             Event::MemoryMap { ref mut backtrace, .. } |
             Event::MemoryUnmap { ref mut backtrace, .. } |
             Event::Mallopt { ref mut backtrace, .. } |
+            Event::MemoryAdvice { ref mut backtrace, .. } |
+            Event::PoolAlloc { ref mut backtrace, .. } |
             Event::GroupStatistics { ref mut backtrace, .. } => {
                 if let Some( target_backtrace ) = loader.lookup_backtrace( *backtrace ) {
                     *backtrace = target_backtrace.raw() as _;
@@ -167,6 +280,11 @@ pub fn postprocess< F, G, D, I  >( ifp: F, ofp: G, debug_symbols: I, anonymize:
                 write = false;
             },
 
+            Event::BinaryReference { .. } | Event::BinaryIdentity { .. } => {
+                process = true;
+                write = false;
+            },
+
             Event::File { .. } | Event::File64 { .. } => {
                 process = true;
                 if anonymize != Anonymize::None {
@@ -200,6 +318,72 @@ pub fn postprocess< F, G, D, I  >( ifp: F, ofp: G, debug_symbols: I, anonymize:
                 *sources = sources_owned.into();
             },
             Event::UpdateRegionUsage { .. } => {},
+            Event::UpdateRegionUsageEx { .. } => {},
+            Event::BacktraceSummaries { ref mut entries, .. } => {
+                let mut entries_owned = std::mem::take( entries ).into_owned();
+                for entry in entries_owned.iter_mut() {
+                    if let Some( target_backtrace ) = loader.lookup_backtrace( entry.backtrace ) {
+                        entry.backtrace = target_backtrace.raw() as _;
+                    } else {
+                        entry.backtrace = u64::MAX;
+                    }
+                }
+
+                *entries = entries_owned.into();
+            },
+            Event::ResidencySamples { ref mut entries, .. } => {
+                let mut entries_owned = std::mem::take( entries ).into_owned();
+                for entry in entries_owned.iter_mut() {
+                    if let Some( target_backtrace ) = loader.lookup_backtrace( entry.backtrace ) {
+                        entry.backtrace = target_backtrace.raw() as _;
+                    } else {
+                        entry.backtrace = u64::MAX;
+                    }
+                }
+
+                *entries = entries_owned.into();
+            },
+            Event::JemallocStats { .. } => {},
+            Event::NumaPlacements { .. } => {},
+            Event::CulledAllocations { ref mut entries, .. } => {
+                let mut entries_owned = std::mem::take( entries ).into_owned();
+                for entry in entries_owned.iter_mut() {
+                    if let Some( target_backtrace ) = loader.lookup_backtrace( entry.backtrace ) {
+                        entry.backtrace = target_backtrace.raw() as _;
+                    } else {
+                        entry.backtrace = u64::MAX;
+                    }
+                }
+
+                *entries = entries_owned.into();
+            },
+            Event::AllocatorLatencies { ref mut entries, .. } => {
+                let mut entries_owned = std::mem::take( entries ).into_owned();
+                for entry in entries_owned.iter_mut() {
+                    if let Some( target_backtrace ) = loader.lookup_backtrace( entry.backtrace ) {
+                        entry.backtrace = target_backtrace.raw() as _;
+                    } else {
+                        entry.backtrace = u64::MAX;
+                    }
+                }
+
+                *entries = entries_owned.into();
+            },
+            Event::PageFaults { .. } => {},
+            Event::ProfilerStatistics { .. } => {},
+            Event::BacktraceCacheStatistics { .. } => {},
+            Event::Checkpoint { ref mut allocations, .. } => {
+                let mut allocations_owned = std::mem::take( allocations ).into_owned();
+                for allocation in allocations_owned.iter_mut() {
+                    if let Some( target_backtrace ) = loader.lookup_backtrace( allocation.allocation.backtrace ) {
+                        allocation.allocation.backtrace = target_backtrace.raw() as _;
+                    } else {
+                        allocation.allocation.backtrace = u64::MAX;
+                    }
+                }
+
+                *allocations = allocations_owned.into();
+            },
             Event::Header( ref mut body ) => {
                 anonymize_header( anonymize, body );
             },
@@ -208,6 +392,7 @@ pub fn postprocess< F, G, D, I  >( ifp: F, ofp: G, debug_symbols: I, anonymize:
                     write = false;
                 }
             },
+            Event::MemoryDumpStarted { .. } => {},
             Event::Marker { .. } => {},
             Event::Environ { .. } => {
                 if anonymize != Anonymize::None {
@@ -215,93 +400,57 @@ pub fn postprocess< F, G, D, I  >( ifp: F, ofp: G, debug_symbols: I, anonymize:
                 }
             },
             Event::WallClock { .. } => {},
+            Event::SamplingInterval { .. } => {},
+            Event::OptionChanged { .. } => {},
+            Event::ThreadTag { .. } => {},
+            Event::ThreadStarted { ref mut name, .. } | Event::ThreadRenamed { ref mut name, .. } => {
+                if anonymize != Anonymize::None {
+                    *name = Cow::Borrowed( "" );
+                }
+            },
+            Event::ThreadExited { .. } => {},
+            Event::ChildData { .. } => {
+                // The children's data would have to be processed recursively to be anonymized.
+                if anonymize != Anonymize::None {
+                    write = false;
+                }
+            },
+            Event::PoolCreated { ref mut name, .. } => {
+                if anonymize != Anonymize::None {
+                    *name = Cow::Borrowed( "" );
+                }
+            },
+            Event::PoolFree { .. } => {},
+            Event::PoolReset { .. } => {},
+            Event::CgroupMemory { .. } => {},
+            Event::ParentData { .. } => {},
+            Event::ThreadContext { .. } => {},
+            Event::AllocCompact { .. } => {},
+            Event::ReallocCompact { .. } => {},
+            Event::ResizeCompact { .. } => {},
+            Event::FreeCompact { .. } => {},
             Event::String { .. } => {},
             Event::DecodedFrame { .. } => {},
             Event::DecodedBacktrace { .. } => {}
         }
 
         if write {
-            event.write_to_stream( &mut ofp )?;
+            event.write_to_stream( &mut emitter.pending )?;
         }
 
         if is_backtrace {
-            frames.clear();
-            frames_to_write.clear();
-
-            let backtrace_id = loader.process_backtrace_event( event, |frame_id, is_new| {
-                frames.push( frame_id as u32 );
-                if is_new {
-                    frames_to_write.push( frame_id );
-                }
-            });
-
-            if backtrace_id.is_none() {
-                assert!( frames.is_empty() );
-                assert!( frames_to_write.is_empty() );
-            }
-
-            for frame_id in frames_to_write.drain( .. ) {
-                let frame = loader.get_frame( frame_id ).clone();
-                macro_rules! intern {
-                    ($value:expr, $anonymizer:ident) => {
-                        if let Some( id ) = $value {
-                            let raw_id = id.to_usize() as u32;
-                            if !emitted_strings.contains( &id ) {
-                                emitted_strings.insert( id );
-                                let string = loader.interner().resolve( id ).unwrap();
-                                Event::String {
-                                    id: raw_id,
-                                    string: $anonymizer.anonymize( anonymize, string )
-                                }.write_to_stream( &mut ofp )?;
-                            }
-
-                            raw_id
-                        } else {
-                            0xFFFFFFFF
-                        }
-                    }
-                }
-
-                let library = intern!( frame.library(), anonymizer_library );
-                let source = intern!( frame.source(), anonymizer_source );
-
-                let raw_function;
-                let function;
-                if anonymize == Anonymize::Full {
-                    raw_function = intern!( frame.raw_function(), anonymizer_function );
-                    function = 0xFFFFFFFF;
-                } else {
-                    raw_function = intern!( frame.raw_function(), anonymizer_function );
-                    function = intern!( frame.function(), anonymizer_function );
-                }
-
-                assert_eq!( frame_id, expected_frame_id );
-                expected_frame_id += 1;
-
-                Event::DecodedFrame {
-                    address: frame.address().raw(),
-                    library,
-                    raw_function,
-                    function,
-                    source,
-                    line: frame.line().unwrap_or( 0xFFFFFFFF ),
-                    column: frame.column().unwrap_or( 0xFFFFFFFF ),
-                    is_inline: frame.is_inline()
-                }.write_to_stream( &mut ofp )?;
-            }
-
-            if let Some( backtrace_id ) = backtrace_id {
-                assert_eq!( backtrace_id.raw(), expected_backtrace_id );
-                expected_backtrace_id += 1;
-
-                Event::DecodedBacktrace {
-                    frames: (&frames).into()
-                }.write_to_stream( &mut ofp )?;
+            if let Some( backtrace_id ) = loader.process_backtrace_event( event, |_, _| {} ) {
+                emitter.pending_backtraces.push( backtrace_id );
             }
         } else if process {
             loader.process( event );
         }
+
+        if emitter.pending.len() >= MAXIMUM_PENDING_SIZE {
+            emitter.flush( &mut loader )?;
+        }
     }
 
-    Ok(())
+    emitter.flush( &mut loader )?;
+    emitter.ofp.finish()
 }
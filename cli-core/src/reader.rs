@@ -1,15 +1,21 @@
-use std::io::{self, Read};
+use std::cmp::min;
+use std::io::{self, Read, Seek, SeekFrom};
+use std::thread;
 
 use common::event::{
     Event,
     HeaderBody
 };
 
+use common::Timestamp;
+use common::chunk_index::read_chunk_index;
+use common::compact_event::Decoder;
 use common::speedy::Readable;
 use crate::threaded_lz4_stream::Lz4Reader;
 
 pub struct Iter< T: Read + Send > {
     fp: Lz4Reader< T >,
+    decoder: Decoder,
     done: bool
 }
 
@@ -22,15 +28,21 @@ impl< T > Iterator for Iter< T > where T: Read + Send {
             return None;
         }
 
-        match Event::read_from_stream_unbuffered( &mut self.fp ) {
-            Ok( event ) => Some( Ok( event ) ),
-            Err( err ) => {
-                self.done = true;
-                let err: io::Error = err.into();
-                if err.kind() == io::ErrorKind::UnexpectedEof {
-                    None
-                } else {
-                    Some( Err( err ) )
+        loop {
+            match Event::read_from_stream_unbuffered( &mut self.fp ) {
+                // The compact events are always expanded here so that nothing else has to deal with them.
+                Ok( event ) => match self.decoder.decode( event ) {
+                    Some( event ) => return Some( Ok( event ) ),
+                    None => continue
+                },
+                Err( err ) => {
+                    self.done = true;
+                    let err: io::Error = err.into();
+                    if err.kind() == io::ErrorKind::UnexpectedEof {
+                        return None;
+                    } else {
+                        return Some( Err( err ) );
+                    }
                 }
             }
         }
@@ -50,6 +62,261 @@ pub fn parse_events< T >( fp: T ) -> io::Result< (HeaderBody, impl Iterator< Ite
         }
     };
 
-    let iter = Iter { fp, done: false };
+    let iter = Iter { fp, decoder: Decoder::default(), done: false };
     Ok( (header, iter) )
 }
+
+/// How much of the decompressed data `scan_events` reads at a time, at least.
+const SCAN_BUFFER_SIZE: usize = 4 * 1024 * 1024;
+
+fn read_as_much_as_possible( fp: &mut impl Read, mut buffer: &mut [u8] ) -> io::Result< usize > {
+    let mut total = 0;
+    while !buffer.is_empty() {
+        match fp.read( buffer ) {
+            Ok( 0 ) => break,
+            Ok( count ) => {
+                total += count;
+                buffer = &mut buffer[ count.. ];
+            },
+            Err( ref error ) if error.kind() == io::ErrorKind::Interrupted => continue,
+            Err( error ) => return Err( error )
+        }
+    }
+
+    Ok( total )
+}
+
+/// Calls the `callback` with every event, starting with the header, along with how many bytes it took.
+///
+/// This is a lot cheaper than `parse_events` when most of the events are only counted: they're read
+/// straight out of big blocks of the decompressed data and borrow from them, so nothing which they
+/// contain is ever copied. The events aren't framed, so they still have to be parsed to be skipped.
+/// The compact events are expanded, and the `ThreadContext`s which only carry the state of that are
+/// passed through as they are.
+pub fn scan_events< T >( fp: T, mut callback: impl FnMut( &Event, usize ) ) -> io::Result< () > where T: Read + Send + 'static {
+    let mut fp = Lz4Reader::new( fp );
+    let mut decoder = Decoder::default();
+    let mut buffer = Vec::new();
+    let mut position = 0;
+    let mut is_first = true;
+    loop {
+        buffer.drain( ..position );
+        position = 0;
+
+        let length = buffer.len();
+        buffer.resize( std::cmp::max( SCAN_BUFFER_SIZE, length * 2 ), 0 );
+        let count = read_as_much_as_possible( &mut fp, &mut buffer[ length.. ] )?;
+        buffer.truncate( length + count );
+
+        loop {
+            let (result, length) = Event::read_with_length_from_buffer( &buffer[ position.. ] );
+            let event = match result {
+                Ok( event ) => event,
+                Err( error ) => {
+                    let error: io::Error = error.into();
+                    if error.kind() == io::ErrorKind::UnexpectedEof {
+                        break;
+                    }
+
+                    return Err( error );
+                }
+            };
+
+            position += length;
+            if is_first {
+                if !matches!( event, Event::Header( .. ) ) {
+                    return Err( io::Error::new( io::ErrorKind::Other, "data file doesn't start with a proper header" ) );
+                }
+                is_first = false;
+            }
+
+            if let Event::ThreadContext { thread, reset } = event {
+                decoder.decode( event );
+                callback( &Event::ThreadContext { thread, reset }, length );
+            } else if let Some( event ) = decoder.decode( event ) {
+                callback( &event, length );
+            }
+        }
+
+        // Same as with `parse_events` a truncated event at the end is silently ignored.
+        if count == 0 {
+            if is_first {
+                return Err( io::Error::new( io::ErrorKind::Other, "data file doesn't start with a proper header" ) );
+            }
+
+            return Ok(());
+        }
+    }
+}
+
+/// How many events are sent at a time by the background decoding thread.
+const BATCH_SIZE: usize = 4096;
+
+pub struct BackgroundIter {
+    rx: crossbeam_channel::Receiver< io::Result< Vec< Event< 'static > > > >,
+    batch: std::vec::IntoIter< Event< 'static > >,
+    done: bool
+}
+
+impl Iterator for BackgroundIter {
+    type Item = io::Result< Event< 'static > >;
+
+    #[inline]
+    fn next( &mut self ) -> Option< Self::Item > {
+        loop {
+            if let Some( event ) = self.batch.next() {
+                return Some( Ok( event ) );
+            }
+
+            if self.done {
+                return None;
+            }
+
+            match self.rx.recv() {
+                Ok( Ok( batch ) ) => {
+                    self.batch = batch.into_iter();
+                },
+                Ok( Err( error ) ) => {
+                    self.done = true;
+                    return Some( Err( error ) );
+                },
+                Err( _ ) => {
+                    self.done = true;
+                    return None;
+                }
+            }
+        }
+    }
+}
+
+/// Same as `parse_events`, except the events are read and decoded on a separate thread.
+///
+/// The events are sent over in batches, so the consumer can process one batch while the next one
+/// is being decoded without paying for the synchronization on every event.
+pub fn parse_events_in_background< T >( fp: T ) -> io::Result< (HeaderBody, BackgroundIter) > where T: Read + Send + 'static {
+    let (header, mut event_stream) = parse_events( fp )?;
+    let (tx, rx) = crossbeam_channel::bounded( 16 );
+    thread::spawn( move || {
+        loop {
+            let mut batch = Vec::with_capacity( BATCH_SIZE );
+            let mut error = None;
+            while batch.len() < BATCH_SIZE {
+                match event_stream.next() {
+                    Some( Ok( event ) ) => batch.push( event ),
+                    Some( Err( err ) ) => {
+                        error = Some( err );
+                        break;
+                    },
+                    None => break
+                }
+            }
+
+            let is_last = batch.len() < BATCH_SIZE;
+            if !batch.is_empty() && tx.send( Ok( batch ) ).is_err() {
+                return;
+            }
+
+            if let Some( error ) = error {
+                let _ = tx.send( Err( error ) );
+                return;
+            }
+
+            if is_last {
+                return;
+            }
+        }
+    });
+
+    let iter = BackgroundIter {
+        rx,
+        batch: Vec::new().into_iter(),
+        done: false
+    };
+
+    Ok( (header, iter) )
+}
+
+/// Reads only the given byte ranges of the underlying file.
+struct RangesReader< T: Read + Seek > {
+    fp: T,
+    ranges: Vec< (u64, u64) >,
+    next_range: usize,
+    remaining: u64
+}
+
+impl< T > Read for RangesReader< T > where T: Read + Seek {
+    fn read( &mut self, buffer: &mut [u8] ) -> io::Result< usize > {
+        while self.remaining == 0 {
+            let (start, end) = match self.ranges.get( self.next_range ) {
+                Some( &range ) => range,
+                None => return Ok( 0 )
+            };
+
+            self.fp.seek( SeekFrom::Start( start ) )?;
+            self.remaining = end - start;
+            self.next_range += 1;
+        }
+
+        let length = min( buffer.len() as u64, self.remaining ) as usize;
+        let count = self.fp.read( &mut buffer[ ..length ] )?;
+        if count == 0 {
+            self.remaining = 0;
+            self.next_range = self.ranges.len();
+        } else {
+            self.remaining -= count as u64;
+        }
+
+        Ok( count )
+    }
+}
+
+fn time_range_reader< T >( mut fp: T, from: Option< Timestamp >, to: Option< Timestamp > ) -> io::Result< RangesReader< T > >
+    where T: Read + Seek
+{
+    let index = read_chunk_index( &mut fp )?;
+    let ranges = match index {
+        Some( index ) => {
+            fp.seek( SeekFrom::Start( 0 ) )?;
+            let header = match Event::read_from_stream_unbuffered( &mut common::lz4_stream::Lz4Reader::new( &mut fp ) )? {
+                Event::Header( header ) => header,
+                _ => return Err( io::Error::new( io::ErrorKind::Other, "data file doesn't start with a proper header" ) )
+            };
+
+            let from = from.map( |from| header.initial_timestamp + from ).unwrap_or( Timestamp::min() );
+            let to = to.map( |to| header.initial_timestamp + to ).unwrap_or( Timestamp::max() );
+            let ranges = index.ranges_for( from, to );
+            debug!( "Will read {} out of {} chunk(s) of the data", ranges.len(), index.entries.len() );
+            ranges
+        },
+        None => vec![ (0, u64::MAX) ]
+    };
+
+    Ok( RangesReader {
+        fp,
+        ranges,
+        next_range: 0,
+        remaining: 0
+    })
+}
+
+/// Same as `parse_events`, except if the data has a chunk index then it only
+/// reads the chunks which contain events from within the given time range.
+///
+/// Both `from` and `to` are relative to the initial timestamp from the header.
+/// The events are *not* filtered individually, so some of the returned events
+/// can still be from outside of the requested range.
+pub fn parse_events_in_time_range< T >( fp: T, from: Option< Timestamp >, to: Option< Timestamp > )
+    -> io::Result< (HeaderBody, impl Iterator< Item = io::Result< Event< 'static > > >) >
+    where T: Read + Seek + Send + 'static
+{
+    parse_events( time_range_reader( fp, from, to )? )
+}
+
+/// Same as `scan_events`, except only the chunks from within the given time range are read,
+/// the same as with `parse_events_in_time_range`.
+pub fn scan_events_in_time_range< T >( fp: T, from: Option< Timestamp >, to: Option< Timestamp >, callback: impl FnMut( &Event, usize ) )
+    -> io::Result< () >
+    where T: Read + Seek + Send + 'static
+{
+    scan_events( time_range_reader( fp, from, to )?, callback )
+}
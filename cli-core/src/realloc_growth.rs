@@ -0,0 +1,223 @@
+//! Detection of reallocation chains which keep on growing in small steps.
+//!
+//! Every time a growing reallocation can't be done in place the old contents have to be copied over,
+//! so a buffer which grows by a constant amount instead of geometrically ends up copying
+//! a quadratic amount of memory. The ratio between everything which was copied and the final size
+//! of the chain (the copy amplification) is around one for buffers which double their size,
+//! and grows linearly with the number of steps for those which don't.
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+
+use crate::{Allocation, AllocationId, BacktraceId, Data, Timestamp};
+use crate::filter::Duration;
+
+/// Growing by less than this factor counts as a small step.
+const SMALL_STEP_FACTOR: f64 = 1.5;
+
+/// How a single or multiple reallocation chains grew.
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub struct ChainGrowth {
+    pub chain_count: u64,
+    pub reallocation_count: u64,
+    /// The number of reallocations which grew by less than 50%.
+    pub small_step_count: u64,
+    /// The number of reallocations which had to be moved, and hence copied.
+    pub moved_count: u64,
+    /// An estimate of how many bytes were copied; the reallocations done in place are not counted.
+    pub bytes_copied: u64,
+    /// The sum of the biggest size of every chain.
+    pub peak_size: u64,
+    /// For how long in total the chains were being reallocated.
+    pub duration: Timestamp
+}
+
+impl Default for ChainGrowth {
+    fn default() -> Self {
+        ChainGrowth {
+            chain_count: 0,
+            reallocation_count: 0,
+            small_step_count: 0,
+            moved_count: 0,
+            bytes_copied: 0,
+            peak_size: 0,
+            duration: Timestamp::min()
+        }
+    }
+}
+
+impl std::ops::Add for ChainGrowth {
+    type Output = Self;
+    fn add( self, rhs: Self ) -> Self {
+        ChainGrowth {
+            chain_count: self.chain_count + rhs.chain_count,
+            reallocation_count: self.reallocation_count + rhs.reallocation_count,
+            small_step_count: self.small_step_count + rhs.small_step_count,
+            moved_count: self.moved_count + rhs.moved_count,
+            bytes_copied: self.bytes_copied + rhs.bytes_copied,
+            peak_size: self.peak_size + rhs.peak_size,
+            duration: self.duration + rhs.duration
+        }
+    }
+}
+
+impl ChainGrowth {
+    /// Follows the chain which starts at the given allocation.
+    ///
+    /// Returns `None` if the allocation isn't the first one of a chain which was reallocated at least once.
+    pub fn of_chain( data: &Data, first: &Allocation ) -> Option< Self > {
+        if first.position_in_chain != 0 || first.reallocation.is_none() {
+            return None;
+        }
+
+        let chain = std::iter::successors( Some( first ), |allocation| {
+            allocation.reallocation.map( |id| data.get_allocation( id ) )
+        });
+
+        Some( Self::from_steps( chain.map( |allocation| (allocation.pointer, allocation.size, allocation.timestamp) ) ) )
+    }
+
+    /// Accumulates the growth of a single chain from the pointer, the size and the timestamp of its every step.
+    fn from_steps( mut steps: impl Iterator< Item = (u64, u64, Timestamp) > ) -> Self {
+        let mut growth = ChainGrowth {
+            chain_count: 1,
+            .. ChainGrowth::default()
+        };
+
+        let (mut previous_pointer, mut previous_size, mut previous_timestamp) = match steps.next() {
+            Some( step ) => step,
+            None => return growth
+        };
+
+        growth.peak_size = previous_size;
+        for (pointer, size, timestamp) in steps {
+            growth.reallocation_count += 1;
+            if size > previous_size && (size as f64) < previous_size as f64 * SMALL_STEP_FACTOR {
+                growth.small_step_count += 1;
+            }
+
+            if pointer != previous_pointer {
+                growth.moved_count += 1;
+                growth.bytes_copied += std::cmp::min( previous_size, size );
+            }
+
+            growth.peak_size = std::cmp::max( growth.peak_size, size );
+            growth.duration = growth.duration + (timestamp - previous_timestamp);
+            previous_pointer = pointer;
+            previous_size = size;
+            previous_timestamp = timestamp;
+        }
+
+        growth
+    }
+
+    /// How many times more bytes were copied than what the chains ended up using at most.
+    pub fn copy_amplification( &self ) -> f64 {
+        if self.peak_size == 0 {
+            0.0
+        } else {
+            self.bytes_copied as f64 / self.peak_size as f64
+        }
+    }
+}
+
+/// The growth of the reallocation chains started from a single backtrace.
+#[derive(Clone, Debug)]
+pub struct ReallocGrowth {
+    pub backtrace: BacktraceId,
+    pub growth: ChainGrowth,
+    /// The first allocation of every chain, sorted.
+    pub allocation_ids: Vec< AllocationId >
+}
+
+impl ReallocGrowth {
+    pub fn duration( &self ) -> Duration {
+        Duration( self.growth.duration )
+    }
+}
+
+/// Finds the chains started by the given allocations which were reallocated at least once,
+/// and groups them by backtrace, with the ones with the highest copy amplification first.
+pub fn find_realloc_growth( data: &Data, ids: &[AllocationId] ) -> Vec< ReallocGrowth > {
+    let per_backtrace = ids.par_iter()
+        .fold( HashMap::new, |mut output: HashMap< BacktraceId, (ChainGrowth, Vec< AllocationId >) >, &id| {
+            let allocation = data.get_allocation( id );
+            if let Some( growth ) = ChainGrowth::of_chain( data, allocation ) {
+                let entry = output.entry( allocation.backtrace ).or_default();
+                entry.0 = entry.0 + growth;
+                entry.1.push( id );
+            }
+            output
+        })
+        .reduce( HashMap::new, |mut lhs, rhs| {
+            for (backtrace, (growth, allocation_ids)) in rhs {
+                let entry = lhs.entry( backtrace ).or_default();
+                entry.0 = entry.0 + growth;
+                entry.1.extend( allocation_ids );
+            }
+            lhs
+        });
+
+    let mut output: Vec< _ > = per_backtrace.into_par_iter().map( |(backtrace, (growth, mut allocation_ids))| {
+        allocation_ids.sort_unstable();
+        ReallocGrowth {
+            backtrace,
+            growth,
+            allocation_ids
+        }
+    }).collect();
+
+    output.par_sort_unstable_by( |lhs, rhs| {
+        rhs.growth.copy_amplification().partial_cmp( &lhs.growth.copy_amplification() ).unwrap_or( std::cmp::Ordering::Equal )
+            .then( rhs.growth.bytes_copied.cmp( &lhs.growth.bytes_copied ) )
+            .then( lhs.backtrace.cmp( &rhs.backtrace ) )
+    });
+
+    output
+}
+
+#[test]
+fn test_chain_growth_from_steps() {
+    let at = Timestamp::from_secs;
+
+    // Growing by a constant amount, moving every time.
+    let linear = ChainGrowth::from_steps( (1..=10).map( |step| (step * 0x1000, step * 100, at( step )) ) );
+    assert_eq!( linear.reallocation_count, 9 );
+    assert_eq!( linear.moved_count, 9 );
+    assert_eq!( linear.small_step_count, 7 );
+    assert_eq!( linear.bytes_copied, (1..10).map( |step| step * 100 ).sum::< u64 >() );
+    assert_eq!( linear.peak_size, 1000 );
+    assert_eq!( linear.duration, at( 9 ) );
+    assert_eq!( linear.copy_amplification(), 4.5 );
+
+    // Doubling, with one of the steps done in place.
+    let doubling = ChainGrowth::from_steps( vec![
+        (0x1000, 100, at( 1 )),
+        (0x2000, 200, at( 2 )),
+        (0x2000, 400, at( 3 )),
+        (0x3000, 800, at( 4 ))
+    ].into_iter() );
+    assert_eq!( doubling.reallocation_count, 3 );
+    assert_eq!( doubling.moved_count, 2 );
+    assert_eq!( doubling.small_step_count, 0 );
+    assert_eq!( doubling.bytes_copied, 100 + 400 );
+    assert_eq!( doubling.peak_size, 800 );
+    assert!( doubling.copy_amplification() < 1.0 );
+}
+
+#[test]
+fn test_copy_amplification() {
+    let growth = ChainGrowth {
+        chain_count: 2,
+        bytes_copied: 300,
+        peak_size: 100,
+        .. ChainGrowth::default()
+    };
+
+    assert_eq!( growth.copy_amplification(), 3.0 );
+    assert_eq!( ChainGrowth::default().copy_amplification(), 0.0 );
+
+    let sum = growth + growth;
+    assert_eq!( sum.chain_count, 4 );
+    assert_eq!( sum.copy_amplification(), 3.0 );
+}
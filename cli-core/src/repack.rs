@@ -1,24 +1,189 @@
-use std::io::{self, Read, Write};
+use std::cmp::{min, max};
+use std::collections::{HashMap, HashSet};
+use std::io::{self, Read, Seek, SeekFrom, Write};
+use std::sync::Arc;
+use std::thread;
+
+use byteorder::{ReadBytesExt, WriteBytesExt, LittleEndian};
+use rayon::prelude::*;
 
 use common::speedy::{
     Writable
 };
 
+use common::Timestamp;
 use common::event::Event;
-use common::lz4_stream::Lz4Writer;
+use common::chunk_index::{ChunkIndex, ChunkIndexEntry, read_chunk_index, write_chunk_index};
+use common::lz4_stream::{CHUNK_KIND_INDEX, CHUNK_KIND_ZSTD, CHUNK_KIND_ZSTD_DICTIONARY, CHUNK_SIZE, Lz4Writer, ZstdDecoder, ZstdEncoder};
 
 use crate::reader::parse_events;
+use crate::threaded_lz4_stream::{Compression, decompress_chunk};
+
+/// How much of the data at the start of the stream is used to train the zstd dictionary.
+const DICTIONARY_TRAINING_SIZE: usize = 16 * CHUNK_SIZE;
+
+const DICTIONARY_SIZE: usize = 112 * 1024;
+
+struct CountingWriter< F: Write > {
+    fp: F,
+    position: u64
+}
+
+impl< F: Write > Write for CountingWriter< F > {
+    fn write( &mut self, data: &[u8] ) -> io::Result< usize > {
+        let count = self.fp.write( data )?;
+        self.position += count as u64;
+        Ok( count )
+    }
+
+    fn flush( &mut self ) -> io::Result< () > {
+        self.fp.flush()
+    }
+}
+
+/// Buffers whole events and writes them out in chunks which always start with a new event.
+struct IndexingWriter< F: Write > {
+    fp: Lz4Writer< CountingWriter< F > >,
+    buffer: Vec< u8 >,
+    index: ChunkIndex,
+    first_timestamp: Timestamp,
+    last_timestamp: Timestamp,
+    event_count: u64
+}
+
+impl< F: Write > IndexingWriter< F > {
+    fn new( fp: Lz4Writer< CountingWriter< F > > ) -> Self {
+        IndexingWriter {
+            fp,
+            buffer: Vec::new(),
+            index: ChunkIndex::default(),
+            first_timestamp: Timestamp::max(),
+            last_timestamp: Timestamp::min(),
+            event_count: 0
+        }
+    }
+
+    fn write_event( &mut self, event: &Event ) -> io::Result< () > {
+        if let Some( timestamp ) = event.timestamp() {
+            self.first_timestamp = min( self.first_timestamp, timestamp );
+            self.last_timestamp = max( self.last_timestamp, timestamp );
+        }
+
+        self.event_count += 1;
+        event.write_to_stream( &mut self.buffer )?;
+        if self.buffer.len() >= CHUNK_SIZE {
+            self.flush_chunk()?;
+        }
+
+        Ok(())
+    }
+
+    fn flush_chunk( &mut self ) -> io::Result< () > {
+        if self.buffer.is_empty() {
+            return Ok(());
+        }
+
+        // The first chunk also covers everything before it, like the compression dictionary.
+        let offset = if self.index.entries.is_empty() { 0 } else { self.fp.inner().position };
+        self.fp.write_all( &self.buffer )?;
+        self.fp.flush()?;
+        self.buffer.clear();
+
+        // Chunks without any timestamped events inherit the timestamps of their predecessors.
+        let (first_timestamp, last_timestamp) =
+            if self.first_timestamp <= self.last_timestamp {
+                (self.first_timestamp, self.last_timestamp)
+            } else if let Some( entry ) = self.index.entries.last() {
+                (entry.last_timestamp, entry.last_timestamp)
+            } else {
+                (Timestamp::min(), Timestamp::min())
+            };
+
+        self.index.entries.push( ChunkIndexEntry {
+            offset,
+            first_timestamp,
+            last_timestamp,
+            event_count: self.event_count
+        });
+
+        self.first_timestamp = Timestamp::max();
+        self.last_timestamp = Timestamp::min();
+        self.event_count = 0;
+
+        Ok(())
+    }
 
-pub fn repack< F, G >( disable_compression: bool, input_fp: F, output_fp: G ) -> Result< (), io::Error >
+    fn finish( mut self ) -> io::Result< () > {
+        self.flush_chunk()?;
+
+        let mut fp = self.fp.into_inner()?;
+        self.index.end_offset = fp.position;
+        write_chunk_index( &mut fp, &self.index )?;
+        fp.flush()
+    }
+}
+
+/// Trains a zstd dictionary on the events at the start of the stream.
+///
+/// Returns the events which were consumed so that they can be written out afterwards.
+fn train_dictionary( event_stream: &mut impl Iterator< Item = io::Result< Event< 'static > > > ) -> io::Result< (Option< Vec< u8 > >, Vec< Event< 'static > >) > {
+    let mut events = Vec::new();
+    let mut samples = Vec::new();
+    let mut sample_sizes = Vec::new();
+    while samples.len() < DICTIONARY_TRAINING_SIZE {
+        let event = match event_stream.next() {
+            Some( event ) => event?,
+            None => break
+        };
+
+        let position = samples.len();
+        event.write_to_stream( &mut samples )?;
+        sample_sizes.push( samples.len() - position );
+        events.push( event );
+    }
+
+    match ZstdEncoder::train_dictionary( &samples, &sample_sizes, DICTIONARY_SIZE ) {
+        Ok( dictionary ) => {
+            info!( "Trained a {} byte dictionary on {} events", dictionary.len(), events.len() );
+            Ok( (Some( dictionary ), events) )
+        },
+        Err( error ) => {
+            warn!( "Failed to train a dictionary: {}", error );
+            Ok( (None, events) )
+        }
+    }
+}
+
+pub fn repack< F, G >( disable_compression: bool, compression_level: u32, zstd_level: Option< i32 >, build_index: bool, input_fp: F, output_fp: G ) -> Result< (), io::Error >
     where F: Read + Send + 'static,
           G: Write + Send + 'static
 {
     let (header, event_stream) = parse_events( input_fp )?;
-    let mut output_fp = Lz4Writer::new( output_fp );
+    let mut event_stream: Box< dyn Iterator< Item = io::Result< Event< 'static > > > > = Box::new( event_stream );
+    let mut output_fp = Lz4Writer::new( CountingWriter { fp: output_fp, position: 0 } );
     if disable_compression {
         output_fp.disable_compression()?;
     }
 
+    output_fp.set_compression_level( compression_level )?;
+
+    if let Some( level ) = zstd_level {
+        let (dictionary, events) = train_dictionary( &mut event_stream )?;
+        output_fp.enable_zstd( ZstdEncoder::new( level, dictionary )? )?;
+        event_stream = Box::new( events.into_iter().map( Ok ).chain( event_stream ) );
+    }
+
+    if build_index {
+        let mut output_fp = IndexingWriter::new( output_fp );
+        output_fp.write_event( &Event::Header( header ) )?;
+        for event in event_stream {
+            let event = event?;
+            output_fp.write_event( &event )?;
+        }
+
+        return output_fp.finish();
+    }
+
     Event::Header( header ).write_to_stream( &mut output_fp )?;
     for event in event_stream {
         let event = event?;
@@ -28,4 +193,356 @@ pub fn repack< F, G >( disable_compression: bool, input_fp: F, output_fp: G ) ->
     output_fp.flush()?;
 
     Ok(())
-}
\ No newline at end of file
+}
+
+/// How many chunks are decompressed or compressed in parallel at a time.
+const CHUNK_BATCH_SIZE: usize = 64;
+
+/// The size of the samples on which the zstd dictionary is trained when the events themselves aren't decoded.
+const DICTIONARY_SAMPLE_SIZE: usize = 1024;
+
+/// A chunk as it was read from the input.
+struct RawChunk {
+    kind: u8,
+    data: Vec< u8 >,
+    /// The dictionary which was in effect for this chunk, if any.
+    dictionary: Option< Arc< Vec< u8 > > >,
+    /// The offset of this chunk in the input, and of any chunks without any data (like the dictionaries)
+    /// which were right before it.
+    offsets: smallvec::SmallVec< [u64; 1] >
+}
+
+/// A piece of the uncompressed stream which will be written out as a single chunk.
+struct Unit {
+    data: Vec< u8 >,
+    offsets: smallvec::SmallVec< [u64; 1] >
+}
+
+fn read_raw_chunks( mut fp: impl Read, tx: crossbeam_channel::Sender< io::Result< Vec< RawChunk > > > ) {
+    let mut offset = 0;
+    let mut offsets = smallvec::SmallVec::new();
+    let mut dictionary = None;
+    let mut batch = Vec::with_capacity( CHUNK_BATCH_SIZE );
+    loop {
+        let kind = match fp.read_u8() {
+            Ok( CHUNK_KIND_INDEX ) => break,
+            Ok( kind ) => kind,
+            Err( ref error ) if error.kind() == io::ErrorKind::UnexpectedEof => break,
+            Err( error ) => {
+                let _ = tx.send( Err( error ) );
+                return;
+            }
+        };
+
+        let result = fp.read_u32::< LittleEndian >().and_then( |length| {
+            let mut data = vec![ 0; length as usize ];
+            fp.read_exact( &mut data ).map( |_| data )
+        });
+
+        let data = match result {
+            Ok( data ) => data,
+            Err( error ) => {
+                let _ = tx.send( Err( error ) );
+                return;
+            }
+        };
+
+        offsets.push( offset );
+        offset += 5 + data.len() as u64;
+
+        match kind {
+            1 | 2 | CHUNK_KIND_ZSTD => {},
+            CHUNK_KIND_ZSTD_DICTIONARY => {
+                dictionary = Some( Arc::new( data ) );
+                continue;
+            },
+            _ => {
+                let _ = tx.send( Err( io::Error::new( io::ErrorKind::InvalidData, format!( "unknown chunk kind: {}", kind ) ) ) );
+                return;
+            }
+        }
+
+        batch.push( RawChunk {
+            kind,
+            data,
+            dictionary: dictionary.clone(),
+            offsets: std::mem::take( &mut offsets )
+        });
+
+        if batch.len() == CHUNK_BATCH_SIZE {
+            let batch = std::mem::replace( &mut batch, Vec::with_capacity( CHUNK_BATCH_SIZE ) );
+            if tx.send( Ok( batch ) ).is_err() {
+                return;
+            }
+        }
+    }
+
+    if !batch.is_empty() {
+        let _ = tx.send( Ok( batch ) );
+    }
+}
+
+fn decompress_raw_chunks( batch: Vec< RawChunk > ) -> io::Result< Vec< Unit > > {
+    batch.into_par_iter().map_init( || None, |zstd: &mut Option< (Option< Arc< Vec< u8 > > >, ZstdDecoder) >, chunk| {
+        let data = match chunk.kind {
+            2 => chunk.data,
+            kind => {
+                let compression = if kind == 1 { Compression::Lz4 } else { Compression::Zstd( chunk.dictionary ) };
+                let mut output = Vec::new();
+                decompress_chunk( &chunk.data, &compression, zstd, &mut output )?;
+                output
+            }
+        };
+
+        Ok( Unit { data, offsets: chunk.offsets } )
+    }).collect()
+}
+
+#[derive(Copy, Clone)]
+enum ChunkCompression {
+    None,
+    Lz4( u32 ),
+    Zstd( i32 )
+}
+
+fn compress_units( units: &[Unit], compression: ChunkCompression, dictionary: &Option< Vec< u8 > > ) -> io::Result< Vec< Vec< u8 > > > {
+    units.par_iter().map_init( || None, |zstd: &mut Option< ZstdEncoder >, unit| {
+        let mut output = Vec::with_capacity( unit.data.len() + 5 );
+        match compression {
+            ChunkCompression::None => {
+                output.write_u8( 2 )?;
+                output.write_u32::< LittleEndian >( unit.data.len() as u32 )?;
+                output.extend_from_slice( &unit.data );
+            },
+            ChunkCompression::Lz4( level ) => {
+                output.extend_from_slice( &[1, 0, 0, 0, 0] );
+                if level == 0 {
+                    lz4_compress::compress_into( &unit.data, &mut output );
+                } else {
+                    lz4_compress::compress_into_hc( &unit.data, &mut output, level );
+                }
+
+                let length = (output.len() - 5) as u32;
+                (&mut output[ 1..5 ]).write_u32::< LittleEndian >( length )?;
+            },
+            ChunkCompression::Zstd( level ) => {
+                if zstd.is_none() {
+                    *zstd = Some( ZstdEncoder::new( level, dictionary.clone() )? );
+                }
+
+                let mut buffer = Vec::new();
+                zstd.as_mut().unwrap().compress_into( &unit.data, &mut buffer )?;
+                output.write_u8( CHUNK_KIND_ZSTD )?;
+                output.write_u32::< LittleEndian >( buffer.len() as u32 )?;
+                output.extend_from_slice( &buffer );
+            }
+        }
+
+        Ok( output )
+    }).collect()
+}
+
+fn train_dictionary_on_chunks( units: &[Unit] ) -> Option< Vec< u8 > > {
+    let mut samples = Vec::new();
+    for unit in units {
+        samples.extend_from_slice( &unit.data[ ..min( unit.data.len(), DICTIONARY_TRAINING_SIZE - samples.len() ) ] );
+        if samples.len() >= DICTIONARY_TRAINING_SIZE {
+            break;
+        }
+    }
+
+    let sample_sizes: Vec< usize > = samples.chunks( DICTIONARY_SAMPLE_SIZE ).map( |sample| sample.len() ).collect();
+    match ZstdEncoder::train_dictionary( &samples, &sample_sizes, DICTIONARY_SIZE ) {
+        Ok( dictionary ) => {
+            info!( "Trained a {} byte dictionary on {} bytes of data", dictionary.len(), samples.len() );
+            Some( dictionary )
+        },
+        Err( error ) => {
+            warn!( "Failed to train a dictionary: {}", error );
+            None
+        }
+    }
+}
+
+/// Same as `repack`, except it works on whole chunks and never decodes any of the events,
+/// which makes it much faster, especially since the chunks are recompressed in parallel.
+///
+/// If `chunk_size` is given then consecutive chunks are merged together into chunks of up
+/// to that many bytes (but never more than `CHUNK_SIZE`) before they're compressed, which
+/// gives better compression ratios when the input has a lot of small chunks.
+///
+/// The chunk index can only be rebuilt this way when the input already has one, since
+/// otherwise there's no way of telling where the events start; in that case this falls
+/// back to `repack`.
+pub fn repack_chunks< F, G >(
+    disable_compression: bool,
+    compression_level: u32,
+    zstd_level: Option< i32 >,
+    build_index: bool,
+    chunk_size: Option< usize >,
+    mut input_fp: F,
+    output_fp: G
+) -> Result< (), io::Error >
+    where F: Read + Seek + Send + 'static,
+          G: Write + Send + 'static
+{
+    let index = if build_index {
+        let index = read_chunk_index( &mut input_fp )?;
+        input_fp.seek( SeekFrom::Start( 0 ) )?;
+        match index {
+            Some( index ) => Some( index ),
+            None => {
+                info!( "The input doesn't have a chunk index; it will have to be repacked event by event" );
+                return repack( disable_compression, compression_level, zstd_level, build_index, input_fp, output_fp );
+            }
+        }
+    } else {
+        None
+    };
+
+    let compression = match zstd_level {
+        _ if disable_compression => ChunkCompression::None,
+        Some( level ) => ChunkCompression::Zstd( level ),
+        None => ChunkCompression::Lz4( compression_level )
+    };
+
+    // The chunks have to start exactly where they did in the index so that its entries still point to whole events.
+    let index_offsets: HashSet< u64 > = index.iter().flat_map( |index| index.entries.iter().map( |entry| entry.offset ) ).collect();
+    let chunk_size = min( chunk_size.unwrap_or( 0 ), CHUNK_SIZE );
+
+    let (tx, rx) = crossbeam_channel::bounded( 2 );
+    thread::spawn( move || read_raw_chunks( io::BufReader::with_capacity( 1024 * 1024, input_fp ), tx ) );
+
+    let mut output_fp = CountingWriter { fp: io::BufWriter::with_capacity( 1024 * 1024, output_fp ), position: 0 };
+    let mut dictionary = None;
+    let mut is_first_batch = true;
+    let mut output_offsets = HashMap::new();
+    let mut current: Option< Unit > = None;
+    let mut units = Vec::new();
+    let mut is_done = false;
+    while !is_done {
+        match rx.recv() {
+            Ok( batch ) => {
+                for chunk in decompress_raw_chunks( batch? )? {
+                    let is_cut = chunk.offsets.iter().any( |offset| index_offsets.contains( offset ) );
+                    match current {
+                        Some( ref mut unit ) if !is_cut && unit.data.len() + chunk.data.len() <= chunk_size => {
+                            unit.data.extend_from_slice( &chunk.data );
+                        },
+                        _ => {
+                            units.extend( current.take() );
+                            current = Some( chunk );
+                        }
+                    }
+                }
+            },
+            Err( _ ) => {
+                units.extend( current.take() );
+                is_done = true;
+            }
+        }
+
+        if units.is_empty() {
+            continue;
+        }
+
+        if is_first_batch {
+            is_first_batch = false;
+            if let ChunkCompression::Zstd( _ ) = compression {
+                dictionary = train_dictionary_on_chunks( &units );
+                if let Some( ref dictionary ) = dictionary {
+                    output_fp.write_u8( CHUNK_KIND_ZSTD_DICTIONARY )?;
+                    output_fp.write_u32::< LittleEndian >( dictionary.len() as u32 )?;
+                    output_fp.write_all( dictionary )?;
+                }
+            }
+        }
+
+        let chunks = compress_units( &units, compression, &dictionary )?;
+        for (unit, chunk) in units.drain( .. ).zip( chunks ) {
+            for offset in unit.offsets {
+                output_offsets.insert( offset, output_fp.position );
+            }
+
+            output_fp.write_all( &chunk )?;
+        }
+    }
+
+    if let Some( index ) = index {
+        let mut entries = Vec::with_capacity( index.entries.len() );
+        for entry in index.entries {
+            // The first chunk also covers everything before it, like the compression dictionary.
+            let offset = if entry.offset == 0 { Some( 0 ) } else { output_offsets.get( &entry.offset ).copied() };
+            match offset {
+                Some( offset ) => entries.push( ChunkIndexEntry { offset, ..entry } ),
+                None => warn!( "The chunk index of the input has an entry which doesn't point to a chunk: 0x{:X}", entry.offset )
+            }
+        }
+
+        let index = ChunkIndex {
+            entries,
+            end_offset: output_fp.position
+        };
+
+        write_chunk_index( &mut output_fp, &index )?;
+    }
+
+    output_fp.flush()
+}
+
+#[test]
+fn test_repack_chunks() {
+    use common::event::AllocationId;
+    use common::speedy::Readable;
+
+    let directory = std::env::temp_dir().join( format!( "bytehound-test-repack-chunks-{}", std::process::id() ) );
+    std::fs::create_dir_all( &directory ).unwrap();
+    let input_path = directory.join( "input.dat" );
+    let output_path = directory.join( "output.dat" );
+
+    let events: Vec< _ > = (0..100000).map( |nth| Event::FreeEx {
+        id: AllocationId { thread: 1, allocation: nth },
+        timestamp: Timestamp::from_usecs( nth ),
+        pointer: nth * 16,
+        backtrace: 0,
+        thread: 1
+    }).collect();
+
+    {
+        let mut fp = Lz4Writer::new( std::fs::File::create( &input_path ).unwrap() );
+        for event in &events {
+            event.write_to_stream( &mut fp ).unwrap();
+            // Make plenty of small chunks.
+            if let Event::FreeEx { pointer, .. } = event {
+                if pointer % (16 * 100) == 0 {
+                    fp.flush().unwrap();
+                }
+            }
+        }
+    }
+
+    let read_all = |path: &std::path::Path| -> Vec< Event< 'static > > {
+        let fp = std::fs::File::open( path ).unwrap();
+        let mut fp = crate::threaded_lz4_stream::Lz4Reader::new( fp );
+        let mut output = Vec::new();
+        while let Ok( event ) = Event::read_from_stream_unbuffered( &mut fp ) {
+            output.push( event );
+        }
+        output
+    };
+
+    let input_size = std::fs::metadata( &input_path ).unwrap().len();
+    for &(disable_compression, zstd, chunk_size) in &[(true, None, None), (false, None, Some( CHUNK_SIZE )), (false, Some( 3 ), Some( 64 * 1024 ))] {
+        let ifp = std::fs::File::open( &input_path ).unwrap();
+        let ofp = std::fs::File::create( &output_path ).unwrap();
+        repack_chunks( disable_compression, 0, zstd, false, chunk_size, ifp, ofp ).unwrap();
+        assert_eq!( read_all( &output_path ), events );
+
+        let output_size = std::fs::metadata( &output_path ).unwrap().len();
+        if chunk_size.is_some() {
+            assert!( output_size < input_size );
+        }
+    }
+
+    let _ = std::fs::remove_dir_all( &directory );
+}
@@ -0,0 +1,316 @@
+use std::iter::FromIterator;
+
+use rayon::prelude::*;
+
+/// Containers with more elements than this are stored as bitmaps.
+const ARRAY_LIMIT: usize = 4096;
+
+const BITMAP_WORDS: usize = (1 << 16) / 64;
+
+#[derive(Clone, PartialEq, Eq, Debug)]
+enum Container {
+    /// A sorted list of the low 16 bits of every index.
+    Array( Vec< u16 > ),
+    /// A bitmap with a bit for every possible value of the low 16 bits.
+    Bitmap( Box< [u64; BITMAP_WORDS] > )
+}
+
+fn array_to_words( array: &[u16] ) -> Box< [u64; BITMAP_WORDS] > {
+    let mut words = Box::new( [0; BITMAP_WORDS] );
+    for &low in array {
+        words[ low as usize / 64 ] |= 1 << (low % 64);
+    }
+
+    words
+}
+
+impl Container {
+    fn from_sorted( lows: &[u16] ) -> Self {
+        if lows.len() > ARRAY_LIMIT {
+            Container::Bitmap( array_to_words( lows ) )
+        } else {
+            Container::Array( lows.to_vec() )
+        }
+    }
+
+    /// Picks the cheaper representation, or returns `None` if the container is empty.
+    fn from_words( words: Box< [u64; BITMAP_WORDS] > ) -> Option< Self > {
+        let count: usize = words.iter().map( |word| word.count_ones() as usize ).sum();
+        if count == 0 {
+            None
+        } else if count <= ARRAY_LIMIT {
+            Some( Container::Array( Container::Bitmap( words ).iter().collect() ) )
+        } else {
+            Some( Container::Bitmap( words ) )
+        }
+    }
+
+    fn len( &self ) -> usize {
+        match *self {
+            Container::Array( ref array ) => array.len(),
+            Container::Bitmap( ref words ) => words.iter().map( |word| word.count_ones() as usize ).sum()
+        }
+    }
+
+    #[inline]
+    fn contains( &self, low: u16 ) -> bool {
+        match *self {
+            Container::Array( ref array ) => array.binary_search( &low ).is_ok(),
+            Container::Bitmap( ref words ) => words[ low as usize / 64 ] & (1 << (low % 64)) != 0
+        }
+    }
+
+    fn to_words( &self ) -> Box< [u64; BITMAP_WORDS] > {
+        match *self {
+            Container::Array( ref array ) => array_to_words( array ),
+            Container::Bitmap( ref words ) => words.clone()
+        }
+    }
+
+    fn iter< 'a >( &'a self ) -> Box< dyn Iterator< Item = u16 > + 'a > {
+        match *self {
+            Container::Array( ref array ) => Box::new( array.iter().copied() ),
+            Container::Bitmap( ref words ) => Box::new( words.iter().enumerate().flat_map( |(word_index, &word)| {
+                let mut word = word;
+                std::iter::from_fn( move || {
+                    if word == 0 {
+                        return None;
+                    }
+
+                    let bit = word.trailing_zeros() as usize;
+                    word &= word - 1;
+                    Some( (word_index * 64 + bit) as u16 )
+                })
+            }))
+        }
+    }
+
+    fn combine_words( &self, rhs: &Container, callback: impl Fn( u64, u64 ) -> u64 ) -> Option< Container > {
+        let mut words = self.to_words();
+        let rhs_words = rhs.to_words();
+        for (lhs, &rhs) in words.iter_mut().zip( rhs_words.iter() ) {
+            *lhs = callback( *lhs, rhs );
+        }
+
+        Container::from_words( words )
+    }
+
+    fn union( &self, rhs: &Container ) -> Option< Container > {
+        match (self, rhs) {
+            (&Container::Array( ref lhs ), &Container::Array( ref rhs )) if lhs.len() + rhs.len() <= ARRAY_LIMIT => {
+                let mut output = Vec::with_capacity( lhs.len() + rhs.len() );
+                let (mut lhs, mut rhs) = (lhs.as_slice(), rhs.as_slice());
+                while let (Some( &a ), Some( &b )) = (lhs.first(), rhs.first()) {
+                    output.push( std::cmp::min( a, b ) );
+                    if a <= b {
+                        lhs = &lhs[ 1.. ];
+                    }
+                    if b <= a {
+                        rhs = &rhs[ 1.. ];
+                    }
+                }
+
+                output.extend_from_slice( lhs );
+                output.extend_from_slice( rhs );
+                Some( Container::Array( output ) )
+            },
+            _ => self.combine_words( rhs, |lhs, rhs| lhs | rhs )
+        }
+    }
+
+    fn intersection( &self, rhs: &Container ) -> Option< Container > {
+        match (self, rhs) {
+            (&Container::Array( ref array ), other) | (other, &Container::Array( ref array )) => {
+                let output: Vec< _ > = array.iter().copied().filter( |&low| other.contains( low ) ).collect();
+                if output.is_empty() {
+                    None
+                } else {
+                    Some( Container::Array( output ) )
+                }
+            },
+            _ => self.combine_words( rhs, |lhs, rhs| lhs & rhs )
+        }
+    }
+
+    fn difference( &self, rhs: &Container ) -> Option< Container > {
+        match *self {
+            Container::Array( ref array ) => {
+                let output: Vec< _ > = array.iter().copied().filter( |&low| !rhs.contains( low ) ).collect();
+                if output.is_empty() {
+                    None
+                } else {
+                    Some( Container::Array( output ) )
+                }
+            },
+            Container::Bitmap( _ ) => self.combine_words( rhs, |lhs, rhs| lhs & !rhs )
+        }
+    }
+}
+
+/// A compressed set of indexes.
+///
+/// The indexes are split into chunks of 65536 by their high bits; every chunk is then
+/// either stored as a sorted list of the low bits if it's sparse, or as a bitmap if it's dense.
+/// This takes at most two bytes per index and usually a lot less for dense sets, while still
+/// allowing the set operations to process whole words at a time.
+#[derive(Clone, PartialEq, Eq, Debug, Default)]
+pub struct RoaringBitmap {
+    containers: Vec< (usize, Container) >
+}
+
+impl RoaringBitmap {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn from_unsorted( mut indexes: Vec< usize > ) -> Self {
+        indexes.par_sort_unstable();
+        indexes.dedup();
+
+        let mut containers = Vec::new();
+        let mut lows = Vec::new();
+        let mut position = 0;
+        while position < indexes.len() {
+            let key = indexes[ position ] >> 16;
+            lows.clear();
+            while position < indexes.len() && indexes[ position ] >> 16 == key {
+                lows.push( indexes[ position ] as u16 );
+                position += 1;
+            }
+
+            containers.push( (key, Container::from_sorted( &lows )) );
+        }
+
+        RoaringBitmap { containers }
+    }
+
+    pub fn len( &self ) -> usize {
+        self.containers.iter().map( |(_, container)| container.len() ).sum()
+    }
+
+    pub fn is_empty( &self ) -> bool {
+        self.containers.is_empty()
+    }
+
+    #[inline]
+    pub fn contains( &self, index: usize ) -> bool {
+        match self.containers.binary_search_by_key( &(index >> 16), |&(key, _)| key ) {
+            Ok( position ) => self.containers[ position ].1.contains( index as u16 ),
+            Err( _ ) => false
+        }
+    }
+
+    pub fn iter< 'a >( &'a self ) -> impl Iterator< Item = usize > + 'a {
+        self.containers.iter().flat_map( |&(key, ref container)| {
+            container.iter().map( move |low| key << 16 | low as usize )
+        })
+    }
+
+    fn merge(
+        &self,
+        rhs: &RoaringBitmap,
+        keep_lhs_only: bool,
+        keep_rhs_only: bool,
+        combine: impl Fn( &Container, &Container ) -> Option< Container >
+    ) -> RoaringBitmap {
+        let mut containers = Vec::new();
+        let mut lhs = self.containers.iter().peekable();
+        let mut rhs = rhs.containers.iter().peekable();
+        loop {
+            let (lhs_key, rhs_key) = match (lhs.peek(), rhs.peek()) {
+                (None, None) => break,
+                (Some( &&(key, _) ), None) => (Some( key ), None),
+                (None, Some( &&(key, _) )) => (None, Some( key )),
+                (Some( &&(lhs_key, _) ), Some( &&(rhs_key, _) )) => (Some( lhs_key ), Some( rhs_key ))
+            };
+
+            match (lhs_key, rhs_key) {
+                (Some( lhs_key ), Some( rhs_key )) if lhs_key == rhs_key => {
+                    let lhs_container = &lhs.next().unwrap().1;
+                    let rhs_container = &rhs.next().unwrap().1;
+                    if let Some( container ) = combine( lhs_container, rhs_container ) {
+                        containers.push( (lhs_key, container) );
+                    }
+                },
+                (Some( lhs_key ), rhs_key) if rhs_key.map( |rhs_key| lhs_key < rhs_key ).unwrap_or( true ) => {
+                    let entry = lhs.next().unwrap();
+                    if keep_lhs_only {
+                        containers.push( entry.clone() );
+                    }
+                },
+                _ => {
+                    let entry = rhs.next().unwrap();
+                    if keep_rhs_only {
+                        containers.push( entry.clone() );
+                    }
+                }
+            }
+        }
+
+        RoaringBitmap { containers }
+    }
+
+    pub fn union( &self, rhs: &RoaringBitmap ) -> RoaringBitmap {
+        self.merge( rhs, true, true, Container::union )
+    }
+
+    pub fn intersection( &self, rhs: &RoaringBitmap ) -> RoaringBitmap {
+        self.merge( rhs, false, false, Container::intersection )
+    }
+
+    pub fn difference( &self, rhs: &RoaringBitmap ) -> RoaringBitmap {
+        self.merge( rhs, true, false, Container::difference )
+    }
+}
+
+impl FromIterator< usize > for RoaringBitmap {
+    fn from_iter< I: IntoIterator< Item = usize > >( iter: I ) -> Self {
+        RoaringBitmap::from_unsorted( iter.into_iter().collect() )
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::BTreeSet;
+    use super::RoaringBitmap;
+
+    fn spread( xs: Vec< u16 > ) -> Vec< usize > {
+        // Make sure we get both sparse and dense containers.
+        xs.into_iter().map( |x| if x % 2 == 0 { x as usize } else { (x as usize) * 37 % 200_000 } ).collect()
+    }
+
+    quickcheck! {
+        fn roaring_bitmap_set_operations_work( xs: Vec< u16 >, ys: Vec< u16 > ) -> bool {
+            let xs = spread( xs );
+            let ys = spread( ys );
+            let lhs: RoaringBitmap = xs.iter().copied().collect();
+            let rhs: RoaringBitmap = ys.iter().copied().collect();
+            let lhs_set: BTreeSet< _ > = xs.iter().copied().collect();
+            let rhs_set: BTreeSet< _ > = ys.iter().copied().collect();
+
+            lhs.iter().collect::< Vec< _ > >() == lhs_set.iter().copied().collect::< Vec< _ > >() &&
+            lhs.len() == lhs_set.len() &&
+            lhs.union( &rhs ).iter().collect::< Vec< _ > >() == lhs_set.union( &rhs_set ).copied().collect::< Vec< _ > >() &&
+            lhs.intersection( &rhs ).iter().collect::< Vec< _ > >() == lhs_set.intersection( &rhs_set ).copied().collect::< Vec< _ > >() &&
+            lhs.difference( &rhs ).iter().collect::< Vec< _ > >() == lhs_set.difference( &rhs_set ).copied().collect::< Vec< _ > >()
+        }
+    }
+
+    #[test]
+    fn test_roaring_bitmap_dense() {
+        let lhs: RoaringBitmap = (0..100_000).collect();
+        let rhs: RoaringBitmap = (50_000..150_000).filter( |x| x % 3 == 0 ).collect();
+
+        assert_eq!( lhs.len(), 100_000 );
+        assert!( lhs.contains( 65_536 ) );
+        assert!( !lhs.contains( 100_000 ) );
+        assert!( rhs.contains( 60_000 ) );
+        assert!( !rhs.contains( 60_001 ) );
+
+        assert_eq!( lhs.union( &rhs ).len(), 100_000 + (100_000..150_000).filter( |x| x % 3 == 0 ).count() );
+        assert_eq!( lhs.intersection( &rhs ).len(), (50_000..100_000).filter( |x| x % 3 == 0 ).count() );
+        assert_eq!( lhs.difference( &rhs ).len(), 100_000 - (50_000..100_000).filter( |x| x % 3 == 0 ).count() );
+        assert!( lhs.difference( &lhs ).is_empty() );
+        assert_eq!( lhs.intersection( &lhs ), lhs );
+    }
+}
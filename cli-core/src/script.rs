@@ -1,19 +1,26 @@
-use std::cell::Cell;
+use std::cell::{Cell, RefCell};
 use std::path::{Path, PathBuf};
 use std::fs::File;
+use std::rc::Rc;
 use std::sync::Arc;
 use std::sync::atomic::AtomicUsize;
 use std::fmt::Write;
 use ahash::AHashMap as HashMap;
 use ahash::AHashSet as HashSet;
+use lru::LruCache;
 use rayon::prelude::*;
 use parking_lot::Mutex;
 use regex::Regex;
-use crate::{AllocationId, BacktraceId, Data, Loader, MapId, Timestamp, UsageDelta};
+use crate::{AllocationId, BacktraceId, Data, LifetimeSketch, Loader, MapId, Timestamp, UsageDelta};
 use crate::data::OperationId;
 use crate::exporter_flamegraph_pl::dump_collation_from_iter;
-use crate::filter::{AllocationFilter, RawAllocationFilter, Duration, Filter, NumberOrFractionOfTotal, Compile, TryMatch, MapFilter, RawMapFilter};
-use crate::timeline::{build_allocation_timeline, build_map_timeline};
+use crate::size_classes::{RequestedSizes, SizeClassAllocator};
+use crate::allocator_simulation::AllocatorSimulation;
+use crate::allocation_rate::find_allocation_rates;
+use crate::filter::{AllocationFilter, RawAllocationFilter, Duration, Filter, NumberOrFractionOfTotal, Compile, TryMatchById, MapFilter, RawMapFilter};
+use crate::bitmap::Bitmap;
+use crate::roaring::RoaringBitmap;
+use crate::timeline::{build_allocation_timelines, build_map_timelines, build_simulated_timelines, timeline_granularity};
 
 pub use rhai;
 pub use crate::script_virtual::VirtualEnvironment;
@@ -148,6 +155,40 @@ impl DataRef {
             filter: None,
         }
     }
+
+    fn diff( &mut self, before: Duration, after: Duration ) -> rhai::Array {
+        let start = self.0.initial_timestamp;
+        let diffs = crate::snapshot_diff::diff_timestamps( &self.0, start + before.0, start + after.0 );
+        diffs_to_array( self, self, diffs )
+    }
+}
+
+fn diff_traces( before: DataRef, before_at: Duration, after: DataRef, after_at: Duration ) -> rhai::Array {
+    let diffs = crate::snapshot_diff::diff_traces(
+        &before.0,
+        before.0.initial_timestamp + before_at.0,
+        &after.0,
+        after.0.initial_timestamp + after_at.0
+    );
+
+    diffs_to_array( &before, &after, diffs )
+}
+
+fn diffs_to_array( before: &DataRef, after: &DataRef, diffs: Vec< crate::BacktraceDiff > ) -> rhai::Array {
+    diffs.into_iter().map( |diff| {
+        // The backtraces which only had something alive in the earlier snapshot come from the other trace.
+        let backtrace = match (diff.after, diff.before) {
+            (Some( id ), _) => Backtrace { data: after.clone(), id, strip: false },
+            (None, Some( id )) => Backtrace { data: before.clone(), id, strip: false },
+            (None, None) => unreachable!()
+        };
+
+        let mut map = rhai::Map::new();
+        map.insert( "backtrace".into(), rhai::Dynamic::from( backtrace ) );
+        map.insert( "count".into(), rhai::Dynamic::from( diff.count ) );
+        map.insert( "size".into(), rhai::Dynamic::from( diff.size ) );
+        rhai::Dynamic::from( map )
+    }).collect()
 }
 
 lazy_static::lazy_static! {
@@ -279,6 +320,123 @@ impl std::fmt::Debug for AllocationList {
     }
 }
 
+/// A property of the `TracedAllocation`.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+enum TracedProperty {
+    Size,
+    Address,
+    AllocatedAt,
+    Lifetime,
+    Marker,
+    ThreadTag
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+enum Comparison {
+    Less,
+    LessOrEqual,
+    Greater,
+    GreaterOrEqual,
+    Equal,
+    NotEqual
+}
+
+impl Comparison {
+    /// Returns the comparison which gives the same result with the operands swapped.
+    fn flipped( self ) -> Self {
+        match self {
+            Comparison::Less => Comparison::Greater,
+            Comparison::LessOrEqual => Comparison::GreaterOrEqual,
+            Comparison::Greater => Comparison::Less,
+            Comparison::GreaterOrEqual => Comparison::LessOrEqual,
+            Comparison::Equal => Comparison::Equal,
+            Comparison::NotEqual => Comparison::NotEqual
+        }
+    }
+}
+
+#[derive(Copy, Clone, Debug)]
+enum TracedValue {
+    Number( i64 ),
+    Duration( Duration )
+}
+
+/// What a callback which is being traced gets instead of an allocation.
+///
+/// Its properties don't have any values; comparing them to a constant builds a `TracedPredicate`
+/// instead, and those can only be combined with `&`, `|` and `!`. Anything else fails, and then the
+/// callback has to be called for every allocation.
+#[derive(Clone, Debug)]
+struct TracedAllocation;
+
+/// The native filter which a traced callback is equivalent to.
+#[derive(Clone, Debug)]
+struct TracedPredicate( AllocationFilter );
+
+fn untraceable() -> Box< rhai::EvalAltResult > {
+    Box::new( rhai::EvalAltResult::from( "the callback can't be turned into a native filter" ) )
+}
+
+fn traced_integer< T: std::convert::TryFrom< i64 > >( value: i64 ) -> Result< T, Box< rhai::EvalAltResult > > {
+    <T as std::convert::TryFrom< i64 >>::try_from( value ).map_err( |_| untraceable() )
+}
+
+fn set_traced_bound( filter: &mut RawAllocationFilter, property: TracedProperty, is_lower_bound: bool, value: TracedValue ) -> Result< (), Box< rhai::EvalAltResult > > {
+    let common = &mut filter.common_filter;
+    match (property, value) {
+        (TracedProperty::Size, TracedValue::Number( value )) => {
+            let value = traced_integer( value )?;
+            if is_lower_bound { common.only_larger_or_equal = Some( value ) } else { common.only_smaller_or_equal = Some( value ) }
+        },
+        (TracedProperty::Address, TracedValue::Number( value )) => {
+            let value = traced_integer( value )?;
+            if is_lower_bound { common.only_address_at_least = Some( value ) } else { common.only_address_at_most = Some( value ) }
+        },
+        (TracedProperty::AllocatedAt, TracedValue::Duration( value )) => {
+            if is_lower_bound { common.only_allocated_after_at_least = Some( value ) } else { common.only_allocated_until_at_most = Some( value ) }
+        },
+        (TracedProperty::Lifetime, TracedValue::Duration( value )) => {
+            if is_lower_bound { common.only_alive_for_at_least = Some( value ) } else { common.only_alive_for_at_most = Some( value ) }
+        },
+        _ => return Err( untraceable() )
+    }
+
+    Ok(())
+}
+
+fn traced_comparison( property: TracedProperty, comparison: Comparison, value: TracedValue ) -> Result< TracedPredicate, Box< rhai::EvalAltResult > > {
+    let bound = |is_lower_bound: bool| -> Result< AllocationFilter, Box< rhai::EvalAltResult > > {
+        let mut filter = RawAllocationFilter::default();
+        set_traced_bound( &mut filter, property, is_lower_bound, value )?;
+        Ok( Filter::Basic( filter ) )
+    };
+
+    let equal = || -> Result< AllocationFilter, Box< rhai::EvalAltResult > > {
+        let mut filter = RawAllocationFilter::default();
+        match (property, value) {
+            (TracedProperty::Marker, TracedValue::Number( value )) => filter.only_with_marker = Some( traced_integer( value )? ),
+            (TracedProperty::ThreadTag, TracedValue::Number( value )) => filter.only_with_thread_tag = Some( traced_integer( value )? ),
+            _ => {
+                set_traced_bound( &mut filter, property, true, value )?;
+                set_traced_bound( &mut filter, property, false, value )?;
+            }
+        }
+        Ok( Filter::Basic( filter ) )
+    };
+
+    // The strict comparisons are the negations of the inclusive ones, which works the same for the integers and the durations.
+    let filter = match comparison {
+        Comparison::GreaterOrEqual => bound( true )?,
+        Comparison::LessOrEqual => bound( false )?,
+        Comparison::Greater => Filter::Not( Box::new( bound( false )? ) ),
+        Comparison::Less => Filter::Not( Box::new( bound( true )? ) ),
+        Comparison::Equal => equal()?,
+        Comparison::NotEqual => Filter::Not( Box::new( equal()? ) )
+    };
+
+    Ok( TracedPredicate( filter ) )
+}
+
 #[derive(Clone)]
 pub struct Map {
     data: DataRef,
@@ -395,6 +553,39 @@ fn test_expand_datapoints() {
     );
 }
 
+#[test]
+fn test_traced_comparison() {
+    let size = |comparison, value| traced_comparison( TracedProperty::Size, comparison, TracedValue::Number( value ) ).map( |predicate| predicate.0 );
+    match size( Comparison::GreaterOrEqual, 10 ) {
+        Ok( Filter::Basic( filter ) ) => {
+            assert_eq!( filter.common_filter.only_larger_or_equal, Some( 10 ) );
+            assert_eq!( filter.common_filter.only_smaller_or_equal, None );
+        },
+        _ => panic!()
+    }
+
+    match size( Comparison::Greater.flipped(), 10 ) {
+        Ok( Filter::Not( filter ) ) => match *filter {
+            Filter::Basic( filter ) => assert_eq!( filter.common_filter.only_larger_or_equal, Some( 10 ) ),
+            _ => panic!()
+        },
+        _ => panic!()
+    }
+
+    match size( Comparison::Equal, 10 ) {
+        Ok( Filter::Basic( filter ) ) => {
+            assert_eq!( filter.common_filter.only_larger_or_equal, Some( 10 ) );
+            assert_eq!( filter.common_filter.only_smaller_or_equal, Some( 10 ) );
+        },
+        _ => panic!()
+    }
+
+    assert!( size( Comparison::GreaterOrEqual, -1 ).is_err() );
+    assert!( traced_comparison( TracedProperty::Size, Comparison::Less, TracedValue::Duration( Duration::from_secs( 1 ) ) ).is_err() );
+    assert!( traced_comparison( TracedProperty::Marker, Comparison::Less, TracedValue::Number( 1 ) ).is_err() );
+    assert!( traced_comparison( TracedProperty::Marker, Comparison::NotEqual, TracedValue::Number( 1 ) ).is_ok() );
+}
+
 #[derive(Copy, Clone, PartialEq, Eq)]
 enum OpFilter {
     Both,
@@ -411,15 +602,35 @@ fn get_timestamp( data: &Data, op: OperationId ) -> common::Timestamp {
 }
 
 fn filtered_ids< 'a, T >( list: &'a T ) -> impl ParallelIterator< Item = <T as List>::Id > + 'a where T: List + Send + Sync {
-    let filter = list.filter_ref().map( |filter| filter.compile( list.data_ref() ) );
-    list.unfiltered_ids_par_iter().filter( move |&id| {
-        let allocation = list.get_native_item( id );
-        if let Some( ref filter ) = filter {
-            filter.try_match( list.data_ref(), allocation )
+    // Evaluating the filter for everything at once only pays off if we're not going to throw most of it out.
+    let total_count = T::default_unfiltered_ids( list.data_ref() ).len();
+    let selection = list.filter_ref()
+        .filter( |_| list.unfiltered_ids().len() >= total_count / 8 )
+        .and_then( |filter| list.select( filter ) );
+
+    // If only a few items were selected then putting them in order is cheaper than going through everything.
+    if let Some( ref selection ) = selection {
+        if list.unfiltered_ids_ref().is_none() && selection.count_ones() < total_count / 64 {
+            let ids = T::ids_in_default_order( list.data_ref(), selection );
+            return rayon::iter::Either::Left( ids.into_par_iter() );
+        }
+    }
+
+    let filter = if selection.is_none() {
+        list.filter_ref().map( |filter| filter.compile( list.data_ref() ) )
+    } else {
+        None
+    };
+
+    rayon::iter::Either::Right( list.unfiltered_ids_par_iter().filter( move |&id| {
+        if let Some( ref selection ) = selection {
+            selection.contains( T::index_of( id ) )
+        } else if let Some( ref filter ) = filter {
+            list.try_match( filter, id )
         } else {
             true
         }
-    })
+    }))
 }
 
 trait List: Sized + Send + Sync {
@@ -436,8 +647,12 @@ trait List: Sized + Send + Sync {
     fn data_ref( &self ) -> &DataRef;
     fn filter_ref( &self ) -> Option< &Filter< Self::RawFilter > >;
     fn unfiltered_ids_ref( &self ) -> Option< &Arc< Vec< Self::Id > > >;
-    fn get_native_item( &self, id: Self::Id ) -> &<<Self::RawFilter as Compile>::Compiled as TryMatch>::Item;
+    fn try_match( &self, filter: &Filter< <Self::RawFilter as Compile>::Compiled >, id: Self::Id ) -> bool;
+    fn select( &self, filter: &Filter< Self::RawFilter > ) -> Option< Arc< Bitmap > >;
+    fn index_of( id: Self::Id ) -> usize;
     fn default_unfiltered_ids( data: &Data ) -> &[Self::Id];
+    /// Returns the selected items in the same order as they are in `default_unfiltered_ids`.
+    fn ids_in_default_order( data: &Data, selection: &Bitmap ) -> Vec< Self::Id >;
     fn list_by_backtrace( data: &Data, backtrace: BacktraceId ) -> Vec< Self::Id >;
 
     fn unfiltered_ids( &self ) -> &[Self::Id] {
@@ -452,6 +667,11 @@ trait List: Sized + Send + Sync {
         self.unfiltered_ids().par_iter().copied()
     }
 
+    /// Returns a compact set of the indexes of all of the unfiltered items, for use in set operations.
+    fn id_set( &self ) -> RoaringBitmap {
+        self.unfiltered_ids_iter().map( Self::index_of ).collect()
+    }
+
     fn len( &mut self ) -> i64 {
         self.apply_filter();
         self.unfiltered_ids().len() as i64
@@ -488,6 +708,15 @@ trait List: Sized + Send + Sync {
         self.add_filter_once( |_| false, callback )
     }
 
+    fn add_compound_filter( &self, filter: Filter< Self::RawFilter > ) -> Self {
+        let filter = match self.filter_ref() {
+            None => filter,
+            Some( old_filter ) => Filter::And( Box::new( old_filter.clone() ), Box::new( filter ) )
+        };
+
+        self.clone_with_filter( Some( filter ) )
+    }
+
     fn add_filter_once( &self, is_filled: impl FnOnce( &Self::RawFilter ) -> bool, callback: impl FnOnce( &mut Self::RawFilter ) ) -> Self {
         let filter = match self.filter_ref() {
             None => {
@@ -547,11 +776,8 @@ trait List: Sized + Send + Sync {
             lhs.apply_filter();
             rhs.apply_filter();
 
-            let mut set: HashSet< Self::Id > = HashSet::new();
-            set.extend( lhs.unfiltered_ids_iter() );
-            set.extend( rhs.unfiltered_ids_iter() );
-
-            let ids: Vec< _ > = Self::create( lhs.data_ref().clone(), None, None ).unfiltered_ids_par_iter().filter( |id| set.contains( &id ) ).collect();
+            let set = lhs.id_set().union( &rhs.id_set() );
+            let ids: Vec< _ > = Self::create( lhs.data_ref().clone(), None, None ).unfiltered_ids_par_iter().filter( |&id| set.contains( Self::index_of( id ) ) ).collect();
             Ok( Self::create(
                 lhs.data_ref().clone(),
                 Some( Arc::new( ids ) ),
@@ -593,10 +819,8 @@ trait List: Sized + Send + Sync {
         } else {
             rhs.apply_filter();
 
-            let mut set: HashSet< Self::Id > = HashSet::new();
-            set.extend( rhs.unfiltered_ids_iter() );
-
-            let ids: Vec< _ > = filtered_ids( &lhs ).filter( |id| !set.contains( id ) ).collect();
+            let set = rhs.id_set();
+            let ids: Vec< _ > = filtered_ids( &lhs ).filter( |&id| !set.contains( Self::index_of( id ) ) ).collect();
             Ok( Self::create(
                 lhs.data_ref().clone(),
                 Some( Arc::new( ids ) ),
@@ -622,10 +846,8 @@ trait List: Sized + Send + Sync {
         } else {
             rhs.apply_filter();
 
-            let mut set: HashSet< Self::Id > = HashSet::new();
-            set.extend( rhs.unfiltered_ids_iter() );
-
-            let ids: Vec< _ > = filtered_ids( &lhs ).filter( |id| set.contains( id ) ).collect();
+            let set = rhs.id_set();
+            let ids: Vec< _ > = filtered_ids( &lhs ).filter( |&id| set.contains( Self::index_of( id ) ) ).collect();
             Ok( Self::create(
                 lhs.data_ref().clone(),
                 Some( Arc::new( ids ) ),
@@ -678,14 +900,27 @@ impl List for MapList {
         self.map_ids.as_ref()
     }
 
-    fn get_native_item( &self, id: Self::Id ) -> &<<Self::RawFilter as Compile>::Compiled as TryMatch>::Item {
-        &self.data.0.maps()[ id.0 as usize ]
+    fn try_match( &self, filter: &Filter< <Self::RawFilter as Compile>::Compiled >, id: Self::Id ) -> bool {
+        filter.try_match_by_id( &self.data, id )
+    }
+
+    fn select( &self, _: &Filter< Self::RawFilter > ) -> Option< Arc< Bitmap > > {
+        // There are usually very few maps, so this wouldn't be any faster than matching them one by one.
+        None
+    }
+
+    fn index_of( id: Self::Id ) -> usize {
+        id.raw() as usize
     }
 
     fn default_unfiltered_ids( data: &Data ) -> &[Self::Id] {
         &data.map_ids
     }
 
+    fn ids_in_default_order( _: &Data, selection: &Bitmap ) -> Vec< Self::Id > {
+        selection.iter().map( |index| MapId( index as u64 ) ).collect()
+    }
+
     fn list_by_backtrace( data: &Data, backtrace: BacktraceId ) -> Vec< Self::Id > {
         // TODO: Cache this.
         data.maps().iter().enumerate().filter( |(_, map)| map.source.map( |source| source.backtrace == backtrace ).unwrap_or( false ) ).map( |(index, _)| MapId( index as u64 ) ).collect()
@@ -728,14 +963,29 @@ impl List for AllocationList {
         self.allocation_ids.as_ref()
     }
 
-    fn get_native_item( &self, id: Self::Id ) -> &<<Self::RawFilter as Compile>::Compiled as TryMatch>::Item {
-        self.data.get_allocation( id )
+    fn try_match( &self, filter: &Filter< <Self::RawFilter as Compile>::Compiled >, id: Self::Id ) -> bool {
+        filter.try_match_by_id( &self.data, id )
+    }
+
+    fn select( &self, filter: &Filter< Self::RawFilter > ) -> Option< Arc< Bitmap > > {
+        Some( filter.select_cached( &self.data ) )
+    }
+
+    fn index_of( id: Self::Id ) -> usize {
+        id.raw() as usize
     }
 
     fn default_unfiltered_ids( data: &Data ) -> &[Self::Id] {
         &data.sorted_by_timestamp
     }
 
+    fn ids_in_default_order( data: &Data, selection: &Bitmap ) -> Vec< Self::Id > {
+        let timestamps = &data.allocation_columns.timestamps;
+        let mut ids: Vec< _ > = selection.iter().map( |index| AllocationId::new( index as _ ) ).collect();
+        ids.par_sort_unstable_by_key( |id| (timestamps[ id.raw() as usize ], *id) );
+        ids
+    }
+
     fn list_by_backtrace( data: &Data, id: BacktraceId ) -> Vec< Self::Id > {
         data.get_allocation_ids_by_backtrace( id ).to_owned()
     }
@@ -764,7 +1014,7 @@ impl AllocationList {
         lines.sort_unstable();
 
         let mut output = String::new();
-        crate::exporter_flamegraph::lines_to_svg( lines, &mut output );
+        crate::exporter_flamegraph::lines_to_svg( lines.iter().map( |line| line.as_str() ), &mut output );
 
         Ok( output )
     }
@@ -803,30 +1053,272 @@ impl AllocationList {
     }
 
     fn group_by_backtrace( &mut self ) -> AllocationGroupList {
-        #[derive(Default)]
-        struct Group {
-            allocation_ids: Vec< AllocationId >,
-            size: u64
+        self.apply_filter();
+        let grouped = self.data.group_by_backtrace( self.unfiltered_ids() );
+        let sizes = &self.data.allocation_columns.sizes;
+        let groups = grouped.par_iter().map( |(_, allocation_ids)| {
+            AllocationGroupInner {
+                allocation_ids: Arc::new( allocation_ids.to_owned() ),
+                size: allocation_ids.iter().map( |id| sizes[ id.raw() as usize ] ).sum()
+            }
+        }).collect();
+
+        AllocationGroupList {
+            data: self.data.clone(),
+            groups: Arc::new( groups )
         }
+    }
 
+    fn co_located_pairs( &mut self, line_size: u64 ) -> rhai::Array {
         self.apply_filter();
-        let mut groups = HashMap::new();
-        for id in self.unfiltered_ids_iter() {
-            let allocation = self.data.get_allocation( id );
-            let group = groups.entry( allocation.backtrace ).or_insert_with( || Group::default() );
-            group.size += allocation.size;
-            group.allocation_ids.push( id );
+        let pairs = crate::false_sharing::find_co_located_allocations( &self.data, self.unfiltered_ids(), line_size );
+        pairs.into_iter().map( |pair| {
+            let backtrace = |id| Backtrace { data: self.data.clone(), id, strip: false };
+            let mut map = rhai::Map::new();
+            map.insert( "backtrace_1".into(), rhai::Dynamic::from( backtrace( pair.backtraces.0 ) ) );
+            map.insert( "backtrace_2".into(), rhai::Dynamic::from( backtrace( pair.backtraces.1 ) ) );
+            map.insert( "count".into(), rhai::Dynamic::from( pair.count as i64 ) );
+            map.insert( "overlap".into(), rhai::Dynamic::from( pair.overlap ) );
+            map.insert( "allocations".into(), rhai::Dynamic::from( AllocationList {
+                data: self.data.clone(),
+                allocation_ids: Some( Arc::new( pair.allocation_ids ) ),
+                filter: None
+            }));
+            rhai::Dynamic::from( map )
+        }).collect()
+    }
+
+    fn heap_retention( &mut self ) -> Result< rhai::Array, Box< rhai::EvalAltResult > > {
+        let data = self.data.clone();
+        let dump = data.memory_dumps().last().ok_or_else( || error( "the data doesn't contain any memory dumps" ) )?;
+        self.apply_filter();
+        let retention = crate::heap_graph::find_heap_retention( &data, self.unfiltered_ids(), dump );
+        let array = retention.into_iter().map( |entry| {
+            let mut map = rhai::Map::new();
+            map.insert( "backtrace".into(), rhai::Dynamic::from( Backtrace { data: self.data.clone(), id: entry.backtrace, strip: false } ) );
+            map.insert( "count".into(), rhai::Dynamic::from( entry.count as i64 ) );
+            map.insert( "size".into(), rhai::Dynamic::from( entry.size as i64 ) );
+            map.insert( "retained_size".into(), rhai::Dynamic::from( entry.retained_size as i64 ) );
+            map.insert( "unreachable_count".into(), rhai::Dynamic::from( entry.unreachable_count as i64 ) );
+            map.insert( "unreachable_size".into(), rhai::Dynamic::from( entry.unreachable_size as i64 ) );
+            map.insert( "allocations".into(), rhai::Dynamic::from( AllocationList {
+                data: self.data.clone(),
+                allocation_ids: Some( Arc::new( entry.allocation_ids ) ),
+                filter: None
+            }));
+            rhai::Dynamic::from( map )
+        }).collect();
+
+        Ok( array )
+    }
+
+    fn duplicates( &mut self ) -> Result< rhai::Array, Box< rhai::EvalAltResult > > {
+        let data = self.data.clone();
+        let dump = data.memory_dumps().last().ok_or_else( || error( "the data doesn't contain any memory dumps" ) )?;
+        self.apply_filter();
+        let groups = crate::duplicates::find_duplicates( &data, self.unfiltered_ids(), dump );
+        let array = groups.into_iter().map( |group| {
+            let backtraces: rhai::Array = group.backtraces.into_iter().map( |(id, count)| {
+                let mut map = rhai::Map::new();
+                map.insert( "backtrace".into(), rhai::Dynamic::from( Backtrace { data: self.data.clone(), id, strip: false } ) );
+                map.insert( "count".into(), rhai::Dynamic::from( count as i64 ) );
+                rhai::Dynamic::from( map )
+            }).collect();
+
+            let mut map = rhai::Map::new();
+            map.insert( "size".into(), rhai::Dynamic::from( group.size as i64 ) );
+            map.insert( "count".into(), rhai::Dynamic::from( group.count as i64 ) );
+            map.insert( "wasted_size".into(), rhai::Dynamic::from( group.wasted_size as i64 ) );
+            map.insert( "backtraces".into(), rhai::Dynamic::from( backtraces ) );
+            map.insert( "allocations".into(), rhai::Dynamic::from( AllocationList {
+                data: self.data.clone(),
+                allocation_ids: Some( Arc::new( group.allocation_ids ) ),
+                filter: None
+            }));
+            rhai::Dynamic::from( map )
+        }).collect();
+
+        Ok( array )
+    }
+
+    fn cross_thread_frees( &mut self ) -> rhai::Array {
+        let data = self.data.clone();
+        self.apply_filter();
+        let frees = crate::cross_thread::find_cross_thread_frees( &data, self.unfiltered_ids() );
+        let thread = |id| {
+            let mut map = rhai::Map::new();
+            map.insert( "id".into(), rhai::Dynamic::from( id as i64 ) );
+            map.insert( "name".into(), data.thread_name( id ).map( |name| rhai::Dynamic::from( name.to_owned() ) ).unwrap_or( rhai::Dynamic::UNIT ) );
+            rhai::Dynamic::from( map )
+        };
+
+        frees.into_iter().map( |entry| {
+            let handoffs: rhai::Array = entry.handoffs.iter().map( |handoff| {
+                let mut map = rhai::Map::new();
+                map.insert( "allocating_thread".into(), thread( handoff.allocating_thread ) );
+                map.insert( "deallocating_thread".into(), thread( handoff.deallocating_thread ) );
+                map.insert( "count".into(), rhai::Dynamic::from( handoff.count as i64 ) );
+                map.insert( "size".into(), rhai::Dynamic::from( handoff.size as i64 ) );
+                map.insert( "mean_latency".into(), rhai::Dynamic::from( Duration( handoff.mean_latency() ) ) );
+                map.insert( "max_latency".into(), rhai::Dynamic::from( Duration( handoff.max_latency ) ) );
+                rhai::Dynamic::from( map )
+            }).collect();
+
+            let mut map = rhai::Map::new();
+            map.insert( "backtrace".into(), rhai::Dynamic::from( Backtrace { data: self.data.clone(), id: entry.backtrace, strip: false } ) );
+            map.insert( "freed_count".into(), rhai::Dynamic::from( entry.freed_count as i64 ) );
+            map.insert( "count".into(), rhai::Dynamic::from( entry.count as i64 ) );
+            map.insert( "size".into(), rhai::Dynamic::from( entry.size as i64 ) );
+            map.insert( "ratio".into(), rhai::Dynamic::from( entry.ratio() ) );
+            map.insert( "latency_p50".into(), rhai::Dynamic::from( Duration( entry.latency_p50 ) ) );
+            map.insert( "max_latency".into(), rhai::Dynamic::from( Duration( entry.max_latency ) ) );
+            map.insert( "handoffs".into(), rhai::Dynamic::from( handoffs ) );
+            rhai::Dynamic::from( map )
+        }).collect()
+    }
+
+    fn size_classes( &mut self, allocator: String ) -> Result< rhai::Array, Box< rhai::EvalAltResult > > {
+        let allocator = parse_size_class_allocator( &allocator )?;
+        self.apply_filter();
+        let histogram = RequestedSizes::new( &self.data, self.unfiltered_ids() ).histogram( allocator );
+        let array = histogram.size_classes.into_iter().map( |size_class| {
+            let optional = |value: Option< u64 >| value.map( |value| rhai::Dynamic::from( value as i64 ) ).unwrap_or( rhai::Dynamic::UNIT );
+            let mut map = rhai::Map::new();
+            map.insert( "size_class".into(), rhai::Dynamic::from( size_class.size_class as i64 ) );
+            map.insert( "count".into(), rhai::Dynamic::from( size_class.count as i64 ) );
+            map.insert( "requested".into(), rhai::Dynamic::from( size_class.requested as i64 ) );
+            map.insert( "slack".into(), rhai::Dynamic::from( size_class.slack() as i64 ) );
+            map.insert( "min_requested_size".into(), rhai::Dynamic::from( size_class.min_requested_size as i64 ) );
+            map.insert( "max_requested_size".into(), rhai::Dynamic::from( size_class.max_requested_size as i64 ) );
+            map.insert( "previous_size_class".into(), optional( size_class.previous_size_class ) );
+            map.insert( "trim_by".into(), optional( size_class.trim_by() ) );
+            map.insert( "savings_if_trimmed".into(), rhai::Dynamic::from( size_class.savings_if_trimmed() as i64 ) );
+            rhai::Dynamic::from( map )
+        }).collect();
+
+        Ok( array )
+    }
+
+    fn simulate_allocator( &mut self, allocator: String ) -> Result< rhai::Map, Box< rhai::EvalAltResult > > {
+        let allocator = parse_size_class_allocator( &allocator )?;
+        let ops = self.filtered_ops( |_| OpFilter::Both );
+        let simulation = AllocatorSimulation::new( &self.data, &ops, allocator );
+
+        let mut map = rhai::Map::new();
+        map.insert( "allocator".into(), rhai::Dynamic::from( allocator.name().to_owned() ) );
+        map.insert( "peak_resident".into(), rhai::Dynamic::from( simulation.peak_resident as i64 ) );
+        map.insert( "peak_resident_at".into(), rhai::Dynamic::from( Duration( std::cmp::max( simulation.peak_resident_timestamp, self.data.initial_timestamp ) - self.data.initial_timestamp ) ) );
+        map.insert( "requested_at_peak".into(), rhai::Dynamic::from( simulation.requested_at_peak as i64 ) );
+        map.insert( "peak_requested".into(), rhai::Dynamic::from( simulation.peak_requested as i64 ) );
+        map.insert( "final_resident".into(), rhai::Dynamic::from( simulation.final_resident as i64 ) );
+        map.insert( "fragmentation_at_peak".into(), rhai::Dynamic::from( simulation.fragmentation_at_peak() ) );
+        map.insert( "average_fragmentation".into(), rhai::Dynamic::from( simulation.average_fragmentation ) );
+        Ok( map )
+    }
+
+    /// Keeps only the allocations for which the `callback` returns `true`.
+    ///
+    /// Most callbacks only compare a few properties to constants, so first we try to trace the callback
+    /// into an equivalent native filter; only when that fails is it called for every allocation.
+    fn filter_with_callback( &mut self, context: &rhai::NativeCallContext, callback: &rhai::FnPtr ) -> Result< Self, Box< rhai::EvalAltResult > > {
+        if let Ok( predicate ) = callback.call_within_context::< TracedPredicate >( context, (TracedAllocation,) ) {
+            return Ok( self.add_compound_filter( predicate.0 ) );
         }
 
-        AllocationGroupList {
-            data: self.data.clone(),
-            groups: Arc::new( groups.into_iter().map( |(_, group)| {
-                AllocationGroupInner {
-                    allocation_ids: Arc::new( group.allocation_ids ),
-                    size: group.size
-                }
-            }).collect() )
+        self.apply_filter();
+        let mut allocation_ids = Vec::new();
+        for &id in self.unfiltered_ids() {
+            let allocation = Allocation { data: self.data.clone(), id };
+            if callback.call_within_context::< bool >( context, (allocation,) )? {
+                allocation_ids.push( id );
+            }
         }
+
+        Ok( AllocationList {
+            data: self.data.clone(),
+            allocation_ids: Some( Arc::new( allocation_ids ) ),
+            filter: None
+        })
+    }
+
+    fn allocation_rates( &mut self, interval: Duration ) -> rhai::Array {
+        self.apply_filter();
+        let rates = find_allocation_rates( &self.data, self.unfiltered_ids(), interval.0 );
+        rates.rates.iter().map( |rate| {
+            let timeline: rhai::Array = rate.buckets.iter().map( |bucket| {
+                let mut map = rhai::Map::new();
+                map.insert( "timestamp".into(), rhai::Dynamic::from( Duration( rates.timestamp_of( bucket.index ) - rates.start ) ) );
+                map.insert( "count_per_second".into(), rhai::Dynamic::from( rates.per_second( bucket.count ) ) );
+                map.insert( "size_per_second".into(), rhai::Dynamic::from( rates.per_second( bucket.size ) ) );
+                rhai::Dynamic::from( map )
+            }).collect();
+
+            let culled_lifetimes: rhai::Array = rate.culled_lifetimes.iter().enumerate().map( |(index, &count)| {
+                let (min, max) = crate::CulledAllocations::lifetime_bucket_range( index );
+                let mut map = rhai::Map::new();
+                map.insert( "min_lifetime".into(), rhai::Dynamic::from( Duration( Timestamp::from_usecs( min ) ) ) );
+                map.insert( "max_lifetime".into(), rhai::Dynamic::from( Duration( Timestamp::from_usecs( max ) ) ) );
+                map.insert( "count".into(), rhai::Dynamic::from( count as i64 ) );
+                rhai::Dynamic::from( map )
+            }).collect();
+
+            let mut map = rhai::Map::new();
+            map.insert( "backtrace".into(), rhai::Dynamic::from( Backtrace { data: self.data.clone(), id: rate.backtrace, strip: false } ) );
+            map.insert( "count".into(), rhai::Dynamic::from( rate.count as i64 ) );
+            map.insert( "size".into(), rhai::Dynamic::from( rate.size as i64 ) );
+            map.insert( "culled_count".into(), rhai::Dynamic::from( rate.culled_count as i64 ) );
+            map.insert( "culled_size".into(), rhai::Dynamic::from( rate.culled_size as i64 ) );
+            map.insert( "culled_lifetimes".into(), rhai::Dynamic::from( culled_lifetimes ) );
+            map.insert( "peak_count_per_second".into(), rhai::Dynamic::from( rates.per_second( rate.peak_count() ) ) );
+            map.insert( "peak_size_per_second".into(), rhai::Dynamic::from( rates.per_second( rate.peak_size() ) ) );
+            map.insert( "timeline".into(), rhai::Dynamic::from( timeline ) );
+            rhai::Dynamic::from( map )
+        }).collect()
+    }
+
+    fn realloc_growth( &mut self ) -> rhai::Array {
+        self.apply_filter();
+        let entries = crate::realloc_growth::find_realloc_growth( &self.data, self.unfiltered_ids() );
+        entries.into_iter().map( |entry| {
+            let mut map = rhai::Map::new();
+            map.insert( "backtrace".into(), rhai::Dynamic::from( Backtrace { data: self.data.clone(), id: entry.backtrace, strip: false } ) );
+            map.insert( "chain_count".into(), rhai::Dynamic::from( entry.growth.chain_count as i64 ) );
+            map.insert( "reallocation_count".into(), rhai::Dynamic::from( entry.growth.reallocation_count as i64 ) );
+            map.insert( "small_step_count".into(), rhai::Dynamic::from( entry.growth.small_step_count as i64 ) );
+            map.insert( "moved_count".into(), rhai::Dynamic::from( entry.growth.moved_count as i64 ) );
+            map.insert( "bytes_copied".into(), rhai::Dynamic::from( entry.growth.bytes_copied as i64 ) );
+            map.insert( "peak_size".into(), rhai::Dynamic::from( entry.growth.peak_size as i64 ) );
+            map.insert( "copy_amplification".into(), rhai::Dynamic::from( entry.growth.copy_amplification() ) );
+            map.insert( "duration".into(), rhai::Dynamic::from( entry.duration() ) );
+            map.insert( "allocations".into(), rhai::Dynamic::from( AllocationList {
+                data: self.data.clone(),
+                allocation_ids: Some( Arc::new( entry.allocation_ids ) ),
+                filter: None
+            }));
+            rhai::Dynamic::from( map )
+        }).collect()
+    }
+
+    fn usage_by_thread_tag( &mut self ) -> rhai::Array {
+        self.apply_filter();
+        let usages = crate::thread_tags::usage_by_thread_tag( &self.data, self.unfiltered_ids() );
+        usages.into_iter().map( |usage| {
+            let mut map = rhai::Map::new();
+            map.insert( "tag".into(), rhai::Dynamic::from( usage.tag as i64 ) );
+            map.insert( "count".into(), rhai::Dynamic::from( usage.count as i64 ) );
+            map.insert( "size".into(), rhai::Dynamic::from( usage.size as i64 ) );
+            map.insert( "freed_count".into(), rhai::Dynamic::from( usage.freed_count as i64 ) );
+            map.insert( "freed_size".into(), rhai::Dynamic::from( usage.freed_size as i64 ) );
+            map.insert( "leaked_count".into(), rhai::Dynamic::from( usage.leaked_count() as i64 ) );
+            map.insert( "leaked_size".into(), rhai::Dynamic::from( usage.leaked_size() as i64 ) );
+            map.insert( "peak_size".into(), rhai::Dynamic::from( usage.peak_size as i64 ) );
+            map.insert( "allocations".into(), rhai::Dynamic::from( AllocationList {
+                data: self.data.clone(),
+                allocation_ids: Some( Arc::new( usage.allocation_ids ) ),
+                filter: None
+            }));
+            rhai::Dynamic::from( map )
+        }).collect()
     }
 }
 
@@ -843,6 +1335,29 @@ struct AllocationGroupInner {
     size: u64
 }
 
+impl AllocationGroupInner {
+    /// Estimates a quantile of the lifetimes of the deallocated allocations in the group.
+    ///
+    /// A group with every allocation of its backtrace uses the sketch built when loading, which also
+    /// has the culled allocations in it; only the groups which were filtered have to go through their allocations.
+    fn lifetime_quantile( &self, data: &Data, quantile: f64 ) -> Option< Timestamp > {
+        let backtrace = data.get_allocation( *self.allocation_ids.first()? ).backtrace;
+        if data.get_allocation_ids_by_backtrace( backtrace ).len() == self.allocation_ids.len() {
+            return data.get_group_statistics( backtrace ).lifetimes.quantile( quantile );
+        }
+
+        let mut sketch = LifetimeSketch::new();
+        for &id in self.allocation_ids.iter() {
+            let allocation = data.get_allocation( id );
+            if let Some( ref deallocation ) = allocation.deallocation {
+                sketch.add( deallocation.timestamp - allocation.timestamp, allocation.sample_count() );
+            }
+        }
+
+        sketch.quantile( quantile )
+    }
+}
+
 struct AllocationGroupListIter {
     group_list: AllocationGroupList,
     index: usize
@@ -940,6 +1455,37 @@ impl AllocationGroupList {
         self.sort_by_key( |group| !group.allocation_ids.len() )
     }
 
+    fn sorted_by_lifetime_quantile( &self, quantile: f64 ) -> AllocationGroupList {
+        let data = &self.data;
+        let mut groups: Vec< _ > = self.groups.par_iter().map( |group| (group.lifetime_quantile( data, quantile ), group.clone()) ).collect();
+        groups.par_sort_by_key( |(lifetime, _)| std::cmp::Reverse( *lifetime ) );
+
+        AllocationGroupList {
+            data: self.data.clone(),
+            groups: Arc::new( groups.into_iter().map( |(_, group)| group ).collect() )
+        }
+    }
+
+    fn sort_by_lifetime_quantile( &mut self, quantile: f64 ) -> Result< AllocationGroupList, Box< rhai::EvalAltResult > > {
+        if !(0.0..=1.0).contains( &quantile ) {
+            return Err( error( "the quantile must be between 0 and 1" ) );
+        }
+
+        Ok( self.sorted_by_lifetime_quantile( quantile ) )
+    }
+
+    fn sort_by_p50_lifetime( &mut self ) -> AllocationGroupList {
+        self.sorted_by_lifetime_quantile( 0.5 )
+    }
+
+    fn sort_by_p90_lifetime( &mut self ) -> AllocationGroupList {
+        self.sorted_by_lifetime_quantile( 0.9 )
+    }
+
+    fn sort_by_p99_lifetime( &mut self ) -> AllocationGroupList {
+        self.sorted_by_lifetime_quantile( 0.99 )
+    }
+
     fn ungroup( &mut self ) -> AllocationList {
         let mut allocation_ids = Vec::new();
         for group in &*self.groups {
@@ -981,13 +1527,17 @@ enum AllocationGraphKind {
     MemoryUsage,
     LiveAllocations,
     NewAllocations,
-    Deallocations
+    Deallocations,
+    AllocationRate,
+    AllocatedBytesRate,
+    SimulatedFootprint( SizeClassAllocator )
 }
 
 #[derive(Copy, Clone)]
 enum MapGraphKind {
     RSS,
-    AddressSpace
+    AddressSpace,
+    HugePages
 }
 
 #[derive(Copy, Clone)]
@@ -1056,20 +1606,25 @@ fn prepare_allocation_graph_datapoints( data: &Data, ops_for_list: &[Vec< Operat
 
     let mut xs = HashSet::new();
     let mut datapoints_for_ops = Vec::new();
-    for ops in ops_for_list {
+    let per_second = 1_000_000.0 / timeline_granularity( timestamp_min, timestamp_max ) as f64;
+    let timelines = build_allocation_timelines( &data, timestamp_min, timestamp_max, ops_for_list );
+    for (ops, timeline) in ops_for_list.iter().zip( timelines ) {
         if ops.is_empty() {
             datapoints_for_ops.push( Vec::new() );
             continue;
         }
 
-        let datapoints: Vec< _ > = build_allocation_timeline( &data, timestamp_min, timestamp_max, ops ).into_iter().map( |point| {
+        let datapoints: Vec< _ > = timeline.into_iter().map( |point| {
             xs.insert( point.timestamp );
             let x = point.timestamp;
             let y = match kind {
                 AllocationGraphKind::MemoryUsage => point.memory_usage,
                 AllocationGraphKind::LiveAllocations => point.allocations,
                 AllocationGraphKind::NewAllocations => point.positive_change.allocations,
-                AllocationGraphKind::Deallocations => point.negative_change.allocations
+                AllocationGraphKind::Deallocations => point.negative_change.allocations,
+                AllocationGraphKind::AllocationRate => (point.positive_change.allocations as f64 * per_second) as i64,
+                AllocationGraphKind::AllocatedBytesRate => (point.positive_change.memory_usage as f64 * per_second) as i64,
+                AllocationGraphKind::SimulatedFootprint( .. ) => unreachable!()
             } as u64;
             (x, y)
         }).collect();
@@ -1080,24 +1635,56 @@ fn prepare_allocation_graph_datapoints( data: &Data, ops_for_list: &[Vec< Operat
     finalize_datapoints( xs.into_iter().collect(), datapoints_for_ops )
 }
 
+fn prepare_simulated_graph_datapoints( data: &Data, ops_for_list: &[Vec< OperationId >], allocator: SizeClassAllocator ) -> (Vec< u64 >, Vec< Vec< (u64, u64) > >) {
+    // The operations are deduplicated across the lists, so each of them can be simulated on its own
+    // and then stacked on top of each other, as if every list had its own separate allocator.
+    let deltas_for_list: Vec< _ > = ops_for_list.par_iter().map( |ops| {
+        AllocatorSimulation::new( data, ops, allocator ).resident_deltas
+    }).collect();
+
+    let timestamp_min = deltas_for_list.iter().flat_map( |deltas| deltas.first() ).map( |(timestamp, _)| *timestamp ).min().unwrap_or( common::Timestamp::min() );
+    let timestamp_max = deltas_for_list.iter().flat_map( |deltas| deltas.last() ).map( |(timestamp, _)| *timestamp ).max().unwrap_or( common::Timestamp::min() );
+
+    let mut xs = HashSet::new();
+    let mut datapoints_for_ops = Vec::new();
+    let timelines = build_simulated_timelines( timestamp_min, timestamp_max, &deltas_for_list );
+    for (deltas, timeline) in deltas_for_list.iter().zip( timelines ) {
+        if deltas.is_empty() {
+            datapoints_for_ops.push( Vec::new() );
+            continue;
+        }
+
+        let datapoints: Vec< _ > = timeline.into_iter().map( |point| {
+            xs.insert( point.timestamp );
+            (point.timestamp, point.value as u64)
+        }).collect();
+
+        datapoints_for_ops.push( datapoints );
+    }
+
+    finalize_datapoints( xs.into_iter().collect(), datapoints_for_ops )
+}
+
 fn prepare_map_graph_datapoints( ops_for_list: &[Vec< (Timestamp, UsageDelta) >], kind: MapGraphKind ) -> (Vec< u64 >, Vec< Vec< (u64, u64) > >) {
     let timestamp_min = ops_for_list.iter().flat_map( |ops| ops.first() ).map( |(timestamp, _)| *timestamp ).min().unwrap_or( common::Timestamp::min() );
     let timestamp_max = ops_for_list.iter().flat_map( |ops| ops.last() ).map( |(timestamp, _)| *timestamp ).max().unwrap_or( common::Timestamp::min() );
 
     let mut xs = HashSet::new();
     let mut datapoints_for_ops = Vec::new();
-    for ops in ops_for_list {
+    let timelines = build_map_timelines( timestamp_min, timestamp_max, ops_for_list );
+    for (ops, timeline) in ops_for_list.iter().zip( timelines ) {
         if ops.is_empty() {
             datapoints_for_ops.push( Vec::new() );
             continue;
         }
 
-        let datapoints: Vec< _ > = build_map_timeline( timestamp_min, timestamp_max, ops ).into_iter().map( |point| {
+        let datapoints: Vec< _ > = timeline.into_iter().map( |point| {
             xs.insert( point.timestamp );
             let x = point.timestamp;
             let y = match kind {
                 MapGraphKind::RSS => point.rss(),
                 MapGraphKind::AddressSpace => point.address_space,
+                MapGraphKind::HugePages => point.huge_pages(),
             } as u64;
             (x, y)
         }).collect();
@@ -1277,6 +1864,31 @@ impl Graph {
         Ok( cloned )
     }
 
+    fn show_allocation_rate( &mut self ) -> Result< Self, Box< rhai::EvalAltResult > > {
+        self.bail_unless_allocation_graph()?;
+        let mut cloned = self.clone();
+        cloned.kind = Some( GraphKind::Allocation( AllocationGraphKind::AllocationRate ) );
+        cloned.cached_datapoints = None;
+        Ok( cloned )
+    }
+
+    fn show_allocated_bytes_rate( &mut self ) -> Result< Self, Box< rhai::EvalAltResult > > {
+        self.bail_unless_allocation_graph()?;
+        let mut cloned = self.clone();
+        cloned.kind = Some( GraphKind::Allocation( AllocationGraphKind::AllocatedBytesRate ) );
+        cloned.cached_datapoints = None;
+        Ok( cloned )
+    }
+
+    fn show_simulated_footprint( &mut self, allocator: String ) -> Result< Self, Box< rhai::EvalAltResult > > {
+        self.bail_unless_allocation_graph()?;
+        let allocator = parse_size_class_allocator( &allocator )?;
+        let mut cloned = self.clone();
+        cloned.kind = Some( GraphKind::Allocation( AllocationGraphKind::SimulatedFootprint( allocator ) ) );
+        cloned.cached_datapoints = None;
+        Ok( cloned )
+    }
+
     fn show_rss( &mut self ) -> Result< Self, Box< rhai::EvalAltResult > > {
         self.bail_unless_map_graph()?;
         let mut cloned = self.clone();
@@ -1293,6 +1905,14 @@ impl Graph {
         Ok( cloned )
     }
 
+    fn show_huge_pages( &mut self ) -> Result< Self, Box< rhai::EvalAltResult > > {
+        self.bail_unless_map_graph()?;
+        let mut cloned = self.clone();
+        cloned.kind = Some( GraphKind::Map( MapGraphKind::HugePages ) );
+        cloned.cached_datapoints = None;
+        Ok( cloned )
+    }
+
     fn generate_allocation_ops( &mut self ) -> Result< Vec< Vec< OperationId > >, Box< rhai::EvalAltResult > > {
         self.bail_unless_allocation_graph()?;
         let lists = &mut self.allocation_lists;
@@ -1496,7 +2116,7 @@ impl Graph {
                         format!( "{}", value )
                     } else {
                         match KIND.with( |cell| cell.get() ) {
-                            GraphKind::Allocation( AllocationGraphKind::MemoryUsage ) | GraphKind::Map( _ ) => {
+                            GraphKind::Allocation( AllocationGraphKind::MemoryUsage | AllocationGraphKind::AllocatedBytesRate | AllocationGraphKind::SimulatedFootprint( .. ) ) | GraphKind::Map( _ ) => {
                                 let (unit, multiplier) = {
                                     if max < 1024 * 1024 {
                                         ("KB", 1024)
@@ -1513,7 +2133,7 @@ impl Graph {
                                     format!( "{} {}", value / multiplier, unit )
                                 }
                             },
-                            GraphKind::Allocation( AllocationGraphKind::LiveAllocations | AllocationGraphKind::NewAllocations | AllocationGraphKind::Deallocations ) => {
+                            GraphKind::Allocation( AllocationGraphKind::LiveAllocations | AllocationGraphKind::NewAllocations | AllocationGraphKind::Deallocations | AllocationGraphKind::AllocationRate ) => {
                                 let (unit, multiplier) = {
                                     if max < 1000 * 1000 {
                                         ("K", 1000)
@@ -1677,8 +2297,12 @@ impl Graph {
                 GraphKind::Allocation( AllocationGraphKind::LiveAllocations ) => "Live allocations",
                 GraphKind::Allocation( AllocationGraphKind::NewAllocations ) => "New allocations",
                 GraphKind::Allocation( AllocationGraphKind::Deallocations ) => "Deallocations",
+                GraphKind::Allocation( AllocationGraphKind::AllocationRate ) => "Allocations per second",
+                GraphKind::Allocation( AllocationGraphKind::AllocatedBytesRate ) => "Allocated bytes per second",
+                GraphKind::Allocation( AllocationGraphKind::SimulatedFootprint( .. ) ) => "Simulated footprint",
                 GraphKind::Map( MapGraphKind::RSS ) => "RSS",
                 GraphKind::Map( MapGraphKind::AddressSpace ) => "Address space",
+                GraphKind::Map( MapGraphKind::HugePages ) => "Huge pages",
             };
             mesh = mesh.x_desc( "Time" ).y_desc( label );
         }
@@ -1717,6 +2341,10 @@ impl Graph {
         (|| {
             if self.cached_datapoints.is_none() {
                 let (xs, datapoints_for_ops) = match self.graph_kind() {
+                    Some( GraphKind::Allocation( AllocationGraphKind::SimulatedFootprint( allocator ) ) ) => {
+                        let ops_for_list = self.generate_allocation_ops()?;
+                        prepare_simulated_graph_datapoints( &self.allocation_lists[ 0 ].data, &ops_for_list, allocator )
+                    },
                     Some( GraphKind::Allocation( kind ) ) => {
                         let ops_for_list = self.generate_allocation_ops()?;
                         prepare_allocation_graph_datapoints( &self.allocation_lists[ 0 ].data, &ops_for_list, kind )
@@ -1752,11 +2380,13 @@ impl Graph {
             path.push( '/' );
         }
 
+        // The series are independent of each other, so their datapoints can be prepared in parallel.
         match self.graph_kind() {
             Some( GraphKind::Allocation( kind ) ) => {
                 let ops_for_list = self.generate_allocation_ops()?;
-                for (index, (ops, label)) in ops_for_list.into_iter().zip( self.labels.iter() ).enumerate() {
-                    let (xs, datapoints_for_ops) = prepare_allocation_graph_datapoints( &self.allocation_lists[ 0 ].data, &[ops], kind );
+                let data = &self.allocation_lists[ 0 ].data;
+                let datapoints_for_list: Vec< _ > = ops_for_list.into_par_iter().map( |ops| prepare_allocation_graph_datapoints( data, &[ops], kind ) ).collect();
+                for (index, ((xs, datapoints_for_ops), label)) in datapoints_for_list.into_iter().zip( self.labels.iter() ).enumerate() {
                     let data = self.save_to_string_impl( &xs, &datapoints_for_ops, &[label.clone()] )?;
 
                     let file_path =
@@ -1771,8 +2401,8 @@ impl Graph {
             },
             Some( GraphKind::Map( kind ) ) => {
                 let ops_for_list = self.generate_map_ops()?;
-                for (index, (ops, label)) in ops_for_list.into_iter().zip( self.labels.iter() ).enumerate() {
-                    let (xs, datapoints_for_ops) = prepare_map_graph_datapoints( &[ops], kind );
+                let datapoints_for_list: Vec< _ > = ops_for_list.into_par_iter().map( |ops| prepare_map_graph_datapoints( &[ops], kind ) ).collect();
+                for (index, ((xs, datapoints_for_ops), label)) in datapoints_for_list.into_iter().zip( self.labels.iter() ).enumerate() {
                     let data = self.save_to_string_impl( &xs, &datapoints_for_ops, &[label.clone()] )?;
 
                     let file_path =
@@ -1839,6 +2469,12 @@ fn load( path: String ) -> Result< Arc< Data >, Box< rhai::EvalAltResult > > {
     Ok( Arc::new( data ) )
 }
 
+fn parse_size_class_allocator( name: &str ) -> Result< SizeClassAllocator, Box< rhai::EvalAltResult > > {
+    SizeClassAllocator::from_name( name ).ok_or_else( || {
+        error( format!( "unknown allocator: '{}'; expected either 'glibc', 'jemalloc' or 'mimalloc'", name ) )
+    })
+}
+
 pub fn error( message: impl Into< String > ) -> Box< rhai::EvalAltResult > {
     Box::new( rhai::EvalAltResult::from( message.into() ) )
 }
@@ -1849,7 +2485,19 @@ pub enum FileKind {
 }
 
 pub struct Engine {
-    inner: rhai::Engine
+    inner: rhai::Engine,
+    env: Arc< Mutex< ForwardingEnvironment > >,
+    args: Arc< Mutex< EngineArgs > >,
+    graph_counter: Arc< AtomicUsize >,
+    flamegraph_counter: Arc< AtomicUsize >
+}
+
+/// How many compiled scripts are kept around on every thread.
+const COMPILED_SCRIPT_CACHE_SIZE: usize = 64;
+
+thread_local! {
+    static CACHED_ENGINE: RefCell< Option< Engine > > = RefCell::new( None );
+    static COMPILED_SCRIPTS: RefCell< LruCache< String, Rc< rhai::AST > > > = RefCell::new( LruCache::new( COMPILED_SCRIPT_CACHE_SIZE ) );
 }
 
 #[derive(Default)]
@@ -1873,6 +2521,35 @@ pub trait Environment {
     }
 }
 
+/// Passes everything through to another environment which can be swapped out.
+struct ForwardingEnvironment( Arc< Mutex< dyn Environment > > );
+
+impl Environment for ForwardingEnvironment {
+    fn println( &mut self, message: &str ) {
+        self.0.lock().println( message )
+    }
+
+    fn mkdir_p( &mut self, path: &str ) -> Result< (), Box< rhai::EvalAltResult > > {
+        self.0.lock().mkdir_p( path )
+    }
+
+    fn chdir( &mut self, path: &str ) -> Result< (), Box< rhai::EvalAltResult > > {
+        self.0.lock().chdir( path )
+    }
+
+    fn file_write( &mut self, path: &str, kind: FileKind, contents: &[u8] ) -> Result< (), Box< rhai::EvalAltResult > > {
+        self.0.lock().file_write( path, kind, contents )
+    }
+
+    fn exit( &mut self, errorcode: Option< i32 > ) -> Result< (), Box< rhai::EvalAltResult > > {
+        self.0.lock().exit( errorcode )
+    }
+
+    fn load( &mut self, path: String ) -> Result< Arc< Data >, Box< rhai::EvalAltResult > > {
+        self.0.lock().load( path )
+    }
+}
+
 #[derive(Default)]
 pub struct NativeEnvironment {}
 
@@ -2003,6 +2680,11 @@ impl Engine {
     pub fn new( env: Arc< Mutex< dyn Environment > >, args: EngineArgs ) -> Self {
         use rhai::packages::Package;
 
+        let env = Arc::new( Mutex::new( ForwardingEnvironment( env ) ) );
+        let args = Arc::new( Mutex::new( args ) );
+        let engine_env = env.clone();
+        let engine_args = args.clone();
+
         let mut engine = rhai::Engine::new_raw();
         engine.register_global_module( rhai::packages::ArithmeticPackage::new().as_shared_module() );
         engine.register_global_module( rhai::packages::BasicArrayPackage::new().as_shared_module() );
@@ -2014,8 +2696,6 @@ impl Engine {
         engine.register_global_module( rhai::packages::LogicPackage::new().as_shared_module() );
         engine.register_global_module( rhai::packages::MoreStringPackage::new().as_shared_module() );
 
-        let argv = args.argv;
-
         // Utility functions.
         engine.register_fn( "dirname", dirname );
         engine.register_fn( "h", |value: i64| Duration::from_secs( value as u64 * 3600 ) );
@@ -2034,14 +2714,23 @@ impl Engine {
         engine.register_fn( "*", |lhs: f64, rhs: Duration| -> Duration { Duration( rhs.0 * lhs as f64 ) } );
         engine.register_fn( "+", |lhs: Duration, rhs: Duration| -> Duration { Duration( lhs.0 + rhs.0 ) } );
         engine.register_fn( "-", |lhs: Duration, rhs: Duration| -> Duration { Duration( lhs.0 - rhs.0 ) } );
+        engine.register_fn( "<", |lhs: Duration, rhs: Duration| lhs < rhs );
+        engine.register_fn( "<=", |lhs: Duration, rhs: Duration| lhs <= rhs );
+        engine.register_fn( ">", |lhs: Duration, rhs: Duration| lhs > rhs );
+        engine.register_fn( ">=", |lhs: Duration, rhs: Duration| lhs >= rhs );
+        engine.register_fn( "==", |lhs: Duration, rhs: Duration| lhs == rhs );
+        engine.register_fn( "!=", |lhs: Duration, rhs: Duration| lhs != rhs );
         engine.register_fn( "kb", |value: i64| value * 1000 );
         engine.register_fn( "mb", |value: i64| value * 1000 * 1000 );
         engine.register_fn( "gb", |value: i64| value * 1000 * 1000 * 1000 );
         engine.register_fn( "info", |message: &str| info!( "{}", message ) );
         engine.register_type::< Duration >();
-        engine.register_fn( "argv", move || -> rhai::Array {
-            argv.iter().cloned().map( rhai::Dynamic::from ).collect()
-        });
+        {
+            let args = args.clone();
+            engine.register_fn( "argv", move || -> rhai::Array {
+                args.lock().argv.iter().cloned().map( rhai::Dynamic::from ).collect()
+            });
+        }
 
         {
             let env = env.clone();
@@ -2088,12 +2777,23 @@ impl Engine {
         engine.register_result_fn( "show_live_allocations", Graph::show_live_allocations );
         engine.register_result_fn( "show_new_allocations", Graph::show_new_allocations );
         engine.register_result_fn( "show_deallocations", Graph::show_deallocations );
+        engine.register_result_fn( "show_allocation_rate", Graph::show_allocation_rate );
+        engine.register_result_fn( "show_allocated_bytes_rate", Graph::show_allocated_bytes_rate );
+        engine.register_result_fn( "show_simulated_footprint", Graph::show_simulated_footprint );
         engine.register_result_fn( "show_rss", Graph::show_rss );
         engine.register_result_fn( "show_address_space", Graph::show_address_space );
+        engine.register_result_fn( "show_huge_pages", Graph::show_huge_pages );
 
         engine.register_result_fn( "with_gradient_color_scheme", Graph::with_gradient_color_scheme );
         engine.register_fn( "allocations", DataRef::allocations );
         engine.register_fn( "maps", DataRef::maps );
+        engine.register_fn( "diff", DataRef::diff );
+        engine.register_fn( "diff", |before: DataRef, after: DataRef| {
+            let before_at = Duration( before.0.last_timestamp - before.0.initial_timestamp );
+            let after_at = Duration( after.0.last_timestamp - after.0.initial_timestamp );
+            diff_traces( before, before_at, after, after_at )
+        });
+        engine.register_fn( "diff", diff_traces );
         engine.register_fn( "runtime", |data: &mut DataRef| Duration( data.0.last_timestamp - data.0.initial_timestamp ) );
 
         engine.register_fn( "strip", |backtrace: &mut Backtrace| {
@@ -2101,6 +2801,9 @@ impl Engine {
             cloned.strip = true;
             cloned
         });
+        engine.register_fn( "is_truncated", |backtrace: &mut Backtrace| {
+            backtrace.data.get_backtrace( backtrace.id ).any( |(_, frame)| frame.is_elided_frames_marker() )
+        });
 
         fn set_max< T >( target: &mut Option< T >, value: T ) where T: PartialOrd {
             if let Some( target ) = target.as_mut() {
@@ -2275,6 +2978,7 @@ impl Engine {
         register_filter!( AllocationList, only_ptmalloc_not_from_main_arena, bool );
         register_filter!( AllocationList, only_jemalloc, bool );
         register_filter!( AllocationList, only_not_jemalloc, bool );
+        register_filter!( AllocationList, only_numa_remote, bool );
 
         engine.register_fn( "only_with_marker", |list: &mut AllocationList, value: i64| {
             list.add_filter_once( |filter| filter.only_with_marker.is_some(), |filter|
@@ -2282,7 +2986,41 @@ impl Engine {
             )
         });
 
+        engine.register_fn( "only_with_thread_tag", |list: &mut AllocationList, value: i64| {
+            list.add_filter_once( |filter| filter.only_with_thread_tag.is_some(), |filter|
+                filter.only_with_thread_tag = Some( value as u32 )
+            )
+        });
+        engine.register_fn( "only_from_pool", |list: &mut AllocationList, value: i64| {
+            list.add_filter_once( |filter| filter.only_from_pool.is_some(), |filter|
+                filter.only_from_pool = Some( value as u16 )
+            )
+        });
+        register_filter!( AllocationList, only_not_from_pools, bool );
+        engine.register_fn( "only_on_numa_node", |list: &mut AllocationList, value: i64| {
+            list.add_filter_once( |filter| filter.only_on_numa_node.is_some(), |filter|
+                filter.only_on_numa_node = Some( value as u32 )
+            )
+        });
+
+        engine.register_fn( "only_from_thread_on_numa_node", |list: &mut AllocationList, value: i64| {
+            list.add_filter_once( |filter| filter.only_from_thread_on_numa_node.is_some(), |filter|
+                filter.only_from_thread_on_numa_node = Some( value as u32 )
+            )
+        });
+
+        engine.register_result_fn( "filter", |context: rhai::NativeCallContext, list: &mut AllocationList, callback: rhai::FnPtr| list.filter_with_callback( &context, &callback ) );
         engine.register_fn( "group_by_backtrace", AllocationList::group_by_backtrace );
+        engine.register_fn( "co_located_pairs", |list: &mut AllocationList| list.co_located_pairs( crate::false_sharing::DEFAULT_CACHE_LINE_SIZE ) );
+        engine.register_result_fn( "heap_retention", AllocationList::heap_retention );
+        engine.register_result_fn( "duplicates", AllocationList::duplicates );
+        engine.register_fn( "cross_thread_frees", AllocationList::cross_thread_frees );
+        engine.register_fn( "co_located_pairs", |list: &mut AllocationList, line_size: i64| list.co_located_pairs( std::cmp::max( line_size, 1 ) as u64 ) );
+        engine.register_result_fn( "size_classes", AllocationList::size_classes );
+        engine.register_result_fn( "simulate_allocator", AllocationList::simulate_allocator );
+        engine.register_fn( "realloc_growth", AllocationList::realloc_growth );
+        engine.register_fn( "usage_by_thread_tag", AllocationList::usage_by_thread_tag );
+        engine.register_fn( "allocation_rates", AllocationList::allocation_rates );
 
         engine.register_fn( "only_all_leaked", AllocationGroupList::only_all_leaked );
         engine.register_fn( "only_count_at_least", AllocationGroupList::only_count_at_least );
@@ -2293,6 +3031,10 @@ impl Engine {
         engine.register_fn( "sort_by_count_ascending", AllocationGroupList::sort_by_count_ascending );
         engine.register_fn( "sort_by_count_descending", AllocationGroupList::sort_by_count_descending );
         engine.register_fn( "sort_by_count", AllocationGroupList::sort_by_count_descending );
+        engine.register_result_fn( "sort_by_lifetime_quantile", AllocationGroupList::sort_by_lifetime_quantile );
+        engine.register_fn( "sort_by_p50_lifetime", AllocationGroupList::sort_by_p50_lifetime );
+        engine.register_fn( "sort_by_p90_lifetime", AllocationGroupList::sort_by_p90_lifetime );
+        engine.register_fn( "sort_by_p99_lifetime", AllocationGroupList::sort_by_p99_lifetime );
         engine.register_fn( "ungroup", AllocationGroupList::ungroup );
         engine.register_indexer_get_result( AllocationGroupList::get );
         engine.register_fn( "take", AllocationGroupList::take );
@@ -2320,6 +3062,55 @@ impl Engine {
             Duration( allocation.data.get_allocation( allocation.id ).timestamp - allocation.data.initial_timestamp )
         });
 
+        // The properties which the `filter` callbacks can use; they're also always available on the `TracedAllocation`.
+        engine.register_get( "size", |allocation: &mut Allocation| allocation.data.get_allocation( allocation.id ).size as i64 );
+        engine.register_get( "address", |allocation: &mut Allocation| allocation.data.get_allocation( allocation.id ).pointer as i64 );
+        engine.register_get( "allocated_at", |allocation: &mut Allocation| {
+            Duration( allocation.data.get_allocation( allocation.id ).timestamp - allocation.data.initial_timestamp )
+        });
+        engine.register_get( "lifetime", |allocation: &mut Allocation| {
+            let entry = allocation.data.get_allocation( allocation.id );
+            let lifetime_end = entry.deallocation.as_ref().map( |deallocation| deallocation.timestamp ).unwrap_or( allocation.data.last_timestamp() );
+            Duration( lifetime_end - entry.timestamp )
+        });
+        engine.register_get( "is_leaked", |allocation: &mut Allocation| allocation.data.get_allocation( allocation.id ).deallocation.is_none() );
+        engine.register_get( "marker", |allocation: &mut Allocation| allocation.data.get_allocation( allocation.id ).marker as i64 );
+        engine.register_get( "thread_tag", |allocation: &mut Allocation| allocation.data.get_allocation( allocation.id ).thread_tag as i64 );
+
+        engine.register_type::< TracedAllocation >();
+        engine.register_type::< TracedProperty >();
+        engine.register_type::< TracedPredicate >();
+        engine.register_get( "size", |_: &mut TracedAllocation| TracedProperty::Size );
+        engine.register_get( "address", |_: &mut TracedAllocation| TracedProperty::Address );
+        engine.register_get( "allocated_at", |_: &mut TracedAllocation| TracedProperty::AllocatedAt );
+        engine.register_get( "lifetime", |_: &mut TracedAllocation| TracedProperty::Lifetime );
+        engine.register_get( "marker", |_: &mut TracedAllocation| TracedProperty::Marker );
+        engine.register_get( "thread_tag", |_: &mut TracedAllocation| TracedProperty::ThreadTag );
+        engine.register_get( "is_leaked", |_: &mut TracedAllocation| {
+            let mut filter = RawAllocationFilter::default();
+            filter.common_filter.only_leaked = true;
+            TracedPredicate( Filter::Basic( filter ) )
+        });
+
+        macro_rules! register_traced_comparison {
+            ($operator:expr, $comparison:expr) => {
+                engine.register_result_fn( $operator, |lhs: TracedProperty, rhs: i64| traced_comparison( lhs, $comparison, TracedValue::Number( rhs ) ) );
+                engine.register_result_fn( $operator, |lhs: i64, rhs: TracedProperty| traced_comparison( rhs, $comparison.flipped(), TracedValue::Number( lhs ) ) );
+                engine.register_result_fn( $operator, |lhs: TracedProperty, rhs: Duration| traced_comparison( lhs, $comparison, TracedValue::Duration( rhs ) ) );
+                engine.register_result_fn( $operator, |lhs: Duration, rhs: TracedProperty| traced_comparison( rhs, $comparison.flipped(), TracedValue::Duration( lhs ) ) );
+            };
+        }
+
+        register_traced_comparison!( "<", Comparison::Less );
+        register_traced_comparison!( "<=", Comparison::LessOrEqual );
+        register_traced_comparison!( ">", Comparison::Greater );
+        register_traced_comparison!( ">=", Comparison::GreaterOrEqual );
+        register_traced_comparison!( "==", Comparison::Equal );
+        register_traced_comparison!( "!=", Comparison::NotEqual );
+        engine.register_fn( "&", |lhs: TracedPredicate, rhs: TracedPredicate| TracedPredicate( Filter::And( Box::new( lhs.0 ), Box::new( rhs.0 ) ) ) );
+        engine.register_fn( "|", |lhs: TracedPredicate, rhs: TracedPredicate| TracedPredicate( Filter::Or( Box::new( lhs.0 ), Box::new( rhs.0 ) ) ) );
+        engine.register_fn( "!", |predicate: TracedPredicate| TracedPredicate( Filter::Not( Box::new( predicate.0 ) ) ) );
+
         engine.register_fn( "allocated_at", |map: &mut Map| {
             Duration( map.data.get_map( map.id ).timestamp - map.data.initial_timestamp )
         });
@@ -2334,6 +3125,10 @@ impl Engine {
 
         register_filter!( MapList, set_max, only_peak_rss_at_least, i64 => u64 );
         register_filter!( MapList, set_min, only_peak_rss_at_most, i64 => u64 );
+        register_filter!( MapList, set_max, only_peak_huge_pages_at_least, i64 => u64 );
+        register_filter!( MapList, set_min, only_peak_huge_pages_at_most, i64 => u64 );
+        register_filter!( MapList, only_huge_page_advised, bool );
+        register_filter!( MapList, only_not_huge_page_advised, bool );
         register_filter!( MapList, only_jemalloc, bool );
         register_filter!( MapList, only_not_jemalloc, bool );
         register_filter!( MapList, only_bytehound, bool );
@@ -2353,9 +3148,9 @@ impl Engine {
         }
 
         {
-            let data = args.data.clone();
+            let args = args.clone();
             engine.register_result_fn( "data", move || {
-                if let Some( ref data ) = data {
+                if let Some( ref data ) = args.lock().data {
                     Ok( DataRef( data.clone() ) )
                 } else {
                     Err( error( "no globally loaded data file" ) )
@@ -2364,13 +3159,13 @@ impl Engine {
         }
 
         {
-            let data = args.data.clone();
-            let allocation_ids = args.allocation_ids.clone();
+            let args = args.clone();
             engine.register_result_fn( "allocations", move || {
-                if let Some( ref data ) = data {
+                let args = args.lock();
+                if let Some( ref data ) = args.data {
                     Ok( AllocationList {
                         data: DataRef( data.clone() ),
-                        allocation_ids: allocation_ids.clone(),
+                        allocation_ids: args.allocation_ids.clone(),
                         filter: None
                     })
                 } else {
@@ -2380,13 +3175,13 @@ impl Engine {
         }
 
         {
-            let data = args.data.clone();
-            let map_ids = args.map_ids.clone();
+            let args = args.clone();
             engine.register_result_fn( "maps", move || {
-                if let Some( ref data ) = data {
+                let args = args.lock();
+                if let Some( ref data ) = args.data {
                     Ok( MapList {
                         data: DataRef( data.clone() ),
-                        map_ids: map_ids.clone(),
+                        map_ids: args.map_ids.clone(),
                         filter: None
                     })
                 } else {
@@ -2678,12 +3473,66 @@ impl Engine {
         register_list!( MapList );
 
         Engine {
-            inner: engine
+            inner: engine,
+            env: engine_env,
+            args: engine_args,
+            graph_counter,
+            flamegraph_counter
         }
     }
 
+    /// Makes the engine run the next scripts as if it was freshly created with the given `env` and `args`.
+    pub fn reset( &self, env: Arc< Mutex< dyn Environment > >, args: EngineArgs ) {
+        self.env.lock().0 = env;
+        *self.args.lock() = args;
+        self.graph_counter.store( 1, std::sync::atomic::Ordering::SeqCst );
+        self.flamegraph_counter.store( 1, std::sync::atomic::Ordering::SeqCst );
+    }
+
+    pub fn compile( &self, code: &str ) -> Result< rhai::AST, EvalError > {
+        self.inner.compile( code ).map_err( |error| {
+            let error: Box< rhai::EvalAltResult > = error.into();
+            EvalError::from_rhai( &error )
+        })
+    }
+
     pub fn run( &self, code: &str ) -> Result< Option< EvalOutput >, EvalError > {
-        match self.inner.eval::< rhai::plugin::Dynamic >( code ) {
+        self.run_ast( &self.compile( code )? )
+    }
+
+    /// Runs the `code` on an engine and with a compiled script which are both reused between the calls on the same thread.
+    ///
+    /// Creating the engine and compiling the script takes longer than running most of the scripts,
+    /// and the same handful of scripts tends to be run over and over again with different arguments.
+    pub fn run_cached( env: Arc< Mutex< dyn Environment > >, args: EngineArgs, code: &str ) -> Result< Option< EvalOutput >, EvalError > {
+        let engine = CACHED_ENGINE.with( |cached| cached.borrow_mut().take() );
+        let engine = match engine {
+            Some( engine ) => {
+                engine.reset( env, args );
+                engine
+            },
+            None => Engine::new( env, args )
+        };
+
+        let ast = COMPILED_SCRIPTS.with( |cache| cache.borrow_mut().get( &code.to_owned() ).cloned() );
+        let result = match ast {
+            Some( ast ) => engine.run_ast( &ast ),
+            None => engine.compile( code ).and_then( |ast| {
+                let ast = Rc::new( ast );
+                COMPILED_SCRIPTS.with( |cache| cache.borrow_mut().put( code.to_owned(), ast.clone() ) );
+                engine.run_ast( &ast )
+            })
+        };
+
+        // Don't keep the data alive while the engine is idle.
+        engine.reset( Arc::new( Mutex::new( VirtualEnvironment::new() ) ), EngineArgs::default() );
+        CACHED_ENGINE.with( |cached| *cached.borrow_mut() = Some( engine ) );
+
+        result
+    }
+
+    pub fn run_ast( &self, ast: &rhai::AST ) -> Result< Option< EvalOutput >, EvalError > {
+        match self.inner.eval_ast::< rhai::plugin::Dynamic >( ast ) {
             Ok( value ) => {
                 if value.is::< AllocationList >() {
                     Ok( Some( EvalOutput::AllocationList( value.cast::< AllocationList >() ) ) )
@@ -2693,14 +3542,7 @@ impl Engine {
                     Ok( None )
                 }
             },
-            Err( error ) => {
-                let p = error.position();
-                Err( EvalError {
-                    message: error.to_string(),
-                    line: p.line(),
-                    column: p.position()
-                })
-            }
+            Err( error ) => Err( EvalError::from_rhai( &error ) )
         }
     }
 }
@@ -2717,6 +3559,17 @@ pub struct EvalError {
     pub column: Option< usize >
 }
 
+impl EvalError {
+    fn from_rhai( error: &rhai::EvalAltResult ) -> Self {
+        let p = error.position();
+        EvalError {
+            message: error.to_string(),
+            line: p.line(),
+            column: p.position()
+        }
+    }
+}
+
 impl From< String > for EvalError {
     fn from( message: String ) -> Self {
         EvalError { message, line: None, column: None }
@@ -2729,7 +3582,7 @@ impl< 'a > From< &'a str > for EvalError {
     }
 }
 
-pub fn run_script( path: &Path, data_path: Option< &Path >, argv: Vec< String > ) -> Result< (), std::io::Error > {
+pub fn run_script( path: &Path, data_path: Option< &Path >, load_filter: crate::LoadFilter, argv: Vec< String > ) -> Result< (), std::io::Error > {
     let mut args = EngineArgs {
         argv,
         .. EngineArgs::default()
@@ -2740,7 +3593,7 @@ pub fn run_script( path: &Path, data_path: Option< &Path >, argv: Vec< String >
         let fp = File::open( &data_path )?;
 
         let debug_symbols: &[PathBuf] = &[];
-        let data = Loader::load_from_stream( fp, debug_symbols )?;
+        let data = Loader::load_from_stream_with_filter( fp, debug_symbols, load_filter )?;
         args.data = Some( Arc::new( data ) );
     }
 
@@ -2760,15 +3613,16 @@ pub fn run_script( path: &Path, data_path: Option< &Path >, argv: Vec< String >
     Ok(())
 }
 
+/// Runs the scripts which it gets through the stdin, one after another; see `script_slave`.
+///
+/// The data is loaded through its cache, so that the slaves which are (re)started later don't have to load it again.
 pub fn run_script_slave( data_path: Option< &Path > ) -> Result< (), std::io::Error > {
     let mut args = EngineArgs::default();
 
     if let Some( data_path ) = data_path {
         info!( "Loading {:?}...", data_path );
-        let fp = File::open( &data_path )?;
-
         let debug_symbols: &[PathBuf] = &[];
-        let data = Loader::load_from_stream( fp, debug_symbols )?;
+        let data = Loader::load_from_file( data_path, debug_symbols, true )?;
         args.data = Some( Arc::new( data ) );
     }
 
@@ -2797,6 +3651,19 @@ pub fn run_script_slave( data_path: Option< &Path > ) -> Result< (), std::io::Er
             buffer.pop();
         }
 
+        if buffer == crate::script_slave::RESET_COMMAND {
+            scope = rhai::Scope::new();
+            global_ast = Default::default();
+            *env.lock() = VirtualEnvironment::new();
+
+            let payload = serde_json::json! {{
+                "kind": "idle"
+            }};
+
+            println!( "{}", serde_json::to_string( &payload ).unwrap() );
+            continue;
+        }
+
         let input = match std::str::from_utf8( &buffer ) {
             Ok( input ) => input,
             Err( _ ) => {
@@ -2948,6 +3815,12 @@ impl ToCode for Regex {
     }
 }
 
+impl ToCode for u16 {
+    fn to_code_impl( &self, ctx: &mut ToCodeContext ) {
+        write!( &mut ctx.output, "{}", self ).unwrap();
+    }
+}
+
 impl ToCode for u32 {
     fn to_code_impl( &self, ctx: &mut ToCodeContext ) {
         write!( &mut ctx.output, "{}", self ).unwrap();
@@ -3176,6 +4049,10 @@ impl ToCode for RawAllocationFilter {
             self.only_group_leaked_allocations_at_most
 
             self.only_with_marker
+            self.only_with_thread_tag
+            self.only_from_pool
+            self.only_on_numa_node
+            self.only_from_thread_on_numa_node
 
             self.only_from_maps
         }
@@ -3188,6 +4065,8 @@ impl ToCode for RawAllocationFilter {
             self.only_ptmalloc_not_from_main_arena
             self.only_jemalloc
             self.only_not_jemalloc
+            self.only_numa_remote
+            self.only_not_from_pools
         }
     }
 }
@@ -3202,9 +4081,13 @@ impl ToCode for RawMapFilter {
         out! { ctx =>
             self.only_peak_rss_at_least
             self.only_peak_rss_at_most
+            self.only_peak_huge_pages_at_least
+            self.only_peak_huge_pages_at_most
         }
 
         out_bool! { ctx =>
+            self.only_huge_page_advised
+            self.only_not_huge_page_advised
             self.only_jemalloc
             self.only_not_jemalloc
             self.only_bytehound
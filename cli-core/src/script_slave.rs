@@ -0,0 +1,202 @@
+//! A pool of long-lived `script-slave` processes which run the scripts in isolation.
+//!
+//! Every slave loads its data only once, through the cache, which is mapped read-only and so is shared
+//! with every other process which has it open, and then keeps running whatever scripts it gets
+//! through its stdin. The scripts don't have to pay for loading the data, and if one of them crashes
+//! only its slave is lost; a new one is spawned in its place the next time one is needed.
+//!
+//! The protocol is the one of `run_script_slave`: every script is terminated with a NUL byte, and
+//! the slave answers with one JSON message per line, the last of which is always an `idle` one.
+
+use std::io::{self, BufRead, BufReader, Write};
+use std::path::{Path, PathBuf};
+use std::process::{Child, ChildStdin, ChildStdout, Command, Stdio};
+use std::sync::Arc;
+
+use parking_lot::Mutex;
+
+use crate::script::{EvalError, ScriptOutputKind};
+
+/// When sent instead of a script the slave forgets everything the previous scripts have defined.
+pub const RESET_COMMAND: &[u8] = b"\x01reset";
+
+/// What a script has printed and generated before it either finished or failed.
+pub struct SlaveResult {
+    pub output: Vec< ScriptOutputKind >,
+    pub error: Option< EvalError >
+}
+
+enum Message {
+    Output( ScriptOutputKind ),
+    Error( EvalError ),
+    Idle
+}
+
+fn parse_message( line: &str ) -> io::Result< Message > {
+    let invalid = |message: &str| io::Error::new( io::ErrorKind::InvalidData, format!( "invalid message from the script slave: {}", message ) );
+    let value: serde_json::Value = serde_json::from_str( line ).map_err( |error| invalid( &error.to_string() ) )?;
+    let string = |key: &str| value.get( key ).and_then( |value| value.as_str() ).map( |value| value.to_owned() );
+    let position = |key: &str| value.get( key ).and_then( |value| value.as_u64() ).map( |value| value as usize );
+
+    let message = match value.get( "kind" ).and_then( |kind| kind.as_str() ) {
+        Some( "println" ) => Message::Output( ScriptOutputKind::PrintLine( string( "message" ).unwrap_or_default() ) ),
+        Some( "image" ) => {
+            let data = value.get( "data" ).and_then( |data| data.as_array() ).ok_or_else( || invalid( "image without any data" ) )?;
+            let data = data.iter().map( |byte| byte.as_u64().map( |byte| byte as u8 ) ).collect::< Option< Vec< u8 > > >().ok_or_else( || invalid( "malformed image data" ) )?;
+            Message::Output( ScriptOutputKind::Image {
+                path: string( "path" ).unwrap_or_default(),
+                data: Arc::new( data )
+            })
+        },
+        Some( "runtime_error" ) | Some( "syntax_error" ) => Message::Error( EvalError {
+            message: string( "message" ).unwrap_or_default(),
+            line: position( "line" ),
+            column: position( "column" )
+        }),
+        Some( "idle" ) => Message::Idle,
+        _ => return Err( invalid( line ) )
+    };
+
+    Ok( message )
+}
+
+struct Slave {
+    child: Child,
+    stdin: ChildStdin,
+    stdout: BufReader< ChildStdout >
+}
+
+impl Slave {
+    fn spawn( executable: &Path, data_path: &Path ) -> io::Result< Self > {
+        let mut child = Command::new( executable )
+            .arg( "script-slave" )
+            .arg( "--data" )
+            .arg( data_path )
+            .stdin( Stdio::piped() )
+            .stdout( Stdio::piped() )
+            .spawn()?;
+
+        let stdin = child.stdin.take().unwrap();
+        let stdout = BufReader::new( child.stdout.take().unwrap() );
+        Ok( Slave { child, stdin, stdout } )
+    }
+
+    fn send( &mut self, input: &[u8] ) -> io::Result< () > {
+        self.stdin.write_all( input )?;
+        self.stdin.write_all( b"\0" )
+    }
+
+    fn receive( &mut self, result: &mut SlaveResult ) -> io::Result< () > {
+        let mut line = String::new();
+        loop {
+            line.clear();
+            if self.stdout.read_line( &mut line )? == 0 {
+                return Err( io::Error::new( io::ErrorKind::UnexpectedEof, "the script slave has died" ) );
+            }
+
+            match parse_message( line.trim_end() )? {
+                Message::Output( output ) => result.output.push( output ),
+                Message::Error( error ) => result.error = Some( error ),
+                Message::Idle => return Ok(())
+            }
+        }
+    }
+
+    /// Runs the `code` and then resets the slave, so that the next script doesn't see anything from this one.
+    fn run( &mut self, code: &str ) -> io::Result< SlaveResult > {
+        self.send( code.as_bytes() )?;
+        self.send( RESET_COMMAND )?;
+        self.stdin.flush()?;
+
+        let mut result = SlaveResult {
+            output: Vec::new(),
+            error: None
+        };
+
+        self.receive( &mut result )?;
+
+        let mut reset = SlaveResult {
+            output: Vec::new(),
+            error: None
+        };
+
+        self.receive( &mut reset )?;
+        Ok( result )
+    }
+}
+
+impl Drop for Slave {
+    fn drop( &mut self ) {
+        let _ = self.child.kill();
+        let _ = self.child.wait();
+    }
+}
+
+pub struct ScriptSlavePool {
+    executable: PathBuf,
+    data_path: PathBuf,
+    idle: Mutex< Vec< Slave > >
+}
+
+impl ScriptSlavePool {
+    /// Starts `count` slaves right away, so that they can already load the data in the background.
+    pub fn new( data_path: &Path, count: usize ) -> io::Result< Self > {
+        ScriptSlavePool::with_executable( &std::env::current_exe()?, data_path, count )
+    }
+
+    /// Same as `new`, except the slaves are spawned from the given `bytehound` executable.
+    pub fn with_executable( executable: &Path, data_path: &Path, count: usize ) -> io::Result< Self > {
+        let idle = (0..count).map( |_| Slave::spawn( executable, data_path ) ).collect::< io::Result< Vec< _ > > >()?;
+        Ok( ScriptSlavePool {
+            executable: executable.to_owned(),
+            data_path: data_path.to_owned(),
+            idle: Mutex::new( idle )
+        })
+    }
+
+    /// Runs the `code` on one of the idle slaves, spawning a new one if they're all busy.
+    ///
+    /// An error is returned only if the slave itself has failed, e.g. because it crashed;
+    /// the errors of the script are returned in the `SlaveResult`.
+    pub fn run( &self, code: &str ) -> io::Result< SlaveResult > {
+        let slave = self.idle.lock().pop();
+        let mut slave = match slave {
+            Some( slave ) => slave,
+            None => Slave::spawn( &self.executable, &self.data_path )?
+        };
+
+        // A slave which failed is dropped, and that kills it.
+        let result = slave.run( code )?;
+        self.idle.lock().push( slave );
+        Ok( result )
+    }
+}
+
+#[test]
+fn test_parse_message() {
+    match parse_message( r#"{"kind":"println","message":"Hello!"}"# ).unwrap() {
+        Message::Output( ScriptOutputKind::PrintLine( message ) ) => assert_eq!( message, "Hello!" ),
+        _ => panic!()
+    }
+
+    match parse_message( r#"{"kind":"image","path":"/a.svg","data":[60,62]}"# ).unwrap() {
+        Message::Output( ScriptOutputKind::Image { path, data } ) => {
+            assert_eq!( path, "/a.svg" );
+            assert_eq!( *data, b"<>".to_vec() );
+        },
+        _ => panic!()
+    }
+
+    match parse_message( r#"{"kind":"runtime_error","message":"oops","line":2,"column":null}"# ).unwrap() {
+        Message::Error( error ) => {
+            assert_eq!( error.message, "oops" );
+            assert_eq!( error.line, Some( 2 ) );
+            assert_eq!( error.column, None );
+        },
+        _ => panic!()
+    }
+
+    assert!( matches!( parse_message( r#"{"kind":"idle"}"# ).unwrap(), Message::Idle ) );
+    assert!( parse_message( r#"{"kind":"unknown"}"# ).is_err() );
+    assert!( parse_message( "garbage" ).is_err() );
+}
@@ -0,0 +1,337 @@
+//! Mapping of the requested allocation sizes onto the size classes of the common allocators.
+//!
+//! Every allocator rounds the requested sizes up to one of its size classes, and the difference
+//! is slack which is paid for but never used. The size classes here are those of the allocators'
+//! default configurations on 64-bit Linux; the glibc ones assume the default mmap threshold.
+
+use std::collections::BTreeMap;
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+
+use crate::{Allocation, AllocationId, Data};
+
+pub(crate) const PAGE_SIZE: u64 = 4096;
+
+// The default `M_MMAP_THRESHOLD`.
+pub(crate) const GLIBC_MMAP_THRESHOLD: u64 = 128 * 1024;
+
+// Anything bigger than this gets its own pages instead of being put into a bin.
+pub(crate) const MIMALLOC_MEDIUM_OBJECT_SIZE_MAX: u64 = 128 * 1024;
+
+#[derive(Copy, Clone, PartialEq, Eq, Hash, Debug)]
+pub enum SizeClassAllocator {
+    Glibc,
+    Jemalloc,
+    Mimalloc
+}
+
+#[inline]
+fn round_up( value: u64, alignment: u64 ) -> u64 {
+    (value + alignment - 1) / alignment * alignment
+}
+
+#[inline]
+fn log2( value: u64 ) -> u32 {
+    63 - value.leading_zeros()
+}
+
+fn glibc_size_class( size: u64 ) -> u64 {
+    // This mirrors `request2size`; the chunk's header takes 8 bytes, but the first 8 bytes
+    // of the next chunk can be used while this one is in use.
+    let chunk_size = std::cmp::max( round_up( size + 8, 16 ), 32 );
+    if chunk_size >= GLIBC_MMAP_THRESHOLD {
+        round_up( chunk_size + 8, PAGE_SIZE ) - 16
+    } else {
+        chunk_size - 8
+    }
+}
+
+fn jemalloc_size_class( size: u64 ) -> u64 {
+    // This follows what `sc.c` generates: a few tiny and quantum spaced classes,
+    // and then four classes for every doubling.
+    if size <= 8 {
+        8
+    } else if size <= 128 {
+        round_up( size, 16 )
+    } else {
+        round_up( size, 1 << (log2( size - 1 ) - 2) )
+    }
+}
+
+fn mimalloc_os_good_alloc_size( size: u64 ) -> u64 {
+    let alignment = if size < 512 * 1024 {
+        PAGE_SIZE
+    } else if size < 2 * 1024 * 1024 {
+        64 * 1024
+    } else if size < 8 * 1024 * 1024 {
+        256 * 1024
+    } else if size < 32 * 1024 * 1024 {
+        1024 * 1024
+    } else {
+        4 * 1024 * 1024
+    };
+
+    round_up( size, alignment )
+}
+
+fn mimalloc_size_class( size: u64 ) -> u64 {
+    if size > MIMALLOC_MEDIUM_OBJECT_SIZE_MAX {
+        return mimalloc_os_good_alloc_size( size );
+    }
+
+    // This mirrors `_mi_bin`: the bins are a word apart up until eight words, and then
+    // there are four bins for every doubling.
+    let words = std::cmp::max( (size + 7) / 8, 1 );
+    let words = if words <= 8 {
+        words
+    } else {
+        round_up( words, 1 << (log2( words - 1 ) - 2) )
+    };
+
+    words * 8
+}
+
+impl SizeClassAllocator {
+    pub const ALL: &'static [SizeClassAllocator] = &[
+        SizeClassAllocator::Glibc,
+        SizeClassAllocator::Jemalloc,
+        SizeClassAllocator::Mimalloc
+    ];
+
+    pub fn name( self ) -> &'static str {
+        match self {
+            SizeClassAllocator::Glibc => "glibc",
+            SizeClassAllocator::Jemalloc => "jemalloc",
+            SizeClassAllocator::Mimalloc => "mimalloc"
+        }
+    }
+
+    pub fn from_name( name: &str ) -> Option< Self > {
+        SizeClassAllocator::ALL.iter().copied().find( |allocator| allocator.name() == name )
+    }
+
+    /// Returns how many bytes the allocator will actually hand out for the given request.
+    pub fn size_class( self, size: u64 ) -> u64 {
+        match self {
+            SizeClassAllocator::Glibc => glibc_size_class( size ),
+            SizeClassAllocator::Jemalloc => jemalloc_size_class( size ),
+            SizeClassAllocator::Mimalloc => mimalloc_size_class( size )
+        }
+    }
+
+    /// Returns the biggest size class which is smaller than the one of the given request, if any.
+    pub fn previous_size_class( self, size: u64 ) -> Option< u64 > {
+        let size_class = self.size_class( size );
+
+        // Find the smallest request which still ends up in the same size class.
+        let mut low = 0;
+        let mut high = size;
+        while low < high {
+            let middle = low + (high - low) / 2;
+            if self.size_class( middle ) < size_class {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        if low == 0 {
+            None
+        } else {
+            Some( self.size_class( low - 1 ) )
+        }
+    }
+}
+
+/// The allocations which ended up in a single size class.
+#[derive(Clone, Debug, PartialEq)]
+pub struct SizeClass {
+    pub size_class: u64,
+    pub previous_size_class: Option< u64 >,
+    pub count: u64,
+    /// The sum of all of the requested sizes.
+    pub requested: u64,
+    pub min_requested_size: u64,
+    pub max_requested_size: u64
+}
+
+impl SizeClass {
+    /// How many of the allocated bytes were never requested.
+    pub fn slack( &self ) -> u64 {
+        self.size_class * self.count - self.requested
+    }
+
+    /// By how many bytes the biggest request would have to shrink to fit into the previous size class.
+    pub fn trim_by( &self ) -> Option< u64 > {
+        self.previous_size_class.map( |previous| self.max_requested_size - previous )
+    }
+
+    /// How many bytes would be saved if every one of these allocations fit into the previous size class.
+    pub fn savings_if_trimmed( &self ) -> u64 {
+        self.previous_size_class.map( |previous| (self.size_class - previous) * self.count ).unwrap_or( 0 )
+    }
+}
+
+/// A histogram of the requested sizes, bucketed into the size classes of one allocator.
+#[derive(Clone, Debug)]
+pub struct SizeClassHistogram {
+    pub allocator: SizeClassAllocator,
+    /// Sorted by the size class.
+    pub size_classes: Vec< SizeClass >,
+    /// How much slack the profiled allocator actually reported.
+    pub recorded_slack: u64
+}
+
+impl SizeClassHistogram {
+    pub fn requested( &self ) -> u64 {
+        self.size_classes.iter().map( |size_class| size_class.requested ).sum()
+    }
+
+    pub fn slack( &self ) -> u64 {
+        self.size_classes.iter().map( |size_class| size_class.slack() ).sum()
+    }
+}
+
+/// Returns the size which was originally requested for a given allocation.
+pub(crate) fn requested_size( allocation: &Allocation ) -> u64 {
+    // The sizes of the sampled allocations are scaled, so get the original request back.
+    if allocation.is_sampled() {
+        (allocation.size as f64 / allocation.sample_weight as f64).round() as u64
+    } else {
+        allocation.size
+    }
+}
+
+/// How many allocations of every requested size there are.
+#[derive(Clone, Debug, Default)]
+pub struct RequestedSizes {
+    counts: Vec< (u64, u64) >,
+    recorded_slack: u64
+}
+
+impl RequestedSizes {
+    pub fn new( data: &Data, ids: &[AllocationId] ) -> Self {
+        let (counts, recorded_slack) = ids.par_iter()
+            .fold( || (HashMap::new(), 0), |(mut counts, mut recorded_slack): (HashMap< u64, u64 >, u64), &id| {
+                let allocation = data.get_allocation( id );
+                let size = requested_size( allocation );
+                *counts.entry( size ).or_default() += allocation.sample_count();
+                recorded_slack += allocation.extra_usable_space as u64;
+                (counts, recorded_slack)
+            })
+            .reduce( || (HashMap::new(), 0), |(mut lhs, lhs_slack), (rhs, rhs_slack)| {
+                for (size, count) in rhs {
+                    *lhs.entry( size ).or_default() += count;
+                }
+                (lhs, lhs_slack + rhs_slack)
+            });
+
+        let mut counts: Vec< _ > = counts.into_iter().collect();
+        counts.sort_unstable();
+
+        RequestedSizes {
+            counts,
+            recorded_slack
+        }
+    }
+
+    pub fn histogram( &self, allocator: SizeClassAllocator ) -> SizeClassHistogram {
+        let mut size_classes: BTreeMap< u64, SizeClass > = BTreeMap::new();
+        for &(size, count) in &self.counts {
+            let size_class = allocator.size_class( size );
+            let entry = size_classes.entry( size_class ).or_insert_with( || SizeClass {
+                size_class,
+                previous_size_class: allocator.previous_size_class( size ),
+                count: 0,
+                requested: 0,
+                min_requested_size: size,
+                max_requested_size: size
+            });
+
+            entry.count += count;
+            entry.requested += size * count;
+            entry.min_requested_size = std::cmp::min( entry.min_requested_size, size );
+            entry.max_requested_size = std::cmp::max( entry.max_requested_size, size );
+        }
+
+        SizeClassHistogram {
+            allocator,
+            size_classes: size_classes.into_iter().map( |(_, size_class)| size_class ).collect(),
+            recorded_slack: self.recorded_slack
+        }
+    }
+}
+
+#[test]
+fn test_size_classes() {
+    let classes = |allocator: SizeClassAllocator, sizes: &[u64]| -> Vec< u64 > {
+        sizes.iter().map( |&size| allocator.size_class( size ) ).collect()
+    };
+
+    assert_eq!(
+        classes( SizeClassAllocator::Glibc, &[0, 1, 24, 25, 40, 41, 1000, 200 * 1024] ),
+        vec![ 24, 24, 24, 40, 40, 56, 1000, 200 * 1024 + 4096 - 16 ]
+    );
+
+    assert_eq!(
+        classes( SizeClassAllocator::Jemalloc, &[0, 8, 9, 17, 128, 129, 161, 257, 1025, 16 * 1024 + 1] ),
+        vec![ 8, 8, 16, 32, 128, 160, 192, 320, 1280, 20 * 1024 ]
+    );
+
+    assert_eq!(
+        classes( SizeClassAllocator::Mimalloc, &[0, 8, 9, 24, 65, 81, 129, 200 * 1024] ),
+        vec![ 8, 8, 16, 24, 80, 96, 160, 200 * 1024 ]
+    );
+
+    assert_eq!( SizeClassAllocator::Jemalloc.previous_size_class( 129 ), Some( 128 ) );
+    assert_eq!( SizeClassAllocator::Jemalloc.previous_size_class( 160 ), Some( 128 ) );
+    assert_eq!( SizeClassAllocator::Jemalloc.previous_size_class( 8 ), None );
+    assert_eq!( SizeClassAllocator::Glibc.previous_size_class( 41 ), Some( 40 ) );
+    assert_eq!( SizeClassAllocator::Glibc.previous_size_class( 24 ), None );
+
+    for &allocator in SizeClassAllocator::ALL {
+        assert_eq!( SizeClassAllocator::from_name( allocator.name() ), Some( allocator ) );
+        let mut last = 0;
+        for size in 0..256 * 1024 {
+            let size_class = allocator.size_class( size );
+            assert!( size_class >= size );
+            assert!( size_class >= last );
+            last = size_class;
+        }
+    }
+}
+
+#[test]
+fn test_size_class_histogram() {
+    let sizes = RequestedSizes {
+        counts: vec![ (129, 10), (150, 2), (256, 1) ],
+        recorded_slack: 123
+    };
+
+    let histogram = sizes.histogram( SizeClassAllocator::Jemalloc );
+    assert_eq!( histogram.size_classes, vec![
+        SizeClass {
+            size_class: 160,
+            previous_size_class: Some( 128 ),
+            count: 12,
+            requested: 129 * 10 + 150 * 2,
+            min_requested_size: 129,
+            max_requested_size: 150
+        },
+        SizeClass {
+            size_class: 256,
+            previous_size_class: Some( 224 ),
+            count: 1,
+            requested: 256,
+            min_requested_size: 256,
+            max_requested_size: 256
+        }
+    ]);
+
+    assert_eq!( histogram.size_classes[ 0 ].slack(), 160 * 12 - (129 * 10 + 150 * 2) );
+    assert_eq!( histogram.size_classes[ 0 ].trim_by(), Some( 22 ) );
+    assert_eq!( histogram.size_classes[ 0 ].savings_if_trimmed(), 32 * 12 );
+    assert_eq!( histogram.slack(), histogram.size_classes[ 0 ].slack() );
+    assert_eq!( histogram.recorded_slack, 123 );
+}
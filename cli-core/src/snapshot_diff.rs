@@ -0,0 +1,215 @@
+//! Per-backtrace differences between what was alive at two points in time.
+//!
+//! Within a single trace only the operations between the two timestamps are looked at, since
+//! everything which happened before the earlier one cancels out; the live sets themselves are never built.
+//! Two different traces don't share their backtraces, so there the live memory is counted separately
+//! for each side and the backtraces are then matched by their symbolicated frames. The frames which
+//! weren't symbolicated are matched by their address, so those will only match between runs of the same
+//! binary without ASLR.
+
+use std::hash::Hash;
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+
+use crate::{AllocationId, BacktraceId, Data, Timestamp};
+
+/// How many more allocations from a single backtrace were alive at a later point in time.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub struct BacktraceDiff {
+    /// The backtrace in the earlier snapshot; `None` if it had nothing alive there.
+    pub before: Option< BacktraceId >,
+    /// The backtrace in the later snapshot; `None` if it had nothing alive there.
+    pub after: Option< BacktraceId >,
+    pub count: i64,
+    pub size: i64
+}
+
+type Counters = HashMap< BacktraceId, (i64, i64) >;
+
+#[inline]
+fn add( counters: &mut Counters, data: &Data, id: AllocationId, sign: i64 ) {
+    let allocation = data.get_allocation( id );
+    let entry = counters.entry( allocation.backtrace ).or_default();
+    entry.0 += sign * allocation.sample_count() as i64;
+    entry.1 += sign * allocation.size as i64;
+}
+
+fn merge( mut lhs: Counters, rhs: Counters ) -> Counters {
+    for (backtrace, (count, size)) in rhs {
+        let entry = lhs.entry( backtrace ).or_default();
+        entry.0 += count;
+        entry.1 += size;
+    }
+    lhs
+}
+
+/// Counts what was alive at the given point in time.
+fn live_at( data: &Data, timestamp: Timestamp ) -> Counters {
+    data.alloc_alive_at( timestamp ).par_iter()
+        .fold( Counters::new, |mut output, &id| {
+            add( &mut output, data, id, 1 );
+            output
+        })
+        .reduce( Counters::new, merge )
+}
+
+/// Drops the backtraces which didn't change and puts the ones which grew the most first.
+fn finish( mut diffs: Vec< BacktraceDiff > ) -> Vec< BacktraceDiff > {
+    diffs.retain( |diff| diff.count != 0 || diff.size != 0 );
+    diffs.par_sort_unstable_by( |lhs, rhs| {
+        rhs.size.cmp( &lhs.size )
+            .then( rhs.count.cmp( &lhs.count ) )
+            .then( lhs.after.cmp( &rhs.after ) )
+            .then( lhs.before.cmp( &rhs.before ) )
+    });
+
+    diffs
+}
+
+/// Diffs what was alive in a single trace at two given points in time.
+pub fn diff_timestamps( data: &Data, before: Timestamp, after: Timestamp ) -> Vec< BacktraceDiff > {
+    let (start, end, sign) = if before <= after { (before, after, 1) } else { (after, before, -1) };
+
+    // Only the operations in `(start, end]` change what's alive.
+    let ops = data.operation_ids();
+    let first = ops.partition_point( |&op| data.operation_timestamp( op ) <= start );
+    let last = ops.partition_point( |&op| data.operation_timestamp( op ) <= end );
+
+    let counters = ops[ first..std::cmp::max( first, last ) ].par_iter()
+        .fold( Counters::new, |mut output, &op| {
+            if op.is_deallocation() {
+                add( &mut output, data, op.id(), -1 );
+            } else {
+                add( &mut output, data, op.id(), 1 );
+                if op.is_reallocation() {
+                    let old_id = data.get_allocation( op.id() ).reallocated_from.unwrap();
+                    add( &mut output, data, old_id, -1 );
+                }
+            }
+            output
+        })
+        .reduce( Counters::new, merge );
+
+    finish( counters.into_iter().map( |(backtrace, (count, size))| BacktraceDiff {
+        before: Some( backtrace ),
+        after: Some( backtrace ),
+        count: sign * count,
+        size: sign * size
+    }).collect() )
+}
+
+#[derive(PartialEq, Eq, Hash)]
+struct FrameKey< 'a > {
+    library: Option< &'a str >,
+    function: Option< &'a str >,
+    source: Option< &'a str >,
+    line: Option< u32 >,
+    is_inline: bool,
+    /// Only for the frames which weren't symbolicated.
+    address: Option< u64 >
+}
+
+fn backtrace_key< 'a >( data: &'a Data, backtrace: BacktraceId ) -> Vec< FrameKey< 'a > > {
+    let resolve = |id| data.interner().resolve( id );
+    data.get_backtrace( backtrace ).map( |(_, frame)| {
+        let function = frame.any_function().and_then( resolve );
+        FrameKey {
+            library: frame.library().and_then( resolve ),
+            function,
+            source: frame.source().and_then( resolve ),
+            line: frame.line(),
+            is_inline: frame.is_inline(),
+            address: if function.is_none() { Some( frame.address().raw() ) } else { None }
+        }
+    }).collect()
+}
+
+fn keyed< 'a >( data: &'a Data, counters: Counters ) -> Vec< (Vec< FrameKey< 'a > >, BacktraceId, (i64, i64)) > {
+    counters.into_par_iter().map( |(backtrace, counter)| (backtrace_key( data, backtrace ), backtrace, counter) ).collect()
+}
+
+/// Matches up the live counters of two snapshots by the keys of their backtraces.
+///
+/// Several backtraces of the same snapshot can end up with the same key, in which case they're
+/// counted together under the one with the lowest ID.
+fn diff_by_key< K >( before: Vec< (K, BacktraceId, (i64, i64)) >, after: Vec< (K, BacktraceId, (i64, i64)) > ) -> Vec< BacktraceDiff >
+    where K: Hash + Eq
+{
+    fn set_min( target: &mut Option< BacktraceId >, backtrace: BacktraceId ) {
+        if target.map( |target| backtrace < target ).unwrap_or( true ) {
+            *target = Some( backtrace );
+        }
+    }
+
+    let mut by_key: HashMap< K, BacktraceDiff > = HashMap::new();
+    let empty = || BacktraceDiff { before: None, after: None, count: 0, size: 0 };
+    for (key, backtrace, (count, size)) in before {
+        let entry = by_key.entry( key ).or_insert_with( empty );
+        set_min( &mut entry.before, backtrace );
+        entry.count -= count;
+        entry.size -= size;
+    }
+
+    for (key, backtrace, (count, size)) in after {
+        let entry = by_key.entry( key ).or_insert_with( empty );
+        set_min( &mut entry.after, backtrace );
+        entry.count += count;
+        entry.size += size;
+    }
+
+    finish( by_key.into_iter().map( |(_, diff)| diff ).collect() )
+}
+
+/// Diffs what was alive at a given point in time in one trace with what was alive in another one.
+pub fn diff_traces( before: &Data, before_at: Timestamp, after: &Data, after_at: Timestamp ) -> Vec< BacktraceDiff > {
+    if before.id() == after.id() {
+        return diff_timestamps( after, before_at, after_at );
+    }
+
+    let (before_counters, after_counters) = rayon::join(
+        || live_at( before, before_at ),
+        || live_at( after, after_at )
+    );
+
+    diff_by_key( keyed( before, before_counters ), keyed( after, after_counters ) )
+}
+
+#[test]
+fn test_diff_by_key() {
+    let bt = BacktraceId::new;
+    let diffs = diff_by_key(
+        vec![
+            ("a", bt( 1 ), (10, 1000)),
+            ("b", bt( 2 ), (5, 50)),
+            ("c", bt( 3 ), (1, 10)),
+            ("c", bt( 4 ), (2, 20))
+        ],
+        vec![
+            ("a", bt( 7 ), (12, 1500)),
+            ("b", bt( 8 ), (5, 50)),
+            ("d", bt( 9 ), (1, 100))
+        ]
+    );
+
+    assert_eq!( diffs, vec![
+        BacktraceDiff { before: Some( bt( 1 ) ), after: Some( bt( 7 ) ), count: 2, size: 500 },
+        BacktraceDiff { before: None, after: Some( bt( 9 ) ), count: 1, size: 100 },
+        BacktraceDiff { before: Some( bt( 3 ) ), after: None, count: -3, size: -30 }
+    ]);
+}
+
+#[test]
+fn test_finish() {
+    let bt = |id| Some( BacktraceId::new( id ) );
+    let diff = |id, count, size| BacktraceDiff { before: bt( id ), after: bt( id ), count, size };
+    let diffs = finish( vec![
+        diff( 1, -1, -100 ),
+        diff( 2, 0, 0 ),
+        diff( 3, 2, 100 ),
+        diff( 4, 1, 100 ),
+        diff( 5, 1, 0 )
+    ]);
+
+    assert_eq!( diffs, vec![ diff( 3, 2, 100 ), diff( 4, 1, 100 ), diff( 5, 1, 0 ), diff( 1, -1, -100 ) ] );
+}
@@ -0,0 +1,103 @@
+use rayon::prelude::*;
+
+use crate::data::{AllocationId, Timestamp};
+
+/// Sorts the values with a least significant digit radix sort.
+///
+/// Digits which are the same for every value are skipped, so this only does
+/// as many passes as there are significant bytes in the values.
+fn radix_sort( values: &mut Vec< u64 > ) {
+    let length = values.len();
+    let mut buffer = vec![ 0; length ];
+    let all_bits = values.iter().fold( 0, |bits, &value| bits | value );
+    let mut shift = 0;
+    while shift < 64 && (all_bits >> shift) != 0 {
+        let mut offsets = [0; 256];
+        for &value in values.iter() {
+            offsets[ ((value >> shift) & 0xff) as usize ] += 1;
+        }
+
+        if offsets.iter().all( |&count| count == 0 || count == length ) {
+            shift += 8;
+            continue;
+        }
+
+        let mut offset = 0;
+        for slot in offsets.iter_mut() {
+            let count = *slot;
+            *slot = offset;
+            offset += count;
+        }
+
+        for &value in values.iter() {
+            let slot = &mut offsets[ ((value >> shift) & 0xff) as usize ];
+            buffer[ *slot ] = value;
+            *slot += 1;
+        }
+
+        std::mem::swap( values, &mut buffer );
+        shift += 8;
+    }
+}
+
+/// Returns the IDs of all of the allocations sorted by the given `keys`, with ties sorted by the ID.
+pub fn sort_ids_by_key( keys: &[u64] ) -> Vec< AllocationId > {
+    let length = keys.len();
+    if length == 0 {
+        return Vec::new();
+    }
+
+    let (min, max) = keys.par_iter().fold( || (!0, 0), |(min, max), &key| (std::cmp::min( min, key ), std::cmp::max( max, key )) )
+        .reduce( || (!0, 0), |(min_a, max_a), (min_b, max_b)| (std::cmp::min( min_a, min_b ), std::cmp::max( max_a, max_b )) );
+
+    // If both the key and the ID fit into a single word we can sort them together.
+    let id_bits = 64 - (length as u64).leading_zeros();
+    let key_bits = 64 - (max - min).leading_zeros();
+    if id_bits + key_bits > 64 {
+        let mut ids: Vec< _ > = (0..length).map( |index| AllocationId::new( index as _ ) ).collect();
+        ids.par_sort_by_key( |id| keys[ id.raw() as usize ] );
+        return ids;
+    }
+
+    let mut packed: Vec< u64 > = keys.par_iter().enumerate().map( |(index, &key)| ((key - min) << id_bits) | index as u64 ).collect();
+    radix_sort( &mut packed );
+
+    let mask = (1 << id_bits) - 1;
+    packed.into_par_iter().map( |value| AllocationId::new( (value & mask) as _ ) ).collect()
+}
+
+/// Returns the IDs of all of the allocations sorted by their timestamps, with ties sorted by the ID.
+///
+/// The allocations are mostly created in the order of their timestamps, so this is usually
+/// already sorted and only needs to be checked; otherwise the stable sort merges the existing runs.
+pub fn sort_ids_by_timestamp( timestamps: &[Timestamp] ) -> Vec< AllocationId > {
+    let mut ids: Vec< _ > = (0..timestamps.len()).into_par_iter().map( |index| AllocationId::new( index as _ ) ).collect();
+    let is_sorted = timestamps.par_windows( 2 ).all( |pair| pair[ 0 ] <= pair[ 1 ] );
+    if !is_sorted {
+        ids.par_sort_by_key( |id| timestamps[ id.raw() as usize ] );
+    }
+
+    ids
+}
+
+#[test]
+fn test_sort_ids_by_key() {
+    fn check( keys: &[u64] ) {
+        let mut expected: Vec< _ > = (0..keys.len()).map( |index| AllocationId::new( index as _ ) ).collect();
+        expected.sort_by_key( |id| keys[ id.raw() as usize ] );
+        assert_eq!( sort_ids_by_key( keys ), expected );
+    }
+
+    check( &[] );
+    check( &[5] );
+    check( &[3, 1, 2, 1, 0x1000, 0x100000, 3] );
+    check( &(0..5000).map( |index| (index * 7919) % 1013 + 0x7f00_0000_0000 ).collect::< Vec< _ > >() );
+    check( &[!0, 0, 1 << 63, 12] );
+}
+
+#[test]
+fn test_sort_ids_by_timestamp() {
+    let timestamps: Vec< _ > = [1, 2, 2, 5, 3, 3, 8].iter().map( |&secs| Timestamp::from_usecs( secs ) ).collect();
+    let ids: Vec< _ > = sort_ids_by_timestamp( &timestamps ).into_iter().map( |id| id.raw() ).collect();
+    assert_eq!( ids, vec![ 0, 1, 2, 4, 5, 3, 6 ] );
+}
@@ -1,5 +1,6 @@
 use std::io::{self, Read, Write};
 use std::cmp::{max, min};
+use std::hash::{BuildHasher, Hasher};
 
 use std::collections::hash_map::Entry;
 use ahash::AHashMap as HashMap;
@@ -18,7 +19,7 @@ use common::event::{
 use crate::loader::Loader;
 use crate::threaded_lz4_stream::Lz4Writer;
 
-use crate::reader::parse_events;
+use crate::reader::parse_events_in_background;
 
 struct Allocation {
     counter: u64,
@@ -34,6 +35,60 @@ impl Allocation {
     }
 }
 
+/// All of the buffered allocations, so that the maps only need to hold their indexes.
+///
+/// Since the maps get drained and refilled on every flush this keeps them small,
+/// and the entries themselves never have to be moved around when the maps grow.
+#[derive(Default)]
+struct Allocations {
+    entries: Vec< Allocation >,
+    unused: Vec< u32 >
+}
+
+impl Allocations {
+    fn insert( &mut self, allocation: Allocation ) -> u32 {
+        if let Some( index ) = self.unused.pop() {
+            self.entries[ index as usize ] = allocation;
+            index
+        } else {
+            self.entries.push( allocation );
+            self.entries.len() as u32 - 1
+        }
+    }
+
+    fn get( &self, index: u32 ) -> &Allocation {
+        &self.entries[ index as usize ]
+    }
+
+    fn get_mut( &mut self, index: u32 ) -> &mut Allocation {
+        &mut self.entries[ index as usize ]
+    }
+
+    fn remove( &mut self, index: u32 ) -> Allocation {
+        self.unused.push( index );
+        let entry = &mut self.entries[ index as usize ];
+        Allocation {
+            counter: entry.counter,
+            events: std::mem::take( &mut entry.events )
+        }
+    }
+}
+
+/// Hashes the addresses of a backtrace, so that the backtraces can be deduplicated
+/// without having to keep all of them around.
+///
+/// With a 64-bit hash the chance of a collision even for tens of millions of unique
+/// backtraces is still on the order of one in a million.
+fn hash_backtrace( hasher: &ahash::RandomState, addresses: impl ExactSizeIterator< Item = u64 > ) -> u64 {
+    let mut hasher = hasher.build_hasher();
+    hasher.write_usize( addresses.len() );
+    for address in addresses {
+        hasher.write_u64( address );
+    }
+
+    hasher.finish()
+}
+
 struct BufferedAllocation {
     timestamp: Timestamp,
     allocation: AllocBody
@@ -77,25 +132,49 @@ struct GroupStatistics {
     max_size: u64
 }
 
+fn update_statistics( stats_by_backtrace: &mut HashMap< u64, GroupStatistics >, backtrace: u64, timestamp: Timestamp, usable_size: u64 ) {
+    let stats = stats_by_backtrace.entry( backtrace ).or_insert_with( || {
+        GroupStatistics {
+            first_allocation: timestamp,
+            last_allocation: timestamp,
+            free_count: 0,
+            free_size: 0,
+            min_size: usable_size,
+            max_size: usable_size
+        }
+    });
+
+    stats.first_allocation = min( stats.first_allocation, timestamp );
+    stats.last_allocation = max( stats.last_allocation, timestamp );
+    stats.min_size = min( stats.min_size, usable_size );
+    stats.max_size = max( stats.max_size, usable_size );
+}
+
 pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 > ) -> Result< (), io::Error >
     where F: Read + Send + 'static,
           G: Write + Send + 'static
 {
-    let (header, event_stream) = parse_events( input_fp )?;
+    // The input is decompressed on multiple threads and decoded on another one,
+    // and the output is compressed on multiple threads too, so this thread only
+    // has to deal with the culling itself.
+    let (header, event_stream) = parse_events_in_background( input_fp )?;
 
     let mut current_timestamp = header.initial_timestamp;
-    let mut ofp = Lz4Writer::new( output_fp );
+    let thread_count = std::thread::available_parallelism().map( |count| count.get() ).unwrap_or( 1 );
+    let mut ofp = Lz4Writer::with_thread_count( output_fp, thread_count );
     Event::Header( header ).write_to_stream( &mut ofp )?;
     let threshold = threshold.map( Timestamp::from_secs );
 
     {
         let mut previous_backtrace_on_thread = HashMap::new();
-        let mut backtrace_cache: HashMap< Vec< u64 >, u64 > = Default::default();
+        let backtrace_hasher = ahash::RandomState::with_seeds( 0x243F6A8885A308D3, 0x13198A2E03707344, 0xA4093822299F31D0, 0x082EFA98EC4E6C89 );
+        let mut backtrace_cache: HashMap< u64, u64 > = Default::default();
         let mut backtrace_map: HashMap< u64, u64 > = Default::default();
         let mut stats_by_backtrace: HashMap< u64, GroupStatistics > = Default::default();
-        let mut young_allocations_by_id: HashMap< AllocationId, Allocation > = Default::default();
-        let mut mature_allocations_by_id: HashMap< AllocationId, Allocation > = Default::default();
-        let mut allocations_by_pointer: HashMap< u64, Allocation > = Default::default();
+        let mut allocations = Allocations::default();
+        let mut young_allocations_by_id: HashMap< AllocationId, u32 > = Default::default();
+        let mut mature_allocations_by_id: HashMap< AllocationId, u32 > = Default::default();
+        let mut allocations_by_pointer: HashMap< u64, u32 > = Default::default();
         let mut last_flush = current_timestamp;
         let mut flushed_buffer = Vec::new();
         let mut allocation_counter = 0;
@@ -134,12 +213,13 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                 if current_timestamp - last_flush > threshold {
                     std::mem::swap( &mut young_allocations_by_id, &mut mature_allocations_by_id );
                     let mut allocations_kept = 0;
-                    for (id, allocation) in young_allocations_by_id.drain() {
-                        if allocation.events[0].timestamp < current_timestamp && current_timestamp - allocation.events[0].timestamp >= threshold {
-                            flushed_buffer.push( (id, allocation) );
+                    for (id, index) in young_allocations_by_id.drain() {
+                        let allocated_at = allocations.get( index ).events[0].timestamp;
+                        if allocated_at < current_timestamp && current_timestamp - allocated_at >= threshold {
+                            flushed_buffer.push( (id, allocations.remove( index )) );
                         } else {
                             // This should not happen, but let's handle it just in case.
-                            mature_allocations_by_id.insert( id, allocation );
+                            mature_allocations_by_id.insert( id, index );
                             allocations_kept += 1;
                         }
                     }
@@ -164,16 +244,16 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                 | Event::Free { .. }
                     => unreachable!(),
                 Event::Backtrace { id, ref addresses } => {
-                    let addresses = addresses.clone().into_owned();
-                    let new_id = backtrace_cache.entry( addresses ).or_insert( id );
+                    let hash = hash_backtrace( &backtrace_hasher, addresses.iter().copied() );
+                    let new_id = backtrace_cache.entry( hash ).or_insert( id );
                     backtrace_map.insert( id, *new_id );
                     if id != *new_id {
                         continue;
                     }
                 },
                 Event::Backtrace32 { id, ref addresses } => {
-                    let addresses = addresses.iter().map( |&p| p as u64 ).collect();
-                    let new_id = backtrace_cache.entry( addresses ).or_insert( id );
+                    let hash = hash_backtrace( &backtrace_hasher, addresses.iter().map( |&address| address as u64 ) );
+                    let new_id = backtrace_cache.entry( hash ).or_insert( id );
                     backtrace_map.insert( id, *new_id );
                     if id != *new_id {
                         continue;
@@ -183,7 +263,8 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                     let addresses = Loader::expand_partial_backtrace( &mut previous_backtrace_on_thread, thread, frames_invalidated, addresses.iter().cloned() );
                     *previous_backtrace_on_thread.get_mut( &thread ).unwrap() = addresses.clone();
 
-                    let new_id = backtrace_cache.entry( addresses.clone() ).or_insert( id );
+                    let hash = hash_backtrace( &backtrace_hasher, addresses.iter().copied() );
+                    let new_id = backtrace_cache.entry( hash ).or_insert( id );
                     backtrace_map.insert( id, *new_id );
                     if id != *new_id {
                         continue;
@@ -198,7 +279,8 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                     let addresses = Loader::expand_partial_backtrace( &mut previous_backtrace_on_thread, thread, frames_invalidated, addresses.iter().map( |&address| address as u64 ) );
                     *previous_backtrace_on_thread.get_mut( &thread ).unwrap() = addresses.clone();
 
-                    let new_id = backtrace_cache.entry( addresses.clone() ).or_insert( id );
+                    let hash = hash_backtrace( &backtrace_hasher, addresses.iter().copied() );
+                    let new_id = backtrace_cache.entry( hash ).or_insert( id );
                     backtrace_map.insert( id, *new_id );
                     if id != *new_id {
                         continue;
@@ -213,33 +295,16 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                     current_timestamp = std::cmp::max( timestamp, current_timestamp );
 
                     let usable_size = allocation.size + allocation.extra_usable_space as u64;
-                    {
-                        allocation.backtrace = backtrace_map.get( &allocation.backtrace ).copied().unwrap();
-                        let stats = stats_by_backtrace.entry( allocation.backtrace ).or_insert_with( || {
-                            GroupStatistics {
-                                first_allocation: timestamp,
-                                last_allocation: timestamp,
-                                free_count: 0,
-                                free_size: 0,
-                                min_size: usable_size,
-                                max_size: usable_size
-                            }
-                        });
-
-                        stats.first_allocation = min( stats.first_allocation, timestamp );
-                        stats.last_allocation = max( stats.last_allocation, timestamp );
-                        stats.min_size = min( stats.min_size, usable_size );
-                        stats.max_size = min( stats.max_size, usable_size );
-                    }
+                    allocation.backtrace = backtrace_map.get( &allocation.backtrace ).copied().unwrap();
+                    update_statistics( &mut stats_by_backtrace, allocation.backtrace, timestamp, usable_size );
 
-                    let entry;
+                    let index;
                     if !id.is_invalid() && !id.is_untracked() {
-                        entry = match young_allocations_by_id.entry( id ) {
+                        index = match young_allocations_by_id.entry( id ) {
                             Entry::Vacant( entry ) => {
                                 let counter = allocation_counter;
                                 allocation_counter += 1;
-                                let allocation = Allocation::new( counter );
-                                entry.insert( allocation )
+                                *entry.insert( allocations.insert( Allocation::new( counter ) ) )
                             },
                             Entry::Occupied( .. ) => {
                                 warn!( "Duplicate allocation with ID: {:?}", id );
@@ -247,12 +312,11 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                             }
                         };
                     } else {
-                        entry = match allocations_by_pointer.entry( allocation.pointer ) {
+                        index = match allocations_by_pointer.entry( allocation.pointer ) {
                             Entry::Vacant( entry ) => {
                                 let counter = allocation_counter;
                                 allocation_counter += 1;
-                                let allocation = Allocation::new( counter );
-                                entry.insert( allocation )
+                                *entry.insert( allocations.insert( Allocation::new( counter ) ) )
                             },
                             Entry::Occupied( .. ) => {
                                 warn!( "Duplicate allocation with address: 0x{:016X}", allocation.pointer );
@@ -261,37 +325,21 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                         };
                     }
 
-                    entry.events.push( BufferedAllocation { timestamp, allocation } );
+                    allocations.get_mut( index ).events.push( BufferedAllocation { timestamp, allocation } );
                     continue;
                 },
                 Event::ReallocEx { timestamp, mut allocation, old_pointer, id, .. } => {
                     let usable_size = allocation.size + allocation.extra_usable_space as u64;
-                    {
-                        allocation.backtrace = backtrace_map.get( &allocation.backtrace ).copied().unwrap();
-                        let stats = stats_by_backtrace.entry( allocation.backtrace ).or_insert_with( || {
-                            GroupStatistics {
-                                first_allocation: timestamp,
-                                last_allocation: timestamp,
-                                free_count: 0,
-                                free_size: 0,
-                                min_size: usable_size,
-                                max_size: usable_size
-                            }
-                        });
-
-                        stats.first_allocation = min( stats.first_allocation, timestamp );
-                        stats.last_allocation = max( stats.last_allocation, timestamp );
-                        stats.min_size = min( stats.min_size, usable_size );
-                        stats.max_size = min( stats.max_size, usable_size );
-                    }
+                    allocation.backtrace = backtrace_map.get( &allocation.backtrace ).copied().unwrap();
+                    update_statistics( &mut stats_by_backtrace, allocation.backtrace, timestamp, usable_size );
 
-                    let entry;
+                    let index;
                     if !id.is_invalid() && !id.is_untracked() {
-                        entry = match young_allocations_by_id.get_mut( &id ) {
-                            Some( entry ) => entry,
+                        index = match young_allocations_by_id.get( &id ) {
+                            Some( &index ) => index,
                             None => {
-                                match mature_allocations_by_id.get_mut( &id ) {
-                                    Some( entry ) => entry,
+                                match mature_allocations_by_id.get( &id ) {
+                                    Some( &index ) => index,
                                     None => {
                                         let event = Event::ReallocEx { timestamp, allocation, old_pointer, id };
                                         event.write_to_stream( &mut ofp )?;
@@ -301,44 +349,46 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                             }
                         };
                     } else {
-                        let old_entry = match allocations_by_pointer.remove( &old_pointer ) {
-                            Some( entry ) => entry,
+                        let old_index = match allocations_by_pointer.remove( &old_pointer ) {
+                            Some( index ) => index,
                             None => {
                                 warn!( "Invalid reallocation of address: 0x{:016X}", old_pointer );
                                 continue;
                             }
                         };
 
-                        entry = match allocations_by_pointer.entry( allocation.pointer ) {
-                            Entry::Vacant( entry ) => entry.insert( old_entry ),
+                        index = match allocations_by_pointer.entry( allocation.pointer ) {
+                            Entry::Vacant( entry ) => *entry.insert( old_index ),
                             Entry::Occupied( .. ) => {
                                 warn!( "Duplicate reallocation with address: 0x{:016X}", allocation.pointer );
+                                allocations.remove( old_index );
                                 continue;
                             }
                         };
                     }
 
-                    entry.events.push( BufferedAllocation { timestamp, allocation } );
+                    allocations.get_mut( index ).events.push( BufferedAllocation { timestamp, allocation } );
                     continue;
                 },
                 Event::FreeEx { id, timestamp, pointer, backtrace, thread } => {
-                    let mut entry;
+                    let mut index;
                     if !id.is_invalid() && !id.is_untracked() {
-                        entry = young_allocations_by_id.remove( &id );
-                        if entry.is_none() {
-                            entry = mature_allocations_by_id.remove( &id );
+                        index = young_allocations_by_id.remove( &id );
+                        if index.is_none() {
+                            index = mature_allocations_by_id.remove( &id );
                         }
 
-                        if entry.is_none() {
+                        if index.is_none() {
                             let event = Event::FreeEx { id, timestamp, pointer, backtrace, thread };
                             event.write_to_stream( &mut ofp )?;
                             continue;
                         }
                     } else {
-                        entry = allocations_by_pointer.remove( &pointer );
+                        index = allocations_by_pointer.remove( &pointer );
                     }
 
-                    if let Some( entry ) = entry {
+                    if let Some( index ) = index {
+                        let entry = allocations.remove( index );
                         if timestamp < entry.events[0].timestamp {
                             warn!( "Deallocation in the past of address: 0x{:016X}", pointer );
                         } else {
@@ -365,7 +415,9 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                 },
                 Event::MemoryMap { ref mut backtrace, .. } |
                 Event::MemoryUnmap { ref mut backtrace, .. } |
-                Event::Mallopt { ref mut backtrace, .. } => {
+                Event::Mallopt { ref mut backtrace, .. } |
+                Event::MemoryAdvice { ref mut backtrace, .. } |
+                Event::PoolAlloc { ref mut backtrace, .. } => {
                     *backtrace = backtrace_map.get( backtrace ).copied().unwrap();
                 },
 
@@ -398,9 +450,29 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                 Event::File64 { .. } => {},
                 Event::Header { .. } => {},
                 Event::MemoryDump { .. } => {},
+                Event::MemoryDumpStarted { .. } => {},
                 Event::Marker { .. } => {},
                 Event::Environ { .. } => {},
                 Event::WallClock { .. } => {},
+                Event::SamplingInterval { .. } => {},
+                Event::OptionChanged { .. } => {},
+                Event::ThreadTag { .. } => {},
+                Event::ThreadStarted { .. } => {},
+                Event::ThreadRenamed { .. } => {},
+                Event::ThreadExited { .. } => {},
+                Event::ChildData { .. } => {},
+                Event::PoolCreated { .. } => {},
+                Event::PoolFree { .. } => {},
+                Event::PoolReset { .. } => {},
+                Event::CgroupMemory { .. } => {},
+                Event::ParentData { .. } => {},
+                Event::BinaryReference { .. } => {},
+                Event::BinaryIdentity { .. } => {},
+                Event::ThreadContext { .. } => {},
+                Event::AllocCompact { .. } => {},
+                Event::ReallocCompact { .. } => {},
+                Event::ResizeCompact { .. } => {},
+                Event::FreeCompact { .. } => {},
                 Event::String { .. } => {},
                 Event::DecodedFrame { .. } => {},
                 Event::DecodedBacktrace { .. } => {},
@@ -408,21 +480,63 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
                 Event::AddRegion { .. } => {},
                 Event::RemoveRegion { .. } => {},
                 Event::UpdateRegionUsage { .. } => {},
+                Event::UpdateRegionUsageEx { .. } => {},
+                Event::BacktraceSummaries { ref mut entries, .. } => {
+                    let mut entries_owned = std::mem::take( entries ).into_owned();
+                    for entry in entries_owned.iter_mut() {
+                        entry.backtrace = backtrace_map.get( &entry.backtrace ).copied().unwrap();
+                    }
+
+                    *entries = entries_owned.into();
+                },
+                Event::ResidencySamples { ref mut entries, .. } => {
+                    let mut entries_owned = std::mem::take( entries ).into_owned();
+                    for entry in entries_owned.iter_mut() {
+                        entry.backtrace = backtrace_map.get( &entry.backtrace ).copied().unwrap();
+                    }
+
+                    *entries = entries_owned.into();
+                },
+                Event::JemallocStats { .. } => {},
+                Event::NumaPlacements { .. } => {},
+                Event::CulledAllocations { ref mut entries, .. } => {
+                    let mut entries_owned = std::mem::take( entries ).into_owned();
+                    for entry in entries_owned.iter_mut() {
+                        entry.backtrace = backtrace_map.get( &entry.backtrace ).copied().unwrap();
+                    }
+
+                    *entries = entries_owned.into();
+                },
+                Event::AllocatorLatencies { ref mut entries, .. } => {
+                    let mut entries_owned = std::mem::take( entries ).into_owned();
+                    for entry in entries_owned.iter_mut() {
+                        entry.backtrace = backtrace_map.get( &entry.backtrace ).copied().unwrap();
+                    }
+
+                    *entries = entries_owned.into();
+                },
+                Event::PageFaults { .. } => {},
+                Event::ProfilerStatistics { .. } => {},
+                Event::BacktraceCacheStatistics { .. } => {},
+                Event::Checkpoint { .. } => {
+                    // Most of the allocations in these get stripped out, so there's no point in keeping them.
+                    continue;
+                },
             }
 
             event.write_to_stream( &mut ofp )?;
         }
 
-        for (id, bucket) in mature_allocations_by_id {
-            emit( id, bucket.events, &mut ofp )?;
+        for (id, index) in mature_allocations_by_id {
+            emit( id, allocations.remove( index ).events, &mut ofp )?;
         }
 
-        for (id, bucket) in young_allocations_by_id {
-            emit( id, bucket.events, &mut ofp )?;
+        for (id, index) in young_allocations_by_id {
+            emit( id, allocations.remove( index ).events, &mut ofp )?;
         }
 
-        for (_, bucket) in allocations_by_pointer {
-            emit( common::event::AllocationId::UNTRACKED, bucket.events, &mut ofp )?;
+        for (_, index) in allocations_by_pointer {
+            emit( common::event::AllocationId::UNTRACKED, allocations.remove( index ).events, &mut ofp )?;
         }
 
         for (backtrace, stats) in stats_by_backtrace {
@@ -439,7 +553,5 @@ pub fn squeeze_data< F, G >( input_fp: F, output_fp: G, threshold: Option< u64 >
         }
     }
 
-    ofp.flush()?;
-
-    Ok(())
+    ofp.finish()
 }
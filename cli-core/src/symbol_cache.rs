@@ -0,0 +1,474 @@
+//! A persistent cache of symbolicated frames, shared between runs.
+//!
+//! Every binary with a build ID gets its own file in the cache directory, which maps
+//! addresses relative to the start of the binary to the frames they were symbolicated to.
+
+use std::fs::{self, File};
+use std::io::{self, BufReader, BufWriter, Read, Write};
+use std::mem;
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+
+use ahash::AHashMap as HashMap;
+use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
+use fast_range_map::{FrozenRangeMap, RangeMap};
+use parking_lot::Mutex;
+
+use crate::data::{CodePointer, StringInterner};
+use crate::frame::Frame;
+
+const MAGIC: &[u8; 8] = b"BHSYMS\0\0";
+const VERSION: u64 = 1;
+
+static SYMBOL_CACHE_DIRECTORY: Mutex< Option< PathBuf > > = parking_lot::const_mutex( None );
+
+lazy_static::lazy_static! {
+    /// Every binary's cache is only read once per process and then shared between all of the loaders,
+    /// so when multiple files from the same build are loaded in parallel they can reuse each other's work.
+    static ref LOADED_BINARIES: Mutex< HashMap< PathBuf, Arc< Mutex< CachedBinary > > > > = Mutex::new( HashMap::new() );
+}
+
+/// Sets the directory where the symbolicated frames are cached; `None` disables the cache.
+pub fn set_symbol_cache_directory( path: Option< PathBuf > ) {
+    *SYMBOL_CACHE_DIRECTORY.lock() = path;
+}
+
+/// A symbolicated frame which owns its strings, so it can be made without access to an interner.
+#[derive(Clone, PartialEq, Eq, Default, Debug)]
+pub struct CachedFrame {
+    pub library: Option< String >,
+    pub function: Option< String >,
+    pub raw_function: Option< String >,
+    pub source: Option< String >,
+    pub line: Option< u32 >,
+    pub column: Option< u32 >,
+    pub is_inline: bool
+}
+
+impl CachedFrame {
+    fn from_frame( interner: &StringInterner, frame: &Frame ) -> Self {
+        let resolve = |id| interner.resolve( id ).map( |string| string.to_owned() );
+        CachedFrame {
+            library: frame.library().and_then( resolve ),
+            function: frame.function().and_then( resolve ),
+            raw_function: frame.raw_function().and_then( resolve ),
+            source: frame.source().and_then( resolve ),
+            line: frame.line(),
+            column: frame.column(),
+            is_inline: frame.is_inline()
+        }
+    }
+
+    fn to_frame( &self, interner: &mut StringInterner, address: u64 ) -> Frame {
+        let mut frame = Frame::new_unknown( CodePointer::new( address ) );
+        if let Some( ref string ) = self.library {
+            frame.set_library( interner.get_or_intern( string ) );
+        }
+        if let Some( ref string ) = self.function {
+            frame.set_function( interner.get_or_intern( string ) );
+        }
+        if let Some( ref string ) = self.raw_function {
+            frame.set_raw_function( interner.get_or_intern( string ) );
+        }
+        if let Some( ref string ) = self.source {
+            frame.set_source( interner.get_or_intern( string ) );
+        }
+        if let Some( value ) = self.line {
+            frame.set_line( value );
+        }
+        if let Some( value ) = self.column {
+            frame.set_column( value );
+        }
+
+        frame.set_is_inline( self.is_inline );
+        frame
+    }
+}
+
+fn write_string< W: Write >( fp: &mut W, string: &Option< String > ) -> io::Result< () > {
+    match *string {
+        Some( ref string ) => {
+            fp.write_u32::< LittleEndian >( string.len() as u32 )?;
+            fp.write_all( string.as_bytes() )
+        },
+        None => fp.write_u32::< LittleEndian >( !0 )
+    }
+}
+
+fn read_string< R: Read >( fp: &mut R ) -> io::Result< Option< String > > {
+    let length = fp.read_u32::< LittleEndian >()?;
+    if length == !0 {
+        return Ok( None );
+    }
+
+    let mut buffer = vec![ 0; length as usize ];
+    fp.read_exact( &mut buffer )?;
+    String::from_utf8( buffer ).map( Some ).map_err( |_| io::Error::new( io::ErrorKind::InvalidData, "invalid string" ) )
+}
+
+fn write_optional_u32< W: Write >( fp: &mut W, value: Option< u32 > ) -> io::Result< () > {
+    fp.write_u8( value.is_some() as u8 )?;
+    fp.write_u32::< LittleEndian >( value.unwrap_or( 0 ) )
+}
+
+fn read_optional_u32< R: Read >( fp: &mut R ) -> io::Result< Option< u32 > > {
+    let is_some = fp.read_u8()? != 0;
+    let value = fp.read_u32::< LittleEndian >()?;
+    Ok( if is_some { Some( value ) } else { None } )
+}
+
+type Entries = HashMap< u64, Vec< CachedFrame > >;
+
+fn read_entries( path: &Path ) -> io::Result< Entries > {
+    let mut fp = BufReader::new( File::open( path )? );
+    let mut magic = [0; 8];
+    fp.read_exact( &mut magic )?;
+    if &magic != MAGIC || fp.read_u64::< LittleEndian >()? != VERSION {
+        return Err( io::Error::new( io::ErrorKind::InvalidData, "unsupported file" ) );
+    }
+
+    let count = fp.read_u64::< LittleEndian >()?;
+    let mut entries = HashMap::with_capacity( count as usize );
+    for _ in 0..count {
+        let address = fp.read_u64::< LittleEndian >()?;
+        let frame_count = fp.read_u32::< LittleEndian >()?;
+        let mut frames = Vec::with_capacity( frame_count as usize );
+        for _ in 0..frame_count {
+            frames.push( CachedFrame {
+                library: read_string( &mut fp )?,
+                function: read_string( &mut fp )?,
+                raw_function: read_string( &mut fp )?,
+                source: read_string( &mut fp )?,
+                line: read_optional_u32( &mut fp )?,
+                column: read_optional_u32( &mut fp )?,
+                is_inline: fp.read_u8()? != 0
+            });
+        }
+
+        entries.insert( address, frames );
+    }
+
+    Ok( entries )
+}
+
+fn write_entries( path: &Path, entries: &Entries ) -> io::Result< () > {
+    let tmp_path = path.with_extension( format!( "tmp{}", std::process::id() ) );
+    {
+        let mut fp = BufWriter::new( File::create( &tmp_path )? );
+        fp.write_all( MAGIC )?;
+        fp.write_u64::< LittleEndian >( VERSION )?;
+        fp.write_u64::< LittleEndian >( entries.len() as u64 )?;
+        for (&address, frames) in entries {
+            fp.write_u64::< LittleEndian >( address )?;
+            fp.write_u32::< LittleEndian >( frames.len() as u32 )?;
+            for frame in frames {
+                write_string( &mut fp, &frame.library )?;
+                write_string( &mut fp, &frame.function )?;
+                write_string( &mut fp, &frame.raw_function )?;
+                write_string( &mut fp, &frame.source )?;
+                write_optional_u32( &mut fp, frame.line )?;
+                write_optional_u32( &mut fp, frame.column )?;
+                fp.write_u8( frame.is_inline as u8 )?;
+            }
+        }
+
+        fp.flush()?;
+    }
+
+    fs::rename( &tmp_path, path )
+}
+
+struct CachedBinary {
+    entries: Entries,
+    is_dirty: bool
+}
+
+#[derive(Clone)]
+struct RegionKey {
+    key: String,
+    start: u64,
+    file_offset: u64
+}
+
+pub struct SymbolCache {
+    directory: PathBuf,
+    regions: FrozenRangeMap< RegionKey >,
+    binaries: HashMap< String, Arc< Mutex< CachedBinary > > >
+}
+
+impl SymbolCache {
+    /// Returns `None` if the cache wasn't enabled with `set_symbol_cache_directory`.
+    pub fn new() -> Option< Self > {
+        let directory = SYMBOL_CACHE_DIRECTORY.lock().clone()?;
+        if let Err( error ) = fs::create_dir_all( &directory ) {
+            warn!( "Failed to create the symbol cache directory {:?}: {}", directory, error );
+            return None;
+        }
+
+        Some( SymbolCache {
+            directory,
+            regions: FrozenRangeMap::new(),
+            binaries: HashMap::new()
+        })
+    }
+
+    /// Sets which binaries are mapped where, as `(range, file_offset, key)`.
+    ///
+    /// The `key` identifies the binary's symbols, so it should also depend on
+    /// the separate debug info, if there is any.
+    pub fn set_regions( &mut self, regions: Vec< (Range< u64 >, u64, String) > ) {
+        self.regions = RangeMap::from_vec(
+            regions.into_iter().map( |(range, file_offset, key)| {
+                let start = range.start;
+                (range, RegionKey { key, start, file_offset })
+            }).collect()
+        ).into_frozen();
+    }
+
+    fn path_for( &self, key: &str ) -> PathBuf {
+        self.directory.join( format!( "{}.bhsymbols", key ) )
+    }
+
+    fn binary( &mut self, key: &str ) -> Arc< Mutex< CachedBinary > > {
+        if let Some( binary ) = self.binaries.get( key ) {
+            return binary.clone();
+        }
+
+        let path = self.path_for( key );
+        let binary = LOADED_BINARIES.lock().entry( path.clone() ).or_insert_with( || {
+            let entries = match read_entries( &path ) {
+                Ok( entries ) => entries,
+                Err( ref error ) if error.kind() == io::ErrorKind::NotFound => Default::default(),
+                Err( error ) => {
+                    warn!( "Failed to read the symbol cache from {:?}: {}", path, error );
+                    Default::default()
+                }
+            };
+
+            Arc::new( Mutex::new( CachedBinary { entries, is_dirty: false } ) )
+        }).clone();
+
+        self.binaries.insert( key.to_owned(), binary.clone() );
+        binary
+    }
+
+    /// Symbolicates `address` using the cache, calling `resolve` to do it if it's not cached.
+    pub fn symbolicate(
+        &mut self,
+        interner: &mut StringInterner,
+        address: u64,
+        resolve: impl FnOnce( &mut StringInterner ) -> Vec< Frame >,
+        mut callback: impl FnMut( Frame )
+    ) {
+        let region = match self.regions.get_value( address ) {
+            Some( region ) => region.clone(),
+            None => {
+                resolve( interner ).into_iter().for_each( callback );
+                return;
+            }
+        };
+
+        let relative_address = address - region.start + region.file_offset;
+        let binary = self.binary( &region.key );
+        if let Some( frames ) = binary.lock().entries.get( &relative_address ) {
+            for frame in frames {
+                callback( frame.to_frame( interner, address ) );
+            }
+
+            return;
+        }
+
+        // Don't hold the lock while resolving so that other loaders can still use the cache.
+        let frames = resolve( interner );
+        let cached = frames.iter().map( |frame| CachedFrame::from_frame( interner, frame ) ).collect();
+        let mut binary = binary.lock();
+        binary.entries.insert( relative_address, cached );
+        binary.is_dirty = true;
+
+        frames.into_iter().for_each( callback );
+    }
+
+    /// Symbolicates all of the `addresses`, which must be sorted, using the cache.
+    ///
+    /// This does the same as calling `symbolicate` for every one of them, except the regions are
+    /// found in a single pass, every binary's cache is only locked once per run of addresses which
+    /// belong to it, and all of the misses are passed to `resolve` at once, so that it can resolve
+    /// them in parallel; it must return the frames of every one of them, in the same order.
+    /// The `callback` gets the index of the address which the frame is for.
+    pub fn symbolicate_many(
+        &mut self,
+        interner: &mut StringInterner,
+        addresses: &[u64],
+        resolve: impl FnOnce( &[u64] ) -> Vec< Vec< CachedFrame > >,
+        mut callback: impl FnMut( usize, Frame )
+    ) {
+        let mut runs: Vec< (Range< usize >, Option< RegionKey >) > = Vec::new();
+        for (nth, (_, region)) in self.regions.lookup_many( addresses.iter().copied() ).enumerate() {
+            let region = region.map( |(_, region)| region );
+            match runs.last_mut() {
+                Some( (range, last) ) if last.as_ref().map( |last| last.start ) == region.map( |region| region.start ) => range.end = nth + 1,
+                _ => runs.push( (nth..nth + 1, region.cloned()) )
+            }
+        }
+
+        // The indexes of the addresses which weren't cached, grouped by the binary they belong to.
+        let mut missing = Vec::new();
+        let mut missing_runs = Vec::new();
+        for (range, region) in runs {
+            let start = missing.len();
+            let binary = match region {
+                Some( ref region ) => {
+                    let binary = self.binary( &region.key );
+                    {
+                        let binary = binary.lock();
+                        for nth in range {
+                            let address = addresses[ nth ];
+                            match binary.entries.get( &(address - region.start + region.file_offset) ) {
+                                Some( frames ) => {
+                                    for frame in frames {
+                                        callback( nth, frame.to_frame( interner, address ) );
+                                    }
+                                },
+                                None => missing.push( nth )
+                            }
+                        }
+                    }
+
+                    Some( binary )
+                },
+                None => {
+                    missing.extend( range );
+                    None
+                }
+            };
+
+            if missing.len() > start {
+                missing_runs.push( (start..missing.len(), region.zip( binary )) );
+            }
+        }
+
+        if missing.is_empty() {
+            return;
+        }
+
+        // Don't hold the locks while resolving so that other loaders can still use the cache.
+        let missing_addresses: Vec< u64 > = missing.iter().map( |&nth| addresses[ nth ] ).collect();
+        let mut resolved = resolve( &missing_addresses );
+        assert_eq!( resolved.len(), missing.len() );
+
+        for (range, region) in missing_runs {
+            let mut cached = Vec::with_capacity( range.len() );
+            for index in range {
+                let nth = missing[ index ];
+                let address = addresses[ nth ];
+                let frames = mem::take( &mut resolved[ index ] );
+                for frame in &frames {
+                    callback( nth, frame.to_frame( interner, address ) );
+                }
+
+                if let Some( (ref region, _) ) = region {
+                    cached.push( (address - region.start + region.file_offset, frames) );
+                }
+            }
+
+            if let Some( (_, binary) ) = region {
+                let mut binary = binary.lock();
+                binary.entries.extend( cached );
+                binary.is_dirty = true;
+            }
+        }
+    }
+
+    pub fn save( &mut self ) {
+        for (key, binary) in &self.binaries {
+            let mut binary = binary.lock();
+            if !binary.is_dirty {
+                continue;
+            }
+
+            let path = self.path_for( key );
+            if let Err( error ) = write_entries( &path, &binary.entries ) {
+                warn!( "Failed to write the symbol cache to {:?}: {}", path, error );
+            }
+
+            binary.is_dirty = false;
+        }
+    }
+}
+
+impl Drop for SymbolCache {
+    fn drop( &mut self ) {
+        self.save();
+    }
+}
+
+#[test]
+fn test_symbol_cache_entries() {
+    let path = std::env::temp_dir().join( format!( "bytehound-test-symbol-cache-{}", std::process::id() ) );
+    let mut entries = Entries::new();
+    entries.insert( 0x1234, vec![
+        CachedFrame {
+            library: Some( "libfoo.so".into() ),
+            function: Some( "foo".into() ),
+            raw_function: Some( "_Z3foov".into() ),
+            source: None,
+            line: Some( 10 ),
+            column: None,
+            is_inline: true
+        }
+    ]);
+    entries.insert( 0x5678, Vec::new() );
+
+    write_entries( &path, &entries ).unwrap();
+    let loaded = read_entries( &path ).unwrap();
+    let _ = fs::remove_file( &path );
+
+    assert_eq!( loaded, entries );
+}
+
+#[test]
+fn test_symbolicate_many() {
+    let directory = std::env::temp_dir().join( format!( "bytehound-test-symbolicate-many-{}", std::process::id() ) );
+    fs::create_dir_all( &directory ).unwrap();
+
+    let mut cache = SymbolCache {
+        directory: directory.clone(),
+        regions: FrozenRangeMap::new(),
+        binaries: HashMap::new()
+    };
+
+    cache.set_regions( vec![
+        (0x1000..0x2000, 0, "first".into()),
+        (0x3000..0x4000, 0x100, "second".into())
+    ]);
+
+    let mut interner = StringInterner::new();
+    let addresses = [ 0x10, 0x1000, 0x1100, 0x3000, 0x3100, 0x5000 ];
+    let mut run = || {
+        let mut resolved_count = 0;
+        let mut output = vec![ Vec::new(); addresses.len() ];
+        cache.symbolicate_many( &mut interner, &addresses, |missing| {
+            resolved_count += missing.len();
+            missing.iter().map( |&address| vec![ CachedFrame {
+                function: Some( format!( "function_{:x}", address ) ),
+                ..CachedFrame::default()
+            }]).collect()
+        }, |nth, frame| output[ nth ].push( frame.function() ) );
+
+        (resolved_count, output)
+    };
+
+    let (first_resolved_count, first_output) = run();
+    let (second_resolved_count, second_output) = run();
+    let _ = fs::remove_dir_all( &directory );
+
+    assert_eq!( first_resolved_count, addresses.len() );
+    // Only the addresses which are outside of any of the binaries have to be resolved again.
+    assert_eq!( second_resolved_count, 2 );
+    assert_eq!( first_output, second_output );
+    for (nth, &address) in addresses.iter().enumerate() {
+        let functions: Vec< _ > = first_output[ nth ].iter().map( |&id| interner.resolve( id.unwrap() ).unwrap().to_owned() ).collect();
+        assert_eq!( functions, vec![ format!( "function_{:x}", address ) ] );
+    }
+}
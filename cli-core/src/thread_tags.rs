@@ -0,0 +1,104 @@
+//! Memory usage and churn aggregated by the tags which the threads had set while allocating.
+//!
+//! A thread's tag usually says what that thread was working on at the time (e.g. the type of the
+//! request it was handling), so this attributes the cost of the allocations to those kinds of work.
+
+use ahash::AHashMap as HashMap;
+use rayon::prelude::*;
+
+use crate::{AllocationId, Data, Timestamp};
+
+/// Everything which was allocated while the allocating threads had a single tag set.
+#[derive(Clone, PartialEq, Eq, Debug, Default)]
+pub struct TagUsage {
+    pub tag: u32,
+    pub count: u64,
+    pub size: u64,
+    /// How much of it was deallocated again.
+    pub freed_count: u64,
+    pub freed_size: u64,
+    /// The most memory which was alive at the same time.
+    pub peak_size: u64,
+    /// Sorted by when they were made.
+    pub allocation_ids: Vec< AllocationId >
+}
+
+impl TagUsage {
+    pub fn leaked_count( &self ) -> u64 {
+        self.count - self.freed_count
+    }
+
+    pub fn leaked_size( &self ) -> u64 {
+        self.size - self.freed_size
+    }
+}
+
+/// Returns the highest sum of the given deltas at any point in time.
+///
+/// The deltas which happen at the same time as each other are all applied at once.
+fn peak_of( mut deltas: Vec< (Timestamp, i64) > ) -> u64 {
+    deltas.par_sort_unstable_by_key( |&(timestamp, _)| timestamp );
+
+    let mut current = 0;
+    let mut peak = 0;
+    for (index, &(timestamp, delta)) in deltas.iter().enumerate() {
+        current += delta;
+        let is_last_at_timestamp = deltas.get( index + 1 ).map( |&(next, _)| next != timestamp ).unwrap_or( true );
+        if is_last_at_timestamp {
+            peak = std::cmp::max( peak, current );
+        }
+    }
+
+    peak as u64
+}
+
+fn usage_of( data: &Data, tag: u32, allocation_ids: Vec< AllocationId > ) -> TagUsage {
+    let mut usage = TagUsage {
+        tag,
+        ..TagUsage::default()
+    };
+
+    let mut deltas = Vec::with_capacity( allocation_ids.len() * 2 );
+    for &id in &allocation_ids {
+        let allocation = data.get_allocation( id );
+        usage.count += allocation.sample_count();
+        usage.size += allocation.size;
+        deltas.push( (allocation.timestamp, allocation.size as i64) );
+        if let Some( ref deallocation ) = allocation.deallocation {
+            usage.freed_count += allocation.sample_count();
+            usage.freed_size += allocation.size;
+            deltas.push( (deallocation.timestamp, -(allocation.size as i64)) );
+        }
+    }
+
+    usage.peak_size = peak_of( deltas );
+    usage.allocation_ids = allocation_ids;
+    usage
+}
+
+/// Groups the given allocations by their thread's tag, putting the tags which allocated the most first.
+pub fn usage_by_thread_tag( data: &Data, ids: &[AllocationId] ) -> Vec< TagUsage > {
+    let mut by_tag: HashMap< u32, Vec< AllocationId > > = HashMap::new();
+    for &id in ids {
+        by_tag.entry( data.get_allocation( id ).thread_tag ).or_default().push( id );
+    }
+
+    let mut usages: Vec< _ > = by_tag.into_par_iter().map( |(tag, mut allocation_ids)| {
+        allocation_ids.sort_by_key( |&id| (data.get_allocation( id ).timestamp, id) );
+        usage_of( data, tag, allocation_ids )
+    }).collect();
+
+    usages.sort_by( |lhs, rhs| rhs.size.cmp( &lhs.size ).then( lhs.tag.cmp( &rhs.tag ) ) );
+    usages
+}
+
+#[test]
+fn test_peak_of() {
+    let at = Timestamp::from_secs;
+    assert_eq!( peak_of( Vec::new() ), 0 );
+    assert_eq!( peak_of( vec![ (at( 1 ), 10), (at( 2 ), 20), (at( 3 ), -10), (at( 4 ), 5) ] ), 30 );
+
+    // Something which was freed at the same time as something else was allocated was never alive at the same time as it.
+    assert_eq!( peak_of( vec![ (at( 1 ), 10), (at( 2 ), 20), (at( 2 ), -10), (at( 3 ), -20) ] ), 20 );
+    assert_eq!( peak_of( vec![ (at( 3 ), -20), (at( 2 ), -10), (at( 2 ), 20), (at( 1 ), 10) ] ), 20 );
+}
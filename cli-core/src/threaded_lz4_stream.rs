@@ -4,9 +4,16 @@ use std::thread;
 use std::marker::PhantomData;
 use std::mem;
 use std::sync::Arc;
+use std::sync::atomic::{AtomicUsize, Ordering};
 use lz4_compress;
 use byteorder::{ReadBytesExt, WriteBytesExt, LittleEndian};
 use parking_lot::Mutex;
+use common::lz4_stream::{CHUNK_KIND_INDEX, CHUNK_KIND_ZSTD, CHUNK_KIND_ZSTD_DICTIONARY, ZstdDecoder};
+
+pub(crate) enum Compression {
+    Lz4,
+    Zstd( Option< Arc< Vec< u8 > > > )
+}
 
 pub struct Lz4Reader< F: io::Read + Send > {
     phantom: PhantomData< F >,
@@ -15,12 +22,60 @@ pub struct Lz4Reader< F: io::Read + Send > {
     counter: u64,
     buffer: Vec< u8 >,
     position: usize,
-    error: Arc< Mutex< Option< io::Error > > >
+    error: Arc< Mutex< Option< io::Error > > >,
+    pool: BufferPool
+}
+
+/// The maximum number of decompression threads per reader; zero means one per core.
+static MAX_DECOMPRESSION_THREADS: AtomicUsize = AtomicUsize::new( 0 );
+
+/// Sets the maximum number of threads every reader can use for decompression.
+///
+/// Passing zero uses one thread per available core, which is the default.
+pub fn set_max_decompression_threads( count: usize ) {
+    MAX_DECOMPRESSION_THREADS.store( count, Ordering::Relaxed );
+}
+
+fn max_decompression_threads() -> usize {
+    match MAX_DECOMPRESSION_THREADS.load( Ordering::Relaxed ) {
+        0 => thread::available_parallelism().map( |count| count.get() ).unwrap_or( 1 ),
+        count => count
+    }
+}
+
+/// A pool of buffers which were already used, so that we don't have to allocate new ones for every chunk.
+#[derive(Clone)]
+struct BufferPool {
+    tx: crossbeam_channel::Sender< Vec< u8 > >,
+    rx: crossbeam_channel::Receiver< Vec< u8 > >
 }
 
-fn read_chunk( fp: &mut impl io::Read, buffer: &mut Vec< u8 > ) -> Result< (Vec< u8 >, bool), io::Error > {
+impl BufferPool {
+    fn new() -> Self {
+        let (tx, rx) = crossbeam_channel::bounded( 16 );
+        BufferPool { tx, rx }
+    }
+
+    fn get( &self ) -> Vec< u8 > {
+        let mut buffer = self.rx.try_recv().unwrap_or_default();
+        buffer.clear();
+        buffer
+    }
+
+    fn put( &self, buffer: Vec< u8 > ) {
+        if buffer.capacity() != 0 {
+            let _ = self.tx.try_send( buffer );
+        }
+    }
+}
+
+fn read_chunk( fp: &mut impl io::Read, mut buffer: Vec< u8 > ) -> Result< (Vec< u8 >, u8), io::Error > {
     let kind = fp.read_u8()?;
-    if kind != 1 && kind != 2 {
+    if kind == CHUNK_KIND_INDEX {
+        return Err( io::Error::new( io::ErrorKind::UnexpectedEof, "reached the chunk index" ) );
+    }
+
+    if kind != 1 && kind != 2 && kind != CHUNK_KIND_ZSTD && kind != CHUNK_KIND_ZSTD_DICTIONARY {
         unimplemented!();
     }
 
@@ -30,25 +85,87 @@ fn read_chunk( fp: &mut impl io::Read, buffer: &mut Vec< u8 > ) -> Result< (Vec<
         buffer.set_len( length );
     }
 
-    fp.read_exact( buffer )?;
-    let chunk = mem::replace( buffer, Vec::new() );
-    Ok( (chunk, kind == 1) )
+    fp.read_exact( &mut buffer )?;
+    Ok( (buffer, kind) )
+}
+
+pub(crate) fn decompress_chunk( input: &[u8], compression: &Compression, zstd: &mut Option< (Option< Arc< Vec< u8 > > >, ZstdDecoder) >, output: &mut Vec< u8 > ) -> Result< (), io::Error > {
+    match *compression {
+        Compression::Lz4 => {
+            lz4_compress::decompress_into( input, output ).map_err( |_| io::Error::new( io::ErrorKind::InvalidData, "decompression error" ) )
+        },
+        Compression::Zstd( ref dictionary ) => {
+            // Only recreate the decoder when the dictionary changes, since loading it isn't free.
+            let is_same = match *zstd {
+                Some( (Some( ref current ), _) ) => dictionary.as_ref().map( |dictionary| Arc::ptr_eq( current, dictionary ) ).unwrap_or( false ),
+                Some( (None, _) ) => dictionary.is_none(),
+                None => false
+            };
+
+            if !is_same {
+                let decoder = ZstdDecoder::new( dictionary.as_ref().map( |dictionary| dictionary.as_slice() ) )?;
+                *zstd = Some( (dictionary.clone(), decoder) );
+            }
+
+            zstd.as_mut().unwrap().1.decompress_into( input, output )
+        }
+    }
 }
 
 impl< F: io::Read + Send + 'static > Lz4Reader< F > {
-    pub fn new( mut fp: F ) -> Self {
-        let thread_count = 1;
+    pub fn new( fp: F ) -> Self {
+        Self::with_max_thread_count( fp, max_decompression_threads() )
+    }
+
+    /// Creates a new reader which will use at most `max_thread_count` threads for decompression.
+    ///
+    /// Only a single decompression thread is started initially; more are only added when
+    /// there are chunks waiting to be decompressed while the consumer is waiting for them.
+    pub fn with_max_thread_count( mut fp: F, max_thread_count: usize ) -> Self {
+        let max_thread_count = std::cmp::max( max_thread_count, 1 );
         let (decompress_tx, decompress_rx) = crossbeam_channel::bounded( 4 );
         let (output_tx, output_rx) = crossbeam_channel::bounded( 4 );
         let error_arc = Arc::new( Mutex::new( None ) );
         let error_arc_clone = error_arc.clone();
+        let pool = BufferPool::new();
+        let pool_clone = pool.clone();
+
+        let spawn_worker = {
+            let error_arc = error_arc.clone();
+            let pool = pool.clone();
+            move |decompress_rx: crossbeam_channel::Receiver< (u64, Vec< u8 >, Compression) >, output_tx: crossbeam_channel::Sender< (u64, Vec< u8 >) >| {
+                let error_arc = error_arc.clone();
+                let pool = pool.clone();
+                thread::spawn( move || {
+                    let mut zstd = None;
+                    while let Ok( (counter, input, compression) ) = decompress_rx.recv() {
+                        let mut output = pool.get();
+                        let result = decompress_chunk( &input, &compression, &mut zstd, &mut output );
+                        pool.put( input );
+
+                        if let Err( error ) = result {
+                            *error_arc.lock() = Some( error );
+                            break;
+                        }
+
+                        if output_tx.send( (counter, output) ).is_err() {
+                            break;
+                        }
+                    }
+                });
+            }
+        };
+
+        spawn_worker( decompress_rx.clone(), output_tx.clone() );
 
-        let output_tx_clone = output_tx.clone();
+        let output_tx_clone = output_tx;
         thread::spawn( move || {
-            let mut buffer = Vec::new();
+            let pool = pool_clone;
+            let mut thread_count = 1;
             let mut counter = 0;
+            let mut dictionary = None;
             loop {
-                let (chunk, is_compressed) = match read_chunk( &mut fp, &mut buffer ) {
+                let (chunk, kind) = match read_chunk( &mut fp, pool.get() ) {
                     Ok( chunk ) => chunk,
                     Err( ref error ) if error.kind() == io::ErrorKind::UnexpectedEof => {
                         break;
@@ -59,8 +176,26 @@ impl< F: io::Read + Send + 'static > Lz4Reader< F > {
                     }
                 };
 
-                if is_compressed {
-                    if decompress_tx.send( (counter, chunk) ).is_err() {
+                if kind == CHUNK_KIND_ZSTD_DICTIONARY {
+                    dictionary = Some( Arc::new( chunk ) );
+                    continue;
+                }
+
+                if kind == 1 || kind == CHUNK_KIND_ZSTD {
+                    let compression =
+                        if kind == 1 {
+                            Compression::Lz4
+                        } else {
+                            Compression::Zstd( dictionary.clone() )
+                        };
+
+                    // The decompression can't keep up while the consumer still has room for more, so add another thread.
+                    if thread_count < max_thread_count && decompress_tx.is_full() && output_tx_clone.is_empty() {
+                        spawn_worker( decompress_rx.clone(), output_tx_clone.clone() );
+                        thread_count += 1;
+                    }
+
+                    if decompress_tx.send( (counter, chunk, compression) ).is_err() {
                         break;
                     }
                 } else {
@@ -73,22 +208,6 @@ impl< F: io::Read + Send + 'static > Lz4Reader< F > {
             }
         });
 
-        for _ in 0..thread_count {
-            let decompress_rx = decompress_rx.clone();
-            let output_tx = output_tx.clone();
-            thread::spawn( move || {
-                let mut output = Vec::new();
-                while let Ok( (counter, input) ) = decompress_rx.recv() {
-                    output.clear();
-                    if let Ok(()) = lz4_compress::decompress_into( &input, &mut output ) {
-                        if output_tx.send( (counter, output.clone()) ).is_err() {
-                            break;
-                        }
-                    }
-                }
-            });
-        }
-
         Lz4Reader {
             phantom: PhantomData,
             output_rx,
@@ -96,7 +215,8 @@ impl< F: io::Read + Send + 'static > Lz4Reader< F > {
             counter: 0,
             buffer: Vec::new(),
             position: 0,
-            error: error_arc
+            error: error_arc,
+            pool
         }
     }
 }
@@ -120,7 +240,7 @@ impl< F: io::Read + Send > Lz4Reader< F > {
             let index = self.queue.iter().position( |(counter, _)| *counter == self.counter );
             if let Some( index ) = index {
                 let (_, buffer) = self.queue.swap_remove( index );
-                self.buffer = buffer;
+                self.pool.put( mem::replace( &mut self.buffer, buffer ) );
                 self.position = 0;
                 self.counter += 1;
                 continue;
@@ -139,7 +259,7 @@ impl< F: io::Read + Send > Lz4Reader< F > {
                 };
 
                 if counter == self.counter {
-                    self.buffer = buffer;
+                    self.pool.put( mem::replace( &mut self.buffer, buffer ) );
                     self.position = 0;
                     self.counter += 1;
                     continue 'outer;
@@ -202,8 +322,13 @@ pub struct Lz4Writer< F: io::Write + Send + 'static > {
 }
 
 impl< F: io::Write + Send + 'static > Lz4Writer< F > {
-    pub fn new( mut fp: F ) -> Self {
-        let thread_count = 1;
+    pub fn new( fp: F ) -> Self {
+        Self::with_thread_count( fp, 1 )
+    }
+
+    /// Creates a new writer which will compress the chunks on `thread_count` threads in parallel.
+    pub fn with_thread_count( mut fp: F, thread_count: usize ) -> Self {
+        let thread_count = std::cmp::max( thread_count, 1 );
         let (compress_tx, compress_rx) = crossbeam_channel::bounded( 4 );
         let (merge_tx, merge_rx) = crossbeam_channel::bounded( 4 );
 
@@ -269,6 +394,11 @@ impl< F: io::Write + Send + 'static > Lz4Writer< F > {
             Ok(())
         }
     }
+
+    /// Flushes everything and waits until it's written; unlike dropping this reports any errors.
+    pub fn finish( mut self ) -> Result< (), io::Error > {
+        self.join()
+    }
 }
 
 impl< F: io::Write + Send + 'static > Drop for Lz4Writer< F > {
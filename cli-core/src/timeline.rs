@@ -1,6 +1,8 @@
 use crate::{Data, OperationId, Map, MapUsage, UsageDelta};
 use crate::Timestamp;
 
+use rayon::prelude::*;
+
 #[derive(Copy, Clone, derive_more::Add, derive_more::Sub, Default, Debug)]
 pub struct AllocationDelta {
     pub memory_usage: i64,
@@ -16,7 +18,10 @@ impl< 'a > From< &'a MapUsage > for UsageDelta {
             shared_dirty: usage.shared_dirty as i64,
             private_clean: usage.private_clean as i64,
             private_dirty: usage.private_dirty as i64,
-            swap: usage.swap as i64
+            swap: usage.swap as i64,
+            anon_huge_pages: usage.anon_huge_pages as i64,
+            shmem_pmd_mapped: usage.shmem_pmd_mapped as i64,
+            file_pmd_mapped: usage.file_pmd_mapped as i64
         }
     }
 }
@@ -80,6 +85,9 @@ impl Delta for UsageDelta {
             private_clean: std::cmp::max( lhs.private_clean, rhs.private_clean ),
             private_dirty: std::cmp::max( lhs.private_dirty, rhs.private_dirty ),
             swap: std::cmp::max( lhs.swap, rhs.swap ),
+            anon_huge_pages: std::cmp::max( lhs.anon_huge_pages, rhs.anon_huge_pages ),
+            shmem_pmd_mapped: std::cmp::max( lhs.shmem_pmd_mapped, rhs.shmem_pmd_mapped ),
+            file_pmd_mapped: std::cmp::max( lhs.file_pmd_mapped, rhs.file_pmd_mapped ),
         }
     }
 
@@ -92,68 +100,281 @@ impl Delta for UsageDelta {
             private_clean: std::cmp::min( lhs.private_clean, rhs.private_clean ),
             private_dirty: std::cmp::min( lhs.private_dirty, rhs.private_dirty ),
             swap: std::cmp::min( lhs.swap, rhs.swap ),
+            anon_huge_pages: std::cmp::min( lhs.anon_huge_pages, rhs.anon_huge_pages ),
+            shmem_pmd_mapped: std::cmp::min( lhs.shmem_pmd_mapped, rhs.shmem_pmd_mapped ),
+            file_pmd_mapped: std::cmp::min( lhs.file_pmd_mapped, rhs.file_pmd_mapped ),
         }
     }
 }
 
+/// How many operations are bucketed at a time by a single thread.
+const CHUNK_SIZE: usize = 64 * 1024;
+
+const POINT_COUNT: usize = 1000;
+
+/// How many points the finest level of a `TimelinePyramid` has.
+const PYRAMID_POINT_COUNT: usize = 1 << 16;
+
+/// Same as above, but for when there are many pyramids at once.
+const SMALL_PYRAMID_POINT_COUNT: usize = 1 << 12;
+
+fn allocation_delta( data: &Data, op: OperationId ) -> (Timestamp, AllocationDelta) {
+    let allocation = data.get_allocation( op.id() );
+    if op.is_allocation() {
+        let delta = AllocationDelta {
+            memory_usage: allocation.size as i64,
+            allocations: allocation.sample_count() as i64
+        };
+        (allocation.timestamp, delta)
+    } else if op.is_deallocation() {
+        let delta = AllocationDelta {
+            memory_usage: -(allocation.size as i64),
+            allocations: -(allocation.sample_count() as i64)
+        };
+        (allocation.deallocation.as_ref().unwrap().timestamp, delta)
+    } else if op.is_reallocation() {
+        let old_allocation = data.get_allocation( allocation.reallocated_from.unwrap() );
+        let delta = AllocationDelta {
+            memory_usage: allocation.size as i64 - old_allocation.size as i64,
+            allocations: 0
+        };
+        (allocation.timestamp, delta)
+    } else {
+        unreachable!()
+    }
+}
+
 pub fn build_allocation_timeline(
     data: &Data,
     timestamp_min: common::Timestamp,
     timestamp_max: common::Timestamp,
     ops: &[OperationId]
 ) -> Vec< TimelinePoint< AllocationDelta > > {
-    build_timeline(
+    build_allocation_timelines( data, timestamp_min, timestamp_max, std::slice::from_ref( &ops ) ).pop().unwrap()
+}
+
+/// Builds the timelines of multiple lists of operations at once, all with the same time range.
+pub fn build_allocation_timelines< L >(
+    data: &Data,
+    timestamp_min: common::Timestamp,
+    timestamp_max: common::Timestamp,
+    ops_for_list: &[L]
+) -> Vec< Vec< TimelinePoint< AllocationDelta > > > where L: AsRef< [OperationId] > + Sync {
+    build_timelines(
         timestamp_min,
         timestamp_max,
-        1000,
-        ops.iter().map( |op| {
-            let allocation = data.get_allocation( op.id() );
-            if op.is_allocation() {
-                let delta = AllocationDelta {
-                    memory_usage: allocation.size as i64,
-                    allocations: 1
-                };
-                (allocation.timestamp, delta)
-            } else if op.is_deallocation() {
-                let delta = AllocationDelta {
-                    memory_usage: -(allocation.size as i64),
-                    allocations: -1
-                };
-                (allocation.deallocation.as_ref().unwrap().timestamp, delta)
-            } else if op.is_reallocation() {
-                let old_allocation = data.get_allocation( allocation.reallocated_from.unwrap() );
-                let delta = AllocationDelta {
-                    memory_usage: allocation.size as i64 - old_allocation.size as i64,
-                    allocations: 0
-                };
-                (allocation.timestamp, delta)
-            } else {
-                unreachable!()
-            }
-        })
+        POINT_COUNT,
+        ops_for_list,
+        |&op| allocation_delta( data, op )
     )
 }
 
+pub fn build_allocation_timeline_pyramid(
+    data: &Data,
+    timestamp_min: common::Timestamp,
+    timestamp_max: common::Timestamp,
+    ops: &[OperationId]
+) -> TimelinePyramid< AllocationDelta > {
+    let timeline = build_timelines(
+        timestamp_min,
+        timestamp_max,
+        PYRAMID_POINT_COUNT,
+        std::slice::from_ref( &ops ),
+        |&op| allocation_delta( data, op )
+    ).pop().unwrap();
+
+    TimelinePyramid::new( timeline )
+}
+
+/// Builds the pyramids of multiple lists of operations at once, all with the same time range.
+///
+/// Their finest level is coarser than the one of `build_allocation_timeline_pyramid`,
+/// since there can be a lot of them.
+pub fn build_allocation_timeline_pyramids< L >(
+    data: &Data,
+    timestamp_min: common::Timestamp,
+    timestamp_max: common::Timestamp,
+    ops_for_list: &[L]
+) -> Vec< TimelinePyramid< AllocationDelta > > where L: AsRef< [OperationId] > + Sync {
+    build_timelines(
+        timestamp_min,
+        timestamp_max,
+        SMALL_PYRAMID_POINT_COUNT,
+        ops_for_list,
+        |&op| allocation_delta( data, op )
+    ).into_par_iter().map( TimelinePyramid::new ).collect()
+}
+
+/// Returns the highest memory usage which the given operations alone have reached.
+pub fn peak_memory_usage( data: &Data, ops: &[OperationId] ) -> u64 {
+    let mut current = 0;
+    let mut peak = 0;
+    for &op in ops {
+        current += allocation_delta( data, op ).1.memory_usage;
+        peak = std::cmp::max( peak, current );
+    }
+
+    peak as u64
+}
+
 pub fn build_map_timeline(
     timestamp_min: common::Timestamp,
     timestamp_max: common::Timestamp,
     ops: &[(Timestamp, UsageDelta)]
 ) -> Vec< TimelinePoint< UsageDelta > > {
-    build_timeline(
+    build_map_timelines( timestamp_min, timestamp_max, std::slice::from_ref( &ops ) ).pop().unwrap()
+}
+
+pub fn build_map_timelines< L >(
+    timestamp_min: common::Timestamp,
+    timestamp_max: common::Timestamp,
+    ops_for_list: &[L]
+) -> Vec< Vec< TimelinePoint< UsageDelta > > > where L: AsRef< [(Timestamp, UsageDelta)] > + Sync {
+    build_timelines(
         timestamp_min,
         timestamp_max,
-        1000,
-        ops.iter().copied()
+        POINT_COUNT,
+        ops_for_list,
+        |&op| op
     )
 }
 
+/// Builds the timelines of the resident memory simulated by `AllocatorSimulation`.
+pub fn build_simulated_timelines< L >(
+    timestamp_min: common::Timestamp,
+    timestamp_max: common::Timestamp,
+    deltas_for_list: &[L]
+) -> Vec< Vec< TimelinePoint< i64 > > > where L: AsRef< [(Timestamp, i64)] > + Sync {
+    build_timelines(
+        timestamp_min,
+        timestamp_max,
+        POINT_COUNT,
+        deltas_for_list,
+        |&delta| delta
+    )
+}
+
+pub fn build_map_timeline_pyramid(
+    timestamp_min: common::Timestamp,
+    timestamp_max: common::Timestamp,
+    ops: &[(Timestamp, UsageDelta)]
+) -> TimelinePyramid< UsageDelta > {
+    let timeline = build_timelines(
+        timestamp_min,
+        timestamp_max,
+        PYRAMID_POINT_COUNT,
+        std::slice::from_ref( &ops ),
+        |&op| op
+    ).pop().unwrap();
+
+    TimelinePyramid::new( timeline )
+}
+
+/// The sum of a run of consecutive operations which all fall into the same bucket.
+#[derive(Copy, Clone)]
+struct Run< T > {
+    bucket: u64,
+    total: T,
+    /// The highest value the running sum reaches within the run, relative to where it started.
+    max_prefix: T,
+    positive: T,
+    negative: T
+}
+
+impl< T > Run< T > where T: Delta {
+    fn new( bucket: u64, delta: T ) -> Self {
+        Run {
+            bucket,
+            total: delta,
+            max_prefix: delta,
+            positive: delta.at_least_zero(),
+            negative: T::default() - delta.at_most_zero()
+        }
+    }
+
+    fn extend( &mut self, other: &Run< T > ) {
+        self.max_prefix = T::max( self.max_prefix, self.total + other.max_prefix );
+        self.total = self.total + other.total;
+        self.positive = self.positive + other.positive;
+        self.negative = self.negative + other.negative;
+    }
+}
+
+fn granularity( timestamp_min: common::Timestamp, timestamp_max: common::Timestamp, point_count: usize ) -> u64 {
+    std::cmp::max( (timestamp_max - timestamp_min).as_usecs() / point_count as u64, 1 )
+}
+
+/// How many microseconds every point of the timelines from `build_allocation_timelines` spans.
+pub fn timeline_granularity( timestamp_min: common::Timestamp, timestamp_max: common::Timestamp ) -> u64 {
+    granularity( timestamp_min, timestamp_max, POINT_COUNT )
+}
+
+fn collect_runs< T >( granularity: u64, ops: impl Iterator< Item = (Timestamp, T) > ) -> Vec< Run< T > > where T: Delta {
+    let mut runs: Vec< Run< T > > = Vec::new();
+    for (timestamp, delta) in ops {
+        let run = Run::new( timestamp.as_usecs() / granularity, delta );
+        match runs.last_mut() {
+            Some( last ) if last.bucket == run.bucket => last.extend( &run ),
+            _ => runs.push( run )
+        }
+    }
+
+    runs
+}
+
+/// Builds the timelines for every list of operations in a single parallel pass.
+///
+/// The operations of every list are split into chunks which are all bucketed
+/// independently into runs; each list's runs are then stitched back together in order,
+/// which is cheap since there are at most as many runs per chunk as there are points.
+fn build_timelines< T, O, L, F >(
+    timestamp_min: common::Timestamp,
+    timestamp_max: common::Timestamp,
+    point_count: usize,
+    ops_for_list: &[L],
+    get_delta: F
+) -> Vec< Vec< TimelinePoint< T > > >
+    where T: Delta + Send + Sync,
+          O: Sync,
+          L: AsRef< [O] > + Sync,
+          F: Fn( &O ) -> (Timestamp, T) + Sync
+{
+    let granularity = granularity( timestamp_min, timestamp_max, point_count );
+    let chunks: Vec< (usize, &[O]) > = ops_for_list.iter().enumerate().flat_map( |(index, ops)| {
+        ops.as_ref().chunks( CHUNK_SIZE ).map( move |chunk| (index, chunk) )
+    }).collect();
+
+    let runs_for_chunk: Vec< (usize, Vec< Run< T > >) > = chunks.into_par_iter().map( |(index, chunk)| {
+        (index, collect_runs( granularity, chunk.iter().map( &get_delta ) ))
+    }).collect();
+
+    let mut runs_for_list: Vec< Vec< Vec< Run< T > > > > = ops_for_list.iter().map( |_| Vec::new() ).collect();
+    for (index, runs) in runs_for_chunk {
+        runs_for_list[ index ].push( runs );
+    }
+
+    runs_for_list.into_par_iter().map( |runs| {
+        emit_timeline( granularity, point_count, runs.into_iter().flatten() )
+    }).collect()
+}
+
 fn build_timeline< T >(
     timestamp_min: common::Timestamp,
     timestamp_max: common::Timestamp,
     point_count: usize,
     ops: impl Iterator< Item = (Timestamp, T) >
 ) -> Vec< TimelinePoint< T > > where T: Delta {
-    let granularity = std::cmp::max( (timestamp_max - timestamp_min).as_usecs() / point_count as u64, 1 );
+    let granularity = granularity( timestamp_min, timestamp_max, point_count );
+    emit_timeline( granularity, point_count, collect_runs( granularity, ops ).into_iter() )
+}
+
+/// Turns the runs into points; consecutive runs can be in the same bucket,
+/// in which case they're treated as if they were a single run.
+fn emit_timeline< T >(
+    granularity: u64,
+    point_count: usize,
+    runs: impl Iterator< Item = Run< T > >
+) -> Vec< TimelinePoint< T > > where T: Delta {
     let mut output = Vec::with_capacity( point_count + 2 );
 
     let mut current_time: u64 = 0;
@@ -161,12 +382,8 @@ fn build_timeline< T >(
     let mut current_max = T::default();
     let mut current_positive_per_time = T::default();
     let mut current_negative_per_time = T::default();
-    for (timestamp, delta) in ops {
-        let mut next = current;
-
-        next = next + delta;
-
-        let next_time = timestamp.as_usecs() / granularity;
+    for run in runs {
+        let next_time = run.bucket;
         if current_time == 0 {
             current_time = next_time;
         } else if current_time != next_time {
@@ -187,10 +404,13 @@ fn build_timeline< T >(
             current_max = Default::default();
         }
 
-        current = next;
-        current_max = T::max( current_max, next );
-        current_positive_per_time = current_positive_per_time + delta.at_least_zero();
-        current_negative_per_time = current_negative_per_time - delta.at_most_zero();
+        // If we went back in time every operation of the run is treated as if it was in a new bucket,
+        // so only the value at the end of the run counts.
+        let highest = if next_time < current_time { run.total } else { run.max_prefix };
+        current_max = T::max( current_max, current + highest );
+        current = current + run.total;
+        current_positive_per_time = current_positive_per_time + run.positive;
+        current_negative_per_time = current_negative_per_time + run.negative;
     }
 
     if output.is_empty() {
@@ -219,7 +439,7 @@ fn build_timeline< T >(
     output
 }
 
-#[derive(PartialEq, Eq, Debug)]
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
 pub struct TimelinePoint< T > {
     pub timestamp: u64,
     pub value: T,
@@ -234,6 +454,116 @@ impl< T > std::ops::Deref for TimelinePoint< T > {
     }
 }
 
+/// A timeline downsampled to every power-of-two resolution, so that any part of it
+/// can be quickly fetched with only about as many points as are going to be drawn.
+pub struct TimelinePyramid< T > {
+    /// The finest level comes first; every next level has half as many points.
+    levels: Vec< Vec< TimelinePoint< T > > >
+}
+
+impl< T > TimelinePyramid< T > where T: Delta {
+    fn new( timeline: Vec< TimelinePoint< T > > ) -> Self {
+        let mut levels = vec![ timeline ];
+        while levels.last().unwrap().len() > 4 {
+            let level = downsample( levels.last().unwrap() );
+            levels.push( level );
+        }
+
+        TimelinePyramid { levels }
+    }
+
+    fn points_of_level_between( &self, level: usize, timestamp_min: u64, timestamp_max: u64 ) -> &[TimelinePoint< T >] {
+        let points = &self.levels[ level ];
+        let start = points.partition_point( |point| point.timestamp < timestamp_min ).saturating_sub( 1 );
+        let end = std::cmp::min( points.partition_point( |point| point.timestamp <= timestamp_max ) + 1, points.len() );
+        &points[ start..std::cmp::max( start, end ) ]
+    }
+
+    /// Returns the points between the given timestamps from the coarsest level which
+    /// still has at least `point_count` of them there.
+    ///
+    /// One extra point is also included on each side so that the edges can be drawn.
+    pub fn points_between( &self, timestamp_min: u64, timestamp_max: u64, point_count: usize ) -> &[TimelinePoint< T >] {
+        let mut output = self.points_of_level_between( 0, timestamp_min, timestamp_max );
+        for level in 1..self.levels.len() {
+            let points = self.points_of_level_between( level, timestamp_min, timestamp_max );
+            if points.len() < point_count {
+                break;
+            }
+
+            output = points;
+        }
+
+        output
+    }
+
+    /// Resamples the timeline onto `count` buckets which are `step` long each, starting at `timestamp_min`.
+    ///
+    /// Every bucket gets the highest value within it, or the last one before it if there are no points
+    /// within it, and the sum of the changes within it.
+    pub fn resample( &self, timestamp_min: u64, step: u64, count: usize ) -> Vec< TimelinePoint< T > > {
+        let step = std::cmp::max( step, 1 );
+        let timestamp_max = timestamp_min.saturating_add( step.saturating_mul( count as u64 ) );
+        let points = self.points_between( timestamp_min, timestamp_max, count );
+
+        let mut output = Vec::with_capacity( count );
+        let mut index = 0;
+        let mut last = T::default();
+        for bucket in 0..count as u64 {
+            let start = timestamp_min.saturating_add( bucket * step );
+            let end = start.saturating_add( step );
+            while index < points.len() && points[ index ].timestamp < start {
+                last = points[ index ].value;
+                index += 1;
+            }
+
+            let mut point = TimelinePoint {
+                timestamp: start,
+                value: last,
+                positive_change: T::default(),
+                negative_change: T::default()
+            };
+
+            let mut is_empty = true;
+            while index < points.len() && points[ index ].timestamp < end {
+                let current = &points[ index ];
+                point.value = if is_empty { current.value } else { T::max( point.value, current.value ) };
+                point.positive_change = point.positive_change + current.positive_change;
+                point.negative_change = point.negative_change + current.negative_change;
+                is_empty = false;
+                last = current.value;
+                index += 1;
+            }
+
+            output.push( point );
+        }
+
+        output
+    }
+}
+
+/// Merges every pair of points into one, keeping the highest value and summing the changes.
+fn downsample< T >( points: &[TimelinePoint< T > ] ) -> Vec< TimelinePoint< T > > where T: Delta {
+    // The last point only carries the final value, so it's kept as it is.
+    let (last, points) = match points.split_last() {
+        Some( value ) => value,
+        None => return Vec::new()
+    };
+
+    let mut output: Vec< _ > = points.chunks( 2 ).map( |pair| {
+        let mut point = pair[ 0 ];
+        for other in &pair[ 1.. ] {
+            point.value = T::max( point.value, other.value );
+            point.positive_change = point.positive_change + other.positive_change;
+            point.negative_change = point.negative_change + other.negative_change;
+        }
+        point
+    }).collect();
+
+    output.push( *last );
+    output
+}
+
 #[test]
 fn test_build_timeline_one_point() {
     let output = build_timeline::< i64 >(
@@ -406,3 +736,64 @@ fn test_build_timeline_undersampled() {
         },
     ]);
 }
+
+#[test]
+fn test_build_timelines_matches_sequential() {
+    let lists: Vec< Vec< (Timestamp, i64) > > = (0..3).map( |list| {
+        (0..CHUNK_SIZE as u64 * 2 + 123).map( |index| {
+            let timestamp = Timestamp::from_usecs( 1000 + index / (list + 1) );
+            let delta = ((index * 7919 + list) % 201) as i64 - 100;
+            (timestamp, delta)
+        }).collect()
+    }).collect();
+
+    let timestamp_min = Timestamp::from_usecs( 1000 );
+    let timestamp_max = Timestamp::from_usecs( 1000 + CHUNK_SIZE as u64 * 2 );
+    let timelines = build_timelines( timestamp_min, timestamp_max, 100, &lists, |&op| op );
+    assert_eq!( timelines.len(), lists.len() );
+    for (timeline, ops) in timelines.into_iter().zip( lists.iter() ) {
+        assert_eq!( timeline, build_timeline( timestamp_min, timestamp_max, 100, ops.iter().copied() ) );
+    }
+}
+
+#[test]
+fn test_timeline_pyramid() {
+    let ops: Vec< (Timestamp, i64) > = (0..64).map( |index| (Timestamp::from_usecs( index ), if index % 4 == 3 { -1 } else { 2 }) ).collect();
+    let timeline = build_timeline( Timestamp::from_usecs( 0 ), Timestamp::from_usecs( 63 ), 64, ops.iter().copied() );
+    let pyramid = TimelinePyramid::new( timeline.clone() );
+
+    assert_eq!( pyramid.points_between( 0, 100, 1000 ), &timeline[..] );
+
+    let points = pyramid.points_between( 0, 100, 16 );
+    assert_eq!( points.len(), 17 );
+    assert_eq!( points[ 0 ].timestamp, timeline[ 0 ].timestamp );
+    assert_eq!( points[ 1 ].timestamp, timeline[ 4 ].timestamp );
+    assert_eq!( points[ 1 ].value, timeline[ 4..8 ].iter().map( |point| point.value ).max().unwrap() );
+    assert_eq!( points[ 1 ].positive_change, timeline[ 4..8 ].iter().map( |point| point.positive_change ).sum::< i64 >() );
+    assert_eq!( points.last(), timeline.last() );
+
+    let points = pyramid.points_between( 20, 30, 4 );
+    assert!( points.first().unwrap().timestamp <= 20 );
+    assert!( points.last().unwrap().timestamp >= 30 );
+    assert!( points.len() >= 4 );
+}
+
+#[test]
+fn test_timeline_pyramid_resample() {
+    let ops: Vec< (Timestamp, i64) > = (10..20).map( |index| (Timestamp::from_usecs( index ), 1) ).collect();
+    let timeline = build_timeline( Timestamp::from_usecs( 0 ), Timestamp::from_usecs( 100 ), 100, ops.iter().copied() );
+    let pyramid = TimelinePyramid::new( timeline );
+
+    let points = pyramid.resample( 0, 1, 30 );
+    assert_eq!( points.len(), 30 );
+    assert_eq!( points[ 5 ].timestamp, 5 );
+    assert_eq!( points[ 5 ].value, 0 );
+    assert_eq!( points[ 10 ].value, 1 );
+    assert_eq!( points[ 19 ].value, 10 );
+    assert_eq!( points[ 25 ].value, 10 );
+    assert_eq!( points.iter().map( |point| point.positive_change ).sum::< i64 >(), 10 );
+
+    // The buckets before the first point carry nothing, and those after the last one keep its value.
+    let points = pyramid.resample( 50, 10, 3 );
+    assert!( points.iter().all( |point| point.value == 10 && point.positive_change == 0 ) );
+}
@@ -1,8 +1,12 @@
 use std::cmp::{min, max};
 use std::collections::HashMap;
 use std::mem::MaybeUninit;
+use std::sync::Arc;
 
-use crate::data::{Timestamp, AllocationId, Allocation, DataPointer};
+use lru::LruCache;
+use parking_lot::Mutex;
+
+use crate::data::{Timestamp, AllocationId, Allocation, DataPointer, FrameId, SourceKey};
 
 pub type NodeId = u64;
 
@@ -83,17 +87,33 @@ impl< K, V > Tree< K, V > where K: PartialEq + Clone {
     }
 
     pub fn add_allocation< T >( &mut self, allocation: &Allocation, allocation_id: AllocationId, backtrace: T ) where T: Iterator< Item = (K, V) > {
-        let timestamp = allocation.timestamp;
-        let size = allocation.size;
+        let node_id = self.add_allocations( backtrace, 1, allocation.size, allocation.timestamp, allocation.timestamp );
+        let node = &mut self.nodes[ node_id as usize ];
+        let index = node.self_allocations.len();
+        self.allocations.insert( allocation.pointer, (node_id, index) );
+        node.self_allocations.push( allocation_id );
+    }
 
+    /// Adds `count` allocations with a total of `size` bytes which all have the same `backtrace`,
+    /// without keeping track of which allocations those were.
+    ///
+    /// Returns the ID of the node the allocations ended up in.
+    pub fn add_allocations< T >(
+        &mut self,
+        backtrace: T,
+        count: u64,
+        size: u64,
+        first_timestamp: Timestamp,
+        last_timestamp: Timestamp
+    ) -> NodeId where T: Iterator< Item = (K, V) > {
         let mut node_id: NodeId = 0;
         for (key, value) in backtrace {
             {
                 let node = &mut self.nodes[ node_id as usize ];
                 node.total_size += size;
-                node.total_count += 1;
-                node.total_first_timestamp = min( node.total_first_timestamp, timestamp );
-                node.total_last_timestamp = max( node.total_last_timestamp, timestamp );
+                node.total_count += count;
+                node.total_first_timestamp = min( node.total_first_timestamp, first_timestamp );
+                node.total_last_timestamp = max( node.total_last_timestamp, last_timestamp );
             }
             let child_id = self.get_child_id( node_id, &key );
             let child_id = if child_id.is_none() {
@@ -102,8 +122,8 @@ impl< K, V > Tree< K, V > where K: PartialEq + Clone {
                     value: MaybeUninit::new( value ),
                     total_size: 0,
                     total_count: 0,
-                    total_first_timestamp: timestamp,
-                    total_last_timestamp: timestamp,
+                    total_first_timestamp: first_timestamp,
+                    total_last_timestamp: last_timestamp,
                     self_size: 0,
                     self_count: 0,
                     self_allocations: Vec::new(),
@@ -124,15 +144,36 @@ impl< K, V > Tree< K, V > where K: PartialEq + Clone {
 
         let node = &mut self.nodes[ node_id as usize ];
         node.self_size += size;
-        node.self_count += 1;
+        node.self_count += count;
         node.total_size += size;
-        node.total_count += 1;
-        node.total_first_timestamp = min( node.total_first_timestamp, timestamp );
-        node.total_last_timestamp = max( node.total_last_timestamp, timestamp );
+        node.total_count += count;
+        node.total_first_timestamp = min( node.total_first_timestamp, first_timestamp );
+        node.total_last_timestamp = max( node.total_last_timestamp, last_timestamp );
 
-        let index = node.self_allocations.len();
-        self.allocations.insert( allocation.pointer, (node_id, index) );
-        node.self_allocations.push( allocation_id );
+        node_id
+    }
+
+    /// Adds a new empty child to the `parent` without checking whether it already has a child
+    /// with the same `key`; the caller has to make sure it doesn't.
+    pub fn push_child( &mut self, parent: NodeId, key: K, value: V ) -> NodeId {
+        let child_node = Node {
+            key: MaybeUninit::new( key.clone() ),
+            value: MaybeUninit::new( value ),
+            total_size: 0,
+            total_count: 0,
+            total_first_timestamp: Timestamp::max(),
+            total_last_timestamp: Timestamp::min(),
+            self_size: 0,
+            self_count: 0,
+            self_allocations: Vec::new(),
+            children: Vec::new(),
+            parent,
+        };
+
+        let child_id = self.nodes.len() as NodeId;
+        self.nodes.push( child_node );
+        self.nodes[ parent as usize ].children.push( (key, child_id) );
+        child_id
     }
 
     pub fn currently_allocated( &self ) -> u64 {
@@ -146,4 +187,49 @@ impl< K, V > Tree< K, V > where K: PartialEq + Clone {
     pub fn get_node( &self, id: NodeId ) -> &Node< K, V > {
         &self.nodes[ id as usize ]
     }
+
+    pub fn get_node_mut( &mut self, id: NodeId ) -> &mut Node< K, V > {
+        &mut self.nodes[ id as usize ]
+    }
+
+    pub fn node_count( &self ) -> usize {
+        self.nodes.len()
+    }
+
+    pub fn memory_usage( &self ) -> usize {
+        self.nodes.capacity() * std::mem::size_of::< Node< K, V > >() +
+        self.nodes.iter().map( |node| {
+            node.children.capacity() * std::mem::size_of::< (K, NodeId) >() +
+            node.self_allocations.capacity() * std::mem::size_of::< AllocationId >()
+        }).sum::< usize >() +
+        self.allocations.capacity() * std::mem::size_of::< (DataPointer, (NodeId, usize)) >()
+    }
+}
+
+/// How many call trees for different filters are kept around.
+const CALL_TREE_CACHE_SIZE: usize = 4;
+
+/// The most recently used call trees, keyed by the filters they were built for.
+pub struct CallTreeCache( Mutex< LruCache< String, Arc< Tree< SourceKey, FrameId > > > > );
+
+impl Default for CallTreeCache {
+    fn default() -> Self {
+        CallTreeCache( Mutex::new( LruCache::new( CALL_TREE_CACHE_SIZE ) ) )
+    }
+}
+
+impl CallTreeCache {
+    pub(crate) fn get_or_insert_with( &self, key: String, callback: impl FnOnce() -> Tree< SourceKey, FrameId > ) -> Arc< Tree< SourceKey, FrameId > > {
+        if let Some( tree ) = self.0.lock().get( &key ) {
+            return tree.clone();
+        }
+
+        let tree = Arc::new( callback() );
+        self.0.lock().put( key, tree.clone() );
+        tree
+    }
+
+    pub(crate) fn memory_usage( &self ) -> usize {
+        self.0.lock().iter().map( |(_, tree)| tree.memory_usage() ).sum()
+    }
 }
@@ -5,7 +5,8 @@ use std::cmp::max;
 use std::ops::Range;
 use ctrlc;
 
-#[derive(Clone)]
+/// A flag which is set when the process receives a SIGINT; the default one is never set.
+#[derive(Clone, Default)]
 pub struct Sigint {
     flag: Arc< AtomicBool >
 }
@@ -3,6 +3,8 @@ use std::cmp::Ordering;
 use std::u32;
 use rayon::prelude::*;
 
+use crate::column::Column;
+
 #[derive(Default)]
 pub struct VecVec< K, T > {
     index: Vec< (K, u32, u32) >,
@@ -18,6 +20,13 @@ impl< K, T > VecVec< K, T > {
         }
     }
 
+    pub(crate) fn from_raw_parts( index: Vec< (K, u32, u32) >, storage: Vec< T > ) -> Self {
+        VecVec {
+            index,
+            storage
+        }
+    }
+
     pub fn shrink_to_fit( &mut self ) {
         self.index.shrink_to_fit();
         self.storage.shrink_to_fit();
@@ -88,7 +97,7 @@ impl< K, T > VecVec< K, T > {
 #[derive(Default)]
 pub struct DenseVecVec< T > {
     index: Vec< (u32, u32) >,
-    storage: Vec< T >
+    storage: Column< T >
 }
 
 impl< T > DenseVecVec< T > {
@@ -96,14 +105,14 @@ impl< T > DenseVecVec< T > {
     pub fn new() -> Self {
         DenseVecVec {
             index: Vec::new(),
-            storage: Vec::new()
+            storage: Column::default()
         }
     }
 
     #[inline]
-    pub fn push< I: IntoIterator< Item = T > >( &mut self, iter: I ) -> usize {
+    pub fn push< I: IntoIterator< Item = T > >( &mut self, iter: I ) -> usize where T: Clone {
         let offset = self.storage.len();
-        self.storage.extend( iter );
+        self.storage.to_mut().extend( iter );
         let length = self.storage.len() - offset;
         let index = self.index.len();
         self.index.push( (offset as _, length as _) );
@@ -116,6 +125,17 @@ impl< T > DenseVecVec< T > {
         &self.storage[ (offset as usize)..(offset + length) as usize ]
     }
 
+    pub(crate) fn from_raw_parts( index: Vec< (u32, u32) >, storage: Column< T > ) -> Self {
+        DenseVecVec {
+            index,
+            storage
+        }
+    }
+
+    pub(crate) fn raw_parts( &self ) -> (&[(u32, u32)], &[T]) {
+        (&self.index, &self.storage)
+    }
+
     pub fn shrink_to_fit( &mut self ) {
         self.index.shrink_to_fit();
         self.storage.shrink_to_fit();
@@ -7,20 +7,36 @@ use std::path::PathBuf;
 use std::io;
 use std::fs::File;
 use std::error::Error;
+use std::time::Duration;
 
 use structopt::StructOpt;
 
+use cli_core::cmd_generate::{Distribution, GenerateOptions};
+use cli_core::cmd_gather::{GatherOptions, StreamKind};
+use cli_core::RuntimeOption;
 use cli_core::{
     Anonymize,
+    LoadFilter,
     Loader,
-    export_as_replay,
+    ReplayFormat,
+    export_as_replay_with_format,
     export_as_heaptrack,
+    export_as_pprof,
+    export_as_parquet,
     postprocess
 };
 
 #[global_allocator]
 static GLOBAL: tikv_jemallocator::Jemalloc = tikv_jemallocator::Jemalloc;
 
+fn parse_stream_kind( source: &str ) -> Result< StreamKind, String > {
+    cli_core::cmd_gather::parse_stream_kind( source )
+}
+
+fn parse_assignment( source: &str ) -> Result< (RuntimeOption, u64), String > {
+    cli_core::cmd_ctl::parse_assignment( source )
+}
+
 fn parse_anonymize( source: &str ) -> Anonymize {
     match source {
         "none" => Anonymize::None,
@@ -35,6 +51,9 @@ enum Opt {
     /// Generates a raw data file which can be used to replay all of the allocations
     #[structopt(name = "export-replay")]
     ExportReplay {
+        /// Writes the ops in a variable length format which is a lot smaller
+        #[structopt(long)]
+        compact: bool,
         #[structopt(short = "o", long = "output", parse(from_os_str))]
         output: PathBuf,
         #[structopt(parse(from_os_str))]
@@ -51,11 +70,74 @@ enum Opt {
         #[structopt(parse(from_os_str))]
         input: PathBuf
     },
+    /// Generates a gzipped pprof heap profile
+    #[structopt(name = "export-pprof")]
+    ExportPprof {
+        /// A file or directory with extra debugging symbols; can be specified multiple times
+        #[structopt(short = "d", long = "debug-symbols", parse(from_os_str))]
+        debug_symbols: Vec< PathBuf >,
+        #[structopt(short = "o", long = "output", parse(from_os_str))]
+        output: PathBuf,
+        #[structopt(parse(from_os_str))]
+        input: PathBuf
+    },
+    /// Writes the allocations, backtraces and frames as Parquet files into a given directory
+    #[structopt(name = "export-parquet")]
+    ExportParquet {
+        /// A file or directory with extra debugging symbols; can be specified multiple times
+        #[structopt(short = "d", long = "debug-symbols", parse(from_os_str))]
+        debug_symbols: Vec< PathBuf >,
+        /// The directory into which `allocations.parquet`, `backtraces.parquet` and `frames.parquet` are written
+        #[structopt(short = "o", long = "output", parse(from_os_str))]
+        output: PathBuf,
+        #[structopt(parse(from_os_str))]
+        input: PathBuf
+    },
     /// Gathers memory tracking data from a given machine
     #[structopt(name = "gather")]
     Gather {
+        /// What to stream; anything other than `full` needs a process which was started in a matching mode
+        #[structopt(long = "stream", parse(try_from_str = "parse_stream_kind"), default_value = "full",
+        raw(possible_values = r#"&[
+            "full",
+            "sampled",
+            "summary"
+        ]"#))]
+        stream: StreamKind,
+        /// The directory into which the data is written
+        #[structopt(long = "output-dir", parse(from_os_str))]
+        output_dir: Option< PathBuf >,
+        /// Stops gathering from a host after this many megabytes were written for all of its processes
+        #[structopt(long = "disk-budget")]
+        disk_budget: Option< u64 >,
+        /// Receives at most this many megabytes per second from all of the processes of a single host
+        #[structopt(long = "bandwidth-budget")]
+        bandwidth_budget: Option< u64 >,
+        /// The process from which to gather; if not given then every process which announces itself is gathered from
         target: Option< String >
     },
+    /// Changes the options of a running process, or prints them if none are given
+    #[structopt(name = "ctl")]
+    Ctl {
+        /// The process to control, e.g. `localhost:8100`
+        target: String,
+        /// Asks the process to write out what its flight recorder has
+        #[structopt(long = "dump-flight-recorder")]
+        dump_flight_recorder: bool,
+        /// The options to change, as `NAME=VALUE`, e.g. `sampling_interval=4096` or `gather_maps=off`
+        #[structopt(parse(try_from_str = "parse_assignment"))]
+        assignments: Vec< (RuntimeOption, u64) >
+    },
+    /// Collects the data of the processes which were started with `MEMORY_PROFILER_COLLECTOR`
+    #[structopt(name = "collector")]
+    Collector {
+        /// The Unix socket to listen on
+        #[structopt(long, parse(from_os_str))]
+        socket: PathBuf,
+        /// The output filename pattern, which supports the same placeholders as `MEMORY_PROFILER_OUTPUT`
+        #[structopt(long, short = "o", default_value = "memory-profiling_%e_%t_%p.dat")]
+        output: String
+    },
     /// Launches a server with all of the data exposed through a REST API
     #[cfg(feature = "subcommand-server")]
     #[structopt(name = "server")]
@@ -69,6 +151,55 @@ enum Opt {
         /// The port on which to start the HTTP server
         #[structopt(short = "p", long = "port", default_value = "8080")]
         port: u16,
+        /// Whenever to cache the loaded data in a `.bhcache` file next to the input; makes reopening the same file much faster
+        #[structopt(long = "cache")]
+        cache: bool,
+        /// Loads all of the input files on startup instead of only when they're first opened
+        #[structopt(long = "preload")]
+        preload: bool,
+        /// Loads all of the input files on startup, multiple of them in parallel
+        #[structopt(long = "load-in-parallel")]
+        load_in_parallel: bool,
+        /// Unloads the least recently used data when the loaded data takes more than this many megabytes; best used with `--cache`
+        #[structopt(long = "memory-budget")]
+        memory_budget: Option< usize >,
+        /// Keeps at most this many megabytes of the files generated by the scripts in memory
+        #[structopt(long = "generated-files-memory-limit", default_value = "32")]
+        generated_files_memory_limit: usize,
+        /// Also writes the files generated by the scripts into this directory so that they don't have to be regenerated
+        #[structopt(long = "generated-files-dir", parse(from_os_str))]
+        generated_files_dir: Option< PathBuf >,
+        /// Keeps at most this many megabytes of the files generated by the scripts on disk
+        #[structopt(long = "generated-files-disk-limit", default_value = "1024")]
+        generated_files_disk_limit: usize,
+        /// Gathers data from a given machine and periodically reloads it while it's being gathered
+        #[structopt(long = "live")]
+        live: Option< String >,
+        /// Only loads the allocations made at least this many seconds after the profiling was started
+        #[structopt(long = "only-allocated-after")]
+        only_allocated_after: Option< f64 >,
+        /// Only loads the allocations made at most this many seconds after the profiling was started
+        #[structopt(long = "only-allocated-before")]
+        only_allocated_before: Option< f64 >,
+        /// Only loads the allocations made by a given thread; can be specified multiple times
+        #[structopt(long = "only-thread")]
+        only_threads: Vec< u32 >,
+        /// Only loads the allocations which are at least this many bytes big
+        #[structopt(long = "only-larger-or-equal")]
+        only_larger_or_equal: Option< u64 >,
+        /// Only loads the allocations with a backtrace in which any function matches a given regex
+        #[structopt(long = "only-backtraces-with-function")]
+        only_backtraces_with_function: Option< String >,
+        /// Shrinks the backtraces which are deeper than this by collapsing the recursion and eliding the middle frames
+        #[structopt(long = "max-backtrace-depth")]
+        max_backtrace_depth: Option< usize >,
+        /// Only loads the allocations which were never deallocated; the rest are only loaded as per-backtrace aggregates, which takes a lot less memory
+        #[structopt(long = "aggregate-deallocated")]
+        aggregate_deallocated: bool,
+        /// Doesn't load anything and instead coordinates the given workers, each of which is a server with a different time range of the same data
+        /// loaded through `--only-allocated-after` and `--only-allocated-before`; can be specified multiple times, in the order of those time ranges
+        #[structopt(long = "worker")]
+        workers: Vec< String >,
         #[structopt(parse(from_os_str), required = false)]
         input: Vec< PathBuf >
     },
@@ -114,6 +245,22 @@ enum Opt {
         #[structopt(long)]
         disable_compression: bool,
 
+        /// The LZ4 compression level; 0 is the fast mode, while 1 to 12 use the slower high-compression mode
+        #[structopt(long, conflicts_with = "disable_compression")]
+        level: Option< u32 >,
+
+        /// Compresses the output with zstd at the given level, with a dictionary trained on the data itself
+        #[structopt(long, conflicts_with = "disable_compression")]
+        zstd: Option< i32 >,
+
+        /// Appends an index of the chunks to the output, which makes it possible to only read parts of it
+        #[structopt(long)]
+        index: bool,
+
+        /// Merges the consecutive chunks into chunks of up to this many kilobytes (at most 512) for a better compression ratio
+        #[structopt(long)]
+        chunk_size: Option< usize >,
+
         #[structopt(long, short = "o", parse(from_os_str))]
         output: PathBuf,
 
@@ -124,6 +271,12 @@ enum Opt {
     AnalyzeSize {
         input: PathBuf
     },
+    /// Prints a quick summary of the data without fully loading it
+    #[structopt(name = "info")]
+    Info {
+        #[structopt(parse(from_os_str))]
+        input: PathBuf
+    },
     /// Runs give analysis script
     #[structopt(name = "script")]
     Script {
@@ -134,6 +287,10 @@ enum Opt {
         #[structopt(long, short = "d", parse(from_os_str))]
         data: Option< PathBuf >,
 
+        /// Only loads the allocations which were never deallocated; the rest are only loaded as per-backtrace aggregates, which takes a lot less memory
+        #[structopt(long = "aggregate-deallocated")]
+        aggregate_deallocated: bool,
+
         args: Vec< String >
     },
     #[structopt(name = "script-slave", raw(setting = "structopt::clap::AppSettings::Hidden"))]
@@ -141,24 +298,101 @@ enum Opt {
         #[structopt(long, short = "d", parse(from_os_str))]
         data: Option< PathBuf >
     },
-    /// Extracts all of the files embedded in the data
+    /// Extracts all of the files embedded in the data, or a part of the data itself
     #[structopt(name = "extract")]
     Extract {
         #[structopt(long, short = "o", parse(from_os_str))]
         output: PathBuf,
+
+        /// Instead of the embedded files write out a new data file with only the events from the given time range
+        ///
+        /// The new file also contains everything which was still alive at the start of the range, so it can be loaded on its own.
+        #[structopt(long)]
+        data: bool,
+
+        /// Only extract the allocations made by these threads (implies `--data`)
+        #[structopt(long = "thread")]
+        threads: Vec< u32 >,
+
+        /// Only extract the files which were written after this many seconds since the start of profiling
+        #[structopt(long)]
+        from: Option< u64 >,
+
+        /// Only extract the files which were written before this many seconds since the start of profiling
+        #[structopt(long)]
+        to: Option< u64 >,
+
         input: PathBuf,
+    },
+    /// Generates a synthetic data file without having to run anything under the profiler
+    #[structopt(name = "generate")]
+    Generate {
+        #[structopt(long, short = "o", parse(from_os_str))]
+        output: PathBuf,
+
+        /// Roughly how many events to generate in total
+        #[structopt(long = "events", default_value = "1000000")]
+        event_count: u64,
+
+        /// How many threads are allocating
+        #[structopt(long = "threads", default_value = "8")]
+        thread_count: u32,
+
+        /// How many distinct backtraces there are
+        #[structopt(long = "backtraces", default_value = "10000")]
+        backtrace_count: u64,
+
+        /// The distribution of the number of frames in each backtrace [default: uniform:8:48]
+        #[structopt(long)]
+        backtrace_depth: Option< Distribution >,
+
+        /// The distribution of the time between two allocations on the same thread, in microseconds [default: exponential:5]
+        #[structopt(long)]
+        allocation_interval: Option< Distribution >,
+
+        /// The distribution of the allocation sizes, in bytes [default: lognormal:64:1.5]
+        #[structopt(long)]
+        allocation_size: Option< Distribution >,
+
+        /// The distribution of the allocation lifetimes, in microseconds [default: lognormal:100:3]
+        #[structopt(long)]
+        lifetime: Option< Distribution >,
+
+        /// The probability that an allocation is never freed
+        #[structopt(long, default_value = "0.01")]
+        leak_probability: f64,
+
+        /// The probability that an allocation is reallocated instead of being freed
+        #[structopt(long, default_value = "0.1")]
+        realloc_probability: f64,
+
+        /// The probability that an allocation is an mmap instead
+        #[structopt(long, default_value = "0.001")]
+        mmap_probability: f64,
+
+        /// The distribution of the mmap lengths, in bytes [default: lognormal:262144:1.5]
+        #[structopt(long)]
+        mmap_size: Option< Distribution >,
+
+        /// The seed of the random number generator; the same seed always generates the same data
+        #[structopt(long, default_value = "0")]
+        seed: u64,
+
+        #[structopt(long)]
+        disable_compression: bool
     }
 }
 
 fn run( opt: Opt ) -> Result< (), Box< dyn Error > > {
     match opt {
-        Opt::ExportReplay { output, input } => {
+        Opt::ExportReplay { compact, output, input } => {
             let fp = File::open( input )?;
             let data = Loader::load_from_stream_without_debug_info( fp )?;
             let data_out = File::create( output )?;
             let data_out = io::BufWriter::new( data_out );
 
-            export_as_replay( &data, data_out, |_, _| true )?;
+            let format = if compact { ReplayFormat::Compact } else { ReplayFormat::Fixed };
+            export_as_replay_with_format( &data, data_out, |_, _| true, format )?;
         },
         Opt::ExportHeaptrack { debug_symbols, output, input } => {
             let fp = File::open( input )?;
@@ -168,12 +402,84 @@ fn run( opt: Opt ) -> Result< (), Box< dyn Error > > {
 
             export_as_heaptrack( &data, data_out, |_, _| true )?;
         },
-        Opt::Gather { target } => {
-            cli_core::cmd_gather::main( target.as_ref().map( |target| target.as_str() ) )?;
+        Opt::ExportPprof { debug_symbols, output, input } => {
+            let fp = File::open( input )?;
+            let data = Loader::load_from_stream( fp, debug_symbols )?;
+            let data_out = File::create( output )?;
+
+            export_as_pprof( &data, data_out, |_, _| true )?;
+        },
+        Opt::ExportParquet { debug_symbols, output, input } => {
+            let fp = File::open( input )?;
+            let data = Loader::load_from_stream( fp, debug_symbols )?;
+
+            export_as_parquet( &data, &output, |_, _| true )?;
+        },
+        Opt::Gather { stream, output_dir, disk_budget, bandwidth_budget, target } => {
+            let options = GatherOptions {
+                kind: stream,
+                output_dir,
+                disk_budget: disk_budget.map( |budget| budget * 1024 * 1024 ),
+                bandwidth_budget: bandwidth_budget.map( |budget| budget * 1024 * 1024 )
+            };
+
+            cli_core::cmd_gather::main( target.as_ref().map( |target| target.as_str() ), options )?;
+        },
+        Opt::Ctl { target, dump_flight_recorder, assignments } => {
+            cli_core::cmd_ctl::main( &target, &assignments, dump_flight_recorder )?;
+        },
+        Opt::Collector { socket, output } => {
+            cli_core::cmd_collector::main( &socket, &output )?;
         },
         #[cfg(feature = "subcommand-server")]
-        Opt::Server { debug_symbols, input, interface, port } => {
-            server_core::main( input, debug_symbols, false, &interface, port )?;
+        Opt::Server {
+            debug_symbols,
+            input,
+            interface,
+            port,
+            cache,
+            preload,
+            load_in_parallel,
+            memory_budget,
+            generated_files_memory_limit,
+            generated_files_dir,
+            generated_files_disk_limit,
+            live,
+            only_allocated_after,
+            only_allocated_before,
+            only_threads,
+            only_larger_or_equal,
+            only_backtraces_with_function,
+            max_backtrace_depth,
+            aggregate_deallocated,
+            workers
+        } => {
+            if !workers.is_empty() {
+                server_core::coordinator_main( workers, &interface, port )?;
+                return Ok(());
+            }
+
+            let mut load_filter = LoadFilter::default();
+            load_filter.only_allocated_after = only_allocated_after.map( Duration::from_secs_f64 );
+            load_filter.only_allocated_before = only_allocated_before.map( Duration::from_secs_f64 );
+            if !only_threads.is_empty() {
+                load_filter.only_threads = Some( only_threads.into_iter().collect() );
+            }
+            load_filter.only_larger_or_equal = only_larger_or_equal;
+            load_filter.max_backtrace_depth = max_backtrace_depth.filter( |&depth| depth > 0 );
+            load_filter.aggregate_deallocated = aggregate_deallocated;
+            if let Some( pattern ) = only_backtraces_with_function {
+                load_filter.set_function_regex( &pattern )?;
+            }
+
+            let memory_budget = memory_budget.map( |megabytes| megabytes * 1024 * 1024 );
+            let generated_files = server_core::GeneratedFilesOptions {
+                memory_limit: generated_files_memory_limit * 1024 * 1024,
+                directory: generated_files_dir,
+                disk_limit: generated_files_disk_limit * 1024 * 1024
+            };
+
+            server_core::main( input, debug_symbols, preload, load_in_parallel, cache, memory_budget, generated_files, live.as_deref(), load_filter, &interface, port )?;
         },
         Opt::Postprocess { debug_symbols, output, input, anonymize } => {
             let ifp = File::open( input )?;
@@ -185,23 +491,70 @@ fn run( opt: Opt ) -> Result< (), Box< dyn Error > > {
             let ofp = File::create( output )?;
             cli_core::squeeze_data( ifp, ofp, threshold )?;
         },
-        Opt::Repack { disable_compression, input, output } => {
+        Opt::Repack { disable_compression, level, zstd, index, chunk_size, input, output } => {
             let ifp = File::open( &input )?;
             let ofp = File::create( output )?;
-            cli_core::repack( disable_compression, ifp, ofp )?;
+            let chunk_size = chunk_size.map( |kilobytes| kilobytes * 1024 );
+            cli_core::repack_chunks( disable_compression, level.unwrap_or( 0 ), zstd, index, chunk_size, ifp, ofp )?;
         },
         Opt::AnalyzeSize { input } => {
             let ifp = File::open( &input )?;
             cli_core::cmd_analyze_size::analyze_size( ifp )?;
         },
-        Opt::Script { input, data, args } => {
-            cli_core::run_script( &input, data.as_ref().map( |path| path.as_path() ), args )?;
+        Opt::Info { input } => {
+            let ifp = File::open( &input )?;
+            cli_core::cmd_info::info( ifp )?;
+        },
+        Opt::Script { input, data, aggregate_deallocated, args } => {
+            let mut load_filter = LoadFilter::default();
+            load_filter.aggregate_deallocated = aggregate_deallocated;
+            cli_core::run_script( &input, data.as_ref().map( |path| path.as_path() ), load_filter, args )?;
         },
         Opt::ScriptSlave { data } => {
             cli_core::script::run_script_slave( data.as_ref().map( |path| path.as_path() ) )?;
         },
-        Opt::Extract { input, output } => {
-            cli_core::cmd_extract::extract( input, output )?;
+        Opt::Extract { input, output, data, threads, from, to } => {
+            if data || !threads.is_empty() {
+                cli_core::cmd_extract::extract_window( input, output, from, to, threads )?;
+            } else {
+                cli_core::cmd_extract::extract( input, output, from, to )?;
+            }
+        },
+        Opt::Generate {
+            output,
+            event_count,
+            thread_count,
+            backtrace_count,
+            backtrace_depth,
+            allocation_interval,
+            allocation_size,
+            lifetime,
+            leak_probability,
+            realloc_probability,
+            mmap_probability,
+            mmap_size,
+            seed,
+            disable_compression
+        } => {
+            let defaults = GenerateOptions::default();
+            let options = GenerateOptions {
+                event_count,
+                thread_count,
+                backtrace_count,
+                backtrace_depth: backtrace_depth.unwrap_or( defaults.backtrace_depth ),
+                allocation_interval: allocation_interval.unwrap_or( defaults.allocation_interval ),
+                allocation_size: allocation_size.unwrap_or( defaults.allocation_size ),
+                lifetime: lifetime.unwrap_or( defaults.lifetime ),
+                leak_probability,
+                realloc_probability,
+                mmap_probability,
+                mmap_size: mmap_size.unwrap_or( defaults.mmap_size ),
+                seed,
+                compress: !disable_compression
+            };
+
+            let ofp = io::BufWriter::new( File::create( output )? );
+            cli_core::cmd_generate::generate( &options, ofp )?;
         },
     }
 
@@ -215,6 +568,24 @@ fn main() {
 
     env_logger::init();
 
+    if let Ok( count ) = env::var( "BYTEHOUND_DECOMPRESSION_THREADS" ) {
+        match count.parse() {
+            Ok( count ) => cli_core::set_max_decompression_threads( count ),
+            Err( _ ) => warn!( "Invalid BYTEHOUND_DECOMPRESSION_THREADS: {:?}", count )
+        }
+    }
+
+    if let Some( path ) = env::var_os( "BYTEHOUND_SYMBOL_CACHE_DIR" ) {
+        cli_core::set_symbol_cache_directory( Some( path.into() ) );
+    }
+
+    if let Ok( bytes ) = env::var( "BYTEHOUND_LIVE_ALLOCATIONS_SPILL_THRESHOLD" ) {
+        match bytes.parse() {
+            Ok( bytes ) => cli_core::set_live_allocations_spill_threshold( bytes ),
+            Err( _ ) => warn!( "Invalid BYTEHOUND_LIVE_ALLOCATIONS_SPILL_THRESHOLD: {:?}", bytes )
+        }
+    }
+
     let opt = Opt::from_args();
     let result = run( opt );
     if let Err( error ) = result {
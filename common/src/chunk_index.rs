@@ -0,0 +1,139 @@
+use std::io::{self, Read, Seek, SeekFrom, Write};
+
+use byteorder::{ReadBytesExt, WriteBytesExt, LittleEndian, ByteOrder};
+use speedy::{Readable, Writable};
+
+use crate::lz4_stream::CHUNK_KIND_INDEX;
+use crate::timestamp::Timestamp;
+
+/// Marks the end of a file which has a chunk index appended to it.
+pub const CHUNK_INDEX_MAGIC: [u8; 8] = *b"BHCHIDX1";
+
+// The offset of the index chunk followed by the magic.
+const TRAILER_SIZE: usize = 16;
+
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct ChunkIndexEntry {
+    /// The offset of the chunk in the file; there's always a whole event at the start of it.
+    pub offset: u64,
+    /// The earliest timestamp of the events up until the next entry.
+    pub first_timestamp: Timestamp,
+    /// The latest timestamp of the events up until the next entry.
+    pub last_timestamp: Timestamp,
+    pub event_count: u64
+}
+
+/// An index of the chunks of the data, which can be optionally appended at its end.
+///
+/// Since the events are not necessarily ordered by their timestamps the entries
+/// can overlap each other in time.
+#[derive(Clone, PartialEq, Debug, Default, Readable, Writable)]
+pub struct ChunkIndex {
+    pub entries: Vec< ChunkIndexEntry >,
+    /// The offset of the index itself, which is also where the events end.
+    pub end_offset: u64
+}
+
+impl ChunkIndex {
+    /// Returns the byte ranges of the data which contain events from within the given time range.
+    ///
+    /// The range containing the header is always returned.
+    pub fn ranges_for( &self, from: Timestamp, to: Timestamp ) -> Vec< (u64, u64) > {
+        let mut ranges: Vec< (u64, u64) > = Vec::new();
+        for (nth, entry) in self.entries.iter().enumerate() {
+            if nth != 0 && (entry.last_timestamp < from || entry.first_timestamp > to) {
+                continue;
+            }
+
+            let end = self.entries.get( nth + 1 ).map( |entry| entry.offset ).unwrap_or( self.end_offset );
+            match ranges.last_mut() {
+                Some( last ) if last.1 == entry.offset => last.1 = end,
+                _ => ranges.push( (entry.offset, end) )
+            }
+        }
+
+        ranges
+    }
+}
+
+pub fn write_chunk_index< F: Write >( mut fp: F, index: &ChunkIndex ) -> io::Result< () > {
+    let mut payload = index.write_to_vec()?;
+    payload.write_u64::< LittleEndian >( index.end_offset )?;
+    payload.extend_from_slice( &CHUNK_INDEX_MAGIC );
+
+    fp.write_u8( CHUNK_KIND_INDEX )?;
+    fp.write_u32::< LittleEndian >( payload.len() as u32 )?;
+    fp.write_all( &payload )
+}
+
+/// Reads the chunk index from the end of the file, if it has one.
+pub fn read_chunk_index< F: Read + Seek >( mut fp: F ) -> io::Result< Option< ChunkIndex > > {
+    let length = fp.seek( SeekFrom::End( 0 ) )?;
+    if length < TRAILER_SIZE as u64 {
+        return Ok( None );
+    }
+
+    let mut trailer = [0; TRAILER_SIZE];
+    fp.seek( SeekFrom::End( -(TRAILER_SIZE as i64) ) )?;
+    fp.read_exact( &mut trailer )?;
+    if trailer[ 8.. ] != CHUNK_INDEX_MAGIC {
+        return Ok( None );
+    }
+
+    let offset = LittleEndian::read_u64( &trailer[ ..8 ] );
+    if offset >= length {
+        return Err( io::Error::new( io::ErrorKind::InvalidData, "invalid chunk index offset" ) );
+    }
+
+    fp.seek( SeekFrom::Start( offset ) )?;
+    if fp.read_u8()? != CHUNK_KIND_INDEX {
+        return Err( io::Error::new( io::ErrorKind::InvalidData, "chunk index not found" ) );
+    }
+
+    let payload_length = fp.read_u32::< LittleEndian >()? as usize;
+    if payload_length < TRAILER_SIZE || offset + 5 + payload_length as u64 != length {
+        return Err( io::Error::new( io::ErrorKind::InvalidData, "invalid chunk index length" ) );
+    }
+
+    let mut payload = vec![ 0; payload_length - TRAILER_SIZE ];
+    fp.read_exact( &mut payload )?;
+
+    let index = ChunkIndex::read_from_buffer( &payload )?;
+    Ok( Some( index ) )
+}
+
+#[test]
+fn test_chunk_index() {
+    let entry = |offset, first, last| ChunkIndexEntry {
+        offset,
+        first_timestamp: Timestamp::from_secs( first ),
+        last_timestamp: Timestamp::from_secs( last ),
+        event_count: 1
+    };
+
+    let index = ChunkIndex {
+        entries: vec![
+            entry( 0, 0, 1 ),
+            entry( 100, 1, 2 ),
+            entry( 200, 2, 3 ),
+            entry( 300, 3, 4 ),
+            entry( 400, 1, 5 )
+        ],
+        end_offset: 500
+    };
+
+    let mut data = vec![ 0xAA; 500 ];
+    write_chunk_index( &mut data, &index ).unwrap();
+    let mut fp = io::Cursor::new( &data );
+    assert_eq!( read_chunk_index( &mut fp ).unwrap(), Some( index.clone() ) );
+
+    assert_eq!( read_chunk_index( io::Cursor::new( &data[ ..500 ] ) ).unwrap(), None );
+
+    let from = Timestamp::from_usecs( 3_500_000 );
+    let to = Timestamp::max();
+    assert_eq!( index.ranges_for( from, to ), vec![ (0, 100), (300, 500) ] );
+
+    let from = Timestamp::from_usecs( 1_500_000 );
+    let to = Timestamp::from_usecs( 1_600_000 );
+    assert_eq!( index.ranges_for( from, to ), vec![ (0, 200), (400, 500) ] );
+}
@@ -0,0 +1,322 @@
+use std::collections::HashMap;
+use std::io::{self, Write};
+
+use speedy::Writable;
+
+use crate::event::{AllocBody, AllocationId, Event};
+use crate::timestamp::Timestamp;
+
+// The compact events are delta-encoded against the previous events from the same thread.
+#[derive(Default)]
+struct ThreadState {
+    timestamp: u64,
+    pointer: u64,
+    allocation: u64,
+    flags: u32
+}
+
+#[inline]
+fn encode_delta( value: u64, base: u64 ) -> u64 {
+    let delta = value.wrapping_sub( base ) as i64;
+    ((delta << 1) ^ (delta >> 63)) as u64
+}
+
+#[inline]
+fn decode_delta( value: u64, base: u64 ) -> u64 {
+    let delta = ((value >> 1) as i64) ^ -((value & 1) as i64);
+    base.wrapping_add( delta as u64 )
+}
+
+/// Writes out the allocation events, either as the usual `*Ex` events or as their compact equivalents.
+pub struct Encoder {
+    is_enabled: bool,
+    threads: HashMap< u32, ThreadState >,
+    current_thread: Option< u32 >,
+    needs_reset: bool
+}
+
+impl Encoder {
+    pub fn new( is_enabled: bool ) -> Self {
+        Encoder {
+            is_enabled,
+            threads: HashMap::new(),
+            current_thread: None,
+            needs_reset: true
+        }
+    }
+
+    /// Makes the next event self-contained, e.g. for when a new reader starts to read the stream from this point.
+    pub fn reset( &mut self ) {
+        self.threads.clear();
+        self.current_thread = None;
+        self.needs_reset = true;
+    }
+
+    fn switch_to_thread< F: Write >( &mut self, fp: &mut F, thread: u32 ) -> io::Result< &mut ThreadState > {
+        if self.needs_reset || self.current_thread != Some( thread ) {
+            Event::ThreadContext {
+                thread,
+                reset: self.needs_reset
+            }.write_to_stream( &mut *fp )?;
+
+            self.needs_reset = false;
+            self.current_thread = Some( thread );
+        }
+
+        Ok( self.threads.entry( thread ).or_default() )
+    }
+
+    pub fn write_alloc< F: Write >( &mut self, fp: &mut F, id: AllocationId, timestamp: Timestamp, allocation: AllocBody ) -> io::Result< () > {
+        if !self.is_enabled {
+            return Event::AllocEx { id, timestamp, allocation }.write_to_stream( fp );
+        }
+
+        let state = self.switch_to_thread( fp, allocation.thread )?;
+        let event = Event::AllocCompact {
+            id_thread: id.thread,
+            id_allocation: encode_delta( id.allocation, state.allocation ),
+            timestamp: encode_delta( timestamp.as_usecs(), state.timestamp ),
+            pointer: encode_delta( allocation.pointer, state.pointer ),
+            size: allocation.size,
+            backtrace: allocation.backtrace,
+            flags: allocation.flags as u64,
+            extra_usable_space: allocation.extra_usable_space as u64
+        };
+
+        state.allocation = id.allocation;
+        state.timestamp = timestamp.as_usecs();
+        state.pointer = allocation.pointer;
+        state.flags = allocation.flags;
+        event.write_to_stream( fp )
+    }
+
+    pub fn write_realloc< F: Write >( &mut self, fp: &mut F, id: AllocationId, timestamp: Timestamp, old_pointer: u64, allocation: AllocBody ) -> io::Result< () > {
+        if !self.is_enabled {
+            return Event::ReallocEx { id, timestamp, old_pointer, allocation }.write_to_stream( fp );
+        }
+
+        let state = self.switch_to_thread( fp, allocation.thread )?;
+        let event = if old_pointer == allocation.pointer && allocation.flags == state.flags {
+            // Growing buffers are usually resized in place over and over again.
+            Event::ResizeCompact {
+                id_thread: id.thread,
+                id_allocation: encode_delta( id.allocation, state.allocation ),
+                timestamp: encode_delta( timestamp.as_usecs(), state.timestamp ),
+                pointer: encode_delta( allocation.pointer, state.pointer ),
+                size: allocation.size,
+                backtrace: allocation.backtrace,
+                extra_usable_space: allocation.extra_usable_space as u64
+            }
+        } else {
+            Event::ReallocCompact {
+                id_thread: id.thread,
+                id_allocation: encode_delta( id.allocation, state.allocation ),
+                timestamp: encode_delta( timestamp.as_usecs(), state.timestamp ),
+                pointer: encode_delta( allocation.pointer, state.pointer ),
+                old_pointer: encode_delta( old_pointer, allocation.pointer ),
+                size: allocation.size,
+                backtrace: allocation.backtrace,
+                flags: allocation.flags as u64,
+                extra_usable_space: allocation.extra_usable_space as u64
+            }
+        };
+
+        state.allocation = id.allocation;
+        state.timestamp = timestamp.as_usecs();
+        state.pointer = allocation.pointer;
+        state.flags = allocation.flags;
+        event.write_to_stream( fp )
+    }
+
+    pub fn write_free< F: Write >( &mut self, fp: &mut F, id: AllocationId, timestamp: Timestamp, pointer: u64, backtrace: u64, thread: u32 ) -> io::Result< () > {
+        if !self.is_enabled {
+            return Event::FreeEx { id, timestamp, pointer, backtrace, thread }.write_to_stream( fp );
+        }
+
+        let state = self.switch_to_thread( fp, thread )?;
+        let event = Event::FreeCompact {
+            id_thread: id.thread,
+            id_allocation: encode_delta( id.allocation, state.allocation ),
+            timestamp: encode_delta( timestamp.as_usecs(), state.timestamp ),
+            pointer: encode_delta( pointer, state.pointer ),
+            backtrace
+        };
+
+        state.allocation = id.allocation;
+        state.timestamp = timestamp.as_usecs();
+        state.pointer = pointer;
+        event.write_to_stream( fp )
+    }
+}
+
+/// Turns the compact events back into the usual `*Ex` events.
+#[derive(Default)]
+pub struct Decoder {
+    threads: HashMap< u32, ThreadState >,
+    current_thread: u32
+}
+
+impl Decoder {
+    /// Returns `None` for the events which only carry the decoder's state.
+    pub fn decode< 'a >( &mut self, event: Event< 'a > ) -> Option< Event< 'a > > {
+        let event = match event {
+            Event::ThreadContext { thread, reset } => {
+                if reset {
+                    self.threads.clear();
+                }
+
+                self.current_thread = thread;
+                return None;
+            },
+            Event::AllocCompact { id_thread, id_allocation, timestamp, pointer, size, backtrace, flags, extra_usable_space } => {
+                let thread = self.current_thread;
+                let state = self.threads.entry( thread ).or_default();
+                state.allocation = decode_delta( id_allocation, state.allocation );
+                state.timestamp = decode_delta( timestamp, state.timestamp );
+                state.pointer = decode_delta( pointer, state.pointer );
+                state.flags = flags as u32;
+
+                Event::AllocEx {
+                    id: AllocationId { thread: id_thread, allocation: state.allocation },
+                    timestamp: Timestamp::from_usecs( state.timestamp ),
+                    allocation: AllocBody {
+                        pointer: state.pointer,
+                        size,
+                        backtrace,
+                        thread,
+                        flags: flags as u32,
+                        extra_usable_space: extra_usable_space as u32,
+                        preceding_free_space: 0
+                    }
+                }
+            },
+            Event::ReallocCompact { id_thread, id_allocation, timestamp, pointer, old_pointer, size, backtrace, flags, extra_usable_space } => {
+                let thread = self.current_thread;
+                let state = self.threads.entry( thread ).or_default();
+                state.allocation = decode_delta( id_allocation, state.allocation );
+                state.timestamp = decode_delta( timestamp, state.timestamp );
+                state.pointer = decode_delta( pointer, state.pointer );
+                state.flags = flags as u32;
+
+                Event::ReallocEx {
+                    id: AllocationId { thread: id_thread, allocation: state.allocation },
+                    timestamp: Timestamp::from_usecs( state.timestamp ),
+                    old_pointer: decode_delta( old_pointer, state.pointer ),
+                    allocation: AllocBody {
+                        pointer: state.pointer,
+                        size,
+                        backtrace,
+                        thread,
+                        flags: flags as u32,
+                        extra_usable_space: extra_usable_space as u32,
+                        preceding_free_space: 0
+                    }
+                }
+            },
+            Event::ResizeCompact { id_thread, id_allocation, timestamp, pointer, size, backtrace, extra_usable_space } => {
+                let thread = self.current_thread;
+                let state = self.threads.entry( thread ).or_default();
+                state.allocation = decode_delta( id_allocation, state.allocation );
+                state.timestamp = decode_delta( timestamp, state.timestamp );
+                state.pointer = decode_delta( pointer, state.pointer );
+
+                Event::ReallocEx {
+                    id: AllocationId { thread: id_thread, allocation: state.allocation },
+                    timestamp: Timestamp::from_usecs( state.timestamp ),
+                    old_pointer: state.pointer,
+                    allocation: AllocBody {
+                        pointer: state.pointer,
+                        size,
+                        backtrace,
+                        thread,
+                        flags: state.flags,
+                        extra_usable_space: extra_usable_space as u32,
+                        preceding_free_space: 0
+                    }
+                }
+            },
+            Event::FreeCompact { id_thread, id_allocation, timestamp, pointer, backtrace } => {
+                let thread = self.current_thread;
+                let state = self.threads.entry( thread ).or_default();
+                state.allocation = decode_delta( id_allocation, state.allocation );
+                state.timestamp = decode_delta( timestamp, state.timestamp );
+                state.pointer = decode_delta( pointer, state.pointer );
+
+                Event::FreeEx {
+                    id: AllocationId { thread: id_thread, allocation: state.allocation },
+                    timestamp: Timestamp::from_usecs( state.timestamp ),
+                    pointer: state.pointer,
+                    backtrace,
+                    thread
+                }
+            },
+            event => event
+        };
+
+        Some( event )
+    }
+}
+
+#[test]
+fn test_delta_roundtrip() {
+    for &(value, base) in &[ (0, 0), (10, 3), (3, 10), (u64::MAX, 0), (0, u64::MAX), (1 << 63, 1) ] {
+        assert_eq!( decode_delta( encode_delta( value, base ), base ), value );
+    }
+
+    assert_eq!( encode_delta( 11, 10 ), 2 );
+    assert_eq!( encode_delta( 9, 10 ), 1 );
+}
+
+#[test]
+fn test_compact_events_roundtrip() {
+    use speedy::Readable;
+
+    let allocation = |pointer, thread| AllocBody {
+        pointer,
+        size: 123,
+        backtrace: 7,
+        thread,
+        flags: 1 << 31,
+        extra_usable_space: 8,
+        preceding_free_space: 0
+    };
+
+    let id = |allocation| AllocationId { thread: 2, allocation };
+    let expected = vec![
+        Event::AllocEx { id: id( 1 ), timestamp: Timestamp::from_usecs( 100 ), allocation: allocation( 0x1000, 10 ) },
+        Event::AllocEx { id: id( 2 ), timestamp: Timestamp::from_usecs( 90 ), allocation: allocation( 0x2000, 11 ) },
+        Event::ReallocEx { id: id( 1 ), timestamp: Timestamp::from_usecs( 110 ), old_pointer: 0x1000, allocation: allocation( 0x800, 10 ) },
+        Event::ReallocEx { id: id( 1 ), timestamp: Timestamp::from_usecs( 115 ), old_pointer: 0x800, allocation: allocation( 0x800, 10 ) },
+        Event::FreeEx { id: id( 2 ), timestamp: Timestamp::from_usecs( 120 ), pointer: 0x2000, backtrace: 0, thread: 10 }
+    ];
+
+    let mut encoder = Encoder::new( true );
+    let mut buffer = Vec::new();
+    for (nth, event) in expected.iter().cloned().enumerate() {
+        if nth == 2 {
+            encoder.reset();
+        }
+
+        match event {
+            Event::AllocEx { id, timestamp, allocation } => encoder.write_alloc( &mut buffer, id, timestamp, allocation ).unwrap(),
+            Event::ReallocEx { id, timestamp, old_pointer, allocation } => encoder.write_realloc( &mut buffer, id, timestamp, old_pointer, allocation ).unwrap(),
+            Event::FreeEx { id, timestamp, pointer, backtrace, thread } => encoder.write_free( &mut buffer, id, timestamp, pointer, backtrace, thread ).unwrap(),
+            _ => unreachable!()
+        }
+    }
+
+    let mut decoder = Decoder::default();
+    let mut actual = Vec::new();
+    let mut resize_count = 0;
+    let mut reader = &buffer[..];
+    while !reader.is_empty() {
+        let event = Event::read_from_stream_unbuffered( &mut reader ).unwrap();
+        if let Event::ResizeCompact { .. } = event {
+            resize_count += 1;
+        }
+        actual.extend( decoder.decode( event ) );
+    }
+
+    assert_eq!( actual, expected );
+    assert_eq!( resize_count, 1 );
+}
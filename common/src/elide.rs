@@ -0,0 +1,99 @@
+//! Shrinking of the backtraces which are too deep to be worth keeping whole.
+
+/// The pseudo-address which stands in for the frames which were elided from a backtrace.
+pub const ELIDED_FRAMES_MARKER: u64 = !0;
+
+/// The name of the frame which the `ELIDED_FRAMES_MARKER` turns into when the backtraces are loaded.
+pub const ELIDED_FRAMES_NAME: &str = "[elided frames]";
+
+/// Checks whether the address is the `ELIDED_FRAMES_MARKER`, also as emitted by a 32-bit process.
+pub fn is_elided_frames_marker( address: u64 ) -> bool {
+    address == ELIDED_FRAMES_MARKER || address == u32::MAX as u64
+}
+
+/// The longest cycle of frames which will be recognized as a recursion.
+const MAXIMUM_CYCLE_LENGTH: usize = 8;
+
+/// Copies the `frames` into `output`, shrinking them to at most `max_depth` frames if there are more.
+///
+/// Every run of a repeating cycle of frames (as in a recursion) is first collapsed into a single
+/// repetition followed by the `marker`. If that's still not enough then only the outermost and
+/// the innermost frames are kept, with another `marker` in place of everything in the middle.
+///
+/// Returns whether any frames were elided.
+pub fn elide_frames< T: Copy + PartialEq >( frames: &[T], max_depth: usize, marker: T, output: &mut Vec< T > ) -> bool {
+    output.clear();
+    if frames.len() <= max_depth {
+        output.extend_from_slice( frames );
+        return false;
+    }
+
+    let mut index = 0;
+    while index < frames.len() {
+        let mut collapsed = false;
+        for length in 1..=MAXIMUM_CYCLE_LENGTH {
+            let cycle = match frames.get( index..index + length ) {
+                Some( cycle ) => cycle,
+                None => break
+            };
+
+            let mut repetitions = 1;
+            while frames.get( index + repetitions * length..index + (repetitions + 1) * length ) == Some( cycle ) {
+                repetitions += 1;
+            }
+
+            // The marker only pays for itself if it replaces more than a single frame.
+            if (repetitions - 1) * length > 1 {
+                output.extend_from_slice( cycle );
+                output.push( marker );
+                index += repetitions * length;
+                collapsed = true;
+                break;
+            }
+        }
+
+        if !collapsed {
+            output.push( frames[ index ] );
+            index += 1;
+        }
+    }
+
+    let max_depth = std::cmp::max( max_depth, 3 );
+    if output.len() > max_depth {
+        let kept = max_depth - 1;
+        let head = (kept + 1) / 2;
+        let tail = kept - head;
+        let tail_start = output.len() - tail;
+        output.splice( head..tail_start, std::iter::once( marker ) );
+    }
+
+    true
+}
+
+#[test]
+fn test_elide_frames() {
+    const M: u32 = 0;
+    let mut output = Vec::new();
+
+    assert!( !elide_frames( &[ 1, 2, 3 ], 3, M, &mut output ) );
+    assert_eq!( output, [ 1, 2, 3 ] );
+
+    // A simple recursion.
+    assert!( elide_frames( &[ 1, 2, 2, 2, 2, 3 ], 4, M, &mut output ) );
+    assert_eq!( output, [ 1, 2, M, 3 ] );
+
+    // A mutual recursion.
+    assert!( elide_frames( &[ 1, 2, 3, 2, 3, 2, 3, 4 ], 5, M, &mut output ) );
+    assert_eq!( output, [ 1, 2, 3, M, 4 ] );
+
+    // Too deep even after the recursion is collapsed; the middle is cut out.
+    assert!( elide_frames( &[ 1, 2, 3, 4, 5, 6, 7, 8 ], 5, M, &mut output ) );
+    assert_eq!( output, [ 1, 2, M, 7, 8 ] );
+
+    assert!( elide_frames( &[ 1, 2, 3, 4, 5, 5, 5, 5, 5, 5, 6, 7, 8, 9 ], 7, M, &mut output ) );
+    assert_eq!( output, [ 1, 2, 3, M, 7, 8, 9 ] );
+
+    // A recursion which is too short to be worth collapsing is left alone.
+    assert!( elide_frames( &[ 1, 2, 2, 3, 4 ], 4, M, &mut output ) );
+    assert_eq!( output, [ 1, 2, M, 4 ] );
+}
@@ -7,6 +7,8 @@ use speedy::{Readable, Writable, Context, Reader, Writer};
 use crate::timestamp::Timestamp;
 
 pub const HEADER_FLAG_IS_LITTLE_ENDIAN: u64 = 1;
+/// The data of the child processes was multiplexed into this one as `ChildData` events.
+pub const HEADER_FLAG_HAS_CHILD_PROCESSES: u64 = 2;
 
 #[derive(Clone, PartialEq, Debug, Readable, Writable)]
 pub struct HeaderBody {
@@ -30,6 +32,10 @@ impl DataId {
     pub fn new( a: u64, b: u64 ) -> Self {
         DataId( a, b )
     }
+
+    pub fn raw( &self ) -> (u64, u64) {
+        (self.0, self.1)
+    }
 }
 
 impl fmt::Display for DataId {
@@ -62,9 +68,29 @@ fn test_data_id_string_conversions() {
     assert_eq!( id_before, id_after );
 }
 
+// Set on allocations which were picked by the sampler; see `Event::SamplingInterval`.
+pub const ALLOC_FLAG_SAMPLED: u32 = 1 << 29;
 pub const ALLOC_FLAG_JEMALLOC: u32 = 1 << 30;
 pub const ALLOC_FLAG_CALLOC: u32 = 1 << 31;
 
+// The NUMA node of the CPU on which the allocating thread was running, plus one; zero if unknown.
+pub const ALLOC_FLAG_NUMA_NODE_SHIFT: u32 = 20;
+pub const ALLOC_FLAG_NUMA_NODE_MASK: u32 = 0xFF << ALLOC_FLAG_NUMA_NODE_SHIFT;
+
+/// Returns the NUMA node of the allocating thread which is stored in the allocation's flags.
+pub fn numa_node_from_alloc_flags( flags: u32 ) -> Option< u32 > {
+    ((flags & ALLOC_FLAG_NUMA_NODE_MASK) >> ALLOC_FLAG_NUMA_NODE_SHIFT).checked_sub( 1 )
+}
+
+/// Stores the NUMA node of the allocating thread, if it fits, in the allocation's flags.
+pub fn numa_node_into_alloc_flags( node: u32 ) -> u32 {
+    if node >= ALLOC_FLAG_NUMA_NODE_MASK >> ALLOC_FLAG_NUMA_NODE_SHIFT {
+        return 0;
+    }
+
+    (node + 1) << ALLOC_FLAG_NUMA_NODE_SHIFT
+}
+
 // These are the same as glibc's allocator flags.
 pub const ALLOC_FLAG_PREV_IN_USE: u32 = 1;
 pub const ALLOC_FLAG_MMAPED: u32 = 2;
@@ -123,6 +149,18 @@ bitflags::bitflags! {
     }
 }
 
+bitflags::bitflags! {
+    // The transparent huge page advice of a region, as seen in the `VmFlags` of smaps.
+    #[derive(Default, Readable, Writable)]
+    #[repr(transparent)]
+    pub struct HugePageFlags: u8 {
+        // The region was `madvise`d with `MADV_HUGEPAGE`.
+        const HUGEPAGE = 1 << 0;
+        // The region was `madvise`d with `MADV_NOHUGEPAGE`.
+        const NOHUGEPAGE = 1 << 1;
+    }
+}
+
 #[derive(Clone, PartialEq, Debug, Readable, Writable)]
 pub struct RegionSource {
     pub timestamp: Timestamp,
@@ -139,6 +177,329 @@ pub struct RegionTargetedSource {
     pub source: RegionSource,
 }
 
+// The live counters of a single backtrace; see `Event::BacktraceSummaries`.
+//
+// The memory which is currently in use is `allocated_size - freed_size`.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct BacktraceSummary {
+    #[speedy(varint)]
+    pub backtrace: u64,
+    #[speedy(varint)]
+    pub allocated_count: u64,
+    #[speedy(varint)]
+    pub allocated_size: u64,
+    #[speedy(varint)]
+    pub freed_count: u64,
+    #[speedy(varint)]
+    pub freed_size: u64,
+    #[speedy(varint)]
+    pub peak_usage: u64
+}
+
+// How much of the memory of the sampled live allocations of a single backtrace
+// is actually resident; see `Event::ResidencySamples`. All of the counts are in pages.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct ResidencySample {
+    #[speedy(varint)]
+    pub backtrace: u64,
+    #[speedy(varint)]
+    pub allocation_count: u64,
+    #[speedy(varint)]
+    pub allocated_size: u64,
+    #[speedy(varint)]
+    pub pages: u64,
+    #[speedy(varint)]
+    pub resident_pages: u64,
+    #[speedy(varint)]
+    pub swapped_pages: u64,
+    // The resident pages which weren't accessed since the previous pass.
+    #[speedy(varint)]
+    pub idle_pages: u64
+}
+
+// The NUMA node on which the first page of an allocation ended up; see `Event::NumaPlacements`.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct NumaPlacement {
+    pub id: AllocationId,
+    #[speedy(varint)]
+    pub pointer: u64,
+    #[speedy(varint)]
+    pub node: u32
+}
+
+// A single allocation carved out of a custom pool; see `Event::PoolAlloc`.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct PoolAllocation {
+    #[speedy(varint)]
+    pub pointer: u64,
+    #[speedy(varint)]
+    pub size: u64
+}
+
+// The pool's memory lives in an address space of its own (e.g. it's a GPU's memory),
+// so it doesn't overlap with nor count towards the memory of the process.
+pub const POOL_FLAG_DEVICE: u32 = 1;
+
+// How many buckets the lifetime histograms of the culled allocations have.
+pub const CULLED_LIFETIME_BUCKET_COUNT: usize = 32;
+
+// Returns the bucket of the lifetime histogram of the culled allocations into which
+// an allocation which lived for the given number of microseconds goes.
+//
+// The first bucket is for the allocations which lived for less than a microsecond,
+// and every other bucket `n` for those which lived for `[2^(n - 1), 2^n)` microseconds.
+pub fn culled_lifetime_bucket( lifetime_us: u64 ) -> usize {
+    std::cmp::min( (64 - lifetime_us.leading_zeros()) as usize, CULLED_LIFETIME_BUCKET_COUNT - 1 )
+}
+
+#[test]
+fn test_culled_lifetime_bucket() {
+    assert_eq!( culled_lifetime_bucket( 0 ), 0 );
+    assert_eq!( culled_lifetime_bucket( 1 ), 1 );
+    assert_eq!( culled_lifetime_bucket( 2 ), 2 );
+    assert_eq!( culled_lifetime_bucket( 3 ), 2 );
+    assert_eq!( culled_lifetime_bucket( 1024 ), 11 );
+    assert_eq!( culled_lifetime_bucket( u64::MAX ), CULLED_LIFETIME_BUCKET_COUNT - 1 );
+}
+
+// The temporary allocations from a single backtrace which were culled by the profiler
+// during a single interval; see `Event::CulledAllocations`.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct CulledAllocationStatistics {
+    #[speedy(varint)]
+    pub backtrace: u64,
+    pub first_allocation: Timestamp,
+    pub last_allocation: Timestamp,
+    #[speedy(varint)]
+    pub count: u64,
+    #[speedy(varint)]
+    pub size: u64,
+    #[speedy(varint)]
+    pub min_size: u64,
+    #[speedy(varint)]
+    pub max_size: u64,
+    // How many of the allocations fell into every bucket of `culled_lifetime_bucket`;
+    // the trailing empty buckets are left out.
+    #[speedy(length_type = u64_varint)]
+    pub lifetimes: Vec< u64 >
+}
+
+pub const ALLOCATOR_LATENCY_BUCKET_COUNT: usize = 32;
+
+// Returns the bucket of the allocator latency histogram into which a call which took
+// the given number of nanoseconds goes.
+//
+// The first bucket is for the calls which took less than a nanosecond,
+// and every other bucket `n` for those which took `[2^(n - 1), 2^n)` nanoseconds.
+pub fn allocator_latency_bucket( latency_ns: u64 ) -> usize {
+    std::cmp::min( (64 - latency_ns.leading_zeros()) as usize, ALLOCATOR_LATENCY_BUCKET_COUNT - 1 )
+}
+
+#[test]
+fn test_allocator_latency_bucket() {
+    assert_eq!( allocator_latency_bucket( 0 ), 0 );
+    assert_eq!( allocator_latency_bucket( 1 ), 1 );
+    assert_eq!( allocator_latency_bucket( 100 ), 7 );
+    assert_eq!( allocator_latency_bucket( 128 ), 8 );
+    assert_eq!( allocator_latency_bucket( u64::MAX ), ALLOCATOR_LATENCY_BUCKET_COUNT - 1 );
+}
+
+// Which of the allocator's functions was called; see `AllocatorLatencyStatistics`.
+#[derive(Copy, Clone, PartialEq, Eq, Debug, Hash, Readable, Writable)]
+pub enum AllocatorCall {
+    Allocate,
+    Reallocate,
+    Deallocate
+}
+
+impl AllocatorCall {
+    pub const ALL: &'static [AllocatorCall] = &[
+        AllocatorCall::Allocate,
+        AllocatorCall::Reallocate,
+        AllocatorCall::Deallocate
+    ];
+}
+
+// How long the underlying allocator took to service the calls from a single backtrace
+// during a single interval; see `Event::AllocatorLatencies`.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct AllocatorLatencyStatistics {
+    #[speedy(varint)]
+    pub backtrace: u64,
+    pub call: AllocatorCall,
+    #[speedy(varint)]
+    pub count: u64,
+    // The sum and the maximum of the latencies, in nanoseconds.
+    #[speedy(varint)]
+    pub total: u64,
+    #[speedy(varint)]
+    pub max: u64,
+    // How many of the calls fell into every bucket of `allocator_latency_bucket`;
+    // the trailing empty buckets are left out.
+    #[speedy(length_type = u64_varint)]
+    pub buckets: Vec< u64 >
+}
+
+// A single sampled page fault; see `Event::PageFaults`.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct PageFault {
+    pub timestamp: Timestamp,
+    pub thread: u32,
+    #[speedy(varint)]
+    pub address: u64
+}
+
+// A setting of the profiler which can be changed while it's running; see `Event::OptionChanged`.
+//
+// The flags are either `0` or `1`, the sampling interval is in bytes, and everything else is in milliseconds.
+#[derive(Copy, Clone, PartialEq, Eq, Debug, Hash, Readable, Writable)]
+pub enum RuntimeOption {
+    SamplingInterval,
+    GatherMaps,
+    GrabBacktracesOnFree,
+    TemporaryAllocationLifetimeThreshold,
+    SmapsMinimumInterval,
+    SmapsMaximumInterval
+}
+
+impl RuntimeOption {
+    pub const ALL: &'static [RuntimeOption] = &[
+        RuntimeOption::SamplingInterval,
+        RuntimeOption::GatherMaps,
+        RuntimeOption::GrabBacktracesOnFree,
+        RuntimeOption::TemporaryAllocationLifetimeThreshold,
+        RuntimeOption::SmapsMinimumInterval,
+        RuntimeOption::SmapsMaximumInterval
+    ];
+
+    // The name of the environment variable which initially sets it, without the `MEMORY_PROFILER_` prefix.
+    pub fn name( self ) -> &'static str {
+        match self {
+            RuntimeOption::SamplingInterval => "SAMPLING_INTERVAL",
+            RuntimeOption::GatherMaps => "GATHER_MAPS",
+            RuntimeOption::GrabBacktracesOnFree => "GRAB_BACKTRACES_ON_FREE",
+            RuntimeOption::TemporaryAllocationLifetimeThreshold => "TEMPORARY_ALLOCATION_LIFETIME_THRESHOLD",
+            RuntimeOption::SmapsMinimumInterval => "SMAPS_MINIMUM_INTERVAL",
+            RuntimeOption::SmapsMaximumInterval => "SMAPS_MAXIMUM_INTERVAL"
+        }
+    }
+
+    // Accepts the name in any case, with or without the prefix.
+    pub fn from_name( name: &str ) -> Option< Self > {
+        let name = name.to_ascii_uppercase();
+        let name = name.strip_prefix( "MEMORY_PROFILER_" ).unwrap_or( &name );
+        RuntimeOption::ALL.iter().copied().find( |option| option.name() == name )
+    }
+
+    pub fn is_flag( self ) -> bool {
+        match self {
+            RuntimeOption::GatherMaps | RuntimeOption::GrabBacktracesOnFree => true,
+            _ => false
+        }
+    }
+}
+
+#[test]
+fn test_runtime_option_from_name() {
+    assert_eq!( RuntimeOption::from_name( "sampling_interval" ), Some( RuntimeOption::SamplingInterval ) );
+    assert_eq!( RuntimeOption::from_name( "MEMORY_PROFILER_GATHER_MAPS" ), Some( RuntimeOption::GatherMaps ) );
+    assert_eq!( RuntimeOption::from_name( "output" ), None );
+    for &option in RuntimeOption::ALL {
+        assert_eq!( RuntimeOption::from_name( option.name() ), Some( option ) );
+    }
+}
+
+// The counters of a single jemalloc arena; see `Event::JemallocStats`.
+//
+// The `pactive`, `pdirty` and `pmuzzy` are in pages; everything else is in bytes.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct JemallocArenaStats {
+    pub index: u32,
+    pub threads: u32,
+    #[speedy(varint)]
+    pub pactive: u64,
+    #[speedy(varint)]
+    pub pdirty: u64,
+    #[speedy(varint)]
+    pub pmuzzy: u64,
+    #[speedy(varint)]
+    pub mapped: u64,
+    #[speedy(varint)]
+    pub retained: u64,
+    #[speedy(varint)]
+    pub resident: u64,
+    #[speedy(varint)]
+    pub tcache_bytes: u64,
+    #[speedy(varint)]
+    pub small_allocated: u64,
+    #[speedy(varint)]
+    pub large_allocated: u64
+}
+
+// The counters of a single jemalloc size class, merged over all of the arenas; see `Event::JemallocStats`.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct JemallocBinStats {
+    #[speedy(varint)]
+    pub size: u64,
+    #[speedy(varint)]
+    pub regions_per_slab: u64,
+    #[speedy(varint)]
+    pub current_regions: u64,
+    #[speedy(varint)]
+    pub current_slabs: u64,
+    #[speedy(varint)]
+    pub nonfull_slabs: u64
+}
+
+// An allocation which was alive when a `Event::Checkpoint` was written.
+//
+// The `timestamp` is when the allocation was made, or when it was last reallocated.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct CheckpointAllocation {
+    pub id: AllocationId,
+    pub timestamp: Timestamp,
+    pub allocation: AllocBody
+}
+
+// A region of a map which was alive when a `Event::Checkpoint` was written.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct CheckpointRegion {
+    #[speedy(varint)]
+    pub map_id: u64,
+    pub address: u64,
+    #[speedy(varint)]
+    pub length: u64
+}
+
+// A histogram of one of the profiler's own measurements; see `Event::ProfilerStatistics`.
+//
+// The `buckets[ 0 ]` counts the zeros, and every other `buckets[ n ]` counts the values in `2^(n - 1)..2^n`.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct ProfilerHistogram {
+    pub name: String,
+    #[speedy(varint)]
+    pub count: u64,
+    #[speedy(varint)]
+    pub sum: u64,
+    #[speedy(length_type = u64_varint)]
+    pub buckets: Vec< u64 >
+}
+
+// The cumulative counters of one level of the profiler's backtrace caches; see `Event::BacktraceCacheStatistics`.
+#[derive(Clone, PartialEq, Debug, Readable, Writable)]
+pub struct BacktraceCacheLevelStatistics {
+    #[speedy(varint)]
+    pub hits: u64,
+    #[speedy(varint)]
+    pub misses: u64,
+    // The keys are 128-bit, so these should never happen; only debug builds of the profiler check for them.
+    #[speedy(varint)]
+    pub conflicts: u64,
+    // How many backtraces the cache can hold at the time; for the 1st level this is per thread.
+    #[speedy(varint)]
+    pub capacity: u64
+}
+
 #[derive(Clone, PartialEq, Debug, Readable, Writable)]
 pub enum Event< 'a > {
     Header( HeaderBody ),
@@ -166,6 +527,7 @@ pub enum Event< 'a > {
         id: u64,
         addresses: Cow< 'a, [u64] >
     },
+    // The memory which isn't covered by any of these was either never touched or was all zeros.
     MemoryDump {
         address: u64,
         length: u64,
@@ -342,6 +704,409 @@ pub enum Event< 'a > {
         #[speedy(varint)]
         offset: u64,
         source: RegionSource
+    },
+    // On average one allocation was sampled every `interval` bytes.
+    SamplingInterval {
+        #[speedy(varint)]
+        interval: u64
+    },
+    // The ID of the data written by the profiled process which spawned this one.
+    ParentData {
+        id: DataId
+    },
+    // A binary which wasn't embedded in the data, but was instead written
+    // out-of-band to a store which is indexed by its build ID.
+    BinaryReference {
+        timestamp: Timestamp,
+        path: Cow< 'a, str >,
+        build_id: Cow< 'a, [u8] >,
+        location: Cow< 'a, str >
+    },
+    // Sets the thread of the compact events which follow it; if `reset` is set
+    // then the deltas of every thread start again from zero.
+    ThreadContext {
+        thread: u32,
+        reset: bool
+    },
+    // The compact versions of `AllocEx`, `ReallocEx` and `FreeEx`.
+    //
+    // The `id_allocation`, `timestamp` and `pointer` are zigzag-encoded deltas against
+    // the previous compact event of the same thread, and the `old_pointer` is a delta
+    // against the `pointer`. See `compact_event` for more details.
+    AllocCompact {
+        id_thread: u32,
+        #[speedy(varint)]
+        id_allocation: u64,
+        #[speedy(varint)]
+        timestamp: u64,
+        #[speedy(varint)]
+        pointer: u64,
+        #[speedy(varint)]
+        size: u64,
+        #[speedy(varint)]
+        backtrace: u64,
+        #[speedy(varint)]
+        flags: u64,
+        #[speedy(varint)]
+        extra_usable_space: u64
+    },
+    ReallocCompact {
+        id_thread: u32,
+        #[speedy(varint)]
+        id_allocation: u64,
+        #[speedy(varint)]
+        timestamp: u64,
+        #[speedy(varint)]
+        pointer: u64,
+        #[speedy(varint)]
+        old_pointer: u64,
+        #[speedy(varint)]
+        size: u64,
+        #[speedy(varint)]
+        backtrace: u64,
+        #[speedy(varint)]
+        flags: u64,
+        #[speedy(varint)]
+        extra_usable_space: u64
+    },
+    FreeCompact {
+        id_thread: u32,
+        #[speedy(varint)]
+        id_allocation: u64,
+        #[speedy(varint)]
+        timestamp: u64,
+        #[speedy(varint)]
+        pointer: u64,
+        #[speedy(varint)]
+        backtrace: u64
+    },
+    // A periodic snapshot of the per-backtrace counters, written instead of the allocation
+    // events when the profiler runs in the summary mode.
+    //
+    // Only the backtraces whose counters have changed since the previous snapshot are included,
+    // and the counters are always the totals since the profiling started.
+    BacktraceSummaries {
+        timestamp: Timestamp,
+        #[speedy(length_type = u64_varint)]
+        entries: Cow< 'a, [BacktraceSummary] >
+    },
+    // Periodically written with how much time the profiler itself spends on what.
+    //
+    // The histograms are cumulative, so only the last one of these matters. The durations are in nanoseconds.
+    ProfilerStatistics {
+        timestamp: Timestamp,
+        #[speedy(varint)]
+        bytes_written: u64,
+        #[speedy(length_type = u64_varint)]
+        histograms: Cow< 'a, [ProfilerHistogram] >
+    },
+    // Periodically written with everything which is alive at the time, as seen by the processing thread,
+    // so that whatever's alive at a given point can be found without replaying everything since the start.
+    //
+    // The backtraces of the allocations were all written out before this event.
+    Checkpoint {
+        timestamp: Timestamp,
+        #[speedy(length_type = u64_varint)]
+        allocations: Cow< 'a, [CheckpointAllocation] >,
+        #[speedy(length_type = u64_varint)]
+        regions: Cow< 'a, [CheckpointRegion] >
+    },
+    // The same as `UpdateRegionUsage`, but also with the usage of the transparent huge pages.
+    UpdateRegionUsageEx {
+        timestamp: Timestamp,
+        #[speedy(varint)]
+        map_id: u64,
+        address: u64,
+        #[speedy(varint)]
+        length: u64,
+
+        // NOTE: All of these are in kilobytes (base 1024).
+        #[speedy(varint)]
+        anonymous: u64,
+        #[speedy(varint)]
+        shared_clean: u64,
+        #[speedy(varint)]
+        shared_dirty: u64,
+        #[speedy(varint)]
+        private_clean: u64,
+        #[speedy(varint)]
+        private_dirty: u64,
+        #[speedy(varint)]
+        swap: u64,
+        #[speedy(varint)]
+        anon_huge_pages: u64,
+        #[speedy(varint)]
+        shmem_pmd_mapped: u64,
+        #[speedy(varint)]
+        file_pmd_mapped: u64,
+
+        huge_page_flags: HugePageFlags
+    },
+    // A call to `madvise` which either changed the transparent huge page advice
+    // of a range of memory or which gave it back to the kernel.
+    MemoryAdvice {
+        timestamp: Timestamp,
+        address: u64,
+        #[speedy(varint)]
+        length: u64,
+        advice: i32,
+        #[speedy(varint)]
+        backtrace: u64,
+        thread: u32
+    },
+    // A periodic pass over the pages of a sample of the live allocations.
+    //
+    // Every pass is complete by itself. The pages which are neither resident nor swapped out
+    // were never touched. The idle pages are only counted when `idle_tracking` is set,
+    // which requires access to `/sys/kernel/mm/page_idle/bitmap`.
+    ResidencySamples {
+        timestamp: Timestamp,
+        idle_tracking: bool,
+        #[speedy(length_type = u64_varint)]
+        entries: Cow< 'a, [ResidencySample] >
+    },
+    // A periodic snapshot of the statistics of the profiler's jemalloc, written when
+    // the profiled program is using jemalloc. Every snapshot is complete by itself.
+    JemallocStats {
+        timestamp: Timestamp,
+        #[speedy(varint)]
+        page_size: u64,
+        #[speedy(varint)]
+        allocated: u64,
+        #[speedy(varint)]
+        active: u64,
+        #[speedy(varint)]
+        metadata: u64,
+        #[speedy(varint)]
+        resident: u64,
+        #[speedy(varint)]
+        mapped: u64,
+        #[speedy(varint)]
+        retained: u64,
+        #[speedy(length_type = u64_varint)]
+        arenas: Cow< 'a, [JemallocArenaStats] >,
+        #[speedy(length_type = u64_varint)]
+        bins: Cow< 'a, [JemallocBinStats] >
+    },
+    // The NUMA nodes of the first pages of the allocations which were first seen
+    // to be resident since the previous pass; every allocation is reported at most once.
+    NumaPlacements {
+        timestamp: Timestamp,
+        #[speedy(length_type = u64_varint)]
+        entries: Cow< 'a, [NumaPlacement] >
+    },
+    // The temporary allocations which were culled by the profiler since the previous one of these,
+    // aggregated per backtrace; these are written instead of the allocations themselves.
+    CulledAllocations {
+        timestamp: Timestamp,
+        #[speedy(length_type = u64_varint)]
+        entries: Cow< 'a, [CulledAllocationStatistics] >
+    },
+    // A setting of the profiler which was changed while it was running; for the sampling interval
+    // this is also followed by an `Event::SamplingInterval`.
+    OptionChanged {
+        timestamp: Timestamp,
+        option: RuntimeOption,
+        #[speedy(varint)]
+        value: u64
+    },
+    // The tag which a thread has set through `memory_profiler_set_thread_tag`; it applies to every
+    // allocation made on that thread from this point onwards, until the next one of these for it.
+    ThreadTag {
+        timestamp: Timestamp,
+        thread: u32,
+        tag: u32
+    },
+    // A custom pool or arena allocator which was registered through `memory_profiler_pool_create`,
+    // or an external allocator registered through `memory_profiler_external_allocator_create`.
+    PoolCreated {
+        timestamp: Timestamp,
+        pool: u16,
+        name: Cow< 'a, str >,
+        // A combination of the `POOL_FLAG_*` flags.
+        flags: u32
+    },
+    // Allocations carved out of a pool's own memory, which was itself most likely allocated
+    // through the regular allocator; these are matched by their pointer and their pool.
+    PoolAlloc {
+        timestamp: Timestamp,
+        pool: u16,
+        thread: u32,
+        #[speedy(varint)]
+        backtrace: u64,
+        flags: u32,
+        #[speedy(length_type = u64_varint)]
+        allocations: Cow< 'a, [PoolAllocation] >
+    },
+    PoolFree {
+        timestamp: Timestamp,
+        pool: u16,
+        thread: u32,
+        #[speedy(length_type = u64_varint)]
+        pointers: Cow< 'a, [u64] >
+    },
+    // Every allocation from the pool which is still alive is freed at once.
+    PoolReset {
+        timestamp: Timestamp,
+        pool: u16,
+        thread: u32
+    },
+    // A periodic sample of the memory usage of the cgroup (v2) which the process is in; all of the sizes are in bytes.
+    CgroupMemory {
+        timestamp: Timestamp,
+        #[speedy(varint)]
+        current: u64,
+        // The `memory.max`; `u64::MAX` if there's no limit.
+        #[speedy(varint)]
+        limit: u64,
+        #[speedy(varint)]
+        anon: u64,
+        #[speedy(varint)]
+        file: u64,
+        #[speedy(varint)]
+        kernel: u64,
+        #[speedy(varint)]
+        sock: u64,
+        // The total time, in microseconds, during which some (or all) of the cgroup's tasks were stalled on memory.
+        #[speedy(varint)]
+        pressure_some: u64,
+        #[speedy(varint)]
+        pressure_full: u64
+    },
+    // Written along with the `ProfilerStatistics`; the 1st level caches are per thread, so their counters are summed.
+    BacktraceCacheStatistics {
+        timestamp: Timestamp,
+        #[speedy(length_type = u64_varint)]
+        levels: Cow< 'a, [BacktraceCacheLevelStatistics] >
+    },
+    // A binary which wasn't embedded in the data at all; only what's needed to find it again was recorded.
+    //
+    // The `build_id` and the `debuglink` are empty if the binary doesn't have them,
+    // and the `mtime` is in seconds since the Unix epoch.
+    BinaryIdentity {
+        timestamp: Timestamp,
+        path: Cow< 'a, str >,
+        build_id: Cow< 'a, [u8] >,
+        debuglink: Cow< 'a, [u8] >,
+        #[speedy(varint)]
+        size: u64,
+        #[speedy(varint)]
+        mtime: u64
+    },
+    // Written right after the process was forked to be dumped, before any of the `MemoryDump`s;
+    // the dump is of the memory as it was at this point.
+    MemoryDumpStarted {
+        timestamp: Timestamp
+    },
+    // The `timestamp` is of when the thread was first seen by the profiler, which might be some time
+    // after it was actually created if it didn't allocate anything; the `name` is the one it had
+    // when the processing thread got to it.
+    ThreadStarted {
+        timestamp: Timestamp,
+        thread: u32,
+        name: Cow< 'a, str >
+    },
+    // Written when a thread has changed its name soon after it was started, which is what most
+    // of the programs which name their threads do.
+    ThreadRenamed {
+        timestamp: Timestamp,
+        thread: u32,
+        name: Cow< 'a, str >
+    },
+    ThreadExited {
+        timestamp: Timestamp,
+        thread: u32
+    },
+    // A chunk of the raw output of a child process which streams its data through its parent;
+    // when all of the chunks with the same `pid` are concatenated they're a whole data file of their own.
+    ChildData {
+        timestamp: Timestamp,
+        pid: u32,
+        data: Cow< 'a, [u8] >
+    },
+    // How long the allocator took to service the sampled calls since the previous one of these,
+    // aggregated per backtrace; only emitted with `MEMORY_PROFILER_ALLOCATOR_LATENCY_INTERVAL`.
+    AllocatorLatencies {
+        timestamp: Timestamp,
+        #[speedy(length_type = u64_varint)]
+        entries: Cow< 'a, [AllocatorLatencyStatistics] >
+    },
+    // The page faults sampled since the previous one of these; every one of them stands for
+    // `period` faults. Only emitted with `MEMORY_PROFILER_PAGE_FAULT_SAMPLING_PERIOD`.
+    PageFaults {
+        timestamp: Timestamp,
+        #[speedy(varint)]
+        period: u64,
+        #[speedy(length_type = u64_varint)]
+        entries: Cow< 'a, [PageFault] >
+    },
+    // A compact `ReallocEx` for when the allocation was resized in place and its flags
+    // are the same as those of the previous compact event of the same thread.
+    ResizeCompact {
+        id_thread: u32,
+        #[speedy(varint)]
+        id_allocation: u64,
+        #[speedy(varint)]
+        timestamp: u64,
+        #[speedy(varint)]
+        pointer: u64,
+        #[speedy(varint)]
+        size: u64,
+        #[speedy(varint)]
+        backtrace: u64,
+        #[speedy(varint)]
+        extra_usable_space: u64
+    }
+}
+
+impl< 'a > Event< 'a > {
+    /// Returns the timestamp of the event, if it has one.
+    pub fn timestamp( &self ) -> Option< Timestamp > {
+        match *self {
+            Event::Alloc { timestamp, .. } |
+            Event::Realloc { timestamp, .. } |
+            Event::Free { timestamp, .. } |
+            Event::File { timestamp, .. } |
+            Event::MemoryMap { timestamp, .. } |
+            Event::MemoryUnmap { timestamp, .. } |
+            Event::Mallopt { timestamp, .. } |
+            Event::WallClock { timestamp, .. } |
+            Event::AllocEx { timestamp, .. } |
+            Event::ReallocEx { timestamp, .. } |
+            Event::FreeEx { timestamp, .. } |
+            Event::File64 { timestamp, .. } |
+            Event::AddRegion { timestamp, .. } |
+            Event::RemoveRegion { timestamp, .. } |
+            Event::UpdateRegionUsage { timestamp, .. } |
+            Event::UpdateRegionUsageEx { timestamp, .. } |
+            Event::MemoryAdvice { timestamp, .. } |
+            Event::ResidencySamples { timestamp, .. } |
+            Event::JemallocStats { timestamp, .. } |
+            Event::NumaPlacements { timestamp, .. } |
+            Event::CulledAllocations { timestamp, .. } |
+            Event::OptionChanged { timestamp, .. } |
+            Event::ThreadTag { timestamp, .. } |
+            Event::PoolCreated { timestamp, .. } |
+            Event::PoolAlloc { timestamp, .. } |
+            Event::PoolFree { timestamp, .. } |
+            Event::PoolReset { timestamp, .. } |
+            Event::CgroupMemory { timestamp, .. } |
+            Event::BinaryReference { timestamp, .. } |
+            Event::BinaryIdentity { timestamp, .. } |
+            Event::MemoryDumpStarted { timestamp, .. } |
+            Event::ThreadStarted { timestamp, .. } |
+            Event::ThreadRenamed { timestamp, .. } |
+            Event::ThreadExited { timestamp, .. } |
+            Event::ChildData { timestamp, .. } |
+            Event::AllocatorLatencies { timestamp, .. } |
+            Event::PageFaults { timestamp, .. } |
+            Event::BacktraceSummaries { timestamp, .. } |
+            Event::ProfilerStatistics { timestamp, .. } |
+            Event::BacktraceCacheStatistics { timestamp, .. } |
+            Event::Checkpoint { timestamp, .. } => Some( timestamp ),
+            Event::Header( ref header ) => Some( header.timestamp ),
+            _ => None
+        }
     }
 }
 
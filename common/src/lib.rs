@@ -3,9 +3,13 @@ pub extern crate speedy;
 mod os_util;
 mod timestamp;
 
+pub mod chunk_index;
+pub mod compact_event;
+pub mod elide;
 pub mod event;
 pub mod lz4_stream;
 pub mod request;
+pub mod shm_ring;
 
 pub use crate::os_util::get_local_ips;
 pub use crate::timestamp::Timestamp;
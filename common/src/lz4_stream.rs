@@ -3,13 +3,90 @@ use std::io::{self, Write};
 use lz4_compress;
 use byteorder::{ReadBytesExt, WriteBytesExt, LittleEndian, ByteOrder};
 
-const CHUNK_SIZE: usize = 512 * 1024;
+pub const CHUNK_SIZE: usize = 512 * 1024;
+
+/// The kind of the chunk which holds the optional index of all of the other chunks.
+///
+/// It's always the last one, so the readers treat it as the end of the stream.
+pub const CHUNK_KIND_INDEX: u8 = 3;
+
+/// The kind of the chunk which is compressed with zstd, using the most recent dictionary, if any.
+pub const CHUNK_KIND_ZSTD: u8 = 4;
+
+/// The kind of the chunk which holds a zstd dictionary for all of the zstd chunks which follow it.
+pub const CHUNK_KIND_ZSTD_DICTIONARY: u8 = 5;
+
+/// Decompresses the zstd chunks.
+#[cfg(feature = "zstd")]
+pub struct ZstdDecoder {
+    decompressor: zstd::bulk::Decompressor< 'static >
+}
+
+#[cfg(feature = "zstd")]
+impl ZstdDecoder {
+    pub fn new( dictionary: Option< &[u8] > ) -> io::Result< Self > {
+        let decompressor = match dictionary {
+            Some( dictionary ) => zstd::bulk::Decompressor::with_dictionary( dictionary )?,
+            None => zstd::bulk::Decompressor::new()?
+        };
+
+        Ok( ZstdDecoder { decompressor } )
+    }
+
+    pub fn decompress_into( &mut self, input: &[u8], output: &mut Vec< u8 > ) -> io::Result< () > {
+        // The chunks are never bigger than this when uncompressed.
+        output.reserve( CHUNK_SIZE );
+        self.decompressor.decompress_to_buffer( input, output )?;
+        Ok(())
+    }
+}
+
+/// Compresses the data into zstd chunks.
+#[cfg(feature = "zstd")]
+pub struct ZstdEncoder {
+    compressor: zstd::bulk::Compressor< 'static >,
+    dictionary: Option< Vec< u8 > >
+}
+
+#[cfg(feature = "zstd")]
+impl ZstdEncoder {
+    pub fn new( level: i32, dictionary: Option< Vec< u8 > > ) -> io::Result< Self > {
+        let compressor = match dictionary {
+            Some( ref dictionary ) => zstd::bulk::Compressor::with_dictionary( level, dictionary )?,
+            None => zstd::bulk::Compressor::new( level )?
+        };
+
+        Ok( ZstdEncoder { compressor, dictionary } )
+    }
+
+    /// Trains a dictionary on the given samples.
+    pub fn train_dictionary( samples: &[u8], sample_sizes: &[usize], max_size: usize ) -> io::Result< Vec< u8 > > {
+        zstd::dict::from_continuous( samples, sample_sizes, max_size )
+    }
+
+    /// Compresses the `input` into the `output`, overwriting whatever was in it.
+    pub fn compress_into( &mut self, input: &[u8], output: &mut Vec< u8 > ) -> io::Result< () > {
+        output.reserve( zstd::zstd_safe::compress_bound( input.len() ) );
+        self.compressor.compress_to_buffer( input, output )?;
+        Ok(())
+    }
+}
+
+#[cfg(not(feature = "zstd"))]
+pub enum ZstdEncoder {}
+
+#[cfg(not(feature = "zstd"))]
+fn zstd_not_supported() -> io::Error {
+    io::Error::new( io::ErrorKind::InvalidData, "the data contains zstd chunks, but zstd support wasn't compiled in" )
+}
 
 pub struct Lz4Reader< F: io::Read > {
     fp: Option< F >,
     buffer: Vec< u8 >,
     compressed_buffer: Vec< u8 >,
-    position: usize
+    position: usize,
+    #[cfg(feature = "zstd")]
+    zstd: Option< ZstdDecoder >
 }
 
 // This doesn't matter in release mode but measurably helps in debug mode.
@@ -26,7 +103,9 @@ impl< F: io::Read > Lz4Reader< F > {
             fp: Some( fp ),
             buffer: Vec::new(),
             compressed_buffer: Vec::new(),
-            position: 0
+            position: 0,
+            #[cfg(feature = "zstd")]
+            zstd: None
         }
     }
 
@@ -39,7 +118,11 @@ impl< F: io::Read > Lz4Reader< F > {
     }
 
     fn fill_cache( &mut self ) -> io::Result< () > {
-        let fp = self.fp.as_mut().unwrap();
+        let fp = match self.fp.as_mut() {
+            Some( fp ) => fp,
+            None => return Ok(())
+        };
+
         let kind = fp.read_u8()?;
         match kind {
             1 => {
@@ -57,6 +140,34 @@ impl< F: io::Read > Lz4Reader< F > {
                 let _length = fp.read_u32::< LittleEndian >()?;
                 unimplemented!();
             },
+            CHUNK_KIND_INDEX => {
+                self.fp = None;
+            },
+            #[cfg(feature = "zstd")]
+            CHUNK_KIND_ZSTD => {
+                let length = fp.read_u32::< LittleEndian >()? as usize;
+                self.compressed_buffer.resize( length, 0 );
+                fp.read_exact( &mut self.compressed_buffer[ .. ] )?;
+
+                if self.zstd.is_none() {
+                    self.zstd = Some( ZstdDecoder::new( None )? );
+                }
+
+                self.zstd.as_mut().unwrap().decompress_into( &self.compressed_buffer, &mut self.buffer )?;
+                clear( &mut self.compressed_buffer );
+            },
+            #[cfg(feature = "zstd")]
+            CHUNK_KIND_ZSTD_DICTIONARY => {
+                let length = fp.read_u32::< LittleEndian >()? as usize;
+                self.compressed_buffer.resize( length, 0 );
+                fp.read_exact( &mut self.compressed_buffer[ .. ] )?;
+                self.zstd = Some( ZstdDecoder::new( Some( &self.compressed_buffer ) )? );
+                clear( &mut self.compressed_buffer );
+            },
+            #[cfg(not(feature = "zstd"))]
+            CHUNK_KIND_ZSTD | CHUNK_KIND_ZSTD_DICTIONARY => {
+                return Err( zstd_not_supported() );
+            },
             _ => {
                 return Err( io::Error::new( io::ErrorKind::InvalidData, format!( "unexpected kind" ) ) );
             }
@@ -74,7 +185,11 @@ impl< F: io::Read > io::Read for Lz4Reader< F > {
 
         self.position = 0;
         clear( &mut self.buffer );
-        self.fill_cache()?;
+
+        // Some chunks (like the dictionaries) don't contain any data.
+        while self.buffer.is_empty() && self.fp.is_some() {
+            self.fill_cache()?;
+        }
 
         Ok( self.read_cached( buf ) )
     }
@@ -84,7 +199,9 @@ pub struct Lz4Writer< F: io::Write > {
     fp: Option< F >,
     buffer: Vec< u8 >,
     compression_buffer: Vec< u8 >,
-    is_compressed: bool
+    is_compressed: bool,
+    compression_level: u32,
+    zstd: Option< ZstdEncoder >
 }
 
 impl< F: io::Write > Lz4Writer< F > {
@@ -93,7 +210,9 @@ impl< F: io::Write > Lz4Writer< F > {
             fp: Some( fp ),
             buffer: Vec::new(),
             compression_buffer: Vec::new(),
-            is_compressed: true
+            is_compressed: true,
+            compression_level: 0,
+            zstd: None
         }
     }
 
@@ -103,6 +222,33 @@ impl< F: io::Write > Lz4Writer< F > {
         Ok(())
     }
 
+    /// Sets the LZ4 compression level of every chunk written from now on.
+    ///
+    /// The default level of zero is the fast mode; anything above that uses the much slower
+    /// high-compression mode, up to `lz4_compress::MAX_LEVEL`.
+    pub fn set_compression_level( &mut self, level: u32 ) -> io::Result< () > {
+        self.flush()?;
+        self.compression_level = level;
+        Ok(())
+    }
+
+    /// Makes every chunk written from now on be compressed with zstd instead of LZ4.
+    ///
+    /// If the encoder has a dictionary then it's written out immediately.
+    #[cfg(feature = "zstd")]
+    pub fn enable_zstd( &mut self, encoder: ZstdEncoder ) -> io::Result< () > {
+        self.flush()?;
+        if let Some( ref dictionary ) = encoder.dictionary {
+            let fp = self.fp.as_mut().unwrap();
+            fp.write_u8( CHUNK_KIND_ZSTD_DICTIONARY )?;
+            fp.write_u32::< LittleEndian >( dictionary.len() as u32 )?;
+            fp.write_all( dictionary )?;
+        }
+
+        self.zstd = Some( encoder );
+        Ok(())
+    }
+
     pub fn replace_inner( &mut self, fp: F ) -> io::Result< () > {
         self.flush()?;
         self.fp = Some( fp );
@@ -136,7 +282,7 @@ impl< F: io::Write > Lz4Writer< F > {
     }
 }
 
-fn write_compressed< T >( mut fp: T, compression_buffer: &mut Vec< u8 >, data: &[u8] ) -> io::Result< usize > where T: io::Write {
+fn write_compressed< T >( mut fp: T, compression_buffer: &mut Vec< u8 >, level: u32, data: &[u8] ) -> io::Result< usize > where T: io::Write {
     clear( compression_buffer );
     compression_buffer.reserve( CHUNK_SIZE );
     for chunk in data.chunks( CHUNK_SIZE ) {
@@ -145,7 +291,11 @@ fn write_compressed< T >( mut fp: T, compression_buffer: &mut Vec< u8 >, data: &
         }
 
         compression_buffer[ 0 ] = 1;
-        lz4_compress::compress_into( chunk, compression_buffer );
+        if level == 0 {
+            lz4_compress::compress_into( chunk, compression_buffer );
+        } else {
+            lz4_compress::compress_into_hc( chunk, compression_buffer, level );
+        }
 
         let length = compression_buffer.len() as u32 - 5;
         LittleEndian::write_u32( &mut compression_buffer[ 1..5 ], length );
@@ -156,6 +306,41 @@ fn write_compressed< T >( mut fp: T, compression_buffer: &mut Vec< u8 >, data: &
     Ok( data.len() )
 }
 
+#[cfg(feature = "zstd")]
+fn write_compressed_zstd< T >( mut fp: T, compression_buffer: &mut Vec< u8 >, encoder: &mut ZstdEncoder, data: &[u8] ) -> io::Result< usize > where T: io::Write {
+    for chunk in data.chunks( CHUNK_SIZE ) {
+        clear( compression_buffer );
+        encoder.compress_into( chunk, compression_buffer )?;
+
+        fp.write_u8( CHUNK_KIND_ZSTD )?;
+        fp.write_u32::< LittleEndian >( compression_buffer.len() as u32 )?;
+        fp.write_all( &compression_buffer )?;
+    }
+
+    clear( compression_buffer );
+    Ok( data.len() )
+}
+
+#[cfg(not(feature = "zstd"))]
+fn write_compressed_zstd< T >( _fp: T, _compression_buffer: &mut Vec< u8 >, encoder: &mut ZstdEncoder, _data: &[u8] ) -> io::Result< usize > where T: io::Write {
+    match *encoder {}
+}
+
+/// Compresses `data` into one or more self-contained chunks and appends them to `output`.
+///
+/// The chunks are exactly the same as those emitted by the `Lz4Writer`, so this can be used
+/// to compress the data elsewhere and then write it out verbatim.
+pub fn compress_into_chunks( data: &[u8], output: &mut Vec< u8 > ) {
+    for chunk in data.chunks( CHUNK_SIZE ) {
+        let position = output.len();
+        output.extend_from_slice( &[1, 0, 0, 0, 0] );
+        lz4_compress::compress_into( chunk, output );
+
+        let length = (output.len() - position - 5) as u32;
+        LittleEndian::write_u32( &mut output[ position + 1..position + 5 ], length );
+    }
+}
+
 fn write_uncompressed< T >( mut fp: T, data: &[u8] ) -> io::Result< usize > where T: io::Write {
     fp.write_u8( 2 )?;
     fp.write_u32::< LittleEndian >( data.len() as u32 )?;
@@ -177,8 +362,10 @@ impl< F: io::Write > io::Write for Lz4Writer< F > {
             self.flush()?;
 
             let mut fp = self.fp.as_mut().unwrap();
-            if self.is_compressed {
-                return write_compressed( &mut fp, &mut self.compression_buffer, &slice );
+            if let Some( ref mut encoder ) = self.zstd {
+                return write_compressed_zstd( &mut fp, &mut self.compression_buffer, encoder, &slice );
+            } else if self.is_compressed {
+                return write_compressed( &mut fp, &mut self.compression_buffer, self.compression_level, &slice );
             } else {
                 return write_uncompressed( &mut fp, &slice );
             }
@@ -205,8 +392,10 @@ impl< F: io::Write > io::Write for Lz4Writer< F > {
         }
 
         let mut fp = self.fp.as_mut().unwrap();
-        if self.is_compressed {
-            write_compressed( &mut fp, &mut self.compression_buffer, &self.buffer )?;
+        if let Some( ref mut encoder ) = self.zstd {
+            write_compressed_zstd( &mut fp, &mut self.compression_buffer, encoder, &self.buffer )?;
+        } else if self.is_compressed {
+            write_compressed( &mut fp, &mut self.compression_buffer, self.compression_level, &self.buffer )?;
         } else {
             write_uncompressed( &mut fp, &self.buffer )?;
         }
@@ -215,3 +404,33 @@ impl< F: io::Write > io::Write for Lz4Writer< F > {
         fp.flush()
     }
 }
+
+#[cfg(feature = "zstd")]
+#[test]
+fn test_zstd_chunks() {
+    use std::io::Read;
+
+    let mut data = Vec::new();
+    for nth in 0..100000 {
+        data.extend_from_slice( format!( "event {} {}\n", nth % 1000, nth ).as_bytes() );
+    }
+
+    let sample_sizes: Vec< usize > = data.chunks( 100 ).map( |chunk| chunk.len() ).collect();
+    let dictionary = ZstdEncoder::train_dictionary( &data, &sample_sizes, 16 * 1024 ).unwrap();
+    for dictionary in vec![ None, Some( dictionary ) ] {
+        let mut output = Vec::new();
+        {
+            let mut fp = Lz4Writer::new( &mut output );
+            fp.write_all( b"header" ).unwrap();
+            fp.enable_zstd( ZstdEncoder::new( 3, dictionary ).unwrap() ).unwrap();
+            fp.write_all( &data ).unwrap();
+        }
+
+        let mut fp = Lz4Reader::new( &output[..] );
+        let mut actual = Vec::new();
+        let error = fp.read_to_end( &mut actual ).unwrap_err();
+        assert_eq!( error.kind(), io::ErrorKind::UnexpectedEof );
+        assert!( actual.starts_with( b"header" ) );
+        assert!( actual[ 6.. ] == data[..] );
+    }
+}
@@ -1,15 +1,69 @@
 use std::borrow::Cow;
 use speedy::{Readable, Writable};
 use crate::timestamp::Timestamp;
-use crate::event::DataId;
+use crate::event::{DataId, RuntimeOption};
 
-pub const PROTOCOL_VERSION: u32 = 2;
+pub const PROTOCOL_VERSION: u32 = 5;
 
 #[derive(PartialEq, Debug, Readable, Writable)]
 pub enum Request {
     StartStreaming,
     TriggerMemoryDump,
-    Ping
+    Ping,
+    /// Starts streaming in a resumable session; only supported as of protocol version 3.
+    StartSession( SessionRequest ),
+    /// Tells the process that everything up to the given offset of the session was safely received,
+    /// so it doesn't have to be kept around anymore for when the session is resumed.
+    Acknowledge( u64 ),
+    /// Changes one of the profiler's settings; only supported as of protocol version 4.
+    SetOption {
+        option: RuntimeOption,
+        value: u64
+    },
+    /// Asks for the current values of the settings which can be changed; only supported as of protocol version 4.
+    GetOptions,
+    /// Asks the flight recorder to write out what it has; only supported as of protocol version 5.
+    DumpFlightRecorder
+}
+
+/// What a client wants to have streamed to it.
+#[derive(Copy, Clone, PartialEq, Eq, Debug, Readable, Writable)]
+pub enum StreamKind {
+    /// Every event.
+    Full,
+    /// Only the allocations which were sampled.
+    Sampled,
+    /// Only the periodic per-backtrace summaries.
+    SummaryOnly
+}
+
+impl StreamKind {
+    /// Whether a stream of this kind is at most as big as one of the `other` kind.
+    pub fn is_at_most( self, other: StreamKind ) -> bool {
+        fn rank( kind: StreamKind ) -> u32 {
+            match kind {
+                StreamKind::SummaryOnly => 0,
+                StreamKind::Sampled => 1,
+                StreamKind::Full => 2
+            }
+        }
+
+        rank( self ) <= rank( other )
+    }
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug, Readable, Writable)]
+pub struct ResumePoint {
+    pub session: u64,
+    /// The offset of the first byte which wasn't received yet.
+    pub offset: u64
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug, Readable, Writable)]
+pub struct SessionRequest {
+    /// The kind of stream which is wanted; anything smaller is also accepted.
+    pub kind: StreamKind,
+    pub resume: Option< ResumePoint >
 }
 
 #[derive(PartialEq, Debug, Readable, Writable)]
@@ -18,7 +72,25 @@ pub enum Response< 'a > {
     Data( Cow< 'a, [u8] > ),
     FinishedInitialStreaming,
     Pong,
-    Finished
+    Finished,
+    /// The session was started; if a resume was requested and it wasn't possible
+    /// then it's a completely new session which starts at offset zero.
+    SessionStarted {
+        session: u64,
+        offset: u64,
+        kind: StreamKind
+    },
+    /// The process can only stream something bigger than what was requested.
+    StreamKindUnavailable( StreamKind ),
+    /// A part of a session's stream; the sequence numbers of a session's chunks increase by one
+    /// with every chunk, including the ones which are sent again after the session is resumed.
+    Chunk {
+        sequence: u64,
+        offset: u64,
+        data: Cow< 'a, [u8] >
+    },
+    /// The current values of every setting which can be changed, in response to `Request::GetOptions` and `Request::SetOption`.
+    Options( Vec< (RuntimeOption, u64) > )
 }
 
 #[derive(PartialEq, Debug, Readable, Writable)]
@@ -35,3 +107,46 @@ pub struct BroadcastHeader {
     pub listener_port: u16,
     pub protocol_version: u32
 }
+
+impl< 'a > Response< 'a > {
+    /// Returns what precedes the payload of a serialized `Response::Data` of a given length,
+    /// so that the payload itself can be sent separately.
+    pub fn data_header( length: usize ) -> Vec< u8 > {
+        let mut header = Response::Data( Cow::Borrowed( &[] ) ).write_to_vec().unwrap();
+        let length_offset = header.len() - std::mem::size_of::< u32 >();
+        header[ length_offset.. ].copy_from_slice( &(length as u32).to_le_bytes() );
+        header
+    }
+
+    /// The same as `data_header`, but for a `Response::Chunk`.
+    pub fn chunk_header( sequence: u64, offset: u64, length: usize ) -> Vec< u8 > {
+        let mut header = Response::Chunk { sequence, offset, data: Cow::Borrowed( &[] ) }.write_to_vec().unwrap();
+        let length_offset = header.len() - std::mem::size_of::< u32 >();
+        header[ length_offset.. ].copy_from_slice( &(length as u32).to_le_bytes() );
+        header
+    }
+}
+
+#[test]
+fn test_data_header() {
+    let payload = [1, 2, 3, 4, 5];
+    let mut serialized = Response::data_header( payload.len() );
+    serialized.extend_from_slice( &payload );
+    assert_eq!( serialized, Response::Data( Cow::Borrowed( &payload ) ).write_to_vec().unwrap() );
+}
+
+#[test]
+fn test_chunk_header() {
+    let payload = [1, 2, 3];
+    let mut serialized = Response::chunk_header( 7, 1000, payload.len() );
+    serialized.extend_from_slice( &payload );
+    assert_eq!( serialized, Response::Chunk { sequence: 7, offset: 1000, data: Cow::Borrowed( &payload ) }.write_to_vec().unwrap() );
+}
+
+#[test]
+fn test_stream_kind_is_at_most() {
+    assert!( StreamKind::SummaryOnly.is_at_most( StreamKind::Full ) );
+    assert!( StreamKind::Sampled.is_at_most( StreamKind::Sampled ) );
+    assert!( !StreamKind::Full.is_at_most( StreamKind::Sampled ) );
+    assert!( !StreamKind::Sampled.is_at_most( StreamKind::SummaryOnly ) );
+}
@@ -0,0 +1,150 @@
+//! A single-producer single-consumer byte ring which lives in memory shared between two processes.
+//!
+//! The control block is on its own page at the start of the mapping and the data follows it.
+//! Mapping and unmapping the memory is left to the users of the ring, since the profiler itself
+//! can't go through the libc's `mmap`.
+
+use std::sync::atomic::{AtomicU32, AtomicUsize, Ordering};
+
+/// How much of the mapping the control block takes.
+pub const HEADER_SIZE: usize = 4096;
+
+#[repr(C, align(64))]
+struct Aligned< T >( T );
+
+#[repr(C)]
+struct Header {
+    /// Only ever written to by the consumer.
+    head: Aligned< AtomicUsize >,
+    /// Only ever written to by the producer.
+    tail: Aligned< AtomicUsize >,
+    is_closed: AtomicU32,
+    consumer_pid: AtomicU32
+}
+
+pub struct ShmRing {
+    pointer: *mut u8,
+    length: usize
+}
+
+unsafe impl Send for ShmRing {}
+
+impl ShmRing {
+    /// Wraps an existing mapping of `length` bytes.
+    ///
+    /// # Safety
+    ///
+    /// The memory must stay mapped for as long as the ring is alive and must have been zero-filled
+    /// when it was created, and `length - HEADER_SIZE` must be a power of two.
+    pub unsafe fn from_raw( pointer: *mut u8, length: usize ) -> Self {
+        debug_assert!( length > HEADER_SIZE && (length - HEADER_SIZE).is_power_of_two() );
+        ShmRing { pointer, length }
+    }
+
+    pub fn as_ptr( &self ) -> *mut u8 {
+        self.pointer
+    }
+
+    pub fn len( &self ) -> usize {
+        self.length
+    }
+
+    fn header( &self ) -> &Header {
+        unsafe { &*(self.pointer as *const Header) }
+    }
+
+    fn capacity( &self ) -> usize {
+        self.length - HEADER_SIZE
+    }
+
+    fn data( &self ) -> *mut u8 {
+        unsafe { self.pointer.add( HEADER_SIZE ) }
+    }
+
+    /// Writes as much of the `data` as there's space for; must only be called by the producer.
+    pub fn write_some( &self, data: &[u8] ) -> usize {
+        let header = self.header();
+        let tail = header.tail.0.load( Ordering::Relaxed );
+        let head = header.head.0.load( Ordering::Acquire );
+        let count = std::cmp::min( self.capacity() - tail.wrapping_sub( head ), data.len() );
+        if count == 0 {
+            return 0;
+        }
+
+        let offset = tail & (self.capacity() - 1);
+        let first = std::cmp::min( count, self.capacity() - offset );
+        unsafe {
+            std::ptr::copy_nonoverlapping( data.as_ptr(), self.data().add( offset ), first );
+            std::ptr::copy_nonoverlapping( data.as_ptr().add( first ), self.data(), count - first );
+        }
+
+        header.tail.0.store( tail.wrapping_add( count ), Ordering::Release );
+        count
+    }
+
+    /// Moves everything which is currently in the ring into `output`; must only be called by the consumer.
+    pub fn read_into( &self, output: &mut Vec< u8 > ) -> usize {
+        let header = self.header();
+        let head = header.head.0.load( Ordering::Relaxed );
+        let tail = header.tail.0.load( Ordering::Acquire );
+        let count = tail.wrapping_sub( head );
+        if count == 0 {
+            return 0;
+        }
+
+        let offset = head & (self.capacity() - 1);
+        let first = std::cmp::min( count, self.capacity() - offset );
+        unsafe {
+            output.extend_from_slice( std::slice::from_raw_parts( self.data().add( offset ), first ) );
+            output.extend_from_slice( std::slice::from_raw_parts( self.data(), count - first ) );
+        }
+
+        header.head.0.store( head.wrapping_add( count ), Ordering::Release );
+        count
+    }
+
+    /// Marks the ring as one which won't be written to anymore; called by the producer.
+    pub fn close( &self ) {
+        self.header().is_closed.store( 1, Ordering::Release );
+    }
+
+    pub fn is_closed( &self ) -> bool {
+        self.header().is_closed.load( Ordering::Acquire ) != 0
+    }
+
+    /// The PID of the process which drains the ring, so that the producer knows when to stop waiting for it.
+    pub fn consumer_pid( &self ) -> u32 {
+        self.header().consumer_pid.load( Ordering::Acquire )
+    }
+
+    pub fn set_consumer_pid( &self, pid: u32 ) {
+        self.header().consumer_pid.store( pid, Ordering::Release );
+    }
+}
+
+#[test]
+fn test_shm_ring_wraparound() {
+    #[repr(C, align(4096))]
+    struct Page( [u8; HEADER_SIZE] );
+
+    let mut memory = vec![ Page( [0; HEADER_SIZE] ), Page( [0; HEADER_SIZE] ) ];
+    let ring = unsafe { ShmRing::from_raw( memory.as_mut_ptr() as *mut u8, HEADER_SIZE + 16 ) };
+    let mut output = Vec::new();
+
+    assert_eq!( ring.write_some( b"0123456789" ), 10 );
+    assert_eq!( ring.write_some( b"abcdefghij" ), 6 );
+    assert_eq!( ring.write_some( b"x" ), 0 );
+
+    assert_eq!( ring.read_into( &mut output ), 16 );
+    assert_eq!( output, b"0123456789abcdef" );
+
+    output.clear();
+    assert_eq!( ring.write_some( b"ABCDEFGHIJKL" ), 12 );
+    assert_eq!( ring.read_into( &mut output ), 12 );
+    assert_eq!( output, b"ABCDEFGHIJKL" );
+    assert_eq!( ring.read_into( &mut output ), 0 );
+
+    assert!( !ring.is_closed() );
+    ring.close();
+    assert!( ring.is_closed() );
+}
@@ -2,6 +2,7 @@ use std::ops::{Add, Sub, Mul, Div};
 use speedy::{Readable, Writable};
 
 #[derive(Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Debug, Hash, Readable, Writable)]
+#[repr(transparent)]
 pub struct Timestamp( u64 );
 
 impl Add for Timestamp {
@@ -104,7 +104,9 @@ def process root, section
 
         content = ""
         if has_code_to_run
-            stdin, stdout, stderr, wait = Open3.popen3( $cli_path, "script-slave", "--data", $simulation_data_path )
+            # The same slave is reused for every chapter so that the data is only loaded once.
+            $slave ||= Open3.popen3( $cli_path, "script-slave", "--data", $simulation_data_path )
+            stdin, stdout, stderr, wait = $slave
             output_preprocessed = []
             output.each do |kind, chunk|
                 if kind == :text
@@ -152,6 +154,11 @@ def process root, section
                 end
             end
 
+            # Every chapter starts from scratch.
+            stdin.print "\x01reset\0"
+            stdin.flush
+            raise "failed to reset the script slave" unless JSON.parse( stdout.readline )["kind"] == "idle"
+
             output_preprocessed.each do |obj|
                 case obj["kind"]
                     when "text"
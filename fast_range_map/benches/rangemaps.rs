@@ -90,10 +90,33 @@ fn run_benches( c: &mut Criterion, name: &str, run: fn( &[(Range<u64>, u64)] ) -
     c.bench_function( &format!( "{} (in the middle)", name ), |b| b.iter( || run( black_box( &input_in_the_middle ) ) ) );
 }
 
+fn bench_lookups( c: &mut Criterion ) {
+    let input = generate_random();
+    let map = fast_range_map::RangeMap::from_vec( input.clone() );
+    let frozen = map.clone().into_frozen();
+
+    let mut rng = oorandom::Rand64::new( 7654321 );
+    let end = input.iter().map( |(range, _)| range.end ).max().unwrap();
+    let keys: Vec< u64 > = (0..16384).map( |_| rng.rand_range( 0..end ) ).collect();
+    let mut sorted_keys = keys.clone();
+    sorted_keys.sort_unstable();
+
+    c.bench_function( "fast_range_map (lookups)", |b| b.iter( || {
+        black_box( &keys ).iter().filter( |&&key| map.get_value( key ).is_some() ).count()
+    }));
+    c.bench_function( "fast_range_map frozen (lookups)", |b| b.iter( || {
+        black_box( &keys ).iter().filter( |&&key| frozen.get_value( key ).is_some() ).count()
+    }));
+    c.bench_function( "fast_range_map frozen (batched lookups)", |b| b.iter( || {
+        frozen.lookup_many( black_box( &sorted_keys ).iter().copied() ).filter( |(_, entry)| entry.is_some() ).count()
+    }));
+}
+
 fn criterion_benchmark( c: &mut Criterion ) {
     run_benches( c, "rangemap", bench_rangemap );
     run_benches( c, "btree_range_map", bench_btree_range_map );
     run_benches( c, "fast_range_map", bench_fast_range_map );
+    bench_lookups( c );
 }
 
 criterion_group!( benches, criterion_benchmark );
@@ -16,6 +16,13 @@ fuzz_target!( |data: &[u8]| {
         map_sanity.insert( range.clone(), nth );
     }
 
+    let frozen = map.clone().into_frozen();
+    let batched: Vec< _ > = frozen.lookup_many( 0..512 ).map( |(_, entry)| entry.map( |(_, &value)| value ) ).collect();
+    for key in 0..512 {
+        assert_eq!( frozen.get_value( key ), map_sanity.get( &key ) );
+        assert_eq!( batched[ key as usize ].as_ref(), map_sanity.get( &key ) );
+    }
+
     let map: Vec< _ > = map.into_vec();
     let map_sanity: Vec< _ > = map_sanity.into_iter().collect();
     assert_eq!( map, map_sanity );
@@ -0,0 +1,177 @@
+use std::ops::Range;
+
+/// A read-only version of a `RangeMap` which is optimized for lookups.
+///
+/// The ranges are kept in a sorted array, and the starts of the ranges are additionally
+/// kept in the Eytzinger order (the implicit layout of a binary heap), so a lookup
+/// touches only a handful of cache lines; the first few levels of the search tree share
+/// the same cache lines, and every next level is exactly where the hardware prefetcher
+/// expects it to be.
+#[derive(Clone)]
+pub struct FrozenRangeMap< V > {
+    /// The starts of the ranges in the Eytzinger order; the element at index zero is unused.
+    starts: Vec< u64 >,
+    /// For every element of `starts` the index of the range in `ranges`.
+    positions: Vec< u32 >,
+    /// The ranges sorted by their start; they never overlap.
+    ranges: Vec< (Range< u64 >, V) >
+}
+
+impl< V > Default for FrozenRangeMap< V > {
+    fn default() -> Self {
+        FrozenRangeMap {
+            starts: vec![ 0 ],
+            positions: vec![ 0 ],
+            ranges: Vec::new()
+        }
+    }
+}
+
+fn fill_eytzinger< V >( ranges: &[(Range< u64 >, V)], starts: &mut [u64], positions: &mut [u32], next: &mut usize, slot: usize ) {
+    if slot >= starts.len() {
+        return;
+    }
+
+    fill_eytzinger( ranges, starts, positions, next, slot * 2 );
+    starts[ slot ] = ranges[ *next ].0.start;
+    positions[ slot ] = *next as u32;
+    *next += 1;
+    fill_eytzinger( ranges, starts, positions, next, slot * 2 + 1 );
+}
+
+impl< V > FrozenRangeMap< V > {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Creates the map from ranges which are sorted and which don't overlap.
+    pub fn from_sorted_vec( ranges: Vec< (Range< u64 >, V) > ) -> Self {
+        assert!( ranges.len() < u32::MAX as usize );
+        debug_assert!( ranges.windows( 2 ).all( |pair| pair[ 0 ].0.end <= pair[ 1 ].0.start ) );
+
+        let mut starts = vec![ 0; ranges.len() + 1 ];
+        let mut positions = vec![ 0; ranges.len() + 1 ];
+        fill_eytzinger( &ranges, &mut starts, &mut positions, &mut 0, 1 );
+
+        FrozenRangeMap {
+            starts,
+            positions,
+            ranges
+        }
+    }
+
+    pub fn is_empty( &self ) -> bool {
+        self.ranges.is_empty()
+    }
+
+    pub fn len( &self ) -> usize {
+        self.ranges.len()
+    }
+
+    /// Returns the position in `ranges` of the last range which starts at or before `key`.
+    #[inline]
+    fn position_for( &self, key: u64 ) -> Option< usize > {
+        let length = self.starts.len();
+        let mut slot = 1;
+        while slot < length {
+            slot = slot * 2 + (self.starts[ slot ] <= key) as usize;
+        }
+
+        // Every right step we took at the bottom of the tree was to a range which starts at or before the key,
+        // so backtrack to the last left step to find the first range which starts after it.
+        slot >>= slot.trailing_ones() + 1;
+        if slot == 0 {
+            self.ranges.len().checked_sub( 1 )
+        } else {
+            (self.positions[ slot ] as usize).checked_sub( 1 )
+        }
+    }
+
+    pub fn get( &self, key: u64 ) -> Option< (Range< u64 >, &V) > {
+        let (range, value) = &self.ranges[ self.position_for( key )? ];
+        if key < range.end {
+            Some( (range.clone(), value) )
+        } else {
+            None
+        }
+    }
+
+    pub fn get_value( &self, key: u64 ) -> Option< &V > {
+        self.get( key ).map( |(_, value)| value )
+    }
+
+    /// Looks up every one of the `keys`, which must be sorted, in a single pass over the ranges.
+    ///
+    /// This is a lot cheaper than calling `get` for each of the keys when there are many of them.
+    pub fn lookup_many< 'a, I >( &'a self, keys: I ) -> impl Iterator< Item = (u64, Option< (Range< u64 >, &'a V) >) > + 'a
+        where I: IntoIterator< Item = u64 >, I::IntoIter: 'a
+    {
+        let mut position = 0;
+        let mut last_key = 0;
+        keys.into_iter().map( move |key| {
+            assert!( key >= last_key, "the keys passed to `lookup_many` must be sorted" );
+            last_key = key;
+
+            let ranges = &self.ranges[ position.. ];
+            if ranges.first().map( |(range, _)| range.end <= key ).unwrap_or( false ) {
+                // Gallop ahead since there might be many ranges between the keys.
+                let mut step = 1;
+                while step < ranges.len() && ranges[ step ].0.end <= key {
+                    step *= 2;
+                }
+
+                let limit = std::cmp::min( step + 1, ranges.len() );
+                position += ranges[ ..limit ].partition_point( |(range, _)| range.end <= key );
+            }
+
+            match self.ranges.get( position ) {
+                Some( (range, value) ) if range.start <= key => (key, Some( (range.clone(), value) )),
+                _ => (key, None)
+            }
+        })
+    }
+
+    pub fn iter( &self ) -> impl ExactSizeIterator< Item = (Range< u64 >, &V) > {
+        self.ranges.iter().map( |(range, value)| (range.clone(), value) )
+    }
+
+    pub fn values( &self ) -> impl ExactSizeIterator< Item = &V > {
+        self.ranges.iter().map( |(_, value)| value )
+    }
+
+    pub fn into_vec( self ) -> Vec< (Range< u64 >, V) > {
+        self.ranges
+    }
+}
+
+#[test]
+fn test_frozen_get() {
+    for count in 0..40 {
+        let ranges: Vec< _ > = (0..count).map( |nth| (nth * 10 + 1..nth * 10 + 8, nth) ).collect();
+        let map = FrozenRangeMap::from_sorted_vec( ranges );
+        assert_eq!( map.len(), count as usize );
+
+        for key in 0..count * 10 + 20 {
+            let expected = if key / 10 < count && key % 10 >= 1 && key % 10 < 8 { Some( key / 10 ) } else { None };
+            assert_eq!( map.get_value( key ).copied(), expected, "count = {}, key = {}", count, key );
+        }
+    }
+}
+
+#[test]
+fn test_frozen_lookup_many() {
+    let map = FrozenRangeMap::from_sorted_vec( vec![
+        (1..8, 0),
+        (10..18, 1),
+        (18..28, 2),
+        (100..200, 3),
+        (1000..1001, 4)
+    ]);
+
+    let keys = vec![ 0, 1, 1, 7, 8, 17, 18, 27, 28, 150, 999, 1000, 1001, 5000 ];
+    let found: Vec< _ > = map.lookup_many( keys.iter().copied() ).map( |(key, entry)| (key, entry.map( |(_, &value)| value )) ).collect();
+    let expected: Vec< _ > = keys.iter().map( |&key| (key, map.get_value( key ).copied()) ).collect();
+    assert_eq!( found, expected );
+    assert_eq!( found[ 9 ], (150, Some( 3 )) );
+    assert_eq!( found[ 11 ], (1000, Some( 4 )) );
+}
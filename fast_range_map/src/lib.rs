@@ -1,6 +1,9 @@
 use std::ops::Range;
 use std::collections::BTreeMap;
 
+mod frozen;
+pub use frozen::FrozenRangeMap;
+
 // This was copied from `ahash`.
 #[inline(always)]
 const fn folded_multiply( s: u64, by: u64 ) -> u64 {
@@ -485,6 +488,11 @@ impl< V > RangeMap< V > {
         self.data.into_vec()
     }
 
+    /// Converts this into a map which can't be modified anymore, but which is faster to look things up in.
+    pub fn into_frozen( self ) -> FrozenRangeMap< V > {
+        FrozenRangeMap::from_sorted_vec( self.into_vec() )
+    }
+
     pub fn get_value( &self, key: u64 ) -> Option< &V > {
         self.get( key ).map( |(_, value)| value )
     }
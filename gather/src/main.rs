@@ -34,12 +34,55 @@ fn main() {
        .arg(
           Arg::with_name( "TARGET" )
               .required( false )
+        )
+       .arg(
+          Arg::with_name( "stream" )
+              .long( "stream" )
+              .takes_value( true )
+              .possible_values( &[ "full", "sampled", "summary" ] )
+              .default_value( "full" )
+              .help( "What to stream; anything other than `full` needs a process which was started in a matching mode" )
+        )
+       .arg(
+          Arg::with_name( "output-dir" )
+              .long( "output-dir" )
+              .takes_value( true )
+              .help( "The directory into which the data is written" )
+        )
+       .arg(
+          Arg::with_name( "disk-budget" )
+              .long( "disk-budget" )
+              .takes_value( true )
+              .help( "Stops gathering from a host after this many megabytes were written for all of its processes" )
+        )
+       .arg(
+          Arg::with_name( "bandwidth-budget" )
+              .long( "bandwidth-budget" )
+              .takes_value( true )
+              .help( "Receives at most this many megabytes per second from all of the processes of a single host" )
         );
 
     let matches = app.get_matches();
 
     let target = matches.value_of( "TARGET" );
-    let result = cli_core::cmd_gather::main( target );
+    let megabytes = |name| matches.value_of( name ).map( |value: &str| {
+        match value.parse::< u64 >() {
+            Ok( value ) => value * 1024 * 1024,
+            Err( _ ) => {
+                error!( "Invalid value of --{}: '{}'", name, value );
+                process::exit( 1 );
+            }
+        }
+    });
+
+    let options = cli_core::cmd_gather::GatherOptions {
+        kind: cli_core::cmd_gather::parse_stream_kind( matches.value_of( "stream" ).unwrap() ).unwrap(),
+        output_dir: matches.value_of( "output-dir" ).map( |path| path.into() ),
+        disk_budget: megabytes( "disk-budget" ),
+        bandwidth_budget: megabytes( "bandwidth-budget" )
+    };
+
+    let result = cli_core::cmd_gather::main( target, options );
 
     if let Err( error ) = result {
         error!( "{}", error );
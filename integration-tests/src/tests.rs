@@ -377,7 +377,7 @@ fn analyze( name: &str, path: impl AsRef< Path > ) -> Analysis {
     );
 
     let start = Instant::now();
-    let mut found = false;
+    let mut found = None;
     while start.elapsed() < Duration::from_secs( 20 ) {
         thread::sleep( Duration::from_millis( 100 ) );
         if let Some( response ) = attohttpc::get( &format!( "http://localhost:{}/list", port ) ).send().ok() {
@@ -385,26 +385,28 @@ fn analyze( name: &str, path: impl AsRef< Path > ) -> Analysis {
             assert_eq!( *response.headers().get( attohttpc::header::CONTENT_TYPE ).unwrap(), "application/json" );
             let list: Vec< ResponseMetadata > = serde_json::from_str( &response.text().unwrap() ).unwrap();
             if !list.is_empty() {
-                assert_eq!( list[ 0 ].executable.split( "/" ).last().unwrap(), name );
-                found = true;
+                // The file can also contain the data of the child processes.
+                let entry = list.iter().find( |entry| entry.executable.split( "/" ).last().unwrap() == name );
+                assert!( entry.is_some(), "no data for '{}' in {:?}", name, path );
+                found = entry.map( |entry| entry.id.clone() );
                 break;
             }
         }
     }
 
-    assert!( found );
+    let id = found.unwrap();
 
-    let response = attohttpc::get( &format!( "http://localhost:{}/data/last/allocations", port ) ).send().unwrap();
+    let response = attohttpc::get( &format!( "http://localhost:{}/data/{}/allocations", port, id ) ).send().unwrap();
     assert_eq!( response.status(), attohttpc::StatusCode::OK );
     assert_eq!( *response.headers().get( attohttpc::header::CONTENT_TYPE ).unwrap(), "application/json" );
     let response: ResponseAllocations = serde_json::from_str( &response.text().unwrap() ).unwrap();
 
-    let groups = attohttpc::get( &format!( "http://localhost:{}/data/last/allocation_groups", port ) ).send().unwrap();
+    let groups = attohttpc::get( &format!( "http://localhost:{}/data/{}/allocation_groups", port, id ) ).send().unwrap();
     assert_eq!( groups.status(), attohttpc::StatusCode::OK );
     assert_eq!( *groups.headers().get( attohttpc::header::CONTENT_TYPE ).unwrap(), "application/json" );
     let groups: ResponseAllocationGroups = serde_json::from_str( &groups.text().unwrap() ).unwrap();
 
-    let maps = attohttpc::get( &format!( "http://localhost:{}/data/last/maps?with_regions=true&with_usage_history=true", port ) ).send().unwrap();
+    let maps = attohttpc::get( &format!( "http://localhost:{}/data/{}/maps?with_regions=true&with_usage_history=true", port, id ) ).send().unwrap();
     assert_eq!( maps.status(), attohttpc::StatusCode::OK );
     assert_eq!( *maps.headers().get( attohttpc::header::CONTENT_TYPE ).unwrap(), "application/json" );
     let response_maps: ResponseMaps = serde_json::from_str( &maps.text().unwrap() ).unwrap();
@@ -1306,6 +1308,39 @@ fn test_longjmp() {
     ]);
 }
 
+#[test]
+fn test_swapcontext() {
+    let cwd = workdir();
+    compile( "swapcontext.c" );
+
+    run_on_target(
+        &cwd,
+        "./swapcontext",
+        EMPTY_ARGS,
+        &[
+            ("LD_PRELOAD", preload_path().into_os_string()),
+            ("MEMORY_PROFILER_LOG", get_log_level()),
+            ("MEMORY_PROFILER_OUTPUT", "swapcontext.dat".into())
+        ]
+    ).assert_success();
+
+    let analysis = analyze( "swapcontext", cwd.join( "swapcontext.dat" ) );
+    for nth in 0..3 {
+        for &(size, function) in &[ (123456, "fiber_1"), (223456, "fiber_1") ] {
+            let alloc = analysis.response.allocations.iter().find( |alloc| alloc.size == size + nth ).unwrap();
+            assert_allocation_backtrace( alloc, &[ "malloc", function, "fiber_0" ] );
+        }
+
+        for &size in &[ 323456, 423456 ] {
+            let alloc = analysis.response.allocations.iter().find( |alloc| alloc.size == size + nth ).unwrap();
+            assert_allocation_backtrace( alloc, &[ "malloc", "main_1", "main_0", "main" ] );
+        }
+    }
+
+    let alloc = analysis.response.allocations.iter().find( |alloc| alloc.size == 523456 ).unwrap();
+    assert_allocation_backtrace( alloc, &[ "malloc", "main" ] );
+}
+
 #[test]
 fn test_backtrace() {
     let cwd = workdir();
@@ -1326,6 +1361,35 @@ fn test_backtrace() {
     assert!( analysis.response.allocations.iter().any( |alloc| alloc.size == 123456 ) );
 }
 
+#[cfg(target_arch = "x86_64")]
+#[test]
+fn test_frame_pointers() {
+    let cwd = workdir();
+    compile_with_flags( "frame-pointers.c", &[ "-fno-omit-frame-pointer", "-ldl" ] );
+
+    // The program itself checks that every backtrace was grabbed through the frame pointers.
+    run_on_target(
+        &cwd,
+        "./frame-pointers",
+        EMPTY_ARGS,
+        &[
+            ("LD_PRELOAD", preload_path().into_os_string()),
+            ("MEMORY_PROFILER_LOG", get_log_level()),
+            ("MEMORY_PROFILER_OUTPUT", "frame-pointers.dat".into()),
+            ("MEMORY_PROFILER_USE_FRAME_POINTERS", "1".into()),
+            ("MEMORY_PROFILER_INSTRUMENTATION", "1".into())
+        ]
+    ).assert_success();
+
+    let analysis = analyze( "frame-pointers", cwd.join( "frame-pointers.dat" ) );
+    let allocations: Vec< _ > = analysis.response.allocations.iter().filter( |alloc| alloc.size == 1234 ).collect();
+    assert_eq!( allocations.len(), 1000 );
+    for alloc in allocations {
+        assert!( is_from_function( alloc, "allocate" ) );
+        assert!( is_from_function( alloc, "run" ) );
+    }
+}
+
 #[test]
 fn test_return_opt_u128() {
     let cwd = workdir();
@@ -1445,9 +1509,10 @@ fn test_cull() {
     assert_eq!( a0.size, 1235 );
     assert_eq!( a1.size, 1236 );
 
+    // The very first allocation was culled, but it's still counted.
     let g0 = analysis.groups.allocations.iter().find( |group| group.backtrace_id == a0.backtrace_id ).unwrap();
     assert_eq!( g0.all.leaked_count, 1 );
-    assert_eq!( g0.all.allocated_count, 2 );
+    assert_eq!( g0.all.allocated_count, 3 );
 
     let a2 = iter.next().unwrap();
     let a3 = iter.next().unwrap();
@@ -1546,6 +1611,38 @@ fn test_track_spawned_children() {
     assert_eq!(a1.size, 10003);
 }
 
+#[test]
+fn test_multiplex_spawned_children() {
+    let cwd = workdir();
+
+    compile_with_flags( "basic.c", &["-o", "basic-from-multiplexed-child"] );
+    compile_with_flags( "spawn-child.c", &["-o", "spawn-child-multiplexed", "-DCHILD=\"./basic-from-multiplexed-child\""] );
+
+    run_on_target(
+        &cwd,
+        "./spawn-child-multiplexed",
+        EMPTY_ARGS,
+        &[
+            ("LD_PRELOAD", preload_path().into_os_string()),
+            ("MEMORY_PROFILER_LOG", get_log_level()),
+            ("MEMORY_PROFILER_TRACK_CHILD_PROCESSES", "1".into()),
+            ("MEMORY_PROFILER_MULTIPLEX_CHILD_PROCESSES", "1".into()),
+            ("MEMORY_PROFILER_OUTPUT", "memory-profiling-%e.dat".into())
+        ]
+    ).assert_success();
+
+    // The child's data went into its parent's file.
+    assert!( !cwd.join( "memory-profiling-basic-from-multiplexed-child.dat" ).exists() );
+
+    let path = cwd.join( "memory-profiling-spawn-child-multiplexed.dat" );
+    check_allocations_basic_program( "basic-from-multiplexed-child", &path );
+
+    let analysis = analyze( "spawn-child-multiplexed", &path );
+    let mut iter = analysis.allocations_from_source( "spawn-child.c" );
+    assert_eq!( iter.next().unwrap().size, 10001 );
+    assert_eq!( iter.next().unwrap().size, 10003 );
+}
+
 fn check_allocations_basic_program( name: &str, path: &Path ) {
     let analysis = analyze( name, path );
     let mut iter = analysis.allocations_from_source( "basic.c" );
@@ -1592,3 +1689,103 @@ fn check_allocations_basic_program( name: &str, path: &Path ) {
 
     assert_eq!( iter.next(), None );
 }
+
+struct HotPathWorkload {
+    name: &'static str,
+    iterations: u64
+}
+
+const HOT_PATH_WORKLOADS: &[HotPathWorkload] = &[
+    HotPathWorkload { name: "churn", iterations: 2_000_000 },
+    HotPathWorkload { name: "threaded-churn", iterations: 100_000 },
+    HotPathWorkload { name: "cross-thread", iterations: 1_000_000 },
+    HotPathWorkload { name: "deep-stacks", iterations: 500_000 },
+    HotPathWorkload { name: "realloc-chains", iterations: 1_000_000 },
+    HotPathWorkload { name: "mmap", iterations: 200_000 }
+];
+
+const HOT_PATH_CONFIGURATIONS: &[(&str, &[(&str, &str)])] = &[
+    ("default", &[]),
+    ("cull", &[("MEMORY_PROFILER_CULL_TEMPORARY_ALLOCATIONS", "1")]),
+    ("no-shadow-stack", &[("MEMORY_PROFILER_USE_SHADOW_STACK", "0")]),
+    ("no-perf-event-open", &[("MEMORY_PROFILER_USE_PERF_EVENT_OPEN", "0")])
+];
+
+/// Runs a single workload of `hot-path.c` and returns how many nanoseconds a single operation took.
+fn run_hot_path( workload: &HotPathWorkload, envs: &[(&str, OsString)] ) -> f64 {
+    let cwd = workdir();
+    let iterations = workload.iterations.to_string();
+    let result = run_on_target( &cwd, "./hot-path", &[workload.name, iterations.as_str()], envs );
+    let output = result.output().to_owned();
+    result.assert_success();
+
+    let line = output.lines().find( |line| line.starts_with( "bench: " ) ).expect( "no benchmark results in the output" );
+    let mut ops = 0;
+    let mut elapsed = 0;
+    for pair in line[ "bench: ".len().. ].split_whitespace() {
+        let mut pair = pair.splitn( 2, '=' );
+        let key = pair.next().unwrap();
+        let value: u64 = pair.next().unwrap().parse().unwrap();
+        match key {
+            "ops" => ops = value,
+            "elapsed_ns" => elapsed = value,
+            _ => {}
+        }
+    }
+
+    assert_ne!( ops, 0 );
+    elapsed as f64 / ops as f64
+}
+
+/// Measures how much `libbytehound.so` slows down the allocator for a few representative workloads.
+///
+/// This is ignored by default; run it with `cargo test --release -- --ignored --nocapture benchmark_hot_path`.
+///
+/// Every workload is run `MEMORY_PROFILER_BENCHMARK_RUNS` times (3 by default) and the fastest run is taken.
+/// If `MEMORY_PROFILER_BENCHMARK_MAX_OVERHEAD_NS` is set then the benchmark fails when the overhead
+/// per operation of any of the workloads exceeds it with the default configuration.
+#[test]
+#[ignore]
+fn benchmark_hot_path() {
+    let cwd = workdir();
+    compile_with_flags( "hot-path.c", &["-O2"] );
+
+    let runs: usize = std::env::var( "MEMORY_PROFILER_BENCHMARK_RUNS" ).ok().map( |runs| runs.parse().unwrap() ).unwrap_or( 3 );
+    let max_overhead: Option< f64 > = std::env::var( "MEMORY_PROFILER_BENCHMARK_MAX_OVERHEAD_NS" ).ok().map( |value| value.parse().unwrap() );
+    let best_of = |workload: &HotPathWorkload, envs: &[(&str, OsString)]| {
+        (0..runs).map( |_| run_hot_path( workload, envs ) ).fold( f64::INFINITY, f64::min )
+    };
+
+    let output_path = cwd.join( "memory-profiling-hot-path.dat" );
+    let mut report = String::new();
+    report.push_str( "workload\tconfiguration\tns_per_op\toverhead_ns_per_op\n" );
+
+    let mut regressions = Vec::new();
+    for workload in HOT_PATH_WORKLOADS {
+        let baseline = best_of( workload, &[] );
+        report.push_str( &format!( "{}\tbaseline\t{:.1}\t0.0\n", workload.name, baseline ) );
+
+        for &(configuration, extra_envs) in HOT_PATH_CONFIGURATIONS {
+            let mut envs: Vec< (&str, OsString) > = vec![
+                ("LD_PRELOAD", preload_path().into_os_string()),
+                ("MEMORY_PROFILER_LOG", "error".into()),
+                ("MEMORY_PROFILER_OUTPUT", output_path.clone().into_os_string())
+            ];
+            envs.extend( extra_envs.iter().map( |&(key, value)| (key, OsString::from( value )) ) );
+
+            let ns_per_op = best_of( workload, &envs );
+            let overhead = ns_per_op - baseline;
+            report.push_str( &format!( "{}\t{}\t{:.1}\t{:.1}\n", workload.name, configuration, ns_per_op, overhead ) );
+
+            if configuration == "default" && max_overhead.map( |max_overhead| overhead > max_overhead ).unwrap_or( false ) {
+                regressions.push( format!( "{}: {:.1}ns per op", workload.name, overhead ) );
+            }
+        }
+    }
+
+    let _ = std::fs::remove_file( &output_path );
+    std::fs::write( cwd.join( "benchmark-hot-path.tsv" ), &report ).unwrap();
+    println!( "{}", report );
+
+    assert!( regressions.is_empty(), "the overhead is too high for: {}", regressions.join( ", " ) );
+}
@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ALLOCATION_COUNT 1000
+
+typedef size_t (*unwind_statistics_t)( uint64_t * output, size_t capacity );
+
+void * __attribute__ ((noinline)) allocate( int depth ) {
+    if( depth == 0 ) {
+        return malloc( 1234 );
+    }
+
+    void * pointer = allocate( depth - 1 );
+    __asm__ __volatile__ ( "" ::: "memory" );
+    return pointer;
+}
+
+static void __attribute__ ((noinline, used)) run() {
+    int i;
+    for( i = 0; i < ALLOCATION_COUNT; ++i ) {
+        free( allocate( i % 16 ) );
+    }
+}
+
+int main() {
+    unwind_statistics_t unwind_statistics = (unwind_statistics_t)dlsym( RTLD_DEFAULT, "memory_profiler_unwind_statistics" );
+    if( !unwind_statistics ) {
+        fprintf( stderr, "memory_profiler_unwind_statistics not found\n" );
+        return 1;
+    }
+
+    uint64_t before[ 8 ] = { 0 };
+    uint64_t after[ 8 ] = { 0 };
+    if( unwind_statistics( before, 8 ) != 8 ) {
+        fprintf( stderr, "not enough unwind statistics\n" );
+        return 1;
+    }
+
+    // libc itself is built without frame pointers, so terminate the chain here,
+    // just like `_start` does, instead of walking into whatever libc left in rbp.
+    __asm__ __volatile__ (
+        "mov %%rbp, %%rbx\n"
+        "xor %%ebp, %%ebp\n"
+        "call run\n"
+        "mov %%rbx, %%rbp\n"
+        ::: "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "memory", "cc"
+    );
+
+    unwind_statistics( after, 8 );
+
+    uint64_t unwinds = after[ 6 ] - before[ 6 ];
+    uint64_t fallbacks = after[ 7 ] - before[ 7 ];
+    printf( "frame pointer unwinds: %llu, fallbacks: %llu\n", (unsigned long long)unwinds, (unsigned long long)fallbacks );
+    if( unwinds < ALLOCATION_COUNT || fallbacks != 0 ) {
+        return 1;
+    }
+
+    return 0;
+}
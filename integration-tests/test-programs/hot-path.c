@@ -0,0 +1,186 @@
+// Microbenchmarks of the allocator hot path, used by `benchmark_hot_path`.
+//
+// Usage: hot-path <workload> <iterations>
+//
+// Prints `bench: ops=<count> elapsed_ns=<nanoseconds>`, where the elapsed time
+// covers only the workload itself and not the startup of the process.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define WINDOW 64
+#define THREAD_COUNT 64
+#define BATCH 1024
+#define STACK_DEPTH 64
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t size_for( uint64_t index ) {
+    return 16 + (index * 2654435761ULL) % 4080;
+}
+
+// Keeps a small window of live allocations so that the frees don't all just hit the same slot.
+static uint64_t churn( uint64_t iterations ) {
+    void * window[ WINDOW ] = { 0 };
+    for( uint64_t i = 0; i < iterations; ++i ) {
+        uint64_t slot = i % WINDOW;
+        free( window[ slot ] );
+        window[ slot ] = malloc( size_for( i ) );
+    }
+
+    for( int slot = 0; slot < WINDOW; ++slot ) {
+        free( window[ slot ] );
+    }
+
+    return iterations * 2;
+}
+
+static void * churn_thread( void * arg ) {
+    churn( *(uint64_t *)arg );
+    return NULL;
+}
+
+static uint64_t threaded_churn( uint64_t iterations ) {
+    pthread_t threads[ THREAD_COUNT ];
+    for( int i = 0; i < THREAD_COUNT; ++i ) {
+        pthread_create( &threads[ i ], NULL, churn_thread, &iterations );
+    }
+
+    for( int i = 0; i < THREAD_COUNT; ++i ) {
+        pthread_join( threads[ i ], NULL );
+    }
+
+    // Reported per thread, since that's the latency which each of them sees.
+    return iterations * 2;
+}
+
+static void * batches[ 2 ][ BATCH ];
+static pthread_barrier_t barrier;
+static uint64_t batch_count;
+
+static void * cross_thread_free( void * arg ) {
+    (void)arg;
+    for( uint64_t i = 0; i < batch_count; ++i ) {
+        pthread_barrier_wait( &barrier );
+        void ** batch = batches[ i % 2 ];
+        for( int j = 0; j < BATCH; ++j ) {
+            free( batch[ j ] );
+        }
+    }
+
+    return NULL;
+}
+
+// Everything is allocated on one thread and freed on another, like in `cross-thread-alloc.c`.
+static uint64_t cross_thread( uint64_t iterations ) {
+    batch_count = iterations / BATCH;
+    pthread_barrier_init( &barrier, NULL, 2 );
+
+    pthread_t thread;
+    pthread_create( &thread, NULL, cross_thread_free, NULL );
+    for( uint64_t i = 0; i < batch_count; ++i ) {
+        void ** batch = batches[ i % 2 ];
+        for( int j = 0; j < BATCH; ++j ) {
+            batch[ j ] = malloc( size_for( j ) );
+        }
+
+        pthread_barrier_wait( &barrier );
+    }
+
+    pthread_join( thread, NULL );
+    pthread_barrier_destroy( &barrier );
+    return batch_count * BATCH * 2;
+}
+
+static __attribute__((noinline)) void * allocate_deep( int depth, size_t size ) {
+    if( depth == 0 ) {
+        return malloc( size );
+    }
+
+    void * volatile pointer = allocate_deep( depth - 1, size );
+    return pointer;
+}
+
+static uint64_t deep_stacks( uint64_t iterations ) {
+    for( uint64_t i = 0; i < iterations; ++i ) {
+        free( allocate_deep( STACK_DEPTH, size_for( i ) ) );
+    }
+
+    return iterations * 2;
+}
+
+static uint64_t realloc_chains( uint64_t iterations ) {
+    void * pointer = NULL;
+    size_t size = 0;
+    for( uint64_t i = 0; i < iterations; ++i ) {
+        size += 16;
+        if( size > 64 * 1024 ) {
+            free( pointer );
+            pointer = NULL;
+            size = 16;
+        }
+
+        pointer = realloc( pointer, size );
+    }
+
+    free( pointer );
+    return iterations;
+}
+
+static uint64_t mmap_heavy( uint64_t iterations ) {
+    for( uint64_t i = 0; i < iterations; ++i ) {
+        size_t size = 4096 * (1 + i % 16);
+        void * pointer = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( pointer == MAP_FAILED ) {
+            abort();
+        }
+
+        munmap( pointer, size );
+    }
+
+    return iterations * 2;
+}
+
+int main( int argc, char ** argv ) {
+    if( argc != 3 ) {
+        fprintf( stderr, "usage: %s <workload> <iterations>\n", argv[ 0 ] );
+        return 1;
+    }
+
+    const char * workload = argv[ 1 ];
+    uint64_t iterations = strtoull( argv[ 2 ], NULL, 10 );
+
+    uint64_t (*callback)( uint64_t ) = NULL;
+    if( strcmp( workload, "churn" ) == 0 ) {
+        callback = churn;
+    } else if( strcmp( workload, "threaded-churn" ) == 0 ) {
+        callback = threaded_churn;
+    } else if( strcmp( workload, "cross-thread" ) == 0 ) {
+        callback = cross_thread;
+    } else if( strcmp( workload, "deep-stacks" ) == 0 ) {
+        callback = deep_stacks;
+    } else if( strcmp( workload, "realloc-chains" ) == 0 ) {
+        callback = realloc_chains;
+    } else if( strcmp( workload, "mmap" ) == 0 ) {
+        callback = mmap_heavy;
+    } else {
+        fprintf( stderr, "unknown workload: %s\n", workload );
+        return 1;
+    }
+
+    uint64_t start = now();
+    uint64_t ops = callback( iterations );
+    uint64_t elapsed = now() - start;
+
+    printf( "bench: ops=%llu elapsed_ns=%llu\n", (unsigned long long)ops, (unsigned long long)elapsed );
+    return 0;
+}
@@ -2,6 +2,10 @@
 #include <unistd.h>
 #include <sys/wait.h>
 
+#ifndef CHILD
+#define CHILD "./basic-from-spawn-child"
+#endif
+
 int main() {
     usleep( 100000 );
     malloc( 10001 );
@@ -9,7 +13,7 @@ int main() {
     pid_t pid = fork();
     if( pid == 0 ) {
         // Child
-        if (execl("./basic-from-spawn-child", "./basic-from-spawn-child", NULL) == -1) {
+        if (execl(CHILD, CHILD, NULL) == -1) {
             return 1;
         }
         return 0;
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+ucontext_t main_context;
+ucontext_t fiber_context;
+char fiber_stack[ 256 * 1024 ];
+
+void __attribute__ ((noinline)) fiber_1( int nth ) {
+    malloc( 123456 + nth );
+    swapcontext( &fiber_context, &main_context );
+    malloc( 223456 + nth );
+}
+
+void __attribute__ ((noinline)) fiber_0() {
+    int nth;
+    for( nth = 0; nth < 3; ++nth ) {
+        fiber_1( nth );
+    }
+}
+
+void __attribute__ ((noinline)) main_1( int nth ) {
+    malloc( 323456 + nth );
+    swapcontext( &main_context, &fiber_context );
+    malloc( 423456 + nth );
+}
+
+void __attribute__ ((noinline)) main_0() {
+    int nth;
+    for( nth = 0; nth < 3; ++nth ) {
+        main_1( nth );
+    }
+}
+
+int main() {
+    getcontext( &fiber_context );
+    fiber_context.uc_stack.ss_sp = fiber_stack;
+    fiber_context.uc_stack.ss_size = sizeof( fiber_stack );
+    fiber_context.uc_link = &main_context;
+    makecontext( &fiber_context, fiber_0, 0 );
+
+    main_0();
+
+    // Resume the fiber one last time and let it return into `main_context`.
+    swapcontext( &main_context, &fiber_context );
+    malloc( 523456 );
+
+    return 0;
+}
@@ -12,6 +12,13 @@ use byteorder::{NativeEndian, ByteOrder};
 /// thus collisions are more likely, hurting the compression ratio.
 const DICTIONARY_SIZE: usize = 4096;
 
+/// How quickly the search for duplicates speeds up when nothing is found.
+///
+/// After every `1 << SKIP_TRIGGER` failed lookups the search will skip one more byte,
+/// exactly like in the reference implementation, which makes incompressible data a lot
+/// cheaper to go through at the cost of a slightly worse compression ratio.
+const SKIP_TRIGGER: usize = 6;
+
 fn hash(x: u32) -> usize {
     let x = x.wrapping_mul(0xd18fd48b);
     let x = x.wrapping_add(x >> 16);
@@ -35,13 +42,13 @@ struct Block {
 
 /// A consecutive sequence of bytes found in already encoded part of the input.
 #[derive(Copy, Clone, Debug)]
-struct Duplicate {
+pub(crate) struct Duplicate {
     /// The number of bytes before our cursor, where the duplicate starts.
-    offset: u16,
+    pub(crate) offset: u16,
     /// The length beyond the four first bytes.
     ///
     /// Adding four to this number yields the actual length.
-    extra_bytes: usize,
+    pub(crate) extra_bytes: usize,
 }
 
 /// An LZ4 encoder.
@@ -142,18 +149,18 @@ fn test_each_u32_window_panics_on_too_short_slice() {
     each_u32_window(&slice, 1, |_| {});
 }
 
-fn common_prefix_length(lhs: &[u8], rhs: &[u8]) -> usize {
+fn common_prefix_length_scalar(lhs: &[u8], rhs: &[u8]) -> usize {
     let mut length = std::cmp::min(lhs.len(), rhs.len());
     let mut count = 0;
     unsafe {
         let mut ap = lhs.as_ptr();
         let mut bp = rhs.as_ptr();
 
-        while length >= 4 {
-            let a = (ap as *const u32).read_unaligned();
-            let b = (bp as *const u32).read_unaligned();
-            ap = ap.add(4);
-            bp = bp.add(4);
+        while length >= 8 {
+            let a = (ap as *const u64).read_unaligned();
+            let b = (bp as *const u64).read_unaligned();
+            ap = ap.add(8);
+            bp = bp.add(8);
             if a != b {
                 let zeros =
                     if cfg!(target_endian = "little") {
@@ -165,8 +172,8 @@ fn common_prefix_length(lhs: &[u8], rhs: &[u8]) -> usize {
                 return count;
             }
 
-            length -= 4;
-            count += 4;
+            length -= 8;
+            count += 8;
         }
 
         while length > 0 {
@@ -186,6 +193,66 @@ fn common_prefix_length(lhs: &[u8], rhs: &[u8]) -> usize {
     }
 }
 
+/// Compares 16 bytes at a time; SSE2 is always available on AMD64.
+#[cfg(target_arch = "x86_64")]
+fn common_prefix_length_sse2(lhs: &[u8], rhs: &[u8]) -> usize {
+    use std::arch::x86_64::{_mm_loadu_si128, _mm_cmpeq_epi8, _mm_movemask_epi8};
+
+    let length = std::cmp::min(lhs.len(), rhs.len());
+    let mut count = 0;
+    while length - count >= 16 {
+        let mask = unsafe {
+            let a = _mm_loadu_si128(lhs.as_ptr().add(count) as *const _);
+            let b = _mm_loadu_si128(rhs.as_ptr().add(count) as *const _);
+            _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) as u32
+        };
+
+        if mask != 0xFFFF {
+            return count + (!mask).trailing_zeros() as usize;
+        }
+
+        count += 16;
+    }
+
+    count + common_prefix_length_scalar(&lhs[count..], &rhs[count..])
+}
+
+/// Compares 32 bytes at a time.
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "avx2")]
+unsafe fn common_prefix_length_avx2(lhs: &[u8], rhs: &[u8]) -> usize {
+    use std::arch::x86_64::{_mm256_loadu_si256, _mm256_cmpeq_epi8, _mm256_movemask_epi8};
+
+    let length = std::cmp::min(lhs.len(), rhs.len());
+    let mut count = 0;
+    while length - count >= 32 {
+        let a = _mm256_loadu_si256(lhs.as_ptr().add(count) as *const _);
+        let b = _mm256_loadu_si256(rhs.as_ptr().add(count) as *const _);
+        let mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) as u32;
+        if mask != 0xFFFFFFFF {
+            return count + (!mask).trailing_zeros() as usize;
+        }
+
+        count += 32;
+    }
+
+    count + common_prefix_length_sse2(&lhs[count..], &rhs[count..])
+}
+
+pub(crate) fn common_prefix_length(lhs: &[u8], rhs: &[u8]) -> usize {
+    #[cfg(target_arch = "x86_64")]
+    {
+        if is_x86_feature_detected!("avx2") {
+            return unsafe { common_prefix_length_avx2(lhs, rhs) };
+        }
+
+        return common_prefix_length_sse2(lhs, rhs);
+    }
+
+    #[cfg(not(target_arch = "x86_64"))]
+    common_prefix_length_scalar(lhs, rhs)
+}
+
 #[test]
 fn test_common_prefix_length() {
     assert_eq!(common_prefix_length(b"", b""), 0);
@@ -207,6 +274,85 @@ fn test_common_prefix_length() {
     assert_eq!(common_prefix_length(b"1234", b"XXX4"), 0);
 }
 
+#[test]
+fn test_common_prefix_length_wide() {
+    let lhs: Vec<u8> = (0..200).map(|n| n as u8).collect();
+    for length in 0..lhs.len() {
+        for mismatch in 0..length {
+            let mut rhs = lhs[..length].to_vec();
+            rhs[mismatch] ^= 0xFF;
+            assert_eq!(common_prefix_length(&lhs, &rhs), mismatch);
+            assert_eq!(common_prefix_length_scalar(&lhs, &rhs), mismatch);
+            #[cfg(target_arch = "x86_64")]
+            assert_eq!(common_prefix_length_sse2(&lhs, &rhs), mismatch);
+        }
+
+        assert_eq!(common_prefix_length(&lhs, &lhs[..length]), length);
+    }
+}
+
+/// Write an integer to the output in LSIC format.
+fn write_integer(output: &mut Vec<u8>, mut n: usize) {
+    // Write the 0xFF bytes as long as the integer is higher than said value.
+    while n >= 0xFF {
+        n -= 0xFF;
+        output.push(0xFF);
+    }
+
+    // Write the remaining byte.
+    output.push(n as u8);
+}
+
+/// Write a single block, consisting of the literals and an optional duplicate, to the output.
+pub(crate) fn write_block(output: &mut Vec<u8>, literals: &[u8], dup: Option<Duplicate>) {
+    // Generate the higher half of the token.
+    let mut token = if literals.len() < 0xF {
+        // Since we can fit the literals length into it, there is no need for saturation.
+        (literals.len() as u8) << 4
+    } else {
+        // We were unable to fit the literals into it, so we saturate to 0xF. We will later
+        // write the extensional value through LSIC encoding.
+        0xF0
+    };
+
+    // Generate the lower half of the token, the duplicates length.
+    let dup_extra_len = dup.map_or(0, |x| x.extra_bytes);
+    token |= if dup_extra_len < 0xF {
+        // We could fit it in.
+        dup_extra_len as u8
+    } else {
+        // We were unable to fit it in, so we default to 0xF, which will later be extended
+        // by LSIC encoding.
+        0xF
+    };
+
+    // Push the token to the output stream.
+    output.push(token);
+
+    // If we were unable to fit the literals length into the token, write the extensional
+    // part through LSIC.
+    if literals.len() >= 0xF {
+        write_integer(output, literals.len() - 0xF);
+    }
+
+    // Now, write the actual literals.
+    output.extend_from_slice(literals);
+
+    if let Some(Duplicate { offset, .. }) = dup {
+        // Wait! There's more. Now, we encode the duplicates section.
+
+        // Push the offset in little endian.
+        output.push(offset as u8);
+        output.push((offset >> 8) as u8);
+
+        // If we were unable to fit the duplicates length into the token, write the
+        // extensional part through LSIC.
+        if dup_extra_len >= 0xF {
+            write_integer(output, dup_extra_len - 0xF);
+        }
+    }
+}
+
 impl<'a> Encoder<'a> {
     /// Go forward by some number of bytes.
     ///
@@ -321,22 +467,12 @@ impl<'a> Encoder<'a> {
         } else { None }
     }
 
-    /// Write an integer to the output in LSIC format.
-    fn write_integer(&mut self, mut n: usize) {
-        // Write the 0xFF bytes as long as the integer is higher than said value.
-        while n >= 0xFF {
-            n -= 0xFF;
-            self.output.push(0xFF);
-        }
-
-        // Write the remaining byte.
-        self.output.push(n as u8);
-    }
-
     /// Read the block of the top of the stream.
     fn pop_block(&mut self) -> Block {
         // The length of the literals section.
         let mut lit = 0;
+        // The number of failed attempts at finding a duplicate.
+        let mut misses = 0;
 
         loop {
             // Search for a duplicate.
@@ -353,8 +489,13 @@ impl<'a> Encoder<'a> {
                 };
             }
 
-            // Try to move forward.
-            if !self.go_forward(1) {
+            // Try to move forward; never past the end of the input though, since then
+            // the literals section would be bigger than the input itself.
+            let remaining = self.input.len() - self.cur;
+            let step = if remaining == 0 { 1 } else { std::cmp::min(1 + (misses >> SKIP_TRIGGER), remaining) };
+            misses += 1;
+
+            if !self.go_forward(step) {
                 // We reached the end of the stream, and no duplicates section follows.
                 return Block {
                     lit_len: lit,
@@ -363,7 +504,7 @@ impl<'a> Encoder<'a> {
             }
 
             // No duplicates found yet, so extend the literals section.
-            lit += 1;
+            lit += step;
         }
     }
 
@@ -377,52 +518,10 @@ impl<'a> Encoder<'a> {
             // Read the next block into two sections, the literals and the duplicates.
             let block = self.pop_block();
 
-            // Generate the higher half of the token.
-            let mut token = if block.lit_len < 0xF {
-                // Since we can fit the literals length into it, there is no need for saturation.
-                (block.lit_len as u8) << 4
-            } else {
-                // We were unable to fit the literals into it, so we saturate to 0xF. We will later
-                // write the extensional value through LSIC encoding.
-                0xF0
-            };
-
-            // Generate the lower half of the token, the duplicates length.
-            let dup_extra_len = block.dup.map_or(0, |x| x.extra_bytes);
-            token |= if dup_extra_len < 0xF {
-                // We could fit it in.
-                dup_extra_len as u8
-            } else {
-                // We were unable to fit it in, so we default to 0xF, which will later be extended
-                // by LSIC encoding.
-                0xF
-            };
-
-            // Push the token to the output stream.
-            self.output.push(token);
-
-            // If we were unable to fit the literals length into the token, write the extensional
-            // part through LSIC.
-            if block.lit_len >= 0xF {
-                self.write_integer(block.lit_len - 0xF);
-            }
-
-            // Now, write the actual literals.
-            self.output.extend_from_slice(&self.input[start..start + block.lit_len]);
+            // Write it out.
+            write_block(self.output, &self.input[start..start + block.lit_len], block.dup);
 
-            if let Some(Duplicate { offset, .. }) = block.dup {
-                // Wait! There's more. Now, we encode the duplicates section.
-
-                // Push the offset in little endian.
-                self.output.push(offset as u8);
-                self.output.push((offset >> 8) as u8);
-
-                // If we were unable to fit the duplicates length into the token, write the
-                // extensional part through LSIC.
-                if dup_extra_len >= 0xF {
-                    self.write_integer(dup_extra_len - 0xF);
-                }
-            } else {
+            if block.dup.is_none() {
                 break;
             }
         }
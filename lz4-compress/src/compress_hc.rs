@@ -0,0 +1,170 @@
+//! The high-compression algorithm.
+//!
+//! Instead of only remembering the last position of every hash, like the normal mode does, we
+//! keep a chain of all of the previous positions with the same hash which are still within the
+//! reach of a duplicate, and go through it to find the longest duplicate. Before a duplicate is
+//! picked we also check whether starting it one byte later would make it longer (so-called lazy
+//! matching). This is a lot slower, but the output is noticeably smaller.
+
+use std::cmp::min;
+
+use byteorder::{NativeEndian, ByteOrder};
+
+use compress::{Duplicate, common_prefix_length, write_block};
+
+/// The maximum compression level.
+pub const MAX_LEVEL: u32 = 12;
+
+/// The size of the table with the heads of the hash chains, as a power of two.
+const HASH_LOG: u32 = 15;
+
+/// The furthest back a duplicate can be.
+const MAX_DISTANCE: usize = 0xFFFF;
+
+/// The number of positions in the hash chains; only those within `MAX_DISTANCE` are ever used.
+const WINDOW_SIZE: usize = MAX_DISTANCE + 1;
+
+fn hash(x: u32) -> usize {
+    (x.wrapping_mul(2654435761) >> (32 - HASH_LOG)) as usize
+}
+
+/// An LZ4 encoder for the high-compression mode.
+struct Encoder<'a> {
+    /// The raw uncompressed input.
+    input: &'a [u8],
+    /// The last position of every hash, or `!0` if there wasn't one yet.
+    head: Vec<u32>,
+    /// The distance from every position in the window to the previous position with the same hash.
+    ///
+    /// Zero marks the end of the chain.
+    chain: Vec<u16>,
+    /// Every position before this one was already inserted into the hash chains.
+    next_to_insert: usize,
+    /// The maximum number of candidates to check when looking for a duplicate.
+    max_attempts: usize,
+}
+
+impl<'a> Encoder<'a> {
+    fn get_batch(&self, position: usize) -> u32 {
+        NativeEndian::read_u32(&self.input[position..])
+    }
+
+    /// Insert every position before `position` into the hash chains.
+    fn insert_until(&mut self, position: usize) {
+        while self.next_to_insert < position {
+            let current = self.next_to_insert;
+            let hash = hash(self.get_batch(current));
+            let previous = self.head[hash];
+            let distance = if previous == !0 { 0 } else { min(current - previous as usize, MAX_DISTANCE) };
+
+            self.chain[current % WINDOW_SIZE] = distance as u16;
+            self.head[hash] = current as u32;
+            self.next_to_insert += 1;
+        }
+    }
+
+    /// Find the longest duplicate for the bytes at `position`.
+    ///
+    /// Returns the distance to the duplicate and its full length.
+    fn find_longest_duplicate(&mut self, position: usize) -> Option<(usize, usize)> {
+        self.insert_until(position);
+
+        let batch = self.get_batch(position);
+        let mut candidate = self.head[hash(batch)];
+        let mut best: Option<(usize, usize)> = None;
+        let mut attempts = self.max_attempts;
+        while candidate != !0 && attempts > 0 {
+            let candidate_position = candidate as usize;
+            let distance = position - candidate_position;
+
+            // The chain entry of a candidate which is too far back might have already been overwritten.
+            if distance > MAX_DISTANCE {
+                break;
+            }
+
+            attempts -= 1;
+            if self.get_batch(candidate_position) == batch {
+                let length = 4 + common_prefix_length(&self.input[position + 4..], &self.input[candidate_position + 4..]);
+                if best.map_or(true, |(_, best_length)| length > best_length) {
+                    best = Some((distance, length));
+                }
+            }
+
+            let delta = self.chain[candidate_position % WINDOW_SIZE] as usize;
+            if delta == 0 {
+                break;
+            }
+
+            candidate = (candidate_position - delta) as u32;
+        }
+
+        best
+    }
+
+    /// Complete the encoding into `output`.
+    fn complete(&mut self, output: &mut Vec<u8>) {
+        // The start of the current literals section.
+        let mut anchor = 0;
+        let mut cur = 0;
+
+        // We need at least one full batch after the cursor to look for a duplicate.
+        while cur + 4 < self.input.len() {
+            let (mut distance, mut length) = match self.find_longest_duplicate(cur) {
+                Some(duplicate) => duplicate,
+                None => {
+                    cur += 1;
+                    continue;
+                }
+            };
+
+            // Check whether we'd get a longer duplicate if we'd start it later.
+            while cur + 1 + 4 < self.input.len() {
+                match self.find_longest_duplicate(cur + 1) {
+                    Some((next_distance, next_length)) if next_length > length => {
+                        cur += 1;
+                        distance = next_distance;
+                        length = next_length;
+                    },
+                    _ => break,
+                }
+            }
+
+            write_block(output, &self.input[anchor..cur], Some(Duplicate {
+                offset: distance as u16,
+                extra_bytes: length - 4,
+            }));
+
+            cur += length;
+            anchor = cur;
+        }
+
+        // The rest of the input is written out as literals.
+        write_block(output, &self.input[anchor..], None);
+    }
+}
+
+/// Compress all bytes of `input` into `output` using the high-compression mode.
+///
+/// The `level` (from 1 to `MAX_LEVEL`) decides how hard the compressor tries to find the longest
+/// duplicates; every level checks twice as many candidates as the previous one.
+pub fn compress_into_hc(input: &[u8], output: &mut Vec<u8>, level: u32) {
+    let level = min(level, MAX_LEVEL);
+    let max_attempts = 1 << level.saturating_sub(1);
+
+    Encoder {
+        input: input,
+        head: vec![!0; 1 << HASH_LOG],
+        chain: vec![0; WINDOW_SIZE],
+        next_to_insert: 0,
+        max_attempts: max_attempts,
+    }.complete(output);
+}
+
+/// Compress all bytes of `input` using the high-compression mode.
+pub fn compress_hc(input: &[u8], level: u32) -> Vec<u8> {
+    let mut vec = Vec::with_capacity(input.len());
+
+    compress_into_hc(input, &mut vec, level);
+
+    vec
+}
@@ -81,9 +81,19 @@ impl<'a> Decoder<'a> {
         // self-referential copies: http://ticki.github.io/img/lz4_runs_encoding_diagram.svg
         self.output.reserve(match_length);
         if start + match_length > self.output.len() {
-            for i in start..start + match_length {
-                let b = self.output.as_slice()[i];
-                self.output.push(b);
+            // The match overlaps with itself, so the bytes from `start` to the end of the output
+            // are repeated. Every copy doubles the amount of the already repeated bytes, so we can
+            // copy them in progressively bigger pieces without ever overlapping.
+            let mut remaining = match_length;
+            while remaining > 0 {
+                let length = self.output.len();
+                let chunk = std::cmp::min(remaining, length - start);
+                unsafe {
+                    let pointer = self.output.as_mut_ptr();
+                    std::ptr::copy_nonoverlapping(pointer.add(start), pointer.add(length), chunk);
+                    self.output.set_len(length + chunk);
+                }
+                remaining -= chunk;
             }
         } else {
             let length = self.output.len();
@@ -297,6 +307,23 @@ mod test {
         assert_eq!(decompress(&[0x30, b'a', b'4', b'9']).unwrap(), b"a49");
     }
 
+    #[test]
+    fn long_overlapping_match() {
+        let mut expected = b"abc".to_vec();
+        for _ in 0..100 {
+            expected.extend_from_slice(b"abc");
+        }
+        // Three literals followed by a match of 300 bytes with an offset of three.
+        let mut compressed = vec![0x3F, b'a', b'b', b'c', 3, 0];
+        let mut extra = 300 - 4 - 15;
+        while extra >= 255 {
+            compressed.push(255);
+            extra -= 255;
+        }
+        compressed.push(extra as u8);
+        assert_eq!(decompress(&compressed).unwrap(), expected);
+    }
+
     #[test]
     fn offset_oob() {
         decompress(&[0x10, b'a', 2, 0]).unwrap_err();
@@ -10,6 +10,7 @@ extern crate quick_error;
 
 mod decompress;
 mod compress;
+mod compress_hc;
 #[cfg(test)]
 mod tests;
 
@@ -21,3 +22,8 @@ pub use compress::{
     compress,
     compress_into
 };
+pub use compress_hc::{
+    MAX_LEVEL,
+    compress_hc,
+    compress_into_hc
+};
@@ -2,7 +2,7 @@
 
 use std::str;
 
-use {decompress, compress};
+use {decompress, compress, compress_hc, MAX_LEVEL};
 
 /// Test that the compressed string decompresses to the original string.
 fn inverse(s: &str) {
@@ -11,6 +11,10 @@ fn inverse(s: &str) {
     let decompressed = decompress(&compressed).unwrap();
     println!("Decompressed it into {:?}", str::from_utf8(&decompressed).unwrap());
     assert_eq!(decompressed, s.as_bytes());
+
+    for level in 1..MAX_LEVEL + 1 {
+        assert_eq!(decompress(&compress_hc(s.as_bytes(), level)).unwrap(), s.as_bytes());
+    }
 }
 
 #[test]
@@ -84,3 +88,26 @@ fn compression_output() {
     let output = compress(b"Random data, a, aa, aaa, aaaa, aaaaa, aaaaaa, aaaaaaa, aaaaaaaa");
     assert_eq!(output, &[208, 82, 97, 110, 100, 111, 109, 32, 100, 97, 116, 97, 44, 32, 3, 0, 1, 4, 0, 2, 5, 0, 3, 6, 0, 4, 7, 0, 5, 8, 0, 6, 9, 0, 16, 97][..]);
 }
+
+#[test]
+fn big_compression_hc() {
+    let mut s = Vec::with_capacity(1_000000);
+
+    for n in 0..1_000000 {
+        s.push((n as u8).wrapping_mul(0xA).wrapping_add(33) ^ 0xA2);
+    }
+
+    assert_eq!(&decompress(&compress_hc(&s, MAX_LEVEL)).unwrap(), &s);
+}
+
+#[test]
+fn hc_compresses_better() {
+    let mut s = String::new();
+    for n in 0..10000 {
+        s.push_str(&format!("{} {} {}; ", n % 7, n % 13, (n * 31) % 101));
+    }
+
+    let fast = compress(s.as_bytes()).len();
+    let hc = compress_hc(s.as_bytes(), MAX_LEVEL).len();
+    assert!(hc < fast, "{} >= {}", hc, fast);
+}
@@ -0,0 +1,33 @@
+use std::env;
+
+fn main() {
+    println!( "cargo:rerun-if-env-changed=CARGO_ENCODED_RUSTFLAGS" );
+
+    // Walking the frame pointers starts from within the profiler itself, so it only works
+    // if none of its own frames omit them; see `.cargo/config.toml`.
+    let flags = env::var( "CARGO_ENCODED_RUSTFLAGS" ).unwrap_or_default();
+    let flags: Vec< _ > = flags.split( '\x1f' ).collect();
+    let mut has_frame_pointers = false;
+    for (index, flag) in flags.iter().enumerate() {
+        let value = if let Some( value ) = flag.strip_prefix( "-C" ).filter( |value| !value.is_empty() ) {
+            value
+        } else if *flag == "-C" || *flag == "--codegen" {
+            flags.get( index + 1 ).copied().unwrap_or( "" )
+        } else {
+            continue;
+        };
+
+        match value {
+            "force-frame-pointers" | "force-frame-pointers=yes" | "force-frame-pointers=y" | "force-frame-pointers=on" => has_frame_pointers = true,
+            "force-frame-pointers=no" | "force-frame-pointers=n" | "force-frame-pointers=off" => has_frame_pointers = false,
+            _ => {}
+        }
+    }
+
+    let arch = env::var( "CARGO_CFG_TARGET_ARCH" ).unwrap_or_default();
+    if has_frame_pointers {
+        println!( "cargo:rustc-cfg=has_frame_pointers" );
+    } else if arch == "x86_64" || arch == "aarch64" {
+        println!( "cargo:warning=the frame pointer based unwinding was disabled since the profiler wasn't built with `-C force-frame-pointers=yes`" );
+    }
+}
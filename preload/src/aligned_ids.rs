@@ -0,0 +1,163 @@
+//! Out-of-band storage of the IDs of the page-aligned allocations.
+//!
+//! Normally every allocation gets a trailer with its ID appended to it, but for an allocation which
+//! has to be aligned to a page that's especially wasteful: a `posix_memalign( 4096, 4096 )` would
+//! then need a whole extra page just for those few bytes. So instead the IDs of those allocations
+//! are kept in a fixed-size, lock-free hash table keyed by the pointer, and the trailer is only
+//! used as a fallback when the table is full.
+
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+
+use libc::c_void;
+
+use crate::event::InternalAllocationId;
+use crate::PAGE_SIZE;
+
+const CAPACITY_SHIFT: u32 = 14;
+const CAPACITY: usize = 1 << CAPACITY_SHIFT;
+
+/// How many consecutive slots are checked before we give up.
+const MAXIMUM_PROBES: usize = 16;
+
+const EMPTY: usize = 0;
+const TOMBSTONE: usize = 1;
+
+pub struct Entry {
+    pointer: AtomicUsize,
+    thread: AtomicU64,
+    allocation: AtomicU64
+}
+
+impl Entry {
+    pub fn set( &self, id: InternalAllocationId ) {
+        self.thread.store( id.thread, Ordering::Relaxed );
+        self.allocation.store( id.allocation, Ordering::Relaxed );
+    }
+
+    fn get( &self ) -> InternalAllocationId {
+        InternalAllocationId::new( self.thread.load( Ordering::Relaxed ), self.allocation.load( Ordering::Relaxed ) )
+    }
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const EMPTY_ENTRY: Entry = Entry {
+    pointer: AtomicUsize::new( EMPTY ),
+    thread: AtomicU64::new( 0 ),
+    allocation: AtomicU64::new( 0 )
+};
+
+static TABLE: [Entry; CAPACITY] = [EMPTY_ENTRY; CAPACITY];
+
+/// How many allocations are currently in the table, so that most frees don't have to look at it at all.
+static LIVE_COUNT: AtomicUsize = AtomicUsize::new( 0 );
+
+/// Whether an allocation with a given alignment should have its ID kept in the table.
+#[inline(always)]
+pub fn should_use( alignment: usize ) -> bool {
+    alignment >= PAGE_SIZE
+}
+
+#[inline(always)]
+fn hash( pointer: usize ) -> u64 {
+    ((pointer / PAGE_SIZE) as u64).wrapping_mul( 0x9E3779B97F4A7C15 ) >> (64 - CAPACITY_SHIFT)
+}
+
+#[inline(always)]
+fn slots( pointer: usize ) -> impl Iterator< Item = &'static Entry > {
+    let hash = hash( pointer );
+    (0..MAXIMUM_PROBES).map( move |nth| &TABLE[ (hash as usize + nth) & (CAPACITY - 1) ] )
+}
+
+/// Claims an entry for a given pointer, initially marked as untracked; returns `None` if the table is full.
+pub fn insert( pointer: *mut c_void ) -> Option< &'static Entry > {
+    let pointer = pointer as usize;
+    debug_assert_eq!( pointer % PAGE_SIZE, 0 );
+
+    for entry in slots( pointer ) {
+        let mut current = entry.pointer.load( Ordering::Relaxed );
+        while current == EMPTY || current == TOMBSTONE {
+            match entry.pointer.compare_exchange_weak( current, pointer, Ordering::AcqRel, Ordering::Relaxed ) {
+                Ok( _ ) => {
+                    entry.set( InternalAllocationId::UNTRACKED );
+                    LIVE_COUNT.fetch_add( 1, Ordering::Relaxed );
+                    return Some( entry );
+                },
+                Err( actual ) => current = actual
+            }
+        }
+    }
+
+    None
+}
+
+#[inline(always)]
+fn find( pointer: *mut c_void ) -> Option< &'static Entry > {
+    let pointer = pointer as usize;
+    if pointer % PAGE_SIZE != 0 || LIVE_COUNT.load( Ordering::Relaxed ) == 0 {
+        return None;
+    }
+
+    for entry in slots( pointer ) {
+        match entry.pointer.load( Ordering::Acquire ) {
+            // Entries are never emptied once used, so nothing could've been inserted past this one.
+            EMPTY => return None,
+            current if current == pointer => return Some( entry ),
+            _ => {}
+        }
+    }
+
+    None
+}
+
+/// Returns the ID of a given allocation if it's kept in the table.
+#[inline(always)]
+pub fn get( pointer: *mut c_void ) -> Option< InternalAllocationId > {
+    find( pointer ).map( Entry::get )
+}
+
+/// Removes a given allocation from the table; has to be called before the allocation is freed.
+#[inline(always)]
+pub fn take( pointer: *mut c_void ) -> Option< InternalAllocationId > {
+    let entry = find( pointer )?;
+    let id = entry.get();
+    entry.pointer.store( TOMBSTONE, Ordering::Release );
+    LIVE_COUNT.fetch_sub( 1, Ordering::Relaxed );
+    Some( id )
+}
+
+#[test]
+fn test_aligned_ids() {
+    let pointers: Vec< _ > = (1..64).map( |nth| (nth * PAGE_SIZE * 1024) as *mut c_void ).collect();
+    for (nth, &pointer) in pointers.iter().enumerate() {
+        assert!( get( pointer ).is_none() );
+        insert( pointer ).unwrap().set( InternalAllocationId::new( 1, nth as u64 ) );
+    }
+
+    for (nth, &pointer) in pointers.iter().enumerate() {
+        assert!( get( pointer ) == Some( InternalAllocationId::new( 1, nth as u64 ) ) );
+    }
+
+    assert!( get( (PAGE_SIZE * 1024 + 16) as *mut c_void ).is_none() );
+    assert!( take( pointers[ 3 ] ) == Some( InternalAllocationId::new( 1, 3 ) ) );
+    assert!( get( pointers[ 3 ] ).is_none() );
+    assert!( take( pointers[ 3 ] ).is_none() );
+
+    // Fill up every slot for a single hash.
+    let colliding: Vec< _ > = ((1 << 28)..)
+        .map( |page| page * PAGE_SIZE )
+        .filter( |&pointer| hash( pointer ) == hash( 1 << 40 ) )
+        .take( MAXIMUM_PROBES * 2 )
+        .map( |pointer| pointer as *mut c_void )
+        .collect();
+    let inserted = colliding.iter().filter( |&&pointer| insert( pointer ).is_some() ).count();
+    assert!( inserted < colliding.len() );
+    for &pointer in &colliding {
+        take( pointer );
+    }
+
+    for &pointer in &pointers {
+        take( pointer );
+    }
+
+    assert_eq!( LIVE_COUNT.load( Ordering::Relaxed ), 0 );
+}
@@ -1,13 +1,16 @@
+use std::cell::UnsafeCell;
 use std::num::NonZeroUsize;
+use std::ptr;
 use std::sync::Arc;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicPtr, Ordering};
 use std::collections::HashMap;
 
 use parking_lot::{Mutex, RwLock};
 
 use common::Timestamp;
-use common::event::AllocationId;
+use common::event::{AllocationId, CULLED_LIFETIME_BUCKET_COUNT, culled_lifetime_bucket};
 
+use crate::backtrace_table::BacktraceRef;
 use crate::global::StrongThreadHandle;
 use crate::unwind::Backtrace;
 use crate::event::{InternalAllocation, InternalAllocationId, InternalEvent};
@@ -25,14 +28,34 @@ pub struct AllocationBucket {
 
 impl AllocationBucket {
     fn is_long_lived( &self, now: Timestamp ) -> bool {
-        now.as_usecs() >= self.events[0].timestamp.as_usecs() + crate::opt::get().temporary_allocation_lifetime_threshold * 1000
+        now.as_usecs() >= self.events[0].timestamp.as_usecs() + crate::opt::temporary_allocation_lifetime_threshold() * 1000
     }
 }
 
+/// The aggregated counters of the culled allocations from a single backtrace.
+pub struct CulledAllocations {
+    pub backtrace: Backtrace,
+    pub first_allocation: Timestamp,
+    pub last_allocation: Timestamp,
+    pub count: u64,
+    pub size: u64,
+    pub min_size: u64,
+    pub max_size: u64,
+    /// A histogram of how long the allocations lived; see `culled_lifetime_bucket`.
+    pub lifetimes: [u64; CULLED_LIFETIME_BUCKET_COUNT]
+}
+
+/// How many allocations can be pending on a single thread before the oldest ones are flushed regardless of their age.
+const RING_CAPACITY: usize = 16 * 1024;
+
+/// How often the counters of the culled allocations are sent out, in microseconds.
+fn culled_flush_interval() -> u64 {
+    crate::opt::get().culled_statistics_interval * 1000
+}
+
 #[derive(Default)]
 struct AllocationTrackerRegistry {
-    per_thread: HashMap< u64, AllocationTracker, crate::nohash::NoHash >,
-    global: Mutex< crate::ordered_map::OrderedMap< (u64, u64), AllocationBucket, crate::nohash::NoHash > >
+    per_thread: HashMap< u64, Arc< Ring >, crate::nohash::NoHash >
 }
 
 static ENABLED: AtomicBool = AtomicBool::new( false );
@@ -41,17 +64,583 @@ lazy_static! {
     static ref ALLOCATION_TRACKER_REGISTRY: RwLock< AllocationTrackerRegistry > = Default::default();
 }
 
+fn get_shard_key( id: AllocationId ) -> usize {
+    id.thread as usize
+}
+
+fn emit_bucket( bucket: AllocationBucket ) {
+    crate::event::send_event_throttled_sharded( get_shard_key( bucket.id ), move || {
+        InternalEvent::AllocationBucket( bucket )
+    });
+}
+
+/// The culled allocations which weren't sent out yet.
 #[derive(Default)]
-struct AllocationTrackerState {
-    buckets: crate::ordered_map::OrderedMap< u64, AllocationBucket, crate::nohash::NoHash >,
+struct Culled {
+    entries: Vec< CulledAllocations >,
+    /// Backtraces' keys aren't necessarily unique, so this only points to the latest entry with a given key.
+    index_by_key: HashMap< crate::unwind::BacktraceKey, usize, crate::nohash::NoHash >,
+    since: u64
 }
 
-fn get_shard_key( id: AllocationId ) -> usize {
-    id.thread as usize
+impl Culled {
+    fn add( &mut self, bucket: AllocationBucket, freed_at: Timestamp ) {
+        if self.entries.is_empty() {
+            self.since = bucket.events[0].timestamp.as_usecs();
+        }
+
+        // Every reallocation is counted too, just as if the allocation was culled when processing the data,
+        // and every step of a reallocation chain lives until the next one.
+        let mut events = bucket.events.into_iter().peekable();
+        while let Some( event ) = events.next() {
+            let end = events.peek().map( |next| next.timestamp ).unwrap_or( freed_at );
+            let size = event.allocation.size as u64;
+            let lifetime = culled_lifetime_bucket( end.as_usecs().saturating_sub( event.timestamp.as_usecs() ) );
+            let key = event.backtrace.key();
+            let entries = &mut self.entries;
+            let index = *self.index_by_key.entry( key ).or_insert_with( || entries.len() );
+            match entries.get_mut( index ) {
+                Some( entry ) if Backtrace::ptr_eq( &entry.backtrace, &event.backtrace ) => {
+                    entry.last_allocation = std::cmp::max( entry.last_allocation, event.timestamp );
+                    entry.count += 1;
+                    entry.size += size;
+                    entry.min_size = std::cmp::min( entry.min_size, size );
+                    entry.max_size = std::cmp::max( entry.max_size, size );
+                    entry.lifetimes[ lifetime ] += 1;
+                    continue;
+                },
+                _ => {}
+            }
+
+            let mut lifetimes = [0; CULLED_LIFETIME_BUCKET_COUNT];
+            lifetimes[ lifetime ] = 1;
+
+            self.index_by_key.insert( key, entries.len() );
+            entries.push( CulledAllocations {
+                backtrace: event.backtrace,
+                first_allocation: event.timestamp,
+                last_allocation: event.timestamp,
+                count: 1,
+                size,
+                min_size: size,
+                max_size: size,
+                lifetimes
+            });
+        }
+    }
+
+    fn flush( &mut self, timestamp: Timestamp, force: bool ) {
+        if self.entries.is_empty() || (!force && timestamp.as_usecs() < self.since + culled_flush_interval()) {
+            return;
+        }
+
+        self.index_by_key.clear();
+        let entries = std::mem::take( &mut self.entries );
+        crate::event::send_event_throttled( move || InternalEvent::CulledAllocations { entries } );
+    }
+}
+
+fn push_reallocation(
+    bucket: &mut AllocationBucket,
+    timestamp: Timestamp,
+    id: AllocationId,
+    old_address: NonZeroUsize,
+    allocation: InternalAllocation,
+    backtrace: Backtrace
+) {
+    if bucket.events.last().unwrap().allocation.address != old_address {
+        error!(
+            "Reallocation with ID {} has old pointer 0x{:016X} while it should have 0x{:016X}; this should never happen",
+            id,
+            old_address,
+            allocation.address
+        );
+    }
+
+    bucket.events.push( BufferedAllocation { timestamp, allocation, backtrace } );
+}
+
+enum Operation {
+    Allocation( AllocationBucket ),
+    Reallocation {
+        id: AllocationId,
+        timestamp: Timestamp,
+        old_address: NonZeroUsize,
+        allocation: InternalAllocation,
+        backtrace: Backtrace
+    },
+    Free {
+        id: AllocationId,
+        timestamp: Timestamp,
+        address: NonZeroUsize,
+        backtrace: Option< Backtrace >,
+        tid: u32
+    }
+}
+
+/// The pending allocations of a single thread.
+///
+/// Since allocation IDs are handed out sequentially on every thread the allocations
+/// can be kept in a ring indexed directly by their ID, which makes both inserting and
+/// removing them cheap, and means the oldest pending allocation is always at `oldest`.
+#[derive(Default)]
+struct RingState {
+    slots: Vec< Option< Box< AllocationBucket > > >,
+    oldest: u64,
+    newest: u64,
+    pending: usize,
+    culled: Culled
+}
+
+impl RingState {
+    fn slot( &mut self, counter: u64 ) -> &mut Option< Box< AllocationBucket > > {
+        let mask = self.slots.len() as u64 - 1;
+        &mut self.slots[ (counter & mask) as usize ]
+    }
+
+    fn take( &mut self, counter: u64 ) -> Option< AllocationBucket > {
+        if self.slots.is_empty() {
+            return None;
+        }
+
+        let slot = self.slot( counter );
+        if slot.as_ref().map( |bucket| bucket.id.allocation ) != Some( counter ) {
+            return None;
+        }
+
+        let bucket = slot.take().unwrap();
+        self.pending -= 1;
+        Some( *bucket )
+    }
+
+    fn get_mut( &mut self, counter: u64 ) -> Option< &mut AllocationBucket > {
+        if self.slots.is_empty() {
+            return None;
+        }
+
+        match self.slot( counter ) {
+            Some( bucket ) if bucket.id.allocation == counter => Some( bucket ),
+            _ => None
+        }
+    }
+
+    fn insert( &mut self, bucket: AllocationBucket ) {
+        if self.slots.is_empty() {
+            self.slots.resize_with( RING_CAPACITY, || None );
+        }
+
+        let counter = bucket.id.allocation;
+        let capacity = self.slots.len() as u64;
+        if self.pending == 0 {
+            self.oldest = counter;
+        }
+
+        if counter < self.oldest {
+            if self.newest - counter > capacity {
+                emit_bucket( bucket );
+                return;
+            }
+
+            self.oldest = counter;
+        }
+
+        if counter >= self.newest {
+            self.newest = counter + 1;
+        }
+
+        if self.newest - self.oldest > capacity {
+            // Make room by flushing everything that's too old to fit.
+            let target = self.newest - capacity;
+            let end = std::cmp::min( target, self.oldest + capacity );
+            for counter in self.oldest..end {
+                let slot = self.slot( counter );
+                if slot.as_ref().map( |bucket| bucket.id.allocation < target ).unwrap_or( false ) {
+                    let bucket = slot.take().unwrap();
+                    self.pending -= 1;
+                    emit_bucket( *bucket );
+                }
+            }
+
+            self.oldest = target;
+        }
+
+        if let Some( old_bucket ) = self.slot( counter ).replace( Box::new( bucket ) ) {
+            if old_bucket.id.allocation == counter {
+                error!( "Duplicate allocation with ID {}; this should never happen", old_bucket.id );
+            }
+
+            self.pending -= 1;
+            emit_bucket( *old_bucket );
+        }
+
+        self.pending += 1;
+    }
+
+    fn flush_pending( &mut self, timestamp: Timestamp ) {
+        let temporary_allocation_pending_threshold = crate::opt::get().temporary_allocation_pending_threshold.unwrap_or( !0 );
+        while self.pending > 0 && self.oldest < self.newest {
+            let counter = self.oldest;
+            let is_over_threshold = self.pending > temporary_allocation_pending_threshold;
+            let should_flush = match self.slot( counter ) {
+                Some( bucket ) if bucket.id.allocation == counter => is_over_threshold || bucket.is_long_lived( timestamp ),
+                _ => {
+                    self.oldest += 1;
+                    continue;
+                }
+            };
+
+            if !should_flush {
+                break;
+            }
+
+            emit_bucket( self.take( counter ).unwrap() );
+            self.oldest += 1;
+        }
+
+        self.culled.flush( timestamp, false );
+    }
+
+    fn has_work( &self ) -> bool {
+        self.pending > 0 || !self.culled.entries.is_empty()
+    }
+
+    /// Returns when the oldest pending allocation will become long-lived, in microseconds,
+    /// or when the culled allocations have to be sent out if there's nothing pending.
+    fn next_expiration( &mut self ) -> Option< u64 > {
+        if self.pending == 0 {
+            if self.culled.entries.is_empty() {
+                return None;
+            }
+
+            return Some( self.culled.since + culled_flush_interval() );
+        }
+
+        let counter = self.oldest;
+        let timestamp = match self.slot( counter ) {
+            Some( bucket ) if bucket.id.allocation == counter => bucket.events[0].timestamp.as_usecs(),
+            // This shouldn't happen right after flushing, but just in case expire it as soon as possible.
+            _ => 0
+        };
+
+        Some( timestamp + crate::opt::temporary_allocation_lifetime_threshold() * 1000 )
+    }
+
+    fn drain( &mut self, output: &mut Vec< AllocationBucket > ) {
+        let start = output.len();
+        output.extend( self.slots.iter_mut().filter_map( |slot| slot.take() ).map( |bucket| *bucket ) );
+        output[ start.. ].sort_by_key( |bucket| bucket.id.allocation );
+        self.pending = 0;
+        self.culled.flush( Timestamp::max(), true );
+    }
+
+    /// Applies a given operation, returning an event which still has to be sent, if any.
+    fn apply( &mut self, operation: Operation ) -> Option< (AllocationId, InternalEvent) > {
+        match operation {
+            Operation::Allocation( bucket ) => {
+                self.insert( bucket );
+                None
+            },
+            Operation::Reallocation { id, timestamp, old_address, allocation, backtrace } => {
+                if let Some( bucket ) = self.get_mut( id.allocation ) {
+                    push_reallocation( bucket, timestamp, id, old_address, allocation, backtrace );
+                    return None;
+                }
+
+                Some( (id, InternalEvent::Realloc { id, timestamp, old_address, allocation, backtrace }) )
+            },
+            Operation::Free { id, timestamp, address, backtrace, tid } => {
+                if let Some( bucket ) = self.take( id.allocation ) {
+                    if !bucket.is_long_lived( timestamp ) {
+                        self.culled.add( bucket, timestamp );
+                        return None;
+                    }
+
+                    emit_bucket( bucket );
+                }
+
+                Some( (id, InternalEvent::Free { timestamp, id, address, backtrace, tid }) )
+            }
+        }
+    }
+}
+
+struct QueuedOperation {
+    next: *mut QueuedOperation,
+    operation: Operation
+}
+
+/// A thread's pending allocations, along with a lock-free queue of operations on them.
+///
+/// Only one thread can access the state at a time, but nobody ever waits for it. Normally
+/// it's the owning thread itself which does so, and the processing thread occasionally
+/// does too when flushing; whoever finds it busy pushes their operation into the queue
+/// instead, and the operation will run before the current user of the state lets go of it.
+struct Ring {
+    state: UnsafeCell< RingState >,
+    unique_tid: u64,
+    is_busy: AtomicBool,
+    is_dead: AtomicBool,
+    is_scheduled: AtomicBool,
+    queue: AtomicPtr< QueuedOperation >
 }
 
-#[repr(transparent)]
-pub struct AllocationTracker( Arc< Mutex< AllocationTrackerState > > );
+unsafe impl Send for Ring {}
+unsafe impl Sync for Ring {}
+
+impl Ring {
+    fn new( unique_tid: u64 ) -> Self {
+        Ring {
+            state: UnsafeCell::new( RingState::default() ),
+            unique_tid,
+            is_busy: AtomicBool::new( false ),
+            is_dead: AtomicBool::new( false ),
+            is_scheduled: AtomicBool::new( false ),
+            queue: AtomicPtr::new( ptr::null_mut() )
+        }
+    }
+
+    fn push( &self, operation: Operation ) {
+        let node = Box::into_raw( Box::new( QueuedOperation { next: ptr::null_mut(), operation } ) );
+        let mut head = self.queue.load( Ordering::Relaxed );
+        loop {
+            unsafe {
+                (*node).next = head;
+            }
+
+            match self.queue.compare_exchange_weak( head, node, Ordering::SeqCst, Ordering::Relaxed ) {
+                Ok( _ ) => break,
+                Err( current ) => head = current
+            }
+        }
+    }
+
+    fn take_queued( &self ) -> *mut QueuedOperation {
+        // The queue is a stack, so reverse it to get the operations in the order they were pushed.
+        let mut node = self.queue.swap( ptr::null_mut(), Ordering::Acquire );
+        let mut reversed = ptr::null_mut();
+        while !node.is_null() {
+            unsafe {
+                let next = (*node).next;
+                (*node).next = reversed;
+                reversed = node;
+                node = next;
+            }
+        }
+
+        reversed
+    }
+
+    /// Runs the queued operations; must only be called while the state is being held.
+    fn run_queued( &self, state: &mut RingState ) {
+        let mut node = self.take_queued();
+        while !node.is_null() {
+            let queued = unsafe { Box::from_raw( node ) };
+            node = queued.next;
+
+            // This could be running on any thread, so these can't be staged.
+            if let Some( (id, event) ) = state.apply( queued.operation ) {
+                crate::event::send_event_throttled_sharded( get_shard_key( id ), move || event );
+            }
+        }
+    }
+
+    fn try_acquire( &self ) -> bool {
+        self.is_busy.compare_exchange( false, true, Ordering::SeqCst, Ordering::Relaxed ).is_ok()
+    }
+
+    fn release( &self ) {
+        loop {
+            if unsafe { (*self.state.get()).has_work() } {
+                schedule( self );
+            }
+
+            self.is_busy.store( false, Ordering::SeqCst );
+
+            // Someone might have queued an operation right before we've let go.
+            if self.queue.load( Ordering::SeqCst ).is_null() || !self.try_acquire() {
+                return;
+            }
+
+            self.run_queued( unsafe { &mut *self.state.get() } );
+        }
+    }
+
+    /// Runs `callback` on the state, unless someone else is holding it.
+    fn try_run< R >( &self, callback: impl FnOnce( &mut RingState ) -> R ) -> Option< R > {
+        if !self.try_acquire() {
+            return None;
+        }
+
+        let state = unsafe { &mut *self.state.get() };
+        self.run_queued( state );
+        let result = callback( state );
+        self.release();
+
+        Some( result )
+    }
+
+    /// Runs `operation`, or queues it if someone else is currently holding the state.
+    fn execute( &self, operation: Operation, timestamp: Timestamp ) -> Option< (AllocationId, InternalEvent) > {
+        let mut operation = Some( operation );
+        let result = self.try_run( |state| {
+            let result = state.apply( operation.take().unwrap() );
+            state.flush_pending( timestamp );
+            result
+        });
+
+        match result {
+            Some( result ) => result,
+            None => {
+                self.push( operation.take().unwrap() );
+                self.try_run( |_| () );
+                None
+            }
+        }
+    }
+
+    fn is_empty( &self ) -> bool {
+        self.queue.load( Ordering::SeqCst ).is_null() && self.try_run( |state| !state.has_work() ).unwrap_or( false )
+    }
+}
+
+impl Drop for Ring {
+    fn drop( &mut self ) {
+        let mut node = self.take_queued();
+        while !node.is_null() {
+            let queued = unsafe { Box::from_raw( node ) };
+            node = queued.next;
+        }
+    }
+}
+
+/// How many slots the timing wheel has.
+const WHEEL_SLOTS: usize = 64;
+
+/// The smallest granularity of the timing wheel, in microseconds.
+const MINIMUM_WHEEL_GRANULARITY: u64 = 1000;
+
+/// A timing wheel of the rings to be flushed, keyed by when their oldest pending allocation becomes long-lived.
+///
+/// Since the oldest pending allocation was made in the past an expiration is never scheduled for
+/// further than `temporary_allocation_lifetime_threshold` ahead, so the wheel spans exactly that
+/// and a single level is enough. If the threshold is raised at runtime the later expirations
+/// just stay in their slots for more than one turn of the wheel. Only accessed from the processing thread.
+struct TimingWheel {
+    slots: Vec< Vec< (u64, u64) > >,
+    granularity: u64,
+    current_tick: Option< u64 >
+}
+
+impl TimingWheel {
+    fn new() -> Self {
+        let threshold = crate::opt::get().temporary_allocation_lifetime_threshold * 1000;
+        TimingWheel {
+            slots: (0..WHEEL_SLOTS).map( |_| Vec::new() ).collect(),
+            granularity: std::cmp::max( threshold / WHEEL_SLOTS as u64, MINIMUM_WHEEL_GRANULARITY ),
+            current_tick: None
+        }
+    }
+
+    fn schedule( &mut self, unique_tid: u64, expiration: u64 ) {
+        let mut tick = expiration / self.granularity + 1;
+        if let Some( current_tick ) = self.current_tick {
+            tick = std::cmp::max( tick, current_tick );
+        }
+
+        self.slots[ tick as usize % WHEEL_SLOTS ].push( (tick, unique_tid) );
+    }
+
+    /// Pops all of the rings which are due at `now`.
+    fn advance( &mut self, now: u64, output: &mut Vec< u64 > ) {
+        let target_tick = now / self.granularity;
+        let mut tick = self.current_tick.unwrap_or( target_tick );
+        let mut count = 0;
+        while tick <= target_tick && count < WHEEL_SLOTS {
+            let slot = &mut self.slots[ tick as usize % WHEEL_SLOTS ];
+            let mut index = 0;
+            while index < slot.len() {
+                if slot[ index ].0 <= target_tick {
+                    output.push( slot.swap_remove( index ).1 );
+                } else {
+                    index += 1;
+                }
+            }
+
+            tick += 1;
+            count += 1;
+        }
+
+        self.current_tick = Some( target_tick + 1 );
+    }
+}
+
+struct ScheduledRing {
+    next: *mut ScheduledRing,
+    unique_tid: u64
+}
+
+/// The rings which have pending allocations but which aren't yet in the timing wheel.
+static NEWLY_SCHEDULED: AtomicPtr< ScheduledRing > = AtomicPtr::new( ptr::null_mut() );
+
+lazy_static! {
+    static ref TIMING_WHEEL: Mutex< TimingWheel > = Mutex::new( TimingWheel::new() );
+}
+
+/// Makes sure the processing thread will eventually flush a given ring.
+fn schedule( ring: &Ring ) {
+    if ring.is_scheduled.load( Ordering::Relaxed ) || ring.is_scheduled.swap( true, Ordering::SeqCst ) {
+        return;
+    }
+
+    let node = Box::into_raw( Box::new( ScheduledRing { next: ptr::null_mut(), unique_tid: ring.unique_tid } ) );
+    let mut head = NEWLY_SCHEDULED.load( Ordering::Relaxed );
+    loop {
+        unsafe {
+            (*node).next = head;
+        }
+
+        match NEWLY_SCHEDULED.compare_exchange_weak( head, node, Ordering::SeqCst, Ordering::Relaxed ) {
+            Ok( _ ) => break,
+            Err( current ) => head = current
+        }
+    }
+}
+
+fn take_newly_scheduled( output: &mut Vec< u64 > ) {
+    let mut node = NEWLY_SCHEDULED.swap( ptr::null_mut(), Ordering::Acquire );
+    while !node.is_null() {
+        let scheduled = unsafe { Box::from_raw( node ) };
+        node = scheduled.next;
+        output.push( scheduled.unique_tid );
+    }
+}
+
+/// The allocation tracker of a single thread.
+///
+/// The ring is only created (and registered, which needs the registry's write lock) when
+/// the thread makes its first allocation which is actually tracked, so threads which never
+/// get that far don't touch the registry at all.
+pub struct AllocationTracker {
+    unique_tid: u64,
+    ring: UnsafeCell< Option< Arc< Ring > > >
+}
+
+impl AllocationTracker {
+    /// This must only be called on the thread which owns the tracker.
+    fn ring( &self ) -> Option< &Arc< Ring > > {
+        unsafe { (*self.ring.get()).as_ref() }
+    }
+
+    /// This must only be called on the thread which owns the tracker.
+    fn ring_or_register( &self ) -> &Arc< Ring > {
+        let ring = unsafe { &mut *self.ring.get() };
+        ring.get_or_insert_with( || {
+            let ring = Arc::new( Ring::new( self.unique_tid ) );
+            ALLOCATION_TRACKER_REGISTRY.write().per_thread.insert( self.unique_tid, ring.clone() );
+            ring
+        })
+    }
+}
 
 pub fn initialize() {
     ENABLED.store( crate::opt::get().cull_temporary_allocations, Ordering::SeqCst );
@@ -59,38 +648,81 @@ pub fn initialize() {
 }
 
 pub fn on_thread_created( unique_tid: u64 ) -> AllocationTracker {
-    let tracker = AllocationTracker( Arc::new( Mutex::new( AllocationTrackerState::default() ) ) );
-
-    ALLOCATION_TRACKER_REGISTRY.write().per_thread.insert( unique_tid, AllocationTracker( tracker.0.clone() ) );
-    tracker
+    AllocationTracker {
+        unique_tid,
+        ring: UnsafeCell::new( None )
+    }
 }
 
 pub fn on_thread_destroyed( unique_tid: u64 ) {
-    let mut registry = ALLOCATION_TRACKER_REGISTRY.write();
-    if let Some( local_tracker ) = registry.per_thread.remove( &unique_tid ) {
-        let timestamp = crate::timestamp::get_timestamp();
-        let mut local_tracker = local_tracker.0.lock();
-        flush_pending( &mut local_tracker.buckets, timestamp );
+    // The ring stays registered until all of its allocations are flushed or freed.
+    let registry = ALLOCATION_TRACKER_REGISTRY.read();
+    if let Some( ring ) = registry.per_thread.get( &unique_tid ) {
+        ring.is_dead.store( true, Ordering::SeqCst );
 
-        let mut global_tracker = registry.global.lock();
-        flush_pending( &mut global_tracker, timestamp );
+        let timestamp = crate::timestamp::get_timestamp();
+        ring.try_run( |state| state.flush_pending( timestamp ) );
 
-        while let Some( (allocation_id, bucket) ) = local_tracker.buckets.pop_front() {
-            global_tracker.insert( (unique_tid, allocation_id), bucket );
-        }
+        // Make sure the processing thread gets to unregister it.
+        schedule( ring );
     }
 }
 
 pub fn on_tick() {
-    let registry = ALLOCATION_TRACKER_REGISTRY.read();
+    if !ENABLED.load( Ordering::Relaxed ) {
+        return;
+    }
+
     let timestamp = crate::timestamp::get_timestamp();
+    let now = timestamp.as_usecs();
+
+    let mut wheel = TIMING_WHEEL.lock();
+    let mut due = Vec::new();
+    take_newly_scheduled( &mut due );
+    for unique_tid in due.drain( .. ) {
+        wheel.schedule( unique_tid, now );
+    }
+
+    wheel.advance( now, &mut due );
+    if due.is_empty() {
+        return;
+    }
+
+    let mut finished = Vec::new();
     {
-        let mut global_tracker = registry.global.lock();
-        flush_pending( &mut global_tracker, timestamp );
+        let registry = ALLOCATION_TRACKER_REGISTRY.read();
+        for unique_tid in due {
+            let ring = match registry.per_thread.get( &unique_tid ) {
+                Some( ring ) => ring,
+                None => continue
+            };
+
+            match ring.try_run( |state| { state.flush_pending( timestamp ); state.next_expiration() } ) {
+                Some( Some( expiration ) ) => wheel.schedule( unique_tid, expiration ),
+                Some( None ) => {
+                    ring.is_scheduled.store( false, Ordering::SeqCst );
+
+                    // Something might have been added right before we've unscheduled it.
+                    if !ring.is_empty() {
+                        schedule( ring );
+                    } else if ring.is_dead.load( Ordering::SeqCst ) {
+                        finished.push( unique_tid );
+                    }
+                },
+                // Someone's using it right now, so try again a little later.
+                None => wheel.schedule( unique_tid, now )
+            }
+        }
     }
-    for tracker in registry.per_thread.values() {
-        let mut local_tracker = tracker.0.lock();
-        flush_pending( &mut local_tracker.buckets, timestamp );
+
+    if !finished.is_empty() {
+        let mut registry = ALLOCATION_TRACKER_REGISTRY.write();
+        for unique_tid in finished {
+            let is_empty = registry.per_thread.get( &unique_tid ).map( |ring| ring.is_empty() ).unwrap_or( false );
+            if is_empty {
+                registry.per_thread.remove( &unique_tid );
+            }
+        }
     }
 }
 
@@ -99,58 +731,51 @@ pub fn on_exit() {
 
     let mut buckets = Vec::new();
     let mut registry = ALLOCATION_TRACKER_REGISTRY.write();
-    for (_, tracker) in std::mem::take( &mut registry.per_thread ) {
-        let mut tracker = tracker.0.lock();
-        while let Some( (_, bucket) ) = tracker.buckets.pop_front() {
-            buckets.push( bucket );
-        }
-    }
-
-    {
-        let mut global = registry.global.lock();
-        while let Some( (_, bucket) ) = global.pop_front() {
-            buckets.push( bucket );
+    for (_, ring) in std::mem::take( &mut registry.per_thread ) {
+        while ring.try_run( |state| state.drain( &mut buckets ) ).is_none() {
+            std::thread::yield_now();
         }
     }
 
     info!( "Flushing {} bucket(s) on exit", buckets.len() );
     for bucket in buckets {
-        crate::event::send_event_throttled_sharded( get_shard_key( bucket.id ), move || {
-            InternalEvent::AllocationBucket( bucket )
-        });
+        emit_bucket( bucket );
     }
 }
 
-fn flush_pending< K >(
-    allocations: &mut crate::ordered_map::OrderedMap< K, AllocationBucket, crate::nohash::NoHash >,
-    timestamp: Timestamp
-) where K: Copy + PartialEq + Eq + std::hash::Hash {
-    let temporary_allocation_pending_threshold = crate::opt::get().temporary_allocation_pending_threshold.unwrap_or( !0 );
-    while let Some( key ) = allocations.front_key() {
-        let should_flush =
-            allocations.len() > temporary_allocation_pending_threshold ||
-            allocations.get( &key ).unwrap().is_long_lived( timestamp );
+/// Sends out the thread's tag if it was changed; this has to happen before the allocation's event is sent.
+#[inline(always)]
+pub(crate) fn send_tag_change( thread: &mut StrongThreadHandle, id: AllocationId, timestamp: Timestamp ) {
+    if thread.is_dead() {
+        return;
+    }
 
-        if should_flush {
-            let bucket = allocations.remove( &key ).unwrap();
-            crate::event::send_event_throttled_sharded( get_shard_key( bucket.id ), move || {
-                InternalEvent::AllocationBucket( bucket )
-            });
-        } else {
-            break;
-        }
+    if let Some( tag ) = thread.take_tag_change() {
+        let system_tid = thread.system_tid();
+        crate::event::send_event_throttled_through_thread( thread, get_shard_key( id ), move || {
+            InternalEvent::ThreadTag {
+                timestamp,
+                thread: system_tid,
+                tag
+            }
+        });
     }
 }
 
 pub fn on_allocation(
     id: InternalAllocationId,
-    allocation: InternalAllocation,
+    mut allocation: InternalAllocation,
     backtrace: Backtrace,
-    thread: StrongThreadHandle
+    mut thread: StrongThreadHandle
 ) {
+    if crate::opt::get().numa_sampling_interval > 0 {
+        allocation.flags |= thread.numa_node_flags();
+    }
+
     let timestamp = crate::timestamp::get_timestamp();
     let id: AllocationId = id.into();
-    debug_assert_eq!( id.thread, thread.unique_tid() );
+    debug_assert!( id.is_untracked() || id.thread == thread.unique_tid() );
+    send_tag_change( &mut thread, id, timestamp );
 
     if thread.is_dead() {
         let mut zombie_events = thread.zombie_events().lock();
@@ -159,7 +784,7 @@ pub fn on_allocation(
                 id,
                 timestamp,
                 allocation,
-                backtrace,
+                backtrace: BacktraceRef::new( backtrace ),
             }
         );
 
@@ -170,19 +795,13 @@ pub fn on_allocation(
             events: Default::default()
         };
 
-        let address = allocation.address;
         bucket.events.push( BufferedAllocation { timestamp, allocation, backtrace } );
-
-        let mut tracker = thread.allocation_tracker().0.lock();
-        if tracker.buckets.insert( id.allocation, bucket ).is_some() {
-            error!( "Duplicate allocation 0x{:08X} with ID {}; this should never happen", address, id );
-        }
-
-        flush_pending( &mut tracker.buckets, timestamp );
+        thread.allocation_tracker().ring_or_register().execute( Operation::Allocation( bucket ), timestamp );
         return;
     }
 
-    crate::event::send_event_throttled_sharded( get_shard_key( id ), move || {
+    let backtrace = BacktraceRef::new( backtrace );
+    crate::event::send_event_throttled_through_thread( &thread, get_shard_key( id ), move || {
         InternalEvent::Alloc {
             id,
             timestamp,
@@ -197,12 +816,17 @@ pub fn on_allocation(
 pub fn on_reallocation(
     id: InternalAllocationId,
     old_address: NonZeroUsize,
-    allocation: InternalAllocation,
+    mut allocation: InternalAllocation,
     backtrace: Backtrace,
-    thread: StrongThreadHandle
+    mut thread: StrongThreadHandle
 ) {
+    if crate::opt::get().numa_sampling_interval > 0 {
+        allocation.flags |= thread.numa_node_flags();
+    }
+
     let timestamp = crate::timestamp::get_timestamp();
     let id: AllocationId = id.into();
+    send_tag_change( &mut thread, id, timestamp );
     if id.is_invalid() {
         // TODO: If we're culling temporary allocations try to find one with the same address and flush it.
         error!( "Allocation 0x{:08X} with invalid ID {} was reallocated; this should never happen; you probably have an out-of-bounds write somewhere", old_address, id );
@@ -220,50 +844,22 @@ pub fn on_reallocation(
 
         return;
     } else if !thread.is_dead() && ENABLED.load( Ordering::Relaxed ) && !id.is_untracked() {
-        fn emit(
-            bucket: &mut AllocationBucket,
-            timestamp: Timestamp,
-            id: AllocationId,
-            old_address: NonZeroUsize,
-            allocation: InternalAllocation,
-            backtrace: Backtrace
-        ) {
-            if bucket.events.last().unwrap().allocation.address != old_address {
-                error!(
-                    "Reallocation with ID {} has old pointer 0x{:016X} while it should have 0x{:016X}; this should never happen",
-                    id,
-                    old_address,
-                    allocation.address
-                );
-            }
-
-            bucket.events.push( BufferedAllocation { timestamp, allocation, backtrace } );
-        }
-
-        if id.thread == thread.unique_tid() {
-            let mut tracker = thread.allocation_tracker().0.lock();
-            flush_pending( &mut tracker.buckets, timestamp );
-
-            if let Some( bucket ) = tracker.buckets.get_mut( &id.allocation ) {
-                return emit( bucket, timestamp, id, old_address, allocation, backtrace );
-            }
-        } else {
-            let registry = ALLOCATION_TRACKER_REGISTRY.read();
-            if let Some( registry ) = registry.per_thread.get( &id.thread ) {
-                let mut tracker = registry.0.lock();
-                flush_pending( &mut tracker.buckets, timestamp );
-
-                if let Some( bucket ) = tracker.buckets.get_mut( &id.allocation ) {
-                    return emit( bucket, timestamp, id, old_address, allocation, backtrace );
-                }
+        let registry;
+        let ring =
+            if id.thread == thread.unique_tid() {
+                thread.allocation_tracker().ring()
             } else {
-                let mut buckets = registry.global.lock();
-                flush_pending( &mut buckets, timestamp );
+                registry = ALLOCATION_TRACKER_REGISTRY.read();
+                registry.per_thread.get( &id.thread )
+            };
 
-                if let Some( bucket ) = buckets.get_mut( &(id.thread, id.allocation) ) {
-                    return emit( bucket, timestamp, id, old_address, allocation, backtrace );
-                }
+        if let Some( ring ) = ring {
+            let operation = Operation::Reallocation { id, timestamp, old_address, allocation, backtrace };
+            if let Some( (id, event) ) = ring.execute( operation, timestamp ) {
+                crate::event::send_event_throttled_sharded( get_shard_key( id ), move || event );
             }
+
+            return;
         }
     }
 
@@ -305,45 +901,33 @@ pub fn on_free(
 
         return;
     } else if !thread.is_dead() && ENABLED.load( Ordering::Relaxed ) && !id.is_untracked() && !id.is_invalid() {
-        let bucket =
+        let registry;
+        let ring =
             if id.thread == thread.unique_tid() {
-                let mut tracker = thread.allocation_tracker().0.lock();
-                flush_pending( &mut tracker.buckets, timestamp );
-
-                tracker.buckets.remove( &id.allocation )
+                thread.allocation_tracker().ring()
             } else {
-                let registry = ALLOCATION_TRACKER_REGISTRY.read();
-                if let Some( registry ) = registry.per_thread.get( &id.thread ) {
-                    let mut tracker = registry.0.lock();
-                    flush_pending( &mut tracker.buckets, timestamp );
-
-                    tracker.buckets.remove( &id.allocation )
-                } else {
-                    let mut allocations = registry.global.lock();
-                    flush_pending( &mut allocations, timestamp );
-
-                    allocations.remove( &(id.thread, id.allocation) )
-                }
+                registry = ALLOCATION_TRACKER_REGISTRY.read();
+                registry.per_thread.get( &id.thread )
             };
 
-        if let Some( bucket ) = bucket {
-            if bucket.is_long_lived( timestamp ) {
-                crate::event::send_event_throttled_sharded( get_shard_key( bucket.id ), move || {
-                    InternalEvent::AllocationBucket( bucket )
-                });
-            } else {
-                return;
+        if let Some( ring ) = ring {
+            let operation = Operation::Free { id, timestamp, address, backtrace, tid: thread.system_tid() };
+            if let Some( (_, event) ) = ring.execute( operation, timestamp ) {
+                crate::event::send_event_staged( &thread, move || event );
             }
+
+            return;
         }
     }
 
-    crate::event::send_event_throttled_sharded( get_shard_key( id ), move || {
+    let tid = thread.system_tid();
+    crate::event::send_event_staged( &thread, move || {
         InternalEvent::Free {
             timestamp,
             id,
             address,
             backtrace,
-            tid: thread.system_tid()
+            tid
         }
     });
 }
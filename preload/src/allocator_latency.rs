@@ -0,0 +1,199 @@
+//! Measurement of how long the underlying allocator takes to service the sampled calls.
+//!
+//! Every thread aggregates its own measurements per backtrace into small histograms and periodically
+//! sends them over, and the processing thread then merges them across the threads and writes them out
+//! in a single event, so even the rare slow calls show up without anything being recorded for every call.
+
+use std::collections::HashMap as StdHashMap;
+use std::io::{self, Write};
+use std::sync::atomic::{AtomicBool, Ordering};
+
+use common::event::{ALLOCATOR_LATENCY_BUCKET_COUNT, AllocatorCall, AllocatorLatencyStatistics, Event, allocator_latency_bucket};
+use common::speedy::Writable;
+
+use crate::event::InternalEvent;
+use crate::global::StrongThreadHandle;
+use crate::processing_thread::BacktraceCache;
+use crate::timestamp::{Timestamp, get_timestamp, interval_to_nsecs, read_interval_clock};
+use crate::unwind::{Backtrace, BacktraceKey};
+use crate::utils::{HashMap, empty_hashmap};
+use crate::writers;
+
+static ENABLED: AtomicBool = AtomicBool::new( false );
+
+/// Must be called after the clock source was picked, since the measurements can't span a change of it.
+pub fn initialize() {
+    ENABLED.store( crate::opt::get().allocator_latency_interval > 0, Ordering::Release );
+}
+
+/// Starts timing a call to the allocator; returns zero if the latencies aren't measured.
+#[inline(always)]
+pub fn start() -> u64 {
+    if !ENABLED.load( Ordering::Relaxed ) {
+        return 0;
+    }
+
+    read_interval_clock()
+}
+
+/// The latencies of the calls from a single backtrace which weren't sent out yet.
+pub struct AllocatorLatencies {
+    pub backtrace: Backtrace,
+    pub call: AllocatorCall,
+    pub count: u64,
+    pub total: u64,
+    pub max: u64,
+    pub buckets: [u64; ALLOCATOR_LATENCY_BUCKET_COUNT]
+}
+
+/// The latencies measured on a single thread.
+#[derive(Default)]
+pub struct PendingLatencies {
+    entries: Vec< AllocatorLatencies >,
+    /// Backtraces' keys aren't necessarily unique, so this only points to the latest entry with a given key.
+    index_by_key: StdHashMap< BacktraceKey, usize, crate::nohash::NoHash >,
+    since: u64
+}
+
+impl PendingLatencies {
+    fn add( &mut self, backtrace: &Backtrace, call: AllocatorCall, latency: u64, timestamp: Timestamp ) {
+        if self.entries.is_empty() {
+            self.since = timestamp.as_usecs();
+        }
+
+        let bucket = allocator_latency_bucket( latency );
+        let key = backtrace.key() ^ call as BacktraceKey;
+        let entries = &mut self.entries;
+        let index = *self.index_by_key.entry( key ).or_insert_with( || entries.len() );
+        match entries.get_mut( index ) {
+            Some( entry ) if entry.call == call && Backtrace::ptr_eq( &entry.backtrace, backtrace ) => {
+                entry.count += 1;
+                entry.total += latency;
+                entry.max = std::cmp::max( entry.max, latency );
+                entry.buckets[ bucket ] += 1;
+                return;
+            },
+            _ => {}
+        }
+
+        let mut buckets = [0; ALLOCATOR_LATENCY_BUCKET_COUNT];
+        buckets[ bucket ] = 1;
+
+        self.index_by_key.insert( key, entries.len() );
+        entries.push( AllocatorLatencies {
+            backtrace: backtrace.clone(),
+            call,
+            count: 1,
+            total: latency,
+            max: latency,
+            buckets
+        });
+    }
+
+    /// Takes everything which was measured so far, if anything.
+    pub fn take( &mut self ) -> Option< InternalEvent > {
+        if self.entries.is_empty() {
+            return None;
+        }
+
+        self.index_by_key.clear();
+        Some( InternalEvent::AllocatorLatencies { entries: std::mem::take( &mut self.entries ) } )
+    }
+}
+
+/// Finishes timing a call to the allocator which was started with `start`.
+#[inline]
+pub fn record( thread: &mut StrongThreadHandle, call: AllocatorCall, start: u64, backtrace: &Backtrace ) {
+    if start == 0 || thread.is_dead() {
+        return;
+    }
+
+    let latency = interval_to_nsecs( start, read_interval_clock() );
+    let timestamp = get_timestamp();
+    let pending = thread.allocator_latencies();
+    pending.add( backtrace, call, latency, timestamp );
+
+    if timestamp.as_usecs() >= pending.since + crate::opt::get().allocator_latency_interval * 1000 {
+        if let Some( event ) = pending.take() {
+            crate::event::send_event_throttled( move || event );
+        }
+    }
+}
+
+/// Sends out whatever the current thread has measured so far, so that it's not lost when we exit.
+pub fn flush_current_thread() {
+    let mut thread = match StrongThreadHandle::acquire() {
+        Some( thread ) => thread,
+        None => return
+    };
+
+    if let Some( event ) = thread.allocator_latencies().take() {
+        crate::event::send_event( event );
+    }
+}
+
+/// The latencies from every thread, merged together; lives on the processing thread.
+pub struct MergedLatencies {
+    by_backtrace: HashMap< (u64, AllocatorCall), AllocatorLatencyStatistics >
+}
+
+fn merge( entry: &mut AllocatorLatencyStatistics, latencies: &AllocatorLatencies ) {
+    entry.count += latencies.count;
+    entry.total += latencies.total;
+    entry.max = std::cmp::max( entry.max, latencies.max );
+
+    let length = latencies.buckets.iter().rposition( |&count| count != 0 ).map( |index| index + 1 ).unwrap_or( 0 );
+    if entry.buckets.len() < length {
+        entry.buckets.resize( length, 0 );
+    }
+
+    for (total, &count) in entry.buckets.iter_mut().zip( latencies.buckets[ ..length ].iter() ) {
+        *total += count;
+    }
+}
+
+impl MergedLatencies {
+    pub fn new() -> Self {
+        MergedLatencies {
+            by_backtrace: empty_hashmap()
+        }
+    }
+
+    pub fn on_latencies(
+        &mut self,
+        entries: Vec< AllocatorLatencies >,
+        backtrace_cache: &mut BacktraceCache,
+        fp: &mut impl Write
+    ) -> io::Result< () > {
+        for latencies in entries {
+            // The backtraces are written right away so that they're always written before they're referenced.
+            let backtrace = writers::write_backtrace( &mut *fp, latencies.backtrace.clone(), backtrace_cache )?;
+            let entry = self.by_backtrace.entry( (backtrace, latencies.call) ).or_insert_with( || AllocatorLatencyStatistics {
+                backtrace,
+                call: latencies.call,
+                count: 0,
+                total: 0,
+                max: 0,
+                buckets: Vec::new()
+            });
+
+            merge( entry, &latencies );
+        }
+
+        Ok(())
+    }
+
+    pub fn write_statistics( &mut self, timestamp: Timestamp, fp: &mut impl Write ) -> io::Result< () > {
+        if self.by_backtrace.is_empty() {
+            return Ok(());
+        }
+
+        let mut entries: Vec< _ > = self.by_backtrace.drain().map( |(_, entry)| entry ).collect();
+        entries.sort_unstable_by_key( |entry| (entry.backtrace, entry.call as u32) );
+
+        Event::AllocatorLatencies {
+            timestamp,
+            entries: entries.into()
+        }.write_to_stream( fp )
+    }
+}
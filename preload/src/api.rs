@@ -1,19 +1,22 @@
 use std::mem;
 use std::ptr;
 use std::num::NonZeroUsize;
+use std::sync::atomic::{AtomicUsize, Ordering};
 
 use libc::{
     c_void,
+    c_char,
     c_int,
     size_t,
     off_t
 };
 
 use common::event;
+use common::event::AllocatorCall;
 use common::Timestamp;
 
 use crate::InternalEvent;
-use crate::event::{InternalAllocation, InternalAllocationId, send_event, send_event_throttled};
+use crate::event::{CompactAllocationId, InternalAllocation, InternalAllocationId, send_event, send_event_throttled};
 use crate::global::{StrongThreadHandle, on_exit};
 use crate::smaps::{MapSource, MapKind};
 use crate::opt;
@@ -21,6 +24,8 @@ use crate::syscall;
 use crate::timestamp::get_timestamp;
 use crate::unwind;
 use crate::allocation_tracker::{on_allocation, on_reallocation, on_free};
+use crate::allocator_latency;
+use crate::aligned_ids;
 
 extern "C" {
     #[link_name = "__libc_malloc"]
@@ -41,11 +46,14 @@ use tikv_jemalloc_sys::malloc as jem_malloc_real;
 use tikv_jemalloc_sys::mallocx as jem_mallocx_real;
 use tikv_jemalloc_sys::calloc as jem_calloc_real;
 use tikv_jemalloc_sys::sdallocx as jem_sdallocx_real;
+use tikv_jemalloc_sys::dallocx as jem_dallocx_real;
+use tikv_jemalloc_sys::sallocx as jem_sallocx_real;
 use tikv_jemalloc_sys::realloc as jem_realloc_real;
 use tikv_jemalloc_sys::rallocx as jem_rallocx_real;
 use tikv_jemalloc_sys::xallocx as jem_xallocx_real;
 use tikv_jemalloc_sys::nallocx as jem_nallocx_real;
 use tikv_jemalloc_sys::malloc_usable_size as jem_malloc_usable_size_real;
+use tikv_jemalloc_sys::mallctl as jem_mallctl_real;
 use tikv_jemalloc_sys::mallctlnametomib as jem_mallctlnametomib_real;
 use tikv_jemalloc_sys::mallctlbymib as jem_mallctlbymib_real;
 use tikv_jemalloc_sys::malloc_stats_print as jem_malloc_stats_print_real;
@@ -67,10 +75,9 @@ extern "C" {
 pub unsafe extern "C" fn bytehound_jemalloc_raw_mmap( addr: *mut c_void, length: size_t, prot: c_int, flags: c_int, fildes: c_int, off: off_t ) -> *mut c_void {
     if !jem_is_initialized() {
         let id = crate::global::next_map_id();
-        let mut maps_registry = crate::global::MMAP_REGISTRY.lock().unwrap();
         let ptr = syscall::mmap( addr, length, prot, flags, fildes, off );
         if ptr != libc::MAP_FAILED {
-            maps_registry.set_vma_name( ptr, length, id, MapKind::Jemalloc );
+            crate::smaps::set_vma_name( ptr, length, id, MapKind::Jemalloc );
         }
 
         return ptr;
@@ -82,10 +89,7 @@ pub unsafe extern "C" fn bytehound_jemalloc_raw_mmap( addr: *mut c_void, length:
 #[no_mangle]
 pub unsafe extern "C" fn bytehound_jemalloc_raw_munmap( addr: *mut c_void, length: size_t ) -> c_int {
     if !jem_is_initialized() {
-        let mut maps_registry = crate::global::MMAP_REGISTRY.lock().unwrap();
-        let result = syscall::munmap( addr, length );
-        maps_registry.clear_vma_name( addr, length );
-        return result;
+        return munmap_untracked( addr, length );
     }
 
     munmap( addr, length )
@@ -135,19 +139,19 @@ pub unsafe extern "C" fn bytehound_mimalloc_raw_mprotect( _addr: *mut c_void, _l
     0
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _exit( status: c_int ) {
     on_exit();
     syscall::exit( status as u32 );
 }
 
 #[allow(non_snake_case)]
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _Exit( status: c_int ) {
     _exit( status );
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn malloc_usable_size( ptr: *mut c_void ) -> size_t {
     if ptr.is_null() {
         return 0;
@@ -161,7 +165,11 @@ pub unsafe extern "C" fn malloc_usable_size( ptr: *mut c_void ) -> size_t {
     #[cfg(not(feature = "jemalloc"))]
     {
         let usable_size = get_allocation_metadata( ptr ).usable_size;
-        match usable_size.checked_sub( mem::size_of::< InternalAllocationId >() ) {
+        if aligned_ids::get( ptr ).is_some() {
+            return usable_size;
+        }
+
+        match usable_size.checked_sub( tracking_size() ) {
             Some( size ) => size,
             None => panic!( "malloc_usable_size: underflow (pointer=0x{:016X}, usable_size={})", ptr as usize , usable_size )
         }
@@ -195,26 +203,137 @@ fn get_allocation_metadata( ptr: *mut c_void ) -> Metadata {
     }
 }
 
-unsafe fn tracking_pointer( pointer: *mut c_void, usable_size: usize ) -> *mut InternalAllocationId {
-    let tracking_offset = usable_size - mem::size_of::< InternalAllocationId >();
-    (pointer as *mut u8).add( tracking_offset ) as *mut InternalAllocationId
+/// The number of extra bytes appended to every allocation to store its ID.
+#[inline(always)]
+fn tracking_size() -> usize {
+    tracking_size_for( opt::get().compact_allocation_ids )
+}
+
+#[inline(always)]
+fn tracking_size_for( compact: bool ) -> usize {
+    if compact {
+        mem::size_of::< CompactAllocationId >()
+    } else {
+        mem::size_of::< InternalAllocationId >()
+    }
+}
+
+#[test]
+fn test_tracking_size() {
+    assert_eq!( tracking_size_for( false ), mem::size_of::< InternalAllocationId >() );
+    assert_eq!( tracking_size_for( true ), 8 );
+}
+
+unsafe fn tracking_pointer( pointer: *mut c_void, usable_size: usize ) -> *mut u8 {
+    let tracking_offset = usable_size - tracking_size();
+    (pointer as *mut u8).add( tracking_offset )
+}
+
+#[inline(always)]
+unsafe fn read_tracking_id( tracking_pointer: *const u8 ) -> InternalAllocationId {
+    if opt::get().compact_allocation_ids {
+        std::ptr::read_unaligned( tracking_pointer as *const CompactAllocationId ).into()
+    } else {
+        std::ptr::read_unaligned( tracking_pointer as *const InternalAllocationId )
+    }
+}
+
+#[inline(always)]
+unsafe fn write_tracking_id( tracking_pointer: *mut u8, id: InternalAllocationId ) {
+    if opt::get().compact_allocation_ids {
+        std::ptr::write_unaligned( tracking_pointer as *mut CompactAllocationId, id.into() );
+    } else {
+        std::ptr::write_unaligned( tracking_pointer as *mut InternalAllocationId, id );
+    }
+}
+
+/// Where a freshly made allocation's ID goes.
+enum TrackingSlot {
+    Trailer( *mut u8 ),
+    OutOfBand( &'static aligned_ids::Entry )
+}
+
+impl TrackingSlot {
+    #[inline(always)]
+    unsafe fn write( &self, id: InternalAllocationId ) {
+        match *self {
+            TrackingSlot::Trailer( tracking_pointer ) => write_tracking_id( tracking_pointer, id ),
+            TrackingSlot::OutOfBand( entry ) => entry.set( id )
+        }
+    }
+}
+
+unsafe fn memalign_real( alignment: usize, size: usize ) -> *mut c_void {
+    if !crate::global::using_unprefixed_jemalloc() {
+        libc_memalign_real( alignment, size as size_t )
+    } else {
+        jem_memalign_real( alignment, size as size_t )
+    }
 }
 
-enum AllocationKind {
+unsafe fn free_real( pointer: *mut c_void ) {
+    if !crate::global::using_unprefixed_jemalloc() {
+        libc_free_real( pointer );
+    } else {
+        jem_free_real( pointer );
+    }
+}
+
+/// Moves an allocation whose ID was kept out of band into a plain one with a trailer.
+///
+/// The underlying `realloc` could've resized it in place, and then we'd have nowhere to put the ID.
+unsafe fn realloc_out_of_band( old_pointer: *mut c_void, old_usable_size: usize, requested_size: usize, effective_size: usize ) -> *mut c_void {
+    let new_pointer = if !crate::global::using_unprefixed_jemalloc() {
+        libc_malloc_real( effective_size )
+    } else {
+        jem_malloc_real( effective_size )
+    };
+
+    if new_pointer.is_null() {
+        return new_pointer;
+    }
+
+    ptr::copy_nonoverlapping( old_pointer as *const u8, new_pointer as *mut u8, std::cmp::min( old_usable_size, requested_size ) );
+    aligned_ids::take( old_pointer );
+    free_real( old_pointer );
+    new_pointer
+}
+
+/// Extra allocation flags which should be set on every allocation we emit.
+#[inline(always)]
+pub fn sampling_flags() -> u32 {
+    if opt::sampling_interval() != 0 {
+        event::ALLOC_FLAG_SAMPLED
+    } else {
+        0
+    }
+}
+
+pub(crate) enum AllocationKind {
     Malloc,
     Calloc,
     Aligned( size_t )
 }
 
 #[inline(always)]
-unsafe fn allocate( requested_size: usize, kind: AllocationKind ) -> *mut c_void {
-    let effective_size = match requested_size.checked_add( mem::size_of::< InternalAllocationId >() ) {
-        Some( size ) => size,
-        None => return ptr::null_mut()
+pub(crate) unsafe fn allocate( requested_size: usize, kind: AllocationKind ) -> *mut c_void {
+    let out_of_band_alignment = match kind {
+        AllocationKind::Aligned( alignment ) if aligned_ids::should_use( alignment ) => Some( alignment ),
+        _ => None
     };
 
-    let mut thread = StrongThreadHandle::acquire();
-    let pointer =
+    let effective_size = if out_of_band_alignment.is_some() {
+        requested_size
+    } else {
+        match requested_size.checked_add( tracking_size() ) {
+            Some( size ) => size,
+            None => return ptr::null_mut()
+        }
+    };
+
+    let mut thread = if crate::global::is_bypassed() { None } else { StrongThreadHandle::acquire() };
+    let latency_start = allocator_latency::start();
+    let mut pointer =
         if !crate::global::using_unprefixed_jemalloc() {
             match kind {
                 AllocationKind::Malloc => {
@@ -253,30 +372,56 @@ unsafe fn allocate( requested_size: usize, kind: AllocationKind ) -> *mut c_void
         thread = None;
     }
 
+    let mut entry = None;
+    if let Some( alignment ) = out_of_band_alignment {
+        if !pointer.is_null() {
+            entry = aligned_ids::insert( pointer );
+            if entry.is_none() && get_allocation_metadata( pointer ).usable_size - requested_size < tracking_size() {
+                // The table is full, so this has to be made again with some space for a trailer.
+                free_real( pointer );
+                pointer = match requested_size.checked_add( tracking_size() ) {
+                    Some( effective_size ) => memalign_real( alignment, effective_size ),
+                    None => ptr::null_mut()
+                };
+            }
+        }
+    }
+
     let address = match NonZeroUsize::new( pointer as usize ) {
         Some( address ) => address,
         None => return pointer
     };
 
     let mut metadata = get_allocation_metadata( pointer );
-    let tracking_pointer = tracking_pointer( pointer, metadata.usable_size );
+    let slot = match entry {
+        Some( entry ) => TrackingSlot::OutOfBand( entry ),
+        None => TrackingSlot::Trailer( tracking_pointer( pointer, metadata.usable_size ) )
+    };
 
     let mut thread = if let Some( thread ) = thread {
         thread
     } else {
-        std::ptr::write_unaligned( tracking_pointer, InternalAllocationId::UNTRACKED );
+        slot.write( InternalAllocationId::UNTRACKED );
         return pointer;
     };
 
+    if !thread.should_sample( requested_size ) {
+        slot.write( InternalAllocationId::UNSAMPLED );
+        return pointer;
+    }
+
     let id = thread.on_new_allocation();
-    std::ptr::write_unaligned( tracking_pointer, id );
+    slot.write( id );
 
     let backtrace = unwind::grab( &mut thread );
+    allocator_latency::record( &mut thread, AllocatorCall::Allocate, latency_start, &backtrace );
 
     if matches!( kind, AllocationKind::Calloc ) {
         metadata.flags |= event::ALLOC_FLAG_CALLOC;
     }
 
+    metadata.flags |= sampling_flags();
+
     let allocation = InternalAllocation {
         address,
         size: requested_size as usize,
@@ -289,12 +434,12 @@ unsafe fn allocate( requested_size: usize, kind: AllocationKind ) -> *mut c_void
     pointer
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn malloc( size: size_t ) -> *mut c_void {
     allocate( size, AllocationKind::Malloc )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn calloc( count: size_t, element_size: size_t ) -> *mut c_void {
     let size = match count.checked_mul( element_size ) {
         None => return ptr::null_mut(),
@@ -305,7 +450,7 @@ pub unsafe extern "C" fn calloc( count: size_t, element_size: size_t ) -> *mut c
 }
 
 #[inline(always)]
-unsafe fn realloc_impl( old_pointer: *mut c_void, requested_size: size_t ) -> *mut c_void {
+pub(crate) unsafe fn realloc_impl( old_pointer: *mut c_void, requested_size: size_t ) -> *mut c_void {
     let old_address = match NonZeroUsize::new( old_pointer as usize ) {
         Some( old_address ) => old_address,
         None => return malloc( requested_size )
@@ -316,23 +461,29 @@ unsafe fn realloc_impl( old_pointer: *mut c_void, requested_size: size_t ) -> *m
         return ptr::null_mut();
     }
 
-    let effective_size = match requested_size.checked_add( mem::size_of::< InternalAllocationId >() ) {
+    let effective_size = match requested_size.checked_add( tracking_size() ) {
         Some( size ) => size,
         None => return ptr::null_mut()
     };
 
     let old_metadata = get_allocation_metadata( old_pointer );
-    let old_tracking_pointer = tracking_pointer( old_pointer, old_metadata.usable_size );
-    let id = std::ptr::read_unaligned( old_tracking_pointer );
+    let out_of_band_id = aligned_ids::get( old_pointer );
+    let id = match out_of_band_id {
+        Some( id ) => id,
+        None => read_tracking_id( tracking_pointer( old_pointer, old_metadata.usable_size ) )
+    };
     debug_assert!( id.is_valid() );
 
-    let mut thread = StrongThreadHandle::acquire();
-    let new_pointer = if !crate::global::using_unprefixed_jemalloc() {
+    let mut thread = if (id.is_untracked() || id.is_unsampled()) && crate::global::is_bypassed() { None } else { StrongThreadHandle::acquire() };
+    let latency_start = allocator_latency::start();
+    let new_pointer = if out_of_band_id.is_some() {
+        realloc_out_of_band( old_pointer, old_metadata.usable_size, requested_size, effective_size )
+    } else if !crate::global::using_unprefixed_jemalloc() {
         libc_realloc_real( old_pointer, effective_size )
     } else {
         jem_realloc_real( old_pointer, effective_size )
     };
-    if id.is_untracked() && !crate::global::is_actively_running() {
+    if (id.is_untracked() || id.is_unsampled()) && !crate::global::is_actively_running() {
         thread = None;
     }
 
@@ -344,23 +495,53 @@ unsafe fn realloc_impl( old_pointer: *mut c_void, requested_size: size_t ) -> *m
         } else {
             let new_metadata = get_allocation_metadata( new_pointer );
             let new_tracking_pointer = tracking_pointer( new_pointer, new_metadata.usable_size );
-            std::ptr::write_unaligned( new_tracking_pointer, InternalAllocationId::UNTRACKED );
+            write_tracking_id( new_tracking_pointer, InternalAllocationId::UNTRACKED );
 
             return new_pointer;
         }
     };
 
+    if id.is_unsampled() {
+        // We've never emitted anything for the old allocation, so treat this as a brand new one.
+        if let Some( new_address ) = NonZeroUsize::new( new_pointer as usize ) {
+            let new_metadata = get_allocation_metadata( new_pointer );
+            let new_tracking_pointer = tracking_pointer( new_pointer, new_metadata.usable_size );
+            if !thread.should_sample( requested_size ) {
+                write_tracking_id( new_tracking_pointer, InternalAllocationId::UNSAMPLED );
+                return new_pointer;
+            }
+
+            let new_id = thread.on_new_allocation();
+            write_tracking_id( new_tracking_pointer, new_id );
+
+            let backtrace = unwind::grab( &mut thread );
+            allocator_latency::record( &mut thread, AllocatorCall::Reallocate, latency_start, &backtrace );
+            let allocation = InternalAllocation {
+                address: new_address,
+                size: requested_size as usize,
+                flags: new_metadata.flags | sampling_flags(),
+                tid: thread.system_tid(),
+                extra_usable_space: (new_metadata.usable_size - requested_size) as u32,
+            };
+
+            on_allocation( new_id, allocation, backtrace, thread );
+        }
+
+        return new_pointer;
+    }
+
     let backtrace = unwind::grab( &mut thread );
+    allocator_latency::record( &mut thread, AllocatorCall::Reallocate, latency_start, &backtrace );
 
     if let Some( new_address ) = NonZeroUsize::new( new_pointer as usize ) {
         let new_metadata = get_allocation_metadata( new_pointer );
         let new_tracking_pointer = tracking_pointer( new_pointer, new_metadata.usable_size );
-        std::ptr::write_unaligned( new_tracking_pointer, id );
+        write_tracking_id( new_tracking_pointer, id );
 
         let allocation = InternalAllocation {
             address: new_address,
             size: requested_size as usize,
-            flags: new_metadata.flags,
+            flags: new_metadata.flags | sampling_flags(),
             tid: thread.system_tid(),
             extra_usable_space: (new_metadata.usable_size - requested_size) as u32,
         };
@@ -373,12 +554,12 @@ unsafe fn realloc_impl( old_pointer: *mut c_void, requested_size: size_t ) -> *m
     }
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn realloc( old_ptr: *mut c_void, size: size_t ) -> *mut c_void {
     realloc_impl( old_ptr, size )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn reallocarray( old_ptr: *mut c_void, count: size_t, element_size: size_t ) -> *mut c_void {
     let size = match (count as usize).checked_mul( element_size as usize ) {
         None => {
@@ -391,40 +572,43 @@ pub unsafe extern "C" fn reallocarray( old_ptr: *mut c_void, count: size_t, elem
     realloc_impl( old_ptr, size )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn free( pointer: *mut c_void ) {
     let address = match NonZeroUsize::new( pointer as usize ) {
         Some( address ) => address,
         None => return
     };
 
-    let metadata = get_allocation_metadata( pointer );
-    let tracking_pointer = tracking_pointer( pointer, metadata.usable_size );
-    let id = std::ptr::read_unaligned( tracking_pointer );
+    // This has to be taken out of the table before the allocation is freed and its address can be reused.
+    let id = match aligned_ids::take( pointer ) {
+        Some( id ) => id,
+        None => read_tracking_id( tracking_pointer( pointer, get_allocation_metadata( pointer ).usable_size ) )
+    };
     debug_assert!( id.is_valid() );
 
-    let mut thread = StrongThreadHandle::acquire();
-    if !crate::global::using_unprefixed_jemalloc() {
-        libc_free_real( pointer );
-    } else {
-        jem_free_real( pointer );
-    }
+    let mut thread = if id.is_unsampled() || (id.is_untracked() && crate::global::is_bypassed()) { None } else { StrongThreadHandle::acquire() };
+    let latency_start = allocator_latency::start();
+    free_real( pointer );
 
-    if id.is_untracked() && !crate::global::is_actively_running() {
+    if id.is_unsampled() || (id.is_untracked() && !crate::global::is_actively_running()) {
         thread = None;
     }
 
     let mut thread = if let Some( thread ) = thread { thread } else { return };
-    let backtrace = if opt::get().grab_backtraces_on_free {
-        Some( unwind::grab( &mut thread ) )
+    let backtrace = if opt::grab_backtraces_on_free() {
+        Some( unwind::grab_on_free( &mut thread ) )
     } else {
         None
     };
 
+    if let Some( ref backtrace ) = backtrace {
+        allocator_latency::record( &mut thread, AllocatorCall::Deallocate, latency_start, backtrace );
+    }
+
     on_free( id, address, backtrace, thread );
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_malloc( requested_size: size_t ) -> *mut c_void {
     let pointer = jemalloc_allocate( requested_size, JeAllocationKind::Malloc );
     #[cfg(feature = "debug-logs")]
@@ -440,7 +624,7 @@ enum JeAllocationKind {
     AlignedAlloc( size_t )
 }
 
-fn translate_jemalloc_flags( flags: c_int ) -> u32 {
+pub fn translate_jemalloc_flags( flags: c_int ) -> u32 {
     const MALLOCX_ZERO: c_int = 0x40;
 
     let mut internal_flags = event::ALLOC_FLAG_JEMALLOC;
@@ -452,12 +636,13 @@ fn translate_jemalloc_flags( flags: c_int ) -> u32 {
 }
 
 unsafe fn jemalloc_allocate( requested_size: usize, kind: JeAllocationKind ) -> *mut c_void {
-    let effective_size = match requested_size.checked_add( mem::size_of::< InternalAllocationId >() ) {
+    let effective_size = match requested_size.checked_add( tracking_size() ) {
         Some( size ) => size,
         None => return ptr::null_mut()
     };
 
-    let mut thread = StrongThreadHandle::acquire();
+    let mut thread = if crate::global::is_bypassed() { None } else { StrongThreadHandle::acquire() };
+    let latency_start = allocator_latency::start();
     let (pointer, flags) = match kind {
         JeAllocationKind::Malloc => (jem_malloc_real( effective_size ), event::ALLOC_FLAG_JEMALLOC),
         JeAllocationKind::MallocX( flags ) => (jem_mallocx_real( effective_size, flags ), translate_jemalloc_flags( flags )),
@@ -482,18 +667,24 @@ unsafe fn jemalloc_allocate( requested_size: usize, kind: JeAllocationKind ) ->
     let mut thread = if let Some( thread ) = thread {
         thread
     } else {
-        std::ptr::write_unaligned( tracking_pointer, InternalAllocationId::UNTRACKED );
+        write_tracking_id( tracking_pointer, InternalAllocationId::UNTRACKED );
         return pointer;
     };
 
+    if !thread.should_sample( requested_size ) {
+        write_tracking_id( tracking_pointer, InternalAllocationId::UNSAMPLED );
+        return pointer;
+    }
+
     let id = thread.on_new_allocation();
-    std::ptr::write_unaligned( tracking_pointer, id );
+    write_tracking_id( tracking_pointer, id );
 
     let backtrace = unwind::grab( &mut thread );
+    allocator_latency::record( &mut thread, AllocatorCall::Allocate, latency_start, &backtrace );
     let allocation = InternalAllocation {
         address,
         size: requested_size as usize,
-        flags,
+        flags: flags | sampling_flags(),
         tid: thread.system_tid(),
         extra_usable_space: 0,
     };
@@ -502,7 +693,7 @@ unsafe fn jemalloc_allocate( requested_size: usize, kind: JeAllocationKind ) ->
     pointer
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_mallocx( requested_size: size_t, flags: c_int ) -> *mut c_void {
     let pointer = jemalloc_allocate( requested_size, JeAllocationKind::MallocX( flags ) );
     #[cfg(feature = "debug-logs")]
@@ -510,7 +701,7 @@ pub unsafe extern "C" fn _rjem_mallocx( requested_size: size_t, flags: c_int ) -
     pointer
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_calloc( count: size_t, element_size: size_t ) -> *mut c_void {
     let requested_size = match count.checked_mul( element_size ) {
         None => return ptr::null_mut(),
@@ -523,46 +714,67 @@ pub unsafe extern "C" fn _rjem_calloc( count: size_t, element_size: size_t ) ->
     pointer
 }
 
-#[cfg_attr(not(test), no_mangle)]
-pub unsafe extern "C" fn _rjem_sdallocx( pointer: *mut c_void, requested_size: size_t, flags: c_int ) {
-    #[cfg(feature = "debug-logs")]
-    trace!( "_rjem_sdallocx: pointer=0x{:X} requested_size={} flags={}", pointer as usize, requested_size, flags );
+enum JeDeallocationKind {
+    Free,
+    DallocX( c_int ),
+    SdallocX( size_t, c_int )
+}
 
+unsafe fn jemalloc_deallocate( pointer: *mut c_void, kind: JeDeallocationKind ) {
     let address = match NonZeroUsize::new( pointer as usize ) {
         Some( address ) => address,
         None => return
     };
 
-    let effective_size = match requested_size.checked_add( mem::size_of::< InternalAllocationId >() ) {
-        Some( size ) => size,
-        None => return
-    };
-
     let usable_size = jem_malloc_usable_size_real( pointer );
-    debug_assert!( usable_size >= effective_size, "tried to deallocate an allocation without space for the tracking pointer: 0x{:X}", pointer as usize );
     let tracking_pointer = tracking_pointer( pointer, usable_size );
-    let id = std::ptr::read_unaligned( tracking_pointer );
+    let id = read_tracking_id( tracking_pointer );
     debug_assert!( id.is_valid() );
 
-    let mut thread = StrongThreadHandle::acquire();
-    jem_sdallocx_real( pointer, effective_size, flags );
+    let mut thread = if id.is_unsampled() || (id.is_untracked() && crate::global::is_bypassed()) { None } else { StrongThreadHandle::acquire() };
+    let latency_start = allocator_latency::start();
+    match kind {
+        JeDeallocationKind::Free => jem_free_real( pointer ),
+        JeDeallocationKind::DallocX( flags ) => jem_dallocx_real( pointer, flags ),
+        JeDeallocationKind::SdallocX( requested_size, flags ) => {
+            let effective_size = requested_size + tracking_size();
+            debug_assert!( usable_size >= effective_size, "tried to deallocate an allocation without space for the tracking pointer: 0x{:X}", pointer as usize );
+            jem_sdallocx_real( pointer, effective_size, flags )
+        }
+    }
 
-    if id.is_untracked() && !crate::global::is_actively_running() {
+    if id.is_unsampled() || (id.is_untracked() && !crate::global::is_actively_running()) {
         thread = None;
     }
 
     let mut thread = if let Some( thread ) = thread { thread } else { return };
     let backtrace =
-        if opt::get().grab_backtraces_on_free {
-            Some( unwind::grab( &mut thread ) )
+        if opt::grab_backtraces_on_free() {
+            Some( unwind::grab_on_free( &mut thread ) )
         } else {
             None
         };
 
+    if let Some( ref backtrace ) = backtrace {
+        allocator_latency::record( &mut thread, AllocatorCall::Deallocate, latency_start, backtrace );
+    }
+
     on_free( id, address, backtrace, thread );
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn _rjem_sdallocx( pointer: *mut c_void, requested_size: size_t, flags: c_int ) {
+    #[cfg(feature = "debug-logs")]
+    trace!( "_rjem_sdallocx: pointer=0x{:X} requested_size={} flags={}", pointer as usize, requested_size, flags );
+
+    if requested_size.checked_add( tracking_size() ).is_none() {
+        return;
+    }
+
+    jemalloc_deallocate( pointer, JeDeallocationKind::SdallocX( requested_size, flags ) );
+}
+
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_realloc( old_pointer: *mut c_void, requested_size: size_t ) -> *mut c_void {
     let new_pointer = jemalloc_reallocate( old_pointer, requested_size, None );
     #[cfg(feature = "debug-logs")]
@@ -570,7 +782,7 @@ pub unsafe extern "C" fn _rjem_realloc( old_pointer: *mut c_void, requested_size
     new_pointer
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_rallocx( old_pointer: *mut c_void, requested_size: size_t, flags: c_int ) -> *mut c_void {
     let new_pointer = jemalloc_reallocate( old_pointer, requested_size, Some( flags ) );
     #[cfg(feature = "debug-logs")]
@@ -589,23 +801,24 @@ unsafe fn jemalloc_reallocate( old_pointer: *mut c_void, requested_size: size_t,
             }
     };
 
-    let effective_size = match requested_size.checked_add( mem::size_of::< InternalAllocationId >() ) {
+    let effective_size = match requested_size.checked_add( tracking_size() ) {
         Some( size ) => size,
         None => return ptr::null_mut()
     };
 
     let old_usable_size = jem_malloc_usable_size_real( old_pointer );
     let old_tracking_pointer = tracking_pointer( old_pointer, old_usable_size );
-    let id = std::ptr::read_unaligned( old_tracking_pointer );
+    let id = read_tracking_id( old_tracking_pointer );
     debug_assert!( id.is_valid() );
 
-    let mut thread = StrongThreadHandle::acquire();
+    let mut thread = if (id.is_untracked() || id.is_unsampled()) && crate::global::is_bypassed() { None } else { StrongThreadHandle::acquire() };
+    let latency_start = allocator_latency::start();
     let (new_pointer, flags) = if let Some( flags ) = flags {
         (jem_rallocx_real( old_pointer, effective_size, flags ), translate_jemalloc_flags( flags ))
     } else {
         (jem_realloc_real( old_pointer, effective_size ), translate_jemalloc_flags( 0 ))
     };
-    if id.is_untracked() && !crate::global::is_actively_running() {
+    if (id.is_untracked() || id.is_unsampled()) && !crate::global::is_actively_running() {
         thread = None;
     }
 
@@ -618,24 +831,55 @@ unsafe fn jemalloc_reallocate( old_pointer: *mut c_void, requested_size: size_t,
             let new_usable_size = jem_malloc_usable_size_real( new_pointer );
             debug_assert!( new_usable_size >= effective_size );
             let new_tracking_pointer = tracking_pointer( new_pointer, new_usable_size );
-            std::ptr::write_unaligned( new_tracking_pointer, InternalAllocationId::UNTRACKED );
+            write_tracking_id( new_tracking_pointer, InternalAllocationId::UNTRACKED );
 
             return new_pointer;
         }
     };
 
+    if id.is_unsampled() {
+        // We've never emitted anything for the old allocation, so treat this as a brand new one.
+        if let Some( new_address ) = NonZeroUsize::new( new_pointer as usize ) {
+            let new_usable_size = jem_malloc_usable_size_real( new_pointer );
+            debug_assert!( new_usable_size >= effective_size );
+            let new_tracking_pointer = tracking_pointer( new_pointer, new_usable_size );
+            if !thread.should_sample( requested_size ) {
+                write_tracking_id( new_tracking_pointer, InternalAllocationId::UNSAMPLED );
+                return new_pointer;
+            }
+
+            let new_id = thread.on_new_allocation();
+            write_tracking_id( new_tracking_pointer, new_id );
+
+            let backtrace = unwind::grab( &mut thread );
+            allocator_latency::record( &mut thread, AllocatorCall::Reallocate, latency_start, &backtrace );
+            let allocation = InternalAllocation {
+                address: new_address,
+                size: requested_size as usize,
+                flags: flags | sampling_flags(),
+                tid: thread.system_tid(),
+                extra_usable_space: 0,
+            };
+
+            on_allocation( new_id, allocation, backtrace, thread );
+        }
+
+        return new_pointer;
+    }
+
     let backtrace = unwind::grab( &mut thread );
+    allocator_latency::record( &mut thread, AllocatorCall::Reallocate, latency_start, &backtrace );
 
     if let Some( new_address ) = NonZeroUsize::new( new_pointer as usize ) {
         let new_usable_size = jem_malloc_usable_size_real( new_pointer );
         debug_assert!( new_usable_size >= effective_size );
         let new_tracking_pointer = tracking_pointer( new_pointer, new_usable_size );
-        std::ptr::write_unaligned( new_tracking_pointer, id );
+        write_tracking_id( new_tracking_pointer, id );
 
         let allocation = InternalAllocation {
             address: new_address,
             size: requested_size as usize,
-            flags,
+            flags: flags | sampling_flags(),
             tid: thread.system_tid(),
             extra_usable_space: 0,
         };
@@ -648,27 +892,27 @@ unsafe fn jemalloc_reallocate( old_pointer: *mut c_void, requested_size: size_t,
     }
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_xallocx( pointer: *mut c_void, requested_size: size_t, extra: size_t, flags: c_int ) -> size_t {
     let address = match NonZeroUsize::new( pointer as usize ) {
         Some( address ) => address,
         None => return 0
     };
 
-    let effective_size = match requested_size.checked_add( mem::size_of::< InternalAllocationId >() ) {
+    let effective_size = match requested_size.checked_add( tracking_size() ) {
         Some( size ) => size,
         None => return _rjem_malloc_usable_size( pointer )
     };
 
     let old_usable_size = jem_malloc_usable_size_real( pointer );
     let old_tracking_pointer = tracking_pointer( pointer, old_usable_size );
-    let id = std::ptr::read_unaligned( old_tracking_pointer );
+    let id = read_tracking_id( old_tracking_pointer );
     debug_assert!( id.is_valid() );
 
-    let mut thread = StrongThreadHandle::acquire();
+    let mut thread = if (id.is_untracked() || id.is_unsampled()) && crate::global::is_bypassed() { None } else { StrongThreadHandle::acquire() };
     let new_effective_size = jem_xallocx_real( pointer, effective_size, extra, flags );
-    let new_requested_size = new_effective_size.checked_sub( mem::size_of::< InternalAllocationId >() ).expect( "_rjem_xallocx: underflow" );
-    if id.is_untracked() && !crate::global::is_actively_running() {
+    let new_requested_size = new_effective_size.checked_sub( tracking_size() ).expect( "_rjem_xallocx: underflow" );
+    if (id.is_untracked() || id.is_unsampled()) && !crate::global::is_actively_running() {
         thread = None;
     }
 
@@ -678,22 +922,31 @@ pub unsafe extern "C" fn _rjem_xallocx( pointer: *mut c_void, requested_size: si
         let new_usable_size = jem_malloc_usable_size_real( pointer );
         debug_assert!( new_usable_size >= effective_size );
         let new_tracking_pointer = tracking_pointer( pointer, new_usable_size );
-        std::ptr::write_unaligned( new_tracking_pointer, InternalAllocationId::UNTRACKED );
+        write_tracking_id( new_tracking_pointer, InternalAllocationId::UNTRACKED );
 
         return new_requested_size;
     };
 
+    if id.is_unsampled() {
+        let new_usable_size = jem_malloc_usable_size_real( pointer );
+        debug_assert!( new_usable_size >= effective_size );
+        let new_tracking_pointer = tracking_pointer( pointer, new_usable_size );
+        write_tracking_id( new_tracking_pointer, InternalAllocationId::UNSAMPLED );
+
+        return new_requested_size;
+    }
+
     let backtrace = unwind::grab( &mut thread );
 
     let new_usable_size = jem_malloc_usable_size_real( pointer );
     debug_assert!( new_usable_size >= effective_size );
     let new_tracking_pointer = tracking_pointer( pointer, new_usable_size );
-    std::ptr::write_unaligned( new_tracking_pointer, id );
+    write_tracking_id( new_tracking_pointer, id );
 
     let allocation = InternalAllocation {
         address: address,
         size: new_requested_size as usize,
-        flags: translate_jemalloc_flags( flags ),
+        flags: translate_jemalloc_flags( flags ) | sampling_flags(),
         tid: thread.system_tid(),
         extra_usable_space: 0,
     };
@@ -702,36 +955,55 @@ pub unsafe extern "C" fn _rjem_xallocx( pointer: *mut c_void, requested_size: si
     new_requested_size
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_nallocx( requested_size: size_t, flags: c_int ) -> size_t {
-    let effective_size = match requested_size.checked_add( mem::size_of::< InternalAllocationId >() ) {
+    let effective_size = match requested_size.checked_add( tracking_size() ) {
         Some( size ) => size,
         None => return 0
     };
 
-    jem_nallocx_real( effective_size, flags ).checked_sub( mem::size_of::< InternalAllocationId >() ).expect( "_rjem_nallocx: underflow" )
+    jem_nallocx_real( effective_size, flags ).checked_sub( tracking_size() ).expect( "_rjem_nallocx: underflow" )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_malloc_usable_size( pointer: *mut c_void ) -> size_t {
     let usable_size = jem_malloc_usable_size_real( pointer );
-    match usable_size.checked_sub( mem::size_of::< InternalAllocationId >() ) {
+    if aligned_ids::get( pointer ).is_some() {
+        return usable_size;
+    }
+
+    match usable_size.checked_sub( tracking_size() ) {
         Some( size ) => {
-            debug_assert!( std::ptr::read_unaligned( tracking_pointer( pointer, usable_size ) ).is_valid() );
+            debug_assert!( read_tracking_id( tracking_pointer( pointer, usable_size ) ).is_valid() );
             size
         },
         None => panic!( "_rjem_malloc_usable_size: underflow (pointer=0x{:016X}, usable_size={})", pointer as usize , usable_size )
     }
 }
 
-#[cfg_attr(not(test), no_mangle)]
-pub unsafe extern "C" fn _rjem_mallctl( name: *const libc::c_char, _oldp: *mut c_void, _oldlenp: *mut size_t, _newp: *mut c_void, _newlen: size_t ) -> c_int {
-    warn!( "unimplemented: rjem_mallctl called: name={:?}", std::ffi::CStr::from_ptr( name ) );
+#[cfg(feature = "jemalloc")]
+#[test]
+fn test_malloc_usable_size_of_page_aligned_allocation() {
+    unsafe {
+        let mut pointer = ptr::null_mut();
+        assert_eq!( posix_memalign( &mut pointer, 4096, 4096 ), 0 );
+        assert!( aligned_ids::get( pointer ).is_some() );
 
-    0
+        // The ID is kept out of band, so there's no trailer to subtract.
+        assert_eq!( malloc_usable_size( pointer ), jem_malloc_usable_size_real( pointer ) );
+        assert!( malloc_usable_size( pointer ) >= 4096 );
+
+        free( pointer );
+        assert!( aligned_ids::get( pointer ).is_none() );
+    }
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn _rjem_mallctl( name: *const libc::c_char, oldp: *mut c_void, oldlenp: *mut size_t, newp: *mut c_void, newlen: size_t ) -> c_int {
+    jem_mallctl_real( name, oldp, oldlenp, newp, newlen )
+}
+
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_posix_memalign( memptr: *mut *mut c_void, alignment: size_t, requested_size: size_t ) -> c_int {
     if memptr.is_null() {
         return libc::EINVAL;
@@ -752,7 +1024,7 @@ pub unsafe extern "C" fn _rjem_posix_memalign( memptr: *mut *mut c_void, alignme
     }
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_aligned_alloc( alignment: size_t, size: size_t ) -> *mut c_void {
     if !alignment.is_power_of_two() || size % alignment != 0 {
         *libc::__errno_location() = libc::EINVAL;
@@ -762,61 +1034,41 @@ pub unsafe extern "C" fn _rjem_aligned_alloc( alignment: size_t, size: size_t )
     jemalloc_allocate( size, JeAllocationKind::AlignedAlloc( alignment ) )
 }
 
-#[cfg_attr(not(test), no_mangle)]
-pub unsafe extern "C" fn _rjem_memalign( _alignment: size_t, _size: size_t ) -> *mut c_void {
-    todo!( "_rjem_memalign" );
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn _rjem_memalign( alignment: size_t, size: size_t ) -> *mut c_void {
+    jemalloc_allocate( size, JeAllocationKind::Memalign( alignment ) )
 }
 
-#[cfg_attr(not(test), no_mangle)]
-pub unsafe extern "C" fn _rjem_valloc( _alignment: size_t, _size: size_t ) -> *mut c_void {
-    todo!( "_rjem_valloc" );
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn _rjem_valloc( size: size_t ) -> *mut c_void {
+    jemalloc_allocate( size, JeAllocationKind::Memalign( crate::PAGE_SIZE ) )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_free( pointer: *mut c_void ) {
-    let address = match NonZeroUsize::new( pointer as usize ) {
-        Some( address ) => address,
-        None => return
-    };
-
-    let usable_size = jem_malloc_usable_size_real( pointer );
-    let tracking_pointer = tracking_pointer( pointer, usable_size );
-    let id = std::ptr::read_unaligned( tracking_pointer );
-    debug_assert!( id.is_valid() );
-
-    let mut thread = StrongThreadHandle::acquire();
-    jem_free_real( pointer );
-
-    if id.is_untracked() && !crate::global::is_actively_running() {
-        thread = None;
-    }
-
-    let mut thread = if let Some( thread ) = thread { thread } else { return };
-    let backtrace = if opt::get().grab_backtraces_on_free {
-        Some( unwind::grab( &mut thread ) )
-    } else {
-        None
-    };
-
-    on_free( id, address, backtrace, thread );
+    jemalloc_deallocate( pointer, JeDeallocationKind::Free );
 }
 
-#[cfg_attr(not(test), no_mangle)]
-pub unsafe extern "C" fn _rjem_sallocx( _pointer: *const c_void, _flags: c_int ) -> size_t {
-    todo!( "_rjem_sallocx" );
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn _rjem_sallocx( pointer: *const c_void, flags: c_int ) -> size_t {
+    let usable_size = jem_sallocx_real( pointer, flags );
+    match usable_size.checked_sub( tracking_size() ) {
+        Some( size ) => size,
+        None => panic!( "_rjem_sallocx: underflow (pointer=0x{:016X}, usable_size={})", pointer as usize , usable_size )
+    }
 }
 
-#[cfg_attr(not(test), no_mangle)]
-pub unsafe extern "C" fn _rjem_dallocx( _pointer: *mut c_void, _flags: c_int ) {
-    todo!( "_rjem_dallocx" );
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn _rjem_dallocx( pointer: *mut c_void, flags: c_int ) {
+    jemalloc_deallocate( pointer, JeDeallocationKind::DallocX( flags ) );
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_mallctlnametomib( name: *const libc::c_char, mibp: *mut size_t, miblenp: *mut size_t ) -> c_int {
     jem_mallctlnametomib_real( name, mibp, miblenp )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_mallctlbymib(
     mib: *const size_t,
     miblen: size_t,
@@ -828,7 +1080,7 @@ pub unsafe extern "C" fn _rjem_mallctlbymib(
     jem_mallctlbymib_real( mib, miblen, oldp, oldpenp, newp, newlen )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn _rjem_malloc_stats_print(
     write_cb: Option< unsafe extern "C" fn( *mut c_void, *const libc::c_char ) >,
     cbopaque: *mut c_void,
@@ -837,7 +1089,7 @@ pub unsafe extern "C" fn _rjem_malloc_stats_print(
     jem_malloc_stats_print_real( write_cb, cbopaque, opts )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn posix_memalign( memptr: *mut *mut c_void, alignment: size_t, requested_size: size_t ) -> c_int {
     if memptr.is_null() {
         return libc::EINVAL;
@@ -858,12 +1110,12 @@ pub unsafe extern "C" fn posix_memalign( memptr: *mut *mut c_void, alignment: si
     }
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn mmap( addr: *mut c_void, length: size_t, prot: c_int, flags: c_int, fildes: c_int, off: off_t ) -> *mut c_void {
     mmap_internal( addr, length, prot, flags, fildes, off as libc::off64_t, MapKind::Mmap )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn mmap64( addr: *mut c_void, length: size_t, prot: c_int, flags: c_int, fildes: c_int, off: libc::off64_t ) -> *mut c_void {
     mmap_internal( addr, length, prot, flags, fildes, off, MapKind::Mmap )
 }
@@ -893,20 +1145,19 @@ unsafe fn call_mmap( addr: *mut c_void, length: size_t, prot: c_int, flags: c_in
 
 #[inline(always)]
 unsafe fn mmap_internal( addr: *mut c_void, length: size_t, prot: c_int, flags: c_int, fildes: c_int, off: libc::off64_t, kind: MapKind ) -> *mut c_void {
-    if !opt::is_initialized() || !opt::get().gather_maps {
+    if !opt::is_initialized() || !opt::gather_maps() {
         return syscall::mmap( addr, length, prot, flags, fildes, off );
     }
 
     let id = crate::global::next_map_id();
     if let Some( mut thread ) = crate::global::acquire_any_thread_handle() {
         if let Some( backtrace ) = unwind::grab_from_any( &mut thread ) {
-            let mut maps_registry = crate::global::MMAP_REGISTRY.lock().unwrap();
             let timestamp = get_timestamp();
             let ptr = call_mmap( addr, length, prot, flags, fildes, off );
             if ptr != libc::MAP_FAILED {
                 let range = ptr as u64..ptr as u64 + length as u64;
-                let source = MapSource { timestamp, backtrace: backtrace.clone(), tid: thread.system_tid() };
-                maps_registry.on_mmap(
+                let source = MapSource { timestamp, backtrace, tid: thread.system_tid() };
+                crate::smaps::on_mmap(
                     id,
                     range,
                     source,
@@ -917,30 +1168,47 @@ unsafe fn mmap_internal( addr: *mut c_void, length: size_t, prot: c_int, flags:
                     off as u64
                 );
 
-                maps_registry.set_vma_name( ptr, length, id, kind );
+                crate::smaps::set_vma_name( ptr, length, id, kind );
             }
 
             return ptr;
         }
     }
 
-    let mut maps_registry = crate::global::MMAP_REGISTRY.lock().unwrap();
     let ptr = call_mmap( addr, length, prot, flags, fildes, off );
-    maps_registry.set_vma_name( ptr, length, id, kind );
+    if ptr != libc::MAP_FAILED {
+        crate::smaps::set_vma_name( ptr, length, id, kind );
+    }
 
     ptr
 }
 
+unsafe fn munmap_untracked( ptr: *mut c_void, length: size_t ) -> c_int {
+    if crate::global::is_pr_set_vma_anon_name_supported() {
+        return syscall::munmap( ptr, length );
+    }
+
+    let operation = crate::smaps::begin_map_operation();
+    let result = syscall::munmap( ptr, length );
+    if result == 0 {
+        operation.clear_vma_name( ptr, length );
+    } else {
+        operation.cancel();
+    }
+
+    result
+}
+
 #[inline(always)]
 unsafe extern "C" fn munmap_internal( ptr: *mut c_void, length: size_t ) -> c_int {
-    if !opt::is_initialized() || !opt::get().gather_maps {
+    if !opt::is_initialized() || !opt::gather_maps() {
         return syscall::munmap( ptr, length );
     }
 
     if let Some( mut thread ) = crate::global::acquire_any_thread_handle() {
         if let Some( backtrace ) = unwind::grab_from_any( &mut thread ) {
-            let mut maps_registry = crate::global::MMAP_REGISTRY.lock().unwrap();
             let timestamp = get_timestamp();
+            let operation = crate::smaps::begin_map_operation();
             let result;
             if !crate::global::is_pr_set_vma_anon_name_supported() {
                 result = syscall::mmap( ptr, length, 0, libc::MAP_PRIVATE | libc::MAP_FIXED, crate::global::dummy_memfd(), 0 ) != libc::MAP_FAILED;
@@ -950,36 +1218,30 @@ unsafe extern "C" fn munmap_internal( ptr: *mut c_void, length: size_t ) -> c_in
 
             if result {
                 let range = ptr as u64..ptr as u64 + length as u64;
-                let source = MapSource { timestamp, backtrace: backtrace.clone(), tid: thread.system_tid() };
-                maps_registry.on_munmap( range, source );
-                maps_registry.clear_vma_name( ptr, length );
-            }
-
-            if result {
+                let source = MapSource { timestamp, backtrace, tid: thread.system_tid() };
+                operation.on_munmap( range, source );
                 return 0;
             } else {
+                operation.cancel();
                 return -1;
             }
         }
     }
 
-    let mut maps_registry = crate::global::MMAP_REGISTRY.lock().unwrap();
-    let result = syscall::munmap( ptr, length );
-    maps_registry.clear_vma_name( ptr, length );
-    result
+    munmap_untracked( ptr, length )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn munmap( ptr: *mut c_void, length: size_t ) -> c_int {
     munmap_internal( ptr, length )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn __munmap( ptr: *mut c_void, length: size_t ) -> c_int {
     munmap_internal( ptr, length )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn mallopt( param: c_int, value: c_int ) -> c_int {
     if crate::global::using_unprefixed_jemalloc() {
         return 0;
@@ -1004,19 +1266,81 @@ pub unsafe extern "C" fn mallopt( param: c_int, value: c_int ) -> c_int {
     result
 }
 
-#[cfg_attr(not(test), no_mangle)]
+static SYM_MADVISE: AtomicUsize = AtomicUsize::new( 0 );
+
+// These aren't in the `libc` crate yet.
+const MADV_PAGEOUT: c_int = 21;
+const MADV_COLLAPSE: c_int = 25;
+
+// Only the advice which affects the transparent huge pages or which gives the memory
+// back to the kernel gets recorded; the rest doesn't change how much memory is used.
+fn is_tracked_advice( advice: c_int ) -> bool {
+    match advice {
+        libc::MADV_HUGEPAGE | libc::MADV_NOHUGEPAGE | MADV_COLLAPSE => true,
+        libc::MADV_DONTNEED | libc::MADV_FREE | libc::MADV_REMOVE | MADV_PAGEOUT => true,
+        _ => false
+    }
+}
+
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn madvise( addr: *mut c_void, length: size_t, advice: c_int ) -> c_int {
+    let original = resolve_next_symbol( &SYM_MADVISE, b"madvise\0" );
+    if original == 0 {
+        error!( "madvise call failed since we couldn't find the original symbol" );
+        *libc::__errno_location() = libc::ENOSYS;
+        return -1;
+    }
+
+    let original: unsafe extern "C" fn( *mut c_void, size_t, c_int ) -> c_int = mem::transmute( original );
+    if !is_tracked_advice( advice ) || !opt::is_initialized() || !opt::gather_maps() {
+        return original( addr, length, advice );
+    }
+
+    let thread = StrongThreadHandle::acquire();
+    let result = original( addr, length, advice );
+    if result != 0 {
+        return result;
+    }
+
+    let mut thread = if let Some( thread ) = thread { thread } else { return result };
+    let backtrace = unwind::grab( &mut thread );
+
+    let timestamp = get_timestamp();
+    send_event_throttled( || InternalEvent::MemoryAdvice {
+        address: addr as u64,
+        length: length as u64,
+        advice: advice as i32,
+        backtrace,
+        timestamp,
+        thread: thread.decay()
+    });
+
+    result
+}
+
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn fork() -> libc::pid_t {
+    let ring = crate::multiplex::prepare_for_fork();
     let pid = fork_real();
     if pid == 0 {
         crate::global::on_fork();
+        if crate::opt::is_initialized() && crate::opt::get().track_child_processes {
+            crate::processing_thread::export_data_id_to_child();
+            if let Some( ring ) = ring {
+                crate::multiplex::export_ring_to_child( ring );
+            }
+        }
     } else {
         info!( "Fork called; child PID: {}", pid );
+        if let Some( ring ) = ring {
+            crate::multiplex::on_child_forked( pid, ring );
+        }
     }
 
     pid
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn memalign( alignment: size_t, size: size_t ) -> *mut c_void {
     if !alignment.is_power_of_two() {
         *libc::__errno_location() = libc::EINVAL;
@@ -1025,7 +1349,7 @@ pub unsafe extern "C" fn memalign( alignment: size_t, size: size_t ) -> *mut c_v
     allocate( size, AllocationKind::Aligned( alignment ) )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn aligned_alloc( alignment: size_t, size: size_t ) -> *mut c_void {
     if !alignment.is_power_of_two() || size % alignment != 0 {
         *libc::__errno_location() = libc::EINVAL;
@@ -1034,12 +1358,12 @@ pub unsafe extern "C" fn aligned_alloc( alignment: size_t, size: size_t ) -> *mu
     allocate( size, AllocationKind::Aligned( alignment ) )
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn valloc( _size: size_t ) -> *mut c_void {
     unimplemented!( "'valloc' is unimplemented!" );
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn pvalloc( _size: size_t ) -> *mut c_void {
     unimplemented!( "'pvalloc' is unimplemented!" );
 }
@@ -1054,6 +1378,85 @@ pub unsafe extern "C" fn memory_profiler_set_marker( value: u32 ) {
     mem::drop( thread );
 }
 
+/// Tags every allocation made afterwards on the current thread, e.g. with the type of the request it's handling.
+///
+/// This only touches thread local storage; the tag is sent out along with the thread's next allocation.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_set_thread_tag( tag: u32 ) {
+    crate::global::set_thread_tag( tag );
+}
+
+/// Returns the current thread's tag, so that it can be restored after a nested scope.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_get_thread_tag() -> u32 {
+    crate::global::thread_tag()
+}
+
+/// Registers a custom pool or arena allocator; returns its ID, or zero if no more pools can be registered.
+///
+/// The `name` is only used for display and can be null.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_pool_create( name: *const c_char ) -> u32 {
+    crate::pools::create( &pool_name( name ), 0 )
+}
+
+/// Registers an external allocator, e.g. of a GPU's memory, whose memory lives in an address space of its own.
+///
+/// It returns a pool ID, so its allocations are reported through the `memory_profiler_pool_*` functions.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_external_allocator_create( name: *const c_char ) -> u32 {
+    crate::pools::create( &pool_name( name ), common::event::POOL_FLAG_DEVICE )
+}
+
+unsafe fn pool_name< 'a >( name: *const c_char ) -> std::borrow::Cow< 'a, str > {
+    if name.is_null() {
+        std::borrow::Cow::Borrowed( "" )
+    } else {
+        std::ffi::CStr::from_ptr( name ).to_string_lossy()
+    }
+}
+
+/// Reports an allocation which a pool has carved out of its own memory.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_pool_alloc( pool: u32, pointer: *mut c_void, size: size_t ) {
+    crate::pools::on_allocations( pool, std::iter::once( (pointer as usize, size) ) );
+}
+
+/// Reports `count` allocations from a pool at once; they'll all share a single backtrace.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_pool_alloc_many( pool: u32, pointers: *const *mut c_void, sizes: *const size_t, count: size_t ) {
+    if count == 0 || pointers.is_null() || sizes.is_null() {
+        return;
+    }
+
+    let pointers = std::slice::from_raw_parts( pointers, count );
+    let sizes = std::slice::from_raw_parts( sizes, count );
+    crate::pools::on_allocations( pool, pointers.iter().map( |&pointer| pointer as usize ).zip( sizes.iter().copied() ) );
+}
+
+/// Reports an allocation which was given back to its pool.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_pool_free( pool: u32, pointer: *mut c_void ) {
+    crate::pools::on_frees( pool, std::iter::once( pointer as usize ) );
+}
+
+/// Reports `count` allocations which were given back to their pool at once.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_pool_free_many( pool: u32, pointers: *const *mut c_void, count: size_t ) {
+    if count == 0 || pointers.is_null() {
+        return;
+    }
+
+    let pointers = std::slice::from_raw_parts( pointers, count );
+    crate::pools::on_frees( pool, pointers.iter().map( |&pointer| pointer as usize ) );
+}
+
+/// Frees every allocation from the pool which is still alive, e.g. when an arena is reset.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_pool_reset( pool: u32 ) {
+    crate::pools::on_reset( pool );
+}
+
 #[cfg_attr(not(test), no_mangle)]
 pub unsafe extern "C" fn memory_profiler_override_next_timestamp( timestamp: u64 ) {
     let thread = StrongThreadHandle::acquire();
@@ -1096,7 +1499,44 @@ pub unsafe extern "C" fn memory_profiler_sync() {
     debug!( "Sync finished" );
 }
 
+/// Copies the profiler's own unwinding statistics into the `output`: the number of backtraces grabbed,
+/// the total time spent grabbing them in nanoseconds, the hits and the misses of the 1st and of the 2nd
+/// level backtrace caches, and then the number of backtraces grabbed by walking the frame pointers and
+/// the number of times that had to fall back to the DWARF unwinder, in that order.
+///
+/// Returns how many values were copied; they're all zero unless `MEMORY_PROFILER_INSTRUMENTATION` is set.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_unwind_statistics( output: *mut u64, capacity: size_t ) -> size_t {
+    use crate::instrumentation::{self, Counter, Stage};
+
+    let (unwind_count, unwind_time) = instrumentation::totals( Stage::Unwind );
+    let values = [
+        unwind_count,
+        unwind_time,
+        instrumentation::counter_value( Counter::BacktraceCacheLevel1Hit ),
+        instrumentation::counter_value( Counter::BacktraceCacheLevel1Miss ),
+        instrumentation::counter_value( Counter::BacktraceCacheLevel2Hit ),
+        instrumentation::counter_value( Counter::BacktraceCacheLevel2Miss ),
+        instrumentation::counter_value( Counter::FramePointerUnwind ),
+        instrumentation::counter_value( Counter::FramePointerFallback )
+    ];
+
+    let count = std::cmp::min( capacity, values.len() );
+    if count > 0 {
+        std::ptr::copy_nonoverlapping( values.as_ptr(), output, count );
+    }
+
+    count
+}
+
+/// Writes out whatever the flight recorder has; has no effect unless `MEMORY_PROFILER_FLIGHT_RECORDER` is set.
 #[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn memory_profiler_dump_flight_recorder() {
+    debug!( "Dump of the flight recorder requested..." );
+    crate::flight_recorder::request_dump();
+}
+
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn __register_frame( fde: *const u8 ) {
     debug!( "Registering new frame: 0x{:016X}", fde as usize );
 
@@ -1111,7 +1551,7 @@ pub unsafe extern "C" fn __register_frame( fde: *const u8 ) {
     std::mem::drop( thread );
 }
 
-#[cfg_attr(not(test), no_mangle)]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
 pub unsafe extern "C" fn __deregister_frame( fde: *const u8 ) {
     debug!( "Deregistering new frame: 0x{:016X}", fde as usize );
 
@@ -1125,3 +1565,126 @@ pub unsafe extern "C" fn __deregister_frame( fde: *const u8 ) {
     unwind::deregister_frame_by_pointer( fde );
     std::mem::drop( thread );
 }
+
+unsafe fn resolve_next_symbol( cache: &AtomicUsize, name: &[u8] ) -> usize {
+    let mut address = cache.load( Ordering::Relaxed );
+    if address == 0 {
+        address = libc::dlsym( libc::RTLD_NEXT, name.as_ptr() as *const libc::c_char ) as usize;
+        cache.store( address, Ordering::Relaxed );
+    }
+
+    address
+}
+
+unsafe fn ucontext_stack( ucontext: *const libc::ucontext_t ) -> Option< std::ops::Range< usize > > {
+    let stack = &(*ucontext).uc_stack;
+    if stack.ss_sp.is_null() || stack.ss_size == 0 {
+        None
+    } else {
+        Some( stack.ss_sp as usize..stack.ss_sp as usize + stack.ss_size )
+    }
+}
+
+static SYM_SWAPCONTEXT: AtomicUsize = AtomicUsize::new( 0 );
+static SYM_SETCONTEXT: AtomicUsize = AtomicUsize::new( 0 );
+
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn swapcontext( saved_ucontext: *mut libc::ucontext_t, ucontext: *const libc::ucontext_t ) -> c_int {
+    let original = resolve_next_symbol( &SYM_SWAPCONTEXT, b"swapcontext\0" );
+    if original == 0 {
+        error!( "swapcontext call failed since we couldn't find the original symbol" );
+        *libc::__errno_location() = libc::ENOSYS;
+        return -1;
+    }
+
+    unwind::on_stack_switch( |unwind_state| {
+        unwind_state.on_swap_ucontext( Some( saved_ucontext as usize ), ucontext as usize, ucontext_stack( ucontext ) );
+    });
+
+    let original: unsafe extern "C" fn( *mut libc::ucontext_t, *const libc::ucontext_t ) -> c_int = mem::transmute( original );
+    original( saved_ucontext, ucontext )
+}
+
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn setcontext( ucontext: *const libc::ucontext_t ) -> c_int {
+    let original = resolve_next_symbol( &SYM_SETCONTEXT, b"setcontext\0" );
+    if original == 0 {
+        error!( "setcontext call failed since we couldn't find the original symbol" );
+        *libc::__errno_location() = libc::ENOSYS;
+        return -1;
+    }
+
+    unwind::on_stack_switch( |unwind_state| {
+        unwind_state.on_swap_ucontext( None, ucontext as usize, ucontext_stack( ucontext ) );
+    });
+
+    let original: unsafe extern "C" fn( *const libc::ucontext_t ) -> c_int = mem::transmute( original );
+    original( ucontext )
+}
+
+/// The `transfer_t` which is passed around by boost.context (1.61 and newer).
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+#[repr(C)]
+pub struct FcontextTransfer {
+    fcontext: *mut c_void,
+    data: *mut c_void
+}
+
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+static SYM_MAKE_FCONTEXT: AtomicUsize = AtomicUsize::new( 0 );
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+static SYM_JUMP_FCONTEXT: AtomicUsize = AtomicUsize::new( 0 );
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+static SYM_ONTOP_FCONTEXT: AtomicUsize = AtomicUsize::new( 0 );
+
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+unsafe fn resolve_fcontext_symbol( cache: &AtomicUsize, name: &[u8] ) -> usize {
+    let original = resolve_next_symbol( cache, name );
+    if original == 0 {
+        error!( "Failed to find the original `{}` symbol", String::from_utf8_lossy( &name[ ..name.len() - 1 ] ) );
+        libc::abort();
+    }
+
+    original
+}
+
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn make_fcontext( stack_pointer: *mut c_void, size: size_t, function: *mut c_void ) -> *mut c_void {
+    let original = resolve_fcontext_symbol( &SYM_MAKE_FCONTEXT, b"make_fcontext\0" );
+    let original: unsafe extern "C" fn( *mut c_void, size_t, *mut c_void ) -> *mut c_void = mem::transmute( original );
+    let fcontext = original( stack_pointer, size, function );
+
+    // The stack grows down, so the pointer we get is at the top of the stack.
+    unwind::on_stack_switch( |unwind_state| {
+        unwind_state.on_new_fcontext( fcontext as usize, stack_pointer as usize - size..stack_pointer as usize );
+    });
+
+    fcontext
+}
+
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn jump_fcontext( fcontext: *mut c_void, data: *mut c_void ) -> FcontextTransfer {
+    let original = resolve_fcontext_symbol( &SYM_JUMP_FCONTEXT, b"jump_fcontext\0" );
+    let original: unsafe extern "C" fn( *mut c_void, *mut c_void ) -> FcontextTransfer = mem::transmute( original );
+
+    unwind::on_stack_switch( |unwind_state| unwind_state.on_jump_fcontext( fcontext as usize ) );
+    let transfer = original( fcontext, data );
+    unwind::on_stack_switch( |unwind_state| unwind_state.on_returned_from_jump_fcontext( transfer.fcontext as usize ) );
+
+    transfer
+}
+
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
+#[cfg_attr(not(any(test, feature = "global-allocator")), no_mangle)]
+pub unsafe extern "C" fn ontop_fcontext( fcontext: *mut c_void, data: *mut c_void, function: *mut c_void ) -> FcontextTransfer {
+    let original = resolve_fcontext_symbol( &SYM_ONTOP_FCONTEXT, b"ontop_fcontext\0" );
+    let original: unsafe extern "C" fn( *mut c_void, *mut c_void, *mut c_void ) -> FcontextTransfer = mem::transmute( original );
+
+    unwind::on_stack_switch( |unwind_state| unwind_state.on_jump_fcontext( fcontext as usize ) );
+    let transfer = original( fcontext, data, function );
+    unwind::on_stack_switch( |unwind_state| unwind_state.on_returned_from_jump_fcontext( transfer.fcontext as usize ) );
+
+    transfer
+}
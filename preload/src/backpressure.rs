@@ -0,0 +1,245 @@
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, AtomicUsize, Ordering};
+use std::time::Duration;
+
+use crate::event::InternalEvent;
+use crate::opt;
+use crate::syscall;
+
+/// What to do when the events queued for the processing thread exceed the configured budget.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum BackpressurePolicy {
+    /// Don't do anything; the queues can grow without bound.
+    None,
+    /// Block the threads which are generating new events.
+    Block,
+    /// Only track a fraction of new allocations.
+    Sample,
+    /// Don't unwind the stack, and emit empty backtraces instead.
+    DropBacktraces
+}
+
+/// When degraded to sampling only one out of this many allocations is tracked.
+const DEGRADED_SAMPLING_RATE: u64 = 16;
+
+/// The maximum amount of time for which a single thread will be blocked for.
+const MAXIMUM_BLOCK_TIME: Duration = Duration::from_millis( 100 );
+
+/// This is only an estimate since this disregards any extra memory owned by the events.
+const EVENT_SIZE: usize = std::mem::size_of::< InternalEvent >();
+
+static QUEUED_BYTES: AtomicUsize = AtomicUsize::new( 0 );
+static IS_OVER_BUDGET: AtomicBool = AtomicBool::new( false );
+static BUDGET_GENERATION: AtomicU32 = AtomicU32::new( 0 );
+
+static THROTTLED_COUNT: AtomicU64 = AtomicU64::new( 0 );
+static BLOCKED_COUNT: AtomicU64 = AtomicU64::new( 0 );
+static SAMPLED_OUT_COUNT: AtomicU64 = AtomicU64::new( 0 );
+static DROPPED_BACKTRACE_COUNT: AtomicU64 = AtomicU64::new( 0 );
+
+#[derive(Copy, Clone, PartialEq, Eq, Default, Debug)]
+pub struct Counters {
+    /// How many times a thread had to wait for the allocation lock to be released.
+    pub throttled: u64,
+    /// How many times a thread was blocked because the budget was exceeded.
+    pub blocked: u64,
+    /// How many allocations weren't tracked because the budget was exceeded.
+    pub sampled_out: u64,
+    /// How many backtraces were dropped because the budget was exceeded.
+    pub dropped_backtraces: u64
+}
+
+pub fn counters() -> Counters {
+    Counters {
+        throttled: THROTTLED_COUNT.load( Ordering::Relaxed ),
+        blocked: BLOCKED_COUNT.load( Ordering::Relaxed ),
+        sampled_out: SAMPLED_OUT_COUNT.load( Ordering::Relaxed ),
+        dropped_backtraces: DROPPED_BACKTRACE_COUNT.load( Ordering::Relaxed )
+    }
+}
+
+/// Waits with an exponential backoff; first by yielding, and then by sleeping on a futex.
+pub struct Backoff {
+    iteration: u32,
+    total: Duration
+}
+
+impl Backoff {
+    const YIELD_ITERATIONS: u32 = 8;
+    const INITIAL_TIMEOUT: Duration = Duration::from_micros( 50 );
+    const MAXIMUM_TIMEOUT: Duration = Duration::from_millis( 10 );
+
+    pub fn new() -> Self {
+        Backoff {
+            iteration: 0,
+            total: Duration::from_secs( 0 )
+        }
+    }
+
+    /// The total amount of time spent sleeping so far.
+    pub fn total( &self ) -> Duration {
+        self.total
+    }
+
+    /// Waits until `futex` is woken up, or until it doesn't hold `expected`, or until a timeout.
+    pub fn wait( &mut self, futex: &AtomicU32, expected: u32 ) {
+        self.iteration += 1;
+        if self.iteration <= Self::YIELD_ITERATIONS {
+            std::thread::yield_now();
+            return;
+        }
+
+        let shift = std::cmp::min( self.iteration - Self::YIELD_ITERATIONS - 1, 16 );
+        let timeout = std::cmp::min( Self::INITIAL_TIMEOUT * (1 << shift), Self::MAXIMUM_TIMEOUT );
+        syscall::futex_wait( futex, expected, timeout );
+        self.total += timeout;
+    }
+}
+
+pub fn wake_all( futex: &AtomicU32 ) {
+    futex.fetch_add( 1, Ordering::Release );
+    syscall::futex_wake( futex, i32::MAX );
+}
+
+/// How many bytes worth of events are currently queued for the processing thread.
+///
+/// This is only tracked when a backpressure policy is set.
+pub fn queued_bytes() -> usize {
+    QUEUED_BYTES.load( Ordering::Relaxed )
+}
+
+pub fn on_throttled() {
+    THROTTLED_COUNT.fetch_add( 1, Ordering::Relaxed );
+}
+
+#[inline(always)]
+fn policy() -> BackpressurePolicy {
+    opt::get().backpressure_policy
+}
+
+/// Called by the threads which generate events from time to time, with the number of events they've queued since.
+pub fn on_events_queued( count: usize ) {
+    if policy() == BackpressurePolicy::None {
+        return;
+    }
+
+    let bytes = count * EVENT_SIZE;
+    let queued = QUEUED_BYTES.fetch_add( bytes, Ordering::Relaxed ) + bytes;
+    if queued > opt::get().backpressure_budget && !IS_OVER_BUDGET.load( Ordering::Relaxed ) {
+        IS_OVER_BUDGET.store( true, Ordering::Relaxed );
+    }
+}
+
+/// Called by the processing thread with the number of events it has received.
+pub fn on_events_received( count: usize ) {
+    if policy() == BackpressurePolicy::None || count == 0 {
+        return;
+    }
+
+    let bytes = count * EVENT_SIZE;
+    let previous = QUEUED_BYTES.fetch_update( Ordering::Relaxed, Ordering::Relaxed, |queued| Some( queued.saturating_sub( bytes ) ) ).unwrap();
+    let queued = previous.saturating_sub( bytes );
+    if queued <= opt::get().backpressure_budget && IS_OVER_BUDGET.load( Ordering::Relaxed ) {
+        IS_OVER_BUDGET.store( false, Ordering::Relaxed );
+        wake_all( &BUDGET_GENERATION );
+    }
+}
+
+#[inline(always)]
+pub fn is_over_budget() -> bool {
+    IS_OVER_BUDGET.load( Ordering::Relaxed )
+}
+
+/// Blocks the current thread until the queued events fit within the budget again, if necessary.
+///
+/// Must never be called while holding a `StrongThreadHandle`, since the processing thread
+/// might be waiting for it to be released.
+#[cold]
+#[inline(never)]
+pub fn on_over_budget() {
+    if policy() != BackpressurePolicy::Block {
+        return;
+    }
+
+    BLOCKED_COUNT.fetch_add( 1, Ordering::Relaxed );
+
+    let mut backoff = Backoff::new();
+    while is_over_budget() && crate::global::is_actively_running() && backoff.total() < MAXIMUM_BLOCK_TIME {
+        let generation = BUDGET_GENERATION.load( Ordering::Acquire );
+        if !is_over_budget() {
+            break;
+        }
+
+        backoff.wait( &BUDGET_GENERATION, generation );
+    }
+}
+
+/// Returns whether a new allocation should not be tracked, given a per-thread counter.
+#[inline(always)]
+pub fn should_sample_out( counter: &mut u64 ) -> bool {
+    if !is_over_budget() {
+        return false;
+    }
+
+    should_sample_out_slow( counter )
+}
+
+#[cold]
+#[inline(never)]
+fn should_sample_out_slow( counter: &mut u64 ) -> bool {
+    if policy() != BackpressurePolicy::Sample {
+        return false;
+    }
+
+    *counter += 1;
+    if *counter % DEGRADED_SAMPLING_RATE == 0 {
+        return false;
+    }
+
+    SAMPLED_OUT_COUNT.fetch_add( 1, Ordering::Relaxed );
+    true
+}
+
+/// Returns whether we should skip unwinding the stack.
+#[inline(always)]
+pub fn should_drop_backtrace() -> bool {
+    if !is_over_budget() || policy() != BackpressurePolicy::DropBacktraces {
+        return false;
+    }
+
+    DROPPED_BACKTRACE_COUNT.fetch_add( 1, Ordering::Relaxed );
+    true
+}
+
+/// Logs the counters if any of them changed since the last time this was called.
+pub fn log_counters( last_counters: &mut Counters ) {
+    let counters = counters();
+    if counters == *last_counters {
+        return;
+    }
+
+    *last_counters = counters;
+    info!(
+        "Backpressure: throttled = {}, blocked = {}, sampled out = {}, dropped backtraces = {}, queued = {} bytes",
+        counters.throttled,
+        counters.blocked,
+        counters.sampled_out,
+        counters.dropped_backtraces,
+        QUEUED_BYTES.load( Ordering::Relaxed )
+    );
+}
+
+#[test]
+fn test_backoff_escalates_to_sleeping() {
+    let futex = AtomicU32::new( 0 );
+    let mut backoff = Backoff::new();
+    for _ in 0..Backoff::YIELD_ITERATIONS {
+        backoff.wait( &futex, 0 );
+    }
+    assert_eq!( backoff.total(), Duration::from_secs( 0 ) );
+
+    backoff.wait( &futex, 0 );
+    assert_eq!( backoff.total(), Backoff::INITIAL_TIMEOUT );
+
+    backoff.wait( &futex, 0 );
+    assert_eq!( backoff.total(), Backoff::INITIAL_TIMEOUT * 3 );
+}
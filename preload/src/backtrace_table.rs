@@ -0,0 +1,242 @@
+use std::mem::ManuallyDrop;
+use std::sync::atomic::{AtomicPtr, AtomicU64, Ordering};
+
+use crate::unwind::{Backtrace, BacktraceHeader, BacktraceKey};
+
+/// How many slots we'll look at before we give up on interning a backtrace.
+const MAXIMUM_PROBE_COUNT: usize = 32;
+
+/// Every interned ID has this bit set, so it never collides with those assigned by the `BacktraceCache`.
+const INTERNED_ID_FLAG: u64 = 1 << 63;
+
+struct Slot {
+    key: AtomicU64,
+    backtrace: AtomicPtr< BacktraceHeader >
+}
+
+/// A lock-free, insert-only, open-addressed table of backtraces shared by all of the threads.
+///
+/// Allocating threads can intern a backtrace as soon as they grab it and only
+/// send its ID to the processing thread, which can then look the frames up
+/// when it first sees a given ID.
+///
+/// Since entries are never removed the ID of an interned backtrace is simply the index
+/// of the slot it's in; once the table fills up (or in case of a conflict) the backtrace
+/// has to be sent along with the event as usual.
+pub struct BacktraceTable {
+    slots: Box< [Slot] >,
+    mask: usize
+}
+
+impl BacktraceTable {
+    pub fn new( capacity: usize ) -> Self {
+        let capacity = std::cmp::max( capacity, 1 ).next_power_of_two();
+        let slots = (0..capacity).map( |_| Slot {
+            key: AtomicU64::new( 0 ),
+            backtrace: AtomicPtr::new( std::ptr::null_mut() )
+        }).collect();
+
+        BacktraceTable {
+            slots,
+            mask: capacity - 1
+        }
+    }
+
+    /// Only half of the key is stored in the slots, so the frames still have to be compared.
+    fn probe( &self, key: BacktraceKey ) -> (u64, impl Iterator< Item = usize >) {
+        // Zero marks an empty slot.
+        let key = match key as u64 ^ (key >> 64) as u64 {
+            0 => !0,
+            key => key
+        };
+
+        let mask = self.mask;
+        let first = (key ^ (key >> 32)) as usize & mask;
+        let indexes = (0..std::cmp::min( MAXIMUM_PROBE_COUNT, self.slots.len() )).map( move |offset| (first + offset) & mask );
+        (key, indexes)
+    }
+
+    pub fn intern( &self, backtrace: &Backtrace ) -> Option< u64 > {
+        if let Some( id ) = backtrace.interned_id() {
+            return Some( id );
+        }
+
+        let (key, indexes) = self.probe( backtrace.key() );
+        for index in indexes {
+            let slot = &self.slots[ index ];
+            let mut current_key = slot.key.load( Ordering::Acquire );
+            if current_key == 0 {
+                match slot.key.compare_exchange( 0, key, Ordering::AcqRel, Ordering::Acquire ) {
+                    Ok( _ ) => {
+                        slot.backtrace.store( backtrace.clone().into_raw(), Ordering::Release );
+
+                        let id = INTERNED_ID_FLAG | index as u64;
+                        backtrace.set_interned_id( id );
+                        return Some( id );
+                    },
+                    Err( key ) => {
+                        current_key = key;
+                    }
+                }
+            }
+
+            if current_key == key {
+                let pointer = slot.backtrace.load( Ordering::Acquire );
+                if pointer.is_null() {
+                    // Someone else is inserting this very backtrace right now.
+                    return None;
+                }
+
+                let interned = ManuallyDrop::new( unsafe { Backtrace::from_raw( pointer ) } );
+                if interned.frames() != backtrace.frames() {
+                    debug!( "Backtrace table conflict detected!" );
+                    return None;
+                }
+
+                let id = INTERNED_ID_FLAG | index as u64;
+                backtrace.set_interned_id( id );
+                return Some( id );
+            }
+        }
+
+        None
+    }
+
+    /// Returns an already interned backtrace with the given frames, if there is one.
+    ///
+    /// This lets a freshly unwound stack reuse what was already interned by any thread instead of allocating.
+    pub fn lookup( &self, key: BacktraceKey, frames: &[usize] ) -> Option< Backtrace > {
+        let (key, indexes) = self.probe( key );
+        for index in indexes {
+            let slot = &self.slots[ index ];
+            let current_key = slot.key.load( Ordering::Acquire );
+            if current_key == 0 {
+                // Entries are never removed, so the backtrace can't be any further.
+                return None;
+            }
+
+            if current_key != key {
+                continue;
+            }
+
+            let pointer = slot.backtrace.load( Ordering::Acquire );
+            if pointer.is_null() {
+                return None;
+            }
+
+            let interned = ManuallyDrop::new( unsafe { Backtrace::from_raw( pointer ) } );
+            if interned.frames() != frames {
+                return None;
+            }
+
+            return Some( (*interned).clone() );
+        }
+
+        None
+    }
+
+    /// Returns the backtrace with a given interned ID.
+    pub fn get( &self, id: u64 ) -> Option< Backtrace > {
+        let index = index_of( id )?;
+        let pointer = self.slots.get( index )?.backtrace.load( Ordering::Acquire );
+        if pointer.is_null() {
+            return None;
+        }
+
+        let interned = ManuallyDrop::new( unsafe { Backtrace::from_raw( pointer ) } );
+        Some( (*interned).clone() )
+    }
+}
+
+impl Drop for BacktraceTable {
+    fn drop( &mut self ) {
+        for slot in self.slots.iter_mut() {
+            let pointer = *slot.backtrace.get_mut();
+            if !pointer.is_null() {
+                std::mem::drop( unsafe { Backtrace::from_raw( pointer ) } );
+            }
+        }
+    }
+}
+
+/// Returns the index of the slot an interned ID refers to.
+pub fn index_of( id: u64 ) -> Option< usize > {
+    if id & INTERNED_ID_FLAG == 0 {
+        return None;
+    }
+
+    Some( (id & !INTERNED_ID_FLAG) as usize )
+}
+
+lazy_static! {
+    static ref BACKTRACE_TABLE: BacktraceTable = BacktraceTable::new( crate::opt::get().backtrace_cache_size_level_2 );
+}
+
+pub fn intern( backtrace: &Backtrace ) -> Option< u64 > {
+    BACKTRACE_TABLE.intern( backtrace )
+}
+
+pub fn get( id: u64 ) -> Option< Backtrace > {
+    BACKTRACE_TABLE.get( id )
+}
+
+pub fn lookup( key: BacktraceKey, frames: &[usize] ) -> Option< Backtrace > {
+    BACKTRACE_TABLE.lookup( key, frames )
+}
+
+/// A backtrace as sent to the processing thread.
+pub enum BacktraceRef {
+    Interned( u64 ),
+    Owned( Backtrace )
+}
+
+impl BacktraceRef {
+    pub fn new( backtrace: Backtrace ) -> Self {
+        match intern( &backtrace ) {
+            Some( id ) => BacktraceRef::Interned( id ),
+            None => BacktraceRef::Owned( backtrace )
+        }
+    }
+}
+
+#[test]
+fn test_backtrace_table() {
+    let table = BacktraceTable::new( 4 );
+
+    let a = Backtrace::new( 1, &[ 1, 2, 3 ] );
+    let b = Backtrace::new( 2, &[ 4, 5 ] );
+    let a_id = table.intern( &a ).unwrap();
+    let b_id = table.intern( &b ).unwrap();
+    assert_ne!( a_id, b_id );
+    assert!( index_of( a_id ).is_some() );
+
+    // The same frames under a different `Backtrace` get the same ID.
+    let a_copy = Backtrace::new( 1, &[ 1, 2, 3 ] );
+    assert_eq!( table.intern( &a_copy ), Some( a_id ) );
+    assert_eq!( table.get( a_id ).unwrap().frames(), &[ 1, 2, 3 ] );
+    assert_eq!( table.get( b_id ).unwrap().frames(), &[ 4, 5 ] );
+
+    // Different frames with the same key are a conflict.
+    let conflict = Backtrace::new( 1, &[ 6 ] );
+    assert_eq!( table.intern( &conflict ), None );
+
+    // Looking it up by its frames gives back the very same interned backtrace.
+    let found = table.lookup( 1, &[ 1, 2, 3 ] ).unwrap();
+    assert!( Backtrace::ptr_eq( &found, &a ) );
+    assert_eq!( found.interned_id(), Some( a_id ) );
+    assert!( table.lookup( 1, &[ 6 ] ).is_none() );
+    assert!( table.lookup( 3, &[ 1, 2, 3 ] ).is_none() );
+
+    // IDs from the `BacktraceCache` are never treated as interned.
+    assert_eq!( index_of( 1 ), None );
+    assert!( table.get( 1 ).is_none() );
+}
+
+#[test]
+fn test_backtrace_table_full() {
+    let table = BacktraceTable::new( 2 );
+    let backtraces: Vec< _ > = (1..4).map( |key| Backtrace::new( key, &[ key as usize ] ) ).collect();
+    assert!( table.intern( &backtraces[ 0 ] ).is_some() );
+    assert!( table.intern( &backtraces[ 1 ] ).is_some() );
+    assert_eq!( table.intern( &backtraces[ 2 ] ), None );
+}
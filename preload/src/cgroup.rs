@@ -0,0 +1,205 @@
+//! Periodic samples of the memory usage of the cgroup which the process is in.
+//!
+//! In a container the limit which actually matters is the cgroup's, and that one also counts
+//! the page cache, the kernel's memory and the socket buffers, so the samples make it possible
+//! to see when the heap's growth starts to evict the page cache and the tasks start to stall
+//! on reclaim. Only cgroup v2 is supported.
+
+use std::io::{self, Write};
+
+use common::event::Event;
+use common::speedy::Writable;
+
+use crate::timestamp::Timestamp;
+use crate::utils::read_file;
+
+/// Returns the root and the mount point of the cgroup2 hierarchy.
+fn find_mount_point( mountinfo: &str ) -> Option< (&str, &str) > {
+    mountinfo.lines().find_map( |line| {
+        // The optional fields end with a lone dash, after which the filesystem type follows.
+        let index = line.find( " - " )?;
+        if !line[ index + 3.. ].starts_with( "cgroup2 " ) {
+            return None;
+        }
+
+        let mut fields = line[ ..index ].split( ' ' ).skip( 3 );
+        let root = fields.next()?;
+        let mount_point = fields.next()?;
+        Some( (root, mount_point) )
+    })
+}
+
+/// Returns the path of the cgroup2 directory of the process.
+fn cgroup_directory( mountinfo: &str, cgroup: &str ) -> Option< String > {
+    let (root, mount_point) = find_mount_point( mountinfo )?;
+    let path = cgroup.lines().find_map( |line| line.strip_prefix( "0::" ) )?;
+    let path = if root != "/" { path.strip_prefix( root ).unwrap_or( path ) } else { path };
+    Some( format!( "{}/{}", mount_point.trim_end_matches( '/' ), path.trim_matches( '/' ) ).trim_end_matches( '/' ).to_owned() )
+}
+
+fn parse_limit( value: &str ) -> Option< u64 > {
+    match value.trim() {
+        "max" => Some( u64::MAX ),
+        value => value.parse().ok()
+    }
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug, Default)]
+struct Stat {
+    anon: u64,
+    file: u64,
+    kernel: u64,
+    sock: u64
+}
+
+fn parse_stat( stat: &str ) -> Stat {
+    let mut output = Stat::default();
+    let mut kernel = None;
+    let mut kernel_parts = 0;
+    for line in stat.lines() {
+        let mut fields = line.split_whitespace();
+        let (key, value) = match (fields.next(), fields.next().and_then( |value| value.parse::< u64 >().ok() )) {
+            (Some( key ), Some( value )) => (key, value),
+            _ => continue
+        };
+
+        match key {
+            "anon" => output.anon = value,
+            "file" => output.file = value,
+            "sock" => output.sock = value,
+            "kernel" => kernel = Some( value ),
+            // Older kernels don't have the total, only its biggest parts.
+            "kernel_stack" | "pagetables" | "percpu" | "slab" => kernel_parts += value,
+            _ => {}
+        }
+    }
+
+    output.kernel = kernel.unwrap_or( kernel_parts );
+    output
+}
+
+/// Returns the `total`s of the `some` and the `full` lines.
+fn parse_pressure( pressure: &str ) -> (u64, u64) {
+    let total_of = |kind: &str| {
+        pressure.lines()
+            .filter( |line| line.split_whitespace().next() == Some( kind ) )
+            .flat_map( |line| line.split_whitespace() )
+            .find_map( |field| field.strip_prefix( "total=" ) )
+            .and_then( |total| total.parse().ok() )
+            .unwrap_or( 0 )
+    };
+
+    (total_of( "some" ), total_of( "full" ))
+}
+
+fn read_string( path: &str ) -> io::Result< String > {
+    read_file( path ).map( |contents| String::from_utf8_lossy( &contents ).into_owned() )
+}
+
+pub struct CgroupMemory {
+    directory: String,
+    is_broken: bool
+}
+
+impl CgroupMemory {
+    /// Returns `None` if the process isn't in a cgroup2 cgroup with the memory controller enabled.
+    pub fn open() -> Option< Self > {
+        let directory = match (read_string( "/proc/self/mountinfo" ), read_string( "/proc/self/cgroup" )) {
+            (Ok( mountinfo ), Ok( cgroup )) => cgroup_directory( &mountinfo, &cgroup ),
+            _ => None
+        };
+
+        let directory = match directory {
+            Some( directory ) => directory,
+            None => {
+                warn!( "Failed to find the cgroup2 cgroup of the process; its memory usage won't be sampled" );
+                return None;
+            }
+        };
+
+        // The root cgroup doesn't have any of these.
+        if read_string( &format!( "{}/memory.current", directory ) ).is_err() {
+            warn!( "The memory controller isn't enabled for '{}'; its memory usage won't be sampled", directory );
+            return None;
+        }
+
+        info!( "Sampling the memory usage of the cgroup at '{}'", directory );
+        Some( CgroupMemory {
+            directory,
+            is_broken: false
+        })
+    }
+
+    fn read( &self, name: &str ) -> io::Result< String > {
+        read_string( &format!( "{}/{}", self.directory, name ) )
+    }
+
+    pub fn write_sample( &mut self, timestamp: Timestamp, fp: &mut impl Write ) -> io::Result< () > {
+        if self.is_broken {
+            return Ok(());
+        }
+
+        let current = match self.read( "memory.current" ).ok().and_then( |current| parse_limit( &current ) ) {
+            Some( current ) => current,
+            None => {
+                warn!( "Failed to read the memory usage of the cgroup; it won't be sampled anymore" );
+                self.is_broken = true;
+                return Ok(());
+            }
+        };
+
+        let limit = self.read( "memory.max" ).ok().and_then( |limit| parse_limit( &limit ) ).unwrap_or( u64::MAX );
+        let stat = self.read( "memory.stat" ).map( |stat| parse_stat( &stat ) ).unwrap_or_default();
+
+        // This can't be read when the kernel was booted with `psi=0`.
+        let (pressure_some, pressure_full) = self.read( "memory.pressure" ).map( |pressure| parse_pressure( &pressure ) ).unwrap_or( (0, 0) );
+
+        Event::CgroupMemory {
+            timestamp,
+            current,
+            limit,
+            anon: stat.anon,
+            file: stat.file,
+            kernel: stat.kernel,
+            sock: stat.sock,
+            pressure_some,
+            pressure_full
+        }.write_to_stream( fp )
+    }
+}
+
+#[test]
+fn test_cgroup_directory() {
+    let mountinfo = "\
+        25 30 0:23 / /sys rw,nosuid,nodev,noexec,relatime shared:7 - sysfs sysfs rw\n\
+        35 25 0:30 / /sys/fs/cgroup rw,nosuid,nodev,noexec,relatime shared:9 - cgroup2 cgroup2 rw,nsdelegate\n";
+
+    assert_eq!( cgroup_directory( mountinfo, "0::/user.slice/app.service\n" ).as_deref(), Some( "/sys/fs/cgroup/user.slice/app.service" ) );
+    assert_eq!( cgroup_directory( mountinfo, "0::/\n" ).as_deref(), Some( "/sys/fs/cgroup" ) );
+
+    // A hybrid hierarchy.
+    let mountinfo = "42 32 0:38 / /sys/fs/cgroup/unified rw,relatime - cgroup2 cgroup2 rw\n";
+    assert_eq!( cgroup_directory( mountinfo, "4:memory:/foo\n0::/kubepods/pod1\n" ).as_deref(), Some( "/sys/fs/cgroup/unified/kubepods/pod1" ) );
+
+    // A container which only sees its own part of the hierarchy.
+    let mountinfo = "1 0 0:30 /kubepods/pod1 /sys/fs/cgroup ro - cgroup2 cgroup rw\n";
+    assert_eq!( cgroup_directory( mountinfo, "0::/kubepods/pod1/nested\n" ).as_deref(), Some( "/sys/fs/cgroup/nested" ) );
+
+    assert_eq!( cgroup_directory( "1 0 0:30 / /sys/fs/cgroup/memory rw - cgroup cgroup rw,memory\n", "0::/\n" ), None );
+}
+
+#[test]
+fn test_parse_cgroup_files() {
+    assert_eq!( parse_limit( "max\n" ), Some( u64::MAX ) );
+    assert_eq!( parse_limit( "1073741824\n" ), Some( 1073741824 ) );
+
+    let stat = "anon 100\nfile 200\nkernel 300\nkernel_stack 10\nsock 40\nshmem 0\n";
+    assert_eq!( parse_stat( stat ), Stat { anon: 100, file: 200, kernel: 300, sock: 40 } );
+
+    let stat = "anon 100\nfile 200\nkernel_stack 10\npagetables 20\npercpu 30\nsock 40\nslab 50\n";
+    assert_eq!( parse_stat( stat ), Stat { anon: 100, file: 200, kernel: 110, sock: 40 } );
+
+    let pressure = "some avg10=1.50 avg60=0.40 avg300=0.10 total=12345\nfull avg10=0.50 avg60=0.10 avg300=0.00 total=678\n";
+    assert_eq!( parse_pressure( pressure ), (12345, 678) );
+    assert_eq!( parse_pressure( "" ), (0, 0) );
+}
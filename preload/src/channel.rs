@@ -6,14 +6,18 @@ use crate::utils::CacheAligned;
 
 const CHUNK_SIZE: usize = 64;
 
+/// The queue which is always drained last.
+const LATE_QUEUE: usize = 5;
+
 #[repr(C)]
 pub struct Channel< T > {
-    queues: [CacheAligned< Mutex< Vec< T > > >; 5],
+    queues: [CacheAligned< Mutex< Vec< T > > >; 6],
     condvar: CacheAligned< Condvar >
 }
 
 pub struct ChannelBuffer< T > {
-    queues: [Vec< T >; 5]
+    front: Vec< T >,
+    queues: [Vec< T >; 6]
 }
 
 impl< T > Default for ChannelBuffer< T > {
@@ -25,12 +29,27 @@ impl< T > Default for ChannelBuffer< T > {
 impl< T > ChannelBuffer< T > {
     pub fn new() -> Self {
         ChannelBuffer {
+            front: Vec::new(),
             queues: Default::default()
         }
     }
 
     pub fn is_empty( &self ) -> bool {
-        self.queues.iter().all( |queue| queue.is_empty() )
+        self.front.is_empty() && self.queues.iter().all( |queue| queue.is_empty() )
+    }
+
+    pub fn len( &self ) -> usize {
+        self.front.len() + self.queues.iter().map( |queue| queue.len() ).sum::< usize >()
+    }
+
+    /// Returns a queue which will be drained before any of the other ones.
+    pub fn front_mut( &mut self ) -> &mut Vec< T > {
+        &mut self.front
+    }
+
+    /// Returns a queue which will be drained after all of the other ones.
+    pub fn back_mut( &mut self ) -> &mut Vec< T > {
+        &mut self.queues[ LATE_QUEUE ]
     }
 
     pub fn extend( &mut self, iter: impl IntoIterator< Item = T > ) {
@@ -38,7 +57,7 @@ impl< T > ChannelBuffer< T > {
     }
 
     pub fn drain< 'a >( &'a mut self ) -> impl Iterator< Item = T > + 'a {
-        self.queues.iter_mut().flat_map( |queue| queue.drain(..) )
+        std::iter::once( &mut self.front ).chain( self.queues.iter_mut() ).flat_map( |queue| queue.drain(..) )
     }
 }
 
@@ -51,6 +70,7 @@ impl< T > Channel< T > {
                 CacheAligned( Mutex::new( Vec::new() ) ),
                 CacheAligned( Mutex::new( Vec::new() ) ),
                 CacheAligned( Mutex::new( Vec::new() ) ),
+                CacheAligned( Mutex::new( Vec::new() ) ),
             ],
             condvar: CacheAligned( Condvar::new() )
         }
@@ -112,6 +132,20 @@ impl< T > Channel< T > {
         length
     }
 
+    /// Moves all of the `values` into a queue which is always received last.
+    pub fn late_chunked_send_all( &self, values: &mut Vec< T > ) -> usize {
+        let mut guard = self.queues[ LATE_QUEUE ].lock().unwrap();
+        let old_length = guard.len();
+        guard.extend( values.drain( .. ) );
+
+        let length = guard.len();
+        if old_length / CHUNK_SIZE != length / CHUNK_SIZE {
+            self.condvar.notify_all();
+        }
+
+        length
+    }
+
     pub fn flush( &self ) {
         self.condvar.notify_all();
     }
@@ -0,0 +1,95 @@
+//! The live allocations as seen by the processing thread, for the periodic checkpoints.
+//!
+//! A checkpoint contains everything which was alive when it was written, so whatever
+//! reads the data can find out what was alive at a given point by starting from
+//! the nearest checkpoint instead of replaying everything since the start.
+
+use std::io::{self, Write};
+
+use common::event::{AllocBody, AllocationId, CheckpointAllocation, CheckpointRegion, Event};
+use common::speedy::Writable;
+
+use crate::timestamp::Timestamp;
+use crate::utils::{HashMap, empty_hashmap};
+
+pub struct LiveSet {
+    allocations: HashMap< u64, CheckpointAllocation >
+}
+
+impl LiveSet {
+    pub fn new() -> Self {
+        LiveSet {
+            allocations: empty_hashmap()
+        }
+    }
+
+    pub fn on_allocation( &mut self, id: AllocationId, timestamp: Timestamp, allocation: AllocBody ) {
+        self.allocations.insert( allocation.pointer, CheckpointAllocation { id, timestamp, allocation } );
+    }
+
+    pub fn on_reallocation( &mut self, id: AllocationId, timestamp: Timestamp, old_pointer: u64, allocation: AllocBody ) {
+        self.on_free( old_pointer );
+        self.on_allocation( id, timestamp, allocation );
+    }
+
+    pub fn on_free( &mut self, pointer: u64 ) {
+        // This can be missing if it was allocated before we've started.
+        self.allocations.remove( &pointer );
+    }
+
+    pub fn write_checkpoint( &self, timestamp: Timestamp, regions: impl Iterator< Item = CheckpointRegion >, fp: &mut impl Write ) -> io::Result< () > {
+        let mut allocations: Vec< _ > = self.allocations.values().cloned().collect();
+        allocations.sort_unstable_by_key( |allocation| allocation.allocation.pointer );
+
+        let mut regions: Vec< _ > = regions.collect();
+        regions.sort_unstable_by_key( |region| (region.map_id, region.address) );
+
+        Event::Checkpoint {
+            timestamp,
+            allocations: allocations.into(),
+            regions: regions.into()
+        }.write_to_stream( fp )
+    }
+}
+
+#[test]
+fn test_live_set() {
+    use common::speedy::Readable;
+
+    fn body( pointer: u64, size: u64 ) -> AllocBody {
+        AllocBody {
+            pointer,
+            size,
+            backtrace: 1,
+            thread: 1,
+            flags: 0,
+            extra_usable_space: 0,
+            preceding_free_space: 0
+        }
+    }
+
+    let id = |allocation| AllocationId { thread: 1, allocation };
+    let mut live = LiveSet::new();
+    live.on_allocation( id( 1 ), Timestamp::from_secs( 1 ), body( 0x1000, 10 ) );
+    live.on_allocation( id( 2 ), Timestamp::from_secs( 2 ), body( 0x2000, 20 ) );
+    live.on_allocation( id( 3 ), Timestamp::from_secs( 3 ), body( 0x3000, 30 ) );
+    live.on_free( 0x1000 );
+    live.on_free( 0x9000 );
+    live.on_reallocation( id( 3 ), Timestamp::from_secs( 4 ), 0x3000, body( 0x4000, 40 ) );
+
+    let region = CheckpointRegion { map_id: 1, address: 0x10000, length: 4096 };
+    let mut buffer = Vec::new();
+    live.write_checkpoint( Timestamp::from_secs( 5 ), std::iter::once( region.clone() ), &mut buffer ).unwrap();
+
+    match Event::read_from_buffer( &buffer ).unwrap() {
+        Event::Checkpoint { timestamp, allocations, regions } => {
+            assert_eq!( timestamp, Timestamp::from_secs( 5 ) );
+            assert_eq!( &*allocations, &[
+                CheckpointAllocation { id: id( 2 ), timestamp: Timestamp::from_secs( 2 ), allocation: body( 0x2000, 20 ) },
+                CheckpointAllocation { id: id( 3 ), timestamp: Timestamp::from_secs( 4 ), allocation: body( 0x4000, 40 ) }
+            ][..] );
+            assert_eq!( &*regions, &[ region ][..] );
+        },
+        _ => unreachable!()
+    }
+}
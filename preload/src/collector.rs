@@ -0,0 +1,86 @@
+//! Handing our output over to a separate collector process.
+//!
+//! We create a memfd-backed ring, connect to the collector's Unix socket and pass it the descriptor.
+//! Everything which would otherwise be compressed and written into the output file is then written
+//! into the ring as it is, and the collector compresses it and writes it out, which takes that work
+//! off of the profiled process.
+
+use std::io::{self, Read};
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::time::Duration;
+
+use crate::multiplex::{RING_LENGTH, RingOutput, SharedRing};
+use crate::syscall;
+
+/// How long to wait for the collector to map the ring before giving up on it.
+const HANDSHAKE_TIMEOUT: Duration = Duration::from_secs( 10 );
+
+fn send_fd( stream: &UnixStream, fd: RawFd, payload: &[u8] ) -> io::Result< () > {
+    unsafe {
+        let mut iov = libc::iovec {
+            iov_base: payload.as_ptr() as *mut libc::c_void,
+            iov_len: payload.len()
+        };
+
+        let mut control = [0_u64; 8];
+        let mut message: libc::msghdr = std::mem::zeroed();
+        message.msg_iov = &mut iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+        message.msg_controllen = libc::CMSG_SPACE( std::mem::size_of::< RawFd >() as u32 ) as _;
+
+        let header = libc::CMSG_FIRSTHDR( &message );
+        (*header).cmsg_level = libc::SOL_SOCKET;
+        (*header).cmsg_type = libc::SCM_RIGHTS;
+        (*header).cmsg_len = libc::CMSG_LEN( std::mem::size_of::< RawFd >() as u32 ) as _;
+        std::ptr::write_unaligned( libc::CMSG_DATA( header ) as *mut RawFd, fd );
+
+        if libc::sendmsg( stream.as_raw_fd(), &message, libc::MSG_NOSIGNAL ) < 0 {
+            return Err( io::Error::last_os_error() );
+        }
+    }
+
+    Ok(())
+}
+
+fn handshake( path: &str, ring: &SharedRing, fd: RawFd ) -> io::Result< () > {
+    let mut stream = UnixStream::connect( path )?;
+    send_fd( &stream, fd, &(ring.len() as u64).to_le_bytes() )?;
+
+    // The collector fills in its PID before it acknowledges the ring.
+    stream.set_read_timeout( Some( HANDSHAKE_TIMEOUT ) )?;
+    let mut ack = [0];
+    stream.read_exact( &mut ack )?;
+    if ring.consumer_pid() == 0 {
+        return Err( io::Error::new( io::ErrorKind::InvalidData, "the collector didn't attach to the ring" ) );
+    }
+
+    Ok(())
+}
+
+/// Connects to the collector listening on the given socket.
+pub fn connect( path: &str ) -> Option< RingOutput > {
+    let (ring, fd) = match SharedRing::create( b"bytehound::collector_ring\0" ) {
+        Some( ring ) => ring,
+        None => {
+            error!( "Failed to create a ring for the collector: {}", io::Error::last_os_error() );
+            return None;
+        }
+    };
+
+    debug_assert_eq!( ring.len(), RING_LENGTH );
+    let result = handshake( path, &ring, fd );
+    syscall::close( fd );
+
+    match result {
+        Ok(()) => {
+            info!( "Streaming the data to the collector process {} at '{}'", ring.consumer_pid(), path );
+            Some( RingOutput::new( ring ) )
+        },
+        Err( error ) => {
+            error!( "Failed to connect to the collector at '{}': {}", path, error );
+            None
+        }
+    }
+}
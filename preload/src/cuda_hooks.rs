@@ -0,0 +1,124 @@
+//! Tracking of the device memory allocated through the CUDA runtime.
+//!
+//! We interpose on the runtime's allocation functions and forward them to the real ones, which are
+//! looked up lazily; this only works when the program is linked with the shared `libcudart`.
+//! The allocations are reported through a single external allocator registered on first use.
+
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use libc::{c_char, c_int, c_uint, c_void, size_t};
+
+/// The value of `cudaSuccess`.
+const CUDA_SUCCESS: c_int = 0;
+
+/// The `cudaErrorInitializationError`, returned when the real function can't be found.
+const CUDA_ERROR_INITIALIZATION_ERROR: c_int = 3;
+
+type CudaStream = *mut c_void;
+
+lazy_static! {
+    static ref POOL: u32 = crate::pools::create( "CUDA", common::event::POOL_FLAG_DEVICE );
+}
+
+struct RealFunction {
+    name: &'static [u8],
+    address: AtomicUsize
+}
+
+impl RealFunction {
+    const fn new( name: &'static [u8] ) -> Self {
+        RealFunction {
+            name,
+            address: AtomicUsize::new( 0 )
+        }
+    }
+
+    fn get( &self ) -> Option< usize > {
+        let address = self.address.load( Ordering::Relaxed );
+        if address != 0 {
+            return Some( address );
+        }
+
+        let address = unsafe { libc::dlsym( libc::RTLD_NEXT, self.name.as_ptr() as *const c_char ) } as usize;
+        if address == 0 {
+            error!( "Failed to find the real '{}'", String::from_utf8_lossy( &self.name[ ..self.name.len() - 1 ] ) );
+            return None;
+        }
+
+        self.address.store( address, Ordering::Relaxed );
+        Some( address )
+    }
+}
+
+static REAL_CUDA_MALLOC: RealFunction = RealFunction::new( b"cudaMalloc\0" );
+static REAL_CUDA_MALLOC_MANAGED: RealFunction = RealFunction::new( b"cudaMallocManaged\0" );
+static REAL_CUDA_MALLOC_ASYNC: RealFunction = RealFunction::new( b"cudaMallocAsync\0" );
+static REAL_CUDA_FREE: RealFunction = RealFunction::new( b"cudaFree\0" );
+static REAL_CUDA_FREE_ASYNC: RealFunction = RealFunction::new( b"cudaFreeAsync\0" );
+
+unsafe fn on_allocation( result: c_int, pointer: *mut *mut c_void, size: size_t ) -> c_int {
+    if result == CUDA_SUCCESS && !pointer.is_null() {
+        crate::pools::on_allocations( *POOL, std::iter::once( (*pointer as usize, size) ) );
+    }
+
+    result
+}
+
+fn on_free( result: c_int, pointer: *mut c_void ) -> c_int {
+    if result == CUDA_SUCCESS {
+        crate::pools::on_frees( *POOL, std::iter::once( pointer as usize ) );
+    }
+
+    result
+}
+
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn cudaMalloc( pointer: *mut *mut c_void, size: size_t ) -> c_int {
+    let real = match REAL_CUDA_MALLOC.get() {
+        Some( real ) => std::mem::transmute::< usize, unsafe extern "C" fn( *mut *mut c_void, size_t ) -> c_int >( real ),
+        None => return CUDA_ERROR_INITIALIZATION_ERROR
+    };
+
+    on_allocation( real( pointer, size ), pointer, size )
+}
+
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn cudaMallocManaged( pointer: *mut *mut c_void, size: size_t, flags: c_uint ) -> c_int {
+    let real = match REAL_CUDA_MALLOC_MANAGED.get() {
+        Some( real ) => std::mem::transmute::< usize, unsafe extern "C" fn( *mut *mut c_void, size_t, c_uint ) -> c_int >( real ),
+        None => return CUDA_ERROR_INITIALIZATION_ERROR
+    };
+
+    on_allocation( real( pointer, size, flags ), pointer, size )
+}
+
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn cudaMallocAsync( pointer: *mut *mut c_void, size: size_t, stream: CudaStream ) -> c_int {
+    let real = match REAL_CUDA_MALLOC_ASYNC.get() {
+        Some( real ) => std::mem::transmute::< usize, unsafe extern "C" fn( *mut *mut c_void, size_t, CudaStream ) -> c_int >( real ),
+        None => return CUDA_ERROR_INITIALIZATION_ERROR
+    };
+
+    on_allocation( real( pointer, size, stream ), pointer, size )
+}
+
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn cudaFree( pointer: *mut c_void ) -> c_int {
+    let real = match REAL_CUDA_FREE.get() {
+        Some( real ) => std::mem::transmute::< usize, unsafe extern "C" fn( *mut c_void ) -> c_int >( real ),
+        None => return CUDA_ERROR_INITIALIZATION_ERROR
+    };
+
+    on_free( real( pointer ), pointer )
+}
+
+/// The memory is only actually freed once the stream gets to it, but it's reported right away.
+#[cfg_attr(not(test), no_mangle)]
+pub unsafe extern "C" fn cudaFreeAsync( pointer: *mut c_void, stream: CudaStream ) -> c_int {
+    let real = match REAL_CUDA_FREE_ASYNC.get() {
+        Some( real ) => std::mem::transmute::< usize, unsafe extern "C" fn( *mut c_void, CudaStream ) -> c_int >( real ),
+        None => return CUDA_ERROR_INITIALIZATION_ERROR
+    };
+
+    on_free( real( pointer, stream ), pointer )
+}
@@ -0,0 +1,86 @@
+//! Aggregation of the culled temporary allocations from every thread.
+//!
+//! Every thread already aggregates its own culled allocations per backtrace before sending them over,
+//! so here they're only merged across the threads and periodically written out in a single event,
+//! with one entry per backtrace for the whole interval.
+
+use std::io::{self, Write};
+
+use common::event::{CulledAllocationStatistics, Event};
+use common::speedy::Writable;
+
+use crate::allocation_tracker::CulledAllocations;
+use crate::processing_thread::BacktraceCache;
+use crate::timestamp::Timestamp;
+use crate::utils::{HashMap, empty_hashmap};
+use crate::writers;
+
+pub struct CulledStatistics {
+    by_backtrace: HashMap< u64, CulledAllocationStatistics >
+}
+
+fn merge( entry: &mut CulledAllocationStatistics, culled: &CulledAllocations ) {
+    entry.first_allocation = std::cmp::min( entry.first_allocation, culled.first_allocation );
+    entry.last_allocation = std::cmp::max( entry.last_allocation, culled.last_allocation );
+    entry.count += culled.count;
+    entry.size += culled.size;
+    entry.min_size = std::cmp::min( entry.min_size, culled.min_size );
+    entry.max_size = std::cmp::max( entry.max_size, culled.max_size );
+
+    let length = culled.lifetimes.iter().rposition( |&count| count != 0 ).map( |index| index + 1 ).unwrap_or( 0 );
+    if entry.lifetimes.len() < length {
+        entry.lifetimes.resize( length, 0 );
+    }
+
+    for (total, &count) in entry.lifetimes.iter_mut().zip( culled.lifetimes[ ..length ].iter() ) {
+        *total += count;
+    }
+}
+
+impl CulledStatistics {
+    pub fn new() -> Self {
+        CulledStatistics {
+            by_backtrace: empty_hashmap()
+        }
+    }
+
+    pub fn on_culled(
+        &mut self,
+        entries: Vec< CulledAllocations >,
+        backtrace_cache: &mut BacktraceCache,
+        fp: &mut impl Write
+    ) -> io::Result< () > {
+        for culled in entries {
+            // The backtraces are written right away so that they're always written before they're referenced.
+            let backtrace = writers::write_backtrace( &mut *fp, culled.backtrace.clone(), backtrace_cache )?;
+            let entry = self.by_backtrace.entry( backtrace ).or_insert_with( || CulledAllocationStatistics {
+                backtrace,
+                first_allocation: culled.first_allocation,
+                last_allocation: culled.last_allocation,
+                count: 0,
+                size: 0,
+                min_size: culled.min_size,
+                max_size: culled.max_size,
+                lifetimes: Vec::new()
+            });
+
+            merge( entry, &culled );
+        }
+
+        Ok(())
+    }
+
+    pub fn write_statistics( &mut self, timestamp: Timestamp, fp: &mut impl Write ) -> io::Result< () > {
+        if self.by_backtrace.is_empty() {
+            return Ok(());
+        }
+
+        let mut entries: Vec< _ > = self.by_backtrace.drain().map( |(_, entry)| entry ).collect();
+        entries.sort_unstable_by_key( |entry| entry.backtrace );
+
+        Event::CulledAllocations {
+            timestamp,
+            entries: entries.into()
+        }.write_to_stream( fp )
+    }
+}
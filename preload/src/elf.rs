@@ -27,6 +27,7 @@
 use libc::{c_char, c_void, size_t};
 use std::ops::ControlFlow;
 use std::ffi::CStr;
+use std::convert::TryInto;
 
 const STT_GNU_IFUNC: u8 = 10;
 
@@ -321,3 +322,179 @@ fn test_dlsym() {
 
     assert!( result.is_some() );
 }
+
+const PT_NOTE: u32 = 4;
+const NT_GNU_BUILD_ID: u32 = 3;
+
+struct Reader< 'a > {
+    bytes: &'a [u8],
+    is_little_endian: bool
+}
+
+impl< 'a > Reader< 'a > {
+    fn slice( &self, offset: usize, length: usize ) -> Option< &'a [u8] > {
+        self.bytes.get( offset..offset.checked_add( length )? )
+    }
+
+    fn u16( &self, offset: usize ) -> Option< u16 > {
+        let bytes = self.slice( offset, 2 )?.try_into().ok()?;
+        Some( if self.is_little_endian { u16::from_le_bytes( bytes ) } else { u16::from_be_bytes( bytes ) } )
+    }
+
+    fn u32( &self, offset: usize ) -> Option< u32 > {
+        let bytes = self.slice( offset, 4 )?.try_into().ok()?;
+        Some( if self.is_little_endian { u32::from_le_bytes( bytes ) } else { u32::from_be_bytes( bytes ) } )
+    }
+
+    fn u64( &self, offset: usize ) -> Option< u64 > {
+        let bytes = self.slice( offset, 8 )?.try_into().ok()?;
+        Some( if self.is_little_endian { u64::from_le_bytes( bytes ) } else { u64::from_be_bytes( bytes ) } )
+    }
+}
+
+/// Returns a reader for the raw contents of an ELF file, and whenever it's a 64-bit one.
+fn open( bytes: &[u8] ) -> Option< (Reader< '_ >, bool) > {
+    if !bytes.starts_with( b"\x7FELF" ) {
+        return None;
+    }
+
+    let is_64bit = match *bytes.get( 4 )? {
+        1 => false,
+        2 => true,
+        _ => return None
+    };
+
+    let reader = Reader {
+        bytes,
+        is_little_endian: *bytes.get( 5 )? == 1
+    };
+
+    Some( (reader, is_64bit) )
+}
+
+/// Extracts the GNU build ID from the raw contents of an ELF file.
+pub fn parse_build_id( bytes: &[u8] ) -> Option< &[u8] > {
+    let (reader, is_64bit) = open( bytes )?;
+
+    let (phoff, phentsize, phnum) = if is_64bit {
+        (reader.u64( 0x20 )? as usize, reader.u16( 0x36 )? as usize, reader.u16( 0x38 )? as usize)
+    } else {
+        (reader.u32( 0x1C )? as usize, reader.u16( 0x2A )? as usize, reader.u16( 0x2C )? as usize)
+    };
+
+    for index in 0..phnum {
+        let header = phoff.checked_add( index.checked_mul( phentsize )? )?;
+        if reader.u32( header )? != PT_NOTE {
+            continue;
+        }
+
+        let (offset, size, align) = if is_64bit {
+            (reader.u64( header + 8 )? as usize, reader.u64( header + 32 )? as usize, reader.u64( header + 48 )? as usize)
+        } else {
+            (reader.u32( header + 4 )? as usize, reader.u32( header + 16 )? as usize, reader.u32( header + 28 )? as usize)
+        };
+
+        let align = if align == 8 { 8 } else { 4 };
+        let pad = |value: usize| (value + align - 1) & !(align - 1);
+
+        let mut note = offset;
+        let end = offset.checked_add( size )?;
+        while note + 12 <= end {
+            let name_size = reader.u32( note )? as usize;
+            let desc_size = reader.u32( note + 4 )? as usize;
+            let kind = reader.u32( note + 8 )?;
+            let name = note + 12;
+            let desc = name.checked_add( pad( name_size ) )?;
+            if kind == NT_GNU_BUILD_ID && reader.slice( name, name_size )? == b"GNU\0" {
+                return reader.slice( desc, desc_size );
+            }
+
+            note = desc.checked_add( pad( desc_size ) )?;
+        }
+    }
+
+    None
+}
+
+/// Extracts the name of the separate debug info file from the `.gnu_debuglink` section of an ELF file.
+///
+/// Only the headers and the section names are read, so if the `bytes` are mmaped the rest of the file is never touched.
+pub fn parse_debuglink( bytes: &[u8] ) -> Option< &[u8] > {
+    let (reader, is_64bit) = open( bytes )?;
+    let (shoff, shentsize, shnum, shstrndx) = if is_64bit {
+        (reader.u64( 0x28 )? as usize, reader.u16( 0x3A )? as usize, reader.u16( 0x3C )? as usize, reader.u16( 0x3E )? as usize)
+    } else {
+        (reader.u32( 0x20 )? as usize, reader.u16( 0x2E )? as usize, reader.u16( 0x30 )? as usize, reader.u16( 0x32 )? as usize)
+    };
+
+    // Returns the name, the offset and the size of a section.
+    let section = |index: usize| {
+        let header = shoff.checked_add( index.checked_mul( shentsize )? )?;
+        if is_64bit {
+            Some( (reader.u32( header )? as usize, reader.u64( header + 24 )? as usize, reader.u64( header + 32 )? as usize) )
+        } else {
+            Some( (reader.u32( header )? as usize, reader.u32( header + 16 )? as usize, reader.u32( header + 20 )? as usize) )
+        }
+    };
+
+    let (_, names_offset, names_size) = section( shstrndx )?;
+    let names = reader.slice( names_offset, names_size )?;
+    for index in 0..shnum {
+        let (name, offset, size) = section( index )?;
+        if names.get( name.. )?.split( |&byte| byte == 0 ).next()? != b".gnu_debuglink" {
+            continue;
+        }
+
+        let contents = reader.slice( offset, size )?;
+        let debuglink = contents.split( |&byte| byte == 0 ).next()?;
+        return if debuglink.is_empty() { None } else { Some( debuglink ) };
+    }
+
+    None
+}
+
+#[test]
+fn test_parse_build_id() {
+    let bytes = std::fs::read( "/proc/self/exe" ).unwrap();
+    let build_id = parse_build_id( &bytes );
+    if let Some( build_id ) = build_id {
+        assert!( !build_id.is_empty() );
+    }
+
+    assert!( parse_build_id( b"\x7FELF" ).is_none() );
+    assert!( parse_build_id( b"not an ELF file" ).is_none() );
+}
+
+#[test]
+fn test_parse_debuglink() {
+    let names = b"\0.shstrtab\0.gnu_debuglink\0";
+    let debuglink = b"foo.debug\0\0\0\x78\x56\x34\x12";
+
+    let mut bytes = vec![ 0; 0x40 ];
+    bytes[ ..6 ].copy_from_slice( b"\x7FELF\x02\x01" );
+    let names_offset = bytes.len();
+    bytes.extend_from_slice( names );
+    let debuglink_offset = bytes.len();
+    bytes.extend_from_slice( debuglink );
+
+    let shoff = bytes.len();
+    let sections = [(0, 0, 0), (1, names_offset, names.len()), (11, debuglink_offset, debuglink.len())];
+    for &(name, offset, size) in &sections {
+        let mut header = vec![ 0; 0x40 ];
+        header[ ..4 ].copy_from_slice( &(name as u32).to_le_bytes() );
+        header[ 24..32 ].copy_from_slice( &(offset as u64).to_le_bytes() );
+        header[ 32..40 ].copy_from_slice( &(size as u64).to_le_bytes() );
+        bytes.extend_from_slice( &header );
+    }
+
+    bytes[ 0x28..0x30 ].copy_from_slice( &(shoff as u64).to_le_bytes() );
+    bytes[ 0x3A..0x3C ].copy_from_slice( &0x40_u16.to_le_bytes() );
+    bytes[ 0x3C..0x3E ].copy_from_slice( &(sections.len() as u16).to_le_bytes() );
+    bytes[ 0x3E..0x40 ].copy_from_slice( &1_u16.to_le_bytes() );
+    assert_eq!( parse_debuglink( &bytes ), Some( &b"foo.debug"[..] ) );
+
+    // Without the section.
+    bytes[ 0x3C..0x3E ].copy_from_slice( &2_u16.to_le_bytes() );
+    assert_eq!( parse_debuglink( &bytes ), None );
+    assert_eq!( parse_debuglink( b"not an ELF file" ), None );
+}
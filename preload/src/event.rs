@@ -1,12 +1,17 @@
 use std::time::Duration;
 use std::sync::Arc;
+use std::sync::atomic::{AtomicUsize, Ordering};
 use std::num::NonZeroUsize;
 
 use common::Timestamp;
-use common::event::AllocationId;
+use common::event::{AllocationId, RuntimeOption};
 
 use crate::channel::{Channel, ChannelBuffer};
-use crate::global::WeakThreadHandle;
+use crate::global::{StrongThreadHandle, WeakThreadHandle};
+use crate::instrumentation::{Stage, Timer};
+use crate::ring_buffer::RingBuffer;
+use crate::spin_lock::SpinLock;
+use crate::backtrace_table::BacktraceRef;
 use crate::unwind::Backtrace;
 
 #[derive(Copy, Clone, PartialEq, Eq)]
@@ -30,12 +35,17 @@ impl std::fmt::Display for InternalAllocationId {
 // These are just arbitrarily picked to be big and random enough.
 const UNTRACKED_THREAD: u64 = 0xEAD1F4ED4A816337;
 const UNTRACKED_ALLOCATION: u64 = 0xEBBDDB5F42D04E74;
+const UNSAMPLED_THREAD: u64 = 0x9C5D4BBE3B1E2A61;
+const UNSAMPLED_ALLOCATION: u64 = 0xC2B65A1F1D7E3F08;
 
 const CHECKSUM_CONSTANT: u64 = 0x8000000000000000;
 
 impl InternalAllocationId {
     pub const UNTRACKED: Self = Self::new( UNTRACKED_THREAD, UNTRACKED_ALLOCATION );
 
+    /// Used for allocations which were skipped by the sampler; no events are ever emitted for those.
+    pub const UNSAMPLED: Self = Self::new( UNSAMPLED_THREAD, UNSAMPLED_ALLOCATION );
+
     pub const fn new( thread: u64, allocation: u64 ) -> Self {
         InternalAllocationId {
             thread,
@@ -48,9 +58,26 @@ impl InternalAllocationId {
         self == Self::UNTRACKED
     }
 
+    pub fn is_unsampled( self ) -> bool {
+        self == Self::UNSAMPLED
+    }
+
     pub fn is_valid( self ) -> bool {
         self.thread ^ self.allocation ^ CHECKSUM_CONSTANT == self.checksum
     }
+
+    /// Returns the ID exactly as it'll be read back from an allocation's trailer.
+    ///
+    /// IDs which don't fit into a compact trailer are stored as untracked, so they also have to be
+    /// reported as such, otherwise the analyzer would never match them with their deallocations.
+    #[inline(always)]
+    pub fn as_stored( self, compact: bool ) -> Self {
+        if compact {
+            CompactAllocationId::from( self ).into()
+        } else {
+            self
+        }
+    }
 }
 
 impl From< InternalAllocationId > for common::event::AllocationId {
@@ -68,6 +95,149 @@ impl From< InternalAllocationId > for common::event::AllocationId {
     }
 }
 
+/// A compact, 8-byte encoding of an `InternalAllocationId`.
+///
+/// The top 16 bits hold the thread ID, the next 40 bits hold the per-thread allocation
+/// counter and the lowest 8 bits hold a checksum derived from the other two.
+///
+/// IDs which don't fit are encoded as untracked.
+#[derive(Copy, Clone, PartialEq, Eq)]
+#[repr(transparent)]
+pub struct CompactAllocationId( u64 );
+
+const COMPACT_THREAD_BITS: u32 = 16;
+const COMPACT_ALLOCATION_BITS: u32 = 40;
+const COMPACT_CHECKSUM_BITS: u32 = 64 - COMPACT_THREAD_BITS - COMPACT_ALLOCATION_BITS;
+
+// The thread ID is zero here, which can never happen for a tracked allocation.
+const COMPACT_UNTRACKED: u64 = 0x0000_D04E_74EB_BD5F;
+const COMPACT_UNSAMPLED: u64 = 0x0000_3F08_1D7E_2A61;
+
+impl CompactAllocationId {
+    const fn checksum( payload: u64 ) -> u64 {
+        let mut value = payload ^ (payload >> 32);
+        value ^= value >> 16;
+        value ^= value >> 8;
+        (value ^ (CHECKSUM_CONSTANT >> 56)) & ((1 << COMPACT_CHECKSUM_BITS) - 1)
+    }
+
+    pub fn thread( self ) -> u64 {
+        self.0 >> (COMPACT_ALLOCATION_BITS + COMPACT_CHECKSUM_BITS)
+    }
+
+    pub fn allocation( self ) -> u64 {
+        (self.0 >> COMPACT_CHECKSUM_BITS) & ((1 << COMPACT_ALLOCATION_BITS) - 1)
+    }
+
+    pub fn is_untracked( self ) -> bool {
+        self.0 == COMPACT_UNTRACKED
+    }
+
+    pub fn is_unsampled( self ) -> bool {
+        self.0 == COMPACT_UNSAMPLED
+    }
+
+    pub fn is_valid( self ) -> bool {
+        self.thread() != 0 && Self::checksum( self.0 >> COMPACT_CHECKSUM_BITS ) == self.0 & ((1 << COMPACT_CHECKSUM_BITS) - 1)
+    }
+}
+
+impl From< InternalAllocationId > for CompactAllocationId {
+    fn from( id: InternalAllocationId ) -> Self {
+        if id.is_unsampled() {
+            return CompactAllocationId( COMPACT_UNSAMPLED );
+        }
+
+        if id.is_untracked() || !id.is_valid() || id.thread >= 1 << COMPACT_THREAD_BITS || id.allocation >= 1 << COMPACT_ALLOCATION_BITS {
+            return CompactAllocationId( COMPACT_UNTRACKED );
+        }
+
+        let payload = (id.thread << COMPACT_ALLOCATION_BITS) | id.allocation;
+        CompactAllocationId( (payload << COMPACT_CHECKSUM_BITS) | Self::checksum( payload ) )
+    }
+}
+
+impl From< CompactAllocationId > for InternalAllocationId {
+    fn from( id: CompactAllocationId ) -> Self {
+        if id.is_untracked() {
+            InternalAllocationId::UNTRACKED
+        } else if id.is_unsampled() {
+            InternalAllocationId::UNSAMPLED
+        } else if !id.is_valid() {
+            InternalAllocationId {
+                thread: id.thread(),
+                allocation: id.allocation(),
+                checksum: !(id.thread() ^ id.allocation() ^ CHECKSUM_CONSTANT)
+            }
+        } else {
+            InternalAllocationId::new( id.thread(), id.allocation() )
+        }
+    }
+}
+
+impl From< CompactAllocationId > for common::event::AllocationId {
+    fn from( id: CompactAllocationId ) -> Self {
+        InternalAllocationId::from( id ).into()
+    }
+}
+
+#[test]
+fn test_compact_allocation_id_roundtrip() {
+    let id = InternalAllocationId::new( 123, 456789 );
+    let compact: CompactAllocationId = id.into();
+    assert!( compact.is_valid() );
+    assert!( InternalAllocationId::from( compact ) == id );
+
+    let max = InternalAllocationId::new( (1 << COMPACT_THREAD_BITS) - 1, (1 << COMPACT_ALLOCATION_BITS) - 1 );
+    assert!( InternalAllocationId::from( CompactAllocationId::from( max ) ) == max );
+
+    let untracked: CompactAllocationId = InternalAllocationId::UNTRACKED.into();
+    assert!( untracked.is_untracked() );
+    assert!( InternalAllocationId::from( untracked ).is_untracked() );
+
+    let unsampled: CompactAllocationId = InternalAllocationId::UNSAMPLED.into();
+    assert!( InternalAllocationId::from( unsampled ).is_unsampled() );
+
+    let too_big: CompactAllocationId = InternalAllocationId::new( 1 << COMPACT_THREAD_BITS, 1 ).into();
+    assert!( too_big.is_untracked() );
+
+    let corrupted = CompactAllocationId( compact.0 ^ 0x100 );
+    assert!( !corrupted.is_valid() );
+    assert!( !InternalAllocationId::from( corrupted ).is_valid() );
+    assert_eq!( common::event::AllocationId::from( corrupted ), common::event::AllocationId::INVALID );
+}
+
+#[test]
+fn test_oversized_compact_allocation_id_is_reported_as_stored() {
+    fn store( trailer: &mut [u8; 8], id: InternalAllocationId ) {
+        *trailer = CompactAllocationId::from( id ).0.to_ne_bytes();
+    }
+
+    fn load( trailer: &[u8; 8] ) -> InternalAllocationId {
+        CompactAllocationId( u64::from_ne_bytes( *trailer ) ).into()
+    }
+
+    // Mirrors what `allocate`, `realloc_impl` and `free` do with the ID.
+    let mut old_trailer = [0; 8];
+    let allocated = InternalAllocationId::new( 1 << COMPACT_THREAD_BITS, 1 ).as_stored( true );
+    store( &mut old_trailer, allocated );
+
+    let reallocated = load( &old_trailer );
+    let mut new_trailer = [0; 8];
+    store( &mut new_trailer, reallocated );
+    let freed = load( &new_trailer );
+
+    // The analyzer keys the untracked allocations by their addresses, so all of these have to agree.
+    let allocated: AllocationId = allocated.into();
+    assert!( allocated.is_untracked() );
+    assert_eq!( AllocationId::from( reallocated ), allocated );
+    assert_eq!( AllocationId::from( freed ), allocated );
+
+    let fits = InternalAllocationId::new( 123, 456 );
+    assert!( fits.as_stored( true ) == fits );
+    assert!( InternalAllocationId::new( 1 << COMPACT_THREAD_BITS, 1 ).as_stored( false ).thread == 1 << COMPACT_THREAD_BITS );
+}
+
 pub struct InternalAllocation {
     pub address: NonZeroUsize,
     pub size: usize,
@@ -81,7 +251,7 @@ pub(crate) enum InternalEvent {
         id: AllocationId,
         timestamp: Timestamp,
         allocation: InternalAllocation,
-        backtrace: Backtrace,
+        backtrace: BacktraceRef,
     },
     Realloc {
         id: AllocationId,
@@ -110,6 +280,14 @@ pub(crate) enum InternalEvent {
         timestamp: Timestamp,
         thread: WeakThreadHandle
     },
+    MemoryAdvice {
+        address: u64,
+        length: u64,
+        advice: i32,
+        backtrace: Backtrace,
+        timestamp: Timestamp,
+        thread: WeakThreadHandle
+    },
     OverrideNextTimestamp {
         timestamp: Timestamp
     },
@@ -119,9 +297,108 @@ pub(crate) enum InternalEvent {
         new_binaries: Vec< Arc< nwind::BinaryData > >
     },
     AllocationBucket( crate::allocation_tracker::AllocationBucket ),
+    CulledAllocations {
+        entries: Vec< crate::allocation_tracker::CulledAllocations >
+    },
+    AllocatorLatencies {
+        entries: Vec< crate::allocator_latency::AllocatorLatencies >
+    },
+    OptionChanged {
+        timestamp: Timestamp,
+        option: RuntimeOption,
+        value: u64
+    },
+    ThreadTag {
+        timestamp: Timestamp,
+        thread: u32,
+        tag: u32
+    },
+    PoolCreated {
+        timestamp: Timestamp,
+        pool: u16,
+        name: String,
+        flags: u32
+    },
+    PoolAlloc {
+        timestamp: Timestamp,
+        pool: u16,
+        tid: u32,
+        flags: u32,
+        backtrace: Backtrace,
+        allocations: Vec< common::event::PoolAllocation >
+    },
+    PoolFree {
+        timestamp: Timestamp,
+        pool: u16,
+        tid: u32,
+        pointers: Vec< u64 >
+    },
+    PoolReset {
+        timestamp: Timestamp,
+        pool: u16,
+        tid: u32
+    },
+    ThreadStarted {
+        timestamp: Timestamp,
+        thread: u32,
+        name: String
+    },
+    ThreadRenamed {
+        timestamp: Timestamp,
+        thread: u32,
+        name: String
+    },
+    ThreadExited {
+        timestamp: Timestamp,
+        thread: u32
+    },
+    ChildForked {
+        pid: u32,
+        ring: crate::multiplex::SharedRing
+    }
+}
+
+pub(crate) type EventRing = RingBuffer< InternalEvent >;
+
+/// The maximum number of events staged per thread before they're sent to the channel in one go.
+const STAGED_EVENTS_LIMIT: usize = 64;
+
+/// How many events a thread can queue before it has to report them to the backpressure accounting.
+const ACCOUNTING_BATCH_SIZE: usize = 64;
+
+/// Per-thread event queues which the processing thread drains on every iteration.
+pub(crate) struct ThreadEventQueues {
+    ring: Option< EventRing >,
+    staged: SpinLock< Vec< InternalEvent > >,
+    unaccounted: AtomicUsize
+}
+
+impl ThreadEventQueues {
+    fn is_empty( &self ) -> bool {
+        self.ring.as_ref().map( |ring| ring.is_empty() ).unwrap_or( true ) && self.staged.lock().is_empty()
+    }
 }
 
 static EVENT_CHANNEL: Channel< InternalEvent > = Channel::new();
+static THREAD_EVENT_QUEUES: SpinLock< Vec< Arc< ThreadEventQueues > > > = SpinLock::new( Vec::new() );
+
+/// Creates the event queues for a new thread and registers them so that the processing thread will drain them.
+pub(crate) fn create_thread_event_queues() -> Arc< ThreadEventQueues > {
+    let capacity = if crate::opt::is_initialized() {
+        crate::opt::get().event_ring_capacity
+    } else {
+        0
+    };
+
+    let queues = Arc::new( ThreadEventQueues {
+        ring: if capacity > 0 { Some( RingBuffer::new( capacity ) ) } else { None },
+        staged: SpinLock::new( Vec::with_capacity( STAGED_EVENTS_LIMIT ) ),
+        unaccounted: AtomicUsize::new( 0 )
+    });
+
+    THREAD_EVENT_QUEUES.lock().push( queues.clone() );
+    queues
+}
 
 pub(crate) fn send_event( event: InternalEvent ) {
     EVENT_CHANNEL.send( event );
@@ -129,16 +406,110 @@ pub(crate) fn send_event( event: InternalEvent ) {
 
 #[inline(always)]
 pub(crate) fn send_event_throttled< F: FnOnce() -> InternalEvent >( callback: F ) {
+    let _timer = Timer::start( Stage::Send );
     EVENT_CHANNEL.chunked_send_with( callback );
 }
 
 #[inline(always)]
 pub(crate) fn send_event_throttled_sharded< F: FnOnce() -> InternalEvent >( address: usize, callback: F ) {
+    let _timer = Timer::start( Stage::Send );
     EVENT_CHANNEL.sharded_chunked_send_with( address, callback );
 }
 
+/// Accounts for a single event queued by the current thread.
+#[inline(always)]
+fn account_for_event( queues: &ThreadEventQueues ) {
+    // Only the thread which owns the queues ever touches this, so there's no need for an atomic increment.
+    let count = queues.unaccounted.load( Ordering::Relaxed ) + 1;
+    if count < ACCOUNTING_BATCH_SIZE {
+        queues.unaccounted.store( count, Ordering::Relaxed );
+        return;
+    }
+
+    queues.unaccounted.store( 0, Ordering::Relaxed );
+    crate::backpressure::on_events_queued( count );
+}
+
+/// Sends an event through the current thread's event ring, falling back to the channel if it's full.
+///
+/// Only events whose ordering doesn't depend on events emitted by any other thread
+/// can be sent this way, since the rings are always processed *before* the channel.
+#[inline(always)]
+pub(crate) fn send_event_throttled_through_thread< F: FnOnce() -> InternalEvent >( thread: &StrongThreadHandle, key: usize, callback: F ) {
+    debug_assert!( !thread.is_dead() );
+
+    let _timer = Timer::start( Stage::Send );
+    account_for_event( thread.event_queues() );
+    if let Some( ring ) = thread.event_queues().ring.as_ref() {
+        // This is safe since a strong handle can only exist on its own thread
+        // and there can only be one of them alive at any given time.
+        match unsafe { ring.push( callback() ) } {
+            Ok( length ) => {
+                if length == ring.capacity() / 2 {
+                    EVENT_CHANNEL.flush();
+                }
+            },
+            Err( event ) => {
+                EVENT_CHANNEL.sharded_chunked_send_with( key, move || event );
+            }
+        }
+
+        return;
+    }
+
+    EVENT_CHANNEL.sharded_chunked_send_with( key, callback );
+}
+
+/// Stages an event on the current thread; it will be sent to the channel in a batch with other events.
+///
+/// Only events after which no other events can be emitted for the same allocation
+/// can be sent this way, since the staged events are always processed *after* the channel.
+#[inline(always)]
+pub(crate) fn send_event_staged< F: FnOnce() -> InternalEvent >( thread: &StrongThreadHandle, callback: F ) {
+    debug_assert!( !thread.is_dead() );
+
+    account_for_event( thread.event_queues() );
+    let mut staged = thread.event_queues().staged.lock();
+    staged.push( callback() );
+    if staged.len() >= STAGED_EVENTS_LIMIT {
+        EVENT_CHANNEL.late_chunked_send_all( &mut staged );
+    }
+}
+
+/// Sends all of the events staged on a given thread to the channel.
+pub(crate) fn flush_staged_events( queues: &ThreadEventQueues ) {
+    let mut staged = queues.staged.lock();
+    if !staged.is_empty() {
+        EVENT_CHANNEL.late_chunked_send_all( &mut staged );
+    }
+}
+
+fn drain_thread_event_queues( buffer: &mut ChannelBuffer< InternalEvent > ) {
+    let mut all_queues = THREAD_EVENT_QUEUES.lock();
+    for queues in all_queues.iter() {
+        if let Some( ring ) = queues.ring.as_ref() {
+            unsafe {
+                ring.drain_into( buffer.front_mut() );
+            }
+        }
+
+        let mut staged = queues.staged.lock();
+        buffer.back_mut().extend( staged.drain( .. ) );
+    }
+
+    // Get rid of the queues of threads which were already garbage collected.
+    all_queues.retain( |queues| Arc::strong_count( queues ) > 1 || !queues.is_empty() );
+}
+
 pub(crate) fn timed_recv_all_events( buffer: &mut ChannelBuffer< InternalEvent >, duration: Duration ) {
-    EVENT_CHANNEL.timed_recv_all( buffer, duration )
+    EVENT_CHANNEL.timed_recv_all( buffer, duration );
+
+    // This must happen *after* the channel was emptied. An event in the channel can depend
+    // on an event which was previously pushed into a ring (e.g. a free on another thread),
+    // and a staged event can depend on an event in the channel, but never the other way around.
+    drain_thread_event_queues( buffer );
+
+    crate::backpressure::on_events_received( buffer.len() );
 }
 
 pub(crate) fn flush() {
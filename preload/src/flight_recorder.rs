@@ -0,0 +1,163 @@
+//! The flight recorder, which only keeps the most recent data in memory and writes it out when triggered.
+//!
+//! The compressed output is split into segments which each start with a checkpoint of the live set,
+//! so whole segments can be dropped from the front and whatever's left is still loadable on its own.
+//! The only things the segments can refer to from before they've started are the backtraces, which
+//! are recorded here on the side as they're written out; the header, the maps and the binaries
+//! are regenerated when a dump is written.
+
+use std::collections::VecDeque;
+use std::fs::File;
+use std::io::{self, Write};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+
+use common::event::{DataId, Event};
+use common::lz4_stream::Lz4Writer;
+use common::speedy::Writable;
+
+use crate::opt;
+use crate::spin_lock::SpinLock;
+use crate::timestamp::Timestamp;
+use crate::writers;
+
+/// Every backtrace which was written out so far, as uncompressed events.
+static BACKTRACES: SpinLock< Vec< u8 > > = SpinLock::new( Vec::new() );
+static DUMP_REQUESTED: AtomicBool = AtomicBool::new( false );
+
+pub fn is_enabled() -> bool {
+    opt::is_initialized() && opt::get().flight_recorder
+}
+
+pub fn on_backtrace( event: &Event ) {
+    let _ = event.write_to_stream( &mut *BACKTRACES.lock() );
+}
+
+/// Asks the processing thread to write out a dump; safe to call from a signal handler.
+pub fn request_dump() {
+    DUMP_REQUESTED.store( true, Ordering::SeqCst );
+}
+
+pub fn take_dump_request() -> bool {
+    DUMP_REQUESTED.load( Ordering::Relaxed ) && DUMP_REQUESTED.swap( false, Ordering::SeqCst )
+}
+
+pub struct FlightRecorder {
+    max_size: usize,
+    max_duration: Option< Timestamp >,
+    /// The segments which are already finished, along with when each of them was started.
+    sealed: VecDeque< (Timestamp, Arc< Vec< u8 > >) >,
+    sealed_size: usize,
+    current: Vec< u8 >,
+    current_started_at: Timestamp
+}
+
+impl FlightRecorder {
+    /// The size is in bytes; the duration is how long is kept, if it's limited.
+    pub fn new( timestamp: Timestamp, max_size: usize, max_duration: Option< Timestamp > ) -> Self {
+        FlightRecorder {
+            max_size,
+            max_duration,
+            sealed: VecDeque::new(),
+            sealed_size: 0,
+            current: Vec::new(),
+            current_started_at: timestamp
+        }
+    }
+
+    pub fn append( &mut self, data: &[u8] ) {
+        self.current.extend_from_slice( data );
+        self.evict( None );
+    }
+
+    /// Finishes the current segment; whatever's appended afterwards must be loadable without anything before it.
+    pub fn start_segment( &mut self, timestamp: Timestamp ) {
+        if !self.current.is_empty() {
+            let current = std::mem::replace( &mut self.current, Vec::new() );
+            self.sealed_size += current.len();
+            self.sealed.push_back( (self.current_started_at, Arc::new( current )) );
+        }
+
+        self.current_started_at = timestamp;
+        self.evict( Some( timestamp ) );
+    }
+
+    /// Drops the oldest segments which don't fit anymore; the current one is always kept.
+    fn evict( &mut self, now: Option< Timestamp > ) {
+        while let Some( &(_, ref segment) ) = self.sealed.front() {
+            let is_too_big = self.sealed_size + self.current.len() > self.max_size;
+            let is_too_old = match (now, self.max_duration) {
+                (Some( now ), Some( max_duration )) => {
+                    // The segment ends when the next one starts.
+                    let end = self.sealed.get( 1 ).map( |&(started_at, _)| started_at ).unwrap_or( self.current_started_at );
+                    now.as_usecs() > end.as_usecs() + max_duration.as_usecs()
+                },
+                _ => false
+            };
+
+            if !is_too_big && !is_too_old {
+                break;
+            }
+
+            self.sealed_size -= segment.len();
+            self.sealed.pop_front();
+        }
+    }
+
+    /// The finished segments, oldest first.
+    pub fn segments( &self ) -> Vec< Arc< Vec< u8 > > > {
+        self.sealed.iter().map( |&(_, ref segment)| segment.clone() ).collect()
+    }
+}
+
+/// Writes out a dump made out of the given segments.
+pub fn write_dump( mut fp: File, id: DataId, initial_timestamp: Timestamp, segments: Vec< Arc< Vec< u8 > > > ) -> io::Result< () > {
+    let backtraces = BACKTRACES.lock().clone();
+    {
+        let mut serializer = Lz4Writer::new( &mut fp );
+        writers::write_initial_data( id, initial_timestamp, &mut serializer )?;
+        if opt::get().write_binaries_to_output {
+            writers::write_binaries( &mut serializer )?;
+        }
+
+        serializer.write_all( &backtraces )?;
+        serializer.flush()?;
+    }
+
+    for segment in segments {
+        fp.write_all( &segment )?;
+    }
+
+    fp.flush()
+}
+
+#[test]
+fn test_flight_recorder_eviction() {
+    let at = Timestamp::from_secs;
+    let lengths = |recorder: &FlightRecorder| recorder.segments().iter().map( |segment| segment.len() ).collect::< Vec< _ > >();
+
+    let mut recorder = FlightRecorder::new( at( 0 ), 100, Some( at( 60 ) ) );
+    recorder.append( &[0; 30] );
+    recorder.start_segment( at( 10 ) );
+    recorder.append( &[0; 30] );
+    recorder.start_segment( at( 20 ) );
+    assert_eq!( lengths( &recorder ), vec![ 30, 30 ] );
+
+    // Too big; the current segment is never dropped.
+    recorder.append( &[0; 50] );
+    assert_eq!( lengths( &recorder ), vec![ 30 ] );
+    recorder.append( &[0; 100] );
+    assert_eq!( lengths( &recorder ), Vec::< usize >::new() );
+
+    let mut recorder = FlightRecorder::new( at( 0 ), 1000, Some( at( 60 ) ) );
+    recorder.append( &[0; 10] );
+    recorder.start_segment( at( 30 ) );
+    recorder.append( &[0; 20] );
+    recorder.start_segment( at( 60 ) );
+    recorder.start_segment( at( 90 ) );
+    assert_eq!( lengths( &recorder ), vec![ 10, 20 ] );
+
+    // Too old; the first segment ended at 30s.
+    recorder.start_segment( at( 91 ) );
+    assert_eq!( lengths( &recorder ), vec![ 20 ] );
+}
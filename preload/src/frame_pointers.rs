@@ -0,0 +1,197 @@
+use std::mem;
+use std::ops::Range;
+
+/// Extracts the address ranges of all of the executable mappings from the contents of `/proc/self/maps`.
+///
+/// The returned ranges are sorted.
+pub fn executable_regions_from_maps( maps: &str ) -> Vec< Range< usize > > {
+    let mut regions = Vec::new();
+    for line in maps.lines() {
+        let mut iter = line.split_whitespace();
+        let (range, permissions) = match (iter.next(), iter.next()) {
+            (Some( range ), Some( permissions )) => (range, permissions),
+            _ => continue
+        };
+
+        if permissions.as_bytes().get( 2 ) != Some( &b'x' ) {
+            continue;
+        }
+
+        let mut range = range.splitn( 2, '-' );
+        let start = range.next().and_then( |value| usize::from_str_radix( value, 16 ).ok() );
+        let end = range.next().and_then( |value| usize::from_str_radix( value, 16 ).ok() );
+        if let (Some( start ), Some( end )) = (start, end) {
+            regions.push( start..end );
+        }
+    }
+
+    regions.sort_by_key( |region| region.start );
+    regions
+}
+
+fn is_executable( regions: &[Range< usize >], address: usize ) -> bool {
+    let index = match regions.binary_search_by_key( &address, |region| region.start ) {
+        Ok( index ) => index,
+        Err( 0 ) => return false,
+        Err( index ) => index - 1
+    };
+
+    regions[ index ].contains( &address )
+}
+
+/// Returns the address range of the current thread's stack, or an empty range if it's unknown.
+pub fn current_thread_stack() -> Range< usize > {
+    unsafe {
+        let mut attr: libc::pthread_attr_t = mem::zeroed();
+        if libc::pthread_getattr_np( libc::pthread_self(), &mut attr ) != 0 {
+            return 0..0;
+        }
+
+        let mut address: *mut libc::c_void = std::ptr::null_mut();
+        let mut size: libc::size_t = 0;
+        let result = libc::pthread_attr_getstack( &attr, &mut address, &mut size );
+        libc::pthread_attr_destroy( &mut attr );
+
+        if result != 0 {
+            return 0..0;
+        }
+
+        address as usize..address as usize + size
+    }
+}
+
+#[cfg(target_arch = "x86_64")]
+#[inline(always)]
+fn current_frame_pointer() -> usize {
+    let fp: usize;
+    unsafe {
+        std::arch::asm!( "mov {}, rbp", out( reg ) fp, options( nomem, nostack, preserves_flags ) );
+    }
+    fp
+}
+
+#[cfg(target_arch = "aarch64")]
+#[inline(always)]
+fn current_frame_pointer() -> usize {
+    let fp: usize;
+    unsafe {
+        std::arch::asm!( "mov {}, x29", out( reg ) fp, options( nomem, nostack, preserves_flags ) );
+    }
+    fp
+}
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+#[inline(always)]
+fn current_frame_pointer() -> usize {
+    0
+}
+
+/// Whether the profiler itself was built with frame pointers, without which the chain
+/// is already broken within our own hooks; see `build.rs`.
+pub const IS_SUPPORTED: bool = cfg!( all( has_frame_pointers, any( target_arch = "x86_64", target_arch = "aarch64" ) ) );
+
+/// Walks the chain of frame pointers starting from the caller's frame, pushing every return address into `output`.
+///
+/// On both AMD64 and AArch64 every frame record consists of the previous frame pointer
+/// followed by the return address, and the chain is terminated with a null frame pointer.
+///
+/// Every frame pointer must point inside of the `stack`, and must be higher than the previous one,
+/// and every return address must point inside of one of the executable `regions`; if any of those
+/// doesn't hold then the chain is considered to be broken and `false` is returned, in which case
+/// the contents of `output` are garbage.
+#[inline(always)]
+pub fn unwind( stack: &Range< usize >, regions: &[Range< usize >], output: &mut Vec< usize > ) -> bool {
+    if !IS_SUPPORTED {
+        return false;
+    }
+
+    unwind_from( current_frame_pointer(), stack, regions, output )
+}
+
+fn unwind_from( mut fp: usize, stack: &Range< usize >, regions: &[Range< usize >], output: &mut Vec< usize > ) -> bool {
+    let mut previous_fp = 0;
+    loop {
+        if fp == 0 {
+            return !output.is_empty();
+        }
+
+        if fp % mem::align_of::< usize >() != 0 || fp <= previous_fp || fp < stack.start || fp.saturating_add( 2 * mem::size_of::< usize >() ) > stack.end {
+            return false;
+        }
+
+        let (next_fp, return_address) = unsafe {
+            let record = fp as *const usize;
+            (*record, *record.add( 1 ))
+        };
+
+        if !is_executable( regions, return_address ) {
+            return false;
+        }
+
+        output.push( return_address );
+        previous_fp = fp;
+        fp = next_fp;
+    }
+}
+
+#[test]
+fn test_executable_regions_from_maps() {
+    let maps = "\
+7f0000002000-7f0000003000 r-xp 00001000 fd:01 1234  /usr/lib/libc.so.6
+7f0000000000-7f0000001000 r-xp 00000000 fd:01 1234  /usr/lib/libfoo.so
+7f0000001000-7f0000002000 rw-p 00000000 00:00 0
+7ffd00000000-7ffd00021000 rw-p 00000000 00:00 0     [stack]
+";
+
+    let regions = executable_regions_from_maps( maps );
+    assert_eq!( regions, vec![ 0x7f0000000000..0x7f0000001000, 0x7f0000002000..0x7f0000003000 ] );
+
+    assert!( !is_executable( &regions, 0x1000 ) );
+    assert!( is_executable( &regions, 0x7f0000000000 ) );
+    assert!( is_executable( &regions, 0x7f0000000fff ) );
+    assert!( !is_executable( &regions, 0x7f0000001000 ) );
+    assert!( is_executable( &regions, 0x7f0000002800 ) );
+    assert!( !is_executable( &regions, 0x7f0000003000 ) );
+}
+
+#[test]
+fn test_unwind_through_fake_frames() {
+    let mut stack = [0_usize; 8];
+    let base = stack.as_ptr() as usize;
+    let word = mem::size_of::< usize >();
+    let range = base..base + stack.len() * word;
+    let regions = vec![ 0x1000..0x2000 ];
+
+    // Two frames, the last one of which terminates the chain.
+    stack[ 2 ] = base + 4 * word;
+    stack[ 3 ] = 0x1010;
+    stack[ 4 ] = 0;
+    stack[ 5 ] = 0x1020;
+
+    let mut output = Vec::new();
+    assert!( unwind_from( base + 2 * word, &range, &regions, &mut output ) );
+    assert_eq!( output, vec![ 0x1010, 0x1020 ] );
+
+    // A return address outside of any executable region breaks the chain.
+    stack[ 5 ] = 0x3000;
+    output.clear();
+    assert!( !unwind_from( base + 2 * word, &range, &regions, &mut output ) );
+
+    // So does a loop.
+    stack[ 4 ] = base + 2 * word;
+    stack[ 5 ] = 0x1020;
+    output.clear();
+    assert!( !unwind_from( base + 2 * word, &range, &regions, &mut output ) );
+}
+
+#[test]
+fn test_current_thread_stack() {
+    fn check() {
+        let local = 0_usize;
+        let address = &local as *const usize as usize;
+        assert!( current_thread_stack().contains( &address ) );
+    }
+
+    check();
+    std::thread::spawn( check ).join().unwrap();
+}
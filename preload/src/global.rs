@@ -1,25 +1,25 @@
 use std::cell::UnsafeCell;
 use std::ops::Deref;
-use std::sync::atomic::{AtomicBool, AtomicUsize, AtomicU64, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicPtr, AtomicUsize, AtomicU32, AtomicU64, Ordering};
 use std::sync::Mutex;
 use std::thread;
 
 use crate::arc_lite::ArcLite;
-use crate::event::{InternalAllocationId, InternalEvent, send_event};
-use crate::spin_lock::{SpinLock, SpinLockGuard};
+use crate::event::{InternalAllocationId, InternalEvent, ThreadEventQueues, send_event};
+use crate::spin_lock::{AdaptiveLock, AdaptiveLockGuard, SpinLock};
 use crate::{opt, syscall};
 use crate::unwind::{ThreadUnwindState, prepare_to_start_unwinding};
 use crate::timestamp::Timestamp;
 use crate::allocation_tracker::AllocationTracker;
+use crate::allocator_latency::PendingLatencies;
+use crate::sampler::Sampler;
 use thread_local_reentrant::AccessError as TlsAccessError;
 
 pub type RawThreadHandle = ArcLite< ThreadData >;
 
 struct ThreadRegistry {
     enabled_for_new_threads: bool,
-    threads_by_system_id: crate::utils::HashMap< u32, RawThreadHandle >,
-    new_dead_thread_queue: Vec< (Timestamp, RawThreadHandle) >,
-    thread_counter: u64
+    threads_by_system_id: crate::utils::HashMap< u32, RawThreadHandle >
 }
 
 unsafe impl Send for ThreadRegistry {}
@@ -48,13 +48,39 @@ const DESIRED_STATE_SUSPENDED: usize = 1;
 const DESIRED_STATE_ENABLED: usize = 2;
 static DESIRED_STATE: AtomicUsize = AtomicUsize::new( DESIRED_STATE_DISABLED );
 
-static THREAD_REGISTRY: SpinLock< ThreadRegistry > = SpinLock::new( ThreadRegistry {
+static THREAD_REGISTRY: AdaptiveLock< ThreadRegistry > = AdaptiveLock::new( ThreadRegistry {
     enabled_for_new_threads: false,
-    threads_by_system_id: crate::utils::empty_hashmap(),
-    new_dead_thread_queue: Vec::new(),
-    thread_counter: 1
+    threads_by_system_id: crate::utils::empty_hashmap()
 });
 
+static THREAD_COUNTER: AtomicU64 = AtomicU64::new( 1 );
+
+struct DeadThread {
+    timestamp: Timestamp,
+    thread: RawThreadHandle,
+    next: *mut DeadThread
+}
+
+/// The threads which have died since the garbage collector last ran, newest first.
+///
+/// This is a lock-free stack so that threads don't have to fight over the registry's lock when they exit.
+static NEW_DEAD_THREADS: AtomicPtr< DeadThread > = AtomicPtr::new( std::ptr::null_mut() );
+
+fn push_dead_thread( timestamp: Timestamp, thread: RawThreadHandle ) {
+    let node = Box::into_raw( Box::new( DeadThread { timestamp, thread, next: std::ptr::null_mut() } ) );
+    let mut head = NEW_DEAD_THREADS.load( Ordering::Relaxed );
+    loop {
+        unsafe {
+            (*node).next = head;
+        }
+
+        match NEW_DEAD_THREADS.compare_exchange_weak( head, node, Ordering::Release, Ordering::Relaxed ) {
+            Ok( _ ) => break,
+            Err( current ) => head = current
+        }
+    }
+}
+
 #[inline(never)]
 fn lock_thread_registry< R >( callback: impl FnOnce( &mut ThreadRegistry ) -> R ) -> R {
     callback( &mut THREAD_REGISTRY.lock() )
@@ -98,6 +124,13 @@ pub fn using_unprefixed_jemalloc() -> bool {
 #[cfg(not(feature = "jemalloc"))]
 static USING_UNPREFIXED_JEMALLOC: AtomicBool = AtomicBool::new( false );
 
+static JEMALLOC_HOOKED: AtomicBool = AtomicBool::new( false );
+
+/// Whether the program's allocations are served by our own jemalloc.
+pub fn is_jemalloc_in_use() -> bool {
+    cfg!( feature = "jemalloc" ) || JEMALLOC_HOOKED.load( Ordering::Relaxed )
+}
+
 #[cfg(not(feature = "jemalloc"))]
 #[inline]
 pub fn using_unprefixed_jemalloc() -> bool {
@@ -173,6 +206,11 @@ fn try_sync_processing_thread_destruction() {
 }
 
 pub fn sync() {
+    if let Some( thread ) = StrongThreadHandle::acquire() {
+        crate::event::flush_staged_events( thread.event_queues() );
+        crate::event::flush();
+    }
+
     try_sync_processing_thread_destruction();
 
     while is_busy() {
@@ -189,6 +227,8 @@ pub extern fn on_exit() {
 
     info!( "Exit hook called" );
 
+    crate::allocator_latency::flush_current_thread();
+
     DESIRED_STATE.store( DESIRED_STATE_DISABLED, Ordering::SeqCst );
     send_event( InternalEvent::Exit );
 
@@ -208,6 +248,7 @@ pub unsafe extern fn on_fork() {
     DESIRED_STATE.store( DESIRED_STATE_DISABLED, Ordering::SeqCst );
     THREAD_RUNNING.store( false, Ordering::SeqCst );
     THREAD_REGISTRY.force_unlock(); // In case we were forked when the lock was held.
+    crate::logger::on_fork();
     {
         let tid = syscall::gettid();
         let mut registry = THREAD_REGISTRY.lock();
@@ -220,6 +261,17 @@ pub unsafe extern fn on_fork() {
     let _ = TLS.try_with( |tls| tls.set_enabled( false ) );
 }
 
+/// Sets the tag of the current thread; it's only sent out along with the thread's next allocation.
+pub fn set_thread_tag( tag: u32 ) {
+    let _ = TLS.try_with( |tls| unsafe {
+        (*tls.tag.get()).0 = tag;
+    });
+}
+
+pub fn thread_tag() -> u32 {
+    TLS.try_with( |tls| unsafe { (*tls.tag.get()).0 } ).unwrap_or( 0 )
+}
+
 fn spawn_processing_thread() {
     info!( "Will spawn the event processing thread..." );
 
@@ -242,9 +294,11 @@ fn spawn_processing_thread() {
             assert!( !tls.is_enabled() );
         }).unwrap();
 
+        crate::logger::start_queueing();
         let result = std::panic::catch_unwind( || {
             crate::processing_thread::thread_main();
         });
+        crate::logger::stop_queueing();
 
         if result.is_err() {
             DESIRED_STATE.store( DESIRED_STATE_DISABLED, Ordering::SeqCst );
@@ -295,6 +349,43 @@ fn spawn_processing_thread() {
     info!( "Event processing thread created!" );
 }
 
+/// Spawns a detached helper thread for the profiler's own use; nothing it does is going to be tracked.
+pub(crate) fn spawn_internal_thread( name: &'static [u8], callback: impl FnOnce() + Send + 'static ) -> bool {
+    type Callback = Box< dyn FnOnce() + Send >;
+
+    extern "C" fn thread_main( argument: *mut libc::c_void ) -> *mut libc::c_void {
+        let callback = unsafe { Box::from_raw( argument as *mut Callback ) };
+        TLS.try_with( |tls| {
+            unsafe {
+                *tls.is_internal.get() = true;
+            }
+            tls.set_enabled( false );
+        }).unwrap();
+
+        let _ = std::panic::catch_unwind( std::panic::AssertUnwindSafe( callback ) );
+        std::ptr::null_mut()
+    }
+
+    debug_assert_eq!( name.last(), Some( &0 ) );
+
+    let callback: Box< Callback > = Box::new( Box::new( callback ) );
+    let argument = Box::into_raw( callback ) as *mut libc::c_void;
+    unsafe {
+        let mut thread: libc::pthread_t = std::mem::zeroed();
+        let result = libc::pthread_create( &mut thread, std::ptr::null(), thread_main, argument );
+        if result != 0 {
+            warn!( "Failed to spawn an internal thread: {}", std::io::Error::from_raw_os_error( result ) );
+            std::mem::drop( Box::from_raw( argument as *mut Callback ) );
+            return false;
+        }
+
+        libc::pthread_setname_np( thread, name.as_ptr() as *const libc::c_char );
+        libc::pthread_detach( thread );
+    }
+
+    true
+}
+
 #[cfg(target_arch = "x86_64")]
 fn find_internal_syms< const N: usize >( names: &[&str; N] ) -> [usize; N] {
     let mut addresses = [0; N];
@@ -480,6 +571,8 @@ fn hook_jemalloc() {
         return;
     }
 
+    JEMALLOC_HOOKED.store( true, Ordering::SeqCst );
+
     let index_mallocx = names.iter().position( |name| *name == "mallocx" ).unwrap();
     let index_sdallocx = names.iter().position( |name| *name == "sdallocx" ).unwrap();
     let index_rallocx = names.iter().position( |name| *name == "rallocx" ).unwrap();
@@ -503,6 +596,19 @@ fn hook_jemalloc() {
     }
 }
 
+/// Makes the executable's own jemalloc report its allocations to us through its hooks.
+#[cfg(target_arch = "x86_64")]
+fn install_jemalloc_hooks() -> bool {
+    let addresses = find_internal_syms( &[ "mallctl", "_rjem_mallctl" ] );
+    let mallctl = match addresses.iter().copied().find( |&address| address != 0 ) {
+        Some( address ) => address,
+        None => return false
+    };
+
+    info!( "Installing jemalloc hooks..." );
+    unsafe { crate::jemalloc_hooks::install( mallctl ) }
+}
+
 #[cfg(target_arch = "x86_64")]
 fn hook_symbols( names: &[&str], addresses: &[usize], replacements: &[usize] ) {
     assert_eq!( names.len(), replacements.len() );
@@ -619,7 +725,11 @@ fn initialize_stage_1() {
     }
 
     #[cfg(target_arch = "x86_64")]
-    hook_jemalloc();
+    {
+        if !(crate::opt::get().use_jemalloc_hooks && install_jemalloc_hooks()) {
+            hook_jemalloc();
+        }
+    }
 
     #[cfg(target_arch = "x86_64")]
     hook_private_mmap();
@@ -666,14 +776,16 @@ fn initialize_stage_2() {
     crate::init::initialize_atexit_hook();
     crate::init::initialize_signal_handlers();
 
-    if !opt::get().track_child_processes {
+    if !opt::get().track_child_processes && !cfg!( feature = "global-allocator" ) {
         std::env::remove_var( "LD_PRELOAD" );
     }
 
     info!( "Stage 2 initialization finished" );
 }
 
-static ALLOW_STAGE_2: AtomicBool = AtomicBool::new( false );
+// The global allocator is only ever called after libc is already initialized,
+// and there's no guarantee our constructor will be linked in when we're a static library.
+static ALLOW_STAGE_2: AtomicBool = AtomicBool::new( cfg!( feature = "global-allocator" ) );
 
 #[used]
 #[link_section = ".init_array.00099"]
@@ -724,6 +836,7 @@ fn try_enable( mut state: usize ) -> bool {
     });
 
     prepare_to_start_unwinding();
+    crate::page_faults::start();
     spawn_processing_thread();
 
     lock_thread_registry( |thread_registry| {
@@ -762,18 +875,50 @@ pub fn try_disable_if_requested() {
 
 const THROTTLE_LIMIT: usize = 8192;
 
+/// Bumped every time the `AllocationLock` is released.
+static THROTTLE_GENERATION: AtomicU32 = AtomicU32::new( 0 );
+
 #[cold]
 #[inline(never)]
 fn throttle( tls: &RawThreadHandle ) {
-    while ArcLite::get_refcount_relaxed( tls ) >= THROTTLE_LIMIT {
-        thread::yield_now();
+    crate::backpressure::on_throttled();
+
+    let _timer = crate::instrumentation::Timer::start( crate::instrumentation::Stage::Throttle );
+    let mut backoff = crate::backpressure::Backoff::new();
+    loop {
+        let generation = THROTTLE_GENERATION.load( Ordering::Acquire );
+        if ArcLite::get_refcount_relaxed( tls ) < THROTTLE_LIMIT {
+            break;
+        }
+
+        backoff.wait( &THROTTLE_GENERATION, generation );
     }
 }
 
+pub fn processing_thread_tid() -> u32 {
+    unsafe { PROCESSING_THREAD_TID }
+}
+
 pub fn is_actively_running() -> bool {
     DESIRED_STATE.load( Ordering::Relaxed ) == DESIRED_STATE_ENABLED
 }
 
+/// Whenever the allocator hooks can skip touching the per-thread state altogether,
+/// which is the case when the profiler is initialized but paused and isn't about to start.
+#[inline(always)]
+pub fn is_bypassed() -> bool {
+    let desired_state = DESIRED_STATE.load( Ordering::Relaxed );
+    if desired_state == DESIRED_STATE_ENABLED {
+        return false;
+    }
+
+    match STATE.load( Ordering::Relaxed ) {
+        STATE_ENABLED | STATE_PERMANENTLY_DISABLED => true,
+        STATE_DISABLED => desired_state == DESIRED_STATE_DISABLED,
+        _ => false
+    }
+}
+
 /// A handle to per-thread storage; you can't do anything with it.
 ///
 /// Can be sent to other threads.
@@ -810,6 +955,9 @@ impl StrongThreadHandle {
             if !tls.is_enabled() {
                 None
             } else {
+                if crate::backpressure::is_over_budget() {
+                    crate::backpressure::on_over_budget();
+                }
                 if ArcLite::get_refcount_relaxed( tls ) >= THROTTLE_LIMIT {
                     throttle( tls );
                 }
@@ -863,7 +1011,67 @@ impl StrongThreadHandle {
             *counter += 1;
         }
 
-        InternalAllocationId::new( tls.internal_thread_id, allocation )
+        InternalAllocationId::new( tls.internal_thread_id, allocation ).as_stored( opt::get().compact_allocation_ids )
+    }
+
+    /// Returns the NUMA node on which this thread is running, already encoded as allocation flags.
+    ///
+    /// Threads rarely migrate between nodes, so this is only looked up once every few allocations.
+    #[inline(always)]
+    pub fn numa_node_flags( &mut self ) -> u32 {
+        const REFRESH_INTERVAL: u32 = 64;
+
+        let tls = match self.0.as_ref() {
+            Some( tls ) => tls,
+            None => unsafe { std::hint::unreachable_unchecked() }
+        };
+
+        let (flags, countdown) = unsafe { &mut *tls.numa_node.get() };
+        if *countdown == 0 {
+            *countdown = REFRESH_INTERVAL;
+            *flags = syscall::getcpu().map( |(_, node)| common::event::numa_node_into_alloc_flags( node ) ).unwrap_or( 0 );
+        }
+
+        *countdown -= 1;
+        *flags
+    }
+
+    /// Returns the tag of this thread if it was changed since the last time this was called.
+    #[inline(always)]
+    pub fn take_tag_change( &mut self ) -> Option< u32 > {
+        let tls = match self.0.as_ref() {
+            Some( tls ) => tls,
+            None => unsafe { std::hint::unreachable_unchecked() }
+        };
+
+        let (tag, sent_tag) = unsafe { &mut *tls.tag.get() };
+        if *sent_tag == *tag as u64 {
+            return None;
+        }
+
+        *sent_tag = *tag as u64;
+        Some( *tag )
+    }
+
+    /// Decides whenever an allocation of a given size should be tracked.
+    ///
+    /// This always returns `true` unless sampling is enabled, or unless we've
+    /// degraded to sampling because too many events are waiting to be processed.
+    #[inline(always)]
+    pub fn should_sample( &mut self, size: usize ) -> bool {
+        let tls = match self.0.as_ref() {
+            Some( tls ) => tls,
+            None => unsafe { std::hint::unreachable_unchecked() }
+        };
+
+        let interval = opt::sampling_interval();
+        if interval != 0 && unsafe { !(*tls.sampler.get()).should_sample( size, interval ) } {
+            return false;
+        }
+
+        unsafe {
+            !crate::backpressure::should_sample_out( &mut *tls.degraded_sampling_counter.get() )
+        }
     }
 
     pub fn system_tid( &self ) -> u32 {
@@ -893,7 +1101,25 @@ impl StrongThreadHandle {
         &tls.allocation_tracker
     }
 
-    pub(crate) fn zombie_events( &self ) -> &SpinLock< Vec< InternalEvent > > {
+    pub(crate) fn allocator_latencies( &mut self ) -> &mut PendingLatencies {
+        let tls = match self.0.as_ref() {
+            Some( tls ) => tls,
+            None => unsafe { std::hint::unreachable_unchecked() }
+        };
+
+        unsafe { &mut *tls.allocator_latencies.get() }
+    }
+
+    pub(crate) fn event_queues( &self ) -> &ThreadEventQueues {
+        let tls = match self.0.as_ref() {
+            Some( tls ) => tls,
+            None => unsafe { std::hint::unreachable_unchecked() }
+        };
+
+        &tls.event_queues
+    }
+
+    pub(crate) fn zombie_events( &self ) -> &AdaptiveLock< Vec< InternalEvent > > {
         let tls = match self.0.as_ref() {
             Some( tls ) => tls,
             None => unsafe { std::hint::unreachable_unchecked() }
@@ -972,6 +1198,9 @@ pub fn acquire_any_thread_handle() -> Option< ThreadHandleKind > {
         if !tls.is_enabled() {
             ThreadHandleKind::Weak( WeakThreadHandle( tls.0.clone() ) )
         } else {
+            if crate::backpressure::is_over_budget() {
+                crate::backpressure::on_over_budget();
+            }
             if ArcLite::get_refcount_relaxed( tls ) >= THROTTLE_LIMIT {
                 throttle( tls );
             }
@@ -996,7 +1225,7 @@ pub fn acquire_any_thread_handle() -> Option< ThreadHandleKind > {
 
 pub struct AllocationLock {
     current_thread_id: u32,
-    registry_lock: SpinLockGuard< 'static, ThreadRegistry >
+    registry_lock: AdaptiveLockGuard< 'static, ThreadRegistry >
 }
 
 impl AllocationLock {
@@ -1052,20 +1281,33 @@ impl Drop for AllocationLock {
                 ArcLite::sub( tls, THROTTLE_LIMIT );
             }
         }
+
+        crate::backpressure::wake_all( &THROTTLE_GENERATION );
     }
 }
 
 pub struct ThreadData {
     thread_id: u32,
     internal_thread_id: u64,
+    created_at: Timestamp,
     is_internal: UnsafeCell< bool >,
     enabled: AtomicBool,
     is_dead: AtomicBool,
     is_unwinding: UnsafeCell< bool >,
     unwind_state: UnsafeCell< ThreadUnwindState >,
     allocation_counter: UnsafeCell< u64 >,
+    sampler: UnsafeCell< Sampler >,
+    degraded_sampling_counter: UnsafeCell< u64 >,
+    /// The cached NUMA node of the thread, as allocation flags, and after how many allocations it should be refreshed.
+    numa_node: UnsafeCell< (u32, u32) >,
+    /// The tag set by the user, and the last one which was sent out; the latter starts out as
+    /// something which can't be a tag so that the first allocation of every thread sends it out.
+    tag: UnsafeCell< (u32, u64) >,
     allocation_tracker: AllocationTracker,
-    zombie_events: SpinLock< Vec< InternalEvent > >
+    /// Only touched by the thread itself while it's alive, and by the processing thread once it's dead.
+    allocator_latencies: UnsafeCell< PendingLatencies >,
+    event_queues: std::sync::Arc< ThreadEventQueues >,
+    zombie_events: AdaptiveLock< Vec< InternalEvent > >
 }
 
 impl ThreadData {
@@ -1102,12 +1344,8 @@ impl Drop for ThreadSentinel {
         let is_enabled = self.enabled.load( Ordering::SeqCst );
         self.enabled.store( false, Ordering::SeqCst );
 
-        lock_thread_registry( |thread_registry| {
-            if let Some( thread ) = thread_registry.threads_by_system_id().get( &self.thread_id ) {
-                let thread = thread.clone();
-                thread_registry.new_dead_thread_queue.push( (crate::timestamp::get_timestamp(), thread) );
-            }
-        });
+        crate::event::flush_staged_events( &self.event_queues );
+        push_dead_thread( crate::timestamp::get_timestamp(), self.0.clone() );
 
         debug!( "Thread dropped: {:04X}", self.thread_id );
         self.enabled.store( is_enabled, Ordering::SeqCst );
@@ -1117,52 +1355,162 @@ impl Drop for ThreadSentinel {
 thread_local_reentrant! {
     static TLS: ThreadSentinel = |callback| {
         let thread_id = syscall::gettid();
-        let tls = lock_thread_registry( |registry| {
-            let internal_thread_id = registry.thread_counter;
-            registry.thread_counter += 1;
+        let tls = {
+            let internal_thread_id = THREAD_COUNTER.fetch_add( 1, Ordering::Relaxed );
+            let created_at = crate::timestamp::get_timestamp();
+            let mut sampler = Sampler::new( internal_thread_id.wrapping_mul( 0x9E3779B97F4A7C15 ) ^ created_at.as_usecs() );
+            if opt::is_initialized() {
+                sampler.reset( opt::sampling_interval() );
+            }
 
             let tls = ThreadData {
                 thread_id,
                 internal_thread_id,
+                created_at,
                 is_internal: UnsafeCell::new( false ),
                 is_dead: AtomicBool::new( false ),
-                enabled: AtomicBool::new( registry.enabled_for_new_threads && thread_id != unsafe { PROCESSING_THREAD_TID } ),
+                enabled: AtomicBool::new( false ),
                 is_unwinding: UnsafeCell::new( false ),
                 unwind_state: UnsafeCell::new( ThreadUnwindState::new() ),
                 allocation_counter: UnsafeCell::new( 1 ),
+                sampler: UnsafeCell::new( sampler ),
+                degraded_sampling_counter: UnsafeCell::new( 0 ),
+                numa_node: UnsafeCell::new( (0, 0) ),
+                tag: UnsafeCell::new( (0, u64::MAX) ),
                 allocation_tracker: crate::allocation_tracker::on_thread_created( internal_thread_id ),
-                zombie_events: SpinLock::new( Vec::new() )
+                allocator_latencies: UnsafeCell::new( PendingLatencies::default() ),
+                event_queues: crate::event::create_thread_event_queues(),
+                zombie_events: AdaptiveLock::new( Vec::new() )
             };
 
-            let tls = ArcLite::new( tls );
-            registry.threads_by_system_id().insert( thread_id, tls.clone() );
+            ArcLite::new( tls )
+        };
 
-            tls
+        // Only this is done under the lock, so that we can't miss the tracing being toggled.
+        lock_thread_registry( |registry| {
+            tls.set_enabled( registry.enabled_for_new_threads && thread_id != unsafe { PROCESSING_THREAD_TID } );
+            registry.threads_by_system_id().insert( thread_id, tls.clone() );
         });
 
         callback( ThreadSentinel( tls ) )
     };
 }
 
+/// How many times the name of a thread is checked after it was first seen.
+const THREAD_NAME_CHECKS: u32 = 5;
+
+fn read_thread_name( thread_id: u32 ) -> String {
+    let path = format!( "/proc/self/task/{}/comm", thread_id );
+    match std::fs::read( path ) {
+        Ok( name ) => String::from_utf8_lossy( &name ).trim_end().to_owned(),
+        Err( _ ) => String::new()
+    }
+}
+
+struct NamedThread {
+    name: String,
+    remaining_checks: u32
+}
+
 #[derive(Default)]
 pub struct ThreadGarbageCollector {
     buffer: Vec< (Timestamp, RawThreadHandle) >,
     dead_threads: Vec< (Timestamp, RawThreadHandle) >,
+    /// The threads we've already sent out a `ThreadStarted` for, by their internal IDs.
+    named_threads: crate::utils::HashMap< u64, NamedThread >,
+    last_name_scan: Option< Timestamp >,
+    scan_buffer: Vec< (u32, u64, Timestamp) >
 }
 
 impl ThreadGarbageCollector {
-    pub(crate) fn run( &mut self, now: Timestamp, events: &mut crate::channel::ChannelBuffer< InternalEvent > ) {
+    fn on_thread_seen( &mut self, thread_id: u32, internal_thread_id: u64, created_at: Timestamp, now: Timestamp, events: &mut crate::channel::ChannelBuffer< InternalEvent > ) {
         use crate::utils::Entry;
 
+        match self.named_threads.entry( internal_thread_id ) {
+            Entry::Vacant( entry ) => {
+                let name = read_thread_name( thread_id );
+                entry.insert( NamedThread { name: name.clone(), remaining_checks: THREAD_NAME_CHECKS } );
+                events.extend( std::iter::once( InternalEvent::ThreadStarted { timestamp: created_at, thread: thread_id, name } ) );
+            },
+            Entry::Occupied( mut entry ) => {
+                let named = entry.get_mut();
+                if named.remaining_checks == 0 {
+                    return;
+                }
+
+                named.remaining_checks -= 1;
+                let name = read_thread_name( thread_id );
+                if !name.is_empty() && name != named.name {
+                    named.name = name.clone();
+                    events.extend( std::iter::once( InternalEvent::ThreadRenamed { timestamp: now, thread: thread_id, name } ) );
+                }
+            }
+        }
+    }
+
+    /// Sends out the names of the threads which were started since the last time, and of those which were renamed.
+    fn scan_thread_names( &mut self, now: Timestamp, events: &mut crate::channel::ChannelBuffer< InternalEvent > ) {
+        if self.last_name_scan.map( |last| now.as_secs() < last.as_secs() + 1 ).unwrap_or( false ) {
+            return;
+        }
+        self.last_name_scan = Some( now );
+
+        let mut threads = std::mem::take( &mut self.scan_buffer );
+        let named_threads = &self.named_threads;
         lock_thread_registry( |thread_registry| {
-            std::mem::swap( &mut thread_registry.new_dead_thread_queue, &mut self.buffer );
+            for thread in thread_registry.threads_by_system_id.values() {
+                if thread.is_internal() || thread.is_dead.load( Ordering::Relaxed ) {
+                    continue;
+                }
+
+                let is_pending = named_threads.get( &thread.internal_thread_id ).map( |named| named.remaining_checks > 0 ).unwrap_or( true );
+                if is_pending {
+                    threads.push( (thread.thread_id, thread.internal_thread_id, thread.created_at) );
+                }
+            }
         });
 
-        for (timestamp, thread) in self.buffer.drain( .. ) {
+        // The names are read outside of the lock since that needs a few syscalls.
+        for (thread_id, internal_thread_id, created_at) in threads.drain( .. ) {
+            self.on_thread_seen( thread_id, internal_thread_id, created_at, now, events );
+        }
+
+        self.scan_buffer = threads;
+    }
+
+    pub(crate) fn run( &mut self, now: Timestamp, events: &mut crate::channel::ChannelBuffer< InternalEvent > ) {
+        use crate::utils::Entry;
+
+        self.scan_thread_names( now, events );
+
+        let mut node = NEW_DEAD_THREADS.swap( std::ptr::null_mut(), Ordering::Acquire );
+        while !node.is_null() {
+            let dead = unsafe { Box::from_raw( node ) };
+            node = dead.next;
+            self.buffer.push( (dead.timestamp, dead.thread) );
+        }
+
+        // The stack is newest first.
+        self.buffer.reverse();
+
+        let mut buffer = std::mem::take( &mut self.buffer );
+        for (timestamp, thread) in buffer.drain( .. ) {
             crate::allocation_tracker::on_thread_destroyed( thread.internal_thread_id );
             events.extend( thread.zombie_events.lock().drain( .. ) );
+            events.extend( unsafe { &mut *thread.allocator_latencies.get() }.take() );
+            if !thread.is_internal() {
+                // A thread which didn't live long enough to be scanned still gets its name, if it's still there.
+                if !self.named_threads.contains_key( &thread.internal_thread_id ) {
+                    self.on_thread_seen( thread.thread_id, thread.internal_thread_id, thread.created_at, now, events );
+                }
+
+                self.named_threads.remove( &thread.internal_thread_id );
+                events.extend( std::iter::once( InternalEvent::ThreadExited { timestamp, thread: thread.thread_id } ) );
+            }
+
             self.dead_threads.push( (timestamp, thread) );
         }
+        self.buffer = buffer;
 
         if self.dead_threads.is_empty() {
             return;
@@ -0,0 +1,68 @@
+//! A `GlobalAlloc` for the Rust programs which can't be profiled through `LD_PRELOAD`, e.g. because they're statically linked.
+//!
+//! This goes through exactly the same paths as the interposed `malloc` and friends, so the allocations
+//! get the same tracking trailer and identical events. The profiler's own allocations also end up going
+//! through here, but those are never tracked since the thread's handle is already taken while they're made.
+
+use std::alloc::{GlobalAlloc, Layout};
+use std::ptr;
+
+use crate::api::{self, AllocationKind};
+
+/// The alignment which `malloc` always guarantees.
+#[cfg(target_pointer_width = "64")]
+const MIN_ALIGN: usize = 16;
+#[cfg(target_pointer_width = "32")]
+const MIN_ALIGN: usize = 8;
+
+/// Tracks every allocation of a Rust program; use it with `#[global_allocator]`.
+pub struct Bytehound;
+
+#[inline(always)]
+fn needs_explicit_alignment( layout: &Layout ) -> bool {
+    layout.align() > MIN_ALIGN || layout.align() > layout.size()
+}
+
+unsafe impl GlobalAlloc for Bytehound {
+    #[inline(always)]
+    unsafe fn alloc( &self, layout: Layout ) -> *mut u8 {
+        let kind = if needs_explicit_alignment( &layout ) { AllocationKind::Aligned( layout.align() ) } else { AllocationKind::Malloc };
+        api::allocate( layout.size(), kind ) as *mut u8
+    }
+
+    #[inline(always)]
+    unsafe fn alloc_zeroed( &self, layout: Layout ) -> *mut u8 {
+        if !needs_explicit_alignment( &layout ) {
+            return api::allocate( layout.size(), AllocationKind::Calloc ) as *mut u8;
+        }
+
+        let pointer = api::allocate( layout.size(), AllocationKind::Aligned( layout.align() ) ) as *mut u8;
+        if !pointer.is_null() {
+            ptr::write_bytes( pointer, 0, layout.size() );
+        }
+
+        pointer
+    }
+
+    #[inline(always)]
+    unsafe fn dealloc( &self, pointer: *mut u8, _layout: Layout ) {
+        api::free( pointer as *mut libc::c_void );
+    }
+
+    #[inline(always)]
+    unsafe fn realloc( &self, pointer: *mut u8, layout: Layout, new_size: usize ) -> *mut u8 {
+        let new_layout = Layout::from_size_align_unchecked( new_size, layout.align() );
+        if !needs_explicit_alignment( &new_layout ) {
+            return api::realloc_impl( pointer as *mut libc::c_void, new_size ) as *mut u8;
+        }
+
+        // There's no aligned `realloc`, so this has to be done by hand.
+        let new_pointer = self.alloc( new_layout );
+        if !new_pointer.is_null() {
+            ptr::copy_nonoverlapping( pointer, new_pointer, std::cmp::min( layout.size(), new_size ) );
+            self.dealloc( pointer, layout );
+        }
+
+        new_pointer
+    }
+}
@@ -0,0 +1,92 @@
+//! A separate heap for the big short-lived buffers of the processing thread.
+//!
+//! The periodic snapshots (checkpoints, residency samples, summaries) build temporary
+//! buffers which can be as big as the whole live set. If those are allocated from the same
+//! heap as the long-lived bookkeeping they end up interleaved with it, and once they're freed
+//! most of the pages they were on can't be given back to the OS. Giving them their own heap
+//! keeps them together, so they can all be released at once as soon as we're done with them.
+
+use libmimalloc_sys::{mi_heap_collect, mi_heap_delete, mi_heap_new, mi_heap_set_default, mi_heap_t};
+
+pub struct ScratchHeap {
+    // This also makes it neither `Send` nor `Sync`, since a heap can only be allocated from on the thread which created it.
+    heap: *mut mi_heap_t
+}
+
+struct RestoreDefault( *mut mi_heap_t );
+
+impl Drop for RestoreDefault {
+    fn drop( &mut self ) {
+        unsafe {
+            mi_heap_set_default( self.0 );
+        }
+    }
+}
+
+impl ScratchHeap {
+    pub fn new() -> Self {
+        let heap = unsafe { mi_heap_new() };
+        if heap.is_null() {
+            warn!( "Failed to create a scratch heap" );
+        }
+
+        ScratchHeap { heap }
+    }
+
+    /// Runs the `callback` with every allocation on this thread served from this heap,
+    /// and then returns everything which was freed in the meantime back to the OS.
+    ///
+    /// Whatever outlives the `callback` stays perfectly valid; it just keeps its page alive.
+    pub fn with< R >( &mut self, callback: impl FnOnce() -> R ) -> R {
+        if self.heap.is_null() {
+            return callback();
+        }
+
+        let result = {
+            let _restore = RestoreDefault( unsafe { mi_heap_set_default( self.heap ) } );
+            callback()
+        };
+
+        unsafe {
+            mi_heap_collect( self.heap, true );
+        }
+
+        result
+    }
+}
+
+impl Drop for ScratchHeap {
+    fn drop( &mut self ) {
+        if !self.heap.is_null() {
+            // This moves whatever is still alive into the thread's default heap.
+            unsafe {
+                mi_heap_delete( self.heap );
+            }
+        }
+    }
+}
+
+#[test]
+fn test_scratch_heap() {
+    use libmimalloc_sys::{mi_heap_check_owned, mi_heap_get_default};
+
+    let default_heap = unsafe { mi_heap_get_default() };
+    let mut scratch = ScratchHeap::new();
+    let heap = scratch.heap;
+    assert!( !heap.is_null() );
+
+    let survivor = scratch.with( || {
+        assert_eq!( unsafe { mi_heap_get_default() }, heap );
+
+        let buffer: Vec< u64 > = (0..100000).collect();
+        assert!( unsafe { mi_heap_check_owned( heap, buffer.as_ptr() as *const _ ) } );
+
+        Box::new( buffer.iter().sum::< u64 >() )
+    });
+
+    assert_eq!( unsafe { mi_heap_get_default() }, default_heap );
+    assert!( unsafe { mi_heap_check_owned( heap, &*survivor as *const u64 as *const _ ) } );
+
+    std::mem::drop( scratch );
+    assert_eq!( *survivor, 4999950000 );
+}
@@ -31,6 +31,7 @@ pub fn initialize_logger() {
 
         unsafe {
             if let Ok(()) = FILE_LOGGER.initialize( path, rotate_at, log_level, pid ) {
+                FILE_LOGGER.route_queued_records();
                 log::set_logger( &FILE_LOGGER ).unwrap();
             }
         }
@@ -62,7 +63,11 @@ pub fn initialize_signal_handlers() {
         };
 
         info!( "Signal handler triggered with signal: {} ({})", signal_name, signal );
-        crate::global::toggle();
+        if crate::flight_recorder::is_enabled() {
+            crate::flight_recorder::request_dump();
+        } else {
+            crate::global::toggle();
+        }
     }
 
     if opt::get().register_sigusr1 {
@@ -0,0 +1,266 @@
+//! Measures where the profiler itself spends its time.
+//!
+//! Everything here is recorded into lock-free histograms with power-of-two buckets, which are
+//! periodically written out as `Event::ProfilerStatistics`, and are also used for the `/metrics`,
+//! along with a few plain counters, e.g. of the backtrace cache hits.
+
+use std::io::{self, Write};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+
+use common::event::{BacktraceCacheLevelStatistics, Event, ProfilerHistogram};
+use common::speedy::Writable;
+
+use crate::timestamp::{Timestamp, get_monotonic_nsecs};
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum Stage {
+    /// The time spent grabbing a backtrace, in nanoseconds.
+    Unwind,
+    /// The time spent sending an event to the processing thread, in nanoseconds.
+    Send,
+    /// The time a thread was blocked because of throttling, in nanoseconds.
+    Throttle,
+    /// The number of events processed by the processing thread at once.
+    BatchSize,
+    /// The time spent processing and serializing a batch of events, in nanoseconds.
+    Processing,
+    /// The time spent compressing a single chunk of the output, in nanoseconds.
+    Compression,
+    /// The time spent scanning smaps, in nanoseconds.
+    SmapsScan
+}
+
+const STAGE_COUNT: usize = 7;
+const STAGES: [Stage; STAGE_COUNT] = [
+    Stage::Unwind,
+    Stage::Send,
+    Stage::Throttle,
+    Stage::BatchSize,
+    Stage::Processing,
+    Stage::Compression,
+    Stage::SmapsScan
+];
+
+impl Stage {
+    pub fn name( self ) -> &'static str {
+        match self {
+            Stage::Unwind => "unwind",
+            Stage::Send => "send",
+            Stage::Throttle => "throttle",
+            Stage::BatchSize => "batch_size",
+            Stage::Processing => "processing",
+            Stage::Compression => "compression",
+            Stage::SmapsScan => "smaps_scan"
+        }
+    }
+
+    pub fn is_duration( self ) -> bool {
+        self != Stage::BatchSize
+    }
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum Counter {
+    /// A freshly unwound backtrace was found in the thread's own cache.
+    BacktraceCacheLevel1Hit,
+    BacktraceCacheLevel1Miss,
+    /// A different backtrace was found under the same key; this is only checked in debug builds.
+    BacktraceCacheLevel1Conflict,
+    /// A backtrace was already known to the processing thread.
+    BacktraceCacheLevel2Hit,
+    BacktraceCacheLevel2Miss,
+    BacktraceCacheLevel2Conflict,
+    /// A backtrace was grabbed by walking the frame pointers.
+    FramePointerUnwind,
+    /// The frame pointer chain was broken, so the DWARF unwinder had to be used instead.
+    FramePointerFallback
+}
+
+const COUNTER_COUNT: usize = 8;
+
+/// `buckets[ 0 ]` counts the zeros, and every other `buckets[ n ]` counts the values in `2^(n - 1)..2^n`.
+const BUCKET_COUNT: usize = 48;
+
+struct Histogram {
+    count: AtomicU64,
+    sum: AtomicU64,
+    buckets: [AtomicU64; BUCKET_COUNT]
+}
+
+impl Histogram {
+    const fn new() -> Self {
+        #[allow(clippy::declare_interior_mutable_const)]
+        const ZERO: AtomicU64 = AtomicU64::new( 0 );
+        Histogram {
+            count: ZERO,
+            sum: ZERO,
+            buckets: [ZERO; BUCKET_COUNT]
+        }
+    }
+
+    #[inline(always)]
+    fn record( &self, value: u64 ) {
+        let bucket = std::cmp::min( (64 - value.leading_zeros()) as usize, BUCKET_COUNT - 1 );
+        self.count.fetch_add( 1, Ordering::Relaxed );
+        self.sum.fetch_add( value, Ordering::Relaxed );
+        self.buckets[ bucket ].fetch_add( 1, Ordering::Relaxed );
+    }
+
+    fn snapshot( &self, name: &str ) -> ProfilerHistogram {
+        let mut buckets: Vec< u64 > = self.buckets.iter().map( |bucket| bucket.load( Ordering::Relaxed ) ).collect();
+        while buckets.last() == Some( &0 ) {
+            buckets.pop();
+        }
+
+        ProfilerHistogram {
+            name: name.to_owned(),
+            count: self.count.load( Ordering::Relaxed ),
+            sum: self.sum.load( Ordering::Relaxed ),
+            buckets
+        }
+    }
+}
+
+static IS_ENABLED: AtomicBool = AtomicBool::new( false );
+static HISTOGRAMS: [Histogram; STAGE_COUNT] = [
+    Histogram::new(),
+    Histogram::new(),
+    Histogram::new(),
+    Histogram::new(),
+    Histogram::new(),
+    Histogram::new(),
+    Histogram::new()
+];
+static BYTES_WRITTEN: AtomicU64 = AtomicU64::new( 0 );
+static COUNTER_VALUES: [AtomicU64; COUNTER_COUNT] = [
+    AtomicU64::new( 0 ),
+    AtomicU64::new( 0 ),
+    AtomicU64::new( 0 ),
+    AtomicU64::new( 0 ),
+    AtomicU64::new( 0 ),
+    AtomicU64::new( 0 ),
+    AtomicU64::new( 0 ),
+    AtomicU64::new( 0 )
+];
+
+pub fn initialize() {
+    let opts = crate::opt::get();
+    if opts.instrumentation || opts.enable_metrics {
+        IS_ENABLED.store( true, Ordering::Relaxed );
+    }
+}
+
+#[inline(always)]
+pub fn is_enabled() -> bool {
+    IS_ENABLED.load( Ordering::Relaxed )
+}
+
+#[inline(always)]
+pub fn record( stage: Stage, value: u64 ) {
+    if is_enabled() {
+        HISTOGRAMS[ stage as usize ].record( value );
+    }
+}
+
+#[inline(always)]
+pub fn on_bytes_written( count: usize ) {
+    if is_enabled() {
+        BYTES_WRITTEN.fetch_add( count as u64, Ordering::Relaxed );
+    }
+}
+
+pub fn bytes_written() -> u64 {
+    BYTES_WRITTEN.load( Ordering::Relaxed )
+}
+
+#[inline(always)]
+pub fn count( counter: Counter ) {
+    if is_enabled() {
+        COUNTER_VALUES[ counter as usize ].fetch_add( 1, Ordering::Relaxed );
+    }
+}
+
+pub fn counter_value( counter: Counter ) -> u64 {
+    COUNTER_VALUES[ counter as usize ].load( Ordering::Relaxed )
+}
+/// Returns how many times the `stage` was recorded, and the sum of what was recorded.
+pub fn totals( stage: Stage ) -> (u64, u64) {
+    let histogram = &HISTOGRAMS[ stage as usize ];
+    (histogram.count.load( Ordering::Relaxed ), histogram.sum.load( Ordering::Relaxed ))
+}
+
+pub fn stages() -> &'static [Stage] {
+    &STAGES
+}
+
+/// Measures the time until it's dropped; does nothing if the instrumentation isn't enabled.
+pub struct Timer {
+    stage: Stage,
+    start: Option< u64 >
+}
+
+impl Timer {
+    #[inline(always)]
+    pub fn start( stage: Stage ) -> Self {
+        Timer {
+            stage,
+            start: if is_enabled() { Some( get_monotonic_nsecs() ) } else { None }
+        }
+    }
+}
+
+impl Drop for Timer {
+    #[inline(always)]
+    fn drop( &mut self ) {
+        if let Some( start ) = self.start {
+            HISTOGRAMS[ self.stage as usize ].record( get_monotonic_nsecs().saturating_sub( start ) );
+        }
+    }
+}
+
+pub fn write_statistics( timestamp: Timestamp, fp: &mut impl Write ) -> io::Result< () > {
+    let histograms: Vec< _ > = STAGES.iter().map( |&stage| HISTOGRAMS[ stage as usize ].snapshot( stage.name() ) ).collect();
+    Event::ProfilerStatistics {
+        timestamp,
+        bytes_written: bytes_written(),
+        histograms: histograms.into()
+    }.write_to_stream( fp )
+}
+
+/// `level_2_capacity` is the current capacity of the processing thread's cache, since that one can change.
+pub fn write_backtrace_cache_statistics( timestamp: Timestamp, level_2_capacity: usize, fp: &mut impl Write ) -> io::Result< () > {
+    let levels = [
+        BacktraceCacheLevelStatistics {
+            hits: counter_value( Counter::BacktraceCacheLevel1Hit ),
+            misses: counter_value( Counter::BacktraceCacheLevel1Miss ),
+            conflicts: counter_value( Counter::BacktraceCacheLevel1Conflict ),
+            capacity: crate::opt::get().backtrace_cache_size_level_1 as u64
+        },
+        BacktraceCacheLevelStatistics {
+            hits: counter_value( Counter::BacktraceCacheLevel2Hit ),
+            misses: counter_value( Counter::BacktraceCacheLevel2Miss ),
+            conflicts: counter_value( Counter::BacktraceCacheLevel2Conflict ),
+            capacity: level_2_capacity as u64
+        }
+    ];
+
+    Event::BacktraceCacheStatistics {
+        timestamp,
+        levels: levels[..].into()
+    }.write_to_stream( fp )
+}
+
+#[test]
+fn test_histogram() {
+    let histogram = Histogram::new();
+    for value in [0, 1, 2, 3, 4, 1000, u64::MAX / 2] {
+        histogram.record( value );
+    }
+
+    let snapshot = histogram.snapshot( "test" );
+    assert_eq!( snapshot.count, 7 );
+    assert_eq!( snapshot.buckets.len(), BUCKET_COUNT );
+    assert_eq!( &snapshot.buckets[ ..4 ], &[1, 1, 2, 1] );
+    assert_eq!( snapshot.buckets[ 10 ], 1 );
+    assert_eq!( snapshot.buckets[ BUCKET_COUNT - 1 ], 1 );
+}
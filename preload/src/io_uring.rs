@@ -0,0 +1,558 @@
+use std::collections::VecDeque;
+use std::io;
+use std::mem;
+use std::os::unix::io::RawFd;
+use std::ptr;
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
+
+use crate::opt;
+use crate::syscall;
+
+/// How many buffers are registered with every ring.
+const BUFFER_COUNT: usize = 4;
+
+/// The size of a single registered buffer.
+const BUFFER_SIZE: usize = 1024 * 1024;
+
+const RING_ENTRIES: u32 = 4;
+
+const IORING_OFF_SQ_RING: libc::off_t = 0;
+const IORING_OFF_CQ_RING: libc::off_t = 0x8000000;
+const IORING_OFF_SQES: libc::off_t = 0x10000000;
+
+const IORING_ENTER_GETEVENTS: u32 = 1 << 0;
+const IORING_REGISTER_BUFFERS: u32 = 0;
+const IORING_OP_WRITE_FIXED: u8 = 5;
+
+/// Whether an offset of -1 means "use the current file position"; we depend on this
+/// as it's the only way to have the writes behave exactly like normal blocking ones.
+const IORING_FEAT_RW_CUR_POS: u32 = 1 << 3;
+
+#[repr(C)]
+#[derive(Default)]
+struct SqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    resv2: u64
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct CqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    resv2: u64
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqringOffsets,
+    cq_off: CqringOffsets
+}
+
+#[repr(C)]
+struct Sqe {
+    opcode: u8,
+    flags: u8,
+    ioprio: u16,
+    fd: i32,
+    off: u64,
+    addr: u64,
+    len: u32,
+    rw_flags: u32,
+    user_data: u64,
+    buf_index: u16,
+    personality: u16,
+    splice_fd_in: i32,
+    addr3: u64,
+    pad: u64
+}
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32
+}
+
+struct Mapping {
+    pointer: *mut u8,
+    length: usize
+}
+
+impl Mapping {
+    fn new( fd: RawFd, length: usize, offset: libc::off_t ) -> io::Result< Self > {
+        let (flags, fd) = if fd < 0 {
+            (libc::MAP_PRIVATE | libc::MAP_ANONYMOUS, -1)
+        } else {
+            (libc::MAP_SHARED | libc::MAP_POPULATE, fd)
+        };
+
+        let pointer = unsafe {
+            syscall::mmap( ptr::null_mut(), length, libc::PROT_READ | libc::PROT_WRITE, flags, fd, offset )
+        };
+
+        if pointer == libc::MAP_FAILED {
+            return Err( io::Error::last_os_error() );
+        }
+
+        Ok( Mapping {
+            pointer: pointer as *mut u8,
+            length
+        })
+    }
+
+    fn anonymous( length: usize ) -> io::Result< Self > {
+        Self::new( -1, length, 0 )
+    }
+
+    fn at< T >( &self, offset: u32 ) -> *mut T {
+        debug_assert!( offset as usize + mem::size_of::< T >() <= self.length );
+        unsafe { self.pointer.add( offset as usize ) as *mut T }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop( &mut self ) {
+        unsafe {
+            syscall::munmap( self.pointer as *mut libc::c_void, self.length );
+        }
+    }
+}
+
+/// A minimal io_uring instance which is only used to submit writes from registered buffers.
+struct Ring {
+    fd: RawFd,
+    sq_head: *const AtomicU32,
+    sq_tail: *const AtomicU32,
+    sq_mask: u32,
+    sq_array: *mut u32,
+    cq_head: *const AtomicU32,
+    cq_tail: *const AtomicU32,
+    cq_mask: u32,
+    cqes: *const Cqe,
+    sqes: Mapping,
+    _sq_ring: Mapping,
+    _cq_ring: Mapping
+}
+
+impl Ring {
+    fn new() -> io::Result< Self > {
+        let mut params = Params::default();
+        let fd = syscall::io_uring_setup( RING_ENTRIES, &mut params as *mut Params as *mut libc::c_void );
+        if fd < 0 {
+            return Err( io::Error::last_os_error() );
+        }
+
+        if params.features & IORING_FEAT_RW_CUR_POS == 0 {
+            syscall::close( fd );
+            return Err( io::Error::new( io::ErrorKind::Other, "the kernel is too old" ) );
+        }
+
+        let mappings = (|| -> io::Result< _ > {
+            let sq_ring = Mapping::new( fd, params.sq_off.array as usize + params.sq_entries as usize * mem::size_of::< u32 >(), IORING_OFF_SQ_RING )?;
+            let cq_ring = Mapping::new( fd, params.cq_off.cqes as usize + params.cq_entries as usize * mem::size_of::< Cqe >(), IORING_OFF_CQ_RING )?;
+            let sqes = Mapping::new( fd, params.sq_entries as usize * mem::size_of::< Sqe >(), IORING_OFF_SQES )?;
+            Ok( (sq_ring, cq_ring, sqes) )
+        })();
+
+        let (sq_ring, cq_ring, sqes) = match mappings {
+            Ok( mappings ) => mappings,
+            Err( error ) => {
+                syscall::close( fd );
+                return Err( error );
+            }
+        };
+
+        unsafe {
+            Ok( Ring {
+                fd,
+                sq_head: sq_ring.at( params.sq_off.head ),
+                sq_tail: sq_ring.at( params.sq_off.tail ),
+                sq_mask: *sq_ring.at::< u32 >( params.sq_off.ring_mask ),
+                sq_array: sq_ring.at( params.sq_off.array ),
+                cq_head: cq_ring.at( params.cq_off.head ),
+                cq_tail: cq_ring.at( params.cq_off.tail ),
+                cq_mask: *cq_ring.at::< u32 >( params.cq_off.ring_mask ),
+                cqes: cq_ring.at( params.cq_off.cqes ),
+                sqes,
+                _sq_ring: sq_ring,
+                _cq_ring: cq_ring
+            })
+        }
+    }
+
+    fn register_buffers( &self, buffers: &Mapping, count: usize, size: usize ) -> io::Result< () > {
+        let iovecs: Vec< libc::iovec > = (0..count).map( |index| libc::iovec {
+            iov_base: unsafe { buffers.pointer.add( index * size ) as *mut libc::c_void },
+            iov_len: size
+        }).collect();
+
+        let result = syscall::io_uring_register( self.fd, IORING_REGISTER_BUFFERS, iovecs.as_ptr() as *const libc::c_void, count as u32 );
+        if result < 0 {
+            return Err( io::Error::last_os_error() );
+        }
+
+        Ok(())
+    }
+
+    /// Submits a write of `length` bytes from `pointer`, which must be inside of the registered buffer `buffer_index`.
+    fn submit_write( &mut self, fd: RawFd, buffer_index: u16, pointer: *const u8, length: usize ) -> io::Result< () > {
+        unsafe {
+            let tail = (*self.sq_tail).load( Ordering::Relaxed );
+            let head = (*self.sq_head).load( Ordering::Acquire );
+            if tail.wrapping_sub( head ) > self.sq_mask {
+                return Err( io::Error::new( io::ErrorKind::Other, "the submission queue is full" ) );
+            }
+
+            let index = tail & self.sq_mask;
+            ptr::write( self.sqes.at::< Sqe >( index * mem::size_of::< Sqe >() as u32 ), Sqe {
+                opcode: IORING_OP_WRITE_FIXED,
+                flags: 0,
+                ioprio: 0,
+                fd,
+                off: !0,
+                addr: pointer as u64,
+                len: length as u32,
+                rw_flags: 0,
+                user_data: 0,
+                buf_index: buffer_index,
+                personality: 0,
+                splice_fd_in: 0,
+                addr3: 0,
+                pad: 0
+            });
+
+            *self.sq_array.add( index as usize ) = index;
+            (*self.sq_tail).store( tail.wrapping_add( 1 ), Ordering::Release );
+        }
+
+        loop {
+            let result = syscall::io_uring_enter( self.fd, 1, 0, 0 );
+            if result >= 0 {
+                return Ok(());
+            }
+
+            let error = io::Error::last_os_error();
+            if error.kind() != io::ErrorKind::Interrupted {
+                return Err( error );
+            }
+        }
+    }
+
+    fn pop_completion( &mut self, block: bool ) -> io::Result< Option< Cqe > > {
+        loop {
+            unsafe {
+                let head = (*self.cq_head).load( Ordering::Relaxed );
+                let tail = (*self.cq_tail).load( Ordering::Acquire );
+                if head != tail {
+                    let cqe = *self.cqes.add( (head & self.cq_mask) as usize );
+                    (*self.cq_head).store( head.wrapping_add( 1 ), Ordering::Release );
+                    return Ok( Some( cqe ) );
+                }
+            }
+
+            if !block {
+                return Ok( None );
+            }
+
+            let result = syscall::io_uring_enter( self.fd, 0, 1, IORING_ENTER_GETEVENTS );
+            if result < 0 {
+                let error = io::Error::last_os_error();
+                if error.kind() != io::ErrorKind::Interrupted {
+                    return Err( error );
+                }
+            }
+        }
+    }
+}
+
+impl Drop for Ring {
+    fn drop( &mut self ) {
+        syscall::close( self.fd );
+    }
+}
+
+struct InFlight {
+    buffer: u16,
+    offset: usize,
+    length: usize
+}
+
+/// A writer which hands off the writes to the kernel through io_uring, so that
+/// they don't block the caller unless all of its buffers are full.
+///
+/// The data is written out in order, exactly as if it was written with normal blocking
+/// writes to the same file descriptor; the file descriptor is *not* owned by the writer
+/// and must outlive it.
+pub struct AsyncWriter {
+    fd: RawFd,
+    ring: Ring,
+    buffers: Mapping,
+    free: Vec< u16 >,
+    current: Option< (u16, usize) >,
+    queued: VecDeque< (u16, usize) >,
+    in_flight: Option< InFlight >,
+    is_broken: bool,
+    pid: libc::pid_t
+}
+
+unsafe impl Send for AsyncWriter {}
+
+impl AsyncWriter {
+    pub fn new( fd: RawFd ) -> io::Result< Self > {
+        let ring = Ring::new()?;
+        let buffers = Mapping::anonymous( BUFFER_COUNT * BUFFER_SIZE )?;
+        ring.register_buffers( &buffers, BUFFER_COUNT, BUFFER_SIZE )?;
+
+        Ok( AsyncWriter {
+            fd,
+            ring,
+            buffers,
+            free: (0..BUFFER_COUNT as u16).rev().collect(),
+            current: None,
+            queued: VecDeque::with_capacity( BUFFER_COUNT ),
+            in_flight: None,
+            is_broken: false,
+            pid: syscall::getpid()
+        })
+    }
+
+    fn buffer_pointer( &self, buffer: u16 ) -> *mut u8 {
+        unsafe { self.buffers.pointer.add( buffer as usize * BUFFER_SIZE ) }
+    }
+
+    fn submit( &mut self, in_flight: InFlight ) -> io::Result< () > {
+        let pointer = unsafe { self.buffer_pointer( in_flight.buffer ).add( in_flight.offset ) };
+        if let Err( error ) = self.ring.submit_write( self.fd, in_flight.buffer, pointer, in_flight.length - in_flight.offset ) {
+            self.free.push( in_flight.buffer );
+            return Err( error );
+        }
+
+        self.in_flight = Some( in_flight );
+        Ok(())
+    }
+
+    fn on_completion( &mut self, cqe: Cqe ) -> io::Result< () > {
+        let mut in_flight = self.in_flight.take().unwrap();
+        if cqe.res < 0 {
+            if cqe.res == -libc::EINTR || cqe.res == -libc::EAGAIN {
+                return self.submit( in_flight );
+            }
+
+            self.free.push( in_flight.buffer );
+            return Err( io::Error::from_raw_os_error( -cqe.res ) );
+        }
+
+        if cqe.res == 0 {
+            self.free.push( in_flight.buffer );
+            return Err( io::Error::new( io::ErrorKind::WriteZero, "failed to write the whole buffer" ) );
+        }
+
+        in_flight.offset += cqe.res as usize;
+        if in_flight.offset < in_flight.length {
+            return self.submit( in_flight );
+        }
+
+        self.free.push( in_flight.buffer );
+        Ok(())
+    }
+
+    /// Submits the queued buffers and processes the completions, waiting for at least one if `block` is set.
+    fn pump( &mut self, mut block: bool ) -> io::Result< () > {
+        loop {
+            if self.in_flight.is_none() {
+                match self.queued.pop_front() {
+                    Some( (buffer, length) ) => self.submit( InFlight { buffer, offset: 0, length } )?,
+                    None => return Ok(())
+                }
+            }
+
+            let cqe = match self.ring.pop_completion( block )? {
+                Some( cqe ) => cqe,
+                None => return Ok(())
+            };
+
+            block = false;
+            self.on_completion( cqe )?;
+        }
+    }
+
+    fn check( &mut self, result: io::Result< () > ) -> io::Result< () > {
+        if result.is_err() {
+            self.is_broken = true;
+            self.free.extend( self.current.take().map( |(buffer, _)| buffer ) );
+            self.free.extend( self.queued.drain( .. ).map( |(buffer, _)| buffer ) );
+        }
+
+        result
+    }
+
+    fn write_blocking( &self, mut data: &[u8] ) -> io::Result< () > {
+        while !data.is_empty() {
+            let result = unsafe { libc::write( self.fd, data.as_ptr() as *const libc::c_void, data.len() ) };
+            if result < 0 {
+                let error = io::Error::last_os_error();
+                if error.kind() == io::ErrorKind::Interrupted {
+                    continue;
+                }
+
+                return Err( error );
+            }
+
+            data = &data[ result as usize.. ];
+        }
+
+        Ok(())
+    }
+
+    pub fn write_all( &mut self, mut data: &[u8] ) -> io::Result< () > {
+        if self.is_broken {
+            return Err( io::Error::new( io::ErrorKind::BrokenPipe, "a previous write failed" ) );
+        }
+
+        // The ring is shared with the parent after a `fork`, and the memory dumper writes from a forked child.
+        // Everything was already flushed before forking, so we can just write directly.
+        if self.pid != syscall::getpid() {
+            return self.write_blocking( data );
+        }
+
+        while !data.is_empty() {
+            let (buffer, length) = match self.current.take() {
+                Some( current ) => current,
+                None => {
+                    while self.free.is_empty() {
+                        let result = self.pump( true );
+                        self.check( result )?;
+                    }
+
+                    (self.free.pop().unwrap(), 0)
+                }
+            };
+
+            let count = std::cmp::min( data.len(), BUFFER_SIZE - length );
+            unsafe {
+                ptr::copy_nonoverlapping( data.as_ptr(), self.buffer_pointer( buffer ).add( length ), count );
+            }
+
+            data = &data[ count.. ];
+            if length + count == BUFFER_SIZE {
+                self.queued.push_back( (buffer, BUFFER_SIZE) );
+            } else {
+                self.current = Some( (buffer, length + count) );
+            }
+        }
+
+        let result = self.pump( false );
+        self.check( result )
+    }
+
+    /// Blocks until everything which was written so far reaches the kernel.
+    pub fn flush( &mut self ) -> io::Result< () > {
+        if self.is_broken || self.pid != syscall::getpid() {
+            return Ok(());
+        }
+
+        if let Some( current ) = self.current.take() {
+            self.queued.push_back( current );
+        }
+
+        while self.in_flight.is_some() || !self.queued.is_empty() {
+            let result = self.pump( true );
+            self.check( result )?;
+        }
+
+        Ok(())
+    }
+}
+
+impl Drop for AsyncWriter {
+    fn drop( &mut self ) {
+        if let Err( error ) = self.flush() {
+            warn!( "Failed to flush an asynchronous writer: {}", error );
+        }
+    }
+}
+
+static IS_UNSUPPORTED: AtomicBool = AtomicBool::new( false );
+
+/// Creates an `AsyncWriter` for `fd` if io_uring is enabled and is supported by the kernel.
+pub fn new_async_writer( fd: RawFd ) -> Option< AsyncWriter > {
+    if !opt::get().use_io_uring || IS_UNSUPPORTED.load( Ordering::Relaxed ) {
+        return None;
+    }
+
+    match AsyncWriter::new( fd ) {
+        Ok( writer ) => Some( writer ),
+        Err( error ) => {
+            if error.raw_os_error() == Some( libc::ENOSYS ) || error.raw_os_error() == Some( libc::EPERM ) || error.kind() == io::ErrorKind::Other {
+                IS_UNSUPPORTED.store( true, Ordering::Relaxed );
+            }
+
+            info!( "Failed to initialize io_uring; falling back to blocking writes: {}", error );
+            None
+        }
+    }
+}
+
+#[test]
+fn test_async_writer() {
+    use std::io::{Read, Seek, SeekFrom, Write};
+    use std::os::unix::io::AsRawFd;
+
+    let path = std::env::temp_dir().join( format!( "bytehound-test-async-writer-{}", std::process::id() ) );
+    let mut file = std::fs::OpenOptions::new().read( true ).write( true ).create( true ).truncate( true ).open( &path ).unwrap();
+    file.write_all( b"header" ).unwrap();
+
+    let mut writer = match AsyncWriter::new( file.as_raw_fd() ) {
+        Ok( writer ) => writer,
+        Err( error ) => {
+            // Not every kernel (or sandbox) supports io_uring.
+            let _ = std::fs::remove_file( &path );
+            eprintln!( "Skipping the test: {}", error );
+            return;
+        }
+    };
+
+    let mut expected = b"header".to_vec();
+    let data: Vec< u8 > = (0..BUFFER_COUNT * BUFFER_SIZE * 2 + 1234).map( |nth| (nth % 251) as u8 ).collect();
+    for chunk in data.chunks( 10000 ) {
+        writer.write_all( chunk ).unwrap();
+    }
+    expected.extend_from_slice( &data );
+    writer.flush().unwrap();
+    std::mem::drop( writer );
+
+    // The writes should've advanced the file position just like normal writes would have.
+    file.write_all( b"footer" ).unwrap();
+    expected.extend_from_slice( b"footer" );
+
+    let mut actual = Vec::new();
+    file.seek( SeekFrom::Start( 0 ) ).unwrap();
+    file.read_to_end( &mut actual ).unwrap();
+    let _ = std::fs::remove_file( &path );
+
+    assert!( actual == expected );
+}
@@ -0,0 +1,218 @@
+//! Tracking of a jemalloc which is statically linked into the executable through jemalloc's own hooks.
+//!
+//! Instead of patching the executable's jemalloc symbols this installs a set of hooks through
+//! `experimental.hooks.install`. The hooks are called after jemalloc is done with an allocation,
+//! so the allocations don't need to be padded with a tracking ID, which means that they don't get
+//! bumped into a bigger size class. Since there's no tracking ID the allocations are matched by
+//! their addresses instead, just as when a profile is loaded without any IDs.
+
+use std::num::NonZeroUsize;
+
+use libc::{c_char, c_int, c_void, size_t, uintptr_t};
+
+use common::event;
+
+use crate::allocation_tracker::{on_allocation, on_free, on_reallocation};
+use crate::event::{InternalAllocation, InternalAllocationId};
+use crate::global::StrongThreadHandle;
+use crate::opt;
+use crate::unwind;
+
+// These mirror `hook_alloc_e`, `hook_dalloc_e` and `hook_expand_e` from jemalloc's `hook.h`.
+const HOOK_ALLOC_MALLOC: c_int = 0;
+const HOOK_ALLOC_POSIX_MEMALIGN: c_int = 1;
+const HOOK_ALLOC_ALIGNED_ALLOC: c_int = 2;
+const HOOK_ALLOC_CALLOC: c_int = 3;
+const HOOK_ALLOC_MEMALIGN: c_int = 4;
+const HOOK_ALLOC_VALLOC: c_int = 5;
+const HOOK_ALLOC_MALLOCX: c_int = 6;
+const HOOK_ALLOC_REALLOC: c_int = 7;
+const HOOK_ALLOC_RALLOCX: c_int = 8;
+
+const HOOK_DALLOC_REALLOC: c_int = 3;
+const HOOK_DALLOC_RALLOCX: c_int = 4;
+
+const HOOK_EXPAND_XALLOCX: c_int = 2;
+
+type AllocHook = unsafe extern "C" fn( extra: *mut c_void, kind: c_int, result: *mut c_void, result_raw: uintptr_t, args: *const uintptr_t );
+type DallocHook = unsafe extern "C" fn( extra: *mut c_void, kind: c_int, address: *mut c_void, args: *const uintptr_t );
+type ExpandHook = unsafe extern "C" fn(
+    extra: *mut c_void,
+    kind: c_int,
+    address: *mut c_void,
+    old_usable_size: size_t,
+    new_usable_size: size_t,
+    result_raw: uintptr_t,
+    args: *const uintptr_t
+);
+
+type Mallctl = unsafe extern "C" fn( name: *const c_char, oldp: *mut c_void, oldlenp: *mut size_t, newp: *mut c_void, newlen: size_t ) -> c_int;
+
+/// This mirrors `hooks_t` from jemalloc's `hook.h`.
+#[repr(C)]
+struct Hooks {
+    alloc_hook: AllocHook,
+    dalloc_hook: DallocHook,
+    expand_hook: ExpandHook,
+    extra: *mut c_void
+}
+
+fn acquire_thread() -> Option< StrongThreadHandle > {
+    if crate::global::is_bypassed() {
+        return None;
+    }
+
+    let thread = StrongThreadHandle::acquire()?;
+    if !crate::global::is_actively_running() {
+        return None;
+    }
+
+    Some( thread )
+}
+
+fn allocation( address: NonZeroUsize, size: usize, flags: u32, thread: &StrongThreadHandle ) -> InternalAllocation {
+    InternalAllocation {
+        address,
+        size,
+        flags: flags | crate::api::sampling_flags(),
+        tid: thread.system_tid(),
+        extra_usable_space: 0
+    }
+}
+
+unsafe extern "C" fn alloc_hook( _extra: *mut c_void, kind: c_int, result: *mut c_void, _result_raw: uintptr_t, args: *const uintptr_t ) {
+    let address = match NonZeroUsize::new( result as usize ) {
+        Some( address ) => address,
+        None => return
+    };
+
+    let args = std::slice::from_raw_parts( args, 3 );
+    let (size, flags, old_address) = match kind {
+        HOOK_ALLOC_MALLOC | HOOK_ALLOC_VALLOC => (args[ 0 ], event::ALLOC_FLAG_JEMALLOC, None),
+        HOOK_ALLOC_POSIX_MEMALIGN => (args[ 2 ], event::ALLOC_FLAG_JEMALLOC, None),
+        HOOK_ALLOC_ALIGNED_ALLOC | HOOK_ALLOC_MEMALIGN => (args[ 1 ], event::ALLOC_FLAG_JEMALLOC, None),
+        HOOK_ALLOC_CALLOC => (args[ 0 ].wrapping_mul( args[ 1 ] ), event::ALLOC_FLAG_JEMALLOC | event::ALLOC_FLAG_CALLOC, None),
+        HOOK_ALLOC_MALLOCX => (args[ 0 ], crate::api::translate_jemalloc_flags( args[ 1 ] as c_int ), None),
+        HOOK_ALLOC_REALLOC => (args[ 1 ], event::ALLOC_FLAG_JEMALLOC, NonZeroUsize::new( args[ 0 ] )),
+        HOOK_ALLOC_RALLOCX => (args[ 1 ], crate::api::translate_jemalloc_flags( args[ 2 ] as c_int ), NonZeroUsize::new( args[ 0 ] )),
+        _ => return
+    };
+
+    let mut thread = match acquire_thread() {
+        Some( thread ) => thread,
+        None => return
+    };
+
+    if let Some( old_address ) = old_address {
+        // A reallocation which had to be moved; the old allocation's dealloc hook is ignored.
+        //
+        // If the old allocation wasn't sampled then it's unknown and this will be ignored too.
+        let backtrace = unwind::grab( &mut thread );
+        let allocation = allocation( address, size, flags, &thread );
+        on_reallocation( InternalAllocationId::UNTRACKED, old_address, allocation, backtrace, thread );
+        return;
+    }
+
+    if !thread.should_sample( size ) {
+        return;
+    }
+
+    let backtrace = unwind::grab( &mut thread );
+    let allocation = allocation( address, size, flags, &thread );
+    on_allocation( InternalAllocationId::UNTRACKED, allocation, backtrace, thread );
+}
+
+unsafe extern "C" fn dalloc_hook( _extra: *mut c_void, kind: c_int, address: *mut c_void, args: *const uintptr_t ) {
+    let address = match NonZeroUsize::new( address as usize ) {
+        Some( address ) => address,
+        None => return
+    };
+
+    if kind == HOOK_DALLOC_REALLOC || kind == HOOK_DALLOC_RALLOCX {
+        // Only a `realloc` to a zero size is a plain deallocation; otherwise it was already
+        // reported as a reallocation by the alloc hook.
+        let args = std::slice::from_raw_parts( args, 3 );
+        if args[ 1 ] != 0 {
+            return;
+        }
+    }
+
+    let mut thread = match acquire_thread() {
+        Some( thread ) => thread,
+        None => return
+    };
+
+    let backtrace =
+        if opt::grab_backtraces_on_free() {
+            Some( unwind::grab_on_free( &mut thread ) )
+        } else {
+            None
+        };
+
+    on_free( InternalAllocationId::UNTRACKED, address, backtrace, thread );
+}
+
+unsafe extern "C" fn expand_hook(
+    _extra: *mut c_void,
+    kind: c_int,
+    address: *mut c_void,
+    old_usable_size: size_t,
+    new_usable_size: size_t,
+    _result_raw: uintptr_t,
+    args: *const uintptr_t
+) {
+    let address = match NonZeroUsize::new( address as usize ) {
+        Some( address ) => address,
+        None => return
+    };
+
+    if old_usable_size == new_usable_size && kind == HOOK_EXPAND_XALLOCX {
+        return;
+    }
+
+    let args = std::slice::from_raw_parts( args, 4 );
+    let (size, flags) = if kind == HOOK_EXPAND_XALLOCX {
+        (new_usable_size, crate::api::translate_jemalloc_flags( args[ 3 ] as c_int ))
+    } else {
+        (args[ 1 ], crate::api::translate_jemalloc_flags( args[ 2 ] as c_int ))
+    };
+
+    let mut thread = match acquire_thread() {
+        Some( thread ) => thread,
+        None => return
+    };
+
+    let backtrace = unwind::grab( &mut thread );
+    let allocation = allocation( address, size, flags, &thread );
+    on_reallocation( InternalAllocationId::UNTRACKED, address, allocation, backtrace, thread );
+}
+
+/// Installs the hooks through the given `mallctl` of the executable's jemalloc.
+///
+/// Returns `false` if that jemalloc doesn't support the hooks.
+pub unsafe fn install( mallctl: usize ) -> bool {
+    let mallctl: Mallctl = std::mem::transmute( mallctl );
+    let mut hooks = Hooks {
+        alloc_hook,
+        dalloc_hook,
+        expand_hook,
+        extra: std::ptr::null_mut()
+    };
+
+    let mut handle: *mut c_void = std::ptr::null_mut();
+    let mut handle_length: size_t = std::mem::size_of::< *mut c_void >();
+    let result = mallctl(
+        b"experimental.hooks.install\0".as_ptr() as *const c_char,
+        &mut handle as *mut *mut c_void as *mut c_void,
+        &mut handle_length,
+        &mut hooks as *mut Hooks as *mut c_void,
+        std::mem::size_of::< Hooks >()
+    );
+
+    if result != 0 {
+        warn!( "Failed to install the jemalloc hooks: {}", std::io::Error::from_raw_os_error( result ) );
+        return false;
+    }
+
+    true
+}
@@ -0,0 +1,137 @@
+//! Periodic snapshots of the statistics of our own jemalloc.
+//!
+//! When the profiled program uses jemalloc its calls are redirected to the jemalloc
+//! which is bundled with the profiler, so its statistics describe the program's heap:
+//! how much of it is fragmented, how much is held as dirty or muzzy pages, and how
+//! much is sitting in the thread caches.
+
+use std::io::{self, Write};
+use std::mem;
+
+use libc::{c_void, size_t};
+
+use common::event::{Event, JemallocArenaStats, JemallocBinStats};
+use common::speedy::Writable;
+
+use crate::timestamp::Timestamp;
+
+// The arena index which `stats.arenas.<i>` accepts to merge the stats of every arena.
+const MALLCTL_ARENAS_ALL: u32 = 4096;
+
+fn read< T: Copy + Default >( name: &str ) -> Option< T > {
+    let mut name = name.as_bytes().to_vec();
+    name.push( 0 );
+
+    let mut value = T::default();
+    let mut length: size_t = mem::size_of::< T >();
+    let result = unsafe {
+        tikv_jemalloc_sys::mallctl(
+            name.as_ptr() as *const libc::c_char,
+            &mut value as *mut T as *mut c_void,
+            &mut length,
+            std::ptr::null_mut(),
+            0
+        )
+    };
+
+    if result != 0 || length != mem::size_of::< T >() {
+        None
+    } else {
+        Some( value )
+    }
+}
+
+fn read_size( name: &str ) -> Option< u64 > {
+    read::< size_t >( name ).map( |value| value as u64 )
+}
+
+fn refresh() -> bool {
+    // Most of the stats are only updated when the epoch is bumped.
+    let mut epoch: u64 = 1;
+    let result = unsafe {
+        tikv_jemalloc_sys::mallctl(
+            b"epoch\0".as_ptr() as *const libc::c_char,
+            std::ptr::null_mut(),
+            std::ptr::null_mut(),
+            &mut epoch as *mut u64 as *mut c_void,
+            mem::size_of::< u64 >()
+        )
+    };
+
+    result == 0
+}
+
+fn read_arena( index: u32 ) -> Option< JemallocArenaStats > {
+    let prefix = format!( "stats.arenas.{}", index );
+    Some( JemallocArenaStats {
+        index,
+        threads: read::< libc::c_uint >( &format!( "{}.nthreads", prefix ) )?,
+        pactive: read_size( &format!( "{}.pactive", prefix ) )?,
+        pdirty: read_size( &format!( "{}.pdirty", prefix ) )?,
+        pmuzzy: read_size( &format!( "{}.pmuzzy", prefix ) )?,
+        mapped: read_size( &format!( "{}.mapped", prefix ) )?,
+        retained: read_size( &format!( "{}.retained", prefix ) )?,
+        resident: read_size( &format!( "{}.resident", prefix ) )?,
+        tcache_bytes: read_size( &format!( "{}.tcache_bytes", prefix ) )?,
+        small_allocated: read_size( &format!( "{}.small.allocated", prefix ) )?,
+        large_allocated: read_size( &format!( "{}.large.allocated", prefix ) )?
+    })
+}
+
+fn read_bin( index: u32 ) -> Option< JemallocBinStats > {
+    let prefix = format!( "stats.arenas.{}.bins.{}", MALLCTL_ARENAS_ALL, index );
+    Some( JemallocBinStats {
+        size: read_size( &format!( "arenas.bin.{}.size", index ) )?,
+        regions_per_slab: read::< u32 >( &format!( "arenas.bin.{}.nregs", index ) )? as u64,
+        current_regions: read_size( &format!( "{}.curregs", prefix ) )?,
+        current_slabs: read_size( &format!( "{}.curslabs", prefix ) )?,
+        nonfull_slabs: read_size( &format!( "{}.nonfull_slabs", prefix ) )?
+    })
+}
+
+pub struct JemallocStats {
+    is_broken: bool
+}
+
+impl JemallocStats {
+    pub fn new() -> Self {
+        JemallocStats {
+            is_broken: false
+        }
+    }
+
+    pub fn write_snapshot( &mut self, timestamp: Timestamp, fp: &mut impl Write ) -> io::Result< () > {
+        if self.is_broken || !unsafe { tikv_jemalloc_sys::is_initialized() } {
+            return Ok(());
+        }
+
+        if !refresh() {
+            // This happens when jemalloc was built without the statistics.
+            warn!( "Failed to refresh the jemalloc statistics; they won't be gathered" );
+            self.is_broken = true;
+            return Ok(());
+        }
+
+        let arena_count = read::< libc::c_uint >( "arenas.narenas" ).unwrap_or( 0 );
+        let arenas: Vec< _ > = (0..arena_count)
+            .filter( |index| read::< bool >( &format!( "arena.{}.initialized", index ) ).unwrap_or( false ) )
+            .filter_map( read_arena )
+            .collect();
+
+        let bin_count = read::< libc::c_uint >( "arenas.nbins" ).unwrap_or( 0 );
+        let bins: Vec< _ > = (0..bin_count).filter_map( read_bin ).collect();
+
+        Event::JemallocStats {
+            timestamp,
+            page_size: read_size( "arenas.page" ).unwrap_or( crate::PAGE_SIZE as u64 ),
+            allocated: read_size( "stats.allocated" ).unwrap_or( 0 ),
+            active: read_size( "stats.active" ).unwrap_or( 0 ),
+            metadata: read_size( "stats.metadata" ).unwrap_or( 0 ),
+            resident: read_size( "stats.resident" ).unwrap_or( 0 ),
+            mapped: read_size( "stats.mapped" ).unwrap_or( 0 ),
+            retained: read_size( "stats.retained" ).unwrap_or( 0 ),
+            arenas: arenas.into(),
+            bins: bins.into()
+        }.write_to_stream( fp )
+    }
+}
@@ -18,9 +18,13 @@ use std::os::unix::ffi::OsStrExt;
 #[macro_use]
 mod macros;
 mod unwind;
+mod backtrace_table;
+mod frame_pointers;
 mod timestamp;
 mod spin_lock;
+mod sharded_rwlock;
 mod channel;
+mod ring_buffer;
 mod utils;
 mod arch;
 mod logger;
@@ -29,7 +33,12 @@ mod syscall;
 mod raw_file;
 mod arc_lite;
 mod writers;
+mod threaded_lz4_stream;
+mod mmap_file;
+mod io_uring;
 mod writer_memory;
+// Most of the interposed functions aren't exported when we're a global allocator.
+#[cfg_attr(feature = "global-allocator", allow(dead_code))]
 mod api;
 mod event;
 mod init;
@@ -38,15 +47,55 @@ mod global;
 mod ordered_map;
 mod nohash;
 mod allocation_tracker;
+mod sampler;
+mod backpressure;
 mod smaps;
+mod summary;
+mod checkpoint;
+mod residency;
+mod numa;
+mod culled;
+mod allocator_latency;
+mod aligned_ids;
+mod page_faults;
+mod flight_recorder;
+mod multiplex;
+mod collector;
+mod pools;
+mod jemalloc_stats;
+mod cgroup;
+#[cfg(target_arch = "x86_64")]
+mod jemalloc_hooks;
+mod heap;
+mod metrics;
+mod instrumentation;
 mod elf;
+#[cfg(feature = "global-allocator")]
+mod global_allocator;
+#[cfg(feature = "cuda")]
+#[allow(non_snake_case)]
+mod cuda_hooks;
 
 use crate::event::InternalEvent;
 use crate::utils::read_file;
 
+// When we're the program's global allocator our own allocations go through there too.
+#[cfg(not(feature = "global-allocator"))]
 #[global_allocator]
 static mut GLOBAL_ALLOCATOR: mimalloc::MiMalloc = mimalloc::MiMalloc;
 
+#[cfg(feature = "global-allocator")]
+pub use crate::global_allocator::Bytehound;
+
+#[cfg(feature = "cuda")]
+pub use crate::cuda_hooks::{
+    cudaMalloc,
+    cudaMallocManaged,
+    cudaMallocAsync,
+    cudaFree,
+    cudaFreeAsync
+};
+
 pub(crate) const PAGE_SIZE: usize = 4096;
 
 lazy_static! {
@@ -95,8 +144,18 @@ pub use crate::api::{
     pvalloc,
 
     memory_profiler_set_marker,
+    memory_profiler_set_thread_tag,
+    memory_profiler_get_thread_tag,
+    memory_profiler_pool_create,
+    memory_profiler_external_allocator_create,
+    memory_profiler_pool_alloc,
+    memory_profiler_pool_alloc_many,
+    memory_profiler_pool_free,
+    memory_profiler_pool_free_many,
+    memory_profiler_pool_reset,
     memory_profiler_override_next_timestamp,
     memory_profiler_start,
     memory_profiler_stop,
-    memory_profiler_sync
+    memory_profiler_sync,
+    memory_profiler_dump_flight_recorder
 };
@@ -1,12 +1,13 @@
+use std::cell::{Cell, UnsafeCell};
 use std::io::{self, Write};
 use std::mem;
-use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
 use log::{self, Level, Record, Metadata};
 use std::os::unix::io::{IntoRawFd, FromRawFd};
 use libc;
 
 use crate::utils::{Buffer, stack_format_bytes, temporarily_change_umask};
-use crate::spin_lock::SpinLock;
+use crate::spin_lock::AdaptiveLock;
 use crate::raw_file::{RawFile, rename};
 use crate::syscall;
 
@@ -53,6 +54,186 @@ pub fn raw_eprint( buffer: &[u8] ) {
     syscall::write( 2, buffer );
 }
 
+thread_local! {
+    static THREAD_ID: Cell< u32 > = const { Cell::new( 0 ) };
+}
+
+/// Returns the ID of the current thread without making a syscall every time.
+fn current_thread_id() -> u32 {
+    THREAD_ID.try_with( |thread_id| {
+        if thread_id.get() == 0 {
+            thread_id.set( syscall::gettid() );
+        }
+        thread_id.get()
+    }).unwrap_or_else( |_| syscall::gettid() )
+}
+
+// While the processing thread is running the log records are only formatted by the threads which
+// emit them, and are then pushed into a lock-free ring which the processing thread drains and writes out.
+// This way the logging never makes any syscalls, nor does it wait for anything, in the allocation path.
+
+/// How many log records can be queued at once; this has to be a power of two.
+const QUEUE_LENGTH: usize = 512;
+
+/// The records' lengths are capped at this; anything longer is truncated.
+const MAXIMUM_QUEUED_RECORD_LENGTH: usize = 496;
+
+/// Every slot's stamp is twice the lap of the ring for which the slot is free, plus one if it's full.
+#[repr(C, align(64))]
+struct QueueSlot {
+    stamp: AtomicUsize,
+    length: UnsafeCell< usize >,
+    data: UnsafeCell< [u8; MAXIMUM_QUEUED_RECORD_LENGTH] >
+}
+
+unsafe impl Sync for QueueSlot {}
+
+const EMPTY_QUEUE_SLOT: QueueSlot = QueueSlot {
+    stamp: AtomicUsize::new( 0 ),
+    length: UnsafeCell::new( 0 ),
+    data: UnsafeCell::new( [0; MAXIMUM_QUEUED_RECORD_LENGTH] )
+};
+
+static QUEUE: [QueueSlot; QUEUE_LENGTH] = [EMPTY_QUEUE_SLOT; QUEUE_LENGTH];
+static QUEUE_TAIL: AtomicUsize = AtomicUsize::new( 0 );
+/// Only ever touched by the processing thread.
+static QUEUE_HEAD: AtomicUsize = AtomicUsize::new( 0 );
+static IS_QUEUE_ENABLED: AtomicBool = AtomicBool::new( false );
+
+static DROPPED_RECORD_COUNT: AtomicU64 = AtomicU64::new( 0 );
+static TRUNCATED_RECORD_COUNT: AtomicU64 = AtomicU64::new( 0 );
+static mut LAST_REPORTED_DROPPED_RECORD_COUNT: u64 = 0;
+
+/// Where the queued records are written; the standard error if `None`.
+static mut QUEUE_OUTPUT: Option< &'static FileLoggerOutput > = None;
+
+#[inline]
+fn lap_stamp( position: usize ) -> usize {
+    (position / QUEUE_LENGTH).wrapping_mul( 2 )
+}
+
+/// Queues the record to be written out by the processing thread.
+///
+/// Returns `false` if the records have to be written out right away instead.
+fn enqueue( record: &[u8] ) -> bool {
+    if !IS_QUEUE_ENABLED.load( Ordering::Acquire ) {
+        return false;
+    }
+
+    let mut position = QUEUE_TAIL.load( Ordering::Relaxed );
+    loop {
+        let slot = &QUEUE[ position & (QUEUE_LENGTH - 1) ];
+        let stamp = slot.stamp.load( Ordering::Acquire );
+        let free_stamp = lap_stamp( position );
+        if stamp == free_stamp {
+            match QUEUE_TAIL.compare_exchange_weak( position, position.wrapping_add( 1 ), Ordering::Relaxed, Ordering::Relaxed ) {
+                Ok( _ ) => {
+                    let length = std::cmp::min( record.len(), MAXIMUM_QUEUED_RECORD_LENGTH );
+                    unsafe {
+                        let data = &mut *slot.data.get();
+                        data[ ..length ].copy_from_slice( &record[ ..length ] );
+                        if length < record.len() {
+                            data[ length - 1 ] = b'\n';
+                            TRUNCATED_RECORD_COUNT.fetch_add( 1, Ordering::Relaxed );
+                        }
+                        *slot.length.get() = length;
+                    }
+
+                    slot.stamp.store( free_stamp.wrapping_add( 1 ), Ordering::Release );
+                    return true;
+                },
+                Err( current ) => position = current
+            }
+        } else if stamp == free_stamp.wrapping_sub( 1 ) {
+            // The slot still holds a record from the previous lap, so the queue is full.
+            DROPPED_RECORD_COUNT.fetch_add( 1, Ordering::Relaxed );
+            return true;
+        } else {
+            position = QUEUE_TAIL.load( Ordering::Relaxed );
+        }
+    }
+}
+
+fn write_out( record: &[u8] ) {
+    match unsafe { QUEUE_OUTPUT } {
+        Some( output ) => output.write_record( record ),
+        None => raw_eprint( record )
+    }
+}
+
+fn drain_queue( mut callback: impl FnMut( &[u8] ) ) {
+    loop {
+        let position = QUEUE_HEAD.load( Ordering::Relaxed );
+        let slot = &QUEUE[ position & (QUEUE_LENGTH - 1) ];
+        let full_stamp = lap_stamp( position ).wrapping_add( 1 );
+        if slot.stamp.load( Ordering::Acquire ) != full_stamp {
+            break;
+        }
+
+        unsafe {
+            let data = &*slot.data.get();
+            callback( &data[ ..*slot.length.get() ] );
+        }
+
+        slot.stamp.store( full_stamp.wrapping_add( 1 ), Ordering::Release );
+        QUEUE_HEAD.store( position.wrapping_add( 1 ), Ordering::Relaxed );
+    }
+}
+
+/// Writes out the queued log records; must only be called from the processing thread.
+pub fn flush_queued_records() {
+    drain_queue( write_out );
+
+    let dropped = DROPPED_RECORD_COUNT.load( Ordering::Relaxed );
+    unsafe {
+        if dropped != LAST_REPORTED_DROPPED_RECORD_COUNT {
+            stack_format_bytes( format_args!( "bytehound: {} log record(s) were dropped since the log queue was full\n", dropped - LAST_REPORTED_DROPPED_RECORD_COUNT ), |buffer| {
+                write_out( buffer );
+            });
+            LAST_REPORTED_DROPPED_RECORD_COUNT = dropped;
+        }
+    }
+}
+
+/// Starts queueing the log records; called when the processing thread starts.
+pub fn start_queueing() {
+    IS_QUEUE_ENABLED.store( true, Ordering::Release );
+}
+
+/// Goes back to writing the records out right away; called when the processing thread exits.
+pub fn stop_queueing() {
+    IS_QUEUE_ENABLED.store( false, Ordering::Release );
+    flush_queued_records();
+}
+
+/// Called in the child after a `fork`, where there's no processing thread anymore.
+pub unsafe fn on_fork() {
+    IS_QUEUE_ENABLED.store( false, Ordering::SeqCst );
+    let _ = THREAD_ID.try_with( |thread_id| thread_id.set( 0 ) );
+
+    // We're the only thread now, so whatever our parent has queued can just be thrown away.
+    for slot in QUEUE.iter() {
+        slot.stamp.store( 0, Ordering::Relaxed );
+    }
+    QUEUE_TAIL.store( 0, Ordering::Relaxed );
+    QUEUE_HEAD.store( 0, Ordering::Relaxed );
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Default, Debug)]
+pub struct Counters {
+    /// How many log records were dropped since the queue was full.
+    pub dropped: u64,
+    /// How many log records were truncated since they were too long to be queued.
+    pub truncated: u64
+}
+
+pub fn counters() -> Counters {
+    Counters {
+        dropped: DROPPED_RECORD_COUNT.load( Ordering::Relaxed ),
+        truncated: TRUNCATED_RECORD_COUNT.load( Ordering::Relaxed )
+    }
+}
+
 impl log::Log for SyscallLogger {
     #[inline]
     fn enabled( &self, metadata: &Metadata ) -> bool {
@@ -66,9 +247,11 @@ impl log::Log for SyscallLogger {
                 return;
             }
 
-            stack_format_bytes( format_args!( "bytehound: {:04x} {:04x} {} {}\n", self.pid, syscall::gettid(), level_to_str( record.level() ), record.args() ), |buffer| {
+            stack_format_bytes( format_args!( "bytehound: {:04x} {:04x} {} {}\n", self.pid, current_thread_id(), level_to_str( record.level() ), record.args() ), |buffer| {
                 buffer[ buffer.len() - 1 ] = b'\n';
-                raw_eprint( buffer );
+                if !enqueue( buffer ) {
+                    raw_eprint( buffer );
+                }
             });
         }
     }
@@ -110,7 +293,7 @@ impl RotationState {
 
 pub struct FileLoggerOutput {
     raw_fd: AtomicUsize,
-    rotation: SpinLock< RotationState >,
+    rotation: AdaptiveLock< RotationState >,
     bytes_written: AtomicUsize,
     rotate_at: Option< usize >
 }
@@ -138,7 +321,7 @@ impl FileLoggerOutput {
 
         let output = FileLoggerOutput {
             raw_fd: AtomicUsize::new( fp.into_raw_fd() as _ ),
-            rotation: SpinLock::new( RotationState {
+            rotation: AdaptiveLock::new( RotationState {
                 path,
                 old_path,
                 initial_path,
@@ -155,6 +338,14 @@ impl FileLoggerOutput {
         self.raw_fd.load( Ordering::SeqCst ) as libc::c_int
     }
 
+    fn write_record( &self, record: &[u8] ) {
+        let fd = self.fd();
+        let mut fp = RawFile::borrow_raw( &fd );
+        let _ = fp.write_all( record );
+        self.bytes_written.fetch_add( record.len(), Ordering::Relaxed );
+        let _ = self.rotate_if_necessary();
+    }
+
     fn rotate_if_necessary( &self ) -> Result< (), io::Error > {
         let threshold = match self.rotate_at {
             Some( threshold ) => threshold,
@@ -207,6 +398,13 @@ impl FileLogger {
         self.output = Some( output );
         Ok(())
     }
+
+    /// Makes the queued records go into the file instead of the standard error.
+    pub fn route_queued_records( &'static self ) {
+        unsafe {
+            QUEUE_OUTPUT = self.output.as_ref();
+        }
+    }
 }
 
 impl log::Log for FileLogger {
@@ -223,13 +421,11 @@ impl log::Log for FileLogger {
             }
 
             if let Some( output ) = self.output.as_ref() {
-                stack_format_bytes( format_args!( "{:04x} {:04x} {} {}\n", self.pid, syscall::gettid(), level_to_str( record.level() ), record.args() ), |buffer| {
-                    let fd = output.fd();
-                    let mut fp = RawFile::borrow_raw( &fd );
-                    let _ = fp.write_all( buffer );
-                    output.bytes_written.fetch_add( buffer.len(), Ordering::Relaxed );
+                stack_format_bytes( format_args!( "{:04x} {:04x} {} {}\n", self.pid, current_thread_id(), level_to_str( record.level() ), record.args() ), |buffer| {
+                    if !enqueue( buffer ) {
+                        output.write_record( buffer );
+                    }
                 });
-                let _ = output.rotate_if_necessary();
             }
         }
     }
@@ -237,3 +433,33 @@ impl log::Log for FileLogger {
     #[inline]
     fn flush( &self ) {}
 }
+
+#[test]
+fn test_log_queue() {
+    start_queueing();
+
+    let dropped = DROPPED_RECORD_COUNT.load( Ordering::Relaxed );
+    for lap in 0..3 {
+        for index in 0..QUEUE_LENGTH + 2 {
+            assert!( enqueue( format!( "{} {}\n", lap, index ).as_bytes() ) );
+        }
+
+        let mut records = Vec::new();
+        drain_queue( |record| records.push( String::from_utf8( record.to_vec() ).unwrap() ) );
+        assert_eq!( records.len(), QUEUE_LENGTH );
+        assert_eq!( records[ 0 ], format!( "{} 0\n", lap ) );
+        assert_eq!( records[ QUEUE_LENGTH - 1 ], format!( "{} {}\n", lap, QUEUE_LENGTH - 1 ) );
+    }
+    assert_eq!( DROPPED_RECORD_COUNT.load( Ordering::Relaxed ) - dropped, 6 );
+
+    let long = vec![ b'x'; MAXIMUM_QUEUED_RECORD_LENGTH * 2 ];
+    assert!( enqueue( &long ) );
+    let mut records = Vec::new();
+    drain_queue( |record| records.push( record.to_vec() ) );
+    assert_eq!( records.len(), 1 );
+    assert_eq!( records[ 0 ].len(), MAXIMUM_QUEUED_RECORD_LENGTH );
+    assert_eq!( records[ 0 ].last(), Some( &b'\n' ) );
+
+    IS_QUEUE_ENABLED.store( false, Ordering::SeqCst );
+    assert!( !enqueue( b"x\n" ) );
+}
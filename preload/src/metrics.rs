@@ -0,0 +1,202 @@
+//! The `/metrics` endpoint, in the Prometheus text format, served by the same
+//! TCP listener which is used for streaming the data when `MEMORY_PROFILER_ENABLE_METRICS` is set.
+
+use std::fmt::Write as _;
+use std::io::{self, Read, Write};
+
+use crate::instrumentation;
+use crate::opt;
+use crate::summary::Summary;
+
+/// The longest HTTP request we're willing to read.
+const MAXIMUM_REQUEST_LENGTH: usize = 8 * 1024;
+
+/// Returns `Some( true )` if the client has started with an HTTP request, or `None` if it's too early to tell.
+pub fn is_http_request( prefix: &[u8] ) -> Option< bool > {
+    const METHOD: &[u8] = b"GET ";
+    let length = std::cmp::min( prefix.len(), METHOD.len() );
+    if prefix[ ..length ] != METHOD[ ..length ] {
+        Some( false )
+    } else if length < METHOD.len() {
+        None
+    } else {
+        Some( true )
+    }
+}
+
+fn metric( output: &mut String, name: &str, kind: &str, help: &str, value: u64 ) {
+    let _ = writeln!( output, "# HELP {} {}", name, help );
+    let _ = writeln!( output, "# TYPE {} {}", name, kind );
+    let _ = writeln!( output, "{} {}", name, value );
+}
+
+fn render_stages( output: &mut String ) {
+    let name = "bytehound_stage_seconds_total";
+    let _ = writeln!( output, "# HELP {} The time the profiler has spent on each of its stages.", name );
+    let _ = writeln!( output, "# TYPE {} counter", name );
+    for &stage in instrumentation::stages().iter().filter( |stage| stage.is_duration() ) {
+        let (_, sum) = instrumentation::totals( stage );
+        let _ = writeln!( output, "{}{{stage=\"{}\"}} {}", name, stage.name(), sum as f64 / 1_000_000_000.0 );
+    }
+
+    let name = "bytehound_stage_total";
+    let _ = writeln!( output, "# HELP {} How many times each of the profiler's stages was measured.", name );
+    let _ = writeln!( output, "# TYPE {} counter", name );
+    for &stage in instrumentation::stages() {
+        let (count, _) = instrumentation::totals( stage );
+        let _ = writeln!( output, "{}{{stage=\"{}\"}} {}", name, stage.name(), count );
+    }
+
+    let (_, events) = instrumentation::totals( instrumentation::Stage::BatchSize );
+    metric( output, "bytehound_processed_events_total", "counter", "The number of events processed by the processing thread.", events );
+
+    let name = "bytehound_backtrace_cache_lookups_total";
+    let _ = writeln!( output, "# HELP {} How many times the backtraces were looked up in the 1st and the 2nd level caches; the conflicts are also counted as misses.", name );
+    let _ = writeln!( output, "# TYPE {} counter", name );
+    for &(level, result, counter) in &[
+        (1, "hit", instrumentation::Counter::BacktraceCacheLevel1Hit),
+        (1, "miss", instrumentation::Counter::BacktraceCacheLevel1Miss),
+        (1, "conflict", instrumentation::Counter::BacktraceCacheLevel1Conflict),
+        (2, "hit", instrumentation::Counter::BacktraceCacheLevel2Hit),
+        (2, "miss", instrumentation::Counter::BacktraceCacheLevel2Miss),
+        (2, "conflict", instrumentation::Counter::BacktraceCacheLevel2Conflict)
+    ] {
+        let _ = writeln!( output, "{}{{level=\"{}\",result=\"{}\"}} {}", name, level, result, instrumentation::counter_value( counter ) );
+    }
+}
+
+/// `batch_size` is the number of events received by the processing thread during its last iteration.
+pub fn render( summary: Option< &Summary >, batch_size: usize ) -> String {
+    let mut output = String::new();
+    if let Some( summary ) = summary {
+        let totals = summary.totals();
+        metric( &mut output, "bytehound_allocations_total", "counter", "The number of allocations made.", totals.allocated_count );
+        metric( &mut output, "bytehound_allocated_bytes_total", "counter", "The number of bytes allocated.", totals.allocated_size );
+        metric( &mut output, "bytehound_deallocations_total", "counter", "The number of allocations freed.", totals.freed_count );
+        metric( &mut output, "bytehound_deallocated_bytes_total", "counter", "The number of bytes freed.", totals.freed_size );
+        metric( &mut output, "bytehound_heap_in_use_bytes", "gauge", "The number of bytes currently allocated.", totals.allocated_size - totals.freed_size );
+        metric( &mut output, "bytehound_heap_peak_bytes", "gauge", "The highest number of bytes which were allocated at the same time.", totals.peak_usage );
+
+        let name = "bytehound_backtrace_heap_in_use_bytes";
+        let _ = writeln!( output, "# HELP {} The number of bytes currently allocated from the backtraces which are using the most memory.", name );
+        let _ = writeln!( output, "# TYPE {} gauge", name );
+        for (backtrace, usage) in summary.top_backtraces_by_usage( opt::get().metrics_top_backtraces ) {
+            let _ = writeln!( output, "{}{{backtrace=\"{}\"}} {}", name, backtrace, usage );
+        }
+    }
+
+    let backpressure = crate::backpressure::counters();
+    metric( &mut output, "bytehound_processing_batch_events", "gauge", "The number of events processed in the last batch.", batch_size as u64 );
+    metric( &mut output, "bytehound_queued_event_bytes", "gauge", "The number of bytes worth of events waiting to be processed.", crate::backpressure::queued_bytes() as u64 );
+    metric( &mut output, "bytehound_throttled_total", "counter", "How many times a thread had to wait for the allocation lock.", backpressure.throttled );
+    metric( &mut output, "bytehound_blocked_total", "counter", "How many times a thread was blocked because of the backpressure budget.", backpressure.blocked );
+    metric( &mut output, "bytehound_sampled_out_total", "counter", "How many allocations weren't tracked because of the backpressure budget.", backpressure.sampled_out );
+    metric( &mut output, "bytehound_dropped_backtraces_total", "counter", "How many backtraces were dropped because of the backpressure budget.", backpressure.dropped_backtraces );
+
+    let log = crate::logger::counters();
+    metric( &mut output, "bytehound_dropped_log_records_total", "counter", "How many log records were dropped because the log queue was full.", log.dropped );
+    metric( &mut output, "bytehound_truncated_log_records_total", "counter", "How many log records were truncated because they were too long to be queued.", log.truncated );
+
+    let locks = crate::spin_lock::lock_counters();
+    metric( &mut output, "bytehound_lock_contended_total", "counter", "How many times one of the profiler's long-held locks wasn't free.", locks.contended );
+    metric( &mut output, "bytehound_lock_parked_total", "counter", "How many times a thread was parked waiting for one of the profiler's long-held locks.", locks.parked );
+
+    if instrumentation::is_enabled() {
+        metric( &mut output, "bytehound_written_bytes_total", "counter", "The number of bytes written to the output.", instrumentation::bytes_written() );
+        render_stages( &mut output );
+    }
+
+    output
+}
+
+/// Appends whatever the client has sent so far to the `request`.
+///
+/// The `stream` should be non-blocking; returns `true` once the whole request was read.
+pub fn read_request( stream: &mut impl Read, request: &mut Vec< u8 > ) -> io::Result< bool > {
+    let mut buffer = [0; 1024];
+    while !request.windows( 4 ).any( |window| window == b"\r\n\r\n" ) {
+        if request.len() >= MAXIMUM_REQUEST_LENGTH {
+            return Err( io::Error::new( io::ErrorKind::InvalidData, "the HTTP request is too long" ) );
+        }
+
+        let count = match stream.read( &mut buffer ) {
+            Ok( count ) => count,
+            Err( ref error ) if error.kind() == io::ErrorKind::WouldBlock => return Ok( false ),
+            Err( ref error ) if error.kind() == io::ErrorKind::Interrupted => continue,
+            Err( error ) => return Err( error )
+        };
+
+        if count == 0 {
+            break;
+        }
+
+        request.extend_from_slice( &buffer[ ..count ] );
+    }
+
+    Ok( true )
+}
+
+/// Responds to an HTTP `request` which was read with `read_request`.
+pub fn respond( stream: &mut impl Write, request: &[u8], render: impl FnOnce() -> String ) -> io::Result< () > {
+    let path = request.split( |&byte| byte == b' ' ).nth( 1 ).unwrap_or( b"" );
+    let path = path.split( |&byte| byte == b'?' ).next().unwrap();
+    let (status, body) = if path == b"/metrics" {
+        ("200 OK", render())
+    } else {
+        ("404 Not Found", "Not found\n".to_owned())
+    };
+
+    let mut response = String::new();
+    let _ = write!(
+        response,
+        "HTTP/1.1 {}\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: {}\r\nConnection: close\r\n\r\n",
+        status,
+        body.len()
+    );
+    response.push_str( &body );
+
+    stream.write_all( response.as_bytes() )?;
+    stream.flush()
+}
+
+#[test]
+fn test_is_http_request() {
+    assert_eq!( is_http_request( b"G" ), None );
+    assert_eq!( is_http_request( b"GET" ), None );
+    assert_eq!( is_http_request( b"GET /metrics" ), Some( true ) );
+    assert_eq!( is_http_request( b"\x01\x02" ), Some( false ) );
+    assert_eq!( is_http_request( b"GEX" ), Some( false ) );
+}
+
+#[test]
+fn test_read_request_in_pieces() {
+    struct Pieces( Vec< &'static [u8] > );
+    impl Read for Pieces {
+        fn read( &mut self, buffer: &mut [u8] ) -> io::Result< usize > {
+            // An empty piece stands for there being nothing more to read at the moment.
+            if self.0.is_empty() {
+                return Err( io::ErrorKind::WouldBlock.into() );
+            }
+
+            let piece = self.0.remove( 0 );
+            if piece.is_empty() {
+                return Err( io::ErrorKind::WouldBlock.into() );
+            }
+
+            buffer[ ..piece.len() ].copy_from_slice( piece );
+            Ok( piece.len() )
+        }
+    }
+
+    let mut stream = Pieces( vec![ b"GET /met", b"", b"rics HTTP/1.1\r\n", b"", b"\r\n" ] );
+    let mut request = Vec::new();
+    assert!( !read_request( &mut stream, &mut request ).unwrap() );
+    assert!( !read_request( &mut stream, &mut request ).unwrap() );
+    assert!( read_request( &mut stream, &mut request ).unwrap() );
+
+    let mut response = Vec::new();
+    respond( &mut response, &request, || "bytehound_test 1\n".to_owned() ).unwrap();
+    let response = String::from_utf8( response ).unwrap();
+    assert!( response.starts_with( "HTTP/1.1 200 OK\r\n" ) );
+    assert!( response.ends_with( "\r\n\r\nbytehound_test 1\n" ) );
+}
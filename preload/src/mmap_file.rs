@@ -0,0 +1,245 @@
+use std::fs::File;
+use std::io::{self, Seek, SeekFrom, Write};
+use std::os::unix::io::AsRawFd;
+use std::ptr::{self, NonNull};
+
+use crate::syscall;
+
+/// The size of the window into the file which is mapped at any given time.
+const WINDOW_SIZE: usize = 32 * 1024 * 1024;
+
+/// The granularity with which the file is preallocated.
+const ALLOCATION_GRANULARITY: u64 = 256 * 1024 * 1024;
+
+/// A file which is written through a sliding memory-mapped window.
+///
+/// The file is preallocated in big increments, and is truncated
+/// to the amount of data which was actually written when finished.
+///
+/// The current position in the file lives in a shared anonymous mapping so that
+/// it's kept in sync when the file is written from a forked child process (which
+/// is what the memory dumper does), just as it would be with a normal file.
+pub struct MmapFile {
+    file: Option< File >,
+    position: NonNull< u64 >,
+    window: *mut u8,
+    window_offset: u64,
+    allocated: u64
+}
+
+unsafe impl Send for MmapFile {}
+
+fn check_mmap( pointer: *mut libc::c_void ) -> io::Result< *mut u8 > {
+    if pointer == libc::MAP_FAILED {
+        Err( io::Error::last_os_error() )
+    } else {
+        Ok( pointer as *mut u8 )
+    }
+}
+
+impl MmapFile {
+    /// Wraps a `file`; everything will be written starting at its current position.
+    ///
+    /// On failure the `file` is given back untouched.
+    pub fn new( mut file: File ) -> Result< Self, (File, io::Error) > {
+        let position = match file.seek( SeekFrom::Current( 0 ) ) {
+            Ok( position ) => position,
+            Err( error ) => return Err( (file, error) )
+        };
+
+        let allocated = match file.metadata() {
+            Ok( metadata ) => metadata.len(),
+            Err( error ) => return Err( (file, error) )
+        };
+
+        let shared = unsafe {
+            syscall::mmap(
+                ptr::null_mut(),
+                crate::PAGE_SIZE,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED | libc::MAP_ANONYMOUS,
+                -1,
+                0
+            )
+        };
+
+        let shared = match check_mmap( shared ) {
+            Ok( pointer ) => pointer as *mut u64,
+            Err( error ) => return Err( (file, error) )
+        };
+
+        unsafe {
+            ptr::write_volatile( shared, position );
+        }
+
+        Ok( MmapFile {
+            file: Some( file ),
+            position: unsafe { NonNull::new_unchecked( shared ) },
+            window: ptr::null_mut(),
+            window_offset: 0,
+            allocated
+        })
+    }
+
+    fn fd( &self ) -> libc::c_int {
+        self.file.as_ref().unwrap().as_raw_fd()
+    }
+
+    fn position( &self ) -> u64 {
+        unsafe { ptr::read_volatile( self.position.as_ptr() ) }
+    }
+
+    fn set_position( &mut self, position: u64 ) {
+        unsafe { ptr::write_volatile( self.position.as_ptr(), position ) }
+    }
+
+    fn reserve( &mut self, end: u64 ) -> io::Result< () > {
+        if end <= self.allocated {
+            return Ok(());
+        }
+
+        let target = (end + ALLOCATION_GRANULARITY - 1) / ALLOCATION_GRANULARITY * ALLOCATION_GRANULARITY;
+        let errcode = unsafe { libc::fallocate( self.fd(), 0, self.allocated as libc::off_t, (target - self.allocated) as libc::off_t ) };
+        if errcode != 0 {
+            let error = io::Error::last_os_error();
+            if error.raw_os_error() != Some( libc::EOPNOTSUPP ) {
+                return Err( error );
+            }
+
+            // Not every filesystem supports `fallocate`, so just create a sparse file instead.
+            self.file.as_ref().unwrap().set_len( target )?;
+        }
+
+        self.allocated = target;
+        Ok(())
+    }
+
+    fn unmap_window( &mut self ) {
+        if self.window.is_null() {
+            return;
+        }
+
+        unsafe {
+            libc::msync( self.window as *mut libc::c_void, WINDOW_SIZE, libc::MS_ASYNC );
+            libc::madvise( self.window as *mut libc::c_void, WINDOW_SIZE, libc::MADV_DONTNEED );
+            syscall::munmap( self.window as *mut libc::c_void, WINDOW_SIZE );
+        }
+
+        self.window = ptr::null_mut();
+    }
+
+    fn map_window( &mut self, position: u64 ) -> io::Result< () > {
+        self.unmap_window();
+
+        let offset = position / WINDOW_SIZE as u64 * WINDOW_SIZE as u64;
+        self.reserve( offset + WINDOW_SIZE as u64 )?;
+
+        self.window = unsafe {
+            check_mmap( syscall::mmap(
+                ptr::null_mut(),
+                WINDOW_SIZE,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                self.fd(),
+                offset as libc::off_t
+            ))?
+        };
+
+        self.window_offset = offset;
+        Ok(())
+    }
+
+    fn finish( &mut self ) -> io::Result< () > {
+        self.unmap_window();
+
+        let position = self.position();
+        let file = self.file.as_mut().unwrap();
+        file.set_len( position )?;
+        file.seek( SeekFrom::Start( position ) )?;
+        self.allocated = position;
+
+        Ok(())
+    }
+
+    /// Truncates the file to its final length and returns it, positioned at its end.
+    pub fn into_file( mut self ) -> io::Result< File > {
+        self.finish()?;
+        Ok( self.file.take().unwrap() )
+    }
+}
+
+impl Drop for MmapFile {
+    fn drop( &mut self ) {
+        if self.file.is_some() {
+            if let Err( error ) = self.finish() {
+                warn!( "Failed to finish the memory mapped output file: {}", error );
+            }
+        }
+
+        unsafe {
+            syscall::munmap( self.position.as_ptr() as *mut libc::c_void, crate::PAGE_SIZE );
+        }
+    }
+}
+
+impl Write for MmapFile {
+    fn write( &mut self, data: &[u8] ) -> io::Result< usize > {
+        let mut position = self.position();
+        let mut remaining = data;
+        while !remaining.is_empty() {
+            if self.window.is_null() || position < self.window_offset || position >= self.window_offset + WINDOW_SIZE as u64 {
+                self.map_window( position )?;
+            }
+
+            let offset = (position - self.window_offset) as usize;
+            let count = std::cmp::min( remaining.len(), WINDOW_SIZE - offset );
+            unsafe {
+                ptr::copy_nonoverlapping( remaining.as_ptr(), self.window.add( offset ), count );
+            }
+
+            position += count as u64;
+            remaining = &remaining[ count.. ];
+            self.set_position( position );
+        }
+
+        Ok( data.len() )
+    }
+
+    fn flush( &mut self ) -> io::Result< () > {
+        if !self.window.is_null() {
+            let errcode = unsafe { libc::msync( self.window as *mut libc::c_void, WINDOW_SIZE, libc::MS_ASYNC ) };
+            if errcode != 0 {
+                return Err( io::Error::last_os_error() );
+            }
+        }
+
+        Ok(())
+    }
+}
+
+#[test]
+fn test_mmap_file() {
+    use std::io::Read;
+
+    let path = std::env::temp_dir().join( format!( "bytehound-test-mmap-file-{}", std::process::id() ) );
+    let mut file = std::fs::OpenOptions::new().read( true ).write( true ).create( true ).truncate( true ).open( &path ).unwrap();
+    file.write_all( b"header" ).unwrap();
+
+    let mut expected = b"header".to_vec();
+    let mut fp = MmapFile::new( file ).map_err( |(_, error)| error ).unwrap();
+    let data: Vec< u8 > = (0..WINDOW_SIZE + 12345).map( |nth| nth as u8 ).collect();
+    fp.write_all( &data ).unwrap();
+    fp.write_all( b"footer" ).unwrap();
+    expected.extend_from_slice( &data );
+    expected.extend_from_slice( b"footer" );
+
+    let mut file = fp.into_file().unwrap();
+    assert_eq!( file.metadata().unwrap().len(), expected.len() as u64 );
+
+    let mut actual = Vec::new();
+    file.seek( SeekFrom::Start( 0 ) ).unwrap();
+    file.read_to_end( &mut actual ).unwrap();
+    let _ = std::fs::remove_file( &path );
+
+    assert!( actual == expected );
+}
@@ -0,0 +1,242 @@
+//! Streaming of the data of the child processes through their parent.
+//!
+//! Every child gets its own single-producer single-consumer byte ring in a memfd which is created
+//! right before it's forked. The memfd is close-on-exec everywhere except in that one child, and
+//! its number is passed down through the environment, so once the child `exec`s and gets profiled
+//! its processing thread writes everything it would have written into its output file into the
+//! ring instead. The parent's processing thread drains the rings and writes what it finds into
+//! its own output as `ChildData` events, which the loader then splits back into separate datasets.
+
+use std::io::{self, Write};
+use std::os::unix::io::RawFd;
+
+use common::event::Event;
+use common::shm_ring::{self, ShmRing};
+use common::speedy::Writable;
+
+use crate::event::{InternalEvent, send_event};
+use crate::opt;
+use crate::syscall;
+use crate::timestamp::Timestamp;
+
+/// The environment variable through which a child learns the number of its ring's file descriptor.
+const RING_FD_VAR: &str = "MEMORY_PROFILER_PARENT_RING_FD";
+
+/// How much data each ring can hold; this has to be a power of two.
+pub const RING_CAPACITY: usize = 4 * 1024 * 1024;
+
+/// The whole length of a ring's mapping.
+pub const RING_LENGTH: usize = shm_ring::HEADER_SIZE + RING_CAPACITY;
+
+/// How often the parent checks whether the children which haven't closed their rings are still alive.
+const LIVENESS_CHECK_INTERVAL: Timestamp = Timestamp::from_secs( 1 );
+
+/// A `ShmRing` which we have mapped ourselves.
+pub struct SharedRing( ShmRing );
+
+impl SharedRing {
+    pub fn map( fd: RawFd, length: usize ) -> Option< Self > {
+        let pointer = unsafe { syscall::mmap( std::ptr::null_mut(), length, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, fd, 0 ) };
+        if pointer == libc::MAP_FAILED {
+            return None;
+        }
+
+        Some( SharedRing( unsafe { ShmRing::from_raw( pointer as *mut u8, length ) } ) )
+    }
+
+    /// Creates a new memfd-backed ring; the returned descriptor is close-on-exec.
+    pub fn create( name: &[u8] ) -> Option< (Self, RawFd) > {
+        let fd = syscall::memfd_create( name.as_ptr().cast(), libc::MFD_CLOEXEC );
+        if fd < 0 {
+            return None;
+        }
+
+        let ring = if unsafe { libc::ftruncate( fd, RING_LENGTH as libc::off_t ) } == 0 { SharedRing::map( fd, RING_LENGTH ) } else { None };
+        match ring {
+            Some( ring ) => Some( (ring, fd) ),
+            None => {
+                syscall::close( fd );
+                None
+            }
+        }
+    }
+}
+
+impl std::ops::Deref for SharedRing {
+    type Target = ShmRing;
+    fn deref( &self ) -> &Self::Target {
+        &self.0
+    }
+}
+
+impl Drop for SharedRing {
+    fn drop( &mut self ) {
+        unsafe {
+            syscall::munmap( self.0.as_ptr() as *mut libc::c_void, self.0.len() );
+        }
+    }
+}
+
+pub fn is_process_alive( pid: u32 ) -> bool {
+    unsafe {
+        libc::kill( pid as libc::pid_t, 0 ) == 0 || *libc::__errno_location() != libc::ESRCH
+    }
+}
+
+/// A ring which was created for a child which is about to be forked.
+pub struct PendingRing {
+    ring: SharedRing,
+    fd: RawFd
+}
+
+/// Creates a ring for the child which is about to be forked, if its data is supposed to go through us.
+pub fn prepare_for_fork() -> Option< PendingRing > {
+    if !opt::is_initialized() || !opt::get().track_child_processes || !opt::get().multiplex_child_processes {
+        return None;
+    }
+
+    if !crate::global::is_actively_running() {
+        return None;
+    }
+
+    let (ring, fd) = match SharedRing::create( b"bytehound::child_ring\0" ) {
+        Some( ring ) => ring,
+        None => {
+            warn!( "Failed to create a ring for a child process: {}", io::Error::last_os_error() );
+            return None;
+        }
+    };
+
+    ring.set_consumer_pid( syscall::getpid() as u32 );
+    Some( PendingRing { ring, fd } )
+}
+
+/// Called in the child right after it's forked.
+pub fn export_ring_to_child( pending: PendingRing ) {
+    unsafe {
+        // Only this one child gets to keep it after an `exec`.
+        libc::fcntl( pending.fd, libc::F_SETFD, 0 );
+    }
+
+    std::env::set_var( RING_FD_VAR, pending.fd.to_string() );
+}
+
+/// Called in the parent right after the child is forked; the `pid` is negative if the `fork` failed.
+pub fn on_child_forked( pid: libc::pid_t, pending: PendingRing ) {
+    syscall::close( pending.fd );
+    if pid > 0 {
+        send_event( InternalEvent::ChildForked { pid: pid as u32, ring: pending.ring } );
+    }
+}
+
+/// Picks up the ring which our parent has created for us, if any.
+pub fn take_parent_ring() -> Option< RingOutput > {
+    let fd: RawFd = std::env::var( RING_FD_VAR ).ok()?.parse().ok()?;
+    std::env::remove_var( RING_FD_VAR );
+
+    let ring = SharedRing::map( fd, RING_LENGTH );
+    syscall::close( fd );
+
+    match ring {
+        Some( ring ) => {
+            info!( "Streaming the data to the parent process {}", ring.consumer_pid() );
+            Some( RingOutput { ring } )
+        },
+        None => {
+            warn!( "Failed to map the ring of the parent process: {}", io::Error::last_os_error() );
+            None
+        }
+    }
+}
+
+/// An output which goes into a ring drained by another process.
+pub struct RingOutput {
+    ring: SharedRing
+}
+
+impl RingOutput {
+    pub fn new( ring: SharedRing ) -> Self {
+        RingOutput { ring }
+    }
+}
+
+impl Write for RingOutput {
+    fn write( &mut self, data: &[u8] ) -> io::Result< usize > {
+        loop {
+            let count = self.ring.write_some( data );
+            if count > 0 || data.is_empty() {
+                return Ok( count );
+            }
+
+            // The ring's full, so wait until it's drained, unless whoever drains it has already exited.
+            if !is_process_alive( self.ring.consumer_pid() ) {
+                return Err( io::Error::new( io::ErrorKind::BrokenPipe, "the process which was draining the ring has exited" ) );
+            }
+
+            unsafe {
+                libc::usleep( 1000 );
+            }
+        }
+    }
+
+    fn flush( &mut self ) -> io::Result< () > {
+        Ok(())
+    }
+}
+
+impl Drop for RingOutput {
+    fn drop( &mut self ) {
+        self.ring.close();
+    }
+}
+
+/// The rings of the children, which the parent's processing thread drains.
+pub struct Children {
+    rings: Vec< (u32, SharedRing) >,
+    buffer: Vec< u8 >,
+    last_liveness_check: Timestamp
+}
+
+impl Children {
+    pub fn new() -> Self {
+        Children {
+            rings: Vec::new(),
+            buffer: Vec::new(),
+            last_liveness_check: Timestamp::min()
+        }
+    }
+
+    pub fn add( &mut self, pid: u32, ring: SharedRing ) {
+        info!( "The child process {} will stream its data through us", pid );
+        self.rings.push( (pid, ring) );
+    }
+
+    /// Writes out whatever the children have written so far, and gets rid of the rings which won't be written to anymore.
+    pub fn poll( &mut self, timestamp: Timestamp, serializer: &mut impl Write ) {
+        if self.rings.is_empty() {
+            return;
+        }
+
+        let check_liveness = timestamp - self.last_liveness_check >= LIVENESS_CHECK_INTERVAL;
+        if check_liveness {
+            self.last_liveness_check = timestamp;
+        }
+
+        let buffer = &mut self.buffer;
+        self.rings.retain( |&(pid, ref ring)| {
+            // This has to be checked before the ring is drained, or we could miss whatever was written in between.
+            let is_finished = ring.is_closed() || (check_liveness && !is_process_alive( pid ));
+
+            buffer.clear();
+            if ring.read_into( buffer ) > 0 {
+                let _ = Event::ChildData { timestamp, pid, data: buffer.as_slice().into() }.write_to_stream( &mut *serializer );
+            }
+
+            if is_finished {
+                info!( "The child process {} has finished streaming its data", pid );
+            }
+
+            !is_finished
+        });
+    }
+}
@@ -26,6 +26,10 @@ impl std::hash::Hasher for NoHasher {
         self.0 ^= value;
     }
 
+    fn write_u128( &mut self, value: u128 ) {
+        self.0 ^= value as u64 ^ (value >> 64) as u64;
+    }
+
     fn write_usize( &mut self, value: usize ) {
         self.0 ^= value as u64;
     }
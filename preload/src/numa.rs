@@ -0,0 +1,155 @@
+//! Periodic lookup of the NUMA nodes on which the memory of the live allocations ended up.
+//!
+//! A page only gets placed on a node when it's first touched, so every pass asks the kernel
+//! (through `move_pages`, without actually moving anything) where the first page of every
+//! allocation which wasn't placed yet is. Once an allocation is placed it's reported and forgotten.
+
+use std::io::{self, Write};
+
+use common::event::{AllocationId, Event, NumaPlacement};
+use common::speedy::Writable;
+
+use crate::timestamp::Timestamp;
+use crate::utils::{HashMap, empty_hashmap};
+
+const CHUNK_SIZE: usize = 512;
+
+// Don't let the allocations which are never touched pile up forever.
+const MAXIMUM_PENDING: usize = 1024 * 1024;
+
+pub struct NumaPlacements {
+    pending: HashMap< u64, AllocationId >,
+    is_broken: bool,
+    pages: Vec< *mut libc::c_void >,
+    status: Vec< libc::c_int >,
+    entries: Vec< NumaPlacement >
+}
+
+impl NumaPlacements {
+    pub fn new() -> Self {
+        NumaPlacements {
+            pending: empty_hashmap(),
+            is_broken: false,
+            pages: Vec::with_capacity( CHUNK_SIZE ),
+            status: Vec::with_capacity( CHUNK_SIZE ),
+            entries: Vec::new()
+        }
+    }
+
+    pub fn on_allocation( &mut self, id: AllocationId, pointer: u64 ) {
+        if self.pending.len() >= MAXIMUM_PENDING {
+            return;
+        }
+
+        self.pending.insert( pointer, id );
+    }
+
+    pub fn on_reallocation( &mut self, id: AllocationId, old_pointer: u64, pointer: u64 ) {
+        self.on_free( old_pointer );
+        self.on_allocation( id, pointer );
+    }
+
+    pub fn on_free( &mut self, pointer: u64 ) {
+        self.pending.remove( &pointer );
+    }
+
+    fn query_chunk( &mut self ) -> bool {
+        self.status.clear();
+        self.status.resize( self.pages.len(), 0 );
+        if crate::syscall::query_page_nodes( &self.pages, &mut self.status ) < 0 {
+            warn!( "Failed to query the NUMA nodes of the allocations: {}", io::Error::last_os_error() );
+            self.is_broken = true;
+            return false;
+        }
+
+        for (&page, &status) in self.pages.iter().zip( self.status.iter() ) {
+            if status < 0 {
+                // Most likely the page wasn't touched yet.
+                continue;
+            }
+
+            let pointer = page as u64;
+            if let Some( id ) = self.pending.remove( &pointer ) {
+                self.entries.push( NumaPlacement { id, pointer, node: status as u32 } );
+            }
+        }
+
+        true
+    }
+
+    pub fn write_placements( &mut self, timestamp: Timestamp, fp: &mut impl Write ) -> io::Result< () > {
+        if self.is_broken || self.pending.is_empty() {
+            return Ok(());
+        }
+
+        // The kernel looks up whichever page contains the given address, so the pointers don't have to be aligned.
+        let pointers: Vec< u64 > = self.pending.keys().copied().collect();
+        for chunk in pointers.chunks( CHUNK_SIZE ) {
+            self.pages.clear();
+            self.pages.extend( chunk.iter().map( |&pointer| pointer as *mut libc::c_void ) );
+            if !self.query_chunk() {
+                return Ok(());
+            }
+        }
+
+        if self.entries.is_empty() {
+            return Ok(());
+        }
+
+        let result = Event::NumaPlacements {
+            timestamp,
+            entries: self.entries.as_slice().into()
+        }.write_to_stream( fp );
+
+        self.entries.clear();
+        result
+    }
+}
+
+#[test]
+fn test_numa_placements() {
+    use common::speedy::Readable;
+    use crate::PAGE_SIZE;
+
+    let length = 4 * PAGE_SIZE;
+    let pointer = unsafe { libc::mmap( std::ptr::null_mut(), length, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_PRIVATE | libc::MAP_ANONYMOUS, -1, 0 ) };
+    assert_ne!( pointer, libc::MAP_FAILED );
+
+    let touched = pointer as u64;
+    let untouched = pointer as u64 + 2 * PAGE_SIZE as u64;
+    let freed = pointer as u64 + 3 * PAGE_SIZE as u64;
+
+    let mut placements = NumaPlacements::new();
+    placements.on_allocation( AllocationId { thread: 1, allocation: 1 }, touched );
+    placements.on_allocation( AllocationId { thread: 1, allocation: 2 }, untouched );
+    placements.on_allocation( AllocationId { thread: 1, allocation: 3 }, freed );
+    placements.on_free( freed );
+
+    unsafe {
+        std::ptr::write_bytes( pointer as *mut u8, 1, PAGE_SIZE );
+        std::ptr::write_bytes( freed as *mut u8, 1, PAGE_SIZE );
+    }
+
+    let mut buffer = Vec::new();
+    placements.write_placements( Timestamp::from_secs( 1 ), &mut buffer ).unwrap();
+    unsafe {
+        libc::munmap( pointer, length );
+    }
+
+    if placements.is_broken {
+        // The kernel was built without NUMA support.
+        return;
+    }
+
+    match Event::read_from_buffer( &buffer ).unwrap() {
+        Event::NumaPlacements { timestamp, entries } => {
+            assert_eq!( timestamp, Timestamp::from_secs( 1 ) );
+            assert_eq!( entries.len(), 1 );
+            assert_eq!( entries[ 0 ].id, AllocationId { thread: 1, allocation: 1 } );
+            assert_eq!( entries[ 0 ].pointer, touched );
+        },
+        _ => unreachable!()
+    }
+
+    assert_eq!( placements.pending.len(), 1 );
+}
@@ -1,3 +1,8 @@
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+
+use common::event::RuntimeOption;
+
+use crate::backpressure::BackpressurePolicy;
 use crate::utils::Buffer;
 
 pub struct Opts {
@@ -9,7 +14,10 @@ pub struct Opts {
     pub enable_broadcasts: bool,
     pub enable_server: bool,
     pub enable_shadow_stack: bool,
+    pub track_stack_switches: bool,
     pub grab_backtraces_on_free: bool,
+    pub backtrace_depth_on_free: usize,
+    pub max_backtrace_depth: usize,
     pub include_file: Option< Buffer >,
     pub output_path_pattern: Buffer,
     pub register_sigusr1: bool,
@@ -20,11 +28,49 @@ pub struct Opts {
     pub gather_maps: bool,
     pub backtrace_cache_size_level_1: usize,
     pub backtrace_cache_size_level_2: usize,
+    pub backtrace_cache_memory_budget_level_2: usize,
     pub cull_temporary_allocations: bool,
     pub temporary_allocation_lifetime_threshold: u64,
     pub temporary_allocation_pending_threshold: Option< usize >,
     pub track_child_processes: bool,
+    pub multiplex_child_processes: bool,
+    pub collector: Option< Buffer >,
     pub disable_pr_set_vma_anon_name: bool,
+    pub event_ring_capacity: usize,
+    pub compact_allocation_ids: bool,
+    pub sampling_interval: usize,
+    pub use_frame_pointers: bool,
+    pub compression_threads: usize,
+    pub backpressure_policy: BackpressurePolicy,
+    pub backpressure_budget: usize,
+    pub mmap_output: bool,
+    pub use_io_uring: bool,
+    pub smaps_minimum_interval: u64,
+    pub smaps_maximum_interval: u64,
+    pub use_tsc: bool,
+    pub binary_store: Option< Buffer >,
+    pub identify_binaries_only: bool,
+    pub compact_events: bool,
+    pub summary_mode: bool,
+    pub summary_interval: u64,
+    pub enable_metrics: bool,
+    pub metrics_top_backtraces: usize,
+    pub instrumentation: bool,
+    pub checkpoint_interval: u64,
+    pub residency_sampling_interval: u64,
+    pub residency_sample_size: usize,
+    pub jemalloc_stats_interval: u64,
+    pub use_jemalloc_hooks: bool,
+    pub numa_sampling_interval: u64,
+    pub cgroup_sampling_interval: u64,
+    pub culled_statistics_interval: u64,
+    pub allocator_latency_interval: u64,
+    pub page_fault_sampling_period: u64,
+    pub flight_recorder: bool,
+    pub flight_recorder_size: usize,
+    pub flight_recorder_duration: u64,
+    pub flight_recorder_checkpoint_interval: u64,
+    pub flight_recorder_rss_threshold: u64,
 }
 
 static mut OPTS: Opts = Opts {
@@ -36,7 +82,10 @@ static mut OPTS: Opts = Opts {
     enable_broadcasts: false,
     enable_server: false,
     enable_shadow_stack: true,
+    track_stack_switches: true,
     grab_backtraces_on_free: true,
+    backtrace_depth_on_free: 0,
+    max_backtrace_depth: 0,
     include_file: None,
     output_path_pattern: Buffer::from_fixed_slice( b"memory-profiling_%e_%t_%p.dat" ),
     register_sigusr1: true,
@@ -47,11 +96,49 @@ static mut OPTS: Opts = Opts {
     gather_maps: true,
     backtrace_cache_size_level_1: 16 * 1024,
     backtrace_cache_size_level_2: 320 * 1024,
+    backtrace_cache_memory_budget_level_2: 256 * 1024 * 1024,
     cull_temporary_allocations: false,
     temporary_allocation_lifetime_threshold: 10000,
     temporary_allocation_pending_threshold: None,
     track_child_processes: false,
+    multiplex_child_processes: false,
+    collector: None,
     disable_pr_set_vma_anon_name: false,
+    event_ring_capacity: 512,
+    compact_allocation_ids: false,
+    sampling_interval: 0,
+    use_frame_pointers: false,
+    compression_threads: 2,
+    backpressure_policy: BackpressurePolicy::None,
+    backpressure_budget: 256 * 1024 * 1024,
+    mmap_output: false,
+    use_io_uring: true,
+    smaps_minimum_interval: 250,
+    smaps_maximum_interval: 10000,
+    use_tsc: false,
+    binary_store: None,
+    identify_binaries_only: false,
+    compact_events: false,
+    summary_mode: false,
+    summary_interval: 1000,
+    enable_metrics: false,
+    metrics_top_backtraces: 10,
+    instrumentation: false,
+    checkpoint_interval: 0,
+    residency_sampling_interval: 0,
+    residency_sample_size: 1000,
+    jemalloc_stats_interval: 0,
+    use_jemalloc_hooks: false,
+    numa_sampling_interval: 0,
+    cgroup_sampling_interval: 0,
+    culled_statistics_interval: 1000,
+    allocator_latency_interval: 0,
+    page_fault_sampling_period: 0,
+    flight_recorder: false,
+    flight_recorder_size: 64,
+    flight_recorder_duration: 600,
+    flight_recorder_checkpoint_interval: 30,
+    flight_recorder_rss_threshold: 0,
 };
 
 trait ParseVar: Sized {
@@ -94,6 +181,18 @@ impl ParseVar for Buffer {
     }
 }
 
+impl ParseVar for BackpressurePolicy {
+    fn parse_var( value: Buffer ) -> Option< Self > {
+        match value.as_slice() {
+            b"none" => Some( BackpressurePolicy::None ),
+            b"block" => Some( BackpressurePolicy::Block ),
+            b"sample" => Some( BackpressurePolicy::Sample ),
+            b"drop-backtraces" => Some( BackpressurePolicy::DropBacktraces ),
+            _ => None
+        }
+    }
+}
+
 impl< T > ParseVar for Option< T > where T: ParseVar {
     fn parse_var( value: Buffer ) -> Option< Self > {
         if let Some( value ) = T::parse_var( value ) {
@@ -135,13 +234,20 @@ pub unsafe fn initialize() {
         "MEMORY_PROFILER_REGISTER_SIGUSR2"          => &mut opts.register_sigusr2,
         "MEMORY_PROFILER_USE_PERF_EVENT_OPEN"       => &mut opts.use_perf_event_open,
         "MEMORY_PROFILER_USE_SHADOW_STACK"          => &mut opts.enable_shadow_stack,
+        "MEMORY_PROFILER_TRACK_STACK_SWITCHES"      => &mut opts.track_stack_switches,
         "MEMORY_PROFILER_WRITE_BINARIES_TO_OUTPUT"  => &mut opts.write_binaries_to_output,
         "MEMORY_PROFILER_ZERO_MEMORY"               => &mut opts.zero_memory,
         "MEMORY_PROFILER_GATHER_MAPS"               => &mut opts.gather_maps,
+        "MEMORY_PROFILER_BACKTRACE_DEPTH_ON_FREE"
+            => &mut opts.backtrace_depth_on_free,
+        "MEMORY_PROFILER_MAX_BACKTRACE_DEPTH"
+            => &mut opts.max_backtrace_depth,
         "MEMORY_PROFILER_BACKTRACE_CACHE_SIZE_LEVEL_1"
             => &mut opts.backtrace_cache_size_level_1,
         "MEMORY_PROFILER_BACKTRACE_CACHE_SIZE_LEVEL_2"
             => &mut opts.backtrace_cache_size_level_2,
+        "MEMORY_PROFILER_BACKTRACE_CACHE_MEMORY_BUDGET_LEVEL_2"
+            => &mut opts.backtrace_cache_memory_budget_level_2,
         "MEMORY_PROFILER_CULL_TEMPORARY_ALLOCATIONS"
             => &mut opts.cull_temporary_allocations,
         "MEMORY_PROFILER_TEMPORARY_ALLOCATION_LIFETIME_THRESHOLD"
@@ -150,13 +256,166 @@ pub unsafe fn initialize() {
             => &mut opts.temporary_allocation_pending_threshold,
         "MEMORY_PROFILER_TRACK_CHILD_PROCESSES"
             => &mut opts.track_child_processes,
+        "MEMORY_PROFILER_MULTIPLEX_CHILD_PROCESSES"
+            => &mut opts.multiplex_child_processes,
+        "MEMORY_PROFILER_COLLECTOR"
+            => &mut opts.collector,
         "MEMORY_PROFILER_DISABLE_PR_SET_VMA_ANON_NAME"
-            => &mut opts.disable_pr_set_vma_anon_name
+            => &mut opts.disable_pr_set_vma_anon_name,
+        "MEMORY_PROFILER_EVENT_RING_CAPACITY"
+            => &mut opts.event_ring_capacity,
+        "MEMORY_PROFILER_COMPACT_ALLOCATION_IDS"
+            => &mut opts.compact_allocation_ids,
+        "MEMORY_PROFILER_SAMPLING_INTERVAL"
+            => &mut opts.sampling_interval,
+        "MEMORY_PROFILER_USE_FRAME_POINTERS"
+            => &mut opts.use_frame_pointers,
+        "MEMORY_PROFILER_COMPRESSION_THREADS"
+            => &mut opts.compression_threads,
+        "MEMORY_PROFILER_BACKPRESSURE_POLICY"
+            => &mut opts.backpressure_policy,
+        "MEMORY_PROFILER_BACKPRESSURE_BUDGET"
+            => &mut opts.backpressure_budget,
+        "MEMORY_PROFILER_MMAP_OUTPUT"
+            => &mut opts.mmap_output,
+        "MEMORY_PROFILER_USE_IO_URING"
+            => &mut opts.use_io_uring,
+        "MEMORY_PROFILER_SMAPS_MINIMUM_INTERVAL"
+            => &mut opts.smaps_minimum_interval,
+        "MEMORY_PROFILER_SMAPS_MAXIMUM_INTERVAL"
+            => &mut opts.smaps_maximum_interval,
+        "MEMORY_PROFILER_USE_TSC"
+            => &mut opts.use_tsc,
+        "MEMORY_PROFILER_BINARY_STORE"
+            => &mut opts.binary_store,
+        "MEMORY_PROFILER_IDENTIFY_BINARIES_ONLY"
+            => &mut opts.identify_binaries_only,
+        "MEMORY_PROFILER_COMPACT_EVENTS"
+            => &mut opts.compact_events,
+        "MEMORY_PROFILER_SUMMARY_MODE"
+            => &mut opts.summary_mode,
+        "MEMORY_PROFILER_SUMMARY_INTERVAL"
+            => &mut opts.summary_interval,
+        "MEMORY_PROFILER_ENABLE_METRICS"
+            => &mut opts.enable_metrics,
+        "MEMORY_PROFILER_METRICS_TOP_BACKTRACES"
+            => &mut opts.metrics_top_backtraces,
+        "MEMORY_PROFILER_INSTRUMENTATION"
+            => &mut opts.instrumentation,
+        "MEMORY_PROFILER_CHECKPOINT_INTERVAL"
+            => &mut opts.checkpoint_interval,
+        "MEMORY_PROFILER_RESIDENCY_SAMPLING_INTERVAL"
+            => &mut opts.residency_sampling_interval,
+        "MEMORY_PROFILER_RESIDENCY_SAMPLE_SIZE"
+            => &mut opts.residency_sample_size,
+        "MEMORY_PROFILER_JEMALLOC_STATS_INTERVAL"
+            => &mut opts.jemalloc_stats_interval,
+        "MEMORY_PROFILER_USE_JEMALLOC_HOOKS"
+            => &mut opts.use_jemalloc_hooks,
+        "MEMORY_PROFILER_NUMA_SAMPLING_INTERVAL"
+            => &mut opts.numa_sampling_interval,
+        "MEMORY_PROFILER_CGROUP_SAMPLING_INTERVAL"
+            => &mut opts.cgroup_sampling_interval,
+        "MEMORY_PROFILER_CULLED_STATISTICS_INTERVAL"
+            => &mut opts.culled_statistics_interval,
+        "MEMORY_PROFILER_ALLOCATOR_LATENCY_INTERVAL"
+            => &mut opts.allocator_latency_interval,
+        "MEMORY_PROFILER_PAGE_FAULT_SAMPLING_PERIOD"
+            => &mut opts.page_fault_sampling_period,
+        "MEMORY_PROFILER_FLIGHT_RECORDER"
+            => &mut opts.flight_recorder,
+        "MEMORY_PROFILER_FLIGHT_RECORDER_SIZE"
+            => &mut opts.flight_recorder_size,
+        "MEMORY_PROFILER_FLIGHT_RECORDER_DURATION"
+            => &mut opts.flight_recorder_duration,
+        "MEMORY_PROFILER_FLIGHT_RECORDER_CHECKPOINT_INTERVAL"
+            => &mut opts.flight_recorder_checkpoint_interval,
+        "MEMORY_PROFILER_FLIGHT_RECORDER_RSS_THRESHOLD"
+            => &mut opts.flight_recorder_rss_threshold
+    }
+
+    if opts.flight_recorder && opts.summary_mode {
+        warn!( "The flight recorder can't be used in the summary mode; disabling it" );
+        opts.flight_recorder = false;
+    }
+
+    if opts.flight_recorder_checkpoint_interval == 0 {
+        opts.flight_recorder_checkpoint_interval = 1;
     }
 
+    SAMPLING_INTERVAL.store( opts.sampling_interval, Ordering::Relaxed );
+    GATHER_MAPS.store( opts.gather_maps, Ordering::Relaxed );
+    GRAB_BACKTRACES_ON_FREE.store( opts.grab_backtraces_on_free, Ordering::Relaxed );
+    TEMPORARY_ALLOCATION_LIFETIME_THRESHOLD.store( opts.temporary_allocation_lifetime_threshold, Ordering::Relaxed );
+    SMAPS_MINIMUM_INTERVAL.store( opts.smaps_minimum_interval, Ordering::Relaxed );
+    SMAPS_MAXIMUM_INTERVAL.store( opts.smaps_maximum_interval, Ordering::Relaxed );
+
     opts.is_initialized = true;
 }
 
+// The options which can be changed at runtime through `Request::SetOption`; the fields
+// of `Opts` with the same names only have their initial values.
+static SAMPLING_INTERVAL: AtomicUsize = AtomicUsize::new( 0 );
+static GATHER_MAPS: AtomicBool = AtomicBool::new( true );
+static GRAB_BACKTRACES_ON_FREE: AtomicBool = AtomicBool::new( true );
+static TEMPORARY_ALLOCATION_LIFETIME_THRESHOLD: AtomicU64 = AtomicU64::new( 10000 );
+static SMAPS_MINIMUM_INTERVAL: AtomicU64 = AtomicU64::new( 0 );
+static SMAPS_MAXIMUM_INTERVAL: AtomicU64 = AtomicU64::new( 0 );
+
+#[inline(always)]
+pub fn sampling_interval() -> usize {
+    SAMPLING_INTERVAL.load( Ordering::Relaxed )
+}
+
+#[inline(always)]
+pub fn gather_maps() -> bool {
+    GATHER_MAPS.load( Ordering::Relaxed )
+}
+
+#[inline(always)]
+pub fn grab_backtraces_on_free() -> bool {
+    GRAB_BACKTRACES_ON_FREE.load( Ordering::Relaxed )
+}
+
+#[inline(always)]
+pub fn temporary_allocation_lifetime_threshold() -> u64 {
+    TEMPORARY_ALLOCATION_LIFETIME_THRESHOLD.load( Ordering::Relaxed )
+}
+
+/// The minimum and the maximum interval between two smaps updates, in milliseconds.
+pub fn smaps_intervals() -> (u64, u64) {
+    (SMAPS_MINIMUM_INTERVAL.load( Ordering::Relaxed ), SMAPS_MAXIMUM_INTERVAL.load( Ordering::Relaxed ))
+}
+
+pub fn runtime_option( option: RuntimeOption ) -> u64 {
+    match option {
+        RuntimeOption::SamplingInterval => sampling_interval() as u64,
+        RuntimeOption::GatherMaps => gather_maps() as u64,
+        RuntimeOption::GrabBacktracesOnFree => grab_backtraces_on_free() as u64,
+        RuntimeOption::TemporaryAllocationLifetimeThreshold => temporary_allocation_lifetime_threshold(),
+        RuntimeOption::SmapsMinimumInterval => smaps_intervals().0,
+        RuntimeOption::SmapsMaximumInterval => smaps_intervals().1
+    }
+}
+
+/// Changes one of the options at runtime; returns `false` if the value doesn't make sense for it.
+pub fn set_runtime_option( option: RuntimeOption, value: u64 ) -> bool {
+    if option.is_flag() && value > 1 {
+        return false;
+    }
+
+    match option {
+        RuntimeOption::SamplingInterval => SAMPLING_INTERVAL.store( value as usize, Ordering::Relaxed ),
+        RuntimeOption::GatherMaps => GATHER_MAPS.store( value != 0, Ordering::Relaxed ),
+        RuntimeOption::GrabBacktracesOnFree => GRAB_BACKTRACES_ON_FREE.store( value != 0, Ordering::Relaxed ),
+        RuntimeOption::TemporaryAllocationLifetimeThreshold => TEMPORARY_ALLOCATION_LIFETIME_THRESHOLD.store( value, Ordering::Relaxed ),
+        RuntimeOption::SmapsMinimumInterval => SMAPS_MINIMUM_INTERVAL.store( value, Ordering::Relaxed ),
+        RuntimeOption::SmapsMaximumInterval => SMAPS_MAXIMUM_INTERVAL.store( value, Ordering::Relaxed )
+    }
+
+    true
+}
+
 #[inline]
 pub fn is_initialized() -> bool {
     unsafe { OPTS.is_initialized }
@@ -10,33 +10,49 @@ use {
         hash::{
             BuildHasher,
             Hash
-        },
-        marker::{
-            PhantomData
         }
     }
 };
 
+const NONE: u32 = u32::MAX;
+
 #[derive(Clone, PartialEq, Eq, Debug, Hash)]
-struct Item< K, V > {
-    prev: Option< K >,
-    next: Option< K >,
+struct Node< K, V > {
+    prev: u32,
+    next: u32,
+    key: K,
     value: V
 }
 
+#[derive(Clone, PartialEq, Eq, Debug, Hash)]
+enum Slot< K, V > {
+    Occupied( Node< K, V > ),
+    /// Points to the next free slot.
+    Vacant( u32 )
+}
+
+/// A map which remembers the order in which its keys were inserted.
+///
+/// The items are kept in a slab and are linked together through their indexes in it, so fixing up
+/// the neighbours of an item is just a few array accesses instead of a hash lookup for each of them;
+/// the hash map is only used to find the slot of a given key.
 #[derive(Clone, Debug)]
 pub struct OrderedMap< K, V, S = RandomState > where K: Copy + PartialEq + Eq + Hash {
-    first_and_last: Option< (K, K) >,
-    map: HashMap< K, Item< K, V >, S >,
-    phantom: PhantomData< S >
+    first: u32,
+    last: u32,
+    first_vacant: u32,
+    slots: Vec< Slot< K, V > >,
+    index: HashMap< K, u32, S >
 }
 
 impl< K, V, S > Default for OrderedMap< K, V, S > where K: Copy + PartialEq + Eq + Hash, S: BuildHasher + Default {
     fn default() -> Self {
         OrderedMap {
-            first_and_last: None,
-            map: Default::default(),
-            phantom: PhantomData
+            first: NONE,
+            last: NONE,
+            first_vacant: NONE,
+            slots: Vec::new(),
+            index: Default::default()
         }
     }
 }
@@ -48,86 +64,154 @@ impl< K, V > OrderedMap< K, V, RandomState > where K: Copy + PartialEq + Eq + Ha
     }
 }
 
+/// Takes the fields directly so that it can be called while the index is borrowed.
+fn allocate_slot< K, V >( slots: &mut Vec< Slot< K, V > >, first_vacant: &mut u32, node: Node< K, V > ) -> u32 {
+    if *first_vacant == NONE {
+        slots.push( Slot::Occupied( node ) );
+        return (slots.len() - 1) as u32;
+    }
+
+    let slot = *first_vacant;
+    *first_vacant = match std::mem::replace( &mut slots[ slot as usize ], Slot::Occupied( node ) ) {
+        Slot::Vacant( next_vacant ) => next_vacant,
+        Slot::Occupied( _ ) => unreachable!()
+    };
+
+    slot
+}
+
 impl< K, V, S > OrderedMap< K, V, S > where K: Copy + PartialEq + Eq + Hash, S: BuildHasher {
+    #[inline]
+    fn node( &self, slot: u32 ) -> &Node< K, V > {
+        match self.slots[ slot as usize ] {
+            Slot::Occupied( ref node ) => node,
+            Slot::Vacant( _ ) => unreachable!()
+        }
+    }
+
+    #[inline]
+    fn node_mut( &mut self, slot: u32 ) -> &mut Node< K, V > {
+        match self.slots[ slot as usize ] {
+            Slot::Occupied( ref mut node ) => node,
+            Slot::Vacant( _ ) => unreachable!()
+        }
+    }
+
+    /// Detaches the node in a given slot from the list, without freeing the slot.
+    fn unlink( &mut self, slot: u32 ) {
+        let (prev, next) = {
+            let node = self.node( slot );
+            (node.prev, node.next)
+        };
+
+        if prev == NONE {
+            self.first = next;
+        } else {
+            self.node_mut( prev ).next = next;
+        }
+
+        if next == NONE {
+            self.last = prev;
+        } else {
+            self.node_mut( next ).prev = prev;
+        }
+    }
+
+    /// Attaches the node in a given slot at the end of the list.
+    fn link_back( &mut self, slot: u32 ) {
+        let last = self.last;
+        {
+            let node = self.node_mut( slot );
+            node.prev = last;
+            node.next = NONE;
+        }
+
+        if last == NONE {
+            self.first = slot;
+        } else {
+            self.node_mut( last ).next = slot;
+        }
+
+        self.last = slot;
+    }
+
+    fn free_slot( &mut self, slot: u32 ) -> Node< K, V > {
+        match std::mem::replace( &mut self.slots[ slot as usize ], Slot::Vacant( self.first_vacant ) ) {
+            Slot::Occupied( node ) => {
+                self.first_vacant = slot;
+                node
+            },
+            Slot::Vacant( _ ) => unreachable!()
+        }
+    }
+
     #[allow(dead_code)]
     pub fn is_empty( &self ) -> bool {
-        debug_assert_eq!( self.first_and_last.is_none(), self.map.is_empty() );
-        self.map.is_empty()
+        debug_assert_eq!( self.first == NONE, self.index.is_empty() );
+        self.index.is_empty()
     }
 
     pub fn len( &self ) -> usize {
-        self.map.len()
+        self.index.len()
     }
 
     pub fn get( &self, key: &K ) -> Option< &V > {
-        self.map.get( key ).map( |item| &item.value )
+        let slot = *self.index.get( key )?;
+        Some( &self.node( slot ).value )
     }
 
     pub fn get_mut( &mut self, key: &K ) -> Option< &mut V > {
-        self.map.get_mut( key ).map( |item| &mut item.value )
+        let slot = *self.index.get( key )?;
+        Some( &mut self.node_mut( slot ).value )
     }
 
     pub fn front_key( &self ) -> Option< K > {
-        self.first_and_last.map( |(key, _)| key )
+        if self.first == NONE {
+            None
+        } else {
+            Some( self.node( self.first ).key )
+        }
     }
 
     #[allow(dead_code)]
     pub fn back_key( &self ) -> Option< K > {
-        self.first_and_last.map( |(_, key)| key )
+        if self.last == NONE {
+            None
+        } else {
+            Some( self.node( self.last ).key )
+        }
     }
 
     pub fn pop_front( &mut self ) -> Option< (K, V) > {
-        let key = self.front_key()?;
-        self.remove( &key ).map( |value| (key, value) )
+        if self.first == NONE {
+            return None;
+        }
+
+        let slot = self.first;
+        self.unlink( slot );
+        let node = self.free_slot( slot );
+        self.index.remove( &node.key );
+        Some( (node.key, node.value) )
     }
 
+    /// Inserts a new value at the end; if the key is already present it's moved to the end.
     pub fn insert( &mut self, key: K, value: V ) -> Option< V > {
-        match self.map.entry( key ) {
-            Entry::Occupied( mut bucket ) => {
-                let (first, last) = self.first_and_last.unwrap();
-
-                let bucket = bucket.get_mut();
-                let old_value = std::mem::replace( &mut bucket.value, value );
-
-                if key != last {
-                    let old_next = bucket.next.take().unwrap();
-                    let old_prev = bucket.prev.take();
-
-                    if key == first {
-                        bucket.prev = Some( last );
-                        self.first_and_last = Some( (old_next, key) );
-                    } else {
-                        let old_prev = old_prev.unwrap();
-                        bucket.prev = Some( last );
-                        self.first_and_last = Some( (first, key) );
-                        self.map.get_mut( &old_prev ).unwrap().next = Some( old_next );
-                    }
-
-                    self.map.get_mut( &old_next ).unwrap().prev = old_prev;
-                    self.map.get_mut( &last ).unwrap().next = Some( key );
+        match self.index.entry( key ) {
+            Entry::Occupied( bucket ) => {
+                let slot = *bucket.get();
+                let old_value = std::mem::replace( &mut self.node_mut( slot ).value, value );
+                if slot != self.last {
+                    self.unlink( slot );
+                    self.link_back( slot );
                 }
 
                 Some( old_value )
             },
             Entry::Vacant( bucket ) => {
-                if let Some( (first, last) ) = self.first_and_last {
-                    self.first_and_last = Some( (first, key) );
-                    bucket.insert( Item {
-                        prev: Some( last ),
-                        next: None,
-                        value
-                    });
-
-                    self.map.get_mut( &last ).unwrap().next = Some( key );
-                } else {
-                    self.first_and_last = Some( (key, key) );
-                    bucket.insert( Item {
-                        prev: None,
-                        next: None,
-                        value
-                    });
-                }
-
+                let node = Node { prev: NONE, next: NONE, key, value };
+                let slot = allocate_slot( &mut self.slots, &mut self.first_vacant, node );
+                bucket.insert( slot );
+                self.link_back( slot );
                 None
             }
         }
@@ -135,37 +219,20 @@ impl< K, V, S > OrderedMap< K, V, S > where K: Copy + PartialEq + Eq + Hash, S:
 
     #[allow(dead_code)]
     pub fn contains_key( &self, key: &K ) -> bool {
-        self.map.contains_key( key )
+        self.index.contains_key( key )
     }
 
     pub fn remove( &mut self, key: &K ) -> Option< V > {
-        let key = *key;
-        if let Some( item ) = self.map.remove( &key ) {
-            if self.map.is_empty() {
-                self.first_and_last = None;
-                return Some( item.value );
-            }
-
-            if let Some( next ) = item.next {
-                self.map.get_mut( &next ).unwrap().prev = item.prev;
-            }
-            if let Some( prev ) = item.prev {
-                self.map.get_mut( &prev ).unwrap().next = item.next;
-            }
-
-            let (mut first, mut last) = self.first_and_last.unwrap();
-            if first == key {
-                first = item.next.unwrap();
-            }
-            if last == key {
-                last = item.prev.unwrap();
-            }
-            self.first_and_last = Some( (first, last) );
-
-            Some( item.value )
-        } else {
-            None
+        let slot = self.index.remove( key )?;
+        self.unlink( slot );
+        let node = self.free_slot( slot );
+        if self.index.is_empty() {
+            // Don't hold on to the memory of the items which are long gone.
+            self.slots.clear();
+            self.first_vacant = NONE;
         }
+
+        Some( node.value )
     }
 }
 
@@ -235,9 +302,42 @@ fn test_ordered_copy_map() {
     map.remove( &10 ); // Remove middle.
     check!( map, &[5, 20] );
 
-    map.remove( &20 ); // Remove last.
+    insert!( map, 30 ); // Reuse a freed slot.
+    check!( map, &[5, 20, 30] );
+
+    map.remove( &20 ); // Remove middle.
+    check!( map, &[5, 30] );
+
+    map.remove( &30 ); // Remove last.
     check!( map, &[5] );
 
     map.remove( &5 ); // Remove first and last.
     check!( map, &[] );
 }
+
+#[test]
+fn test_ordered_map_values() {
+    let mut map = OrderedMap::new();
+    for key in 0..100 {
+        assert_eq!( map.insert( key, key * 10 ), None );
+    }
+
+    for key in (0..100).step_by( 2 ) {
+        assert_eq!( map.remove( &key ), Some( key * 10 ) );
+    }
+
+    assert_eq!( map.insert( 1, 1 ), Some( 10 ) );
+    *map.get_mut( &3 ).unwrap() += 1;
+    assert_eq!( map.get( &3 ), Some( &31 ) );
+    assert!( !map.contains_key( &4 ) );
+
+    for key in 100..150 {
+        map.insert( key, key * 10 );
+    }
+
+    assert_eq!( map.pop_front(), Some( (3, 31) ) );
+    assert_eq!( map.pop_front(), Some( (5, 50) ) );
+    assert_eq!( map.back_key(), Some( 149 ) );
+    assert_eq!( map.len(), 98 );
+    assert!( map.slots.len() <= 100 );
+}
@@ -0,0 +1,289 @@
+//! Sampling of the page faults through `perf_event_open`.
+//!
+//! A software page fault counter is opened for every thread which is running when the profiling
+//! is started, and it's inherited by every thread they create afterwards. All of them write their
+//! samples, which only consist of the thread, the time and the faulting address, into a single ring
+//! buffer which the processing thread drains. Figuring out which allocation or map the addresses
+//! belong to is left to the analyzer, since only it knows what was live at the time of every fault.
+
+use std::io::{self, Write};
+use std::os::unix::io::RawFd;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use common::event::{Event, PageFault};
+use common::speedy::Writable;
+
+use crate::opt;
+use crate::spin_lock::SpinLock;
+use crate::syscall;
+use crate::timestamp::Timestamp;
+
+const PERF_TYPE_SOFTWARE: u32 = 1;
+const PERF_COUNT_SW_PAGE_FAULTS: u64 = 2;
+
+const PERF_SAMPLE_TID: u64 = 1 << 1;
+const PERF_SAMPLE_TIME: u64 = 1 << 2;
+const PERF_SAMPLE_ADDR: u64 = 1 << 3;
+
+const ATTR_FLAG_INHERIT: u64 = 1 << 1;
+const ATTR_FLAG_EXCLUDE_KERNEL: u64 = 1 << 5;
+const ATTR_FLAG_EXCLUDE_HV: u64 = 1 << 6;
+const ATTR_FLAG_USE_CLOCKID: u64 = 1 << 25;
+
+const PERF_FLAG_FD_CLOEXEC: libc::c_ulong = 1 << 3;
+const PERF_EVENT_IOC_SET_OUTPUT: libc::c_ulong = 0x2405;
+
+const PERF_RECORD_LOST: u32 = 2;
+const PERF_RECORD_SAMPLE: u32 = 9;
+
+/// The offsets of `data_head` and `data_tail` within `perf_event_mmap_page`.
+const DATA_HEAD_OFFSET: usize = 1024;
+const DATA_TAIL_OFFSET: usize = 1032;
+
+/// How many pages the ring buffer has, not counting the control page; this has to be a power of two.
+const BUFFER_PAGES: usize = 64;
+
+/// How many samples we buffer before we write them out.
+const MAXIMUM_PENDING: usize = 64 * 1024;
+
+#[repr(C)]
+#[derive(Default)]
+struct PerfEventAttr {
+    kind: u32,
+    size: u32,
+    config: u64,
+    sample_period: u64,
+    sample_type: u64,
+    read_format: u64,
+    flags: u64,
+    wakeup_events: u32,
+    bp_type: u32,
+    config1: u64,
+    config2: u64,
+    branch_sample_type: u64,
+    sample_regs_user: u64,
+    sample_stack_user: u32,
+    clockid: i32,
+    sample_regs_intr: u64,
+    aux_watermark: u32,
+    sample_max_stack: u16,
+    reserved: u16
+}
+
+pub struct PageFaultSampler {
+    fds: Vec< RawFd >,
+    pointer: *mut u8,
+    length: usize,
+    period: u64,
+    pid: u32,
+    entries: Vec< PageFault >,
+    lost: u64
+}
+
+unsafe impl Send for PageFaultSampler {}
+
+static SAMPLER: SpinLock< Option< PageFaultSampler > > = SpinLock::new( None );
+
+fn open_for_thread( attr: &PerfEventAttr, tid: u32 ) -> RawFd {
+    syscall::perf_event_open( attr as *const PerfEventAttr as *const libc::c_void, tid as libc::pid_t, -1, -1, PERF_FLAG_FD_CLOEXEC )
+}
+
+fn running_threads() -> Vec< u32 > {
+    let mut threads: Vec< u32 > = match std::fs::read_dir( "/proc/self/task" ) {
+        Ok( entries ) => entries.filter_map( |entry| entry.ok()?.file_name().to_str()?.parse().ok() ).collect(),
+        Err( _ ) => Vec::new()
+    };
+
+    // The current thread has to go first, since everything else is redirected into its buffer.
+    let current = syscall::gettid();
+    threads.retain( |&tid| tid != current );
+    threads.insert( 0, current );
+    threads
+}
+
+fn read_u64( record: &[u8], offset: usize ) -> u64 {
+    let mut value = [0; 8];
+    value.copy_from_slice( &record[ offset..offset + 8 ] );
+    u64::from_ne_bytes( value )
+}
+
+impl PageFaultSampler {
+    fn open( period: u64 ) -> io::Result< Self > {
+        let attr = PerfEventAttr {
+            kind: PERF_TYPE_SOFTWARE,
+            size: std::mem::size_of::< PerfEventAttr >() as u32,
+            config: PERF_COUNT_SW_PAGE_FAULTS,
+            sample_period: period,
+            sample_type: PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR,
+            flags: ATTR_FLAG_INHERIT | ATTR_FLAG_EXCLUDE_KERNEL | ATTR_FLAG_EXCLUDE_HV | ATTR_FLAG_USE_CLOCKID,
+            clockid: libc::CLOCK_MONOTONIC,
+            ..PerfEventAttr::default()
+        };
+
+        let threads = running_threads();
+        let fd = open_for_thread( &attr, threads[ 0 ] );
+        if fd < 0 {
+            return Err( io::Error::last_os_error() );
+        }
+
+        let page_size = unsafe { libc::sysconf( libc::_SC_PAGESIZE ) } as usize;
+        let length = page_size * (BUFFER_PAGES + 1);
+        let pointer = unsafe { syscall::mmap( std::ptr::null_mut(), length, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, fd, 0 ) };
+        if pointer == libc::MAP_FAILED {
+            let error = io::Error::last_os_error();
+            syscall::close( fd );
+            return Err( error );
+        }
+
+        let mut sampler = PageFaultSampler {
+            fds: vec![ fd ],
+            pointer: pointer as *mut u8,
+            length,
+            period,
+            pid: syscall::getpid() as u32,
+            entries: Vec::new(),
+            lost: 0
+        };
+
+        for &tid in &threads[ 1.. ] {
+            let thread_fd = open_for_thread( &attr, tid );
+            if thread_fd < 0 {
+                // The thread has most likely exited in the meantime.
+                continue;
+            }
+
+            if syscall::ioctl( thread_fd, PERF_EVENT_IOC_SET_OUTPUT, fd as libc::c_ulong ) < 0 {
+                warn!( "Failed to sample the page faults of thread {}: {}", tid, io::Error::last_os_error() );
+                syscall::close( thread_fd );
+                continue;
+            }
+
+            sampler.fds.push( thread_fd );
+        }
+
+        Ok( sampler )
+    }
+
+    fn page_size( &self ) -> usize {
+        self.length / (BUFFER_PAGES + 1)
+    }
+
+    fn control( &self, offset: usize ) -> &AtomicU64 {
+        unsafe { &*(self.pointer.add( offset ) as *const AtomicU64) }
+    }
+
+    fn read_bytes( &self, position: u64, output: &mut [u8] ) {
+        let data_length = self.length - self.page_size();
+        let data = unsafe { self.pointer.add( self.page_size() ) };
+        for (index, byte) in output.iter_mut().enumerate() {
+            let offset = (position as usize + index) & (data_length - 1);
+            *byte = unsafe { *data.add( offset ) };
+        }
+    }
+
+    /// Moves the samples which the kernel has written so far out of the ring buffer.
+    pub fn poll( &mut self ) {
+        let head = self.control( DATA_HEAD_OFFSET ).load( Ordering::Acquire );
+        let mut tail = self.control( DATA_TAIL_OFFSET ).load( Ordering::Relaxed );
+        let processing_thread = crate::global::processing_thread_tid();
+
+        let mut record = [0_u8; 32];
+        while tail + 8 <= head {
+            self.read_bytes( tail, &mut record[ ..8 ] );
+            let kind = u32::from_ne_bytes( [record[ 0 ], record[ 1 ], record[ 2 ], record[ 3 ]] );
+            let size = u16::from_ne_bytes( [record[ 6 ], record[ 7 ]] ) as u64;
+            if size < 8 || tail + size > head {
+                break;
+            }
+
+            if kind == PERF_RECORD_SAMPLE && size >= 32 {
+                self.read_bytes( tail, &mut record );
+                let pid = read_u64( &record, 8 ) as u32;
+                let thread = (read_u64( &record, 8 ) >> 32) as u32;
+                let nsecs = read_u64( &record, 16 );
+                let address = read_u64( &record, 24 );
+
+                // The forked children inherit the counters too.
+                if pid == self.pid && thread != processing_thread {
+                    if self.entries.len() < MAXIMUM_PENDING {
+                        self.entries.push( PageFault {
+                            timestamp: Timestamp::from_timespec( nsecs / 1_000_000_000, nsecs % 1_000_000_000 ),
+                            thread,
+                            address
+                        });
+                    } else {
+                        self.lost += 1;
+                    }
+                }
+            } else if kind == PERF_RECORD_LOST && size >= 24 {
+                self.read_bytes( tail, &mut record[ ..24 ] );
+                self.lost += read_u64( &record, 16 );
+            }
+
+            tail += size;
+        }
+
+        self.control( DATA_TAIL_OFFSET ).store( tail, Ordering::Release );
+    }
+
+    pub fn write_page_faults( &mut self, timestamp: Timestamp, fp: &mut impl Write ) -> io::Result< () > {
+        self.poll();
+        if self.entries.is_empty() {
+            return Ok(());
+        }
+
+        self.entries.sort_by_key( |entry| entry.timestamp );
+        let result = Event::PageFaults {
+            timestamp,
+            period: self.period,
+            entries: self.entries.as_slice().into()
+        }.write_to_stream( fp );
+
+        self.entries.clear();
+        result
+    }
+}
+
+impl Drop for PageFaultSampler {
+    fn drop( &mut self ) {
+        if self.lost > 0 {
+            warn!( "Lost {} page fault samples", self.lost );
+        }
+
+        for &fd in &self.fds {
+            syscall::close( fd );
+        }
+
+        unsafe {
+            syscall::munmap( self.pointer as *mut libc::c_void, self.length );
+        }
+    }
+}
+
+/// Starts sampling the page faults if enabled; must be called before the processing thread is spawned.
+pub fn start() {
+    let period = opt::get().page_fault_sampling_period;
+    if period == 0 {
+        return;
+    }
+
+    let mut sampler = SAMPLER.lock();
+    if sampler.is_some() {
+        return;
+    }
+
+    match PageFaultSampler::open( period ) {
+        Ok( opened ) => {
+            info!( "Sampling every {} page faults of {} thread(s)", period, opened.fds.len() );
+            *sampler = Some( opened );
+        },
+        Err( error ) => {
+            warn!( "Failed to start sampling the page faults: {}", error );
+        }
+    }
+}
+
+/// Hands the sampler over to the processing thread; it stops sampling once that drops it.
+pub fn take() -> Option< PageFaultSampler > {
+    SAMPLER.lock().take()
+}
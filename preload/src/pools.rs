@@ -0,0 +1,159 @@
+//! Tracking of the allocations made by custom pool and arena allocators.
+//!
+//! Whatever such allocators carve out of their own memory is invisible to the profiler, so they
+//! have to report it explicitly. Those allocations overlap with the pool's own memory, which is
+//! usually tracked too, so they don't go through the allocation tracker and are matched by their
+//! pool and their address instead. Every event of a pool is staged on the thread which makes it,
+//! so an address which is reused right after its pool was reset is never seen before the reset.
+//!
+//! The external allocators, e.g. for a GPU's memory, are tracked as pools too; they're just flagged
+//! as having an address space of their own, so their memory isn't counted as the process' own.
+
+use std::sync::atomic::{AtomicU32, Ordering};
+
+use common::event::{AllocationId, PoolAllocation};
+
+use crate::event::{InternalEvent, send_event, send_event_staged};
+use crate::global::StrongThreadHandle;
+use crate::timestamp::get_timestamp;
+use crate::unwind;
+
+/// The pools are identified by 16 bits; zero is never a valid ID.
+const MAX_POOL_ID: u32 = u16::MAX as u32;
+
+static NEXT_POOL_ID: AtomicU32 = AtomicU32::new( 1 );
+
+fn acquire_thread() -> Option< StrongThreadHandle > {
+    if crate::global::is_bypassed() {
+        return None;
+    }
+
+    let thread = StrongThreadHandle::acquire()?;
+    if !crate::global::is_actively_running() {
+        return None;
+    }
+
+    Some( thread )
+}
+
+fn pool_id( pool: u32 ) -> Option< u16 > {
+    if pool == 0 || pool > MAX_POOL_ID {
+        return None;
+    }
+
+    Some( pool as u16 )
+}
+
+fn send( thread: StrongThreadHandle, event: InternalEvent ) {
+    if thread.is_dead() {
+        thread.zombie_events().lock().push( event );
+        return;
+    }
+
+    send_event_staged( &thread, move || event );
+}
+
+/// Registers a new pool with the given `POOL_FLAG_*` flags; returns zero if there are no IDs left.
+pub fn create( name: &str, flags: u32 ) -> u32 {
+    let pool = match NEXT_POOL_ID.fetch_update( Ordering::Relaxed, Ordering::Relaxed, |pool| if pool <= MAX_POOL_ID { Some( pool + 1 ) } else { None } ) {
+        Ok( pool ) => pool,
+        Err( _ ) => return 0
+    };
+
+    let thread = StrongThreadHandle::acquire();
+    send_event( InternalEvent::PoolCreated {
+        timestamp: get_timestamp(),
+        pool: pool as u16,
+        name: name.to_owned(),
+        flags
+    });
+
+    std::mem::drop( thread );
+    pool
+}
+
+/// Reports the given `(address, size)` pairs as allocated from a pool; they all share a single backtrace.
+pub fn on_allocations( pool: u32, allocations: impl Iterator< Item = (usize, usize) > ) {
+    let pool = match pool_id( pool ) {
+        Some( pool ) => pool,
+        None => return
+    };
+
+    let mut thread = match acquire_thread() {
+        Some( thread ) => thread,
+        None => return
+    };
+
+    let allocations: Vec< _ > = allocations
+        .filter( |&(address, size)| address != 0 && thread.should_sample( size ) )
+        .map( |(address, size)| PoolAllocation { pointer: address as u64, size: size as u64 } )
+        .collect();
+
+    if allocations.is_empty() {
+        return;
+    }
+
+    let timestamp = get_timestamp();
+    crate::allocation_tracker::send_tag_change( &mut thread, AllocationId::UNTRACKED, timestamp );
+
+    let backtrace = unwind::grab( &mut thread );
+    let event = InternalEvent::PoolAlloc {
+        timestamp,
+        pool,
+        tid: thread.system_tid(),
+        flags: crate::api::sampling_flags(),
+        backtrace,
+        allocations
+    };
+
+    send( thread, event );
+}
+
+/// Reports the given addresses as freed back into a pool.
+pub fn on_frees( pool: u32, addresses: impl Iterator< Item = usize > ) {
+    let pool = match pool_id( pool ) {
+        Some( pool ) => pool,
+        None => return
+    };
+
+    let thread = match acquire_thread() {
+        Some( thread ) => thread,
+        None => return
+    };
+
+    // With sampling enabled some of these were never reported; the analyzer simply ignores those.
+    let pointers: Vec< u64 > = addresses.filter( |&address| address != 0 ).map( |address| address as u64 ).collect();
+    if pointers.is_empty() {
+        return;
+    }
+
+    let event = InternalEvent::PoolFree {
+        timestamp: get_timestamp(),
+        pool,
+        tid: thread.system_tid(),
+        pointers
+    };
+
+    send( thread, event );
+}
+
+/// Reports that everything which is still alive in a pool was freed at once.
+pub fn on_reset( pool: u32 ) {
+    let pool = match pool_id( pool ) {
+        Some( pool ) => pool,
+        None => return
+    };
+
+    let thread = match acquire_thread() {
+        Some( thread ) => thread,
+        None => return
+    };
+
+    let event = InternalEvent::PoolReset {
+        timestamp: get_timestamp(),
+        pool,
+        tid: thread.system_tid()
+    };
+
+    send( thread, event );
+}
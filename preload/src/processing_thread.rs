@@ -1,3 +1,4 @@
+use std::collections::HashMap;
 use std::hash::Hash;
 use std::mem;
 use std::fs::{self, File, remove_file};
@@ -6,11 +7,14 @@ use std::net::{TcpListener, TcpStream, UdpSocket, IpAddr, SocketAddr};
 use std::time::Duration;
 use std::path::{Path, PathBuf};
 use std::sync::atomic::AtomicUsize;
+use std::sync::mpsc;
 
+use std::os::unix::fs::FileExt;
 use std::os::unix::io::AsRawFd;
 
 use std::io::{
     self,
+    Read,
     Write,
     Seek,
     SeekFrom
@@ -18,13 +22,16 @@ use std::io::{
 
 use common::speedy::{Writable, Readable};
 
-use common::event::{DataId, Event};
+use common::compact_event::Encoder;
+use common::event::{DataId, Event, RuntimeOption};
 use common::lz4_stream::Lz4Writer;
 use common::request::{
     PROTOCOL_VERSION,
     Request,
     Response,
-    BroadcastHeader
+    BroadcastHeader,
+    SessionRequest,
+    StreamKind
 };
 use common::get_local_ips;
 
@@ -32,7 +39,9 @@ use crate::{CMDLINE, EXECUTABLE, PID};
 use crate::arch;
 use crate::event::{InternalEvent, send_event, timed_recv_all_events};
 use crate::global::AllocationLock;
+use crate::instrumentation::{self, Counter, Stage, Timer};
 use crate::opt;
+use crate::syscall;
 use crate::timestamp::{Timestamp, get_timestamp, get_wall_clock};
 use crate::utils::{
     generate_filename,
@@ -42,9 +51,24 @@ use crate::utils::{
 use crate::writer_memory;
 use crate::writers;
 use crate::nohash::NoHash;
-use crate::unwind::Backtrace;
+use crate::unwind::{Backtrace, BacktraceKey};
 use crate::allocation_tracker::{AllocationBucket, BufferedAllocation};
 use crate::smaps::update_smaps;
+use crate::threaded_lz4_stream::Lz4Writer as ThreadedLz4Writer;
+use crate::mmap_file::MmapFile;
+use crate::io_uring::{AsyncWriter, new_async_writer};
+use crate::spin_lock::SpinLock;
+use crate::summary::Summary;
+use crate::checkpoint::LiveSet;
+use crate::residency::Residency;
+use crate::numa::NumaPlacements;
+use crate::culled::CulledStatistics;
+use crate::allocator_latency::MergedLatencies;
+use crate::flight_recorder::FlightRecorder;
+use crate::jemalloc_stats::JemallocStats;
+use crate::cgroup::CgroupMemory;
+use crate::heap::ScratchHeap;
+use crate::multiplex::{self, Children, RingOutput};
 
 fn get_hash< T: Hash >( value: T ) -> u64 {
     use std::collections::hash_map::DefaultHasher;
@@ -74,29 +98,268 @@ fn generate_data_id() -> DataId {
     DataId::new( a, b )
 }
 
+/// How much of a memory dump is copied into the output on each iteration of the processing loop.
+const MEMORY_DUMP_SLICE_SIZE: usize = 4 * 1024 * 1024;
+
+/// How often the profiler's own statistics are written when `MEMORY_PROFILER_INSTRUMENTATION` is set, in milliseconds.
+const PROFILER_STATISTICS_INTERVAL: u64 = 5000;
+
+/// The ID of the data which is currently being written.
+static CURRENT_DATA_ID: SpinLock< Option< DataId > > = SpinLock::new( None );
+
+/// The environment variable through which a child process learns the ID of its parent's data.
+pub const PARENT_DATA_ID_VAR: &str = "MEMORY_PROFILER_PARENT_DATA_ID";
+
+/// Called in a child after a `fork`, so that if it's going to be profiled its data can refer to ours.
+pub fn export_data_id_to_child() {
+    unsafe {
+        // In case we were forked when the lock was held.
+        CURRENT_DATA_ID.force_unlock();
+    }
+
+    match *CURRENT_DATA_ID.lock() {
+        Some( id ) => std::env::set_var( PARENT_DATA_ID_VAR, id.to_string() ),
+        None => std::env::remove_var( PARENT_DATA_ID_VAR )
+    }
+}
+
+enum OutputFile {
+    Plain( File ),
+    Mapped( MmapFile ),
+    // The writer must be dropped before the file is closed.
+    Async( AsyncWriter, File )
+}
+
+impl OutputFile {
+    fn new( fp: File ) -> Self {
+        if !opt::get().mmap_output {
+            return match new_async_writer( fp.as_raw_fd() ) {
+                Some( writer ) => OutputFile::Async( writer, fp ),
+                None => OutputFile::Plain( fp )
+            };
+        }
+
+        match MmapFile::new( fp ) {
+            Ok( fp ) => OutputFile::Mapped( fp ),
+            Err( (fp, error) ) => {
+                warn!( "Failed to memory map the output file: {}", error );
+                OutputFile::Plain( fp )
+            }
+        }
+    }
+
+    fn into_file( self ) -> io::Result< File > {
+        match self {
+            OutputFile::Plain( fp ) => Ok( fp ),
+            OutputFile::Mapped( fp ) => fp.into_file(),
+            OutputFile::Async( mut writer, fp ) => {
+                writer.flush()?;
+                mem::drop( writer );
+                Ok( fp )
+            }
+        }
+    }
+}
+
+impl io::Write for OutputFile {
+    fn write( &mut self, data: &[u8] ) -> io::Result< usize > {
+        match *self {
+            OutputFile::Plain( ref mut fp ) => fp.write( data ),
+            OutputFile::Mapped( ref mut fp ) => fp.write( data ),
+            OutputFile::Async( ref mut writer, _ ) => writer.write_all( data ).map( |_| data.len() )
+        }
+    }
+
+    fn write_all( &mut self, data: &[u8] ) -> io::Result< () > {
+        match *self {
+            OutputFile::Plain( ref mut fp ) => fp.write_all( data ),
+            OutputFile::Mapped( ref mut fp ) => fp.write_all( data ),
+            OutputFile::Async( ref mut writer, _ ) => writer.write_all( data )
+        }
+    }
+
+    fn flush( &mut self ) -> io::Result< () > {
+        match *self {
+            OutputFile::Plain( ref mut fp ) => fp.flush(),
+            OutputFile::Mapped( ref mut fp ) => fp.flush(),
+            OutputFile::Async( ref mut writer, _ ) => writer.flush()
+        }
+    }
+}
+
 struct Output {
-    file: Option< (PathBuf, File) >,
-    clients: Vec< Client >
+    file: Option< (PathBuf, OutputFile) >,
+    /// Used instead of the `file` when we stream our data through our parent process or a collector.
+    ring: Option< RingOutput >,
+    recorder: Option< FlightRecorder >,
+    clients: Vec< Client >,
+    /// The sessions of the clients which went away, along with when that happened.
+    detached: Vec< (Session, Timestamp) >,
+    next_session_id: u64
 }
 
 impl Output {
     fn new() -> Self {
         Output {
             file: None,
-            clients: Vec::new()
+            ring: None,
+            recorder: None,
+            clients: Vec::new(),
+            detached: Vec::new(),
+            next_session_id: 1
         }
     }
 
     fn set_file( &mut self, fp: File, path: PathBuf ) {
-        self.file = Some( (path, fp) );
+        self.file = Some( (path, OutputFile::new( fp )) );
     }
 
     fn is_none( &self ) -> bool {
-        self.file.is_none() && self.clients.is_empty()
+        self.file.is_none() && self.ring.is_none() && self.recorder.is_none() && self.clients.is_empty()
+    }
+
+    /// Switches the clients whose backlog was already sent over to live streaming, optionally waiting for them.
+    ///
+    /// If a backlog couldn't be sent then the output file is written to again.
+    fn finish_catch_ups( &mut self, wait: bool ) {
+        for client in self.clients.iter_mut() {
+            let result = match client.catch_up {
+                Some( ref catch_up ) if wait => catch_up.result.recv().map_err( |_| mpsc::TryRecvError::Disconnected ),
+                Some( ref catch_up ) => catch_up.result.try_recv(),
+                None => continue
+            };
+
+            let result = match result {
+                Ok( result ) => result,
+                Err( mpsc::TryRecvError::Empty ) => continue,
+                Err( mpsc::TryRecvError::Disconnected ) => Err( io::Error::new( io::ErrorKind::Other, "the streaming thread died" ) )
+            };
+
+            let catch_up = client.catch_up.take().unwrap();
+            let position = match result {
+                Ok( position ) => position,
+                Err( error ) => {
+                    info!( "Failed to stream the initial data to a client: {}", error );
+                    client.running = false;
+
+                    // The backlog isn't kept around, so a session can't be resumed from within it.
+                    client.session = None;
+                    if self.file.is_none() {
+                        let CatchUp { path, mut file, buffer, .. } = catch_up;
+                        let restored = file.seek( SeekFrom::End( 0 ) ).and_then( |_| file.write_all( &buffer ) );
+                        match restored {
+                            Ok(()) => self.file = Some( (path, OutputFile::Plain( file )) ),
+                            Err( error ) => warn!( "Write to {:?} failed: {}", path, error )
+                        }
+                    }
+
+                    continue;
+                }
+            };
+
+            if let (Some( session ), Some( position )) = (client.session.as_mut(), position) {
+                session.position = position;
+            }
+
+            info!( "Finished streaming initial data" );
+            if let Err( error ) = remove_file( &catch_up.path ) {
+                warn!( "Failed to remove {:?}: {}", catch_up.path, error );
+            }
+
+            if let Err( error ) = client.send_buffered( &catch_up ) {
+                info!( "Failed to stream to a client: {}", error );
+                client.running = false;
+            }
+        }
+    }
+
+    /// Starts streaming to a client in a session, resuming an old one if possible.
+    ///
+    /// Returns whether the client needs a fresh stream of compact events.
+    fn start_session( &mut self, index: usize, id: DataId, initial_timestamp: Timestamp, request: SessionRequest ) -> io::Result< bool > {
+        let kind = streamed_kind();
+        let client = &mut self.clients[ index ];
+        if !kind.is_at_most( request.kind ) {
+            info!( "A client requested a {:?} stream, but we're streaming {:?}", request.kind, kind );
+            Response::StreamKindUnavailable( kind ).write_to_stream( &mut client.stream )?;
+            client.stream.flush()?;
+            return Ok( false );
+        }
+
+        if let Some( resume ) = request.resume {
+            let position = self.detached.iter().position( |(session, _)| {
+                session.id == resume.session && session.replay_from( resume.offset ).is_some()
+            });
+
+            if let Some( position ) = position {
+                let (session, _) = self.detached.swap_remove( position );
+                client.resume( session, resume.offset, kind )?;
+                return Ok( false );
+            }
+
+            info!( "Session #{} can't be resumed from offset {}; starting a new one...", resume.session, resume.offset );
+        }
+
+        let session = Session::new( self.next_session_id );
+        self.next_session_id += 1;
+
+        info!( "Starting session #{}...", session.id );
+        Response::SessionStarted { session: session.id, offset: 0, kind }.write_to_stream( &mut client.stream )?;
+        client.session = Some( session );
+        client.start_streaming( id, initial_timestamp, &mut self.file )?;
+        client.streaming = true;
+        Ok( true )
+    }
+
+    /// Removes the clients which went away, keeping their sessions for a while so that they can be resumed.
+    fn remove_stopped_clients( &mut self, timestamp: Timestamp ) {
+        for client in self.clients.iter_mut() {
+            if client.running || !client.streaming || client.catch_up.is_some() {
+                continue;
+            }
+
+            if let Some( session ) = client.session.take() {
+                info!( "Session #{} was interrupted; keeping it around in case the client reconnects", session.id );
+                self.detached.push( (session, timestamp) );
+            }
+        }
+
+        // The clients which are still being sent their backlog stay until that's done
+        // since the output file's there and they might need to give it back.
+        self.clients.retain( |client| client.running || client.catch_up.is_some() );
+        self.detached.retain( |(session, detached_at)| {
+            let keep = session.replay.is_some() && (timestamp - *detached_at).as_secs() < SESSION_RESUME_TIMEOUT;
+            if !keep {
+                info!( "Session #{} can't be resumed anymore", session.id );
+            }
+
+            keep
+        });
+    }
+}
+
+/// The kind of stream which this process produces; there's only ever one for all of the clients.
+fn streamed_kind() -> StreamKind {
+    if opt::get().summary_mode {
+        StreamKind::SummaryOnly
+    } else if opt::sampling_interval() != 0 {
+        StreamKind::Sampled
+    } else {
+        StreamKind::Full
     }
 }
 
-fn poll_clients( id: DataId, initial_timestamp: Timestamp, poll_fds: &mut Vec< libc::pollfd >, output: &mut Lz4Writer< Output > ) {
+fn poll_clients(
+    id: DataId,
+    initial_timestamp: Timestamp,
+    listener_port: u16,
+    timestamp: Timestamp,
+    poll_fds: &mut Vec< libc::pollfd >,
+    output: &mut ThreadedLz4Writer< Output >,
+    encoder: &mut Encoder,
+    render_metrics: impl Fn() -> String
+) {
+    output.inner_mut_without_flush().finish_catch_ups( false );
     poll_fds.clear();
 
     for client in output.inner().clients.iter() {
@@ -121,12 +384,69 @@ fn poll_clients( id: DataId, initial_timestamp: Timestamp, poll_fds: &mut Vec< l
         let pollhup = poll_fd.revents & libc::POLLHUP != 0;
 
         let client = &mut output.inner_mut_without_flush().clients[ index ];
+        if !client.running {
+            continue;
+        }
+
         if pollhup {
             info!( "A client was disconnected" );
             client.running = false;
             continue;
         }
 
+        // The `/metrics` endpoint shares the port with our own clients, so only bother telling them apart if it is enabled.
+        if client.is_handshake_pending && client.http_request.is_none() && opt::get().enable_metrics {
+            let is_http = if pollin {
+                match client.is_http_request() {
+                    Ok( is_http ) => is_http,
+                    Err( error ) => {
+                        info!( "Failed to read from a client: {}", error );
+                        client.running = false;
+                        continue;
+                    }
+                }
+            } else {
+                None
+            };
+
+            match is_http {
+                Some( true ) => {
+                    trace!( "Reading an HTTP request..." );
+                    if let Err( error ) = client.stream.stream.set_nonblocking( true ) {
+                        info!( "Failed to read an HTTP request: {}", error );
+                        client.running = false;
+                        continue;
+                    }
+
+                    client.http_request = Some( Vec::new() );
+                },
+                None if (timestamp - client.accepted_at).as_msecs() < HTTP_DETECTION_TIME => continue,
+                _ => {}
+            }
+        }
+
+        if client.http_request.is_some() {
+            if let Some( result ) = client.serve_http( pollin, timestamp, &render_metrics ) {
+                if let Err( error ) = result {
+                    info!( "Failed to serve an HTTP request: {}", error );
+                }
+
+                client.running = false;
+            }
+
+            continue;
+        }
+
+        if client.is_handshake_pending {
+            client.is_handshake_pending = false;
+            if let Err( error ) = Response::Start( broadcast_header( id, initial_timestamp, listener_port ) ).write_to_stream( &mut client.stream ) {
+                info!( "Failed to initialize client: {}", error );
+                client.running = false;
+            }
+
+            continue;
+        }
+
         if !pollin {
             continue;
         }
@@ -143,6 +463,9 @@ fn poll_clients( id: DataId, initial_timestamp: Timestamp, poll_fds: &mut Vec< l
         trace!( "Finished reading the request from client" );
 
         match request {
+            Request::StartSession( .. ) if client.streaming => {
+                info!( "A client which is already streaming asked to start streaming again" );
+            },
             Request::StartStreaming => {
                 let output = &mut output.inner_mut().unwrap();
                 let client = &mut output.clients[ index ];
@@ -151,7 +474,48 @@ fn poll_clients( id: DataId, initial_timestamp: Timestamp, poll_fds: &mut Vec< l
                     client.running = false;
                 } else {
                     client.streaming = true;
+
+                    // The new client hasn't seen any of the previous compact events.
+                    encoder.reset();
+                }
+            },
+            Request::StartSession( request ) => {
+                let output = &mut output.inner_mut().unwrap();
+                match output.start_session( index, id, initial_timestamp, request ) {
+                    Ok( true ) => {
+                        // The new client hasn't seen any of the previous compact events.
+                        encoder.reset();
+                    },
+                    Ok( false ) => {},
+                    Err( error ) => {
+                        info!( "Failed to start a session with a client: {}", error );
+                        output.clients[ index ].running = false;
+                    }
+                }
+            },
+            Request::Acknowledge( offset ) => {
+                trace!( "Received an acknowledgement up to offset {}", offset );
+                if let Some( ref mut session ) = client.session {
+                    session.acknowledge( offset );
+                }
+            },
+            Request::SetOption { option, value } => {
+                debug!( "Received a request to set {} to {}", option.name(), value );
+                if opt::set_runtime_option( option, value ) {
+                    send_event( InternalEvent::OptionChanged { timestamp, option, value } );
+                } else {
+                    info!( "Invalid value for {}: {}", option.name(), value );
                 }
+
+                respond_with_options( client );
+            },
+            Request::GetOptions => {
+                trace!( "Received a GetOptions request" );
+                respond_with_options( client );
+            },
+            Request::DumpFlightRecorder => {
+                debug!( "Received a DumpFlightRecorder request" );
+                crate::flight_recorder::request_dump();
             },
             Request::TriggerMemoryDump => {
                 debug!( "Received a TriggerMemoryDump request" );
@@ -159,7 +523,10 @@ fn poll_clients( id: DataId, initial_timestamp: Timestamp, poll_fds: &mut Vec< l
             },
             Request::Ping => {
                 trace!( "Received a Ping request" );
-                if let Err( error ) = Response::Pong.write_to_stream( &mut client.stream ) {
+                if let Some( ref mut catch_up ) = client.catch_up {
+                    // Nothing else can be written to the socket while the backlog's being sent.
+                    catch_up.pending_pongs += 1;
+                } else if let Err( error ) = Response::Pong.write_to_stream( &mut client.stream ) {
                     info!( "Failed to respond to a client ping: {}", error );
                     client.running = false;
                 }
@@ -167,11 +534,26 @@ fn poll_clients( id: DataId, initial_timestamp: Timestamp, poll_fds: &mut Vec< l
         }
     }
 
-    output.inner_mut_without_flush().clients.retain( |client| client.running );
+    output.inner_mut_without_flush().remove_stopped_clients( timestamp );
+}
+
+fn respond_with_options( client: &mut Client ) {
+    if client.catch_up.is_some() {
+        // Nothing else can be written to the socket while the backlog's being sent;
+        // the client can always ask again with `Request::GetOptions`.
+        return;
+    }
+
+    let options = RuntimeOption::ALL.iter().map( |&option| (option, opt::runtime_option( option )) ).collect();
+    if let Err( error ) = Response::Options( options ).write_to_stream( &mut client.stream ) {
+        info!( "Failed to send the options to a client: {}", error );
+        client.running = false;
+    }
 }
 
 impl io::Write for Output {
     fn write( &mut self, data: &[u8] ) -> io::Result< usize > {
+        crate::instrumentation::on_bytes_written( data.len() );
         if let Some( (ref path, ref mut fp) ) = self.file {
             if let Err( error ) = fp.write_all( data ) {
                 warn!( "Write to {:?} failed: {}", path, error );
@@ -179,8 +561,34 @@ impl io::Write for Output {
             }
         }
 
+        if let Some( ref mut ring ) = self.ring {
+            if let Err( error ) = ring.write_all( data ) {
+                warn!( "Write to the ring failed: {}", error );
+                self.ring = None;
+            }
+        }
+
+        if let Some( ref mut recorder ) = self.recorder {
+            recorder.append( data );
+        }
+
         for mut client in self.clients.iter_mut() {
-            if !client.running || !client.streaming {
+            if !client.streaming {
+                continue;
+            }
+
+            // This is needed even if the client went away since the output file might have to be restored.
+            if let Some( ref mut catch_up ) = client.catch_up {
+                catch_up.buffer.extend_from_slice( data );
+                continue;
+            }
+
+            if !client.running {
+                // The client might reconnect, so its session has to be kept up to date.
+                if let Some( ref mut session ) = client.session {
+                    session.record( data );
+                }
+
                 continue;
             }
 
@@ -191,6 +599,10 @@ impl io::Write for Output {
             }
         }
 
+        for (session, _) in self.detached.iter_mut() {
+            session.record( data );
+        }
+
         Ok( data.len() )
     }
 
@@ -202,16 +614,33 @@ impl io::Write for Output {
             }
         }
 
+        // The writes to the clients are asynchronous, and everything must be
+        // written out before the memory dumper forks.
+        for client in self.clients.iter_mut() {
+            if !client.running || !client.streaming || client.catch_up.is_some() {
+                continue;
+            }
+
+            if let Err( error ) = client.stream.flush() {
+                client.running = false;
+                warn!( "Flush of a client failed: {}", error );
+            }
+        }
+
         Ok(())
     }
 }
 
 impl< 'a > io::Write for &'a mut Client {
     fn write( &mut self, data: &[u8] ) -> io::Result< usize > {
-        let length = data.len();
-        let response = Response::Data( data.into() );
-        let count = response.write_to_stream( &mut self.stream ).map( |_| length )?;
-        Ok( count )
+        let header = match self.session {
+            Some( ref mut session ) => session.next_chunk( data ),
+            None => Response::data_header( data.len() )
+        };
+
+        self.stream.write_all( &header )?;
+        self.stream.write_all( data )?;
+        Ok( data.len() )
     }
 
     fn flush( &mut self ) -> io::Result< () > {
@@ -219,22 +648,308 @@ impl< 'a > io::Write for &'a mut Client {
     }
 }
 
+/// Where the next chunk of a session is going to be.
+#[derive(Copy, Clone, Default)]
+struct ChunkPosition {
+    sequence: u64,
+    offset: u64
+}
+
+impl ChunkPosition {
+    fn next_header( &mut self, length: usize ) -> Vec< u8 > {
+        let header = Response::chunk_header( self.sequence, self.offset, length );
+        self.sequence += 1;
+        self.offset += length as u64;
+        header
+    }
+}
+
+/// Returns the header of a response with a given amount of data, which is a `Response::Chunk` during a session.
+fn response_header( position: &mut Option< ChunkPosition >, length: usize ) -> Vec< u8 > {
+    match *position {
+        Some( ref mut position ) => position.next_header( length ),
+        None => Response::data_header( length )
+    }
+}
+
+/// Wraps everything which is written into `Response::Data`s or `Response::Chunk`s.
+struct DataResponses< W > {
+    stream: W,
+    position: Option< ChunkPosition >
+}
+
+impl< W > io::Write for DataResponses< W > where W: Write {
+    fn write( &mut self, data: &[u8] ) -> io::Result< usize > {
+        self.stream.write_all( &response_header( &mut self.position, data.len() ) )?;
+        self.stream.write_all( data )?;
+        Ok( data.len() )
+    }
+
+    fn flush( &mut self ) -> io::Result< () > {
+        self.stream.flush()
+    }
+}
+
+/// How many of the most recently streamed bytes of a session are kept until the client acknowledges them.
+const SESSION_REPLAY_BUFFER_SIZE: usize = 64 * 1024 * 1024;
+
+/// For how long a session can be resumed after its client went away, in seconds.
+const SESSION_RESUME_TIMEOUT: u64 = 300;
+
+/// A stream which can be resumed from where it was interrupted if the client reconnects.
+struct Session {
+    id: u64,
+    position: ChunkPosition,
+    /// Everything which was streamed since the last acknowledgement; `None` if that got too big.
+    replay: Option< Vec< u8 > >
+}
+
+impl Session {
+    fn new( id: u64 ) -> Self {
+        Session {
+            id,
+            position: ChunkPosition::default(),
+            replay: Some( Vec::new() )
+        }
+    }
+
+    /// Returns the header of the next chunk, remembering its data.
+    fn next_chunk( &mut self, data: &[u8] ) -> Vec< u8 > {
+        let header = Response::chunk_header( self.position.sequence, self.position.offset, data.len() );
+        self.position.sequence += 1;
+        self.record( data );
+        header
+    }
+
+    /// Remembers a part of the stream which is going to be sent later.
+    fn record( &mut self, data: &[u8] ) {
+        self.position.offset += data.len() as u64;
+        if let Some( ref mut replay ) = self.replay {
+            if replay.len() + data.len() <= SESSION_REPLAY_BUFFER_SIZE {
+                replay.extend_from_slice( data );
+                return;
+            }
+        } else {
+            return;
+        }
+
+        info!( "Too much of session #{} wasn't acknowledged; it won't be resumable", self.id );
+        self.replay = None;
+    }
+
+    fn replay_offset( replay: &[u8], position: ChunkPosition ) -> u64 {
+        position.offset - replay.len() as u64
+    }
+
+    fn acknowledge( &mut self, offset: u64 ) {
+        if let Some( ref mut replay ) = self.replay {
+            let start = Session::replay_offset( replay, self.position );
+            if offset > start {
+                let count = std::cmp::min( offset - start, replay.len() as u64 ) as usize;
+                replay.drain( ..count );
+            }
+        }
+    }
+
+    /// Returns what has to be sent again to resume the session from a given offset.
+    fn replay_from( &self, offset: u64 ) -> Option< &[u8] > {
+        let replay = self.replay.as_ref()?;
+        let start = Session::replay_offset( replay, self.position );
+        if offset < start || offset > self.position.offset {
+            return None;
+        }
+
+        Some( &replay[ (offset - start) as usize.. ] )
+    }
+}
+
+/// How much of the backlog is sent in a single `Response::Data`.
+const BACKLOG_CHUNK_SIZE: u64 = 1024 * 1024;
+
+/// Sends a part of a file straight into a socket, without copying it through userspace if possible.
+fn send_file_range( stream: &mut TcpStream, file: &File, offset: u64, length: usize ) -> io::Result< () > {
+    let mut offset = offset as libc::off_t;
+    let mut remaining = length;
+    while remaining > 0 {
+        let result = syscall::sendfile( stream.as_raw_fd(), file.as_raw_fd(), &mut offset, remaining );
+        if result < 0 {
+            let error = io::Error::last_os_error();
+            match error.raw_os_error() {
+                Some( libc::EINTR ) => continue,
+                Some( libc::EINVAL ) | Some( libc::ENOSYS ) => {
+                    // Not every file supports this, so just fall back to a normal copy.
+                    let mut buffer = vec![ 0; remaining ];
+                    file.read_exact_at( &mut buffer, offset as u64 )?;
+                    return stream.write_all( &buffer );
+                },
+                _ => return Err( error )
+            }
+        }
+
+        if result == 0 {
+            return Err( io::Error::new( io::ErrorKind::UnexpectedEof, "the output file is shorter than expected" ) );
+        }
+
+        remaining -= result as usize;
+    }
+
+    Ok(())
+}
+
+/// Sends everything which was written to the output file before a client connected; this runs on its own thread.
+///
+/// Returns where the session's stream ends up, if there's one.
+fn send_backlog( id: DataId, initial_timestamp: Timestamp, mut stream: TcpStream, file: File, mut position: Option< ChunkPosition > ) -> io::Result< Option< ChunkPosition > > {
+    if !opt::get().write_binaries_to_output {
+        info!( "Streaming the binaries which were suppressed in the original output file..." );
+        let mut serializer = Lz4Writer::new( DataResponses { stream: &mut stream, position } );
+        writers::write_header( id, initial_timestamp, &mut serializer )?;
+        writers::write_binaries( &mut serializer )?;
+        serializer.flush()?;
+        position = serializer.into_inner()?.position;
+    }
+
+    info!( "Streaming initial data..." );
+    let length = file.metadata()?.len();
+    let mut offset = 0;
+    while offset < length {
+        let chunk_length = std::cmp::min( length - offset, BACKLOG_CHUNK_SIZE ) as usize;
+        stream.write_all( &response_header( &mut position, chunk_length ) )?;
+        send_file_range( &mut stream, &file, offset, chunk_length )?;
+        offset += chunk_length as u64;
+    }
+
+    Response::FinishedInitialStreaming.write_to_stream( &mut stream )?;
+    Ok( position )
+}
+
+/// The backlog of the output file which is being sent to a client from another thread.
+///
+/// Copying a big output file can take a while, and if the processing thread did it by itself
+/// then nothing would be processed in the meantime and the application would get throttled.
+struct CatchUp {
+    path: PathBuf,
+    file: File,
+    result: mpsc::Receiver< io::Result< Option< ChunkPosition > > >,
+    /// Everything which was written out while the backlog was being sent.
+    buffer: Vec< u8 >,
+    pending_pongs: usize
+}
+
+/// A client's socket; if possible the responses are written through io_uring.
+struct ClientStream {
+    // The writer must be dropped before the socket is closed.
+    writer: Option< AsyncWriter >,
+    stream: TcpStream
+}
+
+impl ClientStream {
+    fn new( stream: TcpStream ) -> Self {
+        ClientStream {
+            writer: new_async_writer( stream.as_raw_fd() ),
+            stream
+        }
+    }
+
+    fn as_raw_fd( &self ) -> libc::c_int {
+        self.stream.as_raw_fd()
+    }
+}
+
+impl io::Read for ClientStream {
+    fn read( &mut self, buffer: &mut [u8] ) -> io::Result< usize > {
+        self.stream.read( buffer )
+    }
+}
+
+impl io::Write for ClientStream {
+    fn write( &mut self, data: &[u8] ) -> io::Result< usize > {
+        match self.writer {
+            Some( ref mut writer ) => writer.write_all( data ).map( |_| data.len() ),
+            None => self.stream.write( data )
+        }
+    }
+
+    fn flush( &mut self ) -> io::Result< () > {
+        match self.writer {
+            Some( ref mut writer ) => writer.flush(),
+            None => self.stream.flush()
+        }
+    }
+}
+
+/// For how long we wait for a new client to send an HTTP request before we assume that it's one of ours.
+///
+/// Our own clients never send anything until they get the `Response::Start`; this is only
+/// done when `MEMORY_PROFILER_ENABLE_METRICS` is set, otherwise they get it right away.
+const HTTP_DETECTION_TIME: u64 = 100;
+
+/// For how long, since the connection was accepted, we wait for the rest of an HTTP request.
+const HTTP_REQUEST_TIMEOUT: u64 = 1000;
+
 struct Client {
-    stream: TcpStream,
+    stream: ClientStream,
     running: bool,
-    streaming: bool
+    streaming: bool,
+    is_handshake_pending: bool,
+    accepted_at: Timestamp,
+    /// The HTTP request read so far, if this client turned out to be an HTTP client.
+    http_request: Option< Vec< u8 > >,
+    catch_up: Option< CatchUp >,
+    session: Option< Session >
 }
 
 impl Client {
-    fn new( id: DataId, initial_timestamp: Timestamp, listener_port: u16, stream: TcpStream ) -> io::Result< Self > {
-        let mut client = Client {
-            stream,
+    fn new( stream: TcpStream, accepted_at: Timestamp ) -> Self {
+        Client {
+            stream: ClientStream::new( stream ),
             running: true,
-            streaming: false
+            streaming: false,
+            is_handshake_pending: true,
+            accepted_at,
+            http_request: None,
+            catch_up: None,
+            session: None
+        }
+    }
+
+    fn is_http_request( &self ) -> io::Result< Option< bool > > {
+        let mut prefix = [0; 4];
+        let count = self.stream.stream.peek( &mut prefix )?;
+        if count == 0 {
+            return Err( io::Error::new( io::ErrorKind::UnexpectedEof, "the connection was closed" ) );
+        }
+
+        Ok( crate::metrics::is_http_request( &prefix[ ..count ] ) )
+    }
+
+    /// Reads whatever's available of the HTTP request without blocking, and responds once it's complete.
+    ///
+    /// Returns `None` if we're still waiting for the rest of the request.
+    fn serve_http( &mut self, pollin: bool, timestamp: Timestamp, render_metrics: impl FnOnce() -> String ) -> Option< io::Result< () > > {
+        let mut request = self.http_request.take().unwrap_or_default();
+        let result = if pollin {
+            crate::metrics::read_request( &mut self.stream.stream, &mut request )
+        } else {
+            Ok( false )
         };
 
-        Response::Start( broadcast_header( id, initial_timestamp, listener_port ) ).write_to_stream( &mut client.stream )?;
-        Ok( client )
+        match result {
+            Ok( true ) => {},
+            Ok( false ) if (timestamp - self.accepted_at).as_msecs() < HTTP_REQUEST_TIMEOUT => {
+                self.http_request = Some( request );
+                return None;
+            },
+            Ok( false ) => return Some( Err( io::Error::new( io::ErrorKind::TimedOut, "timed out while waiting for the HTTP request" ) ) ),
+            Err( error ) => return Some( Err( error ) )
+        }
+
+        // The response is small enough to be written in one go; the timeout is only there in case the client stalls.
+        let result = self.stream.stream.set_nonblocking( false )
+            .and_then( |_| self.stream.stream.set_write_timeout( Some( Duration::from_millis( 100 ) ) ) )
+            .and_then( |_| crate::metrics::respond( &mut self.stream, &request, render_metrics ) );
+
+        Some( result )
     }
 
     fn stream_initial_data( &mut self, id: DataId, initial_timestamp: Timestamp, path: &Path, file: &mut File ) -> io::Result< () > {
@@ -260,16 +975,84 @@ impl Client {
         Ok(())
     }
 
-    fn start_streaming( &mut self, id: DataId, initial_timestamp: Timestamp, output: &mut Option< (PathBuf, File) > ) -> io::Result< () > {
+    /// Starts sending the backlog from another thread; gives the file back if that's not possible.
+    fn start_catch_up( &mut self, id: DataId, initial_timestamp: Timestamp, path: PathBuf, file: File ) -> Result< (), (PathBuf, File) > {
+        let streams = self.stream.flush().and_then( |_| Ok( (self.stream.stream.try_clone()?, file.try_clone()?) ) );
+        let (stream, thread_file) = match streams {
+            Ok( streams ) => streams,
+            Err( error ) => {
+                warn!( "Failed to prepare for streaming the initial data from another thread: {}", error );
+                return Err( (path, file) );
+            }
+        };
+
+        let position = self.session.as_ref().map( |session| session.position );
+        let (result_tx, result_rx) = mpsc::channel();
+        let is_ok = crate::global::spawn_internal_thread( b"mem-prof-stream\0", move || {
+            let _ = result_tx.send( send_backlog( id, initial_timestamp, stream, thread_file, position ) );
+        });
+
+        if !is_ok {
+            return Err( (path, file) );
+        }
+
+        self.catch_up = Some( CatchUp {
+            path,
+            file,
+            result: result_rx,
+            buffer: Vec::new(),
+            pending_pongs: 0
+        });
+
+        Ok(())
+    }
+
+    /// Sends out whatever was buffered while the backlog was being sent.
+    fn send_buffered( &mut self, catch_up: &CatchUp ) -> io::Result< () > {
+        for chunk in catch_up.buffer.chunks( BACKLOG_CHUNK_SIZE as usize ) {
+            (&mut *self).write_all( chunk )?;
+        }
+
+        for _ in 0..catch_up.pending_pongs {
+            Response::Pong.write_to_stream( &mut self.stream )?;
+        }
+
+        self.stream.flush()
+    }
+
+    /// Picks up an interrupted session where the client says it was left off.
+    fn resume( &mut self, mut session: Session, offset: u64, kind: StreamKind ) -> io::Result< () > {
+        info!( "Resuming session #{} from offset {}...", session.id, offset );
+        Response::SessionStarted { session: session.id, offset, kind }.write_to_stream( &mut self.stream )?;
+
+        let mut position = ChunkPosition { sequence: session.position.sequence, offset };
+        for chunk in session.replay_from( offset ).unwrap().chunks( BACKLOG_CHUNK_SIZE as usize ) {
+            self.stream.write_all( &position.next_header( chunk.len() ) )?;
+            self.stream.write_all( chunk )?;
+        }
+
+        session.position.sequence = position.sequence;
+        self.session = Some( session );
+        self.streaming = true;
+        self.stream.flush()
+    }
+
+    fn start_streaming( &mut self, id: DataId, initial_timestamp: Timestamp, output: &mut Option< (PathBuf, OutputFile) > ) -> io::Result< () > {
         // First client which connects to us gets streamed all of the data
         // which we've gathered up until this point.
 
-        if let Some( (path, mut fp) ) = output.take() {
+        if let Some( (path, fp) ) = output.take() {
+            let fp = fp.into_file()?;
+            let (path, mut fp) = match self.start_catch_up( id, initial_timestamp, path, fp ) {
+                Ok(()) => return Ok(()),
+                Err( returned ) => returned
+            };
+
             match self.stream_initial_data( id, initial_timestamp, &path, &mut fp ) {
                 Ok(()) => return Ok(()),
                 Err( error ) => {
                     fp.seek( SeekFrom::End( 0 ) )?;
-                    *output = Some( (path, fp) );
+                    *output = Some( (path, OutputFile::Plain( fp )) );
                     return Err( error );
                 }
             }
@@ -292,7 +1075,10 @@ impl Client {
 
 impl Drop for Client {
     fn drop( &mut self ) {
-        info!( "Removing client..." );
+        // Don't spam the logs every time the metrics are scraped.
+        if !self.is_handshake_pending {
+            info!( "Removing client..." );
+        }
     }
 }
 
@@ -415,118 +1201,391 @@ fn initialize_output_file() -> Option< (File, PathBuf) > {
     Some( (fp, output_path.into()) )
 }
 
+/// How many lookups the miss rate of the `BacktraceCache` is measured over before it's resized.
+const BACKTRACE_CACHE_ADAPTATION_WINDOW: u32 = 64 * 1024;
+
+/// The cache grows if at least this fraction of the lookups, in percent, miss while it's full.
+const BACKTRACE_CACHE_GROWTH_MISS_RATE: u32 = 5;
+
+/// A rough estimate of how much memory the cache itself needs for every entry, besides the frames.
+const BACKTRACE_CACHE_ENTRY_OVERHEAD: usize = 64;
+
+fn backtrace_cache_entry_size( backtrace: &Backtrace ) -> usize {
+    BACKTRACE_CACHE_ENTRY_OVERHEAD + backtrace.frames().len() * mem::size_of::< usize >()
+}
+
+/// Assigns the IDs to the backtraces, so that every one of them only has to be emitted once.
+///
+/// Every backtrace which gets evicted and then seen again is emitted again, so when a full cache
+/// keeps on missing it grows, for as long as the backtraces in it fit into the memory budget.
 pub struct BacktraceCache {
     next_id: u64,
-    cache: lru::LruCache< u64, Backtrace, NoHash >
+    cache: lru::LruCache< BacktraceKey, Backtrace, NoHash >,
+    emitted_interned: Vec< u64 >,
+    memory_budget: usize,
+    cached_bytes: usize,
+    window_lookups: u32,
+    window_misses: u32
 }
 
 impl BacktraceCache {
-    pub fn new( cache_size: usize ) -> Self {
+    /// A zero `memory_budget` keeps the cache at its initial size.
+    pub fn new( cache_size: usize, memory_budget: usize ) -> Self {
         BacktraceCache {
             next_id: 1,
-            cache: lru::LruCache::with_hasher( cache_size, NoHash )
+            cache: lru::LruCache::with_hasher( cache_size, NoHash ),
+            emitted_interned: Vec::new(),
+            memory_budget,
+            cached_bytes: 0,
+            window_lookups: 0,
+            window_misses: 0
+        }
+    }
+
+    pub fn capacity( &self ) -> usize {
+        self.cache.cap()
+    }
+
+    fn evict_least_recently_used( &mut self ) {
+        if let Some( (_, backtrace) ) = self.cache.pop_lru() {
+            self.cached_bytes -= backtrace_cache_entry_size( &backtrace );
+        }
+    }
+
+    fn insert( &mut self, key: BacktraceKey, backtrace: Backtrace ) {
+        if self.cache.len() >= self.cache.cap() {
+            if cfg!( debug_assertions ) {
+                debug!( "2nd level backtrace cache overflow" );
+            }
+
+            self.evict_least_recently_used();
+        }
+
+        self.cached_bytes += backtrace_cache_entry_size( &backtrace );
+        self.cache.put( key, backtrace );
+
+        if self.memory_budget != 0 && self.cached_bytes > self.memory_budget {
+            while self.cached_bytes > self.memory_budget / 4 * 3 && self.cache.len() > 1 {
+                self.evict_least_recently_used();
+            }
+
+            info!( "2nd level backtrace cache is over its memory budget; shrinking it to {} entries", self.cache.len() );
+            self.cache.resize( self.cache.len() );
+        }
+    }
+
+    fn on_lookup( &mut self, is_miss: bool ) {
+        self.window_lookups += 1;
+        self.window_misses += is_miss as u32;
+        if self.window_lookups < BACKTRACE_CACHE_ADAPTATION_WINDOW {
+            return;
+        }
+
+        let is_missing_too_often = self.window_misses * 100 >= self.window_lookups * BACKTRACE_CACHE_GROWTH_MISS_RATE;
+        self.window_lookups = 0;
+        self.window_misses = 0;
+
+        let length = self.cache.len();
+        if self.memory_budget == 0 || !is_missing_too_often || length < self.cache.cap() {
+            return;
+        }
+
+        // Grow as much as what's already cached suggests will still fit, but at most twice.
+        let average_entry_size = std::cmp::max( self.cached_bytes / length, 1 );
+        let capacity = std::cmp::min( length * 2, self.memory_budget / average_entry_size );
+        if capacity > length {
+            info!( "2nd level backtrace cache keeps on missing; growing it to {} entries", capacity );
+            self.cache.resize( capacity );
         }
     }
 
+    /// Marks a backtrace from the global `BacktraceTable` as emitted; returns `true` if it wasn't already.
+    pub(crate) fn mark_interned_as_emitted( &mut self, id: u64 ) -> bool {
+        let index = crate::backtrace_table::index_of( id ).expect( "internal error: not an interned backtrace" );
+        let (word, bit) = (index / 64, index % 64);
+        if word >= self.emitted_interned.len() {
+            self.emitted_interned.resize( word + 1, 0 );
+        }
+
+        let mask = 1 << bit;
+        let is_new = self.emitted_interned[ word ] & mask == 0;
+        self.emitted_interned[ word ] |= mask;
+        is_new
+    }
+
     pub(crate) fn assign_id( &mut self, backtrace: &Backtrace ) -> (u64, bool) {
         let key = backtrace.key();
         if let Some( id ) = backtrace.id() {
+            instrumentation::count( Counter::BacktraceCacheLevel2Hit );
+            self.on_lookup( false );
             self.cache.get( &key );
             return (id, false);
         }
 
-        match self.cache.get_mut( &key ) {
+        let result = match self.cache.get( &key ) {
             None => {
-                if cfg!( debug_assertions ) {
-                    if self.cache.len() >= self.cache.cap() {
-                        debug!( "2nd level backtrace cache overflow" );
-                    }
-                }
+                instrumentation::count( Counter::BacktraceCacheLevel2Miss );
 
                 let id = self.next_id;
                 self.next_id += 1;
                 backtrace.set_id( id );
 
-                self.cache.put( key, backtrace.clone() );
+                self.insert( key, backtrace.clone() );
                 (id, true)
             },
             Some( cached_backtrace ) => {
-                if Backtrace::ptr_eq( &cached_backtrace, &backtrace ) || cached_backtrace.frames() == backtrace.frames() {
-                    (cached_backtrace.id().expect( "internal error: id was not set on a cached backtrace" ), false)
-                } else {
-                    info!( "2nd level backtrace cache conflict detected!" );
+                instrumentation::count( Counter::BacktraceCacheLevel2Hit );
+                if cfg!( debug_assertions ) && !Backtrace::ptr_eq( &cached_backtrace, &backtrace ) && cached_backtrace.frames() != backtrace.frames() {
+                    instrumentation::count( Counter::BacktraceCacheLevel2Conflict );
+                    error!( "2nd level backtrace cache conflict detected!" );
+                }
+
+                (cached_backtrace.id().expect( "internal error: id was not set on a cached backtrace" ), false)
+            }
+        };
+
+        self.on_lookup( result.1 );
+        result
+    }
+}
+
+fn emit_allocation_bucket(
+    mut bucket: AllocationBucket,
+    backtrace_cache: &mut BacktraceCache,
+    encoder: &mut Encoder,
+    mut summary: Option< &mut Summary >,
+    mut live_set: Option< &mut LiveSet >,
+    mut residency: Option< &mut Residency >,
+    mut numa: Option< &mut NumaPlacements >,
+    fp: &mut impl Write
+) -> Result< (), std::io::Error > {
+    if bucket.events.len() == 0 {
+        return Ok(());
+    }
+
+    let mut iter = bucket.events.drain( .. );
+
+    let BufferedAllocation { timestamp, allocation, backtrace } = iter.next().unwrap();
+    let mut old_pointer = allocation.address;
+    let backtrace = writers::write_backtrace( &mut *fp, backtrace, backtrace_cache )?;
+    if let Some( ref mut summary ) = summary {
+        summary.on_allocation( allocation.address.get(), allocation.size as u64, backtrace );
+    }
+
+    if let Some( ref mut residency ) = residency {
+        residency.on_allocation( allocation.address.get() as u64, allocation.size as u64, backtrace );
+    }
+
+    if let Some( ref mut numa ) = numa {
+        numa.on_allocation( bucket.id, allocation.address.get() as u64 );
+    }
+
+    let body = common::event::AllocBody {
+        pointer: allocation.address.get() as u64,
+        size: allocation.size as u64,
+        backtrace,
+        thread: allocation.tid,
+        flags: allocation.flags,
+        extra_usable_space: 0,
+        preceding_free_space: 0
+    };
+
+    if let Some( ref mut live_set ) = live_set {
+        live_set.on_allocation( bucket.id, timestamp, body.clone() );
+    }
+
+    encoder.write_alloc( &mut *fp, bucket.id, timestamp, body )?;
+
+    while let Some( BufferedAllocation { timestamp, allocation, backtrace } ) = iter.next() {
+        let backtrace = writers::write_backtrace( &mut *fp, backtrace, backtrace_cache )?;
+        if let Some( ref mut summary ) = summary {
+            summary.on_reallocation( old_pointer.get(), allocation.address.get(), allocation.size as u64, backtrace );
+        }
+
+        if let Some( ref mut residency ) = residency {
+            residency.on_reallocation( old_pointer.get() as u64, allocation.address.get() as u64, allocation.size as u64, backtrace );
+        }
+
+        if let Some( ref mut numa ) = numa {
+            numa.on_reallocation( bucket.id, old_pointer.get() as u64, allocation.address.get() as u64 );
+        }
+
+        let body = common::event::AllocBody {
+            pointer: allocation.address.get() as u64,
+            size: allocation.size as u64,
+            backtrace,
+            thread: allocation.tid,
+            flags: allocation.flags,
+            extra_usable_space: 0,
+            preceding_free_space: 0
+        };
+
+        if let Some( ref mut live_set ) = live_set {
+            live_set.on_reallocation( bucket.id, timestamp, old_pointer.get() as u64, body.clone() );
+        }
+
+        encoder.write_realloc( &mut *fp, bucket.id, timestamp, old_pointer.get() as u64, body )?;
+        old_pointer = allocation.address;
+    }
+
+    Ok(())
+}
+
+fn summarize_allocation_bucket(
+    mut bucket: AllocationBucket,
+    backtrace_cache: &mut BacktraceCache,
+    summary: &mut Summary,
+    mut residency: Option< &mut Residency >,
+    fp: &mut impl Write
+) -> Result< (), std::io::Error > {
+    let mut old_pointer = None;
+    for BufferedAllocation { allocation, backtrace, .. } in bucket.events.drain( .. ) {
+        let backtrace = writers::write_backtrace( &mut *fp, backtrace, backtrace_cache )?;
+        match old_pointer {
+            None => summary.on_allocation( allocation.address.get(), allocation.size as u64, backtrace ),
+            Some( old_pointer ) => summary.on_reallocation( old_pointer, allocation.address.get(), allocation.size as u64, backtrace )
+        }
+
+        if let Some( ref mut residency ) = residency {
+            match old_pointer {
+                None => residency.on_allocation( allocation.address.get() as u64, allocation.size as u64, backtrace ),
+                Some( old_pointer ) => residency.on_reallocation( old_pointer as u64, allocation.address.get() as u64, allocation.size as u64, backtrace )
+            }
+        }
+
+        old_pointer = Some( allocation.address.get() );
+    }
+
+    Ok(())
+}
 
-                    let id = self.next_id;
-                    self.next_id += 1;
-                    backtrace.set_id( id );
+/// Starts a new segment of the flight recorder; it must be followed by a checkpoint.
+fn start_flight_recorder_segment( timestamp: Timestamp, serializer: &mut ThreadedLz4Writer< Output >, encoder: &mut Encoder ) -> io::Result< () > {
+    if let Some( ref mut recorder ) = serializer.inner_mut()?.recorder {
+        recorder.start_segment( timestamp );
+    }
+
+    // Nothing from the previous segments can be relied on.
+    encoder.reset();
+    Event::SamplingInterval { interval: opt::sampling_interval() as u64 }.write_to_stream( serializer )
+}
 
-                    *cached_backtrace = backtrace.clone();
+/// Writes out whatever the `writers::write_deferred_initial_data_in_background` has sent so far;
+/// returns `false` once it's finished.
+fn write_deferred_initial_data( receiver: &mpsc::Receiver< Vec< u8 > >, wait: bool, serializer: &mut ThreadedLz4Writer< Output > ) -> bool {
+    loop {
+        let chunk = if wait {
+            receiver.recv().map_err( |_| mpsc::TryRecvError::Disconnected )
+        } else {
+            receiver.try_recv()
+        };
 
-                    (id, true)
+        match chunk {
+            Ok( chunk ) => {
+                if let Err( error ) = serializer.write_all( &chunk ) {
+                    warn!( "Failed to write the rest of the initial data: {}", error );
                 }
-            }
+            },
+            Err( mpsc::TryRecvError::Empty ) => return true,
+            Err( mpsc::TryRecvError::Disconnected ) => return false
         }
     }
 }
 
-fn emit_allocation_bucket( mut bucket: AllocationBucket, backtrace_cache: &mut BacktraceCache, fp: &mut impl Write ) -> Result< (), std::io::Error > {
-    if bucket.events.len() == 0 {
-        return Ok(());
-    }
+/// Writes out everything the flight recorder has from another thread.
+fn dump_flight_recorder( id: DataId, initial_timestamp: Timestamp, output: &Output ) {
+    let segments = match output.recorder {
+        Some( ref recorder ) => recorder.segments(),
+        None => return
+    };
 
-    let mut iter = bucket.events.drain( .. );
+    let is_ok = crate::global::spawn_internal_thread( b"mem-prof-dump\0", move || {
+        let (fp, path) = match initialize_output_file() {
+            Some( output ) => output,
+            None => return
+        };
 
-    let BufferedAllocation { timestamp, allocation, backtrace } = iter.next().unwrap();
-    let mut old_pointer = allocation.address;
-    let backtrace = writers::write_backtrace( &mut *fp, backtrace, backtrace_cache )?;
-    Event::AllocEx {
-        id: bucket.id,
-        timestamp,
-        allocation: common::event::AllocBody {
-            pointer: allocation.address.get() as u64,
-            size: allocation.size as u64,
-            backtrace,
-            thread: allocation.tid,
-            flags: allocation.flags,
-            extra_usable_space: 0,
-            preceding_free_space: 0
+        match crate::flight_recorder::write_dump( fp, id, initial_timestamp, segments ) {
+            Ok(()) => info!( "The flight recorder was dumped into {:?}", path ),
+            Err( error ) => warn!( "Failed to dump the flight recorder into {:?}: {}", path, error )
         }
-    }.write_to_stream( &mut *fp )?;
-
-    while let Some( BufferedAllocation { timestamp, allocation, backtrace } ) = iter.next() {
-        let backtrace = writers::write_backtrace( &mut *fp, backtrace, backtrace_cache )?;
+    });
 
-        Event::ReallocEx {
-            id: bucket.id,
-            timestamp,
-            old_pointer: old_pointer.get() as u64,
-            allocation: common::event::AllocBody {
-                pointer: allocation.address.get() as u64,
-                size: allocation.size as u64,
-                backtrace,
-                thread: allocation.tid,
-                flags: allocation.flags,
-                extra_usable_space: 0,
-                preceding_free_space: 0
-            }
-        }.write_to_stream( &mut *fp )?;
-        old_pointer = allocation.address;
+    if !is_ok {
+        warn!( "Failed to start a thread to dump the flight recorder" );
     }
-
-    Ok(())
 }
 
 pub(crate) fn thread_main() {
     info!( "Starting event thread..." );
 
+    crate::instrumentation::initialize();
+
+    if opt::get().use_tsc {
+        crate::timestamp::initialize_tsc();
+    }
+
+    crate::allocator_latency::initialize();
+
     let uuid = generate_data_id();
+    *CURRENT_DATA_ID.lock() = Some( uuid );
     let initial_timestamp = unsafe { crate::global::INITIAL_TIMESTAMP };
     info!( "Data ID: {}", uuid );
 
-    let mut output_writer = Lz4Writer::new( Output::new() );
-    if let Some( (fp, path) ) = initialize_output_file() {
+    let mut output_writer = ThreadedLz4Writer::new( Output::new(), opt::get().compression_threads );
+    let mut deferred_initial_data = None;
+    if opt::get().flight_recorder {
+        info!( "Running as a flight recorder; nothing will be written out until a dump is requested" );
+        let duration = opt::get().flight_recorder_duration;
+        let duration = if duration > 0 { Some( Timestamp::from_secs( duration ) ) } else { None };
+
+        let mut output = Output::new();
+        output.recorder = Some( FlightRecorder::new( get_timestamp(), opt::get().flight_recorder_size * 1024 * 1024, duration ) );
+        output_writer.replace_inner( output ).unwrap();
+    } else if let Some( parent ) = multiplex::take_parent_ring() {
+        let mut fp = Lz4Writer::new( parent );
+        let result = writers::write_initial_metadata( uuid, initial_timestamp, &mut fp ).and_then( |_| {
+            deferred_initial_data = writers::write_deferred_initial_data_in_background( &mut fp )?;
+            Ok(())
+        });
+
+        match result {
+            Ok(()) => {
+                let mut output = Output::new();
+                output.ring = Some( fp.into_inner().unwrap() );
+                output_writer.replace_inner( output ).unwrap();
+            },
+            Err( error ) => {
+                warn!( "Failed to write initial data: {}", error );
+            }
+        }
+    } else if let Some( collector ) = opt::get().collector.as_ref().and_then( |path| crate::collector::connect( path.to_str().unwrap() ) ) {
+        // The collector does the compressing, so everything goes into the ring as it is.
+        let mut fp = io::BufWriter::new( collector );
+        let result = writers::write_initial_metadata( uuid, initial_timestamp, &mut fp ).and_then( |_| {
+            deferred_initial_data = writers::write_deferred_initial_data_in_background( &mut fp )?;
+            Ok(())
+        });
+
+        match result.and_then( |_| fp.into_inner().map_err( |error| error.into_error() ) ) {
+            Ok( collector ) => {
+                let mut output = Output::new();
+                output.ring = Some( collector );
+                output_writer.disable_compression().unwrap();
+                output_writer.replace_inner( output ).unwrap();
+            },
+            Err( error ) => {
+                warn!( "Failed to write initial data: {}", error );
+            }
+        }
+    } else if let Some( (fp, path) ) = initialize_output_file() {
         let mut fp = Lz4Writer::new( fp );
-        match writers::write_initial_data( uuid, initial_timestamp, &mut fp ) {
+        let result = writers::write_initial_metadata( uuid, initial_timestamp, &mut fp ).and_then( |_| {
+            deferred_initial_data = writers::write_deferred_initial_data_in_background( &mut fp )?;
+            Ok(())
+        });
+
+        match result {
             Ok(()) => {
                 let fp = fp.into_inner().unwrap();
 
@@ -542,7 +1601,9 @@ pub(crate) fn thread_main() {
 
     let mut listener = None;
 
-    if opt::get().enable_server {
+    if opt::get().enable_server && output_writer.is_compression_disabled() {
+        warn!( "The embedded server can't be used together with a collector; it won't be started" );
+    } else if opt::get().enable_server {
         if let Some( listener_instance ) = create_listener() {
             let listener_port = listener_instance.local_addr().expect( "couldn't grab the local address of the listener" ).port();
             listener = Some( (listener_instance, listener_port) );
@@ -552,19 +1613,63 @@ pub(crate) fn thread_main() {
     let mut events = Default::default();
     let mut last_flush_timestamp = get_timestamp();
     let mut coarse_timestamp = get_timestamp();
+    let mut last_backpressure_log = coarse_timestamp;
+    let mut backpressure_counters = crate::backpressure::Counters::default();
+    let mut lock_counters = crate::spin_lock::LockCounters::default();
     let mut running = true;
     let mut allocation_lock_for_memory_dump = None;
+    let mut memory_dump: Option< writer_memory::MemoryDump > = None;
     let mut last_broadcast = coarse_timestamp;
     let mut last_server_poll = coarse_timestamp;
     let mut last_smaps_update = coarse_timestamp;
     let mut force_smaps_update = true;
     let mut timestamp_override = None;
     let mut poll_fds = Vec::new();
-    let mut backtrace_cache = BacktraceCache::new( opt::get().backtrace_cache_size_level_2 );
+    let mut backtrace_cache = BacktraceCache::new( opt::get().backtrace_cache_size_level_2, opt::get().backtrace_cache_memory_budget_level_2 );
     let mut thread_gc = crate::global::ThreadGarbageCollector::default();
     let mut smaps_state = crate::smaps::State::new_preallocated();
+    let (smaps_minimum_interval, smaps_maximum_interval) = opt::smaps_intervals();
+    let mut smaps_cadence = crate::smaps::Cadence::new( smaps_minimum_interval, smaps_maximum_interval );
+    let mut encoder = Encoder::new( opt::get().compact_events );
+    let summary_mode = opt::get().summary_mode;
+    let mut summary = if summary_mode || opt::get().enable_metrics { Some( Summary::new() ) } else { None };
+    let mut last_batch_size = 0;
+    let mut last_summary = coarse_timestamp;
+    let mut last_statistics = coarse_timestamp;
+    let mut live_set = if (opt::get().checkpoint_interval > 0 || opt::get().flight_recorder) && !summary_mode { Some( LiveSet::new() ) } else { None };
+    let mut last_checkpoint = coarse_timestamp;
+    let mut last_segment = coarse_timestamp;
+    let mut last_rss_check = coarse_timestamp;
+    let mut is_over_rss_threshold = false;
+    let mut last_flight_recorder_dump = None;
+    // The latest tag of every thread, so that every segment of the flight recorder can start with them.
+    let mut thread_tags: HashMap< u32, (Timestamp, u32) > = HashMap::new();
+    // Likewise for the names of the pools.
+    let mut pool_names: HashMap< u16, (Timestamp, String, u32) > = HashMap::new();
+    // ...and for the names of the threads which are still alive.
+    let mut thread_names: HashMap< u32, (Timestamp, String) > = HashMap::new();
+    let mut residency = if opt::get().residency_sampling_interval > 0 { Some( Residency::new( opt::get().residency_sample_size ) ) } else { None };
+    let mut last_residency_sample = coarse_timestamp;
+    let mut numa = if opt::get().numa_sampling_interval > 0 && !summary_mode { Some( NumaPlacements::new() ) } else { None };
+    let mut last_numa_sample = coarse_timestamp;
+    let mut jemalloc_stats = if opt::get().jemalloc_stats_interval > 0 { Some( JemallocStats::new() ) } else { None };
+    let mut last_jemalloc_stats = coarse_timestamp;
+    let mut cgroup_memory = if opt::get().cgroup_sampling_interval > 0 { CgroupMemory::open() } else { None };
+    let mut last_cgroup_sample = coarse_timestamp;
+    let mut culled = CulledStatistics::new();
+    let mut last_culled_statistics = coarse_timestamp;
+    let mut allocator_latencies = MergedLatencies::new();
+    let mut last_allocator_latencies = coarse_timestamp;
+    let mut page_faults = crate::page_faults::take();
+    let mut children = Children::new();
+    let mut scratch_heap = ScratchHeap::new();
     loop {
-        timed_recv_all_events( &mut events, Duration::from_millis( 250 ) );
+        let timeout = if memory_dump.is_some() { 5 } else { 250 };
+        timed_recv_all_events( &mut events, Duration::from_millis( timeout ) );
+        last_batch_size = events.len();
+        if last_batch_size > 0 {
+            crate::instrumentation::record( Stage::BatchSize, last_batch_size as u64 );
+        }
 
         crate::global::try_disable_if_requested();
         coarse_timestamp = get_timestamp();
@@ -580,40 +1685,76 @@ pub(crate) fn thread_main() {
                 last_server_poll = coarse_timestamp;
                 match listener.accept() {
                     Ok( (stream, _) ) => {
-                        match Client::new( uuid, initial_timestamp, listener_port, stream ) {
-                            Ok( client ) => {
-                                output_writer.inner_mut_without_flush().clients.push( client );
-                            },
-                            Err( error ) => {
-                                info!( "Failed to initialize client: {}", error );
-                            }
-                        }
+                        output_writer.inner_mut_without_flush().clients.push( Client::new( stream, coarse_timestamp ) );
                     },
                     Err( ref error ) if error.kind() == io::ErrorKind::WouldBlock => {},
                     Err( _ ) => {}
                 }
 
-                poll_clients( uuid, initial_timestamp, &mut poll_fds, &mut output_writer );
+                poll_clients(
+                    uuid,
+                    initial_timestamp,
+                    listener_port,
+                    coarse_timestamp,
+                    &mut poll_fds,
+                    &mut output_writer,
+                    &mut encoder,
+                    || crate::metrics::render( summary.as_ref(), last_batch_size )
+                );
             }
         }
 
         thread_gc.run( coarse_timestamp, &mut events );
+        crate::logger::flush_queued_records();
         crate::allocation_tracker::on_tick();
 
+        if let Some( ref receiver ) = deferred_initial_data {
+            if !write_deferred_initial_data( receiver, false, &mut output_writer ) {
+                deferred_initial_data = None;
+            }
+        }
+
+        children.poll( coarse_timestamp, &mut output_writer );
+
         if events.is_empty() && !running {
+            if let Some( memory_dump ) = memory_dump.take() {
+                if let Err( error ) = memory_dump.finish( &mut output_writer ) {
+                    warn!( "Failed to write the memory dump: {}", error );
+                }
+            }
+
             break;
         }
 
         if events.is_empty() {
+            // The allocations only need to be blocked until the dumper is forked.
             if let Some( _lock ) = allocation_lock_for_memory_dump.take() {
                 if !output_writer.inner().is_none() {
-                    let _ = writer_memory::write_memory_dump( &mut output_writer );
+                    match writer_memory::start_memory_dump() {
+                        Ok( dump ) => {
+                            let _ = Event::MemoryDumpStarted { timestamp: get_timestamp() }.write_to_stream( &mut output_writer );
+                            memory_dump = Some( dump );
+                        },
+                        Err( error ) => warn!( "Failed to start a memory dump: {}", error )
+                    }
+                }
+            }
+        }
+
+        if let Some( ref mut dump ) = memory_dump {
+            match dump.poll( &mut output_writer, MEMORY_DUMP_SLICE_SIZE ) {
+                Ok( false ) => {},
+                Ok( true ) => memory_dump = None,
+                Err( error ) => {
+                    warn!( "Failed to write the memory dump: {}", error );
+                    memory_dump = None;
                 }
             }
         }
 
         let serializer = &mut output_writer;
         let skip = serializer.inner().is_none();
+        let processing_timer = if events.is_empty() { None } else { Some( Timer::start( Stage::Processing ) ) };
         for event in events.drain() {
             match event {
                 InternalEvent::Alloc {
@@ -632,20 +1773,37 @@ pub(crate) fn thread_main() {
 
                     timestamp = timestamp_override.take().unwrap_or( timestamp );
 
-                    if let Ok( backtrace ) = writers::write_backtrace( &mut *serializer, backtrace, &mut backtrace_cache ) {
-                        let _ = Event::AllocEx {
-                            id,
-                            timestamp,
-                            allocation: common::event::AllocBody {
-                                pointer: allocation.address.get() as u64,
-                                size: allocation.size as u64,
-                                backtrace,
-                                thread: allocation.tid,
-                                flags: allocation.flags,
-                                extra_usable_space: allocation.extra_usable_space,
-                                preceding_free_space: 0
+                    if let Ok( backtrace ) = writers::write_backtrace_ref( &mut *serializer, backtrace, &mut backtrace_cache ) {
+                        if let Some( ref mut residency ) = residency {
+                            residency.on_allocation( allocation.address.get() as u64, allocation.size as u64, backtrace );
+                        }
+
+                        if let Some( ref mut numa ) = numa {
+                            numa.on_allocation( id, allocation.address.get() as u64 );
+                        }
+
+                        if let Some( ref mut summary ) = summary {
+                            summary.on_allocation( allocation.address.get(), allocation.size as u64, backtrace );
+                            if summary_mode {
+                                continue;
                             }
-                        }.write_to_stream( &mut *serializer );
+                        }
+
+                        let body = common::event::AllocBody {
+                            pointer: allocation.address.get() as u64,
+                            size: allocation.size as u64,
+                            backtrace,
+                            thread: allocation.tid,
+                            flags: allocation.flags,
+                            extra_usable_space: allocation.extra_usable_space,
+                            preceding_free_space: 0
+                        };
+
+                        if let Some( ref mut live_set ) = live_set {
+                            live_set.on_allocation( id, timestamp, body.clone() );
+                        }
+
+                        let _ = encoder.write_alloc( &mut *serializer, id, timestamp, body );
                     }
                 },
                 InternalEvent::Realloc {
@@ -666,21 +1824,36 @@ pub(crate) fn thread_main() {
                     timestamp = timestamp_override.take().unwrap_or( timestamp );
 
                     if let Ok( backtrace ) = writers::write_backtrace( &mut *serializer, backtrace, &mut backtrace_cache ) {
-                        let event = Event::ReallocEx {
-                            id,
-                            timestamp,
-                            old_pointer: old_address.get() as u64,
-                            allocation: common::event::AllocBody {
-                                pointer: allocation.address.get() as u64,
-                                size: allocation.size as u64,
-                                backtrace,
-                                thread: allocation.tid,
-                                flags: allocation.flags,
-                                extra_usable_space: allocation.extra_usable_space,
-                                preceding_free_space: 0
+                        if let Some( ref mut residency ) = residency {
+                            residency.on_reallocation( old_address.get() as u64, allocation.address.get() as u64, allocation.size as u64, backtrace );
+                        }
+
+                        if let Some( ref mut numa ) = numa {
+                            numa.on_reallocation( id, old_address.get() as u64, allocation.address.get() as u64 );
+                        }
+
+                        if let Some( ref mut summary ) = summary {
+                            summary.on_reallocation( old_address.get(), allocation.address.get(), allocation.size as u64, backtrace );
+                            if summary_mode {
+                                continue;
                             }
+                        }
+
+                        let body = common::event::AllocBody {
+                            pointer: allocation.address.get() as u64,
+                            size: allocation.size as u64,
+                            backtrace,
+                            thread: allocation.tid,
+                            flags: allocation.flags,
+                            extra_usable_space: allocation.extra_usable_space,
+                            preceding_free_space: 0
                         };
-                        let _ = event.write_to_stream( &mut *serializer );
+
+                        if let Some( ref mut live_set ) = live_set {
+                            live_set.on_reallocation( id, timestamp, old_address.get() as u64, body.clone() );
+                        }
+
+                        let _ = encoder.write_realloc( &mut *serializer, id, timestamp, old_address.get() as u64, body );
                     }
                 },
                 InternalEvent::Free {
@@ -700,6 +1873,22 @@ pub(crate) fn thread_main() {
 
                     timestamp = timestamp_override.take().unwrap_or( timestamp );
 
+                    if let Some( ref mut residency ) = residency {
+                        residency.on_free( address.get() as u64 );
+                    }
+
+                    if let Some( ref mut numa ) = numa {
+                        numa.on_free( address.get() as u64 );
+                    }
+
+                    if let Some( ref mut summary ) = summary {
+                        summary.on_free( address.get() );
+                        if summary_mode {
+                            // The backtraces of the deallocations aren't part of the summary.
+                            continue;
+                        }
+                    }
+
                     let backtrace =
                         if let Some( backtrace ) = backtrace {
                             writers::write_backtrace( &mut *serializer, backtrace, &mut backtrace_cache ).ok()
@@ -708,13 +1897,11 @@ pub(crate) fn thread_main() {
                         };
 
                     if let Some( backtrace ) = backtrace {
-                        let _ = Event::FreeEx {
-                            id: id.into(),
-                            timestamp,
-                            pointer: address.get() as u64,
-                            backtrace,
-                            thread: tid
-                        }.write_to_stream( &mut *serializer );
+                        if let Some( ref mut live_set ) = live_set {
+                            live_set.on_free( address.get() as u64 );
+                        }
+
+                        let _ = encoder.write_free( &mut *serializer, id.into(), timestamp, address.get() as u64, backtrace, tid );
                     }
                 },
                 InternalEvent::AllocationBucket( bucket ) => {
@@ -722,7 +1909,25 @@ pub(crate) fn thread_main() {
                         continue;
                     }
 
-                    let _ = emit_allocation_bucket( bucket, &mut backtrace_cache, &mut *serializer );
+                    if summary_mode {
+                        let _ = summarize_allocation_bucket( bucket, &mut backtrace_cache, summary.as_mut().unwrap(), residency.as_mut(), &mut *serializer );
+                    } else {
+                        let _ = emit_allocation_bucket( bucket, &mut backtrace_cache, &mut encoder, summary.as_mut(), live_set.as_mut(), residency.as_mut(), numa.as_mut(), &mut *serializer );
+                    }
+                },
+                InternalEvent::CulledAllocations { entries } => {
+                    if skip {
+                        continue;
+                    }
+
+                    let _ = culled.on_culled( entries, &mut backtrace_cache, &mut *serializer );
+                },
+                InternalEvent::AllocatorLatencies { entries } => {
+                    if skip {
+                        continue;
+                    }
+
+                    let _ = allocator_latencies.on_latencies( entries, &mut backtrace_cache, &mut *serializer );
                 },
                 InternalEvent::Mallopt { param, value, result, mut timestamp, backtrace, thread } => {
                     let system_tid = thread.system_tid();
@@ -743,6 +1948,25 @@ pub(crate) fn thread_main() {
                         let _ = event.write_to_stream( &mut *serializer );
                     }
                 },
+                InternalEvent::MemoryAdvice { address, length, advice, mut timestamp, backtrace, thread } => {
+                    let system_tid = thread.system_tid();
+                    mem::drop( thread );
+
+                    if skip {
+                        continue;
+                    }
+
+                    if timestamp == Timestamp::min() {
+                        timestamp = coarse_timestamp;
+                    }
+
+                    let timestamp = timestamp_override.take().unwrap_or( timestamp );
+
+                    if let Ok( backtrace ) = writers::write_backtrace( &mut *serializer, backtrace, &mut backtrace_cache ) {
+                        let event = Event::MemoryAdvice { timestamp, address, length, advice, backtrace, thread: system_tid };
+                        let _ = event.write_to_stream( &mut *serializer );
+                    }
+                },
                 InternalEvent::Exit => {
                     crate::allocation_tracker::on_exit();
                     running = false;
@@ -750,7 +1974,9 @@ pub(crate) fn thread_main() {
                 },
                 InternalEvent::GrabMemoryDump => {
                     // Block any further allocations.
-                    if allocation_lock_for_memory_dump.is_none() {
+                    if memory_dump.is_some() {
+                        debug!( "A memory dump is already in progress" );
+                    } else if allocation_lock_for_memory_dump.is_none() {
                         debug!( "Locking allocations to prepare for a memory dump" );
                         allocation_lock_for_memory_dump = Some( AllocationLock::new() );
                     }
@@ -763,20 +1989,105 @@ pub(crate) fn thread_main() {
                     let event = Event::Marker { value };
                     let _ = event.write_to_stream( &mut *serializer );
                 },
+                InternalEvent::OptionChanged { timestamp, option, value } => {
+                    match option {
+                        RuntimeOption::GatherMaps => force_smaps_update |= value != 0,
+                        RuntimeOption::SmapsMinimumInterval | RuntimeOption::SmapsMaximumInterval => {
+                            let (minimum_interval, maximum_interval) = opt::smaps_intervals();
+                            smaps_cadence = crate::smaps::Cadence::new( minimum_interval, maximum_interval );
+                        },
+                        _ => {}
+                    }
+
+                    if skip {
+                        continue;
+                    }
+
+                    let _ = Event::OptionChanged { timestamp, option, value }.write_to_stream( &mut *serializer );
+                    if option == RuntimeOption::SamplingInterval {
+                        let _ = Event::SamplingInterval { interval: value }.write_to_stream( &mut *serializer );
+                    }
+                },
+                InternalEvent::ThreadTag { timestamp, thread, tag } => {
+                    if opt::get().flight_recorder {
+                        thread_tags.insert( thread, (timestamp, tag) );
+                    }
+
+                    if skip {
+                        continue;
+                    }
+
+                    let _ = Event::ThreadTag { timestamp, thread, tag }.write_to_stream( &mut *serializer );
+                },
+                InternalEvent::PoolCreated { timestamp, pool, name, flags } => {
+                    if !skip {
+                        let _ = Event::PoolCreated { timestamp, pool, name: name.as_str().into(), flags }.write_to_stream( &mut *serializer );
+                    }
+
+                    if opt::get().flight_recorder {
+                        pool_names.insert( pool, (timestamp, name, flags) );
+                    }
+                },
+                InternalEvent::PoolAlloc { timestamp, pool, tid, flags, backtrace, allocations } => {
+                    // These overlap with the memory of their pools, so they're not part of the summary nor the checkpoints.
+                    if skip || summary_mode {
+                        continue;
+                    }
+
+                    if let Ok( backtrace ) = writers::write_backtrace( &mut *serializer, backtrace, &mut backtrace_cache ) {
+                        let _ = Event::PoolAlloc { timestamp, pool, thread: tid, backtrace, flags, allocations: allocations.into() }.write_to_stream( &mut *serializer );
+                    }
+                },
+                InternalEvent::PoolFree { timestamp, pool, tid, pointers } => {
+                    if skip || summary_mode {
+                        continue;
+                    }
+
+                    let _ = Event::PoolFree { timestamp, pool, thread: tid, pointers: pointers.into() }.write_to_stream( &mut *serializer );
+                },
+                InternalEvent::PoolReset { timestamp, pool, tid } => {
+                    if skip || summary_mode {
+                        continue;
+                    }
+
+                    let _ = Event::PoolReset { timestamp, pool, thread: tid }.write_to_stream( &mut *serializer );
+                },
+                InternalEvent::ThreadStarted { timestamp, thread, name } => {
+                    if !skip {
+                        let _ = Event::ThreadStarted { timestamp, thread, name: name.as_str().into() }.write_to_stream( &mut *serializer );
+                    }
+
+                    if opt::get().flight_recorder {
+                        thread_names.insert( thread, (timestamp, name) );
+                    }
+                },
+                InternalEvent::ThreadRenamed { timestamp, thread, name } => {
+                    if !skip {
+                        let _ = Event::ThreadRenamed { timestamp, thread, name: name.as_str().into() }.write_to_stream( &mut *serializer );
+                    }
+
+                    if let Some( entry ) = thread_names.get_mut( &thread ) {
+                        entry.1 = name;
+                    }
+                },
+                InternalEvent::ThreadExited { timestamp, thread } => {
+                    thread_names.remove( &thread );
+                    if !skip {
+                        let _ = Event::ThreadExited { timestamp, thread }.write_to_stream( &mut *serializer );
+                    }
+                },
+                InternalEvent::ChildForked { pid, ring } => {
+                    children.add( pid, ring );
+                },
                 InternalEvent::OverrideNextTimestamp { timestamp } => {
                     timestamp_override = Some( timestamp );
                 },
                 InternalEvent::AddressSpaceUpdated { timestamp, maps, new_binaries } => {
-                    if opt::get().write_binaries_to_output || serializer.inner_mut_without_flush().file.is_none() {
+                    let output = serializer.inner_mut_without_flush();
+                    if opt::get().write_binaries_to_output || (output.file.is_none() && output.ring.is_none()) {
                         for binary in new_binaries {
                             debug!( "Writing new binary: {}", binary.name() );
-                            let event = Event::File64 {
-                                timestamp,
-                                path: binary.name().into(),
-                                contents: binary.as_bytes().into()
-                            };
-
-                            let _ = event.write_to_stream( &mut *serializer );
+                            let _ = writers::write_binary( &mut *serializer, timestamp, binary.name(), binary.as_bytes() );
                         }
                     }
 
@@ -789,7 +2100,7 @@ pub(crate) fn thread_main() {
 
                     let _ = event.write_to_stream( &mut *serializer );
 
-                    if opt::get().gather_maps {
+                    if opt::gather_maps() {
                         update_smaps(
                             &mut smaps_state,
                             &mut backtrace_cache,
@@ -799,13 +2110,16 @@ pub(crate) fn thread_main() {
 
                         last_smaps_update = timestamp;
                         force_smaps_update = false;
+                        smaps_cadence.on_scanned();
                     }
                 }
             }
         }
 
+        mem::drop( processing_timer );
+
         coarse_timestamp = get_timestamp();
-        let should_update_smaps = opt::get().gather_maps && (force_smaps_update || (coarse_timestamp - last_smaps_update).as_msecs() >= 1000);
+        let should_update_smaps = opt::gather_maps() && (force_smaps_update || smaps_cadence.is_due( (coarse_timestamp - last_smaps_update).as_msecs() ));
         if should_update_smaps {
             let timestamp = get_timestamp();
             update_smaps(
@@ -817,6 +2131,142 @@ pub(crate) fn thread_main() {
 
             last_smaps_update = timestamp;
             force_smaps_update = false;
+            smaps_cadence.on_scanned();
+        }
+
+        if let Some( summary ) = summary.as_mut().filter( |_| summary_mode ) {
+            if (coarse_timestamp - last_summary).as_msecs() >= opt::get().summary_interval {
+                last_summary = coarse_timestamp;
+                if !serializer.inner().is_none() {
+                    // These are meant to be looked at as they come, so don't let them sit in the buffers.
+                    let _ = scratch_heap.with( || summary.write_snapshot( coarse_timestamp, &mut *serializer ) );
+                    let _ = serializer.flush();
+                }
+            }
+        }
+
+        if let Some( ref live_set ) = live_set {
+            if opt::get().checkpoint_interval > 0 && (coarse_timestamp - last_checkpoint).as_secs() >= opt::get().checkpoint_interval {
+                last_checkpoint = coarse_timestamp;
+                if !serializer.inner().is_none() {
+                    let _ = scratch_heap.with( || live_set.write_checkpoint( coarse_timestamp, smaps_state.emitted_regions(), &mut *serializer ) );
+                }
+            }
+        }
+
+        if let Some( live_set ) = live_set.as_ref().filter( |_| opt::get().flight_recorder ) {
+            let mut should_dump = crate::flight_recorder::take_dump_request();
+            let rss_threshold = opt::get().flight_recorder_rss_threshold * 1024 * 1024;
+            if rss_threshold > 0 && (coarse_timestamp - last_rss_check).as_secs() >= 1 {
+                last_rss_check = coarse_timestamp;
+                let is_over = crate::smaps::read_rss().map( |rss| rss >= rss_threshold ).unwrap_or( false );
+                if is_over && !is_over_rss_threshold {
+                    info!( "RSS is over the flight recorder's threshold" );
+                    should_dump = true;
+                }
+
+                is_over_rss_threshold = is_over;
+            }
+
+            if should_dump && last_flight_recorder_dump.map( |last| (coarse_timestamp - last).as_secs() < 1 ).unwrap_or( false ) {
+                info!( "Ignoring a flight recorder dump request since there was one just now" );
+                should_dump = false;
+            }
+
+            if should_dump || (coarse_timestamp - last_segment).as_secs() >= opt::get().flight_recorder_checkpoint_interval {
+                last_segment = coarse_timestamp;
+                if start_flight_recorder_segment( coarse_timestamp, &mut *serializer, &mut encoder ).is_ok() {
+                    let _ = scratch_heap.with( || live_set.write_checkpoint( coarse_timestamp, smaps_state.emitted_regions(), &mut *serializer ) );
+                    for (&thread, &(timestamp, ref name)) in &thread_names {
+                        let _ = Event::ThreadStarted { timestamp, thread, name: name.as_str().into() }.write_to_stream( &mut *serializer );
+                    }
+
+                    for (&thread, &(timestamp, tag)) in &thread_tags {
+                        let _ = Event::ThreadTag { timestamp, thread, tag }.write_to_stream( &mut *serializer );
+                    }
+
+                    for (&pool, &(timestamp, ref name, flags)) in &pool_names {
+                        let _ = Event::PoolCreated { timestamp, pool, name: name.as_str().into(), flags }.write_to_stream( &mut *serializer );
+                    }
+                }
+            }
+
+            if should_dump {
+                last_flight_recorder_dump = Some( coarse_timestamp );
+                dump_flight_recorder( uuid, initial_timestamp, serializer.inner() );
+            }
+        }
+
+        if let Some( ref mut residency ) = residency {
+            if (coarse_timestamp - last_residency_sample).as_secs() >= opt::get().residency_sampling_interval {
+                last_residency_sample = coarse_timestamp;
+                if !serializer.inner().is_none() {
+                    let _ = scratch_heap.with( || residency.write_samples( coarse_timestamp, &mut *serializer ) );
+                }
+            }
+        }
+
+        if let Some( ref mut numa ) = numa {
+            if (coarse_timestamp - last_numa_sample).as_msecs() >= opt::get().numa_sampling_interval {
+                last_numa_sample = coarse_timestamp;
+                if !serializer.inner().is_none() {
+                    let _ = scratch_heap.with( || numa.write_placements( coarse_timestamp, &mut *serializer ) );
+                }
+            }
+        }
+
+        if (coarse_timestamp - last_culled_statistics).as_msecs() >= opt::get().culled_statistics_interval {
+            last_culled_statistics = coarse_timestamp;
+            if !serializer.inner().is_none() {
+                let _ = culled.write_statistics( coarse_timestamp, &mut *serializer );
+            }
+        }
+
+        if opt::get().allocator_latency_interval > 0 && (coarse_timestamp - last_allocator_latencies).as_msecs() >= opt::get().allocator_latency_interval {
+            last_allocator_latencies = coarse_timestamp;
+            if !serializer.inner().is_none() {
+                let _ = allocator_latencies.write_statistics( coarse_timestamp, &mut *serializer );
+            }
+        }
+
+        if let Some( ref mut page_faults ) = page_faults {
+            if serializer.inner().is_none() {
+                page_faults.poll();
+            } else {
+                let _ = page_faults.write_page_faults( coarse_timestamp, &mut *serializer );
+            }
+        }
+
+        if let Some( ref mut jemalloc_stats ) = jemalloc_stats {
+            if (coarse_timestamp - last_jemalloc_stats).as_msecs() >= opt::get().jemalloc_stats_interval {
+                last_jemalloc_stats = coarse_timestamp;
+                if !serializer.inner().is_none() && crate::global::is_jemalloc_in_use() {
+                    let _ = jemalloc_stats.write_snapshot( coarse_timestamp, &mut *serializer );
+                }
+            }
+        }
+
+        if let Some( ref mut cgroup_memory ) = cgroup_memory {
+            if (coarse_timestamp - last_cgroup_sample).as_msecs() >= opt::get().cgroup_sampling_interval {
+                last_cgroup_sample = coarse_timestamp;
+                if !serializer.inner().is_none() {
+                    let _ = cgroup_memory.write_sample( coarse_timestamp, &mut *serializer );
+                }
+            }
+        }
+
+        if opt::get().instrumentation && (coarse_timestamp - last_statistics).as_msecs() >= PROFILER_STATISTICS_INTERVAL {
+            last_statistics = coarse_timestamp;
+            if !serializer.inner().is_none() {
+                let _ = crate::instrumentation::write_statistics( coarse_timestamp, &mut *serializer );
+                let _ = crate::instrumentation::write_backtrace_cache_statistics( coarse_timestamp, backtrace_cache.capacity(), &mut *serializer );
+            }
+        }
+
+        if (coarse_timestamp - last_backpressure_log).as_secs() >= 1 {
+            last_backpressure_log = coarse_timestamp;
+            crate::backpressure::log_counters( &mut backpressure_counters );
+            crate::spin_lock::log_lock_counters( &mut lock_counters );
         }
 
         if (coarse_timestamp - last_flush_timestamp).as_secs() > 30 {
@@ -825,7 +2275,7 @@ pub(crate) fn thread_main() {
         }
     }
 
-    if opt::get().gather_maps {
+    if opt::gather_maps() {
         update_smaps(
             &mut smaps_state,
             &mut backtrace_cache,
@@ -834,11 +2284,92 @@ pub(crate) fn thread_main() {
         );
     }
 
+    if let Some( ref receiver ) = deferred_initial_data {
+        write_deferred_initial_data( receiver, true, &mut output_writer );
+    }
+
+    if !output_writer.inner().is_none() {
+        let _ = culled.write_statistics( get_timestamp(), &mut output_writer );
+        let _ = allocator_latencies.write_statistics( get_timestamp(), &mut output_writer );
+        if let Some( ref mut page_faults ) = page_faults {
+            let _ = page_faults.write_page_faults( get_timestamp(), &mut output_writer );
+        }
+    }
+
+    if let Some( summary ) = summary.as_mut().filter( |_| summary_mode ) {
+        let _ = summary.write_snapshot( get_timestamp(), &mut output_writer );
+    }
+
+    if opt::get().instrumentation && !output_writer.inner().is_none() {
+        let _ = crate::instrumentation::write_statistics( get_timestamp(), &mut output_writer );
+        let _ = crate::instrumentation::write_backtrace_cache_statistics( get_timestamp(), backtrace_cache.capacity(), &mut output_writer );
+    }
+
     let _ = output_writer.flush();
+    output_writer.inner_mut_without_flush().finish_catch_ups( true );
     for client in &mut output_writer.inner_mut_without_flush().clients {
+        if client.is_handshake_pending {
+            continue;
+        }
+
         let _ = Response::Finished.write_to_stream( &mut client.stream );
         let _ = client.stream.flush();
     }
 
+    crate::backpressure::log_counters( &mut backpressure_counters );
+    crate::spin_lock::log_lock_counters( &mut lock_counters );
     info!( "Event thread finished" );
 }
+
+#[test]
+fn test_session_replay() {
+    let mut session = Session::new( 1 );
+    session.next_chunk( b"abc" );
+    session.record( b"de" );
+    session.next_chunk( b"fgh" );
+    assert_eq!( session.position.sequence, 2 );
+    assert_eq!( session.position.offset, 8 );
+    assert_eq!( session.replay_from( 0 ), Some( &b"abcdefgh"[..] ) );
+    assert_eq!( session.replay_from( 8 ), Some( &b""[..] ) );
+    assert_eq!( session.replay_from( 9 ), None );
+
+    session.acknowledge( 4 );
+    assert_eq!( session.replay_from( 3 ), None );
+    assert_eq!( session.replay_from( 4 ), Some( &b"efgh"[..] ) );
+
+    // Acknowledging something older doesn't change anything.
+    session.acknowledge( 2 );
+    assert_eq!( session.replay_from( 4 ), Some( &b"efgh"[..] ) );
+
+    session.acknowledge( 100 );
+    assert_eq!( session.replay_from( 8 ), Some( &b""[..] ) );
+}
+
+#[test]
+fn test_backtrace_cache_resizing() {
+    let backtrace = |key: u64| Backtrace::new( key as BacktraceKey + 1, &[ key as usize ] );
+    let entry_size = BACKTRACE_CACHE_ENTRY_OVERHEAD + mem::size_of::< usize >();
+
+    // A full cache which keeps on missing grows.
+    let mut cache = BacktraceCache::new( 16, 1024 * 1024 );
+    for key in 0..BACKTRACE_CACHE_ADAPTATION_WINDOW as u64 {
+        assert_eq!( cache.assign_id( &backtrace( key ) ).1, true );
+    }
+    assert_eq!( cache.capacity(), 32 );
+
+    // One which doesn't stays as it is.
+    let mut cache = BacktraceCache::new( 16, 1024 * 1024 );
+    let backtraces: Vec< _ > = (0..16).map( backtrace ).collect();
+    for nth in 0..BACKTRACE_CACHE_ADAPTATION_WINDOW as usize {
+        cache.assign_id( &backtraces[ nth % backtraces.len() ] );
+    }
+    assert_eq!( cache.capacity(), 16 );
+
+    // And one which goes over its budget shrinks.
+    let mut cache = BacktraceCache::new( 16, entry_size * 8 );
+    for key in 0..16 {
+        cache.assign_id( &backtrace( key ) );
+    }
+    assert_eq!( cache.capacity(), 6 );
+    assert_eq!( cache.cached_bytes, entry_size * 6 );
+}
@@ -0,0 +1,234 @@
+//! Periodic sampling of how much of the memory of the live allocations is actually resident.
+//!
+//! Every pass looks up the pages of a sample of the live allocations in `/proc/self/pagemap`,
+//! which tells whether they're resident, swapped out, or were never touched at all.
+//! If `/sys/kernel/mm/page_idle/bitmap` can be opened (which usually needs root) the resident
+//! pages are also marked as idle, so that the next pass can tell which of them weren't accessed since.
+
+use std::fs::{File, OpenOptions};
+use std::io::{self, Write};
+use std::os::unix::fs::FileExt;
+
+use common::event::{Event, ResidencySample};
+use common::speedy::Writable;
+
+use crate::timestamp::Timestamp;
+use crate::utils::{HashMap, empty_hashmap};
+use crate::PAGE_SIZE;
+
+// Smaller allocations share their pages with their neighbours, so their residency doesn't say much.
+const MINIMUM_SIZE: u64 = PAGE_SIZE as u64;
+const PAGEMAP_CHUNK: usize = 512;
+
+const PAGEMAP_PRESENT: u64 = 1 << 63;
+const PAGEMAP_SWAPPED: u64 = 1 << 62;
+const PAGEMAP_PFN_MASK: u64 = (1 << 55) - 1;
+
+struct LiveAllocation {
+    backtrace: u64,
+    size: u64
+}
+
+#[derive(Default)]
+struct PageCounts {
+    pages: u64,
+    resident_pages: u64,
+    swapped_pages: u64,
+    idle_pages: u64
+}
+
+/// Checks whether the page wasn't accessed since it was last marked as idle, and marks it again.
+fn check_and_mark_idle( page_idle: &File, pfn: u64 ) -> io::Result< bool > {
+    let offset = (pfn / 64) * 8;
+    let bit = 1 << (pfn % 64);
+    let mut word = [0; 8];
+    page_idle.read_exact_at( &mut word, offset )?;
+
+    // The kernel clears the bit whenever the page is accessed, and only the bits which are set get written.
+    page_idle.write_all_at( &u64::to_ne_bytes( bit ), offset )?;
+    Ok( u64::from_ne_bytes( word ) & bit != 0 )
+}
+
+pub struct Residency {
+    allocations: HashMap< u64, LiveAllocation >,
+    sample_size: usize,
+    pagemap: Option< File >,
+    page_idle: Option< File >,
+    buffer: Vec< u64 >
+}
+
+impl Residency {
+    pub fn new( sample_size: usize ) -> Self {
+        let pagemap = match File::open( "/proc/self/pagemap" ) {
+            Ok( fp ) => Some( fp ),
+            Err( error ) => {
+                warn!( "Failed to open /proc/self/pagemap; the residency won't be sampled: {}", error );
+                None
+            }
+        };
+
+        let page_idle = OpenOptions::new().read( true ).write( true ).open( "/sys/kernel/mm/page_idle/bitmap" ).ok();
+        if pagemap.is_some() && page_idle.is_none() {
+            info!( "Failed to open /sys/kernel/mm/page_idle/bitmap; the idle pages won't be tracked" );
+        }
+
+        Residency {
+            allocations: empty_hashmap(),
+            sample_size,
+            pagemap,
+            page_idle,
+            buffer: Vec::new()
+        }
+    }
+
+    pub fn on_allocation( &mut self, pointer: u64, size: u64, backtrace: u64 ) {
+        if size < MINIMUM_SIZE {
+            self.allocations.remove( &pointer );
+            return;
+        }
+
+        self.allocations.insert( pointer, LiveAllocation { backtrace, size } );
+    }
+
+    pub fn on_reallocation( &mut self, old_pointer: u64, pointer: u64, size: u64, backtrace: u64 ) {
+        self.on_free( old_pointer );
+        self.on_allocation( pointer, size, backtrace );
+    }
+
+    pub fn on_free( &mut self, pointer: u64 ) {
+        self.allocations.remove( &pointer );
+    }
+
+    fn count_pages( &mut self, pointer: u64, size: u64, counts: &mut PageCounts ) -> io::Result< () > {
+        let pagemap = match self.pagemap.as_ref() {
+            Some( pagemap ) => pagemap,
+            None => return Ok(())
+        };
+
+        let page_size = PAGE_SIZE as u64;
+        let mut page = pointer / page_size;
+        let end = (pointer + size + page_size - 1) / page_size;
+        while page < end {
+            let count = std::cmp::min( (end - page) as usize, PAGEMAP_CHUNK );
+            self.buffer.resize( count, 0 );
+            let bytes = unsafe { std::slice::from_raw_parts_mut( self.buffer.as_mut_ptr() as *mut u8, count * 8 ) };
+            pagemap.read_exact_at( bytes, page * 8 )?;
+
+            for &entry in &self.buffer {
+                counts.pages += 1;
+                if entry & PAGEMAP_SWAPPED != 0 {
+                    counts.swapped_pages += 1;
+                } else if entry & PAGEMAP_PRESENT != 0 {
+                    counts.resident_pages += 1;
+
+                    // The frame numbers are only visible with `CAP_SYS_ADMIN`.
+                    let pfn = entry & PAGEMAP_PFN_MASK;
+                    if pfn == 0 {
+                        continue;
+                    }
+
+                    if let Some( page_idle ) = self.page_idle.as_ref() {
+                        match check_and_mark_idle( page_idle, pfn ) {
+                            Ok( true ) => counts.idle_pages += 1,
+                            Ok( false ) => {},
+                            Err( error ) => {
+                                warn!( "Failed to track the idle pages: {}", error );
+                                self.page_idle = None;
+                            }
+                        }
+                    }
+                }
+            }
+
+            page += count as u64;
+        }
+
+        Ok(())
+    }
+
+    pub fn write_samples( &mut self, timestamp: Timestamp, fp: &mut impl Write ) -> io::Result< () > {
+        if self.pagemap.is_none() {
+            return Ok(());
+        }
+
+        let sampled: Vec< _ > = self.allocations.iter()
+            .take( self.sample_size )
+            .map( |(&pointer, allocation)| (pointer, allocation.size, allocation.backtrace) )
+            .collect();
+
+        let mut per_backtrace: HashMap< u64, (u64, u64, PageCounts) > = empty_hashmap();
+        for (pointer, size, backtrace) in sampled {
+            let (allocation_count, allocated_size, counts) = per_backtrace.entry( backtrace ).or_default();
+            if let Err( error ) = self.count_pages( pointer, size, counts ) {
+                warn!( "Failed to read /proc/self/pagemap: {}", error );
+                self.pagemap = None;
+                return Ok(());
+            }
+
+            *allocation_count += 1;
+            *allocated_size += size;
+        }
+
+        if per_backtrace.is_empty() {
+            return Ok(());
+        }
+
+        let mut entries: Vec< _ > = per_backtrace.into_iter().map( |(backtrace, (allocation_count, allocated_size, counts))| {
+            ResidencySample {
+                backtrace,
+                allocation_count,
+                allocated_size,
+                pages: counts.pages,
+                resident_pages: counts.resident_pages,
+                swapped_pages: counts.swapped_pages,
+                idle_pages: counts.idle_pages
+            }
+        }).collect();
+        entries.sort_unstable_by_key( |entry| entry.backtrace );
+
+        Event::ResidencySamples {
+            timestamp,
+            idle_tracking: self.page_idle.is_some(),
+            entries: entries.into()
+        }.write_to_stream( fp )
+    }
+}
+
+#[test]
+fn test_residency() {
+    use common::speedy::Readable;
+
+    let length = 16 * PAGE_SIZE;
+    let pointer = unsafe { libc::mmap( std::ptr::null_mut(), length, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_PRIVATE | libc::MAP_ANONYMOUS, -1, 0 ) };
+    assert_ne!( pointer, libc::MAP_FAILED );
+    unsafe {
+        std::ptr::write_bytes( pointer as *mut u8, 1, 4 * PAGE_SIZE );
+    }
+
+    let mut residency = Residency::new( 10 );
+    residency.on_allocation( pointer as u64, length as u64, 1 );
+    residency.on_allocation( 0x1000, 16, 2 );
+    residency.on_allocation( 0x2000, 16, 3 );
+    residency.on_free( 0x2000 );
+
+    let mut buffer = Vec::new();
+    residency.write_samples( Timestamp::from_secs( 1 ), &mut buffer ).unwrap();
+    unsafe {
+        libc::munmap( pointer, length );
+    }
+
+    match Event::read_from_buffer( &buffer ).unwrap() {
+        Event::ResidencySamples { timestamp, entries, .. } => {
+            assert_eq!( timestamp, Timestamp::from_secs( 1 ) );
+            assert_eq!( entries.len(), 1 );
+            let entry = &entries[ 0 ];
+            assert_eq!( entry.backtrace, 1 );
+            assert_eq!( entry.allocation_count, 1 );
+            assert_eq!( entry.allocated_size, length as u64 );
+            assert_eq!( entry.pages, 16 );
+            assert_eq!( entry.resident_pages, 4 );
+            assert_eq!( entry.swapped_pages, 0 );
+        },
+        _ => unreachable!()
+    }
+}
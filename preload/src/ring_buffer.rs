@@ -0,0 +1,142 @@
+use std::cell::UnsafeCell;
+use std::mem::MaybeUninit;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use crate::utils::CacheAligned;
+
+/// A bounded, lock-free, single-producer single-consumer ring buffer.
+///
+/// The producer only ever writes to `tail` and the consumer only ever writes to `head`,
+/// so pushing an element is just a couple of plain stores and an acquire load.
+pub struct RingBuffer< T > {
+    head: CacheAligned< AtomicUsize >,
+    tail: CacheAligned< AtomicUsize >,
+    mask: usize,
+    buffer: Box< [UnsafeCell< MaybeUninit< T > >] >
+}
+
+unsafe impl< T > Send for RingBuffer< T > where T: Send {}
+unsafe impl< T > Sync for RingBuffer< T > where T: Send {}
+
+impl< T > RingBuffer< T > {
+    pub fn new( capacity: usize ) -> Self {
+        let capacity = std::cmp::max( capacity, 1 ).next_power_of_two();
+        let buffer = (0..capacity).map( |_| UnsafeCell::new( MaybeUninit::uninit() ) ).collect();
+
+        RingBuffer {
+            head: CacheAligned( AtomicUsize::new( 0 ) ),
+            tail: CacheAligned( AtomicUsize::new( 0 ) ),
+            mask: capacity - 1,
+            buffer
+        }
+    }
+
+    #[inline]
+    pub fn capacity( &self ) -> usize {
+        self.mask + 1
+    }
+
+    #[inline]
+    pub fn is_empty( &self ) -> bool {
+        self.head.load( Ordering::Acquire ) == self.tail.load( Ordering::Acquire )
+    }
+
+    /// Pushes a new element at the end of the buffer.
+    ///
+    /// Returns the number of elements in the buffer (including the new one),
+    /// or gives the value back if the buffer is full.
+    ///
+    /// # Safety
+    ///
+    /// Must never be called concurrently from more than one thread.
+    #[inline(always)]
+    pub unsafe fn push( &self, value: T ) -> Result< usize, T > {
+        let tail = self.tail.load( Ordering::Relaxed );
+        let head = self.head.load( Ordering::Acquire );
+        let length = tail.wrapping_sub( head );
+        if length > self.mask {
+            return Err( value );
+        }
+
+        (*self.buffer[ tail & self.mask ].get()).as_mut_ptr().write( value );
+        self.tail.store( tail.wrapping_add( 1 ), Ordering::Release );
+
+        Ok( length + 1 )
+    }
+
+    /// Moves every element currently in the buffer into `output`.
+    ///
+    /// Returns the number of elements which were moved.
+    ///
+    /// # Safety
+    ///
+    /// Must never be called concurrently from more than one thread.
+    pub unsafe fn drain_into( &self, output: &mut Vec< T > ) -> usize {
+        let head = self.head.load( Ordering::Relaxed );
+        let tail = self.tail.load( Ordering::Acquire );
+        let count = tail.wrapping_sub( head );
+        if count == 0 {
+            return 0;
+        }
+
+        output.reserve( count );
+        for nth in 0..count {
+            let index = head.wrapping_add( nth ) & self.mask;
+            output.push( (*self.buffer[ index ].get()).as_ptr().read() );
+        }
+
+        self.head.store( tail, Ordering::Release );
+        count
+    }
+}
+
+impl< T > Drop for RingBuffer< T > {
+    fn drop( &mut self ) {
+        let head = *self.head.get_mut();
+        let tail = *self.tail.get_mut();
+        let mut index = head;
+        while index != tail {
+            unsafe {
+                std::ptr::drop_in_place( (*self.buffer[ index & self.mask ].get()).as_mut_ptr() );
+            }
+            index = index.wrapping_add( 1 );
+        }
+    }
+}
+
+#[test]
+fn test_ring_buffer_push_and_drain() {
+    let ring = RingBuffer::new( 3 );
+    assert_eq!( ring.capacity(), 4 );
+    assert!( ring.is_empty() );
+
+    let mut output = Vec::new();
+    unsafe {
+        for round in 0..3 {
+            for nth in 0..4 {
+                assert_eq!( ring.push( round * 10 + nth ), Ok( nth as usize + 1 ) );
+            }
+            assert_eq!( ring.push( 100 ), Err( 100 ) );
+            assert_eq!( ring.drain_into( &mut output ), 4 );
+            assert!( ring.is_empty() );
+        }
+    }
+
+    assert_eq!( output, vec![ 0, 1, 2, 3, 10, 11, 12, 13, 20, 21, 22, 23 ] );
+}
+
+#[test]
+fn test_ring_buffer_drops_leftover_elements() {
+    use std::sync::Arc;
+
+    let value = Arc::new( () );
+    {
+        let ring = RingBuffer::new( 8 );
+        unsafe {
+            ring.push( value.clone() ).unwrap();
+            ring.push( value.clone() ).unwrap();
+        }
+        assert_eq!( Arc::strong_count( &value ), 3 );
+    }
+    assert_eq!( Arc::strong_count( &value ), 1 );
+}
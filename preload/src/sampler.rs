@@ -0,0 +1,68 @@
+/// Decides which allocations should be sampled.
+///
+/// On average one allocation is sampled every `interval` bytes; the distance
+/// between each sample is randomized using a geometric distribution, so that
+/// an allocation of `size` bytes is sampled with a probability of `1 - exp( -size / interval )`.
+pub struct Sampler {
+    rng_state: u64,
+    bytes_until_sample: usize
+}
+
+impl Sampler {
+    pub const fn new( seed: u64 ) -> Self {
+        Sampler {
+            // The xorshift generator gets stuck if its state is zero.
+            rng_state: seed | 1,
+            bytes_until_sample: 0
+        }
+    }
+
+    fn next_random( &mut self ) -> u64 {
+        // This is xorshift64*.
+        let mut x = self.rng_state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        self.rng_state = x;
+        x.wrapping_mul( 0x2545F4914F6CDD1D )
+    }
+
+    fn next_interval( &mut self, interval: usize ) -> usize {
+        // A uniformly distributed value in the range of (0, 1].
+        let uniform = ((self.next_random() >> 11) + 1) as f64 / (1_u64 << 53) as f64;
+        (-uniform.ln() * interval as f64) as usize
+    }
+
+    pub fn reset( &mut self, interval: usize ) {
+        self.bytes_until_sample = self.next_interval( interval );
+    }
+
+    #[inline(always)]
+    pub fn should_sample( &mut self, size: usize, interval: usize ) -> bool {
+        if self.bytes_until_sample > size {
+            self.bytes_until_sample -= size;
+            return false;
+        }
+
+        self.reset( interval );
+        true
+    }
+}
+
+#[test]
+fn test_sampler_average_interval() {
+    let interval = 4096;
+    let mut sampler = Sampler::new( 1234 );
+    sampler.reset( interval );
+
+    let mut count = 0;
+    let total = 64 * 1024 * 1024;
+    for _ in 0..total / 16 {
+        if sampler.should_sample( 16, interval ) {
+            count += 1;
+        }
+    }
+
+    let expected = total / interval;
+    assert!( count > expected * 9 / 10 && count < expected * 11 / 10, "count = {}, expected = {}", count, expected );
+}
@@ -0,0 +1,117 @@
+//! A reader-writer lock which is split into multiple independent shards.
+//!
+//! Every reader only ever touches the shard it was given, so readers on different threads
+//! don't keep on bouncing the same cache line between the cores. A writer has to take every
+//! shard, so this only makes sense for something which is read all the time and written rarely.
+
+use std::cell::UnsafeCell;
+use std::ops::{Deref, DerefMut};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{RwLock, RwLockReadGuard, RwLockWriteGuard};
+
+use crate::utils::CacheAligned;
+
+const SHARD_COUNT: usize = 16;
+
+pub struct ShardedRwLock< T > {
+    shards: Vec< CacheAligned< RwLock< () > > >,
+    value: UnsafeCell< T >
+}
+
+unsafe impl< T > Send for ShardedRwLock< T > where T: Send {}
+unsafe impl< T > Sync for ShardedRwLock< T > where T: Send + Sync {}
+
+pub struct ShardedRwLockReadGuard< 'a, T > {
+    _guard: RwLockReadGuard< 'a, () >,
+    value: &'a T
+}
+
+pub struct ShardedRwLockWriteGuard< 'a, T > {
+    _guards: Vec< RwLockWriteGuard< 'a, () > >,
+    value: &'a mut T
+}
+
+/// Picks a shard for a new reader, spreading the readers evenly over all of the shards.
+pub fn next_shard() -> usize {
+    static COUNTER: AtomicUsize = AtomicUsize::new( 0 );
+    COUNTER.fetch_add( 1, Ordering::Relaxed ) % SHARD_COUNT
+}
+
+impl< T > ShardedRwLock< T > {
+    pub fn new( value: T ) -> Self {
+        ShardedRwLock {
+            shards: (0..SHARD_COUNT).map( |_| CacheAligned( RwLock::new( () ) ) ).collect(),
+            value: UnsafeCell::new( value )
+        }
+    }
+
+    pub fn read( &self, shard: usize ) -> ShardedRwLockReadGuard< T > {
+        ShardedRwLockReadGuard {
+            _guard: self.shards[ shard % SHARD_COUNT ].read().unwrap(),
+            value: unsafe { &*self.value.get() }
+        }
+    }
+
+    pub fn write( &self ) -> ShardedRwLockWriteGuard< T > {
+        // Always lock the shards in the same order so that two writers can't deadlock.
+        let guards = self.shards.iter().map( |shard| shard.write().unwrap() ).collect();
+        ShardedRwLockWriteGuard {
+            _guards: guards,
+            value: unsafe { &mut *self.value.get() }
+        }
+    }
+}
+
+impl< 'a, T > Deref for ShardedRwLockReadGuard< 'a, T > {
+    type Target = T;
+
+    #[inline(always)]
+    fn deref( &self ) -> &Self::Target {
+        self.value
+    }
+}
+
+impl< 'a, T > Deref for ShardedRwLockWriteGuard< 'a, T > {
+    type Target = T;
+
+    #[inline(always)]
+    fn deref( &self ) -> &Self::Target {
+        self.value
+    }
+}
+
+impl< 'a, T > DerefMut for ShardedRwLockWriteGuard< 'a, T > {
+    #[inline(always)]
+    fn deref_mut( &mut self ) -> &mut Self::Target {
+        self.value
+    }
+}
+
+#[test]
+fn test_sharded_rwlock() {
+    use std::sync::Arc;
+
+    let lock = Arc::new( ShardedRwLock::new( (0_u64, 0_u64) ) );
+    let threads: Vec< _ > = (0..8).map( |nth| {
+        let lock = lock.clone();
+        std::thread::spawn( move || {
+            let shard = next_shard();
+            for _ in 0..1000 {
+                if nth % 2 == 0 {
+                    let mut value = lock.write();
+                    value.0 += 1;
+                    value.1 += 1;
+                } else {
+                    let value = lock.read( shard );
+                    assert_eq!( value.0, value.1 );
+                }
+            }
+        })
+    }).collect();
+
+    for thread in threads {
+        thread.join().unwrap();
+    }
+
+    assert_eq!( *lock.read( 0 ), (4000, 4000) );
+}
@@ -2,7 +2,10 @@ use crate::utils::{HashMap, HashSet};
 use std::ops::Range;
 use std::io::{Read, Write};
 use std::borrow::Cow;
+use std::sync::atomic::{AtomicU64, Ordering};
 use common::event::{
+    CheckpointRegion,
+    HugePageFlags,
     RegionFlags,
     Event
 };
@@ -10,6 +13,8 @@ use common::speedy::Writable;
 use crate::timestamp::Timestamp;
 use crate::processing_thread::BacktraceCache;
 use crate::unwind::Backtrace;
+use crate::spin_lock::SpinLock;
+use crate::utils::CacheAligned;
 
 #[derive(Copy, Clone, PartialEq, Eq)]
 #[repr(u8)]
@@ -27,6 +32,14 @@ impl MapKind {
             MapKind::Glibc => "glibc"
         }
     }
+
+    fn as_region_name( self ) -> &'static str {
+        match self {
+            MapKind::Mmap => "[anon:mmap]",
+            MapKind::Jemalloc => "[anon:jemalloc]",
+            MapKind::Glibc => "[anon:glibc]"
+        }
+    }
 }
 
 #[derive(Copy, Clone)]
@@ -66,6 +79,10 @@ pub fn construct_name( id: u64, kind: &str ) -> crate::utils::Buffer< 32 > {
 
 const CULLING_THRESHOLD: Timestamp = Timestamp::from_secs( 1 );
 
+/// The maximum number of consecutive scans which can be skipped
+/// because nothing seems to have changed since the last full scan.
+const MAXIMUM_SKIPPED_SCANS: u32 = 10;
+
 fn get_until< 'a >( p: &mut &'a str, delimiter: char ) -> &'a str {
     let mut found = None;
     for (index, ch) in p.char_indices() {
@@ -127,12 +144,143 @@ struct Mmap {
     source: MapSource
 }
 
+/// The number of times `mmap` or `munmap` was called, as logged for the `MapsRegistry`.
+static MAP_ACTIVITY_COUNTER: AtomicU64 = AtomicU64::new( 0 );
+
+enum MapOperation {
+    Mmap {
+        id: u64,
+        range: Range< u64 >,
+        source: MapSource,
+        requested_address: u64,
+        mmap_protection: u32,
+        mmap_flags: u32,
+        file_descriptor: u32,
+        offset: u64
+    },
+    Munmap {
+        range: Range< u64 >,
+        source: MapSource
+    },
+    SetName {
+        range: Range< u64 >,
+        name: CompactName
+    },
+    ClearName {
+        range: Range< u64 >
+    }
+}
+
+struct LogEntry {
+    ticket: u64,
+    /// `None` if the operation hasn't finished yet.
+    operation: Option< MapOperation >
+}
+
+// The `mmap`s and `munmap`s are only logged here, and are applied to the `MapsRegistry` later
+// by the processing thread, so that the threads which call them don't have to wait on each other.
+//
+// Every operation gets a ticket which determines the order in which it'll be applied.
+// An `munmap` takes its ticket *before* the syscall and an `mmap` *after* it, so when an `mmap`
+// returns memory which was just unmapped by another thread the `munmap` always goes first.
+const LOG_SHARD_COUNT: usize = 32;
+
+#[allow(clippy::declare_interior_mutable_const)]
+const EMPTY_LOG_SHARD: CacheAligned< SpinLock< Vec< LogEntry > > > = CacheAligned( SpinLock::new( Vec::new() ) );
+static MAPS_LOG: [CacheAligned< SpinLock< Vec< LogEntry > > >; LOG_SHARD_COUNT] = [EMPTY_LOG_SHARD; LOG_SHARD_COUNT];
+static NEXT_TICKET: AtomicU64 = AtomicU64::new( 1 );
+
+/// An operation on the maps which was started, but hasn't finished yet.
+///
+/// Every operation which is logged after this one was started will only be applied after this is finished.
+#[must_use]
+pub struct PendingMapOperation {
+    shard: usize,
+    ticket: u64
+}
+
+pub fn begin_map_operation() -> PendingMapOperation {
+    // Every thread has its own stack, so this is a cheap way to spread the threads over the shards.
+    let marker = 0_u8;
+    let shard = ((&marker as *const u8 as usize) >> 16) % LOG_SHARD_COUNT;
+
+    let mut log = MAPS_LOG[ shard ].lock();
+    let ticket = NEXT_TICKET.fetch_add( 1, Ordering::Relaxed );
+    log.push( LogEntry { ticket, operation: None } );
+
+    PendingMapOperation { shard, ticket }
+}
+
+impl PendingMapOperation {
+    fn finish( self, operation: Option< MapOperation > ) {
+        let mut log = MAPS_LOG[ self.shard ].lock();
+        let index = log.iter().rposition( |entry| entry.ticket == self.ticket ).unwrap();
+        if operation.is_some() {
+            log[ index ].operation = operation;
+        } else {
+            log.swap_remove( index );
+        }
+    }
+
+    pub fn on_munmap( self, range: Range< u64 >, source: MapSource ) {
+        MAP_ACTIVITY_COUNTER.fetch_add( 1, Ordering::Relaxed );
+        self.finish( Some( MapOperation::Munmap { range, source } ) );
+    }
+
+    pub fn clear_vma_name( self, pointer: *mut libc::c_void, length: usize ) {
+        self.finish( Some( MapOperation::ClearName { range: pointer as u64..pointer as u64 + length as u64 } ) );
+    }
+
+    pub fn cancel( self ) {
+        self.finish( None );
+    }
+}
+
+pub fn on_mmap(
+    id: u64,
+    range: Range< u64 >,
+    source: MapSource,
+    requested_address: u64,
+    mmap_protection: u32,
+    mmap_flags: u32,
+    file_descriptor: u32,
+    offset: u64
+) {
+    MAP_ACTIVITY_COUNTER.fetch_add( 1, Ordering::Relaxed );
+    begin_map_operation().finish( Some( MapOperation::Mmap {
+        id,
+        range,
+        source,
+        requested_address,
+        mmap_protection,
+        mmap_flags,
+        file_descriptor,
+        offset
+    }));
+}
+
+pub fn set_vma_name( pointer: *mut libc::c_void, length: usize, id: u64, kind: MapKind ) {
+    if crate::global::is_pr_set_vma_anon_name_supported() {
+        let name = construct_name( id, kind.as_str() );
+
+        unsafe {
+            crate::syscall::pr_set_vma_anon_name( pointer, length, &name );
+        }
+    } else {
+        let range = pointer as u64..pointer as u64 + length as u64;
+        begin_map_operation().finish( Some( MapOperation::SetName { range, name: CompactName::new( id, kind ) } ) );
+    }
+}
+
 pub struct MapsRegistry {
     emulated_vma_name_map: fast_range_map::RangeMap< CompactName >,
 
     mmap_by_address: fast_range_map::RangeMap< MapBucket >,
     munmap_by_address: fast_range_map::RangeMap< MapBucket >,
     mmaps: HashMap< u64, Mmap >,
+
+    /// The operations which were taken out of the log but which can't be applied yet.
+    deferred_operations: Vec< LogEntry >
 }
 
 impl MapsRegistry {
@@ -142,32 +290,54 @@ impl MapsRegistry {
             mmap_by_address: fast_range_map::RangeMap::new(),
             munmap_by_address: fast_range_map::RangeMap::new(),
             mmaps: crate::utils::empty_hashmap(),
+            deferred_operations: Vec::new()
         }
     }
 
-    pub fn set_vma_name( &mut self, pointer: *mut libc::c_void, length: usize, id: u64, kind: MapKind ) {
-        if crate::global::is_pr_set_vma_anon_name_supported() {
-            let name = construct_name( id, kind.as_str() );
-
-            unsafe {
-                crate::syscall::pr_set_vma_anon_name( pointer, length, &name );
+    /// Applies every operation from the log which can be applied.
+    fn apply_log( &mut self ) {
+        // Anything which starts after this will get a later ticket, so it can't be missed.
+        let limit = NEXT_TICKET.load( Ordering::Relaxed );
+        let mut watermark = limit;
+
+        let mut entries = std::mem::take( &mut self.deferred_operations );
+        for shard in MAPS_LOG.iter() {
+            let mut log = shard.lock();
+            let mut index = 0;
+            while index < log.len() {
+                if log[ index ].operation.is_none() {
+                    watermark = std::cmp::min( watermark, log[ index ].ticket );
+                    index += 1;
+                } else {
+                    entries.push( log.swap_remove( index ) );
+                }
             }
-        } else {
-            self.set_vma_name_slow( pointer, length, CompactName::new( id, kind ) );
         }
-    }
 
-    fn set_vma_name_slow( &mut self, pointer: *const libc::c_void, length: usize, name: CompactName ) {
-        self.emulated_vma_name_map.insert( pointer as u64..pointer as u64 + length as u64, name );
-    }
-
-    pub fn clear_vma_name( &mut self, pointer: *mut libc::c_void, length: usize ) {
-        if !crate::global::is_pr_set_vma_anon_name_supported() {
-            self.emulated_vma_name_map.remove( pointer as u64..pointer as u64 + length as u64 );
+        // Everything after the first operation which hasn't finished yet has to wait for it.
+        entries.sort_unstable_by_key( |entry| entry.ticket );
+        let ready = entries.partition_point( |entry| entry.ticket < watermark );
+        self.deferred_operations = entries.split_off( ready );
+
+        for entry in entries {
+            match entry.operation.unwrap() {
+                MapOperation::Mmap { id, range, source, requested_address, mmap_protection, mmap_flags, file_descriptor, offset } => {
+                    self.on_mmap( id, range, source, requested_address, mmap_protection, mmap_flags, file_descriptor, offset );
+                },
+                MapOperation::Munmap { range, source } => {
+                    self.on_munmap( range, source );
+                },
+                MapOperation::SetName { range, name } => {
+                    self.emulated_vma_name_map.insert( range, name );
+                },
+                MapOperation::ClearName { range } => {
+                    self.emulated_vma_name_map.remove( range );
+                }
+            }
         }
     }
 
-    pub fn on_mmap(
+    fn on_mmap(
         &mut self,
         id: u64,
         range: Range< u64 >,
@@ -217,7 +387,7 @@ impl MapsRegistry {
         });
     }
 
-    pub fn on_munmap( &mut self, range: Range< u64 >, source: MapSource ) {
+    fn on_munmap( &mut self, range: Range< u64 >, source: MapSource ) {
         trace!( "On mummap: 0x{:016X}..0x{:016X}, pages = {}", range.start, range.end, (range.end - range.start) / 4096 );
 
         if !crate::global::is_pr_set_vma_anon_name_supported() {
@@ -231,7 +401,112 @@ impl MapsRegistry {
     }
 }
 
+/// The minimum change of RSS, in bytes, which is considered significant.
+const MINIMUM_RSS_CHANGE: u64 = 1024 * 1024;
+
+/// Returns the current RSS of the process, in bytes.
+pub(crate) fn read_rss() -> Option< u64 > {
+    let mut buffer = [0; 128];
+    let mut fp = std::fs::File::open( "/proc/self/statm" ).ok()?;
+    let length = fp.read( &mut buffer ).ok()?;
+    let statm = std::str::from_utf8( &buffer[ ..length ] ).ok()?;
+    let pages: u64 = statm.split( ' ' ).nth( 1 )?.trim().parse().ok()?;
+    Some( pages * crate::PAGE_SIZE as u64 )
+}
+
+/// Decides how often smaps should be scanned.
+///
+/// The interval is halved after every scan which was preceded by calls to `mmap`/`munmap`
+/// or by a significant change of RSS, and is doubled after every scan which wasn't,
+/// always staying within the configured bounds. A sudden change of RSS also triggers
+/// a scan immediately, as long as the minimum interval has passed.
+pub struct Cadence {
+    minimum_interval: u64,
+    maximum_interval: u64,
+    interval: u64,
+    last_activity: u64,
+    last_rss: u64
+}
+
+impl Cadence {
+    /// The intervals are in milliseconds.
+    pub fn new( minimum_interval: u64, maximum_interval: u64 ) -> Self {
+        let maximum_interval = std::cmp::max( minimum_interval, maximum_interval );
+        Cadence {
+            minimum_interval,
+            maximum_interval,
+            interval: std::cmp::min( std::cmp::max( 1000, minimum_interval ), maximum_interval ),
+            last_activity: MAP_ACTIVITY_COUNTER.load( Ordering::Relaxed ),
+            last_rss: 0
+        }
+    }
+
+    fn is_significant_rss_change( &self, rss: u64 ) -> bool {
+        let delta = if rss > self.last_rss { rss - self.last_rss } else { self.last_rss - rss };
+        delta >= std::cmp::max( self.last_rss / 32, MINIMUM_RSS_CHANGE )
+    }
+
+    /// Returns whether smaps should be scanned given the time since the last scan, in milliseconds.
+    pub fn is_due( &self, elapsed: u64 ) -> bool {
+        if elapsed >= self.interval {
+            return true;
+        }
+
+        if elapsed < self.minimum_interval {
+            return false;
+        }
+
+        read_rss().map( |rss| self.is_significant_rss_change( rss ) ).unwrap_or( false )
+    }
+
+    pub fn on_scanned( &mut self ) {
+        let activity = MAP_ACTIVITY_COUNTER.load( Ordering::Relaxed );
+        let rss = read_rss().unwrap_or( self.last_rss );
+        self.on_scanned_with( activity, rss );
+    }
+
+    fn on_scanned_with( &mut self, activity: u64, rss: u64 ) {
+        let is_busy = activity != self.last_activity || self.is_significant_rss_change( rss );
+        if is_busy {
+            self.interval = std::cmp::max( self.interval / 2, self.minimum_interval );
+        } else {
+            self.interval = std::cmp::min( self.interval.saturating_mul( 2 ), self.maximum_interval );
+        }
+
+        self.last_activity = activity;
+        self.last_rss = rss;
+    }
+}
+
+#[test]
+fn test_cadence() {
+    let mut cadence = Cadence::new( 250, 8000 );
+    cadence.last_activity = 0;
+    cadence.on_scanned_with( 0, 100 * 1024 * 1024 );
+    assert_eq!( cadence.interval, 500 );
+
+    cadence.on_scanned_with( 0, 100 * 1024 * 1024 );
+    assert_eq!( cadence.interval, 1000 );
+
+    for _ in 0..10 {
+        cadence.on_scanned_with( 0, 100 * 1024 * 1024 );
+    }
+    assert_eq!( cadence.interval, 8000 );
+    assert!( !cadence.is_significant_rss_change( 101 * 1024 * 1024 ) );
+    assert!( cadence.is_significant_rss_change( 110 * 1024 * 1024 ) );
+
+    cadence.on_scanned_with( 1, 100 * 1024 * 1024 );
+    assert_eq!( cadence.interval, 4000 );
+
+    cadence.on_scanned_with( 1, 90 * 1024 * 1024 );
+    assert_eq!( cadence.interval, 2000 );
+
+    assert!( !cadence.is_due( 100 ) );
+    assert!( cadence.is_due( 2000 ) );
+}
+
 type RegionVec = smallvec::SmallVec< [Region; 1] >;
+type FoundRegionVec = smallvec::SmallVec< [FoundRegion; 1] >;
 type SourcesVec = smallvec::SmallVec< [RegionRemovalSource; 1] >;
 
 struct Map {
@@ -269,6 +544,17 @@ enum PendingEvent {
     }
 }
 
+impl PendingEvent {
+    fn epoch( &self ) -> u64 {
+        match *self {
+            PendingEvent::Mmap { epoch, .. } |
+            PendingEvent::AddRegion { epoch, .. } |
+            PendingEvent::UpdateUsage { epoch, .. } |
+            PendingEvent::RemoveRegion { epoch, .. } => epoch
+        }
+    }
+}
+
 struct PendingMap {
     earliest_timestamp: Timestamp,
     events: smallvec::SmallVec< [PendingEvent; 1] >
@@ -284,7 +570,7 @@ struct RegionInfo {
     minor: u32,
 }
 
-#[derive(PartialEq, Eq, Clone, Debug)]
+#[derive(PartialEq, Eq, Clone, Default, Debug)]
 struct RegionUsage {
     anonymous: u64,
     shared_clean: u64,
@@ -292,6 +578,25 @@ struct RegionUsage {
     private_clean: u64,
     private_dirty: u64,
     swap: u64,
+    anon_huge_pages: u64,
+    shmem_pmd_mapped: u64,
+    file_pmd_mapped: u64,
+    /// This is only there for the regions; the rollup has no `VmFlags`.
+    huge_page_flags: HugePageFlags,
+}
+
+impl RegionUsage {
+    fn add( &mut self, other: &RegionUsage ) {
+        self.anonymous += other.anonymous;
+        self.shared_clean += other.shared_clean;
+        self.shared_dirty += other.shared_dirty;
+        self.private_clean += other.private_clean;
+        self.private_dirty += other.private_dirty;
+        self.swap += other.swap;
+        self.anon_huge_pages += other.anon_huge_pages;
+        self.shmem_pmd_mapped += other.shmem_pmd_mapped;
+        self.file_pmd_mapped += other.file_pmd_mapped;
+    }
 }
 
 #[derive(Debug)]
@@ -302,6 +607,113 @@ struct Region {
     last_usage: RegionUsage,
 }
 
+/// The name of a region which was just parsed, without making a copy of it.
+#[derive(Clone, Debug)]
+enum RegionName {
+    /// A range within the raw contents of smaps.
+    Raw( Range< usize > ),
+    /// A range within the buffer with the names we had to clean up.
+    Cleaned( Range< usize > ),
+    Static( &'static str )
+}
+
+impl RegionName {
+    fn resolve< 'a >( &self, smaps: &'a str, cleaned_names: &'a str ) -> &'a str {
+        match *self {
+            RegionName::Raw( ref range ) => &smaps[ range.clone() ],
+            RegionName::Cleaned( ref range ) => &cleaned_names[ range.clone() ],
+            RegionName::Static( name ) => name
+        }
+    }
+}
+
+/// A region which was just parsed.
+#[derive(Debug)]
+struct FoundRegion {
+    info: RegionInfo,
+    name: RegionName,
+    flags: RegionFlags,
+    usage: RegionUsage,
+}
+
+impl FoundRegion {
+    fn into_region( self, name: String ) -> Region {
+        Region {
+            info: self.info,
+            name,
+            last_flags: self.flags,
+            last_usage: self.usage
+        }
+    }
+}
+
+/// A cheap summary of smaps which is used to check whether anything's changed since the last scan.
+#[derive(PartialEq, Eq, Clone, Default, Debug)]
+struct Snapshot {
+    /// A hash of the list of the maps, as seen in `/proc/self/maps`.
+    layout: u64,
+    /// The total usage of all of the maps, as seen in `/proc/self/smaps_rollup`.
+    usage: RegionUsage
+}
+
+const LAYOUT_HASH_SEED: u64 = 0xcbf29ce484222325;
+
+fn hash_layout_line( hash: u64, line: &str ) -> u64 {
+    // This is FNV-1a.
+    line.trim_end().as_bytes().iter().fold( hash, |hash, &byte| (hash ^ byte as u64).wrapping_mul( 0x100000001b3 ) )
+}
+
+fn hash_layout( maps: &str ) -> u64 {
+    maps.trim().split( "\n" ).fold( LAYOUT_HASH_SEED, hash_layout_line )
+}
+
+/// Parses the `Key: value kB` lines following a header until the next header.
+fn parse_usage< 'a >( lines: &mut std::iter::Peekable< impl Iterator< Item = &'a str > > ) -> (u64, RegionUsage) {
+    let mut rss = 0;
+    let mut usage = RegionUsage::default();
+    while let Some( line ) = lines.peek() {
+        let mut line = *line;
+        let key = get_until( &mut line, ':' );
+        if key.as_bytes().contains( &b' ' ) {
+            break;
+        }
+
+        skip_whitespace( &mut line );
+        if key == "VmFlags" {
+            for flag in line.split_whitespace() {
+                match flag {
+                    "hg" => usage.huge_page_flags.insert( HugePageFlags::HUGEPAGE ),
+                    "nh" => usage.huge_page_flags.insert( HugePageFlags::NOHUGEPAGE ),
+                    _ => {}
+                }
+            }
+
+            lines.next();
+            continue;
+        }
+
+        let value = get_until( &mut line, ' ' );
+
+        match key {
+            "Rss" => rss = value.parse().unwrap(),
+            "Shared_Clean" => usage.shared_clean = value.parse().unwrap(),
+            "Shared_Dirty" => usage.shared_dirty = value.parse().unwrap(),
+            "Private_Clean" => usage.private_clean = value.parse().unwrap(),
+            "Private_Dirty" => usage.private_dirty = value.parse().unwrap(),
+            "Anonymous" => usage.anonymous = value.parse().unwrap(),
+            "Swap" => usage.swap = value.parse().unwrap(),
+            "AnonHugePages" => usage.anon_huge_pages = value.parse().unwrap(),
+            "ShmemPmdMapped" => usage.shmem_pmd_mapped = value.parse().unwrap(),
+            "FilePmdMapped" => usage.file_pmd_mapped = value.parse().unwrap(),
+            _ => {}
+        }
+
+        lines.next();
+    }
+
+    (rss, usage)
+}
+
 struct RegionRemovalSource {
     address: u64,
     length: u64,
@@ -314,16 +726,27 @@ pub struct State {
     tmp_munmap_by_address: fast_range_map::RangeMap< MapBucket >,
     tmp_mmaps: HashMap< u64, Mmap >,
     tmp_buffer: Vec< u8 >,
-    tmp_found_maps: HashMap< u64, RegionVec >,
+    tmp_cleaned_names: String,
+    tmp_region_info_to_id: HashMap< RegionInfo, (u64, usize) >,
+    tmp_found_maps: HashMap< u64, FoundRegionVec >,
     tmp_new_map_by_id: HashMap< u64, Map >,
     tmp_all_new_events: Vec< PendingEvent >,
     tmp_emulated_vma_name_map: fast_range_map::RangeMap< CompactName >,
     tmp_padding_maps: Vec< (u64, u64) >,
     tmp_seen_maps: HashSet< u64 >,
 
+    // Since smaps is read before the registry is drained these can arrive one scan late,
+    // so whatever wasn't matched during the last scan is kept around for one more.
+    previous_munmap_by_address: fast_range_map::RangeMap< MapBucket >,
+    previous_mmaps: HashMap< u64, Mmap >,
+
     map_by_id: HashMap< u64, Map >,
     pending: HashMap< u64, PendingMap >,
     epoch: u64,
+
+    last_snapshot: Snapshot,
+    skipped_scans: u32,
+    is_rollup_unsupported: bool,
 }
 
 impl State {
@@ -338,11 +761,24 @@ impl State {
         state
     }
 
+    /// Returns the regions of all of the maps which were already written out.
+    pub fn emitted_regions( &self ) -> impl Iterator< Item = CheckpointRegion > + '_ {
+        self.map_by_id.iter()
+            .filter( move |(id, _)| !self.pending.contains_key( id ) )
+            .flat_map( |(&map_id, map)| map.regions.iter().map( move |region| CheckpointRegion {
+                map_id,
+                address: region.info.address,
+                length: region.info.length
+            }))
+    }
+
     fn clear_ephemeral( &mut self ) {
         self.tmp_mmap_by_address.clear();
         self.tmp_munmap_by_address.clear();
         self.tmp_mmaps.clear();
         self.tmp_buffer.clear();
+        self.tmp_cleaned_names.clear();
+        self.tmp_region_info_to_id.clear();
         self.tmp_found_maps.clear();
         self.tmp_new_map_by_id.clear();
         self.tmp_all_new_events.clear();
@@ -407,7 +843,7 @@ fn emit_usage(
     usage: RegionUsage,
     serializer: &mut impl Write
 ) {
-    let _ = Event::UpdateRegionUsage {
+    let _ = Event::UpdateRegionUsageEx {
         timestamp,
         map_id,
         address,
@@ -418,6 +854,10 @@ fn emit_usage(
         private_clean: usage.private_clean,
         private_dirty: usage.private_dirty,
         swap: usage.swap,
+        anon_huge_pages: usage.anon_huge_pages,
+        shmem_pmd_mapped: usage.shmem_pmd_mapped,
+        file_pmd_mapped: usage.file_pmd_mapped,
+        huge_page_flags: usage.huge_page_flags,
     }.write_to_stream( &mut *serializer );
 }
 
@@ -499,6 +939,7 @@ fn emit_events( backtrace_cache: &mut BacktraceCache, serializer: &mut impl Writ
 
 fn generate_unmaps(
     tmp_munmap_by_address: &fast_range_map::RangeMap< MapBucket >,
+    previous_munmap_by_address: &fast_range_map::RangeMap< MapBucket >,
     timestamp: Timestamp,
     epoch: u64,
     id: u64,
@@ -511,14 +952,22 @@ fn generate_unmaps(
     let mut sources = SourcesVec::new();
 
     // Let's try to find which calls resulted in its disappearance.
-    for (unmap_range, unmap_bucket) in tmp_munmap_by_address.get_in_range( address_start..address_end ) {
-        trace!( "Found a source for an unmap: 0x{:016X}..0x{:016X}, id = {}, pages = {}", unmap_range.start, unmap_range.end, id, (unmap_range.end - unmap_range.start) / 4096 );
+    //
+    // If smaps was read right before the region was unmapped then it was recorded during the previous scan.
+    for munmap_by_address in [tmp_munmap_by_address, previous_munmap_by_address] {
+        for (unmap_range, unmap_bucket) in munmap_by_address.get_in_range( address_start..address_end ) {
+            trace!( "Found a source for an unmap: 0x{:016X}..0x{:016X}, id = {}, pages = {}", unmap_range.start, unmap_range.end, id, (unmap_range.end - unmap_range.start) / 4096 );
+
+            sources.push( RegionRemovalSource {
+                address: unmap_range.start,
+                length: unmap_range.end - unmap_range.start,
+                source: unmap_bucket.source.clone()
+            });
+        }
 
-        sources.push( RegionRemovalSource {
-            address: unmap_range.start,
-            length: unmap_range.end - unmap_range.start,
-            source: unmap_bucket.source.clone()
-        });
+        if !sources.is_empty() {
+            break;
+        }
     }
 
     output.push( PendingEvent::RemoveRegion {
@@ -531,45 +980,110 @@ fn generate_unmaps(
     });
 }
 
+fn read_file( path: &str, buffer: &mut Vec< u8 > ) -> std::io::Result< () > {
+    buffer.clear();
+    let mut fp = std::fs::File::open( path )?;
+    fp.read_to_end( buffer )?;
+    Ok(())
+}
+
+/// Cheaply checks whether anything could have changed since the last full scan.
+///
+/// Neither `/proc/self/maps` nor `/proc/self/smaps_rollup` have to format the
+/// usage of every map, so reading them is a lot cheaper than reading smaps.
+fn is_rescan_necessary( state: &mut State, is_registry_dirty: bool ) -> bool {
+    if is_registry_dirty || state.is_rollup_unsupported || state.skipped_scans >= MAXIMUM_SKIPPED_SCANS {
+        return true;
+    }
+
+    if read_file( "/proc/self/maps", &mut state.tmp_buffer ).is_err() {
+        return true;
+    }
+
+    let layout = match std::str::from_utf8( &state.tmp_buffer ) {
+        Ok( maps ) => hash_layout( maps ),
+        Err( _ ) => return true
+    };
+
+    if layout != state.last_snapshot.layout {
+        return true;
+    }
+
+    if let Err( error ) = read_file( "/proc/self/smaps_rollup", &mut state.tmp_buffer ) {
+        info!( "Failed to read /proc/self/smaps_rollup: {}; smaps will always be fully rescanned", error );
+        state.is_rollup_unsupported = true;
+        return true;
+    }
+
+    let rollup = match std::str::from_utf8( &state.tmp_buffer ) {
+        Ok( rollup ) => rollup,
+        Err( _ ) => return true
+    };
+
+    let mut lines = rollup.trim().split( "\n" ).peekable();
+    lines.next();
+
+    let (_, usage) = parse_usage( &mut lines );
+    usage != state.last_snapshot.usage
+}
+
 pub fn update_smaps(
     state: &mut State,
     backtrace_cache: &mut BacktraceCache,
     serializer: &mut impl Write,
     force_emit: bool,
 ) {
+    let is_registry_dirty = {
+        let mut maps_registry = crate::global::MMAP_REGISTRY.lock().unwrap();
+        maps_registry.apply_log();
+        !maps_registry.mmaps.is_empty() || !maps_registry.munmap_by_address.is_empty()
+    };
+
+    if !force_emit && !is_rescan_necessary( state, is_registry_dirty ) {
+        trace!( "Nothing has changed since the last scan; skipping smaps" );
+        state.skipped_scans += 1;
+        return;
+    }
+
     trace!( "Scanning smaps..." );
+    let _timer = crate::instrumentation::Timer::start( crate::instrumentation::Stage::SmapsScan );
 
+    std::mem::swap( &mut state.previous_munmap_by_address, &mut state.tmp_munmap_by_address );
     state.clear_ephemeral();
+    state.skipped_scans = 0;
     state.epoch += 1;
 
-    let timestamp;
+    if !crate::global::is_pr_set_vma_anon_name_supported() {
+        let mut maps_registry = crate::global::MMAP_REGISTRY.lock().unwrap();
+        maps_registry.apply_log();
+        maps_registry.emulated_vma_name_map.clone_into( &mut state.tmp_emulated_vma_name_map );
+    }
+
+    // This is done without holding the lock so that we don't block every other thread which calls `mmap`.
+    let timestamp = crate::timestamp::get_timestamp();
+    read_file( "/proc/self/smaps", &mut state.tmp_buffer ).expect( "failed to read smaps" );
+
     {
         let mut maps_registry = crate::global::MMAP_REGISTRY.lock().unwrap();
+        maps_registry.apply_log();
 
-        maps_registry.mmap_by_address.clone_into( &mut state.tmp_mmap_by_address );
+        if log_enabled!( ::log::Level::Trace ) {
+            maps_registry.mmap_by_address.clone_into( &mut state.tmp_mmap_by_address );
+        }
         std::mem::swap( &mut maps_registry.munmap_by_address, &mut state.tmp_munmap_by_address );
         maps_registry.munmap_by_address.clear();
         std::mem::swap( &mut maps_registry.mmaps, &mut state.tmp_mmaps );
         maps_registry.mmaps.clear();
-
-        maps_registry.emulated_vma_name_map.clone_into( &mut state.tmp_emulated_vma_name_map );
-
-        timestamp = crate::timestamp::get_timestamp();
-        let mut fp = std::fs::File::open( "/proc/self/smaps" ).expect( "failed to open smaps" );
-        fp.read_to_end( &mut state.tmp_buffer ).expect( "failed to read smaps" );
-
-        std::mem::drop( maps_registry );
-        std::mem::drop( fp );
-    };
+    }
 
     let smaps = std::str::from_utf8( &state.tmp_buffer ).expect( "failed to parse smaps as UTF-8" ); // TODO: This is probably not always true.
 
-    let region_info_to_id: HashMap< RegionInfo, (u64, usize) > =
-        state.map_by_id.iter()
-            .flat_map( |(id, map)| std::iter::once( id ).cycle().zip( map.regions.iter().enumerate() ) )
-            .map( |(id, (region_index, region))| (region.info.clone(), (*id, region_index)) )
-            .collect();
+    let mut snapshot = Snapshot {
+        layout: LAYOUT_HASH_SEED,
+        usage: RegionUsage::default()
+    };
 
+    let mut is_region_info_to_id_built = false;
     let mut lines = smaps.trim().split( "\n" ).peekable();
     loop {
         let mut line = match lines.next() {
@@ -577,6 +1091,8 @@ pub fn update_smaps(
             None => break
         };
 
+        snapshot.layout = hash_layout_line( snapshot.layout, line );
+
         let address = u64::from_str_radix( get_until( &mut line, '-' ), 16 ).unwrap();
         let address_end = u64::from_str_radix( get_until( &mut line, ' ' ), 16 ).unwrap();
         let is_readable = if get_char( &mut line ).unwrap() == 'r' { RegionFlags::READABLE } else { RegionFlags::empty() };
@@ -590,7 +1106,10 @@ pub fn update_smaps(
         let minor = u32::from_str_radix( get_until( &mut line, ' ' ), 16 ).unwrap();
         let inode: u64 = get_until( &mut line, ' ' ).parse().unwrap();
         skip_whitespace( &mut line );
-        let mut name = Cow::Borrowed( line );
+
+        let raw_name = line;
+        let raw_name_offset = raw_name.as_ptr() as usize - smaps.as_ptr() as usize;
+        let mut name = RegionName::Raw( raw_name_offset..raw_name_offset + raw_name.len() );
         let mut id: Option< u64 > = None;
 
         const BYTEHOUND_MEMFD_PREFIX: &str = "/memfd:bytehound::";
@@ -598,7 +1117,7 @@ pub fn update_smaps(
 
         let mut is_padding = false;
         if !crate::global::is_pr_set_vma_anon_name_supported() {
-            if name.starts_with( BYTEHOUND_MEMFD_PADDING ) {
+            if raw_name.starts_with( BYTEHOUND_MEMFD_PADDING ) {
                 state.tmp_padding_maps.push( (address, address_end - address) );
                 is_padding = true;
             } else {
@@ -608,32 +1127,32 @@ pub fn update_smaps(
         }
 
         // Try to extract the ID we've packed into the name.
-        if crate::global::is_pr_set_vma_anon_name_supported() && name.starts_with( "[anon:" ) {
+        if crate::global::is_pr_set_vma_anon_name_supported() && raw_name.starts_with( "[anon:" ) {
             // A name set with PR_SET_VMA_ANON_NAME.
-            if let Some( index_1 ) = name.find( "::" ) {
-                if let Some( length ) = name[ index_1 + 2.. ].find( "]" ) {
+            if let Some( index_1 ) = raw_name.find( "::" ) {
+                if let Some( length ) = raw_name[ index_1 + 2.. ].find( "]" ) {
                     let index_2 = index_1 + 2 + length;
-                    if index_2 + 1 == name.len() {
-                        if let Ok( value ) = name[ index_1 + 2..index_2 ].parse() {
+                    if index_2 + 1 == raw_name.len() {
+                        if let Ok( value ) = raw_name[ index_1 + 2..index_2 ].parse() {
                             id = Some( value );
-                            let mut cleaned_name = String::with_capacity( index_1 + 1 );
-                            cleaned_name.push_str( &name[ ..index_1 ] );
-                            cleaned_name.push_str( "]" );
-                            name = Cow::Owned( cleaned_name );
+                            let start = state.tmp_cleaned_names.len();
+                            state.tmp_cleaned_names.push_str( &raw_name[ ..index_1 ] );
+                            state.tmp_cleaned_names.push_str( "]" );
+                            name = RegionName::Cleaned( start..state.tmp_cleaned_names.len() );
                         }
                     }
                 }
             }
-        } else if name.starts_with( BYTEHOUND_MEMFD_PREFIX ) {
+        } else if raw_name.starts_with( BYTEHOUND_MEMFD_PREFIX ) {
             let index_1 = BYTEHOUND_MEMFD_PREFIX.len();
-            let index_2 = name[ index_1.. ].find( " " ).map( |index_2| index_1 + index_2 ).unwrap_or( name.len() );
-            if let Ok( value ) = name[ index_1..index_2 ].parse() {
+            let index_2 = raw_name[ index_1.. ].find( " " ).map( |index_2| index_1 + index_2 ).unwrap_or( raw_name.len() );
+            if let Ok( value ) = raw_name[ index_1..index_2 ].parse() {
                 id = Some( value );
-                name = Cow::Borrowed( "[anon:bytehound]" );
+                name = RegionName::Static( "[anon:bytehound]" );
             }
         } else if let Some( (_, compact_name) ) = state.tmp_emulated_vma_name_map.get( address ) {
-            if name != "anon_inode:[perf_event]" {
-                name = Cow::Owned( format!( "[anon:{}]", compact_name.kind().as_str() ) );
+            if raw_name != "anon_inode:[perf_event]" {
+                name = RegionName::Static( compact_name.kind().as_region_name() );
             }
             id = Some( compact_name.id() );
         }
@@ -648,60 +1167,31 @@ pub fn update_smaps(
         };
 
         let flags = is_readable | is_writable | is_executable | is_shared;
-
-        let mut rss = 0;
-        let mut shared_clean = 0;
-        let mut shared_dirty = 0;
-        let mut private_clean = 0;
-        let mut private_dirty = 0;
-        let mut anonymous = 0;
-        let mut swap = 0;
-        while let Some( line ) = lines.peek() {
-            let mut line = *line;
-            let key = get_until( &mut line, ':' );
-            if key.as_bytes().contains( &b' ' ) {
-                break;
-            }
-
-            skip_whitespace( &mut line );
-            let value = get_until( &mut line, ' ' );
-
-            match key {
-                "Rss" => rss = value.parse().unwrap(),
-                "Shared_Clean" => shared_clean = value.parse().unwrap(),
-                "Shared_Dirty" => shared_dirty = value.parse().unwrap(),
-                "Private_Clean" => private_clean = value.parse().unwrap(),
-                "Private_Dirty" => private_dirty = value.parse().unwrap(),
-                "Anonymous" => anonymous = value.parse().unwrap(),
-                "Swap" => swap = value.parse().unwrap(),
-                _ => {}
-            }
-
-            lines.next();
-        }
+        let (rss, usage) = parse_usage( &mut lines );
+        snapshot.usage.add( &usage );
 
         if is_padding {
             continue;
         }
 
-        debug_assert_eq!( rss, shared_clean + shared_dirty + private_clean + private_dirty );
-
-        let usage = RegionUsage {
-            anonymous,
-            shared_clean,
-            shared_dirty,
-            private_clean,
-            private_dirty,
-            swap,
-        };
+        debug_assert_eq!( rss, usage.shared_clean + usage.shared_dirty + usage.private_clean + usage.private_dirty );
 
         if id.is_none() {
             // If we haven't managed to extract the ID from the name then try to match the region itself.
             //
             // This can happen if the name was changed by the application itself, or if it's just simply
             // a map which was mmaped outside of our control.
-            if let Some( &(map_id, region_index) ) = region_info_to_id.get( &info ) {
-                if state.map_by_id.get( &map_id ).unwrap().regions[ region_index ].name == name {
+            if !is_region_info_to_id_built {
+                is_region_info_to_id_built = true;
+                for (&map_id, map) in &state.map_by_id {
+                    for (region_index, region) in map.regions.iter().enumerate() {
+                        state.tmp_region_info_to_id.insert( region.info.clone(), (map_id, region_index) );
+                    }
+                }
+            }
+
+            if let Some( &(map_id, region_index) ) = state.tmp_region_info_to_id.get( &info ) {
+                if state.map_by_id.get( &map_id ).unwrap().regions[ region_index ].name == name.resolve( smaps, &state.tmp_cleaned_names ) {
                     id = Some( map_id );
                 }
             }
@@ -710,16 +1200,19 @@ pub fn update_smaps(
         }
 
         let id = id.unwrap_or_else( || crate::global::next_map_id() );
-        let region = Region {
+        let region = FoundRegion {
             info,
-            name: name.into(),
-            last_flags: flags,
-            last_usage: usage,
+            name,
+            flags,
+            usage
         };
 
-        state.tmp_found_maps.entry( id ).or_insert_with( RegionVec::new ).push( region );
+        state.tmp_found_maps.entry( id ).or_insert_with( FoundRegionVec::new ).push( region );
     }
 
+    state.last_snapshot = snapshot;
+
+    let cleaned_names = &state.tmp_cleaned_names;
     for (id, new_regions) in state.tmp_found_maps.drain() {
         match state.map_by_id.remove( &id ) {
             Some( mut map ) => {
@@ -727,19 +1220,20 @@ pub fn update_smaps(
                 let mut new_events = Vec::new();
                 let mut merged_regions = RegionVec::new();
                 for new_region in new_regions {
-                    if let Some( old_region_index ) = map.regions.iter().position( |old_region| old_region.info == new_region.info && old_region.name == new_region.name ) {
+                    let name = new_region.name.resolve( smaps, cleaned_names );
+                    if let Some( old_region_index ) = map.regions.iter().position( |old_region| old_region.info == new_region.info && old_region.name == name ) {
                         // This is an existing region.
                         let mut old_region = map.regions.swap_remove( old_region_index );
-                        if old_region.last_usage != new_region.last_usage {
+                        if old_region.last_usage != new_region.usage {
                             new_events.push( PendingEvent::UpdateUsage {
                                 epoch: state.epoch,
                                 id,
                                 timestamp,
                                 address: new_region.info.address,
                                 length: new_region.info.length,
-                                usage: new_region.last_usage.clone()
+                                usage: new_region.usage.clone()
                             });
-                            old_region.last_usage = new_region.last_usage;
+                            old_region.last_usage = new_region.usage;
                         }
                         // TODO: Handle flag changes.
                         merged_regions.push( old_region );
@@ -752,13 +1246,14 @@ pub fn update_smaps(
                             state.tmp_mmap_by_address.get_value( new_region.info.address ).is_some()
                         );
 
+                        let name = name.to_owned();
                         new_events.push( PendingEvent::AddRegion {
                             timestamp,
                             epoch: state.epoch,
                             id,
                             info: new_region.info.clone(),
-                            flags: new_region.last_flags,
-                            name: new_region.name.clone(),
+                            flags: new_region.flags,
+                            name: name.clone(),
                         });
                         new_events.push( PendingEvent::UpdateUsage {
                             epoch: state.epoch,
@@ -766,9 +1261,9 @@ pub fn update_smaps(
                             timestamp,
                             address: new_region.info.address,
                             length: new_region.info.length,
-                            usage: new_region.last_usage.clone()
+                            usage: new_region.usage.clone()
                         });
-                        merged_regions.push( new_region );
+                        merged_regions.push( new_region.into_region( name ) );
                     }
                 }
 
@@ -777,6 +1272,7 @@ pub fn update_smaps(
 
                     generate_unmaps(
                         &state.tmp_munmap_by_address,
+                        &state.previous_munmap_by_address,
                         timestamp,
                         state.epoch,
                         id,
@@ -789,6 +1285,16 @@ pub fn update_smaps(
 
                 if let Some( pending ) = state.pending.get_mut( &id ) {
                     // We haven't emitted this map yet.
+                    if let Some( mmap ) = state.tmp_mmaps.remove( &id ) {
+                        // The map was picked up before its `mmap` was registered.
+                        let epoch = pending.events.first().map( PendingEvent::epoch ).unwrap_or( state.epoch );
+                        pending.earliest_timestamp = std::cmp::min( pending.earliest_timestamp, mmap.source.timestamp );
+                        pending.events.insert( 0, PendingEvent::Mmap {
+                            epoch,
+                            mmap
+                        });
+                    }
+
                     if timestamp - pending.earliest_timestamp < CULLING_THRESHOLD && !force_emit {
                         // It still hasn't lived long enough to be emitted.
                         pending.events.extend( new_events.drain( .. ) );
@@ -807,7 +1313,12 @@ pub fn update_smaps(
                 let mut earliest_timestamp = timestamp;
                 let mut events = smallvec::SmallVec::new();
 
-                if let Some( mmap ) = state.tmp_mmaps.remove( &id ) {
+                let mmap = match state.tmp_mmaps.remove( &id ) {
+                    Some( mmap ) => Some( mmap ),
+                    None => state.previous_mmaps.remove( &id )
+                };
+
+                if let Some( mmap ) = mmap {
                     earliest_timestamp = mmap.source.timestamp;
                     events.push( PendingEvent::Mmap {
                         epoch: state.epoch,
@@ -815,7 +1326,8 @@ pub fn update_smaps(
                     });
                 }
 
-                for region in &new_regions {
+                let mut regions = RegionVec::new();
+                for region in new_regions {
                     trace!(
                         "Found new map: 0x{:016X}..0x{:016X}, id = {}, source = {}",
                         region.info.address,
@@ -824,13 +1336,14 @@ pub fn update_smaps(
                         state.tmp_mmap_by_address.get_value( region.info.address ).is_some()
                     );
 
+                    let name = region.name.resolve( smaps, cleaned_names ).to_owned();
                     events.push( PendingEvent::AddRegion {
                         timestamp,
                         epoch: state.epoch,
                         id,
                         info: region.info.clone(),
-                        flags: region.last_flags,
-                        name: region.name.clone(),
+                        flags: region.flags,
+                        name: name.clone(),
                     });
                     events.push( PendingEvent::UpdateUsage {
                         epoch: state.epoch,
@@ -838,15 +1351,16 @@ pub fn update_smaps(
                         timestamp,
                         address: region.info.address,
                         length: region.info.length,
-                        usage: region.last_usage.clone()
+                        usage: region.usage.clone()
                     });
+                    regions.push( region.into_region( name ) );
                 }
 
                 state.pending.insert( id, PendingMap {
                     earliest_timestamp,
                     events
                 });
-                state.tmp_new_map_by_id.insert( id, Map { regions: new_regions } );
+                state.tmp_new_map_by_id.insert( id, Map { regions } );
             }
         }
     }
@@ -861,6 +1375,7 @@ pub fn update_smaps(
         for region in map.regions {
             generate_unmaps(
                 &state.tmp_munmap_by_address,
+                &state.previous_munmap_by_address,
                 timestamp,
                 state.epoch,
                 id,
@@ -894,7 +1409,54 @@ pub fn update_smaps(
         }
     }
 
-    for (id, mmap) in state.tmp_mmaps.drain() {
+    for (id, mmap) in state.previous_mmaps.drain() {
         debug!( "Map registered yet not found in smaps: 0x{:016X}..0x{:016X}, id = {}", mmap.address, mmap.address + mmap.requested_length, id );
     }
+
+    // These might have been registered after smaps was read, so they get one more chance during the next scan.
+    std::mem::swap( &mut state.previous_mmaps, &mut state.tmp_mmaps );
+}
+
+#[test]
+fn test_hash_layout() {
+    let maps = "00400000-00452000 r-xp 00000000 08:02 173521      /usr/bin/dbus-daemon\n7ffc2a5d1000-7ffc2a5f2000 rw-p 00000000 00:00 0                          [stack]\n";
+    let mut hash = LAYOUT_HASH_SEED;
+    for line in maps.lines() {
+        hash = hash_layout_line( hash, line );
+    }
+
+    assert_eq!( hash_layout( maps ), hash );
+    assert_ne!( hash_layout( maps ), hash_layout( "00400000-00452000 r-xp 00000000 08:02 173521      /usr/bin/dbus-daemon\n" ) );
+}
+
+#[test]
+fn test_parse_usage() {
+    let rollup = "00400000-7ffc2a5f2000 ---p 00000000 00:00 0                          [rollup]\nRss:                 884 kB\nPss:                 385 kB\nShared_Clean:        504 kB\nShared_Dirty:          0 kB\nPrivate_Clean:        12 kB\nPrivate_Dirty:       368 kB\nAnonymous:           368 kB\nAnonHugePages:      2048 kB\nShmemPmdMapped:        0 kB\nFilePmdMapped:         0 kB\nSwap:                  4 kB\nSwapPss:               4 kB\n";
+    let mut lines = rollup.trim().split( "\n" ).peekable();
+    lines.next();
+
+    let (rss, usage) = parse_usage( &mut lines );
+    assert_eq!( rss, 884 );
+    assert_eq!( usage, RegionUsage {
+        anonymous: 368,
+        shared_clean: 504,
+        shared_dirty: 0,
+        private_clean: 12,
+        private_dirty: 368,
+        swap: 4,
+        anon_huge_pages: 2048,
+        shmem_pmd_mapped: 0,
+        file_pmd_mapped: 0,
+        huge_page_flags: HugePageFlags::empty()
+    });
+    assert!( lines.next().is_none() );
+
+    let region = "7f0000000000-7f0000400000 rw-p 00000000 00:00 0\nRss:                4096 kB\nAnonHugePages:      4096 kB\nVmFlags: rd wr mr mw me ac sd hg\n";
+    let mut lines = region.trim().split( "\n" ).peekable();
+    lines.next();
+
+    let (_, usage) = parse_usage( &mut lines );
+    assert_eq!( usage.anon_huge_pages, 4096 );
+    assert_eq!( usage.huge_page_flags, HugePageFlags::HUGEPAGE );
+    assert!( lines.next().is_none() );
 }
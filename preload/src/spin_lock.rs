@@ -1,7 +1,10 @@
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
 use std::ops::{Deref, DerefMut};
 use std::cell::UnsafeCell;
 use std::mem::transmute;
+use std::time::Duration;
+
+use crate::syscall;
 
 pub struct SpinLock< T > {
     pub value: UnsafeCell< T >,
@@ -82,3 +85,171 @@ impl< 'a, T > DerefMut for SpinLockGuard< 'a, T > {
         }
     }
 }
+
+/// How many times `AdaptiveLock` spins before it parks the thread.
+const SPIN_LIMIT: u32 = 128;
+
+/// How long a parked thread sleeps before it checks the lock again even if it wasn't woken up,
+/// e.g. because the lock was forcibly unlocked after a `fork`.
+const PARK_TIMEOUT: Duration = Duration::from_millis( 50 );
+
+const UNLOCKED: u32 = 0;
+const LOCKED: u32 = 1;
+const LOCKED_WITH_WAITERS: u32 = 2;
+
+static CONTENDED_COUNT: AtomicU64 = AtomicU64::new( 0 );
+static PARKED_COUNT: AtomicU64 = AtomicU64::new( 0 );
+
+/// A lock which spins only for a little while and then parks the thread on a futex.
+///
+/// This is meant for the locks which can be held for a long time. If a thread gets preempted while
+/// holding a `SpinLock` everyone who's waiting for it spins for their whole timeslices, which is
+/// especially bad when there are more runnable threads than there are cores.
+pub struct AdaptiveLock< T > {
+    value: UnsafeCell< T >,
+    state: AtomicU32
+}
+
+unsafe impl< T > Send for AdaptiveLock< T > where T: Send {}
+unsafe impl< T > Sync for AdaptiveLock< T > where T: Send {}
+
+pub struct AdaptiveLockGuard< 'a, T: 'a >( &'a AdaptiveLock< T > );
+
+impl< T > AdaptiveLock< T > {
+    pub const fn new( value: T ) -> Self {
+        AdaptiveLock {
+            value: UnsafeCell::new( value ),
+            state: AtomicU32::new( UNLOCKED )
+        }
+    }
+
+    #[inline]
+    pub fn lock( &self ) -> AdaptiveLockGuard< T > {
+        if self.state.compare_exchange( UNLOCKED, LOCKED, Ordering::Acquire, Ordering::Relaxed ).is_err() {
+            self.lock_slow();
+        }
+
+        AdaptiveLockGuard( self )
+    }
+
+    #[cold]
+    #[inline(never)]
+    fn lock_slow( &self ) {
+        CONTENDED_COUNT.fetch_add( 1, Ordering::Relaxed );
+        for _ in 0..SPIN_LIMIT {
+            if self.state.load( Ordering::Relaxed ) == UNLOCKED && self.state.compare_exchange_weak( UNLOCKED, LOCKED, Ordering::Acquire, Ordering::Relaxed ).is_ok() {
+                return;
+            }
+
+            std::hint::spin_loop();
+        }
+
+        // Since we can't know whether anyone else is parked once we get it the lock is
+        // always taken with waiters from now on, which at worst costs a spurious wakeup.
+        let mut is_parked = false;
+        while self.state.swap( LOCKED_WITH_WAITERS, Ordering::Acquire ) != UNLOCKED {
+            if !is_parked {
+                is_parked = true;
+                PARKED_COUNT.fetch_add( 1, Ordering::Relaxed );
+            }
+
+            syscall::futex_wait( &self.state, LOCKED_WITH_WAITERS, PARK_TIMEOUT );
+        }
+    }
+
+    pub fn try_lock( &self ) -> Option< AdaptiveLockGuard< T > > {
+        if self.state.compare_exchange( UNLOCKED, LOCKED, Ordering::Acquire, Ordering::Relaxed ).is_ok() {
+            Some( AdaptiveLockGuard( self ) )
+        } else {
+            None
+        }
+    }
+
+    pub unsafe fn unsafe_as_ref( &self ) -> &T {
+        &*self.value.get()
+    }
+
+    pub unsafe fn force_unlock( &self ) {
+        self.state.store( UNLOCKED, Ordering::SeqCst );
+    }
+}
+
+impl< 'a, T > Drop for AdaptiveLockGuard< 'a, T > {
+    fn drop( &mut self ) {
+        if self.0.state.swap( UNLOCKED, Ordering::Release ) == LOCKED_WITH_WAITERS {
+            syscall::futex_wake( &self.0.state, 1 );
+        }
+    }
+}
+
+impl< 'a, T > Deref for AdaptiveLockGuard< 'a, T > {
+    type Target = T;
+
+    fn deref( &self ) -> &Self::Target {
+        unsafe {
+            &*self.0.value.get()
+        }
+    }
+}
+
+impl< 'a, T > DerefMut for AdaptiveLockGuard< 'a, T > {
+    fn deref_mut( &mut self ) -> &mut Self::Target {
+        unsafe {
+            &mut *self.0.value.get()
+        }
+    }
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Default, Debug)]
+pub struct LockCounters {
+    /// How many times an `AdaptiveLock` wasn't free when a thread tried to take it.
+    pub contended: u64,
+    /// How many times a thread had to be parked until an `AdaptiveLock` was released.
+    pub parked: u64
+}
+
+pub fn lock_counters() -> LockCounters {
+    LockCounters {
+        contended: CONTENDED_COUNT.load( Ordering::Relaxed ),
+        parked: PARKED_COUNT.load( Ordering::Relaxed )
+    }
+}
+
+/// Logs the counters if any of them changed since the last time this was called.
+pub fn log_lock_counters( last_counters: &mut LockCounters ) {
+    let counters = lock_counters();
+    if counters == *last_counters {
+        return;
+    }
+
+    *last_counters = counters;
+    info!( "Lock contention: contended = {}, parked = {}", counters.contended, counters.parked );
+}
+
+#[test]
+fn test_adaptive_lock_under_contention() {
+    use std::sync::Arc;
+
+    let lock = Arc::new( AdaptiveLock::new( 0_u64 ) );
+    let threads: Vec< _ > = (0..8).map( |_| {
+        let lock = lock.clone();
+        std::thread::spawn( move || {
+            for _ in 0..10000 {
+                let mut value = lock.lock();
+                *value += 1;
+                if *value % 1000 == 0 {
+                    // Hold on to it for long enough for the others to give up on spinning.
+                    std::thread::sleep( Duration::from_micros( 100 ) );
+                }
+            }
+        })
+    }).collect();
+
+    for thread in threads {
+        thread.join().unwrap();
+    }
+
+    assert_eq!( *lock.lock(), 80000 );
+    assert!( lock.try_lock().is_some() );
+    assert_eq!( lock.state.load( Ordering::Relaxed ), UNLOCKED );
+}
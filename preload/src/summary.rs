@@ -0,0 +1,196 @@
+//! The live per-backtrace counters for the summary mode.
+//!
+//! Instead of writing out every allocation the processing thread only updates
+//! these, and periodically writes out a snapshot of the ones which have changed,
+//! which is only a few kilobytes per second even for very allocation heavy programs.
+
+use std::io::{self, Write};
+
+use common::event::{BacktraceSummary, Event};
+use common::speedy::Writable;
+
+use crate::timestamp::Timestamp;
+use crate::utils::{HashMap, empty_hashmap};
+
+struct LiveAllocation {
+    backtrace: u64,
+    size: u64
+}
+
+#[derive(Default)]
+struct Counters {
+    allocated_count: u64,
+    allocated_size: u64,
+    freed_count: u64,
+    freed_size: u64,
+    peak_usage: u64,
+    is_dirty: bool
+}
+
+/// The totals of every backtrace.
+#[derive(Copy, Clone, PartialEq, Eq, Default, Debug)]
+pub struct Totals {
+    pub allocated_count: u64,
+    pub allocated_size: u64,
+    pub freed_count: u64,
+    pub freed_size: u64,
+    pub peak_usage: u64
+}
+
+pub struct Summary {
+    allocations: HashMap< usize, LiveAllocation >,
+    counters: HashMap< u64, Counters >,
+    dirty: Vec< u64 >,
+    totals: Totals
+}
+
+impl Summary {
+    pub fn new() -> Self {
+        Summary {
+            allocations: empty_hashmap(),
+            counters: empty_hashmap(),
+            dirty: Vec::new(),
+            totals: Totals::default()
+        }
+    }
+
+    fn counters_mut( &mut self, backtrace: u64 ) -> &mut Counters {
+        let counters = self.counters.entry( backtrace ).or_default();
+        if !counters.is_dirty {
+            counters.is_dirty = true;
+            self.dirty.push( backtrace );
+        }
+
+        counters
+    }
+
+    pub fn on_allocation( &mut self, address: usize, size: u64, backtrace: u64 ) {
+        // If it's already there then we must have missed its deallocation.
+        self.on_free( address );
+        self.allocations.insert( address, LiveAllocation { backtrace, size } );
+
+        let counters = self.counters_mut( backtrace );
+        counters.allocated_count += 1;
+        counters.allocated_size += size;
+        counters.peak_usage = std::cmp::max( counters.peak_usage, counters.allocated_size - counters.freed_size );
+
+        let totals = &mut self.totals;
+        totals.allocated_count += 1;
+        totals.allocated_size += size;
+        totals.peak_usage = std::cmp::max( totals.peak_usage, totals.allocated_size - totals.freed_size );
+    }
+
+    pub fn on_reallocation( &mut self, old_address: usize, address: usize, size: u64, backtrace: u64 ) {
+        self.on_free( old_address );
+        self.on_allocation( address, size, backtrace );
+    }
+
+    pub fn on_free( &mut self, address: usize ) {
+        // This can be missing if it was allocated before we've started, or if it wasn't sampled.
+        let allocation = match self.allocations.remove( &address ) {
+            Some( allocation ) => allocation,
+            None => return
+        };
+
+        let counters = self.counters_mut( allocation.backtrace );
+        counters.freed_count += 1;
+        counters.freed_size += allocation.size;
+
+        self.totals.freed_count += 1;
+        self.totals.freed_size += allocation.size;
+    }
+
+    pub fn totals( &self ) -> Totals {
+        self.totals
+    }
+
+    /// Returns up to `count` backtraces which are currently using the most memory, with how much they're using.
+    pub fn top_backtraces_by_usage( &self, count: usize ) -> Vec< (u64, u64) > {
+        let mut usage: Vec< _ > = self.counters.iter()
+            .map( |(&backtrace, counters)| (backtrace, counters.allocated_size - counters.freed_size) )
+            .filter( |&(_, usage)| usage > 0 )
+            .collect();
+
+        let by_usage = |&(backtrace, usage): &(u64, u64)| (std::cmp::Reverse( usage ), backtrace);
+        if usage.len() > count {
+            usage.select_nth_unstable_by_key( count, by_usage );
+            usage.truncate( count );
+        }
+
+        usage.sort_unstable_by_key( by_usage );
+        usage
+    }
+
+    /// Writes out the counters which have changed since the last call; does nothing if none have.
+    pub fn write_snapshot( &mut self, timestamp: Timestamp, fp: &mut impl Write ) -> io::Result< () > {
+        if self.dirty.is_empty() {
+            return Ok(());
+        }
+
+        let mut entries = Vec::with_capacity( self.dirty.len() );
+        for backtrace in self.dirty.drain( .. ) {
+            let counters = self.counters.get_mut( &backtrace ).unwrap();
+            counters.is_dirty = false;
+            entries.push( BacktraceSummary {
+                backtrace,
+                allocated_count: counters.allocated_count,
+                allocated_size: counters.allocated_size,
+                freed_count: counters.freed_count,
+                freed_size: counters.freed_size,
+                peak_usage: counters.peak_usage
+            });
+        }
+
+        Event::BacktraceSummaries {
+            timestamp,
+            entries: entries.into()
+        }.write_to_stream( fp )
+    }
+}
+
+#[test]
+fn test_summary() {
+    use common::speedy::Readable;
+
+    fn snapshot( summary: &mut Summary ) -> Vec< BacktraceSummary > {
+        let mut buffer = Vec::new();
+        summary.write_snapshot( Timestamp::min(), &mut buffer ).unwrap();
+        if buffer.is_empty() {
+            return Vec::new();
+        }
+
+        match Event::read_from_buffer( &buffer ).unwrap() {
+            Event::BacktraceSummaries { entries, .. } => {
+                let mut entries = entries.into_owned();
+                entries.sort_by_key( |entry| entry.backtrace );
+                entries
+            },
+            _ => unreachable!()
+        }
+    }
+
+    let mut summary = Summary::new();
+    summary.on_allocation( 0x1000, 10, 1 );
+    summary.on_allocation( 0x2000, 20, 1 );
+    summary.on_allocation( 0x3000, 5, 2 );
+    summary.on_free( 0x1000 );
+    summary.on_free( 0x9000 );
+
+    let entries = snapshot( &mut summary );
+    assert_eq!( entries.len(), 2 );
+    assert_eq!( entries[0], BacktraceSummary { backtrace: 1, allocated_count: 2, allocated_size: 30, freed_count: 1, freed_size: 10, peak_usage: 30 } );
+    assert_eq!( entries[1], BacktraceSummary { backtrace: 2, allocated_count: 1, allocated_size: 5, freed_count: 0, freed_size: 0, peak_usage: 5 } );
+
+    // Nothing has changed.
+    assert!( snapshot( &mut summary ).is_empty() );
+
+    summary.on_reallocation( 0x3000, 0x4000, 50, 3 );
+    let entries = snapshot( &mut summary );
+    assert_eq!( entries.len(), 2 );
+    assert_eq!( entries[0], BacktraceSummary { backtrace: 2, allocated_count: 1, allocated_size: 5, freed_count: 1, freed_size: 5, peak_usage: 5 } );
+    assert_eq!( entries[1], BacktraceSummary { backtrace: 3, allocated_count: 1, allocated_size: 50, freed_count: 0, freed_size: 0, peak_usage: 50 } );
+
+    assert_eq!( summary.totals(), Totals { allocated_count: 4, allocated_size: 85, freed_count: 2, freed_size: 15, peak_usage: 70 } );
+    assert_eq!( summary.top_backtraces_by_usage( 1 ), vec![ (3, 50) ] );
+    assert_eq!( summary.top_backtraces_by_usage( 10 ), vec![ (3, 50), (1, 20) ] );
+}
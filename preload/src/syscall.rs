@@ -19,6 +19,15 @@ macro_rules! syscall {
     (@to_libc MUNMAP) => { libc::SYS_munmap };
     (@to_libc GETPID) => { libc::SYS_getpid };
     (@to_libc MEMFD_CREATE) => { libc::SYS_memfd_create };
+    (@to_libc FUTEX) => { libc::SYS_futex };
+    (@to_libc IO_URING_SETUP) => { libc::SYS_io_uring_setup };
+    (@to_libc IO_URING_ENTER) => { libc::SYS_io_uring_enter };
+    (@to_libc IO_URING_REGISTER) => { libc::SYS_io_uring_register };
+    (@to_libc GETCPU) => { libc::SYS_getcpu };
+    (@to_libc MOVE_PAGES) => { libc::SYS_move_pages };
+    (@to_libc SENDFILE) => { libc::SYS_sendfile };
+    (@to_libc PERF_EVENT_OPEN) => { libc::SYS_perf_event_open };
+    (@to_libc IOCTL) => { libc::SYS_ioctl };
 
     ($num:ident) => {
         libc::syscall( syscall!( @to_libc $num ) )
@@ -57,6 +66,12 @@ pub fn write( fd: libc::c_int, buffer: &[u8] ) -> libc::ssize_t {
     }
 }
 
+pub fn sendfile( out_fd: libc::c_int, in_fd: libc::c_int, offset: &mut libc::off_t, count: usize ) -> libc::ssize_t {
+    unsafe {
+        syscall!( SENDFILE, out_fd, in_fd, offset as *mut libc::off_t, count ) as _
+    }
+}
+
 pub fn umask( umask: libc::c_int ) -> libc::c_int {
     unsafe {
         syscall!( UMASK, umask ) as _
@@ -174,3 +189,77 @@ pub fn memfd_create( name: *const libc::c_char, flags: libc::c_uint ) -> libc::c
         syscall!( MEMFD_CREATE, name, flags ) as _
     }
 }
+
+/// Sleeps until `futex` is woken up, or until it doesn't hold `expected`, or until `timeout` elapses.
+pub fn futex_wait( futex: &std::sync::atomic::AtomicU32, expected: u32, timeout: std::time::Duration ) {
+    let timeout = libc::timespec {
+        tv_sec: timeout.as_secs() as _,
+        tv_nsec: timeout.subsec_nanos() as _
+    };
+
+    unsafe {
+        syscall!( FUTEX, futex as *const std::sync::atomic::AtomicU32 as *const u32, libc::FUTEX_WAIT | libc::FUTEX_PRIVATE_FLAG, expected, &timeout as *const libc::timespec );
+    }
+}
+
+/// Wakes up to `count` threads sleeping on `futex`.
+pub fn futex_wake( futex: &std::sync::atomic::AtomicU32, count: i32 ) {
+    unsafe {
+        syscall!( FUTEX, futex as *const std::sync::atomic::AtomicU32 as *const u32, libc::FUTEX_WAKE | libc::FUTEX_PRIVATE_FLAG, count );
+    }
+}
+
+pub fn io_uring_setup( entries: u32, params: *mut libc::c_void ) -> libc::c_int {
+    unsafe {
+        syscall!( IO_URING_SETUP, entries, params ) as _
+    }
+}
+
+pub fn io_uring_enter( fd: libc::c_int, to_submit: u32, min_complete: u32, flags: u32 ) -> libc::c_int {
+    unsafe {
+        syscall!( IO_URING_ENTER, fd, to_submit, min_complete, flags, std::ptr::null::< libc::c_void >(), 0 as libc::size_t ) as _
+    }
+}
+
+pub fn io_uring_register( fd: libc::c_int, opcode: u32, arg: *const libc::c_void, count: u32 ) -> libc::c_int {
+    unsafe {
+        syscall!( IO_URING_REGISTER, fd, opcode, arg, count ) as _
+    }
+}
+
+pub fn perf_event_open( attr: *const libc::c_void, pid: libc::pid_t, cpu: libc::c_int, group_fd: libc::c_int, flags: libc::c_ulong ) -> libc::c_int {
+    unsafe {
+        syscall!( PERF_EVENT_OPEN, attr, pid, cpu, group_fd, flags ) as _
+    }
+}
+
+pub fn ioctl( fd: libc::c_int, request: libc::c_ulong, arg: libc::c_ulong ) -> libc::c_int {
+    unsafe {
+        syscall!( IOCTL, fd, request, arg ) as _
+    }
+}
+
+/// Returns the CPU and the NUMA node on which the current thread is running.
+pub fn getcpu() -> Option< (u32, u32) > {
+    let mut cpu: libc::c_uint = 0;
+    let mut node: libc::c_uint = 0;
+    let result = unsafe {
+        syscall!( GETCPU, &mut cpu as *mut libc::c_uint, &mut node as *mut libc::c_uint, std::ptr::null_mut::< libc::c_void >() )
+    };
+
+    if result < 0 {
+        None
+    } else {
+        Some( (cpu, node) )
+    }
+}
+
+/// Looks up on which NUMA nodes the given pages of the current process are, without moving them.
+///
+/// Every status is either the node of the page or a negated error code, e.g. `-ENOENT` for pages which aren't present.
+pub fn query_page_nodes( pages: &[*mut libc::c_void], status: &mut [libc::c_int] ) -> libc::c_int {
+    assert_eq!( pages.len(), status.len() );
+    unsafe {
+        syscall!( MOVE_PAGES, 0 as libc::pid_t, pages.len() as libc::c_ulong, pages.as_ptr(), std::ptr::null::< libc::c_int >(), status.as_mut_ptr(), 0 as libc::c_int ) as _
+    }
+}
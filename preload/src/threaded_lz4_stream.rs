@@ -0,0 +1,274 @@
+use std::io::{self, Write};
+use std::mem;
+use std::sync::{mpsc, Arc};
+
+use parking_lot::Mutex;
+
+use common::lz4_stream::compress_into_chunks;
+
+use crate::instrumentation::{Stage, Timer};
+
+const CHUNK_SIZE: usize = 512 * 1024;
+
+/// How many chunks per compression thread can be in flight before we start to block.
+const MAXIMUM_IN_FLIGHT_PER_THREAD: usize = 2;
+
+struct CompressedChunk {
+    counter: u64,
+    data: Vec< u8 >,
+    input: Vec< u8 >
+}
+
+struct Workers {
+    job_tx: mpsc::Sender< (u64, Vec< u8 >) >,
+    result_rx: mpsc::Receiver< CompressedChunk >,
+    maximum_in_flight: usize
+}
+
+/// An LZ4 writer which compresses its chunks on a pool of background threads.
+///
+/// The output is exactly the same as the one of `common::lz4_stream::Lz4Writer`; the chunks
+/// are written out to the inner writer in order, on the thread which owns the writer.
+pub struct Lz4Writer< F: io::Write > {
+    fp: Option< F >,
+    buffer: Vec< u8 >,
+    compression_buffer: Vec< u8 >,
+    workers: Option< Workers >,
+    pid: libc::pid_t,
+    next_counter: u64,
+    next_counter_to_write: u64,
+    completed: Vec< CompressedChunk >,
+    spare_buffers: Vec< Vec< u8 > >,
+    is_compression_disabled: bool
+}
+
+fn compress( input: &[u8], output: &mut Vec< u8 > ) {
+    let _timer = Timer::start( Stage::Compression );
+    compress_into_chunks( input, output );
+}
+
+fn spawn_workers( thread_count: usize ) -> Option< Workers > {
+    let (job_tx, job_rx) = mpsc::channel::< (u64, Vec< u8 >) >();
+    let (result_tx, result_rx) = mpsc::channel();
+    let job_rx = Arc::new( Mutex::new( job_rx ) );
+
+    let mut spawned = 0;
+    for _ in 0..thread_count {
+        let job_rx = job_rx.clone();
+        let result_tx = result_tx.clone();
+        let is_ok = crate::global::spawn_internal_thread( b"mem-prof-lz4\0", move || {
+            loop {
+                let job = job_rx.lock().recv();
+                let (counter, input) = match job {
+                    Ok( job ) => job,
+                    Err( _ ) => break
+                };
+
+                let mut data = Vec::with_capacity( input.len() / 2 );
+                compress( &input, &mut data );
+                if result_tx.send( CompressedChunk { counter, data, input } ).is_err() {
+                    break;
+                }
+            }
+        });
+
+        if is_ok {
+            spawned += 1;
+        }
+    }
+
+    if spawned == 0 {
+        warn!( "Failed to spawn any compression threads; will compress on the processing thread" );
+        return None;
+    }
+
+    info!( "Spawned {} compression thread(s)", spawned );
+    Some( Workers {
+        job_tx,
+        result_rx,
+        maximum_in_flight: spawned * MAXIMUM_IN_FLIGHT_PER_THREAD
+    })
+}
+
+impl< F: io::Write > Lz4Writer< F > {
+    pub fn new( fp: F, thread_count: usize ) -> Self {
+        let workers = if thread_count > 0 {
+            spawn_workers( thread_count )
+        } else {
+            None
+        };
+
+        Lz4Writer {
+            fp: Some( fp ),
+            buffer: Vec::new(),
+            compression_buffer: Vec::new(),
+            workers,
+            pid: unsafe { libc::getpid() },
+            next_counter: 0,
+            next_counter_to_write: 0,
+            completed: Vec::new(),
+            spare_buffers: Vec::new(),
+            is_compression_disabled: false
+        }
+    }
+
+    /// Makes the writer pass the data through as it is, for when it's going to be compressed by someone else.
+    pub fn disable_compression( &mut self ) -> io::Result< () > {
+        self.flush()?;
+        self.workers = None;
+        self.is_compression_disabled = true;
+        Ok(())
+    }
+
+    pub fn is_compression_disabled( &self ) -> bool {
+        self.is_compression_disabled
+    }
+
+    pub fn replace_inner( &mut self, fp: F ) -> io::Result< () > {
+        self.flush()?;
+        self.fp = Some( fp );
+        Ok(())
+    }
+
+    pub fn inner( &self ) -> &F {
+        self.fp.as_ref().unwrap()
+    }
+
+    pub fn inner_mut_without_flush( &mut self ) -> &mut F {
+        self.fp.as_mut().unwrap()
+    }
+
+    pub fn inner_mut( &mut self ) -> io::Result< &mut F > {
+        self.flush()?;
+        Ok( self.fp.as_mut().unwrap() )
+    }
+
+    fn compress_inline( &mut self ) -> io::Result< () > {
+        self.compression_buffer.clear();
+        compress( &self.buffer, &mut self.compression_buffer );
+        self.buffer.clear();
+        self.fp.as_mut().unwrap().write_all( &self.compression_buffer )
+    }
+
+    fn submit( &mut self ) -> io::Result< () > {
+        if self.buffer.is_empty() {
+            return Ok(());
+        }
+
+        if self.is_compression_disabled {
+            self.fp.as_mut().unwrap().write_all( &self.buffer )?;
+            self.buffer.clear();
+            return Ok(());
+        }
+
+        // The compression threads don't survive a `fork`, and the memory dumper writes from a forked child.
+        if self.workers.is_none() || self.pid != unsafe { libc::getpid() } {
+            self.write_completed( 0 )?;
+            return self.compress_inline();
+        }
+
+        let next_buffer = self.spare_buffers.pop().unwrap_or_else( || Vec::with_capacity( CHUNK_SIZE + 8 * 1024 ) );
+        let buffer = mem::replace( &mut self.buffer, next_buffer );
+        let maximum_in_flight = {
+            let workers = self.workers.as_ref().unwrap();
+            if let Err( mpsc::SendError( (_, buffer) ) ) = workers.job_tx.send( (self.next_counter, buffer) ) {
+                warn!( "The compression threads are gone; will compress on the processing thread" );
+                self.buffer = buffer;
+                self.write_completed( 0 )?;
+                self.workers = None;
+                return self.compress_inline();
+            }
+
+            workers.maximum_in_flight
+        };
+
+        self.next_counter += 1;
+        self.write_completed( maximum_in_flight )
+    }
+
+    /// Writes out every chunk which was compressed in order, waiting until at most `maximum_in_flight` are left.
+    fn write_completed( &mut self, maximum_in_flight: usize ) -> io::Result< () > {
+        loop {
+            if let Some( ref workers ) = self.workers {
+                while let Ok( chunk ) = workers.result_rx.try_recv() {
+                    self.completed.push( chunk );
+                }
+            }
+
+            while let Some( index ) = self.completed.iter().position( |chunk| chunk.counter == self.next_counter_to_write ) {
+                let CompressedChunk { data, mut input, .. } = self.completed.swap_remove( index );
+                self.next_counter_to_write += 1;
+                self.fp.as_mut().unwrap().write_all( &data )?;
+
+                input.clear();
+                if self.spare_buffers.len() < MAXIMUM_IN_FLIGHT_PER_THREAD {
+                    self.spare_buffers.push( input );
+                }
+            }
+
+            let in_flight = (self.next_counter - self.next_counter_to_write) as usize;
+            if in_flight <= maximum_in_flight {
+                return Ok(());
+            }
+
+            let chunk = match self.workers {
+                Some( ref workers ) => workers.result_rx.recv(),
+                None => return Err( io::Error::new( io::ErrorKind::Other, "compression threads are gone" ) )
+            };
+
+            match chunk {
+                Ok( chunk ) => self.completed.push( chunk ),
+                Err( _ ) => {
+                    self.workers = None;
+                    return Err( io::Error::new( io::ErrorKind::Other, "compression threads are gone" ) );
+                }
+            }
+        }
+    }
+}
+
+impl< F: io::Write > Drop for Lz4Writer< F > {
+    fn drop( &mut self ) {
+        let _ = self.flush();
+    }
+}
+
+impl< F: io::Write > io::Write for Lz4Writer< F > {
+    fn write( &mut self, slice: &[u8] ) -> io::Result< usize > {
+        self.buffer.extend_from_slice( slice );
+        if self.buffer.len() >= CHUNK_SIZE {
+            self.submit()?;
+        }
+
+        Ok( slice.len() )
+    }
+
+    fn flush( &mut self ) -> io::Result< () > {
+        self.submit()?;
+        self.write_completed( 0 )?;
+        self.fp.as_mut().unwrap().flush()
+    }
+}
+
+#[test]
+fn test_threaded_lz4_writer_matches_single_threaded_output() {
+    let data: Vec< u8 > = (0..3 * CHUNK_SIZE + 1234).map( |nth| (nth % 251) as u8 ^ (nth / 4096) as u8 ).collect();
+
+    let mut expected = Vec::new();
+    {
+        let mut fp = common::lz4_stream::Lz4Writer::new( &mut expected );
+        for chunk in data.chunks( 1000 ) {
+            fp.write_all( chunk ).unwrap();
+        }
+    }
+
+    let mut actual = Vec::new();
+    {
+        let mut fp = Lz4Writer::new( &mut actual, 0 );
+        for chunk in data.chunks( 1000 ) {
+            fp.write_all( chunk ).unwrap();
+        }
+    }
+
+    assert_eq!( actual, expected );
+}
@@ -1,8 +1,21 @@
 use libc;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::time::Duration;
 
 pub use common::Timestamp;
 
-pub fn get_timestamp() -> Timestamp {
+/// For how long the TSC is calibrated against `CLOCK_MONOTONIC`.
+const TSC_CALIBRATION_TIME: Duration = Duration::from_millis( 20 );
+
+/// The number of fractional bits of `TSC_MULTIPLIER`.
+const TSC_MULTIPLIER_SHIFT: u32 = 48;
+
+static IS_TSC_ENABLED: AtomicBool = AtomicBool::new( false );
+static TSC_BASE_TICKS: AtomicU64 = AtomicU64::new( 0 );
+static TSC_BASE_TIMESTAMP: AtomicU64 = AtomicU64::new( 0 );
+static TSC_MULTIPLIER: AtomicU64 = AtomicU64::new( 0 );
+
+pub fn get_monotonic_nsecs() -> u64 {
     let mut timespec = libc::timespec {
         tv_sec: 0,
         tv_nsec: 0
@@ -12,7 +25,158 @@ pub fn get_timestamp() -> Timestamp {
         libc::clock_gettime( libc::CLOCK_MONOTONIC, &mut timespec );
     }
 
-    Timestamp::from_timespec( timespec.tv_sec as u64, timespec.tv_nsec as u64 )
+    timespec.tv_sec as u64 * 1_000_000_000 + timespec.tv_nsec as u64
+}
+
+#[cfg(target_arch = "x86_64")]
+#[inline(always)]
+fn read_tsc() -> u64 {
+    unsafe { std::arch::x86_64::_rdtsc() }
+}
+
+#[cfg(target_arch = "aarch64")]
+#[inline(always)]
+fn read_tsc() -> u64 {
+    let value: u64;
+    unsafe {
+        std::arch::asm!( "mrs {}, cntvct_el0", out( reg ) value, options( nomem, nostack, preserves_flags ) );
+    }
+    value
+}
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+#[inline(always)]
+fn read_tsc() -> u64 {
+    0
+}
+
+#[cfg(target_arch = "x86_64")]
+fn check_tsc() -> Result< (), &'static str > {
+    use std::arch::x86_64::__cpuid;
+
+    let max_extended_leaf = unsafe { __cpuid( 0x80000000 ) }.eax;
+    if max_extended_leaf < 0x80000007 {
+        return Err( "the CPU doesn't report whether its TSC is invariant" );
+    }
+
+    if unsafe { __cpuid( 0x80000007 ) }.edx & (1 << 8) == 0 {
+        return Err( "the TSC is not invariant" );
+    }
+
+    match std::fs::read_to_string( "/sys/devices/system/clocksource/clocksource0/current_clocksource" ) {
+        Ok( clocksource ) if clocksource.trim() != "tsc" => {
+            Err( "the kernel doesn't use the TSC as its clock source, so it might not be synchronized across CPUs" )
+        },
+        _ => Ok(())
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+fn check_tsc() -> Result< (), &'static str > {
+    // The generic timer always ticks at a constant rate.
+    Ok(())
+}
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+fn check_tsc() -> Result< (), &'static str > {
+    Err( "not supported on this architecture" )
+}
+
+/// Returns the value of the TSC and of the monotonic clock, read as close together as possible.
+fn sample_tsc() -> (u64, u64) {
+    let mut best = (0, 0, u64::MAX);
+    for _ in 0..5 {
+        let start = read_tsc();
+        let nsecs = get_monotonic_nsecs();
+        let end = read_tsc();
+
+        let window = end.wrapping_sub( start );
+        if window < best.2 {
+            best = (start + window / 2, nsecs, window);
+        }
+    }
+
+    (best.0, best.1)
+}
+
+/// Calibrates the TSC against the monotonic clock and, if successful, makes `get_timestamp` use it.
+///
+/// This blocks for a few milliseconds; until it returns the monotonic clock is used as usual.
+pub fn initialize_tsc() {
+    if let Err( reason ) = check_tsc() {
+        warn!( "Cannot use the TSC as the clock source: {}; falling back to clock_gettime", reason );
+        return;
+    }
+
+    let (ticks_0, nsecs_0) = sample_tsc();
+    std::thread::sleep( TSC_CALIBRATION_TIME );
+    let (ticks_1, nsecs_1) = sample_tsc();
+
+    if ticks_1 <= ticks_0 || nsecs_1 <= nsecs_0 {
+        warn!( "Cannot use the TSC as the clock source: it doesn't advance; falling back to clock_gettime" );
+        return;
+    }
+
+    let ticks = (ticks_1 - ticks_0) as u128;
+    let nsecs = (nsecs_1 - nsecs_0) as u128;
+    let multiplier = (nsecs << TSC_MULTIPLIER_SHIFT) / (ticks * 1000);
+    if multiplier == 0 || multiplier > u64::MAX as u128 {
+        warn!( "Cannot use the TSC as the clock source: its frequency is out of range; falling back to clock_gettime" );
+        return;
+    }
+
+    TSC_BASE_TICKS.store( ticks_1, Ordering::Relaxed );
+    TSC_BASE_TIMESTAMP.store( nsecs_1 / 1000, Ordering::Relaxed );
+    TSC_MULTIPLIER.store( multiplier as u64, Ordering::Relaxed );
+    IS_TSC_ENABLED.store( true, Ordering::Release );
+
+    info!( "Using the TSC as the clock source; frequency = {} kHz", ticks * 1_000_000 / nsecs );
+}
+
+#[inline(always)]
+fn tsc_to_usecs( ticks: u64, base_ticks: u64, base_usecs: u64, multiplier: u64 ) -> u64 {
+    // Another thread could have read a slightly older value of the TSC
+    // right before the calibration finished, so clamp it.
+    let elapsed = if ticks > base_ticks { ticks - base_ticks } else { 0 };
+    base_usecs + ((elapsed as u128 * multiplier as u128) >> TSC_MULTIPLIER_SHIFT) as u64
+}
+
+#[inline]
+pub fn get_timestamp() -> Timestamp {
+    if IS_TSC_ENABLED.load( Ordering::Acquire ) {
+        let usecs = tsc_to_usecs(
+            read_tsc(),
+            TSC_BASE_TICKS.load( Ordering::Relaxed ),
+            TSC_BASE_TIMESTAMP.load( Ordering::Relaxed ),
+            TSC_MULTIPLIER.load( Ordering::Relaxed )
+        );
+
+        return Timestamp::from_usecs( usecs );
+    }
+
+    let nsecs = get_monotonic_nsecs();
+    Timestamp::from_timespec( nsecs / 1_000_000_000, nsecs % 1_000_000_000 )
+}
+
+/// Returns a raw reading of the fastest clock we have, for measuring short intervals with `interval_to_nsecs`.
+#[inline(always)]
+pub fn read_interval_clock() -> u64 {
+    if IS_TSC_ENABLED.load( Ordering::Relaxed ) {
+        read_tsc()
+    } else {
+        get_monotonic_nsecs()
+    }
+}
+
+/// Converts the difference between two readings of `read_interval_clock` into nanoseconds.
+#[inline]
+pub fn interval_to_nsecs( start: u64, end: u64 ) -> u64 {
+    let elapsed = end.saturating_sub( start );
+    if IS_TSC_ENABLED.load( Ordering::Relaxed ) {
+        ((elapsed as u128 * TSC_MULTIPLIER.load( Ordering::Relaxed ) as u128 * 1000) >> TSC_MULTIPLIER_SHIFT) as u64
+    } else {
+        elapsed
+    }
 }
 
 pub fn get_wall_clock() -> (Timestamp, u64, u64) {
@@ -28,3 +192,12 @@ pub fn get_wall_clock() -> (Timestamp, u64, u64) {
 
     (timestamp, timespec.tv_sec as u64, timespec.tv_nsec as u64)
 }
+
+#[test]
+fn test_tsc_to_usecs() {
+    // A 3 GHz clock.
+    let multiplier = ((1_u128 << TSC_MULTIPLIER_SHIFT) / 3000) as u64;
+    assert_eq!( tsc_to_usecs( 1000, 1000, 5, multiplier ), 5 );
+    assert_eq!( tsc_to_usecs( 900, 1000, 5, multiplier ), 5 );
+    assert_eq!( tsc_to_usecs( 1000 + 3_000_000_000 * 3600, 1000, 5, multiplier ), 5 + 3600 * 1_000_000 - 1 );
+}
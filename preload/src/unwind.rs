@@ -1,5 +1,6 @@
 use std::mem::{self, transmute};
-use std::sync::atomic::{AtomicU64, AtomicUsize};
+use std::ops::Range;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
 use libc::{self, c_void, c_int, uintptr_t};
 use perf_event_open::{Perf, EventSource, Event};
 use nwind::{
@@ -8,17 +9,50 @@ use nwind::{
     LocalUnwindContext,
     UnwindControl
 };
-use std::sync::{RwLock, RwLockReadGuard};
 
 use crate::global::StrongThreadHandle;
-use crate::spin_lock::SpinLock;
+use crate::instrumentation::{self, Counter, Stage, Timer};
+use crate::spin_lock::{AdaptiveLock, SpinLock};
 use crate::opt;
 use crate::nohash::NoHash;
+use crate::sharded_rwlock::{ShardedRwLock, ShardedRwLockReadGuard, next_shard};
+use crate::utils::{HashMap, empty_hashmap};
+
+/// A 128-bit fingerprint of the frames of a backtrace.
+///
+/// It's wide enough that different backtraces are assumed to never have the same one,
+/// so the caches which are keyed by it don't have to compare the frames.
+pub type BacktraceKey = u128;
+
+/// The key of an empty backtrace.
+pub const BACKTRACE_KEY_SEED: BacktraceKey = 0x243f_6a88_85a3_08d3_1319_8a2e_0370_7344;
+
+// This was copied from `ahash`.
+#[inline(always)]
+const fn folded_multiply( s: u64, by: u64 ) -> u64 {
+    let result = (s as u128).wrapping_mul( by as u128 );
+    ((result & 0xffff_ffff_ffff_ffff) as u64) ^ ((result >> 64) as u64)
+}
+
+/// Mixes the next frame into the `key` of the frames before it.
+///
+/// The two halves are independent of each other, so they're computed in parallel.
+#[inline(always)]
+pub const fn extend_backtrace_key( key: BacktraceKey, frame: usize ) -> BacktraceKey {
+    let low = folded_multiply( key as u64 ^ frame as u64, 0x5851_f42d_4c95_7f2d );
+    let high = folded_multiply( (key >> 64) as u64 ^ frame as u64, 0x9e37_79b9_7f4a_7c15 );
+    ((high as u128) << 64) | low as u128
+}
+
+pub fn backtrace_key( frames: &[usize] ) -> BacktraceKey {
+    frames.iter().fold( BACKTRACE_KEY_SEED, |key, &frame| extend_backtrace_key( key, frame ) )
+}
 
 #[repr(C)]
 pub struct BacktraceHeader {
-    pub key: u64,
+    pub key: BacktraceKey,
     pub id: AtomicU64,
+    interned_id: AtomicU64,
     counter: AtomicUsize,
     length: usize
 }
@@ -32,7 +66,7 @@ impl Backtrace {
         lhs.0.as_ptr() == rhs.0.as_ptr()
     }
 
-    pub fn key( &self ) -> u64 {
+    pub fn key( &self ) -> BacktraceKey {
         self.header().key
     }
 
@@ -49,6 +83,34 @@ impl Backtrace {
         self.header().id.store( value, std::sync::atomic::Ordering::Relaxed );
     }
 
+    /// The ID under which this backtrace was interned in the global `BacktraceTable`, if any.
+    pub fn interned_id( &self ) -> Option< u64 > {
+        let id = self.header().interned_id.load( std::sync::atomic::Ordering::Relaxed );
+        if id == 0 {
+            None
+        } else {
+            Some( id )
+        }
+    }
+
+    pub fn set_interned_id( &self, value: u64 ) {
+        self.header().interned_id.store( value, std::sync::atomic::Ordering::Relaxed );
+    }
+
+    pub fn into_raw( self ) -> *mut BacktraceHeader {
+        let pointer = self.0.as_ptr();
+        mem::forget( self );
+        pointer
+    }
+
+    /// # Safety
+    ///
+    /// The `pointer` must have been returned from `into_raw`, and every `from_raw`
+    /// must be paired with a single `into_raw`.
+    pub unsafe fn from_raw( pointer: *mut BacktraceHeader ) -> Self {
+        Backtrace( std::ptr::NonNull::new_unchecked( pointer ) )
+    }
+
     pub fn frames( &self ) -> &[usize] {
         let length = self.header().length;
         unsafe {
@@ -81,14 +143,15 @@ impl Drop for Backtrace {
 }
 
 impl Backtrace {
-    fn new( key: u64, backtrace: &[usize] ) -> Self {
+    pub(crate) fn new( key: BacktraceKey, backtrace: &[usize] ) -> Self {
         unsafe {
             let length = backtrace.len();
-            let layout = std::alloc::Layout::from_size_align( std::mem::size_of::< BacktraceHeader >() + std::mem::size_of::< usize >() * length, 8 ).unwrap();
+            let layout = std::alloc::Layout::from_size_align( std::mem::size_of::< BacktraceHeader >() + std::mem::size_of::< usize >() * length, std::mem::align_of::< BacktraceHeader >() ).unwrap();
             let memory = std::alloc::alloc( layout ) as *mut BacktraceHeader;
             std::ptr::write( memory, BacktraceHeader {
                 key,
                 id: AtomicU64::new( 0 ),
+                interned_id: AtomicU64::new( 0 ),
                 counter: AtomicUsize::new( 1 ),
                 length
             });
@@ -105,7 +168,7 @@ impl Backtrace {
     #[inline(never)]
     unsafe fn drop_slow( &mut self ) {
         let length = self.header().length;
-        let layout = std::alloc::Layout::from_size_align( std::mem::size_of::< BacktraceHeader >() + std::mem::size_of::< usize >() * length, 8 ).unwrap();
+        let layout = std::alloc::Layout::from_size_align( std::mem::size_of::< BacktraceHeader >() + std::mem::size_of::< usize >() * length, std::mem::align_of::< BacktraceHeader >() ).unwrap();
         std::alloc::dealloc( self.0.as_ptr() as *mut u8, layout );
     }
 
@@ -119,22 +182,160 @@ impl Backtrace {
 
 pub struct ThreadUnwindState {
     unwind_ctx: LocalUnwindContext,
-    last_dl_state: (u64, u64),
+    unwinds_until_dl_probe: u32,
+    address_space_shard: usize,
     current_backtrace: Vec< usize >,
+    /// The keys of every prefix of the `current_backtrace`, so that only the fresh frames have to be hashed.
+    current_keys: Vec< BacktraceKey >,
     buffer: Vec< usize >,
-    cache: lru::LruCache< u64, Backtrace, NoHash >
+    /// The `current_backtrace` after it was shrunk down to `MEMORY_PROFILER_MAX_BACKTRACE_DEPTH`.
+    elided_backtrace: Vec< usize >,
+    cache: lru::LruCache< BacktraceKey, Backtrace, NoHash >,
+    stack: Option< Range< usize > >,
+    /// The stacks which were switched away from, keyed by the context through which they'll be resumed.
+    suspended_stacks: HashMap< usize, StackState >,
+    /// The stacks which were switched away from for which we don't know the context yet.
+    orphaned_stacks: Vec< StackState >,
+    /// The contexts which were created but which haven't been switched to yet.
+    new_stacks: HashMap< usize, Range< usize > >
+}
+
+/// The incremental unwinding state of a single stack.
+///
+/// Every stack needs its own since the unwinding context keeps track of the frames which
+/// were already unwound on the stack it was used on; using the same one for different stacks
+/// would make every unwind after a stack switch fall back to a full one.
+struct StackState {
+    unwind_ctx: LocalUnwindContext,
+    current_backtrace: Vec< usize >,
+    current_keys: Vec< BacktraceKey >,
+    stack: Option< Range< usize > >
+}
+
+impl StackState {
+    fn new( stack: Option< Range< usize > > ) -> Self {
+        StackState {
+            unwind_ctx: LocalUnwindContext::new(),
+            current_backtrace: Vec::new(),
+            current_keys: Vec::new(),
+            stack
+        }
+    }
 }
 
 impl ThreadUnwindState {
     pub fn new() -> Self {
         ThreadUnwindState {
             unwind_ctx: LocalUnwindContext::new(),
-            last_dl_state: (0, 0),
+            unwinds_until_dl_probe: 0,
+            address_space_shard: next_shard(),
             current_backtrace: Vec::new(),
+            current_keys: Vec::new(),
             buffer: Vec::new(),
-            cache: lru::LruCache::with_hasher( crate::opt::get().backtrace_cache_size_level_1, NoHash )
+            elided_backtrace: Vec::new(),
+            cache: lru::LruCache::with_hasher( crate::opt::get().backtrace_cache_size_level_1, NoHash ),
+            // `pthread_getattr_np` can allocate, so this is looked up once when the thread is first seen.
+            stack: if use_frame_pointers() { Some( crate::frame_pointers::current_thread_stack() ) } else { None },
+            suspended_stacks: empty_hashmap(),
+            orphaned_stacks: Vec::new(),
+            new_stacks: empty_hashmap()
+        }
+    }
+
+    fn replace_stack_state( &mut self, state: StackState ) -> StackState {
+        StackState {
+            unwind_ctx: mem::replace( &mut self.unwind_ctx, state.unwind_ctx ),
+            current_backtrace: mem::replace( &mut self.current_backtrace, state.current_backtrace ),
+            current_keys: mem::replace( &mut self.current_keys, state.current_keys ),
+            stack: mem::replace( &mut self.stack, state.stack )
         }
     }
+
+    fn take_stack_state( &mut self, context: usize ) -> StackState {
+        if let Some( state ) = self.suspended_stacks.remove( &context ) {
+            state
+        } else if let Some( stack ) = self.new_stacks.remove( &context ) {
+            StackState::new( Some( stack ) )
+        } else {
+            StackState::new( None )
+        }
+    }
+
+    /// Called right before switching to `ucontext`, with the current stack saved into `saved_ucontext`, if any.
+    pub fn on_swap_ucontext( &mut self, saved_ucontext: Option< usize >, ucontext: usize, stack: Option< Range< usize > > ) {
+        let mut state = self.take_stack_state( ucontext );
+        if state.stack.is_none() {
+            state.stack = stack;
+        }
+
+        let previous = self.replace_stack_state( state );
+        if let Some( saved_ucontext ) = saved_ucontext {
+            self.suspended_stacks.insert( saved_ucontext, previous );
+        }
+    }
+
+    pub fn on_new_fcontext( &mut self, fcontext: usize, stack: Range< usize > ) {
+        self.new_stacks.insert( fcontext, stack );
+    }
+
+    /// Called right before jumping to `fcontext`.
+    ///
+    /// The context of the current stack only gets known once something jumps back to it,
+    /// so until then it's kept as an orphan.
+    pub fn on_jump_fcontext( &mut self, fcontext: usize ) {
+        let state =
+            if self.suspended_stacks.contains_key( &fcontext ) || self.new_stacks.contains_key( &fcontext ) {
+                self.take_stack_state( fcontext )
+            } else if let Some( state ) = self.orphaned_stacks.pop() {
+                // Most likely this is a context which was passed to a freshly started one
+                // which is now jumping back to it for the first time.
+                state
+            } else {
+                StackState::new( None )
+            };
+
+        let previous = self.replace_stack_state( state );
+        self.orphaned_stacks.push( previous );
+    }
+
+    /// Called right after a jump to the current stack, with the context of the stack we've jumped from.
+    pub fn on_returned_from_jump_fcontext( &mut self, previous_fcontext: usize ) {
+        if let Some( previous ) = self.orphaned_stacks.pop() {
+            self.suspended_stacks.insert( previous_fcontext, previous );
+        }
+    }
+
+    /// Recovers from a stack switch we didn't see, like when a `ucontext` returns into its `uc_link`.
+    #[inline(always)]
+    fn check_current_stack( &mut self ) {
+        if self.suspended_stacks.is_empty() {
+            return;
+        }
+
+        let marker = 0_u8;
+        let stack_pointer = &marker as *const u8 as usize;
+        if self.stack.as_ref().map( |stack| stack.contains( &stack_pointer ) ).unwrap_or( true ) {
+            return;
+        }
+
+        self.switch_to_stack_containing( stack_pointer );
+    }
+
+    #[inline(never)]
+    #[cold]
+    fn switch_to_stack_containing( &mut self, stack_pointer: usize ) {
+        let context = self.suspended_stacks.iter()
+            .find( |(_, state)| state.stack.as_ref().map( |stack| stack.contains( &stack_pointer ) ).unwrap_or( false ) )
+            .map( |(&context, _)| context );
+
+        let state = match context {
+            Some( context ) => self.suspended_stacks.remove( &context ).unwrap(),
+            None => StackState::new( None )
+        };
+
+        // Whatever was running on the previous stack has most likely finished.
+        self.replace_stack_state( state );
+    }
 }
 
 type Context = *mut c_void;
@@ -201,28 +402,92 @@ extern "C" fn on_backtrace( context: Context, data: *mut c_void ) -> ReasonCode
 }
 
 lazy_static! {
-    static ref AS: RwLock< LocalAddressSpace > = {
+    static ref AS: ShardedRwLock< LocalAddressSpace > = {
         let opts = LocalAddressSpaceOptions::new()
             .should_load_symbols( cfg!( feature = "debug-logs" ) && log_enabled!( ::log::Level::Debug ) );
 
         let mut address_space = LocalAddressSpace::new_with_opts( opts ).unwrap();
-        address_space.use_shadow_stack( opt::get().enable_shadow_stack );
-        RwLock::new( address_space )
+
+        // The shadow stack replaces the return addresses on the stack, so it can't be used
+        // when we're also going to be walking the frame pointers.
+        address_space.use_shadow_stack( opt::get().enable_shadow_stack && !use_frame_pointers() );
+        ShardedRwLock::new( address_space )
     };
+
+    static ref EXECUTABLE_REGIONS: ShardedRwLock< Vec< Range< usize > > > = {
+        let maps = crate::utils::read_file( "/proc/self/maps" ).unwrap_or_default();
+        ShardedRwLock::new( crate::frame_pointers::executable_regions_from_maps( &String::from_utf8_lossy( &maps ) ) )
+    };
+}
+
+fn use_frame_pointers() -> bool {
+    opt::get().use_frame_pointers && crate::frame_pointers::IS_SUPPORTED
 }
 
+/// The frames registered by a JIT which weren't added to the address space yet.
+///
+/// JITs can register thousands of frames every second, and every write to the address space has to wait
+/// until every thread which is unwinding is done, so the new frames are only queued up here and are added
+/// in bulk right before the next unwind. They can't be used by anything before that anyway.
+static PENDING_FRAMES: SpinLock< Vec< usize > > = SpinLock::new( Vec::new() );
+
+/// How many frames are in `PENDING_FRAMES`, so that the unwinding doesn't have to take the lock to check.
+static PENDING_FRAME_COUNT: AtomicUsize = AtomicUsize::new( 0 );
+
 pub unsafe fn register_frame_by_pointer( fde: *const u8 ) {
-    AS.write().unwrap().register_fde_from_pointer( fde )
+    let mut pending = PENDING_FRAMES.lock();
+    pending.push( fde as usize );
+    PENDING_FRAME_COUNT.store( pending.len(), Ordering::Release );
 }
 
 pub fn deregister_frame_by_pointer( fde: *const u8 ) {
-    AS.write().unwrap().unregister_fde_from_pointer( fde )
+    {
+        let mut pending = PENDING_FRAMES.lock();
+        if let Some( index ) = pending.iter().rposition( |&pending_fde| pending_fde == fde as usize ) {
+            // It was never added, so there's nothing to remove.
+            pending.remove( index );
+            PENDING_FRAME_COUNT.store( pending.len(), Ordering::Release );
+            return;
+        }
+    }
+
+    // The JIT is free to release the frame as soon as this returns, so this can't be queued.
+    let mut address_space = AS.write();
+    add_pending_frames( &mut address_space );
+    address_space.unregister_fde_from_pointer( fde )
 }
 
-static mut PERF: Option< SpinLock< Perf > > = None;
+fn add_pending_frames( address_space: &mut LocalAddressSpace ) {
+    let pending = {
+        let mut pending = PENDING_FRAMES.lock();
+        PENDING_FRAME_COUNT.store( 0, Ordering::Release );
+        mem::take( &mut *pending )
+    };
+
+    if !pending.is_empty() {
+        debug!( "Registering {} new frame(s)", pending.len() );
+    }
+
+    for fde in pending {
+        unsafe {
+            address_space.register_fde_from_pointer( fde as *const u8 );
+        }
+    }
+}
+
+/// Gets the address space for unwinding, first adding any frames which were registered since the last time.
+fn address_space_for_unwinding( shard: usize ) -> ShardedRwLockReadGuard< 'static, LocalAddressSpace > {
+    if PENDING_FRAME_COUNT.load( Ordering::Acquire ) != 0 {
+        add_pending_frames( &mut AS.write() );
+    }
+
+    AS.read( shard )
+}
+
+static mut PERF: Option< AdaptiveLock< Perf > > = None;
 
 pub fn prepare_to_start_unwinding() {
-    static FLAG: SpinLock< bool > = SpinLock::new( false );
+    static FLAG: AdaptiveLock< bool > = AdaptiveLock::new( false );
     let mut flag = FLAG.lock();
     if *flag {
         return;
@@ -245,7 +510,7 @@ pub fn prepare_to_start_unwinding() {
     match perf {
         Ok( perf ) => {
             unsafe {
-                PERF = Some( SpinLock::new( perf ) );
+                PERF = Some( AdaptiveLock::new( perf ) );
             }
         },
         Err( error ) => {
@@ -255,10 +520,15 @@ pub fn prepare_to_start_unwinding() {
 }
 
 fn reload() {
-    let mut address_space = AS.write().unwrap();
+    let mut address_space = AS.write();
+    add_pending_frames( &mut address_space );
     info!( "Reloading address space" );
     let timestamp = crate::timestamp::get_timestamp();
     let update = address_space.reload().unwrap();
+    if use_frame_pointers() {
+        *EXECUTABLE_REGIONS.write() = crate::frame_pointers::executable_regions_from_maps( &update.maps );
+    }
+
     crate::event::send_event( crate::event::InternalEvent::AddressSpaceUpdated {
         timestamp,
         maps: update.maps,
@@ -266,7 +536,7 @@ fn reload() {
     });
 }
 
-fn reload_if_necessary_perf_event_open( perf: &SpinLock< Perf > ) -> RwLockReadGuard< 'static, LocalAddressSpace > {
+fn reload_if_necessary_perf_event_open( perf: &AdaptiveLock< Perf >, shard: usize ) -> ShardedRwLockReadGuard< 'static, LocalAddressSpace > {
     if unsafe { perf.unsafe_as_ref().are_events_pending() } {
         let mut perf = perf.lock();
         let mut reload_address_space = false;
@@ -289,17 +559,35 @@ fn reload_if_necessary_perf_event_open( perf: &SpinLock< Perf > ) -> RwLockReadG
         }
     }
 
-    AS.read().unwrap()
+    address_space_for_unwinding( shard )
 }
 
-fn reload_if_necessary_dl_iterate_phdr( last_state: &mut (u64, u64) ) -> RwLockReadGuard< 'static, LocalAddressSpace > {
-    let dl_state = get_dl_state();
-    if *last_state != dl_state {
-        *last_state = dl_state;
-        reload();
+/// The sum of the dynamic linker's `dlpi_adds` and `dlpi_subs` counters as of the last reload;
+/// since both of them only ever grow this changes every time a library is loaded or unloaded.
+static DL_GENERATION: AtomicU64 = AtomicU64::new( 0 );
+
+/// How many times a thread can unwind before it checks whether any libraries were loaded or unloaded.
+///
+/// Checking that through `dl_iterate_phdr` takes the dynamic linker's lock, so it's only done once
+/// per this many unwinds; until then the frames from a library which was just loaded might be missing.
+const DL_PROBE_INTERVAL: u32 = 64;
+
+fn reload_if_necessary_dl_iterate_phdr( unwind_state: &mut ThreadUnwindState ) -> ShardedRwLockReadGuard< 'static, LocalAddressSpace > {
+    if unwind_state.unwinds_until_dl_probe == 0 {
+        unwind_state.unwinds_until_dl_probe = DL_PROBE_INTERVAL;
+
+        let (adds, subs) = get_dl_state();
+        let generation = adds.wrapping_add( subs );
+
+        // Every thread will notice the change, but only one of them has to reload the address space.
+        if DL_GENERATION.swap( generation, std::sync::atomic::Ordering::AcqRel ) != generation {
+            reload();
+        }
+    } else {
+        unwind_state.unwinds_until_dl_probe -= 1;
     }
 
-    AS.read().unwrap()
+    address_space_for_unwinding( unwind_state.address_space_shard )
 }
 
 fn get_dl_state() -> (u64, u64) {
@@ -329,8 +617,17 @@ fn on_broken_unwinding( last_backtrace_depth: usize, stale_frame_count: usize )
     unsafe { libc::abort(); }
 }
 
+lazy_static! {
+    static ref EMPTY_BACKTRACE: Backtrace = Backtrace::new( BACKTRACE_KEY_SEED, &[] );
+}
+
 #[inline(always)]
 pub fn grab( tls: &mut StrongThreadHandle ) -> Backtrace {
+    if crate::backpressure::should_drop_backtrace() {
+        return EMPTY_BACKTRACE.clone();
+    }
+
+    let _timer = Timer::start( Stage::Unwind );
     unsafe {
         let (is_unwinding, unwind_state) = tls.unwind_state();
         *is_unwinding.get() = true;
@@ -347,12 +644,17 @@ pub fn grab_from_any( tls: &mut crate::global::ThreadHandleKind ) -> Option< Bac
             Some( grab( tls ) )
         },
         crate::global::ThreadHandleKind::Weak( tls ) => {
+            if crate::backpressure::should_drop_backtrace() {
+                return Some( EMPTY_BACKTRACE.clone() );
+            }
+
             unsafe {
                 let (is_unwinding, unwind_state) = tls.unwind_state();
                 if *is_unwinding.get() {
                     return None;
                 }
 
+                let _timer = Timer::start( Stage::Unwind );
                 *is_unwinding.get() = true;
                 let backtrace = grab_with_unwind_state( &mut *unwind_state.get() );
                 *is_unwinding.get() = false;
@@ -362,23 +664,104 @@ pub fn grab_from_any( tls: &mut crate::global::ThreadHandleKind ) -> Option< Bac
     }
 }
 
+/// Grabs the backtrace for a deallocation, which is only as deep as `MEMORY_PROFILER_BACKTRACE_DEPTH_ON_FREE`, if set.
+#[inline(always)]
+pub fn grab_on_free( tls: &mut StrongThreadHandle ) -> Backtrace {
+    let max_depth = opt::get().backtrace_depth_on_free;
+    if max_depth == 0 {
+        return grab( tls );
+    }
+
+    if crate::backpressure::should_drop_backtrace() {
+        return EMPTY_BACKTRACE.clone();
+    }
+
+    let _timer = Timer::start( Stage::Unwind );
+    unsafe {
+        let (is_unwinding, unwind_state) = tls.unwind_state();
+        *is_unwinding.get() = true;
+        let backtrace = grab_shallow_with_unwind_state( &mut *unwind_state.get(), max_depth );
+        *is_unwinding.get() = false;
+        backtrace
+    }
+}
+
+/// Lets the unwinder know that this thread is about to switch, or has just switched, to another stack.
+pub fn on_stack_switch( callback: impl FnOnce( &mut ThreadUnwindState ) ) {
+    if !opt::get().track_stack_switches {
+        return;
+    }
+
+    let mut thread = match StrongThreadHandle::acquire() {
+        Some( thread ) => thread,
+        None => return
+    };
+
+    unsafe {
+        let (is_unwinding, unwind_state) = thread.unwind_state();
+        if !*is_unwinding.get() {
+            callback( &mut *unwind_state.get() );
+        }
+    }
+}
+
+#[inline(always)]
+fn unwind_through_frame_pointers( unwind_state: &mut ThreadUnwindState ) -> bool {
+    let stack = match unwind_state.stack {
+        Some( ref stack ) => stack,
+        None => {
+            instrumentation::count( Counter::FramePointerFallback );
+            return false;
+        }
+    };
+
+    let regions = EXECUTABLE_REGIONS.read( unwind_state.address_space_shard );
+    let buffer = &mut unwind_state.buffer;
+    buffer.clear();
+
+    if crate::frame_pointers::unwind( stack, &regions, buffer ) {
+        instrumentation::count( Counter::FramePointerUnwind );
+        return true;
+    }
+
+    instrumentation::count( Counter::FramePointerFallback );
+    if cfg!( feature = "debug-logs" ) {
+        debug!( "Broken frame pointer chain after {} frames; falling back to DWARF unwinding", buffer.len() );
+    }
+
+    false
+}
+
+/// Reuses the backtrace if any thread has already interned it, so that the same stack
+/// seen on many threads doesn't get allocated (and later freed) over and over again.
+fn new_backtrace( key: BacktraceKey, frames: &[usize] ) -> Backtrace {
+    if let Some( backtrace ) = crate::backtrace_table::lookup( key, frames ) {
+        return backtrace;
+    }
+
+    Backtrace::new( key, frames )
+}
+
 #[inline(never)]
 fn grab_with_unwind_state( unwind_state: &mut ThreadUnwindState ) -> Backtrace {
-    let unwind_ctx = &mut unwind_state.unwind_ctx;
+    unwind_state.check_current_stack();
 
     let address_space = unsafe {
         if let Some( ref perf ) = PERF {
-            reload_if_necessary_perf_event_open( perf )
+            reload_if_necessary_perf_event_open( perf, unwind_state.address_space_shard )
         } else {
-            reload_if_necessary_dl_iterate_phdr( &mut unwind_state.last_dl_state )
+            reload_if_necessary_dl_iterate_phdr( unwind_state )
         }
     };
 
     let stale_count;
     let debug_crosscheck_unwind_results = opt::crosscheck_unwind_results_with_libunwind() && !address_space.is_shadow_stack_enabled();
-    if debug_crosscheck_unwind_results || !opt::emit_partial_backtraces() {
+    if use_frame_pointers() && unwind_through_frame_pointers( unwind_state ) {
+        stale_count = unwind_state.current_backtrace.len();
+    } else if debug_crosscheck_unwind_results || !opt::emit_partial_backtraces() {
         stale_count = unwind_state.current_backtrace.len();
 
+        let unwind_ctx = &mut unwind_state.unwind_ctx;
         let buffer = &mut unwind_state.buffer;
         buffer.clear();
 
@@ -387,6 +770,7 @@ fn grab_with_unwind_state( unwind_state: &mut ThreadUnwindState ) -> Backtrace {
             UnwindControl::Continue
         });
     } else {
+        let unwind_ctx = &mut unwind_state.unwind_ctx;
         let buffer = &mut unwind_state.buffer;
         buffer.clear();
 
@@ -421,48 +805,56 @@ fn grab_with_unwind_state( unwind_state: &mut ThreadUnwindState ) -> Backtrace {
     let remaining = unwind_state.current_backtrace.len() - stale_count;
     unwind_state.current_backtrace.truncate( remaining );
     unwind_state.current_backtrace.reserve( unwind_state.buffer.len() );
+    unwind_state.current_keys.truncate( remaining );
+    unwind_state.current_keys.reserve( unwind_state.buffer.len() );
 
-    const PRIME: u64 = 1099511628211;
-    let mut key: u64 = 0;
-    for &frame in &unwind_state.current_backtrace {
-        key = key.wrapping_mul( PRIME );
-        key ^= frame as u64;
-    }
+    let mut key = unwind_state.current_keys.last().copied().unwrap_or( BACKTRACE_KEY_SEED );
     for &frame in unwind_state.buffer.iter().rev() {
-        key = key.wrapping_mul( PRIME );
-        key ^= frame as u64;
+        key = extend_backtrace_key( key, frame );
         unwind_state.current_backtrace.push( frame );
+        unwind_state.current_keys.push( key );
     }
     unwind_state.buffer.clear();
 
+    // The full backtrace still has to be kept around as-is for the next partial unwind.
+    let max_depth = opt::get().max_backtrace_depth;
+    let frames = if max_depth > 0 && unwind_state.current_backtrace.len() > max_depth {
+        let elided = &mut unwind_state.elided_backtrace;
+        common::elide::elide_frames( &unwind_state.current_backtrace, max_depth, common::elide::ELIDED_FRAMES_MARKER as usize, elided );
+
+        key = backtrace_key( elided );
+
+        &unwind_state.elided_backtrace[..]
+    } else {
+        &unwind_state.current_backtrace[..]
+    };
+
     let backtrace = match unwind_state.cache.get_mut( &key ) {
         None => {
+            instrumentation::count( Counter::BacktraceCacheLevel1Miss );
             if cfg!( debug_assertions ) {
                 if unwind_state.cache.len() >= unwind_state.cache.cap() {
                     debug!( "1st level backtrace cache overflow" );
                 }
             }
 
-            let entry = Backtrace::new( key, &unwind_state.current_backtrace );
+            let entry = new_backtrace( key, frames );
             unwind_state.cache.put( key, entry.clone() );
 
             entry
         },
         Some( entry ) => {
-            if entry.frames() == unwind_state.current_backtrace {
-                entry.clone()
-            } else {
-                info!( "1st level backtrace cache conflict detected!" );
-
-                let new_entry = Backtrace::new( key, &unwind_state.current_backtrace );
-                *entry = new_entry.clone();
-
-                new_entry
+            instrumentation::count( Counter::BacktraceCacheLevel1Hit );
+            if cfg!( debug_assertions ) && entry.frames() != frames {
+                instrumentation::count( Counter::BacktraceCacheLevel1Conflict );
+                error!( "1st level backtrace cache conflict detected!" );
             }
+
+            entry.clone()
         }
     };
 
-    if debug_crosscheck_unwind_results {
+    if debug_crosscheck_unwind_results && backtrace.frames().len() == unwind_state.current_backtrace.len() {
         let mut expected: Vec< usize > = Vec::with_capacity( backtrace.frames().len() );
         unsafe {
             _Unwind_Backtrace( on_backtrace, transmute( &mut expected ) );
@@ -476,7 +868,7 @@ fn grab_with_unwind_state( unwind_state: &mut ThreadUnwindState ) -> Backtrace {
         if backtrace.frames()[ ..backtrace.frames().len() - 1 ] != expected[ ..expected.len() - 1 ] {
             info!( "/proc/self/maps:\n{}", String::from_utf8_lossy( &::std::fs::read( "/proc/self/maps" ).unwrap() ).trim() );
 
-            let address_space = AS.read().unwrap();
+            let address_space = AS.read( unwind_state.address_space_shard );
             info!( "Expected: ({} frames)", expected.len() );
             for (nth, &address) in expected.iter().enumerate() {
                 info!( "({:02})    {:?}", nth, address_space.decode_symbol_once( address ) );
@@ -493,3 +885,70 @@ fn grab_with_unwind_state( unwind_state: &mut ThreadUnwindState ) -> Backtrace {
 
     backtrace
 }
+
+/// Unwinds at most `max_depth` of the innermost frames.
+///
+/// This doesn't touch the state which is used for the partial unwinding, so the next
+/// full backtrace on this thread will be unwound exactly as if this one never happened.
+#[inline(never)]
+fn grab_shallow_with_unwind_state( unwind_state: &mut ThreadUnwindState, max_depth: usize ) -> Backtrace {
+    unwind_state.check_current_stack();
+
+    let address_space = unsafe {
+        if let Some( ref perf ) = PERF {
+            reload_if_necessary_perf_event_open( perf, unwind_state.address_space_shard )
+        } else {
+            reload_if_necessary_dl_iterate_phdr( unwind_state )
+        }
+    };
+
+    if !(use_frame_pointers() && unwind_through_frame_pointers( unwind_state )) {
+        let unwind_ctx = &mut unwind_state.unwind_ctx;
+        let buffer = &mut unwind_state.buffer;
+        buffer.clear();
+
+        address_space.unwind( unwind_ctx, |address| {
+            buffer.push( address );
+            if buffer.len() < max_depth {
+                UnwindControl::Continue
+            } else {
+                UnwindControl::Stop
+            }
+        });
+    }
+
+    mem::drop( address_space );
+
+    let buffer = &mut unwind_state.buffer;
+    buffer.truncate( max_depth );
+    buffer.reverse();
+
+    // Seed the key differently so that these don't keep on evicting the full backtraces from the cache.
+    let key = buffer.iter().fold( BACKTRACE_KEY_SEED ^ max_depth as BacktraceKey, |key, &frame| extend_backtrace_key( key, frame ) );
+    let backtrace = match unwind_state.cache.get( &key ) {
+        Some( entry ) => entry.clone(),
+        None => {
+            let entry = Backtrace::new( key, buffer );
+            unwind_state.cache.put( key, entry.clone() );
+            entry
+        }
+    };
+
+    buffer.clear();
+    backtrace
+}
+
+#[test]
+fn test_backtrace_key() {
+    let frames = [ 0x1000, 0x2000, 0x3000 ];
+    let mut key = BACKTRACE_KEY_SEED;
+    for &frame in &frames {
+        key = extend_backtrace_key( key, frame );
+    }
+
+    assert_eq!( key, backtrace_key( &frames ) );
+    assert_eq!( backtrace_key( &[] ), BACKTRACE_KEY_SEED );
+    assert_ne!( backtrace_key( &[ 0x1000, 0x3000, 0x2000 ] ), key );
+    assert_ne!( backtrace_key( &frames[ ..2 ] ), key );
+    assert_ne!( (key >> 64) as u64, key as u64 );
+}
@@ -1,6 +1,10 @@
 use std::cmp::min;
+use std::convert::TryInto;
 use std::fs::File;
 use std::io::{self, Read, Write, Seek, SeekFrom};
+use std::mem;
+use std::ops::Range;
+use std::os::unix::fs::FileExt;
 use std::ptr;
 
 use nwind::proc_maps::parse as parse_maps;
@@ -12,6 +16,48 @@ use crate::PAGE_SIZE;
 use crate::syscall;
 use crate::writers::write_maps;
 
+// How much data is read from the pipe with a single `read`.
+const READ_CHUNK_SIZE: usize = 64 * 1024;
+
+// The dumper is a separate process, so the data is framed on its way through
+// the pipe; that way the events written by the processing thread can be safely
+// interleaved with the events of the memory dump.
+struct FramedPipeWriter {
+    fd: libc::c_int,
+    frame: Vec< u8 >
+}
+
+impl FramedPipeWriter {
+    fn write_event( &mut self, event: Event ) -> io::Result< () > {
+        self.frame.clear();
+        self.frame.extend_from_slice( &[0; 4] );
+        event.write_to_stream( &mut self.frame )?;
+        self.write_frame()
+    }
+
+    fn write_frame( &mut self ) -> io::Result< () > {
+        let length = (self.frame.len() - 4) as u32;
+        self.frame[ 0..4 ].copy_from_slice( &length.to_le_bytes() );
+
+        let mut data = &self.frame[..];
+        while !data.is_empty() {
+            let count = syscall::write( self.fd, data );
+            if count < 0 {
+                let error = io::Error::last_os_error();
+                if error.kind() == io::ErrorKind::Interrupted {
+                    continue;
+                }
+
+                return Err( error );
+            }
+
+            data = &data[ count as usize.. ];
+        }
+
+        Ok(())
+    }
+}
+
 fn is_accessible< U: Read + Seek >( mut fp: U, address: u64 ) -> bool {
     if let Err( _ ) = fp.seek( SeekFrom::Start( address ) ) {
         return false;
@@ -24,112 +70,336 @@ fn is_accessible< U: Read + Seek >( mut fp: U, address: u64 ) -> bool {
     }
 }
 
-fn memory_dump_body< U: Write >( mut serializer: &mut U ) -> io::Result< () > {
+/// Returns the end of the accessible part of a region, assuming that it starts at the region's start.
+fn accessible_end( fp: &mut File, start: u64, end: u64, page_size: u64 ) -> u64 {
+    let mut low = 0;
+    let mut high = (end - start) / page_size;
+    while low != high {
+        let current = low + (high - low) / 2;
+        if is_accessible( &mut *fp, start + current * page_size + page_size - 1 ) {
+            low = current + 1;
+        } else {
+            high = current;
+        }
+    }
+
+    start + high * page_size
+}
+
+// The bits of a `/proc/self/pagemap` entry which say whenever the page is in memory or in swap.
+const PAGEMAP_PRESENT: u64 = 1 << 63;
+const PAGEMAP_SWAPPED: u64 = 1 << 62;
+
+// How many pagemap entries are read at a time.
+const PAGEMAP_CHUNK_LENGTH: usize = 4096;
+
+/// Appends the ranges of the pages of `start..end` which were ever touched, according to the pagemap.
+///
+/// Those which were never touched read back as zeros anyway, so there's no point in dumping them.
+fn touched_ranges( pagemap: &File, start: u64, end: u64, page_size: u64, output: &mut Vec< Range< u64 > > ) -> io::Result< () > {
+    let mut entries = [0_u8; PAGEMAP_CHUNK_LENGTH * 8];
+    let mut page = start / page_size;
+    let end_page = end / page_size;
+    while page < end_page {
+        let count = min( PAGEMAP_CHUNK_LENGTH as u64, end_page - page ) as usize;
+        pagemap.read_exact_at( &mut entries[ ..count * 8 ], page * 8 )?;
+        for (index, entry) in entries[ ..count * 8 ].chunks_exact( 8 ).enumerate() {
+            let entry = u64::from_le_bytes( entry.try_into().unwrap() );
+            if entry & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED) == 0 {
+                continue;
+            }
+
+            let address = (page + index as u64) * page_size;
+            match output.last_mut() {
+                Some( range ) if range.end == address => range.end += page_size,
+                _ => output.push( address..address + page_size )
+            }
+        }
+
+        page += count as u64;
+    }
+
+    Ok(())
+}
+
+fn is_zero( page: &[u8] ) -> bool {
+    page.chunks_exact( 16 ).all( |chunk| u128::from_ne_bytes( chunk.try_into().unwrap() ) == 0 )
+}
+
+/// Writes out the given memory, skipping over the pages which are all zeros.
+fn write_memory( serializer: &mut FramedPipeWriter, address: u64, data: &[u8], page_size: u64 ) -> io::Result< () > {
+    let mut run_start = None;
+    for (index, page) in data.chunks( page_size as usize ).enumerate() {
+        let offset = index * page_size as usize;
+        match (run_start, is_zero( page )) {
+            (None, false) => run_start = Some( offset ),
+            (Some( start ), true) => {
+                serializer.write_event( Event::MemoryDump {
+                    address: address + start as u64,
+                    length: (offset - start) as u64,
+                    data: data[ start..offset ].into()
+                })?;
+                run_start = None;
+            },
+            _ => {}
+        }
+    }
+
+    if let Some( start ) = run_start {
+        serializer.write_event( Event::MemoryDump {
+            address: address + start as u64,
+            length: (data.len() - start) as u64,
+            data: data[ start.. ].into()
+        })?;
+    }
+
+    Ok(())
+}
+
+fn memory_dump_body( serializer: &mut FramedPipeWriter ) -> io::Result< () > {
     let mut buffer = Vec::new();
     buffer.resize( 1024 * 128, 0 );
     let mut buffer = buffer.into_boxed_slice();
-    let maps = write_maps( serializer )?;
+
+    serializer.frame.clear();
+    serializer.frame.extend_from_slice( &[0; 4] );
+    let maps = write_maps( &mut serializer.frame )?;
+    serializer.write_frame()?;
+
     let maps = String::from_utf8_lossy( &maps );
     let maps = parse_maps( &maps );
     let mut fp = File::open( "/proc/self/mem" )?;
     let page_size = PAGE_SIZE as u64;
 
+    let pagemap = match File::open( "/proc/self/pagemap" ) {
+        Ok( pagemap ) => Some( pagemap ),
+        Err( error ) => {
+            warn!( "Failed to open the pagemap; the whole memory will be dumped: {}", error );
+            None
+        }
+    };
 
+    let mut ranges = Vec::new();
     for region in maps {
         if !region.is_write && region.inode != 0 {
             continue;
         }
 
-        let mut end = {
-            let total_length = (region.end - region.start) / page_size;
+        ranges.clear();
+        let has_ranges = match pagemap {
+            Some( ref pagemap ) => touched_ranges( pagemap, region.start, region.end, page_size, &mut ranges ).is_ok(),
+            None => false
+        };
 
-            let mut start = 0;
-            let mut end = total_length;
-            loop {
-                if start == end {
-                    break;
-                }
+        if !has_ranges {
+            ranges.clear();
+            ranges.push( region.start..accessible_end( &mut fp, region.start, region.end, page_size ) );
+        }
 
-                let current = start + (end - start) / 2;
-                let accessible = is_accessible( &mut fp, region.start + current * page_size + page_size - 1 );
-                if !accessible {
-                    end = current;
-                } else {
-                    start = current + 1;
+        for range in &ranges {
+            let mut address = range.start;
+            while address < range.end {
+                let chunk_size = min( buffer.len() as u64, range.end - address ) as usize;
+                let data = &mut buffer[ ..chunk_size ];
+
+                // Whatever was made inaccessible since the maps were read is simply skipped.
+                if fp.read_exact_at( data, address ).is_ok() {
+                    write_memory( serializer, address, data, page_size )?;
                 }
+
+                address += chunk_size as u64;
             }
+        }
+    }
+
+    Ok(())
+}
+
+/// A memory dump which is being streamed from a forked child process.
+///
+/// The child gets a copy-on-write snapshot of the whole address space, so the allocations
+/// only have to be blocked while forking; the dump is then gradually copied to the output
+/// in slices, in between the other events.
+pub struct MemoryDump {
+    pid: libc::pid_t,
+    fd: libc::c_int,
+    buffer: Vec< u8 >,
+    is_finished: bool
+}
+
+pub fn start_memory_dump() -> io::Result< MemoryDump > {
+    info!( "Writing a memory dump..." );
+
+    let mut fds = [0; 2];
+    if unsafe { libc::pipe2( fds.as_mut_ptr(), libc::O_CLOEXEC ) } < 0 {
+        return Err( io::Error::last_os_error() );
+    }
 
-            region.start + end * page_size
+    let [fd_read, fd_write] = fds;
+    unsafe {
+        // Not fatal if it fails; it's only going to be slower.
+        libc::fcntl( fd_write, libc::F_SETPIPE_SZ, 1024 * 1024 );
+        libc::fcntl( fd_read, libc::F_SETFL, libc::fcntl( fd_read, libc::F_GETFL ) | libc::O_NONBLOCK );
+    }
+
+    let pid = unsafe { libc::fork() };
+    if pid == 0 {
+        syscall::close( fd_read );
+        let mut serializer = FramedPipeWriter {
+            fd: fd_write,
+            frame: Vec::new()
         };
 
-        loop {
-            let chunk_size = min( buffer.len() as u64, end - region.start );
-            if chunk_size == 0 {
-                break;
+        let result = memory_dump_body( &mut serializer );
+        syscall::exit( if result.is_err() { 1 } else { 0 } );
+    }
+
+    let error = io::Error::last_os_error();
+    syscall::close( fd_write );
+    if pid < 0 {
+        syscall::close( fd_read );
+        return Err( error );
+    }
+
+    Ok( MemoryDump {
+        pid,
+        fd: fd_read,
+        buffer: Vec::new(),
+        is_finished: false
+    })
+}
+
+impl MemoryDump {
+    /// Copies at most around `budget` bytes of the memory dump into the `serializer`
+    /// without blocking. Returns `true` once the whole dump was written.
+    pub fn poll< U: Write >( &mut self, serializer: &mut U, budget: usize ) -> io::Result< bool > {
+        let mut total = 0;
+        while !self.is_finished && total < budget {
+            let position = self.buffer.len();
+            self.buffer.resize( position + READ_CHUNK_SIZE, 0 );
+            let count = unsafe { libc::read( self.fd, self.buffer.as_mut_ptr().add( position ) as *mut libc::c_void, READ_CHUNK_SIZE ) };
+            if count < 0 {
+                self.buffer.truncate( position );
+                let error = io::Error::last_os_error();
+                match error.kind() {
+                    io::ErrorKind::Interrupted => continue,
+                    io::ErrorKind::WouldBlock => break,
+                    _ => return Err( error )
+                }
             }
 
-            let address = end - chunk_size;
-            fp.seek( SeekFrom::Start( address ) )?;
-            fp.read_exact( &mut buffer[ 0..chunk_size as usize ] )?;
-            let data = &buffer[ 0..chunk_size as usize ];
-            Event::MemoryDump {
-                address,
-                length: chunk_size as u64,
-                data: data.into()
-            }.write_to_stream( &mut serializer )?;
+            self.buffer.truncate( position + count as usize );
+            if count == 0 {
+                self.is_finished = true;
+            }
+
+            total += count as usize;
+            self.write_complete_frames( serializer )?;
+        }
+
+        if self.is_finished {
+            if !self.buffer.is_empty() {
+                warn!( "Memory dump was truncated" );
+            }
+
+            self.wait();
+            info!( "Memory dump finished" );
+        }
+
+        Ok( self.is_finished )
+    }
+
+    /// Copies the rest of the memory dump into the `serializer`, blocking if necessary.
+    pub fn finish< U: Write >( mut self, serializer: &mut U ) -> io::Result< () > {
+        while !self.poll( serializer, usize::MAX )? {
+            let mut fd = libc::pollfd {
+                fd: self.fd,
+                events: libc::POLLIN,
+                revents: 0
+            };
 
-            end -= chunk_size;
+            unsafe {
+                libc::poll( &mut fd, 1, 100 );
+            }
         }
 
-/*
-        let mut page: [u8; 4096] = [0; 4096];
-        while address > region.start {
-            fp.seek( SeekFrom::Start( address - page_size ) )?;
-            fp.read_exact( &mut page )?;
+        Ok(())
+    }
 
-            if page.iter().all( |&byte| byte == 0 ) {
-                address -= page_size;
-            } else {
+    fn write_complete_frames< U: Write >( &mut self, serializer: &mut U ) -> io::Result< () > {
+        let mut offset = 0;
+        while self.buffer.len() - offset >= 4 {
+            let mut length = [0; 4];
+            length.copy_from_slice( &self.buffer[ offset..offset + 4 ] );
+            let length = u32::from_le_bytes( length ) as usize;
+            if self.buffer.len() - offset - 4 < length {
                 break;
             }
+
+            serializer.write_all( &self.buffer[ offset + 4..offset + 4 + length ] )?;
+            offset += 4 + length;
         }
 
-        fp.seek( SeekFrom::Start( region.start ) )?;
-        let mut current = region.start;
+        self.buffer.drain( ..offset );
+        Ok(())
+    }
+
+    fn wait( &mut self ) {
+        if self.pid == 0 {
+            return;
+        }
 
-        while current < address {
-            let chunk_size = min( buffer.len(), (address - current) as usize );
-            fp.read_exact( &mut buffer[ 0..chunk_size ] )?;
-            let data = &buffer[ 0..chunk_size ];
-            Event::MemoryDump {
-                address: current,
-                length: chunk_size as u64,
-                data
-            }.write_to_stream( LittleEndian, serializer )?;
-            current += chunk_size as u64;
+        let pid = mem::replace( &mut self.pid, 0 );
+        unsafe {
+            libc::waitpid( pid, ptr::null_mut(), 0 );
         }
-*/
     }
+}
 
-    serializer.flush()?;
-    Ok(())
+impl Drop for MemoryDump {
+    fn drop( &mut self ) {
+        if self.pid != 0 {
+            unsafe {
+                libc::kill( self.pid, libc::SIGKILL );
+            }
+
+            self.wait();
+        }
+
+        syscall::close( self.fd );
+    }
 }
 
-pub fn write_memory_dump< U: Write >( serializer: &mut U ) -> io::Result< () > {
-    info!( "Writing a memory dump..." );
-    serializer.flush()?;
+#[test]
+fn test_touched_ranges() {
+    let page_size = unsafe { libc::sysconf( libc::_SC_PAGESIZE ) } as u64;
+    let length = 16 * page_size as usize;
+    let pointer = unsafe {
+        libc::mmap( ptr::null_mut(), length, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_PRIVATE | libc::MAP_ANONYMOUS, -1, 0 )
+    };
+    assert_ne!( pointer, libc::MAP_FAILED );
 
-    let pid = unsafe { libc::fork() };
-    if pid == 0 {
-        let result = memory_dump_body( serializer );
-        syscall::exit( if result.is_err() { 1 } else { 0 } );
-    } else {
-        info!( "Waiting for child to finish..." );
+    let start = pointer as u64;
+    for &page in &[2, 3, 7] {
         unsafe {
-            libc::waitpid( pid, ptr::null_mut(), 0 );
+            *(pointer as *mut u8).add( page * page_size as usize ) = 1;
         }
     }
 
-    info!( "Memory dump finished" );
-    Ok(())
+    let pagemap = File::open( "/proc/self/pagemap" ).unwrap();
+    let mut ranges = Vec::new();
+    touched_ranges( &pagemap, start, start + length as u64, page_size, &mut ranges ).unwrap();
+    assert_eq!( ranges, vec![
+        start + 2 * page_size..start + 4 * page_size,
+        start + 7 * page_size..start + 8 * page_size
+    ]);
+
+    unsafe {
+        libc::munmap( pointer, length );
+    }
+
+    assert!( is_zero( &[0; 4096] ) );
+    let mut page = [0; 4096];
+    page[ 4095 ] = 1;
+    assert!( !is_zero( &page ) );
 }
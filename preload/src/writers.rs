@@ -4,11 +4,12 @@ use std::fs::{self, File};
 use std::io::{self, Write};
 use std::mem;
 use std::path::Path;
+use std::sync::mpsc;
 
 use nwind::proc_maps::Region;
 use nwind::proc_maps::parse as parse_maps;
 
-use common::event::{DataId, Event, HeaderBody, HEADER_FLAG_IS_LITTLE_ENDIAN};
+use common::event::{DataId, Event, HeaderBody, HEADER_FLAG_HAS_CHILD_PROCESSES, HEADER_FLAG_IS_LITTLE_ENDIAN};
 use common::speedy::Writable;
 use common::Timestamp;
 
@@ -17,6 +18,7 @@ use crate::arch;
 use crate::opt;
 use crate::timestamp::{get_timestamp, get_wall_clock};
 use crate::utils::read_file;
+use crate::backtrace_table::BacktraceRef;
 use crate::processing_thread::BacktraceCache;
 use crate::unwind::Backtrace;
 
@@ -62,6 +64,82 @@ fn write_file< U: Write >( mut serializer: &mut U, path: &str, bytes: &[u8] ) ->
     Ok(())
 }
 
+fn store_binary( store: &str, build_id: &[u8], bytes: &[u8] ) -> io::Result< String > {
+    let mut name = String::with_capacity( build_id.len() * 2 );
+    for byte in build_id {
+        name.push_str( &format!( "{:02x}", byte ) );
+    }
+
+    let location = Path::new( store ).join( &name );
+    if location.exists() {
+        return Ok( location.to_string_lossy().into_owned() );
+    }
+
+    fs::create_dir_all( store )?;
+    let tmp_location = Path::new( store ).join( format!( ".{}.{}.tmp", name, crate::syscall::getpid() ) );
+    {
+        let mut fp = File::create( &tmp_location )?;
+        fp.write_all( bytes )?;
+    }
+
+    if let Err( error ) = fs::rename( &tmp_location, &location ) {
+        let _ = fs::remove_file( &tmp_location );
+        return Err( error );
+    }
+
+    Ok( location.to_string_lossy().into_owned() )
+}
+
+/// Writes out a binary; if a binary store is configured and the binary
+/// has a build ID then only a reference to it is written.
+/// Writes out only what's needed to find the binary again when the data is loaded.
+fn write_binary_identity< U: Write >( serializer: &mut U, timestamp: Timestamp, path: &str, bytes: &[u8] ) -> io::Result< () > {
+    let mtime = fs::metadata( path ).ok()
+        .and_then( |metadata| metadata.modified().ok() )
+        .and_then( |mtime| mtime.duration_since( std::time::UNIX_EPOCH ).ok() )
+        .map( |mtime| mtime.as_secs() )
+        .unwrap_or( 0 );
+
+    Event::BinaryIdentity {
+        timestamp,
+        path: path.into(),
+        build_id: crate::elf::parse_build_id( bytes ).unwrap_or( &[] ).into(),
+        debuglink: crate::elf::parse_debuglink( bytes ).unwrap_or( &[] ).into(),
+        size: bytes.len() as u64,
+        mtime
+    }.write_to_stream( serializer )
+}
+
+pub fn write_binary< U: Write >( mut serializer: &mut U, timestamp: Timestamp, path: &str, bytes: &[u8] ) -> io::Result< () > {
+    if opt::get().identify_binaries_only {
+        return write_binary_identity( serializer, timestamp, path, bytes );
+    }
+
+    if let Some( ref store ) = opt::get().binary_store {
+        if let Some( build_id ) = crate::elf::parse_build_id( bytes ) {
+            match store_binary( store.to_str().unwrap(), build_id, bytes ) {
+                Ok( location ) => {
+                    return Event::BinaryReference {
+                        timestamp,
+                        path: path.into(),
+                        build_id: build_id.into(),
+                        location: location.into()
+                    }.write_to_stream( &mut serializer );
+                },
+                Err( error ) => {
+                    warn!( "Failed to write '{}' to the binary store: {}", path, error );
+                }
+            }
+        }
+    }
+
+    Event::File64 {
+        timestamp,
+        path: path.into(),
+        contents: bytes.into()
+    }.write_to_stream( &mut serializer )
+}
+
 fn new_header_body( id: DataId, initial_timestamp: Timestamp ) -> io::Result< HeaderBody > {
     let (timestamp, wall_clock_secs, wall_clock_nsecs) = get_wall_clock();
 
@@ -70,6 +148,10 @@ fn new_header_body( id: DataId, initial_timestamp: Timestamp ) -> io::Result< He
         flags |= HEADER_FLAG_IS_LITTLE_ENDIAN;
     }
 
+    if opt::get().track_child_processes && opt::get().multiplex_child_processes {
+        flags |= HEADER_FLAG_HAS_CHILD_PROCESSES;
+    }
+
     Ok( HeaderBody {
         id,
         initial_timestamp,
@@ -112,7 +194,7 @@ pub fn write_binaries< U: Write >( mut serializer: &mut U ) -> io::Result< () >
     serializer.flush()?;
     for filename in files {
         debug!( "Writing '{}'...", filename );
-        match mmap_file( &filename, |bytes| write_file( &mut serializer, &filename, bytes ) ) {
+        match mmap_file( &filename, |bytes| write_binary( &mut serializer, get_timestamp(), &filename, bytes ) ) {
             Ok( result ) => {
                 result?
             },
@@ -120,6 +202,8 @@ pub fn write_binaries< U: Write >( mut serializer: &mut U ) -> io::Result< () >
                 debug!( "Failed to mmap '{}': {}", filename, error );
             }
         }
+
+        serializer.flush()?;
     }
 
     Ok(())
@@ -131,12 +215,41 @@ pub fn write_maps< U: Write >( serializer: &mut U ) -> io::Result< Vec< u8 > > {
     Ok( maps )
 }
 
+fn write_parent_data< U: Write >( serializer: &mut U ) -> io::Result< () > {
+    let value = match unsafe { crate::syscall::getenv( crate::processing_thread::PARENT_DATA_ID_VAR.as_bytes() ) } {
+        Some( value ) => value,
+        None => return Ok(())
+    };
+
+    let id: DataId = match value.to_str().and_then( |value| value.parse().ok() ) {
+        Some( id ) => id,
+        None => {
+            warn!( "Invalid {}: {:?}", crate::processing_thread::PARENT_DATA_ID_VAR, value );
+            return Ok(());
+        }
+    };
+
+    info!( "Parent data ID: {}", id );
+    Event::ParentData { id }.write_to_stream( serializer )?;
+    Ok(())
+}
+
 fn write_wallclock< U: Write >( serializer: &mut U ) -> io::Result< () > {
     let (timestamp, sec, nsec) = get_wall_clock();
     Event::WallClock { timestamp, sec, nsec }.write_to_stream( serializer )?;
     Ok(())
 }
 
+fn write_sampling_interval< U: Write >( serializer: &mut U ) -> io::Result< () > {
+    let interval = opt::sampling_interval();
+    if interval == 0 {
+        return Ok(());
+    }
+
+    Event::SamplingInterval { interval: interval as u64 }.write_to_stream( serializer )?;
+    Ok(())
+}
+
 fn write_uptime< U: Write >( serializer: &mut U ) -> io::Result< () > {
     let uptime = fs::read( "/proc/uptime" )?;
     write_file( serializer, "/proc/uptime", &uptime )
@@ -170,28 +283,51 @@ pub(crate) fn write_backtrace< U: Write >( serializer: &mut U, backtrace: Backtr
         return Ok( id );
     }
 
-    let frames = backtrace.frames();
+    write_backtrace_frames( serializer, id, backtrace.frames() )?;
+    Ok( id )
+}
+
+pub(crate) fn write_backtrace_ref< U: Write >( serializer: &mut U, backtrace: BacktraceRef, cache: &mut BacktraceCache ) -> io::Result< u64 > {
+    let id = match backtrace {
+        BacktraceRef::Owned( backtrace ) => return write_backtrace( serializer, backtrace, cache ),
+        BacktraceRef::Interned( id ) => id
+    };
+
+    if cache.mark_interned_as_emitted( id ) {
+        let backtrace = crate::backtrace_table::get( id ).expect( "internal error: interned backtrace not found" );
+        write_backtrace_frames( serializer, id, backtrace.frames() )?;
+    }
+
+    Ok( id )
+}
 
+fn write_backtrace_frames< U: Write >( serializer: &mut U, id: u64, frames: &[usize] ) -> io::Result< () > {
     // TODO: Get rid of this.
     let frames: Vec< _ > = frames.iter().copied().rev().collect();
 
-    if mem::size_of::< usize >() == mem::size_of::< u32 >() {
+    let event = if mem::size_of::< usize >() == mem::size_of::< u32 >() {
         let frames: &[u32] = unsafe { std::slice::from_raw_parts( frames.as_ptr() as *const u32, frames.len() ) };
         Event::Backtrace32 {
             id,
             addresses: frames.into()
-        }.write_to_stream( serializer )?;
+        }
     } else if mem::size_of::< usize >() == mem::size_of::< u64 >() {
         let frames: &[u64] = unsafe { std::slice::from_raw_parts( frames.as_ptr() as *const u64, frames.len() ) };
         Event::Backtrace {
             id,
             addresses: frames.into()
-        }.write_to_stream( serializer )?;
+        }
     } else {
         unreachable!();
+    };
+
+    event.write_to_stream( serializer )?;
+    if crate::flight_recorder::is_enabled() {
+        // The segment with this event might get dropped while the backtrace is still in use.
+        crate::flight_recorder::on_backtrace( &event );
     }
 
-    Ok( id )
+    Ok(())
 }
 
 fn write_included_files< U: Write >( serializer: &mut U ) -> io::Result< () > {
@@ -238,29 +374,96 @@ fn write_included_files< U: Write >( serializer: &mut U ) -> io::Result< () > {
 }
 
 pub fn write_initial_data< T >( id: DataId, initial_timestamp: Timestamp, mut fp: T ) -> Result< (), io::Error > where T: Write {
+    write_initial_metadata( id, initial_timestamp, &mut fp )?;
+    write_deferred_initial_data( &mut fp )?;
+
+    info!( "Flushing..." );
+    fp.flush()?;
+    Ok(())
+}
+
+/// Writes the part of the initial data which is cheap to gather; this is everything except the files.
+pub fn write_initial_metadata< T >( id: DataId, initial_timestamp: Timestamp, mut fp: T ) -> Result< (), io::Error > where T: Write {
     info!( "Writing initial header..." );
     write_header( id, initial_timestamp, &mut fp )?;
+    write_parent_data( &mut fp )?;
 
     info!( "Writing wall clock..." );
     write_wallclock( &mut fp )?;
 
+    write_sampling_interval( &mut fp )?;
+
     info!( "Writing uptime..." );
     write_uptime( &mut fp )?;
-    write_included_files( &mut fp )?;
 
     info!( "Writing environ..." );
     write_environ( &mut fp )?;
 
     info!( "Writing maps..." );
     write_maps( &mut fp )?;
-    fp.flush()?;
+    fp.flush()
+}
 
+/// Writes the rest of the initial data, which can be written at any point after the metadata.
+pub fn write_deferred_initial_data< T >( mut fp: T ) -> Result< (), io::Error > where T: Write {
+    write_included_files( &mut fp )?;
     if opt::get().write_binaries_to_output {
         info!( "Writing binaries..." );
         write_binaries( &mut fp )?;
     }
 
-    info!( "Flushing..." );
-    fp.flush()?;
-    Ok(())
+    fp.flush()
+}
+
+/// Sends out everything that's written into it whenever it's flushed.
+struct ChunkSender {
+    buffer: Vec< u8 >,
+    tx: mpsc::SyncSender< Vec< u8 > >
+}
+
+impl Write for ChunkSender {
+    fn write( &mut self, data: &[u8] ) -> io::Result< usize > {
+        self.buffer.extend_from_slice( data );
+        Ok( data.len() )
+    }
+
+    fn flush( &mut self ) -> io::Result< () > {
+        if self.buffer.is_empty() {
+            return Ok(());
+        }
+
+        let buffer = mem::take( &mut self.buffer );
+        self.tx.send( buffer ).map_err( |_| io::Error::new( io::ErrorKind::BrokenPipe, "the processing thread is gone" ) )
+    }
+}
+
+/// Runs `write_deferred_initial_data` on a low priority thread, so that it doesn't delay the processing of the events.
+///
+/// The data is sent back a file at a time, to be written out between the events, until the channel
+/// is disconnected. If there's nothing to write, or the thread can't be started, `None` is returned;
+/// in the latter case everything is written into `fp` right away instead.
+pub fn write_deferred_initial_data_in_background< T >( fp: T ) -> Result< Option< mpsc::Receiver< Vec< u8 > > >, io::Error > where T: Write {
+    if opt::get().include_file.is_none() && !opt::get().write_binaries_to_output {
+        return Ok( None );
+    }
+
+    // Only a single file at a time is allowed to be in flight, since the binaries can be big.
+    let (tx, rx) = mpsc::sync_channel( 1 );
+    let is_ok = crate::global::spawn_internal_thread( b"mem-prof-init\0", move || {
+        unsafe {
+            libc::setpriority( libc::PRIO_PROCESS, 0, 19 );
+        }
+
+        let mut fp = ChunkSender { buffer: Vec::new(), tx };
+        if let Err( error ) = write_deferred_initial_data( &mut fp ) {
+            warn!( "Failed to write the rest of the initial data: {}", error );
+        }
+    });
+
+    if !is_ok {
+        write_deferred_initial_data( fp )?;
+        return Ok( None );
+    }
+
+    Ok( Some( rx ) )
 }
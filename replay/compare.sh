@@ -0,0 +1,55 @@
+#!/bin/sh
+
+# Replays the same file under glibc, jemalloc and mimalloc and prints the results as JSON.
+#
+# syntax: ./compare.sh <replay.dat>
+#
+# Set TOUCH to the fraction of every allocation which should be written to, e.g. TOUCH=0.5,
+# to also compare the page faults and the RSS under a more realistic load.
+
+set -e
+
+if [ "$#" -ne 1 ]; then
+    echo "syntax: $0 <replay.dat>" >&2
+    exit 1
+fi
+
+INPUT=$1
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=${BUILD_DIR:-$ROOT/replay/target}
+TOUCH=${TOUCH:-0}
+JEMALLOC_SRC=$ROOT/jemallocator/jemalloc-sys/jemalloc
+MIMALLOC_SRC=$ROOT/mimalloc_rust/libmimalloc-sys/c_src/mimalloc
+
+mkdir -p $BUILD_DIR
+
+if [ ! -f $BUILD_DIR/jemalloc/lib/libjemalloc.so ]; then
+    echo "Building jemalloc..." >&2
+    rm -Rf $BUILD_DIR/jemalloc
+    cp -R $JEMALLOC_SRC $BUILD_DIR/jemalloc
+    (
+        cd $BUILD_DIR/jemalloc
+        ./autogen.sh --disable-cxx > /dev/null
+        make -j$(nproc) build_lib_shared > /dev/null
+    ) >&2
+fi
+
+if [ ! -f $BUILD_DIR/mimalloc/libmimalloc.so ]; then
+    echo "Building mimalloc..." >&2
+    mkdir -p $BUILD_DIR/mimalloc
+    (
+        cd $BUILD_DIR/mimalloc
+        cmake -DCMAKE_BUILD_TYPE=Release -DMI_BUILD_TESTS=OFF $MIMALLOC_SRC > /dev/null
+        make -j$(nproc) mimalloc > /dev/null
+    ) >&2
+fi
+
+make -C $ROOT/replay replay >&2
+
+REPLAY=$ROOT/replay/replay
+
+echo "{"
+echo "\"glibc\": $($REPLAY --benchmark --json --touch $TOUCH $INPUT),"
+echo "\"jemalloc\": $(LD_PRELOAD=$BUILD_DIR/jemalloc/lib/libjemalloc.so $REPLAY --benchmark --json --touch $TOUCH $INPUT),"
+echo "\"mimalloc\": $(LD_PRELOAD=$BUILD_DIR/mimalloc/libmimalloc.so $REPLAY --benchmark --json --touch $TOUCH $INPUT)"
+echo "}"
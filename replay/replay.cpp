@@ -13,6 +13,16 @@
 #include <fcntl.h>
 #include <malloc.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <array>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #define OP_END     0
 #define OP_ALLOC   1
@@ -20,6 +30,19 @@
 #define OP_REALLOC 3
 #define OP_GO_DOWN 4
 #define OP_GO_UP   5
+#define OP_WAIT    6
+#define OP_SIGNAL  7
+
+#define REPLAY_MAGIC 0x424852504c590002ULL
+#define COMPACT_REPLAY_MAGIC 0x424852504c590003ULL
+
+// How many ops are decoded ahead of the one which is being replayed; must be a power of two.
+#define LOOKAHEAD 16
+
+// How many distinct frames there can be; the rarest ones above this all share a single frame.
+#ifndef FRAME_COUNT
+#define FRAME_COUNT 65536
+#endif
 
 typedef struct Data Data;
 typedef struct Op Op;
@@ -44,15 +67,101 @@ struct Op {
         struct {
             uint64_t frame;
         } go_down;
+        struct {
+            uint64_t handoff;
+        } handoff;
     };
 };
 
 struct Data {
+    uint64_t magic;
     uint64_t slot_count;
-    Op operations[];
+    uint64_t thread_count;
+    uint64_t handoff_count;
+    uint64_t initial_timestamp;
+    // Followed by the index of the first op of every thread, and then by the ops themselves.
+    // In the compact format these are byte offsets instead, and the ops are variable length.
+    uint64_t thread_offsets[];
 };
 
-void * mmap_file(const char * path) {
+// Reads the ops of a single thread in either of the formats.
+struct Reader {
+    bool compact;
+    const Op * op;
+    const uint8_t * cursor;
+    uint64_t last_timestamp;
+};
+
+static Reader reader_for_thread(const Data * data, uint64_t thread) {
+    const void * ops = &data->thread_offsets[data->thread_count];
+
+    Reader reader;
+    reader.compact = data->magic == COMPACT_REPLAY_MAGIC;
+    reader.op = (const Op *)ops + data->thread_offsets[thread];
+    reader.cursor = (const uint8_t *)ops + data->thread_offsets[thread];
+    reader.last_timestamp = 0;
+    return reader;
+}
+
+static inline uint64_t __attribute__ ((always_inline)) read_varint(const uint8_t *& cursor) {
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = *cursor++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+static inline uint64_t __attribute__ ((always_inline)) read_timestamp(Reader& reader) {
+    uint64_t zigzag = read_varint(reader.cursor);
+    reader.last_timestamp += (zigzag >> 1) ^ -(zigzag & 1);
+    return reader.last_timestamp;
+}
+
+// Doesn't go past the OP_END, so it can be called again once the end is reached.
+static inline void __attribute__ ((always_inline)) read_op(Reader& reader, Op& op) {
+    if (!reader.compact) {
+        op = *reader.op;
+        if (op.kind != OP_END) {
+            reader.op++;
+        }
+        return;
+    }
+
+    op.kind = *reader.cursor;
+    switch (op.kind) {
+        case OP_END:
+            return;
+        case OP_ALLOC:
+        case OP_REALLOC:
+            reader.cursor++;
+            op.alloc.slot = read_varint(reader.cursor);
+            op.alloc.timestamp = read_timestamp(reader);
+            op.alloc.size = read_varint(reader.cursor);
+            break;
+        case OP_FREE:
+            reader.cursor++;
+            op.free.slot = read_varint(reader.cursor);
+            op.free.timestamp = read_timestamp(reader);
+            break;
+        case OP_GO_DOWN:
+            reader.cursor++;
+            op.go_down.frame = read_varint(reader.cursor);
+            break;
+        case OP_WAIT:
+        case OP_SIGNAL:
+            reader.cursor++;
+            op.handoff.handoff = read_varint(reader.cursor);
+            break;
+        default:
+            reader.cursor++;
+            break;
+    }
+}
+
+void * mmap_file(const char * path, size_t * size_out) {
     int fd = open(path, O_RDONLY);
     if (fd < 0) {
         perror("open failed");
@@ -67,6 +176,10 @@ void * mmap_file(const char * path) {
         exit(1);
     }
 
+    if (size_out) {
+        *size_out = sb.st_size;
+    }
+
     return result;
 }
 
@@ -86,12 +199,105 @@ void default_override_next_timestamp(uint64_t timestamp) {
 }
 
 struct State {
-    size_t i;
-    Data * data;
+    Reader reader;
+    // A ring buffer of the ops which were already decoded but not yet replayed.
+    Op lookahead[LOOKAHEAD];
+    size_t lookahead_start;
+    size_t lookahead_end;
     void ** slots;
+    uint8_t * handoffs;
     size_t count;
+    bool paced;
+    uint64_t initial_timestamp;
+    uint64_t start_time;
+    // Which fraction of every allocation gets written to.
+    double touch_fraction;
+
+    // Only used when measuring.
+    bool measure;
+    uint64_t * slot_sizes;
+    uint64_t * latencies;
+    size_t latency_count;
 };
 
+static uint64_t live_bytes = 0;
+static uint64_t peak_live_bytes = 0;
+
+// Cycles on x86, nanoseconds everywhere else.
+static inline uint64_t __attribute__ ((always_inline)) read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void __attribute__ ((always_inline)) record_op(State& state, uint64_t start, uint64_t slot, uint64_t size) {
+    state.latencies[state.latency_count++] = read_cycles() - start;
+
+    uint64_t old_size = state.slot_sizes[slot];
+    state.slot_sizes[slot] = size;
+
+    uint64_t live = __atomic_add_fetch(&live_bytes, size - old_size, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&peak_live_bytes, &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Writes to the given fraction of a freshly allocated block, so that its pages actually get faulted in
+// and its cache lines get dirtied like they would have been by the original program. Small blocks are
+// written from the start, like a program would initialize them, while for the big ones every page
+// is touched only once, since that's enough to make them count towards the RSS.
+static inline void __attribute__ ((always_inline)) touch(void * pointer, uint64_t size, double fraction) {
+    if (pointer == NULL || fraction <= 0.0) {
+        return;
+    }
+
+    size_t length = std::min((size_t)(size * fraction), (size_t)size);
+    if (length == 0) {
+        return;
+    }
+
+    volatile uint8_t * bytes = (volatile uint8_t *)pointer;
+    if (size < 4096) {
+        memset(pointer, 0xa5, length);
+        // Otherwise the compiler is free to remove the writes if it can see the block being freed.
+        asm volatile ("" : : "r"(pointer) : "memory");
+        return;
+    }
+
+    for (size_t offset = 0; offset < length; offset += 4096) {
+        bytes[offset] = 0xa5;
+    }
+}
+
+static uint64_t now_usecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Sleeps until as much time has passed since the start of the replay as had passed originally.
+static void wait_until(State& state, uint64_t timestamp) {
+    if (!state.paced || timestamp < state.initial_timestamp) {
+        return;
+    }
+
+    uint64_t target = state.start_time + (timestamp - state.initial_timestamp);
+    uint64_t now = now_usecs();
+    if (now >= target) {
+        return;
+    }
+
+    uint64_t delay = target - now;
+    struct timespec ts;
+    ts.tv_sec = delay / 1000000;
+    ts.tv_nsec = (delay % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
 typedef void (*override_next_timestamp_t)(uint64_t timestamp);
 typedef void (*set_marker_t)(uint32_t marker);
 typedef void (*frame_t)(State&);
@@ -100,27 +306,59 @@ static size_t count = 0;
 static set_marker_t set_marker;
 static override_next_timestamp_t override_next_timestamp;
 
-extern frame_t FRAMES[];
-extern size_t FRAME_COUNT;
-
-void __attribute__ ((noinline)) frame_default(State&);
+static frame_t frame_for(uint64_t frame);
 
-static inline void __attribute__ ((always_inline)) go_down(State& state, uint64_t frame) {
-    frame_t cb = frame_default;
-    if (frame < FRAME_COUNT) {
-        cb = FRAMES[frame];
+static inline uint64_t __attribute__ ((always_inline)) slot_of(const Op& op) {
+    switch (op.kind) {
+        case OP_ALLOC: return op.alloc.slot;
+        case OP_FREE: return op.free.slot;
+        case OP_REALLOC: return op.realloc.slot;
+        default: return ~0ULL;
     }
+}
+
+// Decodes the ops ahead of time so that the slots which they're going to touch can be prefetched,
+// since those are all over the place and will usually miss the cache.
+static inline void __attribute__ ((always_inline)) fill_lookahead(State& state) {
+    while (state.lookahead_end - state.lookahead_start < LOOKAHEAD) {
+        Op& op = state.lookahead[state.lookahead_end % LOOKAHEAD];
+        read_op(state.reader, op);
+        if (op.kind == OP_END) {
+            // The OP_END is never consumed, so there's no point in decoding it again.
+            if (state.lookahead_end == state.lookahead_start) {
+                state.lookahead_end++;
+            }
+            return;
+        }
+
+        uint64_t slot = slot_of(op);
+        if (slot != ~0ULL) {
+            __builtin_prefetch(&state.slots[slot], 1);
+            if (state.measure) {
+                __builtin_prefetch(&state.slot_sizes[slot], 1);
+            }
+        }
 
-    cb(state);
+        state.lookahead_end++;
+    }
 }
 
-static inline void __attribute__ ((always_inline)) run(State& state) {
+// Replays the ops until one of them goes down into another frame, which is then returned,
+// or up from the current one, in which case null is returned.
+static frame_t __attribute__ ((noinline)) step(State& state) {
     for (;;) {
-        const Op * op = &state.data->operations[state.i];
+        if (state.lookahead_start == state.lookahead_end) {
+            fill_lookahead(state);
+        }
+
+        // This has to be copied out since refilling the lookahead is going to overwrite it.
+        const Op current = state.lookahead[state.lookahead_start % LOOKAHEAD];
+        const Op * op = &current;
         if (op->kind == OP_END) {
-            return;
+            return nullptr;
         }
-        state.i++;
+        state.lookahead_start++;
+        fill_lookahead(state);
 
         switch (op->kind) {
             case OP_ALLOC:
@@ -128,31 +366,69 @@ static inline void __attribute__ ((always_inline)) run(State& state) {
                 if (state.slots[op->alloc.slot] != NULL) {
                     abort();
                 }
+                wait_until(state, op->alloc.timestamp);
                 override_next_timestamp(op->alloc.timestamp);
-                state.slots[op->alloc.slot] = malloc(op->alloc.size);
+                if (state.measure) {
+                    uint64_t start = read_cycles();
+                    state.slots[op->alloc.slot] = malloc(op->alloc.size);
+                    record_op(state, start, op->alloc.slot, op->alloc.size);
+                } else {
+                    state.slots[op->alloc.slot] = malloc(op->alloc.size);
+                }
+                touch(state.slots[op->alloc.slot], op->alloc.size, state.touch_fraction);
                 break;
             case OP_FREE:
+                wait_until(state, op->free.timestamp);
                 override_next_timestamp(op->free.timestamp);
-                free(state.slots[op->free.slot]);
+                if (state.measure) {
+                    uint64_t start = read_cycles();
+                    free(state.slots[op->free.slot]);
+                    record_op(state, start, op->free.slot, 0);
+                } else {
+                    free(state.slots[op->free.slot]);
+                }
                 state.slots[op->free.slot] = NULL;
                 break;
             case OP_REALLOC:
                 state.count++;
+                wait_until(state, op->realloc.timestamp);
                 override_next_timestamp(op->realloc.timestamp);
-                state.slots[op->realloc.slot] = realloc(state.slots[op->realloc.slot], op->realloc.size);
+                if (state.measure) {
+                    uint64_t start = read_cycles();
+                    state.slots[op->realloc.slot] = realloc(state.slots[op->realloc.slot], op->realloc.size);
+                    record_op(state, start, op->realloc.slot, op->realloc.size);
+                } else {
+                    state.slots[op->realloc.slot] = realloc(state.slots[op->realloc.slot], op->realloc.size);
+                }
+                touch(state.slots[op->realloc.slot], op->realloc.size, state.touch_fraction);
                 break;
-            case OP_GO_DOWN:
-                go_down(state, op->go_down.frame);
+            case OP_WAIT:
+                while (!__atomic_load_n(&state.handoffs[op->handoff.handoff], __ATOMIC_ACQUIRE)) {
+                    sched_yield();
+                }
+                break;
+            case OP_SIGNAL:
+                __atomic_store_n(&state.handoffs[op->handoff.handoff], 1, __ATOMIC_RELEASE);
                 break;
+            case OP_GO_DOWN:
+                return frame_for(op->go_down.frame);
             case OP_GO_UP:
-                return;
+                return nullptr;
             default:
                 abort();
         }
     }
 }
 
-template <int N>
+// The frames themselves only stay on the stack while the ops below them are replayed, so every
+// allocation is made with the same backtrace as originally, plus `step` at the very top.
+static inline void __attribute__ ((always_inline)) run(State& state) {
+    while (frame_t frame = step(state)) {
+        frame(state);
+    }
+}
+
+template <size_t N>
 void __attribute__ ((noinline)) frame_n(State& state) {
     run(state);
     asm("");
@@ -163,29 +439,305 @@ void __attribute__ ((noinline)) frame_default(State& state) {
     asm("");
 }
 
-State run_for_data(Data * data) {
+template <size_t... N>
+static constexpr std::array<frame_t, sizeof...(N)> make_frames(std::index_sequence<N...>) {
+    return {{ frame_n<N>... }};
+}
+
+static const std::array<frame_t, FRAME_COUNT> FRAMES = make_frames(std::make_index_sequence<FRAME_COUNT>());
+
+static frame_t frame_for(uint64_t frame) {
+    return frame < FRAME_COUNT ? FRAMES[frame] : frame_default;
+}
+
+static void * thread_main(void * state_ptr) {
+    State * state = (State *)state_ptr;
+    run(*state);
+    return nullptr;
+}
+
+struct Results {
+    size_t allocations;
+    size_t operations;
+    uint64_t * latencies;
+};
+
+static size_t count_measured_ops(const Data * data, uint64_t thread) {
+    Reader reader = reader_for_thread(data, thread);
+    size_t count = 0;
+    for (;;) {
+        Op op;
+        read_op(reader, op);
+        if (op.kind == OP_END) {
+            break;
+        }
+
+        if (op.kind == OP_ALLOC || op.kind == OP_FREE || op.kind == OP_REALLOC) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// Replays every thread's ops on its own thread.
+static Results run_for_data(Data * data, bool paced, double touch_fraction, bool measure) {
     void ** slots = (void **)mmap_anonymous(data->slot_count * sizeof(void *));
+    uint8_t * handoffs = (uint8_t *)mmap_anonymous(data->handoff_count);
+    uint64_t * slot_sizes = nullptr;
+    uint64_t * latencies = nullptr;
+    size_t total_op_count = 0;
+    if (measure) {
+        for (uint64_t n = 0; n < data->thread_count; ++n) {
+            total_op_count += count_measured_ops(data, n);
+        }
 
-    State state;
-    state.data = data;
-    state.slots = slots;
-    state.i = 0;
-    state.count = 0;
-    run(state);
+        slot_sizes = (uint64_t *)mmap_anonymous(data->slot_count * sizeof(uint64_t));
+        latencies = (uint64_t *)mmap_anonymous(total_op_count * sizeof(uint64_t));
+
+        // Fault everything in beforehand so that it doesn't get counted towards the peak RSS.
+        memset(slot_sizes, 0, data->slot_count * sizeof(uint64_t));
+        memset(latencies, 0, total_op_count * sizeof(uint64_t));
+        memset(slots, 0, data->slot_count * sizeof(void *));
+    }
+
+    State * states = (State *)calloc(data->thread_count, sizeof(State));
+    pthread_t * threads = (pthread_t *)calloc(data->thread_count, sizeof(pthread_t));
+    uint64_t start_time = now_usecs();
+    size_t latency_offset = 0;
+    for (uint64_t n = 0; n < data->thread_count; ++n) {
+        State& state = states[n];
+        state.reader = reader_for_thread(data, n);
+        state.lookahead_start = 0;
+        state.lookahead_end = 0;
+        state.slots = slots;
+        state.handoffs = handoffs;
+        state.count = 0;
+        state.paced = paced;
+        state.initial_timestamp = data->initial_timestamp;
+        state.start_time = start_time;
+        state.touch_fraction = touch_fraction;
+        state.measure = measure;
+        state.slot_sizes = slot_sizes;
+        state.latency_count = 0;
+        if (measure) {
+            state.latencies = latencies + latency_offset;
+            latency_offset += count_measured_ops(data, n);
+        }
+
+        if (pthread_create(&threads[n], nullptr, thread_main, (void *)&state) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+
+    Results results;
+    results.allocations = 0;
+    results.operations = total_op_count;
+    results.latencies = latencies;
+    for (uint64_t n = 0; n < data->thread_count; ++n) {
+        pthread_join(threads[n], nullptr);
+        results.allocations += states[n].count;
+    }
 
-    return state;
+    free(threads);
+    free(states);
+    return results;
 }
 
-#include "generated.inc"
+static uint64_t percentile(uint64_t * values, size_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
 
-void * benchmark_thread_main(void * data_ptr) {
-    Data * data = (Data *)data_ptr;
-    run_for_data(data);
-    return nullptr;
+    size_t index = std::min((size_t)(count * fraction), count - 1);
+    std::nth_element(values, values + index, values + count);
+    return values[index];
+}
+
+static uint64_t peak_rss_bytes() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)usage.ru_maxrss * 1024;
+}
+
+static uint64_t page_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)usage.ru_minflt + (uint64_t)usage.ru_majflt;
+}
+
+// Reads the whole file so that its pages are already resident before we start measuring.
+static void prefault(const void * pointer, size_t size) {
+    const volatile uint8_t * bytes = (const volatile uint8_t *)pointer;
+    for (size_t offset = 0; offset < size; offset += 4096) {
+        (void)bytes[offset];
+    }
+}
+
+typedef size_t (*unwind_statistics_t)(uint64_t * output, size_t capacity);
+typedef void (*sync_t)();
+
+// What `memory_profiler_unwind_statistics` returns, in the same order.
+struct UnwindStatistics {
+    uint64_t unwinds;
+    uint64_t unwind_nsecs;
+    uint64_t level_1_hits;
+    uint64_t level_1_misses;
+    uint64_t level_2_hits;
+    uint64_t level_2_misses;
+};
+
+static UnwindStatistics read_unwind_statistics(unwind_statistics_t get_statistics, sync_t sync) {
+    UnwindStatistics statistics;
+    memset(&statistics, 0, sizeof(statistics));
+    if (get_statistics) {
+        // The 2nd level cache is only looked up once the processing thread gets to the events.
+        if (sync) {
+            sync();
+        }
+        get_statistics((uint64_t *)&statistics, sizeof(statistics) / sizeof(uint64_t));
+    }
+
+    return statistics;
+}
+
+static double ratio(uint64_t numerator, uint64_t denominator) {
+    return denominator > 0 ? (double)numerator / denominator : 0.0;
+}
+
+// Generates the ops which go down `depth - 1` frames, and then `repeat` times allocate and free
+// from within each of `distinct` different innermost frames.
+static Data * generate_unwind_benchmark(size_t depth, size_t distinct, size_t repeat, size_t * size_out) {
+    size_t op_count = (depth - 1) * 2 + repeat * distinct * 4 + 1;
+    size_t size = sizeof(Data) + sizeof(uint64_t) + op_count * sizeof(Op);
+    Data * data = (Data *)mmap_anonymous(size);
+    data->magic = REPLAY_MAGIC;
+    data->slot_count = 1;
+    data->thread_count = 1;
+    data->handoff_count = 1;
+    data->initial_timestamp = 0;
+    data->thread_offsets[0] = 0;
+
+    Op * op = (Op *)&data->thread_offsets[1];
+    for (size_t frame = 0; frame + 1 < depth; ++frame, ++op) {
+        op->kind = OP_GO_DOWN;
+        op->go_down.frame = frame;
+    }
+
+    for (size_t n = 0; n < repeat; ++n) {
+        for (size_t leaf = 0; leaf < distinct; ++leaf) {
+            op->kind = OP_GO_DOWN;
+            op->go_down.frame = depth - 1 + leaf;
+            op++;
+
+            op->kind = OP_ALLOC;
+            op->alloc.slot = 0;
+            op->alloc.timestamp = 0;
+            op->alloc.size = 16;
+            op++;
+
+            op->kind = OP_FREE;
+            op->free.slot = 0;
+            op->free.timestamp = 0;
+            op++;
+
+            op->kind = OP_GO_UP;
+            op++;
+        }
+    }
+
+    for (size_t frame = 0; frame + 1 < depth; ++frame, ++op) {
+        op->kind = OP_GO_UP;
+    }
+
+    op->kind = OP_END;
+    *size_out = size;
+    return data;
+}
+
+// Allocates at increasingly deeper stacks to see how fast the profiler can unwind them;
+// this is only really useful when running under the profiler with MEMORY_PROFILER_INSTRUMENTATION=1.
+static int run_unwind_benchmark(size_t max_depth, size_t distinct, size_t repeat, bool json) {
+    if (max_depth - 1 + distinct > FRAME_COUNT) {
+        fprintf(stderr, "only %zu distinct frames are available; try a lower --max-depth or --distinct\n", (size_t)FRAME_COUNT);
+        return 1;
+    }
+
+    unwind_statistics_t get_statistics = (unwind_statistics_t)dlsym(RTLD_DEFAULT, "memory_profiler_unwind_statistics");
+    sync_t sync = (sync_t)dlsym(RTLD_DEFAULT, "memory_profiler_sync");
+    if (!get_statistics) {
+        fprintf(stderr, "warning: not running under the profiler; only the total time per allocation will be measured\n");
+    }
+
+    if (json) {
+        printf("[");
+    }
+
+    for (size_t depth = 1; depth <= max_depth; depth *= 2) {
+        size_t size = 0;
+        Data * data = generate_unwind_benchmark(depth, distinct, repeat, &size);
+
+        UnwindStatistics before = read_unwind_statistics(get_statistics, sync);
+        uint64_t start_usecs = now_usecs();
+        Results results = run_for_data(data, false, 0.0, false);
+        uint64_t elapsed_usecs = now_usecs() - start_usecs;
+        UnwindStatistics after = read_unwind_statistics(get_statistics, sync);
+        munmap(data, size);
+
+        uint64_t unwinds = after.unwinds - before.unwinds;
+        uint64_t level_1_hits = after.level_1_hits - before.level_1_hits;
+        uint64_t level_1_lookups = level_1_hits + after.level_1_misses - before.level_1_misses;
+        uint64_t level_2_hits = after.level_2_hits - before.level_2_hits;
+        uint64_t level_2_lookups = level_2_hits + after.level_2_misses - before.level_2_misses;
+
+        // Every allocation is also freed, so that's two operations.
+        double ns_per_operation = ratio(elapsed_usecs * 1000, results.allocations * 2);
+        double ns_per_unwind = ratio(after.unwind_nsecs - before.unwind_nsecs, unwinds);
+        if (json) {
+            printf("%s{", depth == 1 ? "" : ",");
+            printf("\"depth\":%zu,", depth);
+            printf("\"distinct\":%zu,", distinct);
+            printf("\"operations\":%zu,", results.allocations * 2);
+            printf("\"ns_per_operation\":%.1f,", ns_per_operation);
+            printf("\"unwinds\":%llu,", (unsigned long long)unwinds);
+            printf("\"ns_per_unwind\":%.1f,", ns_per_unwind);
+            printf("\"level_1_hit_rate\":%.4f,", ratio(level_1_hits, level_1_lookups));
+            printf("\"level_2_hit_rate\":%.4f", ratio(level_2_hits, level_2_lookups));
+            printf("}");
+        } else {
+            printf("depth %3zu: %8.1f ns/operation, %8.1f ns/unwind, 1st level cache hits: %5.1f%%, 2nd level cache hits: %5.1f%%\n",
+                depth, ns_per_operation, ns_per_unwind, ratio(level_1_hits, level_1_lookups) * 100.0, ratio(level_2_hits, level_2_lookups) * 100.0);
+        }
+    }
+
+    if (json) {
+        printf("]\n");
+    }
+
+    return 0;
+}
+
+static bool parse_count(const char * value, size_t * output) {
+    char * end = nullptr;
+    unsigned long long count = strtoull(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || count == 0) {
+        return false;
+    }
+
+    *output = (size_t)count;
+    return true;
 }
 
 int main(int argc, char * argv[]) {
     bool benchmark_mode = false;
+    bool unwind_benchmark_mode = false;
+    size_t max_depth = 512;
+    size_t distinct = 1;
+    size_t repeat = 10000;
+    bool paced = false;
+    bool json = false;
+    double touch_fraction = 0.0;
     bool args_are_valid = true;
     const char * input = nullptr;
 
@@ -193,6 +745,30 @@ int main(int argc, char * argv[]) {
         char * arg = argv[i];
         if (!strcmp(arg, "--benchmark")) {
             benchmark_mode = true;
+        } else if (!strcmp(arg, "--paced")) {
+            paced = true;
+        } else if (!strcmp(arg, "--json")) {
+            json = true;
+        } else if (!strcmp(arg, "--unwind-benchmark")) {
+            unwind_benchmark_mode = true;
+        } else if (!strcmp(arg, "--max-depth") || !strcmp(arg, "--distinct") || !strcmp(arg, "--repeat")) {
+            size_t * output = !strcmp(arg, "--max-depth") ? &max_depth : !strcmp(arg, "--distinct") ? &distinct : &repeat;
+            if (i + 1 >= argc || !parse_count(argv[++i], output)) {
+                args_are_valid = false;
+                break;
+            }
+        } else if (!strcmp(arg, "--touch")) {
+            if (i + 1 >= argc) {
+                args_are_valid = false;
+                break;
+            }
+
+            char * end = nullptr;
+            touch_fraction = strtod(argv[++i], &end);
+            if (*end != '\0' || !(touch_fraction >= 0.0 && touch_fraction <= 1.0)) {
+                args_are_valid = false;
+                break;
+            }
         } else {
             if (input != nullptr) {
                 args_are_valid = false;
@@ -203,17 +779,30 @@ int main(int argc, char * argv[]) {
         }
     }
 
-    args_are_valid = args_are_valid && input != nullptr;
+    args_are_valid = args_are_valid && (input != nullptr) != unwind_benchmark_mode;
 
     if (!args_are_valid) {
-        fprintf(stderr, "syntax: replay [--benchmark] <replay.dat>\n");
+        fprintf(stderr, "syntax: replay [--benchmark] [--paced] [--json] [--touch <fraction>] <replay.dat>\n");
+        fprintf(stderr, "  --touch <fraction>  write to the given fraction (0 to 1) of every allocation\n");
+        fprintf(stderr, "                      so that its pages are faulted in; with --paced the memory\n");
+        fprintf(stderr, "                      is also kept resident for as long as it originally was\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "syntax: replay --unwind-benchmark [--max-depth <depth>] [--distinct <count>] [--repeat <count>] [--json]\n");
+        fprintf(stderr, "  allocates at stacks from 1 up to --max-depth (512) frames deep, --repeat (10000) times\n");
+        fprintf(stderr, "  from within each of --distinct (1) different innermost frames\n");
         return 1;
     }
 
+    if (unwind_benchmark_mode) {
+        set_marker = default_set_marker;
+        override_next_timestamp = default_override_next_timestamp;
+        return run_unwind_benchmark(max_depth, distinct, repeat, json);
+    }
+
     if (!benchmark_mode) {
         set_marker = (set_marker_t)dlsym(RTLD_DEFAULT, "memory_profiler_set_marker");
         override_next_timestamp = (override_next_timestamp_t)dlsym(RTLD_DEFAULT, "memory_profiler_override_next_timestamp");
-    } else {
+    } else if (!json) {
         puts("Running in benchmark mode...");
     }
 
@@ -225,23 +814,72 @@ int main(int argc, char * argv[]) {
         override_next_timestamp = default_override_next_timestamp;
     }
 
-    Data * data = (Data *)mmap_file(input);
-    if (!benchmark_mode) {
-        State state = run_for_data(data);
-        printf("total allocations: %i\n", state.count);
-    } else {
-        pthread_t threads[3];
-        for (int i = 0; i < 3; ++i) {
-            pthread_create(&threads[i], nullptr, benchmark_thread_main, (void *)data);
-        }
-        for (int i = 0; i < 3; ++i) {
-            pthread_join(threads[i], nullptr);
-        }
+    size_t file_size = 0;
+    Data * data = (Data *)mmap_file(input, &file_size);
+    if (data->magic != REPLAY_MAGIC && data->magic != COMPACT_REPLAY_MAGIC) {
+        fprintf(stderr, "%s is not a replay file or was generated by an incompatible version\n", input);
+        return 1;
     }
 
-    printf("free: %i\n", mallinfo().fordblks);
-    printf("fast free: %i\n", mallinfo().fsmblks);
-    printf("fast free blocks: %i\n", mallinfo().smblks);
+    // Every thread only ever reads its own ops front to back.
+    madvise(data, file_size, MADV_SEQUENTIAL);
+    madvise(data, file_size, MADV_WILLNEED);
+
+    if (json) {
+        prefault(data, file_size);
+    }
+
+    uint64_t baseline_rss = peak_rss_bytes();
+    uint64_t baseline_page_faults = page_faults();
+    uint64_t start_time = now_usecs();
+    Results results = run_for_data(data, paced, touch_fraction, json);
+    uint64_t elapsed = now_usecs() - start_time;
+    uint64_t peak_rss = peak_rss_bytes();
+    uint64_t replay_page_faults = page_faults() - baseline_page_faults;
+
+    struct mallinfo info = mallinfo();
+    if (!json) {
+        printf("threads: %i\n", (int)data->thread_count);
+        printf("total allocations: %zu\n", results.allocations);
+        printf("elapsed: %.3fs\n", elapsed / 1000000.0);
+        printf("page faults: %llu\n", (unsigned long long)replay_page_faults);
+
+        printf("free: %i\n", info.fordblks);
+        printf("fast free: %i\n", info.fsmblks);
+        printf("fast free blocks: %i\n", info.smblks);
+        return 0;
+    }
+
+    // The RSS from before the replay started is mostly the replay file itself.
+    uint64_t heap_peak_rss = peak_rss > baseline_rss ? peak_rss - baseline_rss : 0;
+    double seconds = elapsed / 1000000.0;
+    uint64_t p50 = percentile(results.latencies, results.operations, 0.5);
+    uint64_t p99 = percentile(results.latencies, results.operations, 0.99);
+    uint64_t p999 = percentile(results.latencies, results.operations, 0.999);
+    uint64_t max = percentile(results.latencies, results.operations, 1.0);
+
+    printf("{");
+    printf("\"threads\":%llu,", (unsigned long long)data->thread_count);
+    printf("\"operations\":%zu,", results.operations);
+    printf("\"allocations\":%zu,", results.allocations);
+    printf("\"elapsed_seconds\":%.6f,", seconds);
+    printf("\"operations_per_second\":%.1f,", seconds > 0.0 ? results.operations / seconds : 0.0);
+#if defined(__x86_64__) || defined(__i386__)
+    printf("\"latency_unit\":\"cycles\",");
+#else
+    printf("\"latency_unit\":\"nanoseconds\",");
+#endif
+    printf("\"latency\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},",
+        (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999, (unsigned long long)max);
+    printf("\"peak_rss_bytes\":%llu,", (unsigned long long)peak_rss);
+    printf("\"heap_peak_rss_bytes\":%llu,", (unsigned long long)heap_peak_rss);
+    printf("\"peak_live_bytes\":%llu,", (unsigned long long)peak_live_bytes);
+    printf("\"page_faults\":%llu,", (unsigned long long)replay_page_faults);
+    printf("\"touch_fraction\":%.3f,", touch_fraction);
+    printf("\"fragmentation\":%.4f,", peak_live_bytes > 0 ? (double)heap_peak_rss / peak_live_bytes : 0.0);
+    printf("\"mallinfo\":{\"arena\":%i,\"uordblks\":%i,\"fordblks\":%i,\"fsmblks\":%i,\"smblks\":%i}",
+        info.arena, info.uordblks, info.fordblks, info.fsmblks, info.smblks);
+    printf("}\n");
 
     return 0;
 }
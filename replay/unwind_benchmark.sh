@@ -0,0 +1,40 @@
+#!/bin/sh
+
+# Runs the unwinding benchmark under the profiler with every way it can unwind and prints the results as JSON.
+#
+# syntax: ./unwind_benchmark.sh [extra arguments for `replay --unwind-benchmark`]
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PRELOAD=${PRELOAD:-$ROOT/target/release/libbytehound.so}
+OUTPUT_DIR=$(mktemp -d)
+trap 'rm -Rf $OUTPUT_DIR' EXIT
+
+if [ ! -f $PRELOAD ]; then
+    echo "$PRELOAD not found; build it with 'cargo build --release -p bytehound-preload' first" >&2
+    exit 1
+fi
+
+make -C $ROOT/replay replay >&2
+
+REPLAY=$ROOT/replay/replay
+
+run() {
+    env \
+        LD_PRELOAD=$PRELOAD \
+        MEMORY_PROFILER_INSTRUMENTATION=1 \
+        MEMORY_PROFILER_OUTPUT=$OUTPUT_DIR/%n.dat \
+        MEMORY_PROFILER_LOG=error \
+        "$@" \
+        $REPLAY --unwind-benchmark --json $BENCHMARK_ARGS
+}
+
+BENCHMARK_ARGS="$*"
+
+echo "{"
+echo "\"dwarf\": $(run MEMORY_PROFILER_USE_SHADOW_STACK=0 MEMORY_PROFILER_USE_PERF_EVENT_OPEN=0),"
+echo "\"shadow_stack\": $(run MEMORY_PROFILER_USE_SHADOW_STACK=1 MEMORY_PROFILER_USE_PERF_EVENT_OPEN=0),"
+echo "\"perf_event_open\": $(run MEMORY_PROFILER_USE_SHADOW_STACK=1 MEMORY_PROFILER_USE_PERF_EVENT_OPEN=1),"
+echo "\"frame_pointers\": $(run MEMORY_PROFILER_USE_FRAME_POINTERS=1)"
+echo "}"
@@ -1,19 +1,28 @@
 use std::fmt;
-use std::mem;
+use std::cmp::min;
 use std::io;
 
-use bytes::Bytes;
+use bytes::{Bytes, BytesMut};
 use crate::streaming_channel::{self, streaming_channel};
 
+/// How big are the chunks which are sent through the channel.
+const CHUNK_SIZE: usize = 64 * 1024;
+
+/// How much memory is allocated at a time for the chunks.
+///
+/// The chunks are all carved out of the same allocation, which gets reused
+/// once every chunk sent from it has been written out and dropped.
+const ARENA_SIZE: usize = 16 * CHUNK_SIZE;
+
 pub struct ByteSender {
-    buffer: Vec< u8 >,
+    buffer: BytesMut,
     tx: streaming_channel::Sender< Bytes >
 }
 
 pub fn byte_channel() -> (ByteSender, streaming_channel::Receiver< Bytes >) {
     let (tx, rx) = streaming_channel();
     let tx = ByteSender {
-        buffer: Vec::new(),
+        buffer: BytesMut::with_capacity( ARENA_SIZE ),
         tx
     };
 
@@ -21,10 +30,20 @@ pub fn byte_channel() -> (ByteSender, streaming_channel::Receiver< Bytes >) {
 }
 
 impl ByteSender {
-    fn write_buffer( &mut self, buffer: &[u8] ) -> Result< (), () > {
-        self.buffer.extend_from_slice( buffer );
-        if self.buffer.len() >= 128 * 1024 {
-            self.flush_buffer()?;
+    /// Whether nobody is going to receive what's sent anymore, e.g. because the HTTP client disconnected.
+    pub fn is_closed( &self ) -> bool {
+        self.tx.is_closed()
+    }
+
+    fn write_buffer( &mut self, mut buffer: &[u8] ) -> Result< (), () > {
+        while !buffer.is_empty() {
+            let length = min( buffer.len(), CHUNK_SIZE - self.buffer.len() );
+            self.buffer.extend_from_slice( &buffer[ ..length ] );
+            buffer = &buffer[ length.. ];
+
+            if self.buffer.len() >= CHUNK_SIZE {
+                self.flush_buffer()?;
+            }
         }
 
         Ok(())
@@ -35,9 +54,12 @@ impl ByteSender {
             return Ok(());
         }
 
-        let mut vec = Vec::with_capacity( self.buffer.capacity() );
-        mem::swap( &mut vec, &mut self.buffer );
-        return self.tx.send( vec.into() );
+        let chunk = self.buffer.take().freeze();
+        if self.buffer.capacity() < CHUNK_SIZE {
+            self.buffer.reserve( ARENA_SIZE );
+        }
+
+        self.tx.send( chunk )
     }
 }
 
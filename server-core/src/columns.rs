@@ -0,0 +1,427 @@
+//! A compact binary alternative to the JSON responses of the table endpoints,
+//! sent when the client asks for it with `Accept: application/x-bytehound-columns`.
+//!
+//! Everything is little endian:
+//!
+//! ```text
+//! <magic: "BHCOLS01"> <table_count: u32>
+//! for each table:
+//!     <name> <row_count: u64> <column_count: u32>
+//!     for each column: <name> <type: u8> <byte_count: u64> <values>
+//! ```
+//!
+//! where every name is a `u32` length followed by that many bytes of UTF-8.
+//!
+//! The column types are:
+//!
+//!   * 0 - u64,
+//!   * 1 - u32,
+//!   * 2 - bool, one byte per row,
+//!   * 3 - string, a `u32` length per row (`!0` if there's no string) followed by all of the bytes.
+//!
+//! Missing integers are sent as `!0`, and timestamps are in microseconds. Redundant
+//! fields of the JSON responses (like the hexadecimal addresses or the relative timestamps)
+//! are not sent at all. Every row only refers to its backtraces by their ID; each backtrace
+//! is sent once in the `backtraces` table, whose `offset` and `length` point into
+//! the `backtrace_frames` table, which in turn points into the deduplicated `frames` table.
+//!
+//! A table without any rows might not have any columns either.
+
+use std::io::{self, Write};
+
+use ahash::{AHashMap as HashMap, AHashSet as HashSet};
+
+use cli_core::{BacktraceId, Data, FrameId};
+
+use crate::protocol;
+
+pub const MIME_TYPE: &str = "application/x-bytehound-columns";
+
+const MAGIC: &[u8; 8] = b"BHCOLS01";
+
+enum Values {
+    U64( Vec< u64 > ),
+    U32( Vec< u32 > ),
+    Bool( Vec< bool > ),
+    String {
+        lengths: Vec< u32 >,
+        bytes: Vec< u8 >
+    }
+}
+
+struct Column {
+    name: String,
+    values: Values
+}
+
+fn write_name< W: Write >( fp: &mut W, name: &str ) -> io::Result< () > {
+    fp.write_all( &(name.len() as u32).to_le_bytes() )?;
+    fp.write_all( name.as_bytes() )
+}
+
+impl Column {
+    fn write_to< W: Write >( &self, fp: &mut W ) -> io::Result< () > {
+        let mut output = Vec::new();
+        let kind = match self.values {
+            Values::U64( ref values ) => {
+                values.iter().for_each( |value| output.extend_from_slice( &value.to_le_bytes() ) );
+                0
+            },
+            Values::U32( ref values ) => {
+                values.iter().for_each( |value| output.extend_from_slice( &value.to_le_bytes() ) );
+                1
+            },
+            Values::Bool( ref values ) => {
+                output.extend( values.iter().map( |&value| value as u8 ) );
+                2
+            },
+            Values::String { ref lengths, ref bytes } => {
+                lengths.iter().for_each( |value| output.extend_from_slice( &value.to_le_bytes() ) );
+                output.extend_from_slice( bytes );
+                3
+            }
+        };
+
+        write_name( fp, &self.name )?;
+        fp.write_all( &[kind] )?;
+        fp.write_all( &(output.len() as u64).to_le_bytes() )?;
+        fp.write_all( &output )
+    }
+}
+
+pub struct Table {
+    name: &'static str,
+    row_count: u64,
+    columns: Vec< Column >
+}
+
+impl Table {
+    pub fn new( name: &'static str ) -> Self {
+        Table {
+            name,
+            row_count: 0,
+            columns: Vec::new()
+        }
+    }
+
+    /// Adds a new row; every row has to write the same columns in the same order.
+    pub fn row( &mut self ) -> RowWriter {
+        self.row_count += 1;
+        RowWriter {
+            table: self,
+            index: 0
+        }
+    }
+
+    fn write_to< W: Write >( &self, fp: &mut W ) -> io::Result< () > {
+        write_name( fp, self.name )?;
+        fp.write_all( &self.row_count.to_le_bytes() )?;
+        fp.write_all( &(self.columns.len() as u32).to_le_bytes() )?;
+        for column in &self.columns {
+            column.write_to( fp )?;
+        }
+
+        Ok(())
+    }
+}
+
+pub struct RowWriter< 'a > {
+    table: &'a mut Table,
+    index: usize
+}
+
+impl< 'a > RowWriter< 'a > {
+    fn column( &mut self, name: &str, empty: fn() -> Values ) -> &mut Values {
+        let index = self.index;
+        self.index += 1;
+
+        if index == self.table.columns.len() {
+            debug_assert_eq!( self.table.row_count, 1 );
+            self.table.columns.push( Column {
+                name: name.to_owned(),
+                values: empty()
+            });
+        }
+
+        let column = &mut self.table.columns[ index ];
+        debug_assert_eq!( column.name, name );
+        &mut column.values
+    }
+
+    pub fn u64( &mut self, name: &str, value: u64 ) {
+        match self.column( name, || Values::U64( Vec::new() ) ) {
+            Values::U64( values ) => values.push( value ),
+            _ => unreachable!()
+        }
+    }
+
+    pub fn u32( &mut self, name: &str, value: u32 ) {
+        match self.column( name, || Values::U32( Vec::new() ) ) {
+            Values::U32( values ) => values.push( value ),
+            _ => unreachable!()
+        }
+    }
+
+    pub fn bool( &mut self, name: &str, value: bool ) {
+        match self.column( name, || Values::Bool( Vec::new() ) ) {
+            Values::Bool( values ) => values.push( value ),
+            _ => unreachable!()
+        }
+    }
+
+    pub fn string( &mut self, name: &str, value: Option< &str > ) {
+        match self.column( name, || Values::String { lengths: Vec::new(), bytes: Vec::new() } ) {
+            Values::String { lengths, bytes } => {
+                if let Some( value ) = value {
+                    lengths.push( value.len() as u32 );
+                    bytes.extend_from_slice( value.as_bytes() );
+                } else {
+                    lengths.push( !0 );
+                }
+            },
+            _ => unreachable!()
+        }
+    }
+
+    pub fn optional_u64( &mut self, name: &str, value: Option< u64 > ) {
+        self.u64( name, value.unwrap_or( !0 ) );
+    }
+
+    pub fn optional_u32( &mut self, name: &str, value: Option< u32 > ) {
+        self.u32( name, value.unwrap_or( !0 ) );
+    }
+
+    pub fn timestamp( &mut self, name: &str, value: &protocol::Timeval ) {
+        self.u64( name, value.as_usecs() );
+    }
+
+    pub fn optional_timestamp( &mut self, name: &str, value: Option< &protocol::Timeval > ) {
+        self.optional_u64( name, value.map( |value| value.as_usecs() ) );
+    }
+}
+
+/// Collects every backtrace which is referred to by the rows, deduplicating their frames.
+pub struct Backtraces< 'a > {
+    data: &'a Data,
+    format: protocol::BacktraceFormat,
+    seen: HashSet< u32 >,
+    frame_to_index: HashMap< FrameId, u32 >,
+    backtraces: Table,
+    backtrace_frames: Table,
+    frames: Table
+}
+
+impl< 'a > Backtraces< 'a > {
+    pub fn new( data: &'a Data, format: protocol::BacktraceFormat ) -> Self {
+        Backtraces {
+            data,
+            format,
+            seen: HashSet::new(),
+            frame_to_index: HashMap::new(),
+            backtraces: Table::new( "backtraces" ),
+            backtrace_frames: Table::new( "backtrace_frames" ),
+            frames: Table::new( "frames" )
+        }
+    }
+
+    pub fn add( &mut self, backtrace_id: u32 ) {
+        if !self.seen.insert( backtrace_id ) {
+            return;
+        }
+
+        let offset = self.backtrace_frames.row_count;
+        for (frame_id, frame) in self.data.get_backtrace( BacktraceId::new( backtrace_id ) ) {
+            let next_index = self.frame_to_index.len() as u32;
+            let index = *self.frame_to_index.entry( frame_id ).or_insert( next_index );
+            if index == next_index {
+                let frame = crate::get_frame( self.data, &self.format, frame );
+                let mut row = self.frames.row();
+                row.u64( "address", frame.address );
+                row.u64( "count", frame.count );
+                row.string( "library", frame.library.as_deref() );
+                row.string( "function", frame.function.as_deref() );
+                row.string( "raw_function", frame.raw_function.as_deref() );
+                row.string( "source", frame.source.as_deref() );
+                row.optional_u32( "line", frame.line );
+                row.optional_u32( "column", frame.column );
+                row.bool( "is_inline", frame.is_inline );
+            }
+
+            self.backtrace_frames.row().u32( "frame", index );
+        }
+
+        let mut row = self.backtraces.row();
+        row.u32( "id", backtrace_id );
+        row.u32( "offset", offset as u32 );
+        row.u32( "length", (self.backtrace_frames.row_count - offset) as u32 );
+    }
+
+    pub fn add_optional( &mut self, backtrace_id: Option< u32 > ) {
+        if let Some( backtrace_id ) = backtrace_id {
+            self.add( backtrace_id );
+        }
+    }
+}
+
+pub trait Row {
+    fn write( &self, row: &mut RowWriter, backtraces: &mut Backtraces );
+}
+
+/// Writes out the rows as a table named `name` along with the total count and every backtrace they refer to.
+pub fn encode< W, R, I >( mut fp: W, mut backtraces: Backtraces, name: &'static str, total_count: u64, rows: I ) -> io::Result< () >
+    where W: Write,
+          R: Row,
+          I: IntoIterator< Item = R >
+{
+    let mut table = Table::new( name );
+    for item in rows {
+        item.write( &mut table.row(), &mut backtraces );
+    }
+
+    let mut response = Table::new( "response" );
+    response.row().u64( "total_count", total_count );
+
+    let tables = [response, table, backtraces.backtraces, backtraces.backtrace_frames, backtraces.frames];
+    fp.write_all( MAGIC )?;
+    fp.write_all( &(tables.len() as u32).to_le_bytes() )?;
+    for table in &tables {
+        table.write_to( &mut fp )?;
+    }
+
+    fp.flush()
+}
+
+impl< 'a > Row for protocol::Allocation< 'a > {
+    fn write( &self, row: &mut RowWriter, backtraces: &mut Backtraces ) {
+        backtraces.add( self.backtrace_id );
+
+        row.u64( "id", self.id );
+        row.u64( "address", self.address );
+        row.timestamp( "timestamp", &self.timestamp );
+        row.u32( "thread", self.thread );
+        row.u64( "size", self.size );
+        row.u32( "backtrace_id", self.backtrace_id );
+
+        let deallocation = self.deallocation.as_ref();
+        backtraces.add_optional( deallocation.and_then( |deallocation| deallocation.backtrace_id ) );
+        row.optional_timestamp( "deallocation_timestamp", deallocation.map( |deallocation| &deallocation.timestamp ) );
+        row.optional_u32( "deallocation_thread", deallocation.map( |deallocation| deallocation.thread ) );
+        row.optional_u32( "deallocation_backtrace_id", deallocation.and_then( |deallocation| deallocation.backtrace_id ) );
+
+        let deallocation = self.chain_deallocation.as_ref();
+        backtraces.add_optional( deallocation.and_then( |deallocation| deallocation.backtrace_id ) );
+        row.optional_timestamp( "chain_deallocation_timestamp", deallocation.map( |deallocation| &deallocation.timestamp ) );
+        row.optional_u32( "chain_deallocation_thread", deallocation.map( |deallocation| deallocation.thread ) );
+        row.optional_u32( "chain_deallocation_backtrace_id", deallocation.and_then( |deallocation| deallocation.backtrace_id ) );
+
+        row.bool( "is_mmaped", self.is_mmaped );
+        row.bool( "is_jemalloc", self.is_jemalloc );
+        row.bool( "in_main_arena", self.in_main_arena );
+        row.u32( "extra_space", self.extra_space );
+        row.optional_u32( "pool", self.pool.map( |pool| pool as u32 ) );
+        row.string( "pool_name", self.pool_name );
+        row.optional_timestamp( "chain_lifetime", self.chain_lifetime.as_ref() );
+        row.u32( "position_in_chain", self.position_in_chain );
+        row.u32( "chain_length", self.chain_length );
+    }
+}
+
+macro_rules! write_group_data {
+    ($row:expr, $prefix:literal, $group:expr) => {
+        $row.u64( concat!( $prefix, "size" ), $group.size );
+        $row.u64( concat!( $prefix, "min_size" ), $group.min_size );
+        $row.u64( concat!( $prefix, "max_size" ), $group.max_size );
+        $row.timestamp( concat!( $prefix, "min_timestamp" ), &$group.min_timestamp );
+        $row.timestamp( concat!( $prefix, "max_timestamp" ), &$group.max_timestamp );
+        $row.timestamp( concat!( $prefix, "interval" ), &$group.interval );
+        $row.u64( concat!( $prefix, "leaked_count" ), $group.leaked_count );
+        $row.u64( concat!( $prefix, "allocated_count" ), $group.allocated_count );
+        $row.string( concat!( $prefix, "graph_preview_url" ), $group.graph_preview_url.as_deref() );
+        $row.string( concat!( $prefix, "graph_url" ), $group.graph_url.as_deref() );
+        $row.optional_timestamp( concat!( $prefix, "max_total_usage_first_seen_at" ), $group.max_total_usage_first_seen_at.as_ref() );
+        $row.optional_u64( concat!( $prefix, "slack" ), $group.slack );
+        // The copy amplification is just the ratio of these two.
+        $row.optional_u64( concat!( $prefix, "bytes_copied" ), $group.bytes_copied );
+        $row.optional_u64( concat!( $prefix, "chain_peak_size" ), $group.chain_peak_size );
+        $row.optional_u64( concat!( $prefix, "cross_thread_free_count" ), $group.cross_thread_free_count );
+        $row.optional_u64( concat!( $prefix, "cross_thread_free_size" ), $group.cross_thread_free_size );
+        $row.optional_timestamp( concat!( $prefix, "cross_thread_free_latency" ), $group.cross_thread_free_latency.as_ref() );
+        $row.optional_timestamp( concat!( $prefix, "lifetime_p50" ), $group.lifetime_p50.as_ref() );
+        $row.optional_timestamp( concat!( $prefix, "lifetime_p90" ), $group.lifetime_p90.as_ref() );
+        $row.optional_timestamp( concat!( $prefix, "lifetime_p99" ), $group.lifetime_p99.as_ref() );
+    };
+}
+
+impl< 'a > Row for protocol::AllocationGroup< 'a > {
+    fn write( &self, row: &mut RowWriter, backtraces: &mut Backtraces ) {
+        backtraces.add( self.backtrace_id );
+
+        row.u32( "backtrace_id", self.backtrace_id );
+        write_group_data!( row, "all_", self.all );
+        write_group_data!( row, "only_matched_", self.only_matched );
+    }
+}
+
+impl< 'a > Row for protocol::Map< 'a > {
+    fn write( &self, row: &mut RowWriter, backtraces: &mut Backtraces ) {
+        row.u64( "id", self.id );
+        row.u64( "address", self.address );
+        row.timestamp( "timestamp", &self.timestamp );
+        row.u64( "size", self.size );
+
+        let source = self.source.as_ref();
+        backtraces.add_optional( source.map( |source| source.backtrace_id ) );
+        row.optional_u32( "source_thread", source.map( |source| source.thread ) );
+        row.optional_u32( "source_backtrace_id", source.map( |source| source.backtrace_id ) );
+
+        let deallocation = self.deallocation.as_ref();
+        let source = deallocation.and_then( |deallocation| deallocation.source.as_ref() );
+        backtraces.add_optional( source.map( |source| source.backtrace_id ) );
+        row.optional_timestamp( "deallocation_timestamp", deallocation.map( |deallocation| &deallocation.timestamp ) );
+        row.optional_u32( "deallocation_source_thread", source.map( |source| source.thread ) );
+        row.optional_u32( "deallocation_source_backtrace_id", source.map( |source| source.backtrace_id ) );
+
+        row.bool( "is_readable", self.is_readable );
+        row.bool( "is_writable", self.is_writable );
+        row.bool( "is_executable", self.is_executable );
+        row.bool( "is_shared", self.is_shared );
+        row.bool( "is_huge_page_advised", self.is_huge_page_advised );
+        row.bool( "is_no_huge_page_advised", self.is_no_huge_page_advised );
+        row.string( "name", Some( &*self.name ) );
+        row.u64( "peak_rss", self.peak_rss );
+        row.u64( "peak_huge_pages", self.peak_huge_pages );
+        row.u64( "purge_count", self.purge_count );
+        row.u64( "purged", self.purged );
+        row.u64( "reclaimed", self.reclaimed );
+        row.u64( "refaulted", self.refaulted );
+        row.string( "graph_preview_url", self.graph_preview_url.as_deref() );
+        row.string( "graph_url", self.graph_url.as_deref() );
+    }
+}
+
+#[test]
+fn test_table_encoding() {
+    let mut table = Table::new( "t" );
+    for value in 0..2 {
+        let mut row = table.row();
+        row.u32( "a", value );
+        row.string( "b", if value == 0 { Some( "xy" ) } else { None } );
+    }
+
+    let mut output = Vec::new();
+    table.write_to( &mut output ).unwrap();
+
+    let mut expected = Vec::new();
+    expected.extend_from_slice( b"\x01\0\0\0t" );
+    expected.extend_from_slice( &2_u64.to_le_bytes() );
+    expected.extend_from_slice( &2_u32.to_le_bytes() );
+    expected.extend_from_slice( b"\x01\0\0\0a\x01" );
+    expected.extend_from_slice( &8_u64.to_le_bytes() );
+    expected.extend_from_slice( &[0, 0, 0, 0, 1, 0, 0, 0] );
+    expected.extend_from_slice( b"\x01\0\0\0b\x03" );
+    expected.extend_from_slice( &10_u64.to_le_bytes() );
+    expected.extend_from_slice( &[2, 0, 0, 0, 0xff, 0xff, 0xff, 0xff] );
+    expected.extend_from_slice( b"xy" );
+
+    assert_eq!( output, expected );
+}
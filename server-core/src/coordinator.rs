@@ -0,0 +1,659 @@
+//! The coordinator of a distributed analysis.
+//!
+//! A trace which doesn't fit on a single machine can be split up by the time at which its allocations
+//! were made, with every shard loaded by a separate server (a worker) started with `--only-allocated-after`
+//! and `--only-allocated-before`. The coordinator doesn't load anything itself; it forwards every query
+//! to all of the workers, which answer it with partial aggregates of only their own allocations, and then
+//! merges those into the very same responses a single server would've returned.
+//!
+//! Every worker has to load the same file with the same filters other than the time range, since then
+//! all of them assign the same IDs to the backtraces, so the backtraces can be fetched from any of them.
+
+use std::cmp::{max, min, Reverse};
+use std::collections::BTreeMap;
+use std::io::{self, Read, Write};
+use std::net::TcpStream;
+use std::sync::Arc;
+use std::thread;
+
+use actix_web::error::{BlockingError, Error as ActixWebError};
+use actix_web::{http::StatusCode, middleware, web, App, HttpRequest, HttpResponse};
+use actix_cors::Cors;
+use ahash::AHashMap as HashMap;
+use futures::Future;
+use serde::de::DeserializeOwned;
+use serde_json::Value;
+
+use common::Timestamp;
+
+use crate::protocol;
+use crate::{ServerError, StaticResponse, WEBUI_ASSETS};
+
+#[derive(Debug)]
+enum CoordinatorError {
+    BadRequest( String ),
+    /// A worker couldn't be reached or it returned an error, along with the HTTP status it returned, if any.
+    Worker( String, Option< u16 > )
+}
+
+impl CoordinatorError {
+    fn into_response( self ) -> HttpResponse {
+        match self {
+            CoordinatorError::BadRequest( message ) => HttpResponse::BadRequest().body( message ),
+            CoordinatorError::Worker( message, Some( 404 ) ) => HttpResponse::NotFound().body( message ),
+            CoordinatorError::Worker( message, _ ) => HttpResponse::build( StatusCode::BAD_GATEWAY ).body( message )
+        }
+    }
+}
+
+fn bad_request( message: impl Into< String > ) -> CoordinatorError {
+    CoordinatorError::BadRequest( message.into() )
+}
+
+struct Coordinator {
+    /// The base URLs of the workers, in the order of the time ranges of their shards.
+    workers: Vec< String >
+}
+
+fn find( haystack: &[u8], needle: &[u8] ) -> Option< usize > {
+    haystack.windows( needle.len() ).position( |window| window == needle )
+}
+
+fn invalid_response( message: &str ) -> io::Error {
+    io::Error::new( io::ErrorKind::InvalidData, format!( "invalid HTTP response: {}", message ) )
+}
+
+fn decode_chunked( mut body: &[u8] ) -> io::Result< Vec< u8 > > {
+    let mut output = Vec::new();
+    loop {
+        let line_end = find( body, b"\r\n" ).ok_or_else( || invalid_response( "truncated chunk header" ) )?;
+        let size = std::str::from_utf8( &body[ ..line_end ] ).ok()
+            .and_then( |line| usize::from_str_radix( line.split( ';' ).next().unwrap().trim(), 16 ).ok() )
+            .ok_or_else( || invalid_response( "invalid chunk size" ) )?;
+
+        body = &body[ line_end + 2.. ];
+        if size == 0 {
+            return Ok( output );
+        }
+
+        if body.len() < size + 2 {
+            return Err( invalid_response( "truncated chunk" ) );
+        }
+
+        output.extend_from_slice( &body[ ..size ] );
+        body = &body[ size + 2.. ];
+    }
+}
+
+/// Splits a raw HTTP response into its status code and its decoded body.
+fn parse_response( response: &[u8] ) -> io::Result< (u16, Vec< u8 >) > {
+    let headers_end = find( response, b"\r\n\r\n" ).ok_or_else( || invalid_response( "truncated headers" ) )?;
+    let headers = String::from_utf8_lossy( &response[ ..headers_end ] );
+    let body = &response[ headers_end + 4.. ];
+
+    let mut lines = headers.split( "\r\n" );
+    let status = lines.next()
+        .and_then( |line| line.split( ' ' ).nth( 1 ) )
+        .and_then( |status| status.parse().ok() )
+        .ok_or_else( || invalid_response( "invalid status line" ) )?;
+
+    let mut is_chunked = false;
+    let mut length = None;
+    for line in lines {
+        let mut parts = line.splitn( 2, ':' );
+        let name = parts.next().unwrap().trim().to_ascii_lowercase();
+        let value = parts.next().unwrap_or( "" ).trim();
+        if name == "transfer-encoding" && value.eq_ignore_ascii_case( "chunked" ) {
+            is_chunked = true;
+        } else if name == "content-length" {
+            length = value.parse::< usize >().ok();
+        }
+    }
+
+    let body = if is_chunked {
+        decode_chunked( body )?
+    } else if let Some( length ) = length {
+        if body.len() < length {
+            return Err( invalid_response( "truncated body" ) );
+        }
+        body[ ..length ].to_vec()
+    } else {
+        body.to_vec()
+    };
+
+    Ok( (status, body) )
+}
+
+/// Makes a plain HTTP GET request to a worker; `path` also has the query string in it.
+fn http_get( worker: &str, path: &str ) -> Result< Vec< u8 >, CoordinatorError > {
+    let error = |error: io::Error| CoordinatorError::Worker( format!( "request to {} failed: {}", worker, error ), None );
+    let address = worker.trim_start_matches( "http://" ).trim_end_matches( '/' );
+    let (host, prefix) = match address.find( '/' ) {
+        Some( index ) => (&address[ ..index ], &address[ index.. ]),
+        None => (address, "")
+    };
+
+    let mut stream = TcpStream::connect( host ).map_err( error )?;
+    write!( stream, "GET {}{} HTTP/1.1\r\nHost: {}\r\nConnection: close\r\n\r\n", prefix, path, host ).map_err( error )?;
+
+    let mut response = Vec::new();
+    stream.read_to_end( &mut response ).map_err( error )?;
+
+    let (status, body) = parse_response( &response ).map_err( error )?;
+    if status != 200 {
+        let message = format!( "{}{} returned {}: {}", worker, path, status, String::from_utf8_lossy( &body ) );
+        return Err( CoordinatorError::Worker( message, Some( status ) ) );
+    }
+
+    Ok( body )
+}
+
+fn parse_json< T: DeserializeOwned >( worker: &str, body: &[u8] ) -> Result< T, CoordinatorError > {
+    serde_json::from_slice( body ).map_err( |error| {
+        CoordinatorError::Worker( format!( "{} returned an invalid response: {}", worker, error ), None )
+    })
+}
+
+impl Coordinator {
+    fn fetch< T: DeserializeOwned >( &self, worker: &str, path: &str ) -> Result< T, CoordinatorError > {
+        parse_json( worker, &http_get( worker, path )? )
+    }
+
+    /// Sends the same request to every worker at the same time; the responses are in the order of the workers.
+    fn fetch_all< T: DeserializeOwned + Send + 'static >( &self, path: &str ) -> Result< Vec< T >, CoordinatorError > {
+        let handles: Vec< _ > = self.workers.iter().map( |worker| {
+            let worker = worker.clone();
+            let path = path.to_owned();
+            thread::spawn( move || {
+                let body = http_get( &worker, &path )?;
+                parse_json::< T >( &worker, &body )
+            })
+        }).collect();
+
+        handles.into_iter().map( |handle| {
+            handle.join().unwrap_or_else( |_| Err( CoordinatorError::Worker( "request thread panicked".into(), None ) ) )
+        }).collect()
+    }
+
+    /// Fetches the frames of the given backtraces; every worker has the same backtraces, so only the first one is asked.
+    fn fetch_backtraces( &self, id: &str, query: &str, backtrace_ids: &[u32] ) -> Result< Vec< Vec< protocol::Frame< 'static > > >, CoordinatorError > {
+        if backtrace_ids.is_empty() {
+            return Ok( Vec::new() );
+        }
+
+        let ids: Vec< _ > = backtrace_ids.iter().map( |id| id.to_string() ).collect();
+        let query = replace_query_params( query, &[("ids", ids.join( "," ))] )?;
+        let response: protocol::ResponseBacktraces< Vec< Vec< protocol::Frame< 'static > > > > =
+            self.fetch( &self.workers[ 0 ], &format!( "/data/{}/backtraces?{}", id, query ) )?;
+
+        Ok( response.backtraces )
+    }
+}
+
+/// Returns the query string with the given parameters replaced.
+fn replace_query_params( query: &str, params: &[(&str, String)] ) -> Result< String, CoordinatorError > {
+    let mut pairs: Vec< (String, String) > = serde_urlencoded::from_str( query ).map_err( |error| bad_request( error.to_string() ) )?;
+    pairs.retain( |(key, _)| !params.iter().any( |(name, _)| name == key ) );
+    pairs.extend( params.iter().map( |(name, value)| (name.to_string(), value.clone()) ) );
+    Ok( serde_urlencoded::to_string( pairs ).unwrap() )
+}
+
+fn parse_query< T: DeserializeOwned >( query: &str ) -> Result< T, CoordinatorError > {
+    serde_urlencoded::from_str( query ).map_err( |error| bad_request( error.to_string() ) )
+}
+
+fn to_json< T: serde::Serialize >( value: &T ) -> Result< Vec< u8 >, CoordinatorError > {
+    Ok( serde_json::to_vec( value ).unwrap() )
+}
+
+/// Merges the metadata of the same data from every worker; only the totals differ between them.
+fn merge_metadata( mut entries: Vec< Value > ) -> Value {
+    let mut output = entries.remove( 0 );
+    for key in &["final_allocated", "final_allocated_count"] {
+        let mut total = output[ key ].as_u64();
+        for entry in &entries {
+            total = total.and_then( |total| entry[ key ].as_u64().map( |value| total + value ) );
+        }
+        output[ key ] = total.map( Value::from ).unwrap_or( Value::Null );
+    }
+
+    let is_loaded = output[ "is_loaded" ].as_bool().unwrap_or( false ) && entries.iter().all( |entry| entry[ "is_loaded" ].as_bool().unwrap_or( false ) );
+    output[ "is_loaded" ] = Value::from( is_loaded );
+    output
+}
+
+fn merge_lists( lists: Vec< Vec< Value > > ) -> Vec< Value > {
+    let mut lists = lists.into_iter();
+    let first = lists.next().unwrap_or_default();
+    let others: Vec< _ > = lists.collect();
+    first.into_iter().map( |entry| {
+        let id = entry[ "id" ].clone();
+        let mut entries = vec![ entry ];
+        for list in &others {
+            entries.extend( list.iter().find( |other| other[ "id" ] == id ).cloned() );
+        }
+        merge_metadata( entries )
+    }).collect()
+}
+
+/// Merges the timelines of the shards into one; every timeline is a step function, so they're
+/// sampled at every point at which any of them changes and then added up.
+fn merge_timelines( timelines: Vec< protocol::ResponseTimeline > ) -> protocol::ResponseTimeline {
+    let mut xs: Vec< u64 > = timelines.iter().flat_map( |timeline| timeline.xs.iter().copied() ).collect();
+    xs.sort_unstable();
+    xs.dedup();
+
+    let mut output = protocol::ResponseTimeline {
+        xs: Vec::with_capacity( xs.len() ),
+        size_delta: Vec::with_capacity( xs.len() ),
+        count_delta: Vec::with_capacity( xs.len() ),
+        allocated_size: vec![ 0; xs.len() ],
+        allocated_count: vec![ 0; xs.len() ],
+        allocations: vec![ 0; xs.len() ],
+        deallocations: vec![ 0; xs.len() ]
+    };
+
+    for timeline in &timelines {
+        let mut position = 0;
+        let mut current = (0, 0);
+        for (index, &x) in xs.iter().enumerate() {
+            while position < timeline.xs.len() && timeline.xs[ position ] <= x {
+                current = (timeline.allocated_size[ position ], timeline.allocated_count[ position ]);
+                output.allocations[ index ] += timeline.allocations[ position ];
+                output.deallocations[ index ] += timeline.deallocations[ position ];
+                position += 1;
+            }
+
+            output.allocated_size[ index ] += current.0;
+            output.allocated_count[ index ] += current.1;
+        }
+    }
+
+    let mut last = (0, 0);
+    for index in 0..xs.len() {
+        let size = output.allocated_size[ index ] as i64;
+        let count = output.allocated_count[ index ] as i64;
+        output.size_delta.push( size - last.0 );
+        output.count_delta.push( count - last.1 );
+        last = (size, count);
+    }
+
+    output.xs = xs;
+    output
+}
+
+fn merge_group_stats( lhs: &mut protocol::ShardGroupStats, rhs: &protocol::ShardGroupStats ) {
+    lhs.allocated_count += rhs.allocated_count;
+    lhs.leaked_count += rhs.leaked_count;
+    lhs.size += rhs.size;
+    lhs.min_size = min( lhs.min_size, rhs.min_size );
+    lhs.max_size = max( lhs.max_size, rhs.max_size );
+    lhs.min_timestamp = min( lhs.min_timestamp, rhs.min_timestamp );
+    lhs.max_timestamp = max( lhs.max_timestamp, rhs.max_timestamp );
+}
+
+fn merge_allocation_groups( shards: Vec< protocol::ResponseShardAllocationGroups > ) -> Vec< protocol::ShardAllocationGroup > {
+    let mut groups: HashMap< u32, protocol::ShardAllocationGroup > = HashMap::new();
+    for shard in shards {
+        for group in shard.groups {
+            match groups.get_mut( &group.backtrace_id ) {
+                Some( existing ) => {
+                    merge_group_stats( &mut existing.all, &group.all );
+                    merge_group_stats( &mut existing.only_matched, &group.only_matched );
+                },
+                None => {
+                    groups.insert( group.backtrace_id, group );
+                }
+            }
+        }
+    }
+
+    let mut groups: Vec< _ > = groups.into_iter().map( |(_, group)| group ).collect();
+    groups.sort_unstable_by_key( |group| group.backtrace_id );
+    groups
+}
+
+fn sort_allocation_groups( groups: &mut [protocol::ShardAllocationGroup], sort_by: protocol::AllocGroupsSortBy ) -> Result< (), CoordinatorError > {
+    use protocol::AllocGroupsSortBy::*;
+
+    let key: fn( &protocol::ShardAllocationGroup ) -> u64 = match sort_by {
+        MinTimestamp => |group| group.only_matched.min_timestamp,
+        MaxTimestamp => |group| group.only_matched.max_timestamp,
+        Interval => |group| group.only_matched.max_timestamp - group.only_matched.min_timestamp,
+        AllocatedCount => |group| group.only_matched.allocated_count,
+        LeakedCount => |group| group.only_matched.leaked_count,
+        Size => |group| group.only_matched.size,
+        GlobalMinTimestamp => |group| group.all.min_timestamp,
+        GlobalMaxTimestamp => |group| group.all.max_timestamp,
+        GlobalInterval => |group| group.all.max_timestamp - group.all.min_timestamp,
+        GlobalAllocatedCount => |group| group.all.allocated_count,
+        GlobalLeakedCount => |group| group.all.leaked_count,
+        GlobalSize => |group| group.all.size,
+        CopyAmplification |
+        GlobalMaxTotalUsageFirstSeenAt |
+        GlobalLifetimeP50 |
+        GlobalLifetimeP90 |
+        GlobalLifetimeP99 => return Err( bad_request( "this sort order is not supported in the distributed mode" ) )
+    };
+
+    // The groups are already sorted by their backtraces, and this sort is stable.
+    groups.sort_by_key( key );
+    Ok(())
+}
+
+fn group_data( stats: &protocol::ShardGroupStats, initial_timestamp: u64, last_timestamp: u64 ) -> protocol::AllocationGroupData {
+    let fraction = |timestamp: u64| {
+        (timestamp.saturating_sub( initial_timestamp ) as f64 / max( last_timestamp.saturating_sub( initial_timestamp ), 1 ) as f64) as f32
+    };
+
+    let relative = |timestamp: u64| Timestamp::from_usecs( timestamp.saturating_sub( initial_timestamp ) ).into();
+    protocol::AllocationGroupData {
+        size: stats.size,
+        min_size: stats.min_size,
+        max_size: stats.max_size,
+        min_timestamp: Timestamp::from_usecs( stats.min_timestamp ).into(),
+        min_timestamp_relative: relative( stats.min_timestamp ),
+        min_timestamp_relative_p: fraction( stats.min_timestamp ),
+        max_timestamp: Timestamp::from_usecs( stats.max_timestamp ).into(),
+        max_timestamp_relative: relative( stats.max_timestamp ),
+        max_timestamp_relative_p: fraction( stats.max_timestamp ),
+        interval: Timestamp::from_usecs( stats.max_timestamp - stats.min_timestamp ).into(),
+        leaked_count: stats.leaked_count,
+        allocated_count: stats.allocated_count,
+        graph_preview_url: None,
+        graph_url: None,
+        max_total_usage_first_seen_at: None,
+        max_total_usage_first_seen_at_relative: None,
+        max_total_usage_first_seen_at_relative_p: None,
+        slack: None,
+        bytes_copied: None,
+        chain_peak_size: None,
+        copy_amplification: None,
+        cross_thread_free_count: None,
+        cross_thread_free_size: None,
+        cross_thread_free_latency: None,
+        lifetime_p50: None,
+        lifetime_p90: None,
+        lifetime_p99: None
+    }
+}
+
+fn allocation_groups( coordinator: &Coordinator, id: &str, query: &str ) -> Result< Vec< u8 >, CoordinatorError > {
+    let params: protocol::RequestAllocationGroups = parse_query( query )?;
+    if params.generate_graphs.unwrap_or( false ) {
+        return Err( bad_request( "the graphs can't be generated in the distributed mode" ) );
+    }
+
+    let shards: Vec< protocol::ResponseShardAllocationGroups > = coordinator.fetch_all( &format!( "/data/{}/shard/allocation_groups?{}", id, query ) )?;
+    let initial_timestamp = shards.iter().map( |shard| shard.initial_timestamp ).min().unwrap_or( 0 );
+    let last_timestamp = shards.iter().map( |shard| shard.last_timestamp ).max().unwrap_or( 0 );
+
+    let mut groups = merge_allocation_groups( shards );
+    sort_allocation_groups( &mut groups, params.sort_by.unwrap_or( protocol::AllocGroupsSortBy::MinTimestamp ) )?;
+    if let Some( protocol::Order::Dsc ) = params.order {
+        groups.reverse();
+    }
+
+    let total_count = groups.len() as u64;
+    let page: Vec< _ > = groups.into_iter()
+        .skip( params.skip.unwrap_or( 0 ) as usize )
+        .take( params.count.map( |count| count as usize ).unwrap_or( usize::MAX ) )
+        .collect();
+
+    let backtrace_ids: Vec< _ > = page.iter().map( |group| group.backtrace_id ).collect();
+    let backtraces = coordinator.fetch_backtraces( id, query, &backtrace_ids )?;
+    let allocations: Vec< _ > = page.into_iter().zip( backtraces ).map( |(group, backtrace)| protocol::AllocationGroup {
+        all: group_data( &group.all, initial_timestamp, last_timestamp ),
+        only_matched: group_data( &group.only_matched, initial_timestamp, last_timestamp ),
+        backtrace_id: group.backtrace_id,
+        backtrace
+    }).collect();
+
+    to_json( &protocol::ResponseAllocationGroups {
+        allocations,
+        total_count,
+        backtraces: None
+    })
+}
+
+fn diff( coordinator: &Coordinator, id: &str, query: &str ) -> Result< Vec< u8 >, CoordinatorError > {
+    let params: protocol::RequestDiff = parse_query( query )?;
+    if params.other.is_some() {
+        return Err( bad_request( "diffing against other data is not supported in the distributed mode" ) );
+    }
+
+    let shards: Vec< protocol::ResponseShardDiff > = coordinator.fetch_all( &format!( "/data/{}/shard/diff?{}", id, query ) )?;
+    let mut totals: HashMap< u32, (i64, i64) > = HashMap::new();
+    for entry in shards.into_iter().flat_map( |shard| shard.entries ) {
+        let total = totals.entry( entry.backtrace_id ).or_insert( (0, 0) );
+        total.0 += entry.count;
+        total.1 += entry.size;
+    }
+
+    let mut entries: Vec< _ > = totals.into_iter().filter( |&(_, (count, size))| count != 0 || size != 0 ).collect();
+    entries.sort_unstable_by_key( |&(backtrace_id, (count, size))| (Reverse( size ), Reverse( count ), backtrace_id) );
+
+    let total_count = entries.len() as u64;
+    let count = entries.iter().map( |&(_, (count, _))| count ).sum();
+    let size = entries.iter().map( |&(_, (_, size))| size ).sum();
+    entries.truncate( params.count.map( |count| count as usize ).unwrap_or( 100 ) );
+
+    let backtrace_ids: Vec< _ > = entries.iter().map( |&(backtrace_id, _)| backtrace_id ).collect();
+    let backtraces = coordinator.fetch_backtraces( id, query, &backtrace_ids )?;
+    let entries = entries.into_iter().zip( backtraces ).map( |((backtrace_id, (count, size)), backtrace)| protocol::BacktraceDiff {
+        backtrace_id,
+        is_from_other: false,
+        backtrace,
+        count,
+        size
+    }).collect();
+
+    to_json( &protocol::ResponseDiff {
+        total_count,
+        count,
+        size,
+        entries
+    })
+}
+
+/// The shards are split by time, so the allocations sorted by their timestamps are simply the shards' allocations one after another.
+fn allocations( coordinator: &Coordinator, id: &str, query: &str ) -> Result< Vec< u8 >, CoordinatorError > {
+    let params: protocol::RequestAllocations = parse_query( query )?;
+    if params.sort_by.unwrap_or_default() != protocol::AllocSortBy::Timestamp {
+        return Err( bad_request( "the allocations can only be sorted by their timestamps in the distributed mode" ) );
+    }
+
+    let counts: Vec< protocol::ResponseShardCount > = coordinator.fetch_all( &format!( "/data/{}/shard/count?{}", id, query ) )?;
+    let total_count: u64 = counts.iter().map( |count| count.count ).sum();
+
+    let mut shards: Vec< (usize, u64) > = counts.iter().map( |count| count.count ).enumerate().collect();
+    if let Some( protocol::Order::Dsc ) = params.order {
+        shards.reverse();
+    }
+
+    let start = params.skip.unwrap_or( 0 );
+    let end = params.count.map( |count| start.saturating_add( count as u64 ) ).unwrap_or( u64::MAX );
+    let mut offset = 0;
+    let mut output = protocol::ResponseAllocations {
+        allocations: Vec::< Value >::new(),
+        total_count,
+        backtraces: None
+    };
+
+    for (index, count) in shards {
+        let (shard_start, shard_end) = (max( start, offset ), min( end, offset + count ));
+        offset += count;
+        if shard_start >= shard_end {
+            continue;
+        }
+
+        let query = replace_query_params( query, &[
+            ("skip", (shard_start - (offset - count)).to_string()),
+            ("count", (shard_end - shard_start).to_string())
+        ])?;
+
+        let worker = &coordinator.workers[ index ];
+        let response: protocol::ResponseAllocations< Vec< Value > > = coordinator.fetch( worker, &format!( "/data/{}/allocations?{}", id, query ) )?;
+        output.allocations.extend( response.allocations );
+        if let Some( backtraces ) = response.backtraces {
+            output.backtraces.get_or_insert_with( BTreeMap::new ).extend( backtraces );
+        }
+    }
+
+    to_json( &output )
+}
+
+fn respond< F >( callback: F ) -> impl Future< Item = HttpResponse, Error = ActixWebError >
+    where F: FnOnce() -> Result< Vec< u8 >, CoordinatorError > + Send + 'static
+{
+    web::block( callback ).then( |result| {
+        Ok::< _, ActixWebError >( match result {
+            Ok( body ) => HttpResponse::Ok().content_type( "application/json" ).body( body ),
+            Err( BlockingError::Error( error ) ) => {
+                warn!( "Failed to handle a request: {:?}", error );
+                error.into_response()
+            },
+            Err( BlockingError::Canceled ) => HttpResponse::InternalServerError().finish()
+        })
+    })
+}
+
+fn coordinator( req: &HttpRequest ) -> Arc< Coordinator > {
+    req.app_data::< Arc< Coordinator > >().unwrap().clone()
+}
+
+fn data_id( req: &HttpRequest ) -> String {
+    req.match_info().get( "id" ).unwrap().to_owned()
+}
+
+fn handler_list( req: HttpRequest ) -> impl Future< Item = HttpResponse, Error = ActixWebError > {
+    let coordinator = coordinator( &req );
+    respond( move || to_json( &merge_lists( coordinator.fetch_all( "/list" )? ) ) )
+}
+
+fn handler_metadata( req: HttpRequest ) -> impl Future< Item = HttpResponse, Error = ActixWebError > {
+    let coordinator = coordinator( &req );
+    let id = data_id( &req );
+    respond( move || to_json( &merge_metadata( coordinator.fetch_all( &format!( "/data/{}/metadata", id ) )? ) ) )
+}
+
+fn timeline_handler( req: HttpRequest, kind: &'static str ) -> impl Future< Item = HttpResponse, Error = ActixWebError > {
+    let coordinator = coordinator( &req );
+    let path = format!( "/data/{}/{}?{}", data_id( &req ), kind, req.query_string() );
+    respond( move || to_json( &merge_timelines( coordinator.fetch_all( &path )? ) ) )
+}
+
+fn handler_timeline( req: HttpRequest ) -> impl Future< Item = HttpResponse, Error = ActixWebError > {
+    timeline_handler( req, "timeline" )
+}
+
+fn handler_timeline_leaked( req: HttpRequest ) -> impl Future< Item = HttpResponse, Error = ActixWebError > {
+    timeline_handler( req, "timeline_leaked" )
+}
+
+fn handler_allocation_groups( req: HttpRequest ) -> impl Future< Item = HttpResponse, Error = ActixWebError > {
+    let coordinator = coordinator( &req );
+    let (id, query) = (data_id( &req ), req.query_string().to_owned());
+    respond( move || allocation_groups( &coordinator, &id, &query ) )
+}
+
+fn handler_diff( req: HttpRequest ) -> impl Future< Item = HttpResponse, Error = ActixWebError > {
+    let coordinator = coordinator( &req );
+    let (id, query) = (data_id( &req ), req.query_string().to_owned());
+    respond( move || diff( &coordinator, &id, &query ) )
+}
+
+fn handler_allocations( req: HttpRequest ) -> impl Future< Item = HttpResponse, Error = ActixWebError > {
+    let coordinator = coordinator( &req );
+    let (id, query) = (data_id( &req ), req.query_string().to_owned());
+    respond( move || allocations( &coordinator, &id, &query ) )
+}
+
+/// The backtraces are the same on every worker, so these are simply fetched from the first one.
+fn handler_forward( req: HttpRequest ) -> impl Future< Item = HttpResponse, Error = ActixWebError > {
+    let coordinator = coordinator( &req );
+    let path = format!( "{}?{}", req.path(), req.query_string() );
+    respond( move || http_get( &coordinator.workers[ 0 ], &path ) )
+}
+
+fn handler_unsupported() -> HttpResponse {
+    HttpResponse::NotImplemented().body( "not supported in the distributed mode" )
+}
+
+/// Starts a server which answers the queries by merging the partial results of the given workers.
+pub fn main( workers: Vec< String >, interface: &str, port: u16 ) -> Result< (), ServerError > {
+    if workers.iter().any( |worker| worker.starts_with( "https://" ) ) {
+        return Err( ServerError::Other( io::Error::new( io::ErrorKind::InvalidInput, "only plain HTTP is supported for the workers" ) ) );
+    }
+
+    info!( "Coordinating {} worker(s)", workers.len() );
+    let coordinator = Arc::new( Coordinator { workers } );
+
+    let sys = actix::System::new( "coordinator" );
+    actix_web::HttpServer::new( move || {
+        App::new().data( coordinator.clone() )
+            .wrap( Cors::new() )
+            .wrap( middleware::Compress::default() )
+            .configure( |app| {
+                app
+                    .service( web::resource( "/list" ).route( web::get().to_async( handler_list ) ) )
+                    .service( web::resource( "/data/{id}/metadata" ).route( web::get().to_async( handler_metadata ) ) )
+                    .service( web::resource( "/data/{id}/timeline" ).route( web::get().to_async( handler_timeline ) ) )
+                    .service( web::resource( "/data/{id}/timeline_leaked" ).route( web::get().to_async( handler_timeline_leaked ) ) )
+                    .service( web::resource( "/data/{id}/allocations" ).route( web::get().to_async( handler_allocations ) ) )
+                    .service( web::resource( "/data/{id}/allocation_groups" ).route( web::get().to_async( handler_allocation_groups ) ) )
+                    .service( web::resource( "/data/{id}/diff" ).route( web::get().to_async( handler_diff ) ) )
+                    .service( web::resource( "/data/{id}/backtraces" ).route( web::get().to_async( handler_forward ) ) )
+                    .service( web::resource( "/data/{id}/backtrace/{backtrace_id}" ).route( web::get().to_async( handler_forward ) ) )
+                    .service( web::resource( "/data/{id}/{rest:.*}" ).route( web::get().to( handler_unsupported ) ) )
+                ;
+
+                for (key, bytes) in WEBUI_ASSETS {
+                    app.service( web::resource( &format!( "/{}", key ) ).route( web::get().to( move || StaticResponse( key, bytes ) ) ) );
+                    if *key == "index.html" {
+                        app.service( web::resource( "/" ).route( web::get().to( move || StaticResponse( key, bytes ) ) ) );
+                    }
+                }
+            })
+    }).bind( &format!( "{}:{}", interface, port ) ).map_err( |err| ServerError::BindFailed( err ) )?
+        .shutdown_timeout( 1 )
+        .start();
+
+    let _ = sys.run();
+    Ok(())
+}
+
+#[test]
+fn test_parse_response() {
+    let response = b"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nHello\r\n7;x=y\r\n, world\r\n0\r\n\r\n";
+    assert_eq!( parse_response( response ).unwrap(), (200, b"Hello, world".to_vec()) );
+
+    let response = b"HTTP/1.1 404 Not Found\r\ncontent-length: 4\r\n\r\nnope";
+    assert_eq!( parse_response( response ).unwrap(), (404, b"nope".to_vec()) );
+
+    assert!( parse_response( b"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nHel" ).is_err() );
+}
+
+#[test]
+fn test_merge_timelines() {
+    let timeline = |xs: Vec< u64 >, allocated_size: Vec< u64 >, allocations: Vec< u32 >| protocol::ResponseTimeline {
+        size_delta: Vec::new(),
+        count_delta: Vec::new(),
+        allocated_count: allocated_size.iter().map( |&size| size / 10 ).collect(),
+        deallocations: vec![ 0; xs.len() ],
+        xs,
+        allocated_size,
+        allocations
+    };
+
+    let merged = merge_timelines( vec![
+        timeline( vec![ 0, 10, 20 ], vec![ 100, 200, 50 ], vec![ 1, 2, 3 ] ),
+        timeline( vec![ 5, 10 ], vec![ 30, 40 ], vec![ 4, 5 ] )
+    ]);
+
+    assert_eq!( merged.xs, vec![ 0, 5, 10, 20 ] );
+    assert_eq!( merged.allocated_size, vec![ 100, 130, 240, 90 ] );
+    assert_eq!( merged.allocated_count, vec![ 10, 13, 24, 9 ] );
+    assert_eq!( merged.size_delta, vec![ 100, 30, 110, -150 ] );
+    assert_eq!( merged.allocations, vec![ 1, 4, 7, 3 ] );
+}
@@ -0,0 +1,216 @@
+//! Keeps track of every dataset the server knows about.
+//!
+//! The files are only loaded when they're first used, and when the loaded datasets
+//! go over the memory budget the least recently used ones are unloaded again; they
+//! can be reloaded at any time, which is quick if they're cached on disk.
+
+use std::fs::File;
+use std::io;
+use std::path::PathBuf;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use ahash::AHashMap as HashMap;
+use parking_lot::{Mutex, RwLock};
+
+use cli_core::{Data, DataId, LoadFilter, Loader, parse_events};
+
+use crate::protocol;
+
+pub struct LoadOptions {
+    pub debug_symbols: Vec< PathBuf >,
+    pub use_cache: bool,
+    pub load_filter: LoadFilter
+}
+
+struct Dataset {
+    /// Where the data can be loaded from again; the data which doesn't have one is never unloaded.
+    path: Option< PathBuf >,
+    metadata: protocol::ResponseMetadata,
+    data: Option< Arc< Data > >,
+    memory_usage: usize,
+    last_used: u64,
+    /// Held while the data is being loaded so that it's only ever loaded once at a time.
+    load_lock: Arc< Mutex< () > >
+}
+
+pub struct Datasets {
+    options: LoadOptions,
+    memory_budget: Option< usize >,
+    datasets: Mutex< HashMap< DataId, Dataset > >,
+    /// In the order in which they were added.
+    ids: RwLock< Vec< DataId > >,
+    clock: AtomicU64
+}
+
+impl Datasets {
+    pub fn new( options: LoadOptions, memory_budget: Option< usize > ) -> Self {
+        Datasets {
+            options,
+            memory_budget,
+            datasets: Mutex::new( HashMap::new() ),
+            ids: RwLock::new( Vec::new() ),
+            clock: AtomicU64::new( 0 )
+        }
+    }
+
+    fn tick( &self ) -> u64 {
+        self.clock.fetch_add( 1, Ordering::Relaxed )
+    }
+
+    fn insert( &self, id: DataId, dataset: Dataset ) -> bool {
+        let mut datasets = self.datasets.lock();
+        if datasets.contains_key( &id ) {
+            return false;
+        }
+
+        datasets.insert( id, dataset );
+        self.ids.write().push( id );
+        true
+    }
+
+    /// Registers a file without loading it; only its header is read.
+    pub fn add_file( &self, path: PathBuf ) -> io::Result< DataId > {
+        let (header, _) = parse_events( File::open( &path )? )?;
+        let id = header.id;
+        let dataset = Dataset {
+            path: Some( path ),
+            metadata: protocol::ResponseMetadata::from_header( &header ),
+            data: None,
+            memory_usage: 0,
+            last_used: 0,
+            load_lock: Default::default()
+        };
+
+        self.insert( id, dataset );
+        Ok( id )
+    }
+
+    /// Adds data which was already loaded; returns `false` if it was already there.
+    pub fn add_data( &self, path: Option< PathBuf >, data: Arc< Data > ) -> bool {
+        let id = data.id();
+        let dataset = Dataset {
+            path,
+            metadata: protocol::ResponseMetadata::new( &data ),
+            memory_usage: data.memory_usage(),
+            data: Some( data ),
+            last_used: self.tick(),
+            load_lock: Default::default()
+        };
+
+        self.insert( id, dataset )
+    }
+
+    /// Replaces the data with a newer snapshot of it.
+    pub fn replace_data( &self, data: Arc< Data > ) {
+        let id = data.id();
+        let mut datasets = self.datasets.lock();
+        if let Some( dataset ) = datasets.get_mut( &id ) {
+            dataset.metadata = protocol::ResponseMetadata::new( &data );
+            dataset.memory_usage = data.memory_usage();
+            dataset.data = Some( data );
+            dataset.last_used = self.tick();
+            return;
+        }
+
+        std::mem::drop( datasets );
+        self.add_data( None, data );
+    }
+
+    pub fn contains( &self, id: DataId ) -> bool {
+        self.datasets.lock().contains_key( &id )
+    }
+
+    pub fn last_id( &self ) -> Option< DataId > {
+        self.ids.read().last().cloned()
+    }
+
+    pub fn list( &self ) -> Vec< protocol::ResponseMetadata > {
+        let datasets = self.datasets.lock();
+        self.ids.read().iter().map( |id| {
+            let dataset = &datasets[ id ];
+            let mut metadata = dataset.metadata.clone();
+            metadata.is_loaded = dataset.data.is_some();
+            metadata
+        }).collect()
+    }
+
+    /// Returns the data, loading it first if necessary.
+    ///
+    /// Every dataset which had to be unloaded to make room for it is passed to `on_unload`.
+    pub fn get( &self, id: DataId, on_unload: impl FnMut( DataId ) ) -> io::Result< Option< Arc< Data > > > {
+        let load_lock = {
+            let mut datasets = self.datasets.lock();
+            let dataset = match datasets.get_mut( &id ) {
+                Some( dataset ) => dataset,
+                None => return Ok( None )
+            };
+
+            dataset.last_used = self.tick();
+            if let Some( ref data ) = dataset.data {
+                return Ok( Some( data.clone() ) );
+            }
+
+            dataset.load_lock.clone()
+        };
+
+        let _guard = load_lock.lock();
+        let path = {
+            let datasets = self.datasets.lock();
+            let dataset = &datasets[ &id ];
+
+            // Someone else could have loaded it while we were waiting.
+            if let Some( ref data ) = dataset.data {
+                return Ok( Some( data.clone() ) );
+            }
+
+            dataset.path.clone().unwrap()
+        };
+
+        info!( "Loading {:?}...", path );
+        let data = Loader::load_from_file_with_filter( &path, &self.options.debug_symbols, self.options.use_cache, self.options.load_filter.clone() )?;
+        if data.id() != id {
+            return Err( io::Error::new( io::ErrorKind::InvalidData, format!( "{:?} has changed since the server was started", path ) ) );
+        }
+
+        let data = Arc::new( data );
+        {
+            let mut datasets = self.datasets.lock();
+            let dataset = datasets.get_mut( &id ).unwrap();
+            dataset.metadata = protocol::ResponseMetadata::new( &data );
+            dataset.memory_usage = data.memory_usage();
+            dataset.data = Some( data.clone() );
+        }
+
+        self.unload_over_budget( id, on_unload );
+        Ok( Some( data ) )
+    }
+
+    /// Unloads the least recently used datasets until the rest fits within the memory budget.
+    ///
+    /// The memory is only actually freed once the requests which are still using the data finish.
+    fn unload_over_budget( &self, keep: DataId, mut on_unload: impl FnMut( DataId ) ) {
+        let memory_budget = match self.memory_budget {
+            Some( memory_budget ) => memory_budget,
+            None => return
+        };
+
+        let mut datasets = self.datasets.lock();
+        let mut total: usize = datasets.values().filter( |dataset| dataset.data.is_some() ).map( |dataset| dataset.memory_usage ).sum();
+        while total > memory_budget {
+            let lru = datasets.iter_mut()
+                .filter( |(&id, dataset)| id != keep && dataset.data.is_some() && dataset.path.is_some() )
+                .min_by_key( |(_, dataset)| dataset.last_used );
+
+            let (&id, dataset) = match lru {
+                Some( lru ) => lru,
+                None => break
+            };
+
+            info!( "Unloading {:?} to stay within the memory budget", dataset.path.as_ref().unwrap() );
+            dataset.data = None;
+            total -= dataset.memory_usage;
+            on_unload( id );
+        }
+    }
+}
@@ -1,6 +1,4 @@
 use std::sync::Arc;
-use ahash::AHashMap as HashMap;
-use ahash::AHashSet as HashSet;
 use parking_lot::Mutex;
 
 use regex::{self, Regex};
@@ -9,6 +7,7 @@ use cli_core::{
     Allocation,
     AllocationId,
     BacktraceId,
+    Bitmap,
     Data,
     Timestamp,
     Compile,
@@ -61,60 +60,79 @@ fn run_custom_filter( data: &Arc< Data >, custom_filter: &protocol::CustomFilter
         };
 
         let env = Arc::new( Mutex::new( cli_core::script::VirtualEnvironment::new() ) );
-        let engine = cli_core::script::Engine::new( env.clone(), args );
-        return Ok( engine.run( &custom_filter )? );
+        return Ok( cli_core::script::Engine::run_cached( env.clone(), args, custom_filter )? );
     }
 
     Ok( None )
 }
 
-fn run_custom_allocation_filter( data: &Arc< Data >, custom_filter: &protocol::CustomFilter ) -> Result< Option< Arc< HashSet< AllocationId > > >, cli_core::script::EvalError > {
-    match run_custom_filter( data, custom_filter )? {
-        None => {
-            Ok( None )
-        },
-        Some( EvalOutput::AllocationList( mut list ) ) => {
-            Ok( Some( Arc::new( list.allocation_ids().iter().copied().collect() ) ) )
-        },
-        Some( EvalOutput::MapList( .. ) ) => {
-            Err( "expected 'AllocationList', got 'MapList'".into() )
+fn custom_filter_cache_key( kind: &str, custom_filter: &str ) -> String {
+    format!( "custom {} filter {:x}", kind, md5::compute( custom_filter ) )
+}
+
+/// Runs the custom filter and returns a bitmap of the matching allocations, indexed by their IDs.
+///
+/// The result only depends on the data and on the script, so it's cached alongside the data.
+fn run_custom_allocation_filter( data: &Arc< Data >, custom_filter: &protocol::CustomFilter ) -> Result< Option< Arc< Bitmap > >, cli_core::script::EvalError > {
+    let key = match custom_filter.custom_filter {
+        Some( ref custom_filter ) if !custom_filter.is_empty() => custom_filter_cache_key( "allocation", custom_filter ),
+        _ => return Ok( None )
+    };
+
+    data.cached_selection( key, || {
+        match run_custom_filter( data, custom_filter )? {
+            Some( EvalOutput::AllocationList( mut list ) ) => {
+                let mut bitmap = Bitmap::empty( data.allocation_count() );
+                for &id in list.allocation_ids() {
+                    bitmap.insert( id.raw() as usize );
+                }
+                Ok( bitmap )
+            },
+            Some( EvalOutput::MapList( .. ) ) => {
+                Err( "expected 'AllocationList', got 'MapList'".into() )
+            },
+            None => {
+                Ok( Bitmap::full( data.allocation_count() ) )
+            }
         }
-    }
+    }).map( Some )
 }
 
-fn run_custom_map_filter( data: &Arc< Data >, custom_filter: &protocol::CustomFilter ) -> Result< Option< Arc< HashSet< MapId > > >, cli_core::script::EvalError > {
-    match run_custom_filter( data, custom_filter )? {
-        None => {
-            Ok( None )
-        },
-        Some( EvalOutput::AllocationList( .. ) ) => {
-            Err( "expected 'MapList', got 'AllocationList'".into() )
-        },
-        Some( EvalOutput::MapList( mut list ) ) => {
-            Ok( Some( Arc::new( list.map_ids().iter().copied().collect() ) ) )
+/// Runs the custom filter and returns a bitmap of the matching maps, indexed by their IDs.
+fn run_custom_map_filter( data: &Arc< Data >, custom_filter: &protocol::CustomFilter ) -> Result< Option< Arc< Bitmap > >, cli_core::script::EvalError > {
+    let key = match custom_filter.custom_filter {
+        Some( ref custom_filter ) if !custom_filter.is_empty() => custom_filter_cache_key( "map", custom_filter ),
+        _ => return Ok( None )
+    };
+
+    data.cached_selection( key, || {
+        match run_custom_filter( data, custom_filter )? {
+            Some( EvalOutput::AllocationList( .. ) ) => {
+                Err( "expected 'MapList', got 'AllocationList'".into() )
+            },
+            Some( EvalOutput::MapList( mut list ) ) => {
+                let mut bitmap = Bitmap::empty( data.maps().len() );
+                for &id in list.map_ids() {
+                    bitmap.insert( id.raw() as usize );
+                }
+                Ok( bitmap )
+            },
+            None => {
+                Ok( Bitmap::full( data.maps().len() ) )
+            }
         }
-    }
+    }).map( Some )
 }
 
 #[derive(Clone)]
 pub struct AllocationFilter {
-    filter: cli_core::CompiledAllocationFilter,
-    custom_filter: Option< Arc< HashSet< AllocationId > > >
+    /// Already includes the results of the custom filter.
+    selection: Arc< Bitmap >
 }
 
 impl AllocationFilter {
-    pub fn try_match( &self, data: &Data, id: AllocationId, allocation: &Allocation ) -> bool {
-        if let Some( ref custom_filter ) = self.custom_filter {
-            if !custom_filter.contains( &id ) {
-                return false;
-            }
-        }
-
-        if !self.filter.try_match( data, allocation ) {
-            return false;
-        }
-
-        true
+    pub fn try_match( &self, _: &Data, id: AllocationId, _: &Allocation ) -> bool {
+        self.selection.contains( id.raw() as usize )
     }
 }
 
@@ -123,10 +141,26 @@ pub fn prepare_allocation_filter(
     filter: &protocol::AllocFilter,
     custom_filter: &protocol::CustomFilter
 ) -> Result< AllocationFilter, PrepareFilterError > {
-    let filter = prepare_raw_allocation_filter( data, filter )?.compile( data );
-    let custom_filter = run_custom_allocation_filter( data, custom_filter ).map_err( |error| PrepareFilterError::InvalidCustomFilter( error.message ) )?;
+    // The web UI sends the same filter for every page, for the counts and for the graphs,
+    // so the filter is only compiled and selected when it's seen for the first time.
+    let key = format!( "prepared_allocation_filter:{:?}:{:?}", filter, custom_filter );
+    let selection = data.cached_shared_selection( key, || {
+        let filter = prepare_raw_allocation_filter( data, filter )?;
+        let custom_filter = run_custom_allocation_filter( data, custom_filter ).map_err( |error| PrepareFilterError::InvalidCustomFilter( error.message ) )?;
+
+        // The filter's evaluated for every allocation anyway, so do it once in bulk instead of for every lookup.
+        let selection = filter.select_cached( data );
+        match custom_filter {
+            Some( custom_filter ) => {
+                let mut combined = (*selection).clone();
+                combined.intersect_with( &custom_filter );
+                Ok( Arc::new( combined ) )
+            },
+            None => Ok( selection )
+        }
+    })?;
 
-    Ok( AllocationFilter { filter, custom_filter } )
+    Ok( AllocationFilter { selection } )
 }
 
 pub fn prepare_raw_allocation_filter( data: &Data, filter: &protocol::AllocFilter ) -> Result< cli_core::AllocationFilter, PrepareFilterError > {
@@ -213,6 +247,12 @@ pub fn prepare_raw_allocation_filter( data: &Data, filter: &protocol::AllocFilte
     }
 
     output.only_with_marker = filter.marker;
+    output.only_with_thread_tag = filter.thread_tag;
+    output.only_from_pool = filter.pool;
+    output.only_not_from_pools = filter.not_from_pools.unwrap_or( false );
+    output.only_on_numa_node = filter.numa_node;
+    output.only_from_thread_on_numa_node = filter.thread_numa_node;
+    output.only_numa_remote = filter.numa_remote.unwrap_or( false );
 
     output.only_group_interval_at_least = filter.group_interval_min.map( |ts| Duration( ts.to_timestamp( data.initial_timestamp(), data.last_timestamp() ) ) );
     output.only_group_interval_at_most = filter.group_interval_max.map( |ts| Duration( ts.to_timestamp( data.initial_timestamp(), data.last_timestamp() ) ) );
@@ -253,13 +293,13 @@ pub fn prepare_raw_allocation_filter( data: &Data, filter: &protocol::AllocFilte
 #[derive(Clone)]
 pub struct MapFilter {
     filter: cli_core::CompiledMapFilter,
-    custom_filter: Option< Arc< HashSet< MapId > > >
+    custom_filter: Option< Arc< Bitmap > >
 }
 
 impl MapFilter {
     pub fn try_match( &self, data: &Data, id: MapId, allocation: &Map ) -> bool {
         if let Some( ref custom_filter ) = self.custom_filter {
-            if !custom_filter.contains( &id ) {
+            if !custom_filter.contains( id.raw() as usize ) {
                 return false;
             }
         }
@@ -359,6 +399,10 @@ pub fn prepare_raw_map_filter( data: &Data, filter: &protocol::MapFilter ) -> Re
 
     output.only_peak_rss_at_least = filter.peak_rss_min;
     output.only_peak_rss_at_most = filter.peak_rss_max;
+    output.only_peak_huge_pages_at_least = filter.peak_huge_pages_min;
+    output.only_peak_huge_pages_at_most = filter.peak_huge_pages_max;
+    output.only_huge_page_advised = filter.huge_page_advised == Some( protocol::BoolFilter::OnlyTrue );
+    output.only_not_huge_page_advised = filter.huge_page_advised == Some( protocol::BoolFilter::OnlyFalse );
     output.only_jemalloc = filter.jemalloc == Some( protocol::BoolFilter::OnlyTrue );
     output.only_not_jemalloc = filter.jemalloc == Some( protocol::BoolFilter::OnlyFalse );
     output.only_bytehound = filter.bytehound == Some( protocol::BoolFilter::OnlyTrue );
@@ -416,108 +460,35 @@ pub fn prepare_backtrace_filter( filter: &protocol::BacktraceFilter ) -> Result<
     Ok( filter )
 }
 
-pub fn match_backtrace< 'a >(
-    data: &Data,
-    positive_cache: &mut HashMap< crate::FrameId, bool >,
-    negative_cache: &mut HashMap< crate::FrameId, bool >,
-    filter: &BacktraceFilter,
-    backtrace: impl ExactSizeIterator< Item = (crate::FrameId, &'a crate::Frame) >
-) -> bool {
-    if backtrace.len() < filter.backtrace_depth_min || backtrace.len() > filter.backtrace_depth_max {
-        return false;
-    }
-
-    let mut positive_matched = filter.function_regex.is_none() && filter.source_regex.is_none();
-    let mut negative_matched = false;
-    let check_negative = filter.negative_function_regex.is_some() || filter.negative_source_regex.is_some();
-
-    for (frame_id, frame) in backtrace {
-        let check_positive =
-            if positive_matched {
-                false
-            } else if let Some( &cached_result ) = positive_cache.get( &frame_id ) {
-                positive_matched = cached_result;
-                false
-            } else {
-                true
-            };
-
-        if positive_matched && !check_negative {
-            break;
-        }
-
-        let mut function = None;
-        if (check_positive && filter.function_regex.is_some()) || filter.negative_function_regex.is_some() {
-            function = frame.function().or_else( || frame.raw_function() ).map( |id| data.interner().resolve( id ).unwrap() );
-        }
-
-        let mut source = None;
-        if (check_positive && filter.source_regex.is_some()) || filter.negative_source_regex.is_some() {
-            source = frame.source().map( |id| data.interner().resolve( id ).unwrap() )
-        }
-
-        if check_positive {
-            let matched_function =
-                if let Some( regex ) = filter.function_regex.as_ref() {
-                    if let Some( ref function ) = function {
-                        regex.is_match( function )
-                    } else {
-                        false
-                    }
-                } else {
-                    true
-                };
-
-            let matched_source =
-                if let Some( regex ) = filter.source_regex.as_ref() {
-                    if let Some( ref source ) = source {
-                        regex.is_match( source )
-                    } else {
-                        false
-                    }
-                } else {
-                    true
-                };
-
-            positive_matched = matched_function && matched_source;
-            positive_cache.insert( frame_id, positive_matched );
-        }
-
-        if check_negative {
-            match negative_cache.get( &frame_id ).cloned() {
-                Some( true ) => {
-                    negative_matched = true;
-                    break;
-                },
-                Some( false ) => {
-                    continue;
-                },
-                None => {}
-            }
-
-            if let Some( regex ) = filter.negative_function_regex.as_ref() {
-                if let Some( ref function ) = function {
-                    if regex.is_match( function ) {
-                        negative_cache.insert( frame_id, true );
-                        negative_matched = true;
-                        break;
-                    }
-                }
-            }
+/// Returns the backtraces which match the filter, indexed by their IDs; the filter is only compiled
+/// and matched when it's seen for the first time.
+pub fn select_backtraces( data: &Data, filter: &protocol::BacktraceFilter ) -> Result< Arc< Bitmap >, PrepareFilterError > {
+    let key = format!( "prepared_backtrace_filter:{:?}", filter );
+    data.cached_selection( key, || {
+        let filter = prepare_backtrace_filter( filter )?;
+        Ok( match_backtraces( data, &filter ) )
+    })
+}
 
-            if let Some( regex ) = filter.negative_source_regex.as_ref() {
-                if let Some( ref source ) = source {
-                    if regex.is_match( source ) {
-                        negative_cache.insert( frame_id, true );
-                        negative_matched = true;
-                        break;
-                    }
-                }
+fn match_backtraces( data: &Data, filter: &BacktraceFilter ) -> Bitmap {
+    let mut matched = data.backtraces_matching_frames(
+        filter.function_regex.as_ref(),
+        filter.source_regex.as_ref(),
+        filter.negative_function_regex.as_ref(),
+        filter.negative_source_regex.as_ref()
+    );
+
+    let matched_depth = Bitmap::from_words( data.unique_backtrace_count(), |start, count| {
+        let mut word = 0;
+        for bit in 0..count {
+            let depth = data.get_frame_ids( BacktraceId::new( (start + bit) as u32 ) ).len();
+            if depth >= filter.backtrace_depth_min && depth <= filter.backtrace_depth_max {
+                word |= 1 << bit;
             }
-
-            negative_cache.insert( frame_id, false );
         }
-    }
+        word
+    });
 
-    positive_matched && !negative_matched
+    matched.intersect_with( &matched_depth );
+    matched
 }
@@ -0,0 +1,127 @@
+//! Keeps the files generated by the scripts so that they can be served afterwards.
+//!
+//! The most recently used files are kept in memory. If a directory was given then every file
+//! is also written there, so once it falls out of memory it can be read back instead of having
+//! to be generated all over again.
+
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+
+use parking_lot::Mutex;
+
+use crate::sized_cache::SizedCache;
+
+pub struct GeneratedFilesOptions {
+    /// How much memory the generated files can take.
+    pub memory_limit: usize,
+    /// Where the generated files are written; they're only kept in memory when this is `None`.
+    pub directory: Option< PathBuf >,
+    /// How much disk space the generated files can take.
+    pub disk_limit: usize
+}
+
+impl Default for GeneratedFilesOptions {
+    fn default() -> Self {
+        GeneratedFilesOptions {
+            memory_limit: 32 * 1024 * 1024,
+            directory: None,
+            disk_limit: 1024 * 1024 * 1024
+        }
+    }
+}
+
+#[derive(Clone)]
+pub struct GeneratedFile {
+    /// The md5 of the contents.
+    pub hash: String,
+    pub mime: &'static str,
+    pub data: Arc< Vec< u8 > >
+}
+
+pub struct GeneratedFiles {
+    directory: Option< PathBuf >,
+    in_memory: Mutex< SizedCache< String, GeneratedFile > >,
+    /// The mime types of the files which were written to the directory.
+    on_disk: Mutex< SizedCache< String, &'static str > >
+}
+
+impl GeneratedFiles {
+    pub fn new( options: GeneratedFilesOptions ) -> io::Result< Self > {
+        if let Some( ref directory ) = options.directory {
+            fs::create_dir_all( directory )?;
+        }
+
+        Ok( GeneratedFiles {
+            directory: options.directory,
+            in_memory: Mutex::new( SizedCache::new( options.memory_limit ) ),
+            on_disk: Mutex::new( SizedCache::new( options.disk_limit ) )
+        })
+    }
+
+    pub fn add( &self, file: GeneratedFile ) {
+        if let Some( ref directory ) = self.directory {
+            if !self.on_disk.lock().contains( &file.hash ) {
+                if let Err( error ) = self.write_to_disk( directory, &file ) {
+                    warn!( "Failed to write a generated file to {:?}: {}", directory, error );
+                }
+            }
+        }
+
+        let size = file.data.len();
+        self.in_memory.lock().put( file.hash.clone(), file, size );
+    }
+
+    fn write_to_disk( &self, directory: &Path, file: &GeneratedFile ) -> io::Result< () > {
+        // Write it under a temporary name first so that a half-written file is never served.
+        let path = directory.join( &file.hash );
+        let tmp_path = directory.join( format!( "{}.tmp", file.hash ) );
+        fs::write( &tmp_path, &*file.data )?;
+        fs::rename( &tmp_path, &path )?;
+
+        let mut evicted = Vec::new();
+        self.on_disk.lock().put_and_evict( file.hash.clone(), file.mime, file.data.len(), |hash, _| evicted.push( hash ) );
+        for hash in evicted {
+            let _ = fs::remove_file( directory.join( hash ) );
+        }
+
+        Ok(())
+    }
+
+    pub fn get( &self, hash: &str ) -> io::Result< Option< GeneratedFile > > {
+        let hash = hash.to_owned();
+        if let Some( file ) = self.in_memory.lock().get( &hash ) {
+            return Ok( Some( file.clone() ) );
+        }
+
+        let directory = match self.directory {
+            Some( ref directory ) => directory,
+            None => return Ok( None )
+        };
+
+        let mime = match self.on_disk.lock().get( &hash ) {
+            Some( &mime ) => mime,
+            None => return Ok( None )
+        };
+
+        let data = match fs::read( directory.join( &hash ) ) {
+            Ok( data ) => data,
+            Err( ref error ) if error.kind() == io::ErrorKind::NotFound => {
+                self.on_disk.lock().remove( &hash );
+                return Ok( None );
+            },
+            Err( error ) => return Err( error )
+        };
+
+        let file = GeneratedFile {
+            hash,
+            mime,
+            data: Arc::new( data )
+        };
+
+        let size = file.data.len();
+        self.in_memory.lock().put( file.hash.clone(), file.clone(), size );
+        Ok( Some( file ) )
+    }
+}
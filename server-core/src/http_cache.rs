@@ -0,0 +1,138 @@
+use std::io::Write;
+
+use actix_web::{HttpRequest, HttpResponse};
+use actix_web::dev::HttpResponseBuilder;
+use bytes::Bytes;
+use flate2::Compression;
+use flate2::write::GzEncoder;
+
+use cli_core::DataId;
+
+/// The headers which let the clients cache the responses which only depend on the data and the query.
+pub struct CacheHeaders {
+    etag: String,
+    is_immutable: bool
+}
+
+impl CacheHeaders {
+    /// The `revision` is only there if the data is a live snapshot which can still change.
+    pub fn new( data_id: DataId, revision: Option< u64 >, query: &str, variant: &str ) -> Self {
+        let hash = md5::compute( format!( "{}\0{}", normalize_query( query ), variant ) );
+        CacheHeaders {
+            etag: format!( "\"{}-{}-{:x}\"", data_id, revision.unwrap_or( 0 ), hash ),
+            is_immutable: revision.is_none()
+        }
+    }
+
+    pub fn etag( &self ) -> &str {
+        &self.etag
+    }
+
+    /// Returns a `304 Not Modified` if the client already has this exact response.
+    pub fn not_modified( &self, req: &HttpRequest ) -> Option< HttpResponse > {
+        let if_none_match = req.headers().get( "if-none-match" )?.to_str().ok()?;
+        if !etag_matches( if_none_match, &self.etag ) {
+            return None;
+        }
+
+        Some( self.apply( &mut HttpResponse::NotModified() ).finish() )
+    }
+
+    pub fn apply< 'a >( &self, builder: &'a mut HttpResponseBuilder ) -> &'a mut HttpResponseBuilder {
+        // Live snapshots still have to be revalidated, but the 304s make that cheap.
+        let cache_control = if self.is_immutable {
+            "public, max-age=31536000, immutable"
+        } else {
+            "no-cache"
+        };
+
+        builder
+            .header( "ETag", self.etag.as_str() )
+            .header( "Cache-Control", cache_control )
+            .header( "Vary", "Accept, Accept-Encoding" )
+    }
+}
+
+/// A fully generated response which is kept around in both its plain and compressed form.
+pub struct CachedResponse {
+    content_type: &'static str,
+    identity: Bytes,
+    gzip: Bytes
+}
+
+impl CachedResponse {
+    pub fn new( content_type: &'static str, body: Vec< u8 > ) -> Self {
+        let mut encoder = GzEncoder::new( Vec::with_capacity( body.len() / 4 ), Compression::default() );
+        let gzip = encoder.write_all( &body ).and_then( |_| encoder.finish() ).expect( "compression into memory failed" );
+
+        CachedResponse {
+            content_type,
+            identity: body.into(),
+            gzip: gzip.into()
+        }
+    }
+
+    pub fn memory_usage( &self ) -> usize {
+        self.identity.len() + self.gzip.len()
+    }
+
+    pub fn respond( &self, req: &HttpRequest, headers: &CacheHeaders ) -> HttpResponse {
+        let mut builder = HttpResponse::Ok();
+        headers.apply( &mut builder ).content_type( self.content_type );
+
+        // Setting the `Content-Encoding` ourselves keeps the compression middleware from compressing this again.
+        if accepts_gzip( req ) {
+            builder.header( "Content-Encoding", "gzip" ).body( self.gzip.clone() )
+        } else {
+            builder.body( self.identity.clone() )
+        }
+    }
+}
+
+/// Sorts the query parameters so that the same query always ends up with the same ETag.
+fn normalize_query( query: &str ) -> String {
+    let mut pairs: Vec< (String, String) > = match serde_urlencoded::from_str( query ) {
+        Ok( pairs ) => pairs,
+        Err( _ ) => return query.to_owned()
+    };
+
+    pairs.sort();
+    serde_urlencoded::to_string( pairs ).unwrap_or_else( |_| query.to_owned() )
+}
+
+fn etag_matches( if_none_match: &str, etag: &str ) -> bool {
+    if_none_match.split( ',' )
+        .map( |value| value.trim() )
+        .map( |value| value.strip_prefix( "W/" ).unwrap_or( value ) )
+        .any( |value| value == "*" || value == etag )
+}
+
+fn accepts_gzip( req: &HttpRequest ) -> bool {
+    let accept_encoding = match req.headers().get( "accept-encoding" ).and_then( |value| value.to_str().ok() ) {
+        Some( value ) => value,
+        None => return false
+    };
+
+    accept_encoding.split( ',' ).any( |encoding| {
+        let mut parts = encoding.split( ';' ).map( |part| part.trim() );
+        let name = parts.next().unwrap_or( "" );
+        let is_disabled = parts.any( |part| part.strip_prefix( "q=" ).and_then( |q| q.parse::< f32 >().ok() ) == Some( 0.0 ) );
+        (name == "gzip" || name == "*") && !is_disabled
+    })
+}
+
+#[test]
+fn test_normalize_query() {
+    assert_eq!( normalize_query( "b=2&a=1&c=" ), "a=1&b=2&c=" );
+    assert_eq!( normalize_query( "a=1&b=2&c=" ), normalize_query( "c=&b=2&a=1" ) );
+    assert_eq!( normalize_query( "x=%20y" ), "x=+y" );
+    assert_eq!( normalize_query( "" ), "" );
+}
+
+#[test]
+fn test_etag_matches() {
+    assert!( etag_matches( "\"a\"", "\"a\"" ) );
+    assert!( etag_matches( "\"b\", W/\"a\"", "\"a\"" ) );
+    assert!( etag_matches( "*", "\"a\"" ) );
+    assert!( !etag_matches( "\"b\"", "\"a\"" ) );
+}
@@ -4,7 +4,6 @@ extern crate log;
 extern crate serde_derive;
 
 use std::collections::BTreeMap;
-use std::fs::File;
 use std::error::Error;
 use std::sync::Arc;
 use std::fmt::{self, Write};
@@ -12,14 +11,16 @@ use std::thread;
 use std::io;
 use std::borrow::Cow;
 use std::cmp::{min, max};
-use std::path::PathBuf;
-use std::time::Instant;
+use std::path::{Path, PathBuf};
+use std::fs::File;
+use std::time::Duration;
 
 use actix_web::{
     body::{
         Body,
         BodyStream
     },
+    middleware,
     web,
     App,
     HttpRequest,
@@ -36,11 +37,11 @@ use actix_cors::Cors;
 use futures::Stream;
 use serde::Serialize;
 use itertools::Itertools;
-use lru::LruCache;
-use parking_lot::Mutex;
+use parking_lot::{Condvar, Mutex};
 use rayon::prelude::*;
 
 use cli_core::{
+    LoadFilter,
     Loader,
     Data,
     DataId,
@@ -52,20 +53,44 @@ use cli_core::{
     Tree,
     NodeId,
     FrameId,
+    SourceKey,
     MalloptKind,
     VecVec,
     CountAndSize,
     Map,
     MapId,
     RegionFlags,
+    HugePageFlags,
+    AllocationDelta,
+    UsageDelta,
+    TimelinePoint,
+    TimelinePyramid,
+    ThreadId,
+    CoLocatedPair,
+    DEFAULT_CACHE_LINE_SIZE,
+    find_co_located_allocations,
+    DuplicateGroup,
+    find_duplicates,
+    cross_thread_latency,
+    RequestedSizes,
+    SizeClassAllocator,
+    ChainGrowth,
+    CulledAllocations,
+    AllocatorLatencies,
+    AllocatorCall,
+    find_allocation_rates,
+    diff_timestamps,
+    diff_traces,
     export_as_replay,
     export_as_heaptrack,
+    export_as_pprof,
     export_as_flamegraph,
     export_as_flamegraph_pl,
     table_to_string
 };
 
 use common::Timestamp;
+use common::event::HeaderBody;
 
 mod itertools;
 mod protocol;
@@ -73,145 +98,243 @@ mod streaming_channel;
 mod byte_channel;
 mod streaming_serializer;
 mod filter;
+mod columns;
+mod sized_cache;
+mod scheduler;
+mod http_cache;
+mod datasets;
+mod generated_files;
+mod coordinator;
 
 use crate::byte_channel::byte_channel;
 use crate::streaming_serializer::StreamingSerializer;
+use crate::sized_cache::SizedCache;
+use crate::scheduler::{Priority, Scheduler};
+use crate::http_cache::{CacheHeaders, CachedResponse};
+use crate::datasets::{Datasets, LoadOptions};
+use crate::generated_files::{GeneratedFile, GeneratedFiles};
 use crate::filter::{AllocationFilter, PrepareFilterError, prepare_allocation_filter, prepare_raw_allocation_filter, prepare_map_filter, prepare_raw_map_filter};
 
+pub use crate::generated_files::GeneratedFilesOptions;
+pub use crate::coordinator::main as coordinator_main;
+
+/// How much memory the cached allocation groups and the cached filtered allocations can each take.
+const CACHE_SIZE: usize = 512 * 1024 * 1024;
+
+/// How much memory the pre-generated responses can take at most.
+const RESPONSE_CACHE_SIZE: usize = 128 * 1024 * 1024;
+
 struct AllocationGroups {
-    allocations_by_backtrace: VecVec< BacktraceId, AllocationId >
+    allocations_by_backtrace: VecVec< BacktraceId, AllocationId >,
+    /// The statistics of only the matched allocations of every group.
+    only_matched: Vec< protocol::AllocationGroupData >,
+    /// The index of every group in ascending order, for every sort key which was needed so far.
+    sorted: Mutex< HashMap< protocol::AllocGroupsSortBy, Arc< Vec< u32 > > > >
 }
 
 impl AllocationGroups {
-    fn new< 'a, T: ParallelIterator< Item = (AllocationId, &'a Allocation) > >( iter: T ) -> Self {
-        let grouped = iter
-            .fold_with(
-                HashMap::new(),
-                |mut grouped, (id, allocation)| {
-                    grouped.entry( allocation.backtrace ).or_insert_with( Vec::new ).push( id );
-                    grouped
-                }
-            )
-            .reduce(
-                || HashMap::new(),
-                |mut a, mut b| {
-                    if b.len() > a.len() {
-                        std::mem::swap( &mut a, &mut b );
-                    }
+    fn new( data: &Data, allocation_ids: &[AllocationId] ) -> Self {
+        let allocations_by_backtrace = data.group_by_backtrace( allocation_ids );
+        let only_matched = allocations_by_backtrace.par_iter().map( |(_, allocation_ids)| {
+            get_allocation_group_data( data, allocation_ids.par_iter().map( |&allocation_id| data.get_allocation( allocation_id ) ) )
+        }).collect();
 
-                    for (backtrace, ids) in b {
-                        a.entry( backtrace ).or_insert_with( Vec::new ).extend( ids );
-                    }
+        AllocationGroups {
+            allocations_by_backtrace,
+            only_matched,
+            sorted: Mutex::new( HashMap::new() )
+        }
+    }
 
-                    a
-                }
-            );
+    fn len( &self ) -> usize {
+        self.allocations_by_backtrace.len()
+    }
+
+    /// A rough upper bound of how much memory this takes, including every sort order it could ever need.
+    fn memory_usage( &self ) -> usize {
+        const SORT_KEY_COUNT: usize = 17;
+        let group_count = self.len();
+        let allocation_count: usize = self.allocations_by_backtrace.iter().map( |(_, ids)| ids.len() ).sum();
+
+        allocation_count * std::mem::size_of::< AllocationId >() +
+        group_count * (
+            std::mem::size_of::< (BacktraceId, u32, u32) >() +
+            std::mem::size_of::< protocol::AllocationGroupData >() +
+            SORT_KEY_COUNT * std::mem::size_of::< u32 >()
+        )
+    }
+
+    fn sort_by< T, F >( &self, data: &Data, is_global: bool, callback: F ) -> Vec< u32 >
+        where F: Fn( &protocol::AllocationGroupData ) -> T + Send + Sync,
+              T: Ord + Send + Sync
+    {
+        let keys: Vec< T > = (0..self.len()).into_par_iter().map( |index| {
+            if is_global {
+                let (&backtrace_id, _) = self.allocations_by_backtrace.get( index );
+                callback( &get_global_group_data( data, backtrace_id ) )
+            } else {
+                callback( &self.only_matched[ index ] )
+            }
+        }).collect();
 
-        let mut grouped: Vec< (BacktraceId, Vec< AllocationId >) > = grouped.into_iter().collect();
-        grouped.par_sort_by_key( |&(backtrace_id, _)| backtrace_id );
+        let mut order: Vec< u32 > = (0..self.len() as u32).collect();
+        order.par_sort_by( |&a, &b| keys[ a as usize ].cmp( &keys[ b as usize ] ) );
+        order
+    }
 
-        let mut allocations = VecVec::new();
-        for (backtrace_id, allocation_ids) in grouped {
-            allocations.insert( backtrace_id, allocation_ids );
+    /// Returns the index of every group in ascending order, sorting them only the first time each sort key is used.
+    fn sorted( &self, data: &Data, sort_by: protocol::AllocGroupsSortBy ) -> Arc< Vec< u32 > > {
+        if let Some( order ) = self.sorted.lock().get( &sort_by ) {
+            return order.clone();
         }
 
-        let groups = AllocationGroups {
-            allocations_by_backtrace: allocations
+        let order = match sort_by {
+            protocol::AllocGroupsSortBy::MinTimestamp => self.sort_by( data, false, |group_data| group_data.min_timestamp.clone() ),
+            protocol::AllocGroupsSortBy::MaxTimestamp => self.sort_by( data, false, |group_data| group_data.max_timestamp.clone() ),
+            protocol::AllocGroupsSortBy::Interval => self.sort_by( data, false, |group_data| group_data.interval.clone() ),
+            protocol::AllocGroupsSortBy::AllocatedCount => self.sort_by( data, false, |group_data| group_data.allocated_count ),
+            protocol::AllocGroupsSortBy::LeakedCount => self.sort_by( data, false, |group_data| group_data.leaked_count ),
+            protocol::AllocGroupsSortBy::Size => self.sort_by( data, false, |group_data| group_data.size ),
+            protocol::AllocGroupsSortBy::CopyAmplification => self.sort_by( data, false, |group_data| group_data.copy_amplification.map( |value| (value * 1000.0) as u64 ) ),
+            protocol::AllocGroupsSortBy::GlobalMinTimestamp => self.sort_by( data, true, |group_data| group_data.min_timestamp.clone() ),
+            protocol::AllocGroupsSortBy::GlobalMaxTimestamp => self.sort_by( data, true, |group_data| group_data.max_timestamp.clone() ),
+            protocol::AllocGroupsSortBy::GlobalInterval => self.sort_by( data, true, |group_data| group_data.interval.clone() ),
+            protocol::AllocGroupsSortBy::GlobalAllocatedCount => self.sort_by( data, true, |group_data| group_data.allocated_count ),
+            protocol::AllocGroupsSortBy::GlobalLeakedCount => self.sort_by( data, true, |group_data| group_data.leaked_count ),
+            protocol::AllocGroupsSortBy::GlobalSize => self.sort_by( data, true, |group_data| group_data.size ),
+            protocol::AllocGroupsSortBy::GlobalMaxTotalUsageFirstSeenAt => self.sort_by( data, true, |group_data| group_data.max_total_usage_first_seen_at.clone() ),
+            protocol::AllocGroupsSortBy::GlobalLifetimeP50 => self.sort_by( data, true, |group_data| group_data.lifetime_p50.clone() ),
+            protocol::AllocGroupsSortBy::GlobalLifetimeP90 => self.sort_by( data, true, |group_data| group_data.lifetime_p90.clone() ),
+            protocol::AllocGroupsSortBy::GlobalLifetimeP99 => self.sort_by( data, true, |group_data| group_data.lifetime_p99.clone() )
         };
 
-        groups
-    }
-
-    fn len( &self ) -> usize {
-        self.allocations_by_backtrace.len()
+        let order = Arc::new( order );
+        self.sorted.lock().insert( sort_by, order.clone() );
+        order
     }
 }
 
+/// The sort order doesn't matter here since every sort order is kept along with the groups.
 #[derive(Clone, PartialEq, Eq, Hash)]
 struct AllocationGroupsKey {
     data_id: DataId,
     filter: protocol::AllocFilter,
-    custom_filter: protocol::CustomFilter,
-    sort_by: protocol::AllocGroupsSortBy,
-    order: protocol::Order
+    custom_filter: protocol::CustomFilter
 }
 
-#[derive(Clone)]
-struct GeneratedFile {
-    timestamp: Instant,
-    hash: String,
-    mime: &'static str,
-    data: Arc< Vec< u8 > >
+/// The order doesn't matter here since the matching allocations are always kept in ascending order.
+#[derive(Clone, PartialEq, Eq, Hash)]
+struct AllocationsKey {
+    data_id: DataId,
+    filter: protocol::AllocFilter,
+    custom_filter: protocol::CustomFilter,
+    sort_by: protocol::AllocSortBy
 }
 
-#[derive(Default)]
-struct GeneratedFilesCollection {
-    by_hash: HashMap< String, GeneratedFile >,
-    total_size: usize
+struct State {
+    datasets: Datasets,
+    allocation_group_cache: Mutex< SizedCache< AllocationGroupsKey, Arc< AllocationGroups > > >,
+    allocation_cache: Mutex< SizedCache< AllocationsKey, Arc< Vec< AllocationId > > > >,
+    timelines: Mutex< HashMap< DataId, Arc< Timelines > > >,
+    /// How many times the live snapshots were replaced; the data which isn't in here never changes.
+    revisions: Mutex< HashMap< DataId, u64 > >,
+    /// Notified whenever any of the `revisions` changes.
+    data_replaced: Condvar,
+    /// The fully generated responses keyed by their ETag.
+    responses: Mutex< SizedCache< String, Arc< CachedResponse > > >,
+    generated_files: GeneratedFiles,
+    scheduler: Arc< Scheduler >
 }
 
-impl GeneratedFilesCollection {
-    fn purge_old_if_too_big( &mut self ) {
-        if self.total_size < 32 * 1024 * 1024 {
+impl State {
+    fn new( datasets: Datasets, generated_files: GeneratedFiles ) -> Self {
+        State {
+            datasets,
+            allocation_group_cache: Mutex::new( SizedCache::new( CACHE_SIZE ) ),
+            allocation_cache: Mutex::new( SizedCache::new( CACHE_SIZE ) ),
+            timelines: Mutex::new( HashMap::new() ),
+            revisions: Mutex::new( HashMap::new() ),
+            data_replaced: Condvar::new(),
+            responses: Mutex::new( SizedCache::new( RESPONSE_CACHE_SIZE ) ),
+            generated_files,
+            scheduler: Arc::new( Scheduler::new() )
+        }
+    }
+
+    /// The data without a `path` can't be reloaded, so it's never unloaded either.
+    fn add_data( &self, path: Option< PathBuf >, data: Data ) {
+        if self.datasets.contains( data.id() ) {
             return;
         }
 
-        let mut list: Vec< _ > = self.by_hash.values().cloned().collect();
-        list.sort_by_key( |entry| entry.timestamp );
-        list.reverse();
+        // Precompute these while we're still loading so that the first requests are instant.
+        let timelines = Arc::new( Timelines::new( &data ) );
+        let id = data.id();
+        if self.datasets.add_data( path, Arc::new( data ) ) {
+            self.timelines.lock().insert( id, timelines );
+        }
+    }
 
-        while let Some( entry ) = list.pop() {
-            if self.total_size <= 16 * 1024 * 1024 {
-                break;
-            }
+    /// Publishes a newer snapshot of data which is still being gathered.
+    fn replace_data( &self, data: Data ) {
+        let id = data.id();
+        self.datasets.replace_data( Arc::new( data ) );
+
+        // Anything cached for the old snapshot is now stale.
+        let revision = {
+            let mut revisions = self.revisions.lock();
+            let revision = revisions.entry( id ).or_insert( 0 );
+            *revision += 1;
+            *revision
+        };
 
-            self.total_size -= entry.data.len();
-            self.by_hash.remove( &entry.hash );
-        }
+        let stale_prefix = format!( "\"{}-", id );
+        let current_prefix = format!( "\"{}-{}-", id, revision );
+        self.responses.lock().remove_if( |etag| etag.starts_with( &stale_prefix ) && !etag.starts_with( &current_prefix ) );
+        self.purge_caches( id );
+        self.data_replaced.notify_all();
     }
 
-    fn add_file( &mut self, entry: GeneratedFile ) {
-        if !self.by_hash.contains_key( &entry.hash ) {
-            self.total_size += entry.data.len();
-            self.by_hash.insert( entry.hash.clone(), entry );
+    /// Waits until the revision of the data is different than `last_revision`, or until the `timeout` runs out.
+    ///
+    /// Returns the revision the data has now.
+    fn wait_for_new_revision( &self, id: DataId, last_revision: Option< u64 >, timeout: Duration ) -> Option< u64 > {
+        let deadline = std::time::Instant::now() + timeout;
+        let mut revisions = self.revisions.lock();
+        loop {
+            let revision = revisions.get( &id ).cloned();
+            if revision != last_revision || self.data_replaced.wait_until( &mut revisions, deadline ).timed_out() {
+                return revisions.get( &id ).cloned();
+            }
         }
     }
-}
 
-struct State {
-    data: HashMap< DataId, Arc< Data > >,
-    data_ids: Vec< DataId >,
-    allocation_group_cache: Mutex< LruCache< AllocationGroupsKey, Arc< AllocationGroups > > >,
-    generated_files: Mutex< GeneratedFilesCollection >
-}
+    /// Drops everything derived from the data which is kept around for the faster requests.
+    ///
+    /// The cached responses are kept since they're small and can't change as long as the revision doesn't.
+    fn purge_caches( &self, id: DataId ) {
+        self.timelines.lock().remove( &id );
+        self.allocation_group_cache.lock().remove_if( |key| key.data_id == id );
+        self.allocation_cache.lock().remove_if( |key| key.data_id == id );
+    }
 
-impl State {
-    fn new() -> Self {
-        State {
-            data: HashMap::new(),
-            data_ids: Vec::new(),
-            allocation_group_cache: Mutex::new( LruCache::new( 4 ) ),
-            generated_files: Default::default(),
-        }
+    fn get_data( &self, id: DataId ) -> io::Result< Option< Arc< Data > > > {
+        self.datasets.get( id, |unloaded_id| self.purge_caches( unloaded_id ) )
     }
 
-    fn add_data( &mut self, data: Data ) {
-        if self.data.contains_key( &data.id() ) {
-            return;
+    fn timelines( &self, data: &Data ) -> Arc< Timelines > {
+        if let Some( timelines ) = self.timelines.lock().get( &data.id() ) {
+            return timelines.clone();
         }
 
-        self.data_ids.push( data.id() );
-        self.data.insert( data.id(), Arc::new( data ) );
-    }
-
-    fn last_id( &self ) -> Option< DataId > {
-        self.data_ids.last().cloned()
+        let timelines = Arc::new( Timelines::new( data ) );
+        self.timelines.lock().insert( data.id(), timelines.clone() );
+        timelines
     }
 
     fn generate_graphs( &self, data: &Data, args: cli_core::script::EngineArgs, code: &str ) -> Vec< String > {
         let env = Arc::new( Mutex::new( cli_core::script::VirtualEnvironment::new() ) );
-        let engine = cli_core::script::Engine::new( env.clone(), args );
-        engine.run( &code ).unwrap();
+        cli_core::script::Engine::run_cached( env.clone(), args, code ).unwrap();
         let mut urls = Vec::new();
         let files = std::mem::take( &mut env.lock().output );
         for file in files {
@@ -220,16 +343,11 @@ impl State {
                     let hash = format!( "{:x}", md5::compute( &*bytes ) );
                     let basename = path[ path.rfind( "/" ).unwrap() + 1.. ].to_owned();
                     let url = format!( "/data/{}/script_files/{}/{}", data.id(), hash, basename );
-                    let entry = GeneratedFile {
-                        timestamp: Instant::now(),
+                    self.generated_files.add( GeneratedFile {
                         hash,
                         mime: "image/svg+xml",
                         data: bytes
-                    };
-
-                    let mut generated = self.generated_files.lock();
-                    generated.purge_old_if_too_big();
-                    generated.add_file( entry );
+                    });
 
                     urls.push( url );
                 },
@@ -261,19 +379,30 @@ fn query< 'a, T: serde::Deserialize< 'a > >( req: &'a HttpRequest ) -> Result< T
 fn get_data_id( req: &HttpRequest ) -> Result< DataId > {
     let id = req.match_info().get( "id" ).unwrap();
     if id == "last" {
-        return req.state().last_id().ok_or( ErrorNotFound( "data not found" ) );
+        return req.state().datasets.last_id().ok_or( ErrorNotFound( "data not found" ) );
     }
 
     let id: DataId = id.parse().map_err( |_| ErrorNotFound( "data not found" ) )?;
-    if !req.state().data.contains_key( &id ) {
+    if !req.state().datasets.contains( id ) {
         return Err( ErrorNotFound( "data not found" ) );
     }
     Ok( id )
 }
 
-fn get_data( req: &HttpRequest ) -> Result< &Arc< Data > > {
+fn get_data( req: &HttpRequest ) -> Result< Arc< Data > > {
     let id = get_data_id( req )?;
-    req.state().data.get( &id ).ok_or_else( || ErrorNotFound( "data not found" ) )
+    get_data_by_id( req, id )
+}
+
+fn get_data_by_id( req: &HttpRequest, id: DataId ) -> Result< Arc< Data > > {
+    match req.state().get_data( id ) {
+        Ok( Some( data ) ) => Ok( data ),
+        Ok( None ) => Err( ErrorNotFound( "data not found" ) ),
+        Err( error ) => {
+            error!( "Failed to load {}: {}", id, error );
+            Err( ErrorInternalServerError( format!( "failed to load the data: {}", error ) ) )
+        }
+    }
 }
 
 impl From< PrepareFilterError > for ActixWebError {
@@ -289,7 +418,41 @@ impl From< PrepareFilterError > for ActixWebError {
     }
 }
 
-fn async_data_handler< F: FnOnce( Arc< Data >, byte_channel::ByteSender ) + Send + 'static >( req: &HttpRequest, callback: F ) -> Result< Body > {
+/// Whether the client wants the response in the binary columnar format instead of JSON.
+fn wants_columns( req: &HttpRequest ) -> bool {
+    req.headers().get( "accept" )
+        .and_then( |value| value.to_str().ok() )
+        .map( |value| value.contains( columns::MIME_TYPE ) )
+        .unwrap_or( false )
+}
+
+fn cache_headers( req: &HttpRequest, data: &Data ) -> CacheHeaders {
+    let revision = req.state().revisions.lock().get( &data.id() ).cloned();
+    let variant = if wants_columns( req ) { "columns" } else { "json" };
+    CacheHeaders::new( data.id(), revision, req.query_string(), variant )
+}
+
+/// Serves a response which is only generated once for a given query and then kept around already compressed.
+fn cached_response< F: FnOnce() -> Vec< u8 > >( req: &HttpRequest, headers: &CacheHeaders, content_type: &'static str, generate: F ) -> HttpResponse {
+    if let Some( response ) = headers.not_modified( req ) {
+        return response;
+    }
+
+    let state = req.state();
+    let cached = state.responses.lock().get( &headers.etag().to_owned() ).cloned();
+    let cached = match cached {
+        Some( cached ) => cached,
+        None => {
+            let cached = Arc::new( CachedResponse::new( content_type, generate() ) );
+            state.responses.lock().put( headers.etag().to_owned(), cached.clone(), cached.memory_usage() );
+            cached
+        }
+    };
+
+    cached.respond( req, headers )
+}
+
+fn spawn_data_handler< F: FnOnce( Arc< Data >, byte_channel::ByteSender ) + Send + 'static >( req: &HttpRequest, priority: Priority, callback: F ) -> Result< Body > {
     let (tx, rx) = byte_channel();
     let rx = rx.map_err( |_| ErrorInternalServerError( "internal error" ) );
     let rx = BodyStream::new( rx );
@@ -297,18 +460,32 @@ fn async_data_handler< F: FnOnce( Arc< Data >, byte_channel::ByteSender ) + Send
 
     let data_id = get_data_id( &req )?;
     let state = req.state().clone();
-    thread::spawn( move || {
-        let data = match state.data.get( &data_id ) {
-            Some( data ) => data,
-            None => return
+    let scheduler = state.scheduler.clone();
+    Scheduler::spawn( &scheduler, priority, tx, move |tx| {
+        let data = match state.get_data( data_id ) {
+            Ok( Some( data ) ) => data,
+            Ok( None ) => return,
+            Err( error ) => {
+                error!( "Failed to load {}: {}", data_id, error );
+                return;
+            }
         };
 
-        callback( data.clone(), tx );
+        callback( data, tx );
     });
 
     Ok( body )
 }
 
+fn async_data_handler< F: FnOnce( Arc< Data >, byte_channel::ByteSender ) + Send + 'static >( req: &HttpRequest, callback: F ) -> Result< Body > {
+    spawn_data_handler( req, Priority::Interactive, callback )
+}
+
+/// Like `async_data_handler`, but for heavy requests which shouldn't slow down the interactive ones.
+fn background_data_handler< F: FnOnce( Arc< Data >, byte_channel::ByteSender ) + Send + 'static >( req: &HttpRequest, callback: F ) -> Result< Body > {
+    spawn_data_handler( req, Priority::Background, callback )
+}
+
 fn strip_template( input: &str ) -> String {
     let mut out = String::new();
     let mut buffered = String::new();
@@ -353,6 +530,56 @@ fn strip_template( input: &str ) -> String {
     out
 }
 
+/// How the backtraces are sent along with the rows which refer to them.
+#[derive(Copy, Clone, PartialEq, Eq)]
+enum BacktraceMode {
+    /// Every row has its own copy of its backtraces.
+    Embedded,
+    /// Every unique backtrace is sent only once, in a side table.
+    Separate,
+    /// The backtraces aren't sent as JSON at all.
+    Omitted
+}
+
+impl BacktraceMode {
+    fn new( as_columns: bool, separate_backtraces: Option< bool > ) -> Self {
+        if as_columns {
+            BacktraceMode::Omitted
+        } else if separate_backtraces.unwrap_or( false ) {
+            BacktraceMode::Separate
+        } else {
+            BacktraceMode::Embedded
+        }
+    }
+}
+
+/// The frames of a backtrace, unless the backtraces aren't embedded.
+fn get_backtrace_frames< 'a >( data: &'a Data, format: &protocol::BacktraceFormat, backtrace_id: BacktraceId, mode: BacktraceMode ) -> Vec< protocol::Frame< 'a > > {
+    if mode != BacktraceMode::Embedded {
+        return Vec::new();
+    }
+
+    data.get_backtrace( backtrace_id ).map( |(_, frame)| get_frame( data, format, frame ) ).collect()
+}
+
+/// Formats each of the given backtraces once, if they're supposed to be sent separately.
+fn get_backtrace_table< 'a, I >( data: &'a Data, format: &protocol::BacktraceFormat, mode: BacktraceMode, backtrace_ids: I ) -> Option< BTreeMap< u32, Vec< protocol::Frame< 'a > > > >
+    where I: IntoIterator< Item = BacktraceId >
+{
+    if mode != BacktraceMode::Separate {
+        return None;
+    }
+
+    let mut table = BTreeMap::new();
+    for backtrace_id in backtrace_ids {
+        table.entry( backtrace_id.raw() ).or_insert_with( || {
+            data.get_backtrace( backtrace_id ).map( |(_, frame)| get_frame( data, format, frame ) ).collect()
+        });
+    }
+
+    Some( table )
+}
+
 fn get_frame< 'a >( data: &'a Data, format: &protocol::BacktraceFormat, frame: &Frame ) -> protocol::Frame< 'a > {
     let mut function = frame.function().map( |id| Cow::Borrowed( data.interner().resolve( id ).unwrap() ) );
     if format.strip_template_args.unwrap_or( false ) {
@@ -363,50 +590,213 @@ fn get_frame< 'a >( data: &'a Data, format: &protocol::BacktraceFormat, frame: &
         address: frame.address().raw(),
         address_s: format!( "{:016X}", frame.address().raw() ),
         count: frame.count(),
-        library: frame.library().map( |id| data.interner().resolve( id ).unwrap() ),
+        library: frame.library().map( |id| Cow::Borrowed( data.interner().resolve( id ).unwrap() ) ),
         function,
-        raw_function: frame.raw_function().map( |id| data.interner().resolve( id ).unwrap() ),
-        source: frame.source().map( |id| data.interner().resolve( id ).unwrap() ),
+        raw_function: frame.raw_function().map( |id| Cow::Borrowed( data.interner().resolve( id ).unwrap() ) ),
+        source: frame.source().map( |id| Cow::Borrowed( data.interner().resolve( id ).unwrap() ) ),
         line: frame.line(),
         column: frame.column(),
         is_inline: frame.is_inline()
     }
 }
 
+fn format_cmdline( args: impl Iterator< Item = String > ) -> String {
+    args.map( |arg| {
+        if arg.contains( " " ) {
+            format!( "\"{}\"", arg )
+        } else {
+            arg
+        }
+    }).collect::< Vec< _ > >().join( " " )
+}
+
 impl protocol::ResponseMetadata {
     fn new( data: &Data ) -> Self {
         protocol::ResponseMetadata {
             id: format!( "{}", data.id() ),
+            parent_id: data.parent_id().map( |id| format!( "{}", id ) ),
             executable: data.executable().to_owned(),
-            cmdline: data.cmdline().into_iter().map( |arg| {
-                if arg.contains( " " ) {
-                    format!( "\"{}\"", arg )
-                } else {
-                    arg
-                }
-            }).collect::< Vec< _ > >().join( " " ),
+            cmdline: format_cmdline( data.cmdline().into_iter() ),
             architecture: data.architecture().to_owned(),
-            final_allocated: data.total_allocated() - data.total_freed(),
-            final_allocated_count: data.total_allocated_count() - data.total_freed_count(),
-            runtime: (data.last_timestamp() - data.initial_timestamp()).into(),
-            unique_backtrace_count: data.unique_backtrace_count() as u64,
-            maximum_backtrace_depth: data.maximum_backtrace_depth(),
-            timestamp: data.initial_timestamp().into()
+            final_allocated: Some( data.total_allocated() - data.total_freed() ),
+            final_allocated_count: Some( data.total_allocated_count() - data.total_freed_count() ),
+            runtime: Some( (data.last_timestamp() - data.initial_timestamp()).into() ),
+            unique_backtrace_count: Some( data.unique_backtrace_count() as u64 ),
+            maximum_backtrace_depth: Some( data.maximum_backtrace_depth() ),
+            timestamp: data.initial_timestamp().into(),
+            is_loaded: true,
+            is_live: false
+        }
+    }
+
+    /// Whatever can be known about the data without actually loading it.
+    fn from_header( header: &HeaderBody ) -> Self {
+        // This is the same wall clock time the loader would use.
+        let timestamp_to_wall_clock = Timestamp::from_timespec( header.wall_clock_secs, header.wall_clock_nsecs ).as_usecs().wrapping_sub( header.timestamp.as_usecs() );
+        let timestamp = Timestamp::from_usecs( header.initial_timestamp.as_usecs().wrapping_add( timestamp_to_wall_clock ) );
+
+        protocol::ResponseMetadata {
+            id: format!( "{}", header.id ),
+            parent_id: None,
+            executable: String::from_utf8_lossy( &header.executable ).into_owned(),
+            cmdline: format_cmdline( String::from_utf8_lossy( &header.cmdline ).split( "\0" ).map( |arg| arg.to_owned() ) ),
+            architecture: header.arch.clone(),
+            final_allocated: None,
+            final_allocated_count: None,
+            runtime: None,
+            unique_backtrace_count: None,
+            maximum_backtrace_depth: None,
+            timestamp: timestamp.into(),
+            is_loaded: false,
+            is_live: false
         }
     }
 }
 
 fn handler_list( req: HttpRequest ) -> HttpResponse {
-    let list: Vec< _ > = req.state().data.values().map( |data| {
-        protocol::ResponseMetadata::new( data )
+    HttpResponse::Ok().json( req.state().datasets.list() )
+}
+
+fn handler_metadata( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = get_data( &req )?;
+    let mut metadata = protocol::ResponseMetadata::new( &data );
+    metadata.is_live = req.state().revisions.lock().contains_key( &data.id() );
+    Ok( HttpResponse::Ok().json( metadata ) )
+}
+
+/// The timelines shown on the overview page, precomputed at every resolution.
+///
+/// The memory of the external allocators (e.g. a GPU's) isn't the process' own,
+/// so it's only in the `device` timeline and not in any of the others.
+struct Timelines {
+    all: TimelinePyramid< AllocationDelta >,
+    leaked: TimelinePyramid< AllocationDelta >,
+    device: TimelinePyramid< AllocationDelta >,
+    maps: TimelinePyramid< UsageDelta >,
+    threads: Vec< ThreadTimeline >
+}
+
+/// How many of the threads with the highest peak memory usage get a timeline of their own;
+/// all of the others share a single one.
+const THREAD_TIMELINE_COUNT: usize = 8;
+
+/// The memory is attributed to the thread which allocated it, regardless of which one deallocated it.
+struct ThreadTimeline {
+    /// `None` for the one which has every other thread in it.
+    thread: Option< ThreadId >,
+    peak_size: u64,
+    allocation_count: u64,
+    timeline: TimelinePyramid< AllocationDelta >
+}
+
+fn build_thread_timelines( data: &Data, ops: &[OperationId] ) -> Vec< ThreadTimeline > {
+    // Every chunk is split separately and then they're concatenated in order, so every list stays sorted.
+    let chunks: Vec< HashMap< ThreadId, Vec< OperationId > > > = ops.par_chunks( 64 * 1024 ).map( |chunk| {
+        let mut ops_for_thread: HashMap< ThreadId, Vec< OperationId > > = HashMap::new();
+        for &op in chunk {
+            ops_for_thread.entry( data.get_allocation( op.id() ).thread ).or_default().push( op );
+        }
+        ops_for_thread
+    }).collect();
+
+    let mut ops_for_thread: HashMap< ThreadId, Vec< OperationId > > = HashMap::new();
+    for chunk in chunks {
+        for (thread, ops) in chunk {
+            ops_for_thread.entry( thread ).or_default().extend( ops );
+        }
+    }
+
+    let mut threads: Vec< (ThreadId, Vec< OperationId >, u64, u64) > = ops_for_thread.into_par_iter().map( |(thread, ops)| {
+        let peak_size = cli_core::peak_memory_usage( data, &ops );
+        let allocation_count = ops.iter().filter( |op| op.is_allocation() ).count() as u64;
+        (thread, ops, peak_size, allocation_count)
+    }).collect();
+
+    threads.par_sort_unstable_by( |lhs, rhs| rhs.2.cmp( &lhs.2 ).then( lhs.0.cmp( &rhs.0 ) ) );
+
+    let others = threads.split_off( min( threads.len(), THREAD_TIMELINE_COUNT ) );
+    let mut lists: Vec< &[OperationId] > = threads.iter().map( |(_, ops, _, _)| ops.as_slice() ).collect();
+    let others_ops: Vec< OperationId >;
+    if !others.is_empty() {
+        let top: Vec< ThreadId > = threads.iter().map( |&(thread, ..)| thread ).collect();
+        others_ops = ops.par_iter().cloned().filter( |op| !top.contains( &data.get_allocation( op.id() ).thread ) ).collect();
+        lists.push( &others_ops );
+    }
+
+    let mut pyramids = cli_core::build_allocation_timeline_pyramids( data, data.initial_timestamp(), data.last_timestamp(), &lists ).into_iter();
+    let mut output: Vec< _ > = threads.iter().map( |&(thread, _, peak_size, allocation_count)| ThreadTimeline {
+        thread: Some( thread ),
+        peak_size,
+        allocation_count,
+        timeline: pyramids.next().unwrap()
     }).collect();
 
-    HttpResponse::Ok().json( list )
+    if let Some( timeline ) = pyramids.next() {
+        output.push( ThreadTimeline {
+            thread: None,
+            peak_size: cli_core::peak_memory_usage( data, lists.last().unwrap() ),
+            allocation_count: others.iter().map( |&(.., allocation_count)| allocation_count ).sum(),
+            timeline
+        });
+    }
+
+    output
+}
+
+impl Timelines {
+    fn new( data: &Data ) -> Self {
+        let (host_ops, device_ops): (Cow< [OperationId] >, Vec< _ >) = if data.pools().iter().any( |pool| pool.is_device() ) {
+            let (host_ops, device_ops): (Vec< _ >, Vec< _ >) = data.operation_ids().par_iter().cloned()
+                .partition( |op| !data.is_device_allocation( data.get_allocation( op.id() ) ) );
+            (host_ops.into(), device_ops)
+        } else {
+            (data.operation_ids().into(), Vec::new())
+        };
+
+        let leaked_ops: Vec< _ > = host_ops.par_iter().flat_map( |op| {
+            let allocation = data.get_allocation( op.id() );
+            if allocation.deallocation.is_some() {
+                None
+            } else {
+                Some( OperationId::new_allocation( op.id() ) )
+            }
+        }).collect();
+
+        let mut map_ops = Vec::new();
+        for map in data.maps() {
+            if map.is_from_bytehound() {
+                continue;
+            }
+
+            map.emit_ops( &mut map_ops );
+        }
+
+        map_ops.par_sort_by_key( |(timestamp, _)| *timestamp );
+
+        let timestamp_min = map_ops.first().map( |(timestamp, _)| *timestamp ).unwrap_or( common::Timestamp::min() );
+        let timestamp_max = map_ops.last().map( |(timestamp, _)| *timestamp ).unwrap_or( common::Timestamp::min() );
+
+        Timelines {
+            all: cli_core::build_allocation_timeline_pyramid( data, data.initial_timestamp(), data.last_timestamp(), &host_ops ),
+            leaked: cli_core::build_allocation_timeline_pyramid( data, data.initial_timestamp(), data.last_timestamp(), &leaked_ops ),
+            device: cli_core::build_allocation_timeline_pyramid( data, data.initial_timestamp(), data.last_timestamp(), &device_ops ),
+            maps: cli_core::build_map_timeline_pyramid( timestamp_min, timestamp_max, &map_ops ),
+            threads: build_thread_timelines( data, &host_ops )
+        }
+    }
 }
 
-fn build_timeline( data: &Data, ops: &[OperationId] ) -> protocol::ResponseTimeline {
-    let timeline = cli_core::build_allocation_timeline( data, data.initial_timestamp(), data.last_timestamp(), ops );
+/// Returns the points of the timeline which fall within the viewport from the request.
+fn timeline_points< 'a, T >( timeline: &'a TimelinePyramid< T >, params: &protocol::RequestTimeline ) -> &'a [TimelinePoint< T >] where T: cli_core::Delta {
+    // The timestamps in the responses are in milliseconds.
+    let timestamp_min = params.from.map( |from| from.saturating_mul( 1000 ) ).unwrap_or( 0 );
+    let timestamp_max = params.to.map( |to| to.saturating_mul( 1000 ).saturating_add( 999 ) ).unwrap_or( !0 );
+    let width = params.width.unwrap_or( 1000 ) as usize;
+    timeline.points_between( timestamp_min, timestamp_max, width )
+}
 
+/// The deltas of the first point are relative to the `previous` one, if there is one.
+fn build_timeline( previous: Option< &TimelinePoint< AllocationDelta > >, timeline: &[TimelinePoint< AllocationDelta >] ) -> protocol::ResponseTimeline {
     let mut xs = Vec::with_capacity( timeline.len() );
     let mut size_delta = Vec::with_capacity( timeline.len() );
     let mut count_delta = Vec::with_capacity( timeline.len() );
@@ -415,8 +805,8 @@ fn build_timeline( data: &Data, ops: &[OperationId] ) -> protocol::ResponseTimel
     let mut allocations = Vec::with_capacity( timeline.len() );
     let mut deallocations = Vec::with_capacity( timeline.len() );
 
-    let mut last_size = 0;
-    let mut last_count = 0;
+    let mut last_size = previous.map( |point| point.memory_usage as i64 ).unwrap_or( 0 );
+    let mut last_count = previous.map( |point| point.allocations as i64 ).unwrap_or( 0 );
     for point in timeline {
         xs.push( point.timestamp / 1000 );
         size_delta.push( point.memory_usage as i64 - last_size );
@@ -442,45 +832,92 @@ fn build_timeline( data: &Data, ops: &[OperationId] ) -> protocol::ResponseTimel
 }
 
 fn handler_timeline( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
-    let timeline = build_timeline( &data, data.operation_ids() );
-    Ok( HttpResponse::Ok().json( timeline ) )
+    let data = &get_data( &req )?;
+    let params: protocol::RequestTimeline = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        let timelines = req.state().timelines( data );
+        let timeline = build_timeline( None, timeline_points( &timelines.all, &params ) );
+        serde_json::to_vec( &timeline ).unwrap()
+    }))
 }
 
 fn handler_timeline_leaked( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
-    let ops: Vec< _ > = data.operation_ids().par_iter().flat_map( |op| {
-        let allocation = data.get_allocation( op.id() );
-        if allocation.deallocation.is_some() {
-            None
-        } else {
-            Some( OperationId::new_allocation( op.id() ) )
-        }
-    }).collect();
+    let data = &get_data( &req )?;
+    let params: protocol::RequestTimeline = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        let timelines = req.state().timelines( data );
+        let timeline = build_timeline( None, timeline_points( &timelines.leaked, &params ) );
+        serde_json::to_vec( &timeline ).unwrap()
+    }))
+}
 
-    let timeline = build_timeline( &data, &ops );
-    Ok( HttpResponse::Ok().json( timeline ) )
+fn handler_timeline_device( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let params: protocol::RequestTimeline = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        let timelines = req.state().timelines( data );
+        let timeline = build_timeline( None, timeline_points( &timelines.device, &params ) );
+        serde_json::to_vec( &timeline ).unwrap()
+    }))
 }
 
-fn handler_timeline_maps( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
-    let mut ops = Vec::new();
-    for map in data.maps() {
-        if map.is_from_bytehound() {
-            continue;
+/// Samples the timelines of the threads at the same points in time; the whole runtime is used if the viewport isn't given.
+fn build_thread_timelines_response( data: &Data, threads: &[ThreadTimeline], params: &protocol::RequestTimeline ) -> protocol::ResponseThreadTimelines {
+    let timestamp_min = params.from.map( |from| from.saturating_mul( 1000 ) ).unwrap_or( data.initial_timestamp().as_usecs() );
+    let timestamp_max = params.to.map( |to| to.saturating_mul( 1000 ).saturating_add( 999 ) ).unwrap_or( data.last_timestamp().as_usecs() );
+    let span = timestamp_max.saturating_sub( timestamp_min );
+    let width = max( params.width.unwrap_or( 1000 ), 1 ) as u64;
+    let step = max( span / width, 1 );
+    let count = min( width, span / step + 1 ) as usize;
+
+    let xs = (0..count as u64).map( |index| (timestamp_min + index * step) / 1000 ).collect();
+    let threads = threads.iter().map( |timeline| {
+        let points = timeline.timeline.resample( timestamp_min, step, count );
+        let thread = timeline.thread.and_then( |thread| data.thread( thread ) );
+        protocol::ThreadTimeline {
+            thread: timeline.thread,
+            name: timeline.thread.and_then( |thread| data.thread_name( thread ) ).map( |name| name.to_owned() ),
+            started_at: thread.and_then( |thread| thread.started_at ).map( |timestamp| timestamp.as_usecs() / 1000 ),
+            exited_at: thread.and_then( |thread| thread.exited_at ).map( |timestamp| timestamp.as_usecs() / 1000 ),
+            peak_size: timeline.peak_size,
+            allocation_count: timeline.allocation_count,
+            allocated_size: points.iter().map( |point| max( point.memory_usage, 0 ) as u64 ).collect(),
+            allocations_per_second: points.iter().map( |point| point.positive_change.allocations as f64 * 1_000_000.0 / step as f64 ).collect()
         }
+    }).collect();
 
-        map.emit_ops( &mut ops );
+    protocol::ResponseThreadTimelines {
+        xs,
+        threads
     }
+}
 
-    ops.par_sort_by_key( |(timestamp, _)| *timestamp );
+fn handler_timeline_threads( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let params: protocol::RequestTimeline = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        let timelines = req.state().timelines( data );
+        serde_json::to_vec( &build_thread_timelines_response( data, &timelines.threads, &params ) ).unwrap()
+    }))
+}
 
-    let timestamp_min = ops.first().map( |(timestamp, _)| *timestamp ).unwrap_or( common::Timestamp::min() );
-    let timestamp_max = ops.last().map( |(timestamp, _)| *timestamp ).unwrap_or( common::Timestamp::min() );
+fn handler_timeline_maps( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let params: protocol::RequestTimeline = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || serde_json::to_vec( &generate_map_timeline( &req, data, &params ) ).unwrap() ) )
+}
 
-    let timeline = cli_core::build_map_timeline( timestamp_min, timestamp_max, &ops );
-    std::mem::drop( ops );
+fn generate_map_timeline( req: &HttpRequest, data: &Data, params: &protocol::RequestTimeline ) -> protocol::ResponseMapTimeline {
+    let timelines = req.state().timelines( data );
+    build_map_timeline( timeline_points( &timelines.maps, params ) )
+}
 
+fn build_map_timeline( timeline: &[TimelinePoint< UsageDelta >] ) -> protocol::ResponseMapTimeline {
     let mut xs = Vec::with_capacity( timeline.len() );
     let mut address_space = Vec::with_capacity( timeline.len() );
     let mut rss = Vec::with_capacity( timeline.len() );
@@ -488,6 +925,7 @@ fn handler_timeline_maps( req: HttpRequest ) -> Result< HttpResponse > {
     let mut dirty = Vec::with_capacity( timeline.len() );
     let mut clean = Vec::with_capacity( timeline.len() );
     let mut swap = Vec::with_capacity( timeline.len() );
+    let mut huge_pages = Vec::with_capacity( timeline.len() );
 
     for point in timeline {
         xs.push( point.timestamp / 1000 );
@@ -497,19 +935,181 @@ fn handler_timeline_maps( req: HttpRequest ) -> Result< HttpResponse > {
         dirty.push( point.dirty() as i64 );
         clean.push( point.clean() as i64 );
         swap.push( point.swap as i64 );
+        huge_pages.push( point.huge_pages() );
     }
 
-    let timeline = protocol::ResponseMapTimeline {
+    protocol::ResponseMapTimeline {
         xs,
         address_space,
         rss,
         anonymous,
         dirty,
         clean,
-        swap
+        swap,
+        huge_pages
+    }
+}
+
+/// How often an idle live update stream sends something to find out whether the client's still there.
+const LIVE_UPDATE_KEEPALIVE_INTERVAL: Duration = Duration::from_secs( 15 );
+
+/// Returns the points of the whole timeline from `since` (in milliseconds) onwards, and the point right before them.
+/// Returns the cgroup samples from the given range of milliseconds, along with the one right before them.
+fn cgroup_samples_between( data: &Data, from: u64, to: u64 ) -> (Option< &cli_core::CgroupSample >, &[cli_core::CgroupSample]) {
+    let samples = data.cgroup_samples();
+    let start = samples.partition_point( |sample| sample.timestamp.as_usecs() / 1000 < from );
+    let end = samples.partition_point( |sample| sample.timestamp.as_usecs() / 1000 <= to );
+    (start.checked_sub( 1 ).map( |index| &samples[ index ] ), &samples[ start..std::cmp::max( start, end ) ])
+}
+
+/// Keeps at most roughly `width` of the samples; the pressure is always relative to the previous point which was kept.
+fn build_cgroup_timeline( mut previous: Option< &cli_core::CgroupSample >, samples: &[cli_core::CgroupSample], width: usize ) -> protocol::ResponseCgroupTimeline {
+    let step = std::cmp::max( 1, samples.len() / std::cmp::max( 1, width ) );
+    let mut timeline = protocol::ResponseCgroupTimeline {
+        xs: Vec::new(),
+        current: Vec::new(),
+        limit: Vec::new(),
+        anon: Vec::new(),
+        file: Vec::new(),
+        kernel: Vec::new(),
+        sock: Vec::new(),
+        pressure_some: Vec::new(),
+        pressure_full: Vec::new()
+    };
+
+    let stalled = |previous: Option< &cli_core::CgroupSample >, sample: &cli_core::CgroupSample, total: fn( &cli_core::CgroupSample ) -> u64| {
+        let previous = match previous {
+            Some( previous ) => previous,
+            None => return 0.0
+        };
+
+        let elapsed = sample.timestamp.as_usecs().saturating_sub( previous.timestamp.as_usecs() );
+        if elapsed == 0 {
+            return 0.0;
+        }
+
+        total( sample ).saturating_sub( total( previous ) ) as f64 * 100.0 / elapsed as f64
     };
 
-    Ok( HttpResponse::Ok().json( timeline ) )
+    for sample in samples.iter().skip( step - 1 ).step_by( step ) {
+        timeline.xs.push( sample.timestamp.as_usecs() / 1000 );
+        timeline.current.push( sample.current );
+        timeline.limit.push( Some( sample.limit ).filter( |&limit| limit != u64::MAX ) );
+        timeline.anon.push( sample.anon );
+        timeline.file.push( sample.file );
+        timeline.kernel.push( sample.kernel );
+        timeline.sock.push( sample.sock );
+        timeline.pressure_some.push( stalled( previous, sample, |sample| sample.pressure_some ) );
+        timeline.pressure_full.push( stalled( previous, sample, |sample| sample.pressure_full ) );
+        previous = Some( sample );
+    }
+
+    timeline
+}
+
+fn handler_timeline_cgroup( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let params: protocol::RequestTimeline = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        let (previous, samples) = cgroup_samples_between( data, params.from.unwrap_or( 0 ), params.to.unwrap_or( !0 ) );
+        let timeline = build_cgroup_timeline( previous, samples, params.width.unwrap_or( 1000 ) as usize );
+        serde_json::to_vec( &timeline ).unwrap()
+    }))
+}
+
+fn timeline_points_since< T >( timeline: &TimelinePyramid< T >, since: u64, width: usize ) -> (Option< &TimelinePoint< T > >, &[TimelinePoint< T >]) where T: cli_core::Delta {
+    let points = timeline.points_between( 0, !0, width );
+    let index = points.partition_point( |point| point.timestamp / 1000 < since );
+    (index.checked_sub( 1 ).map( |index| &points[ index ] ), &points[ index.. ])
+}
+
+fn generate_timeline_update( state: &State, data: &Data, since: u64, width: usize ) -> protocol::ResponseTimelineUpdate {
+    let timelines = state.timelines( data );
+    let (previous, all) = timeline_points_since( &timelines.all, since, width );
+    let (previous_leaked, leaked) = timeline_points_since( &timelines.leaked, since, width );
+    let (previous_device, device) = timeline_points_since( &timelines.device, since, width );
+    let (_, maps) = timeline_points_since( &timelines.maps, since, width );
+    let (previous_cgroup, cgroup) = cgroup_samples_between( data, since, !0 );
+
+    let mut metadata = protocol::ResponseMetadata::new( data );
+    metadata.is_live = true;
+
+    protocol::ResponseTimelineUpdate {
+        metadata,
+        timeline: build_timeline( previous, all ),
+        timeline_leaked: build_timeline( previous_leaked, leaked ),
+        timeline_device: build_timeline( previous_device, device ),
+        timeline_maps: build_map_timeline( maps ),
+        timeline_cgroup: build_cgroup_timeline( previous_cgroup, cgroup, width )
+    }
+}
+
+/// Streams the new timeline points of a live dataset as server-sent events, every time a new snapshot is published.
+fn handler_timeline_updates( req: HttpRequest ) -> Result< HttpResponse > {
+    let id = get_data_id( &req )?;
+    let params: protocol::RequestTimelineUpdates = query( &req )?;
+    let state = req.state().clone();
+
+    let (mut tx, rx) = byte_channel();
+    let rx = rx.map_err( |_| ErrorInternalServerError( "internal error" ) );
+    let body = Body::Message( Box::new( BodyStream::new( rx ) ) );
+
+    // This can stay open for as long as the client wants, so it gets a thread of its own instead of taking up one from a pool.
+    thread::spawn( move || {
+        use std::io::Write;
+
+        let width = params.width.unwrap_or( 1000 ) as usize;
+        let mut since = params.since.unwrap_or( 0 );
+        let mut revision = state.revisions.lock().get( &id ).cloned();
+        let mut is_first = true;
+        loop {
+            if !is_first {
+                let new_revision = state.wait_for_new_revision( id, revision, LIVE_UPDATE_KEEPALIVE_INTERVAL );
+                if new_revision == revision {
+                    if tx.write_all( b": keepalive\n\n" ).and_then( |_| tx.flush() ).is_err() {
+                        return;
+                    }
+                    continue;
+                }
+
+                revision = new_revision;
+            }
+
+            is_first = false;
+
+            let data = match state.get_data( id ) {
+                Ok( Some( data ) ) => data,
+                _ => return
+            };
+
+            let update = generate_timeline_update( &state, &data, since, width );
+
+            // Whatever's at the end can still change in the next snapshot, so it's sent again next time.
+            let last_xs = [ update.timeline.xs.last(), update.timeline_leaked.xs.last(), update.timeline_device.xs.last(), update.timeline_maps.xs.last(), update.timeline_cgroup.xs.last() ];
+            if let Some( &last_x ) = last_xs.iter().flatten().min() {
+                since = std::cmp::max( since, *last_x );
+            }
+
+            let result = tx.write_all( b"data: " )
+                .and_then( |_| serde_json::to_writer( &mut tx, &update ).map_err( io::Error::from ) )
+                .and_then( |_| tx.write_all( b"\n\n" ) )
+                .and_then( |_| tx.flush() );
+
+            if result.is_err() {
+                return;
+            }
+        }
+    });
+
+    // The events have to go out as soon as they're sent, so they can't go through the compression.
+    Ok(
+        HttpResponse::Ok()
+            .content_type( "text/event-stream" )
+            .header( "Cache-Control", "no-cache" )
+            .header( "Content-Encoding", "identity" )
+            .body( body )
+    )
 }
 
 fn prefiltered_allocation_ids< 'a >(
@@ -525,57 +1125,63 @@ fn prefiltered_allocation_ids< 'a >(
     }
 }
 
-fn allocations_iter< 'a >(
-    data: &'a Data,
-    array: &'a [AllocationId],
-    order: protocol::Order,
-    filter: AllocationFilter
-) -> Box< dyn DoubleEndedIterator< Item = (AllocationId, &'a Allocation) > + 'a > {
-    match order {
-        protocol::Order::Asc => Box::new( array.iter()
-            .map( move |&id| (id, data.get_allocation( id )) )
-            .filter( move |(id, allocation)| filter.try_match( data, *id, allocation ) )
-        ),
-        protocol::Order::Dsc => Box::new( array.iter().rev()
-            .map( move |&id| (id, data.get_allocation( id )) )
-            .filter( move |(id, allocation)| filter.try_match( data, *id, allocation ) )
-        )
-    }
-}
-
 fn timestamp_to_fraction( data: &Data, timestamp: Timestamp ) -> f32 {
     let relative = timestamp - data.initial_timestamp();
     let range = data.last_timestamp() - data.initial_timestamp();
     (relative.as_usecs() as f64 / range.as_usecs() as f64) as f32
 }
 
+/// Returns the IDs of every allocation matching the filter in ascending order,
+/// either from the cache or by filtering them all in one pass.
+fn matching_allocation_ids( state: &State, data: &Data, key: AllocationsKey, filter: &AllocationFilter ) -> Arc< Vec< AllocationId > > {
+    if let Some( allocation_ids ) = state.allocation_cache.lock().get( &key ).cloned() {
+        return allocation_ids;
+    }
+
+    let allocation_ids: Vec< _ > = prefiltered_allocation_ids( data, key.sort_by, filter )
+        .par_iter()
+        .copied()
+        .filter( |&allocation_id| filter.try_match( data, allocation_id, data.get_allocation( allocation_id ) ) )
+        .collect();
+
+    let size = allocation_ids.len() * std::mem::size_of::< AllocationId >();
+    let allocation_ids = Arc::new( allocation_ids );
+    state.allocation_cache.lock().put( key, allocation_ids.clone(), size );
+    allocation_ids
+}
+
 fn get_allocations< 'a >(
     data: &'a Arc< Data >,
     backtrace_format: protocol::BacktraceFormat,
+    backtrace_mode: BacktraceMode,
     params: protocol::RequestAllocations,
-    filter: crate::filter::AllocationFilter
-) -> protocol::ResponseAllocations< impl Serialize + 'a > {
+    allocation_ids: Arc< Vec< AllocationId > >
+) -> protocol::ResponseAllocations< 'a, impl Serialize + IntoIterator< Item = protocol::Allocation< 'a > > + 'a > {
     let remaining = params.count.unwrap_or( -1_i32 as _ ) as usize;
     let skip = params.skip.unwrap_or( 0 ) as usize;
-    let sort_by = params.sort_by.unwrap_or( protocol::AllocSortBy::Timestamp );
     let order = params.order.unwrap_or( protocol::Order::Asc );
 
-    let allocation_ids = prefiltered_allocation_ids( data, sort_by, &filter );
-    let total_count =
-        allocation_ids
-        .par_iter()
-        .filter( |&&id| filter.try_match( data, id, data.get_allocation( id ) ) )
-        .count() as u64;
+    let total_count = allocation_ids.len() as u64;
+    let page: Vec< AllocationId > = match order {
+        protocol::Order::Asc => allocation_ids.iter().skip( skip ).take( remaining ).copied().collect(),
+        protocol::Order::Dsc => allocation_ids.iter().rev().skip( skip ).take( remaining ).copied().collect()
+    };
+
+    let backtraces = get_backtrace_table( data, &backtrace_format, backtrace_mode, page.iter().flat_map( |&allocation_id| {
+        let allocation = data.get_allocation( allocation_id );
+        let chain = data.get_chain_by_any_allocation( allocation_id );
+        let deallocation = allocation.deallocation.as_ref().and_then( |deallocation| deallocation.backtrace );
+        let chain_deallocation = data.get_allocation( chain.last ).deallocation.as_ref().and_then( |deallocation| deallocation.backtrace );
+        std::iter::once( allocation.backtrace ).chain( deallocation ).chain( chain_deallocation )
+    }));
 
     let allocations = move || {
         let backtrace_format = backtrace_format.clone();
-        let filter = filter.clone();
 
-        allocations_iter( data, allocation_ids, order, filter )
-            .skip( skip )
-            .take( remaining )
-            .map( move |(allocation_id, allocation)| {
-                let backtrace = data.get_backtrace( allocation.backtrace ).map( |(_, frame)| get_frame( data, &backtrace_format, frame ) ).collect();
+        page.into_iter()
+            .map( move |allocation_id| {
+                let allocation = data.get_allocation( allocation_id );
+                let backtrace = get_backtrace_frames( data, &backtrace_format, allocation.backtrace, backtrace_mode );
                 let chain = data.get_chain_by_any_allocation( allocation_id );
                 protocol::Allocation {
                     id: allocation_id.raw(),
@@ -593,7 +1199,7 @@ fn get_allocations< 'a >(
                             thread: deallocation.thread,
                             backtrace_id: deallocation.backtrace.map( |id| id.raw() ),
                             backtrace: deallocation.backtrace.map( |backtrace_id| {
-                                data.get_backtrace( backtrace_id ).map( |(_, frame)| get_frame( data, &backtrace_format, frame ) ).collect()
+                                get_backtrace_frames( data, &backtrace_format, backtrace_id, backtrace_mode )
                             })
                         }
                     }),
@@ -606,7 +1212,7 @@ fn get_allocations< 'a >(
                                 thread: deallocation.thread,
                                 backtrace_id: deallocation.backtrace.map( |id| id.raw() ),
                                 backtrace: deallocation.backtrace.map( |backtrace_id| {
-                                    data.get_backtrace( backtrace_id ).map( |(_, frame)| get_frame( data, &backtrace_format, frame ) ).collect()
+                                    get_backtrace_frames( data, &backtrace_format, backtrace_id, backtrace_mode )
                                 })
                             }
                         })
@@ -616,6 +1222,8 @@ fn get_allocations< 'a >(
                     is_mmaped: allocation.is_mmaped(),
                     is_jemalloc: allocation.is_jemalloc(),
                     extra_space: allocation.extra_usable_space,
+                    pool: allocation.pool,
+                    pool_name: allocation.pool.and_then( |pool| data.pool_name( pool ) ),
                     chain_lifetime: chain.lifetime( data ).map( |lifetime| lifetime.into() ),
                     position_in_chain: allocation.position_in_chain,
                     chain_length: chain.length
@@ -625,24 +1233,48 @@ fn get_allocations< 'a >(
 
     protocol::ResponseAllocations {
         allocations: StreamingSerializer::new( allocations ),
-        total_count
+        total_count,
+        backtraces
     }
 }
 
 fn handler_allocations( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let params: protocol::RequestAllocations = query( &req )?;
     let filter: protocol::AllocFilter = query( &req )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
-    let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
+    let prepared_filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
     let backtrace_format: protocol::BacktraceFormat = query( &req )?;
 
-    let body = async_data_handler( &req, move |data, tx| {
-        let response = get_allocations( &data, backtrace_format, params, filter );
-        let _ = serde_json::to_writer( tx, &response );
-    })?;
+    let key = AllocationsKey {
+        data_id: data.id(),
+        filter,
+        custom_filter,
+        sort_by: params.sort_by.unwrap_or( protocol::AllocSortBy::Timestamp )
+    };
 
-    Ok( HttpResponse::Ok().content_type( "application/json" ).body( body ) )
+    let state = req.state().clone();
+    let as_columns = wants_columns( &req );
+    let backtrace_mode = if params.omit_backtraces.unwrap_or( false ) {
+        BacktraceMode::Omitted
+    } else {
+        BacktraceMode::new( as_columns, params.separate_backtraces )
+    };
+
+    let body = async_data_handler( &req, move |data, tx| {
+        let allocation_ids = matching_allocation_ids( &state, &data, key, &prepared_filter );
+        if as_columns {
+            let backtraces = columns::Backtraces::new( &data, backtrace_format.clone() );
+            let response = get_allocations( &data, backtrace_format, backtrace_mode, params, allocation_ids );
+            let _ = columns::encode( tx, backtraces, "allocations", response.total_count, response.allocations );
+        } else {
+            let response = get_allocations( &data, backtrace_format, backtrace_mode, params, allocation_ids );
+            let _ = serde_json::to_writer( tx, &response );
+        }
+    })?;
+
+    let content_type = if as_columns { columns::MIME_TYPE } else { "application/json" };
+    Ok( HttpResponse::Ok().content_type( content_type ).body( body ) )
 }
 
 fn get_regions< 'a >( data: &'a Data, backtrace_format: &protocol::BacktraceFormat, map: &'a Map ) -> Vec< protocol::MapRegion< 'a > > {
@@ -690,9 +1322,10 @@ fn get_maps< 'a >(
     state: Arc< State >,
     data: &'a Arc< Data >,
     backtrace_format: protocol::BacktraceFormat,
+    backtrace_mode: BacktraceMode,
     params: protocol::RequestMaps,
     filter: crate::filter::MapFilter
-) -> protocol::ResponseMaps< impl Serialize + 'a > {
+) -> protocol::ResponseMaps< impl Serialize + IntoIterator< Item = protocol::Map< 'a > > + 'a > {
     let remaining = params.count.unwrap_or( -1_i32 as _ ) as usize;
     let skip = params.skip.unwrap_or( 0 ) as usize;
     let sort_by = params.sort_by.unwrap_or( protocol::MapsSortBy::Timestamp );
@@ -746,6 +1379,20 @@ fn get_maps< 'a >(
             } else {
                 |a: &Map, b: &Map| b.peak_rss.cmp( &a.peak_rss )
             }
+        },
+        protocol::MapsSortBy::PeakHugePages => {
+            if order == protocol::Order::Asc {
+                |a: &Map, b: &Map| a.peak_huge_pages.cmp( &b.peak_huge_pages )
+            } else {
+                |a: &Map, b: &Map| b.peak_huge_pages.cmp( &a.peak_huge_pages )
+            }
+        },
+        protocol::MapsSortBy::Purged => {
+            if order == protocol::Order::Asc {
+                |a: &Map, b: &Map| a.purged.cmp( &b.purged )
+            } else {
+                |a: &Map, b: &Map| b.purged.cmp( &a.purged )
+            }
         }
     };
 
@@ -772,7 +1419,7 @@ fn get_maps< 'a >(
                         timestamp_relative_p: timestamp_to_fraction( data, source.timestamp ),
                         thread: source.thread,
                         backtrace_id: source.backtrace.raw(),
-                        backtrace: data.get_backtrace( source.backtrace ).map( |(_, frame)| get_frame( data, &backtrace_format, frame ) ).collect()
+                        backtrace: get_backtrace_frames( data, &backtrace_format, source.backtrace, backtrace_mode )
                     }
                 });
 
@@ -823,11 +1470,25 @@ fn get_maps< 'a >(
                                 private_clean: usage.private_clean,
                                 private_dirty: usage.private_dirty,
                                 swap: usage.swap,
+                                anon_huge_pages: usage.anon_huge_pages,
+                                shmem_pmd_mapped: usage.shmem_pmd_mapped,
+                                file_pmd_mapped: usage.file_pmd_mapped,
                                 rss: usage.rss(),
                             }
                         }).collect() )
                     };
 
+                let sparkline =
+                    if !params.with_sparklines.unwrap_or( false ) || map.sparkline.rss.is_empty() {
+                        None
+                    } else {
+                        Some( protocol::MapSparkline {
+                            rss: &map.sparkline.rss,
+                            dirty: &map.sparkline.dirty,
+                            swap: &map.sparkline.swap
+                        })
+                    };
+
                 protocol::Map {
                     id: id.0,
 
@@ -848,7 +1509,7 @@ fn get_maps< 'a >(
                                     timestamp_relative_p: timestamp_to_fraction( data, source.timestamp ),
                                     thread: source.thread,
                                     backtrace_id: source.backtrace.raw(),
-                                    backtrace: data.get_backtrace( source.backtrace ).map( |(_, frame)| get_frame( data, &backtrace_format, frame ) ).collect()
+                                    backtrace: get_backtrace_frames( data, &backtrace_format, source.backtrace, backtrace_mode )
                                 }
                             })
                         }
@@ -858,12 +1519,20 @@ fn get_maps< 'a >(
                     is_writable: map.flags.contains( RegionFlags::WRITABLE ),
                     is_executable: map.flags.contains( RegionFlags::EXECUTABLE ),
                     is_shared: map.flags.contains( RegionFlags::SHARED ),
+                    is_huge_page_advised: map.huge_page_flags.contains( HugePageFlags::HUGEPAGE ),
+                    is_no_huge_page_advised: map.huge_page_flags.contains( HugePageFlags::NOHUGEPAGE ),
 
                     peak_rss: map.peak_rss,
+                    peak_huge_pages: map.peak_huge_pages,
+                    purge_count: map.purge_count,
+                    purged: map.purged,
+                    reclaimed: map.reclaimed,
+                    refaulted: map.refaulted,
                     graph_preview_url,
                     graph_url,
                     regions,
-                    usage_history
+                    usage_history,
+                    sparkline
                 }
             })
     };
@@ -875,20 +1544,30 @@ fn get_maps< 'a >(
 }
 
 fn handler_maps( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let params: protocol::RequestMaps = query( &req )?;
     let filter: protocol::MapFilter = query( &req )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
     let filter = prepare_map_filter( data, &filter, &custom_filter )?;
     let backtrace_format: protocol::BacktraceFormat = query( &req )?;
     let state = req.state().clone();
+    let as_columns = wants_columns( &req );
+
+    let backtrace_mode = BacktraceMode::new( as_columns, None );
 
     let body = async_data_handler( &req, move |data, tx| {
-        let response = get_maps( state, &data, backtrace_format, params, filter );
-        let _ = serde_json::to_writer( tx, &response );
+        if as_columns {
+            let backtraces = columns::Backtraces::new( &data, backtrace_format.clone() );
+            let response = get_maps( state, &data, backtrace_format, backtrace_mode, params, filter );
+            let _ = columns::encode( tx, backtraces, "maps", response.total_count, response.maps );
+        } else {
+            let response = get_maps( state, &data, backtrace_format, backtrace_mode, params, filter );
+            let _ = serde_json::to_writer( tx, &response );
+        }
     })?;
 
-    Ok( HttpResponse::Ok().content_type( "application/json" ).body( body ) )
+    let content_type = if as_columns { columns::MIME_TYPE } else { "application/json" };
+    Ok( HttpResponse::Ok().content_type( content_type ).body( body ) )
 }
 
 fn get_allocation_group_data< 'a, I >( data: &Data, iter: I ) -> protocol::AllocationGroupData
@@ -902,7 +1581,12 @@ fn get_allocation_group_data< 'a, I >( data: &Data, iter: I ) -> protocol::Alloc
         min_timestamp: Timestamp,
         max_timestamp: Timestamp,
         leaked_count: u64,
-        allocated_count: u64
+        allocated_count: u64,
+        slack: u64,
+        growth: ChainGrowth,
+        cross_thread_free_count: u64,
+        cross_thread_free_size: u64,
+        cross_thread_free_latency: Timestamp
     }
 
     impl Default for Group {
@@ -914,7 +1598,12 @@ fn get_allocation_group_data< 'a, I >( data: &Data, iter: I ) -> protocol::Alloc
                 min_timestamp: Timestamp::max(),
                 max_timestamp: Timestamp::min(),
                 leaked_count: 0,
-                allocated_count: 0
+                allocated_count: 0,
+                slack: 0,
+                growth: ChainGrowth::default(),
+                cross_thread_free_count: 0,
+                cross_thread_free_size: 0,
+                cross_thread_free_latency: Timestamp::min()
             }
         }
     }
@@ -925,6 +1614,10 @@ fn get_allocation_group_data< 'a, I >( data: &Data, iter: I ) -> protocol::Alloc
             let size = allocation.size;
             let timestamp = allocation.timestamp;
             group.size_sum += size;
+            group.slack += allocation.extra_usable_space as u64;
+            if let Some( growth ) = ChainGrowth::of_chain( data, allocation ) {
+                group.growth = group.growth + growth;
+            }
             group.min_size = min( group.min_size, size );
             group.max_size = max( group.max_size, size );
             group.min_timestamp = min( group.min_timestamp, timestamp );
@@ -935,6 +1628,12 @@ fn get_allocation_group_data< 'a, I >( data: &Data, iter: I ) -> protocol::Alloc
                 group.leaked_count += 1;
             }
 
+            if let Some( latency ) = cross_thread_latency( allocation ) {
+                group.cross_thread_free_count += 1;
+                group.cross_thread_free_size += allocation.usable_size();
+                group.cross_thread_free_latency = group.cross_thread_free_latency + latency;
+            }
+
             group
         }
     ).reduce(
@@ -947,6 +1646,11 @@ fn get_allocation_group_data< 'a, I >( data: &Data, iter: I ) -> protocol::Alloc
             a.max_timestamp = max( a.max_timestamp, b.max_timestamp );
             a.allocated_count += b.allocated_count;
             a.leaked_count += b.leaked_count;
+            a.slack += b.slack;
+            a.growth = a.growth + b.growth;
+            a.cross_thread_free_count += b.cross_thread_free_count;
+            a.cross_thread_free_size += b.cross_thread_free_size;
+            a.cross_thread_free_latency = a.cross_thread_free_latency + b.cross_thread_free_latency;
 
             a
         }
@@ -970,6 +1674,20 @@ fn get_allocation_group_data< 'a, I >( data: &Data, iter: I ) -> protocol::Alloc
         max_total_usage_first_seen_at: None,
         max_total_usage_first_seen_at_relative: None,
         max_total_usage_first_seen_at_relative_p: None,
+        slack: Some( group.slack ),
+        bytes_copied: Some( group.growth.bytes_copied ),
+        chain_peak_size: Some( group.growth.peak_size ),
+        copy_amplification: Some( group.growth.copy_amplification() ),
+        cross_thread_free_count: Some( group.cross_thread_free_count ),
+        cross_thread_free_size: Some( group.cross_thread_free_size ),
+        cross_thread_free_latency: if group.cross_thread_free_count > 0 {
+            Some( Timestamp::from_usecs( group.cross_thread_free_latency.as_usecs() / group.cross_thread_free_count ).into() )
+        } else {
+            None
+        },
+        lifetime_p50: None,
+        lifetime_p90: None,
+        lifetime_p99: None,
     }
 }
 
@@ -1002,6 +1720,16 @@ fn get_global_group_data( data: &Data, backtrace_id: BacktraceId ) -> protocol::
         max_total_usage_first_seen_at: Some( stats.max_total_usage_first_seen_at.into() ),
         max_total_usage_first_seen_at_relative: Some( (stats.max_total_usage_first_seen_at - data.initial_timestamp()).into() ),
         max_total_usage_first_seen_at_relative_p: Some( timestamp_to_fraction( data, stats.max_total_usage_first_seen_at ) ),
+        slack: None,
+        bytes_copied: None,
+        chain_peak_size: None,
+        copy_amplification: None,
+        cross_thread_free_count: None,
+        cross_thread_free_size: None,
+        cross_thread_free_latency: None,
+        lifetime_p50: stats.lifetimes.quantile( 0.5 ).map( |lifetime| lifetime.into() ),
+        lifetime_p90: stats.lifetimes.quantile( 0.9 ).map( |lifetime| lifetime.into() ),
+        lifetime_p99: stats.lifetimes.quantile( 0.99 ).map( |lifetime| lifetime.into() ),
     }
 }
 
@@ -1009,25 +1737,36 @@ fn get_allocation_groups< 'a >(
     state: &'a State,
     data: &'a Arc< Data >,
     backtrace_format: protocol::BacktraceFormat,
+    backtrace_mode: BacktraceMode,
     params: protocol::RequestAllocationGroups,
     allocation_groups: Arc< AllocationGroups >
-) -> protocol::ResponseAllocationGroups< impl Serialize + 'a > {
+) -> protocol::ResponseAllocationGroups< 'a, impl Serialize + IntoIterator< Item = protocol::AllocationGroup< 'a > > + 'a > {
     let remaining = params.count.unwrap_or( -1_i32 as _ ) as usize;
     let skip = params.skip.unwrap_or( 0 ) as usize;
     let generate_graphs = params.generate_graphs.unwrap_or( false );
+    let sort_by = params.sort_by.unwrap_or( protocol::AllocGroupsSortBy::MinTimestamp );
+    let order = params.order.unwrap_or( protocol::Order::Asc );
 
     let total_count = allocation_groups.len();
+    let sorted = allocation_groups.sorted( data, sort_by );
+    let page: Vec< usize > = match order {
+        protocol::Order::Asc => sorted.iter().skip( skip ).take( remaining ).map( |&index| index as usize ).collect(),
+        protocol::Order::Dsc => sorted.iter().rev().skip( skip ).take( remaining ).map( |&index| index as usize ).collect()
+    };
+
+    let backtraces = get_backtrace_table( data, &backtrace_format, backtrace_mode,
+        page.iter().map( |&index| *allocation_groups.allocations_by_backtrace.get( index ).0 )
+    );
+
     let factory = move || {
         let backtrace_format = backtrace_format.clone();
         let allocations = allocation_groups.clone();
-        (0..allocations.allocations_by_backtrace.len())
-            .skip( skip )
-            .take( remaining )
+        page.into_iter()
             .map( move |index| {
                 let (&backtrace_id, matched_allocation_ids) = allocations.allocations_by_backtrace.get( index );
                 let all = get_global_group_data( data, backtrace_id );
-                let mut only_matched = get_allocation_group_data( data, matched_allocation_ids.into_par_iter().map( |&allocation_id| data.get_allocation( allocation_id ) ) );
-                let backtrace = data.get_backtrace( backtrace_id ).map( |(_, frame)| get_frame( data, &backtrace_format, frame ) ).collect();
+                let mut only_matched = allocations.only_matched[ index ].clone();
+                let backtrace = get_backtrace_frames( data, &backtrace_format, backtrace_id, backtrace_mode );
 
                 if generate_graphs {
                     let code = format!( r#"
@@ -1062,128 +1801,68 @@ fn get_allocation_groups< 'a >(
 
     let response = protocol::ResponseAllocationGroups {
         allocations: StreamingSerializer::new( factory ),
-        total_count: total_count as _
+        total_count: total_count as _,
+        backtraces
     };
 
     response
 }
 
-fn handler_allocation_groups( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
-    let filter_params: protocol::AllocFilter = query( &req )?;
-    let custom_filter: protocol::CustomFilter = query( &req )?;
+/// Groups the allocations which match the filter from the request, or returns the groups cached for the same filter.
+fn get_cached_allocation_groups( req: &HttpRequest, data: &Data ) -> Result< Arc< AllocationGroups > > {
+    let filter_params: protocol::AllocFilter = query( req )?;
+    let custom_filter: protocol::CustomFilter = query( req )?;
     let filter = prepare_allocation_filter( data, &filter_params, &custom_filter )?;
-    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
-    let params: protocol::RequestAllocationGroups = query( &req )?;
 
     let key = AllocationGroupsKey {
         data_id: data.id(),
         filter: filter_params,
-        custom_filter,
-        sort_by: params.sort_by.unwrap_or( protocol::AllocGroupsSortBy::MinTimestamp ),
-        order: params.order.unwrap_or( protocol::Order::Asc )
+        custom_filter
     };
 
-    let groups = req.state().allocation_group_cache.lock().get( &key ).cloned();
-
-    fn sort_by< T, F >( data: &Data, groups: &mut AllocationGroups, order: protocol::Order, is_global: bool, callback: F )
-        where F: Fn( &protocol::AllocationGroupData ) -> T + Send + Sync,
-              T: Ord + Send + Sync
-    {
-        if is_global {
-            groups.allocations_by_backtrace.par_sort_by_key( |(&backtrace_id, _)| {
-                let group_data = get_global_group_data( data, backtrace_id );
-                callback( &group_data )
-            });
-        } else {
-            let key_for_backtrace: Vec< _ > =
-                groups.allocations_by_backtrace.par_iter().map( |(&backtrace_id, ids)| {
-                    let allocations = ids.par_iter().map( |&id| data.get_allocation( id ) );
-                    let group_data = get_allocation_group_data( data, allocations );
-                    (backtrace_id, callback( &group_data ))
-                }).collect();
-
-            let key_for_backtrace: HashMap< _, _ > = key_for_backtrace.into_iter().collect();
-            groups.allocations_by_backtrace.par_sort_by_key( |(&backtrace_id, _)| {
-                key_for_backtrace.get( &backtrace_id ).unwrap().clone()
-            });
-        }
-
-        match order {
-            protocol::Order::Asc => {},
-            protocol::Order::Dsc => {
-                groups.allocations_by_backtrace.reverse();
-            }
-        }
+    if let Some( groups ) = req.state().allocation_group_cache.lock().get( &key ).cloned() {
+        return Ok( groups );
     }
 
-    let allocation_groups;
-    if let Some( groups ) = groups {
-        allocation_groups = groups;
-    } else {
-        let iter = prefiltered_allocation_ids( data, Default::default(), &filter )
-            .par_iter()
-            .map( |&allocation_id| (allocation_id, data.get_allocation( allocation_id )) )
-            .filter( move |(id, allocation)| filter.try_match( data, *id, allocation ) );
-
-        let mut groups = AllocationGroups::new( iter );
-        match key.sort_by {
-            protocol::AllocGroupsSortBy::MinTimestamp => {
-                sort_by( data, &mut groups, key.order, false, |group_data| group_data.min_timestamp.clone() );
-            },
-            protocol::AllocGroupsSortBy::MaxTimestamp => {
-                sort_by( data, &mut groups, key.order, false, |group_data| group_data.max_timestamp.clone() );
-            },
-            protocol::AllocGroupsSortBy::Interval => {
-                sort_by( data, &mut groups, key.order, false, |group_data| group_data.interval.clone() );
-            },
-            protocol::AllocGroupsSortBy::AllocatedCount => {
-                sort_by( data, &mut groups, key.order, false, |group_data| group_data.allocated_count );
-            },
-            protocol::AllocGroupsSortBy::LeakedCount => {
-                sort_by( data, &mut groups, key.order, false, |group_data| group_data.leaked_count );
-            },
-            protocol::AllocGroupsSortBy::Size => {
-                sort_by( data, &mut groups, key.order, false, |group_data| group_data.size );
-            },
-            protocol::AllocGroupsSortBy::GlobalMinTimestamp => {
-                sort_by( data, &mut groups, key.order, true, |group_data| group_data.min_timestamp.clone() );
-            },
-            protocol::AllocGroupsSortBy::GlobalMaxTimestamp => {
-                sort_by( data, &mut groups, key.order, true, |group_data| group_data.max_timestamp.clone() );
-            },
-            protocol::AllocGroupsSortBy::GlobalInterval => {
-                sort_by( data, &mut groups, key.order, true, |group_data| group_data.interval.clone() );
-            },
-            protocol::AllocGroupsSortBy::GlobalAllocatedCount => {
-                sort_by( data, &mut groups, key.order, true, |group_data| group_data.allocated_count );
-            },
-            protocol::AllocGroupsSortBy::GlobalLeakedCount => {
-                sort_by( data, &mut groups, key.order, true, |group_data| group_data.leaked_count );
-            },
-            protocol::AllocGroupsSortBy::GlobalSize => {
-                sort_by( data, &mut groups, key.order, true, |group_data| group_data.size );
-            },
-            protocol::AllocGroupsSortBy::GlobalMaxTotalUsageFirstSeenAt => {
-                sort_by( data, &mut groups, key.order, true, |group_data| group_data.max_total_usage_first_seen_at.clone() );
-            }
-        }
+    let allocation_ids: Vec< _ > = prefiltered_allocation_ids( data, Default::default(), &filter )
+        .par_iter()
+        .copied()
+        .filter( |&allocation_id| filter.try_match( data, allocation_id, data.get_allocation( allocation_id ) ) )
+        .collect();
+
+    let groups = AllocationGroups::new( data, &allocation_ids );
+    let size = groups.memory_usage();
+    let allocation_groups = Arc::new( groups );
+    req.state().allocation_group_cache.lock().put( key, allocation_groups.clone(), size );
+    Ok( allocation_groups )
+}
 
-        allocation_groups = Arc::new( groups );
-        req.state().allocation_group_cache.lock().put( key, allocation_groups.clone() );
-    }
+fn handler_allocation_groups( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let params: protocol::RequestAllocationGroups = query( &req )?;
+    let allocation_groups = get_cached_allocation_groups( &req, data )?;
 
     let state = req.state().clone();
+    let as_columns = wants_columns( &req );
+    let backtrace_mode = BacktraceMode::new( as_columns, params.separate_backtraces );
     let body = async_data_handler( &req, move |data, tx| {
-        let response = get_allocation_groups( &state, &data, backtrace_format, params, allocation_groups );
-        let _ = serde_json::to_writer( tx, &response );
+        if as_columns {
+            let backtraces = columns::Backtraces::new( &data, backtrace_format.clone() );
+            let response = get_allocation_groups( &state, &data, backtrace_format, backtrace_mode, params, allocation_groups );
+            let _ = columns::encode( tx, backtraces, "allocation_groups", response.total_count, response.allocations );
+        } else {
+            let response = get_allocation_groups( &state, &data, backtrace_format, backtrace_mode, params, allocation_groups );
+            let _ = serde_json::to_writer( tx, &response );
+        }
     })?;
 
-    Ok( HttpResponse::Ok().content_type( "application/json" ).body( body ) )
+    let content_type = if as_columns { columns::MIME_TYPE } else { "application/json" };
+    Ok( HttpResponse::Ok().content_type( content_type ).body( body ) )
 }
 
 fn handler_raw_allocations( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let iter = data.alloc_sorted_by_timestamp( None, None ).iter().map( |&id| data.get_allocation( id ) );
 
     let mut output = String::new();
@@ -1250,7 +1929,7 @@ fn dump_node< T: fmt::Write, K: PartialEq + Clone, V, F: Fn( &mut T, &V ) -> fmt
 }
 
 fn handler_tree( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let filter: protocol::AllocFilter = query( &req )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
     let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
@@ -1276,7 +1955,7 @@ fn handler_tree( req: HttpRequest ) -> Result< HttpResponse > {
 }
 
 fn handler_backtrace( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let backtrace_id: u32 = req.match_info().get( "backtrace_id" ).unwrap().parse().unwrap();
     let backtrace_id = BacktraceId::new( backtrace_id );
     let backtrace = data.get_backtrace( backtrace_id );
@@ -1295,28 +1974,57 @@ fn handler_backtrace( req: HttpRequest ) -> Result< HttpResponse > {
 }
 
 fn handler_backtraces( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = get_data( &req )?;
     let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let params: protocol::RequestBacktraces = query( &req )?;
+
+    let headers = cache_headers( &req, &data );
+    if let Some( response ) = headers.not_modified( &req ) {
+        return Ok( response );
+    }
+
+    if let Some( ids ) = params.ids {
+        let mut backtrace_ids = Vec::new();
+        for id in ids.split( ',' ).filter( |id| !id.is_empty() ) {
+            let id: u32 = id.parse().map_err( |_| ErrorBadRequest( format!( "invalid backtrace ID: '{}'", id ) ) )?;
+            if id as usize >= data.unique_backtrace_count() {
+                return Err( ErrorNotFound( format!( "backtrace not found: {}", id ) ) );
+            }
+
+            backtrace_ids.push( BacktraceId::new( id ) );
+        }
+
+        let body = async_data_handler( &req, move |data, tx| {
+            let total_count = backtrace_ids.len() as u64;
+            let data = &data;
+            let backtraces = move || {
+                backtrace_ids.into_iter().map( move |backtrace_id| {
+                    data.get_backtrace( backtrace_id ).map( |(_, frame)| get_frame( data, &backtrace_format, frame ) ).collect::< Vec< _ > >()
+                })
+            };
+
+            let response = protocol::ResponseBacktraces {
+                backtraces: StreamingSerializer::new( backtraces ),
+                total_count
+            };
+
+            let _ = serde_json::to_writer( tx, &response );
+        })?;
+
+        return Ok( headers.apply( &mut HttpResponse::Ok() ).content_type( "application/json" ).body( body ) );
+    }
+
     let filter: protocol::BacktraceFilter = query( &req )?;
-    let filter = crate::filter::prepare_backtrace_filter( &filter )?;
+    let matched = crate::filter::select_backtraces( &data, &filter )?;
     let body = async_data_handler( &req, move |data, tx| {
-        let mut positive_cache = HashMap::new();
-        let mut negative_cache = HashMap::new();
-        let total_count = data.all_backtraces().flat_map( |(_, backtrace)| {
-            if !crate::filter::match_backtrace( &data, &mut positive_cache, &mut negative_cache, &filter, backtrace ) {
-                None
-            } else {
-                Some(())
-            }
-        }).count();
+        let total_count = matched.count_ones();
 
         let data = &data;
+        let matched = &*matched;
         let backtraces = move || {
-            let mut positive_cache = positive_cache.clone();
-            let mut negative_cache = negative_cache.clone();
             let backtrace_format = backtrace_format.clone();
-            let filter = filter.clone();
-            data.all_backtraces().flat_map( move |(_, backtrace)| {
-                if !crate::filter::match_backtrace( &data, &mut positive_cache, &mut negative_cache, &filter, backtrace.clone() ) {
+            data.all_backtraces().flat_map( move |(backtrace_id, backtrace)| {
+                if !matched.contains( backtrace_id.raw() as usize ) {
                     return None;
                 }
 
@@ -1336,7 +2044,7 @@ fn handler_backtraces( req: HttpRequest ) -> Result< HttpResponse > {
         let _ = serde_json::to_writer( tx, &response );
     })?;
 
-    Ok( HttpResponse::Ok().content_type( "application/json" ).body( body ) )
+    Ok( headers.apply( &mut HttpResponse::Ok() ).content_type( "application/json" ).body( body ) )
 }
 
 fn generate_regions< 'a, F: Fn( AllocationId, &Allocation ) -> bool + Clone + 'a >( data: &'a Data, filter: F ) -> impl Serialize + 'a {
@@ -1385,27 +2093,76 @@ fn generate_regions< 'a, F: Fn( AllocationId, &Allocation ) -> bool + Clone + 'a
 }
 
 fn handler_regions( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let filter: protocol::AllocFilter = query( &req )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
     let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
+    let headers = cache_headers( &req, data );
+    if let Some( response ) = headers.not_modified( &req ) {
+        return Ok( response );
+    }
 
     let body = async_data_handler( &req, move |data, tx| {
         let response = generate_regions( &data, |id, allocation| filter.try_match( &data, id, allocation ) );
         let _ = serde_json::to_writer( tx, &response );
     })?;
 
-    Ok( HttpResponse::Ok().content_type( "application/json" ).body( body ) )
+    Ok( headers.apply( &mut HttpResponse::Ok() ).content_type( "application/json" ).body( body ) )
+}
+
+fn handler_region_tiles( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let filter: protocol::AllocFilter = query( &req )?;
+    let custom_filter: protocol::CustomFilter = query( &req )?;
+    let params: protocol::RequestRegionTiles = query( &req )?;
+    let key = format!( "{:?}:{:?}", filter, custom_filter );
+    let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
+    let headers = cache_headers( &req, data );
+    if let Some( response ) = headers.not_modified( &req ) {
+        return Ok( response );
+    }
+
+    let body = async_data_handler( &req, move |data, tx| {
+        // The index is only built once for every filter, so zooming and panning around is cheap.
+        let tiles = data.cached_address_tiles( key, || {
+            cli_core::AddressTiles::from_allocations( &data, |id| filter.try_match( &data, id, data.get_allocation( id ) ) )
+        });
+
+        let view = params.view_start.unwrap_or( 0 )..params.view_end.unwrap_or( !0 );
+        let level = tiles.level_for( view.clone(), params.max_tiles.unwrap_or( 4096 ) );
+        let tile_size = tiles.tile_size( level );
+        let response = protocol::ResponseRegionTiles {
+            tile_size,
+            tiles: tiles.tiles( level, view.clone() ).map( |run| {
+                // The runs can extend past the edges of the view.
+                let first = max( run.address / tile_size, view.start / tile_size );
+                let last = min( run.address / tile_size + run.count - 1, (view.end - 1) / tile_size );
+                protocol::RegionTile {
+                    address: first * tile_size,
+                    count: last - first + 1,
+                    occupied: run.occupied
+                }
+            }).collect()
+        };
+
+        let _ = serde_json::to_writer( tx, &response );
+    })?;
+
+    Ok( headers.apply( &mut HttpResponse::Ok() ).content_type( "application/json" ).body( body ) )
 }
 
 fn handler_mallopts( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || serde_json::to_vec( &generate_mallopts( data, &backtrace_format ) ).unwrap() ) )
+}
 
+fn generate_mallopts< 'a >( data: &'a Data, backtrace_format: &protocol::BacktraceFormat ) -> Vec< protocol::Mallopt< 'a > > {
     let response: Vec< _ > = data.mallopts().iter().map( |mallopt| {
         let mut backtrace = Vec::new();
         for (_, frame) in data.get_backtrace( mallopt.backtrace ) {
-            backtrace.push( get_frame( &data, &backtrace_format, frame ) );
+            backtrace.push( get_frame( data, backtrace_format, frame ) );
         }
 
         protocol::Mallopt {
@@ -1430,16 +2187,678 @@ fn handler_mallopts( req: HttpRequest ) -> Result< HttpResponse > {
         }
     }).collect();
 
-    Ok( HttpResponse::Ok().json( response ) )
+    response
+}
+
+fn handler_memory_advices( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || serde_json::to_vec( &generate_memory_advices( data, &backtrace_format ) ).unwrap() ) )
+}
+
+fn generate_memory_advices< 'a >( data: &'a Data, backtrace_format: &protocol::BacktraceFormat ) -> Vec< protocol::MemoryAdvice< 'a > > {
+    data.memory_advices().iter().map( |advice| {
+        let mut backtrace = Vec::new();
+        for (_, frame) in data.get_backtrace( advice.backtrace ) {
+            backtrace.push( get_frame( data, backtrace_format, frame ) );
+        }
+
+        protocol::MemoryAdvice {
+            timestamp: advice.timestamp.into(),
+            thread: advice.thread,
+            backtrace_id: advice.backtrace.raw(),
+            backtrace,
+            address: advice.address,
+            length: advice.length,
+            raw_advice: advice.advice,
+            advice: advice.name().map( |value| value.into() )
+        }
+    }).collect()
+}
+
+fn handler_residency( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || serde_json::to_vec( &generate_residency( data, &backtrace_format ) ).unwrap() ) )
+}
+
+fn generate_residency< 'a >( data: &'a Data, backtrace_format: &protocol::BacktraceFormat ) -> Vec< protocol::ResidencySample< 'a > > {
+    let mut samples: Vec< _ > = data.last_residency_samples().iter().collect();
+    samples.sort_by_key( |sample| std::cmp::Reverse( sample.allocated_size ) );
+    samples.into_iter().map( |sample| {
+        let mut backtrace = Vec::new();
+        for (_, frame) in data.get_backtrace( sample.backtrace ) {
+            backtrace.push( get_frame( data, backtrace_format, frame ) );
+        }
+
+        protocol::ResidencySample {
+            timestamp: sample.timestamp.into(),
+            backtrace_id: sample.backtrace.raw(),
+            backtrace,
+            allocation_count: sample.allocation_count,
+            allocated_size: sample.allocated_size,
+            pages: sample.pages,
+            resident_pages: sample.resident_pages,
+            swapped_pages: sample.swapped_pages,
+            untouched_pages: sample.untouched_pages(),
+            idle_pages: if sample.idle_tracking { Some( sample.idle_pages ) } else { None }
+        }
+    }).collect()
+}
+
+fn handler_co_located_pairs( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let filter_params: protocol::AllocFilter = query( &req )?;
+    let custom_filter: protocol::CustomFilter = query( &req )?;
+    let filter = prepare_allocation_filter( data, &filter_params, &custom_filter )?;
+    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let params: protocol::RequestCoLocatedPairs = query( &req )?;
+
+    let allocation_ids: Vec< _ > = prefiltered_allocation_ids( data, protocol::AllocSortBy::Address, &filter )
+        .par_iter()
+        .copied()
+        .filter( |&allocation_id| filter.try_match( data, allocation_id, data.get_allocation( allocation_id ) ) )
+        .collect();
+
+    let line_size = params.line_size.unwrap_or( DEFAULT_CACHE_LINE_SIZE );
+    let pairs = find_co_located_allocations( data, &allocation_ids, line_size );
+    let response = generate_co_located_pairs( data, &backtrace_format, &pairs, params.count.map( |count| count as usize ).unwrap_or( 100 ) );
+    Ok( HttpResponse::Ok().content_type( "application/json" ).body( serde_json::to_vec( &response ).unwrap() ) )
+}
+
+fn generate_co_located_pairs< 'a >(
+    data: &'a Data,
+    backtrace_format: &protocol::BacktraceFormat,
+    pairs: &[CoLocatedPair],
+    count: usize
+) -> protocol::ResponseCoLocatedPairs< 'a > {
+    let get_backtrace = |id: BacktraceId| -> Vec< _ > {
+        data.get_backtrace( id ).map( |(_, frame)| get_frame( data, backtrace_format, frame ) ).collect()
+    };
+
+    let response_pairs = pairs.iter().take( count ).map( |pair| {
+        protocol::CoLocatedPair {
+            backtrace_1_id: pair.backtraces.0.raw(),
+            backtrace_1: get_backtrace( pair.backtraces.0 ),
+            backtrace_2_id: pair.backtraces.1.raw(),
+            backtrace_2: get_backtrace( pair.backtraces.1 ),
+            count: pair.count,
+            overlap: pair.overlap.0.into(),
+            allocation_count: pair.allocation_ids.len() as u64
+        }
+    }).collect();
+
+    protocol::ResponseCoLocatedPairs {
+        total_count: pairs.len() as u64,
+        pairs: response_pairs
+    }
+}
+
+fn handler_duplicates( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let filter_params: protocol::AllocFilter = query( &req )?;
+    let custom_filter: protocol::CustomFilter = query( &req )?;
+    let filter = prepare_allocation_filter( data, &filter_params, &custom_filter )?;
+    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let params: protocol::RequestDuplicates = query( &req )?;
+    let dump = data.memory_dumps().last().ok_or_else( || ErrorNotFound( "the data doesn't contain any memory dumps" ) )?;
+
+    let allocation_ids: Vec< _ > = prefiltered_allocation_ids( data, protocol::AllocSortBy::Address, &filter )
+        .par_iter()
+        .copied()
+        .filter( |&allocation_id| filter.try_match( data, allocation_id, data.get_allocation( allocation_id ) ) )
+        .collect();
+
+    let groups = find_duplicates( data, &allocation_ids, dump );
+    let response = generate_duplicates( data, &backtrace_format, &groups, params.count.map( |count| count as usize ).unwrap_or( 100 ) );
+    Ok( HttpResponse::Ok().content_type( "application/json" ).body( serde_json::to_vec( &response ).unwrap() ) )
+}
+
+fn generate_duplicates< 'a >(
+    data: &'a Data,
+    backtrace_format: &protocol::BacktraceFormat,
+    groups: &[DuplicateGroup],
+    count: usize
+) -> protocol::ResponseDuplicates< 'a > {
+    let response_groups = groups.iter().take( count ).map( |group| {
+        protocol::DuplicateGroup {
+            size: group.size,
+            count: group.count,
+            wasted_size: group.wasted_size,
+            backtraces: group.backtraces.iter().map( |&(id, count)| {
+                protocol::DuplicateBacktrace {
+                    backtrace_id: id.raw(),
+                    backtrace: data.get_backtrace( id ).map( |(_, frame)| get_frame( data, backtrace_format, frame ) ).collect(),
+                    count
+                }
+            }).collect()
+        }
+    }).collect();
+
+    protocol::ResponseDuplicates {
+        total_count: groups.len() as u64,
+        total_wasted_size: groups.iter().map( |group| group.wasted_size ).sum(),
+        groups: response_groups
+    }
+}
+
+fn handler_churners( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let filter_params: protocol::AllocFilter = query( &req )?;
+    let custom_filter: protocol::CustomFilter = query( &req )?;
+    let filter = prepare_allocation_filter( data, &filter_params, &custom_filter )?;
+    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let params: protocol::RequestChurners = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        serde_json::to_vec( &generate_churners( data, &filter, &backtrace_format, &params ) ).unwrap()
+    }))
+}
+
+fn generate_churners< 'a >(
+    data: &'a Data,
+    filter: &AllocationFilter,
+    backtrace_format: &protocol::BacktraceFormat,
+    params: &protocol::RequestChurners
+) -> protocol::ResponseChurners< 'a > {
+    let allocation_ids: Vec< _ > = prefiltered_allocation_ids( data, protocol::AllocSortBy::Timestamp, filter )
+        .par_iter()
+        .copied()
+        .filter( |&allocation_id| filter.try_match( data, allocation_id, data.get_allocation( allocation_id ) ) )
+        .collect();
+
+    let interval = params.interval.as_ref().map( |interval| interval.0 ).unwrap_or( Timestamp::from_secs( 1 ) );
+    let mut rates = find_allocation_rates( data, &allocation_ids, interval );
+    match params.sort_by.unwrap_or( protocol::ChurnersSortBy::Count ) {
+        protocol::ChurnersSortBy::Count => {},
+        protocol::ChurnersSortBy::Size => rates.rates.par_sort_by_key( |rate| std::cmp::Reverse( rate.size ) ),
+        protocol::ChurnersSortBy::PeakCount => rates.rates.par_sort_by_key( |rate| std::cmp::Reverse( rate.peak_count() ) ),
+        protocol::ChurnersSortBy::PeakSize => rates.rates.par_sort_by_key( |rate| std::cmp::Reverse( rate.peak_size() ) )
+    }
+
+    let churners = rates.rates.iter().take( params.count.map( |count| count as usize ).unwrap_or( 100 ) ).map( |rate| {
+        protocol::Churner {
+            backtrace_id: rate.backtrace.raw(),
+            backtrace: data.get_backtrace( rate.backtrace ).map( |(_, frame)| get_frame( data, backtrace_format, frame ) ).collect(),
+            count: rate.count,
+            size: rate.size,
+            culled_count: rate.culled_count,
+            culled_size: rate.culled_size,
+            culled_lifetimes: rate.culled_lifetimes.iter().enumerate().map( |(index, &count)| {
+                let (min, max) = CulledAllocations::lifetime_bucket_range( index );
+                protocol::LifetimeBucket {
+                    min_lifetime: Timestamp::from_usecs( min ).into(),
+                    max_lifetime: Timestamp::from_usecs( max ).into(),
+                    count
+                }
+            }).collect(),
+            peak_count_per_second: rates.per_second( rate.peak_count() ),
+            peak_size_per_second: rates.per_second( rate.peak_size() ),
+            timeline: rate.buckets.iter().map( |bucket| {
+                let timestamp = rates.timestamp_of( bucket.index );
+                protocol::RateBucket {
+                    timestamp: timestamp.into(),
+                    timestamp_relative: (timestamp - rates.start).into(),
+                    count_per_second: rates.per_second( bucket.count ),
+                    size_per_second: rates.per_second( bucket.size )
+                }
+            }).collect()
+        }
+    }).collect();
+
+    protocol::ResponseChurners {
+        interval: rates.interval.into(),
+        total_count: rates.rates.len() as u64,
+        churners
+    }
+}
+
+fn handler_allocator_latencies( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let params: protocol::RequestAllocatorLatencies = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        serde_json::to_vec( &generate_allocator_latencies( data, &backtrace_format, &params ) ).unwrap()
+    }))
+}
+
+fn generate_allocator_latencies< 'a >(
+    data: &'a Data,
+    backtrace_format: &protocol::BacktraceFormat,
+    params: &protocol::RequestAllocatorLatencies
+) -> protocol::ResponseAllocatorLatencies< 'a > {
+    let call = |latencies: &AllocatorLatencies| match latencies.call {
+        AllocatorCall::Allocate => protocol::AllocatorCall::Allocate,
+        AllocatorCall::Reallocate => protocol::AllocatorCall::Reallocate,
+        AllocatorCall::Deallocate => protocol::AllocatorCall::Deallocate
+    };
+
+    let mut entries: Vec< &AllocatorLatencies > = data.allocator_latencies().iter()
+        .filter( |&latencies| params.call.map( |expected| call( latencies ) == expected ).unwrap_or( true ) )
+        .collect();
+
+    match params.sort_by.unwrap_or( protocol::AllocatorLatenciesSortBy::Max ) {
+        protocol::AllocatorLatenciesSortBy::Max => entries.sort_by_key( |latencies| std::cmp::Reverse( (latencies.max, latencies.quantile( 0.99 )) ) ),
+        protocol::AllocatorLatenciesSortBy::P99 => entries.sort_by_key( |latencies| std::cmp::Reverse( (latencies.quantile( 0.99 ), latencies.max) ) ),
+        protocol::AllocatorLatenciesSortBy::Mean => entries.sort_by_key( |latencies| std::cmp::Reverse( latencies.mean() ) ),
+        protocol::AllocatorLatenciesSortBy::Total => entries.sort_by_key( |latencies| std::cmp::Reverse( latencies.total ) )
+    }
+
+    let total_count = entries.len() as u64;
+    let entries = entries.into_iter().take( params.count.map( |count| count as usize ).unwrap_or( 100 ) ).map( |latencies| {
+        protocol::AllocatorLatencies {
+            backtrace_id: latencies.backtrace.raw(),
+            backtrace: data.get_backtrace( latencies.backtrace ).map( |(_, frame)| get_frame( data, backtrace_format, frame ) ).collect(),
+            call: call( latencies ),
+            count: latencies.count,
+            mean: latencies.mean(),
+            p50: latencies.quantile( 0.5 ),
+            p99: latencies.quantile( 0.99 ),
+            max: latencies.max,
+            total: latencies.total,
+            histogram: latencies.buckets.iter().enumerate().filter( |&(_, &count)| count > 0 ).map( |(index, &count)| {
+                let (min_latency, max_latency) = AllocatorLatencies::bucket_range( index );
+                protocol::LatencyBucket { min_latency, max_latency, count }
+            }).collect()
+        }
+    }).collect();
+
+    protocol::ResponseAllocatorLatencies {
+        total_count,
+        entries
+    }
+}
+
+fn handler_page_faults( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let params: protocol::RequestPageFaults = query( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        serde_json::to_vec( &generate_page_faults( data, &backtrace_format, &params ) ).unwrap()
+    }))
+}
+
+fn generate_page_faults< 'a >(
+    data: &'a Data,
+    backtrace_format: &protocol::BacktraceFormat,
+    params: &protocol::RequestPageFaults
+) -> protocol::ResponsePageFaults< 'a > {
+    let mut by_backtrace: HashMap< BacktraceId, u64 > = HashMap::new();
+    let mut by_map: HashMap< MapId, u64 > = HashMap::new();
+    let mut unresolved_samples = 0;
+    for page_fault in data.page_faults() {
+        if let Some( id ) = page_fault.allocation {
+            *by_backtrace.entry( data.get_allocation( id ).backtrace ).or_insert( 0 ) += 1;
+        } else if let Some( id ) = page_fault.map {
+            *by_map.entry( id ).or_insert( 0 ) += 1;
+        } else {
+            unresolved_samples += 1;
+        }
+    }
+
+    let count = params.count.map( |count| count as usize ).unwrap_or( 100 );
+    let period = data.page_fault_period();
+
+    let mut by_backtrace: Vec< _ > = by_backtrace.into_iter().collect();
+    by_backtrace.sort_unstable_by_key( |&(backtrace, samples)| (std::cmp::Reverse( samples ), backtrace) );
+    let backtraces = by_backtrace.into_iter().take( count ).map( |(backtrace, samples)| {
+        protocol::BacktracePageFaults {
+            backtrace_id: backtrace.raw(),
+            backtrace: data.get_backtrace( backtrace ).map( |(_, frame)| get_frame( data, backtrace_format, frame ) ).collect(),
+            samples,
+            page_faults: samples * period
+        }
+    }).collect();
+
+    let mut by_map: Vec< _ > = by_map.into_iter().collect();
+    by_map.sort_unstable_by_key( |&(map, samples)| (std::cmp::Reverse( samples ), map.raw()) );
+    let maps = by_map.into_iter().take( count ).map( |(id, samples)| {
+        let map = data.get_map( id );
+        protocol::MapPageFaults {
+            map_id: id.raw(),
+            name: map.name.to_string(),
+            address: map.pointer,
+            samples,
+            page_faults: samples * period
+        }
+    }).collect();
+
+    protocol::ResponsePageFaults {
+        period,
+        total_samples: data.page_faults().len() as u64,
+        unresolved_samples,
+        backtraces,
+        maps
+    }
+}
+
+fn handler_diff( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let backtrace_format: protocol::BacktraceFormat = query( &req )?;
+    let params: protocol::RequestDiff = query( &req )?;
+    let other = match params.other {
+        Some( ref other ) => {
+            let id: DataId = other.parse().map_err( |_| ErrorBadRequest( "invalid 'other'" ) )?;
+            if !req.state().datasets.contains( id ) {
+                return Err( ErrorNotFound( "data not found" ) );
+            }
+            Some( get_data_by_id( &req, id )? )
+        },
+        None => None
+    };
+
+    let headers = match other {
+        Some( ref other ) => {
+            // The response also has to change whenever the other data does.
+            let revisions = req.state().revisions.lock();
+            let revision = revisions.get( &data.id() ).cloned();
+            let other_revision = revisions.get( &other.id() ).cloned();
+            let query = format!( "{}&other_revision={}", req.query_string(), other_revision.unwrap_or( 0 ) );
+            let revision = if revision.is_none() && other_revision.is_none() { None } else { Some( revision.unwrap_or( 0 ) ) };
+            CacheHeaders::new( data.id(), revision, &query, "json" )
+        },
+        None => cache_headers( &req, data )
+    };
+
+    Ok( cached_response( &req, &headers, "application/json", || {
+        serde_json::to_vec( &generate_diff( data, other.as_ref().map( |other| &**other ), &backtrace_format, &params ) ).unwrap()
+    }))
+}
+
+fn diff_timestamp( data: &Data, filter: &protocol::TimestampFilter< protocol::OffsetMax > ) -> Timestamp {
+    data.initial_timestamp() + filter.to_timestamp( data.initial_timestamp(), data.last_timestamp() )
+}
+
+fn generate_diff< 'a >(
+    data: &'a Data,
+    other: Option< &'a Data >,
+    backtrace_format: &protocol::BacktraceFormat,
+    params: &protocol::RequestDiff
+) -> protocol::ResponseDiff< 'a > {
+    let after_at = params.after.as_ref().map( |after| diff_timestamp( data, after ) ).unwrap_or( data.last_timestamp() );
+    let (before_data, diffs) = match other {
+        Some( other ) => {
+            let before_at = params.before.as_ref().map( |before| diff_timestamp( other, before ) ).unwrap_or( other.last_timestamp() );
+            (other, diff_traces( other, before_at, data, after_at ))
+        },
+        None => {
+            let before_at = params.before.as_ref().map( |before| diff_timestamp( data, before ) ).unwrap_or( data.initial_timestamp() );
+            (data, diff_timestamps( data, before_at, after_at ))
+        }
+    };
+
+    let entries = diffs.iter().take( params.count.map( |count| count as usize ).unwrap_or( 100 ) ).map( |diff| {
+        let (backtrace_data, backtrace) = match (diff.after, diff.before) {
+            (Some( backtrace ), _) => (data, backtrace),
+            (None, Some( backtrace )) => (before_data, backtrace),
+            (None, None) => unreachable!()
+        };
+
+        protocol::BacktraceDiff {
+            backtrace_id: backtrace.raw(),
+            is_from_other: !std::ptr::eq( backtrace_data, data ),
+            backtrace: backtrace_data.get_backtrace( backtrace ).map( |(_, frame)| get_frame( backtrace_data, backtrace_format, frame ) ).collect(),
+            count: diff.count,
+            size: diff.size
+        }
+    }).collect();
+
+    protocol::ResponseDiff {
+        total_count: diffs.len() as u64,
+        count: diffs.iter().map( |diff| diff.count ).sum(),
+        size: diffs.iter().map( |diff| diff.size ).sum(),
+        entries
+    }
+}
+
+fn shard_group_stats( group_data: &protocol::AllocationGroupData ) -> protocol::ShardGroupStats {
+    protocol::ShardGroupStats {
+        allocated_count: group_data.allocated_count,
+        leaked_count: group_data.leaked_count,
+        size: group_data.size,
+        min_size: group_data.min_size,
+        max_size: group_data.max_size,
+        min_timestamp: group_data.min_timestamp.as_usecs(),
+        max_timestamp: group_data.max_timestamp.as_usecs()
+    }
+}
+
+/// The allocation groups of this shard of a distributed analysis, to be merged by the coordinator.
+fn handler_shard_allocation_groups( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let allocation_groups = get_cached_allocation_groups( &req, data )?;
+    let body = async_data_handler( &req, move |data, tx| {
+        let groups = (0..allocation_groups.len()).into_par_iter().map( |index| {
+            let (&backtrace_id, _) = allocation_groups.allocations_by_backtrace.get( index );
+            protocol::ShardAllocationGroup {
+                backtrace_id: backtrace_id.raw(),
+                all: shard_group_stats( &get_global_group_data( &data, backtrace_id ) ),
+                only_matched: shard_group_stats( &allocation_groups.only_matched[ index ] )
+            }
+        }).collect();
+
+        let response = protocol::ResponseShardAllocationGroups {
+            initial_timestamp: data.initial_timestamp().as_usecs(),
+            last_timestamp: data.last_timestamp().as_usecs(),
+            groups
+        };
+
+        let _ = serde_json::to_writer( tx, &response );
+    })?;
+
+    Ok( HttpResponse::Ok().content_type( "application/json" ).body( body ) )
+}
+
+/// The diff of this shard of a distributed analysis; unlike `/diff` every changed backtrace is returned.
+fn handler_shard_diff( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let params: protocol::RequestDiff = query( &req )?;
+    if params.other.is_some() {
+        return Err( ErrorBadRequest( "diffing against other data is not supported for the shards" ) );
+    }
+
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        let before_at = params.before.as_ref().map( |before| diff_timestamp( data, before ) ).unwrap_or( data.initial_timestamp() );
+        let after_at = params.after.as_ref().map( |after| diff_timestamp( data, after ) ).unwrap_or( data.last_timestamp() );
+        let entries = diff_timestamps( data, before_at, after_at ).into_iter().map( |diff| protocol::ShardBacktraceDiff {
+            backtrace_id: diff.after.or( diff.before ).unwrap().raw(),
+            count: diff.count,
+            size: diff.size
+        }).collect();
+
+        serde_json::to_vec( &protocol::ResponseShardDiff { entries } ).unwrap()
+    }))
+}
+
+/// How many of the allocations of this shard of a distributed analysis match the filter.
+fn handler_shard_count( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let filter_params: protocol::AllocFilter = query( &req )?;
+    let custom_filter: protocol::CustomFilter = query( &req )?;
+    let filter = prepare_allocation_filter( data, &filter_params, &custom_filter )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || {
+        let (count, size) = prefiltered_allocation_ids( data, Default::default(), &filter ).par_iter()
+            .filter_map( |&allocation_id| {
+                let allocation = data.get_allocation( allocation_id );
+                if filter.try_match( data, allocation_id, allocation ) {
+                    Some( (1, allocation.size) )
+                } else {
+                    None
+                }
+            })
+            .reduce( || (0_u64, 0_u64), |lhs, rhs| (lhs.0 + rhs.0, lhs.1 + rhs.1) );
+
+        serde_json::to_vec( &protocol::ResponseShardCount { count, size } ).unwrap()
+    }))
+}
+
+fn handler_size_classes( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let filter_params: protocol::AllocFilter = query( &req )?;
+    let custom_filter: protocol::CustomFilter = query( &req )?;
+    let filter = prepare_allocation_filter( data, &filter_params, &custom_filter )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || serde_json::to_vec( &generate_size_classes( data, &filter ) ).unwrap() ) )
+}
+
+fn generate_size_classes( data: &Data, filter: &AllocationFilter ) -> Vec< protocol::SizeClassHistogram > {
+    let allocation_ids: Vec< _ > = prefiltered_allocation_ids( data, protocol::AllocSortBy::Size, filter )
+        .par_iter()
+        .copied()
+        .filter( |&allocation_id| filter.try_match( data, allocation_id, data.get_allocation( allocation_id ) ) )
+        .collect();
+
+    let sizes = RequestedSizes::new( data, &allocation_ids );
+    SizeClassAllocator::ALL.iter().map( |&allocator| {
+        let histogram = sizes.histogram( allocator );
+        protocol::SizeClassHistogram {
+            allocator: allocator.name(),
+            requested: histogram.requested(),
+            slack: histogram.slack(),
+            recorded_slack: histogram.recorded_slack,
+            size_classes: histogram.size_classes.iter().map( |size_class| {
+                protocol::SizeClass {
+                    size_class: size_class.size_class,
+                    previous_size_class: size_class.previous_size_class,
+                    count: size_class.count,
+                    requested: size_class.requested,
+                    slack: size_class.slack(),
+                    min_requested_size: size_class.min_requested_size,
+                    max_requested_size: size_class.max_requested_size,
+                    trim_by: size_class.trim_by(),
+                    savings_if_trimmed: size_class.savings_if_trimmed()
+                }
+            }).collect()
+        }
+    }).collect()
+}
+
+fn handler_jemalloc_stats( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || serde_json::to_vec( &generate_jemalloc_stats( data ) ).unwrap() ) )
+}
+
+fn generate_jemalloc_stats( data: &Data ) -> protocol::ResponseJemallocStats {
+    let snapshots = data.jemalloc_snapshots().iter().map( |snapshot| {
+        protocol::JemallocSnapshot {
+            timestamp: snapshot.timestamp.into(),
+            allocated: snapshot.allocated,
+            active: snapshot.active,
+            metadata: snapshot.metadata,
+            resident: snapshot.resident,
+            mapped: snapshot.mapped,
+            retained: snapshot.retained,
+            dirty: snapshot.dirty(),
+            muzzy: snapshot.muzzy(),
+            tcache: snapshot.tcache(),
+            fragmentation: snapshot.fragmentation()
+        }
+    }).collect();
+
+    // The per-arena and per-size-class stats are only interesting as of the very end.
+    let last = match data.jemalloc_snapshots().last() {
+        Some( last ) => last,
+        None => return protocol::ResponseJemallocStats { snapshots, arenas: Vec::new(), bins: Vec::new() }
+    };
+
+    let arenas = last.arenas.iter().map( |arena| {
+        protocol::JemallocArena {
+            index: arena.index,
+            threads: arena.threads,
+            active: arena.pactive * last.page_size,
+            dirty: arena.pdirty * last.page_size,
+            muzzy: arena.pmuzzy * last.page_size,
+            mapped: arena.mapped,
+            retained: arena.retained,
+            resident: arena.resident,
+            tcache: arena.tcache_bytes,
+            small_allocated: arena.small_allocated,
+            large_allocated: arena.large_allocated
+        }
+    }).collect();
+
+    let bins = last.bins.iter().map( |bin| {
+        let capacity = bin.current_slabs * bin.regions_per_slab;
+        protocol::JemallocBin {
+            size: bin.size,
+            regions_per_slab: bin.regions_per_slab,
+            current_regions: bin.current_regions,
+            current_slabs: bin.current_slabs,
+            nonfull_slabs: bin.nonfull_slabs,
+            utilization: if capacity == 0 { 0.0 } else { bin.current_regions as f64 / capacity as f64 }
+        }
+    }).collect();
+
+    protocol::ResponseJemallocStats { snapshots, arenas, bins }
+}
+
+fn handler_profiler_statistics( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let headers = cache_headers( &req, data );
+    Ok( cached_response( &req, &headers, "application/json", || serde_json::to_vec( &generate_profiler_statistics( data ) ).unwrap() ) )
+}
+
+/// Estimates a percentile from a histogram whose `buckets[ n ]` counts the values in `2^(n - 1)..2^n`
+/// by returning the upper bound of the bucket in which it falls.
+fn estimate_percentile( buckets: &[u64], count: u64, fraction: f64 ) -> u64 {
+    let threshold = (count as f64 * fraction).ceil() as u64;
+    let mut seen = 0;
+    for (index, &bucket) in buckets.iter().enumerate() {
+        seen += bucket;
+        if seen >= threshold {
+            return if index == 0 { 0 } else { (1_u64 << (index as u32).min( 63 )) - 1 };
+        }
+    }
+
+    0
+}
+
+fn generate_profiler_statistics( data: &Data ) -> protocol::ResponseProfilerStatistics {
+    let histograms = data.profiler_histograms().iter().map( |histogram| {
+        protocol::ProfilerHistogram {
+            name: &histogram.name,
+            count: histogram.count,
+            sum: histogram.sum,
+            mean: if histogram.count == 0 { 0.0 } else { histogram.sum as f64 / histogram.count as f64 },
+            p50: estimate_percentile( &histogram.buckets, histogram.count, 0.50 ),
+            p90: estimate_percentile( &histogram.buckets, histogram.count, 0.90 ),
+            p99: estimate_percentile( &histogram.buckets, histogram.count, 0.99 )
+        }
+    }).collect();
+
+    let backtrace_caches = data.backtrace_cache_statistics().iter().enumerate().map( |(index, level)| {
+        let lookups = level.hits + level.misses;
+        protocol::BacktraceCacheStatistics {
+            level: index as u32 + 1,
+            hits: level.hits,
+            misses: level.misses,
+            conflicts: level.conflicts,
+            capacity: level.capacity,
+            hit_rate: if lookups == 0 { 0.0 } else { level.hits as f64 / lookups as f64 }
+        }
+    }).collect();
+
+    protocol::ResponseProfilerStatistics {
+        bytes_written: data.profiler_bytes_written(),
+        histograms,
+        backtrace_caches
+    }
 }
 
 fn handler_export_flamegraph_pl( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let filter: protocol::AllocFilter = query( &req )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
     let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
 
-    let body = async_data_handler( &req, move |data, tx| {
+    let body = background_data_handler( &req, move |data, tx| {
         let _ = export_as_flamegraph_pl( &data, tx, |id, allocation| filter.try_match( &data, id, allocation ) );
     })?;
 
@@ -1447,12 +2866,12 @@ fn handler_export_flamegraph_pl( req: HttpRequest ) -> Result< HttpResponse > {
 }
 
 fn handler_export_flamegraph( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let filter: protocol::AllocFilter = query( &req )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
     let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
 
-    let body = async_data_handler( &req, move |data, tx| {
+    let body = background_data_handler( &req, move |data, tx| {
         let _ = export_as_flamegraph( &data, tx, |id, allocation| filter.try_match( &data, id, allocation ) );
     })?;
 
@@ -1460,12 +2879,12 @@ fn handler_export_flamegraph( req: HttpRequest ) -> Result< HttpResponse > {
 }
 
 fn handler_export_replay( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let filter: protocol::AllocFilter = query( &req )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
     let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
 
-    let body = async_data_handler( &req, move |data, tx| {
+    let body = background_data_handler( &req, move |data, tx| {
         let _ = export_as_replay( &data, tx, |id, allocation| filter.try_match( &data, id, allocation ) );
     })?;
 
@@ -1473,20 +2892,33 @@ fn handler_export_replay( req: HttpRequest ) -> Result< HttpResponse > {
 }
 
 fn handler_export_heaptrack( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let filter: protocol::AllocFilter = query( &req )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
     let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
 
-    let body = async_data_handler( &req, move |data, tx| {
+    let body = background_data_handler( &req, move |data, tx| {
         let _ = export_as_heaptrack( &data, tx, |id, allocation| filter.try_match( &data, id, allocation ) );
     })?;
 
     Ok( HttpResponse::Ok().content_type( "application/octet-stream" ).body( body ) )
 }
 
+fn handler_export_pprof( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let filter: protocol::AllocFilter = query( &req )?;
+    let custom_filter: protocol::CustomFilter = query( &req )?;
+    let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
+
+    let body = background_data_handler( &req, move |data, tx| {
+        let _ = export_as_pprof( &data, tx, |id, allocation| filter.try_match( &data, id, allocation ) );
+    })?;
+
+    Ok( HttpResponse::Ok().content_type( "application/octet-stream" ).body( body ) )
+}
+
 fn handler_allocation_ascii_tree( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let filter: protocol::AllocFilter = query( &req )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
     let filter = prepare_allocation_filter( &data, &filter, &custom_filter )?;
@@ -1501,6 +2933,63 @@ fn handler_allocation_ascii_tree( req: HttpRequest ) -> Result< HttpResponse > {
     Ok( HttpResponse::Ok().content_type( "text/plain; charset=utf-8" ).body( body ) )
 }
 
+fn call_tree_node( data: &Data, tree: &Tree< SourceKey, FrameId >, id: NodeId ) -> protocol::CallTreeNode {
+    let node = tree.get_node( id );
+    protocol::CallTreeNode {
+        id,
+        label: node.value().map( |&frame_id| data.tree_frame_label( frame_id ) ).unwrap_or_default(),
+        total_size: node.total_size,
+        total_count: node.total_count,
+        self_size: node.self_size,
+        self_count: node.self_count,
+        child_count: node.children.len() as u32
+    }
+}
+
+fn handler_call_tree( req: HttpRequest ) -> Result< HttpResponse > {
+    let data = &get_data( &req )?;
+    let filter: protocol::AllocFilter = query( &req )?;
+    let custom_filter: protocol::CustomFilter = query( &req )?;
+    let params: protocol::RequestCallTree = query( &req )?;
+    let bottom_up = params.bottom_up.unwrap_or( false );
+    let key = format!( "{:?}:{:?}:{}", filter, custom_filter, bottom_up );
+    let filter = prepare_allocation_filter( data, &filter, &custom_filter )?;
+    let headers = cache_headers( &req, data );
+    if let Some( response ) = headers.not_modified( &req ) {
+        return Ok( response );
+    }
+
+    let body = async_data_handler( &req, move |data, tx| {
+        // The whole tree is only built once for every filter; expanding a node only has to look at its children.
+        let tree = data.cached_call_tree( key, || {
+            data.call_tree( |id, allocation| filter.try_match( &data, id, allocation ), bottom_up )
+        });
+
+        let id = params.node.unwrap_or( 0 );
+        if id as usize >= tree.node_count() {
+            let _ = serde_json::to_writer( tx, &serde_json::json!({ "error": "no such node" }) );
+            return;
+        }
+
+        let mut children: Vec< _ > = tree.get_node( id ).children.iter().map( |&(_, child_id)| child_id ).collect();
+        children.sort_by_key( |&child_id| std::cmp::Reverse( tree.get_node( child_id ).total_size ) );
+
+        let count = params.count.map( |count| count as usize ).unwrap_or( children.len() );
+        let omitted = children.split_off( min( count, children.len() ) );
+        let response = protocol::ResponseCallTree {
+            node: call_tree_node( &data, &tree, id ),
+            children: children.into_iter().map( |child_id| call_tree_node( &data, &tree, child_id ) ).collect(),
+            omitted_children: omitted.len() as u32,
+            omitted_size: omitted.iter().map( |&child_id| tree.get_node( child_id ).total_size ).sum(),
+            omitted_count: omitted.iter().map( |&child_id| tree.get_node( child_id ).total_count ).sum()
+        };
+
+        let _ = serde_json::to_writer( tx, &response );
+    })?;
+
+    Ok( headers.apply( &mut HttpResponse::Ok() ).content_type( "application/json" ).body( body ) )
+}
+
 fn handler_collation_json< F >( req: HttpRequest, callback: F ) -> Result< HttpResponse >
     where F: Fn( &Data ) -> BTreeMap< String, BTreeMap< u32, CountAndSize > > + Send + 'static
 {
@@ -1574,8 +3063,8 @@ fn handler_dynamic_statics_ascii_tree( req: HttpRequest ) -> Result< HttpRespons
 
 fn handler_script_files( req: HttpRequest ) -> Result< HttpResponse > {
     let hash = req.match_info().get( "hash" ).unwrap();
-    let entry = match req.state().generated_files.lock().by_hash.get( hash ) {
-        Some( entry ) => entry.clone(),
+    let entry = match req.state().generated_files.get( hash )? {
+        Some( entry ) => entry,
         None => {
             return Err( ErrorNotFound( "file not found" ) );
         }
@@ -1595,7 +3084,7 @@ fn handler_script_files( req: HttpRequest ) -> Result< HttpResponse > {
 }
 
 fn handler_allocation_filter_to_script( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let filter: protocol::AllocFilter = query( &req )?;
     let filter = prepare_raw_allocation_filter( data, &filter )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
@@ -1626,7 +3115,7 @@ fn handler_allocation_filter_to_script( req: HttpRequest ) -> Result< HttpRespon
 }
 
 fn handler_map_filter_to_script( req: HttpRequest ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
+    let data = &get_data( &req )?;
     let filter: protocol::MapFilter = query( &req )?;
     let filter = prepare_raw_map_filter( data, &filter )?;
     let custom_filter: protocol::CustomFilter = query( &req )?;
@@ -1657,84 +3146,85 @@ fn handler_map_filter_to_script( req: HttpRequest ) -> Result< HttpResponse > {
 }
 
 fn handler_execute_script( req: HttpRequest, body: web::Bytes ) -> Result< HttpResponse > {
-    let data = get_data( &req )?;
-    let body = String::from_utf8( body.to_vec() ).unwrap();
-    let args = cli_core::script::EngineArgs {
-        data: Some( data.clone() ),
-        .. cli_core::script::EngineArgs::default()
-    };
+    let code = String::from_utf8( body.to_vec() ).unwrap();
+    let state = req.state().clone();
 
-    let env = Arc::new( Mutex::new( cli_core::script::VirtualEnvironment::new() ) );
-    let engine = cli_core::script::Engine::new( env.clone(), args );
-    let timestamp = std::time::Instant::now();
-    let result = engine.run( &body );
-    let elapsed = timestamp.elapsed();
-    let data_id = data.id();
+    // Scripts can take arbitrarily long, so don't let them hog the CPUs.
+    let body = background_data_handler( &req, move |data, tx| {
+        let args = cli_core::script::EngineArgs {
+            data: Some( data.clone() ),
+            .. cli_core::script::EngineArgs::default()
+        };
 
-    let mut new_files = Vec::new();
-    let mut output = Vec::new();
-    for item in std::mem::take( &mut env.lock().output ) {
-        match item {
-            cli_core::script::ScriptOutputKind::PrintLine( line ) => {
-                output.push( serde_json::json! {{
-                    "kind": "println",
-                    "value": line
-                }});
-            },
-            cli_core::script::ScriptOutputKind::Image { path, data } => {
-                let hash = format!( "{:x}", md5::compute( &*data ) );
-                let basename = path[ path.rfind( "/" ).unwrap() + 1.. ].to_owned();
-                output.push( serde_json::json! {{
-                    "url": format!( "/data/{}/script_files/{}/{}", data_id, hash, basename ),
-                    "kind": "image",
-                    "basename": basename,
-                    "path": path,
-                    "checksum": hash
-                }});
-
-                let entry = GeneratedFile {
-                    timestamp: Instant::now(),
-                    hash,
-                    mime: "image/svg+xml",
-                    data
-                };
-
-                new_files.push( entry );
+        let env = Arc::new( Mutex::new( cli_core::script::VirtualEnvironment::new() ) );
+        let timestamp = std::time::Instant::now();
+        let result = cli_core::script::Engine::run_cached( env.clone(), args, &code );
+        let elapsed = timestamp.elapsed();
+        let data_id = data.id();
+
+        let mut new_files = Vec::new();
+        let mut output = Vec::new();
+        for item in std::mem::take( &mut env.lock().output ) {
+            match item {
+                cli_core::script::ScriptOutputKind::PrintLine( line ) => {
+                    output.push( serde_json::json! {{
+                        "kind": "println",
+                        "value": line
+                    }});
+                },
+                cli_core::script::ScriptOutputKind::Image { path, data } => {
+                    let hash = format!( "{:x}", md5::compute( &*data ) );
+                    let basename = path[ path.rfind( "/" ).unwrap() + 1.. ].to_owned();
+                    output.push( serde_json::json! {{
+                        "url": format!( "/data/{}/script_files/{}/{}", data_id, hash, basename ),
+                        "kind": "image",
+                        "basename": basename,
+                        "path": path,
+                        "checksum": hash
+                    }});
+
+                    let entry = GeneratedFile {
+                        hash,
+                        mime: "image/svg+xml",
+                        data
+                    };
+
+                    new_files.push( entry );
+                }
             }
         }
-    }
-
-    let mut generated = req.state().generated_files.lock();
-    generated.purge_old_if_too_big();
-    for entry in new_files {
-        generated.add_file( entry );
-    }
-    std::mem::drop( generated );
 
-    let result = match result {
-        Ok( _ ) => {
-            serde_json::json! {{
-                "status": "ok",
-                "elapsed": elapsed.as_secs_f64(),
-                "output": output
-            }}
-        },
-        Err( error ) => {
-            serde_json::json! {{
-                "status": "error",
-                "message": error.message,
-                "line": error.line,
-                "column": error.column,
-                "output": output
-            }}
+        for entry in new_files {
+            state.generated_files.add( entry );
         }
-    };
+
+        let result = match result {
+            Ok( _ ) => {
+                serde_json::json! {{
+                    "status": "ok",
+                    "elapsed": elapsed.as_secs_f64(),
+                    "output": output
+                }}
+            },
+            Err( error ) => {
+                serde_json::json! {{
+                    "status": "error",
+                    "message": error.message,
+                    "line": error.line,
+                    "column": error.column,
+                    "output": output
+                }}
+            }
+        };
+
+        let _ = serde_json::to_writer( tx, &result );
+    })?;
 
     Ok(
         HttpResponse::Ok()
         .content_type( "application/json; charset=utf-8" )
         .header( "Access-Control-Allow-Origin", "http://localhost:1234" )
-        .body( serde_json::to_string( &result ).unwrap() )
+        .body( body )
     )
 }
 
@@ -1799,32 +3289,157 @@ impl From< io::Error > for ServerError {
 
 impl Error for ServerError {}
 
-pub fn main( inputs: Vec< PathBuf >, debug_symbols: Vec< PathBuf >, load_in_parallel: bool, interface: &str, port: u16 ) -> Result< (), ServerError > {
-    let mut state = State::new();
+/// How often the data gathered in the `--live` mode is reloaded.
+const LIVE_RELOAD_INTERVAL: Duration = Duration::from_secs( 10 );
+
+fn load_child_processes( filename: &Path, debug_symbols: &[PathBuf], load_filter: &LoadFilter ) -> io::Result< Vec< (u32, Data) > > {
+    let children = Loader::load_child_processes_from_file( filename, debug_symbols, load_filter.clone() )?;
+    for (pid, data) in &children {
+        info!( "Loaded {} of the child process {} from {:?}", data.id(), pid, filename );
+    }
+
+    Ok( children )
+}
+
+/// Periodically reloads the data which is being gathered into `path`, publishing it as a new snapshot.
+///
+/// TODO: Every reload still goes through the whole file. Making this incremental needs a `Loader`
+/// which is kept open between the reloads and is only fed the events appended since the last one,
+/// and a way to get a `Data` out of it without consuming it, so that its indexes are updated
+/// instead of being rebuilt from scratch.
+fn reload_live_data( state: StateRef, path: PathBuf, debug_symbols: Vec< PathBuf >, load_filter: LoadFilter, gatherer: thread::JoinHandle< () > ) {
+    loop {
+        thread::sleep( LIVE_RELOAD_INTERVAL );
+
+        // If the gathering has finished we have everything, so this is the last reload.
+        let is_finished = gatherer.is_finished();
+        match File::open( &path ).and_then( |fp| Loader::load_from_stream_with_filter( fp, &debug_symbols, load_filter.clone() ) ) {
+            Ok( data ) => {
+                info!( "Publishing a new snapshot of {:?} with {} allocation(s)", path, data.unsorted_allocations().len() );
+                state.replace_data( data );
+            },
+            Err( error ) => warn!( "Failed to load {:?}: {}", path, error )
+        }
+
+        if is_finished {
+            break;
+        }
+    }
+}
+
+/// Expands the directories among the inputs into the data files inside of them.
+fn find_inputs( inputs: Vec< PathBuf > ) -> io::Result< Vec< PathBuf > > {
+    let mut output = Vec::new();
+    for input in inputs {
+        if !input.is_dir() {
+            output.push( input );
+            continue;
+        }
 
-    if !load_in_parallel {
+        let mut paths = Vec::new();
+        for entry in std::fs::read_dir( &input )? {
+            let path = entry?.path();
+            if !path.is_file() || path.extension().map( |extension| extension == "bhcache" ).unwrap_or( false ) {
+                continue;
+            }
+
+            // Whatever else is in there doesn't have to be a data file.
+            match File::open( &path ).and_then( |fp| cli_core::parse_events( fp ) ) {
+                Ok( _ ) => paths.push( path ),
+                Err( error ) => debug!( "Skipping {:?}: {}", path, error )
+            }
+        }
+
+        paths.sort();
+        output.extend( paths );
+    }
+
+    Ok( output )
+}
+
+pub fn main(
+    inputs: Vec< PathBuf >,
+    debug_symbols: Vec< PathBuf >,
+    preload: bool,
+    load_in_parallel: bool,
+    use_cache: bool,
+    memory_budget: Option< usize >,
+    generated_files: GeneratedFilesOptions,
+    live: Option< &str >,
+    load_filter: LoadFilter,
+    interface: &str,
+    port: u16
+) -> Result< (), ServerError > {
+    let live_debug_symbols = debug_symbols.clone();
+    let live_load_filter = load_filter.clone();
+    let options = LoadOptions {
+        debug_symbols: debug_symbols.clone(),
+        use_cache,
+        load_filter: load_filter.clone()
+    };
+
+    let state = State::new( Datasets::new( options, memory_budget ), GeneratedFiles::new( generated_files )? );
+    let inputs = find_inputs( inputs )?;
+
+    if !preload && !load_in_parallel {
+        // Only the headers are read here; the data itself is loaded once it's needed.
+        for filename in inputs {
+            let id = state.datasets.add_file( filename.clone() )?;
+            info!( "Found {} in {:?}", id, filename );
+
+            // The children only exist within their parent's file, so they can't be loaded lazily.
+            for (_, data) in load_child_processes( &filename, &debug_symbols, &load_filter )? {
+                state.add_data( None, data );
+            }
+        }
+    } else if !load_in_parallel {
         for filename in inputs {
             info!( "Trying to load {:?}...", filename );
-            let fp = File::open( filename )?;
-            let data = Loader::load_from_stream( fp, &debug_symbols )?;
-            state.add_data( data );
+            let data = Loader::load_from_file_with_filter( &filename, &debug_symbols, use_cache, load_filter.clone() )?;
+            let children = load_child_processes( &filename, &debug_symbols, &load_filter )?;
+            state.add_data( Some( filename ), data );
+            for (_, data) in children {
+                state.add_data( None, data );
+            }
         }
     } else {
-        let handles: Vec< thread::JoinHandle< io::Result< Data > > > = inputs.iter().map( move |filename| {
-            let filename = filename.clone();
+        // Every loader uses multiple threads on its own, so only load as many files at a time as we have cores.
+        let thread_count = thread::available_parallelism().map( |count| count.get() ).unwrap_or( 1 );
+        let thread_count = std::cmp::max( 1, std::cmp::min( thread_count, inputs.len() ) );
+        let input_count = inputs.len();
+        let queue = Arc::new( Mutex::new( inputs.into_iter().enumerate() ) );
+        let handles: Vec< thread::JoinHandle< io::Result< Vec< (usize, Option< PathBuf >, Data) > > > > = (0..thread_count).map( move |_| {
+            let queue = queue.clone();
             let debug_symbols = debug_symbols.clone();
+            let load_filter = load_filter.clone();
             thread::spawn( move || {
-                info!( "Trying to load {:?}...", filename );
-                let fp = File::open( filename )?;
-                let data = Loader::load_from_stream( fp, debug_symbols )?;
-                Ok( data )
+                let mut loaded = Vec::new();
+                loop {
+                    let (index, filename) = match queue.lock().next() {
+                        Some( input ) => input,
+                        None => break
+                    };
+
+                    info!( "Trying to load {:?}...", filename );
+                    let data = Loader::load_from_file_with_filter( &filename, &debug_symbols, use_cache, load_filter.clone() )?;
+                    let children = load_child_processes( &filename, &debug_symbols, &load_filter )?;
+                    loaded.push( (index, Some( filename ), data) );
+                    loaded.extend( children.into_iter().map( |(_, data)| (index, None, data) ) );
+                }
+
+                Ok( loaded )
             })
         }).collect();
 
-
+        let mut loaded = Vec::with_capacity( input_count );
         for handle in handles {
-            let data = handle.join().unwrap()?;
-            state.add_data( data );
+            loaded.extend( handle.join().unwrap()? );
+        }
+
+        // This is a stable sort, so the children still come right after their parent.
+        loaded.sort_by_key( |&(index, _, _)| index );
+        for (_, filename, data) in loaded {
+            state.add_data( filename, data );
         }
     }
 
@@ -1833,16 +3448,28 @@ pub fn main( inputs: Vec< PathBuf >, debug_symbols: Vec< PathBuf >, load_in_para
     }
 
     let state = Arc::new( state );
+    if let Some( target ) = live {
+        let (path, gatherer) = cli_core::cmd_gather::gather_in_background( target )?;
+        let state = state.clone();
+        thread::spawn( move || reload_live_data( state, path, live_debug_symbols, live_load_filter, gatherer ) );
+    }
+
     let sys = actix::System::new( "server" );
     actix_web::HttpServer::new( move || {
         App::new().data( state.clone() )
             .wrap( Cors::new() )
+            .wrap( middleware::Compress::default() )
             .configure( |app| {
                 app
                     .service( web::resource( "/list" ).route( web::get().to( handler_list ) ) )
+                    .service( web::resource( "/data/{id}/metadata" ).route( web::get().to( handler_metadata ) ) )
                     .service( web::resource( "/data/{id}/timeline" ).route( web::get().to( handler_timeline ) ) )
                     .service( web::resource( "/data/{id}/timeline_leaked" ).route( web::get().to( handler_timeline_leaked ) ) )
+                    .service( web::resource( "/data/{id}/timeline_device" ).route( web::get().to( handler_timeline_device ) ) )
+                    .service( web::resource( "/data/{id}/timeline_cgroup" ).route( web::get().to( handler_timeline_cgroup ) ) )
+                    .service( web::resource( "/data/{id}/timeline_threads" ).route( web::get().to( handler_timeline_threads ) ) )
                     .service( web::resource( "/data/{id}/timeline_maps" ).route( web::get().to( handler_timeline_maps ) ) )
+                    .service( web::resource( "/data/{id}/timeline_updates" ).route( web::get().to( handler_timeline_updates ) ) )
                     .service( web::resource( "/data/{id}/allocations" ).route( web::get().to( handler_allocations ) ) )
                     .service( web::resource( "/data/{id}/allocation_groups" ).route( web::get().to( handler_allocation_groups ) ) )
                     .service( web::resource( "/data/{id}/maps" ).route( web::get().to( handler_maps ) ) )
@@ -1851,16 +3478,34 @@ pub fn main( inputs: Vec< PathBuf >, debug_symbols: Vec< PathBuf >, load_in_para
                     .service( web::resource( "/data/{id}/tree" ).route( web::get().to( handler_tree ) ) )
                     .service( web::resource( "/data/{id}/backtrace/{backtrace_id}" ).route( web::get().to( handler_backtrace ) ) )
                     .service( web::resource( "/data/{id}/regions" ).route( web::get().to( handler_regions ) ) )
+                    .service( web::resource( "/data/{id}/region_tiles" ).route( web::get().to( handler_region_tiles ) ) )
                     .service( web::resource( "/data/{id}/mallopts" ).route( web::get().to( handler_mallopts ) ) )
+                    .service( web::resource( "/data/{id}/memory_advices" ).route( web::get().to( handler_memory_advices ) ) )
+                    .service( web::resource( "/data/{id}/residency" ).route( web::get().to( handler_residency ) ) )
+                    .service( web::resource( "/data/{id}/size_classes" ).route( web::get().to( handler_size_classes ) ) )
+                    .service( web::resource( "/data/{id}/co_located_pairs" ).route( web::get().to( handler_co_located_pairs ) ) )
+                    .service( web::resource( "/data/{id}/duplicates" ).route( web::get().to( handler_duplicates ) ) )
+                    .service( web::resource( "/data/{id}/churners" ).route( web::get().to( handler_churners ) ) )
+                    .service( web::resource( "/data/{id}/allocator_latencies" ).route( web::get().to( handler_allocator_latencies ) ) )
+                    .service( web::resource( "/data/{id}/page_faults" ).route( web::get().to( handler_page_faults ) ) )
+                    .service( web::resource( "/data/{id}/diff" ).route( web::get().to( handler_diff ) ) )
+                    .service( web::resource( "/data/{id}/shard/allocation_groups" ).route( web::get().to( handler_shard_allocation_groups ) ) )
+                    .service( web::resource( "/data/{id}/shard/diff" ).route( web::get().to( handler_shard_diff ) ) )
+                    .service( web::resource( "/data/{id}/shard/count" ).route( web::get().to( handler_shard_count ) ) )
+                    .service( web::resource( "/data/{id}/jemalloc_stats" ).route( web::get().to( handler_jemalloc_stats ) ) )
+                    .service( web::resource( "/data/{id}/profiler_statistics" ).route( web::get().to( handler_profiler_statistics ) ) )
                     .service( web::resource( "/data/{id}/export/flamegraph" ).route( web::get().to( handler_export_flamegraph ) ) )
                     .service( web::resource( "/data/{id}/export/flamegraph/{filename}" ).route( web::get().to( handler_export_flamegraph ) ) )
                     .service( web::resource( "/data/{id}/export/flamegraph.pl" ).route( web::get().to( handler_export_flamegraph_pl ) ) )
                     .service( web::resource( "/data/{id}/export/flamegraph.pl/{filename}" ).route( web::get().to( handler_export_flamegraph_pl ) ) )
                     .service( web::resource( "/data/{id}/export/heaptrack" ).route( web::get().to( handler_export_heaptrack ) ) )
                     .service( web::resource( "/data/{id}/export/heaptrack/{filename}" ).route( web::get().to( handler_export_heaptrack ) ) )
+                    .service( web::resource( "/data/{id}/export/pprof" ).route( web::get().to( handler_export_pprof ) ) )
+                    .service( web::resource( "/data/{id}/export/pprof/{filename}" ).route( web::get().to( handler_export_pprof ) ) )
                     .service( web::resource( "/data/{id}/export/replay" ).route( web::get().to( handler_export_replay ) ) )
                     .service( web::resource( "/data/{id}/export/replay/{filename}" ).route( web::get().to( handler_export_replay ) ) )
                     .service( web::resource( "/data/{id}/allocation_ascii_tree" ).route( web::get().to( handler_allocation_ascii_tree ) ) )
+                    .service( web::resource( "/data/{id}/call_tree" ).route( web::get().to( handler_call_tree ) ) )
                     .service( web::resource( "/data/{id}/dynamic_constants" ).route( web::get().to( handler_dynamic_constants ) ) )
                     .service( web::resource( "/data/{id}/dynamic_constants/{filename}" ).route( web::get().to( handler_dynamic_constants ) ) )
                     .service( web::resource( "/data/{id}/dynamic_constants_ascii_tree" ).route( web::get().to( handler_dynamic_constants_ascii_tree ) ) )
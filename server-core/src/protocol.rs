@@ -1,4 +1,5 @@
 use std::borrow::Cow;
+use std::collections::BTreeMap;
 use std::marker::PhantomData;
 use std::str::FromStr;
 use std::fmt;
@@ -52,6 +53,13 @@ pub struct Timeval {
     pub fract_nsecs: FractNanos
 }
 
+impl Timeval {
+    #[inline]
+    pub fn as_usecs( &self ) -> u64 {
+        self.secs.0 * 1_000_000 + self.fract_nsecs.0 as u64 / 1000
+    }
+}
+
 impl From< Timestamp > for Timeval {
     #[inline]
     fn from( value: Timestamp ) -> Self {
@@ -62,21 +70,26 @@ impl From< Timestamp > for Timeval {
     }
 }
 
-#[derive(Serialize)]
+/// The fields which can only be known after the data was loaded are `None` until it's loaded for the first time.
+#[derive(Clone, Serialize)]
 pub struct ResponseMetadata {
     pub id: String,
+    pub parent_id: Option< String >,
     pub executable: String,
     pub cmdline: String,
     pub architecture: String,
-    pub final_allocated: u64,
-    pub final_allocated_count: u64,
-    pub runtime: Timeval,
-    pub unique_backtrace_count: u64,
-    pub maximum_backtrace_depth: u32,
-    pub timestamp: Timeval
+    pub final_allocated: Option< u64 >,
+    pub final_allocated_count: Option< u64 >,
+    pub runtime: Option< Timeval >,
+    pub unique_backtrace_count: Option< u64 >,
+    pub maximum_backtrace_depth: Option< u32 >,
+    pub timestamp: Timeval,
+    pub is_loaded: bool,
+    /// Whether this is a snapshot of data which is still being gathered.
+    pub is_live: bool
 }
 
-#[derive(Serialize)]
+#[derive(Serialize, Deserialize)]
 pub struct ResponseTimeline {
     pub xs: Vec< u64 >,
     pub size_delta: Vec< i64 >,
@@ -96,21 +109,76 @@ pub struct ResponseMapTimeline {
     pub dirty: Vec< i64 >,
     pub clean: Vec< i64 >,
     pub swap: Vec< i64 >,
+    pub huge_pages: Vec< i64 >,
 }
 
-#[derive(Clone, Serialize)]
+/// The memory usage of the threads which allocated the most, all sampled at the same `xs`.
+#[derive(Serialize)]
+pub struct ResponseThreadTimelines {
+    pub xs: Vec< u64 >,
+    /// The threads with the highest peak memory usage first, and then the one with all of the others, if any.
+    pub threads: Vec< ThreadTimeline >
+}
+
+#[derive(Serialize)]
+pub struct ThreadTimeline {
+    /// `null` for the one which has every other thread in it.
+    pub thread: Option< u32 >,
+    pub name: Option< String >,
+    /// In milliseconds, like the `xs`; `null` if the profiler didn't record it.
+    pub started_at: Option< u64 >,
+    pub exited_at: Option< u64 >,
+    pub peak_size: u64,
+    pub allocation_count: u64,
+    /// The memory allocated by the thread which wasn't deallocated yet.
+    pub allocated_size: Vec< u64 >,
+    pub allocations_per_second: Vec< f64 >
+}
+
+/// The samples of the memory usage of the process' cgroup; the sizes are in bytes.
+#[derive(Serialize)]
+pub struct ResponseCgroupTimeline {
+    pub xs: Vec< u64 >,
+    pub current: Vec< u64 >,
+    /// `null` if there's no limit.
+    pub limit: Vec< Option< u64 > >,
+    pub anon: Vec< u64 >,
+    pub file: Vec< u64 >,
+    pub kernel: Vec< u64 >,
+    pub sock: Vec< u64 >,
+    /// The percentage of the time since the previous point during which some (or all) of the tasks were stalled on memory.
+    pub pressure_some: Vec< f64 >,
+    pub pressure_full: Vec< f64 >
+}
+
+/// Sent through the live update stream whenever a newer snapshot of the data is published.
+///
+/// The timelines only contain the points from the requested timestamp onwards,
+/// which replace whatever points the client already had from there on.
+#[derive(Serialize)]
+pub struct ResponseTimelineUpdate {
+    pub metadata: ResponseMetadata,
+    pub timeline: ResponseTimeline,
+    pub timeline_leaked: ResponseTimeline,
+    pub timeline_device: ResponseTimeline,
+    pub timeline_maps: ResponseMapTimeline,
+    pub timeline_cgroup: ResponseCgroupTimeline
+}
+
+/// Also deserialized by the coordinator of a distributed analysis, which is why the strings aren't plain references.
+#[derive(Clone, Serialize, Deserialize)]
 pub struct Frame< 'a > {
     pub address: u64,
     pub address_s: String,
     pub count: u64,
     #[serde(skip_serializing_if = "Option::is_none")]
-    pub library: Option< &'a str >,
+    pub library: Option< Cow< 'a, str > >,
     #[serde(skip_serializing_if = "Option::is_none")]
     pub function: Option< Cow< 'a, str > >,
     #[serde(skip_serializing_if = "Option::is_none")]
-    pub raw_function: Option< &'a str >,
+    pub raw_function: Option< Cow< 'a, str > >,
     #[serde(skip_serializing_if = "Option::is_none")]
-    pub source: Option< &'a str >,
+    pub source: Option< Cow< 'a, str > >,
     #[serde(skip_serializing_if = "Option::is_none")]
     pub line: Option< u32 >,
     #[serde(skip_serializing_if = "Option::is_none")]
@@ -154,12 +222,16 @@ pub struct Allocation< 'a > {
     pub in_main_arena: bool,
     pub extra_space: u32,
     #[serde(skip_serializing_if = "Option::is_none")]
+    pub pool: Option< u16 >,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub pool_name: Option< &'a str >,
+    #[serde(skip_serializing_if = "Option::is_none")]
     pub chain_lifetime: Option< Timeval >,
     pub position_in_chain: u32,
     pub chain_length: u32,
 }
 
-#[derive(Serialize)]
+#[derive(Clone, Serialize)]
 pub struct AllocationGroupData {
     pub size: u64,
     pub min_size: u64,
@@ -178,6 +250,22 @@ pub struct AllocationGroupData {
     pub max_total_usage_first_seen_at: Option< Timeval >,
     pub max_total_usage_first_seen_at_relative: Option< Timeval >,
     pub max_total_usage_first_seen_at_relative_p: Option< f32 >,
+    /// How much of the usable space of the allocations wasn't requested; only known for the matched allocations.
+    pub slack: Option< u64 >,
+    /// How many bytes the reallocation chains started by the matched allocations had to copy.
+    pub bytes_copied: Option< u64 >,
+    /// The sum of the biggest size of each of those chains.
+    pub chain_peak_size: Option< u64 >,
+    pub copy_amplification: Option< f64 >,
+    /// How many of the matched allocations were deallocated on a different thread than the one which made them,
+    /// their total usable size and their mean lifetime.
+    pub cross_thread_free_count: Option< u64 >,
+    pub cross_thread_free_size: Option< u64 >,
+    pub cross_thread_free_latency: Option< Timeval >,
+    /// The estimated quantiles of the lifetimes of the deallocated allocations; only known globally.
+    pub lifetime_p50: Option< Timeval >,
+    pub lifetime_p90: Option< Timeval >,
+    pub lifetime_p99: Option< Timeval >,
 }
 
 #[derive(Serialize)]
@@ -256,14 +344,31 @@ pub struct Map< 'a > {
     pub is_writable: bool,
     pub is_executable: bool,
     pub is_shared: bool,
+    pub is_huge_page_advised: bool,
+    pub is_no_huge_page_advised: bool,
     pub name: Cow< 'a, str >,
     pub peak_rss: u64,
+    pub peak_huge_pages: u64,
+    pub purge_count: u64,
+    pub purged: u64,
+    pub reclaimed: u64,
+    pub refaulted: u64,
     pub graph_preview_url: Option< String >,
     pub graph_url: Option< String >,
     #[serde(skip_serializing_if = "Option::is_none")]
     pub regions: Option< Vec< MapRegion< 'a > > >,
     #[serde(skip_serializing_if = "Option::is_none")]
-    pub usage_history: Option< Vec< MapUsage > >
+    pub usage_history: Option< Vec< MapUsage > >,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub sparkline: Option< MapSparkline< 'a > >
+}
+
+/// The map's peak usage within evenly sized slices of the whole run, in KiB.
+#[derive(Serialize)]
+pub struct MapSparkline< 'a > {
+    pub rss: &'a [u32],
+    pub dirty: &'a [u32],
+    pub swap: &'a [u32]
 }
 
 #[derive(Serialize)]
@@ -278,9 +383,40 @@ pub struct MapUsage {
     pub private_clean: u64,
     pub private_dirty: u64,
     pub swap: u64,
+    pub anon_huge_pages: u64,
+    pub shmem_pmd_mapped: u64,
+    pub file_pmd_mapped: u64,
     pub rss: u64,
 }
 
+#[derive(Serialize)]
+pub struct ProfilerHistogram< 'a > {
+    pub name: &'a str,
+    pub count: u64,
+    pub sum: u64,
+    pub mean: f64,
+    pub p50: u64,
+    pub p90: u64,
+    pub p99: u64
+}
+
+#[derive(Serialize)]
+pub struct ResponseProfilerStatistics< 'a > {
+    pub bytes_written: u64,
+    pub histograms: Vec< ProfilerHistogram< 'a > >,
+    pub backtrace_caches: Vec< BacktraceCacheStatistics >
+}
+
+#[derive(Serialize)]
+pub struct BacktraceCacheStatistics {
+    pub level: u32,
+    pub hits: u64,
+    pub misses: u64,
+    pub conflicts: u64,
+    pub capacity: u64,
+    pub hit_rate: f64
+}
+
 #[derive(Serialize)]
 pub struct Mallopt< 'a > {
     pub timestamp: Timeval,
@@ -295,15 +431,285 @@ pub struct Mallopt< 'a > {
 }
 
 #[derive(Serialize)]
-pub struct ResponseAllocations< T: Serialize > {
+pub struct MemoryAdvice< 'a > {
+    pub timestamp: Timeval,
+    pub thread: u32,
+    pub backtrace_id: u32,
+    pub backtrace: Vec< Frame< 'a > >,
+    pub address: u64,
+    pub length: u64,
+    pub raw_advice: i32,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub advice: Option< String >
+}
+
+#[derive(Serialize)]
+pub struct ResidencySample< 'a > {
+    pub timestamp: Timeval,
+    pub backtrace_id: u32,
+    pub backtrace: Vec< Frame< 'a > >,
+    pub allocation_count: u64,
+    pub allocated_size: u64,
+    pub pages: u64,
+    pub resident_pages: u64,
+    pub swapped_pages: u64,
+    pub untouched_pages: u64,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub idle_pages: Option< u64 >
+}
+
+#[derive(Serialize)]
+pub struct CoLocatedPair< 'a > {
+    pub backtrace_1_id: u32,
+    pub backtrace_1: Vec< Frame< 'a > >,
+    pub backtrace_2_id: u32,
+    pub backtrace_2: Vec< Frame< 'a > >,
+    pub count: u64,
+    pub overlap: Timeval,
+    pub allocation_count: u64
+}
+
+#[derive(Serialize)]
+pub struct ResponseCoLocatedPairs< 'a > {
+    pub total_count: u64,
+    pub pairs: Vec< CoLocatedPair< 'a > >
+}
+
+#[derive(Serialize)]
+pub struct DuplicateBacktrace< 'a > {
+    pub backtrace_id: u32,
+    pub backtrace: Vec< Frame< 'a > >,
+    pub count: u64
+}
+
+#[derive(Serialize)]
+pub struct DuplicateGroup< 'a > {
+    pub size: u64,
+    pub count: u64,
+    pub wasted_size: u64,
+    pub backtraces: Vec< DuplicateBacktrace< 'a > >
+}
+
+#[derive(Serialize)]
+pub struct ResponseDuplicates< 'a > {
+    pub total_count: u64,
+    pub total_wasted_size: u64,
+    pub groups: Vec< DuplicateGroup< 'a > >
+}
+
+#[derive(Serialize)]
+pub struct RateBucket {
+    pub timestamp: Timeval,
+    pub timestamp_relative: Timeval,
+    pub count_per_second: f64,
+    pub size_per_second: f64
+}
+
+#[derive(Serialize)]
+pub struct LifetimeBucket {
+    pub min_lifetime: Timeval,
+    pub max_lifetime: Timeval,
+    pub count: u64
+}
+
+#[derive(Serialize)]
+pub struct Churner< 'a > {
+    pub backtrace_id: u32,
+    pub backtrace: Vec< Frame< 'a > >,
+    pub count: u64,
+    pub size: u64,
+    pub culled_count: u64,
+    pub culled_size: u64,
+    /// How long the culled allocations lived; empty if the profiler didn't record it.
+    pub culled_lifetimes: Vec< LifetimeBucket >,
+    pub peak_count_per_second: f64,
+    pub peak_size_per_second: f64,
+    /// Only the intervals in which something was allocated.
+    pub timeline: Vec< RateBucket >
+}
+
+#[derive(Serialize)]
+pub struct BacktraceDiff< 'a > {
+    pub backtrace_id: u32,
+    /// Whether the backtrace is from the `other` data, which happens when nothing from it is alive in this one.
+    pub is_from_other: bool,
+    pub backtrace: Vec< Frame< 'a > >,
+    pub count: i64,
+    pub size: i64
+}
+
+#[derive(Serialize)]
+pub struct ResponseDiff< 'a > {
+    /// How many backtraces changed.
+    pub total_count: u64,
+    pub count: i64,
+    pub size: i64,
+    /// The backtraces which grew the most first.
+    pub entries: Vec< BacktraceDiff< 'a > >
+}
+
+#[derive(Copy, Clone, PartialEq, Eq, Serialize, Deserialize, Debug)]
+pub enum AllocatorCall {
+    #[serde(rename = "allocate")]
+    Allocate,
+    #[serde(rename = "reallocate")]
+    Reallocate,
+    #[serde(rename = "deallocate")]
+    Deallocate
+}
+
+#[derive(Serialize)]
+pub struct LatencyBucket {
+    /// In nanoseconds.
+    pub min_latency: u64,
+    pub max_latency: u64,
+    pub count: u64
+}
+
+#[derive(Serialize)]
+pub struct AllocatorLatencies< 'a > {
+    pub backtrace_id: u32,
+    pub backtrace: Vec< Frame< 'a > >,
+    pub call: AllocatorCall,
+    pub count: u64,
+    /// In nanoseconds; the quantiles are upper bounds.
+    pub mean: u64,
+    pub p50: u64,
+    pub p99: u64,
+    pub max: u64,
+    pub total: u64,
+    pub histogram: Vec< LatencyBucket >
+}
+
+#[derive(Serialize)]
+pub struct ResponseAllocatorLatencies< 'a > {
+    pub total_count: u64,
+    /// The slowest sites first.
+    pub entries: Vec< AllocatorLatencies< 'a > >
+}
+
+#[derive(Serialize)]
+pub struct BacktracePageFaults< 'a > {
+    pub backtrace_id: u32,
+    pub backtrace: Vec< Frame< 'a > >,
+    /// How many of the faults were sampled in this backtrace's allocations.
+    pub samples: u64,
+    /// The estimated number of all of the faults, assuming they were sampled uniformly.
+    pub page_faults: u64
+}
+
+#[derive(Serialize)]
+pub struct MapPageFaults {
+    pub map_id: u64,
+    pub name: String,
+    pub address: u64,
+    pub samples: u64,
+    pub page_faults: u64
+}
+
+#[derive(Serialize)]
+pub struct ResponsePageFaults< 'a > {
+    /// How many page faults every sample stands for.
+    pub period: u64,
+    pub total_samples: u64,
+    /// How many of the samples weren't in any of the allocations or the maps which we know about.
+    pub unresolved_samples: u64,
+    /// The backtraces whose allocations took the most faults first.
+    pub backtraces: Vec< BacktracePageFaults< 'a > >,
+    /// Likewise for the maps, for the faults which weren't in any of the allocations.
+    pub maps: Vec< MapPageFaults >
+}
+
+#[derive(Serialize)]
+pub struct ResponseChurners< 'a > {
+    pub interval: Timeval,
+    pub total_count: u64,
+    pub churners: Vec< Churner< 'a > >
+}
+
+#[derive(Serialize)]
+pub struct SizeClass {
+    pub size_class: u64,
+    pub previous_size_class: Option< u64 >,
+    pub count: u64,
+    pub requested: u64,
+    pub slack: u64,
+    pub min_requested_size: u64,
+    pub max_requested_size: u64,
+    pub trim_by: Option< u64 >,
+    pub savings_if_trimmed: u64
+}
+
+#[derive(Serialize)]
+pub struct SizeClassHistogram {
+    pub allocator: &'static str,
+    pub requested: u64,
+    pub slack: u64,
+    pub recorded_slack: u64,
+    pub size_classes: Vec< SizeClass >
+}
+
+#[derive(Serialize)]
+pub struct JemallocSnapshot {
+    pub timestamp: Timeval,
+    pub allocated: u64,
+    pub active: u64,
+    pub metadata: u64,
+    pub resident: u64,
+    pub mapped: u64,
+    pub retained: u64,
+    pub dirty: u64,
+    pub muzzy: u64,
+    pub tcache: u64,
+    pub fragmentation: f64
+}
+
+#[derive(Serialize)]
+pub struct JemallocArena {
+    pub index: u32,
+    pub threads: u32,
+    pub active: u64,
+    pub dirty: u64,
+    pub muzzy: u64,
+    pub mapped: u64,
+    pub retained: u64,
+    pub resident: u64,
+    pub tcache: u64,
+    pub small_allocated: u64,
+    pub large_allocated: u64
+}
+
+#[derive(Serialize)]
+pub struct JemallocBin {
+    pub size: u64,
+    pub regions_per_slab: u64,
+    pub current_regions: u64,
+    pub current_slabs: u64,
+    pub nonfull_slabs: u64,
+    pub utilization: f64
+}
+
+#[derive(Serialize)]
+pub struct ResponseJemallocStats {
+    pub snapshots: Vec< JemallocSnapshot >,
+    pub arenas: Vec< JemallocArena >,
+    pub bins: Vec< JemallocBin >
+}
+
+#[derive(Serialize, Deserialize)]
+pub struct ResponseAllocations< 'a, T: Serialize > {
     pub allocations: T,
-    pub total_count: u64
+    pub total_count: u64,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub backtraces: Option< BTreeMap< u32, Vec< Frame< 'a > > > >
 }
 
 #[derive(Serialize)]
-pub struct ResponseAllocationGroups< T: Serialize > {
+pub struct ResponseAllocationGroups< 'a, T: Serialize > {
     pub allocations: T,
-    pub total_count: u64
+    pub total_count: u64,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub backtraces: Option< BTreeMap< u32, Vec< Frame< 'a > > > >
 }
 
 #[derive(Serialize)]
@@ -326,12 +732,99 @@ pub struct ResponseRegions< T: Serialize > {
     pub regions: T
 }
 
+/// A run of equally occupied tiles of the address space; `occupied` is in bytes per tile.
+#[derive(Serialize)]
+pub struct RegionTile {
+    pub address: u64,
+    pub count: u64,
+    pub occupied: u64
+}
+
+#[derive(Serialize)]
+pub struct ResponseRegionTiles {
+    pub tile_size: u64,
+    pub tiles: Vec< RegionTile >
+}
+
 #[derive(Serialize)]
+pub struct CallTreeNode {
+    pub id: u64,
+    /// Empty for the root.
+    pub label: String,
+    pub total_size: u64,
+    pub total_count: u64,
+    pub self_size: u64,
+    pub self_count: u64,
+    pub child_count: u32
+}
+
+#[derive(Serialize)]
+pub struct ResponseCallTree {
+    pub node: CallTreeNode,
+    /// Sorted by their total size, biggest first.
+    pub children: Vec< CallTreeNode >,
+    /// How many of the smaller children were left out because of the `count` limit.
+    pub omitted_children: u32,
+    pub omitted_size: u64,
+    pub omitted_count: u64
+}
+
+#[derive(Serialize, Deserialize)]
 pub struct ResponseBacktraces< T: Serialize > {
     pub backtraces: T,
     pub total_count: u64
 }
 
+/// The statistics of a single allocation group within a single shard of a distributed analysis.
+///
+/// The shards are split up by the time at which the allocations were made, so these can simply be added up.
+#[derive(Clone, Serialize, Deserialize)]
+pub struct ShardGroupStats {
+    pub allocated_count: u64,
+    pub leaked_count: u64,
+    pub size: u64,
+    pub min_size: u64,
+    pub max_size: u64,
+    /// In microseconds, like every other timestamp of the shards.
+    pub min_timestamp: u64,
+    pub max_timestamp: u64
+}
+
+#[derive(Clone, Serialize, Deserialize)]
+pub struct ShardAllocationGroup {
+    pub backtrace_id: u32,
+    pub all: ShardGroupStats,
+    pub only_matched: ShardGroupStats
+}
+
+/// Every allocation group with any matching allocations in the shard, in no particular order.
+#[derive(Serialize, Deserialize)]
+pub struct ResponseShardAllocationGroups {
+    pub initial_timestamp: u64,
+    pub last_timestamp: u64,
+    pub groups: Vec< ShardAllocationGroup >
+}
+
+#[derive(Serialize, Deserialize)]
+pub struct ShardBacktraceDiff {
+    pub backtrace_id: u32,
+    pub count: i64,
+    pub size: i64
+}
+
+/// Every backtrace whose memory usage changed within the shard, in no particular order.
+#[derive(Serialize, Deserialize)]
+pub struct ResponseShardDiff {
+    pub entries: Vec< ShardBacktraceDiff >
+}
+
+/// How many allocations in the shard match the filter, and their total size.
+#[derive(Serialize, Deserialize)]
+pub struct ResponseShardCount {
+    pub count: u64,
+    pub size: u64
+}
+
 #[derive(Copy, Clone, PartialEq, Eq, Deserialize, Debug, Hash)]
 pub enum LifetimeFilter {
     #[serde(rename = "all")]
@@ -370,7 +863,7 @@ pub enum ArenaFilter {
     NonMain
 }
 
-#[derive(Copy, Clone, Deserialize, Debug)]
+#[derive(Copy, Clone, PartialEq, Eq, Deserialize, Debug, Hash)]
 pub enum AllocSortBy {
     #[serde(rename = "timestamp")]
     Timestamp,
@@ -394,6 +887,8 @@ pub enum AllocGroupsSortBy {
     LeakedCount,
     #[serde(rename = "only_matched.size")]
     Size,
+    #[serde(rename = "only_matched.copy_amplification")]
+    CopyAmplification,
 
     #[serde(rename = "all.min_timestamp")]
     GlobalMinTimestamp,
@@ -409,6 +904,12 @@ pub enum AllocGroupsSortBy {
     GlobalSize,
     #[serde(rename = "all.max_total_usage_first_seen_at")]
     GlobalMaxTotalUsageFirstSeenAt,
+    #[serde(rename = "all.lifetime_p50")]
+    GlobalLifetimeP50,
+    #[serde(rename = "all.lifetime_p90")]
+    GlobalLifetimeP90,
+    #[serde(rename = "all.lifetime_p99")]
+    GlobalLifetimeP99,
 }
 
 impl Default for AllocSortBy {
@@ -710,6 +1211,12 @@ pub struct AllocFilter {
     pub negative_function_regex: Option< String >,
     pub negative_source_regex: Option< String >,
     pub marker: Option< u32 >,
+    pub thread_tag: Option< u32 >,
+    pub pool: Option< u16 >,
+    pub not_from_pools: Option< bool >,
+    pub numa_node: Option< u32 >,
+    pub thread_numa_node: Option< u32 >,
+    pub numa_remote: Option< bool >,
     pub group_interval_min: Option< TimestampFilter< Interval > >,
     pub group_interval_max: Option< TimestampFilter< Interval > >,
     pub group_max_total_usage_first_seen_min: Option< TimestampFilter< OffsetMin > >,
@@ -773,6 +1280,9 @@ pub struct MapFilter {
     pub negative_source_regex: Option< String >,
     pub peak_rss_min: Option< u64 >,
     pub peak_rss_max: Option< u64 >,
+    pub peak_huge_pages_min: Option< u64 >,
+    pub peak_huge_pages_max: Option< u64 >,
+    pub huge_page_advised: Option< BoolFilter >,
     pub alive_at: Option< TimestampFilter< OffsetMin > >,
     pub alive_at_2: Option< TimestampFilter< OffsetMin > >,
     pub jemalloc: Option< BoolFilter >,
@@ -782,13 +1292,41 @@ pub struct MapFilter {
     pub executable: Option< BoolFilter >,
 }
 
+#[derive(Deserialize, Debug)]
+pub struct RequestTimelineUpdates {
+    /// From when on the points should be sent in the first update, in milliseconds.
+    pub since: Option< u64 >,
+    /// Roughly how many points are drawn for the whole timeline.
+    pub width: Option< u32 >
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestTimeline {
+    /// The start of the viewport, in milliseconds.
+    pub from: Option< u64 >,
+    /// The end of the viewport, in milliseconds.
+    pub to: Option< u64 >,
+    /// Roughly how many points are going to be drawn.
+    pub width: Option< u32 >
+}
+
 #[derive(Deserialize, Debug)]
 pub struct RequestAllocations {
     pub skip: Option< u64 >,
     pub count: Option< u32 >,
 
     pub sort_by: Option< AllocSortBy >,
-    pub order: Option< Order >
+    pub order: Option< Order >,
+
+    pub separate_backtraces: Option< bool >,
+    /// Only the IDs of the backtraces are sent, so that they can be fetched on demand through `/backtraces`.
+    pub omit_backtraces: Option< bool >
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestBacktraces {
+    /// A comma separated list of the backtraces to return, in that order; if not given the backtraces are filtered instead.
+    pub ids: Option< String >
 }
 
 #[derive(Deserialize, Debug)]
@@ -799,7 +1337,73 @@ pub struct RequestAllocationGroups {
     pub sort_by: Option< AllocGroupsSortBy >,
     pub order: Option< Order >,
 
-    pub generate_graphs: Option< bool >
+    pub generate_graphs: Option< bool >,
+    pub separate_backtraces: Option< bool >
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestCoLocatedPairs {
+    pub line_size: Option< u64 >,
+    pub count: Option< u32 >
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestDuplicates {
+    pub count: Option< u32 >
+}
+
+#[derive(Copy, Clone, Deserialize, Debug)]
+pub enum ChurnersSortBy {
+    #[serde(rename = "count")]
+    Count,
+    #[serde(rename = "size")]
+    Size,
+    #[serde(rename = "peak_count")]
+    PeakCount,
+    #[serde(rename = "peak_size")]
+    PeakSize
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestDiff {
+    /// Defaults to the start of the profiling, or to the end of the `other` data if there is one.
+    pub before: Option< TimestampFilter< OffsetMax > >,
+    /// Defaults to the end of the profiling.
+    pub after: Option< TimestampFilter< OffsetMax > >,
+    /// The ID of the data to compare against; `before` is then a point in that data.
+    pub other: Option< String >,
+    pub count: Option< u32 >
+}
+
+#[derive(Copy, Clone, Deserialize, Debug)]
+pub enum AllocatorLatenciesSortBy {
+    #[serde(rename = "max")]
+    Max,
+    #[serde(rename = "p99")]
+    P99,
+    #[serde(rename = "mean")]
+    Mean,
+    #[serde(rename = "total")]
+    Total
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestAllocatorLatencies {
+    pub call: Option< AllocatorCall >,
+    pub count: Option< u32 >,
+    pub sort_by: Option< AllocatorLatenciesSortBy >
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestPageFaults {
+    pub count: Option< u32 >
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestChurners {
+    pub interval: Option< Interval >,
+    pub count: Option< u32 >,
+    pub sort_by: Option< ChurnersSortBy >
 }
 
 #[derive(Copy, Clone, Deserialize, Debug)]
@@ -812,6 +1416,29 @@ pub enum MapsSortBy {
     Size,
     #[serde(rename = "peak_rss")]
     PeakRss,
+    #[serde(rename = "peak_huge_pages")]
+    PeakHugePages,
+    #[serde(rename = "purged")]
+    Purged,
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestRegionTiles {
+    /// The visible part of the address space; these don't filter the allocations, unlike `address_min` and `address_max`.
+    pub view_start: Option< u64 >,
+    pub view_end: Option< u64 >,
+    /// The zoom level is picked so that there are at most this many tiles in view.
+    pub max_tiles: Option< u64 >
+}
+
+#[derive(Deserialize, Debug)]
+pub struct RequestCallTree {
+    /// The node whose children should be returned; defaults to the root.
+    pub node: Option< u64 >,
+    /// Whether the tree should start at the innermost frames instead of at the outermost ones.
+    pub bottom_up: Option< bool >,
+    /// How many of the biggest children should be returned at most.
+    pub count: Option< u32 >
 }
 
 #[derive(Deserialize, Debug)]
@@ -825,6 +1452,7 @@ pub struct RequestMaps {
     pub generate_graphs: Option< bool >,
     pub with_regions: Option< bool >,
     pub with_usage_history: Option< bool >,
+    pub with_sparklines: Option< bool >,
 
     pub id: Option< u64 >,
 }
@@ -0,0 +1,109 @@
+//! Runs the work of the requests so that the interactive ones don't get stuck behind the heavy ones.
+//!
+//! Interactive requests (the tables, the timelines, etc.) run right away on the global thread pool.
+//! Background requests (the exports and the scripts) only get a limited share of the CPUs through
+//! their own pool of lower priority threads, and only a few of them run at the same time; the rest
+//! wait in line, and are dropped without ever running if their client disconnects in the meantime.
+
+use std::cmp::max;
+use std::sync::Arc;
+use std::thread;
+use std::time::Duration;
+
+use parking_lot::{Condvar, Mutex};
+
+use crate::byte_channel::ByteSender;
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum Priority {
+    Interactive,
+    Background
+}
+
+pub struct Scheduler {
+    background_pool: rayon::ThreadPool,
+    max_running_background: usize,
+    running_background: Mutex< usize >,
+    background_finished: Condvar
+}
+
+struct BackgroundSlot< 'a >( &'a Scheduler );
+
+impl< 'a > Drop for BackgroundSlot< 'a > {
+    fn drop( &mut self ) {
+        *self.0.running_background.lock() -= 1;
+        self.0.background_finished.notify_one();
+    }
+}
+
+impl Scheduler {
+    pub fn new() -> Self {
+        // Leave at least half of the CPUs for the interactive requests.
+        let background_threads = max( 1, rayon::current_num_threads() / 2 );
+        let background_pool = rayon::ThreadPoolBuilder::new()
+            .num_threads( background_threads )
+            .thread_name( |index| format!( "background-{}", index ) )
+            .start_handler( |_| lower_thread_priority() )
+            .build()
+            .expect( "failed to create the background thread pool" );
+
+        Scheduler {
+            background_pool,
+            max_running_background: 2,
+            running_background: Mutex::new( 0 ),
+            background_finished: Condvar::new()
+        }
+    }
+
+    fn acquire_background_slot( &self, tx: &ByteSender ) -> Option< BackgroundSlot > {
+        let mut running = self.running_background.lock();
+        while *running >= self.max_running_background {
+            self.background_finished.wait_for( &mut running, Duration::from_millis( 100 ) );
+            if tx.is_closed() {
+                return None;
+            }
+        }
+
+        *running += 1;
+        Some( BackgroundSlot( self ) )
+    }
+
+    /// Runs `callback` on its own thread; any parallel work it does runs on the pool for the given `priority`.
+    ///
+    /// The `callback` is skipped if nobody's listening on `tx` anymore by the time it would've started.
+    pub fn spawn< F >( scheduler: &Arc< Scheduler >, priority: Priority, tx: ByteSender, callback: F )
+        where F: FnOnce( ByteSender ) + Send + 'static
+    {
+        let scheduler = scheduler.clone();
+        thread::spawn( move || {
+            match priority {
+                Priority::Interactive => {
+                    if !tx.is_closed() {
+                        callback( tx );
+                    }
+                },
+                Priority::Background => {
+                    let _slot = match scheduler.acquire_background_slot( &tx ) {
+                        Some( slot ) => slot,
+                        None => return
+                    };
+
+                    if !tx.is_closed() {
+                        scheduler.background_pool.install( move || callback( tx ) );
+                    }
+                }
+            }
+        });
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn lower_thread_priority() {
+    // On Linux this only affects the calling thread.
+    unsafe {
+        libc::setpriority( libc::PRIO_PROCESS, 0, 10 );
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn lower_thread_priority() {}
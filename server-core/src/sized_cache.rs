@@ -0,0 +1,94 @@
+use std::hash::Hash;
+
+use lru::LruCache;
+
+/// An LRU cache which is bounded by the total size of its entries instead of by their count.
+///
+/// The most recently inserted entry is always kept, even if it's bigger than the limit by itself.
+pub struct SizedCache< K: Hash + Eq, V > {
+    cache: LruCache< K, (V, usize) >,
+    total_size: usize,
+    max_size: usize
+}
+
+impl< K: Hash + Eq, V > SizedCache< K, V > {
+    pub fn new( max_size: usize ) -> Self {
+        SizedCache {
+            cache: LruCache::unbounded(),
+            total_size: 0,
+            max_size
+        }
+    }
+
+    pub fn get( &mut self, key: &K ) -> Option< &V > {
+        self.cache.get( key ).map( |(value, _)| value )
+    }
+
+    pub fn put( &mut self, key: K, value: V, size: usize ) {
+        self.put_and_evict( key, value, size, |_, _| {} );
+    }
+
+    /// Same as `put`, except every entry which gets evicted to make room is passed to `on_evict`.
+    pub fn put_and_evict( &mut self, key: K, value: V, size: usize, mut on_evict: impl FnMut( K, V ) ) {
+        if let Some( (_, old_size) ) = self.cache.put( key, (value, size) ) {
+            self.total_size -= old_size;
+        }
+
+        self.total_size += size;
+        while self.total_size > self.max_size && self.cache.len() > 1 {
+            let (key, (value, size)) = self.cache.pop_lru().unwrap();
+            self.total_size -= size;
+            on_evict( key, value );
+        }
+    }
+
+    pub fn contains( &self, key: &K ) -> bool {
+        self.cache.contains( key )
+    }
+
+    pub fn remove( &mut self, key: &K ) -> Option< V > {
+        let (value, size) = self.cache.pop( key )?;
+        self.total_size -= size;
+        Some( value )
+    }
+
+    pub fn remove_if( &mut self, mut callback: impl FnMut( &K ) -> bool ) where K: Clone {
+        let keys: Vec< _ > = self.cache.iter().map( |(key, _)| key ).filter( |key| callback( key ) ).cloned().collect();
+        for key in keys {
+            if let Some( (_, size) ) = self.cache.pop( &key ) {
+                self.total_size -= size;
+            }
+        }
+    }
+}
+
+#[test]
+fn test_sized_cache() {
+    let mut cache = SizedCache::new( 10 );
+    cache.put( 1, "a", 4 );
+    cache.put( 2, "b", 4 );
+    assert_eq!( cache.get( &1 ), Some( &"a" ) );
+
+    // This evicts the least recently used entry, which is now the second one.
+    cache.put( 3, "c", 4 );
+    assert_eq!( cache.get( &2 ), None );
+    assert_eq!( cache.get( &1 ), Some( &"a" ) );
+    assert_eq!( cache.get( &3 ), Some( &"c" ) );
+
+    cache.put( 4, "d", 100 );
+    assert_eq!( cache.get( &1 ), None );
+    assert_eq!( cache.get( &3 ), None );
+    assert_eq!( cache.get( &4 ), Some( &"d" ) );
+
+    cache.remove_if( |&key| key == 4 );
+    assert_eq!( cache.get( &4 ), None );
+    cache.put( 5, "e", 10 );
+    assert_eq!( cache.get( &5 ), Some( &"e" ) );
+
+    let mut evicted = Vec::new();
+    cache.put_and_evict( 6, "f", 5, |key, value| evicted.push( (key, value) ) );
+    assert_eq!( evicted, vec![ (5, "e") ] );
+    assert!( cache.contains( &6 ) );
+    assert_eq!( cache.remove( &6 ), Some( "f" ) );
+    assert!( !cache.contains( &6 ) );
+}
@@ -3,24 +3,37 @@ use std::collections::VecDeque;
 
 use futures;
 
+/// How many bytes can be queued up in the channel before the sender has to wait.
+const BYTE_BUDGET: usize = 4 * 1024 * 1024;
+
 struct Inner< T > {
     buffer: VecDeque< T >,
+    buffered_bytes: usize,
     task: Option< futures::task::Task >,
+    sender_waiting: bool,
     sender_closed: bool,
     receiver_closed: bool
 }
 
 pub struct Sender< T >( Arc< (Condvar, Mutex< Inner< T > >) > );
 
-impl< T > Sender< T > {
+impl< T: AsRef< [u8] > > Sender< T > {
+    /// Whether the other side has hung up.
+    pub fn is_closed( &self ) -> bool {
+        (self.0).1.lock().unwrap().receiver_closed
+    }
+
     pub fn send( &mut self, value: T ) -> Result< (), () > {
+        let length = value.as_ref().len();
         let mut inner = (self.0).1.lock().unwrap();
         if inner.receiver_closed {
             inner.buffer.clear();
             return Err(());
         }
 
-        while inner.buffer.len() >= 16 {
+        // Something always has to be let through, even if it's over the budget by itself.
+        while inner.buffered_bytes > 0 && inner.buffered_bytes + length > BYTE_BUDGET {
+            inner.sender_waiting = true;
             inner = (self.0).0.wait( inner ).unwrap();
             if inner.receiver_closed {
                 inner.buffer.clear();
@@ -29,8 +42,10 @@ impl< T > Sender< T > {
         }
 
         inner.buffer.push_back( value );
+        inner.buffered_bytes += length;
 
-        if let Some( ref mut task ) = inner.task {
+        // Only wake up the receiver if it's actually waiting for something.
+        if let Some( task ) = inner.task.take() {
             task.notify();
         }
 
@@ -42,7 +57,7 @@ impl< T > Drop for Sender< T > {
     fn drop( &mut self ) {
         let mut inner = (self.0).1.lock().unwrap();
         inner.sender_closed = true;
-        if let Some( ref mut task ) = inner.task {
+        if let Some( task ) = inner.task.take() {
             task.notify();
         }
     }
@@ -50,7 +65,7 @@ impl< T > Drop for Sender< T > {
 
 pub struct Receiver< T >( Arc< (Condvar, Mutex< Inner< T > >) > );
 
-impl< T > futures::Stream for Receiver< T > {
+impl< T: AsRef< [u8] > > futures::Stream for Receiver< T > {
     type Item = T;
     type Error = ();
 
@@ -58,7 +73,14 @@ impl< T > futures::Stream for Receiver< T > {
         let mut inner = (self.0).1.lock().unwrap();
         match inner.buffer.pop_front() {
             Some( value ) => {
-                (self.0).0.notify_all();
+                inner.buffered_bytes -= value.as_ref().len();
+
+                // Let the sender fill up a good chunk of the budget at once instead of waking it up after every message.
+                if inner.sender_waiting && inner.buffered_bytes <= BYTE_BUDGET / 2 {
+                    inner.sender_waiting = false;
+                    (self.0).0.notify_all();
+                }
+
                 Ok( futures::Async::Ready( Some( value ) ) )
             },
             None => {
@@ -84,7 +106,9 @@ impl< T > Drop for Receiver< T > {
 pub fn streaming_channel< T >() -> (Sender< T >, Receiver< T >) {
     let inner = Inner {
         buffer: VecDeque::new(),
+        buffered_bytes: 0,
         task: None,
+        sender_waiting: false,
         sender_closed: false,
         receiver_closed: false
     };
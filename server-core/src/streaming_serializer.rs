@@ -35,3 +35,16 @@ impl< F, R, T > Serialize for StreamingSerializer< F, R, T >
         seq.end()
     }
 }
+
+/// Allows the elements to be consumed some other way than by serializing them.
+impl< F, R, T > IntoIterator for StreamingSerializer< F, R, T >
+    where F: FnOnce() -> R,
+          R: Iterator< Item = T >
+{
+    type Item = T;
+    type IntoIter = R;
+
+    fn into_iter( self ) -> R {
+        (self.callback.into_inner().unwrap())()
+    }
+}
@@ -15,7 +15,8 @@ cargo build -p bytehound-cli
 
 echo "Profiling the simulation..."
 export MEMORY_PROFILER_OUTPUT=simulation/memory-profiling-simulation-raw.dat
-LD_PRELOAD=target/debug/libbytehound.so simulation/target/debug/simulation
+# Pass a number of iterations to generate a trace of a deterministic size instead of running for a fixed time.
+LD_PRELOAD=target/debug/libbytehound.so simulation/target/debug/simulation "$@"
 
 target/debug/bytehound postprocess --anonymize=partial -o simulation/memory-profiling-simulation.dat simulation/memory-profiling-simulation-raw.dat
 rm -f simulation/memory-profiling-simulation-raw.dat
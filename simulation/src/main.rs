@@ -110,14 +110,35 @@ fn allocate_both_temporary_and_linear_leak(
 const RUNTIME: u64 = 10;
 
 fn main() {
+    // When given a number of iterations the simulation runs exactly that many of them,
+    // as fast as it can, so that the size of the generated trace is deterministic.
+    let iterations: Option< u64 > = std::env::args().nth( 1 ).map( |arg| arg.parse().expect( "invalid number of iterations" ) );
+
     let mut rng = Rand64::new( 12341234 );
     let start = Instant::now();
+    let mut iteration = 0;
     let mut state_temporary = Vec::new();
     let mut state_linear_leak = Vec::new();
     let mut state_both_temporary_and_linear_leak = Vec::new();
     let mut state_bounded_leak = StateBoundedLeak::default();
 
-    while start.elapsed() < Duration::from_secs( RUNTIME ) {
+    loop {
+        let should_stop_leaking = match iterations {
+            Some( iterations ) => {
+                if iteration >= iterations {
+                    break;
+                }
+                iteration >= iterations / 2
+            },
+            None => {
+                if start.elapsed() >= Duration::from_secs( RUNTIME ) {
+                    break;
+                }
+                start.elapsed() >= Duration::from_secs( RUNTIME / 2 )
+            }
+        };
+        iteration += 1;
+
         allocate_temporary( &mut rng, &mut state_temporary );
         allocate_linear_leak_never_deallocated( &mut rng );
         allocate_linear_leak_deallocated_at_the_end(
@@ -127,14 +148,14 @@ fn main() {
         allocate_bounded_leak(
             &mut rng,
             &mut state_bounded_leak,
-            start.elapsed() >= Duration::from_secs( RUNTIME / 2 )
+            should_stop_leaking
         );
         allocate_both_temporary_and_linear_leak(
             &mut rng,
             &mut state_both_temporary_and_linear_leak
         );
 
-        if rng.rand_float() >= 0.5 {
+        if iterations.is_none() && rng.rand_float() >= 0.5 {
             std::thread::sleep(
                 Duration::from_micros( rng.rand_range( 1..10 ) )
             );
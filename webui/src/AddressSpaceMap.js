@@ -0,0 +1,302 @@
+import React from "react";
+import { fmt_hex16, fmt_full_size } from "./utils.js";
+
+const TILE_WIDTH = 256;
+const MAX_CACHED_TILES = 256;
+const HEIGHT = 120;
+const AXIS_HEIGHT = 20;
+const TICK_COUNT = 5;
+
+// Returns the index of the first region which ends after the `address`.
+function first_region_ending_after( ends, address ) {
+    let low = 0;
+    let high = ends.length;
+    while( low < high ) {
+        const middle = (low + high) >>> 1;
+        if( ends[ middle ] <= address ) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+// Returns which fraction of every pixel is covered by the regions, starting at `address`.
+//
+// The regions are sorted and never overlap, so this only ever looks at the ones which are
+// actually visible, and every pixel is visited at most once per region which covers it.
+function compute_coverage( starts, ends, address, bytes_per_pixel, width ) {
+    const coverage = new Float32Array( width );
+    const end_address = address + bytes_per_pixel * width;
+    for( let i = first_region_ending_after( ends, address ); i < starts.length && starts[ i ] < end_address; ++i ) {
+        let position = Math.max( starts[ i ], address );
+        const region_end = Math.min( ends[ i ], end_address );
+        let pixel = Math.floor( (position - address) / bytes_per_pixel );
+        while( position < region_end && pixel < width ) {
+            const chunk_end = Math.min( address + (pixel + 1) * bytes_per_pixel, region_end );
+            coverage[ pixel ] += (chunk_end - position) / bytes_per_pixel;
+            position = chunk_end;
+            pixel += 1;
+        }
+    }
+
+    return coverage;
+}
+
+// Draws the address space on a canvas.
+//
+// The view is split into tiles which are rendered once and then reused for as long as
+// the zoom level doesn't change, so nothing depends on how many regions there are
+// outside of the tiles which are actually on the screen.
+export default class AddressSpaceMap extends React.Component {
+    canvas = null
+    tiles = new Map()
+    selection = null
+    hover = null
+    frame = null
+
+    constructor() {
+        super()
+        this.onResize = this.onResize.bind( this );
+        this.onMouseDown = this.onMouseDown.bind( this );
+        this.onMouseMove = this.onMouseMove.bind( this );
+        this.onMouseUp = this.onMouseUp.bind( this );
+        this.onMouseLeave = this.onMouseLeave.bind( this );
+        this.onDoubleClick = this.onDoubleClick.bind( this );
+        this.onContextMenu = this.onContextMenu.bind( this );
+    }
+
+    componentDidMount() {
+        window.addEventListener( "resize", this.onResize );
+        this.onResize();
+    }
+
+    componentWillUnmount() {
+        window.removeEventListener( "resize", this.onResize );
+        if( this.frame !== null ) {
+            window.cancelAnimationFrame( this.frame );
+        }
+    }
+
+    componentDidUpdate( prev_props ) {
+        if( prev_props.regions !== this.props.regions ) {
+            this.tiles.clear();
+        }
+
+        this.scheduleRedraw();
+    }
+
+    onResize() {
+        if( !this.canvas ) {
+            return;
+        }
+
+        const width = this.canvas.parentElement.offsetWidth;
+        if( width > 0 && width !== this.canvas.width ) {
+            this.canvas.width = width;
+            this.canvas.height = HEIGHT + AXIS_HEIGHT;
+            this.tiles.clear();
+        }
+
+        this.scheduleRedraw();
+    }
+
+    scheduleRedraw() {
+        if( this.frame !== null ) {
+            return;
+        }
+
+        this.frame = window.requestAnimationFrame( () => {
+            this.frame = null;
+            this.redraw();
+        });
+    }
+
+    bytesPerPixel() {
+        return Math.max( (this.props.x1 - this.props.x0) / this.canvas.width, 1e-6 );
+    }
+
+    toAddress( pixel ) {
+        return this.props.x0 + pixel * this.bytesPerPixel();
+    }
+
+    getTile( index, bytes_per_pixel ) {
+        const key = bytes_per_pixel + ":" + index;
+        let tile = this.tiles.get( key );
+        if( tile !== undefined ) {
+            // Move it to the end so that the least recently used tiles are the first ones to go.
+            this.tiles.delete( key );
+            this.tiles.set( key, tile );
+            return tile;
+        }
+
+        const address = index * TILE_WIDTH * bytes_per_pixel;
+        const coverage = compute_coverage( this.props.regions.starts, this.props.regions.ends, address, bytes_per_pixel, TILE_WIDTH );
+
+        tile = document.createElement( "canvas" );
+        tile.width = TILE_WIDTH;
+        tile.height = HEIGHT;
+        const ctx = tile.getContext( "2d" );
+        for( let pixel = 0; pixel < TILE_WIDTH; ++pixel ) {
+            if( coverage[ pixel ] <= 0 ) {
+                continue;
+            }
+
+            // Partially covered pixels are drawn lighter so that the fragmentation is visible when zoomed out.
+            ctx.fillStyle = "rgba(0, 128, 128, " + (0.25 + 0.75 * Math.min( coverage[ pixel ], 1 )) + ")";
+            ctx.fillRect( pixel, 0, 1, HEIGHT );
+        }
+
+        this.tiles.set( key, tile );
+        if( this.tiles.size > MAX_CACHED_TILES ) {
+            this.tiles.delete( this.tiles.keys().next().value );
+        }
+
+        return tile;
+    }
+
+    redraw() {
+        if( !this.canvas || this.canvas.width === 0 ) {
+            return;
+        }
+
+        const width = this.canvas.width;
+        const ctx = this.canvas.getContext( "2d" );
+        ctx.clearRect( 0, 0, width, HEIGHT + AXIS_HEIGHT );
+
+        const bytes_per_pixel = this.bytesPerPixel();
+        const tile_bytes = TILE_WIDTH * bytes_per_pixel;
+        const first_tile = Math.floor( this.props.x0 / tile_bytes );
+        const last_tile = Math.floor( this.props.x1 / tile_bytes );
+        for( let index = first_tile; index <= last_tile; ++index ) {
+            const x = Math.round( (index * tile_bytes - this.props.x0) / bytes_per_pixel );
+            ctx.drawImage( this.getTile( index, bytes_per_pixel ), x, 0 );
+        }
+
+        ctx.fillStyle = "#666";
+        ctx.strokeStyle = "#666";
+        ctx.font = "11px sans-serif";
+        ctx.beginPath();
+        ctx.moveTo( 0, HEIGHT + 0.5 );
+        ctx.lineTo( width, HEIGHT + 0.5 );
+        for( let tick = 0; tick < TICK_COUNT; ++tick ) {
+            const x = Math.round( tick * (width - 1) / (TICK_COUNT - 1) ) + 0.5;
+            ctx.moveTo( x, HEIGHT );
+            ctx.lineTo( x, HEIGHT + 4 );
+
+            const label = "0x" + fmt_hex16( Math.round( this.toAddress( x ) ) );
+            ctx.textAlign = tick === 0 ? "left" : (tick === TICK_COUNT - 1 ? "right" : "center");
+            ctx.fillText( label, x, HEIGHT + AXIS_HEIGHT - 4 );
+        }
+        ctx.stroke();
+
+        if( this.selection !== null ) {
+            const x0 = Math.min( this.selection[ 0 ], this.selection[ 1 ] );
+            const x1 = Math.max( this.selection[ 0 ], this.selection[ 1 ] );
+            ctx.fillStyle = "rgba(128, 128, 128, 0.33)";
+            ctx.fillRect( x0, 0, x1 - x0, HEIGHT );
+        }
+
+        if( this.hover !== null ) {
+            ctx.strokeStyle = "#de7b18ff";
+            ctx.beginPath();
+            ctx.moveTo( this.hover + 0.5, 0 );
+            ctx.lineTo( this.hover + 0.5, HEIGHT );
+            ctx.stroke();
+        }
+    }
+
+    eventToPixel( event ) {
+        const rect = this.canvas.getBoundingClientRect();
+        return Math.max( 0, Math.min( this.canvas.width - 1, event.clientX - rect.left ) );
+    }
+
+    onMouseDown( event ) {
+        if( event.button !== 0 ) {
+            return;
+        }
+
+        const x = this.eventToPixel( event );
+        this.selection = [x, x];
+        this.scheduleRedraw();
+    }
+
+    onMouseMove( event ) {
+        const x = this.eventToPixel( event );
+        this.hover = x;
+        if( this.selection !== null ) {
+            this.selection[ 1 ] = x;
+        }
+
+        if( this.label ) {
+            const address = Math.round( this.toAddress( x ) );
+            this.label.textContent = "0x" + fmt_hex16( address ) + " (" + fmt_full_size( address ) + ")";
+        }
+
+        this.scheduleRedraw();
+    }
+
+    onMouseUp( event ) {
+        if( this.selection === null ) {
+            return;
+        }
+
+        const x0 = Math.min( this.selection[ 0 ], this.selection[ 1 ] );
+        const x1 = Math.max( this.selection[ 0 ], this.selection[ 1 ] );
+        this.selection = null;
+        this.scheduleRedraw();
+
+        if( x1 - x0 >= 3 && this.props.onZoom ) {
+            this.props.onZoom( this.toAddress( x0 ), this.toAddress( x1 ) );
+        }
+    }
+
+    onMouseLeave() {
+        this.hover = null;
+        this.selection = null;
+        if( this.label ) {
+            this.label.textContent = "";
+        }
+
+        this.scheduleRedraw();
+    }
+
+    onDoubleClick() {
+        if( this.props.onZoom ) {
+            this.props.onZoom( this.props.min, this.props.max );
+        }
+    }
+
+    onContextMenu( event ) {
+        event.preventDefault();
+        if( this.props.onRightClick ) {
+            this.props.onRightClick({
+                event,
+                x: this.toAddress( this.eventToPixel( event ) ),
+                x0: this.props.x0,
+                x1: this.props.x1
+            });
+        }
+
+        return false;
+    }
+
+    render() {
+        return (
+            <div className="AddressSpaceMap">
+                <canvas
+                    ref={ ref => this.canvas = ref }
+                    onMouseDown={this.onMouseDown}
+                    onMouseMove={this.onMouseMove}
+                    onMouseUp={this.onMouseUp}
+                    onMouseLeave={this.onMouseLeave}
+                    onDoubleClick={this.onDoubleClick}
+                    onContextMenu={this.onContextMenu}
+                />
+                <div className="AddressSpaceMap-label" ref={ ref => this.label = ref } />
+            </div>
+        );
+    }
+}
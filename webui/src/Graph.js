@@ -64,36 +64,28 @@ export default class Graph extends React.Component {
         return output;
     }
 
-    getCsvData() {
+    // Dygraph takes the rows as native arrays much faster than it parses them from a CSV.
+    getRows() {
         const data = this.getData();
-
-        let output = "";
-        output += data.x_label + ",";
-        _.each( data.y_labels, y_label => {
-            output += y_label + ",";
-        });
-        output = output.slice( 0, output.length - 1 );
-        output += "\n";
-
+        const rows = new Array( data.xs.length );
         for( let n_row = 0; n_row < data.xs.length; ++n_row ) {
-            const x = data.xs[ n_row ];
-            output += x + ",";
+            const row = new Array( data.ys.length + 1 );
+            row[ 0 ] = data.xs[ n_row ];
 
             let offset = 0;
             for( let n_column = 0; n_column < data.ys.length; ++n_column ) {
                 const raw_value = data.ys[ n_column ][ n_row ] || 0;
                 const y = raw_value + offset;
-                output += y + ",";
+                row[ n_column + 1 ] = y;
                 if( this.props.fill ) {
                     offset += y;
                 }
             }
 
-            output = output.slice( 0, output.length - 1 );
-            output += "\n";
+            rows[ n_row ] = row;
         }
 
-        return output;
+        return rows;
     }
 
     getZoom( props ) {
@@ -213,9 +205,15 @@ export default class Graph extends React.Component {
             return;
         }
 
-        const data = this.getCsvData();
+        const data = this.getData();
         const options = this.getOptions();
-        this.graph = new Dygraph( this.target, data, options );
+        options.labels = [data.x_label].concat( data.y_labels );
+
+        if( this.graph ) {
+            this.graph.destroy();
+        }
+
+        this.graph = new Dygraph( this.target, this.getRows(), options );
         this.width = options.width;
     }
 
@@ -1,11 +1,12 @@
 import _ from "lodash";
 import React from "react";
-import Graph from "./Graph.js";
+import AddressSpaceMap from "./AddressSpaceMap.js";
 import { Button, ButtonGroup, DropdownMenu, DropdownItem } from "reactstrap";
 import { ContextMenu, MenuItem, ContextMenuTrigger } from "react-contextmenu";
 import { Link } from "react-router-dom";
 import classNames from "classnames";
-import { extract_query, create_query, fmt_hex16, fmt_size, fmt_full_size } from "./utils.js";
+import { extract_query, create_query, fmt_hex16, fmt_size } from "./utils.js";
+import { fetch_json } from "./fetch_json.js";
 
 export default class PageDataAddressSpace extends React.Component {
     state = { zoom: {} }
@@ -19,13 +20,11 @@ export default class PageDataAddressSpace extends React.Component {
         const params = extract_query( this.props.location.search );
         const encoded_body = create_query( params ).toString();
         const url = (this.props.sourceUrl || "") + "/data/" + this.props.id + "/regions?" + encoded_body;
-        fetch( url )
-            .then( rsp => rsp.json() )
-            .then( json => this.processData( json ) );
+        fetch_json( url ).then( json => this.processData( json ) );
     }
 
     processData( raw_data ) {
-        let data = [];
+        let groups = [];
         let last = null;
         const regions = raw_data.regions;
         for( let i = 0; i < regions.length; ++i ) {
@@ -33,28 +32,22 @@ export default class PageDataAddressSpace extends React.Component {
             let x1 = regions[ i ][ 1 ];
 
             if( last === null || x0 - last > 1024 * 1024 * 30 ) {
-                data.push( {xs: [], ys: []} );
+                groups.push( {starts: [], ends: []} );
             }
 
             last = x0;
-            const xs = data[ data.length - 1 ].xs;
-            const ys = data[ data.length - 1 ].ys;
-            xs.push( x0 - 0.0001 );
-            ys.push( 0 );
-            xs.push( x0 );
-            ys.push( 1 );
-            xs.push( x1 );
-            ys.push( 1 );
-            xs.push( x1 + 0.0001 );
-            ys.push( 0 );
-            data[ data.length - 1 ].allocated += x1 - x0;
+            groups[ groups.length - 1 ].starts.push( x0 );
+            groups[ groups.length - 1 ].ends.push( x1 );
         }
 
+        const data = [];
         const zoom = [];
-        for( let i = 0; i < data.length; ++i ) {
-            const xs = data[ i ].xs;
-            const min = Math.round( xs[ 0 ] );
-            const max = Math.round( xs[ xs.length - 1 ] );
+        for( let i = 0; i < groups.length; ++i ) {
+            const starts = Float64Array.from( groups[ i ].starts );
+            const ends = Float64Array.from( groups[ i ].ends );
+            const min = starts[ 0 ];
+            const max = ends[ ends.length - 1 ];
+            data.push( {starts, ends, min, max} );
             zoom.push( [min, max] );
         }
 
@@ -75,20 +68,14 @@ export default class PageDataAddressSpace extends React.Component {
             output.push(
                 <div key={"as_" + i}>
                 <h2 className="h3">0x{fmt_hex16( min )} - 0x{fmt_hex16( max )} ({fmt_size( max - min )})</h2>
-                <Graph
-                    data={data[ i ]}
+                <AddressSpaceMap
+                    regions={data[ i ]}
+                    min={data[ i ].min}
+                    max={data[ i ].max}
+                    x0={this.state.zoom[ i ][ 0 ]}
+                    x1={this.state.zoom[ i ][ 1 ]}
                     onZoom={this.onZoom.bind(this, i)}
                     onRightClick={this.onRightClick.bind(this, i)}
-                    showYValue={false}
-                    xUnit={x => fmt_hex16( Math.round( x ) )}
-                    x_legend_formatter={x =>
-                        fmt_hex16( Math.round( x ) ) + "<br />" + fmt_full_size( Math.round( x ) )
-                    }
-                    y_label=""
-                    fill={true}
-                    includeZero={false}
-                    drawY={false}
-                    fillAlpha={1.0}
                 />
                 <ContextMenuTrigger id={"context_menu_" + i} ref={c => this.context_triggers[ i ] = c}></ContextMenuTrigger>
                 <ContextMenu id={"context_menu_" + i}>
@@ -6,7 +6,8 @@ import { Link } from "react-router-dom";
 import { ContextMenu, MenuItem, ContextMenuTrigger } from "react-contextmenu";
 import AceEditor from "react-ace";
 import Tabbed from "./Tabbed.js";
-import { fmt_size, fmt_date_unix_ms, fmt_hex16, fmt_uptime_timeval, fmt_duration_for_display, update_query, create_query, extract_query } from "./utils.js";
+import { fmt_size, fmt_date_unix_ms, fmt_date_timeval, fmt_hex16, fmt_uptime_timeval, fmt_duration_for_display, update_query, create_query, extract_query } from "./utils.js";
+import { fetch_json } from "./fetch_json.js";
 
 import {
     DATE_FIELD,
@@ -21,6 +22,7 @@ import {
 
     ControlBase,
     FilterEditorBase,
+    VirtualRows,
 
     fmt_or_percent,
     backtrace_cell,
@@ -428,12 +430,21 @@ class Control extends ControlBase {
                 <Input type="checkbox" id="group-by-backtraces" checked={this.props.groupByBacktraces} onChange={this.onGroupByBacktracesChanged.bind(this)} />{' '}
                 Group by backtraces
             </Label>
+            <Label check className="ml-5">
+                <Input type="checkbox" id="show-call-tree" checked={this.props.showCallTree} onChange={this.onShowCallTreeChanged.bind(this)} />{' '}
+                Call tree
+            </Label>
+            <Label check className="ml-5">
+                <Input type="checkbox" id="continuous-scrolling" checked={this.props.continuousScrolling} onChange={this.onContinuousScrollingChanged.bind(this)} />{' '}
+                Continuous scrolling
+            </Label>
         </div>
     }
 
     renderMenu() {
         let fullDataUrl;
         let heaptrackUrl;
+        let pprofUrl;
         let treeUrl;
         let flamegraphUrl;
         let scriptingUrl;
@@ -446,6 +457,9 @@ class Control extends ControlBase {
             data_url.pathname = "/data/" + this.props.id + "/export/heaptrack/heaptrack.dat";
             heaptrackUrl = data_url.toString();
 
+            data_url.pathname = "/data/" + this.props.id + "/export/pprof/heap.pb.gz";
+            pprofUrl = data_url.toString();
+
             data_url.pathname = "/data/" + this.props.id + "/allocation_ascii_tree";
             treeUrl = data_url.toString();
 
@@ -470,6 +484,9 @@ class Control extends ControlBase {
                 <MenuItem>
                     <a href={heaptrackUrl || "#"}>Download as Heaptrack data file</a>
                 </MenuItem>
+                <MenuItem>
+                    <a href={pprofUrl || "#"}>Download as pprof profile</a>
+                </MenuItem>
                 <MenuItem>
                     <a href={treeUrl || "#"}>Download as ASCII tree</a>
                 </MenuItem>
@@ -495,6 +512,18 @@ class Control extends ControlBase {
         }
     }
 
+    onShowCallTreeChanged( event ) {
+        if( this.props.onShowCallTreeChanged ) {
+            this.props.onShowCallTreeChanged( event.target.checked )
+        }
+    }
+
+    onContinuousScrollingChanged( event ) {
+        if( this.props.onContinuousScrollingChanged ) {
+            this.props.onContinuousScrollingChanged( event.target.checked )
+        }
+    }
+
     openScriptingConsole() {
         let code = "";
         if( this.props.filterAsScript.prologue !== "" ) {
@@ -512,6 +541,24 @@ class Control extends ControlBase {
     }
 }
 
+function fmt_lifetime( entry ) {
+    if( !entry.deallocation ) {
+        return "∞";
+    }
+
+    let interval = {
+        secs: entry.deallocation.timestamp.secs - entry.timestamp.secs,
+        fract_nsecs: entry.deallocation.timestamp.fract_nsecs - entry.timestamp.fract_nsecs,
+    };
+
+    if( interval.fract_nsecs < 0 ) {
+        interval.secs -= 1;
+        interval.fract_nsecs += 1000000000;
+    }
+
+    return fmt_uptime_timeval( interval );
+}
+
 function get_data_url( source_url, id, params ) {
     const group_allocations = params.group_allocations === "true" || params.group_allocations === "1";
     let source;
@@ -521,7 +568,298 @@ function get_data_url( source_url, id, params ) {
         source = "allocations";
     }
 
-    return get_data_url_generic( source_url, source, id, _.omit( params, "show_full_backtraces", "group_allocations" ) )
+    const query = {..._.omit( params, "show_full_backtraces", "group_allocations" ), separate_backtraces: true};
+    return get_data_url_generic( source_url, source, id, query )
+}
+
+// Every unique backtrace is only sent once, so put them back into the rows which refer to them.
+// This modifies the `data` in place, and does nothing if it was already resolved,
+// since the same cached response can be resolved more than once.
+function resolve_backtraces( data ) {
+    if( !data.backtraces ) {
+        return data;
+    }
+
+    const backtraces = data.backtraces;
+    const resolve = object => {
+        if( object && object.backtrace_id !== undefined && object.backtrace_id !== null ) {
+            object.backtrace = backtraces[ object.backtrace_id ] || [];
+        }
+    };
+
+    for( const row of data.allocations || [] ) {
+        resolve( row );
+        resolve( row.deallocation );
+        resolve( row.chain_deallocation );
+    }
+
+    delete data.backtraces;
+    return data;
+}
+
+// Shows how the requested sizes of a single group map onto the size classes of the common allocators.
+class SizeClasses extends React.Component {
+    state = { data: null, error: null, allocator: "glibc" };
+
+    componentDidMount() {
+        fetch_json( this.props.url )
+            .then( data => this.setState({ data }) )
+            .catch( error => this.setState({ error: "" + error }) );
+    }
+
+    render() {
+        if( this.state.error ) {
+            return <div>Failed to fetch the size classes: {this.state.error}</div>;
+        }
+
+        if( !this.state.data ) {
+            return <div>Loading the size classes...</div>;
+        }
+
+        const histogram = this.state.data.find( histogram => histogram.allocator === this.state.allocator ) || this.state.data[ 0 ];
+        return (
+            <div className="size-classes">
+                <div>
+                    {this.state.data.map( histogram =>
+                        <Label key={histogram.allocator} check style={{marginRight: "1rem"}}>
+                            <Input
+                                type="radio"
+                                checked={histogram.allocator === this.state.allocator}
+                                onChange={() => this.setState({ allocator: histogram.allocator })}
+                            />
+                            {histogram.allocator}
+                        </Label>
+                    )}
+                </div>
+                <div>
+                    Requested {fmt_size( histogram.requested )}, wasted {fmt_size( histogram.slack )} as slack
+                    (the profiled allocator reported {fmt_size( histogram.recorded_slack )})
+                </div>
+                <table className="table table-sm">
+                    <thead>
+                        <tr>
+                            <th>Size class</th>
+                            <th>Requested sizes</th>
+                            <th>Count</th>
+                            <th>Slack</th>
+                            <th>Trim by</th>
+                            <th>Savings if trimmed</th>
+                        </tr>
+                    </thead>
+                    <tbody>
+                        {histogram.size_classes.map( size_class =>
+                            <tr key={size_class.size_class}>
+                                <td>{size_class.size_class}</td>
+                                <td>{size_class.min_requested_size === size_class.max_requested_size ? size_class.min_requested_size : size_class.min_requested_size + " - " + size_class.max_requested_size}</td>
+                                <td>{size_class.count}</td>
+                                <td>{fmt_size( size_class.slack )}</td>
+                                <td>{size_class.trim_by === null ? "" : size_class.trim_by + " → " + size_class.previous_size_class}</td>
+                                <td>{fmt_size( size_class.savings_if_trimmed )}</td>
+                            </tr>
+                        )}
+                    </tbody>
+                </table>
+            </div>
+        );
+    }
+}
+
+// How many of the biggest children of a node of the call tree are shown.
+const CALL_TREE_CHILDREN_LIMIT = 100;
+
+// Lists the children of a single node of the call tree; they're only fetched once the node is expanded.
+class CallTreeChildren extends React.Component {
+    state = { data: null, error: null };
+
+    componentDidMount() {
+        fetch_json( this.props.url + "&node=" + this.props.node + "&count=" + CALL_TREE_CHILDREN_LIMIT )
+            .then( data => this.setState({ data }) )
+            .catch( error => this.setState({ error: "" + error }) );
+    }
+
+    render() {
+        if( this.state.error ) {
+            return <div>Failed to fetch the call tree: {this.state.error}</div>;
+        }
+
+        if( !this.state.data ) {
+            return <div>Loading...</div>;
+        }
+
+        const data = this.state.data;
+        const total = this.props.total !== undefined ? this.props.total : data.node.total_size;
+        let omitted = null;
+        if( data.omitted_children > 0 ) {
+            omitted = (
+                <li className="call-tree-omitted">
+                    ...and {data.omitted_children} more, with {fmt_size( data.omitted_size )} in {data.omitted_count} allocation(s)
+                </li>
+            );
+        }
+
+        return (
+            <ul className="call-tree">
+                {data.children.map( child => <CallTreeNode key={child.id} url={this.props.url} node={child} total={total} /> )}
+                {omitted}
+            </ul>
+        );
+    }
+}
+
+class CallTreeNode extends React.Component {
+    state = { expanded: false };
+
+    render() {
+        const node = this.props.node;
+        const percent = this.props.total > 0 ? (node.total_size * 100 / this.props.total).toFixed( 1 ) : "0.0";
+        let toggle;
+        if( node.child_count > 0 ) {
+            toggle = <a href="#" className="call-tree-toggle" onClick={event => {
+                event.preventDefault();
+                this.setState({ expanded: !this.state.expanded });
+            }}>{this.state.expanded ? "\u25be" : "\u25b8"}</a>;
+        } else {
+            toggle = <span className="call-tree-toggle" />;
+        }
+
+        return (
+            <li>
+                {toggle}
+                <span className="call-tree-size">{fmt_size( node.total_size )} ({percent}%), {node.total_count} allocation(s)</span>
+                {node.label}
+                {this.state.expanded ? <CallTreeChildren url={this.props.url} node={node.id} total={this.props.total} /> : null}
+            </li>
+        );
+    }
+}
+
+class CallTree extends React.Component {
+    state = { bottomUp: false };
+
+    render() {
+        const url = this.props.url + "&bottom_up=" + this.state.bottomUp;
+        return (
+            <div className="call-tree-parent">
+                <Label check style={{marginRight: "1rem"}}>
+                    <Input type="radio" checked={!this.state.bottomUp} onChange={() => this.setState({ bottomUp: false })} />
+                    Top-down
+                </Label>
+                <Label check style={{marginRight: "1rem"}}>
+                    <Input type="radio" checked={this.state.bottomUp} onChange={() => this.setState({ bottomUp: true })} />
+                    Bottom-up
+                </Label>
+                <CallTreeChildren key={url} url={url} node={0} />
+            </div>
+        );
+    }
+}
+
+const VIRTUAL_ROW_HEIGHT = 28;
+
+// All of the matched allocations as a single list which only fetches the rows which are scrolled
+// into view; the backtraces aren't sent with the rows, and are only fetched for the selected one.
+class VirtualAllocations extends React.Component {
+    state = { totalCount: null, selected: null, backtraces: null, error: null };
+
+    componentDidMount() {
+        fetch_json( this.props.url + "&count=0" )
+            .then( data => {
+                if( data.error ) {
+                    return Promise.reject( data.error );
+                }
+
+                this.setState({ totalCount: data.total_count });
+                if( this.props.onTotalCount ) {
+                    this.props.onTotalCount( data.total_count );
+                }
+            })
+            .catch( error => this.setState({ error: "" + error }) );
+    }
+
+    fetchRows( skip, count ) {
+        return fetch_json( this.props.url + "&skip=" + skip + "&count=" + count ).then( data => {
+            if( data.error ) {
+                return Promise.reject( data.error );
+            }
+
+            return data.allocations;
+        });
+    }
+
+    select( row ) {
+        const ids = [row.backtrace_id];
+        if( row.deallocation && !_.isNil( row.deallocation.backtrace_id ) ) {
+            ids.push( row.deallocation.backtrace_id );
+        }
+
+        this.setState({ selected: row, backtraces: null });
+        fetch_json( this.props.backtracesUrl + "?ids=" + ids.join( "," ) )
+            .then( data => {
+                if( this.state.selected === row ) {
+                    this.setState({ backtraces: data.backtraces });
+                }
+            })
+            .catch( error => this.setState({ error: "" + error }) );
+    }
+
+    renderRow( row, index ) {
+        if( !row ) {
+            return <div className="virtual-row">Loading...</div>;
+        }
+
+        const selected = this.state.selected && this.state.selected.id === row.id;
+        return (
+            <div className={"virtual-row" + (selected ? " selected" : "")} onClick={() => this.select( row )}>
+                <div style={{width: "4rem"}}>{index + 1}</div>
+                <div style={{width: "14rem"}}>{fmt_date_timeval( row.timestamp )}</div>
+                <div style={{width: "7rem"}}>{fmt_lifetime( row )}</div>
+                <div style={{width: "10rem"}}>{row.address_s}</div>
+                <div style={{width: "5rem"}}>{fmt_hex16( row.thread )}</div>
+                <div style={{width: "7rem"}}>{fmt_size( row.size )}</div>
+            </div>
+        );
+    }
+
+    render() {
+        if( this.state.error ) {
+            return <div>Failed to fetch the allocations: {this.state.error}</div>;
+        }
+
+        if( this.state.totalCount === null ) {
+            return <div>Loading...</div>;
+        }
+
+        let details = null;
+        if( this.state.selected ) {
+            if( !this.state.backtraces ) {
+                details = <div>Loading the backtrace...</div>;
+            } else if( this.state.backtraces.length > 1 ) {
+                details = [
+                    <div key="allocated" style={{fontStyle: "italic"}}>Allocated at:</div>,
+                    <div key="allocation" className="backtrace-cell">{backtrace_cell( this.props.showFullBacktraces, this.state.backtraces[ 0 ] )}</div>,
+                    <div key="deallocated" style={{fontStyle: "italic", marginTop: "1rem"}}>Deallocated at:</div>,
+                    <div key="deallocation" className="backtrace-cell">{backtrace_cell( this.props.showFullBacktraces, this.state.backtraces[ 1 ] )}</div>
+                ];
+            } else {
+                details = <div className="backtrace-cell">{backtrace_cell( this.props.showFullBacktraces, this.state.backtraces[ 0 ] )}</div>;
+            }
+        }
+
+        return (
+            <div className="virtual-allocations">
+                <VirtualRows
+                    totalCount={this.state.totalCount}
+                    rowHeight={VIRTUAL_ROW_HEIGHT}
+                    height="60vh"
+                    fetchRows={this.fetchRows.bind( this )}
+                    renderRow={this.renderRow.bind( this )}
+                />
+                <div className="backtrace-parent">
+                    {details}
+                </div>
+            </div>
+        );
+    }
 }
 
 export default class PageDataAllocations extends React.Component {
@@ -541,6 +879,8 @@ export default class PageDataAllocations extends React.Component {
         const show_graphs = q.get( "generate_graphs" ) === "true" || q.get( "generate_graphs" ) === "1";
         const show_full_backtraces = q.get( "show_full_backtraces" ) === "true" || q.get( "show_full_backtraces" ) === "1";
         const group_by_backtraces = q.get( "group_allocations" ) === "true" || q.get( "group_allocations" ) === "1";
+        const show_call_tree = q.get( "show_call_tree" ) === "true" || q.get( "show_call_tree" ) === "1";
+        const continuous_scrolling = !group_by_backtraces && (q.get( "continuous_scrolling" ) === "true" || q.get( "continuous_scrolling" ) === "1");
 
         const columns = [
             {
@@ -555,23 +895,7 @@ export default class PageDataAllocations extends React.Component {
             {
                 id: "lifetime",
                 Header: "Lifetime",
-                accessor: entry => {
-                    if( !entry.deallocation ) {
-                        return "∞";
-                    } else {
-                        let interval = {
-                            secs: entry.deallocation.timestamp.secs - entry.timestamp.secs,
-                            fract_nsecs: entry.deallocation.timestamp.fract_nsecs - entry.timestamp.fract_nsecs,
-                        };
-
-                        if( interval.fract_nsecs < 0 ) {
-                            interval.secs -= 1;
-                            interval.fract_nsecs += 1000000000;
-                        }
-
-                        return fmt_uptime_timeval( interval );
-                    }
-                },
+                accessor: fmt_lifetime,
                 maxWidth: 90,
                 sortable: false,
                 view: "allocations"
@@ -706,6 +1030,24 @@ export default class PageDataAllocations extends React.Component {
                 maxWidth: 95,
                 view: "grouped"
             },
+            {
+                id: "all.lifetime_p99",
+                Header: <div>(global)<br />p99 lifetime</div>,
+                Cell: cell => {
+                    const data = cell.original.all;
+                    if( !data.lifetime_p99 ) {
+                        return "";
+                    }
+
+                    return (
+                        <div title={"p50: " + fmt_uptime_timeval( data.lifetime_p50 ) + ", p90: " + fmt_uptime_timeval( data.lifetime_p90 )}>
+                            {fmt_uptime_timeval( data.lifetime_p99 )}
+                        </div>
+                    );
+                },
+                maxWidth: 95,
+                view: "grouped"
+            },
             {
                 id: "all.allocated_count",
                 Header: <div>(global)<br />Allocated</div>,
@@ -778,6 +1120,57 @@ export default class PageDataAllocations extends React.Component {
                 },
                 maxWidth: 85,
                 view: "grouped"
+            },
+            {
+                id: "only_matched.slack",
+                Header: <div>(matched)<br />Slack</div>,
+                Cell: cell => {
+                    return fmt_size( cell.original.only_matched.slack );
+                },
+                maxWidth: 85,
+                sortable: false,
+                view: "grouped"
+            },
+            {
+                id: "only_matched.copy_amplification",
+                Header: <div>(matched)<br />Realloc copies</div>,
+                Cell: cell => {
+                    const data = cell.original.only_matched;
+                    if( !data.bytes_copied ) {
+                        return "";
+                    }
+
+                    return (
+                        <div title={"Copied " + fmt_size( data.bytes_copied ) + " while reallocating"}>
+                            {data.copy_amplification.toFixed( 2 )}x
+                        </div>
+                    );
+                },
+                maxWidth: 85,
+                view: "grouped"
+            },
+            {
+                id: "only_matched.cross_thread_free_count",
+                Header: <div>(matched)<br />Freed elsewhere</div>,
+                Cell: cell => {
+                    const data = cell.original.only_matched;
+                    if( !data.cross_thread_free_count ) {
+                        return "";
+                    }
+
+                    const title =
+                        fmt_size( data.cross_thread_free_size ) + " deallocated on a different thread, after " +
+                        fmt_uptime_timeval( data.cross_thread_free_latency ) + " on average";
+
+                    return (
+                        <div title={title}>
+                            {data.cross_thread_free_count}
+                        </div>
+                    );
+                },
+                maxWidth: 85,
+                sortable: false,
+                view: "grouped"
             }
         ].filter( (column) => {
             if( column.view === "allocations" && this.state.group ) {
@@ -804,6 +1197,26 @@ export default class PageDataAllocations extends React.Component {
 
         const table_sorted = [];
         const p = extract_query( this.props.location.search );
+
+        let call_tree = null;
+        if( show_call_tree ) {
+            const tq = _.omit( p, "page", "page_size", "generate_graphs", "show_full_backtraces", "group_allocations", "sort_by", "order", "show_call_tree" );
+            const url = (this.props.sourceUrl || "") + "/data/" + this.props.id + "/call_tree?" + create_query( tq ).toString();
+            call_tree = <CallTree key={url} url={url} />;
+        }
+
+        let virtual_allocations = null;
+        if( continuous_scrolling ) {
+            const vq = {..._.omit( p, "page", "page_size", "generate_graphs", "show_full_backtraces", "group_allocations", "show_call_tree", "continuous_scrolling" ), omit_backtraces: true};
+            const url = (this.props.sourceUrl || "") + "/data/" + this.props.id + "/allocations?" + create_query( vq ).toString();
+            virtual_allocations = <VirtualAllocations
+                key={url}
+                url={url}
+                backtracesUrl={(this.props.sourceUrl || "") + "/data/" + this.props.id + "/backtraces"}
+                showFullBacktraces={show_full_backtraces}
+                onTotalCount={total_count => this.setState({ virtualTotalCount: total_count })}
+            />;
+        }
         if( p.sort_by || p.order ) {
             table_sorted[ 0 ] = {
                 id: p.sort_by || "timestamp",
@@ -821,12 +1234,14 @@ export default class PageDataAllocations extends React.Component {
                 <Control
                     id={this.props.id}
                     location={this.props.location}
-                    totalCount={this.state.data.total_count}
+                    totalCount={continuous_scrolling ? this.state.virtualTotalCount : this.state.data.total_count}
                     page={page}
                     pageSize={page_size}
                     showGraphs={show_graphs}
                     showFullBacktraces={show_full_backtraces}
                     groupByBacktraces={group_by_backtraces}
+                    showCallTree={show_call_tree}
+                    continuousScrolling={continuous_scrolling}
                     filter={extract_query( this.props.location.search )}
                     filterAsScript={this.state.filterAsScript}
                     dataUrl={this.state.lastDataUrl}
@@ -848,11 +1263,18 @@ export default class PageDataAllocations extends React.Component {
                             otherOrder: p.order
                         });
                     }}
+                    onShowCallTreeChanged={value => {
+                        update_query( this.props, {show_call_tree: value} );
+                    }}
+                    onContinuousScrollingChanged={value => {
+                        update_query( this.props, {continuous_scrolling: value} );
+                    }}
                     onFilterChange={(filter) => {
                         update_query( this.props, filter );
                     }}
                 />
-                <ReactTable
+                {call_tree}
+                {virtual_allocations || <ReactTable
                     manual
                     data={this.state.data.allocations}
                     pages={this.state.pages}
@@ -956,15 +1378,31 @@ export default class PageDataAllocations extends React.Component {
                             );
                         }
 
+                        let size_classes = null;
+                        if( this.state.group ) {
+                            const backtrace_id = row.original.backtrace_id;
+                            if( this.state.sizeClassesFor === backtrace_id ) {
+                                const sq = {..._.omit( q, "page", "page_size", "generate_graphs", "show_full_backtraces" ), backtraces: backtrace_id};
+                                const url = (this.props.sourceUrl || "") + "/data/" + this.props.id + "/size_classes?" + create_query( sq ).toString();
+                                size_classes = <SizeClasses key={url} url={url} />;
+                            } else {
+                                size_classes = <a href="#" onClick={event => {
+                                    event.preventDefault();
+                                    this.setState({ sizeClassesFor: backtrace_id });
+                                }}>Show size classes...</a>;
+                            }
+                        }
+
                         return <div className="backtrace-parent">
                             <div>
                                 {cell}
+                                {size_classes}
                             </div>
                             {graph}
                         </div>;
                     }}
                     expanded={expanded}
-                />
+                />}
                 <ContextMenuTrigger id="allocation_context_menu" ref={c => this.allocation_menu_trigger = c}>
                     <div />
                 </ContextMenuTrigger>
@@ -999,19 +1437,13 @@ export default class PageDataAllocations extends React.Component {
             loading: true,
             filterAsScript: null
         });
-        fetch( data_url )
-            .then( response => {
-                if( response.status !== 200 ) {
-                    return response.text().then( error => Promise.reject( error ) );
-                }
-
-                return response.json();
-             })
+        fetch_json( data_url )
             .then( data => {
                 if( data.error ) {
                     return Promise.reject( data.error );
                 }
 
+                resolve_backtraces( data );
                 const pages = Math.floor( (data.total_count / params.page_size) ) + (((data.total_count % params.page_size) !== 0) ? 1 : 0);
                 this.setState({
                     data,
@@ -36,6 +36,10 @@ export default class PageDataList extends React.Component {
                 id: "runtime",
                 Header: "Runtime",
                 Cell: cell => {
+                    // This is only known once the data was loaded.
+                    if( !cell.original.runtime ) {
+                        return "";
+                    }
                     return fmt_uptime( cell.original.runtime.secs );
                 },
                 maxWidth: 150
@@ -43,6 +47,9 @@ export default class PageDataList extends React.Component {
             {
                 Header: "Allocated",
                 Cell: cell => {
+                    if( cell.value === null ) {
+                        return "";
+                    }
                     return fmt_size( cell.value ) + "B";
                 },
                 accessor: "final_allocated",
@@ -51,6 +58,9 @@ export default class PageDataList extends React.Component {
             {
                 Header: "Allocated count",
                 Cell: cell => {
+                    if( cell.value === null ) {
+                        return "";
+                    }
                     return fmt_size( cell.value );
                 },
                 accessor: "final_allocated_count",
@@ -3,6 +3,7 @@ import { Link } from "react-router-dom";
 import Feather from "./Feather.js";
 import { timestamp_cell, backtrace_cell } from "./list-common.js";
 import { fmt_size, fmt_hex16, fmt_uptime_timeval } from "./utils.js";
+import { fetch_json } from "./fetch_json.js";
 
 function size_cell( size, last_size ) {
     let classes = [];
@@ -32,8 +33,7 @@ export default class PageDataMapDetails extends React.Component {
     state = {}
 
     componentDidMount() {
-        fetch( (this.props.sourceUrl || "") + "/data/" + this.props.id + "/maps?with_regions=true&with_usage_history=true&id=" + this.props.map_id )
-            .then( rsp => rsp.json() )
+        fetch_json( (this.props.sourceUrl || "") + "/data/" + this.props.id + "/maps?with_regions=true&with_usage_history=true&id=" + this.props.map_id )
             .then( json => this.setState( {details: json.maps[0]} ) );
     }
 
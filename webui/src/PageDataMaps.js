@@ -7,6 +7,7 @@ import { ContextMenu, MenuItem, ContextMenuTrigger } from "react-contextmenu";
 import AceEditor from "react-ace";
 import Tabbed from "./Tabbed.js";
 import { fmt_size, fmt_date_unix_ms, fmt_hex16, fmt_uptime_timeval, fmt_duration_for_display, update_query, create_query, extract_query } from "./utils.js";
+import { fetch_json } from "./fetch_json.js";
 
 import {
     DATE_FIELD,
@@ -80,6 +81,16 @@ const FIELDS = {
         label: "Max peak RSS",
         badge: value => "Peak RSS at most " + fmt_size( value, false ) + "B"
     },
+    peak_huge_pages_min: {
+        ...SIZE_FIELD,
+        label: "Min peak huge pages",
+        badge: value => "Peak huge pages at least " + fmt_size( value, false ) + "B"
+    },
+    peak_huge_pages_max: {
+        ...SIZE_FIELD,
+        label: "Max peak huge pages",
+        badge: value => "Peak huge pages at most " + fmt_size( value, false ) + "B"
+    },
     backtrace_depth_min: {
         ...POSITIVE_INTEGER_FIELD,
         label: "Min backtrace depth",
@@ -190,6 +201,18 @@ const FIELDS = {
             only_false: "Only not executable",
         }
     },
+    huge_page_advised: {
+        ...RADIO_FIELD,
+        variants: {
+            "": "Show all",
+            only_true: "Only MADV_HUGEPAGE",
+            only_false: "Only not MADV_HUGEPAGE",
+        },
+        badge: {
+            only_true: "Only MADV_HUGEPAGE",
+            only_false: "Only not MADV_HUGEPAGE",
+        }
+    },
 };
 
 const EMPTY_CUSTOM_FILTER = "return maps();";
@@ -229,6 +252,11 @@ class FilterEditor extends FilterEditorBase {
                         <div className="px-2" />
                         {this.field("peak_rss_max")}
                     </div>
+                    <div className="d-flex flex-row">
+                        {this.field("peak_huge_pages_min")}
+                        <div className="px-2" />
+                        {this.field("peak_huge_pages_max")}
+                    </div>
                 </div>
                 <div title="By lifetime" className="d-flex">
                     <div className="d-flex flex-column">
@@ -275,6 +303,9 @@ class FilterEditor extends FilterEditorBase {
                         <div className="px-2" />
                         {this.field("executable")}
                     </div>
+                    <div className="d-flex flex-row">
+                        {this.field("huge_page_advised")}
+                    </div>
                 </div>
                 <div title="Custom">
                     <div className="editor-pane">
@@ -372,7 +403,37 @@ class Control extends ControlBase {
 }
 
 function get_data_url( source_url, id, params ) {
-    return get_data_url_generic( source_url, "maps", id, _.omit( params, "show_full_backtraces" ) )
+    return get_data_url_generic( source_url, "maps", id, {..._.omit( params, "show_full_backtraces" ), with_sparklines: true} )
+}
+
+const SPARKLINE_SERIES = [
+    ["rss", "#1f77b4", "RSS"],
+    ["dirty", "#ff7f0e", "Dirty"],
+    ["swap", "#d62728", "Swap"]
+];
+
+function sparkline_cell( sparkline ) {
+    if( !sparkline ) {
+        return <div>-</div>;
+    }
+
+    const width = 120;
+    const height = 32;
+    const max = Math.max( 1, ...sparkline.rss, ...sparkline.swap );
+    const lines = SPARKLINE_SERIES.map( ([key, color]) => {
+        const values = sparkline[ key ];
+        const step = width / Math.max( 1, values.length - 1 );
+        const points = values.map( (value, index) => (index * step).toFixed( 1 ) + "," + (height - value / max * (height - 1)).toFixed( 1 ) ).join( " " );
+        return <polyline key={key} points={points} fill="none" stroke={color} strokeWidth="1" />;
+    });
+
+    const title = SPARKLINE_SERIES.map( ([key, _color, label]) => label + ": peak " + fmt_size( Math.max( ...sparkline[ key ] ) * 1024 ) + "B" ).join( ", " );
+    return (
+        <svg width={width} height={height} style={{display: "block"}}>
+            <title>{title}</title>
+            {lines}
+        </svg>
+    );
 }
 
 export default class PageDataAllocations extends React.Component {
@@ -494,6 +555,43 @@ export default class PageDataAllocations extends React.Component {
                 maxWidth: 80,
                 sortable: true,
             },
+            {
+                Header: "Usage",
+                Cell: cell => sparkline_cell( cell.original.sparkline ),
+                id: "sparkline",
+                maxWidth: 140,
+                sortable: false,
+            },
+            {
+                Header: "Peak THP",
+                Cell: cell => {
+                    let advice = "";
+                    if( cell.original.is_huge_page_advised ) {
+                        advice = "MADV_HUGEPAGE";
+                    } else if( cell.original.is_no_huge_page_advised ) {
+                        advice = "MADV_NOHUGEPAGE";
+                    }
+
+                    return <div>{fmt_size( cell.value )}<br />{advice}</div>;
+                },
+                accessor: "peak_huge_pages",
+                maxWidth: 120,
+                sortable: true,
+            },
+            {
+                Header: "Purged",
+                Cell: cell => {
+                    if( cell.original.purge_count === 0 ) {
+                        return <div>-</div>;
+                    }
+
+                    const title = cell.original.purge_count + " purges; RSS reclaimed: " + fmt_size( cell.original.reclaimed ) + ", refaulted: " + fmt_size( cell.original.refaulted );
+                    return <div title={title}>{fmt_size( cell.value )}<br />(-{fmt_size( cell.original.reclaimed )} / +{fmt_size( cell.original.refaulted )})</div>;
+                },
+                accessor: "purged",
+                maxWidth: 120,
+                sortable: true,
+            },
             {
                 Header: "Name",
                 accessor: "name",
@@ -692,14 +790,7 @@ export default class PageDataAllocations extends React.Component {
             loading: true,
             filterAsScript: null
         });
-        fetch( data_url )
-            .then( response => {
-                if( response.status !== 200 ) {
-                    return response.text().then( error => Promise.reject( error ) );
-                }
-
-                return response.json();
-             })
+        fetch_json( data_url )
             .then( data => {
                 if( data.error ) {
                     return Promise.reject( data.error );
@@ -6,6 +6,7 @@ import { ContextMenu, MenuItem, ContextMenuTrigger } from "react-contextmenu";
 import { Link } from "react-router-dom";
 import classNames from "classnames";
 import { fmt_date_unix_ms, fmt_uptime, fmt_size } from "./utils.js";
+import { fetch_json } from "./fetch_json.js";
 import Feather from "./Feather.js";
 
 class Switcher extends React.Component {
@@ -49,25 +50,264 @@ class Switcher extends React.Component {
     }
 }
 
+const TIMELINES = ["timeline", "timeline_leaked", "timeline_device", "timeline_maps", "timeline_cgroup"];
+
+// Replaces the part of the `overview` covered by the more detailed `detail`.
+function splice_timeline( overview, detail ) {
+    if( !overview || detail.xs.length === 0 ) {
+        return detail;
+    }
+
+    const x0 = detail.xs[ 0 ];
+    const x1 = detail.xs[ detail.xs.length - 1 ];
+    const start = _.sortedIndex( overview.xs, x0 );
+    const end = _.sortedLastIndex( overview.xs, x1 );
+
+    let output = {};
+    _.each( overview, (values, key) => {
+        output[ key ] = values.slice( 0, start ).concat( detail[ key ], values.slice( end ) );
+    });
+
+    return output;
+}
+
+// Replaces the points of the `timeline` from the first point of the `update` onwards.
+function append_timeline( timeline, update ) {
+    if( !timeline || update.xs.length === 0 ) {
+        return timeline || update;
+    }
+
+    const start = _.sortedIndex( timeline.xs, update.xs[ 0 ] );
+
+    let output = {};
+    _.each( timeline, (values, key) => {
+        output[ key ] = values.slice( 0, start ).concat( update[ key ] );
+    });
+
+    return output;
+}
+
+// Puts the timelines of every thread into a single object with a column for each, so that they can share a graph.
+function flatten_thread_timelines( json ) {
+    let output = {xs: json.xs};
+    _.each( json.threads, (thread, index) => {
+        output[ "size_" + index ] = thread.allocated_size;
+        output[ "rate_" + index ] = thread.allocations_per_second;
+    });
+
+    return output;
+}
+
+function thread_label( thread ) {
+    if( thread.thread === null ) {
+        return "Other threads";
+    }
+
+    return (thread.name || "Thread") + " (" + thread.thread + ")";
+}
+
+// The threads which allocated the most, by their peak memory usage.
+function ThreadTable( props ) {
+    return (
+        <table id="thread-table" className={props.className}>
+            <thead>
+                <tr>
+                    <th>Thread</th>
+                    <th>Peak</th>
+                    <th>Allocations</th>
+                    <th>Started</th>
+                    <th>Exited</th>
+                </tr>
+            </thead>
+            <tbody>
+                {props.threads.map( (thread, index) => (
+                    <tr key={index}>
+                        <td>{thread_label( thread )}</td>
+                        <td>{fmt_size( thread.peak_size )}</td>
+                        <td>{thread.allocation_count}</td>
+                        <td>{thread.started_at !== null ? fmt_date_unix_ms( thread.started_at ) : ""}</td>
+                        <td>{thread.exited_at !== null ? fmt_date_unix_ms( thread.exited_at ) : ""}</td>
+                    </tr>
+                ))}
+            </tbody>
+        </table>
+    );
+}
+
+// Every histogram is measured in nanoseconds, except for the batch sizes.
+function fmt_stage_value( name, value ) {
+    if( name === "batch_size" ) {
+        return Math.round( value ).toString();
+    }
+
+    if( value < 1000 ) {
+        return Math.round( value ) + "ns";
+    } else if( value < 1000 * 1000 ) {
+        return (value / 1000).toFixed( 1 ) + "\u00b5s";
+    } else if( value < 1000 * 1000 * 1000 ) {
+        return (value / (1000 * 1000)).toFixed( 1 ) + "ms";
+    } else {
+        return (value / (1000 * 1000 * 1000)).toFixed( 2 ) + "s";
+    }
+}
+
+// How much time the profiler itself has spent on what, if it was running with `MEMORY_PROFILER_INSTRUMENTATION`.
+function ProfilerStatistics( props ) {
+    const histograms = props.statistics.histograms.filter( histogram => histogram.count > 0 );
+    const caches = props.statistics.backtrace_caches.filter( cache => cache.hits + cache.misses > 0 );
+    if( histograms.length === 0 && caches.length === 0 ) {
+        return null;
+    }
+
+    return (
+        <div>
+            <div>Profiler overhead ({fmt_size( props.statistics.bytes_written )} written)</div>
+            {histograms.length > 0 && <table id="profiler-statistics-table">
+                <thead>
+                    <tr>
+                        <th>Stage</th>
+                        <th>Count</th>
+                        <th>Total</th>
+                        <th>Mean</th>
+                        <th>p50</th>
+                        <th>p90</th>
+                        <th>p99</th>
+                    </tr>
+                </thead>
+                <tbody>
+                    {histograms.map( histogram => (
+                        <tr key={histogram.name}>
+                            <td>{histogram.name}</td>
+                            <td>{histogram.count}</td>
+                            <td>{fmt_stage_value( histogram.name, histogram.sum )}</td>
+                            <td>{fmt_stage_value( histogram.name, histogram.mean )}</td>
+                            <td>&le;&nbsp;{fmt_stage_value( histogram.name, histogram.p50 )}</td>
+                            <td>&le;&nbsp;{fmt_stage_value( histogram.name, histogram.p90 )}</td>
+                            <td>&le;&nbsp;{fmt_stage_value( histogram.name, histogram.p99 )}</td>
+                        </tr>
+                    ))}
+                </tbody>
+            </table>}
+            {caches.length > 0 && <table id="backtrace-cache-statistics-table">
+                <thead>
+                    <tr>
+                        <th>Backtrace cache</th>
+                        <th>Hits</th>
+                        <th>Misses</th>
+                        <th>Conflicts</th>
+                        <th>Hit rate</th>
+                        <th>Capacity</th>
+                    </tr>
+                </thead>
+                <tbody>
+                    {caches.map( cache => (
+                        <tr key={cache.level}>
+                            <td>Level {cache.level}</td>
+                            <td>{cache.hits}</td>
+                            <td>{cache.misses}</td>
+                            <td>{cache.conflicts}</td>
+                            <td>{(cache.hit_rate * 100).toFixed( 1 )}%</td>
+                            <td>{cache.capacity}</td>
+                        </tr>
+                    ))}
+                </tbody>
+            </table>}
+        </div>
+    );
+}
+
 export default class PageDataOverview extends React.Component {
     state = {}
+    overview = {}
+
+    constructor() {
+        super()
+        this.fetchDetail = _.debounce( this.fetchDetail.bind( this ), 250 );
+    }
+
+    timelineWidth() {
+        // The server only sends about as many points as we can draw.
+        return Math.max( Math.floor( window.innerWidth || 1000 ), 100 );
+    }
+
+    fetchTimeline( kind, query ) {
+        const url = (this.props.sourceUrl || "") + "/data/" + this.props.id + "/" + kind + "?width=" + this.timelineWidth() + (query || "");
+        return fetch_json( url );
+    }
 
     componentDidMount() {
-        fetch( this.props.sourceUrl + "/list" )
-            .then( response => response.json() )
-            .then( list => this.setState( {general: _.find( list, entry => entry.id === this.props.id ) } ) );
+        fetch_json( this.props.sourceUrl + "/data/" + this.props.id + "/metadata" )
+            .then( general => {
+                this.setState( {general} );
+                if( general.is_live ) {
+                    this.subscribe();
+                }
+            });
+
+        _.each( TIMELINES, kind => {
+            this.fetchTimeline( kind ).then( json => {
+                this.overview[ kind ] = json;
+                this.setState( {[kind]: json} );
+            });
+        });
+
+        this.fetchTimeline( "timeline_threads" ).then( thread_timelines => {
+            const timeline_threads = flatten_thread_timelines( thread_timelines );
+            this.overview.timeline_threads = timeline_threads;
+            this.setState( {thread_timelines, timeline_threads} );
+        });
+
+        fetch_json( this.props.sourceUrl + "/data/" + this.props.id + "/profiler_statistics" )
+            .then( profiler_statistics => this.setState( {profiler_statistics} ) );
+    }
+
+    componentWillUnmount() {
+        if( this.updates ) {
+            this.updates.close();
+            this.updates = null;
+        }
+    }
+
+    // Keeps receiving the new points of the timelines while the data is still being gathered.
+    subscribe() {
+        if( this.updates || typeof EventSource === "undefined" ) {
+            return;
+        }
 
-        fetch( (this.props.sourceUrl || "") + "/data/" + this.props.id + "/timeline" )
-            .then( rsp => rsp.json() )
-            .then( json => this.setState( {timeline: json} ) );
+        // The first update has everything, so it doesn't matter whether the first fetch is done yet.
+        const url = (this.props.sourceUrl || "") + "/data/" + this.props.id + "/timeline_updates?width=" + this.timelineWidth() + "&since=0";
+        this.updates = new EventSource( url );
+        this.updates.onmessage = event => {
+            const update = JSON.parse( event.data );
+            let state = {general: update.metadata};
+            _.each( TIMELINES, kind => {
+                this.overview[ kind ] = append_timeline( this.overview[ kind ], update[ kind ] );
+                state[ kind ] = append_timeline( this.state[ kind ], update[ kind ] );
+            });
+
+            this.setState( state );
+        };
+    }
+
+    fetchDetail( x0, x1 ) {
+        const query = "&from=" + Math.floor( x0 ) + "&to=" + Math.ceil( x1 );
+        _.each( TIMELINES, kind => {
+            this.fetchTimeline( kind, query ).then( json => {
+                if( this.state.x0 !== x0 || this.state.x1 !== x1 ) {
+                    return;
+                }
 
-        fetch( (this.props.sourceUrl || "") + "/data/" + this.props.id + "/timeline_leaked" )
-            .then( rsp => rsp.json() )
-            .then( json => this.setState( {timeline_leaked: json} ) );
+                this.setState( {[kind]: splice_timeline( this.overview[ kind ], json )} );
+            });
+        });
 
-        fetch( (this.props.sourceUrl || "") + "/data/" + this.props.id + "/timeline_maps" )
-            .then( rsp => rsp.json() )
-            .then( json => this.setState( {timeline_maps: json} ) );
+        this.fetchTimeline( "timeline_threads", query ).then( json => {
+            if( this.state.x0 !== x0 || this.state.x1 !== x1 ) {
+                return;
+            }
+
+            this.setState( {timeline_threads: splice_timeline( this.overview.timeline_threads, flatten_thread_timelines( json ) )} );
+        });
     }
 
     render() {
@@ -200,6 +440,45 @@ export default class PageDataOverview extends React.Component {
             }
         }
 
+        // A single thread wouldn't show anything which the graphs above don't.
+        if( this.state.timeline_threads && this.state.thread_timelines.threads.length > 1 ) {
+            if( this.state.timeline_threads.xs.length > 2 ) {
+                const threads = this.state.thread_timelines.threads;
+                const labels = threads.map( thread_label );
+                inner.push(
+                    <Switcher key="s7">
+                        <Graph
+                            key="thread_size"
+                            title="Memory allocated per thread"
+                            data={this.state.timeline_threads}
+                            y_accessors={threads.map( (_thread, index) => "size_" + index )}
+                            y_labels={labels}
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={false}
+                            xUnit="unix_timestamp_ms"
+                        />
+                        <Graph
+                            key="thread_rate"
+                            title="Alloc/s per thread"
+                            data={this.state.timeline_threads}
+                            y_accessors={threads.map( (_thread, index) => "rate_" + index )}
+                            y_labels={labels}
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={false}
+                            xUnit="unix_timestamp_ms"
+                        />
+                        <ThreadTable key="thread_table" title="Threads" threads={threads} />
+                    </Switcher>
+                );
+            }
+        }
+
         if( this.state.timeline_leaked ) {
             if( this.state.timeline_leaked.xs.length > 2 ) {
                 inner.push(
@@ -235,6 +514,41 @@ export default class PageDataOverview extends React.Component {
             }
         }
 
+        if( this.state.timeline_device ) {
+            if( this.state.timeline_device.xs.length > 2 ) {
+                inner.push(
+                    <Switcher key="s5">
+                        <Graph
+                            key="device_size"
+                            title="Device memory usage"
+                            data={this.state.timeline_device}
+                            y_accessor="allocated_size"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={true}
+                            xUnit="unix_timestamp_ms"
+                        />
+                        <Graph
+                            key="device_count"
+                            title="Live device allocations"
+                            data={this.state.timeline_device}
+                            y_accessor="allocated_count"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={true}
+                            xUnit="unix_timestamp_ms"
+                        />
+                    </Switcher>
+                );
+            }
+        }
+
         if( this.state.timeline_maps ) {
             if( this.state.timeline_maps.xs.length > 2 ) {
                 inner.push(
@@ -317,6 +631,119 @@ export default class PageDataOverview extends React.Component {
                             fill={true}
                             xUnit="unix_timestamp_ms"
                         />
+                        <Graph
+                            key="huge_pages"
+                            title="Huge pages"
+                            data={this.state.timeline_maps}
+                            y_accessor="huge_pages"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={true}
+                            xUnit="unix_timestamp_ms"
+                        />
+                    </Switcher>
+                );
+            }
+        }
+
+        if( this.state.timeline_cgroup ) {
+            if( this.state.timeline_cgroup.xs.length > 2 ) {
+                inner.push(
+                    <Switcher key="s6">
+                        <Graph
+                            key="cgroup_current"
+                            title="Cgroup memory usage"
+                            data={this.state.timeline_cgroup}
+                            y_accessor="current"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={true}
+                            xUnit="unix_timestamp_ms"
+                        />
+                        <Graph
+                            key="cgroup_anon"
+                            title="Cgroup anonymous memory"
+                            data={this.state.timeline_cgroup}
+                            y_accessor="anon"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={true}
+                            xUnit="unix_timestamp_ms"
+                        />
+                        <Graph
+                            key="cgroup_file"
+                            title="Cgroup page cache"
+                            data={this.state.timeline_cgroup}
+                            y_accessor="file"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={true}
+                            xUnit="unix_timestamp_ms"
+                        />
+                        <Graph
+                            key="cgroup_kernel"
+                            title="Cgroup kernel memory"
+                            data={this.state.timeline_cgroup}
+                            y_accessor="kernel"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={true}
+                            xUnit="unix_timestamp_ms"
+                        />
+                        <Graph
+                            key="cgroup_sock"
+                            title="Cgroup socket buffers"
+                            data={this.state.timeline_cgroup}
+                            y_accessor="sock"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={true}
+                            xUnit="unix_timestamp_ms"
+                        />
+                        <Graph
+                            key="cgroup_pressure_some"
+                            title="Memory pressure (% of time some tasks stalled)"
+                            data={this.state.timeline_cgroup}
+                            y_accessor="pressure_some"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={false}
+                            xUnit="unix_timestamp_ms"
+                        />
+                        <Graph
+                            key="cgroup_pressure_full"
+                            title="Memory pressure (% of time all tasks stalled)"
+                            data={this.state.timeline_cgroup}
+                            y_accessor="pressure_full"
+                            y_label=""
+                            onZoom={this.onZoom.bind(this)}
+                            onRightClick={this.onRightClick.bind(this)}
+                            x0={this.state.x0}
+                            x1={this.state.x1}
+                            fill={false}
+                            xUnit="unix_timestamp_ms"
+                        />
                     </Switcher>
                 );
             }
@@ -340,6 +767,7 @@ export default class PageDataOverview extends React.Component {
                 <div className="pt-4 px-4">
                     <div className="d-flex justify-content-between flex-wrap" style={{gap: "1rem"}}>
                         {general}
+                        {this.state.profiler_statistics && <ProfilerStatistics statistics={this.state.profiler_statistics} />}
                         <div id="subpage-list">
                             <div>List of allocations</div>
                             <div style={{marginLeft: "1rem"}}>
@@ -447,6 +875,7 @@ export default class PageDataOverview extends React.Component {
 
     onZoom( min, max ) {
         this.setState( {x0: min, x1: max} );
+        this.fetchDetail( min, max );
     }
 
     onRightClick( {event, x, x0, x1} ) {
@@ -0,0 +1,109 @@
+// Fetches the JSON responses from the server, decoding them on a worker thread,
+// and caches the ones which will never change.
+//
+// The responses for the data which isn't live anymore are immutable (the server marks
+// them as such), so they're kept in memory for as long as the page is open, and
+// in IndexedDB by the worker so that they survive a reload.
+
+const MAX_CACHED_RESPONSES = 64;
+
+const cache = new Map();
+const pending = new Map();
+let worker = null;
+let next_request_id = 0;
+
+function is_immutable( response ) {
+    const cache_control = response.headers.get( "cache-control" ) || "";
+    return cache_control.indexOf( "immutable" ) !== -1;
+}
+
+// Resolves to `{data, cacheable}`, or rejects with the error message from the server.
+//
+// This is also what the worker runs.
+function fetch_and_decode( url ) {
+    return fetch( url ).then( response => {
+        if( response.status !== 200 ) {
+            return response.text().then( error => Promise.reject( error ) );
+        }
+
+        const cacheable = is_immutable( response );
+        return response.json().then( data => ({ data, cacheable }) );
+    });
+}
+
+function get_worker() {
+    if( worker !== null ) {
+        return worker;
+    }
+
+    worker = false;
+    if( typeof Worker === "undefined" ) {
+        return worker;
+    }
+
+    try {
+        worker = new Worker( new URL( "./fetch_worker.js", import.meta.url ), { type: "module" } );
+    } catch( error ) {
+        return worker;
+    }
+
+    worker.onmessage = event => {
+        const { request_id, ok, data, cacheable, error } = event.data;
+        const callbacks = pending.get( request_id );
+        pending.delete( request_id );
+        if( ok ) {
+            callbacks.resolve( { data, cacheable } );
+        } else {
+            callbacks.reject( error );
+        }
+    };
+
+    return worker;
+}
+
+function fetch_in_worker( url ) {
+    const worker = get_worker();
+    if( !worker ) {
+        return fetch_and_decode( url );
+    }
+
+    return new Promise( (resolve, reject) => {
+        const request_id = next_request_id++;
+        pending.set( request_id, { resolve, reject } );
+        worker.postMessage( { request_id, url } );
+    });
+}
+
+// Fetches the `url` and resolves to its decoded JSON.
+//
+// The same object is returned for every request of an immutable response, so it shouldn't be modified.
+function fetch_json( url ) {
+    const cached = cache.get( url );
+    if( cached !== undefined ) {
+        // Move it to the end so that the least recently used responses are the first ones to go.
+        cache.delete( url );
+        cache.set( url, cached );
+        return cached;
+    }
+
+    const promise = fetch_in_worker( url ).then( ({ data, cacheable }) => {
+        if( !cacheable ) {
+            cache.delete( url );
+        }
+
+        return data;
+    }, error => {
+        cache.delete( url );
+        return Promise.reject( error );
+    });
+
+    // This is put into the cache right away so that concurrent requests for the same URL are only made once.
+    cache.set( url, promise );
+    if( cache.size > MAX_CACHED_RESPONSES ) {
+        cache.delete( cache.keys().next().value );
+    }
+
+    return promise;
+}
+
+export { fetch_json, fetch_and_decode };
@@ -0,0 +1,102 @@
+// Fetches and decodes the responses off the main thread for `fetch_json`,
+// and keeps the immutable ones in IndexedDB.
+
+import { fetch_and_decode } from "./fetch_json.js";
+
+const DB_NAME = "bytehound-responses";
+const STORE_NAME = "responses";
+const MAX_PERSISTED_RESPONSES = 256;
+
+let database = null;
+
+function request_to_promise( request ) {
+    return new Promise( (resolve, reject) => {
+        request.onsuccess = () => resolve( request.result );
+        request.onerror = () => reject( request.error );
+    });
+}
+
+function open_database() {
+    if( database === null ) {
+        if( typeof indexedDB === "undefined" ) {
+            database = Promise.reject( "IndexedDB is not available" );
+        } else {
+            const request = indexedDB.open( DB_NAME, 1 );
+            request.onupgradeneeded = () => {
+                const store = request.result.createObjectStore( STORE_NAME, { keyPath: "url" } );
+                store.createIndex( "last_used", "last_used" );
+            };
+
+            database = request_to_promise( request );
+        }
+
+        // Everything still works without it, just without persisting anything.
+        database.catch( () => {} );
+    }
+
+    return database;
+}
+
+function load( url ) {
+    return open_database().then( db => {
+        const store = db.transaction( STORE_NAME, "readwrite" ).objectStore( STORE_NAME );
+        return request_to_promise( store.get( url ) ).then( entry => {
+            if( entry === undefined ) {
+                return undefined;
+            }
+
+            entry.last_used = Date.now();
+            store.put( entry );
+            return entry.data;
+        });
+    }).catch( () => undefined );
+}
+
+function persist( url, data ) {
+    return open_database().then( db => {
+        const store = db.transaction( STORE_NAME, "readwrite" ).objectStore( STORE_NAME );
+        store.put( { url, data, last_used: Date.now() } );
+
+        return request_to_promise( store.count() ).then( count => {
+            let excess = count - MAX_PERSISTED_RESPONSES;
+            if( excess <= 0 ) {
+                return;
+            }
+
+            store.index( "last_used" ).openCursor().onsuccess = event => {
+                const cursor = event.target.result;
+                if( !cursor || excess <= 0 ) {
+                    return;
+                }
+
+                cursor.delete();
+                excess -= 1;
+                cursor.continue();
+            };
+        });
+    }).catch( () => {} );
+}
+
+self.onmessage = event => {
+    const { request_id, url } = event.data;
+    load( url )
+        .then( data => {
+            if( data !== undefined ) {
+                return { data, cacheable: true };
+            }
+
+            return fetch_and_decode( url ).then( response => {
+                if( response.cacheable ) {
+                    persist( url, response.data );
+                }
+
+                return response;
+            });
+        })
+        .then( ({ data, cacheable }) => {
+            self.postMessage( { request_id, ok: true, data, cacheable } );
+        })
+        .catch( error => {
+            self.postMessage( { request_id, ok: false, error: String( error ) } );
+        });
+};
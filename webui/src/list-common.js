@@ -500,6 +500,147 @@ function backtrace_cell( show_full_backtraces, frames ) {
     return out;
 }
 
+// How many rows are fetched at a time as they're scrolled into view.
+const VIRTUAL_CHUNK_SIZE = 200;
+
+// How many of the fetched chunks are kept around; the ones which are the furthest away are dropped first.
+const VIRTUAL_CACHED_CHUNKS = 32;
+
+// The browsers can't scroll through elements which are arbitrarily tall, so past this height
+// the scrollbar doesn't map onto the rows one to one anymore.
+const VIRTUAL_MAX_SCROLL_HEIGHT = 8000000;
+
+// A list which only renders the rows which are visible, and only fetches those as they're
+// scrolled into view, so that it can go through millions of them.
+//
+// Every row has to be exactly `rowHeight` pixels tall; `fetchRows( skip, count )` has
+// to return a promise of an array of the rows, and `renderRow( row, index )` gets
+// a `null` for the rows which weren't fetched yet.
+class VirtualRows extends React.Component {
+    constructor( props ) {
+        super( props );
+        this.chunks = new Map();
+        this.pending = new Set();
+        this.state = { scrollTop: 0, viewportHeight: 0, revision: 0, error: null };
+        this.onScroll = this.onScroll.bind( this );
+    }
+
+    componentDidMount() {
+        this.setState({ viewportHeight: this.container.clientHeight });
+        this.fetchVisibleChunks();
+    }
+
+    componentDidUpdate() {
+        this.fetchVisibleChunks();
+    }
+
+    onScroll() {
+        this.setState({
+            scrollTop: this.container.scrollTop,
+            viewportHeight: this.container.clientHeight
+        });
+    }
+
+    scrollHeight() {
+        return Math.min( this.props.totalCount * this.props.rowHeight, VIRTUAL_MAX_SCROLL_HEIGHT );
+    }
+
+    // The row at the top of the viewport; this is fractional when it's only partially visible.
+    topRow() {
+        const content_height = this.props.totalCount * this.props.rowHeight;
+        const scrollable = this.scrollHeight() - this.state.viewportHeight;
+        if( scrollable <= 0 ) {
+            return 0;
+        }
+
+        const fraction = Math.min( this.state.scrollTop / scrollable, 1 );
+        return fraction * (content_height - this.state.viewportHeight) / this.props.rowHeight;
+    }
+
+    visibleRange() {
+        const first = Math.floor( this.topRow() );
+        const count = Math.ceil( this.state.viewportHeight / this.props.rowHeight ) + 1;
+        return [first, Math.min( first + count, this.props.totalCount )];
+    }
+
+    fetchVisibleChunks() {
+        const [first, last] = this.visibleRange();
+        if( first >= last ) {
+            return;
+        }
+
+        const first_chunk = Math.floor( first / VIRTUAL_CHUNK_SIZE );
+        const last_chunk = Math.floor( (last - 1) / VIRTUAL_CHUNK_SIZE );
+        for( let chunk = first_chunk; chunk <= last_chunk; ++chunk ) {
+            this.fetchChunk( chunk );
+        }
+    }
+
+    fetchChunk( chunk ) {
+        if( this.chunks.has( chunk ) || this.pending.has( chunk ) ) {
+            return;
+        }
+
+        this.pending.add( chunk );
+        this.props.fetchRows( chunk * VIRTUAL_CHUNK_SIZE, VIRTUAL_CHUNK_SIZE )
+            .then( rows => {
+                this.pending.delete( chunk );
+                this.chunks.set( chunk, rows );
+                this.evictChunks( chunk );
+                this.setState( state => ({ revision: state.revision + 1 }) );
+            })
+            .catch( error => {
+                this.pending.delete( chunk );
+                this.setState({ error: "" + error });
+            });
+    }
+
+    evictChunks( current ) {
+        while( this.chunks.size > VIRTUAL_CACHED_CHUNKS ) {
+            let furthest = null;
+            for( const chunk of this.chunks.keys() ) {
+                if( furthest === null || Math.abs( chunk - current ) > Math.abs( furthest - current ) ) {
+                    furthest = chunk;
+                }
+            }
+
+            this.chunks.delete( furthest );
+        }
+    }
+
+    render() {
+        if( this.state.error ) {
+            return <div>Failed to fetch the rows: {this.state.error}</div>;
+        }
+
+        const row_height = this.props.rowHeight;
+        const top = this.topRow();
+        const [first, last] = this.visibleRange();
+        const rows = [];
+        for( let index = first; index < last; ++index ) {
+            const chunk = this.chunks.get( Math.floor( index / VIRTUAL_CHUNK_SIZE ) );
+            const row = chunk ? (chunk[ index % VIRTUAL_CHUNK_SIZE ] || null) : null;
+            rows.push(
+                <div key={index} style={{height: row_height, overflow: "hidden"}}>
+                    {this.props.renderRow( row, index )}
+                </div>
+            );
+        }
+
+        // The rows are positioned relative to the viewport, since with a scaled scrollbar
+        // they wouldn't line up with the scroll position otherwise.
+        const offset = this.state.scrollTop - (top - first) * row_height;
+        return (
+            <div className="virtual-rows" ref={c => this.container = c} onScroll={this.onScroll} style={{height: this.props.height}}>
+                <div style={{height: this.scrollHeight()}} />
+                <div className="virtual-rows-window" style={{top: offset}}>
+                    {rows}
+                </div>
+            </div>
+        );
+    }
+}
+
 function get_data_url_generic( source_url, source, id, params ) {
     params = {...params};
 
@@ -527,6 +668,7 @@ export {
 
     ControlBase,
     FilterEditorBase,
+    VirtualRows,
 
     fmt_or_percent,
     backtrace_cell,